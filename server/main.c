@@ -3,8 +3,34 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <unistd.h>
+
 #include "render_context.h"
+#include "render_host.h"
 #include "render_server.h"
+#include "render_worker.h"
+#include "vkr_library.h"
+
+static bool
+render_wait_context_args(struct render_context_args *ctx_args)
+{
+   assert(ctx_args->pooled);
+   const int pool_fd = ctx_args->ctx_fd;
+
+   vkr_library_warm_up();
+
+   int ctx_fd;
+   if (!render_worker_wait(pool_fd, ctx_args, sizeof(*ctx_args), &ctx_fd))
+      return false;
+
+   if (!ctx_args->valid || ctx_args->pooled || ctx_args->thread_host) {
+      close(ctx_fd);
+      return false;
+   }
+   ctx_args->ctx_fd = ctx_fd;
+
+   return true;
+}
 
 /* The main process is the server process.  It enters render_server_main and
  * never returns except on fatal errors.
@@ -23,6 +49,17 @@
  * When a worker is a thread, the thread enters render_context_main directly
  * from its start function.  In this case, render_context_main must be
  * thread-safe.
+ *
+ * With --worker-threads, the server process creates a single subprocess
+ * worker, the thread host, which enters render_host_main.  The thread host
+ * creates a thread entering render_context_main for each context.
+ *
+ * With --worker-pool-size, the server process also keeps subprocess workers
+ * forked ahead of time.  They return from render_server_main early, warm up,
+ * and wait for their render_context_args before entering render_context_main.
+ *
+ * With --worker-preinit, the server process loads libvulkan and the ICDs
+ * before forking any worker, and the workers inherit them.
  */
 int
 main(int argc, char **argv)
@@ -32,9 +69,14 @@ main(int argc, char **argv)
    struct render_context_args ctx_args;
    bool ok = render_server_main(argc, argv, &ctx_args);
 
+   if (ok && ctx_args.valid && ctx_args.pooled)
+      ok = render_wait_context_args(&ctx_args);
+
    /* this is a subprocess */
-   if (ok && ctx_args.valid)
-      ok = render_context_main(&ctx_args);
+   if (ok && ctx_args.valid) {
+      ok = ctx_args.thread_host ? render_host_main(&ctx_args)
+                                : render_context_main(&ctx_args);
+   }
 
    return ok ? 0 : -1;
 }
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "render_context.h"
+#include "render_host.h"
 #include "render_server.h"
 #include "render_worker.h"
 #include "vkr_library.h"
@@ -19,9 +20,13 @@
  * RENDER_CLIENT_OP_DESTROY_CONTEXT to us to remove the record.  Because we
  * are responsible for cleaning up the worker, we don't care if the worker has
  * terminated or not.  We always kill, reap, and remove the record.
+ *
+ * With a thread host, all records share the thread host worker.  Removing a
+ * record asks the thread host to join the context thread instead.
  */
 struct render_context_record {
    uint32_t ctx_id;
+   /* NULL when the context is a thread of the thread host */
    struct render_worker *worker;
 
    struct list_head head;
@@ -46,6 +51,11 @@ render_client_detach_all_records(struct render_client *client)
    /* free all render_workers without killing nor reaping */
    render_worker_jail_detach_workers(srv->worker_jail);
 
+   if (client->host_worker) {
+      render_socket_fini(&client->host_socket);
+      client->host_worker = NULL;
+   }
+
    list_for_each_entry_safe (struct render_context_record, rec, &client->context_records,
                              head)
       free(rec);
@@ -58,12 +68,43 @@ render_client_remove_record(struct render_client *client,
 {
    struct render_server *srv = client->server;
 
-   render_worker_destroy(srv->worker_jail, rec->worker);
+   if (rec->worker) {
+      render_worker_destroy(srv->worker_jail, rec->worker);
+   } else {
+      const struct render_host_request host_req = {
+         .op = RENDER_HOST_OP_DESTROY_CONTEXT,
+         .args.ctx_id = rec->ctx_id,
+      };
+      if (!render_socket_send_reply(&client->host_socket, &host_req, sizeof(host_req)))
+         render_log("failed to destroy hosted context %u", rec->ctx_id);
+   }
 
    list_del(&rec->head);
    free(rec);
 }
 
+static void
+render_client_destroy_host(struct render_client *client)
+{
+   struct render_server *srv = client->server;
+
+   if (!client->host_worker)
+      return;
+
+   render_socket_fini(&client->host_socket);
+   render_worker_destroy(srv->worker_jail, client->host_worker);
+   client->host_worker = NULL;
+
+   /* the hosted contexts are gone with the thread host */
+   list_for_each_entry_safe (struct render_context_record, rec, &client->context_records,
+                             head) {
+      if (!rec->worker) {
+         list_del(&rec->head);
+         free(rec);
+      }
+   }
+}
+
 static void
 render_client_clear_records(struct render_client *client)
 {
@@ -80,6 +121,9 @@ init_context_args(struct render_context_args *ctx_args,
 {
    *ctx_args = (struct render_context_args){
       .valid = true,
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+      .threaded = true,
+#endif
       .init_flags = init_flags,
       .ctx_id = req->ctx_id,
       .ctx_fd = ctx_fd,
@@ -87,6 +131,8 @@ init_context_args(struct render_context_args *ctx_args,
 
    static_assert(sizeof(ctx_args->ctx_name) == sizeof(req->ctx_name), "");
    memcpy(ctx_args->ctx_name, req->ctx_name, sizeof(req->ctx_name) - 1);
+
+   ctx_args->sched = req->sched;
 }
 
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
@@ -98,6 +144,109 @@ render_client_worker_thread(void *thread_data)
    return render_context_main(ctx_args) ? 0 : -1;
 }
 
+#else /* ENABLE_RENDER_SERVER_WORKER_THREAD */
+
+static bool
+render_client_init_host(struct render_client *client)
+{
+   struct render_server *srv = client->server;
+
+   if (client->host_worker)
+      return true;
+
+   int socket_fds[2];
+   if (!render_socket_pair(socket_fds))
+      return false;
+   const int host_fd = socket_fds[0];
+   const int remote_fd = socket_fds[1];
+
+   struct render_worker *worker = render_worker_create(srv->worker_jail, NULL, NULL, 0);
+   if (!worker) {
+      render_log("failed to create a thread host");
+      close(host_fd);
+      close(remote_fd);
+      return false;
+   }
+
+   if (!render_worker_is_record(worker)) {
+      /* this is the child process */
+      srv->state = RENDER_SERVER_STATE_SUBPROCESS;
+      *srv->context_args = (struct render_context_args){
+         .valid = true,
+         .thread_host = true,
+         .init_flags = client->init_flags,
+         .ctx_fd = host_fd,
+      };
+
+      render_client_detach_all_records(client);
+      close(remote_fd);
+
+      return true;
+   }
+
+   /* this is the parent process */
+   close(host_fd);
+   client->host_worker = worker;
+   render_socket_init(&client->host_socket, remote_fd);
+
+   return true;
+}
+
+static bool
+render_client_create_hosted_context(
+   struct render_client *client,
+   const struct render_client_op_create_context_request *req,
+   int *out_remote_fd)
+{
+   struct render_server *srv = client->server;
+
+   *out_remote_fd = -1;
+
+   if (!render_client_init_host(client))
+      return false;
+
+   /* this is the thread host */
+   if (srv->state == RENDER_SERVER_STATE_SUBPROCESS)
+      return true;
+
+   struct render_context_record *rec = calloc(1, sizeof(*rec));
+   if (!rec)
+      return false;
+
+   int socket_fds[2];
+   if (!render_socket_pair(socket_fds)) {
+      free(rec);
+      return false;
+   }
+   const int ctx_fd = socket_fds[0];
+   const int remote_fd = socket_fds[1];
+
+   struct render_host_request host_req = {
+      .op = RENDER_HOST_OP_CREATE_CONTEXT,
+   };
+   init_context_args(&host_req.args, client->init_flags, req, -1);
+
+   const bool ok = render_socket_send_reply_with_fds(&client->host_socket, &host_req,
+                                                     sizeof(host_req), &ctx_fd, 1);
+   close(ctx_fd);
+   if (!ok) {
+      render_log("failed to send a context to the thread host");
+      close(remote_fd);
+      free(rec);
+
+      /* the next context gets a new thread host */
+      render_client_destroy_host(client);
+      return false;
+   }
+
+   rec->ctx_id = req->ctx_id;
+   list_addtail(&rec->head, &client->context_records);
+
+   *out_remote_fd = remote_fd;
+
+   return true;
+}
+
 #endif /* ENABLE_RENDER_SERVER_WORKER_THREAD */
 
 static bool
@@ -107,6 +256,11 @@ render_client_create_context(struct render_client *client,
 {
    struct render_server *srv = client->server;
 
+#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+   if (srv->worker_threads)
+      return render_client_create_hosted_context(client, req, out_remote_fd);
+#endif
+
    struct render_context_record *rec = calloc(1, sizeof(*rec));
    if (!rec) {
       *out_remote_fd = -1;
@@ -131,7 +285,10 @@ render_client_create_context(struct render_client *client,
    if (rec->worker)
       ctx_fd = -1; /* ownership transferred */
 #else
-   rec->worker = render_worker_create(srv->worker_jail, NULL, NULL, 0);
+   rec->worker =
+      render_worker_take(srv->worker_jail, &ctx_args, sizeof(ctx_args), ctx_fd);
+   if (!rec->worker)
+      rec->worker = render_worker_create(srv->worker_jail, NULL, NULL, 0);
 #endif
    if (!rec->worker) {
       render_log("failed to create a context worker");
@@ -254,41 +411,91 @@ static const struct render_client_dispatch_entry
 #undef RENDER_CLIENT_DISPATCH
    };
 
-bool
-render_client_dispatch(struct render_client *client)
+static bool
+render_client_dispatch_request(struct render_client *client,
+                               const union render_client_op_request *req,
+                               size_t req_size)
 {
-   union render_client_op_request req;
-   size_t req_size;
-   if (!render_socket_receive_request(&client->socket, &req, sizeof(req), &req_size))
-      return false;
-
-   if (req.header.op >= RENDER_CLIENT_OP_COUNT) {
-      render_log("invalid client op %d", req.header.op);
+   if (req->header.op >= RENDER_CLIENT_OP_COUNT) {
+      render_log("invalid client op %d", req->header.op);
       return false;
    }
 
    const struct render_client_dispatch_entry *entry =
-      &render_client_dispatch_table[req.header.op];
+      &render_client_dispatch_table[req->header.op];
    if (entry->expect_size != req_size) {
-      render_log("invalid request size %zu for client op %d", req_size, req.header.op);
+      render_log("invalid request size %zu for client op %d", req_size, req->header.op);
       return false;
    }
 
-   if (!entry->dispatch(client, &req))
-      render_log("failed to dispatch client op %d", req.header.op);
+   if (!entry->dispatch(client, req))
+      render_log("failed to dispatch client op %d", req->header.op);
 
    return true;
 }
 
+bool
+render_client_dispatch(struct render_client *client)
+{
+   /* drain the queued requests, such as a burst of context creations, in one
+    * wakeup
+    */
+   union render_client_op_request reqs[RENDER_CLIENT_REQUEST_BATCH_COUNT];
+   struct render_socket_request batch_reqs[RENDER_CLIENT_REQUEST_BATCH_COUNT];
+   for (uint32_t i = 0; i < RENDER_CLIENT_REQUEST_BATCH_COUNT; i++) {
+      batch_reqs[i] = (struct render_socket_request){
+         .data = &reqs[i],
+         .max_size = sizeof(reqs[i]),
+      };
+   }
+
+   uint32_t count;
+   if (!render_socket_receive_requests(&client->socket, batch_reqs,
+                                       RENDER_CLIENT_REQUEST_BATCH_COUNT, &count))
+      return false;
+
+   for (uint32_t i = 0; i < count; i++) {
+      if (!render_client_dispatch_request(client, &reqs[i], batch_reqs[i].size))
+         return false;
+
+      /* the rest of the batch is for the server when this is now a worker */
+      if (client->server->state != RENDER_SERVER_STATE_RUN)
+         break;
+   }
+
+   return true;
+}
+
+void
+render_client_fill_worker_pool(struct render_client *client)
+{
+   struct render_server *srv = client->server;
+
+   const int pool_fd = render_worker_jail_fill_pool(srv->worker_jail);
+   if (pool_fd < 0)
+      return;
+
+   /* this is a pre-forked worker */
+   srv->state = RENDER_SERVER_STATE_SUBPROCESS;
+   *srv->context_args = (struct render_context_args){
+      .valid = true,
+      .pooled = true,
+      .ctx_fd = pool_fd,
+   };
+
+   render_client_detach_all_records(client);
+}
+
 void
 render_client_destroy(struct render_client *client)
 {
    struct render_server *srv = client->server;
 
    if (srv->state == RENDER_SERVER_STATE_SUBPROCESS) {
-      assert(list_is_empty(&client->context_records));
+      assert(list_is_empty(&client->context_records) && !client->host_worker);
    } else {
       render_client_clear_records(client);
+      render_client_destroy_host(client);
    }
 
    render_socket_fini(&client->socket);
@@ -8,6 +8,8 @@
 
 #include "render_common.h"
 
+#define RENDER_CLIENT_REQUEST_BATCH_COUNT 8
+
 struct render_client {
    struct render_server *server;
    struct render_socket socket;
@@ -15,6 +17,10 @@ struct render_client {
    uint32_t init_flags;
 
    struct list_head context_records;
+
+   /* the thread host when the server is started with --worker-threads */
+   struct render_worker *host_worker;
+   struct render_socket host_socket;
 };
 
 struct render_client *
@@ -26,4 +32,7 @@ render_client_destroy(struct render_client *client);
 bool
 render_client_dispatch(struct render_client *client);
 
+void
+render_client_fill_worker_pool(struct render_client *client);
+
 #endif /* RENDER_CLIENT_H */
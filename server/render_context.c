@@ -5,8 +5,13 @@
 
 #include "render_context.h"
 
+#include <errno.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
+#include "util/bitscan.h"
 #include "util/u_thread.h"
 #include "virgl_util.h"
 
@@ -24,13 +29,9 @@ render_context_update_timeline(struct render_context *ctx,
 }
 
 static bool
-render_context_dispatch_submit_fence(struct render_context *ctx,
-                                     const union render_context_op_request *request,
-                                     UNUSED const int *fds,
-                                     UNUSED int fd_count)
+render_context_submit_fence(struct render_context *ctx,
+                            const struct render_context_op_submit_fence_request *req)
 {
-   const struct render_context_op_submit_fence_request *req = &request->submit_fence;
-
    /* always merge fences */
    assert(!(req->flags & ~VIRGL_RENDERER_FENCE_FLAG_MERGEABLE));
    assert(req->ring_index < (uint32_t)ctx->timeline_count);
@@ -38,35 +39,127 @@ render_context_dispatch_submit_fence(struct render_context *ctx,
                                     req->ring_index, req->seqno);
 }
 
+static bool
+render_context_dispatch_submit_fence(struct render_context *ctx,
+                                     const union render_context_op_request *request,
+                                     UNUSED const int *fds,
+                                     UNUSED int fd_count)
+{
+   return render_context_submit_fence(ctx, &request->submit_fence);
+}
+
+static bool
+render_context_submit_cmd_ring(struct render_context *ctx,
+                               const struct render_context_op_submit_cmd_request *req)
+{
+   const uint32_t offset = req->cmd_ring_pos & (ctx->cmd_ring_size - 1);
+   if (!ctx->cmd_ring || req->cmd_ring_pos % RENDER_CONTEXT_CMD_RING_ALIGN ||
+       req->size > ctx->cmd_ring_size - offset) {
+      render_log("invalid cmd ring pos %u or size %u", req->cmd_ring_pos, req->size);
+      return false;
+   }
+
+   bool ok =
+      render_state_submit_cmd(ctx->ctx_id, (void *)(ctx->cmd_ring + offset), req->size);
+
+   /* the client may reuse the space from now on */
+   atomic_store_explicit(ctx->cmd_ring_tail, req->cmd_ring_pos + req->size,
+                         memory_order_release);
+
+   return ok;
+}
+
+static bool
+render_context_submit_cmd_fd(struct render_context *ctx,
+                             const struct render_context_op_submit_cmd_request *req,
+                             int fd)
+{
+   struct stat st;
+   if (fstat(fd, &st) || st.st_size < (off_t)req->size) {
+      render_log("invalid cmd fd for size %u", req->size);
+      return false;
+   }
+
+   /* private in case the context writes to the command stream */
+   void *cmd = mmap(NULL, req->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   if (cmd == MAP_FAILED)
+      return false;
+
+   const bool ok = render_state_submit_cmd(ctx->ctx_id, cmd, req->size);
+   munmap(cmd, req->size);
+
+   /* the fd is closed by render_context_dispatch on errors */
+   if (ok)
+      close(fd);
+
+   return ok;
+}
+
 static bool
 render_context_dispatch_submit_cmd(struct render_context *ctx,
                                    const union render_context_op_request *request,
-                                   UNUSED const int *fds,
-                                   UNUSED int fd_count)
+                                   const int *fds,
+                                   int fd_count)
 {
    const struct render_context_op_submit_cmd_request *req = &request->submit_cmd;
-   void *cmd = (void *)req->cmd;
+
+   if (fd_count)
+      return req->size && render_context_submit_cmd_fd(ctx, req, fds[0]);
+
+   if (req->in_cmd_ring)
+      return render_context_submit_cmd_ring(ctx, req);
+
    if (req->size > sizeof(req->cmd)) {
-      cmd = malloc(req->size);
-      if (!cmd)
-         return true;
+      render_log("invalid cmd size %u", req->size);
+      return false;
+   }
 
-      const size_t inlined = sizeof(req->cmd);
-      const size_t remain = req->size - inlined;
+   return render_state_submit_cmd(ctx->ctx_id, (void *)req->cmd, req->size);
+}
 
-      memcpy(cmd, req->cmd, inlined);
-      if (!render_socket_receive_data(&ctx->socket, (char *)cmd + inlined, remain)) {
-         free(cmd);
-         return false;
-      }
+static bool
+render_context_dispatch_submit_batch(struct render_context *ctx,
+                                     const union render_context_op_request *request,
+                                     UNUSED const int *fds,
+                                     UNUSED int fd_count)
+{
+   const struct render_context_op_submit_batch_request *req = &request->submit_batch;
+   if (req->count > ARRAY_SIZE(req->entries)) {
+      render_log("invalid batch count %u", req->count);
+      return false;
    }
 
-   bool ok = render_state_submit_cmd(ctx->ctx_id, cmd, req->size);
+   for (uint32_t i = 0; i < req->count; i++) {
+      const union render_context_op_submit_batch_entry *entry = &req->entries[i];
+      const struct render_context_op_submit_cmd_request *cmd_req = &entry->submit_cmd;
+      bool ok;
+
+      switch (entry->header.op) {
+      case RENDER_CONTEXT_OP_SUBMIT_CMD:
+         if (cmd_req->in_cmd_ring) {
+            ok = render_context_submit_cmd_ring(ctx, cmd_req);
+         } else if (cmd_req->size <= sizeof(cmd_req->cmd)) {
+            ok = render_state_submit_cmd(ctx->ctx_id, (void *)cmd_req->cmd,
+                                         cmd_req->size);
+         } else {
+            render_log("invalid batched cmd size %u", cmd_req->size);
+            ok = false;
+         }
+         break;
+      case RENDER_CONTEXT_OP_SUBMIT_FENCE:
+         ok = render_context_submit_fence(ctx, &entry->submit_fence);
+         break;
+      default:
+         render_log("invalid batched context op %d", entry->header.op);
+         ok = false;
+         break;
+      }
 
-   if (cmd != req->cmd)
-      free(cmd);
+      if (!ok)
+         return false;
+   }
 
-   return ok;
+   return true;
 }
 
 static bool
@@ -97,6 +190,26 @@ render_context_dispatch_import_resource(struct render_context *ctx,
                                        req->size);
 }
 
+static bool
+render_context_dispatch_get_stats(struct render_context *ctx,
+                                  UNUSED const union render_context_op_request *req,
+                                  UNUSED const int *fds,
+                                  UNUSED int fd_count)
+{
+   struct virgl_renderer_stats stats = { 0 };
+   const bool ok = render_state_get_stats(ctx->ctx_id, &stats);
+
+   const struct render_context_op_get_stats_reply reply = {
+      .ok = ok,
+      .ring_count = stats.ring_count,
+      .temp_pool_size = stats.temp_pool_size,
+      .ring_idle_time = stats.ring_idle_time,
+      .ring_exec_time = stats.ring_exec_time,
+      .sparse_committed_size = stats.sparse_committed_size,
+   };
+   return render_socket_send_reply(&ctx->socket, &reply, sizeof(reply));
+}
+
 static bool
 render_context_dispatch_create_resource(struct render_context *ctx,
                                         const union render_context_op_request *request,
@@ -122,6 +235,40 @@ render_context_dispatch_create_resource(struct render_context *ctx,
    return ok;
 }
 
+static bool
+render_context_dispatch_create_resources(struct render_context *ctx,
+                                         const union render_context_op_request *request,
+                                         UNUSED const int *fds,
+                                         UNUSED int fd_count)
+{
+   const struct render_context_op_create_resources_request *req =
+      &request->create_resources;
+   if (req->count > RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT) {
+      render_log("invalid resource count %u", req->count);
+      return false;
+   }
+
+   struct render_context_op_create_resources_reply reply;
+   int res_fds[RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT];
+   memset(&reply, 0, sizeof(reply));
+   render_state_create_resources(ctx->ctx_id, req->entries, req->count, reply.entries,
+                                 res_fds);
+
+   int reply_fds[RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT];
+   int reply_fd_count = 0;
+   for (uint32_t i = 0; i < req->count; i++) {
+      if (reply.entries[i].fd_type != VIRGL_RESOURCE_FD_INVALID)
+         reply_fds[reply_fd_count++] = res_fds[i];
+   }
+
+   const bool ok = render_socket_send_reply_with_fds(&ctx->socket, &reply, sizeof(reply),
+                                                     reply_fds, reply_fd_count);
+   for (int i = 0; i < reply_fd_count; i++)
+      close(reply_fds[i]);
+
+   return ok;
+}
+
 static bool
 render_context_dispatch_init(struct render_context *ctx,
                              const union render_context_op_request *request,
@@ -132,11 +279,33 @@ render_context_dispatch_init(struct render_context *ctx,
       return false;
 
    const struct render_context_op_init_request *req = &request->init;
-   const int timeline_count = req->shmem_size / sizeof(*ctx->shmem_timelines);
+   const size_t timeline_size =
+      req->cmd_ring_size ? req->cmd_ring_tail_offset : req->shmem_size;
+   const int timeline_count = timeline_size / sizeof(*ctx->shmem_timelines);
    const int shmem_fd = fds[0];
    const int fence_eventfd = fd_count == 2 ? fds[1] : -1;
 
-   void *shmem_ptr = mmap(NULL, req->shmem_size, PROT_WRITE, MAP_SHARED, shmem_fd, 0);
+   if (timeline_size > req->shmem_size) {
+      render_log("invalid shmem layout");
+      return false;
+   }
+
+   if (req->cmd_ring_size) {
+      if (req->cmd_ring_size > UINT32_MAX / 2 ||
+          !util_is_power_of_two_nonzero(req->cmd_ring_size) ||
+          req->cmd_ring_tail_offset % sizeof(*ctx->cmd_ring_tail) ||
+          req->cmd_ring_offset % RENDER_CONTEXT_CMD_RING_ALIGN ||
+          req->cmd_ring_tail_offset + sizeof(*ctx->cmd_ring_tail) >
+             req->cmd_ring_offset ||
+          req->cmd_ring_offset > req->shmem_size ||
+          req->cmd_ring_size > req->shmem_size - req->cmd_ring_offset) {
+         render_log("invalid cmd ring layout");
+         return false;
+      }
+   }
+
+   void *shmem_ptr =
+      mmap(NULL, req->shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmem_fd, 0);
    if (shmem_ptr == MAP_FAILED)
       return false;
 
@@ -155,6 +324,12 @@ render_context_dispatch_init(struct render_context *ctx,
 
    ctx->timeline_count = timeline_count;
 
+   if (req->cmd_ring_size) {
+      ctx->cmd_ring_tail = (atomic_uint *)((char *)shmem_ptr + req->cmd_ring_tail_offset);
+      ctx->cmd_ring = (const char *)shmem_ptr + req->cmd_ring_offset;
+      ctx->cmd_ring_size = req->cmd_ring_size;
+   }
+
    ctx->fence_eventfd = fence_eventfd;
 
    return true;
@@ -190,41 +365,52 @@ static const struct render_context_dispatch_entry
       RENDER_CONTEXT_DISPATCH(CREATE_RESOURCE, create_resource, 0),
       RENDER_CONTEXT_DISPATCH(IMPORT_RESOURCE, import_resource, 1),
       RENDER_CONTEXT_DISPATCH(DESTROY_RESOURCE, destroy_resource, 0),
-      RENDER_CONTEXT_DISPATCH(SUBMIT_CMD, submit_cmd, 0),
+      RENDER_CONTEXT_DISPATCH(SUBMIT_CMD, submit_cmd, 1),
       RENDER_CONTEXT_DISPATCH(SUBMIT_FENCE, submit_fence, 0),
+      RENDER_CONTEXT_DISPATCH(SUBMIT_BATCH, submit_batch, 0),
+      RENDER_CONTEXT_DISPATCH(GET_STATS, get_stats, 0),
+      RENDER_CONTEXT_DISPATCH(CREATE_RESOURCES, create_resources, 0),
 #undef RENDER_CONTEXT_DISPATCH
    };
 
+static bool
+render_context_receive_requests(struct render_context *ctx)
+{
+   ctx->batch.next = 0;
+   ctx->batch.count = 0;
+   return render_socket_receive_requests(&ctx->socket, ctx->batch.reqs,
+                                         RENDER_CONTEXT_REQUEST_BATCH_COUNT,
+                                         &ctx->batch.count);
+}
+
 static bool
 render_context_dispatch(struct render_context *ctx)
 {
-   union render_context_op_request req;
-   size_t req_size;
-   int req_fds[8];
-   int req_fd_count;
-   if (!render_socket_receive_request_with_fds(&ctx->socket, &req, sizeof(req), &req_size,
-                                               req_fds, ARRAY_SIZE(req_fds),
-                                               &req_fd_count))
+   if (ctx->batch.next == ctx->batch.count && !render_context_receive_requests(ctx))
       return false;
 
-   assert((unsigned int)req_fd_count <= ARRAY_SIZE(req_fds));
+   const struct render_socket_request *batch_req = &ctx->batch.reqs[ctx->batch.next++];
+   const union render_context_op_request *req = batch_req->data;
+   const size_t req_size = batch_req->size;
+   const int *req_fds = batch_req->fds;
+   const int req_fd_count = batch_req->fd_count;
 
-   if (req.header.op >= RENDER_CONTEXT_OP_COUNT) {
-      render_log("invalid context op %d", req.header.op);
+   if (req->header.op >= RENDER_CONTEXT_OP_COUNT) {
+      render_log("invalid context op %d", req->header.op);
       goto fail;
    }
 
    const struct render_context_dispatch_entry *entry =
-      &render_context_dispatch_table[req.header.op];
+      &render_context_dispatch_table[req->header.op];
    if (entry->expect_size != req_size || entry->max_fd_count < req_fd_count) {
       render_log("invalid request size (%zu) or fd count (%d) for context op %d",
-                 req_size, req_fd_count, req.header.op);
+                 req_size, req_fd_count, req->header.op);
       goto fail;
    }
 
-   const bool ok = entry->dispatch(ctx, &req, req_fds, req_fd_count);
+   const bool ok = entry->dispatch(ctx, req, req_fds, req_fd_count);
    if (!ok) {
-      render_log("failed to dispatch context op %d", req.header.op);
+      render_log("failed to dispatch context op %d", req->header.op);
       goto fail;
    }
 
@@ -253,6 +439,12 @@ render_context_fini(struct render_context *ctx)
    /* destroy the context first to join its sync threads and ring threads */
    render_state_destroy_context(ctx->ctx_id);
 
+   for (uint32_t i = ctx->batch.next; i < ctx->batch.count; i++) {
+      const struct render_socket_request *req = &ctx->batch.reqs[i];
+      for (int j = 0; j < req->fd_count; j++)
+         close(req->fds[j]);
+   }
+
    if (ctx->shmem_ptr)
       munmap(ctx->shmem_ptr, ctx->shmem_size);
    if (ctx->shmem_fd >= 0)
@@ -289,6 +481,44 @@ render_context_set_thread_name(uint32_t ctx_id, UNUSED const char *ctx_name)
    u_thread_setname(thread_name);
 }
 
+static void
+render_context_set_sched(const struct virgl_renderer_context_sched *sched)
+{
+   /* On Linux, these apply to the calling thread only and are inherited by the
+    * threads it creates.
+    */
+#ifdef __linux__
+   cpu_set_t cpu_set;
+   CPU_ZERO(&cpu_set);
+   bool has_cpu = false;
+   for (int i = 0; i < VIRGL_RENDERER_CONTEXT_SCHED_MAX_CPUS && i < CPU_SETSIZE; i++) {
+      if (sched->cpu_mask[i / 64] & (1ull << (i % 64))) {
+         CPU_SET(i, &cpu_set);
+         has_cpu = true;
+      }
+   }
+   if (has_cpu && sched_setaffinity(0, sizeof(cpu_set), &cpu_set))
+      render_log("failed to set cpu affinity: %s", strerror(errno));
+
+   if (sched->policy < 0)
+      return;
+
+   const bool is_rt = sched->policy == SCHED_FIFO || sched->policy == SCHED_RR;
+   const struct sched_param param = {
+      .sched_priority = is_rt ? sched->priority : 0,
+   };
+   if (sched_setscheduler(0, sched->policy, &param)) {
+      render_log("failed to set sched policy %d: %s", sched->policy, strerror(errno));
+      return;
+   }
+
+   if (!is_rt && setpriority(PRIO_PROCESS, 0, sched->priority))
+      render_log("failed to set nice value %d: %s", sched->priority, strerror(errno));
+#else
+   (void)sched;
+#endif
+}
+
 static const char *ctx_name_expansions[] = {
    "DOOMEternalx64vk.exe",
 };
@@ -344,6 +574,17 @@ render_context_init(struct render_context *ctx, const struct render_context_args
    ctx->shmem_fd = -1;
    ctx->fence_eventfd = -1;
 
+   for (int i = 0; i < RENDER_CONTEXT_REQUEST_BATCH_COUNT; i++) {
+      ctx->batch.reqs[i] = (struct render_socket_request){
+         .data = &ctx->batch.data[i],
+         .max_size = sizeof(ctx->batch.data[i]),
+         .fds = ctx->batch.fds[i],
+         .max_fd_count = RENDER_CONTEXT_REQUEST_MAX_FD_COUNT,
+      };
+   }
+
+   render_context_set_sched(&args->sched);
+
    if (!render_context_init_name(ctx, args->ctx_id, args->ctx_name))
       return false;
 
@@ -357,7 +598,7 @@ render_context_main(const struct render_context_args *args)
 
    assert(args->valid && args->ctx_id && args->ctx_fd >= 0);
 
-   if (!render_state_init(args->init_flags)) {
+   if (!render_state_init(args->init_flags, args->threaded)) {
       close(args->ctx_fd);
       return false;
    }
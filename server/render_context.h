@@ -10,6 +10,10 @@
 
 #include <stdatomic.h>
 
+/* how many requests are received at once */
+#define RENDER_CONTEXT_REQUEST_BATCH_COUNT 8
+#define RENDER_CONTEXT_REQUEST_MAX_FD_COUNT 2
+
 struct render_context {
    uint32_t ctx_id;
    struct render_socket socket;
@@ -25,17 +29,38 @@ struct render_context {
 
    int timeline_count;
 
+   /* optional, in the shmem */
+   atomic_uint *cmd_ring_tail;
+   const char *cmd_ring;
+   uint32_t cmd_ring_size;
+
    /* optional */
    int fence_eventfd;
+
+   /* requests received but not dispatched yet */
+   struct {
+      union render_context_op_request data[RENDER_CONTEXT_REQUEST_BATCH_COUNT];
+      int fds[RENDER_CONTEXT_REQUEST_BATCH_COUNT][RENDER_CONTEXT_REQUEST_MAX_FD_COUNT];
+      struct render_socket_request reqs[RENDER_CONTEXT_REQUEST_BATCH_COUNT];
+      uint32_t count;
+      uint32_t next;
+   } batch;
 };
 
 struct render_context_args {
    bool valid;
+   /* the worker hosts contexts received from ctx_fd instead (render_host.h) */
+   bool thread_host;
+   /* the context is serviced by a thread of a longer-lived process */
+   bool threaded;
+   /* the worker is pre-forked and receives the real args from ctx_fd */
+   bool pooled;
 
    uint32_t init_flags;
 
    uint32_t ctx_id;
    char ctx_name[32];
+   struct virgl_renderer_context_sched sched;
 
    /* render_context_main always takes ownership even on errors */
    int ctx_fd;
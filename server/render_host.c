@@ -0,0 +1,151 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "render_host.h"
+
+#include <unistd.h>
+
+#include "c11/threads.h"
+
+#include "render_state.h"
+
+struct render_host_context {
+   struct render_context_args args;
+   thrd_t thread;
+
+   struct list_head head;
+};
+
+static int
+render_host_context_thread(void *arg)
+{
+   const struct render_host_context *hctx = arg;
+   return render_context_main(&hctx->args) ? 0 : -1;
+}
+
+static bool
+render_host_create_context(struct list_head *contexts,
+                           const struct render_context_args *args,
+                           int ctx_fd)
+{
+   list_for_each_entry (struct render_host_context, hctx, contexts, head) {
+      if (hctx->args.ctx_id == args->ctx_id) {
+         render_log("duplicated hosted context %u", args->ctx_id);
+         close(ctx_fd);
+         return false;
+      }
+   }
+
+   struct render_host_context *hctx = calloc(1, sizeof(*hctx));
+   if (!hctx) {
+      close(ctx_fd);
+      return false;
+   }
+
+   hctx->args = *args;
+   hctx->args.valid = true;
+   hctx->args.thread_host = false;
+   hctx->args.threaded = true;
+   hctx->args.ctx_fd = ctx_fd;
+   hctx->args.ctx_name[sizeof(hctx->args.ctx_name) - 1] = '\0';
+
+   if (thrd_create(&hctx->thread, render_host_context_thread, hctx) != thrd_success) {
+      close(ctx_fd);
+      free(hctx);
+      return false;
+   }
+
+   list_addtail(&hctx->head, contexts);
+
+   return true;
+}
+
+static void
+render_host_destroy_context(struct list_head *contexts, uint32_t ctx_id)
+{
+   list_for_each_entry (struct render_host_context, hctx, contexts, head) {
+      if (hctx->args.ctx_id == ctx_id) {
+         /* the client process has closed the connection and we trust the
+          * thread to clean up and exit in finite time
+          */
+         thrd_join(hctx->thread, NULL);
+         list_del(&hctx->head);
+         free(hctx);
+         return;
+      }
+   }
+}
+
+static bool
+render_host_dispatch(struct render_socket *socket, struct list_head *contexts)
+{
+   struct render_host_request req;
+   size_t req_size;
+   int ctx_fd;
+   int fd_count;
+   if (!render_socket_receive_request_with_fds(socket, &req, sizeof(req), &req_size,
+                                               &ctx_fd, 1, &fd_count))
+      return false;
+
+   if (req_size != sizeof(req)) {
+      render_log("invalid host request size %zu", req_size);
+      if (fd_count)
+         close(ctx_fd);
+      return false;
+   }
+
+   switch (req.op) {
+   case RENDER_HOST_OP_CREATE_CONTEXT:
+      if (fd_count != 1 || !req.args.ctx_id) {
+         render_log("invalid hosted context %u", req.args.ctx_id);
+         if (fd_count)
+            close(ctx_fd);
+         return false;
+      }
+      if (!render_host_create_context(contexts, &req.args, ctx_fd))
+         render_log("failed to create hosted context %u", req.args.ctx_id);
+      break;
+   case RENDER_HOST_OP_DESTROY_CONTEXT:
+      if (fd_count)
+         close(ctx_fd);
+      render_host_destroy_context(contexts, req.args.ctx_id);
+      break;
+   default:
+      render_log("invalid host op %d", req.op);
+      if (fd_count)
+         close(ctx_fd);
+      return false;
+   }
+
+   return true;
+}
+
+bool
+render_host_main(const struct render_context_args *args)
+{
+   assert(args->valid && args->thread_host && args->ctx_fd >= 0);
+
+   struct render_socket socket;
+   render_socket_init(&socket, args->ctx_fd);
+
+   /* keep the renderer initialized between contexts */
+   if (!render_state_init(args->init_flags, true)) {
+      render_socket_fini(&socket);
+      return false;
+   }
+
+   struct list_head contexts;
+   list_inithead(&contexts);
+
+   /* this returns when the server closes the connection, and the server
+    * kills us right after
+    */
+   while (render_host_dispatch(&socket, &contexts))
+      ;
+
+   render_socket_fini(&socket);
+
+   return true;
+}
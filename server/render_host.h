@@ -0,0 +1,35 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RENDER_HOST_H
+#define RENDER_HOST_H
+
+#include "render_common.h"
+
+#include "render_context.h"
+
+/* A thread host is a worker process servicing all contexts of a client as
+ * threads.  The contexts share the loaded drivers and the renderer state,
+ * while different clients still have different processes.
+ *
+ * The server sends a RENDER_HOST_OP_CREATE_CONTEXT with the context fd for
+ * each new context, and a RENDER_HOST_OP_DESTROY_CONTEXT after the client
+ * process has closed its end of the context socket pair.
+ */
+enum render_host_op {
+   RENDER_HOST_OP_CREATE_CONTEXT,
+   RENDER_HOST_OP_DESTROY_CONTEXT,
+};
+
+struct render_host_request {
+   enum render_host_op op;
+   /* ctx_fd is passed with the request and is ignored */
+   struct render_context_args args;
+};
+
+bool
+render_host_main(const struct render_context_args *args);
+
+#endif /* RENDER_HOST_H */
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "virgl_resource.h"
+#include "virglrenderer.h"
 
 /* this covers the command line options and the socket type */
 #define RENDER_SERVER_VERSION 0
@@ -39,6 +40,9 @@ enum render_context_op {
    RENDER_CONTEXT_OP_DESTROY_RESOURCE,
    RENDER_CONTEXT_OP_SUBMIT_CMD,
    RENDER_CONTEXT_OP_SUBMIT_FENCE,
+   RENDER_CONTEXT_OP_SUBMIT_BATCH,
+   RENDER_CONTEXT_OP_GET_STATS,
+   RENDER_CONTEXT_OP_CREATE_RESOURCES,
 
    RENDER_CONTEXT_OP_COUNT,
 };
@@ -78,6 +82,8 @@ struct render_client_op_create_context_request {
    struct render_client_op_header header;
    uint32_t ctx_id;
    char ctx_name[32];
+   /* applied by the worker before the context is initialized */
+   struct virgl_renderer_context_sched sched;
 };
 
 struct render_client_op_create_context_reply {
@@ -113,10 +119,16 @@ struct render_context_op_nop_request {
 
 /* Initialize the context.
  *
- * The shmem is required and currently holds an array of atomic_uint.  Each
+ * The shmem is required and starts with an array of atomic_uint.  Each
  * atomic_uint represents the current sequence number of a ring (as defined by
  * the virtio-gpu spec).
  *
+ * The shmem optionally holds a command ring as well.  When cmd_ring_size is
+ * non-zero, the array of atomic_uint ends at cmd_ring_tail_offset, where an
+ * atomic_uint holds the ring position the worker is done with.  The ring of
+ * cmd_ring_size bytes, a power of two, is at cmd_ring_offset.  Positions are
+ * free-running and the command at position pos is at (pos % cmd_ring_size).
+ *
  * The eventfd is optional.  When given, it will be written to when there are
  * changes to any of the sequence numbers.
  *
@@ -126,6 +138,9 @@ struct render_context_op_init_request {
    struct render_context_op_header header;
    uint32_t flags; /* VIRGL_RENDERER_CONTEXT_FLAG_*/
    size_t shmem_size;
+   size_t cmd_ring_tail_offset;
+   size_t cmd_ring_offset;
+   size_t cmd_ring_size;
    /* followed by 1 shmem fd and optionally 1 eventfd */
 };
 
@@ -182,15 +197,26 @@ struct render_context_op_destroy_resource_request {
  * The size limit depends on the socket type.  Currently, SOCK_SEQPACKET is
  * used and the size limit is best treated as one page.
  *
+ * Larger command streams can instead be written to the command ring of the
+ * shmem, at cmd_ring_pos.  The command stream must not cross the end of the
+ * ring, and must start at a multiple of RENDER_CONTEXT_CMD_RING_ALIGN.  The
+ * worker stores cmd_ring_pos + size to the ring tail once the command stream
+ * is consumed.
+ *
+ * Command streams that fit in neither can be passed as an fd of at least size
+ * bytes, attached to the request.  The worker maps the fd privately.
+ *
  * This roughly corresponds to virgl_renderer_submit_cmd.
  */
+#define RENDER_CONTEXT_CMD_RING_ALIGN 16
+
 struct render_context_op_submit_cmd_request {
    struct render_context_op_header header;
    uint32_t size;
+   bool in_cmd_ring;
+   uint32_t cmd_ring_pos;
+   /* ignored when in_cmd_ring or when an fd is attached */
    char cmd[256];
-   /* if size > sizeof(cmd), followed by (size - sizeof(cmd)) bytes in another
-    * message; size still must be small
-    */
 };
 
 /* Submit a fence to the context.
@@ -208,6 +234,70 @@ struct render_context_op_submit_fence_request {
    uint32_t seqno;
 };
 
+/* Submit several command streams and fences to the context, in order.
+ *
+ * Each entry is a SUBMIT_CMD or SUBMIT_FENCE request.  The command streams
+ * must fit in the request or be in the command ring.
+ */
+#define RENDER_CONTEXT_BATCH_MAX_COUNT 4
+
+union render_context_op_submit_batch_entry {
+   struct render_context_op_header header;
+   struct render_context_op_submit_cmd_request submit_cmd;
+   struct render_context_op_submit_fence_request submit_fence;
+};
+
+struct render_context_op_submit_batch_request {
+   struct render_context_op_header header;
+   uint32_t count;
+   union render_context_op_submit_batch_entry entries[RENDER_CONTEXT_BATCH_MAX_COUNT];
+};
+
+/* Get the counters of the context.
+ *
+ * This roughly corresponds to virgl_renderer_get_stats.
+ */
+struct render_context_op_get_stats_request {
+   struct render_context_op_header header;
+};
+
+struct render_context_op_get_stats_reply {
+   bool ok;
+   uint32_t ring_count;
+   uint64_t temp_pool_size;
+   uint64_t ring_idle_time;
+   uint64_t ring_exec_time;
+   uint64_t sparse_committed_size;
+};
+
+/* Export several blob resources from the context.
+ *
+ * This is the same as a CREATE_RESOURCE request for each entry, in order.
+ * The reply has a CREATE_RESOURCE reply for each entry, followed by the fds
+ * of the entries whose fd_type is not VIRGL_RESOURCE_FD_INVALID, in order.
+ */
+#define RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT 8
+
+struct render_context_op_create_resources_entry {
+   uint32_t res_id;
+   uint64_t blob_id;
+   uint64_t blob_size;
+   uint32_t blob_flags; /* VIRGL_RENDERER_BLOB_FLAG_* */
+};
+
+struct render_context_op_create_resources_request {
+   struct render_context_op_header header;
+   uint32_t count;
+   struct render_context_op_create_resources_entry
+      entries[RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT];
+};
+
+struct render_context_op_create_resources_reply {
+   struct render_context_op_create_resource_reply
+      entries[RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT];
+   /* followed by the fds */
+};
+
 union render_context_op_request {
    struct render_context_op_header header;
    struct render_context_op_nop_request nop;
@@ -217,6 +307,9 @@ union render_context_op_request {
    struct render_context_op_destroy_resource_request destroy_resource;
    struct render_context_op_submit_cmd_request submit_cmd;
    struct render_context_op_submit_fence_request submit_fence;
+   struct render_context_op_submit_batch_request submit_batch;
+   struct render_context_op_get_stats_request get_stats;
+   struct render_context_op_create_resources_request create_resources;
 };
 
 #endif /* RENDER_PROTOCOL_H */
@@ -12,6 +12,7 @@
 
 #include "render_client.h"
 #include "render_worker.h"
+#include "vkr_library.h"
 
 #define RENDER_SERVER_MAX_WORKER_COUNT 256
 
@@ -67,16 +68,24 @@ render_server_run(struct render_server *srv)
    const int poll_fd_count = render_server_init_poll_fds(srv, poll_fds);
 
    while (srv->state == RENDER_SERVER_STATE_RUN) {
+      /* refill before blocking; this may turn us into a pre-forked worker */
+      render_client_fill_worker_pool(client);
+      if (srv->state != RENDER_SERVER_STATE_RUN)
+         break;
+
       if (!render_server_poll(srv, poll_fds, poll_fd_count))
          return false;
 
-      if (poll_fds[RENDER_SERVER_POLL_SOCKET].revents) {
-         if (!render_client_dispatch(client))
+      /* reap all exited workers first, to free their slots for the contexts
+       * the requests create
+       */
+      if (poll_fds[RENDER_SERVER_POLL_SIGCHLD].revents) {
+         if (!render_worker_jail_reap_workers(srv->worker_jail))
             return false;
       }
 
-      if (poll_fds[RENDER_SERVER_POLL_SIGCHLD].revents) {
-         if (!render_worker_jail_reap_workers(srv->worker_jail))
+      if (poll_fds[RENDER_SERVER_POLL_SOCKET].revents) {
+         if (!render_client_dispatch(client))
             return false;
       }
    }
@@ -105,6 +114,9 @@ render_server_parse_options(struct render_server *srv, int argc, char **argv)
       OPT_WORKER_SECCOMP_BPF,
       OPT_WORKER_SECCOMP_MINIJAIL_POLICY,
       OPT_WORKER_SECCOMP_MINIJAIL_LOG,
+      OPT_WORKER_THREADS,
+      OPT_WORKER_POOL_SIZE,
+      OPT_WORKER_PREINIT,
       OPT_COUNT,
    };
    static const struct option options[] = {
@@ -114,6 +126,9 @@ render_server_parse_options(struct render_server *srv, int argc, char **argv)
         OPT_WORKER_SECCOMP_MINIJAIL_POLICY },
       { "worker-seccomp-minijail-log", no_argument, NULL,
         OPT_WORKER_SECCOMP_MINIJAIL_LOG },
+      { "worker-threads", no_argument, NULL, OPT_WORKER_THREADS },
+      { "worker-pool-size", required_argument, NULL, OPT_WORKER_POOL_SIZE },
+      { "worker-preinit", no_argument, NULL, OPT_WORKER_PREINIT },
       { NULL, 0, NULL, 0 }
    };
    static_assert(OPT_COUNT <= 'z', "");
@@ -136,6 +151,15 @@ render_server_parse_options(struct render_server *srv, int argc, char **argv)
       case OPT_WORKER_SECCOMP_MINIJAIL_LOG:
          srv->worker_seccomp_minijail_log = true;
          break;
+      case OPT_WORKER_THREADS:
+         srv->worker_threads = true;
+         break;
+      case OPT_WORKER_POOL_SIZE:
+         srv->worker_pool_size = atoi(optarg);
+         break;
+      case OPT_WORKER_PREINIT:
+         srv->worker_preinit = true;
+         break;
       default:
          render_log("unknown option specified");
          return false;
@@ -148,6 +172,11 @@ render_server_parse_options(struct render_server *srv, int argc, char **argv)
       return false;
    }
 
+   if (srv->worker_pool_size < 0) {
+      render_log("invalid worker pool size specified");
+      return false;
+   }
+
    if (srv->client_fd < 0 || !render_socket_is_seqpacket(srv->client_fd)) {
       render_log("no valid client fd specified");
       return false;
@@ -170,6 +199,13 @@ render_server_init(struct render_server *srv,
    if (!render_server_parse_options(srv, argc, argv))
       return false;
 
+   /* Loading libvulkan and the ICDs is fork-safe.  When the server keeps them
+    * loaded, workers share the pages copy-on-write instead of loading them
+    * again.
+    */
+   if (srv->worker_preinit)
+      vkr_library_warm_up();
+
    enum render_worker_jail_seccomp_filter seccomp_filter =
       RENDER_WORKER_JAIL_SECCOMP_NONE;
    const char *seccomp_path = NULL;
@@ -184,7 +220,9 @@ render_server_init(struct render_server *srv,
       seccomp_path = srv->worker_seccomp_minijail_policy;
    }
 
-   srv->worker_jail = render_worker_jail_create(RENDER_SERVER_MAX_WORKER_COUNT,
+   /* contexts do not use pre-forked workers with a thread host */
+   const int pool_size = srv->worker_threads ? 0 : srv->worker_pool_size;
+   srv->worker_jail = render_worker_jail_create(RENDER_SERVER_MAX_WORKER_COUNT, pool_size,
                                                 seccomp_filter, seccomp_path);
    if (!srv->worker_jail) {
       render_log("failed to create worker jail");
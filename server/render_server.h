@@ -24,6 +24,11 @@ struct render_server {
    const char *worker_seccomp_bpf;
    const char *worker_seccomp_minijail_policy;
    bool worker_seccomp_minijail_log;
+   /* contexts are threads of a subprocess worker (render_host.h) */
+   bool worker_threads;
+   int worker_pool_size;
+   /* libvulkan and the ICDs are loaded before workers are forked */
+   bool worker_preinit;
 
    struct render_worker_jail *worker_jail;
 
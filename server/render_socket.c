@@ -25,6 +25,7 @@
 #endif
 
 #define RENDER_SOCKET_MAX_FD_COUNT 8
+#define RENDER_SOCKET_MAX_REQUEST_COUNT 8
 
 #ifdef __APPLE__
 /*
@@ -358,6 +359,119 @@ render_socket_receive_request_with_fds(struct render_socket *socket,
                                                  max_fd_count, out_fd_count);
 }
 
+#ifndef __APPLE__
+static uint32_t
+render_socket_process_mmsgs(struct mmsghdr *msgs,
+                            uint32_t msg_count,
+                            struct render_socket_request *reqs)
+{
+   uint32_t req_count = 0;
+   bool truncated = false;
+   bool eof = false;
+
+   for (uint32_t i = 0; i < msg_count; i++) {
+      const struct msghdr *msg = &msgs[i].msg_hdr;
+      struct render_socket_request *req = &reqs[i];
+
+      int fd_count;
+      const int *fds = get_received_fds(msg, &fd_count);
+      assert(fd_count <= req->max_fd_count);
+
+      /* a zero-sized message means the peer has shut down */
+      if (!msgs[i].msg_len)
+         eof = true;
+      else if (msg->msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+         truncated = true;
+
+      if (eof || truncated) {
+         for (int j = 0; j < fd_count; j++)
+            close(fds[j]);
+         continue;
+      }
+
+      req->size = msgs[i].msg_len;
+      if (fd_count)
+         memcpy(req->fds, fds, sizeof(*fds) * fd_count);
+      req->fd_count = fd_count;
+      req_count++;
+   }
+
+   /* the requests before a shutdown are still valid */
+   if (truncated) {
+      render_log("failed to receive message: truncated");
+      for (uint32_t i = 0; i < req_count; i++) {
+         for (int j = 0; j < reqs[i].fd_count; j++)
+            close(reqs[i].fds[j]);
+      }
+      req_count = 0;
+   }
+
+   return req_count;
+}
+#endif
+
+bool
+render_socket_receive_requests(struct render_socket *socket,
+                               struct render_socket_request *reqs,
+                               uint32_t count,
+                               uint32_t *out_count)
+{
+   assert(count);
+
+#ifdef __APPLE__
+   /* the framing of SOCK_STREAM requires one message at a time */
+   struct render_socket_request *req = &reqs[0];
+   if (!render_socket_receive_request_internal(socket, req->data, req->max_size,
+                                               &req->size, req->fds, req->max_fd_count,
+                                               &req->fd_count))
+      return false;
+
+   *out_count = 1;
+   return true;
+#else
+   alignas(struct cmsghdr) char cmsg_bufs[RENDER_SOCKET_MAX_REQUEST_COUNT]
+                                          [CMSG_SPACE(sizeof(int) * RENDER_SOCKET_MAX_FD_COUNT)];
+   struct iovec iovs[RENDER_SOCKET_MAX_REQUEST_COUNT];
+   struct mmsghdr msgs[RENDER_SOCKET_MAX_REQUEST_COUNT];
+
+   count = MIN2(count, RENDER_SOCKET_MAX_REQUEST_COUNT);
+   for (uint32_t i = 0; i < count; i++) {
+      const struct render_socket_request *req = &reqs[i];
+      assert(req->data && req->max_size);
+      assert(req->max_fd_count <= RENDER_SOCKET_MAX_FD_COUNT);
+
+      iovs[i] = (struct iovec){
+         .iov_base = req->data,
+         .iov_len = req->max_size,
+      };
+      msgs[i] = (struct mmsghdr){
+         .msg_hdr = {
+            .msg_iov = &iovs[i],
+            .msg_iovlen = 1,
+         },
+      };
+      if (req->max_fd_count) {
+         msgs[i].msg_hdr.msg_control = cmsg_bufs[i];
+         msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int) * req->max_fd_count);
+      }
+   }
+
+   int received;
+   do {
+      received =
+         recvmmsg(socket->fd, msgs, count, MSG_CMSG_CLOEXEC | MSG_WAITFORONE, NULL);
+   } while (received < 0 && (errno == EAGAIN || errno == EINTR));
+
+   if (received < 0) {
+      render_log("failed to receive messages: %s", strerror(errno));
+      return false;
+   }
+
+   *out_count = render_socket_process_mmsgs(msgs, received, reqs);
+   return *out_count;
+#endif
+}
+
 bool
 render_socket_receive_data(struct render_socket *socket, void *data, size_t size)
 {
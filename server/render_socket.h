@@ -39,6 +39,28 @@ render_socket_receive_request_with_fds(struct render_socket *socket,
                                        int max_fd_count,
                                        int *out_fd_count);
 
+/* Requests received by render_socket_receive_requests.  The caller sets the
+ * buffers and their limits.
+ */
+struct render_socket_request {
+   void *data;
+   size_t max_size;
+   size_t size;
+
+   int *fds;
+   int max_fd_count;
+   int fd_count;
+};
+
+/* Receives up to count requests, blocking only until the first one.  On
+ * Linux, the requests already queued are received with a single recvmmsg.
+ */
+bool
+render_socket_receive_requests(struct render_socket *socket,
+                               struct render_socket_request *reqs,
+                               uint32_t count,
+                               uint32_t *out_count);
+
 bool
 render_socket_receive_data(struct render_socket *socket, void *data, size_t size);
 
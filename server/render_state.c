@@ -7,24 +7,21 @@
 
 #include <inttypes.h>
 
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
 #include "c11/threads.h"
-#endif
 
 #include "render_context.h"
 #include "vkr_renderer.h"
 
-/* Workers call into vkr renderer.  When they are processes, not much care is
- * required. But when workers are threads, we need to grab a lock to protect
- * vkr renderer.
+/* Workers call into vkr renderer.  When workers are threads, either of the
+ * server process or of a thread host (render_host.h), we need to grab a lock
+ * to protect vkr renderer.  The locks are uncontended when workers are
+ * processes.
  */
 struct render_state {
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
    /* protect renderer interface */
    mtx_t renderer_mutex;
    /* protect the below global states */
    mtx_t state_mutex;
-#endif
 
    /* track and init/fini just once */
    int init_count;
@@ -34,14 +31,11 @@ struct render_state {
 };
 
 struct render_state state = {
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
    .renderer_mutex = _MTX_INITIALIZER_NP,
    .state_mutex = _MTX_INITIALIZER_NP,
-#endif
    .init_count = 0,
 };
 
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
 static inline mtx_t *
 render_state_lock(mtx_t *mtx)
 {
@@ -63,32 +57,18 @@ render_state_unlock(mtx_t **mtx)
    mtx_t *_renderer_mtx __attribute__((cleanup(render_state_unlock), unused)) =          \
       render_state_lock(&state.renderer_mutex)
 
-#else
-
-#define SCOPE_LOCK_STATE()
-#define SCOPE_LOCK_RENDERER()
-
-#endif /* ENABLE_RENDER_SERVER_WORKER_THREAD */
-
 static struct render_context *
 render_state_lookup_context(uint32_t ctx_id)
 {
    struct render_context *ctx = NULL;
 
    SCOPE_LOCK_STATE();
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
    list_for_each_entry (struct render_context, iter, &state.contexts, head) {
       if (iter->ctx_id == ctx_id) {
          ctx = iter;
          break;
       }
    }
-#else
-   assert(list_is_singular(&state.contexts));
-   ctx = list_first_entry(&state.contexts, struct render_context, head);
-   assert(ctx->ctx_id == ctx_id);
-   (void)ctx_id;
-#endif
 
    return ctx;
 }
@@ -143,7 +123,7 @@ render_state_fini(void)
 }
 
 bool
-render_state_init(uint32_t init_flags)
+render_state_init(uint32_t init_flags, bool threaded)
 {
    static const uint32_t required_flags = VIRGL_RENDERER_VENUS | VIRGL_RENDERER_NO_VIRGL;
    if ((init_flags & required_flags) != required_flags)
@@ -152,8 +132,9 @@ render_state_init(uint32_t init_flags)
    SCOPE_LOCK_STATE();
    if (!state.init_count) {
       /* always use sync thread and async fence cb for low latency */
-      static const uint32_t vkr_flags =
-         VKR_RENDERER_THREAD_SYNC | VKR_RENDERER_ASYNC_FENCE_CB;
+      uint32_t vkr_flags = VKR_RENDERER_THREAD_SYNC | VKR_RENDERER_ASYNC_FENCE_CB;
+      if (threaded)
+         vkr_flags |= VKR_RENDERER_WORKER_THREAD;
       if (!vkr_renderer_init(vkr_flags, &render_state_cbs))
          return false;
 
@@ -231,6 +212,26 @@ render_state_create_resource(uint32_t ctx_id,
                                        out_vulkan_info);
 }
 
+void
+render_state_create_resources(uint32_t ctx_id,
+                              const struct render_context_op_create_resources_entry *entries,
+                              uint32_t count,
+                              struct render_context_op_create_resource_reply *out_replies,
+                              int *out_res_fds)
+{
+   SCOPE_LOCK_RENDERER();
+   for (uint32_t i = 0; i < count; i++) {
+      const struct render_context_op_create_resources_entry *entry = &entries[i];
+      struct render_context_op_create_resource_reply *reply = &out_replies[i];
+
+      if (!vkr_renderer_create_resource(ctx_id, entry->res_id, entry->blob_id,
+                                        entry->blob_size, entry->blob_flags,
+                                        &reply->fd_type, &out_res_fds[i],
+                                        &reply->map_info, &reply->vulkan_info))
+         reply->fd_type = VIRGL_RESOURCE_FD_INVALID;
+   }
+}
+
 bool
 render_state_import_resource(uint32_t ctx_id,
                              uint32_t res_id,
@@ -248,3 +249,10 @@ render_state_destroy_resource(uint32_t ctx_id, uint32_t res_id)
    SCOPE_LOCK_RENDERER();
    vkr_renderer_destroy_resource(ctx_id, res_id);
 }
+
+bool
+render_state_get_stats(uint32_t ctx_id, struct virgl_renderer_stats *stats)
+{
+   SCOPE_LOCK_RENDERER();
+   return vkr_renderer_get_context_stats(ctx_id, stats);
+}
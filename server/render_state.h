@@ -8,8 +8,11 @@
 
 #include "render_common.h"
 
+/* threaded is only used by the first init, and means that the contexts are
+ * serviced by threads of a process that outlives them
+ */
 bool
-render_state_init(uint32_t init_flags);
+render_state_init(uint32_t init_flags, bool threaded);
 
 void
 render_state_fini(void);
@@ -43,6 +46,13 @@ render_state_create_resource(uint32_t ctx_id,
                              uint32_t *out_map_info,
                              struct virgl_resource_vulkan_info *out_vulkan_info);
 
+void
+render_state_create_resources(uint32_t ctx_id,
+                              const struct render_context_op_create_resources_entry *entries,
+                              uint32_t count,
+                              struct render_context_op_create_resource_reply *out_replies,
+                              int *out_res_fds);
+
 bool
 render_state_import_resource(uint32_t ctx_id,
                              uint32_t res_id,
@@ -53,4 +63,7 @@ render_state_import_resource(uint32_t ctx_id,
 void
 render_state_destroy_resource(uint32_t ctx_id, uint32_t res_id);
 
+bool
+render_state_get_stats(uint32_t ctx_id, struct virgl_renderer_stats *stats);
+
 #endif /* RENDER_STATE_H */
@@ -66,6 +66,10 @@ struct render_worker_jail {
 
    struct list_head workers;
    int worker_count;
+
+   /* pre-forked workers are also in workers */
+   int pool_size;
+   int pooled_count;
 };
 
 struct render_worker {
@@ -77,6 +81,10 @@ struct render_worker {
    bool destroyed;
    bool reaped;
 
+   /* a pre-forked worker waiting on the other end of pool_fd */
+   bool pooled;
+   int pool_fd;
+
    struct list_head head;
 
    char thread_data[];
@@ -269,10 +277,24 @@ render_worker_jail_add_worker(struct render_worker_jail *jail,
    jail->worker_count++;
 }
 
+static void
+render_worker_jail_unpool_worker(struct render_worker_jail *jail,
+                                 struct render_worker *worker)
+{
+   assert(worker->pooled);
+   close(worker->pool_fd);
+   worker->pool_fd = -1;
+   worker->pooled = false;
+   jail->pooled_count--;
+}
+
 static void
 render_worker_jail_remove_worker(struct render_worker_jail *jail,
                                  struct render_worker *worker)
 {
+   if (worker->pooled)
+      render_worker_jail_unpool_worker(jail, worker);
+
    list_del(&worker->head);
    jail->worker_count--;
 
@@ -308,14 +330,23 @@ render_worker_jail_reap_any_worker(struct render_worker_jail *jail, bool block)
 
 struct render_worker_jail *
 render_worker_jail_create(int max_worker_count,
+                          int pool_size,
                           enum render_worker_jail_seccomp_filter seccomp_filter,
                           const char *seccomp_path)
 {
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   if (pool_size) {
+      render_log("pre-forked workers require process workers");
+      return NULL;
+   }
+#endif
+
    struct render_worker_jail *jail = calloc(1, sizeof(*jail));
    if (!jail)
       return NULL;
 
    jail->max_worker_count = max_worker_count;
+   jail->pool_size = MIN2(pool_size, max_worker_count);
    jail->sigchld_fd = -1;
    list_inithead(&jail->workers);
 
@@ -359,6 +390,13 @@ render_worker_jail_wait_workers(struct render_worker_jail *jail)
 void
 render_worker_jail_destroy(struct render_worker_jail *jail)
 {
+   list_for_each_entry_safe (struct render_worker, worker, &jail->workers, head) {
+      if (worker->pooled) {
+         render_worker_jail_unpool_worker(jail, worker);
+         render_worker_destroy(jail, worker);
+      }
+   }
+
    render_worker_jail_wait_workers(jail);
 
 #if defined(ENABLE_RENDER_SERVER_WORKER_MINIJAIL)
@@ -426,7 +464,7 @@ render_worker_jail_reap_workers(struct render_worker_jail *jail)
          break;
 
       assert(worker->reaped);
-      if (worker->destroyed)
+      if (worker->destroyed || worker->pooled)
          render_worker_jail_remove_worker(jail, worker);
    } while (true);
 
@@ -441,6 +479,114 @@ render_worker_jail_detach_workers(struct render_worker_jail *jail)
       render_worker_jail_remove_worker(jail, worker);
 }
 
+#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+
+static pid_t
+render_worker_jail_fork(struct render_worker_jail *jail)
+{
+#if defined(ENABLE_RENDER_SERVER_WORKER_MINIJAIL)
+   return fork_minijail(jail->minijail);
+#else
+   (void)jail;
+   return fork();
+#endif
+}
+
+#endif /* !ENABLE_RENDER_SERVER_WORKER_THREAD */
+
+int
+render_worker_jail_fill_pool(struct render_worker_jail *jail)
+{
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   (void)jail;
+   return -1;
+#else
+   while (jail->pooled_count < jail->pool_size &&
+          jail->worker_count < jail->max_worker_count) {
+      int socket_fds[2];
+      if (!render_socket_pair(socket_fds))
+         break;
+
+      struct render_worker *worker = calloc(1, sizeof(*worker));
+      if (!worker) {
+         close(socket_fds[0]);
+         close(socket_fds[1]);
+         break;
+      }
+
+      worker->pid = render_worker_jail_fork(jail);
+      if (worker->pid < 0) {
+         render_log("failed to pre-fork a worker");
+         close(socket_fds[0]);
+         close(socket_fds[1]);
+         free(worker);
+         break;
+      }
+
+      if (!worker->pid) {
+         /* this is the pre-forked worker */
+         close(socket_fds[1]);
+         free(worker);
+         return socket_fds[0];
+      }
+
+      close(socket_fds[0]);
+      worker->pooled = true;
+      worker->pool_fd = socket_fds[1];
+      render_worker_jail_add_worker(jail, worker);
+      jail->pooled_count++;
+   }
+
+   return -1;
+#endif
+}
+
+bool
+render_worker_wait(int pool_fd, void *data, size_t size, int *out_fd)
+{
+   struct render_socket socket;
+   render_socket_init(&socket, pool_fd);
+
+   size_t received_size;
+   int fd_count;
+   bool ok = render_socket_receive_request_with_fds(&socket, data, size, &received_size,
+                                                    out_fd, 1, &fd_count);
+   if (ok && (received_size != size || fd_count != 1)) {
+      render_log("invalid data received by pre-forked worker");
+      if (fd_count)
+         close(*out_fd);
+      ok = false;
+   }
+
+   render_socket_fini(&socket);
+
+   return ok;
+}
+
+struct render_worker *
+render_worker_take(struct render_worker_jail *jail,
+                   const void *data,
+                   size_t size,
+                   int fd)
+{
+   list_for_each_entry_safe (struct render_worker, worker, &jail->workers, head) {
+      if (!worker->pooled || worker->reaped)
+         continue;
+
+      struct render_socket socket;
+      render_socket_init(&socket, worker->pool_fd);
+      const bool ok = render_socket_send_reply_with_fds(&socket, data, size, &fd, 1);
+      render_worker_jail_unpool_worker(jail, worker);
+      if (ok)
+         return worker;
+
+      /* kill and leave it to the reaper */
+      render_worker_destroy(jail, worker);
+   }
+
+   return NULL;
+}
+
 struct render_worker *
 render_worker_create(struct render_worker_jail *jail,
                      int (*thread_func)(void *thread_data),
@@ -459,14 +605,10 @@ render_worker_create(struct render_worker_jail *jail,
    memcpy(worker->thread_data, thread_data, thread_data_size);
 
    bool ok;
-#if defined(ENABLE_RENDER_SERVER_WORKER_PROCESS)
-   worker->pid = fork();
-   ok = worker->pid >= 0;
-   (void)thread_func;
-#elif defined(ENABLE_RENDER_SERVER_WORKER_THREAD)
+#if defined(ENABLE_RENDER_SERVER_WORKER_THREAD)
    ok = thrd_create(&worker->thread, thread_func, worker->thread_data) == thrd_success;
-#elif defined(ENABLE_RENDER_SERVER_WORKER_MINIJAIL)
-   worker->pid = fork_minijail(jail->minijail);
+#else
+   worker->pid = render_worker_jail_fork(jail);
    ok = worker->pid >= 0;
    (void)thread_func;
 #endif
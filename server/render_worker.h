@@ -18,8 +18,12 @@ enum render_worker_jail_seccomp_filter {
    RENDER_WORKER_JAIL_SECCOMP_MINIJAIL_POLICY_LOG,
 };
 
+/* pool_size is the number of pre-forked workers to keep, and requires
+ * subprocess workers
+ */
 struct render_worker_jail *
 render_worker_jail_create(int max_worker_count,
+                          int pool_size,
                           enum render_worker_jail_seccomp_filter seccomp_filter,
                           const char *seccomp_path);
 
@@ -35,6 +39,27 @@ render_worker_jail_reap_workers(struct render_worker_jail *jail);
 void
 render_worker_jail_detach_workers(struct render_worker_jail *jail);
 
+/* Pre-forks workers until the pool is full and returns -1.  In a pre-forked
+ * worker, this returns the fd to pass to render_worker_wait instead.
+ */
+int
+render_worker_jail_fill_pool(struct render_worker_jail *jail);
+
+/* In a pre-forked worker, waits until the worker is taken and receives the
+ * data and the fd passed to render_worker_take.  pool_fd is closed.
+ */
+bool
+render_worker_wait(int pool_fd, void *data, size_t size, int *out_fd);
+
+/* Takes a pre-forked worker and sends it data and fd, or returns NULL when
+ * the pool is empty.  fd is not closed.
+ */
+struct render_worker *
+render_worker_take(struct render_worker_jail *jail,
+                   const void *data,
+                   size_t size,
+                   int fd);
+
 struct render_worker *
 render_worker_create(struct render_worker_jail *jail,
                      int (*thread_func)(void *thread_data),
@@ -39,8 +39,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <xf86drm.h>
 
@@ -74,6 +76,18 @@
  } while (false)
 #endif
 
+#define AMDGPU_BO_LIST_CACHE_SIZE 8
+
+/* A kernel BO list created for a guest BO list. */
+struct amdgpu_bo_list {
+   uint32_t hash;
+   uint32_t bo_count;
+   /* the guest entries, with res_ids as the handles */
+   struct drm_amdgpu_bo_list_entry *guest_entries;
+   /* zero when unused */
+   uint32_t handle;
+};
+
 struct amdgpu_context {
    struct drm_context base;
 
@@ -84,10 +98,33 @@ struct amdgpu_context {
    struct amdgpu_ccmd_rsp *current_rsp;
 
    amdgpu_device_handle dev;
+   /* of the render node, identifies the device across the contexts */
+   dev_t rdev;
+   /* false when fstat failed, the heap info is then queried each time */
+   bool has_rdev;
    int debug;
 
    struct hash_table_u64 *id_to_ctx;
 
+   /* The BO lists of the recent submits.  A list is destroyed when one of
+    * its objects is freed.
+    */
+   struct amdgpu_bo_list bo_lists[AMDGPU_BO_LIST_CACHE_SIZE];
+   unsigned next_bo_list;
+
+   /* The host copy of shmem->fence_status, which the guest can scribble
+    * over.  The mutex is also taken by the fence thread, and protects the
+    * shmem pointer.
+    */
+   struct {
+      mtx_t mutex;
+      uint64_t keys[AMDGPU_SHMEM_FENCE_STATUS_COUNT];
+      uint64_t seqnos[AMDGPU_SHMEM_FENCE_STATUS_COUNT];
+      /* bumped when an entry is reused, in the tags of the pending fences */
+      uint32_t generations[AMDGPU_SHMEM_FENCE_STATUS_COUNT];
+      unsigned next;
+   } fence_status;
+
    uint32_t timeline_count;
    struct drm_timeline timelines[];
 };
@@ -144,6 +181,15 @@ static void free_id_to_ctx(struct hash_entry *entry)
    amdgpu_cs_ctx_free(entry->data);
 }
 
+static void
+amdgpu_bo_list_fini(struct amdgpu_context *ctx, struct amdgpu_bo_list *list)
+{
+   if (list->handle)
+      amdgpu_bo_list_destroy_raw(ctx->dev, list->handle);
+   free(list->guest_entries);
+   memset(list, 0, sizeof(*list));
+}
+
 static void
 amdgpu_renderer_destroy(struct virgl_context *vctx)
 {
@@ -157,8 +203,13 @@ amdgpu_renderer_destroy(struct virgl_context *vctx)
 
    drm_context_deinit(&ctx->base);
 
-   if (ctx->id_to_ctx)
+   for (unsigned i = 0; i < ARRAY_SIZE(ctx->bo_lists); i++)
+      amdgpu_bo_list_fini(ctx, &ctx->bo_lists[i]);
+
+   if (ctx->id_to_ctx) {
       _mesa_hash_table_u64_destroy(ctx->id_to_ctx, free_id_to_ctx);
+      mtx_destroy(&ctx->fence_status.mutex);
+   }
 
    amdgpu_device_deinitialize(ctx->dev);
 
@@ -277,6 +328,18 @@ amdgpu_renderer_free_object(struct drm_context *dctx, struct drm_object *dobj)
 
    print(2, "free obj res_id: %d", dobj->res_id);
 
+   for (unsigned i = 0; i < ARRAY_SIZE(ctx->bo_lists); i++) {
+      struct amdgpu_bo_list *list = &ctx->bo_lists[i];
+      for (uint32_t j = 0; j < list->bo_count; j++) {
+         if (list->guest_entries[j].bo_handle == dobj->res_id) {
+            amdgpu_bo_list_fini(ctx, list);
+            break;
+         }
+      }
+   }
+
+   drm_context_release_object_map(dctx, dobj);
+
    amdgpu_bo_free(obj->bo);
    free(obj);
 }
@@ -321,51 +384,266 @@ amdgpu_renderer_export_opaque_handle(struct virgl_context *vctx,
    return VIRGL_RESOURCE_FD_DMABUF;
 }
 
-static void * amdgpu_renderer_resource_map(struct virgl_context *vctx,
-                                           struct virgl_resource *res,
-                                           void *addr,
-                                           int32_t prot,
-                                           int32_t flags)
+static void * amdgpu_renderer_mmap_object(struct drm_context *dctx,
+                                          struct drm_object *dobj,
+                                          void *addr,
+                                          int prot,
+                                          int flags)
 {
-   struct drm_context *dctx = to_drm_context(vctx);
    struct amdgpu_context *ctx = to_amdgpu_context(dctx);
-   struct amdgpu_object *obj = amdgpu_get_object_from_res_id(ctx, res->res_id, __FUNCTION__);
    union drm_amdgpu_gem_mmap args = { 0 };
    int r;
 
-   print(2, "obj=%p, res_id=%u", (void *)obj, res->res_id);
+   print(2, "obj=%p, res_id=%u", (void *)dobj, dobj->res_id);
 
-   if (!obj) {
-      print(0, "invalid res_id %u", res->res_id);
-      return NULL;
-   }
-
-   args.in.handle = obj->base.handle;
+   args.in.handle = dobj->handle;
 
    r = drmCommandWriteRead(amdgpu_device_get_fd(ctx->dev), DRM_AMDGPU_GEM_MMAP, &args,
                            sizeof(args));
 
    if (r) {
       print(0, "DRM_AMDGPU_GEM_MMAP failed with r=%d", r);
-      return NULL;
+      return MAP_FAILED;
    }
 
-   return mmap(addr, obj->base.size, prot, flags,
+   return mmap(addr, dobj->size, prot, flags,
                amdgpu_device_get_fd(ctx->dev), args.out.addr_ptr);
 }
 
+/* The heap usage is that of the whole device, so the contexts share one
+ * snapshot per device, even though each has its own device handle.  It is
+ * refreshed when it gets older than HEAP_INFO_MAX_AGE_NS, or once
+ * HEAP_INFO_MAX_ALLOC bytes were allocated since, which saves the three
+ * queries on most blob creations.
+ */
+#define HEAP_INFO_MAX_DEVICES 4
+#define HEAP_INFO_MAX_AGE_NS (100 * 1000 * 1000ll)
+#define HEAP_INFO_MAX_ALLOC (64 * 1024 * 1024ull)
+
+struct heap_info_snapshot {
+   dev_t rdev;
+   bool valid;
+   int64_t timestamp;
+   uint64_t allocated;
+   struct amdgpu_heap_info gtt;
+   struct amdgpu_heap_info vram;
+   struct amdgpu_heap_info vis_vram;
+};
+
+static struct {
+   once_flag init_once;
+   mtx_t mutex;
+   struct heap_info_snapshot snapshots[HEAP_INFO_MAX_DEVICES];
+} heap_info_cache = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
 static void
-update_heap_info_in_shmem(struct amdgpu_context *ctx)
+heap_info_cache_init_once(void)
+{
+   mtx_init(&heap_info_cache.mutex, mtx_plain);
+}
+
+static int64_t
+heap_info_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* returns the snapshot of the device, or NULL when the cache is full */
+static struct heap_info_snapshot *
+heap_info_cache_get_locked(dev_t rdev)
+{
+   for (unsigned i = 0; i < HEAP_INFO_MAX_DEVICES; i++) {
+      struct heap_info_snapshot *snapshot = &heap_info_cache.snapshots[i];
+      if (snapshot->valid && snapshot->rdev == rdev)
+         return snapshot;
+      if (!snapshot->valid) {
+         snapshot->rdev = rdev;
+         snapshot->valid = true;
+         /* refreshed on first use */
+         snapshot->allocated = HEAP_INFO_MAX_ALLOC;
+         return snapshot;
+      }
+   }
+
+   return NULL;
+}
+
+static void
+heap_info_cache_add_allocation(struct amdgpu_context *ctx, uint64_t size)
 {
-   amdgpu_query_heap_info(ctx->dev, AMDGPU_GEM_DOMAIN_VRAM,
-                       AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED,
-                       &ctx->shmem->vis_vram);
-   amdgpu_query_heap_info(ctx->dev, AMDGPU_GEM_DOMAIN_VRAM,
+   if (!ctx->has_rdev)
+      return;
+
+   call_once(&heap_info_cache.init_once, heap_info_cache_init_once);
+
+   mtx_lock(&heap_info_cache.mutex);
+   struct heap_info_snapshot *snapshot = heap_info_cache_get_locked(ctx->rdev);
+   if (snapshot)
+      snapshot->allocated += size;
+   mtx_unlock(&heap_info_cache.mutex);
+}
+
+static void
+query_heap_info(amdgpu_device_handle dev, struct amdgpu_heap_info *gtt,
+                struct amdgpu_heap_info *vram, struct amdgpu_heap_info *vis_vram)
+{
+   amdgpu_query_heap_info(dev, AMDGPU_GEM_DOMAIN_VRAM,
+                          AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED,
+                          vis_vram);
+   amdgpu_query_heap_info(dev, AMDGPU_GEM_DOMAIN_VRAM,
                           0,
-                          &ctx->shmem->vram);
-   amdgpu_query_heap_info(ctx->dev, AMDGPU_GEM_DOMAIN_GTT,
+                          vram);
+   amdgpu_query_heap_info(dev, AMDGPU_GEM_DOMAIN_GTT,
                           0,
-                          &ctx->shmem->gtt);
+                          gtt);
+}
+
+static void
+update_heap_info_in_shmem(struct amdgpu_context *ctx)
+{
+   /* without the device number, the snapshot of another device could be used */
+   if (!ctx->has_rdev) {
+      query_heap_info(ctx->dev, &ctx->shmem->gtt, &ctx->shmem->vram,
+                      &ctx->shmem->vis_vram);
+      return;
+   }
+
+   call_once(&heap_info_cache.init_once, heap_info_cache_init_once);
+
+   mtx_lock(&heap_info_cache.mutex);
+
+   struct heap_info_snapshot *snapshot = heap_info_cache_get_locked(ctx->rdev);
+   if (!snapshot) {
+      mtx_unlock(&heap_info_cache.mutex);
+      query_heap_info(ctx->dev, &ctx->shmem->gtt, &ctx->shmem->vram,
+                      &ctx->shmem->vis_vram);
+      return;
+   }
+
+   const int64_t now = heap_info_now();
+   if (now - snapshot->timestamp > HEAP_INFO_MAX_AGE_NS ||
+       snapshot->allocated >= HEAP_INFO_MAX_ALLOC) {
+      query_heap_info(ctx->dev, &snapshot->gtt, &snapshot->vram, &snapshot->vis_vram);
+      snapshot->timestamp = now;
+      snapshot->allocated = 0;
+   }
+
+   ctx->shmem->gtt = snapshot->gtt;
+   ctx->shmem->vram = snapshot->vram;
+   ctx->shmem->vis_vram = snapshot->vis_vram;
+
+   mtx_unlock(&heap_info_cache.mutex);
+}
+
+/* The tag of a drm_fence: the entry index plus one, and its generation. */
+#define FENCE_STATUS_TAG(ctx, i) \
+   ((uint32_t)(i) + 1 | (ctx)->fence_status.generations[i] << 8)
+
+static void
+fence_status_set_locked(struct amdgpu_context *ctx, unsigned i, uint64_t key,
+                        uint64_t seqno)
+{
+   ctx->fence_status.keys[i] = key;
+   ctx->fence_status.seqnos[i] = seqno;
+
+   if (!ctx->shmem)
+      return;
+
+   /* the guest only trusts the seqno when it sees the same key around it */
+   p_atomic_set(&ctx->shmem->fence_status[i].key, 0);
+   p_atomic_set(&ctx->shmem->fence_status[i].seqno, seqno);
+   p_atomic_set(&ctx->shmem->fence_status[i].key, key);
+}
+
+static int
+fence_status_find_locked(struct amdgpu_context *ctx, uint64_t key)
+{
+   for (unsigned i = 0; i < AMDGPU_SHMEM_FENCE_STATUS_COUNT; i++) {
+      if (ctx->fence_status.keys[i] == key)
+         return i;
+   }
+   return -1;
+}
+
+/* Returns the tag of the entry of a ring, reusing the entry of another ring
+ * when they are all taken, or 0 when the ring can not be keyed.
+ */
+static uint32_t
+fence_status_get_tag(struct amdgpu_context *ctx, uint32_t ctx_id,
+                     const struct drm_amdgpu_cs_chunk_ib *ib)
+{
+   if (ib->ip_type > UINT8_MAX || ib->ip_instance > UINT8_MAX || ib->ring > UINT8_MAX)
+      return 0;
+
+   const uint64_t key =
+      AMDGPU_FENCE_STATUS_KEY(ctx_id, ib->ip_type, ib->ip_instance, ib->ring);
+
+   mtx_lock(&ctx->fence_status.mutex);
+
+   int i = fence_status_find_locked(ctx, key);
+   if (i < 0) {
+      i = fence_status_find_locked(ctx, 0);
+      if (i < 0) {
+         i = ctx->fence_status.next;
+         ctx->fence_status.next = (i + 1) % AMDGPU_SHMEM_FENCE_STATUS_COUNT;
+      }
+      ctx->fence_status.generations[i] = (ctx->fence_status.generations[i] + 1) & 0xffffff;
+      fence_status_set_locked(ctx, i, key, 0);
+   }
+
+   const uint32_t tag = FENCE_STATUS_TAG(ctx, i);
+
+   mtx_unlock(&ctx->fence_status.mutex);
+
+   return tag;
+}
+
+static void
+fence_status_update_locked(struct amdgpu_context *ctx, unsigned i, uint64_t seqno)
+{
+   if (seqno <= ctx->fence_status.seqnos[i])
+      return;
+
+   ctx->fence_status.seqnos[i] = seqno;
+   if (ctx->shmem)
+      p_atomic_set(&ctx->shmem->fence_status[i].seqno, seqno);
+}
+
+/* drm_timeline::fence_signaled, on the fence thread */
+static void
+fence_status_signaled(struct drm_timeline *timeline, uint32_t tag, uint64_t seqno)
+{
+   struct amdgpu_context *ctx = to_amdgpu_context(to_drm_context(timeline->vctx));
+   const unsigned i = (tag & 0xff) - 1;
+
+   /* untagged fences have no entry */
+   if (!tag || i >= AMDGPU_SHMEM_FENCE_STATUS_COUNT)
+      return;
+
+   mtx_lock(&ctx->fence_status.mutex);
+   /* the entry may have been reused since the submit */
+   if (FENCE_STATUS_TAG(ctx, i) == tag)
+      fence_status_update_locked(ctx, i, seqno);
+   mtx_unlock(&ctx->fence_status.mutex);
+}
+
+/* frees the entries of the rings of a destroyed amdgpu context */
+static void
+fence_status_remove_ctx(struct amdgpu_context *ctx, uint32_t ctx_id)
+{
+   mtx_lock(&ctx->fence_status.mutex);
+   for (unsigned i = 0; i < AMDGPU_SHMEM_FENCE_STATUS_COUNT; i++) {
+      if (ctx->fence_status.keys[i] &&
+          (uint32_t)ctx->fence_status.keys[i] == ctx_id) {
+         ctx->fence_status.generations[i] = (ctx->fence_status.generations[i] + 1) & 0xffffff;
+         fence_status_set_locked(ctx, i, 0, 0);
+      }
+   }
+   mtx_unlock(&ctx->fence_status.mutex);
 }
 
 static int
@@ -395,7 +673,12 @@ amdgpu_renderer_get_blob(struct virgl_context *vctx, uint32_t res_id, uint64_t b
       if (ret)
          return ret;
 
+      mtx_lock(&ctx->fence_status.mutex);
       ctx->shmem = to_amdvgpu_shmem(dctx->shmem);
+      for (unsigned i = 0; i < AMDGPU_SHMEM_FENCE_STATUS_COUNT; i++)
+         fence_status_set_locked(ctx, i, ctx->fence_status.keys[i],
+                                 ctx->fence_status.seqnos[i]);
+      mtx_unlock(&ctx->fence_status.mutex);
 
       update_heap_info_in_shmem(ctx);
 
@@ -519,6 +802,10 @@ amdgpu_ccmd_gem_new(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       ret = -EINVAL;
       goto alloc_failed;
    }
+   if (!drm_context_memory_budget_fits(dctx, req->r.alloc_size)) {
+      ret = -ENOMEM;
+      goto alloc_failed;
+   }
 
    struct amdgpu_bo_alloc_request r = {
       .alloc_size = req->r.alloc_size,
@@ -545,6 +832,8 @@ amdgpu_ccmd_gem_new(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    if (obj == NULL)
       goto va_map_failed;
 
+   heap_info_cache_add_allocation(ctx, req->r.alloc_size);
+
    obj->base.handle = gem_handle;
    /* Enable Write-Combine except for GTT buffers with WC disabled. */
    obj->enable_cache_wc =
@@ -775,6 +1064,7 @@ amdgpu_ccmd_create_ctx(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
          amdgpu_cs_ctx_free(actx);
          rsp->hdr.ret = 0;
         _mesa_hash_table_u64_remove(ctx->id_to_ctx, req->id);
+         fence_status_remove_ctx(ctx, req->id);
       }
 
       print(1, "amdgpu_cs_ctx_free dev: %p -> %p", (void*)ctx->dev, (void*)actx);
@@ -804,19 +1094,88 @@ static bool validate_chunk_inputs(size_t offset, size_t len, struct amdgpu_conte
    return true;
 }
 
+/* Returns a kernel BO list for the guest entries, reusing a cached list
+ * with the same entries.
+ */
+static int
+amdgpu_get_bo_list(struct amdgpu_context *ctx,
+                   const struct drm_amdgpu_bo_list_entry *guest_entries,
+                   uint32_t bo_count,
+                   uint32_t *out_handle)
+{
+   const size_t size = bo_count * sizeof(*guest_entries);
+   const uint32_t hash = _mesa_hash_data(guest_entries, size);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(ctx->bo_lists); i++) {
+      const struct amdgpu_bo_list *list = &ctx->bo_lists[i];
+      if (list->handle && list->hash == hash && list->bo_count == bo_count &&
+          !memcmp(list->guest_entries, guest_entries, size)) {
+         *out_handle = list->handle;
+         return 0;
+      }
+   }
+
+   struct drm_amdgpu_bo_list_entry *entries = malloc(size);
+   struct drm_amdgpu_bo_list_entry *bo_list = malloc(size);
+   if (!entries || !bo_list) {
+      print(0, "Unable to allocate %zu bytes for bo_list", size);
+      free(entries);
+      free(bo_list);
+      return -ENOMEM;
+   }
+
+   memcpy(entries, guest_entries, size);
+   for (uint32_t i = 0; i < bo_count; i++) {
+      struct amdgpu_object *obj =
+         amdgpu_get_object_from_res_id(ctx, guest_entries[i].bo_handle, __FUNCTION__);
+      if (!obj) {
+         print(0, "Couldn't retrieve bo with res_id %d", guest_entries[i].bo_handle);
+         free(entries);
+         free(bo_list);
+         return -EINVAL;
+      }
+      bo_list[i].bo_handle = obj->base.handle;
+      bo_list[i].bo_priority = guest_entries[i].bo_priority;
+   }
+
+   uint32_t handle;
+   int r = amdgpu_bo_list_create_raw(ctx->dev, bo_count, bo_list, &handle);
+   free(bo_list);
+   if (r) {
+      print(0, "BO list creation failed (%d)", r);
+      free(entries);
+      return r;
+   }
+
+   /* replace the oldest list */
+   struct amdgpu_bo_list *list = &ctx->bo_lists[ctx->next_bo_list];
+   ctx->next_bo_list = (ctx->next_bo_list + 1) % ARRAY_SIZE(ctx->bo_lists);
+   amdgpu_bo_list_fini(ctx, list);
+
+   list->hash = hash;
+   list->bo_count = bo_count;
+   list->guest_entries = entries;
+   list->handle = handle;
+
+   *out_handle = handle;
+   return 0;
+}
+
 static int
 amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
 {
    const struct amdgpu_ccmd_cs_submit_req *req = to_amdgpu_ccmd_cs_submit_req(hdr);
    struct amdgpu_context *ctx = to_amdgpu_context(dctx);
-   struct drm_amdgpu_bo_list_in bo_list_in = { 0 };
    struct drm_amdgpu_cs_chunk_fence user_fence;
    struct drm_amdgpu_cs_chunk_sem syncobj_in = { 0 };
    const struct drm_amdgpu_bo_list_entry *bo_handles_in = NULL;
-   struct drm_amdgpu_bo_list_entry *bo_list = NULL;
+   uint32_t bo_count = 0;
+   uint32_t bo_list_handle = 0;
    struct drm_amdgpu_cs_chunk *chunks;
    unsigned num_chunks = 0;
    uint64_t seqno = 0;
+   struct drm_amdgpu_cs_chunk_ib ib;
+   bool has_ib = false;
    int r;
 
    struct amdgpu_ccmd_rsp *rsp;
@@ -887,47 +1246,27 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       const void *input = (const char *)req + offset;
 
       if (chunk_id == AMDGPU_CHUNK_ID_BO_HANDLES) {
-         uint32_t bo_count = len / sizeof(*bo_handles_in);
+         bo_count = len / sizeof(*bo_handles_in);
          if (!validate_chunk_inputs(bo_count, typeof(*bo_handles_in))) {
             r = -EINVAL;
             goto end;
          }
 
-         if (bo_list != NULL) {
+         if (bo_handles_in != NULL) {
             print(0, "Refusing to allocate multiple BO lists");
             r = -EINVAL;
             goto end;
          }
 
          bo_handles_in = input;
-         bo_list = malloc(bo_count * sizeof(struct drm_amdgpu_bo_list_entry));
-         if (!bo_list) {
-            print(0, "Unable to allocate %zu bytes for bo_list",
-                  bo_count * sizeof(struct drm_amdgpu_bo_list_entry));
-            r = -ENOMEM;
-            goto end;
-         }
 
-         bo_list_in.operation = ~0;
-         bo_list_in.list_handle = ~0;
-         bo_list_in.bo_number = bo_count;
-         bo_list_in.bo_info_size = sizeof(struct drm_amdgpu_bo_list_entry);
-         bo_list_in.bo_info_ptr = (uint64_t)(uintptr_t)bo_list;
-
-         for (uint32_t j = 0; j < bo_count; j++) {
-            struct amdgpu_object *obj =
-               amdgpu_get_object_from_res_id(ctx, bo_handles_in[j].bo_handle, __FUNCTION__);
-            if (!obj) {
-               print(0, "Couldn't retrieve bo with res_id %d", bo_handles_in[j].bo_handle);
-               r = -EINVAL;
+         /* the list is passed by handle instead of as a chunk */
+         if (bo_count) {
+            r = amdgpu_get_bo_list(ctx, bo_handles_in, bo_count, &bo_list_handle);
+            if (r)
                goto end;
-            }
-            bo_list[j].bo_handle = obj->base.handle;
-            bo_list[j].bo_priority = bo_handles_in[j].bo_priority;
          }
-
-         chunks[num_chunks].length_dw = sizeof(bo_list_in) / 4;
-         chunks[num_chunks].chunk_data = (uintptr_t)&bo_list_in;
+         continue;
       } else if (chunk_id == AMDGPU_CHUNK_ID_FENCE) {
          const struct drm_amdgpu_cs_chunk_fence *in;
          if (!validate_chunk_inputs(1, typeof(*in))) {
@@ -963,6 +1302,11 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
             r = -EINVAL;
             goto end;
          }
+         /* all the IBs of a submit are on the same ring */
+         if (!has_ib) {
+            memcpy(&ib, input, sizeof(ib));
+            has_ib = true;
+         }
       } else {
          print(0, "Unsupported chunk_id %d received", chunk_id);
          r = -EINVAL;
@@ -999,7 +1343,7 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    }
    num_chunks++;
 
-   r = amdgpu_cs_submit_raw2(ctx->dev, actx, 0, num_chunks, chunks, &seqno);
+   r = amdgpu_cs_submit_raw2(ctx->dev, actx, bo_list_handle, num_chunks, chunks, &seqno);
 
    if (in_fence_fd >= 0) {
       close(in_fence_fd);
@@ -1010,7 +1354,12 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       int submit_fd;
       r = drmSyncobjExportSyncFile(amdgpu_device_get_fd(ctx->dev), syncobj_out.handle, &submit_fd);
       if (r == 0) {
-         drm_timeline_set_last_fence_fd(&ctx->timelines[req->ring_idx - 1], submit_fd);
+         struct drm_timeline *timeline = &ctx->timelines[req->ring_idx - 1];
+         drm_timeline_set_last_fence_fd(timeline, submit_fd);
+         if (has_ib) {
+            timeline->last_fence_tag = fence_status_get_tag(ctx, req->ctx_id, &ib);
+            timeline->last_fence_seqno = seqno;
+         }
          print(3, "Set last fd ring_idx: %d: %d", req->ring_idx, submit_fd);
       } else {
          print(0, "Failed to create a FD from the syncobj (%d)", r);
@@ -1022,13 +1371,13 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    }
 
    if (r != 0 || ctx->debug >= 4) {
-      print(1, "GPU submit used %d BOs:", bo_list_in.bo_number);
+      print(1, "GPU submit used %d BOs:", bo_count);
       print(1, "Used | Resource ID ");
       print(1, "-----|-------------");
       hash_table_foreach (ctx->base.resource_table, entry) {
          const struct amdgpu_object *o = entry->data;
          bool used = false;
-         for (unsigned j = 0; j < bo_list_in.bo_number && !used; j++) {
+         for (unsigned j = 0; j < bo_count && !used; j++) {
             if (bo_handles_in[j].bo_handle == o->base.res_id)
                used = true;
          }
@@ -1046,8 +1395,6 @@ amdgpu_ccmd_cs_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    print(3, "ctx: %d -> seqno={v=%d a=%ld} r=%d", req->ctx_id, hdr->seqno, seqno, r);
 
 end:
-   if (bo_list)
-      free(bo_list);
    free(chunks);
    rsp->ret = r;
    return r;
@@ -1131,6 +1478,19 @@ static int amdgpu_ccmd_cs_query_fence_status(struct drm_context *dctx, struct vd
 
    rsp->hdr.ret = amdgpu_cs_query_fence_status(&fence, req->timeout_ns, req->flags, &rsp->expired);
 
+   /* saves the next polls of the guest when the ring has an entry */
+   if (!rsp->hdr.ret && rsp->expired && req->ip_type <= UINT8_MAX &&
+       req->ip_instance <= UINT8_MAX && req->ring <= UINT8_MAX) {
+      const uint64_t key = AMDGPU_FENCE_STATUS_KEY(req->ctx_id, req->ip_type,
+                                                   req->ip_instance, req->ring);
+
+      mtx_lock(&ctx->fence_status.mutex);
+      const int i = fence_status_find_locked(ctx, key);
+      if (i >= 0)
+         fence_status_update_locked(ctx, i, req->fence);
+      mtx_unlock(&ctx->fence_status.mutex);
+   }
+
    return 0;
 }
 
@@ -1224,6 +1584,13 @@ amdgpu_renderer_create(int fd, size_t debug_len, const char *debug_name)
       goto fail;
    ctx->debug = -1;
    ctx->dev = dev;
+
+   struct stat st;
+   if (!fstat(fd, &st)) {
+      ctx->rdev = st.st_rdev;
+      ctx->has_rdev = true;
+   }
+
    const char *d = getenv("DEBUG");
    if (d)
       ctx->debug = atoi(d);
@@ -1238,7 +1605,9 @@ amdgpu_renderer_create(int fd, size_t debug_len, const char *debug_name)
    ctx->base.base.destroy = amdgpu_renderer_destroy;
    ctx->base.base.attach_resource = amdgpu_renderer_attach_resource;
    ctx->base.base.export_opaque_handle = amdgpu_renderer_export_opaque_handle;
-   ctx->base.base.resource_map = amdgpu_renderer_resource_map;
+   ctx->base.base.resource_map = drm_context_resource_map;
+   ctx->base.base.resource_unmap = drm_context_resource_unmap;
+   ctx->base.mmap_object = amdgpu_renderer_mmap_object;
    ctx->base.base.get_blob = amdgpu_renderer_get_blob;
    ctx->base.base.submit_fence = amdgpu_renderer_submit_fence;
    ctx->base.base.supports_fence_sharing = true;
@@ -1248,6 +1617,8 @@ amdgpu_renderer_create(int fd, size_t debug_len, const char *debug_name)
    if (ctx->id_to_ctx == NULL)
       goto fail_hash_table;
 
+   mtx_init(&ctx->fence_status.mutex, mtx_plain);
+
    /* Ring 0 is for CPU execution. */
    /* TODO: add a setting to control which queues are exposed to the
     * guest.
@@ -1268,6 +1639,7 @@ amdgpu_renderer_create(int fd, size_t debug_len, const char *debug_name)
          drm_timeline_init(&ctx->timelines[ring_idx - 1], &ctx->base.base,
                            name, ring_idx,
                            drm_context_fence_retire);
+         ctx->timelines[ring_idx - 1].fence_signaled = fence_status_signaled;
          ring_idx += 1;
       }
    }
@@ -1279,6 +1651,7 @@ amdgpu_renderer_create(int fd, size_t debug_len, const char *debug_name)
    return &ctx->base.base;
 
 fail_context_deinit:
+   mtx_destroy(&ctx->fence_status.mutex);
    _mesa_hash_table_u64_destroy(ctx->id_to_ctx, NULL);
 fail_hash_table:
    drm_context_deinit(&ctx->base);
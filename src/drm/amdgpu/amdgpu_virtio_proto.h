@@ -32,6 +32,29 @@ static_assert(sizeof(struct amdgpu_ccmd_rsp) == 8, "bug");
    static_assert(sizeof(struct t) % 8 == 0, "sizeof(struct " #t ") not multiple of 8"); \
    static_assert(alignof(struct t) <= 8, "alignof(struct " #t ") too large");
 
+/**
+ * The last signaled seqno of the fences of a ring of an amdgpu context, the
+ * seqnos returned by CS_SUBMIT.
+ *
+ * An entry is reused for another ring with its key cleared while its seqno
+ * is reset.  The guest reads the key, the seqno and the key again, all with
+ * acquire semantics, and can only trust the seqno when both keys match the
+ * ring it asks about.  The fences of a ring without an entry are queried
+ * with CS_QUERY_FENCE_STATUS.
+ */
+struct amdgpu_fence_status {
+   /* AMDGPU_FENCE_STATUS_KEY, zero when unused */
+   uint64_t key;
+   uint64_t seqno;
+};
+AMDGPU_STATIC_ASSERT_SIZE(amdgpu_fence_status)
+
+#define AMDGPU_FENCE_STATUS_KEY(ctx_id, ip_type, ip_instance, ring) \
+   ((1ull << 63) | ((uint64_t)(ring) << 48) | ((uint64_t)(ip_instance) << 40) | \
+    ((uint64_t)(ip_type) << 32) | (uint32_t)(ctx_id))
+
+#define AMDGPU_SHMEM_FENCE_STATUS_COUNT 32
+
 /**
  * Defines the layout of shmem buffer used for host->guest communication.
  */
@@ -50,6 +73,12 @@ struct amdvgpu_shmem {
    struct amdgpu_heap_info gtt;
    struct amdgpu_heap_info vram;
    struct amdgpu_heap_info vis_vram;
+
+   /**
+    * Updated as the submits signal, see struct amdgpu_fence_status.  Only
+    * present when rsp_mem_offset is past it.
+    */
+   struct amdgpu_fence_status fence_status[AMDGPU_SHMEM_FENCE_STATUS_COUNT];
 };
 AMDGPU_STATIC_ASSERT_SIZE(amdvgpu_shmem)
 DEFINE_CAST(vdrm_shmem, amdvgpu_shmem)
@@ -17,12 +17,16 @@
 #include <xf86drm.h>
 
 #include "virgl_context.h"
+#include "virgl_numa.h"
 #include "virgl_util.h"
 #include "virglrenderer.h"
 
 #include "util/anon_file.h"
 #include "util/hash_table.h"
 #include "util/u_atomic.h"
+#include "util/u_debug.h"
+#include "util/u_math.h"
+#include "util/u_thread.h"
 
 #include "drm_context.h"
 #include "drm_fence.h"
@@ -73,6 +77,33 @@ struct asahi_context {
     * against a single sched entity complete in fifo order.
     */
    struct drm_timeline timelines[NR_TIMELINES];
+
+   /**
+    * The thread making the submits, so that the ccmds keep being decoded
+    * while the kernel takes a submit.  The submits and the fences are
+    * queued in order.  The ccmds touching what the queued submits use wait
+    * for them with asahi_submit_thread_flush().
+    *
+    * ASAHI_SUBMIT_THREAD=false makes the submits in the ccmds instead.
+    */
+   struct {
+      bool enabled;
+      thrd_t thread;
+      mtx_t mutex;
+      cnd_t cond;
+      cnd_t idle_cond;
+      struct list_head jobs;
+      unsigned pending_count;
+      bool stop;
+   } submit_thread;
+
+   /* the sync array of the submits, used by one thread at a time */
+   struct drm_asahi_sync *syncs;
+   uint32_t syncs_capacity;
+
+   /* the translated ops of VM_BIND */
+   struct drm_asahi_gem_bind_op *bind_ops;
+   uint32_t bind_ops_capacity;
 };
 DEFINE_CAST(drm_context, asahi_context)
 
@@ -85,13 +116,49 @@ static int
 async_ret(struct asahi_context *actx, int ret)
 {
    if (unlikely(ret)) {
+      /* also from the submit thread */
       if (actx->shmem)
-         actx->shmem->async_error++;
+         p_atomic_inc(&actx->shmem->async_error);
    }
 
    return 0;
 }
 
+/**
+ * Waits until the queued submits and fences, if any, have been processed.
+ */
+static void
+asahi_submit_thread_flush(struct asahi_context *actx)
+{
+   if (!actx->submit_thread.enabled)
+      return;
+
+   mtx_lock(&actx->submit_thread.mutex);
+   while (actx->submit_thread.pending_count)
+      cnd_wait(&actx->submit_thread.idle_cond, &actx->submit_thread.mutex);
+   mtx_unlock(&actx->submit_thread.mutex);
+}
+
+static void
+asahi_submit_thread_fini(struct asahi_context *actx)
+{
+   if (!actx->submit_thread.enabled)
+      return;
+
+   /* the thread processes the remaining jobs before exiting */
+   mtx_lock(&actx->submit_thread.mutex);
+   actx->submit_thread.stop = true;
+   cnd_signal(&actx->submit_thread.cond);
+   mtx_unlock(&actx->submit_thread.mutex);
+
+   thrd_join(actx->submit_thread.thread, NULL);
+
+   cnd_destroy(&actx->submit_thread.idle_cond);
+   cnd_destroy(&actx->submit_thread.cond);
+   mtx_destroy(&actx->submit_thread.mutex);
+   actx->submit_thread.enabled = false;
+}
+
 static int
 gem_close(int fd, uint32_t handle)
 {
@@ -102,9 +169,10 @@ gem_close(int fd, uint32_t handle)
 struct asahi_object {
    struct drm_object base;
    uint32_t flags;
+   /* exported for the extres of the submits, or -1 */
+   int dmabuf_fd;
    bool exported   : 1;
    bool exportable : 1;
-   uint8_t *map;
 };
 DEFINE_CAST(drm_object, asahi_object)
 
@@ -119,6 +187,7 @@ asahi_object_create(uint32_t handle, uint32_t flags, uint32_t size)
    obj->base.handle = handle;
    obj->base.size = size;
    obj->flags = flags;
+   obj->dmabuf_fd = -1;
 
    return obj;
 }
@@ -148,6 +217,8 @@ asahi_renderer_destroy(struct virgl_context *vctx)
    struct drm_context *dctx = to_drm_context(vctx);
    struct asahi_context *actx = to_asahi_context(dctx);
 
+   asahi_submit_thread_fini(actx);
+
    for (unsigned i = 0; i < NR_TIMELINES; ++i) {
       drm_timeline_fini(&actx->timelines[i]);
    }
@@ -156,6 +227,9 @@ asahi_renderer_destroy(struct virgl_context *vctx)
 
    _mesa_hash_table_destroy(actx->queue_to_ring_idx, NULL);
 
+   free(actx->syncs);
+   free(actx->bind_ops);
+
    free(actx);
 }
 
@@ -240,14 +314,32 @@ asahi_renderer_free_object(struct drm_context *dctx, struct drm_object *dobj)
 {
    struct asahi_object *obj = to_asahi_object(dobj);
 
-   if (obj->map)
-      munmap(obj->map, obj->base.size);
+   /* the queued submits may use the object */
+   asahi_submit_thread_flush(to_asahi_context(dctx));
+
+   drm_context_release_object_map(dctx, dobj);
 
+   if (obj->dmabuf_fd >= 0)
+      close(obj->dmabuf_fd);
    gem_close(dctx->fd, obj->base.handle);
 
    free(obj);
 }
 
+static void *
+asahi_renderer_mmap_object(struct drm_context *dctx, struct drm_object *dobj, void *addr,
+                           int prot, int flags)
+{
+   struct drm_asahi_gem_mmap_offset args = { .handle = dobj->handle };
+
+   if (drmIoctl(dctx->fd, DRM_IOCTL_ASAHI_GEM_MMAP_OFFSET, &args)) {
+      drm_err("DRM_IOCTL_ASAHI_GEM_MMAP_OFFSET failed: %s", strerror(errno));
+      return MAP_FAILED;
+   }
+
+   return mmap(addr, dobj->size, prot, flags, dctx->fd, args.offset);
+}
+
 static int
 asahi_renderer_get_blob(struct virgl_context *vctx, uint32_t res_id, uint64_t blob_id,
                         uint64_t blob_size, uint32_t blob_flags,
@@ -404,6 +496,9 @@ asahi_ccmd_ioctl_simple(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    if (!rsp)
       return -ENOMEM;
 
+   /* the queues may be destroyed */
+   asahi_submit_thread_flush(actx);
+
    /* Copy the payload because the kernel can write (if IOC_OUT bit
     * is set) and to avoid casting away the const:
     */
@@ -469,6 +564,9 @@ asahi_ccmd_gem_new(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       return async_ret(actx, -EINVAL);
    }
 
+   if (!drm_context_memory_budget_fits(dctx, req->size))
+      return async_ret(actx, -ENOMEM);
+
    int create_vm_id = req->vm_id;
    if (!(req->flags & DRM_ASAHI_GEM_VM_PRIVATE)) {
       create_vm_id = 0;
@@ -558,7 +656,17 @@ asahi_ccmd_vm_bind(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       return -EINVAL;
    }
 
-   struct drm_asahi_gem_bind_op *ops = calloc(req->count, req->stride);
+   /* the ops array is kept between the binds */
+   if (req->count > actx->bind_ops_capacity) {
+      struct drm_asahi_gem_bind_op *ops =
+         realloc(actx->bind_ops, size_mul(req->count, sizeof(*ops)));
+      if (!ops)
+         return async_ret(actx, -ENOMEM);
+      actx->bind_ops = ops;
+      actx->bind_ops_capacity = req->count;
+   }
+
+   struct drm_asahi_gem_bind_op *ops = actx->bind_ops;
    struct drm_asahi_vm_bind bind = {
       .vm_id = req->vm_id,
       .stride = sizeof(*ops),
@@ -566,17 +674,21 @@ asahi_ccmd_vm_bind(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       .userptr = (uint64_t)(uintptr_t)ops,
    };
 
+   const size_t op_size = MIN2(req->stride, sizeof(*ops));
    for (unsigned i = 0; i < req->count; ++i) {
-      memcpy(&ops[i], payload + (i * req->stride), req->stride);
+      memset(&ops[i], 0, sizeof(ops[i]));
+      memcpy(&ops[i], payload + (i * req->stride), op_size);
       ops[i].handle = handle_from_res_id(dctx, ops[i].handle);
    }
 
+   /* the queued submits may use the mappings */
+   asahi_submit_thread_flush(actx);
+
    ret = drmIoctl(dctx->fd, DRM_IOCTL_ASAHI_VM_BIND, &bind);
    if (ret) {
       drm_err("DRM_IOCTL_ASAHI_GEM_BIND failed");
    }
 
-   free(ops);
    return async_ret(actx, ret);
 }
 
@@ -598,6 +710,9 @@ asahi_ccmd_gem_bind_object(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
          return -ENOMEM;
    }
 
+   /* the queued submits may use the object */
+   asahi_submit_thread_flush(actx);
+
    if (gem_bind->handle) {
       struct drm_object *obj = drm_context_get_object_from_res_id(dctx, gem_bind->handle);
 
@@ -626,54 +741,64 @@ exit_rsp:
    }
 }
 
+/* an external resource of a submit, the fd is owned by the object */
+struct asahi_submit_extres {
+   int dmabuf_fd;
+   uint32_t flags;
+};
+
+/* returns the fd of the object, exported on first use */
 static int
-asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
+asahi_object_get_dmabuf_fd(struct drm_context *dctx, struct asahi_object *obj)
 {
-   struct asahi_context *actx = to_asahi_context(dctx);
-   const struct asahi_ccmd_submit_req *req = to_asahi_ccmd_submit_req(hdr);
-   int ret = 0;
-
-   if (hdr->len < sizeof(struct asahi_ccmd_submit_req)) {
-      drm_err("invalid cmd length");
-      return -EINVAL;
-   }
-
-   const struct hash_entry *entry =
-      hash_table_search(actx->queue_to_ring_idx, req->queue_id);
-   if (!entry) {
-      drm_err("unknown submitqueue: %u", req->queue_id);
-      return -EINVAL;
+   if (obj->dmabuf_fd < 0) {
+      int ret = drmPrimeHandleToFD(dctx->fd, obj->base.handle, DRM_CLOEXEC | DRM_RDWR,
+                                   &obj->dmabuf_fd);
+      if (ret < 0) {
+         drm_log("failed to get dmabuf fd: %s", strerror(errno));
+         obj->dmabuf_fd = -1;
+      }
    }
 
-   unsigned ring_idx = (uintptr_t)entry->data;
-   uint8_t *ptr = (uint8_t *)req->payload;
-   uint8_t *end = ptr + (hdr->len - sizeof(struct asahi_ccmd_submit_req));
-
-   uint8_t *cmdbuf = ptr;
-   ptr += req->cmdbuf_size;
-
-   struct asahi_ccmd_submit_res *extres = (struct asahi_ccmd_submit_res *)ptr;
-   ptr += req->extres_count * sizeof(struct asahi_ccmd_submit_res);
+   return obj->dmabuf_fd;
+}
 
-   if (ptr > end) {
-      drm_err("invalid command buffer / extres array");
-      return -EINVAL;
+static struct drm_asahi_sync *
+asahi_get_syncs(struct asahi_context *actx, uint32_t count)
+{
+   if (count > actx->syncs_capacity) {
+      struct drm_asahi_sync *syncs = realloc(actx->syncs, sizeof(*syncs) * count);
+      if (!syncs)
+         return NULL;
+      actx->syncs = syncs;
+      actx->syncs_capacity = count;
    }
 
-   struct drm_asahi_sync *syncs =
-      malloc(sizeof(struct drm_asahi_sync) * (2 + req->extres_count));
+   return actx->syncs;
+}
 
-   struct drm_asahi_submit submit = {
-      .flags = req->flags,
-      .queue_id = req->queue_id,
-      .cmdbuf = (uint64_t)(uintptr_t)cmdbuf,
-      .cmdbuf_size = req->cmdbuf_size,
-      .syncs = (uint64_t)(uintptr_t)syncs,
-   };
+/* Makes the submit, with the cmdbuf of args, and closes in_fence_fd.  This
+ * runs on the submit thread when there is one.
+ */
+static int
+asahi_do_submit(struct asahi_context *actx, const struct drm_asahi_submit *args,
+                unsigned ring_idx, int in_fence_fd,
+                const struct asahi_submit_extres *extres, uint32_t extres_count)
+{
+   struct drm_context *dctx = &actx->base;
+   int ret = 0;
 
-   int *extres_fds = malloc(sizeof(int) * req->extres_count);
+   struct drm_asahi_sync *syncs = asahi_get_syncs(actx, 2 + extres_count);
+   if (!syncs) {
+      if (in_fence_fd >= 0)
+         close(in_fence_fd);
+      return -ENOMEM;
+   }
 
-   int in_fence_fd = virgl_context_take_in_fence_fd(&dctx->base);
+   struct drm_asahi_submit submit = *args;
+   submit.syncs = (uint64_t)(uintptr_t)syncs;
+   submit.in_sync_count = 0;
+   submit.out_sync_count = 0;
 
    if (in_fence_fd >= 0) {
       struct drm_asahi_sync in_sync = { .sync_type = DRM_ASAHI_SYNC_SYNCOBJ };
@@ -687,27 +812,8 @@ asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    }
 
    // Do the dance to get the in_syncs populated from external resources
-   for (uint32_t i = 0; i < req->extres_count; i++) {
-      extres_fds[i] = -1;
-
-      if (!(extres[i].flags & (ASAHI_EXTRES_READ | ASAHI_EXTRES_WRITE)))
-         continue;
-
-      struct drm_object *obj = drm_context_get_object_from_res_id(dctx, extres[i].res_id);
-      if (!obj || !to_asahi_object(obj)->exportable) {
-         drm_log("invalid extres res_id %u (%s)", extres[i].res_id,
-                 obj ? "not exportable" : "not found");
-         continue;
-      }
-
-      ret = drmPrimeHandleToFD(dctx->fd, obj->handle, DRM_CLOEXEC | DRM_RDWR,
-                               &extres_fds[i]);
-      if (ret < 0 || extres_fds[i] == -1) {
-         drm_log("failed to get dmabuf fd: %s", strerror(errno));
-         continue;
-      }
-
-      if (!(extres[i].flags & ASAHI_EXTRES_READ))
+   for (uint32_t i = 0; i < extres_count; i++) {
+      if (extres[i].dmabuf_fd < 0 || !(extres[i].flags & ASAHI_EXTRES_READ))
          continue;
 
       struct dma_buf_export_sync_file export_sync_file_ioctl = {
@@ -716,7 +822,7 @@ asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       };
 
       ret =
-         drmIoctl(extres_fds[i], DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync_file_ioctl);
+         drmIoctl(extres[i].dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync_file_ioctl);
       if (ret < 0 || export_sync_file_ioctl.fd < 0) {
          drm_log("failed to export sync file: %s", strerror(errno));
          continue;
@@ -768,8 +874,8 @@ asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       int submit_fd;
       ret = drmSyncobjExportSyncFile(dctx->fd, out_sync.handle, &submit_fd);
       if (ret == 0) {
-         for (uint32_t i = 0; i < req->extres_count; i++) {
-            if (extres_fds[i] < 0 || !(extres[i].flags & ASAHI_EXTRES_WRITE))
+         for (uint32_t i = 0; i < extres_count; i++) {
+            if (extres[i].dmabuf_fd < 0 || !(extres[i].flags & ASAHI_EXTRES_WRITE))
                continue;
 
             struct dma_buf_import_sync_file import_sync_file_ioctl = {
@@ -777,7 +883,7 @@ asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
                .fd = submit_fd,
             };
 
-            ret = drmIoctl(extres_fds[i], DMA_BUF_IOCTL_IMPORT_SYNC_FILE,
+            ret = drmIoctl(extres[i].dmabuf_fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE,
                            &import_sync_file_ioctl);
             if (ret < 0)
                drm_log("failed to import sync file into dmabuf");
@@ -792,14 +898,235 @@ asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       drm_log("command submission failed");
    }
 
-   for (uint32_t i = 0; i < req->extres_count; i++)
-      if (extres_fds[i] >= 0)
-         close(extres_fds[i]);
-
    drmSyncobjDestroy(dctx->fd, out_sync.handle);
-   free(syncs);
-   free(extres_fds);
-   return async_ret(actx, ret);
+   return ret;
+}
+
+static int
+asahi_do_submit_fence(struct asahi_context *actx, uint32_t flags, uint32_t ring_idx,
+                      uint64_t fence_id)
+{
+   struct virgl_context *vctx = &actx->base.base;
+
+   /* ring_idx zero is used for the guest to synchronize with host CPU,
+    * meaning by the time ->submit_fence() is called, the fence has
+    * already passed.. so just immediate signal:
+    */
+   if (ring_idx == 0 || actx->timelines[ring_idx - 1].last_fence_fd < 0) {
+      vctx->fence_retire(vctx, ring_idx, fence_id);
+      return 0;
+   }
+
+   return drm_timeline_submit_fence(&actx->timelines[ring_idx - 1], flags, fence_id);
+}
+
+enum asahi_submit_job_type {
+   ASAHI_SUBMIT_JOB_SUBMIT,
+   ASAHI_SUBMIT_JOB_FENCE,
+};
+
+struct asahi_submit_job {
+   struct list_head head;
+   enum asahi_submit_job_type type;
+
+   union {
+      struct {
+         struct drm_asahi_submit args;
+         unsigned ring_idx;
+         int in_fence_fd;
+         uint32_t extres_count;
+      } submit;
+
+      struct {
+         uint32_t flags;
+         uint32_t ring_idx;
+         uint64_t fence_id;
+      } fence;
+   };
+
+   /* the extres and the cmdbuf of the submit */
+   uint64_t data[];
+};
+
+static int
+asahi_submit_thread_main(void *arg)
+{
+   struct asahi_context *actx = arg;
+
+   u_thread_setname("asahi-submit");
+   virgl_numa_bind_thread();
+
+   mtx_lock(&actx->submit_thread.mutex);
+   while (true) {
+      if (list_is_empty(&actx->submit_thread.jobs)) {
+         if (actx->submit_thread.stop)
+            break;
+         cnd_wait(&actx->submit_thread.cond, &actx->submit_thread.mutex);
+         continue;
+      }
+
+      /* the jobs are processed in order, which keeps the order of the
+       * submits of each queue, and of the fences after them */
+      struct asahi_submit_job *job =
+         list_first_entry(&actx->submit_thread.jobs, struct asahi_submit_job, head);
+      list_del(&job->head);
+      mtx_unlock(&actx->submit_thread.mutex);
+
+      switch (job->type) {
+      case ASAHI_SUBMIT_JOB_SUBMIT: {
+         const struct asahi_submit_extres *extres = (const void *)job->data;
+         int ret = asahi_do_submit(actx, &job->submit.args, job->submit.ring_idx,
+                                   job->submit.in_fence_fd, extres,
+                                   job->submit.extres_count);
+         async_ret(actx, ret);
+         break;
+      }
+      case ASAHI_SUBMIT_JOB_FENCE:
+         if (asahi_do_submit_fence(actx, job->fence.flags, job->fence.ring_idx,
+                                   job->fence.fence_id))
+            drm_err("failed to submit fence: %" PRIu64, job->fence.fence_id);
+         break;
+      }
+      free(job);
+
+      mtx_lock(&actx->submit_thread.mutex);
+      if (!--actx->submit_thread.pending_count)
+         cnd_broadcast(&actx->submit_thread.idle_cond);
+   }
+   mtx_unlock(&actx->submit_thread.mutex);
+
+   return 0;
+}
+
+static bool
+asahi_submit_thread_init(struct asahi_context *actx)
+{
+   if (!debug_get_bool_option("ASAHI_SUBMIT_THREAD", true))
+      return true;
+
+   list_inithead(&actx->submit_thread.jobs);
+
+   if (mtx_init(&actx->submit_thread.mutex, mtx_plain) != thrd_success)
+      return false;
+   if (cnd_init(&actx->submit_thread.cond) != thrd_success)
+      goto fail_cond;
+   if (cnd_init(&actx->submit_thread.idle_cond) != thrd_success)
+      goto fail_idle_cond;
+   if (thrd_create(&actx->submit_thread.thread, asahi_submit_thread_main, actx) !=
+       thrd_success)
+      goto fail_thread;
+
+   actx->submit_thread.enabled = true;
+   return true;
+
+fail_thread:
+   cnd_destroy(&actx->submit_thread.idle_cond);
+fail_idle_cond:
+   cnd_destroy(&actx->submit_thread.cond);
+fail_cond:
+   mtx_destroy(&actx->submit_thread.mutex);
+   return false;
+}
+
+static void
+asahi_submit_thread_queue(struct asahi_context *actx, struct asahi_submit_job *job)
+{
+   mtx_lock(&actx->submit_thread.mutex);
+   list_addtail(&job->head, &actx->submit_thread.jobs);
+   actx->submit_thread.pending_count++;
+   cnd_signal(&actx->submit_thread.cond);
+   mtx_unlock(&actx->submit_thread.mutex);
+}
+
+static int
+asahi_ccmd_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
+{
+   struct asahi_context *actx = to_asahi_context(dctx);
+   const struct asahi_ccmd_submit_req *req = to_asahi_ccmd_submit_req(hdr);
+
+   if (hdr->len < sizeof(struct asahi_ccmd_submit_req)) {
+      drm_err("invalid cmd length");
+      return -EINVAL;
+   }
+
+   const struct hash_entry *entry =
+      hash_table_search(actx->queue_to_ring_idx, req->queue_id);
+   if (!entry) {
+      drm_err("unknown submitqueue: %u", req->queue_id);
+      return -EINVAL;
+   }
+
+   unsigned ring_idx = (uintptr_t)entry->data;
+   uint8_t *ptr = (uint8_t *)req->payload;
+   uint8_t *end = ptr + (hdr->len - sizeof(struct asahi_ccmd_submit_req));
+
+   uint8_t *cmdbuf = ptr;
+   ptr += req->cmdbuf_size;
+
+   struct asahi_ccmd_submit_res *extres_in = (struct asahi_ccmd_submit_res *)ptr;
+   ptr += req->extres_count * sizeof(struct asahi_ccmd_submit_res);
+
+   if (ptr > end) {
+      drm_err("invalid command buffer / extres array");
+      return -EINVAL;
+   }
+
+   /* The job carries copies of the extres and the cmdbuf, the ccmd is gone
+    * by the time it runs.  Without the submit thread, the extres go in the
+    * job and the cmdbuf stays in the ccmd.
+    */
+   const size_t extres_size = sizeof(struct asahi_submit_extres) * req->extres_count;
+   const size_t cmdbuf_size = actx->submit_thread.enabled ? req->cmdbuf_size : 0;
+   struct asahi_submit_job *job =
+      malloc(size_add(sizeof(*job), size_add(extres_size, cmdbuf_size)));
+   if (!job)
+      return async_ret(actx, -ENOMEM);
+
+   /* the objects are resolved here, the resource table belongs to this
+    * thread and the objects outlive the queued submits */
+   struct asahi_submit_extres *extres = (struct asahi_submit_extres *)job->data;
+   for (uint32_t i = 0; i < req->extres_count; i++) {
+      extres[i].dmabuf_fd = -1;
+      extres[i].flags = extres_in[i].flags;
+
+      if (!(extres_in[i].flags & (ASAHI_EXTRES_READ | ASAHI_EXTRES_WRITE)))
+         continue;
+
+      struct drm_object *obj = drm_context_get_object_from_res_id(dctx, extres_in[i].res_id);
+      if (!obj || !to_asahi_object(obj)->exportable) {
+         drm_log("invalid extres res_id %u (%s)", extres_in[i].res_id,
+                 obj ? "not exportable" : "not found");
+         continue;
+      }
+
+      extres[i].dmabuf_fd = asahi_object_get_dmabuf_fd(dctx, to_asahi_object(obj));
+   }
+
+   job->type = ASAHI_SUBMIT_JOB_SUBMIT;
+   job->submit.args = (struct drm_asahi_submit){
+      .flags = req->flags,
+      .queue_id = req->queue_id,
+      .cmdbuf = (uint64_t)(uintptr_t)cmdbuf,
+      .cmdbuf_size = req->cmdbuf_size,
+   };
+   job->submit.ring_idx = ring_idx;
+   job->submit.in_fence_fd = virgl_context_take_in_fence_fd(&dctx->base);
+   job->submit.extres_count = req->extres_count;
+
+   if (!actx->submit_thread.enabled) {
+      int ret = asahi_do_submit(actx, &job->submit.args, ring_idx,
+                                job->submit.in_fence_fd, extres, req->extres_count);
+      free(job);
+      return async_ret(actx, ret);
+   }
+
+   uint8_t *cmdbuf_copy = (uint8_t *)job->data + extres_size;
+   memcpy(cmdbuf_copy, cmdbuf, req->cmdbuf_size);
+   job->submit.args.cmdbuf = (uint64_t)(uintptr_t)cmdbuf_copy;
+
+   asahi_submit_thread_queue(actx, job);
+
+   return 0;
 }
 
 static const struct drm_ccmd ccmd_dispatch[] = {
@@ -827,16 +1154,22 @@ asahi_renderer_submit_fence(struct virgl_context *vctx, uint32_t flags, uint32_t
       return -EINVAL;
    }
 
-   /* ring_idx zero is used for the guest to synchronize with host CPU,
-    * meaning by the time ->submit_fence() is called, the fence has
-    * already passed.. so just immediate signal:
-    */
-   if (ring_idx == 0 || actx->timelines[ring_idx - 1].last_fence_fd < 0) {
-      vctx->fence_retire(vctx, ring_idx, fence_id);
+   /* the fence follows the queued submits */
+   if (actx->submit_thread.enabled) {
+      struct asahi_submit_job *job = malloc(sizeof(*job));
+      if (!job)
+         return -ENOMEM;
+
+      job->type = ASAHI_SUBMIT_JOB_FENCE;
+      job->fence.flags = flags;
+      job->fence.ring_idx = ring_idx;
+      job->fence.fence_id = fence_id;
+      asahi_submit_thread_queue(actx, job);
+
       return 0;
    }
 
-   return drm_timeline_submit_fence(&actx->timelines[ring_idx - 1], flags, fence_id);
+   return asahi_do_submit_fence(actx, flags, ring_idx, fence_id);
 }
 
 struct virgl_context *
@@ -860,13 +1193,20 @@ asahi_renderer_create(int fd, UNUSED size_t debug_len, UNUSED const char *debug_
                         drm_context_fence_retire);
    }
 
+   /* without the thread, the submits are made in the ccmds */
+   if (!asahi_submit_thread_init(actx))
+      drm_log("failed to start the submit thread");
+
    actx->base.base.destroy = asahi_renderer_destroy;
    actx->base.base.attach_resource = asahi_renderer_attach_resource;
    actx->base.base.export_opaque_handle = asahi_renderer_export_opaque_handle;
    actx->base.base.get_blob = asahi_renderer_get_blob;
    actx->base.base.submit_fence = asahi_renderer_submit_fence;
+   actx->base.base.resource_map = drm_context_resource_map;
+   actx->base.base.resource_unmap = drm_context_resource_unmap;
    actx->base.base.supports_fence_sharing = true;
    actx->base.free_object = asahi_renderer_free_object;
+   actx->base.mmap_object = asahi_renderer_mmap_object;
    actx->base.ccmd_alignment = 4;
 
    return &actx->base.base;
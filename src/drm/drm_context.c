@@ -14,15 +14,22 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
-#include "util/anon_file.h"
 #include "util/hash_table.h"
 #include "util/macros.h"
 #include "util/os_file.h"
 #include "util/u_atomic.h"
+#include "util/u_math.h"
+
+#include "virgl_command_stats.h"
+#include "virgl_flight_recorder.h"
+#include "virgl_shm.h"
 
 #include "drm_context.h"
 #include "drm_util.h"
 
+/* unreferenced CPU mappings are munmapped beyond this size */
+#define DRM_CONTEXT_MAX_IDLE_MAP_SIZE (256 * 1024 * 1024)
+
 static int
 drm_context_get_fencing_fd(UNUSED struct virgl_context *vctx)
 {
@@ -59,20 +66,107 @@ drm_context_unmap_shmem_blob(struct drm_context *dctx)
    dctx->shmem = NULL;
    dctx->rsp_mem = NULL;
    dctx->rsp_mem_sz = 0;
+   memset(&dctx->rsp_ring, 0, sizeof(dctx->rsp_ring));
+}
+
+static int
+drm_context_ccmd_rsp_ring_init(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
+{
+   const struct vdrm_ccmd_rsp_ring_init_req *req =
+      (const struct vdrm_ccmd_rsp_ring_init_req *)hdr;
+
+   if (!dctx->shmem || dctx->rsp_ring.ring) {
+      drm_err("no shmem or ring already set up");
+      return -EINVAL;
+   }
+
+   /* the entries are 8-byte aligned within the ring */
+   const size_t ring_size = sizeof(struct vdrm_rsp_ring) + (size_t)req->size;
+   if (req->size < 64 || !util_is_power_of_two_nonzero(req->size) || (req->offset & 7) ||
+       req->offset > dctx->rsp_mem_sz || dctx->rsp_mem_sz - req->offset < ring_size) {
+      drm_err("invalid rsp ring: offset=%u, size=%u (rsp_mem_sz=%u)", req->offset,
+              req->size, dctx->rsp_mem_sz);
+      return -EINVAL;
+   }
+
+   dctx->rsp_ring.ring = (struct vdrm_rsp_ring *)&dctx->rsp_mem[req->offset];
+   dctx->rsp_ring.size = req->size;
+   dctx->rsp_ring.head = 0;
+   p_atomic_xchg(&dctx->rsp_ring.ring->head, 0);
+
+   return 0;
+}
+
+static const struct drm_ccmd drm_context_rsp_ring_init_ccmd = {
+   .name = "RSP_RING_INIT",
+   .handler = drm_context_ccmd_rsp_ring_init,
+   .size = sizeof(struct vdrm_ccmd_rsp_ring_init_req),
+};
+
+static inline size_t
+drm_context_rsp_ring_entry_size(size_t len)
+{
+   return ALIGN_POT(sizeof(struct vdrm_rsp_ring_entry) + len, 8);
+}
+
+static void
+drm_context_rsp_ring_copy(struct drm_context *dctx, uint32_t pos, const void *data,
+                          size_t size)
+{
+   struct vdrm_rsp_ring *ring = dctx->rsp_ring.ring;
+   const uint32_t offset = pos & (dctx->rsp_ring.size - 1);
+   const size_t first = MIN2(size, dctx->rsp_ring.size - offset);
+
+   memcpy(&ring->data[offset], data, first);
+   if (first < size)
+      memcpy(&ring->data[0], (const uint8_t *)data + first, size - first);
+}
+
+static int
+drm_context_rsp_ring_write(struct drm_context *dctx, uint32_t seqno,
+                           const struct vdrm_ccmd_rsp *rsp)
+{
+   /* tail is written by the guest and is untrusted */
+   const uint32_t tail = *(volatile uint32_t *)&dctx->rsp_ring.ring->tail;
+   const uint32_t used = dctx->rsp_ring.head - tail;
+   const size_t entry_size = drm_context_rsp_ring_entry_size(rsp->len);
+
+   if (used > dctx->rsp_ring.size || entry_size > dctx->rsp_ring.size - used) {
+      drm_err("no room in rsp ring: head=%u, tail=%u, len=%u", dctx->rsp_ring.head,
+              tail, rsp->len);
+      return -ENOSPC;
+   }
+
+   const struct vdrm_rsp_ring_entry entry = {
+      .seqno = seqno,
+   };
+   uint32_t pos = dctx->rsp_ring.head;
+   drm_context_rsp_ring_copy(dctx, pos, &entry, sizeof(entry));
+   pos += sizeof(entry);
+   drm_context_rsp_ring_copy(dctx, pos, rsp, rsp->len);
+
+   /* make the entry visible to the guest */
+   dctx->rsp_ring.head += entry_size;
+   p_atomic_xchg(&dctx->rsp_ring.ring->head, dctx->rsp_ring.head);
+
+   return 0;
 }
 
 static int
 drm_context_submit_cmd_dispatch(struct drm_context *dctx, const struct vdrm_ccmd_req *hdr)
 {
+   const struct drm_ccmd *ccmd;
    int ret;
 
-   if (hdr->cmd >= dctx->dispatch_size) {
+   if (hdr->cmd == VDRM_CCMD_RSP_RING_INIT) {
+      ccmd = &drm_context_rsp_ring_init_ccmd;
+   } else if (hdr->cmd < dctx->dispatch_size) {
+      ccmd = &dctx->ccmd_dispatch[hdr->cmd];
+   } else {
       drm_err("invalid cmd: %u", hdr->cmd);
       return -EINVAL;
    }
 
-   const struct drm_ccmd *ccmd = &dctx->ccmd_dispatch[hdr->cmd];
-
    if (!ccmd->handler) {
       drm_err("no handler: %u", hdr->cmd);
       return -EINVAL;
@@ -99,15 +193,22 @@ drm_context_submit_cmd_dispatch(struct drm_context *dctx, const struct vdrm_ccmd
    struct vdrm_ccmd_req *ccmd_hdr = (struct vdrm_ccmd_req *)buf;
 
    void *trace_scope = TRACE_SCOPE_BEGIN(ccmd->name);
+   const uint64_t begin =
+      virgl_flight_recorder_begin(dctx->base.flight_recorder, dctx->base.command_stats);
 
    ret = ccmd->handler(dctx, ccmd_hdr);
 
+   virgl_flight_recorder_end(dctx->base.flight_recorder, dctx->base.command_stats,
+                             hdr->cmd, ccmd->name, hdr->len, begin);
    TRACE_SCOPE_END(trace_scope);
 
    free(buf);
 
    if (ret) {
       drm_err("%s: dispatch failed: %d (%s)", ccmd->name, ret, strerror(errno));
+      virgl_flight_recorder_dump_once(dctx->base.flight_recorder, dctx->base.ctx_id);
+      free(dctx->current_rsp);
+      dctx->current_rsp = NULL;
       return ret;
    }
 
@@ -120,10 +221,16 @@ drm_context_submit_cmd_dispatch(struct drm_context *dctx, const struct vdrm_ccmd
    /* If the response length from the guest is smaller than the
     * expected size, ie. newer host and older guest, then a shadow
     * copy is used, and we need to copy back to the actual rsp
-    * buffer.
+    * buffer.  Responses to the ring are appended as is.
     */
-   struct vdrm_ccmd_rsp *rsp = (struct vdrm_ccmd_rsp *)&dctx->rsp_mem[hdr->rsp_off];
-   if (dctx->current_rsp) {
+   if (dctx->current_rsp && hdr->rsp_off == VDRM_CCMD_RSP_OFF_RING) {
+      ret = drm_context_rsp_ring_write(dctx, hdr->seqno, dctx->current_rsp);
+      free(dctx->current_rsp);
+      dctx->current_rsp = NULL;
+      if (ret)
+         return ret;
+   } else if (dctx->current_rsp) {
+      struct vdrm_ccmd_rsp *rsp = (struct vdrm_ccmd_rsp *)&dctx->rsp_mem[hdr->rsp_off];
       uint32_t len = *(volatile uint32_t *)&rsp->len;
       len = MIN2(len, dctx->current_rsp->len);
       memcpy(rsp, dctx->current_rsp, len);
@@ -193,6 +300,8 @@ drm_context_remove_object(struct drm_context *dctx, struct drm_object *obj)
    if (drm_context_res_id_unused(dctx, obj->res_id))
       return;
 
+   if (obj->res_id < dctx->res_object_count)
+      dctx->res_objects[obj->res_id] = NULL;
    _mesa_hash_table_remove_key(dctx->resource_table, (void *)(uintptr_t)obj->res_id);
 }
 
@@ -201,6 +310,11 @@ drm_context_free_object(struct drm_context *dctx, struct drm_object *dobj)
 {
    drm_context_remove_object(dctx, dobj);
 
+   if (dobj->charged) {
+      virgl_memory_budget_uncharge(&dctx->memory_budget, dobj->size);
+      dobj->charged = false;
+   }
+
    dctx->free_object(dctx, dobj);
 }
 
@@ -251,6 +365,14 @@ drm_context_init(struct drm_context *dctx, int fd,
    /* 8 bytes by default */
    dctx->ccmd_alignment = 8;
 
+   list_inithead(&dctx->idle_maps);
+
+   virgl_memory_budget_init(&dctx->memory_budget);
+
+   if (virgl_command_stats_enabled)
+      dctx->base.command_stats = virgl_command_stats_create(dispatch_size);
+   dctx->base.flight_recorder = virgl_flight_recorder_create();
+
    dctx->base.submit_cmd = drm_context_submit_cmd;
    dctx->base.transfer_3d = drm_context_transfer_3d;
    dctx->base.get_fencing_fd = drm_context_get_fencing_fd;
@@ -303,9 +425,13 @@ drm_context_deinit(struct drm_context *dctx)
    /* sanity-check for a leaked resources */
    assert(!dctx->resource_table->entries);
    assert(!dctx->blob_table->entries);
+   assert(list_is_empty(&dctx->idle_maps));
 
    _mesa_hash_table_destroy(dctx->resource_table, NULL);
    _mesa_hash_table_destroy(dctx->blob_table, NULL);
+   free(dctx->res_objects);
+   virgl_command_stats_destroy(dctx->base.command_stats);
+   virgl_flight_recorder_destroy(dctx->base.flight_recorder);
 
    close(dctx->fd);
 }
@@ -317,7 +443,13 @@ drm_context_rsp(struct drm_context *dctx, const struct vdrm_ccmd_req *hdr,
    size_t rsp_mem_sz = dctx->rsp_mem_sz;
    size_t off = hdr->rsp_off;
 
-   if ((off > rsp_mem_sz) || (len > rsp_mem_sz - off)) {
+   if (off == VDRM_CCMD_RSP_OFF_RING) {
+      if (!dctx->rsp_ring.ring ||
+          drm_context_rsp_ring_entry_size(len) > dctx->rsp_ring.size) {
+         drm_err("invalid rsp ring response: len=%zu", len);
+         return NULL;
+      }
+   } else if ((off > rsp_mem_sz) || (len > rsp_mem_sz - off)) {
       drm_err("invalid shm offset: off=%zu, len=%zu (shmem_size=%zu)",
               off, len, rsp_mem_sz);
       return NULL;
@@ -362,12 +494,12 @@ drm_context_get_shmem_blob(struct drm_context *dctx,
       return -EINVAL;
    }
 
-   if ((blob_size < sizeof(*dctx->shmem)) || (blob_size > UINT32_MAX)) {
+   if ((blob_size < MAX2(shmem_size, sizeof(*dctx->shmem))) || (blob_size > UINT32_MAX)) {
       drm_err("invalid blob size 0x%" PRIx64, blob_size);
       return -EINVAL;
    }
 
-   fd = os_create_anonymous_file(blob_size, name);
+   fd = virgl_shm_create(blob_size, name);
    if (fd < 0) {
       drm_err("failed to create shmem file: %s", strerror(errno));
       return -ENOMEM;
@@ -382,7 +514,7 @@ drm_context_get_shmem_blob(struct drm_context *dctx,
    }
 #endif
 
-   dctx->shmem = mmap(NULL, blob_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+   dctx->shmem = virgl_shm_map(fd, blob_size);
    if (dctx->shmem == MAP_FAILED) {
       drm_err("shmem mmap failed: %s", strerror(errno));
       dctx->shmem = NULL;
@@ -417,6 +549,17 @@ drm_context_blob_id_valid(struct drm_context *dctx, uint32_t blob_id)
    return true;
 }
 
+/* whether a new GEM object of the given size fits the hard budget */
+bool
+drm_context_memory_budget_fits(struct drm_context *dctx, uint64_t size)
+{
+   if (virgl_memory_budget_fits(&dctx->memory_budget, size))
+      return true;
+
+   drm_log("GEM object of %" PRIu64 " bytes over the context memory budget", size);
+   return false;
+}
+
 struct drm_object *
 drm_context_retrieve_object_from_blob_id(struct drm_context *dctx, uint64_t blob_id)
 {
@@ -443,10 +586,46 @@ drm_context_object_set_blob_id(struct drm_context *dctx,
 {
    assert(drm_context_blob_id_valid(dctx, blob_id));
 
+   /* only the objects created by the guest get a blob_id */
+   obj->charged = virgl_memory_budget_charge(&dctx->memory_budget, obj->size);
+
    obj->blob_id = blob_id;
    _mesa_hash_table_insert(dctx->blob_table, (void *)(uintptr_t)obj->blob_id, obj);
 }
 
+/* larger res_ids are only in resource_table */
+#define DRM_CONTEXT_MAX_RES_OBJECT_COUNT (64 * 1024)
+
+static void
+drm_context_set_res_object(struct drm_context *dctx,
+                           uint32_t res_id,
+                           struct drm_object *obj)
+{
+   if (res_id >= DRM_CONTEXT_MAX_RES_OBJECT_COUNT)
+      return;
+
+   if (res_id >= dctx->res_object_count) {
+      uint32_t count = MAX2(dctx->res_object_count, 256);
+      while (count <= res_id)
+         count *= 2;
+
+      struct drm_object **objs = realloc(dctx->res_objects, sizeof(*objs) * count);
+      /* resource_table still has the object */
+      if (!objs)
+         return;
+
+      /* objects may have been added to resource_table only on earlier failures */
+      for (uint32_t i = dctx->res_object_count; i < count; i++) {
+         const struct hash_entry *entry = hash_table_search(dctx->resource_table, i);
+         objs[i] = entry ? entry->data : NULL;
+      }
+      dctx->res_objects = objs;
+      dctx->res_object_count = count;
+   }
+
+   dctx->res_objects[res_id] = obj;
+}
+
 void
 drm_context_object_set_res_id(struct drm_context *dctx,
                               struct drm_object *obj,
@@ -456,11 +635,15 @@ drm_context_object_set_res_id(struct drm_context *dctx,
 
    obj->res_id = res_id;
    _mesa_hash_table_insert(dctx->resource_table, (void *)(uintptr_t)obj->res_id, obj);
+   drm_context_set_res_object(dctx, res_id, obj);
 }
 
 struct drm_object *
 drm_context_get_object_from_res_id(struct drm_context *dctx, uint32_t res_id)
 {
+   if (likely(res_id < dctx->res_object_count))
+      return dctx->res_objects[res_id];
+
    const struct hash_entry *entry = hash_table_search(dctx->resource_table, res_id);
    return likely(entry) ? entry->data : NULL;
 }
@@ -470,3 +653,101 @@ drm_context_res_id_unused(struct drm_context *dctx, uint32_t res_id)
 {
    return !hash_table_search(dctx->resource_table, res_id);
 }
+
+/**
+ * Returns the CPU mapping of the object, shared by all users of the object
+ * and kept after the last drm_context_unmap_object for reuse.
+ */
+void *
+drm_context_map_object(struct drm_context *dctx, struct drm_object *dobj)
+{
+   if (dobj->map) {
+      if (!dobj->map_refcount++) {
+         list_del(&dobj->map_head);
+         dctx->idle_map_size -= dobj->size;
+      }
+      return dobj->map;
+   }
+
+   void *map = dctx->mmap_object(dctx, dobj, NULL, PROT_READ | PROT_WRITE, MAP_SHARED);
+   if (map == MAP_FAILED) {
+      drm_err("mmap failed: %s", strerror(errno));
+      return NULL;
+   }
+
+   dobj->map = map;
+   dobj->map_refcount = 1;
+
+   return map;
+}
+
+void
+drm_context_unmap_object(struct drm_context *dctx, struct drm_object *dobj)
+{
+   assert(dobj->map_refcount);
+   if (--dobj->map_refcount)
+      return;
+
+   list_addtail(&dobj->map_head, &dctx->idle_maps);
+   dctx->idle_map_size += dobj->size;
+
+   while (dctx->idle_map_size > DRM_CONTEXT_MAX_IDLE_MAP_SIZE) {
+      struct drm_object *idle =
+         list_first_entry(&dctx->idle_maps, struct drm_object, map_head);
+      drm_context_release_object_map(dctx, idle);
+   }
+}
+
+/* called when the object is freed */
+void
+drm_context_release_object_map(struct drm_context *dctx, struct drm_object *dobj)
+{
+   if (!dobj->map)
+      return;
+
+   if (dobj->map_refcount) {
+      /* still mapped by the VMM, which will munmap it */
+      drm_log("freeing a mapped object: res_id=%u", dobj->res_id);
+   } else {
+      list_del(&dobj->map_head);
+      dctx->idle_map_size -= dobj->size;
+      munmap(dobj->map, dobj->size);
+   }
+
+   dobj->map = NULL;
+   dobj->map_refcount = 0;
+}
+
+void *
+drm_context_resource_map(struct virgl_context *vctx, struct virgl_resource *res,
+                         void *addr, int32_t prot, int32_t flags)
+{
+   struct drm_context *dctx = to_drm_context(vctx);
+   struct drm_object *dobj = drm_context_get_object_from_res_id(dctx, res->res_id);
+
+   if (!dobj) {
+      drm_err("invalid res_id %u", res->res_id);
+      return NULL;
+   }
+
+   /* only the default mapping is shared */
+   if (addr || prot != (PROT_READ | PROT_WRITE) || flags != MAP_SHARED)
+      return dctx->mmap_object(dctx, dobj, addr, prot, flags);
+
+   return drm_context_map_object(dctx, dobj);
+}
+
+int
+drm_context_resource_unmap(struct virgl_context *vctx, struct virgl_resource *res,
+                           void *map)
+{
+   struct drm_context *dctx = to_drm_context(vctx);
+   struct drm_object *dobj = drm_context_get_object_from_res_id(dctx, res->res_id);
+
+   if (dobj && dobj->map == map && dobj->map_refcount) {
+      drm_context_unmap_object(dctx, dobj);
+      return 0;
+   }
+
+   return munmap(map, res->map_size);
+}
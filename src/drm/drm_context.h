@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include "virgl_context.h"
+#include "virgl_memory_budget.h"
 #include "virgl_util.h"
 
 #include "drm_hw.h"
@@ -35,6 +36,15 @@ struct drm_object {
    uint32_t handle;
    /* GEM size. */
    uint64_t size;
+   /* size is charged to drm_context::memory_budget */
+   bool charged;
+
+   /* CPU mapping shared by the users of drm_context_map_object, kept in
+    * drm_context::idle_maps once unreferenced.
+    */
+   void *map;
+   uint32_t map_refcount;
+   struct list_head map_head;
 };
 
 struct drm_context {
@@ -46,16 +56,41 @@ struct drm_context {
 
    struct vdrm_ccmd_rsp *current_rsp;
 
+   /* set up by VDRM_CCMD_RSP_RING_INIT, in rsp_mem */
+   struct {
+      struct vdrm_rsp_ring *ring;
+      uint32_t size;
+      /* the host copy of ring->head */
+      uint32_t head;
+   } rsp_ring;
+
    struct hash_table *blob_table;
    struct hash_table *resource_table;
 
+   /* Mirrors resource_table for the res_ids below res_object_count, which
+    * is the common case since the guest kernel allocates small res_ids.
+    */
+   struct drm_object **res_objects;
+   uint32_t res_object_count;
+
    int fd;
 
+   /* unreferenced CPU mappings, the least recently used first */
+   struct list_head idle_maps;
+   uint64_t idle_map_size;
+
+   /* the size of the GEM objects created by the guest */
+   struct virgl_memory_budget memory_budget;
+
    const struct drm_ccmd *ccmd_dispatch;
    unsigned int dispatch_size;
    unsigned int ccmd_alignment;
 
    void (*free_object)(struct drm_context *dctx, struct drm_object *dobj);
+
+   /* optional, required by drm_context_map_object */
+   void *(*mmap_object)(struct drm_context *dctx, struct drm_object *dobj, void *addr,
+                        int prot, int flags);
 };
 DEFINE_CAST(virgl_context, drm_context)
 
@@ -76,6 +111,8 @@ int drm_context_get_shmem_blob(struct drm_context *dctx,
 
 bool drm_context_blob_id_valid(struct drm_context *dctx, uint32_t blob_id);
 
+bool drm_context_memory_budget_fits(struct drm_context *dctx, uint64_t size);
+
 struct drm_object *drm_context_retrieve_object_from_blob_id(struct drm_context *dctx,
                                                             uint64_t blob_id);
 
@@ -92,6 +129,18 @@ struct drm_object *drm_context_get_object_from_res_id(struct drm_context *dctx,
 
 bool drm_context_res_id_unused(struct drm_context *dctx, uint32_t res_id);
 
+void *drm_context_map_object(struct drm_context *dctx, struct drm_object *dobj);
+
+void drm_context_unmap_object(struct drm_context *dctx, struct drm_object *dobj);
+
+void drm_context_release_object_map(struct drm_context *dctx, struct drm_object *dobj);
+
+void *drm_context_resource_map(struct virgl_context *vctx, struct virgl_resource *res,
+                               void *addr, int32_t prot, int32_t flags);
+
+int drm_context_resource_unmap(struct virgl_context *vctx, struct virgl_resource *res,
+                               void *map);
+
 #endif /* ENABLE_DRM */
 
 #endif /* DRM_CONTEXT_H_ */
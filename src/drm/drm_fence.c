@@ -5,18 +5,24 @@
 
 #include <poll.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 #include "virgl_context.h"
 #include "virgl_fence.h"
+#include "virgl_numa.h"
 #include "virgl_util.h"
 
+#include "c11/threads.h"
 #include "util/os_file.h"
+#include "util/slab.h"
 #include "util/u_atomic.h"
 #include "util/u_thread.h"
 
 #include "drm_fence.h"
 #include "drm_util.h"
 
+#define DRM_FENCE_THREAD_MAX_EVENTS 16
+
 /**
  * Tracking for a single fence on a timeline
  */
@@ -24,21 +30,49 @@ struct drm_fence {
    int fd;
    uint32_t flags;
    uint64_t fence_id;
+   /* for fence_signaled */
+   uint32_t tag;
+   uint64_t seqno;
    struct list_head node;
 };
 
+/**
+ * The thread waiting for the fences of all timelines.  The first pending
+ * fence of each busy timeline is in the epoll set, with the timeline as the
+ * data.  The mutex protects the timelines and their pending fences.
+ */
+static struct {
+   mtx_t mutex;
+   struct list_head timelines;
+   bool started;
+
+   int epoll_fd;
+   /* in the epoll set with NULL as the data, to stop the thread */
+   int stop_eventfd;
+   thrd_t thread;
+
+   /* the fences are created by the context threads and destroyed by the
+    * fence thread, like the mutex the pool lives as long as the process */
+   struct slab_pool fence_pool;
+} drm_fence_thread = {
+   .epoll_fd = -1,
+   .stop_eventfd = -1,
+};
+
+static once_flag drm_fence_thread_once = ONCE_FLAG_INIT;
+
 static void
 drm_fence_destroy(struct drm_fence *fence)
 {
    close(fence->fd);
    list_del(&fence->node);
-   free(fence);
+   slab_free(&drm_fence_thread.fence_pool, fence);
 }
 
 static struct drm_fence *
 drm_fence_create(int fd, uint32_t flags, uint64_t fence_id)
 {
-   struct drm_fence *fence = calloc(1, sizeof(*fence));
+   struct drm_fence *fence = slab_zalloc(&drm_fence_thread.fence_pool);
 
    if (!fence)
       return NULL;
@@ -46,7 +80,7 @@ drm_fence_create(int fd, uint32_t flags, uint64_t fence_id)
    fence->fd = os_dupfd_cloexec(fd);
 
    if (fence->fd < 0) {
-      free(fence);
+      slab_free(&drm_fence_thread.fence_pool, fence);
       return NULL;
    }
 
@@ -56,42 +90,175 @@ drm_fence_create(int fd, uint32_t flags, uint64_t fence_id)
    return fence;
 }
 
-static int
-thread_sync(void *arg)
+static bool
+drm_fence_is_signaled(const struct drm_fence *fence)
 {
-   struct drm_timeline *timeline = arg;
+   return poll(&(struct pollfd){fence->fd, POLLIN, 0}, 1, 0) == 1;
+}
 
-   u_thread_setname(timeline->name);
+/* adds the first pending fence of the timeline to the epoll set */
+static void
+drm_timeline_arm_locked(struct drm_timeline *timeline)
+{
+   if (list_is_empty(&timeline->pending_fences))
+      return;
 
-   mtx_lock(&timeline->fence_mutex);
-   while (!timeline->stop_sync_thread) {
-      if (list_is_empty(&timeline->pending_fences)) {
-         if (cnd_wait(&timeline->fence_cond, &timeline->fence_mutex))
-            drm_err("error waiting on fence condition");
+   struct drm_fence *fence =
+      list_first_entry(&timeline->pending_fences, struct drm_fence, node);
+   struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.ptr = timeline,
+   };
+   if (epoll_ctl(drm_fence_thread.epoll_fd, EPOLL_CTL_ADD, fence->fd, &ev))
+      drm_err("failed to add fence to epoll: %s", strerror(errno));
+}
+
+static void
+drm_timeline_disarm_locked(struct drm_timeline *timeline)
+{
+   if (list_is_empty(&timeline->pending_fences))
+      return;
+
+   struct drm_fence *fence =
+      list_first_entry(&timeline->pending_fences, struct drm_fence, node);
+   epoll_ctl(drm_fence_thread.epoll_fd, EPOLL_CTL_DEL, fence->fd, NULL);
+}
+
+static bool
+drm_timeline_is_registered_locked(const struct drm_timeline *timeline)
+{
+   list_for_each_entry (struct drm_timeline, iter, &drm_fence_thread.timelines, head) {
+      if (iter == timeline)
+         return true;
+   }
+   return false;
+}
+
+static void
+drm_timeline_retire_fences_locked(struct drm_timeline *timeline)
+{
+   /* the event may predate drm_timeline_fini or a newer first fence */
+   if (!drm_timeline_is_registered_locked(timeline))
+      return;
+
+   drm_timeline_disarm_locked(timeline);
+
+   list_for_each_entry_safe (struct drm_fence, fence, &timeline->pending_fences, node) {
+      if (!drm_fence_is_signaled(fence))
+         break;
+
+      drm_dbg("fence signaled: %p (%" PRIu64 ")", (void*)fence, fence->fence_id);
+      TRACE_FENCE(TRACE_FENCE_SIGNAL, timeline->vctx->ctx_id, timeline->ring_idx,
+                  fence->fence_id);
+      if (timeline->fence_signaled)
+         timeline->fence_signaled(timeline, fence->tag, fence->seqno);
+      timeline->fence_retire(timeline->vctx, timeline->ring_idx, fence->fence_id);
+      drm_fence_destroy(fence);
+   }
+
+   drm_timeline_arm_locked(timeline);
+}
+
+static int
+drm_fence_thread_main(UNUSED void *arg)
+{
+   u_thread_setname("drm-fence");
+   virgl_numa_bind_thread();
+
+   while (true) {
+      struct epoll_event events[DRM_FENCE_THREAD_MAX_EVENTS];
+      const int count = epoll_wait(drm_fence_thread.epoll_fd, events,
+                                   ARRAY_SIZE(events), -1);
+      if (count < 0) {
+         if (errno != EINTR)
+            drm_err("epoll_wait failed: %s", strerror(errno));
          continue;
       }
 
-      struct drm_fence *fence =
-         list_first_entry(&timeline->pending_fences, struct drm_fence, node);
-      int ret;
+      mtx_lock(&drm_fence_thread.mutex);
 
-      mtx_unlock(&timeline->fence_mutex);
-      ret = poll(&(struct pollfd){fence->fd, POLLIN}, 1, -1); /* wait forever */
-      mtx_lock(&timeline->fence_mutex);
+      bool stop = false;
+      for (int i = 0; i < count; i++) {
+         struct drm_timeline *timeline = events[i].data.ptr;
+         if (!timeline) {
+            stop = true;
+            continue;
+         }
 
-      if (ret == 1) {
-         drm_dbg("fence signaled: %p (%" PRIu64 ")", (void*)fence, fence->fence_id);
-         timeline->fence_retire(timeline->vctx, timeline->ring_idx, fence->fence_id);
-         drm_fence_destroy(fence);
-      } else if (ret != 0) {
-         drm_err("poll failed: %s", strerror(errno));
+         drm_timeline_retire_fences_locked(timeline);
       }
+
+      mtx_unlock(&drm_fence_thread.mutex);
+
+      if (stop)
+         break;
    }
-   mtx_unlock(&timeline->fence_mutex);
 
    return 0;
 }
 
+static void
+drm_fence_thread_init_once(void)
+{
+   mtx_init(&drm_fence_thread.mutex, mtx_plain);
+   list_inithead(&drm_fence_thread.timelines);
+   slab_pool_init(&drm_fence_thread.fence_pool, sizeof(struct drm_fence), 64);
+}
+
+static bool
+drm_fence_thread_start_locked(void)
+{
+   drm_fence_thread.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (drm_fence_thread.epoll_fd < 0)
+      goto fail;
+
+   drm_fence_thread.stop_eventfd = create_eventfd(0);
+   if (drm_fence_thread.stop_eventfd < 0)
+      goto fail;
+
+   struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.ptr = NULL,
+   };
+   if (epoll_ctl(drm_fence_thread.epoll_fd, EPOLL_CTL_ADD, drm_fence_thread.stop_eventfd,
+                 &ev))
+      goto fail;
+
+   if (thrd_create(&drm_fence_thread.thread, drm_fence_thread_main, NULL) != thrd_success)
+      goto fail;
+
+   drm_fence_thread.started = true;
+   return true;
+
+fail:
+   drm_err("failed to start the fence thread");
+   if (drm_fence_thread.stop_eventfd >= 0)
+      close(drm_fence_thread.stop_eventfd);
+   if (drm_fence_thread.epoll_fd >= 0)
+      close(drm_fence_thread.epoll_fd);
+   drm_fence_thread.stop_eventfd = -1;
+   drm_fence_thread.epoll_fd = -1;
+   return false;
+}
+
+void
+drm_fence_fini(void)
+{
+   if (!drm_fence_thread.started)
+      return;
+
+   assert(list_is_empty(&drm_fence_thread.timelines));
+
+   write_eventfd(drm_fence_thread.stop_eventfd, 1);
+   thrd_join(drm_fence_thread.thread, NULL);
+
+   close(drm_fence_thread.stop_eventfd);
+   close(drm_fence_thread.epoll_fd);
+   drm_fence_thread.stop_eventfd = -1;
+   drm_fence_thread.epoll_fd = -1;
+   drm_fence_thread.started = false;
+}
+
 void
 drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
                   const char *name, int ring_idx,
@@ -103,26 +270,33 @@ drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
    timeline->fence_retire = fence_retire;
 
    timeline->last_fence_fd = -1;
+   timeline->fence_signaled = NULL;
+   timeline->last_fence_seqno = 0;
+   timeline->last_fence_tag = 0;
 
    list_inithead(&timeline->pending_fences);
 
-   mtx_init(&timeline->fence_mutex, mtx_plain);
-   cnd_init(&timeline->fence_cond);
+   call_once(&drm_fence_thread_once, drm_fence_thread_init_once);
 
-   timeline->sync_thread = u_thread_create(thread_sync, timeline);
+   mtx_lock(&drm_fence_thread.mutex);
+   /* without the thread, the fences are submitted but never retired */
+   if (drm_fence_thread.started || drm_fence_thread_start_locked()) {
+      list_addtail(&timeline->head, &drm_fence_thread.timelines);
+   } else {
+      list_inithead(&timeline->head);
+   }
+   mtx_unlock(&drm_fence_thread.mutex);
 }
 
 void
 drm_timeline_fini(struct drm_timeline *timeline)
 {
-   /* signal thread_sync to shutdown: */
-   mtx_lock(&timeline->fence_mutex);
-   timeline->stop_sync_thread = true;
-   cnd_signal(&timeline->fence_cond);
-   mtx_unlock(&timeline->fence_mutex);
-
-   /* wait for thread_sync to exit: */
-   thrd_join(timeline->sync_thread, NULL);
+   mtx_lock(&drm_fence_thread.mutex);
+   if (!list_is_empty(&timeline->head)) {
+      drm_timeline_disarm_locked(timeline);
+      list_del(&timeline->head);
+   }
+   mtx_unlock(&drm_fence_thread.mutex);
 
    if (timeline->last_fence_fd != -1)
       close(timeline->last_fence_fd);
@@ -131,9 +305,6 @@ drm_timeline_fini(struct drm_timeline *timeline)
    list_for_each_entry_safe (struct drm_fence, fence, &timeline->pending_fences, node) {
       drm_fence_destroy(fence);
    }
-
-   cnd_destroy(&timeline->fence_cond);
-   mtx_destroy(&timeline->fence_mutex);
 }
 
 int
@@ -151,24 +322,36 @@ drm_timeline_submit_fence(struct drm_timeline *timeline, uint32_t flags,
 
    drm_dbg("fence: %p (%" PRIu64 ")", (void*)fence, fence->fence_id);
 
-   virgl_fence_set_fd(fence_id, fence->fd);
+   fence->tag = timeline->last_fence_tag;
+   fence->seqno = timeline->last_fence_seqno;
+
+   /* timeline 0 is the one of vrend */
+   const uint64_t timeline_id =
+      ((uint64_t)timeline->vctx->ctx_id << 32) | (uint32_t)(timeline->ring_idx + 1);
+   virgl_fence_set_fd(timeline_id, fence_id, fence->fd);
 
-   mtx_lock(&timeline->fence_mutex);
+   mtx_lock(&drm_fence_thread.mutex);
+   const bool idle = list_is_empty(&timeline->pending_fences);
    list_addtail(&fence->node, &timeline->pending_fences);
-   cnd_signal(&timeline->fence_cond);
-   mtx_unlock(&timeline->fence_mutex);
+   if (idle && !list_is_empty(&timeline->head))
+      drm_timeline_arm_locked(timeline);
+   mtx_unlock(&drm_fence_thread.mutex);
 
    close(timeline->last_fence_fd);
    timeline->last_fence_fd = -1;
 
+   TRACE_FENCE(TRACE_FENCE_SUBMIT, timeline->vctx->ctx_id, timeline->ring_idx, fence_id);
+
    return 0;
 }
 
-/* takes ownership of the fd */
+/* takes ownership of the fd, clears the seqno and tag */
 void
 drm_timeline_set_last_fence_fd(struct drm_timeline *timeline, int fd)
 {
    if (timeline->last_fence_fd != -1)
       close(timeline->last_fence_fd);
    timeline->last_fence_fd = fd;
+   timeline->last_fence_seqno = 0;
+   timeline->last_fence_tag = 0;
 }
@@ -9,8 +9,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#include "c11/threads.h"
 #include "util/list.h"
+#include "virgl_context.h"
 
 /*
  * Helpers to deal with managing dma-fence fd's.  This should something that
@@ -23,6 +23,9 @@ struct virgl_context;
 /**
  * Represents a single timeline of fence-fd's.  Fences on a timeline are
  * signaled in FIFO order.
+ *
+ * The fences of all timelines are waited for by a single process-wide
+ * thread, which polls the first pending fence of each timeline with epoll.
  */
 struct drm_timeline {
    struct virgl_context *vctx;
@@ -33,10 +36,18 @@ struct drm_timeline {
    int last_fence_fd;
    struct list_head pending_fences;
 
-   mtx_t fence_mutex;
-   cnd_t fence_cond;
-   thrd_t sync_thread;
-   bool stop_sync_thread;
+   /* Optional, called by the fence thread for each signaled fence before
+    * fence_retire, with the seqno and tag that were set with the fd of the
+    * fence.  The driver defines both, like the seqno of the submit behind
+    * the fd and the sequence it belongs to.
+    */
+   void (*fence_signaled)(struct drm_timeline *timeline, uint32_t tag,
+                          uint64_t seqno);
+   uint64_t last_fence_seqno;
+   uint32_t last_fence_tag;
+
+   /* in the list of timelines of the fence thread */
+   struct list_head head;
 };
 
 void drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
@@ -50,4 +61,7 @@ int drm_timeline_submit_fence(struct drm_timeline *timeline, uint32_t flags,
 
 void drm_timeline_set_last_fence_fd(struct drm_timeline *timeline, int fd);
 
+/* stops the fence thread once all timelines are gone */
+void drm_fence_fini(void);
+
 #endif /* DRM_FENCE_H_ */
@@ -14,9 +14,11 @@
 
 #include <xf86drm.h>
 
+#include "drm_fence.h"
 #include "drm_hw.h"
 #include "drm_renderer.h"
 #include "drm_util.h"
+#include "virgl_numa.h"
 
 #ifdef ENABLE_DRM_MSM
 #  include "msm/msm_renderer.h"
@@ -100,10 +102,14 @@ drm_renderer_init(int drm_fd)
       capset.version_minor = ver->version_minor;
       capset.version_patchlevel = ver->version_patchlevel;
       capset.context_type = b->context_type;
+      /* handled by drm_context for all backends */
+      capset.features = VIRTGPU_DRM_FEATURE_RSP_RING;
 
       int ret = b->probe(fd, &capset);
       if (ret)
          memset(&capset, 0, sizeof(capset));
+      else
+         virgl_numa_set_device(fd);
 
       drmFreeVersion(ver);
       close(fd);
@@ -120,6 +126,8 @@ void
 drm_renderer_fini(void)
 {
    drm_log("");
+
+   drm_fence_fini();
 }
 
 void
@@ -10,10 +10,12 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <xf86drm.h>
 
 #include "virgl_context.h"
+#include "virgl_numa.h"
 #include "virgl_util.h"
 #include "virglrenderer.h"
 
@@ -23,6 +25,8 @@
 #include "util/macros.h"
 #include "util/os_file.h"
 #include "util/u_atomic.h"
+#include "util/u_debug.h"
+#include "util/u_math.h"
 #include "util/u_thread.h"
 
 #include "drm_context.h"
@@ -34,8 +38,46 @@
 #include "msm_renderer.h"
 
 static unsigned nr_timelines;
+/* added to the priorities of the guest submitqueues, see msm_kernel_prio() */
+static int prio_bias;
 static uint32_t uabi_version;
 
+#define MSM_BO_TABLE_CACHE_SIZE 4
+
+/**
+ * A thread processing the queued submits and fences of some timelines.
+ */
+struct msm_submit_worker {
+   struct msm_context *mctx;
+   thrd_t thread;
+   mtx_t mutex;
+   cnd_t cond;
+   cnd_t idle_cond;
+   struct list_head jobs;
+   unsigned pending_count;
+   bool stop;
+};
+
+/* objects are bucketed by log2 of their page count */
+#define MSM_BO_CACHE_BUCKET_COUNT 16
+#define MSM_BO_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define MSM_BO_CACHE_MAX_AGE_NS 1000000000ll
+
+/**
+ * A bo table of the guest, and its translation to GEM handles.
+ */
+struct msm_bo_table {
+   uint32_t hash;
+   uint32_t nr_bos;
+   uint32_t capacity;
+   /* only tables with valid handles are reused */
+   bool valid;
+   uint32_t generation;
+
+   struct drm_msm_gem_submit_bo *guest_bos;
+   struct drm_msm_gem_submit_bo *bos;
+};
+
 /**
  * A single context (from the PoV of the virtio-gpu protocol) maps to
  * a single drm device open.  Other drm/msm constructs (ie. submitqueue)
@@ -67,6 +109,40 @@ struct msm_context {
     */
    struct hash_table *sq_to_ring_idx_table;
 
+   /**
+    * Recently translated bo tables of GEM_SUBMIT.  They are invalidated by
+    * bumping bo_generation whenever an object is freed.
+    */
+   struct msm_bo_table bo_tables[MSM_BO_TABLE_CACHE_SIZE];
+   unsigned next_bo_table;
+   uint32_t bo_generation;
+
+   /**
+    * With MSM_BO_CACHE=true, the idle objects freed by the guest are kept for
+    * a while, purgeable and without iova, and recycled by GEM_NEW of the
+    * same size and flags.
+    */
+   struct {
+      bool enabled;
+      struct list_head buckets[MSM_BO_CACHE_BUCKET_COUNT];
+      uint64_t size;
+   } bo_cache;
+
+   /**
+    * With MSM_SUBMIT_THREAD=true, GEM_SUBMIT and the fences are queued to a
+    * thread, so that the kernel submits overlap with the parsing of the next
+    * ccmds.  The ccmds that depend on the submits wait for the queue first.
+    *
+    * With MSM_SUBMIT_THREAD_PER_RING=true, each timeline gets its own
+    * thread, so that a submit blocked in the kernel does not delay the
+    * submits of the other timelines.
+    */
+   struct {
+      bool enabled;
+      unsigned worker_count;
+      struct msm_submit_worker *workers;
+   } submit_thread;
+
    /**
     * Indexed by ring_idx-1, which is the same as the submitqueue priority+1.
     * On the kernel side, there is some drm_sched_entity per {drm_file, prio}
@@ -111,7 +187,12 @@ struct msm_object {
    uint32_t flags;
    bool exported   : 1;
    bool exportable : 1;
-   uint8_t *map;
+   /* a dma-buf of the object was handed out */
+   bool shared     : 1;
+
+   /* in msm_context::bo_cache */
+   struct list_head cache_head;
+   int64_t cache_time;
 };
 DEFINE_CAST(drm_object, msm_object)
 
@@ -159,6 +240,207 @@ handle_from_res_id(struct msm_context *mctx, uint32_t res_id)
    return obj->base.handle;
 }
 
+static void
+msm_object_destroy(struct msm_context *mctx, struct msm_object *obj)
+{
+   drm_context_release_object_map(&mctx->base, &obj->base);
+
+   gem_close(mctx->base.fd, obj->base.handle);
+
+   free(obj);
+}
+
+static int64_t
+msm_bo_cache_now(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct list_head *
+msm_bo_cache_get_bucket(struct msm_context *mctx, uint64_t size)
+{
+   const uint64_t page_count = MAX2(size >> 12, 1);
+   const unsigned idx = MIN2(util_logbase2_64(page_count), MSM_BO_CACHE_BUCKET_COUNT - 1);
+   return &mctx->bo_cache.buckets[idx];
+}
+
+static void
+msm_bo_cache_remove(struct msm_context *mctx, struct msm_object *obj)
+{
+   list_del(&obj->cache_head);
+   mctx->bo_cache.size -= obj->base.size;
+}
+
+static void
+msm_bo_cache_init(struct msm_context *mctx)
+{
+   for (unsigned i = 0; i < MSM_BO_CACHE_BUCKET_COUNT; i++)
+      list_inithead(&mctx->bo_cache.buckets[i]);
+
+   mctx->bo_cache.enabled = debug_get_bool_option("MSM_BO_CACHE", false);
+}
+
+static void
+msm_bo_cache_fini(struct msm_context *mctx)
+{
+   for (unsigned i = 0; i < MSM_BO_CACHE_BUCKET_COUNT; i++) {
+      list_for_each_entry_safe (struct msm_object, obj, &mctx->bo_cache.buckets[i],
+                                cache_head) {
+         msm_bo_cache_remove(mctx, obj);
+         msm_object_destroy(mctx, obj);
+      }
+   }
+
+   mctx->bo_cache.enabled = false;
+}
+
+/* destroys the objects that are too old, and the oldest of the largest
+ * objects while the cache is over its size
+ */
+static void
+msm_bo_cache_evict(struct msm_context *mctx, int64_t now)
+{
+   for (int i = MSM_BO_CACHE_BUCKET_COUNT - 1; i >= 0; i--) {
+      list_for_each_entry_safe (struct msm_object, obj, &mctx->bo_cache.buckets[i],
+                                cache_head) {
+         if (mctx->bo_cache.size <= MSM_BO_CACHE_MAX_SIZE &&
+             now - obj->cache_time < MSM_BO_CACHE_MAX_AGE_NS)
+            break;
+
+         msm_bo_cache_remove(mctx, obj);
+         msm_object_destroy(mctx, obj);
+      }
+   }
+}
+
+/* takes ownership of an idle object that the guest no longer references */
+static bool
+msm_bo_cache_put(struct msm_context *mctx, struct msm_object *obj)
+{
+   /* objects imported, shared with others or still mapped by the VMM are not
+    * ours to recycle
+    */
+   if (!mctx->bo_cache.enabled || !obj->base.blob_id || obj->shared ||
+       obj->base.map_refcount || obj->base.size > MSM_BO_CACHE_MAX_SIZE)
+      return false;
+
+   struct drm_msm_gem_cpu_prep prep = {
+      .handle = obj->base.handle,
+      .op = MSM_PREP_READ | MSM_PREP_WRITE | MSM_PREP_NOSYNC,
+   };
+   if (drmCommandWrite(mctx->base.fd, DRM_MSM_GEM_CPU_PREP, &prep, sizeof(prep)))
+      return false;
+
+   /* the guest may reuse the iova right away */
+   uint64_t iova = 0;
+   if (gem_info(mctx, obj->base.handle, MSM_INFO_SET_IOVA, &iova))
+      return false;
+
+   struct drm_msm_gem_madvise madv = {
+      .handle = obj->base.handle,
+      .madv = MSM_MADV_DONTNEED,
+   };
+   if (drmCommandWriteRead(mctx->base.fd, DRM_MSM_GEM_MADVISE, &madv, sizeof(madv)))
+      return false;
+
+   obj->base.blob_id = 0;
+   obj->base.res_id = 0;
+   obj->exported = false;
+   obj->exportable = false;
+
+   const int64_t now = msm_bo_cache_now();
+   obj->cache_time = now;
+   list_addtail(&obj->cache_head, msm_bo_cache_get_bucket(mctx, obj->base.size));
+   mctx->bo_cache.size += obj->base.size;
+
+   msm_bo_cache_evict(mctx, now);
+
+   return true;
+}
+
+static struct msm_object *
+msm_bo_cache_get(struct msm_context *mctx, uint64_t size, uint32_t flags)
+{
+   if (!mctx->bo_cache.enabled)
+      return NULL;
+
+   struct list_head *bucket = msm_bo_cache_get_bucket(mctx, size);
+
+   /* the most recently freed objects are the most likely to be retained */
+   list_for_each_entry_safe_rev (struct msm_object, obj, bucket, cache_head) {
+      if (obj->base.size != size || obj->flags != flags)
+         continue;
+
+      msm_bo_cache_remove(mctx, obj);
+
+      struct drm_msm_gem_madvise madv = {
+         .handle = obj->base.handle,
+         .madv = MSM_MADV_WILLNEED,
+      };
+      if (!drmCommandWriteRead(mctx->base.fd, DRM_MSM_GEM_MADVISE, &madv,
+                               sizeof(madv)) &&
+          madv.retained)
+         return obj;
+
+      /* purged by the kernel */
+      msm_object_destroy(mctx, obj);
+   }
+
+   return NULL;
+}
+
+/**
+ * Waits until the queued submits and fences, if any, have been processed.
+ */
+static void
+msm_submit_thread_flush(struct msm_context *mctx)
+{
+   if (!mctx->submit_thread.enabled)
+      return;
+
+   for (unsigned i = 0; i < mctx->submit_thread.worker_count; i++) {
+      struct msm_submit_worker *worker = &mctx->submit_thread.workers[i];
+
+      mtx_lock(&worker->mutex);
+      while (worker->pending_count)
+         cnd_wait(&worker->idle_cond, &worker->mutex);
+      mtx_unlock(&worker->mutex);
+   }
+}
+
+static void
+msm_submit_worker_fini(struct msm_submit_worker *worker)
+{
+   /* the thread processes the remaining jobs before exiting */
+   mtx_lock(&worker->mutex);
+   worker->stop = true;
+   cnd_signal(&worker->cond);
+   mtx_unlock(&worker->mutex);
+
+   thrd_join(worker->thread, NULL);
+
+   cnd_destroy(&worker->idle_cond);
+   cnd_destroy(&worker->cond);
+   mtx_destroy(&worker->mutex);
+}
+
+static void
+msm_submit_thread_fini(struct msm_context *mctx)
+{
+   if (!mctx->submit_thread.enabled)
+      return;
+
+   for (unsigned i = 0; i < mctx->submit_thread.worker_count; i++)
+      msm_submit_worker_fini(&mctx->submit_thread.workers[i]);
+
+   free(mctx->submit_thread.workers);
+   mctx->submit_thread.workers = NULL;
+   mctx->submit_thread.worker_count = 0;
+   mctx->submit_thread.enabled = false;
+}
+
 static bool
 has_cached_coherent(int fd)
 {
@@ -273,6 +555,7 @@ msm_renderer_probe(int fd, struct virgl_renderer_capset_drm *capset)
 
    nr_timelines = capset->u.msm.priorities;
    uabi_version = capset->version_minor;
+   prio_bias = debug_get_num_option("MSM_PRIORITY_BIAS", 0);
 
    drm_log("wire_format_version: %u", capset->wire_format_version);
    drm_log("version_major:       %u", capset->version_major);
@@ -293,6 +576,7 @@ msm_renderer_probe(int fd, struct virgl_renderer_capset_drm *capset)
    drm_log("has_raytracing:      %x", capset->u.msm.has_raytracing);
    drm_log("has_preemption:      %d", capset->u.msm.has_preemption);
    drm_log("uche_trap_base:      0x%" PRIx64, capset->u.msm.uche_trap_base);
+   drm_log("priority bias:       %d", prio_bias);
 
    if (!capset->u.msm.va_size) {
       drm_log("Host kernel does not support userspace allocated IOVA");
@@ -308,13 +592,21 @@ msm_renderer_destroy(struct virgl_context *vctx)
    struct drm_context *dctx = to_drm_context(vctx);
    struct msm_context *mctx = to_msm_context(dctx);
 
+   msm_submit_thread_fini(mctx);
+
    for (unsigned i = 0; i < nr_timelines; i++)
       drm_timeline_fini(&mctx->timelines[i]);
 
+   /* the objects freed by drm_context_deinit are no longer cached */
+   msm_bo_cache_fini(mctx);
+
    drm_context_deinit(dctx);
 
    _mesa_hash_table_destroy(mctx->sq_to_ring_idx_table, NULL);
 
+   for (unsigned i = 0; i < ARRAY_SIZE(mctx->bo_tables); i++)
+      free(mctx->bo_tables[i].guest_bos);
+
    free(mctx);
 }
 
@@ -375,14 +667,17 @@ msm_renderer_attach_resource(struct virgl_context *vctx, struct virgl_resource *
 static void
 msm_renderer_free_object(struct drm_context *dctx, struct drm_object *dobj)
 {
+   struct msm_context *mctx = to_msm_context(dctx);
    struct msm_object *obj = to_msm_object(dobj);
 
-   if (obj->map)
-      munmap(obj->map, obj->base.size);
+   /* the handle may be used by a queued submit or a cached bo table */
+   msm_submit_thread_flush(mctx);
+   mctx->bo_generation++;
 
-   gem_close(dctx->fd, obj->base.handle);
+   if (msm_bo_cache_put(mctx, obj))
+      return;
 
-   free(obj);
+   msm_object_destroy(mctx, obj);
 }
 
 static enum virgl_resource_fd_type
@@ -414,6 +709,8 @@ msm_renderer_export_opaque_handle(struct virgl_context *vctx, struct virgl_resou
       return VIRGL_RESOURCE_FD_INVALID;
    }
 
+   obj->shared = true;
+
    return VIRGL_RESOURCE_FD_DMABUF;
 }
 
@@ -489,6 +786,7 @@ msm_renderer_get_blob(struct virgl_context *vctx, uint32_t res_id, uint64_t blob
 
       blob->type = VIRGL_RESOURCE_FD_DMABUF;
       blob->u.fd = fd;
+      obj->shared = true;
    } else {
       blob->type = VIRGL_RESOURCE_OPAQUE_HANDLE;
       blob->u.opaque_handle = obj->base.handle;
@@ -518,6 +816,28 @@ msm_ccmd_nop(UNUSED struct drm_context *dctx, UNUSED struct vdrm_ccmd_req *hdr)
    return 0;
 }
 
+/**
+ * The kernel priority of a guest submitqueue.
+ *
+ * The guest picks the priorities of its submitqueues relative to each other,
+ * but the kernel schedules the submitqueues of all the VMs sharing the GPU
+ * against each other.  With MSM_PRIORITY_BIAS, the VMM shifts the priorities
+ * of the whole VM, positive values for batch VMs that should yield to the
+ * interactive ones, negative values for the interactive VMs.  Lower values
+ * are higher priorities, and the result is clamped to the kernel range.
+ *
+ * The guest keeps seeing its own priorities, they also index the timelines.
+ */
+static uint32_t
+msm_kernel_prio(uint32_t guest_prio)
+{
+   if (!prio_bias || !nr_timelines || guest_prio >= nr_timelines)
+      return guest_prio;
+
+   const int prio = (int)guest_prio + prio_bias;
+   return CLAMP(prio, 0, (int)nr_timelines - 1);
+}
+
 static int
 msm_ccmd_ioctl_simple(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
 {
@@ -566,20 +886,34 @@ msm_ccmd_ioctl_simple(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    char payload[payload_len];
    memcpy(payload, req->payload, payload_len);
 
-   rsp->ret = drmIoctl(dctx->fd, req->cmd, payload);
+   uint32_t guest_prio = 0;
+   if (iocnr == DRM_MSM_SUBMITQUEUE_NEW && payload_len >= sizeof(struct drm_msm_submitqueue)) {
+      struct drm_msm_submitqueue *args = (void *)payload;
+      guest_prio = args->prio;
+      args->prio = msm_kernel_prio(guest_prio);
+   }
 
-   if (req->cmd & IOC_OUT)
-      memcpy(rsp->payload, payload, payload_len);
+   /* the submitqueue may be used by queued submits */
+   msm_submit_thread_flush(mctx);
 
-   if (iocnr == DRM_MSM_SUBMITQUEUE_NEW && !rsp->ret) {
+   rsp->ret = drmIoctl(dctx->fd, req->cmd, payload);
+
+   if (iocnr == DRM_MSM_SUBMITQUEUE_NEW && payload_len >= sizeof(struct drm_msm_submitqueue)) {
       struct drm_msm_submitqueue *args = (void *)payload;
 
-      drm_dbg("submitqueue %u, prio %u", args->id, args->prio);
+      if (!rsp->ret) {
+         drm_dbg("submitqueue %u, prio %u (kernel prio %u)", args->id, guest_prio,
+                 args->prio);
 
-      _mesa_hash_table_insert(mctx->sq_to_ring_idx_table, (void *)(uintptr_t)args->id,
-                              (void *)(uintptr_t)args->prio);
+         _mesa_hash_table_insert(mctx->sq_to_ring_idx_table, (void *)(uintptr_t)args->id,
+                                 (void *)(uintptr_t)guest_prio);
+      }
+      args->prio = guest_prio;
    }
 
+   if (req->cmd & IOC_OUT)
+      memcpy(rsp->payload, payload, payload_len);
+
    return 0;
 }
 
@@ -596,6 +930,29 @@ msm_ccmd_gem_new(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       goto out_error;
    }
 
+   if (!drm_context_memory_budget_fits(dctx, req->size)) {
+      ret = -ENOMEM;
+      goto out_error;
+   }
+
+   struct msm_object *obj = msm_bo_cache_get(mctx, req->size, req->flags);
+   if (obj) {
+      uint64_t iova = req->iova;
+      ret = gem_info(mctx, obj->base.handle, MSM_INFO_SET_IOVA, &iova);
+      if (ret) {
+         drm_err("SET_IOVA failed: %d (%s)", ret, strerror(errno));
+         msm_object_destroy(mctx, obj);
+         goto out_error;
+      }
+
+      drm_context_object_set_blob_id(dctx, &obj->base, req->blob_id);
+
+      drm_dbg("cached obj=%p, blob_id=%u, handle=%u, iova=%" PRIx64,
+              (void*)obj, obj->base.blob_id, obj->base.handle, iova);
+
+      return 0;
+   }
+
    /*
     * First part, allocate the GEM bo:
     */
@@ -624,7 +981,7 @@ msm_ccmd_gem_new(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
     * And then finally create our msm_object for tracking the resource,
     * and add to blob table:
     */
-   struct msm_object *obj = msm_object_create(gem_new.handle, req->flags, req->size);
+   obj = msm_object_create(gem_new.handle, req->flags, req->size);
 
    if (!obj) {
       ret = -ENOMEM;
@@ -660,6 +1017,9 @@ msm_ccmd_gem_set_iova(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       goto out_error;
    }
 
+   /* the iova may be used by queued submits */
+   msm_submit_thread_flush(mctx);
+
    uint64_t iova = req->iova;
    if (iova) {
       TRACE_SCOPE("SET_IOVA");
@@ -680,7 +1040,7 @@ msm_ccmd_gem_set_iova(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
 
 out_error:
    if (mctx->shmem)
-      mctx->shmem->async_error++;
+      p_atomic_inc(&mctx->shmem->async_error);
    return 0;
 }
 
@@ -702,6 +1062,9 @@ msm_ccmd_gem_cpu_prep(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    if (uabi_version >= 11)
       args.op |= MSM_PREP_BOOST;
 
+   /* the bo is only busy once the queued submits are in the kernel */
+   msm_submit_thread_flush(mctx);
+
    rsp->ret = drmCommandWrite(dctx->fd, DRM_MSM_GEM_CPU_PREP, &args, sizeof(args));
 
    return 0;
@@ -751,6 +1114,302 @@ msm_dump_submit(struct drm_msm_gem_submit *req)
 #endif
 }
 
+/**
+ * Returns the guest bos translated to GEM handles, from the cache when the
+ * same table was seen before.  The result is valid until the next call.
+ */
+static const struct drm_msm_gem_submit_bo *
+msm_translate_bos(struct msm_context *mctx,
+                  const struct drm_msm_gem_submit_bo *guest_bos,
+                  uint32_t nr_bos)
+{
+   const size_t size = nr_bos * sizeof(guest_bos[0]);
+   const uint32_t hash = _mesa_hash_data(guest_bos, size);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(mctx->bo_tables); i++) {
+      const struct msm_bo_table *table = &mctx->bo_tables[i];
+      if (table->valid && table->generation == mctx->bo_generation &&
+          table->hash == hash && table->nr_bos == nr_bos &&
+          !memcmp(table->guest_bos, guest_bos, size))
+         return table->bos;
+   }
+
+   /* replace the oldest table */
+   struct msm_bo_table *table = &mctx->bo_tables[mctx->next_bo_table];
+   mctx->next_bo_table = (mctx->next_bo_table + 1) % ARRAY_SIZE(mctx->bo_tables);
+
+   if (table->capacity < nr_bos) {
+      struct drm_msm_gem_submit_bo *bos = malloc(2 * size);
+      if (!bos)
+         return NULL;
+
+      free(table->guest_bos);
+      table->guest_bos = bos;
+      table->bos = bos + nr_bos;
+      table->capacity = nr_bos;
+   }
+
+   memcpy(table->guest_bos, guest_bos, size);
+
+   bool valid = true;
+   for (uint32_t i = 0; i < nr_bos; i++) {
+      table->bos[i] = guest_bos[i];
+      table->bos[i].handle = handle_from_res_id(mctx, guest_bos[i].handle);
+      if (!table->bos[i].handle)
+         valid = false;
+   }
+
+   table->hash = hash;
+   table->nr_bos = nr_bos;
+   table->valid = valid;
+   table->generation = mctx->bo_generation;
+
+   return table->bos;
+}
+
+static void
+msm_do_submit(struct msm_context *mctx,
+              struct drm_msm_gem_submit *args,
+              struct drm_timeline *timeline)
+{
+   const int in_fence_fd = args->flags & MSM_SUBMIT_FENCE_FD_IN ? args->fence_fd : -1;
+
+   int ret = drmCommandWriteRead(mctx->base.fd, DRM_MSM_GEM_SUBMIT, args, sizeof(*args));
+   drm_dbg("fence=%u, ret=%d", args->fence, ret);
+
+   if (unlikely(ret)) {
+      drm_err("submit failed: %s", strerror(errno));
+      msm_dump_submit(args);
+      if (mctx->shmem)
+         p_atomic_inc(&mctx->shmem->async_error);
+   } else if (!timeline) {
+      drm_err("unknown submitqueue: %u", args->queueid);
+      close(args->fence_fd);
+   } else {
+      drm_timeline_set_last_fence_fd(timeline, args->fence_fd);
+   }
+
+   if (in_fence_fd >= 0)
+      close(in_fence_fd);
+}
+
+static int
+msm_do_submit_fence(struct msm_context *mctx,
+                    uint32_t flags,
+                    uint32_t ring_idx,
+                    uint64_t fence_id)
+{
+   struct virgl_context *vctx = &mctx->base.base;
+
+   /* ring_idx zero is used for the guest to synchronize with host CPU,
+    * meaning by the time ->submit_fence() is called, the fence has
+    * already passed.. so just immediate signal:
+    */
+   if (ring_idx == 0 || mctx->timelines[ring_idx - 1].last_fence_fd < 0) {
+      vctx->fence_retire(vctx, ring_idx, fence_id);
+      return 0;
+   }
+
+   return drm_timeline_submit_fence(&mctx->timelines[ring_idx - 1], flags, fence_id);
+}
+
+enum msm_submit_job_type {
+   MSM_SUBMIT_JOB_SUBMIT,
+   MSM_SUBMIT_JOB_FENCE,
+};
+
+struct msm_submit_job {
+   struct list_head head;
+   enum msm_submit_job_type type;
+   /* the index of the timeline is its priority, lower is higher */
+   unsigned timeline_idx;
+   /* jobs that must not be reordered with any other */
+   bool barrier;
+
+   union {
+      struct {
+         struct drm_msm_gem_submit args;
+         struct drm_timeline *timeline;
+      } submit;
+
+      struct {
+         uint32_t flags;
+         uint32_t ring_idx;
+         uint64_t fence_id;
+      } fence;
+   };
+
+   /* the bo and cmd tables of the submit */
+   uint64_t data[];
+};
+
+/**
+ * The first job of the highest priority timeline that is queued, so that the
+ * submits of the interactive queues do not wait behind a batch of background
+ * submits.  The jobs of a timeline stay in order, and no job moves across a
+ * barrier.
+ */
+static struct msm_submit_job *
+msm_submit_worker_next_job(struct msm_submit_worker *worker)
+{
+   struct msm_submit_job *next = NULL;
+
+   list_for_each_entry (struct msm_submit_job, job, &worker->jobs, head) {
+      if (job->barrier)
+         return next ? next : job;
+      if (!next || job->timeline_idx < next->timeline_idx)
+         next = job;
+   }
+
+   return next;
+}
+
+static int
+msm_submit_worker_main(void *arg)
+{
+   struct msm_submit_worker *worker = arg;
+   struct msm_context *mctx = worker->mctx;
+
+   u_thread_setname("msm-submit");
+   virgl_numa_bind_thread();
+
+   mtx_lock(&worker->mutex);
+   while (true) {
+      if (list_is_empty(&worker->jobs)) {
+         if (worker->stop)
+            break;
+         cnd_wait(&worker->cond, &worker->mutex);
+         continue;
+      }
+
+      struct msm_submit_job *job = msm_submit_worker_next_job(worker);
+      list_del(&job->head);
+      mtx_unlock(&worker->mutex);
+
+      switch (job->type) {
+      case MSM_SUBMIT_JOB_SUBMIT:
+         msm_do_submit(mctx, &job->submit.args, job->submit.timeline);
+         break;
+      case MSM_SUBMIT_JOB_FENCE:
+         if (msm_do_submit_fence(mctx, job->fence.flags, job->fence.ring_idx,
+                                 job->fence.fence_id))
+            drm_err("failed to submit fence: %" PRIu64, job->fence.fence_id);
+         break;
+      }
+      free(job);
+
+      mtx_lock(&worker->mutex);
+      if (!--worker->pending_count)
+         cnd_broadcast(&worker->idle_cond);
+   }
+   mtx_unlock(&worker->mutex);
+
+   return 0;
+}
+
+static bool
+msm_submit_worker_init(struct msm_submit_worker *worker, struct msm_context *mctx)
+{
+   worker->mctx = mctx;
+   list_inithead(&worker->jobs);
+
+   if (mtx_init(&worker->mutex, mtx_plain) != thrd_success)
+      return false;
+   if (cnd_init(&worker->cond) != thrd_success)
+      goto fail_cond;
+   if (cnd_init(&worker->idle_cond) != thrd_success)
+      goto fail_idle_cond;
+   if (thrd_create(&worker->thread, msm_submit_worker_main, worker) != thrd_success)
+      goto fail_thread;
+
+   return true;
+
+fail_thread:
+   cnd_destroy(&worker->idle_cond);
+fail_idle_cond:
+   cnd_destroy(&worker->cond);
+fail_cond:
+   mtx_destroy(&worker->mutex);
+   return false;
+}
+
+static bool
+msm_submit_thread_init(struct msm_context *mctx)
+{
+   const bool per_ring = debug_get_bool_option("MSM_SUBMIT_THREAD_PER_RING", false);
+   if (!per_ring && !debug_get_bool_option("MSM_SUBMIT_THREAD", false))
+      return true;
+
+   const unsigned worker_count = per_ring ? MAX2(nr_timelines, 1) : 1;
+   mctx->submit_thread.workers = calloc(worker_count, sizeof(struct msm_submit_worker));
+   if (!mctx->submit_thread.workers)
+      return false;
+
+   for (unsigned i = 0; i < worker_count; i++) {
+      if (!msm_submit_worker_init(&mctx->submit_thread.workers[i], mctx)) {
+         for (unsigned j = 0; j < i; j++)
+            msm_submit_worker_fini(&mctx->submit_thread.workers[j]);
+         free(mctx->submit_thread.workers);
+         mctx->submit_thread.workers = NULL;
+         return false;
+      }
+   }
+
+   mctx->submit_thread.worker_count = worker_count;
+   mctx->submit_thread.enabled = true;
+   return true;
+}
+
+/* queues the job to the worker of the timeline, indexed by ring_idx-1 */
+static void
+msm_submit_thread_queue(struct msm_context *mctx, unsigned timeline_idx,
+                        struct msm_submit_job *job)
+{
+   struct msm_submit_worker *worker =
+      &mctx->submit_thread.workers[timeline_idx % mctx->submit_thread.worker_count];
+
+   job->timeline_idx = timeline_idx;
+
+   mtx_lock(&worker->mutex);
+   list_addtail(&job->head, &worker->jobs);
+   worker->pending_count++;
+   cnd_signal(&worker->cond);
+   mtx_unlock(&worker->mutex);
+}
+
+/* queues a copy of the submit, which must not refer to the ccmd */
+static int
+msm_submit_thread_queue_submit(struct msm_context *mctx,
+                               const struct drm_msm_gem_submit *args,
+                               struct drm_timeline *timeline)
+{
+   const size_t bos_size = args->nr_bos * sizeof(struct drm_msm_gem_submit_bo);
+   const size_t cmds_size = args->nr_cmds * sizeof(struct drm_msm_gem_submit_cmd);
+   struct msm_submit_job *job =
+      malloc(size_add(sizeof(*job), size_add(bos_size, cmds_size)));
+   if (!job)
+      return -ENOMEM;
+
+   job->type = MSM_SUBMIT_JOB_SUBMIT;
+   /* with implicit sync, the kernel orders the submits sharing bos in the
+    * order they are made, whatever their submitqueues */
+   job->barrier = !timeline || !(args->flags & MSM_SUBMIT_NO_IMPLICIT);
+   job->submit.args = *args;
+   job->submit.timeline = timeline;
+
+   uint8_t *data = (uint8_t *)job->data;
+   memcpy(data, U642VOID(args->bos), bos_size);
+   memcpy(data + bos_size, U642VOID(args->cmds), cmds_size);
+   job->submit.args.bos = VOID2U64(data);
+   job->submit.args.cmds = VOID2U64(data + bos_size);
+
+   /* submits to unknown submitqueues fail in the first worker */
+   const unsigned timeline_idx = timeline ? timeline - mctx->timelines : 0;
+   msm_submit_thread_queue(mctx, timeline_idx, job);
+
+   return 0;
+}
+
 static int
 msm_ccmd_gem_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
 {
@@ -770,24 +1429,13 @@ msm_ccmd_gem_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       return -ENOSPC;
    }
 
-   const unsigned bo_limit = 8192 / sizeof(struct drm_msm_gem_submit_bo);
-   bool bos_on_stack = req->nr_bos < bo_limit;
-   struct drm_msm_gem_submit_bo _bos[bos_on_stack ? req->nr_bos : 0];
-   struct drm_msm_gem_submit_bo *bos;
-
-   if (bos_on_stack) {
-      bos = _bos;
-   } else {
-      bos = malloc(req->nr_bos * sizeof(bos[0]));
+   const struct drm_msm_gem_submit_bo *bos = NULL;
+   if (req->nr_bos) {
+      bos = msm_translate_bos(mctx, (const void *)req->payload, req->nr_bos);
       if (!bos)
          return -ENOMEM;
    }
 
-   memcpy(bos, req->payload, req->nr_bos * sizeof(bos[0]));
-
-   for (uint32_t i = 0; i < req->nr_bos; i++)
-      bos[i].handle = handle_from_res_id(mctx, bos[i].handle);
-
    uint32_t fence_flags = MSM_SUBMIT_FENCE_FD_OUT | MSM_SUBMIT_FENCE_SN_IN;
 
    int in_fence_fd = virgl_context_take_in_fence_fd(&dctx->base);
@@ -805,62 +1453,39 @@ msm_ccmd_gem_submit(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       .queueid = req->queue_id,
    };
 
-   int ret = drmCommandWriteRead(dctx->fd, DRM_MSM_GEM_SUBMIT, &args, sizeof(args));
-   drm_dbg("fence=%u, ret=%d", args.fence, ret);
-
-   if (unlikely(ret)) {
-      drm_err("submit failed: %s", strerror(errno));
-      msm_dump_submit(&args);
-      if (mctx->shmem)
-         mctx->shmem->async_error++;
-   } else {
-      const struct hash_entry *entry =
-            hash_table_search(mctx->sq_to_ring_idx_table, args.queueid);
-
-      if (!entry) {
-         drm_err("unknown submitqueue: %u", args.queueid);
-         goto out;
-      }
-
+   const struct hash_entry *entry =
+         hash_table_search(mctx->sq_to_ring_idx_table, args.queueid);
+   struct drm_timeline *timeline = NULL;
+   if (entry) {
       unsigned prio = (uintptr_t)entry->data;
+      timeline = &mctx->timelines[prio];
+   }
 
-      drm_timeline_set_last_fence_fd(&mctx->timelines[prio], args.fence_fd);
+   if (mctx->submit_thread.enabled) {
+      int ret = msm_submit_thread_queue_submit(mctx, &args, timeline);
+      if (ret && in_fence_fd >= 0)
+         close(in_fence_fd);
+      return ret;
    }
 
-out:
-   if (in_fence_fd >= 0)
-      close(in_fence_fd);
-   if (!bos_on_stack)
-      free(bos);
+   msm_do_submit(mctx, &args, timeline);
+
    return 0;
 }
 
-static int
-map_object(struct msm_context *mctx, struct msm_object *obj)
+static void *
+msm_renderer_mmap_object(struct drm_context *dctx, struct drm_object *dobj, void *addr,
+                         int prot, int flags)
 {
+   struct msm_context *mctx = to_msm_context(dctx);
    uint64_t offset = 0;
-   int ret;
 
-   if (obj->map)
-      return 0;
-
-   uint32_t handle = handle_from_res_id(mctx, obj->base.res_id);
-   ret = gem_info(mctx, handle, MSM_INFO_GET_OFFSET, &offset);
-   if (ret) {
+   if (gem_info(mctx, dobj->handle, MSM_INFO_GET_OFFSET, &offset)) {
       drm_err("alloc failed: %s", strerror(errno));
-      return ret;
+      return MAP_FAILED;
    }
 
-   uint8_t *map =
-      mmap(0, obj->base.size, PROT_READ | PROT_WRITE, MAP_SHARED, mctx->base.fd, offset);
-   if (map == MAP_FAILED) {
-      drm_err("mmap failed: %s", strerror(errno));
-      return -ENOMEM;
-   }
-
-   obj->map = map;
-
-   return 0;
+   return mmap(addr, dobj->size, prot, flags, dctx->fd, offset);
 }
 
 static int
@@ -868,7 +1493,6 @@ msm_ccmd_gem_upload(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
 {
    const struct msm_ccmd_gem_upload_req *req = to_msm_ccmd_gem_upload_req(hdr);
    struct msm_context *mctx = to_msm_context(dctx);
-   int ret;
 
    if (req->pad || !valid_payload_len(req)) {
       drm_err("Invalid upload ccmd");
@@ -884,11 +1508,13 @@ msm_ccmd_gem_upload(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    if (size_add(req->off, req->len) > obj->base.size)
       return -EFAULT;
 
-   ret = map_object(mctx, obj);
-   if (ret)
-      return ret;
+   uint8_t *map = drm_context_map_object(dctx, &obj->base);
+   if (!map)
+      return -ENOMEM;
+
+   memcpy(&map[req->off], req->payload, req->len);
 
-   memcpy(&obj->map[req->off], req->payload, req->len);
+   drm_context_unmap_object(dctx, &obj->base);
 
    return 0;
 }
@@ -912,6 +1538,8 @@ msm_ccmd_submitqueue_query(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
       .len = req->len,
    };
 
+   msm_submit_thread_flush(mctx);
+
    rsp->ret =
       drmCommandWriteRead(dctx->fd, DRM_MSM_SUBMITQUEUE_QUERY, &args, sizeof(args));
 
@@ -930,6 +1558,9 @@ msm_ccmd_wait_fence(struct drm_context *dctx, struct vdrm_ccmd_req *hdr)
    if (!rsp)
       return -ENOMEM;
 
+   /* the kernel does not know the fences of the queued submits */
+   msm_submit_thread_flush(mctx);
+
    struct timespec t;
 
    /* Use current time as timeout, to avoid blocking: */
@@ -1031,16 +1662,28 @@ msm_renderer_submit_fence(struct virgl_context *vctx, uint32_t flags, uint32_t r
       return -EINVAL;
    }
 
-   /* ring_idx zero is used for the guest to synchronize with host CPU,
-    * meaning by the time ->submit_fence() is called, the fence has
-    * already passed.. so just immediate signal:
+   /* the fence must follow the queued submits of its timeline, or of all
+    * timelines for the host CPU timeline
     */
-   if (ring_idx == 0 || mctx->timelines[ring_idx - 1].last_fence_fd < 0) {
-      vctx->fence_retire(vctx, ring_idx, fence_id);
+   if (mctx->submit_thread.worker_count > 1 && ring_idx == 0) {
+      msm_submit_thread_flush(mctx);
+   } else if (mctx->submit_thread.enabled) {
+      struct msm_submit_job *job = malloc(sizeof(*job));
+      if (!job)
+         return -ENOMEM;
+
+      job->type = MSM_SUBMIT_JOB_FENCE;
+      /* the host CPU timeline signals once all the previous jobs are done */
+      job->barrier = !ring_idx;
+      job->fence.flags = flags;
+      job->fence.ring_idx = ring_idx;
+      job->fence.fence_id = fence_id;
+      msm_submit_thread_queue(mctx, ring_idx ? ring_idx - 1 : 0, job);
+
       return 0;
    }
 
-   return drm_timeline_submit_fence(&mctx->timelines[ring_idx - 1], flags, fence_id);
+   return msm_do_submit_fence(mctx, flags, ring_idx, fence_id);
 }
 
 struct virgl_context *
@@ -1068,13 +1711,21 @@ msm_renderer_create(int fd, UNUSED size_t debug_len, UNUSED const char *debug_na
                         ring_idx, msm_renderer_fence_retire);
    }
 
+   msm_bo_cache_init(mctx);
+
+   if (!msm_submit_thread_init(mctx))
+      drm_log("failed to create submit thread");
+
    mctx->base.base.destroy = msm_renderer_destroy;
    mctx->base.base.attach_resource = msm_renderer_attach_resource;
    mctx->base.base.export_opaque_handle = msm_renderer_export_opaque_handle;
    mctx->base.base.get_blob = msm_renderer_get_blob;
    mctx->base.base.submit_fence = msm_renderer_submit_fence;
    mctx->base.base.supports_fence_sharing = true;
+   mctx->base.base.resource_map = drm_context_resource_map;
+   mctx->base.base.resource_unmap = drm_context_resource_unmap;
    mctx->base.free_object = msm_renderer_free_object;
+   mctx->base.mmap_object = msm_renderer_mmap_object;
 
    /* Only 4 byte alignment is required for legacy reasons. */
    mctx->base.ccmd_alignment = 4;
@@ -32,7 +32,9 @@ struct virgl_renderer_capset_drm {
 #define VIRTGPU_DRM_CONTEXT_AMDGPU   2
 #define VIRTGPU_DRM_CONTEXT_ASAHI    4
    uint32_t context_type;
-   uint32_t pad;
+   /* VIRTGPU_DRM_FEATURE_x, zero on older hosts */
+#define VIRTGPU_DRM_FEATURE_RSP_RING (1 << 0)
+   uint32_t features;
    union {
       struct {
          uint32_t has_cached_coherent;
@@ -120,6 +122,43 @@ struct vdrm_ccmd_rsp {
    uint32_t len;
 };
 
+/**
+ * Optional response ring, with VIRTGPU_DRM_FEATURE_RSP_RING.
+ *
+ * The guest places the ring in the rsp memory region and sets it up with
+ * VDRM_CCMD_RSP_RING_INIT.  A req with rsp_off set to VDRM_CCMD_RSP_OFF_RING
+ * then gets its response appended to the ring, as a vdrm_rsp_ring_entry
+ * followed by the response and padded to 8 bytes.  Entries wrap around the
+ * end of the ring.  The guest polls head instead of waiting for each req,
+ * and advances tail once it has consumed the entries.  When the ring has no
+ * room for a response, the req fails.
+ */
+#define VDRM_CCMD_RSP_RING_INIT 0x8000
+#define VDRM_CCMD_RSP_OFF_RING  0xfffffff8
+
+struct vdrm_ccmd_rsp_ring_init_req {
+   struct vdrm_ccmd_req hdr;
+
+   /* Offset into the rsp memory region of the vdrm_rsp_ring */
+   uint32_t offset;
+   /* Size of the ring data, a power of two */
+   uint32_t size;
+};
+
+struct vdrm_rsp_ring {
+   /* Bytes written by the host, updated after the entries are written */
+   uint32_t head;
+   /* Bytes consumed by the guest */
+   uint32_t tail;
+   uint8_t data[];
+};
+
+struct vdrm_rsp_ring_entry {
+   /* The seqno of the req */
+   uint32_t seqno;
+   uint32_t pad;
+};
+
 #define DEFINE_CAST(parent, child)                                             \
    static inline struct child *to_##child(const struct parent *x)              \
    {                                                                           \
@@ -380,6 +380,9 @@ struct translate_ctx
    unsigned processor : 4;
    unsigned implied_array_size : 6;
    unsigned num_immediates;
+   /* set by the incremental parser, which falls back to a full parse */
+   bool quiet;
+   bool header_parsed;
 };
 
 static void report_error(struct translate_ctx *ctx, const char *format, ...)
@@ -389,6 +392,9 @@ static void report_error(struct translate_ctx *ctx, const char *format, ...)
    int column = 1;
    const char *itr = ctx->text;
 
+   if (ctx->quiet)
+      return;
+
    debug_printf("\nTGSI asm error: ");
 
    va_start(args, format);
@@ -1885,16 +1891,8 @@ static bool parse_property( struct translate_ctx *ctx )
 }
 
 
-static bool translate( struct translate_ctx *ctx )
+static bool translate_statements( struct translate_ctx *ctx )
 {
-   eat_opt_white( &ctx->cur );
-   if (!parse_header( ctx ))
-      return false;
-
-   if (ctx->processor == TGSI_PROCESSOR_TESS_CTRL ||
-       ctx->processor == TGSI_PROCESSOR_TESS_EVAL)
-       ctx->implied_array_size = 32;
-
    while (*ctx->cur != '\0') {
       unsigned label_val = 0;
       if (!eat_white( &ctx->cur )) {
@@ -1928,6 +1926,19 @@ static bool translate( struct translate_ctx *ctx )
    return true;
 }
 
+static bool translate( struct translate_ctx *ctx )
+{
+   eat_opt_white( &ctx->cur );
+   if (!parse_header( ctx ))
+      return false;
+
+   if (ctx->processor == TGSI_PROCESSOR_TESS_CTRL ||
+       ctx->processor == TGSI_PROCESSOR_TESS_EVAL)
+       ctx->implied_array_size = 32;
+
+   return translate_statements( ctx );
+}
+
 bool
 tgsi_text_translate(
    const char *text,
@@ -1947,3 +1958,65 @@ tgsi_text_translate(
 
    return tgsi_sanity_check( tokens );
 }
+
+struct tgsi_text_parser
+{
+   struct translate_ctx ctx;
+};
+
+struct tgsi_text_parser *
+tgsi_text_parser_create(
+   const char *text,
+   struct tgsi_token *tokens,
+   unsigned num_tokens )
+{
+   struct tgsi_text_parser *parser = CALLOC_STRUCT(tgsi_text_parser);
+   if (!parser)
+      return NULL;
+
+   parser->ctx.text = text;
+   parser->ctx.cur = text;
+   parser->ctx.tokens = tokens;
+   parser->ctx.tokens_cur = tokens;
+   parser->ctx.tokens_end = tokens + num_tokens;
+   parser->ctx.quiet = true;
+
+   return parser;
+}
+
+bool
+tgsi_text_parser_feed(
+   struct tgsi_text_parser *parser )
+{
+   struct translate_ctx *ctx = &parser->ctx;
+
+   if (!ctx->header_parsed) {
+      eat_opt_white( &ctx->cur );
+      /* nothing but blanks so far */
+      if (*ctx->cur == '\0')
+         return true;
+      if (!translate( ctx ))
+         return false;
+      ctx->header_parsed = true;
+      return true;
+   }
+
+   return translate_statements( ctx );
+}
+
+bool
+tgsi_text_parser_finish(
+   struct tgsi_text_parser *parser )
+{
+   if (!tgsi_text_parser_feed( parser ) || !parser->ctx.header_parsed)
+      return false;
+
+   return tgsi_sanity_check( parser->ctx.tokens );
+}
+
+void
+tgsi_text_parser_destroy(
+   struct tgsi_text_parser *parser )
+{
+   FREE( parser );
+}
@@ -42,6 +42,35 @@ tgsi_text_translate(
    struct tgsi_token *tokens,
    unsigned num_tokens );
 
+/* Translates a text that arrives in pieces, while it arrives.
+ *
+ * The text stays at the same address and is fed in whole statements: before
+ * each feed the caller ends the received part with a NUL after the last
+ * complete line, and puts the original character back afterwards.  The
+ * errors are not reported, a failed parser is to be replaced by
+ * tgsi_text_translate on the complete text.
+ */
+struct tgsi_text_parser;
+
+struct tgsi_text_parser *
+tgsi_text_parser_create(
+   const char *text,
+   struct tgsi_token *tokens,
+   unsigned num_tokens );
+
+bool
+tgsi_text_parser_feed(
+   struct tgsi_text_parser *parser );
+
+/* parses the rest of the NUL terminated text and checks the tokens */
+bool
+tgsi_text_parser_finish(
+   struct tgsi_text_parser *parser );
+
+void
+tgsi_text_parser_destroy(
+   struct tgsi_text_parser *parser );
+
 #if defined __cplusplus
 }
 #endif
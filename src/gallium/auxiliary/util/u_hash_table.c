@@ -38,6 +38,8 @@
  */
 
 
+#include <string.h>
+
 #include "pipe/p_compiler.h"
 #include "util/u_debug.h"
 
@@ -50,14 +52,55 @@
 #include "ralloc.h"
 
 
+/** keys this far apart from 0 are expected to be handles, not outliers */
+#define DENSE_LIMIT (1 << 16)
+#define DENSE_MIN_SIZE 64
+
+
 struct util_hash_table
 {
    struct hash_table table;
    
    /** free value */
    void (*destroy)(void *value);
+
+   /** values of the keys below dense_limit, indexed by key */
+   void **dense;
+   uint32_t dense_size;
+   uint32_t dense_limit;
 };
 
+
+static inline bool
+dense_key(const struct util_hash_table *ht, void *key)
+{
+   return (uintptr_t)key < ht->dense_limit;
+}
+
+
+static bool
+dense_reserve(struct util_hash_table *ht, uint32_t index)
+{
+   uint32_t size;
+   void **dense;
+
+   if (index < ht->dense_size)
+      return true;
+
+   size = MAX2(ht->dense_size, DENSE_MIN_SIZE);
+   while (size <= index)
+      size *= 2;
+
+   dense = reralloc(ht, ht->dense, void *, size);
+   if (!dense)
+      return false;
+
+   memset(dense + ht->dense_size, 0, (size - ht->dense_size) * sizeof(void *));
+   ht->dense = dense;
+   ht->dense_size = size;
+   return true;
+}
+
 struct util_hash_table *
 util_hash_table_create(uint32_t (*hash)(const void *key),
                        bool (*equal)(const void *key1, const void *key2),
@@ -75,10 +118,37 @@ util_hash_table_create(uint32_t (*hash)(const void *key),
    }
    
    ht->destroy = destroy;
+   ht->dense = NULL;
+   ht->dense_size = 0;
+   ht->dense_limit = 0;
    
    return ht;
 }
 
+
+struct util_hash_table *
+util_hash_table_create_dense(uint32_t (*hash)(const void *key),
+                             bool (*equal)(const void *key1, const void *key2),
+                             void (*destroy)(void *value))
+{
+   struct util_hash_table *ht = util_hash_table_create(hash, equal, destroy);
+
+   if (ht)
+      ht->dense_limit = DENSE_LIMIT;
+
+   return ht;
+}
+
+bool
+util_hash_table_reserve(struct util_hash_table *ht,
+                        void *max_key)
+{
+   if (!dense_key(ht, max_key))
+      return true;
+
+   return dense_reserve(ht, (uintptr_t)max_key);
+}
+
 enum pipe_error
 util_hash_table_set(struct util_hash_table *ht,
                     void *key,
@@ -94,6 +164,16 @@ util_hash_table_set(struct util_hash_table *ht,
    if (!key)
       return PIPE_ERROR_BAD_INPUT;
 
+   if (dense_key(ht, key)) {
+      uint32_t index = (uintptr_t)key;
+      if (!dense_reserve(ht, index))
+         return PIPE_ERROR_OUT_OF_MEMORY;
+      if (ht->dense[index])
+         ht->destroy(ht->dense[index]);
+      ht->dense[index] = value;
+      return PIPE_OK;
+   }
+
    key_hash = ht->table.key_hash_function(key);
 
    item = _mesa_hash_table_search_pre_hashed(&ht->table, key_hash, key);
@@ -124,6 +204,9 @@ util_hash_table_get(struct util_hash_table *ht,
    if (!key)
       return NULL;
 
+   if (dense_key(ht, key))
+      return (uintptr_t)key < ht->dense_size ? ht->dense[(uintptr_t)key] : NULL;
+
    item = _mesa_hash_table_search(&ht->table, key);
    if(!item)
       return NULL;
@@ -145,6 +228,16 @@ util_hash_table_remove(struct util_hash_table *ht,
    if (!key)
       return;
 
+   if (dense_key(ht, key)) {
+      uint32_t index = (uintptr_t)key;
+      if (index < ht->dense_size && ht->dense[index]) {
+         void *value = ht->dense[index];
+         ht->dense[index] = NULL;
+         ht->destroy(value);
+      }
+      return;
+   }
+
    item = _mesa_hash_table_search(&ht->table, key);
    if (!item)
       return;
@@ -161,6 +254,14 @@ util_hash_table_clear(struct util_hash_table *ht)
    if (!ht)
       return;
 
+   for (uint32_t i = 0; i < ht->dense_size; i++) {
+      if (ht->dense[i]) {
+         void *value = ht->dense[i];
+         ht->dense[i] = NULL;
+         ht->destroy(value);
+      }
+   }
+
    hash_table_foreach(&ht->table, item) {
       ht->destroy(item->data);
    }
@@ -179,6 +280,14 @@ util_hash_table_foreach(struct util_hash_table *ht,
    if (!ht)
       return PIPE_ERROR_BAD_INPUT;
 
+   for (uint32_t i = 0; i < ht->dense_size; i++) {
+      if (ht->dense[i]) {
+         enum pipe_error result = callback(uintptr_to_pointer(i), ht->dense[i], data);
+         if (result != PIPE_OK)
+            return result;
+      }
+   }
+
    hash_table_foreach(&ht->table, item) {
       enum pipe_error result = callback((void *)item->key, item->data, data);
       if (result != PIPE_OK)
@@ -196,6 +305,11 @@ util_hash_table_destroy(struct util_hash_table *ht)
    if (!ht)
       return;
 
+   for (uint32_t i = 0; i < ht->dense_size; i++) {
+      if (ht->dense[i])
+         ht->destroy(ht->dense[i]);
+   }
+
    hash_table_foreach(&ht->table, item) {
       ht->destroy(item->data);
    }
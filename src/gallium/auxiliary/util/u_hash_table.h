@@ -61,6 +61,28 @@ util_hash_table_create(uint32_t (*hash)(const void *key),
                        void (*destroy)(void *value));
 
 
+/**
+ * Create an hash table for keys that are small integers cast to pointers,
+ * like object handles.
+ *
+ * Keys below a limit are stored in an array indexed by the key that grows
+ * as needed, only the keys past it go through the hash functions.
+ */
+struct util_hash_table *
+util_hash_table_create_dense(uint32_t (*hash)(const void *key),
+                             bool (*equal)(const void *key1, const void *key2),
+                             void (*destroy)(void *value));
+
+
+/**
+ * Make room for the keys up to max_key of a dense hash table, so that
+ * setting many of them grows the table only once.
+ */
+bool
+util_hash_table_reserve(struct util_hash_table *ht,
+                        void *max_key);
+
+
 enum pipe_error
 util_hash_table_set(struct util_hash_table *ht,
                     void *key,
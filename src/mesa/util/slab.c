@@ -0,0 +1,203 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "slab.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "u_math.h"
+
+#define SLAB_MAGAZINE_SIZE 16
+#define SLAB_MAX_MAGAZINES 8
+#define SLAB_ALIGNMENT 16
+
+struct slab_element {
+   struct slab_element *next;
+};
+
+struct slab_page {
+   struct slab_page *next;
+};
+
+struct slab_magazine {
+   uint64_t generation;
+   unsigned count;
+   void *elements[SLAB_MAGAZINE_SIZE];
+};
+
+/* indexed by the magazine_index of the pools */
+static _Thread_local struct slab_magazine slab_magazines[SLAB_MAX_MAGAZINES];
+
+static atomic_uint slab_magazines_used;
+static atomic_uint_least64_t slab_generation;
+
+#define SLAB_PAGE_HEADER_SIZE ALIGN(sizeof(struct slab_page), SLAB_ALIGNMENT)
+
+static unsigned
+slab_reserve_magazine(void)
+{
+   unsigned used = atomic_load(&slab_magazines_used);
+
+   for (unsigned i = 0; i < SLAB_MAX_MAGAZINES; i++) {
+      if (used & (1u << i))
+         continue;
+      if (atomic_compare_exchange_strong(&slab_magazines_used, &used, used | (1u << i)))
+         return i;
+      /* used was reloaded, try the slots again */
+      i = -1u;
+   }
+
+   return SLAB_NO_MAGAZINE;
+}
+
+bool
+slab_pool_init(struct slab_pool *pool, size_t element_size,
+               unsigned elements_per_page)
+{
+   memset(pool, 0, sizeof(*pool));
+
+   if (mtx_init(&pool->mutex, mtx_plain) != thrd_success)
+      return false;
+
+   pool->element_size = ALIGN(MAX2(element_size, sizeof(struct slab_element)),
+                              SLAB_ALIGNMENT);
+   pool->elements_per_page = MAX2(elements_per_page, SLAB_MAGAZINE_SIZE);
+   pool->magazine_index = slab_reserve_magazine();
+   pool->generation = atomic_fetch_add(&slab_generation, 1) + 1;
+
+   return true;
+}
+
+void
+slab_pool_fini(struct slab_pool *pool)
+{
+   struct slab_page *page = pool->pages;
+   while (page) {
+      struct slab_page *next = page->next;
+      free(page);
+      page = next;
+   }
+
+   /* the stale magazines are dropped by the generation check */
+   if (pool->magazine_index != SLAB_NO_MAGAZINE)
+      atomic_fetch_and(&slab_magazines_used, ~(1u << pool->magazine_index));
+
+   mtx_destroy(&pool->mutex);
+}
+
+static bool
+slab_add_page_locked(struct slab_pool *pool)
+{
+   /* the header and the elements keep the alignment of malloc */
+   struct slab_page *page =
+      malloc(SLAB_PAGE_HEADER_SIZE + pool->element_size * pool->elements_per_page);
+   if (!page)
+      return false;
+
+   page->next = pool->pages;
+   pool->pages = page;
+
+   uint8_t *elements = (uint8_t *)page + SLAB_PAGE_HEADER_SIZE;
+   for (unsigned i = 0; i < pool->elements_per_page; i++) {
+      struct slab_element *elem =
+         (struct slab_element *)(elements + i * pool->element_size);
+      elem->next = pool->free_list;
+      pool->free_list = elem;
+   }
+
+   return true;
+}
+
+static void *
+slab_alloc_locked(struct slab_pool *pool)
+{
+   if (!pool->free_list && !slab_add_page_locked(pool))
+      return NULL;
+
+   struct slab_element *elem = pool->free_list;
+   pool->free_list = elem->next;
+   return elem;
+}
+
+static struct slab_magazine *
+slab_get_magazine(struct slab_pool *pool)
+{
+   if (pool->magazine_index == SLAB_NO_MAGAZINE)
+      return NULL;
+
+   struct slab_magazine *mag = &slab_magazines[pool->magazine_index];
+   if (mag->generation != pool->generation) {
+      /* left by a destroyed pool, its pages are gone */
+      mag->generation = pool->generation;
+      mag->count = 0;
+   }
+
+   return mag;
+}
+
+void *
+slab_alloc(struct slab_pool *pool)
+{
+   struct slab_magazine *mag = slab_get_magazine(pool);
+   void *ptr;
+
+   if (mag && mag->count)
+      return mag->elements[--mag->count];
+
+   mtx_lock(&pool->mutex);
+   ptr = slab_alloc_locked(pool);
+   /* refill half of the magazine while the lock is held */
+   if (ptr && mag) {
+      while (mag->count < SLAB_MAGAZINE_SIZE / 2) {
+         void *elem = slab_alloc_locked(pool);
+         if (!elem)
+            break;
+         mag->elements[mag->count++] = elem;
+      }
+   }
+   mtx_unlock(&pool->mutex);
+
+   return ptr;
+}
+
+void *
+slab_zalloc(struct slab_pool *pool)
+{
+   void *ptr = slab_alloc(pool);
+   if (ptr)
+      memset(ptr, 0, pool->element_size);
+   return ptr;
+}
+
+void
+slab_free(struct slab_pool *pool, void *ptr)
+{
+   struct slab_magazine *mag = slab_get_magazine(pool);
+   struct slab_element *elem;
+
+   if (!ptr)
+      return;
+
+   if (mag && mag->count < SLAB_MAGAZINE_SIZE) {
+      mag->elements[mag->count++] = ptr;
+      return;
+   }
+
+   mtx_lock(&pool->mutex);
+   elem = ptr;
+   elem->next = pool->free_list;
+   pool->free_list = elem;
+   /* give back half of the full magazine */
+   if (mag) {
+      while (mag->count > SLAB_MAGAZINE_SIZE / 2) {
+         elem = mag->elements[--mag->count];
+         elem->next = pool->free_list;
+         pool->free_list = elem;
+      }
+   }
+   mtx_unlock(&pool->mutex);
+}
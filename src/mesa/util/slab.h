@@ -0,0 +1,69 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "c11/threads.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A pool of fixed size elements for objects that are allocated and freed at
+ * high rates, possibly by different threads.
+ *
+ * The elements are carved out of pages that are only released with the
+ * pool.  Each thread keeps a magazine of free elements of each pool, and
+ * exchanges half of it with the free list of the pool when it runs empty
+ * or full, so that most allocations and frees take no lock.  The elements
+ * in the magazine of a thread that exits are only reclaimed with the pool.
+ */
+
+struct slab_element;
+struct slab_page;
+
+struct slab_pool {
+   mtx_t mutex;
+   size_t element_size;
+   unsigned elements_per_page;
+
+   /* of the magazines of this pool, or SLAB_NO_MAGAZINE */
+   unsigned magazine_index;
+   /* tells the magazines of this pool from those of a destroyed pool */
+   uint64_t generation;
+
+   struct slab_element *free_list;
+   struct slab_page *pages;
+};
+
+#define SLAB_NO_MAGAZINE (~0u)
+
+bool
+slab_pool_init(struct slab_pool *pool, size_t element_size,
+               unsigned elements_per_page);
+
+/* all the elements must have been freed, by any thread */
+void
+slab_pool_fini(struct slab_pool *pool);
+
+void *
+slab_alloc(struct slab_pool *pool);
+
+void *
+slab_zalloc(struct slab_pool *pool);
+
+void
+slab_free(struct slab_pool *pool, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLAB_H */
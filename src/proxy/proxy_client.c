@@ -27,12 +27,16 @@ proxy_client_create_context(struct proxy_client *client,
                             uint32_t ctx_id,
                             size_t ctx_name_len,
                             const char *ctx_name,
+                            const struct virgl_renderer_context_sched *sched,
                             int *out_ctx_fd)
 {
    struct render_client_op_create_context_request req = {
       .header.op = RENDER_CLIENT_OP_CREATE_CONTEXT,
       .ctx_id = ctx_id,
+      .sched.policy = -1,
    };
+   if (sched)
+      req.sched = *sched;
 
    const size_t len = MIN2(ctx_name_len, sizeof(req.ctx_name) - 1);
    memcpy(req.ctx_name, ctx_name, len);
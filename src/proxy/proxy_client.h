@@ -26,6 +26,7 @@ proxy_client_create_context(struct proxy_client *client,
                             uint32_t ctx_id,
                             size_t ctx_name_len,
                             const char *ctx_name,
+                            const struct virgl_renderer_context_sched *sched,
                             int *out_ctx_fd);
 
 bool
@@ -13,6 +13,7 @@
 #include "server/render_protocol.h"
 #include "util/anon_file.h"
 #include "util/bitscan.h"
+#include "virgl_shm.h"
 
 #include "proxy_client.h"
 
@@ -20,7 +21,6 @@ struct proxy_fence {
    uint32_t flags;
    uint32_t seqno;
    uint64_t fence_id;
-   struct list_head head;
 };
 
 static inline void
@@ -63,35 +63,48 @@ proxy_fence_is_signaled(const struct proxy_fence *fence, uint32_t cur_seqno)
    return d < INT32_MAX;
 }
 
-static struct proxy_fence *
-proxy_context_alloc_fence(struct proxy_context *ctx)
+static inline struct proxy_fence *
+proxy_timeline_get_fence(const struct proxy_timeline *timeline, uint32_t idx)
 {
-   struct proxy_fence *fence = NULL;
+   const uint32_t mask = timeline->fence_capacity - 1;
+   return &timeline->fences[(timeline->fence_head + idx) & mask];
+}
 
-   if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
-      mtx_lock(&ctx->free_fences_mutex);
+static bool
+proxy_timeline_grow_fences(struct proxy_timeline *timeline)
+{
+   const uint32_t capacity = timeline->fence_capacity ? timeline->fence_capacity * 2 : 16;
+   struct proxy_fence *fences = malloc(sizeof(*fences) * capacity);
+   if (!fences)
+      return false;
 
-   if (!list_is_empty(&ctx->free_fences)) {
-      fence = list_first_entry(&ctx->free_fences, struct proxy_fence, head);
-      list_del(&fence->head);
-   }
+   for (uint32_t i = 0; i < timeline->fence_count; i++)
+      fences[i] = *proxy_timeline_get_fence(timeline, i);
 
-   if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
-      mtx_unlock(&ctx->free_fences_mutex);
+   free(timeline->fences);
+   timeline->fences = fences;
+   timeline->fence_capacity = capacity;
+   timeline->fence_head = 0;
 
-   return fence ? fence : malloc(sizeof(*fence));
+   return true;
 }
 
-static void
-proxy_context_free_fence(struct proxy_context *ctx, struct proxy_fence *fence)
+static uint32_t
+proxy_timeline_count_signaled_fences(const struct proxy_timeline *timeline)
 {
-   if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
-      mtx_lock(&ctx->free_fences_mutex);
-
-   list_add(&fence->head, &ctx->free_fences);
+   /* the signaled fences are a prefix of the sorted fences */
+   uint32_t lo = 0;
+   uint32_t hi = timeline->fence_count;
+   while (lo < hi) {
+      const uint32_t mid = lo + (hi - lo) / 2;
+      if (proxy_fence_is_signaled(proxy_timeline_get_fence(timeline, mid),
+                                  timeline->cur_seqno))
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
 
-   if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
-      mtx_unlock(&ctx->free_fences_mutex);
+   return lo;
 }
 
 static uint32_t
@@ -111,7 +124,7 @@ proxy_context_retire_timeline_fences_locked(struct proxy_context *ctx,
    /* check if the socket has been disconnected (i.e., the other end has
     * crashed) if no progress is made after a while
     */
-   if (timeline->cur_seqno == cur_seqno && !list_is_empty(&timeline->fences)) {
+   if (timeline->cur_seqno == cur_seqno && timeline->fence_count) {
       timeline->cur_seqno_stall_count++;
       if (timeline->cur_seqno_stall_count < 100 ||
           proxy_socket_is_connected(&ctx->socket))
@@ -124,17 +137,19 @@ proxy_context_retire_timeline_fences_locked(struct proxy_context *ctx,
    timeline->cur_seqno = cur_seqno;
    timeline->cur_seqno_stall_count = 0;
 
-   list_for_each_entry_safe (struct proxy_fence, fence, &timeline->fences, head) {
-      if (!proxy_fence_is_signaled(fence, timeline->cur_seqno) && !force_retire_all)
-         return false;
-
-      ctx->base.fence_retire(&ctx->base, ring_idx, fence->fence_id);
+   const uint32_t retire_count = force_retire_all
+                                    ? timeline->fence_count
+                                    : proxy_timeline_count_signaled_fences(timeline);
+   for (uint32_t i = 0; i < retire_count; i++) {
+      /* pop the fence first in case the callback submits another one */
+      const uint64_t fence_id = proxy_timeline_get_fence(timeline, 0)->fence_id;
+      timeline->fence_head = (timeline->fence_head + 1) & (timeline->fence_capacity - 1);
+      timeline->fence_count--;
 
-      list_del(&fence->head);
-      proxy_context_free_fence(ctx, fence);
+      ctx->base.fence_retire(&ctx->base, ring_idx, fence_id);
    }
 
-   return true;
+   return !timeline->fence_count;
 }
 
 static void
@@ -193,56 +208,93 @@ proxy_context_sync_thread(void *arg)
    return 0;
 }
 
-static int
-proxy_context_submit_fence(struct virgl_context *base,
-                           uint32_t flags,
-                           uint32_t ring_idx,
-                           uint64_t fence_id)
+/* Adds a fence to the timeline and initializes the request to submit it. */
+static bool
+proxy_context_add_fence(struct proxy_context *ctx,
+                        uint32_t flags,
+                        uint32_t ring_idx,
+                        uint64_t fence_id,
+                        struct render_context_op_submit_fence_request *req)
 {
-   struct proxy_context *ctx = (struct proxy_context *)base;
-   const uint64_t old_busy_mask = ctx->timeline_busy_mask;
-
-   if (ring_idx >= PROXY_CONTEXT_TIMELINE_COUNT)
-      return -EINVAL;
-
    struct proxy_timeline *timeline = &ctx->timelines[ring_idx];
-   struct proxy_fence *fence = proxy_context_alloc_fence(ctx);
-   if (!fence)
-      return -ENOMEM;
-
-   fence->flags = flags;
-   fence->seqno = timeline->next_seqno++;
-   fence->fence_id = fence_id;
+   bool ok = true;
 
    if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
       mtx_lock(&ctx->timeline_mutex);
 
-   list_addtail(&fence->head, &timeline->fences);
-   ctx->timeline_busy_mask |= 1ull << ring_idx;
+   if (timeline->fence_count == timeline->fence_capacity)
+      ok = proxy_timeline_grow_fences(timeline);
+
+   if (ok) {
+      struct proxy_fence *fence =
+         proxy_timeline_get_fence(timeline, timeline->fence_count++);
+      fence->flags = flags;
+      fence->seqno = timeline->next_seqno++;
+      fence->fence_id = fence_id;
+
+      ctx->timeline_busy_mask |= 1ull << ring_idx;
+
+      *req = (struct render_context_op_submit_fence_request){
+         .header.op = RENDER_CONTEXT_OP_SUBMIT_FENCE,
+         .flags = flags,
+         .ring_index = ring_idx,
+         .seqno = fence->seqno,
+      };
+   }
 
    if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
       mtx_unlock(&ctx->timeline_mutex);
 
-   const struct render_context_op_submit_fence_request req = {
-      .header.op = RENDER_CONTEXT_OP_SUBMIT_FENCE,
-      .flags = flags,
-      .ring_index = ring_idx,
-      .seqno = fence->seqno,
-   };
-   if (proxy_socket_send_request(&ctx->socket, &req, sizeof(req)))
-      return 0;
+   return ok;
+}
 
-   /* recover timeline fences and busy_mask on submit_fence request failure */
+/* recovers timeline fences and busy_mask on submit_fence request failure */
+static void
+proxy_context_remove_fences(struct proxy_context *ctx,
+                            const uint32_t *ring_indices,
+                            uint32_t count,
+                            uint64_t old_busy_mask)
+{
    if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
       mtx_lock(&ctx->timeline_mutex);
 
-   list_del(&fence->head);
+   /* the fences are the last ones and have not been submitted */
+   for (uint32_t i = 0; i < count; i++)
+      ctx->timelines[ring_indices[i]].fence_count--;
    ctx->timeline_busy_mask = old_busy_mask;
 
    if (proxy_renderer.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
       mtx_unlock(&ctx->timeline_mutex);
+}
+
+static void
+proxy_context_remove_fence(struct proxy_context *ctx,
+                           uint32_t ring_idx,
+                           uint64_t old_busy_mask)
+{
+   proxy_context_remove_fences(ctx, &ring_idx, 1, old_busy_mask);
+}
 
-   proxy_context_free_fence(ctx, fence);
+static int
+proxy_context_submit_fence(struct virgl_context *base,
+                           uint32_t flags,
+                           uint32_t ring_idx,
+                           uint64_t fence_id)
+{
+   struct proxy_context *ctx = (struct proxy_context *)base;
+   const uint64_t old_busy_mask = ctx->timeline_busy_mask;
+
+   if (ring_idx >= PROXY_CONTEXT_TIMELINE_COUNT)
+      return -EINVAL;
+
+   struct render_context_op_submit_fence_request req;
+   if (!proxy_context_add_fence(ctx, flags, ring_idx, fence_id, &req))
+      return -ENOMEM;
+
+   if (proxy_socket_send_request(&ctx->socket, &req, sizeof(req)))
+      return 0;
+
+   proxy_context_remove_fence(ctx, ring_idx, old_busy_mask);
    proxy_log("failed to submit fence");
    return -1;
 }
@@ -265,6 +317,84 @@ proxy_context_get_fencing_fd(struct virgl_context *base)
    return ctx->sync_thread.fence_eventfd;
 }
 
+/* Writes the command stream to the command ring, when the render worker is
+ * done with enough of the ring, and initializes the request to submit it.  The
+ * ring is never waited for.
+ */
+static bool
+proxy_context_write_cmd_ring(struct proxy_context *ctx,
+                             const void *buffer,
+                             size_t size,
+                             struct render_context_op_submit_cmd_request *req)
+{
+   const uint32_t ring_size = ctx->cmd_ring.size;
+   if (size > ring_size / 2)
+      return false;
+
+   /* a command stream must not cross the end of the ring */
+   uint32_t pos = ctx->cmd_ring.head;
+   const uint32_t offset = pos & (ring_size - 1);
+   if (size > ring_size - offset)
+      pos += ring_size - offset;
+
+   const uint32_t tail =
+      atomic_load_explicit(ctx->cmd_ring.tail, memory_order_acquire);
+   if (pos + size - tail > ring_size)
+      return false;
+
+   memcpy(ctx->cmd_ring.data + (pos & (ring_size - 1)), buffer, size);
+   ctx->cmd_ring.head = ALIGN_POT(pos + size, RENDER_CONTEXT_CMD_RING_ALIGN);
+
+   req->in_cmd_ring = true;
+   req->cmd_ring_pos = pos;
+
+   return true;
+}
+
+/* Initializes the request to submit a command stream that needs no other
+ * message, or returns false.
+ */
+static bool
+proxy_context_init_submit_cmd(struct proxy_context *ctx,
+                              const void *buffer,
+                              size_t size,
+                              struct render_context_op_submit_cmd_request *req)
+{
+   *req = (struct render_context_op_submit_cmd_request){
+      .header.op = RENDER_CONTEXT_OP_SUBMIT_CMD,
+      .size = size,
+   };
+
+   if (size > sizeof(req->cmd))
+      return proxy_context_write_cmd_ring(ctx, buffer, size, req);
+
+   memcpy(req->cmd, buffer, size);
+   return true;
+}
+
+static int
+proxy_context_create_cmd_fd(const void *buffer, size_t size)
+{
+   int fd = os_create_anonymous_file(size, "proxy-cmd");
+   if (fd < 0)
+      return -1;
+
+   size_t written = 0;
+   while (written < size) {
+      const ssize_t s =
+         pwrite(fd, (const char *)buffer + written, size - written, written);
+      if (s < 0 && errno == EINTR)
+         continue;
+      if (s <= 0) {
+         close(fd);
+         return -1;
+      }
+      written += s;
+   }
+
+   return fd;
+}
+
 static int
 proxy_context_submit_cmd(struct virgl_context *base, const void *buffer, size_t size)
 {
@@ -273,28 +403,153 @@ proxy_context_submit_cmd(struct virgl_context *base, const void *buffer, size_t
    if (!size)
       return 0;
 
-   struct render_context_op_submit_cmd_request req = {
-      .header.op = RENDER_CONTEXT_OP_SUBMIT_CMD,
-      .size = size,
-   };
+   struct render_context_op_submit_cmd_request req;
+   if (proxy_context_init_submit_cmd(ctx, buffer, size, &req)) {
+      if (!proxy_socket_send_request(&ctx->socket, &req, sizeof(req))) {
+         proxy_log("failed to submit cmd");
+         return -1;
+      }
+      return 0;
+   }
 
-   const size_t inlined = MIN2(size, sizeof(req.cmd));
-   memcpy(req.cmd, buffer, inlined);
+   /* too large for the ring as well */
+   const int cmd_fd = proxy_context_create_cmd_fd(buffer, size);
+   if (cmd_fd < 0) {
+      proxy_log("failed to create large cmd fd");
+      return -1;
+   }
 
-   if (!proxy_socket_send_request(&ctx->socket, &req, sizeof(req))) {
-      proxy_log("failed to submit cmd");
+   const bool ok =
+      proxy_socket_send_request_with_fds(&ctx->socket, &req, sizeof(req), &cmd_fd, 1);
+   close(cmd_fd);
+   if (!ok) {
+      proxy_log("failed to submit large cmd");
       return -1;
    }
 
-   if (size > inlined) {
-      if (!proxy_socket_send_request(&ctx->socket, (const char *)buffer + inlined,
-                                     size - inlined)) {
-         proxy_log("failed to submit large cmd buffer");
+   return 0;
+}
+
+static int
+proxy_context_submit_cmd_with_fence(struct virgl_context *base,
+                                    const void *buffer,
+                                    size_t size,
+                                    uint32_t flags,
+                                    uint32_t ring_idx,
+                                    uint64_t fence_id)
+{
+   struct proxy_context *ctx = (struct proxy_context *)base;
+   const uint64_t old_busy_mask = ctx->timeline_busy_mask;
+
+   if (ring_idx >= PROXY_CONTEXT_TIMELINE_COUNT)
+      return -EINVAL;
+
+   struct render_context_op_submit_fence_request fence_req;
+   if (!proxy_context_add_fence(ctx, flags, ring_idx, fence_id, &fence_req))
+      return -ENOMEM;
+
+   struct render_context_op_submit_batch_request req = {
+      .header.op = RENDER_CONTEXT_OP_SUBMIT_BATCH,
+   };
+   bool ok;
+   struct render_context_op_submit_cmd_request *cmd_req = &req.entries[0].submit_cmd;
+   if (!size || proxy_context_init_submit_cmd(ctx, buffer, size, cmd_req)) {
+      if (size)
+         req.count++;
+      req.entries[req.count++].submit_fence = fence_req;
+      ok = proxy_socket_send_request(&ctx->socket, &req, sizeof(req));
+   } else {
+      /* too large to be batched */
+      ok = !proxy_context_submit_cmd(base, buffer, size) &&
+           proxy_socket_send_request(&ctx->socket, &fence_req, sizeof(fence_req));
+   }
+   if (ok)
+      return 0;
+
+   proxy_context_remove_fence(ctx, ring_idx, old_busy_mask);
+   proxy_log("failed to submit cmd with fence");
+   return -1;
+}
+
+/* The fences of a batch request that has not been sent. */
+struct proxy_context_batch_fences {
+   uint64_t old_busy_mask;
+   uint32_t ring_indices[RENDER_CONTEXT_BATCH_MAX_COUNT];
+   uint32_t count;
+};
+
+static bool
+proxy_context_send_batch(struct proxy_context *ctx,
+                         struct render_context_op_submit_batch_request *req,
+                         struct proxy_context_batch_fences *fences)
+{
+   if (req->count && !proxy_socket_send_request(&ctx->socket, req, sizeof(*req))) {
+      proxy_context_remove_fences(ctx, fences->ring_indices, fences->count,
+                                  fences->old_busy_mask);
+      proxy_log("failed to submit batch");
+      return false;
+   }
+
+   req->count = 0;
+   fences->old_busy_mask = ctx->timeline_busy_mask;
+   fences->count = 0;
+   return true;
+}
+
+static int
+proxy_context_submit_batch(struct virgl_context *base,
+                           const struct virgl_context_submit *submits,
+                           uint32_t count)
+{
+   struct proxy_context *ctx = (struct proxy_context *)base;
+
+   for (uint32_t i = 0; i < count; i++) {
+      if (submits[i].fence && submits[i].ring_idx >= PROXY_CONTEXT_TIMELINE_COUNT)
+         return -EINVAL;
+   }
+
+   struct render_context_op_submit_batch_request req = {
+      .header.op = RENDER_CONTEXT_OP_SUBMIT_BATCH,
+   };
+   struct proxy_context_batch_fences fences = {
+      .old_busy_mask = ctx->timeline_busy_mask,
+   };
+
+   for (uint32_t i = 0; i < count; i++) {
+      const struct virgl_context_submit *submit = &submits[i];
+
+      /* make room for the command stream and the fence */
+      if (req.count + 2 > RENDER_CONTEXT_BATCH_MAX_COUNT &&
+          !proxy_context_send_batch(ctx, &req, &fences))
          return -1;
+
+      if (submit->size) {
+         struct render_context_op_submit_cmd_request *cmd_req =
+            &req.entries[req.count].submit_cmd;
+         if (proxy_context_init_submit_cmd(ctx, submit->buffer, submit->size, cmd_req)) {
+            req.count++;
+         } else {
+            /* too large to be batched */
+            if (!proxy_context_send_batch(ctx, &req, &fences) ||
+                proxy_context_submit_cmd(base, submit->buffer, submit->size))
+               return -1;
+         }
+      }
+
+      if (submit->fence) {
+         if (!proxy_context_add_fence(ctx, submit->fence_flags, submit->ring_idx,
+                                      submit->fence_id,
+                                      &req.entries[req.count].submit_fence)) {
+            proxy_context_remove_fences(ctx, fences.ring_indices, fences.count,
+                                        fences.old_busy_mask);
+            return -ENOMEM;
+         }
+         req.count++;
+         fences.ring_indices[fences.count++] = submit->ring_idx;
       }
    }
 
-   return 0;
+   return proxy_context_send_batch(ctx, &req, &fences) ? 0 : -1;
 }
 
 static bool
@@ -335,6 +590,52 @@ add_required_seals_to_fd(int fd)
 #endif
 }
 
+/* Validates the reply of a created resource and takes ownership of reply_fd. */
+static bool
+proxy_context_init_blob(struct proxy_context *ctx,
+                        uint32_t res_id,
+                        uint64_t blob_id,
+                        uint64_t blob_size,
+                        const struct render_context_op_create_resource_reply *reply,
+                        int reply_fd,
+                        struct virgl_context_blob *blob)
+{
+   bool reply_fd_valid = false;
+   switch (reply->fd_type) {
+   case VIRGL_RESOURCE_FD_DMABUF:
+      /* TODO validate the fd is dmabuf >= blob_size */
+      reply_fd_valid = true;
+      break;
+   case VIRGL_RESOURCE_FD_OPAQUE:
+      /* this will be validated when imported by the client */
+      reply_fd_valid = true;
+      break;
+   case VIRGL_RESOURCE_FD_SHM:
+      /* validate the seals and size here */
+      reply_fd_valid = !add_required_seals_to_fd(reply_fd) &&
+                       validate_resource_fd_shm(reply_fd, blob_size);
+      break;
+   default:
+      break;
+   }
+   if (!reply_fd_valid) {
+      proxy_log("invalid fd type %d for blob %" PRIu64, reply->fd_type, blob_id);
+      close(reply_fd);
+      return false;
+   }
+
+   blob->type = reply->fd_type;
+   blob->u.fd = reply_fd;
+   blob->map_info = reply->map_info;
+
+   if (reply->fd_type == VIRGL_RESOURCE_FD_OPAQUE)
+      blob->vulkan_info = reply->vulkan_info;
+
+   proxy_context_resource_add(ctx, res_id);
+
+   return true;
+}
+
 static int
 proxy_context_get_blob(struct virgl_context *base,
                        uint32_t res_id,
@@ -375,40 +676,96 @@ proxy_context_get_blob(struct virgl_context *base,
       return -1;
    }
 
-   bool reply_fd_valid = false;
-   switch (reply.fd_type) {
-   case VIRGL_RESOURCE_FD_DMABUF:
-      /* TODO validate the fd is dmabuf >= blob_size */
-      reply_fd_valid = true;
-      break;
-   case VIRGL_RESOURCE_FD_OPAQUE:
-      /* this will be validated when imported by the client */
-      reply_fd_valid = true;
-      break;
-   case VIRGL_RESOURCE_FD_SHM:
-      /* validate the seals and size here */
-      reply_fd_valid = !add_required_seals_to_fd(reply_fd) &&
-                       validate_resource_fd_shm(reply_fd, blob_size);
-      break;
-   default:
-      break;
-   }
-   if (!reply_fd_valid) {
-      proxy_log("invalid fd type %d for blob %" PRIu64, reply.fd_type, blob_id);
-      close(reply_fd);
+   if (!proxy_context_init_blob(ctx, res_id, blob_id, blob_size, &reply, reply_fd, blob))
       return -1;
-   }
 
-   blob->type = reply.fd_type;
-   blob->u.fd = reply_fd;
-   blob->map_info = reply.map_info;
+   return 0;
+}
 
-   if (reply.fd_type == VIRGL_RESOURCE_FD_OPAQUE)
-      blob->vulkan_info = reply.vulkan_info;
+static uint32_t
+proxy_context_get_blobs(struct virgl_context *base,
+                        const struct virgl_context_blob_request *blob_reqs,
+                        uint32_t count,
+                        struct virgl_context_blob *blobs)
+{
+   struct proxy_context *ctx = (struct proxy_context *)base;
+   uint32_t blob_count = 0;
+
+   while (blob_count < count) {
+      const uint32_t batch_count =
+         MIN2(count - blob_count, RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT);
+      const struct virgl_context_blob_request *batch_reqs = &blob_reqs[blob_count];
+
+      struct render_context_op_create_resources_request req = {
+         .header.op = RENDER_CONTEXT_OP_CREATE_RESOURCES,
+         .count = batch_count,
+      };
+      for (uint32_t i = 0; i < batch_count; i++) {
+         req.entries[i] = (struct render_context_op_create_resources_entry){
+            .res_id = batch_reqs[i].res_id,
+            .blob_id = batch_reqs[i].blob_id,
+            .blob_size = batch_reqs[i].blob_size,
+            .blob_flags = batch_reqs[i].blob_flags,
+         };
+      }
+      if (!proxy_socket_send_request(&ctx->socket, &req, sizeof(req))) {
+         proxy_log("failed to get %u blobs", batch_count);
+         break;
+      }
 
-   proxy_context_resource_add(ctx, res_id);
+      struct render_context_op_create_resources_reply reply;
+      int reply_fds[RENDER_CONTEXT_CREATE_RESOURCES_MAX_COUNT];
+      int reply_fd_count;
+      if (!proxy_socket_receive_reply_with_fds(&ctx->socket, &reply, sizeof(reply),
+                                               reply_fds, ARRAY_SIZE(reply_fds),
+                                               &reply_fd_count)) {
+         proxy_log("failed to get reply of %u blobs", batch_count);
+         break;
+      }
 
-   return 0;
+      /* the blobs past a failed one are destroyed, to fail in order */
+      bool failed = false;
+      int fd_index = 0;
+      for (uint32_t i = 0; i < batch_count; i++) {
+         const struct virgl_context_blob_request *blob_req = &batch_reqs[i];
+         const struct render_context_op_create_resource_reply *entry = &reply.entries[i];
+         const bool created = entry->fd_type != VIRGL_RESOURCE_FD_INVALID;
+         const int reply_fd = created && fd_index < reply_fd_count ? reply_fds[fd_index++] : -1;
+
+         if (!failed) {
+            if (reply_fd >= 0 &&
+                proxy_context_init_blob(ctx, blob_req->res_id, blob_req->blob_id,
+                                        blob_req->blob_size, entry, reply_fd,
+                                        &blobs[blob_count])) {
+               blob_count++;
+               continue;
+            }
+
+            if (reply_fd < 0)
+               proxy_log("invalid reply for blob %" PRIu64, blob_req->blob_id);
+            failed = true;
+         } else if (reply_fd >= 0) {
+            close(reply_fd);
+         }
+
+         if (created) {
+            const struct render_context_op_destroy_resource_request destroy_req = {
+               .header.op = RENDER_CONTEXT_OP_DESTROY_RESOURCE,
+               .res_id = blob_req->res_id,
+            };
+            if (!proxy_socket_send_request(&ctx->socket, &destroy_req, sizeof(destroy_req)))
+               proxy_log("failed to destroy res %d", blob_req->res_id);
+         }
+      }
+
+      for (int i = fd_index; i < reply_fd_count; i++)
+         close(reply_fds[i]);
+
+      if (failed)
+         break;
+   }
+
+   return blob_count;
 }
 
 static int
@@ -504,6 +861,35 @@ proxy_context_attach_resource(struct virgl_context *base, struct virgl_resource
    proxy_context_resource_add(ctx, res_id);
 }
 
+static void
+proxy_context_get_stats(struct virgl_context *base, struct virgl_renderer_stats *stats)
+{
+   struct proxy_context *ctx = (struct proxy_context *)base;
+
+   const struct render_context_op_get_stats_request req = {
+      .header.op = RENDER_CONTEXT_OP_GET_STATS,
+   };
+   if (!proxy_socket_send_request(&ctx->socket, &req, sizeof(req))) {
+      proxy_log("failed to get stats");
+      return;
+   }
+
+   struct render_context_op_get_stats_reply reply;
+   if (!proxy_socket_receive_reply(&ctx->socket, &reply, sizeof(reply))) {
+      proxy_log("failed to get reply of stats");
+      return;
+   }
+
+   if (!reply.ok)
+      return;
+
+   stats->ring_count += reply.ring_count;
+   stats->temp_pool_size += reply.temp_pool_size;
+   stats->ring_idle_time += reply.ring_idle_time;
+   stats->ring_exec_time += reply.ring_exec_time;
+   stats->sparse_committed_size += reply.sparse_committed_size;
+}
+
 static void
 proxy_context_destroy(struct virgl_context *base)
 {
@@ -528,19 +914,10 @@ proxy_context_destroy(struct virgl_context *base)
    if (ctx->shmem.fd >= 0)
       close(ctx->shmem.fd);
 
-   if (ctx->timeline_seqnos) {
-      for (uint32_t i = 0; i < PROXY_CONTEXT_TIMELINE_COUNT; i++) {
-         struct proxy_timeline *timeline = &ctx->timelines[i];
-         list_for_each_entry_safe (struct proxy_fence, fence, &timeline->fences, head)
-            free(fence);
-      }
-   }
+   for (uint32_t i = 0; i < PROXY_CONTEXT_TIMELINE_COUNT; i++)
+      free(ctx->timelines[i].fences);
    mtx_destroy(&ctx->timeline_mutex);
 
-   list_for_each_entry_safe (struct proxy_fence, fence, &ctx->free_fences, head)
-      free(fence);
-   mtx_destroy(&ctx->free_fences_mutex);
-
    proxy_context_resource_table_fini(ctx);
 
    proxy_socket_fini(&ctx->socket);
@@ -556,11 +933,16 @@ proxy_context_init_base(struct proxy_context *ctx)
    ctx->base.detach_resource = proxy_context_detach_resource;
    ctx->base.transfer_3d = proxy_context_transfer_3d;
    ctx->base.get_blob = proxy_context_get_blob;
+   ctx->base.get_blobs = proxy_context_get_blobs;
    ctx->base.submit_cmd = proxy_context_submit_cmd;
+   ctx->base.submit_cmd_with_fence = proxy_context_submit_cmd_with_fence;
+   ctx->base.submit_batch = proxy_context_submit_batch;
 
    ctx->base.get_fencing_fd = proxy_context_get_fencing_fd;
    ctx->base.retire_fences = proxy_context_retire_fences;
    ctx->base.submit_fence = proxy_context_submit_fence;
+
+   ctx->base.get_stats = proxy_context_get_stats;
 }
 
 static bool
@@ -605,7 +987,6 @@ proxy_context_init_timelines(struct proxy_context *ctx)
       struct proxy_timeline *timeline = &ctx->timelines[i];
       timeline->cur_seqno = 0;
       timeline->next_seqno = 1;
-      list_inithead(&timeline->fences);
    }
 
    ctx->timeline_seqnos = timeline_seqnos;
@@ -616,7 +997,7 @@ proxy_context_init_timelines(struct proxy_context *ctx)
 static int
 alloc_memfd(const char *name, size_t size, void **out_ptr)
 {
-   int fd = os_create_anonymous_file(size, name);
+   int fd = virgl_shm_create(size, name);
    if (fd < 0)
       return -1;
 
@@ -627,7 +1008,7 @@ alloc_memfd(const char *name, size_t size, void **out_ptr)
    if (!out_ptr)
       return fd;
 
-   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   void *ptr = virgl_shm_map(fd, size);
    if (ptr == MAP_FAILED)
       goto fail;
 
@@ -642,13 +1023,26 @@ fail:
 static bool
 proxy_context_init_shmem(struct proxy_context *ctx)
 {
-   const size_t shmem_size = sizeof(*ctx->timeline_seqnos) * PROXY_CONTEXT_TIMELINE_COUNT;
+   /* the timelines, the ring tail, and the ring on its own pages */
+   const size_t cmd_ring_tail_offset =
+      sizeof(*ctx->timeline_seqnos) * PROXY_CONTEXT_TIMELINE_COUNT;
+   const size_t cmd_ring_offset =
+      ALIGN_POT(cmd_ring_tail_offset + sizeof(*ctx->cmd_ring.tail), 4096);
+   const size_t shmem_size = cmd_ring_offset + PROXY_CONTEXT_CMD_RING_SIZE;
    ctx->shmem.fd = alloc_memfd("proxy-ctx", shmem_size, &ctx->shmem.ptr);
    if (ctx->shmem.fd < 0)
       return false;
 
    ctx->shmem.size = shmem_size;
 
+   atomic_uint *cmd_ring_tail =
+      (atomic_uint *)((char *)ctx->shmem.ptr + cmd_ring_tail_offset);
+   atomic_init(cmd_ring_tail, 0);
+   ctx->cmd_ring.tail = cmd_ring_tail;
+   ctx->cmd_ring.data = (char *)ctx->shmem.ptr + cmd_ring_offset;
+   ctx->cmd_ring.size = PROXY_CONTEXT_CMD_RING_SIZE;
+   ctx->cmd_ring.head = 0;
+
    return true;
 }
 
@@ -665,6 +1059,9 @@ proxy_context_init(struct proxy_context *ctx, uint32_t ctx_flags)
       .header.op = RENDER_CONTEXT_OP_INIT,
       .flags = ctx_flags,
       .shmem_size = ctx->shmem.size,
+      .cmd_ring_tail_offset = (char *)ctx->cmd_ring.tail - (char *)ctx->shmem.ptr,
+      .cmd_ring_offset = ctx->cmd_ring.data - (char *)ctx->shmem.ptr,
+      .cmd_ring_size = ctx->cmd_ring.size,
    };
    const int req_fds[2] = { ctx->shmem.fd, ctx->sync_thread.fence_eventfd };
    const int req_fd_count = req_fds[1] >= 0 ? 2 : 1;
@@ -681,13 +1078,15 @@ struct virgl_context *
 proxy_context_create(uint32_t ctx_id,
                      uint32_t ctx_flags,
                      size_t debug_len,
-                     const char *debug_name)
+                     const char *debug_name,
+                     const struct virgl_renderer_context_sched *sched)
 {
    struct proxy_client *client = proxy_renderer.client;
    struct proxy_context *ctx;
 
    int ctx_fd;
-   if (!proxy_client_create_context(client, ctx_id, debug_len, debug_name, &ctx_fd)) {
+   if (!proxy_client_create_context(client, ctx_id, debug_len, debug_name, sched,
+                                    &ctx_fd)) {
       proxy_log("failed to create a context");
       return NULL;
    }
@@ -703,8 +1102,6 @@ proxy_context_create(uint32_t ctx_id,
    proxy_socket_init(&ctx->socket, ctx_fd);
    ctx->shmem.fd = -1;
    mtx_init(&ctx->timeline_mutex, mtx_plain);
-   mtx_init(&ctx->free_fences_mutex, mtx_plain);
-   list_inithead(&ctx->free_fences);
    ctx->sync_thread.fence_eventfd = -1;
 
    if (!proxy_context_init(ctx, ctx_flags)) {
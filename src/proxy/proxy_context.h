@@ -14,12 +14,22 @@
 /* matches virtio-gpu */
 #define PROXY_CONTEXT_TIMELINE_COUNT 64
 
+/* commands that do not fit in a submit_cmd request are written to the ring */
+#define PROXY_CONTEXT_CMD_RING_SIZE (1024 * 1024)
+
 static_assert(ATOMIC_INT_LOCK_FREE == 2, "proxy renderer requires lock-free atomic_uint");
 
+struct proxy_fence;
+
 struct proxy_timeline {
    uint32_t cur_seqno;
    uint32_t next_seqno;
-   struct list_head fences;
+
+   /* a ring of the pending fences, sorted by seqno */
+   struct proxy_fence *fences;
+   uint32_t fence_capacity;
+   uint32_t fence_head;
+   uint32_t fence_count;
 
    int cur_seqno_stall_count;
 };
@@ -47,8 +57,14 @@ struct proxy_context {
    /* this points a region of shmem updated by the render worker */
    const volatile atomic_uint *timeline_seqnos;
 
-   mtx_t free_fences_mutex;
-   struct list_head free_fences;
+   /* this is a region of shmem read by the render worker */
+   struct {
+      /* updated by the render worker */
+      const volatile atomic_uint *tail;
+      char *data;
+      uint32_t size;
+      uint32_t head;
+   } cmd_ring;
 
    struct {
       /* when VIRGL_RENDERER_THREAD_SYNC is set */
@@ -11,6 +11,7 @@
 
 struct iovec;
 struct virgl_context;
+struct virgl_renderer_context_sched;
 
 struct proxy_renderer_cbs {
    int (*get_server_fd)(uint32_t version);
@@ -34,7 +35,8 @@ struct virgl_context *
 proxy_context_create(uint32_t ctx_id,
                      uint32_t ctx_flags,
                      size_t debug_len,
-                     const char *debug_name);
+                     const char *debug_name,
+                     const struct virgl_renderer_context_sched *sched);
 
 #else /* ENABLE_RENDER_SERVER */
 
@@ -65,7 +67,8 @@ static inline struct virgl_context *
 proxy_context_create(UNUSED uint32_t ctx_id,
                      UNUSED uint32_t ctx_flags,
                      UNUSED size_t debug_len,
-                     UNUSED const char *debug_name)
+                     UNUSED const char *debug_name,
+                     UNUSED const struct virgl_renderer_context_sched *sched)
 {
    return NULL;
 }
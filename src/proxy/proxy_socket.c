@@ -264,11 +264,9 @@ proxy_socket_receive_reply_internal(struct proxy_socket *socket,
     * 2. Receive exactly that many bytes with recvmsg for fds
     */
    struct stream_msg_header hdr;
-   proxy_log("proxy_receive_reply: reading framing header, expecting size=%zu", size);
    if (!proxy_socket_read_all(socket->fd, &hdr, sizeof(hdr)))
       return false;
 
-   proxy_log("proxy_receive_reply: got header size=%u fd_count=%u", hdr.size, hdr.fd_count);
    if (hdr.size != size) {
       proxy_log("message size mismatch: expected %zu but got %u", size, hdr.size);
       return false;
@@ -465,7 +463,6 @@ proxy_socket_send_request_internal(struct proxy_socket *socket,
       .size = (uint32_t)size,
       .fd_count = (uint32_t)fd_count,
    };
-   proxy_log("proxy_send_request: sending framing header size=%u fd_count=%u", hdr.size, hdr.fd_count);
    if (!proxy_socket_write_all(socket->fd, &hdr, sizeof(hdr)))
       return false;
 #endif
@@ -492,7 +489,6 @@ proxy_socket_send_request_internal(struct proxy_socket *socket,
       memcpy(CMSG_DATA(cmsg), fds, sizeof(*fds) * fd_count);
    }
 
-   proxy_log("proxy_send_request: sending data size=%zu", size);
    return proxy_socket_sendmsg(socket, &msg);
 }
 
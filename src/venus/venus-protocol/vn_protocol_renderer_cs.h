@@ -77,9 +77,9 @@ vn_cs_decoder_get_fatal(const struct vn_cs_decoder *dec)
 }
 
 static inline void *
-vn_cs_decoder_lookup_object(const struct vn_cs_decoder *dec, vn_object_id id, VkObjectType type)
+vn_cs_decoder_lookup_object(struct vn_cs_decoder *dec, vn_object_id id, VkObjectType type)
 {
-   const struct vkr_cs_decoder *d = (const struct vkr_cs_decoder *)dec;
+   struct vkr_cs_decoder *d = (struct vkr_cs_decoder *)dec;
    return vkr_cs_decoder_lookup_object(d, id, type);
 }
 
@@ -126,9 +126,9 @@ vn_cs_decoder_read(struct vn_cs_decoder *dec, size_t size, void *val, size_t val
 }
 
 static inline void
-vn_cs_decoder_peek(const struct vn_cs_decoder *dec, size_t size, void *val, size_t val_size)
+vn_cs_decoder_peek(struct vn_cs_decoder *dec, size_t size, void *val, size_t val_size)
 {
-   const struct vkr_cs_decoder *d = (const struct vkr_cs_decoder *)dec;
+   struct vkr_cs_decoder *d = (struct vkr_cs_decoder *)dec;
    vkr_cs_decoder_peek(d, size, val, val_size);
 }
 
@@ -50,6 +50,8 @@ struct vkr_inst_proc_table {
    PFN_vkDestroyInstance DestroyInstance;
    PFN_vkEnumeratePhysicalDevices EnumeratePhysicalDevices;
    PFN_vkGetPhysicalDeviceProperties2 GetPhysicalDeviceProperties2;
+   PFN_vkGetPhysicalDeviceFeatures2 GetPhysicalDeviceFeatures2;
+   PFN_vkEnumerateDeviceExtensionProperties EnumerateDeviceExtensionProperties;
    PFN_vkCreateDevice CreateDevice;
    PFN_vkGetDeviceProcAddr GetDeviceProcAddr;
 };
@@ -60,6 +62,7 @@ struct vkr_dev_proc_table {
    PFN_vkFreeMemory FreeMemory;
    PFN_vkMapMemory MapMemory;
    PFN_vkUnmapMemory UnmapMemory;
+   PFN_vkMapMemory2KHR MapMemory2KHR;
 };
 
 struct vkr_opaque_fd_mem_info {
@@ -69,6 +72,8 @@ struct vkr_opaque_fd_mem_info {
    VkDeviceMemory device_memory;
    uint32_t res_id;
    uint64_t size;
+   /* mapped at an address chosen by the caller, who owns the mapping */
+   bool placed;
 
    struct list_head head;
 };
@@ -81,6 +86,7 @@ static struct vkr_allocator {
    VkPhysicalDevice physical_devices[VKR_ALLOCATOR_MAX_DEVICE_COUNT];
    VkDevice devices[VKR_ALLOCATOR_MAX_DEVICE_COUNT];
    uint8_t device_uuids[VKR_ALLOCATOR_MAX_DEVICE_COUNT][VK_UUID_SIZE];
+   bool map_placed[VKR_ALLOCATOR_MAX_DEVICE_COUNT];
    uint32_t device_count;
 
    struct list_head memories;
@@ -196,6 +202,8 @@ vkr_allocator_inst_proc_table_init(VkInstance inst_handle,
    vk->DestroyInstance = VN_GIPA(vkDestroyInstance);
    vk->EnumeratePhysicalDevices = VN_GIPA(vkEnumeratePhysicalDevices);
    vk->GetPhysicalDeviceProperties2 = VN_GIPA(vkGetPhysicalDeviceProperties2);
+   vk->GetPhysicalDeviceFeatures2 = VN_GIPA(vkGetPhysicalDeviceFeatures2);
+   vk->EnumerateDeviceExtensionProperties = VN_GIPA(vkEnumerateDeviceExtensionProperties);
    vk->CreateDevice = VN_GIPA(vkCreateDevice);
    vk->GetDeviceProcAddr = VN_GIPA(vkGetDeviceProcAddr);
 #undef VN_GIPA
@@ -212,15 +220,63 @@ vkr_allocator_dev_proc_table_init(VkDevice dev_handle,
    vk->FreeMemory = VN_GDPA(vkFreeMemory);
    vk->MapMemory = VN_GDPA(vkMapMemory);
    vk->UnmapMemory = VN_GDPA(vkUnmapMemory);
+   vk->MapMemory2KHR = VN_GDPA(vkMapMemory2KHR);
 #undef VN_GDPA
 }
 
+static bool
+vkr_allocator_supports_map_placed(VkPhysicalDevice physical_dev_handle)
+{
+   struct vkr_inst_proc_table *vk = &vkr_allocator.proc_table;
+   bool has_map_memory2 = false;
+   bool has_map_placed = false;
+   uint32_t count = 0;
+
+   if (vk->EnumerateDeviceExtensionProperties(physical_dev_handle, NULL, &count, NULL) !=
+       VK_SUCCESS)
+      return false;
+
+   VkExtensionProperties *exts = calloc(count, sizeof(*exts));
+   if (!exts)
+      return false;
+
+   if (vk->EnumerateDeviceExtensionProperties(physical_dev_handle, NULL, &count, exts) ==
+       VK_SUCCESS) {
+      for (uint32_t i = 0; i < count; i++) {
+         if (!strcmp(exts[i].extensionName, VK_KHR_MAP_MEMORY_2_EXTENSION_NAME))
+            has_map_memory2 = true;
+         else if (!strcmp(exts[i].extensionName, VK_EXT_MAP_MEMORY_PLACED_EXTENSION_NAME))
+            has_map_placed = true;
+      }
+   }
+   free(exts);
+
+   if (!has_map_memory2 || !has_map_placed)
+      return false;
+
+   VkPhysicalDeviceMapMemoryPlacedFeaturesEXT placed_feats = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAP_MEMORY_PLACED_FEATURES_EXT
+   };
+   VkPhysicalDeviceFeatures2 feats2 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &placed_feats
+   };
+   vk->GetPhysicalDeviceFeatures2(physical_dev_handle, &feats2);
+
+   return placed_feats.memoryMapPlaced;
+}
+
 int
 vkr_allocator_init(void)
 {
    static const char *required_extensions[] = {
       "VK_KHR_external_memory_fd",
    };
+   /* enabled when available for vkr_allocator_resource_map_fixed */
+   static const char *map_placed_extensions[] = {
+      "VK_KHR_external_memory_fd",
+      VK_KHR_MAP_MEMORY_2_EXTENSION_NAME,
+      VK_EXT_MAP_MEMORY_PLACED_EXTENSION_NAME,
+   };
    struct vkr_inst_proc_table *vk = &vkr_allocator.proc_table;
    VkResult res;
 
@@ -280,12 +336,20 @@ vkr_allocator_init(void)
          .pQueuePriorities = &priority
       };
 
+      const bool map_placed = vkr_allocator_supports_map_placed(physical_dev_handle);
+      VkPhysicalDeviceMapMemoryPlacedFeaturesEXT placed_feats = {
+         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAP_MEMORY_PLACED_FEATURES_EXT,
+         .memoryMapPlaced = VK_TRUE,
+      };
+
       VkDeviceCreateInfo dev_info = {
          .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+         .pNext = map_placed ? &placed_feats : NULL,
          .queueCreateInfoCount = 1,
          .pQueueCreateInfos = &queue_info,
-         .enabledExtensionCount = ARRAY_SIZE(required_extensions),
-         .ppEnabledExtensionNames = required_extensions,
+         .enabledExtensionCount = map_placed ? ARRAY_SIZE(map_placed_extensions)
+                                             : ARRAY_SIZE(required_extensions),
+         .ppEnabledExtensionNames = map_placed ? map_placed_extensions : required_extensions,
       };
 
       res = vk->CreateDevice(physical_dev_handle, &dev_info, NULL,
@@ -299,6 +363,8 @@ vkr_allocator_init(void)
 
       vkr_allocator_dev_proc_table_init(vkr_allocator.devices[i], vk->GetDeviceProcAddr,
                                         &vkr_allocator.proc_tables[i]);
+      vkr_allocator.map_placed[i] =
+         map_placed && vkr_allocator.proc_tables[i].MapMemory2KHR;
    }
 
    list_inithead(&vkr_allocator.memories);
@@ -319,14 +385,22 @@ fail:
    return -1;
 }
 
-int
-vkr_allocator_resource_map(struct virgl_resource *res, void **map, uint64_t *out_size)
+static int
+vkr_allocator_ensure_initialized(void)
 {
    if (!vkr_allocator_initialized) {
       if (vkr_allocator_init())
          return -EINVAL;
       vkr_allocator_initialized = true;
    }
+   return 0;
+}
+
+int
+vkr_allocator_resource_map(struct virgl_resource *res, void **map, uint64_t *out_size)
+{
+   if (vkr_allocator_ensure_initialized())
+      return -EINVAL;
 
    assert(vkr_allocator_initialized);
 
@@ -348,21 +422,66 @@ vkr_allocator_resource_map(struct virgl_resource *res, void **map, uint64_t *out
 }
 
 static struct vkr_opaque_fd_mem_info *
-vkr_allocator_get_mem_info(struct virgl_resource *res)
+vkr_allocator_get_mem_info(struct virgl_resource *res, bool placed)
 {
    list_for_each_entry_safe (struct vkr_opaque_fd_mem_info, mem_info, &vkr_allocator.memories, head)
-      if (mem_info->res_id == res->res_id)
+      if (mem_info->res_id == res->res_id && mem_info->placed == placed)
          return mem_info;
 
    return NULL;
 }
 
+int
+vkr_allocator_resource_map_fixed(struct virgl_resource *res, void *addr)
+{
+   if (vkr_allocator_ensure_initialized())
+      return -EINVAL;
+
+   const uint32_t idx = vkr_allocator_get_dev_idx(res);
+   if (idx == VKR_ALLOCATOR_MAX_DEVICE_COUNT || !vkr_allocator.map_placed[idx])
+      return -EOPNOTSUPP;
+
+   /* The caller owns placed mappings and drops them by its own means, the
+    * memory of the previous one is released when the resource is placed
+    * again.
+    */
+   struct vkr_opaque_fd_mem_info *mem_info = vkr_allocator_get_mem_info(res, true);
+   if (mem_info)
+      vkr_allocator_free_memory(mem_info);
+
+   mem_info = vkr_allocator_allocate_memory(res);
+   if (!mem_info)
+      return -EINVAL;
+
+   const VkMemoryMapPlacedInfoEXT placed_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_MAP_PLACED_INFO_EXT,
+      .pPlacedAddress = addr,
+   };
+   const VkMemoryMapInfoKHR map_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_MAP_INFO_KHR,
+      .pNext = &placed_info,
+      .flags = VK_MEMORY_MAP_PLACED_BIT_EXT,
+      .memory = mem_info->device_memory,
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+   };
+   void *ptr;
+   if (mem_info->vk->MapMemory2KHR(mem_info->device, &map_info, &ptr) != VK_SUCCESS) {
+      vkr_allocator_free_memory(mem_info);
+      return -EINVAL;
+   }
+
+   mem_info->placed = true;
+
+   return 0;
+}
+
 int
 vkr_allocator_resource_unmap(struct virgl_resource *res)
 {
    assert(vkr_allocator_initialized);
 
-   struct vkr_opaque_fd_mem_info *mem_info = vkr_allocator_get_mem_info(res);
+   struct vkr_opaque_fd_mem_info *mem_info = vkr_allocator_get_mem_info(res, false);
    if (!mem_info)
       return -EINVAL;
 
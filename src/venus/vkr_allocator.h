@@ -39,6 +39,8 @@ vkr_allocator_fini(void);
 int
 vkr_allocator_resource_map(struct virgl_resource *res, void **map, uint64_t *out_size);
 int
+vkr_allocator_resource_map_fixed(struct virgl_resource *res, void *addr);
+int
 vkr_allocator_resource_unmap(struct virgl_resource *res);
 
 #else /* ENABLE_VENUS */
@@ -64,6 +66,12 @@ vkr_allocator_resource_map(UNUSED struct virgl_resource *res,
    return -1;
 }
 
+static inline int
+vkr_allocator_resource_map_fixed(UNUSED struct virgl_resource *res, UNUSED void *addr)
+{
+   return -1;
+}
+
 static inline int
 vkr_allocator_resource_unmap(UNUSED struct virgl_resource *res)
 {
@@ -6,7 +6,10 @@
 #include "vkr_buffer.h"
 
 #include "vkr_buffer_gen.h"
+#include "vkr_device_memory.h"
+#include "vkr_memory_requirements.h"
 #include "vkr_physical_device.h"
+#include "vkr_sparse.h"
 
 static void
 vkr_dispatch_vkCreateBuffer(struct vn_dispatch_context *dispatch,
@@ -37,13 +40,27 @@ vkr_dispatch_vkCreateBuffer(struct vn_dispatch_context *dispatch,
     * vkr_physical_device_init_memory_properties as well.
     */
 
-   vkr_buffer_create_and_add(dispatch->data, args);
+   struct vkr_buffer *buf = vkr_buffer_create_and_add(dispatch->data, args);
+   if (!buf)
+      return;
+
+   if (args->pCreateInfo->flags & VK_BUFFER_CREATE_SPARSE_BINDING_BIT)
+      buf->sparse = vkr_sparse_residency_create_buffer();
+
+   buf->memory_requirements = vkr_memory_requirements_get_buffer_entry(
+      vkr_device_from_handle(args->device), args->pCreateInfo);
 }
 
 static void
 vkr_dispatch_vkDestroyBuffer(struct vn_dispatch_context *dispatch,
                              struct vn_command_vkDestroyBuffer *args)
 {
+   struct vkr_buffer *buf = vkr_buffer_from_handle(args->buffer);
+   if (buf) {
+      vkr_sparse_residency_destroy(dispatch->data, buf->sparse);
+      buf->sparse = NULL;
+   }
+
    vkr_buffer_destroy_and_remove(dispatch->data, args);
 }
 
@@ -54,9 +71,19 @@ vkr_dispatch_vkGetBufferMemoryRequirements(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_buffer *buf = vkr_buffer_from_handle(args->buffer);
+   VkMemoryRequirements2 reqs = { .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2 };
+
+   if (vkr_memory_requirements_read(dev, buf->memory_requirements, &reqs)) {
+      *args->pMemoryRequirements = reqs.memoryRequirements;
+      return;
+   }
 
    vn_replace_vkGetBufferMemoryRequirements_args_handle(args);
    vk->GetBufferMemoryRequirements(args->device, args->buffer, args->pMemoryRequirements);
+
+   reqs.memoryRequirements = *args->pMemoryRequirements;
+   vkr_memory_requirements_write(dev, buf->memory_requirements, &reqs);
 }
 
 static void
@@ -66,9 +93,18 @@ vkr_dispatch_vkGetBufferMemoryRequirements2(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   /* nothing chained to pInfo selects a part of the buffer */
+   struct vkr_memory_requirements_entry *entry =
+      args->pInfo->pNext ? NULL
+                         : vkr_buffer_from_handle(args->pInfo->buffer)->memory_requirements;
+
+   if (vkr_memory_requirements_read(dev, entry, args->pMemoryRequirements))
+      return;
 
    vn_replace_vkGetBufferMemoryRequirements2_args_handle(args);
    vk->GetBufferMemoryRequirements2(args->device, args->pInfo, args->pMemoryRequirements);
+
+   vkr_memory_requirements_write(dev, entry, args->pMemoryRequirements);
 }
 
 static void
@@ -78,6 +114,7 @@ vkr_dispatch_vkBindBufferMemory(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   args->memoryOffset += vkr_device_memory_get_block_offset(args->memory);
    vn_replace_vkBindBufferMemory_args_handle(args);
    args->ret =
       vk->BindBufferMemory(args->device, args->buffer, args->memory, args->memoryOffset);
@@ -90,6 +127,10 @@ vkr_dispatch_vkBindBufferMemory2(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   for (uint32_t i = 0; i < args->bindInfoCount; i++) {
+      VkBindBufferMemoryInfo *info = (VkBindBufferMemoryInfo *)&args->pBindInfos[i];
+      info->memoryOffset += vkr_device_memory_get_block_offset(info->memory);
+   }
    vn_replace_vkBindBufferMemory2_args_handle(args);
    args->ret = vk->BindBufferMemory2(args->device, args->bindInfoCount, args->pBindInfos);
 }
@@ -138,10 +179,17 @@ vkr_dispatch_vkGetDeviceBufferMemoryRequirements(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_memory_requirements_entry *entry =
+      vkr_memory_requirements_get_buffer_entry(dev, args->pInfo->pCreateInfo);
+
+   if (vkr_memory_requirements_read(dev, entry, args->pMemoryRequirements))
+      return;
 
    vn_replace_vkGetDeviceBufferMemoryRequirements_args_handle(args);
    vk->GetDeviceBufferMemoryRequirements(args->device, args->pInfo,
                                          args->pMemoryRequirements);
+
+   vkr_memory_requirements_write(dev, entry, args->pMemoryRequirements);
 }
 
 void
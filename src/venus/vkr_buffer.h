@@ -10,6 +10,12 @@
 
 struct vkr_buffer {
    struct vkr_object base;
+
+   /* for buffers created with VK_BUFFER_CREATE_SPARSE_BINDING_BIT */
+   struct vkr_sparse_residency *sparse;
+
+   /* see vkr_memory_requirements.h, NULL when not cached */
+   struct vkr_memory_requirements_entry *memory_requirements;
 };
 VKR_DEFINE_OBJECT_CAST(buffer, VK_OBJECT_TYPE_BUFFER, VkBuffer)
 
@@ -6,6 +6,24 @@
 #include "vkr_command_buffer.h"
 
 #include "vkr_command_buffer_gen.h"
+#include "vkr_cs.h"
+#include "vkr_query_pool.h"
+
+/* the deferred calls are recorded at the latest when this many infos pile up */
+#define VKR_COMMAND_BUFFER_BUILDS_MAX_INFOS 64
+
+struct vkr_command_buffer_builds {
+   struct vkr_command_buffer *cmd;
+
+   VkAccelerationStructureBuildGeometryInfoKHR *infos;
+   const VkAccelerationStructureBuildRangeInfoKHR **ranges;
+   uint32_t info_count;
+
+   /* the geometries and ranges the infos point to, one block per deferred call */
+   void **blocks;
+   uint32_t block_count;
+   uint32_t block_capacity;
+};
 
 #ifdef __clang__
 #pragma clang diagnostic ignored "-Wgnu-zero-variadic-macro-arguments"
@@ -29,6 +47,7 @@ vkr_dispatch_vkCreateCommandPool(struct vn_dispatch_context *dispatch,
    if (!pool)
       return;
 
+   pool->flags = args->pCreateInfo->flags;
    list_inithead(&pool->command_buffers);
 }
 
@@ -46,15 +65,93 @@ vkr_dispatch_vkDestroyCommandPool(struct vn_dispatch_context *dispatch,
    vkr_command_pool_destroy_and_remove(ctx, args);
 }
 
+/* keeps a command buffer freed by the guest for a later allocation */
+static bool
+vkr_command_pool_recycle(struct vkr_device *dev,
+                         struct vkr_command_pool *pool,
+                         struct vkr_command_buffer *cmd)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   if (cmd->level > VK_COMMAND_BUFFER_LEVEL_SECONDARY)
+      return false;
+
+   struct vkr_command_pool_recycled *recycled = &pool->recycled[cmd->level];
+   if (recycled->count == VKR_COMMAND_POOL_MAX_RECYCLED)
+      return false;
+
+   const VkCommandBuffer handle = cmd->base.handle.command_buffer;
+   if (!(pool->flags & VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT)) {
+      recycled->handles[recycled->count++] = handle;
+      return true;
+   }
+
+   /* keep the resources of the command buffer for its next recording */
+   if (vk->ResetCommandBuffer(handle, 0) != VK_SUCCESS)
+      return false;
+
+   /* move the first handle waiting for a pool reset to the end */
+   recycled->handles[recycled->count++] = recycled->handles[recycled->ready];
+   recycled->handles[recycled->ready++] = handle;
+   return true;
+}
+
+/* allocates the command buffers from the recycled ones when there are enough */
+static bool
+vkr_command_pool_reuse(struct vkr_context *ctx,
+                       struct vkr_device *dev,
+                       struct vkr_command_pool *pool,
+                       struct vn_command_vkAllocateCommandBuffers *args)
+{
+   const VkCommandBufferAllocateInfo *info = args->pAllocateInfo;
+   struct object_array arr;
+
+   if (info->level > VK_COMMAND_BUFFER_LEVEL_SECONDARY)
+      return false;
+
+   struct vkr_command_pool_recycled *recycled = &pool->recycled[info->level];
+   if (!info->commandBufferCount || info->commandBufferCount > recycled->ready)
+      return false;
+
+   if (vkr_command_buffer_init_array(ctx, args, &arr) != VK_SUCCESS)
+      return true;
+
+   VkCommandBuffer *handles = arr.handle_storage;
+   for (uint32_t i = 0; i < arr.count; i++) {
+      handles[i] = recycled->handles[--recycled->ready];
+      recycled->handles[recycled->ready] = recycled->handles[--recycled->count];
+   }
+
+   for (uint32_t i = 0; i < arr.count; i++) {
+      struct vkr_command_buffer *cmd = arr.objects[i];
+      cmd->pool = pool;
+      cmd->level = info->level;
+   }
+
+   vkr_command_buffer_add_array(ctx, dev, pool, &arr);
+   return true;
+}
+
 static void
 vkr_dispatch_vkResetCommandPool(UNUSED struct vn_dispatch_context *dispatch,
                                 struct vn_command_vkResetCommandPool *args)
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_command_pool *pool = vkr_command_pool_from_handle(args->commandPool);
+
+   list_for_each_entry (struct vkr_command_buffer, cmd, &pool->command_buffers,
+                        base.track_head)
+      vkr_record_cache_drop(cmd);
 
    vn_replace_vkResetCommandPool_args_handle(args);
    args->ret = vk->ResetCommandPool(args->device, args->commandPool, args->flags);
+
+   /* the recycled command buffers are reset along with the others */
+   if (args->ret == VK_SUCCESS) {
+      for (uint32_t i = 0; i < ARRAY_SIZE(pool->recycled); i++)
+         pool->recycled[i].ready = pool->recycled[i].count;
+   }
 }
 
 static void
@@ -63,8 +160,21 @@ vkr_dispatch_vkTrimCommandPool(UNUSED struct vn_dispatch_context *dispatch,
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_command_pool *pool = vkr_command_pool_from_handle(args->commandPool);
 
    vn_replace_vkTrimCommandPool_args_handle(args);
+
+   /* the guest wants the memory back */
+   for (uint32_t i = 0; i < ARRAY_SIZE(pool->recycled); i++) {
+      if (!pool->recycled[i].count)
+         continue;
+
+      vk->FreeCommandBuffers(args->device, args->commandPool, pool->recycled[i].count,
+                             pool->recycled[i].handles);
+      pool->recycled[i].count = 0;
+      pool->recycled[i].ready = 0;
+   }
+
    vk->TrimCommandPool(args->device, args->commandPool, args->flags);
 }
 
@@ -83,9 +193,18 @@ vkr_dispatch_vkAllocateCommandBuffers(struct vn_dispatch_context *dispatch,
       return;
    }
 
+   if (vkr_command_pool_reuse(ctx, dev, pool, args))
+      return;
+
    if (vkr_command_buffer_create_array(ctx, args, &arr) != VK_SUCCESS)
       return;
 
+   for (uint32_t i = 0; i < arr.count; i++) {
+      struct vkr_command_buffer *cmd = arr.objects[i];
+      cmd->pool = pool;
+      cmd->level = args->pAllocateInfo->level;
+   }
+
    vkr_command_buffer_add_array(ctx, dev, pool, &arr);
 }
 
@@ -94,15 +213,42 @@ vkr_dispatch_vkFreeCommandBuffers(struct vn_dispatch_context *dispatch,
                                   struct vn_command_vkFreeCommandBuffers *args)
 {
    struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_command_pool *pool = vkr_command_pool_from_handle(args->commandPool);
    struct list_head free_list;
 
    /* args->pCommandBuffers is marked noautovalidity="true" */
-   if (args->commandBufferCount && !args->pCommandBuffers) {
+   if (!pool || (args->commandBufferCount && !args->pCommandBuffers)) {
       vkr_context_set_fatal(ctx);
       return;
    }
 
-   vkr_command_buffer_destroy_driver_handles(ctx, args, &free_list);
+   /* the command buffers that are not recycled are compacted in place, as
+    * vn_replace_vkFreeCommandBuffers_args_handle would replace them
+    */
+   VkCommandBuffer *handles = (VkCommandBuffer *)args->pCommandBuffers;
+   uint32_t free_count = 0;
+
+   list_inithead(&free_list);
+   for (uint32_t i = 0; i < args->commandBufferCount; i++) {
+      struct vkr_command_buffer *cmd = vkr_command_buffer_from_handle(handles[i]);
+      if (!cmd)
+         continue;
+
+      list_del(&cmd->base.track_head);
+      list_addtail(&cmd->base.track_head, &free_list);
+      vkr_record_cache_drop(cmd);
+
+      if (!vkr_command_pool_recycle(dev, pool, cmd))
+         handles[free_count++] = cmd->base.handle.command_buffer;
+   }
+
+   if (free_count) {
+      vk->FreeCommandBuffers(dev->base.handle.device, pool->base.handle.command_pool,
+                             free_count, handles);
+   }
+
    vkr_context_remove_objects(ctx, &free_list);
 }
 
@@ -113,6 +259,8 @@ vkr_dispatch_vkResetCommandBuffer(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_command_buffer *cmd = vkr_command_buffer_from_handle(args->commandBuffer);
    struct vn_device_proc_table *vk = &cmd->device->proc_table;
 
+   vkr_record_cache_drop(cmd);
+
    vn_replace_vkResetCommandBuffer_args_handle(args);
    args->ret = vk->ResetCommandBuffer(args->commandBuffer, args->flags);
 }
@@ -125,8 +273,14 @@ vkr_dispatch_vkBeginCommandBuffer(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_command_buffer *cmd = vkr_command_buffer_from_handle(args->commandBuffer);
    struct vn_device_proc_table *vk = &cmd->device->proc_table;
 
+   vkr_record_cache_drop(cmd);
+
    vn_replace_vkBeginCommandBuffer_args_handle(args);
    args->ret = vk->BeginCommandBuffer(args->commandBuffer, args->pBeginInfo);
+
+   cmd->record_cacheable =
+      args->ret == VK_SUCCESS &&
+      !(args->pBeginInfo->flags & VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 }
 
 static void
@@ -139,6 +293,8 @@ vkr_dispatch_vkEndCommandBuffer(UNUSED struct vn_dispatch_context *dispatch,
 
    vn_replace_vkEndCommandBuffer_args_handle(args);
    args->ret = vk->EndCommandBuffer(args->commandBuffer);
+   if (args->ret != VK_SUCCESS)
+      cmd->record_cacheable = false;
 }
 
 static void
@@ -468,6 +624,10 @@ static void
 vkr_dispatch_vkCmdResetQueryPool(UNUSED struct vn_dispatch_context *dispatch,
                                  struct vn_command_vkCmdResetQueryPool *args)
 {
+   struct vkr_query_pool *pool = vkr_query_pool_from_handle(args->queryPool);
+   if (pool)
+      vkr_query_pool_device_reset(pool);
+
    VKR_CMD_CALL(CmdResetQueryPool, args, args->queryPool, args->firstQuery,
                 args->queryCount);
 }
@@ -1119,13 +1279,184 @@ vkr_dispatch_vkCmdBuildAccelerationStructuresIndirectKHR(
                 args->ppMaxPrimitiveCounts);
 }
 
+static bool
+vkr_command_buffer_can_defer_build_info(const VkAccelerationStructureBuildGeometryInfoKHR *info,
+                                        const VkAccelerationStructureBuildRangeInfoKHR *ranges)
+{
+   if (info->pNext || (info->geometryCount && !ranges))
+      return false;
+
+   for (uint32_t i = 0; i < info->geometryCount; i++) {
+      const VkAccelerationStructureGeometryKHR *geom =
+         info->pGeometries ? &info->pGeometries[i] : info->ppGeometries[i];
+      if (geom->pNext)
+         return false;
+
+      switch (geom->geometryType) {
+      case VK_GEOMETRY_TYPE_TRIANGLES_KHR:
+         if (geom->geometry.triangles.pNext)
+            return false;
+         break;
+      case VK_GEOMETRY_TYPE_AABBS_KHR:
+         if (geom->geometry.aabbs.pNext)
+            return false;
+         break;
+      case VK_GEOMETRY_TYPE_INSTANCES_KHR:
+         if (geom->geometry.instances.pNext)
+            return false;
+         break;
+      default:
+         return false;
+      }
+   }
+
+   return true;
+}
+
+void
+vkr_command_buffer_flush_builds(struct vkr_cs_decoder *dec)
+{
+   struct vkr_command_buffer_builds *builds = dec->as_builds;
+   if (!builds || !builds->info_count)
+      return;
+
+   TRACE_FUNC();
+   struct vkr_command_buffer *cmd = builds->cmd;
+   struct vn_device_proc_table *vk = &cmd->device->proc_table;
+
+   vk->CmdBuildAccelerationStructuresKHR(cmd->base.handle.command_buffer, builds->info_count,
+                                         builds->infos, builds->ranges);
+
+   for (uint32_t i = 0; i < builds->block_count; i++)
+      free(builds->blocks[i]);
+   builds->block_count = 0;
+   builds->info_count = 0;
+   builds->cmd = NULL;
+}
+
+vkr_object_id
+vkr_command_buffer_get_builds_target(const struct vkr_cs_decoder *dec)
+{
+   const struct vkr_command_buffer_builds *builds = dec->as_builds;
+   return builds && builds->info_count ? builds->cmd->base.id : 0;
+}
+
+void
+vkr_command_buffer_fini_builds(struct vkr_cs_decoder *dec)
+{
+   struct vkr_command_buffer_builds *builds = dec->as_builds;
+   if (!builds)
+      return;
+
+   /* the command buffer might be gone */
+   for (uint32_t i = 0; i < builds->block_count; i++)
+      free(builds->blocks[i]);
+   free(builds->blocks);
+   free(builds->infos);
+   free(builds->ranges);
+   free(builds);
+   dec->as_builds = NULL;
+}
+
+/* Copies the infos to be recorded together with the following
+ * vkCmdBuildAccelerationStructuresKHR calls into the same command buffer.
+ * Builds in one call are as unordered as builds in consecutive calls without
+ * a barrier in between, and any other command records them first.
+ */
+static bool
+vkr_command_buffer_defer_builds(struct vkr_cs_decoder *dec,
+                                struct vkr_command_buffer *cmd,
+                                uint32_t count,
+                                const VkAccelerationStructureBuildGeometryInfoKHR *infos,
+                                const VkAccelerationStructureBuildRangeInfoKHR *const *ranges)
+{
+   if (count > VKR_COMMAND_BUFFER_BUILDS_MAX_INFOS)
+      return false;
+
+   size_t size = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      if (!vkr_command_buffer_can_defer_build_info(&infos[i], ranges[i]))
+         return false;
+      size += (sizeof(VkAccelerationStructureGeometryKHR) +
+               sizeof(VkAccelerationStructureBuildRangeInfoKHR)) *
+              infos[i].geometryCount;
+   }
+
+   if (!dec->as_builds) {
+      struct vkr_command_buffer_builds *builds = calloc(1, sizeof(*builds));
+      if (!builds)
+         return false;
+
+      builds->infos = malloc(sizeof(*builds->infos) * VKR_COMMAND_BUFFER_BUILDS_MAX_INFOS);
+      builds->ranges = malloc(sizeof(*builds->ranges) * VKR_COMMAND_BUFFER_BUILDS_MAX_INFOS);
+      dec->as_builds = builds;
+      if (!builds->infos || !builds->ranges) {
+         vkr_command_buffer_fini_builds(dec);
+         return false;
+      }
+   }
+   struct vkr_command_buffer_builds *builds = dec->as_builds;
+
+   if (builds->cmd != cmd ||
+       builds->info_count + count > VKR_COMMAND_BUFFER_BUILDS_MAX_INFOS)
+      vkr_command_buffer_flush_builds(dec);
+
+   if (builds->block_count == builds->block_capacity) {
+      const uint32_t capacity = MAX2(builds->block_capacity * 2, 16);
+      void **new_blocks = realloc(builds->blocks, sizeof(*new_blocks) * capacity);
+      if (!new_blocks)
+         return false;
+      builds->blocks = new_blocks;
+      builds->block_capacity = capacity;
+   }
+
+   uint8_t *block = malloc(MAX2(size, 1));
+   if (!block)
+      return false;
+   builds->blocks[builds->block_count++] = block;
+
+   for (uint32_t i = 0; i < count; i++) {
+      const VkAccelerationStructureBuildGeometryInfoKHR *src = &infos[i];
+      VkAccelerationStructureBuildGeometryInfoKHR *dst = &builds->infos[builds->info_count];
+
+      VkAccelerationStructureGeometryKHR *geoms = (VkAccelerationStructureGeometryKHR *)block;
+      block += sizeof(*geoms) * src->geometryCount;
+      for (uint32_t j = 0; j < src->geometryCount; j++)
+         geoms[j] = src->pGeometries ? src->pGeometries[j] : *src->ppGeometries[j];
+
+      VkAccelerationStructureBuildRangeInfoKHR *dst_ranges =
+         (VkAccelerationStructureBuildRangeInfoKHR *)block;
+      block += sizeof(*dst_ranges) * src->geometryCount;
+      if (src->geometryCount)
+         memcpy(dst_ranges, ranges[i], sizeof(*dst_ranges) * src->geometryCount);
+
+      *dst = *src;
+      dst->pGeometries = geoms;
+      dst->ppGeometries = NULL;
+      builds->ranges[builds->info_count] = dst_ranges;
+      builds->info_count++;
+   }
+   builds->cmd = cmd;
+
+   return true;
+}
+
 static void
 vkr_dispatch_vkCmdBuildAccelerationStructuresKHR(
-   UNUSED struct vn_dispatch_context *dispatch,
+   struct vn_dispatch_context *dispatch,
    struct vn_command_vkCmdBuildAccelerationStructuresKHR *args)
 {
-   VKR_CMD_CALL(CmdBuildAccelerationStructuresKHR, args, args->infoCount, args->pInfos,
-                args->ppBuildRangeInfos);
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+   struct vkr_command_buffer *cmd = vkr_command_buffer_from_handle(args->commandBuffer);
+
+   vn_replace_vkCmdBuildAccelerationStructuresKHR_args_handle(args);
+   if (vkr_command_buffer_defer_builds(dec, cmd, args->infoCount, args->pInfos,
+                                       args->ppBuildRangeInfos))
+      return;
+
+   vkr_command_buffer_flush_builds(dec);
+   cmd->device->proc_table.CmdBuildAccelerationStructuresKHR(
+      args->commandBuffer, args->infoCount, args->pInfos, args->ppBuildRangeInfos);
 }
 
 static void
@@ -9,11 +9,27 @@
 #include "vkr_common.h"
 
 #include "vkr_context.h"
+#include "vkr_record_cache.h"
+
+/* at most this many freed command buffers are kept per level */
+#define VKR_COMMAND_POOL_MAX_RECYCLED 32
 
 struct vkr_command_pool {
    struct vkr_object base;
 
+   VkCommandPoolCreateFlags flags;
    struct list_head command_buffers;
+
+   /* The driver command buffers freed by the guest, indexed by level, and
+    * handed out again by later allocations.  The first ready handles are in
+    * the initial state.  The others were freed from a pool that cannot reset
+    * them individually, and wait for the next vkResetCommandPool.
+    */
+   struct vkr_command_pool_recycled {
+      VkCommandBuffer handles[VKR_COMMAND_POOL_MAX_RECYCLED];
+      uint32_t count;
+      uint32_t ready;
+   } recycled[2];
 };
 VKR_DEFINE_OBJECT_CAST(command_pool, VK_OBJECT_TYPE_COMMAND_POOL, VkCommandPool)
 
@@ -21,6 +37,13 @@ struct vkr_command_buffer {
    struct vkr_object base;
 
    struct vkr_device *device;
+   struct vkr_command_pool *pool;
+   VkCommandBufferLevel level;
+
+   /* the last recording, see vkr_record_cache.h */
+   struct vkr_record_cache_entry *record_cache;
+   /* whether the recording in progress can be cached */
+   bool record_cacheable;
 };
 VKR_DEFINE_OBJECT_CAST(command_buffer, VK_OBJECT_TYPE_COMMAND_BUFFER, VkCommandBuffer)
 
@@ -30,9 +53,27 @@ vkr_context_init_command_pool_dispatch(struct vkr_context *ctx);
 void
 vkr_context_init_command_buffer_dispatch(struct vkr_context *ctx);
 
+/* Records the vkCmdBuildAccelerationStructuresKHR calls deferred by the
+ * decoder.  They are deferred to be recorded as one call, and must be
+ * recorded before any other command is dispatched.
+ */
+void
+vkr_command_buffer_flush_builds(struct vkr_cs_decoder *dec);
+
+/* returns the command buffer the deferred builds are for, or 0 */
+vkr_object_id
+vkr_command_buffer_get_builds_target(const struct vkr_cs_decoder *dec);
+
+void
+vkr_command_buffer_fini_builds(struct vkr_cs_decoder *dec);
+
 static inline void
 vkr_command_pool_release(struct vkr_context *ctx, struct vkr_command_pool *pool)
 {
+   list_for_each_entry (struct vkr_command_buffer, cmd, &pool->command_buffers,
+                        base.track_head)
+      vkr_record_cache_drop(cmd);
+
    vkr_context_remove_objects(ctx, &pool->command_buffers);
 }
 
@@ -214,17 +214,54 @@ static const struct vn_info_extension_table vkr_extension_table = {
 static const struct debug_named_value vkr_debug_options[] = {
    { "validate", VKR_DEBUG_VALIDATE, "Force enabling the validation layer" },
    { "udmabuf", VKR_DEBUG_UDMABUF, "Force udmabuf for host visible memory" },
+   { "ring_stats", VKR_DEBUG_RING_STATS, "Log the ring thread statistics when a ring is destroyed" },
+   { "cs_stats", VKR_DEBUG_CS_STATS, "Log the decoder temp pool statistics when a decoder is destroyed" },
+   { "cmd_stats", VKR_DEBUG_CMD_STATS, "Log the time spent in each command type when a decoder is destroyed" },
    DEBUG_NAMED_VALUE_END
 };
 
+static const struct {
+   const char *name;
+   enum vkr_ring_wait_mode mode;
+} vkr_ring_wait_modes[] = {
+   { "relax", VKR_RING_WAIT_RELAX },
+   { "notify", VKR_RING_WAIT_NOTIFY },
+   { "futex", VKR_RING_WAIT_FUTEX },
+   { "adaptive", VKR_RING_WAIT_ADAPTIVE },
+};
+
 uint32_t vkr_debug_flags;
+enum vkr_ring_wait_mode vkr_ring_wait_mode;
+const char *vkr_pipeline_cache_dir;
+bool vkr_memory_suballoc;
+uint32_t vkr_instance_pool_size;
+bool vkr_record_cache;
 
 DEBUG_GET_ONCE_FLAGS_OPTION(vkr_debug_flags, "VKR_DEBUG", vkr_debug_options, 0)
+DEBUG_GET_ONCE_OPTION(vkr_ring_wait, "VKR_RING_WAIT", "relax")
+DEBUG_GET_ONCE_OPTION(vkr_pipeline_cache_dir, "VKR_PIPELINE_CACHE_DIR", NULL)
+DEBUG_GET_ONCE_BOOL_OPTION(vkr_memory_suballoc, "VKR_MEMORY_SUBALLOC", false)
+DEBUG_GET_ONCE_NUM_OPTION(vkr_instance_pool_size, "VKR_INSTANCE_POOL", 0)
+DEBUG_GET_ONCE_BOOL_OPTION(vkr_record_cache, "VKR_RECORD_CACHE", false)
 
 void
 vkr_debug_init(void)
 {
    vkr_debug_flags = debug_get_option_vkr_debug_flags();
+   vkr_pipeline_cache_dir = debug_get_option_vkr_pipeline_cache_dir();
+   vkr_memory_suballoc = debug_get_option_vkr_memory_suballoc();
+   vkr_instance_pool_size = MAX2(debug_get_option_vkr_instance_pool_size(), 0);
+   vkr_record_cache = debug_get_option_vkr_record_cache();
+
+   const char *ring_wait = debug_get_option_vkr_ring_wait();
+   vkr_ring_wait_mode = VKR_RING_WAIT_RELAX;
+   for (uint32_t i = 0; i < ARRAY_SIZE(vkr_ring_wait_modes); i++) {
+      if (!strcmp(ring_wait, vkr_ring_wait_modes[i].name)) {
+         vkr_ring_wait_mode = vkr_ring_wait_modes[i].mode;
+         return;
+      }
+   }
+   vkr_log("unknown VKR_RING_WAIT mode %s", ring_wait);
 }
 
 void
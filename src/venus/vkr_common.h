@@ -116,6 +116,23 @@ typedef uint64_t vkr_object_id;
 enum vkr_debug_flags {
    VKR_DEBUG_VALIDATE = 1 << 0,
    VKR_DEBUG_UDMABUF = 1 << 1,
+   VKR_DEBUG_RING_STATS = 1 << 2,
+   VKR_DEBUG_CS_STATS = 1 << 3,
+   VKR_DEBUG_CMD_STATS = 1 << 4,
+};
+
+/* how a ring thread waits for new commands before it goes idle */
+enum vkr_ring_wait_mode {
+   /* yield, then sleep for exponentially growing periods */
+   VKR_RING_WAIT_RELAX,
+   /* go idle right away and wait for the driver to notify the ring */
+   VKR_RING_WAIT_NOTIFY,
+   /* sleep on the tail word, clients sharing the ring through host memory
+    * can wake the thread with FUTEX_WAKE
+    */
+   VKR_RING_WAIT_FUTEX,
+   /* spin or sleep depending on the average interval between submits */
+   VKR_RING_WAIT_ADAPTIVE,
 };
 
 /* base class for all objects */
@@ -178,6 +195,15 @@ struct vkr_region {
 };
 
 extern uint32_t vkr_debug_flags;
+extern enum vkr_ring_wait_mode vkr_ring_wait_mode;
+/* where the host pipeline caches are persisted, NULL to not have them */
+extern const char *vkr_pipeline_cache_dir;
+/* whether small device-local memories share larger driver memories */
+extern bool vkr_memory_suballoc;
+/* how many instances are created ahead, 0 to not pool them */
+extern uint32_t vkr_instance_pool_size;
+/* whether identical command buffer recordings are skipped, see vkr_record_cache.h */
+extern bool vkr_record_cache;
 
 void
 vkr_debug_init(void);
@@ -9,11 +9,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "util/anon_file.h"
-#include "venus-protocol/vn_protocol_renderer_dispatches.h"
-
-#define XXH_INLINE_ALL
-#include "util/xxhash.h"
+#include "virgl_shm.h"
 
 #include "vkr_acceleration_structure.h"
 #include "vkr_buffer.h"
@@ -23,6 +19,7 @@
 #include "vkr_descriptor_set.h"
 #include "vkr_device.h"
 #include "vkr_device_memory.h"
+#include "vkr_dispatch.h"
 #include "vkr_host_copy.h"
 #include "vkr_image.h"
 #include "vkr_instance.h"
@@ -32,6 +29,7 @@
 #include "vkr_queue.h"
 #include "vkr_render_pass.h"
 #include "vkr_ring.h"
+#include "vkr_ring_monitor.h"
 #include "vkr_transport.h"
 
 void
@@ -141,7 +139,7 @@ vkr_context_submit_fence(struct vkr_context *ctx,
 {
    /* retire fence on cpu timeline directly */
    if (ring_idx == 0) {
-      ctx->retire_fence(ctx->ctx_id, ring_idx, fence_id);
+      vkr_context_retire_fence(ctx, ring_idx, fence_id);
       return true;
    }
 
@@ -158,6 +156,23 @@ vkr_context_submit_fence(struct vkr_context *ctx,
    return ok;
 }
 
+void
+vkr_context_get_stats(struct vkr_context *ctx, struct virgl_renderer_stats *stats)
+{
+   stats->temp_pool_size += ctx->decoder.temp_pool.total_size;
+   stats->sparse_committed_size += atomic_load(&ctx->sparse_committed_size);
+
+   /* the ring threads update their stats and temp pools without locking */
+   mtx_lock(&ctx->ring_mutex);
+   list_for_each_entry (struct vkr_ring, ring, &ctx->rings, head) {
+      stats->ring_count++;
+      stats->ring_idle_time += ring->stats.idle_time;
+      stats->ring_exec_time += ring->stats.exec_time;
+      stats->temp_pool_size += ring->decoder.temp_pool.total_size;
+   }
+   mtx_unlock(&ctx->ring_mutex);
+}
+
 bool
 vkr_context_submit_cmd(struct vkr_context *ctx, const void *buffer, size_t size)
 {
@@ -170,23 +185,27 @@ vkr_context_submit_cmd(struct vkr_context *ctx, const void *buffer, size_t size)
    vkr_cs_decoder_set_buffer_stream(&ctx->decoder, buffer, size);
 
    while (vkr_cs_decoder_has_command(&ctx->decoder)) {
-      vn_dispatch_command(&ctx->dispatch);
+      vkr_dispatch_command(&ctx->dispatch);
       if (vkr_context_get_fatal(ctx)) {
          vkr_log("submit_cmd: vn_dispatch_command failed");
+         virgl_flight_recorder_dump_once(ctx->flight_recorder, ctx->ctx_id);
 
+         vkr_queue_flush_sparse_binds(&ctx->decoder);
+         vkr_command_buffer_flush_builds(&ctx->decoder);
          vkr_cs_decoder_reset(&ctx->decoder);
          return false;
       }
    }
 
+   vkr_queue_flush_sparse_binds(&ctx->decoder);
+   vkr_command_buffer_flush_builds(&ctx->decoder);
    vkr_cs_decoder_reset(&ctx->decoder);
    return true;
 }
 
 static inline void
-vkr_context_free_resource(struct hash_entry *entry)
+vkr_context_free_resource(struct vkr_resource *res)
 {
-   struct vkr_resource *res = entry->data;
    if (res->fd_type == VIRGL_RESOURCE_FD_SHM)
       munmap(res->u.data, res->size);
    else if (res->u.fd >= 0)
@@ -194,27 +213,32 @@ vkr_context_free_resource(struct hash_entry *entry)
    free(res);
 }
 
+static void
+vkr_context_destroy_resource_table(struct vkr_context *ctx)
+{
+   virgl_id_table_foreach(&ctx->resource_table, slot)
+      vkr_context_free_resource(slot->value);
+   virgl_id_table_fini(&ctx->resource_table);
+}
+
 static inline bool
 vkr_context_add_resource(struct vkr_context *ctx, struct vkr_resource *res)
 {
    mtx_lock(&ctx->resource_mutex);
-   assert(!_mesa_hash_table_search(ctx->resource_table, &res->res_id));
-   struct hash_entry *entry =
-      _mesa_hash_table_insert(ctx->resource_table, &res->res_id, res);
+   assert(!virgl_id_table_search(&ctx->resource_table, res->res_id));
+   const bool ok = virgl_id_table_insert(&ctx->resource_table, res->res_id, res);
    mtx_unlock(&ctx->resource_mutex);
 
-   return entry;
+   return ok;
 }
 
 static inline void
 vkr_context_remove_resource(struct vkr_context *ctx, uint32_t res_id)
 {
    mtx_lock(&ctx->resource_mutex);
-   struct hash_entry *entry = _mesa_hash_table_search(ctx->resource_table, &res_id);
-   if (likely(entry)) {
-      vkr_context_free_resource(entry);
-      _mesa_hash_table_remove(ctx->resource_table, entry);
-   }
+   struct vkr_resource *res = virgl_id_table_remove(&ctx->resource_table, res_id);
+   if (likely(res))
+      vkr_context_free_resource(res);
    mtx_unlock(&ctx->resource_mutex);
 }
 
@@ -280,11 +304,11 @@ vkr_context_create_resource_from_shm(struct vkr_context *ctx,
 {
    assert(!vkr_context_get_resource(ctx, res_id));
 
-   int fd = os_create_anonymous_file(blob_size, "vkr-shmem");
+   int fd = virgl_shm_create(blob_size, "vkr-shmem");
    if (fd < 0)
       return false;
 
-   void *mmap_ptr = mmap(NULL, blob_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+   void *mmap_ptr = virgl_shm_map(fd, blob_size);
    if (mmap_ptr == MAP_FAILED) {
       close(fd);
       return false;
@@ -415,8 +439,16 @@ vkr_context_on_ring_seqno_update(struct vkr_context *ctx,
                                  uint64_t ring_id,
                                  uint32_t ring_seqno)
 {
+   /* Pairs with the fence in vkr_context_wait_ring_seqno, either the waiter
+    * sees the head stored before this call, or this sees the waiter.
+    */
+   atomic_thread_fence(memory_order_seq_cst);
+   if (atomic_load_explicit(&ctx->wait_ring.id, memory_order_relaxed) != ring_id)
+      return;
+
    mtx_lock(&ctx->wait_ring.mutex);
-   if (ctx->wait_ring.id == ring_id && vkr_seqno_ge(ring_seqno, ctx->wait_ring.seqno))
+   if (atomic_load_explicit(&ctx->wait_ring.id, memory_order_relaxed) == ring_id &&
+       vkr_seqno_ge(ring_seqno, ctx->wait_ring.seqno))
       cnd_signal(&ctx->wait_ring.cond);
    mtx_unlock(&ctx->wait_ring.mutex);
 }
@@ -426,9 +458,13 @@ vkr_context_get_wait_ring_seqno(struct vkr_context *ctx,
                                 uint64_t ring_id,
                                 uint32_t *out_seqno)
 {
+   /* the caller orders this with its own loads of the ring */
+   if (atomic_load_explicit(&ctx->wait_ring.id, memory_order_relaxed) != ring_id)
+      return false;
+
    bool wait_ring = false;
    mtx_lock(&ctx->wait_ring.mutex);
-   if (ctx->wait_ring.id == ring_id) {
+   if (atomic_load_explicit(&ctx->wait_ring.id, memory_order_relaxed) == ring_id) {
       wait_ring = true;
       *out_seqno = ctx->wait_ring.seqno;
    }
@@ -440,6 +476,7 @@ void
 vkr_context_on_ring_fatal(struct vkr_context *ctx)
 {
    vkr_context_set_fatal(ctx);
+   virgl_flight_recorder_dump_once(ctx->flight_recorder, ctx->ctx_id);
 
    mtx_lock(&ctx->wait_ring.mutex);
    cnd_signal(&ctx->wait_ring.cond);
@@ -456,13 +493,15 @@ vkr_context_wait_ring_seqno(struct vkr_context *ctx,
    bool ok = true;
 
    mtx_lock(&ctx->wait_ring.mutex);
-   ctx->wait_ring.id = ring->id;
    ctx->wait_ring.seqno = ring_seqno;
+   atomic_store_explicit(&ctx->wait_ring.id, ring->id, memory_order_relaxed);
+   /* pairs with the fence in vkr_context_on_ring_seqno_update */
+   atomic_thread_fence(memory_order_seq_cst);
    while (!vkr_context_get_fatal(ctx) && ok &&
           !vkr_seqno_ge(vkr_ring_load_head(ring), ring_seqno)) {
       ok = cnd_wait(&ctx->wait_ring.cond, &ctx->wait_ring.mutex) == thrd_success;
    }
-   ctx->wait_ring.id = 0;
+   atomic_store_explicit(&ctx->wait_ring.id, 0, memory_order_relaxed);
    mtx_unlock(&ctx->wait_ring.mutex);
 
    return ok;
@@ -499,125 +538,46 @@ vkr_context_wait_ring_init(struct vkr_context *ctx)
    return true;
 }
 
-static struct timespec
-timespec_add(struct timespec a, struct timespec b)
-{
-   /* handle only the non-negative case, unless needed. */
-   assert(a.tv_sec >= 0 && a.tv_nsec >= 0 && b.tv_sec >= 0 && b.tv_nsec >= 0);
-
-#define NS_PER_SEC 1000000000
-   a.tv_sec += b.tv_sec;
-   a.tv_nsec += b.tv_nsec;
-   if (a.tv_nsec >= NS_PER_SEC) {
-      a.tv_sec += 1;
-      a.tv_nsec -= NS_PER_SEC;
-   }
-#undef NS_PER_SEC
-
-   return a;
-}
-
-static int
-vkr_context_ring_monitor_thread(void *arg)
+void
+vkr_context_retire_fence(struct vkr_context *ctx, uint32_t ring_idx, uint64_t fence_id)
 {
-   struct vkr_context *ctx = arg;
-
-   char thread_name[16];
-   snprintf(thread_name, ARRAY_SIZE(thread_name), "vkr-ringmon-%d", ctx->ctx_id);
-   u_thread_setname(thread_name);
-
-   struct timespec ts;
-   int ret = thrd_busy;
-   assert(ctx->ring_monitor.started);
-   while (ctx->ring_monitor.started) {
-      /* only notify at the configured rate, not faster. */
-      if (ret == thrd_busy) {
-         mtx_lock(&ctx->ring_mutex);
-         list_for_each_entry (struct vkr_ring, ring, &ctx->rings, head) {
-            if (ring->monitor)
-               vkr_ring_set_status_bits(ring, VK_RING_STATUS_ALIVE_BIT_MESA);
-         }
-         mtx_unlock(&ctx->ring_mutex);
-         ret = 0;
-      } else if (ret)
-         break;
-
-      mtx_lock(&ctx->ring_monitor.mutex);
-      if ((ret = clock_gettime(CLOCK_REALTIME, &ts))) {
-         mtx_unlock(&ctx->ring_monitor.mutex);
-         break;
-      }
+   TRACE_FENCE(TRACE_FENCE_SIGNAL, ctx->ctx_id, ring_idx, fence_id);
 
-      const uint32_t period_us = ctx->ring_monitor.report_period_us;
-      ts = timespec_add(
-         ts, (struct timespec){ period_us / 1000000, (period_us % 1000000) * 1000 });
-      ret = cnd_timedwait(&ctx->ring_monitor.cond, &ctx->ring_monitor.mutex, &ts);
-      mtx_unlock(&ctx->ring_monitor.mutex);
-   }
-
-   return ret;
+   mtx_lock(&ctx->retire_mutex);
+   if (!ctx->detached)
+      ctx->retire_fence(ctx->ctx_id, ring_idx, fence_id);
+   mtx_unlock(&ctx->retire_mutex);
 }
 
-bool
-vkr_context_ring_monitor_init(struct vkr_context *ctx, uint32_t report_period_us)
+void
+vkr_context_detach(struct vkr_context *ctx)
 {
-   int ret;
-   assert(report_period_us > 0);
-   assert(!ctx->ring_monitor.started);
-
-   if (mtx_init(&ctx->ring_monitor.mutex, mtx_plain) != thrd_success)
-      goto err_mtx_init;
-   if (cnd_init(&ctx->ring_monitor.cond) != thrd_success)
-      goto err_cnd_init;
-
-   ctx->ring_monitor.report_period_us = report_period_us;
-   ctx->ring_monitor.started = true;
-   ret = thrd_create(&ctx->ring_monitor.thread, vkr_context_ring_monitor_thread, ctx);
-   if (ret != thrd_success)
-      goto err_monitor_thrd_create;
-
-   return true;
-
-err_monitor_thrd_create:
-   cnd_destroy(&ctx->ring_monitor.cond);
-err_cnd_init:
-   mtx_destroy(&ctx->ring_monitor.mutex);
-err_mtx_init:
-   return false;
-}
+   if (ctx->detached)
+      return;
 
-static void
-vkr_context_ring_monitor_fini(struct vkr_context *ctx)
-{
-   mtx_lock(&ctx->ring_monitor.mutex);
-   assert(ctx->ring_monitor.started);
-   ctx->ring_monitor.started = false;
-   cnd_signal(&ctx->ring_monitor.cond);
-   mtx_unlock(&ctx->ring_monitor.mutex);
+   vkr_ring_monitor_remove_context(ctx);
 
-   thrd_join(ctx->ring_monitor.thread, NULL);
+   list_for_each_entry_safe (struct vkr_ring, ring, &ctx->rings, head) {
+      vkr_ring_stop(ring);
+      vkr_ring_destroy(ring);
+   }
+   list_inithead(&ctx->rings);
 
-   cnd_destroy(&ctx->ring_monitor.cond);
-   mtx_destroy(&ctx->ring_monitor.mutex);
+   /* the sync threads of the queues keep running until the devices are
+    * destroyed, but the renderer forgets about the context after this */
+   mtx_lock(&ctx->retire_mutex);
+   ctx->detached = true;
+   mtx_unlock(&ctx->retire_mutex);
 }
 
 void
 vkr_context_destroy(struct vkr_context *ctx)
 {
-   /* TODO Move the entire teardown process to a separate thread so that the main thread
-    * cannot get blocked by the vkDeviceWaitIdle upon device destruction.
-    */
-   list_for_each_entry_safe (struct vkr_ring, ring, &ctx->rings, head) {
-      vkr_ring_stop(ring);
-      vkr_ring_destroy(ring);
-   }
+   vkr_context_detach(ctx);
    mtx_destroy(&ctx->ring_mutex);
 
    vkr_context_wait_ring_fini(ctx);
 
-   if (ctx->ring_monitor.started)
-      vkr_context_ring_monitor_fini(ctx);
-
    if (ctx->instance) {
       vkr_log("destroying context %d (%s) with a valid instance", ctx->ctx_id,
               vkr_context_get_name(ctx));
@@ -625,45 +585,29 @@ vkr_context_destroy(struct vkr_context *ctx)
       vkr_instance_destroy(ctx, ctx->instance, false);
    }
 
-   _mesa_hash_table_destroy(ctx->resource_table, vkr_context_free_resource);
+   vkr_context_destroy_resource_table(ctx);
    mtx_destroy(&ctx->resource_mutex);
 
-   _mesa_hash_table_destroy(ctx->object_table, vkr_context_free_object);
-   mtx_destroy(&ctx->object_mutex);
-
    vkr_cs_encoder_fini(&ctx->encoder);
    vkr_cs_decoder_fini(&ctx->decoder);
 
+   vkr_object_table_fini(&ctx->object_table);
+   virgl_flight_recorder_destroy(ctx->flight_recorder);
+
    vkr_library_unload(&ctx->vulkan_library);
 
+   mtx_destroy(&ctx->retire_mutex);
    free(ctx->debug_name);
    free(ctx);
 }
 
-static uint32_t
-vkr_hash_u64(const void *key)
-{
-   return XXH32(key, sizeof(uint64_t), 0);
-}
-
-static bool
-vkr_key_u64_equal(const void *key1, const void *key2)
-{
-   return *(const uint64_t *)key1 == *(const uint64_t *)key2;
-}
-
-void
-vkr_context_free_object(struct hash_entry *entry)
-{
-   struct vkr_object *obj = entry->data;
-   free(obj);
-}
 
 struct vkr_context *
 vkr_context_create(uint32_t ctx_id,
                    vkr_renderer_retire_fence_callback_type cb,
                    size_t debug_len,
-                   const char *debug_name)
+                   const char *debug_name,
+                   bool on_worker_thread)
 {
    struct vkr_context *ctx = calloc(1, sizeof(*ctx));
    if (!ctx)
@@ -689,28 +633,24 @@ vkr_context_create(uint32_t ctx_id,
    if (VKR_DEBUG(VALIDATE))
       ctx->validate_level = VKR_CONTEXT_VALIDATE_FULL;
 
-#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
-   ctx->on_worker_thread = true;
-#else
-   ctx->on_worker_thread = false;
-#endif
+   ctx->on_worker_thread = on_worker_thread;
+
+   if (mtx_init(&ctx->retire_mutex, mtx_plain) != thrd_success)
+      goto err_ctx_retire_mutex;
 
    if (!vkr_context_wait_ring_init(ctx))
       goto err_ctx_wait_ring_init;
 
-   if (mtx_init(&ctx->object_mutex, mtx_plain) != thrd_success)
-      goto err_ctx_object_mutex;
-
-   ctx->object_table = _mesa_hash_table_create(NULL, vkr_hash_u64, vkr_key_u64_equal);
-   if (!ctx->object_table)
+   if (!vkr_object_table_init(&ctx->object_table))
       goto err_ctx_object_table;
 
+   virgl_memory_budget_init(&ctx->memory_budget);
+   ctx->flight_recorder = virgl_flight_recorder_create();
+
    if (mtx_init(&ctx->resource_mutex, mtx_plain) != thrd_success)
       goto err_ctx_resource_mutex;
 
-   ctx->resource_table =
-      _mesa_hash_table_create(NULL, _mesa_hash_u32, _mesa_key_u32_equal);
-   if (!ctx->resource_table)
+   if (!virgl_id_table_init(&ctx->resource_table))
       goto err_ctx_resource_table;
 
    if (vkr_cs_decoder_init(&ctx->decoder, ctx))
@@ -734,16 +674,17 @@ err_ctx_ring_mutex:
 err_cs_encoder_init:
    vkr_cs_decoder_fini(&ctx->decoder);
 err_cs_decoder_init:
-   _mesa_hash_table_destroy(ctx->resource_table, vkr_context_free_resource);
+   vkr_context_destroy_resource_table(ctx);
 err_ctx_resource_table:
    mtx_destroy(&ctx->resource_mutex);
 err_ctx_resource_mutex:
-   _mesa_hash_table_destroy(ctx->object_table, vkr_context_free_object);
+   vkr_object_table_fini(&ctx->object_table);
 err_ctx_object_table:
-   mtx_destroy(&ctx->object_mutex);
-err_ctx_object_mutex:
+   virgl_flight_recorder_destroy(ctx->flight_recorder);
    vkr_context_wait_ring_fini(ctx);
 err_ctx_wait_ring_init:
+   mtx_destroy(&ctx->retire_mutex);
+err_ctx_retire_mutex:
    free(ctx->debug_name);
 err_debug_name:
    free(ctx);
@@ -11,6 +11,8 @@
 
 #include "venus-protocol/vn_protocol_renderer_defines.h"
 #include "venus-protocol/vn_protocol_renderer_util.h"
+#include "virgl_id_table.h"
+#include "virgl_memory_budget.h"
 #include "virgl_resource.h"
 
 #include "vkr_cs.h"
@@ -46,12 +48,16 @@ enum vkr_context_validate_level {
 struct vkr_context {
    uint32_t ctx_id;
    vkr_renderer_retire_fence_callback_type retire_fence;
+   /* serializes the retire_fence calls with vkr_context_detach */
+   mtx_t retire_mutex;
+   /* set by vkr_context_detach, the fences are no longer retired */
+   bool detached;
 
    char *debug_name;
    enum vkr_context_validate_level validate_level;
    bool validate_fatal;
 
-   /* true if ENABLE_RENDER_SERVER_WORKER_THREAD is defined */
+   /* true if VKR_RENDERER_WORKER_THREAD is set */
    bool on_worker_thread;
 
    mtx_t ring_mutex;
@@ -60,7 +66,11 @@ struct vkr_context {
    struct {
       mtx_t mutex;
       cnd_t cond;
-      uint64_t id;
+      /* the ring being waited on, or 0.  It is only set with the mutex held,
+       * but the ring threads check it without the mutex, so that they only
+       * take the mutex when their ring is waited on.
+       */
+      atomic_uint_least64_t id;
       /* This represents the ring head position to be waited on. The protocol supports
        * 64bit seqno and we only use 32bit internally because the delta between the ring
        * head and ring current will never exceed the ring size, which is far smaller than
@@ -69,24 +79,30 @@ struct vkr_context {
       uint32_t seqno;
    } wait_ring;
 
+   /* When monitoring multiple rings, all rings are reported at the minimum of
+    * per-ring maxReportingPeriodMicroseconds to ensure that every ring is marked
+    * ALIVE before the next renderer check.  See vkr_ring_monitor.h.
+    */
    struct {
-      mtx_t mutex;
-      cnd_t cond;
-      thrd_t thread;
-      atomic_bool started;
-
-      /* When monitoring multiple rings, wake to report on all rings at the minimum of
-       * per-ring maxReportingPeriodMicroseconds to ensure that every ring is marked ALIVE
-       * before the next renderer check.
-       */
-      atomic_uint report_period_us;
+      /* the group of the reporting period, or NULL when not monitored */
+      struct vkr_ring_monitor_group *group;
+      struct list_head head;
    } ring_monitor;
 
-   mtx_t object_mutex;
-   struct hash_table *object_table;
+   struct vkr_object_table object_table;
+
+   /* the size of the device memories allocated by the context */
+   struct virgl_memory_budget memory_budget;
+   /* the size of the memory bound to the sparse resources, see vkr_sparse.h */
+   atomic_uint_least64_t sparse_committed_size;
+   /* bumped when the recordings cached by vkr_record_cache may be stale */
+   atomic_uint_least64_t record_cache_epoch;
+
+   /* the last commands decoded by the context and its rings, or NULL */
+   struct virgl_flight_recorder *flight_recorder;
 
    mtx_t resource_mutex;
-   struct hash_table *resource_table;
+   struct virgl_id_table resource_table;
 
    bool cs_fatal_error;
    struct vkr_cs_encoder encoder;
@@ -109,13 +125,21 @@ struct vkr_context *
 vkr_context_create(uint32_t ctx_id,
                    vkr_renderer_retire_fence_callback_type cb,
                    size_t debug_len,
-                   const char *debug_name);
+                   const char *debug_name,
+                   bool on_worker_thread);
+
+/* Stops the rings and the retiring of fences, so that the rest of the
+ * teardown can happen on another thread once the context is forgotten by the
+ * renderer.  vkr_context_destroy detaches the context when still needed.
+ */
+void
+vkr_context_detach(struct vkr_context *ctx);
 
 void
 vkr_context_destroy(struct vkr_context *ctx);
 
-bool
-vkr_context_ring_monitor_init(struct vkr_context *ctx, uint32_t report_period_us);
+void
+vkr_context_retire_fence(struct vkr_context *ctx, uint32_t ring_idx, uint64_t fence_id);
 
 bool
 vkr_context_submit_fence(struct vkr_context *ctx,
@@ -126,6 +150,9 @@ vkr_context_submit_fence(struct vkr_context *ctx,
 bool
 vkr_context_submit_cmd(struct vkr_context *ctx, const void *buffer, size_t size);
 
+void
+vkr_context_get_stats(struct vkr_context *ctx, struct virgl_renderer_stats *stats);
+
 bool
 vkr_context_create_resource(struct vkr_context *ctx,
                             uint32_t res_id,
@@ -148,10 +175,10 @@ static inline struct vkr_resource *
 vkr_context_get_resource(struct vkr_context *ctx, uint32_t res_id)
 {
    mtx_lock(&ctx->resource_mutex);
-   const struct hash_entry *entry = _mesa_hash_table_search(ctx->resource_table, &res_id);
+   struct vkr_resource *res = virgl_id_table_search(&ctx->resource_table, res_id);
    mtx_unlock(&ctx->resource_mutex);
 
-   return likely(entry) ? entry->data : NULL;
+   return res;
 }
 
 static inline void
@@ -169,14 +196,14 @@ vkr_context_get_fatal(struct vkr_context *ctx)
 static inline bool
 vkr_context_validate_object_id(struct vkr_context *ctx, vkr_object_id id)
 {
-   mtx_lock(&ctx->object_mutex);
-   if (unlikely(!id || _mesa_hash_table_search(ctx->object_table, &id))) {
-      mtx_unlock(&ctx->object_mutex);
+   mtx_lock(&ctx->object_table.mutex);
+   if (unlikely(!id || vkr_object_table_search_locked(&ctx->object_table, id))) {
+      mtx_unlock(&ctx->object_table.mutex);
       vkr_log("invalid object id %" PRIu64, id);
       vkr_context_set_fatal(ctx);
       return false;
    }
-   mtx_unlock(&ctx->object_mutex);
+   mtx_unlock(&ctx->object_table.mutex);
 
    return true;
 }
@@ -194,58 +221,58 @@ vkr_context_alloc_object(UNUSED struct vkr_context *ctx,
    return vkr_object_alloc(size, type, id);
 }
 
-void
-vkr_context_free_object(struct hash_entry *entry);
-
 static inline void
 vkr_context_add_object(struct vkr_context *ctx, struct vkr_object *obj)
 {
    assert(vkr_is_recognized_object_type(obj->type));
    assert(obj->id);
 
-   mtx_lock(&ctx->object_mutex);
-   assert(!_mesa_hash_table_search(ctx->object_table, &obj->id));
-   _mesa_hash_table_insert(ctx->object_table, &obj->id, obj);
-   mtx_unlock(&ctx->object_mutex);
+   mtx_lock(&ctx->object_table.mutex);
+   const bool ok = vkr_object_table_insert_locked(&ctx->object_table, obj);
+   mtx_unlock(&ctx->object_table.mutex);
+
+   if (unlikely(!ok)) {
+      vkr_log("failed to add object %" PRIu64 " to the object table", obj->id);
+      vkr_context_set_fatal(ctx);
+   }
 }
 
 static inline void
 vkr_context_remove_object_locked(struct vkr_context *ctx, struct vkr_object *obj)
 {
-   assert(_mesa_hash_table_search(ctx->object_table, &obj->id));
+   assert(vkr_object_table_search_locked(&ctx->object_table, obj->id));
 
-   struct hash_entry *entry = _mesa_hash_table_search(ctx->object_table, &obj->id);
-   if (likely(entry)) {
-      vkr_context_free_object(entry);
-      _mesa_hash_table_remove(ctx->object_table, entry);
-   }
+   /* a cached recording can reference any object but a command buffer */
+   if (vkr_record_cache && obj->type != VK_OBJECT_TYPE_COMMAND_BUFFER)
+      atomic_fetch_add(&ctx->record_cache_epoch, 1);
+
+   free(vkr_object_table_remove_locked(&ctx->object_table, obj->id));
 }
 
 static inline void
 vkr_context_remove_object(struct vkr_context *ctx, struct vkr_object *obj)
 {
-   mtx_lock(&ctx->object_mutex);
+   mtx_lock(&ctx->object_table.mutex);
    vkr_context_remove_object_locked(ctx, obj);
-   mtx_unlock(&ctx->object_mutex);
+   mtx_unlock(&ctx->object_table.mutex);
 }
 
 static inline void
 vkr_context_remove_objects(struct vkr_context *ctx, struct list_head *objects)
 {
-   mtx_lock(&ctx->object_mutex);
+   mtx_lock(&ctx->object_table.mutex);
    list_for_each_entry_safe (struct vkr_object, obj, objects, track_head)
       vkr_context_remove_object_locked(ctx, obj);
-   mtx_unlock(&ctx->object_mutex);
+   mtx_unlock(&ctx->object_table.mutex);
    /* objects should be reinitialized if to be reused */
 }
 
 static inline void *
 vkr_context_get_object(struct vkr_context *ctx, vkr_object_id obj_id)
 {
-   mtx_lock(&ctx->object_mutex);
-   const struct hash_entry *entry = _mesa_hash_table_search(ctx->object_table, &obj_id);
-   void *obj = likely(entry) ? entry->data : NULL;
-   mtx_unlock(&ctx->object_mutex);
+   mtx_lock(&ctx->object_table.mutex);
+   void *obj = vkr_object_table_search_locked(&ctx->object_table, obj_id);
+   mtx_unlock(&ctx->object_table.mutex);
    return obj;
 }
 
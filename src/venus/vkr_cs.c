@@ -5,7 +5,24 @@
 
 #include "vkr_cs.h"
 
+#include <time.h>
+
+#include "vkr_command_buffer.h"
 #include "vkr_context.h"
+#include "vkr_dispatch.h"
+#include "vkr_queue.h"
+#include "vkr_stream_pool.h"
+
+#include "virgl_numa.h"
+
+static uint64_t
+vkr_cs_now(void)
+{
+   struct timespec now;
+   if (clock_gettime(CLOCK_MONOTONIC, &now))
+      return 0;
+   return 1000000000llu * now.tv_sec + now.tv_nsec;
+}
 
 void
 vkr_cs_encoder_set_stream_locked(struct vkr_cs_encoder *enc,
@@ -54,20 +71,41 @@ vkr_cs_decoder_init(struct vkr_cs_decoder *dec, struct vkr_context *ctx)
 {
    memset(dec, 0, sizeof(*dec));
    dec->fatal_error = &ctx->cs_fatal_error;
-   dec->object_table = ctx->object_table;
-   dec->object_mutex = &ctx->object_mutex;
-   return mtx_init(&dec->resource_mutex, mtx_plain);
+   dec->object_table = &ctx->object_table;
+   dec->flight_recorder = ctx->flight_recorder;
+   dec->init_time = vkr_cs_now();
+   if (mtx_init(&dec->resource_mutex, mtx_plain) != thrd_success)
+      return -1;
+
+   vkr_object_table_add_reader(dec->object_table, &dec->object_reader);
+   return 0;
 }
 
 void
 vkr_cs_decoder_fini(struct vkr_cs_decoder *dec)
 {
    struct vkr_cs_decoder_temp_pool *pool = &dec->temp_pool;
+
+   if (VKR_DEBUG(CS_STATS)) {
+      const uint64_t elapsed_ms = MAX2((vkr_cs_now() - dec->init_time) / 1000000, 1);
+      vkr_log("decoder temp pool: %" PRIu64 " allocations of %" PRIu64
+              " KiB in total, %.2f per second, %zu KiB kept",
+              pool->malloc_count, pool->malloc_size / 1024,
+              pool->malloc_count * 1000.0 / elapsed_ms, pool->total_size / 1024);
+   }
+
+   vkr_dispatch_fini_command_stats(dec);
+   vkr_queue_fini_sparse_binds(dec);
+   vkr_command_buffer_fini_builds(dec);
+   vkr_record_cache_fini_decoder(dec);
+   vkr_stream_pool_fini_decoder(dec);
+
    for (uint32_t i = 0; i < pool->buffer_count; i++)
       free(pool->buffers[i]);
    if (pool->buffers)
       free(pool->buffers);
 
+   vkr_object_table_remove_reader(dec->object_table, &dec->object_reader);
    mtx_destroy(&dec->resource_mutex);
 }
 
@@ -87,6 +125,8 @@ vkr_cs_decoder_set_resource_stream(struct vkr_cs_decoder *dec,
    }
 
    dec->resource = res;
+   dec->peeked.cur = NULL;
+   dec->record_capture.cmd = NULL;
    dec->cur = res->u.data + offset;
    dec->end = dec->cur + size;
    mtx_unlock(&dec->resource_mutex);
@@ -107,6 +147,40 @@ vkr_cs_decoder_sanity_check(const struct vkr_cs_decoder *dec)
    assert(dec->cur <= dec->end);
 }
 
+static size_t
+next_buffer_size(size_t cur_size, size_t min_size, size_t need)
+{
+   size_t next_size = cur_size ? cur_size * 2 : min_size;
+   while (next_size < need) {
+      next_size *= 2;
+      if (!next_size)
+         return 0;
+   }
+   return next_size;
+}
+
+static bool
+vkr_cs_decoder_realloc_temp_pool(struct vkr_cs_decoder *dec, size_t size)
+{
+   struct vkr_cs_decoder_temp_pool *pool = &dec->temp_pool;
+
+   uint8_t *buf = malloc(size);
+   if (!buf)
+      return false;
+   virgl_numa_bind_memory(buf, size);
+   pool->malloc_count++;
+   pool->malloc_size += size;
+
+   for (uint32_t i = 0; i < pool->buffer_count; i++)
+      free(pool->buffers[i]);
+
+   pool->buffers[0] = buf;
+   pool->buffer_count = 1;
+   pool->end = buf + size;
+
+   return true;
+}
+
 static void
 vkr_cs_decoder_gc_temp_pool(struct vkr_cs_decoder *dec)
 {
@@ -114,13 +188,34 @@ vkr_cs_decoder_gc_temp_pool(struct vkr_cs_decoder *dec)
    if (!pool->buffer_count)
       return;
 
-   /* free all but the last buffer */
-   if (pool->buffer_count > 1) {
-      for (uint32_t i = 0; i < pool->buffer_count - 1; i++)
-         free(pool->buffers[i]);
+   const size_t used = pool->total_size - (pool->end - pool->cur);
+   const size_t peak_size = MAX2(pool->peak_size, used);
+   pool->peak_size = 0;
 
-      pool->buffers[0] = pool->buffers[pool->buffer_count - 1];
-      pool->buffer_count = 1;
+   /* Replace the buffers by one that holds all of them, so that the next
+    * streams with the same needs do not allocate at all, or shrink the
+    * buffer after it has been mostly unused for a while.  The buffers are
+    * kept as they are if that fails.
+    */
+   if (pool->buffer_count > 1) {
+      pool->low_usage_streams = 0;
+      const size_t size = next_buffer_size(0, 4096, pool->total_size);
+      if (!size || size > VKR_CS_DECODER_TEMP_POOL_MAX_SIZE ||
+          !vkr_cs_decoder_realloc_temp_pool(dec, size)) {
+         /* free all but the last buffer */
+         for (uint32_t i = 0; i < pool->buffer_count - 1; i++)
+            free(pool->buffers[i]);
+
+         pool->buffers[0] = pool->buffers[pool->buffer_count - 1];
+         pool->buffer_count = 1;
+      }
+   } else if (peak_size < pool->total_size / 4 && pool->total_size > 4096) {
+      if (++pool->low_usage_streams >= VKR_CS_DECODER_TEMP_POOL_SHRINK_STREAMS) {
+         pool->low_usage_streams = 0;
+         vkr_cs_decoder_realloc_temp_pool(dec, next_buffer_size(0, 4096, peak_size));
+      }
+   } else {
+      pool->low_usage_streams = 0;
    }
 
    pool->reset_to = pool->buffers[0];
@@ -144,6 +239,8 @@ vkr_cs_decoder_reset(struct vkr_cs_decoder *dec)
    dec->saved_state_valid = false;
    /* no need to lock decoder here */
    dec->resource = NULL;
+   dec->peeked.cur = NULL;
+   dec->record_capture.cmd = NULL;
    dec->cur = NULL;
    dec->end = NULL;
 }
@@ -177,6 +274,8 @@ vkr_cs_decoder_restore_state(struct vkr_cs_decoder *dec)
    dec->resource = NULL;
 
    const struct vkr_cs_decoder_saved_state *saved = &dec->saved_state;
+   dec->peeked.cur = NULL;
+   dec->record_capture.cmd = NULL;
    dec->cur = saved->cur;
    dec->end = saved->end;
 
@@ -195,18 +294,6 @@ next_array_size(uint32_t cur_size, uint32_t min_size)
    return next_size > cur_size ? next_size : 0;
 }
 
-static size_t
-next_buffer_size(size_t cur_size, size_t min_size, size_t need)
-{
-   size_t next_size = cur_size ? cur_size * 2 : min_size;
-   while (next_size < need) {
-      next_size *= 2;
-      if (!next_size)
-         return 0;
-   }
-   return next_size;
-}
-
 static bool
 vkr_cs_decoder_grow_temp_pool(struct vkr_cs_decoder *dec)
 {
@@ -248,6 +335,9 @@ vkr_cs_decoder_alloc_temp_internal(struct vkr_cs_decoder *dec, size_t size)
    uint8_t *buf = malloc(buf_size);
    if (!buf)
       return false;
+   virgl_numa_bind_memory(buf, buf_size);
+   pool->malloc_count++;
+   pool->malloc_size += buf_size;
 
    pool->total_size += buf_size;
    pool->buffers[pool->buffer_count++] = buf;
@@ -8,6 +8,10 @@
 
 #include "vkr_common.h"
 
+#include "virgl_command_stats.h"
+#include "virgl_flight_recorder.h"
+#include "vkr_object_table.h"
+
 /* This is to avoid integer overflows and to catch bogus allocations (e.g.,
  * the guest driver encodes an uninitialized value).  In practice, the largest
  * allocations we've seen are from vkGetPipelineCacheData and are dozens of
@@ -15,6 +19,11 @@
  */
 #define VKR_CS_DECODER_TEMP_POOL_MAX_SIZE (1u * 1024 * 1024 * 1024)
 
+/* The temp pool shrinks to its peak usage after this many consecutive
+ * command streams used less than a quarter of it.
+ */
+#define VKR_CS_DECODER_TEMP_POOL_SHRINK_STREAMS 256
+
 struct vkr_cs_encoder {
    bool *fatal_error;
 
@@ -58,11 +67,31 @@ struct vkr_cs_decoder_temp_pool {
 
    uint8_t *cur;
    const uint8_t *end;
+
+   /* the most memory a command of the current stream used */
+   size_t peak_size;
+   /* consecutive streams that used less than a quarter of the pool */
+   uint32_t low_usage_streams;
+
+   /* statistics */
+   uint64_t malloc_count;
+   uint64_t malloc_size;
 };
 
+/* the last object looked up, per object type */
+struct vkr_cs_decoder_object_cache {
+   vkr_object_id id;
+   VkObjectType type;
+   uint64_t generation;
+   struct vkr_object *obj;
+};
+
+#define VKR_CS_DECODER_OBJECT_CACHE_SIZE 16
+
 struct vkr_cs_decoder {
-   const struct hash_table *object_table;
-   mtx_t *object_mutex;
+   struct vkr_object_table *object_table;
+   struct vkr_object_table_reader object_reader;
+   struct vkr_cs_decoder_object_cache object_cache[VKR_CS_DECODER_OBJECT_CACHE_SIZE];
 
    bool *fatal_error;
    struct vkr_cs_decoder_temp_pool temp_pool;
@@ -78,6 +107,51 @@ struct vkr_cs_decoder {
    mtx_t resource_mutex;
    const struct vkr_resource *resource;
 
+   /* CLOCK_MONOTONIC time of vkr_cs_decoder_init, for the statistics */
+   uint64_t init_time;
+   /* indexed by command type, allocated on first use with VKR_DEBUG(CMD_STATS) */
+   struct virgl_command_stats *command_stats;
+   /* shared by the decoders of the context, not owned */
+   struct virgl_flight_recorder *flight_recorder;
+
+   /* see vkr_queue_flush_sparse_binds */
+   struct vkr_queue_sparse_binds *sparse_binds;
+   /* whether the vkQueueBindSparse being dispatched expects a reply */
+   bool sparse_bind_reply;
+   /* see vkr_command_buffer_flush_builds */
+   struct vkr_command_buffer_builds *as_builds;
+
+   /* the decoders of the pool threads, see vkr_stream_pool_execute */
+   struct vkr_cs_decoder *stream_helpers;
+   uint32_t stream_helper_count;
+
+   /* the recording being captured for vkr_record_cache */
+   struct {
+      /* NULL when nothing is captured */
+      struct vkr_command_buffer *cmd;
+      /* where the command being dispatched starts in the stream */
+      const uint8_t *command;
+      /* the commands dispatched so far, copied as each is dispatched because
+       * the stream can be handed back to the guest before the recording ends
+       */
+      uint8_t *data;
+      size_t size;
+      size_t capacity;
+      uint64_t epoch;
+      /* whether the command being dispatched is its vkEndCommandBuffer */
+      bool end;
+   } record_capture;
+
+   /* The stream may be shared with the guest, which can modify it while it
+    * is decoded.  A value that is peeked is kept here so that reading it
+    * right after returns what was peeked.
+    */
+   struct {
+      const uint8_t *cur;
+      size_t size;
+      uint8_t data[8];
+   } peeked;
+
    const uint8_t *cur;
    const uint8_t *end;
 };
@@ -197,6 +271,34 @@ vkr_cs_encoder_write(struct vkr_cs_encoder *enc,
    enc->cur += size;
 }
 
+/* Reserves size bytes of the reply stream, for a reply that is known in full
+ * before it is written.  The stream is checked once, and stays locked until
+ * vkr_cs_encoder_commit, which saves the acquire and release of the stream
+ * and the checks of the writes.  Returns NULL, with the encoder fatal, when
+ * the stream is unset or too small.
+ */
+static inline void *
+vkr_cs_encoder_reserve(struct vkr_cs_encoder *enc, size_t size)
+{
+   mtx_lock(&enc->mutex);
+   if (unlikely(!enc->stream.resource || size > (size_t)(enc->end - enc->cur))) {
+      vkr_log("failed to reserve the reply stream");
+      vkr_cs_encoder_set_fatal(enc);
+      mtx_unlock(&enc->mutex);
+      return NULL;
+   }
+
+   return enc->cur;
+}
+
+/* commits the reservation of vkr_cs_encoder_reserve */
+static inline void
+vkr_cs_encoder_commit(struct vkr_cs_encoder *enc, size_t size)
+{
+   enc->cur += size;
+   mtx_unlock(&enc->mutex);
+}
+
 int
 vkr_cs_decoder_init(struct vkr_cs_decoder *dec, struct vkr_context *ctx);
 
@@ -223,6 +325,8 @@ vkr_cs_decoder_set_buffer_stream(struct vkr_cs_decoder *dec,
                                  const void *data,
                                  size_t size)
 {
+   dec->peeked.cur = NULL;
+   dec->record_capture.cmd = NULL;
    dec->cur = data;
    dec->end = dec->cur + size;
 }
@@ -285,21 +389,36 @@ vkr_cs_decoder_peek_internal(const struct vkr_cs_decoder *dec,
 static inline void
 vkr_cs_decoder_read(struct vkr_cs_decoder *dec, size_t size, void *val, size_t val_size)
 {
+   if (unlikely(dec->peeked.cur == dec->cur)) {
+      dec->peeked.cur = NULL;
+      if (dec->peeked.size == size && val_size <= size) {
+         memcpy(val, dec->peeked.data, val_size);
+         dec->cur += size;
+         return;
+      }
+   }
+
    if (vkr_cs_decoder_peek_internal(dec, size, val, val_size))
       dec->cur += size;
 }
 
 static inline void
-vkr_cs_decoder_peek(const struct vkr_cs_decoder *dec,
-                    size_t size,
-                    void *val,
-                    size_t val_size)
+vkr_cs_decoder_peek(struct vkr_cs_decoder *dec, size_t size, void *val, size_t val_size)
 {
-   vkr_cs_decoder_peek_internal(dec, size, val, val_size);
+   if (size > sizeof(dec->peeked.data)) {
+      vkr_cs_decoder_peek_internal(dec, size, val, val_size);
+      return;
+   }
+
+   if (vkr_cs_decoder_peek_internal(dec, size, dec->peeked.data, size)) {
+      dec->peeked.cur = dec->cur;
+      dec->peeked.size = size;
+   }
+   memcpy(val, dec->peeked.data, val_size);
 }
 
 static inline struct vkr_object *
-vkr_cs_decoder_lookup_object(const struct vkr_cs_decoder *dec,
+vkr_cs_decoder_lookup_object(struct vkr_cs_decoder *dec,
                              vkr_object_id id,
                              VkObjectType type)
 {
@@ -308,19 +427,30 @@ vkr_cs_decoder_lookup_object(const struct vkr_cs_decoder *dec,
    if (!id)
       return NULL;
 
-   mtx_lock(dec->object_mutex);
-   const struct hash_entry *entry =
-      _mesa_hash_table_search((struct hash_table *)dec->object_table, &id);
-   obj = likely(entry) ? entry->data : NULL;
-   mtx_unlock(dec->object_mutex);
+   /* command buffer decoding looks the same few objects up over and over,
+    * remember the last one of each type until an object is removed
+    */
+   struct vkr_cs_decoder_object_cache *cache =
+      &dec->object_cache[(uint32_t)type % VKR_CS_DECODER_OBJECT_CACHE_SIZE];
+   const uint64_t generation = vkr_object_table_generation(dec->object_table);
+   if (cache->id == id && cache->type == type && cache->generation == generation)
+      return cache->obj;
+
+   obj = vkr_object_table_lookup(dec->object_table, &dec->object_reader, id);
    if (unlikely(!obj || obj->type != type)) {
       if (obj)
          vkr_log("object %" PRIu64 " has type %d, not %d", id, obj->type, type);
       else
          vkr_log("failed to look up object %" PRIu64 " of type %d", id, type);
       vkr_cs_decoder_set_fatal(dec);
+      return obj;
    }
 
+   cache->id = id;
+   cache->type = type;
+   cache->generation = generation;
+   cache->obj = obj;
+
    return obj;
 }
 
@@ -328,6 +458,9 @@ static inline void
 vkr_cs_decoder_reset_temp_pool(struct vkr_cs_decoder *dec)
 {
    struct vkr_cs_decoder_temp_pool *pool = &dec->temp_pool;
+   const size_t used = pool->total_size - (pool->end - pool->cur);
+   if (used > pool->peak_size)
+      pool->peak_size = used;
    pool->cur = pool->reset_to;
 }
 
@@ -6,6 +6,9 @@
 #include "vkr_descriptor_set.h"
 
 #include "vkr_descriptor_set_gen.h"
+#include "vkr_image.h"
+#include "vkr_record_cache.h"
+#include "vkr_shared_object.h"
 
 static void
 vkr_dispatch_vkGetDescriptorSetLayoutSupport(
@@ -19,12 +22,98 @@ vkr_dispatch_vkGetDescriptorSetLayoutSupport(
    vk->GetDescriptorSetLayoutSupport(args->device, args->pCreateInfo, args->pSupport);
 }
 
+/* Layouts are only shared with no chained struct but the binding flags, and
+ * with immutable samplers that are either shared or keyed by their ids.
+ */
+static bool
+vkr_descriptor_set_layout_init_key(struct vkr_shared_key *key,
+                                   const VkDescriptorSetLayoutCreateInfo *info)
+{
+   const VkDescriptorSetLayoutBindingFlagsCreateInfo *binding_flags = info->pNext;
+
+   memset(key, 0, sizeof(*key));
+   if (binding_flags &&
+       (binding_flags->sType !=
+           VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO ||
+        binding_flags->pNext))
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD(key, info->flags);
+
+   VKR_SHARED_KEY_ADD(key, info->bindingCount);
+   for (uint32_t i = 0; i < info->bindingCount; i++) {
+      const VkDescriptorSetLayoutBinding *binding = &info->pBindings[i];
+      VKR_SHARED_KEY_ADD_MEMBERS(key, VkDescriptorSetLayoutBinding, binding, binding,
+                                 stageFlags);
+
+      /* pImmutableSamplers is ignored for the other types */
+      const bool immutable =
+         binding->pImmutableSamplers &&
+         (binding->descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER ||
+          binding->descriptorType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+      VKR_SHARED_KEY_ADD(key, immutable);
+      if (!immutable)
+         continue;
+
+      for (uint32_t j = 0; j < binding->descriptorCount; j++) {
+         const struct vkr_sampler *sampler =
+            vkr_sampler_from_handle(binding->pImmutableSamplers[j]);
+         if (!sampler)
+            return false;
+         vkr_shared_key_add_ref(key, &sampler->base);
+      }
+   }
+
+   const bool has_binding_flags = binding_flags;
+   VKR_SHARED_KEY_ADD(key, has_binding_flags);
+   if (has_binding_flags) {
+      VKR_SHARED_KEY_ADD_ARRAY(key, binding_flags->bindingCount,
+                               binding_flags->pBindingFlags);
+   }
+
+   return !key->failed;
+}
+
 static void
 vkr_dispatch_vkCreateDescriptorSetLayout(
    struct vn_dispatch_context *dispatch,
    struct vn_command_vkCreateDescriptorSetLayout *args)
 {
-   vkr_descriptor_set_layout_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   struct vkr_shared_key key = { 0 };
+   if (!dev->shared_objects ||
+       !vkr_descriptor_set_layout_init_key(&key, args->pCreateInfo)) {
+      vkr_shared_key_fini(&key);
+      vkr_descriptor_set_layout_create_and_add(ctx, args);
+      return;
+   }
+
+   struct vkr_descriptor_set_layout *layout = vkr_context_alloc_object(
+      ctx, sizeof(*layout), VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, args->pSetLayout);
+   if (!layout) {
+      vkr_shared_key_fini(&key);
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   layout->shared = vkr_shared_object_get(dev, &key);
+   if (layout->shared) {
+      layout->base.handle.u64 = layout->shared->handle;
+      args->ret = VK_SUCCESS;
+   } else if (vkr_descriptor_set_layout_create_driver_handle(ctx, args, layout) ==
+              VK_SUCCESS) {
+      layout->shared = vkr_shared_object_add(dev, &key, layout->base.handle.u64);
+   } else {
+      vkr_shared_key_fini(&key);
+      free(layout);
+      return;
+   }
+   vkr_shared_key_fini(&key);
+
+   vkr_device_add_object(ctx, dev, &layout->base);
 }
 
 static void
@@ -32,7 +121,16 @@ vkr_dispatch_vkDestroyDescriptorSetLayout(
    struct vn_dispatch_context *dispatch,
    struct vn_command_vkDestroyDescriptorSetLayout *args)
 {
-   vkr_descriptor_set_layout_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_descriptor_set_layout *layout =
+      vkr_descriptor_set_layout_from_handle(args->descriptorSetLayout);
+   if (layout && !vkr_shared_object_release(dev, &layout->base)) {
+      vkr_device_remove_object(ctx, dev, &layout->base);
+      return;
+   }
+
+   vkr_descriptor_set_layout_destroy_and_remove(ctx, args);
 }
 
 static void
@@ -133,24 +231,122 @@ vkr_dispatch_vkFreeDescriptorSets(struct vn_dispatch_context *dispatch,
 }
 
 static void
-vkr_dispatch_vkUpdateDescriptorSets(UNUSED struct vn_dispatch_context *dispatch,
+vkr_dispatch_vkUpdateDescriptorSets(struct vn_dispatch_context *dispatch,
                                     struct vn_command_vkUpdateDescriptorSets *args)
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   vkr_record_cache_invalidate(dispatch->data);
+
    vn_replace_vkUpdateDescriptorSets_args_handle(args);
    vk->UpdateDescriptorSets(args->device, args->descriptorWriteCount,
                             args->pDescriptorWrites, args->descriptorCopyCount,
                             args->pDescriptorCopies);
 }
 
+static size_t
+vkr_descriptor_update_template_get_element_size(VkDescriptorType type)
+{
+   switch (type) {
+   case VK_DESCRIPTOR_TYPE_SAMPLER:
+   case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+   case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+   case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+   case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+      return sizeof(VkDescriptorImageInfo);
+   case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+   case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+      return sizeof(VkBufferView);
+   case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+   case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+   case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+   case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+      return sizeof(VkDescriptorBufferInfo);
+   case VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR:
+      return sizeof(VkAccelerationStructureKHR);
+   case VK_DESCRIPTOR_TYPE_INLINE_UNIFORM_BLOCK:
+      /* the count is in bytes */
+      return 1;
+   default:
+      return 0;
+   }
+}
+
+static void
+vkr_descriptor_update_template_init_entries(
+   struct vkr_descriptor_update_template *tmpl,
+   const VkDescriptorUpdateTemplateCreateInfo *create_info)
+{
+   tmpl->data_supported = true;
+   tmpl->data_size = 0;
+   tmpl->entry_count = create_info->descriptorUpdateEntryCount;
+
+   for (uint32_t i = 0; i < create_info->descriptorUpdateEntryCount; i++) {
+      const VkDescriptorUpdateTemplateEntry *entry =
+         &create_info->pDescriptorUpdateEntries[i];
+
+      tmpl->entries[i] = (struct vkr_descriptor_update_template_entry){
+         .type = entry->descriptorType,
+         .count = entry->descriptorCount,
+         .offset = entry->offset,
+         .stride = entry->stride,
+      };
+
+      const size_t elem_size =
+         vkr_descriptor_update_template_get_element_size(entry->descriptorType);
+      if (!elem_size) {
+         tmpl->data_supported = false;
+         continue;
+      }
+      if (!entry->descriptorCount)
+         continue;
+
+      /* an inline uniform block is a single element of count bytes */
+      const bool inline_block =
+         entry->descriptorType == VK_DESCRIPTOR_TYPE_INLINE_UNIFORM_BLOCK;
+      const uint64_t end =
+         inline_block ? (uint64_t)entry->offset + entry->descriptorCount
+                      : (uint64_t)entry->offset +
+                           (uint64_t)(entry->descriptorCount - 1) * entry->stride +
+                           elem_size;
+      if (end > SIZE_MAX) {
+         tmpl->data_supported = false;
+         continue;
+      }
+      tmpl->data_size = MAX2(tmpl->data_size, (size_t)end);
+   }
+}
+
 static void
 vkr_dispatch_vkCreateDescriptorUpdateTemplate(
    struct vn_dispatch_context *dispatch,
    struct vn_command_vkCreateDescriptorUpdateTemplate *args)
 {
-   vkr_descriptor_update_template_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   const VkDescriptorUpdateTemplateCreateInfo *create_info = args->pCreateInfo;
+
+   /* the entries are kept, to find the handles in the data of the updates */
+   struct vkr_descriptor_update_template *tmpl = vkr_context_alloc_object(
+      ctx,
+      sizeof(*tmpl) +
+         sizeof(*tmpl->entries) * create_info->descriptorUpdateEntryCount,
+      VK_OBJECT_TYPE_DESCRIPTOR_UPDATE_TEMPLATE, args->pDescriptorUpdateTemplate);
+   if (!tmpl) {
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   vkr_descriptor_update_template_init_entries(tmpl, create_info);
+
+   if (vkr_descriptor_update_template_create_driver_handle(ctx, args, tmpl) !=
+       VK_SUCCESS) {
+      free(tmpl);
+      return;
+   }
+
+   vkr_device_add_object(ctx, dev, &tmpl->base);
 }
 
 static void
@@ -161,6 +357,149 @@ vkr_dispatch_vkDestroyDescriptorUpdateTemplate(
    vkr_descriptor_update_template_destroy_and_remove(dispatch->data, args);
 }
 
+static void
+vkr_dispatch_vkUpdateDescriptorSetWithTemplate(
+   struct vn_dispatch_context *dispatch,
+   struct vn_command_vkUpdateDescriptorSetWithTemplate *args)
+{
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   vkr_record_cache_invalidate(dispatch->data);
+
+   /* the handles in pData are replaced by the decoder */
+   vn_replace_VkDevice_handle(&args->device);
+   vn_replace_VkDescriptorSet_handle(&args->descriptorSet);
+   vn_replace_VkDescriptorUpdateTemplate_handle(&args->descriptorUpdateTemplate);
+   vk->UpdateDescriptorSetWithTemplate(args->device, args->descriptorSet,
+                                       args->descriptorUpdateTemplate, args->pData);
+}
+
+static inline bool
+vkr_descriptor_update_template_replace_id(struct vkr_cs_decoder *dec,
+                                          uint8_t *data,
+                                          VkObjectType type)
+{
+   uint64_t id;
+   memcpy(&id, data, sizeof(id));
+
+   const struct vkr_object *obj = vkr_cs_decoder_lookup_object(dec, id, type);
+   if (vkr_cs_decoder_get_fatal(dec))
+      return false;
+
+   const uint64_t handle = obj ? obj->handle.u64 : 0;
+   memcpy(data, &handle, sizeof(handle));
+   return true;
+}
+
+static bool
+vkr_descriptor_update_template_replace_ids(
+   struct vkr_cs_decoder *dec,
+   const struct vkr_descriptor_update_template *tmpl,
+   uint8_t *data)
+{
+   for (uint32_t i = 0; i < tmpl->entry_count; i++) {
+      const struct vkr_descriptor_update_template_entry *entry = &tmpl->entries[i];
+      if (entry->type == VK_DESCRIPTOR_TYPE_INLINE_UNIFORM_BLOCK)
+         continue;
+
+      for (uint32_t j = 0; j < entry->count; j++) {
+         uint8_t *elem = data + entry->offset + entry->stride * j;
+         bool ok = true;
+
+         switch (entry->type) {
+         case VK_DESCRIPTOR_TYPE_SAMPLER:
+            memset(elem + offsetof(VkDescriptorImageInfo, imageView), 0,
+                   sizeof(VkImageView));
+            ok = vkr_descriptor_update_template_replace_id(
+               dec, elem + offsetof(VkDescriptorImageInfo, sampler),
+               VK_OBJECT_TYPE_SAMPLER);
+            break;
+         case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+            ok = vkr_descriptor_update_template_replace_id(
+                    dec, elem + offsetof(VkDescriptorImageInfo, sampler),
+                    VK_OBJECT_TYPE_SAMPLER) &&
+                 vkr_descriptor_update_template_replace_id(
+                    dec, elem + offsetof(VkDescriptorImageInfo, imageView),
+                    VK_OBJECT_TYPE_IMAGE_VIEW);
+            break;
+         case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+         case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+         case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+            memset(elem + offsetof(VkDescriptorImageInfo, sampler), 0, sizeof(VkSampler));
+            ok = vkr_descriptor_update_template_replace_id(
+               dec, elem + offsetof(VkDescriptorImageInfo, imageView),
+               VK_OBJECT_TYPE_IMAGE_VIEW);
+            break;
+         case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+         case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+            ok = vkr_descriptor_update_template_replace_id(dec, elem,
+                                                           VK_OBJECT_TYPE_BUFFER_VIEW);
+            break;
+         case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+         case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+         case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+         case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+            ok = vkr_descriptor_update_template_replace_id(
+               dec, elem + offsetof(VkDescriptorBufferInfo, buffer),
+               VK_OBJECT_TYPE_BUFFER);
+            break;
+         case VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR:
+            ok = vkr_descriptor_update_template_replace_id(
+               dec, elem, VK_OBJECT_TYPE_ACCELERATION_STRUCTURE_KHR);
+            break;
+         default:
+            UNREACHABLE("unsupported descriptor type");
+         }
+
+         if (!ok)
+            return false;
+      }
+   }
+
+   return true;
+}
+
+void
+vkr_decode_vkUpdateDescriptorSetWithTemplate_args_temp(
+   struct vn_cs_decoder *dec, struct vn_command_vkUpdateDescriptorSetWithTemplate *args)
+{
+   vn_decode_VkDevice_lookup(dec, &args->device);
+   vn_decode_VkDescriptorSet_lookup(dec, &args->descriptorSet);
+   vn_decode_VkDescriptorUpdateTemplate_lookup(dec, &args->descriptorUpdateTemplate);
+   args->pData = NULL;
+   if (vn_cs_decoder_get_fatal(dec))
+      return;
+
+   const struct vkr_descriptor_update_template *tmpl =
+      vkr_descriptor_update_template_from_handle(args->descriptorUpdateTemplate);
+   if (!args->descriptorSet || !tmpl || !tmpl->data_supported) {
+      vn_cs_decoder_set_fatal(dec);
+      return;
+   }
+
+   const uint64_t size = vn_decode_array_size_unchecked(dec);
+   if (size < tmpl->data_size || size > SIZE_MAX) {
+      vkr_log("descriptor update data of %" PRIu64 " bytes, template needs %zu", size,
+              tmpl->data_size);
+      vn_cs_decoder_set_fatal(dec);
+      return;
+   }
+
+   uint8_t *data = vn_cs_decoder_get_blob_storage(dec, size);
+   if (!data)
+      return;
+   vn_decode_blob_array(dec, data, size);
+   if (vn_cs_decoder_get_fatal(dec))
+      return;
+
+   if (!vkr_descriptor_update_template_replace_ids((struct vkr_cs_decoder *)dec, tmpl,
+                                                    data))
+      return;
+
+   args->pData = data;
+}
+
 void
 vkr_context_init_descriptor_set_layout_dispatch(struct vkr_context *ctx)
 {
@@ -203,5 +542,6 @@ vkr_context_init_descriptor_update_template_dispatch(struct vkr_context *ctx)
       vkr_dispatch_vkCreateDescriptorUpdateTemplate;
    dispatch->dispatch_vkDestroyDescriptorUpdateTemplate =
       vkr_dispatch_vkDestroyDescriptorUpdateTemplate;
-   dispatch->dispatch_vkUpdateDescriptorSetWithTemplate = NULL;
+   dispatch->dispatch_vkUpdateDescriptorSetWithTemplate =
+      vkr_dispatch_vkUpdateDescriptorSetWithTemplate;
 }
@@ -12,6 +12,9 @@
 
 struct vkr_descriptor_set_layout {
    struct vkr_object base;
+
+   /* NULL when the driver layout is not shared, see vkr_shared_object.h */
+   struct vkr_shared_object *shared;
 };
 VKR_DEFINE_OBJECT_CAST(descriptor_set_layout,
                        VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
@@ -33,8 +36,23 @@ struct vkr_descriptor_set {
 };
 VKR_DEFINE_OBJECT_CAST(descriptor_set, VK_OBJECT_TYPE_DESCRIPTOR_SET, VkDescriptorSet)
 
+struct vkr_descriptor_update_template_entry {
+   VkDescriptorType type;
+   uint32_t count;
+   size_t offset;
+   size_t stride;
+};
+
 struct vkr_descriptor_update_template {
    struct vkr_object base;
+
+   /* false when an entry has a descriptor type whose data is not known */
+   bool data_supported;
+   /* the minimum size of the data of an update */
+   size_t data_size;
+
+   uint32_t entry_count;
+   struct vkr_descriptor_update_template_entry entries[];
 };
 VKR_DEFINE_OBJECT_CAST(descriptor_update_template,
                        VK_OBJECT_TYPE_DESCRIPTOR_UPDATE_TEMPLATE,
@@ -52,6 +70,16 @@ vkr_context_init_descriptor_set_dispatch(struct vkr_context *ctx);
 void
 vkr_context_init_descriptor_update_template_dispatch(struct vkr_context *ctx);
 
+/* vkUpdateDescriptorSetWithTemplate is not in the generated decoder.  After the
+ * device, the descriptor set and the template, the command carries pData as an
+ * array of bytes: a uint64_t size, then the bytes padded to 4.  The data is laid
+ * out as the template entries say, with object ids in place of the handles.
+ * The decoder replaces the ids with the driver handles in a copy of the data.
+ */
+void
+vkr_decode_vkUpdateDescriptorSetWithTemplate_args_temp(
+   struct vn_cs_decoder *dec, struct vn_command_vkUpdateDescriptorSetWithTemplate *args);
+
 static inline void
 vkr_descriptor_pool_release(struct vkr_context *ctx, struct vkr_descriptor_pool *pool)
 {
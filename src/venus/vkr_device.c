@@ -7,12 +7,19 @@
 
 #include "venus-protocol/vn_protocol_renderer_device.h"
 
+#include "vkr_buffer.h"
 #include "vkr_command_buffer.h"
 #include "vkr_context.h"
 #include "vkr_descriptor_set.h"
 #include "vkr_device_memory.h"
+#include "vkr_image.h"
+#include "vkr_memory_requirements.h"
 #include "vkr_physical_device.h"
+#include "vkr_pipeline.h"
+#include "vkr_query_pool.h"
 #include "vkr_queue.h"
+#include "vkr_shared_object.h"
+#include "vkr_sparse.h"
 
 static VkResult
 vkr_device_create_queues(struct vkr_context *ctx,
@@ -73,8 +80,33 @@ vkr_device_init_proc_table(struct vkr_device *dev,
    struct vn_info_extension_table ext_table;
    vkr_extension_table_init(&ext_table, exts, count);
 
+   if (vkr_physical_device_load_device_proc_table(dev->physical_device,
+                                                  dev->base.handle.device, api_version,
+                                                  &ext_table, &dev->proc_table))
+      return;
+
    vn_util_init_device_proc_table(dev->base.handle.device, vk->GetDeviceProcAddr,
                                   api_version, &ext_table, &dev->proc_table);
+   vkr_physical_device_store_device_proc_table(dev->physical_device, api_version,
+                                               &ext_table, &dev->proc_table);
+}
+
+static bool
+vkr_device_has_timeline_semaphore(const struct vkr_device *dev,
+                                  const VkDeviceCreateInfo *create_info)
+{
+   const struct vn_device_proc_table *vk = &dev->proc_table;
+   if (!vk->WaitSemaphores || !vk->GetSemaphoreCounterValue || !vk->SignalSemaphore)
+      return false;
+
+   const VkPhysicalDeviceVulkan12Features *features12 = vkr_find_struct(
+      create_info->pNext, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES);
+   if (features12)
+      return features12->timelineSemaphore;
+
+   const VkPhysicalDeviceTimelineSemaphoreFeatures *timeline_features = vkr_find_struct(
+      create_info->pNext, VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES);
+   return timeline_features && timeline_features->timelineSemaphore;
 }
 
 static void
@@ -257,10 +289,18 @@ vkr_dispatch_vkCreateDevice(struct vn_dispatch_context *dispatch,
 
    free(exts);
 
+   if (vkr_device_has_timeline_semaphore(dev, args->pCreateInfo)) {
+      /* fall back to a fence and a thread per queue */
+      dev->sync_thread = vkr_queue_sync_thread_create(ctx, dev, true);
+      dev->use_timeline_sync = dev->sync_thread != NULL;
+   }
+
    args->ret = vkr_device_create_queues(ctx, dev, args->pCreateInfo->queueCreateInfoCount,
                                         args->pCreateInfo->pQueueCreateInfos);
    if (args->ret != VK_SUCCESS) {
       struct vn_device_proc_table *vk = &dev->proc_table;
+      if (dev->sync_thread)
+         vkr_queue_sync_thread_destroy(dev->sync_thread);
       vk->DestroyDevice(dev->base.handle.device, NULL);
       free(dev);
       return;
@@ -272,6 +312,11 @@ vkr_dispatch_vkCreateDevice(struct vn_dispatch_context *dispatch,
    mtx_init(&dev->object_mutex, mtx_plain);
    list_inithead(&dev->objects);
 
+   vkr_device_init_host_pipeline_cache(dev);
+   vkr_device_init_memory_pools(dev);
+   vkr_device_init_memory_requirements_cache(dev);
+   vkr_device_init_shared_objects(dev);
+
    list_add(&dev->base.track_head, &physical_dev->devices);
 
    vkr_context_add_object(ctx, &dev->base);
@@ -287,6 +332,12 @@ vkr_device_object_destroy(struct vkr_context *ctx,
 
    assert(vkr_device_should_track_object(obj));
 
+   /* a shared driver object is destroyed with the last object */
+   if (!vkr_shared_object_release(dev, obj)) {
+      vkr_device_remove_object(ctx, dev, obj);
+      return;
+   }
+
    if (ctx->on_worker_thread) {
       switch (obj->type) {
       case VK_OBJECT_TYPE_SEMAPHORE:
@@ -296,7 +347,9 @@ vkr_device_object_destroy(struct vkr_context *ctx,
          vk->DestroyFence(device, obj->handle.fence, NULL);
          break;
       case VK_OBJECT_TYPE_DEVICE_MEMORY:
-         vk->FreeMemory(device, obj->handle.device_memory, NULL);
+         /* a suballocated memory shares the driver memory of its block */
+         if (!((struct vkr_device_memory *)obj)->block)
+            vk->FreeMemory(device, obj->handle.device_memory, NULL);
          break;
       case VK_OBJECT_TYPE_BUFFER:
          vk->DestroyBuffer(device, obj->handle.buffer, NULL);
@@ -369,7 +422,7 @@ vkr_device_object_destroy(struct vkr_context *ctx,
    /* always cleanup vkr allocs */
    switch (obj->type) {
    case VK_OBJECT_TYPE_DEVICE_MEMORY:
-      vkr_device_memory_release((struct vkr_device_memory *)obj);
+      vkr_device_memory_release(ctx, (struct vkr_device_memory *)obj);
       break;
    case VK_OBJECT_TYPE_DESCRIPTOR_POOL:
       /* Destroying VkDescriptorPool frees all VkDescriptorSet allocated inside. */
@@ -379,6 +432,15 @@ vkr_device_object_destroy(struct vkr_context *ctx,
       /* Destroying VkCommandPool frees all VkCommandBuffer allocated inside. */
       vkr_command_pool_release(ctx, (struct vkr_command_pool *)obj);
       break;
+   case VK_OBJECT_TYPE_BUFFER:
+      vkr_sparse_residency_destroy(ctx, ((struct vkr_buffer *)obj)->sparse);
+      break;
+   case VK_OBJECT_TYPE_IMAGE:
+      vkr_sparse_residency_destroy(ctx, ((struct vkr_image *)obj)->sparse);
+      break;
+   case VK_OBJECT_TYPE_QUERY_POOL:
+      vkr_query_pool_release((struct vkr_query_pool *)obj);
+      break;
    default:
       break;
    };
@@ -409,6 +471,9 @@ vkr_device_destroy(struct vkr_context *ctx, struct vkr_device *dev, bool destroy
          vkr_device_object_destroy(ctx, dev, obj);
    }
 
+   if (dev->sync_thread)
+      vkr_queue_sync_thread_destroy(dev->sync_thread);
+
    list_for_each_entry_safe (struct vkr_queue, queue, &dev->queues, base.track_head)
       vkr_queue_destroy(ctx, queue);
 
@@ -419,6 +484,11 @@ vkr_device_destroy(struct vkr_context *ctx, struct vkr_device *dev, bool destroy
 
    mtx_destroy(&dev->free_sync_mutex);
 
+   vkr_device_fini_memory_pools(dev, ctx->on_worker_thread);
+   vkr_device_fini_memory_requirements_cache(dev);
+   vkr_device_fini_shared_objects(dev);
+   vkr_device_fini_host_pipeline_cache(dev);
+
    if (destroy_vk || ctx->on_worker_thread)
       vk->DestroyDevice(device, NULL);
 
@@ -21,6 +21,39 @@ struct vkr_device {
 
    struct list_head queues;
 
+   /* queues own a timeline semaphore and syncs carry no fence */
+   bool use_timeline_sync;
+   /* retires the syncs of all queues, only with use_timeline_sync */
+   struct vkr_queue_sync_thread *sync_thread;
+
+   /* With vkr_pipeline_cache_dir, every pipeline cache of the device is seeded from
+    * and merged back into this one, which is persisted for later contexts.
+    */
+   VkPipelineCache host_pipeline_cache;
+   mtx_t host_pipeline_cache_mutex;
+
+   /* with vkr_memory_suballoc, the blocks small memories are carved out of,
+    * per memory type
+    */
+   mtx_t memory_block_mutex;
+   struct list_head memory_blocks[VK_MAX_MEMORY_TYPES];
+
+   /* udmabufs or gbm bos of freed memories that were never exported, reused
+    * by later allocations of the same size
+    */
+   mtx_t memory_backing_mutex;
+   struct list_head memory_backings;
+   uint64_t memory_backing_size;
+
+   /* see vkr_memory_requirements.h */
+   mtx_t memory_requirements_mutex;
+   struct hash_table *memory_requirements;
+
+   /* driver objects shared by identical objects, see vkr_shared_object.h */
+   mtx_t shared_object_mutex;
+   struct hash_table *shared_objects;
+   uint64_t shared_object_serial;
+
    mtx_t free_sync_mutex;
    struct list_head free_syncs;
 
@@ -231,12 +231,305 @@ vkr_gbm_get_fd_info_from_allocation_info(UNUSED struct vkr_physical_device *phys
 
 #endif /* ENABLE_GBM_ALLOCATION */
 
+static struct vkr_device_memory_block *
+vkr_device_memory_block_create(struct vkr_device *dev,
+                               uint32_t mem_type_index,
+                               VkMemoryAllocateFlags flags)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   struct vkr_device_memory_block *block = calloc(1, sizeof(*block));
+   if (!block)
+      return NULL;
+
+   const VkMemoryAllocateFlagsInfo flags_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
+      .flags = flags,
+   };
+   const VkMemoryAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .pNext = flags ? &flags_info : NULL,
+      .allocationSize = VKR_DEVICE_MEMORY_BLOCK_SIZE,
+      .memoryTypeIndex = mem_type_index,
+   };
+   VkResult result =
+      vk->AllocateMemory(dev->base.handle.device, &alloc_info, NULL, &block->handle);
+   if (result != VK_SUCCESS) {
+      free(block);
+      return NULL;
+   }
+
+   block->flags = flags;
+
+   return block;
+}
+
 static void
-vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
-                              struct vn_command_vkAllocateMemory *args)
+vkr_device_memory_block_destroy(struct vkr_device *dev,
+                                struct vkr_device_memory_block *block,
+                                bool free_vk)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   if (free_vk)
+      vk->FreeMemory(dev->base.handle.device, block->handle, NULL);
+
+   list_del(&block->head);
+   free(block);
+}
+
+static bool
+vkr_device_memory_block_alloc_units(struct vkr_device_memory_block *block,
+                                    uint32_t count,
+                                    uint32_t *out_first)
+{
+   if (block->used_unit_count + count > VKR_DEVICE_MEMORY_BLOCK_UNIT_COUNT)
+      return false;
+
+   /* first fit */
+   uint32_t run = 0;
+   for (uint32_t i = 0; i < VKR_DEVICE_MEMORY_BLOCK_UNIT_COUNT; i++) {
+      if (block->used_units[i / 64] & (1ull << (i % 64))) {
+         run = 0;
+         continue;
+      }
+      if (++run < count)
+         continue;
+
+      const uint32_t first = i + 1 - count;
+      for (uint32_t j = first; j <= i; j++)
+         block->used_units[j / 64] |= 1ull << (j % 64);
+      block->used_unit_count += count;
+
+      *out_first = first;
+      return true;
+   }
+
+   return false;
+}
+
+static void
+vkr_device_memory_block_free_units(struct vkr_device_memory_block *block,
+                                   uint32_t first,
+                                   uint32_t count)
+{
+   for (uint32_t i = first; i < first + count; i++) {
+      assert(block->used_units[i / 64] & (1ull << (i % 64)));
+      block->used_units[i / 64] &= ~(1ull << (i % 64));
+   }
+   block->used_unit_count -= count;
+}
+
+static bool
+vkr_device_memory_can_suballocate(const struct vkr_device *dev,
+                                  const VkMemoryAllocateInfo *alloc_info,
+                                  VkMemoryAllocateFlags *out_flags)
+{
+   const struct vkr_physical_device *physical_dev = dev->physical_device;
+
+   if (!vkr_memory_suballoc || !alloc_info->allocationSize ||
+       alloc_info->allocationSize > VKR_DEVICE_MEMORY_SUBALLOC_MAX_SIZE)
+      return false;
+
+   /* HOST_VISIBLE memories are mapped or exported through their own fds */
+   const uint32_t property_flags =
+      physical_dev->memory_properties.memoryTypes[alloc_info->memoryTypeIndex]
+         .propertyFlags;
+   if (property_flags &
+       (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT |
+        VK_MEMORY_PROPERTY_PROTECTED_BIT))
+      return false;
+
+   /* linear and optimal resources of neighbouring memories must not share a page */
+   if (physical_dev->properties.limits.bufferImageGranularity >
+       VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE)
+      return false;
+
+   /* imports, exports, dedicated memories and the like are kept one-to-one */
+   VkMemoryAllocateFlags flags = 0;
+   for (const VkBaseInStructure *pnext = alloc_info->pNext; pnext; pnext = pnext->pNext) {
+      if (pnext->sType != VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO)
+         return false;
+      flags = ((const VkMemoryAllocateFlagsInfo *)pnext)->flags;
+   }
+   if (flags & ~VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT)
+      return false;
+
+   *out_flags = flags;
+   return true;
+}
+
+static bool
+vkr_device_memory_suballocate(struct vkr_device *dev,
+                              struct vkr_device_memory *mem,
+                              const VkMemoryAllocateInfo *alloc_info,
+                              VkMemoryAllocateFlags flags)
+{
+   struct list_head *blocks = &dev->memory_blocks[alloc_info->memoryTypeIndex];
+   const uint32_t count =
+      DIV_ROUND_UP(alloc_info->allocationSize, VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE);
+   struct vkr_device_memory_block *found = NULL;
+   uint32_t first;
+
+   mtx_lock(&dev->memory_block_mutex);
+
+   list_for_each_entry (struct vkr_device_memory_block, block, blocks, head) {
+      if (block->flags == flags &&
+          vkr_device_memory_block_alloc_units(block, count, &first)) {
+         found = block;
+         break;
+      }
+   }
+
+   if (!found) {
+      found = vkr_device_memory_block_create(dev, alloc_info->memoryTypeIndex, flags);
+      if (found) {
+         list_add(&found->head, blocks);
+         ASSERTED const bool ok =
+            vkr_device_memory_block_alloc_units(found, count, &first);
+         assert(ok);
+      }
+   }
+
+   mtx_unlock(&dev->memory_block_mutex);
+
+   if (!found)
+      return false;
+
+   mem->block = found;
+   mem->block_offset = (VkDeviceSize)first * VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE;
+   mem->base.handle.device_memory = found->handle;
+
+   return true;
+}
+
+/* An emptied block is freed, unless it is the only one of its memory type. */
+static void
+vkr_device_memory_free_suballocation(struct vkr_device_memory *mem, bool free_empty)
+{
+   struct vkr_device *dev = mem->device;
+   struct vkr_device_memory_block *block = mem->block;
+   const uint32_t count =
+      DIV_ROUND_UP(mem->allocation_size, VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE);
+
+   mtx_lock(&dev->memory_block_mutex);
+
+   vkr_device_memory_block_free_units(
+      block, mem->block_offset / VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE, count);
+   if (free_empty && !block->used_unit_count &&
+       !list_is_singular(&dev->memory_blocks[mem->memory_type_index]))
+      vkr_device_memory_block_destroy(dev, block, true);
+
+   mtx_unlock(&dev->memory_block_mutex);
+
+   mem->block = NULL;
+}
+
+static void
+vkr_device_memory_backing_destroy(struct vkr_device *dev,
+                                  struct vkr_device_memory_backing *backing)
+{
+   if (backing->gbm_bo)
+      vkr_gbm_bo_destroy(backing->gbm_bo);
+   if (backing->udmabuf_fd >= 0)
+      close(backing->udmabuf_fd);
+
+   dev->memory_backing_size -= backing->size;
+   list_del(&backing->head);
+   free(backing);
+}
+
+/* Looks for the udmabuf or gbm bo of a freed memory of the same size, and takes
+ * it to be imported.
+ */
+static bool
+vkr_device_memory_take_backing(struct vkr_device *dev,
+                               const VkMemoryAllocateInfo *alloc_info,
+                               int *out_udmabuf_fd,
+                               void **out_gbm_bo,
+                               VkImportMemoryFdInfoKHR *out_fd_info)
+{
+   const uint64_t size = align64(alloc_info->allocationSize, getpagesize());
+   struct vkr_device_memory_backing *found = NULL;
+
+   mtx_lock(&dev->memory_backing_mutex);
+   list_for_each_entry (struct vkr_device_memory_backing, backing, &dev->memory_backings,
+                        head) {
+      if (backing->size == size) {
+         found = backing;
+         list_del(&found->head);
+         dev->memory_backing_size -= size;
+         break;
+      }
+   }
+   mtx_unlock(&dev->memory_backing_mutex);
+
+   if (!found)
+      return false;
+
+   int fd = found->udmabuf_fd >= 0 ? os_dupfd_cloexec(found->udmabuf_fd)
+                                   : vkr_gbm_bo_get_fd(found->gbm_bo);
+   if (fd < 0) {
+      if (found->gbm_bo)
+         vkr_gbm_bo_destroy(found->gbm_bo);
+      if (found->udmabuf_fd >= 0)
+         close(found->udmabuf_fd);
+      free(found);
+      return false;
+   }
+
+   *out_udmabuf_fd = found->udmabuf_fd;
+   *out_gbm_bo = found->gbm_bo;
+   *out_fd_info = (VkImportMemoryFdInfoKHR){
+      .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+      .pNext = alloc_info->pNext,
+      .fd = fd,
+      .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+   };
+   free(found);
+
+   return true;
+}
+
+/* Keeps the udmabuf or gbm bo of a memory that has been freed, the oldest ones
+ * are dropped to stay within VKR_DEVICE_MEMORY_BACKING_CACHE_SIZE.
+ */
+static void
+vkr_device_memory_put_backing(struct vkr_device_memory *mem)
+{
+   struct vkr_device *dev = mem->device;
+   const uint64_t size = align64(mem->allocation_size, getpagesize());
+
+   /* pages that a resource still refers to cannot be handed out again */
+   if (mem->exported || size > VKR_DEVICE_MEMORY_BACKING_CACHE_SIZE)
+      return;
+
+   struct vkr_device_memory_backing *backing = malloc(sizeof(*backing));
+   if (!backing)
+      return;
+
+   backing->size = size;
+   backing->udmabuf_fd = mem->udmabuf_fd;
+   backing->gbm_bo = mem->gbm_bo;
+
+   mtx_lock(&dev->memory_backing_mutex);
+   while (dev->memory_backing_size + size > VKR_DEVICE_MEMORY_BACKING_CACHE_SIZE) {
+      vkr_device_memory_backing_destroy(
+         dev, list_first_entry(&dev->memory_backings, struct vkr_device_memory_backing,
+                               head));
+   }
+   list_addtail(&backing->head, &dev->memory_backings);
+   dev->memory_backing_size += size;
+   mtx_unlock(&dev->memory_backing_mutex);
+
+   mem->udmabuf_fd = -1;
+   mem->gbm_bo = NULL;
+}
+
+static struct vkr_device_memory *
+vkr_device_memory_allocate(struct vkr_context *ctx,
+                           struct vn_command_vkAllocateMemory *args)
 {
-   TRACE_FUNC();
-   struct vkr_context *ctx = dispatch->data;
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vkr_physical_device *physical_dev = dev->physical_device;
 
@@ -244,7 +537,33 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
    const uint32_t mem_type_index = alloc_info->memoryTypeIndex;
    if (unlikely(mem_type_index >= physical_dev->memory_properties.memoryTypeCount)) {
       args->ret = VK_ERROR_UNKNOWN;
-      return;
+      return NULL;
+   }
+
+   VkMemoryAllocateFlags suballoc_flags;
+   if (vkr_device_memory_can_suballocate(dev, alloc_info, &suballoc_flags)) {
+      struct vkr_device_memory *mem = vkr_context_alloc_object(
+         ctx, sizeof(*mem), VK_OBJECT_TYPE_DEVICE_MEMORY, args->pMemory);
+      if (!mem) {
+         args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+         return NULL;
+      }
+
+      mem->device = dev;
+      mem->udmabuf_fd = -1;
+      mem->shm_fd = -1;
+      mem->allocation_size = alloc_info->allocationSize;
+      mem->memory_type_index = mem_type_index;
+      mem->property_flags =
+         physical_dev->memory_properties.memoryTypes[mem_type_index].propertyFlags;
+
+      /* fall back to a driver memory of its own when no block can be allocated */
+      if (vkr_device_memory_suballocate(dev, mem, alloc_info, suballoc_flags)) {
+         vkr_device_add_object(ctx, dev, &mem->base);
+         args->ret = VK_SUCCESS;
+         return mem;
+      }
+      free(mem);
    }
 
    /* translate VkImportMemoryResourceInfoMESA into VkImportMemoryFdInfoKHR in place,
@@ -270,7 +589,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
             vkr_log("failed to import resource: invalid res_id %u", res_info->resourceId);
             vkr_context_set_fatal(ctx);
             args->ret = VK_ERROR_INVALID_EXTERNAL_HANDLE;
-            return;
+            return NULL;
          }
 
          /* Get the fd and mmap it for host pointer import */
@@ -278,7 +597,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
          if (imported_res_fd < 0) {
             vkr_log("failed to dup resource fd");
             args->ret = VK_ERROR_INVALID_EXTERNAL_HANDLE;
-            return;
+            return NULL;
          }
 
          /* Get size from resource or align allocation size */
@@ -292,7 +611,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
             vkr_log("failed to mmap resource fd for host pointer import: %s", strerror(errno));
             close(imported_res_fd);
             args->ret = VK_ERROR_INVALID_EXTERNAL_HANDLE;
-            return;
+            return NULL;
          }
 
          local_import_host_ptr_info = (VkImportMemoryHostPointerInfoEXT){
@@ -308,7 +627,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
       } else {
          if (!vkr_get_fd_info_from_resource_info(ctx, res_info, &local_import_info)) {
             args->ret = VK_ERROR_INVALID_EXTERNAL_HANDLE;
-            return;
+            return NULL;
          }
 
          prev_of_res_info->pNext = (const struct VkBaseInStructure *)&local_import_info;
@@ -400,7 +719,10 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
             export_info = NULL;
          }
 
-         if (force_udmabuf_import) {
+         if (vkr_device_memory_take_backing(dev, alloc_info, &udmabuf_fd, &gbm_bo,
+                                            &local_import_info)) {
+            args->ret = VK_SUCCESS;
+         } else if (force_udmabuf_import) {
             /* To be noted, there are 2 limits for udmabuf:
              * - list_limit: udmabuf_create_list->count limit. Default is 1024.
              * - size_limit_mb: Max size of a dmabuf, in megabytes. Default is 64.
@@ -412,7 +734,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
                physical_dev, alloc_info, &gbm_bo, &local_import_info);
          }
          if (args->ret != VK_SUCCESS)
-            return;
+            return NULL;
 
          alloc_info->pNext = &local_import_info;
          valid_fd_types = 1 << VIRGL_RESOURCE_FD_DMABUF;
@@ -440,7 +762,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
       if (shm_fd < 0) {
          vkr_log("failed to create SHM for host pointer import");
          args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
-         return;
+         return NULL;
       }
 
       shm_ptr = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
@@ -448,7 +770,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
          vkr_log("failed to mmap SHM for host pointer import");
          close(shm_fd);
          args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
-         return;
+         return NULL;
       }
 
       local_host_pointer_info = (VkImportMemoryHostPointerInfoEXT){
@@ -490,7 +812,7 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
          munmap(shm_ptr, shm_size);
       if (shm_fd >= 0)
          close(shm_fd);
-      return;
+      return NULL;
    }
 
    mem->device = dev;
@@ -504,6 +826,29 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
    mem->shm_size = shm_size;
    mem->allocation_size = alloc_info->allocationSize;
    mem->memory_type_index = mem_type_index;
+
+   return mem;
+}
+
+static void
+vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
+                              struct vn_command_vkAllocateMemory *args)
+{
+   TRACE_FUNC();
+   struct vkr_context *ctx = dispatch->data;
+
+   /* charge the size the guest asked for, before any padding */
+   const uint64_t size = args->pAllocateInfo->allocationSize;
+   if (!virgl_memory_budget_charge(&ctx->memory_budget, size)) {
+      args->ret = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+      return;
+   }
+
+   struct vkr_device_memory *mem = vkr_device_memory_allocate(ctx, args);
+   if (mem)
+      mem->budget_size = size;
+   else
+      virgl_memory_budget_uncharge(&ctx->memory_budget, size);
 }
 
 static void
@@ -511,12 +856,22 @@ vkr_dispatch_vkFreeMemory(struct vn_dispatch_context *dispatch,
                           struct vn_command_vkFreeMemory *args)
 {
    TRACE_FUNC();
+   struct vkr_context *ctx = dispatch->data;
    struct vkr_device_memory *mem = vkr_device_memory_from_handle(args->memory);
    if (!mem)
       return;
 
-   vkr_device_memory_release(mem);
-   vkr_device_memory_destroy_and_remove(dispatch->data, args);
+   if (mem->block) {
+      virgl_memory_budget_uncharge(&ctx->memory_budget, mem->budget_size);
+      vkr_device_memory_free_suballocation(mem, true);
+      vkr_device_remove_object(dispatch->data, mem->device, &mem->base);
+      return;
+   }
+
+   /* the udmabuf or gbm bo is only reused once the driver let go of it */
+   vkr_device_memory_destroy_driver_handle(dispatch->data, args);
+   vkr_device_memory_release(ctx, mem);
+   vkr_device_remove_object(dispatch->data, mem->device, &mem->base);
 }
 
 static void
@@ -632,8 +987,42 @@ vkr_context_init_device_memory_dispatch(struct vkr_context *ctx)
 }
 
 void
-vkr_device_memory_release(struct vkr_device_memory *mem)
+vkr_device_init_memory_pools(struct vkr_device *dev)
 {
+   mtx_init(&dev->memory_block_mutex, mtx_plain);
+   for (uint32_t i = 0; i < ARRAY_SIZE(dev->memory_blocks); i++)
+      list_inithead(&dev->memory_blocks[i]);
+
+   mtx_init(&dev->memory_backing_mutex, mtx_plain);
+   list_inithead(&dev->memory_backings);
+   dev->memory_backing_size = 0;
+}
+
+void
+vkr_device_fini_memory_pools(struct vkr_device *dev, bool free_vk)
+{
+   for (uint32_t i = 0; i < ARRAY_SIZE(dev->memory_blocks); i++) {
+      list_for_each_entry_safe (struct vkr_device_memory_block, block,
+                                &dev->memory_blocks[i], head)
+         vkr_device_memory_block_destroy(dev, block, free_vk);
+   }
+   mtx_destroy(&dev->memory_block_mutex);
+
+   list_for_each_entry_safe (struct vkr_device_memory_backing, backing,
+                             &dev->memory_backings, head)
+      vkr_device_memory_backing_destroy(dev, backing);
+   mtx_destroy(&dev->memory_backing_mutex);
+}
+
+void
+vkr_device_memory_release(struct vkr_context *ctx, struct vkr_device_memory *mem)
+{
+   virgl_memory_budget_uncharge(&ctx->memory_budget, mem->budget_size);
+
+   if (mem->block)
+      vkr_device_memory_free_suballocation(mem, false);
+   if (mem->gbm_bo || mem->udmabuf_fd >= 0)
+      vkr_device_memory_put_backing(mem);
    if (mem->gbm_bo)
       vkr_gbm_bo_destroy(mem->gbm_bo);
    if (mem->udmabuf_fd >= 0)
@@ -10,6 +10,38 @@
 
 struct gbm_bo;
 
+/* With vkr_memory_suballoc, small memories of the device-local types that the
+ * host never maps or exports are carved out of larger driver memories.  A
+ * block is split in units, aligned for any buffer or image.
+ */
+#define VKR_DEVICE_MEMORY_BLOCK_SIZE (16ull << 20)
+#define VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE (64ull << 10)
+#define VKR_DEVICE_MEMORY_BLOCK_UNIT_COUNT                                               \
+   (VKR_DEVICE_MEMORY_BLOCK_SIZE / VKR_DEVICE_MEMORY_BLOCK_UNIT_SIZE)
+/* larger memories are allocated one-to-one */
+#define VKR_DEVICE_MEMORY_SUBALLOC_MAX_SIZE (VKR_DEVICE_MEMORY_BLOCK_SIZE / 16)
+
+struct vkr_device_memory_block {
+   struct list_head head;
+
+   VkDeviceMemory handle;
+   VkMemoryAllocateFlags flags;
+
+   uint32_t used_unit_count;
+   uint64_t used_units[VKR_DEVICE_MEMORY_BLOCK_UNIT_COUNT / 64];
+};
+
+/* at most this many bytes of udmabufs or gbm bos are kept for reuse */
+#define VKR_DEVICE_MEMORY_BACKING_CACHE_SIZE (64ull << 20)
+
+struct vkr_device_memory_backing {
+   struct list_head head;
+
+   uint64_t size;
+   int udmabuf_fd;
+   struct gbm_bo *gbm_bo;
+};
+
 struct vkr_device_memory {
    struct vkr_object base;
 
@@ -34,7 +66,14 @@ struct vkr_device_memory {
    uint64_t allocation_size;
    uint32_t memory_type_index;
 
+   /* charged to the memory budget of the context */
+   uint64_t budget_size;
+
    bool exported;
+
+   /* when suballocated, base.handle is the driver memory of the block */
+   struct vkr_device_memory_block *block;
+   VkDeviceSize block_offset;
 };
 VKR_DEFINE_OBJECT_CAST(device_memory, VK_OBJECT_TYPE_DEVICE_MEMORY, VkDeviceMemory)
 
@@ -42,7 +81,13 @@ void
 vkr_context_init_device_memory_dispatch(struct vkr_context *ctx);
 
 void
-vkr_device_memory_release(struct vkr_device_memory *mem);
+vkr_device_init_memory_pools(struct vkr_device *dev);
+
+void
+vkr_device_fini_memory_pools(struct vkr_device *dev, bool free_vk);
+
+void
+vkr_device_memory_release(struct vkr_context *ctx, struct vkr_device_memory *mem);
 
 bool
 vkr_device_memory_export_blob(struct vkr_device_memory *mem,
@@ -50,4 +95,14 @@ vkr_device_memory_export_blob(struct vkr_device_memory *mem,
                               uint32_t blob_flags,
                               struct virgl_context_blob *out_blob);
 
+/* the offset to add to the memory offsets of the guest, before the handle of
+ * the memory is replaced
+ */
+static inline VkDeviceSize
+vkr_device_memory_get_block_offset(VkDeviceMemory handle)
+{
+   const struct vkr_device_memory *mem = vkr_device_memory_from_handle(handle);
+   return mem ? mem->block_offset : 0;
+}
+
 #endif /* VKR_DEVICE_MEMORY_H */
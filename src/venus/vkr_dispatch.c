@@ -0,0 +1,595 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_dispatch.h"
+
+#include "venus-protocol/vn_protocol_renderer_dispatches.h"
+
+#include "vkr_command_buffer.h"
+#include "vkr_cs.h"
+#include "vkr_descriptor_set.h"
+#include "vkr_device.h"
+#include "vkr_queue.h"
+#include "vkr_record_cache.h"
+
+/* The fast path handles the commands below when they need no reply.  Each
+ * part of a command is copied out of the stream with a single bounds check,
+ * so the guest cannot change it while it is used.  Commands that are not
+ * well-formed, or larger than the local arrays, are left to the generated
+ * decoder, which reports the errors.
+ */
+#define VKR_DISPATCH_MAX_VIEWPORTS 16
+#define VKR_DISPATCH_MAX_DESCRIPTOR_SETS 32
+#define VKR_DISPATCH_MAX_DYNAMIC_OFFSETS 64
+#define VKR_DISPATCH_MAX_PUSH_CONSTANTS_SIZE 256
+
+#define VKR_DISPATCH_COMMAND_TYPE_COUNT ARRAY_SIZE(vn_dispatch_table)
+
+struct vkr_dispatch_stream {
+   const uint8_t *cur;
+   const uint8_t *end;
+};
+
+static inline bool
+vkr_dispatch_read(struct vkr_dispatch_stream *stream, void *data, size_t size)
+{
+   if (size > (size_t)(stream->end - stream->cur))
+      return false;
+   memcpy(data, stream->cur, size);
+   stream->cur += size;
+   return true;
+}
+
+static inline uint64_t
+vkr_dispatch_u64(const uint32_t *words)
+{
+   uint64_t val;
+   memcpy(&val, words, sizeof(val));
+   return val;
+}
+
+static inline uint64_t
+vkr_dispatch_lookup_handle(struct vkr_cs_decoder *dec, uint64_t id, VkObjectType type)
+{
+   const struct vkr_object *obj = vkr_cs_decoder_lookup_object(dec, id, type);
+   return obj ? obj->handle.u64 : 0;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdBindPipeline(struct vkr_cs_decoder *dec,
+                                    struct vkr_dispatch_stream *stream,
+                                    struct vkr_command_buffer *cmd)
+{
+   uint32_t args[3];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   const VkPipeline pipeline = (VkPipeline)vkr_dispatch_lookup_handle(
+      dec, vkr_dispatch_u64(&args[1]), VK_OBJECT_TYPE_PIPELINE);
+   if (!vkr_cs_decoder_get_fatal(dec)) {
+      cmd->device->proc_table.CmdBindPipeline(cmd->base.handle.command_buffer, args[0],
+                                              pipeline);
+   }
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdSetViewport(UNUSED struct vkr_cs_decoder *dec,
+                                   struct vkr_dispatch_stream *stream,
+                                   struct vkr_command_buffer *cmd)
+{
+   uint32_t args[4];
+   VkViewport viewports[VKR_DISPATCH_MAX_VIEWPORTS];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   const uint32_t count = args[1];
+   if (!count || count > ARRAY_SIZE(viewports) || vkr_dispatch_u64(&args[2]) != count ||
+       !vkr_dispatch_read(stream, viewports, sizeof(*viewports) * count))
+      return false;
+
+   cmd->device->proc_table.CmdSetViewport(cmd->base.handle.command_buffer, args[0], count,
+                                          viewports);
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdSetScissor(UNUSED struct vkr_cs_decoder *dec,
+                                  struct vkr_dispatch_stream *stream,
+                                  struct vkr_command_buffer *cmd)
+{
+   uint32_t args[4];
+   VkRect2D scissors[VKR_DISPATCH_MAX_VIEWPORTS];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   const uint32_t count = args[1];
+   if (!count || count > ARRAY_SIZE(scissors) || vkr_dispatch_u64(&args[2]) != count ||
+       !vkr_dispatch_read(stream, scissors, sizeof(*scissors) * count))
+      return false;
+
+   cmd->device->proc_table.CmdSetScissor(cmd->base.handle.command_buffer, args[0], count,
+                                         scissors);
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdBindDescriptorSets(struct vkr_cs_decoder *dec,
+                                          struct vkr_dispatch_stream *stream,
+                                          struct vkr_command_buffer *cmd)
+{
+   uint32_t args[7];
+   uint64_t set_ids[VKR_DISPATCH_MAX_DESCRIPTOR_SETS];
+   uint32_t dynamic_args[3];
+   uint32_t dynamic_offsets[VKR_DISPATCH_MAX_DYNAMIC_OFFSETS];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   const uint32_t set_count = args[4];
+   if (!set_count || set_count > ARRAY_SIZE(set_ids) ||
+       vkr_dispatch_u64(&args[5]) != set_count ||
+       !vkr_dispatch_read(stream, set_ids, sizeof(*set_ids) * set_count) ||
+       !vkr_dispatch_read(stream, dynamic_args, sizeof(dynamic_args)))
+      return false;
+
+   const uint32_t dynamic_count = dynamic_args[0];
+   if (dynamic_count > ARRAY_SIZE(dynamic_offsets) ||
+       vkr_dispatch_u64(&dynamic_args[1]) != dynamic_count ||
+       !vkr_dispatch_read(stream, dynamic_offsets,
+                          sizeof(*dynamic_offsets) * dynamic_count))
+      return false;
+
+   const VkPipelineLayout layout = (VkPipelineLayout)vkr_dispatch_lookup_handle(
+      dec, vkr_dispatch_u64(&args[1]), VK_OBJECT_TYPE_PIPELINE_LAYOUT);
+   VkDescriptorSet sets[VKR_DISPATCH_MAX_DESCRIPTOR_SETS];
+   for (uint32_t i = 0; i < set_count; i++) {
+      sets[i] = (VkDescriptorSet)vkr_dispatch_lookup_handle(
+         dec, set_ids[i], VK_OBJECT_TYPE_DESCRIPTOR_SET);
+   }
+
+   if (!vkr_cs_decoder_get_fatal(dec)) {
+      cmd->device->proc_table.CmdBindDescriptorSets(
+         cmd->base.handle.command_buffer, args[0], layout, args[3], set_count, sets,
+         dynamic_count, dynamic_count ? dynamic_offsets : NULL);
+   }
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdPushConstants(struct vkr_cs_decoder *dec,
+                                     struct vkr_dispatch_stream *stream,
+                                     struct vkr_command_buffer *cmd)
+{
+   uint32_t args[7];
+   uint8_t values[VKR_DISPATCH_MAX_PUSH_CONSTANTS_SIZE];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   /* the values are padded to 4 bytes in the stream */
+   const uint32_t size = args[4];
+   if (!size || size > sizeof(values) || vkr_dispatch_u64(&args[5]) != size ||
+       !vkr_dispatch_read(stream, values, (size + 3) & ~3))
+      return false;
+
+   const VkPipelineLayout layout = (VkPipelineLayout)vkr_dispatch_lookup_handle(
+      dec, vkr_dispatch_u64(&args[0]), VK_OBJECT_TYPE_PIPELINE_LAYOUT);
+   if (!vkr_cs_decoder_get_fatal(dec)) {
+      cmd->device->proc_table.CmdPushConstants(cmd->base.handle.command_buffer, layout,
+                                               args[2], args[3], size, values);
+   }
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdDraw(UNUSED struct vkr_cs_decoder *dec,
+                            struct vkr_dispatch_stream *stream,
+                            struct vkr_command_buffer *cmd)
+{
+   uint32_t args[4];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   cmd->device->proc_table.CmdDraw(cmd->base.handle.command_buffer, args[0], args[1],
+                                   args[2], args[3]);
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdDrawIndexed(UNUSED struct vkr_cs_decoder *dec,
+                                   struct vkr_dispatch_stream *stream,
+                                   struct vkr_command_buffer *cmd)
+{
+   uint32_t args[5];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   cmd->device->proc_table.CmdDrawIndexed(cmd->base.handle.command_buffer, args[0],
+                                          args[1], args[2], (int32_t)args[3], args[4]);
+   return true;
+}
+
+static bool
+vkr_dispatch_fast_vkCmdDispatch(UNUSED struct vkr_cs_decoder *dec,
+                                struct vkr_dispatch_stream *stream,
+                                struct vkr_command_buffer *cmd)
+{
+   uint32_t args[3];
+   if (!vkr_dispatch_read(stream, args, sizeof(args)))
+      return false;
+
+   cmd->device->proc_table.CmdDispatch(cmd->base.handle.command_buffer, args[0], args[1],
+                                       args[2]);
+   return true;
+}
+
+typedef bool (*vkr_dispatch_fast_func)(struct vkr_cs_decoder *dec,
+                                       struct vkr_dispatch_stream *stream,
+                                       struct vkr_command_buffer *cmd);
+
+static inline vkr_dispatch_fast_func
+vkr_dispatch_get_fast_func(VkCommandTypeEXT type)
+{
+   switch (type) {
+   case VK_COMMAND_TYPE_vkCmdBindPipeline_EXT:
+      return vkr_dispatch_fast_vkCmdBindPipeline;
+   case VK_COMMAND_TYPE_vkCmdSetViewport_EXT:
+      return vkr_dispatch_fast_vkCmdSetViewport;
+   case VK_COMMAND_TYPE_vkCmdSetScissor_EXT:
+      return vkr_dispatch_fast_vkCmdSetScissor;
+   case VK_COMMAND_TYPE_vkCmdBindDescriptorSets_EXT:
+      return vkr_dispatch_fast_vkCmdBindDescriptorSets;
+   case VK_COMMAND_TYPE_vkCmdPushConstants_EXT:
+      return vkr_dispatch_fast_vkCmdPushConstants;
+   case VK_COMMAND_TYPE_vkCmdDraw_EXT:
+      return vkr_dispatch_fast_vkCmdDraw;
+   case VK_COMMAND_TYPE_vkCmdDrawIndexed_EXT:
+      return vkr_dispatch_fast_vkCmdDrawIndexed;
+   case VK_COMMAND_TYPE_vkCmdDispatch_EXT:
+      return vkr_dispatch_fast_vkCmdDispatch;
+   default:
+      return NULL;
+   }
+}
+
+/* Returns false, with the stream untouched, when the next command is not one
+ * for the fast path.
+ */
+static bool
+vkr_dispatch_fast_command(struct vkr_cs_decoder *dec)
+{
+   /* the command type, the flags and the command buffer */
+   uint32_t header[4];
+   struct vkr_dispatch_stream stream = { .cur = dec->cur, .end = dec->end };
+   if (dec->peeked.cur == dec->cur || !vkr_dispatch_read(&stream, header, sizeof(header)))
+      return false;
+
+   const vkr_dispatch_fast_func func = vkr_dispatch_get_fast_func(header[0]);
+   const uint64_t cmd_id = vkr_dispatch_u64(&header[2]);
+   if (!func || header[1] || !cmd_id)
+      return false;
+
+   struct vkr_command_buffer *cmd = (struct vkr_command_buffer *)
+      vkr_cs_decoder_lookup_object(dec, cmd_id, VK_OBJECT_TYPE_COMMAND_BUFFER);
+   if (vkr_cs_decoder_get_fatal(dec))
+      return true;
+
+   if (!func(dec, &stream, cmd))
+      return false;
+
+   dec->cur = stream.cur;
+   return true;
+}
+
+static void
+vkr_dispatch_vkUpdateDescriptorSetWithTemplate(struct vn_dispatch_context *ctx,
+                                               VkCommandFlagsEXT flags)
+{
+   struct vn_command_vkUpdateDescriptorSetWithTemplate args;
+
+   if (!ctx->dispatch_vkUpdateDescriptorSetWithTemplate) {
+      vn_cs_decoder_set_fatal(ctx->decoder);
+      return;
+   }
+
+   vkr_decode_vkUpdateDescriptorSetWithTemplate_args_temp(ctx->decoder, &args);
+   if (!args.device) {
+      vn_cs_decoder_set_fatal(ctx->decoder);
+      return;
+   }
+
+   if (!vn_cs_decoder_get_fatal(ctx->decoder))
+      ctx->dispatch_vkUpdateDescriptorSetWithTemplate(ctx, &args);
+
+   if ((flags & VK_COMMAND_GENERATE_REPLY_BIT_EXT) &&
+       !vn_cs_decoder_get_fatal(ctx->decoder)) {
+      if (vn_cs_encoder_acquire(ctx->encoder)) {
+         const VkCommandTypeEXT cmd_type =
+            VK_COMMAND_TYPE_vkUpdateDescriptorSetWithTemplate_EXT;
+         vn_encode_VkCommandTypeEXT(ctx->encoder, &cmd_type);
+         vn_cs_encoder_release(ctx->encoder);
+      }
+   }
+
+   vn_cs_decoder_reset_temp_pool(ctx->decoder);
+}
+
+/* writes a reply that is the command type and its result, in one reservation */
+static void
+vkr_dispatch_encode_result_reply(struct vn_dispatch_context *ctx,
+                                 VkCommandTypeEXT type,
+                                 VkResult result)
+{
+   struct vkr_cs_encoder *enc = (struct vkr_cs_encoder *)ctx->encoder;
+   const int32_t reply[2] = { type, result };
+
+   void *ptr = vkr_cs_encoder_reserve(enc, sizeof(reply));
+   if (!ptr)
+      return;
+
+   memcpy(ptr, reply, sizeof(reply));
+   vkr_cs_encoder_commit(enc, sizeof(reply));
+}
+
+/* The generated dispatch of a command whose reply is the command type and its
+ * result, but with the reply written by vkr_dispatch_encode_result_reply.
+ * Guests poll the status commands, and their replies are most of the cost.
+ */
+#define VKR_DISPATCH_RESULT_COMMAND(name)                                                \
+   static void vkr_dispatch_result_##name(struct vn_dispatch_context *ctx,               \
+                                          VkCommandFlagsEXT flags)                       \
+   {                                                                                     \
+      struct vn_command_##name args;                                                     \
+                                                                                         \
+      if (!ctx->dispatch_##name) {                                                       \
+         vn_cs_decoder_set_fatal(ctx->decoder);                                          \
+         return;                                                                         \
+      }                                                                                  \
+                                                                                         \
+      vn_decode_##name##_args_temp(ctx->decoder, &args);                                 \
+      if (!args.device) {                                                                \
+         vn_cs_decoder_set_fatal(ctx->decoder);                                          \
+         return;                                                                         \
+      }                                                                                  \
+                                                                                         \
+      if (!vn_cs_decoder_get_fatal(ctx->decoder))                                        \
+         ctx->dispatch_##name(ctx, &args);                                               \
+                                                                                         \
+      if (flags & VK_COMMAND_GENERATE_REPLY_BIT_EXT) {                                   \
+         if (!vn_cs_decoder_get_fatal(ctx->decoder))                                     \
+            vkr_dispatch_encode_result_reply(ctx, VK_COMMAND_TYPE_##name##_EXT,          \
+                                             args.ret);                                  \
+      } else if (args.ret == VK_ERROR_DEVICE_LOST) {                                     \
+         vn_cs_decoder_set_fatal(ctx->decoder);                                          \
+      }                                                                                  \
+                                                                                         \
+      vn_cs_decoder_reset_temp_pool(ctx->decoder);                                       \
+   }
+
+VKR_DISPATCH_RESULT_COMMAND(vkGetFenceStatus)
+VKR_DISPATCH_RESULT_COMMAND(vkResetFences)
+VKR_DISPATCH_RESULT_COMMAND(vkWaitForFences)
+VKR_DISPATCH_RESULT_COMMAND(vkGetEventStatus)
+
+/* vn_dispatch_command, plus the commands that the generated decoder lacks */
+static void
+vkr_dispatch_decoded_command(struct vn_dispatch_context *dispatch)
+{
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+
+   int32_t type = -1;
+   if (dec->end - dec->cur >= (ptrdiff_t)sizeof(type))
+      memcpy(&type, dec->cur, sizeof(type));
+
+   if (type == VK_COMMAND_TYPE_vkQueueBindSparse_EXT) {
+      /* the flags follow the type */
+      VkCommandFlagsEXT flags = 0;
+      if (dec->end - dec->cur >= (ptrdiff_t)(sizeof(type) + sizeof(flags)))
+         memcpy(&flags, dec->cur + sizeof(type), sizeof(flags));
+      dec->sparse_bind_reply = flags & VK_COMMAND_GENERATE_REPLY_BIT_EXT;
+   } else {
+      vkr_queue_flush_sparse_binds(dec);
+   }
+
+   void (*func)(struct vn_dispatch_context *ctx, VkCommandFlagsEXT flags);
+   switch (type) {
+   case VK_COMMAND_TYPE_vkUpdateDescriptorSetWithTemplate_EXT:
+      func = vkr_dispatch_vkUpdateDescriptorSetWithTemplate;
+      break;
+   case VK_COMMAND_TYPE_vkGetFenceStatus_EXT:
+      func = vkr_dispatch_result_vkGetFenceStatus;
+      break;
+   case VK_COMMAND_TYPE_vkResetFences_EXT:
+      func = vkr_dispatch_result_vkResetFences;
+      break;
+   case VK_COMMAND_TYPE_vkWaitForFences_EXT:
+      func = vkr_dispatch_result_vkWaitForFences;
+      break;
+   case VK_COMMAND_TYPE_vkGetEventStatus_EXT:
+      func = vkr_dispatch_result_vkGetEventStatus;
+      break;
+   default:
+      vn_dispatch_command(dispatch);
+      return;
+   }
+
+   VkCommandTypeEXT cmd_type;
+   VkCommandFlagsEXT cmd_flags;
+   vn_decode_VkCommandTypeEXT(dispatch->decoder, &cmd_type);
+   vn_decode_VkFlags(dispatch->decoder, &cmd_flags);
+   func(dispatch, cmd_flags);
+
+   if (vn_cs_decoder_get_fatal(dispatch->decoder)) {
+      vn_dispatch_debug_log(dispatch, "%s resulted in CS error",
+                            vn_dispatch_command_name(cmd_type));
+   }
+}
+
+/* whether each command type records into the command buffer it starts with,
+ * and touches no other command buffer
+ */
+static struct {
+   once_flag init_once;
+   bool types[VKR_DISPATCH_COMMAND_TYPE_COUNT];
+} vkr_dispatch_recording = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static void
+vkr_dispatch_init_recording_types(void)
+{
+   for (uint32_t type = 0; type < VKR_DISPATCH_COMMAND_TYPE_COUNT; type++) {
+      const char *name = vn_dispatch_command_name(type);
+      vkr_dispatch_recording.types[type] =
+         (!strncmp(name, "vkCmd", 5) && strcmp(name, "vkCmdExecuteCommands")) ||
+         !strcmp(name, "vkBeginCommandBuffer") || !strcmp(name, "vkEndCommandBuffer") ||
+         !strcmp(name, "vkResetCommandBuffer");
+   }
+}
+
+static void
+vkr_dispatch_flush_builds(struct vkr_cs_decoder *dec);
+
+vkr_object_id
+vkr_dispatch_get_recording_command_buffer(const struct vkr_cs_decoder *dec)
+{
+   /* the command type, the flags and the command buffer */
+   uint32_t header[4];
+   if (dec->end - dec->cur < (ptrdiff_t)sizeof(header))
+      return 0;
+   memcpy(header, dec->cur, sizeof(header));
+
+   call_once(&vkr_dispatch_recording.init_once, vkr_dispatch_init_recording_types);
+   if (header[0] >= VKR_DISPATCH_COMMAND_TYPE_COUNT ||
+       !vkr_dispatch_recording.types[header[0]] || header[1])
+      return 0;
+
+   return vkr_dispatch_u64(&header[2]);
+}
+
+bool
+vkr_dispatch_recording_command(struct vn_dispatch_context *dispatch, vkr_object_id cmd_id)
+{
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+
+   if (vkr_dispatch_get_recording_command_buffer(dec) != cmd_id)
+      return false;
+
+   vkr_dispatch_flush_builds(dec);
+
+   if (unlikely(vkr_record_cache) && vkr_record_cache_begin_command(dispatch))
+      return true;
+
+   if (!vkr_dispatch_fast_command(dec))
+      vkr_dispatch_decoded_command(dispatch);
+
+   if (unlikely(vkr_record_cache))
+      vkr_record_cache_end_command(dispatch);
+   return true;
+}
+
+/* dispatches a single command, to time it for the statistics and the flight recorder */
+static void
+vkr_dispatch_command_timed(struct vn_dispatch_context *dispatch)
+{
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+
+   if (VKR_DEBUG(CMD_STATS) && !dec->command_stats)
+      dec->command_stats = virgl_command_stats_create(VKR_DISPATCH_COMMAND_TYPE_COUNT);
+
+   int32_t type = -1;
+   if (dec->end - dec->cur >= (ptrdiff_t)sizeof(type))
+      memcpy(&type, dec->cur, sizeof(type));
+   const uint8_t *cur = dec->cur;
+
+   const uint64_t begin =
+      virgl_flight_recorder_begin(dec->flight_recorder, dec->command_stats);
+   if (!vkr_dispatch_fast_command(dec))
+      vkr_dispatch_decoded_command(dispatch);
+
+   if (type >= 0 && (uint32_t)type < VKR_DISPATCH_COMMAND_TYPE_COUNT) {
+      const uint32_t size = dec->cur > cur ? dec->cur - cur : 0;
+      virgl_flight_recorder_end(dec->flight_recorder, dec->command_stats, type,
+                                vn_dispatch_command_name(type), size, begin);
+   }
+}
+
+/* flushes the deferred builds, unless the next command is another build that
+ * can be deferred with them
+ */
+static void
+vkr_dispatch_flush_builds(struct vkr_cs_decoder *dec)
+{
+   const vkr_object_id target = vkr_command_buffer_get_builds_target(dec);
+   if (likely(!target))
+      return;
+
+   uint32_t type;
+   if (vkr_dispatch_get_recording_command_buffer(dec) == target) {
+      memcpy(&type, dec->cur, sizeof(type));
+      if (type == VK_COMMAND_TYPE_vkCmdBuildAccelerationStructuresKHR_EXT)
+         return;
+   }
+
+   vkr_command_buffer_flush_builds(dec);
+}
+
+void
+vkr_dispatch_command(struct vn_dispatch_context *dispatch)
+{
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+
+   vkr_dispatch_flush_builds(dec);
+
+   /* one command at a time, for the cache to see each of them */
+   if (unlikely(vkr_record_cache)) {
+      if (vkr_record_cache_begin_command(dispatch))
+         return;
+
+      if (VKR_DEBUG(CMD_STATS) || dec->flight_recorder)
+         vkr_dispatch_command_timed(dispatch);
+      else if (!vkr_dispatch_fast_command(dec))
+         vkr_dispatch_decoded_command(dispatch);
+
+      vkr_record_cache_end_command(dispatch);
+      return;
+   }
+
+   if (VKR_DEBUG(CMD_STATS) || dec->flight_recorder) {
+      vkr_dispatch_command_timed(dispatch);
+      return;
+   }
+
+   if (!vkr_dispatch_fast_command(dec)) {
+      vkr_dispatch_decoded_command(dispatch);
+      return;
+   }
+
+   while (vkr_cs_decoder_has_command(dec) && !vkr_cs_decoder_get_fatal(dec)) {
+      if (!vkr_dispatch_fast_command(dec))
+         break;
+   }
+}
+
+void
+vkr_dispatch_fini_command_stats(struct vkr_cs_decoder *dec)
+{
+   if (!dec->command_stats)
+      return;
+
+   for (uint32_t i = 0; i < dec->command_stats->command_count; i++) {
+      const struct virgl_command_stats_entry *entry = dec->command_stats->entries[i];
+      if (!entry)
+         continue;
+
+      vkr_log("%s: %" PRIu64 " commands, %" PRIu64 " ns each, p50 < %" PRIu64
+              " ns, p99 < %" PRIu64 " ns",
+              entry->name, entry->count, entry->total_ns / entry->count,
+              virgl_command_stats_entry_percentile(entry, 50),
+              virgl_command_stats_entry_percentile(entry, 99));
+   }
+
+   virgl_command_stats_destroy(dec->command_stats);
+   dec->command_stats = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_DISPATCH_H
+#define VKR_DISPATCH_H
+
+#include "vkr_common.h"
+
+#include "venus-protocol/vn_protocol_renderer_defines.h"
+
+struct vkr_cs_decoder;
+
+/* Dispatches the next command of the decoder.  The most frequent vkCmd*
+ * commands are decoded and recorded in runs, without going through
+ * vn_dispatch_command for each of them.
+ */
+void
+vkr_dispatch_command(struct vn_dispatch_context *dispatch);
+
+/* Returns the command buffer the next command records into, or 0 when it is
+ * not a command buffer command, or it expects a reply.
+ */
+vkr_object_id
+vkr_dispatch_get_recording_command_buffer(const struct vkr_cs_decoder *dec);
+
+/* Dispatches the next command when it records into the command buffer, and
+ * returns false without dispatching anything otherwise.
+ */
+bool
+vkr_dispatch_recording_command(struct vn_dispatch_context *dispatch, vkr_object_id cmd_id);
+
+/* logs and frees the statistics of VKR_DEBUG(CMD_STATS) */
+void
+vkr_dispatch_fini_command_stats(struct vkr_cs_decoder *dec);
+
+#endif /* VKR_DISPATCH_H */
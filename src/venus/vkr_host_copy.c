@@ -5,10 +5,251 @@
 
 #include "vkr_host_copy.h"
 
+#include <unistd.h>
+
 #include "venus-protocol/vn_protocol_renderer_host_copy.h"
 
 #include "vkr_context.h"
 #include "vkr_device.h"
+#include "vkr_image.h"
+#include "vkr_sparse.h"
+
+/* Large copies of several regions are split among the pool threads and the ring
+ * thread.  The ring thread waits for all of them before it moves on, so the
+ * copy is still done when the next command is decoded.
+ */
+#define VKR_HOST_COPY_THREAD_MAX 4
+/* below this, splitting a copy costs more than it saves */
+#define VKR_HOST_COPY_SPLIT_MIN_SIZE (512 * 1024)
+
+struct vkr_host_copy_batch {
+   uint32_t pending;
+   VkResult result;
+};
+
+struct vkr_host_copy_task {
+   struct list_head head;
+   struct vkr_host_copy_batch *batch;
+
+   struct vkr_device *device;
+   VkCopyMemoryToImageInfo info;
+};
+
+static struct {
+   once_flag init_once;
+   bool init_ok;
+
+   mtx_t mutex;
+   /* signaled when a task is queued, or on quit */
+   cnd_t task_cond;
+   /* signaled when a batch is done */
+   cnd_t batch_cond;
+   struct list_head tasks;
+
+   bool started;
+   bool quit;
+   uint32_t thread_count;
+   thrd_t threads[VKR_HOST_COPY_THREAD_MAX];
+} vkr_host_copy_pool = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static void
+vkr_host_copy_pool_init_once(void)
+{
+   if (mtx_init(&vkr_host_copy_pool.mutex, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vkr_host_copy_pool.task_cond) != thrd_success) {
+      mtx_destroy(&vkr_host_copy_pool.mutex);
+      return;
+   }
+   if (cnd_init(&vkr_host_copy_pool.batch_cond) != thrd_success) {
+      cnd_destroy(&vkr_host_copy_pool.task_cond);
+      mtx_destroy(&vkr_host_copy_pool.mutex);
+      return;
+   }
+
+   list_inithead(&vkr_host_copy_pool.tasks);
+   vkr_host_copy_pool.init_ok = true;
+}
+
+static void
+vkr_host_copy_task_run(struct vkr_host_copy_task *task)
+{
+   struct vn_device_proc_table *vk = &task->device->proc_table;
+   const VkResult result = vk->CopyMemoryToImage(task->device->base.handle.device,
+                                                 &task->info);
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   if (result != VK_SUCCESS)
+      task->batch->result = result;
+   if (!--task->batch->pending)
+      cnd_broadcast(&vkr_host_copy_pool.batch_cond);
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+}
+
+static int
+vkr_host_copy_thread(UNUSED void *arg)
+{
+   u_thread_setname("vkr-host-copy");
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   while (true) {
+      while (!vkr_host_copy_pool.quit && list_is_empty(&vkr_host_copy_pool.tasks))
+         cnd_wait(&vkr_host_copy_pool.task_cond, &vkr_host_copy_pool.mutex);
+      if (vkr_host_copy_pool.quit)
+         break;
+
+      struct vkr_host_copy_task *task =
+         list_first_entry(&vkr_host_copy_pool.tasks, struct vkr_host_copy_task, head);
+      list_del(&task->head);
+      mtx_unlock(&vkr_host_copy_pool.mutex);
+
+      vkr_host_copy_task_run(task);
+
+      mtx_lock(&vkr_host_copy_pool.mutex);
+   }
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+
+   return 0;
+}
+
+/* returns the number of pool threads, the threads are started on first use */
+static uint32_t
+vkr_host_copy_pool_get_thread_count(void)
+{
+   call_once(&vkr_host_copy_pool.init_once, vkr_host_copy_pool_init_once);
+   if (!vkr_host_copy_pool.init_ok)
+      return 0;
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   if (!vkr_host_copy_pool.started) {
+      const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+      const uint32_t count =
+         cpu_count > 1 ? MIN2((uint32_t)cpu_count - 1, VKR_HOST_COPY_THREAD_MAX) : 0;
+
+      vkr_host_copy_pool.quit = false;
+      vkr_host_copy_pool.thread_count = 0;
+      for (uint32_t i = 0; i < count; i++) {
+         if (thrd_create(&vkr_host_copy_pool.threads[i], vkr_host_copy_thread, NULL) !=
+             thrd_success)
+            break;
+         vkr_host_copy_pool.thread_count++;
+      }
+      vkr_host_copy_pool.started = true;
+   }
+   const uint32_t thread_count = vkr_host_copy_pool.thread_count;
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+
+   return thread_count;
+}
+
+/* Runs the tasks, the first one on the calling thread.  The calling thread also
+ * helps with the queued tasks until its batch is done.
+ */
+static VkResult
+vkr_host_copy_pool_run(struct vkr_host_copy_task *tasks, uint32_t task_count)
+{
+   struct vkr_host_copy_batch batch = {
+      .pending = task_count,
+      .result = VK_SUCCESS,
+   };
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   for (uint32_t i = 0; i < task_count; i++) {
+      tasks[i].batch = &batch;
+      if (i)
+         list_addtail(&tasks[i].head, &vkr_host_copy_pool.tasks);
+   }
+   cnd_broadcast(&vkr_host_copy_pool.task_cond);
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+
+   vkr_host_copy_task_run(&tasks[0]);
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   while (batch.pending) {
+      if (list_is_empty(&vkr_host_copy_pool.tasks)) {
+         cnd_wait(&vkr_host_copy_pool.batch_cond, &vkr_host_copy_pool.mutex);
+         continue;
+      }
+
+      struct vkr_host_copy_task *task =
+         list_first_entry(&vkr_host_copy_pool.tasks, struct vkr_host_copy_task, head);
+      list_del(&task->head);
+      mtx_unlock(&vkr_host_copy_pool.mutex);
+
+      vkr_host_copy_task_run(task);
+
+      mtx_lock(&vkr_host_copy_pool.mutex);
+   }
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+
+   return batch.result;
+}
+
+/* Splits the regions in tasks of about the same size, one per thread at most.
+ * Returns 0 when the copy is not worth splitting.
+ */
+static uint32_t
+vkr_host_copy_split_regions(struct vkr_device *dev,
+                            const VkCopyMemoryToImageInfo *info,
+                            const VkMemoryToImageCopyMESA *regions,
+                            struct vkr_host_copy_task tasks[VKR_HOST_COPY_THREAD_MAX + 1])
+{
+   if (info->regionCount < 2)
+      return 0;
+
+   uint64_t total_size = 0;
+   for (uint32_t i = 0; i < info->regionCount; i++)
+      total_size += regions[i].dataSize;
+   if (total_size < VKR_HOST_COPY_SPLIT_MIN_SIZE)
+      return 0;
+
+   const uint32_t thread_count = vkr_host_copy_pool_get_thread_count();
+   if (!thread_count)
+      return 0;
+
+   const uint32_t task_max = MIN2(info->regionCount, thread_count + 1);
+
+   const uint64_t task_size = DIV_ROUND_UP(total_size, task_max);
+   uint32_t task_count = 0;
+   uint32_t first = 0;
+   uint64_t size = 0;
+   for (uint32_t i = 0; i < info->regionCount; i++) {
+      size += regions[i].dataSize;
+      /* the last task takes the remaining regions */
+      if (i + 1 < info->regionCount && (size < task_size || task_count + 1 == task_max))
+         continue;
+
+      tasks[task_count] = (struct vkr_host_copy_task){
+         .device = dev,
+         .info = *info,
+      };
+      tasks[task_count].info.regionCount = i + 1 - first;
+      tasks[task_count].info.pRegions = &info->pRegions[first];
+      task_count++;
+
+      first = i + 1;
+      size = 0;
+   }
+
+   return task_count > 1 ? task_count : 0;
+}
+
+/* Sparse images may have regions without memory, which the drivers are not
+ * required to handle.  Copies from them read zeros, and copies to them are
+ * dropped, like the device accesses with residencyNonResidentStrict.
+ */
+static bool
+vkr_host_copy_is_region_resident(VkImage image,
+                                 const VkImageSubresourceLayers *subresource,
+                                 VkOffset3D offset,
+                                 VkExtent3D extent)
+{
+   const struct vkr_image *img = vkr_image_from_handle(image);
+   return !img ||
+          vkr_sparse_residency_is_region_resident(img->sparse, subresource, offset, extent);
+}
 
 static void
 vkr_dispatch_vkCopyImageToImage(UNUSED struct vn_dispatch_context *dispatch,
@@ -17,6 +258,24 @@ vkr_dispatch_vkCopyImageToImage(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   /* drop the regions that are not resident, before the handles are replaced */
+   VkCopyImageToImageInfo *info = (VkCopyImageToImageInfo *)args->pCopyImageToImageInfo;
+   VkImageCopy2 *regions = (VkImageCopy2 *)info->pRegions;
+   uint32_t region_count = 0;
+   for (uint32_t i = 0; i < info->regionCount; i++) {
+      if (!vkr_host_copy_is_region_resident(info->srcImage, &regions[i].srcSubresource,
+                                            regions[i].srcOffset, regions[i].extent) ||
+          !vkr_host_copy_is_region_resident(info->dstImage, &regions[i].dstSubresource,
+                                            regions[i].dstOffset, regions[i].extent))
+         continue;
+      regions[region_count++] = regions[i];
+   }
+   info->regionCount = region_count;
+   if (!region_count) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    vn_replace_vkCopyImageToImage_args_handle(args);
    args->ret = vk->CopyImageToImage(args->device, args->pCopyImageToImageInfo);
 }
@@ -40,9 +299,16 @@ vkr_dispatch_vkCopyImageToMemoryMESA(UNUSED struct vn_dispatch_context *dispatch
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   const VkCopyImageToMemoryInfoMESA *info = args->pCopyImageToMemoryInfo;
+   if (!vkr_host_copy_is_region_resident(info->srcImage, &info->imageSubresource,
+                                         info->imageOffset, info->imageExtent)) {
+      memset(args->pData, 0, args->dataSize);
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    vn_replace_vkCopyImageToMemoryMESA_args_handle(args);
 
-   const VkCopyImageToMemoryInfoMESA *info = args->pCopyImageToMemoryInfo;
    const VkImageToMemoryCopy local_region = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_TO_MEMORY_COPY,
       .pHostPointer = args->pData,
@@ -70,10 +336,24 @@ vkr_dispatch_vkCopyMemoryToImageMESA(UNUSED struct vn_dispatch_context *dispatch
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
-   vn_replace_vkCopyMemoryToImageMESA_args_handle(args);
+   /* drop the regions that are not resident, before the handles are replaced */
+   VkCopyMemoryToImageInfoMESA *info =
+      (VkCopyMemoryToImageInfoMESA *)args->pCopyMemoryToImageInfo;
+   VkMemoryToImageCopyMESA *regions = (VkMemoryToImageCopyMESA *)info->pRegions;
+   uint32_t region_count = 0;
+   for (uint32_t i = 0; i < info->regionCount; i++) {
+      if (!vkr_host_copy_is_region_resident(info->dstImage, &regions[i].imageSubresource,
+                                            regions[i].imageOffset, regions[i].imageExtent))
+         continue;
+      regions[region_count++] = regions[i];
+   }
+   info->regionCount = region_count;
+   if (!region_count) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
 
-   const VkCopyMemoryToImageInfoMESA *info = args->pCopyMemoryToImageInfo;
-   const VkMemoryToImageCopyMESA *regions = info->pRegions;
+   vn_replace_vkCopyMemoryToImageMESA_args_handle(args);
 
    STACK_ARRAY(VkMemoryToImageCopy, local_regions, info->regionCount);
 
@@ -97,11 +377,39 @@ vkr_dispatch_vkCopyMemoryToImageMESA(UNUSED struct vn_dispatch_context *dispatch
       .regionCount = info->regionCount,
       .pRegions = local_regions,
    };
-   args->ret = vk->CopyMemoryToImage(args->device, &local_info);
+
+   struct vkr_host_copy_task tasks[VKR_HOST_COPY_THREAD_MAX + 1];
+   const uint32_t task_count = vkr_host_copy_split_regions(dev, &local_info, regions, tasks);
+   if (task_count)
+      args->ret = vkr_host_copy_pool_run(tasks, task_count);
+   else
+      args->ret = vk->CopyMemoryToImage(args->device, &local_info);
 
    STACK_ARRAY_FINISH(local_regions);
 }
 
+void
+vkr_host_copy_fini(void)
+{
+   if (!vkr_host_copy_pool.init_ok)
+      return;
+
+   mtx_lock(&vkr_host_copy_pool.mutex);
+   const bool started = vkr_host_copy_pool.started;
+   vkr_host_copy_pool.quit = true;
+   cnd_broadcast(&vkr_host_copy_pool.task_cond);
+   mtx_unlock(&vkr_host_copy_pool.mutex);
+
+   if (!started)
+      return;
+
+   for (uint32_t i = 0; i < vkr_host_copy_pool.thread_count; i++)
+      thrd_join(vkr_host_copy_pool.threads[i], NULL);
+
+   vkr_host_copy_pool.thread_count = 0;
+   vkr_host_copy_pool.started = false;
+}
+
 void
 vkr_context_init_host_copy_dispatch(struct vkr_context *ctx)
 {
@@ -11,4 +11,8 @@
 void
 vkr_context_init_host_copy_dispatch(struct vkr_context *ctx);
 
+/* stops the threads that split large host image copies */
+void
+vkr_host_copy_fini(void);
+
 #endif /* VKR_HOST_COPY_H */
@@ -5,8 +5,12 @@
 
 #include "vkr_image.h"
 
+#include "vkr_device_memory.h"
 #include "vkr_image_gen.h"
+#include "vkr_memory_requirements.h"
 #include "vkr_physical_device.h"
+#include "vkr_shared_object.h"
+#include "vkr_sparse.h"
 
 static void
 vkr_dispatch_vkCreateImage(struct vn_dispatch_context *dispatch,
@@ -31,13 +35,30 @@ vkr_dispatch_vkCreateImage(struct vn_dispatch_context *dispatch,
     * situation because the app does not consider the memory external.
     */
 
-   vkr_image_create_and_add(dispatch->data, args);
+   struct vkr_image *img = vkr_image_create_and_add(dispatch->data, args);
+   if (!img)
+      return;
+
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   if (args->pCreateInfo->flags & VK_IMAGE_CREATE_SPARSE_BINDING_BIT) {
+      img->sparse =
+         vkr_sparse_residency_create_image(dev, img->base.handle.image, args->pCreateInfo);
+   }
+
+   img->memory_requirements =
+      vkr_memory_requirements_get_image_entry(dev, args->pCreateInfo);
 }
 
 static void
 vkr_dispatch_vkDestroyImage(struct vn_dispatch_context *dispatch,
                             struct vn_command_vkDestroyImage *args)
 {
+   struct vkr_image *img = vkr_image_from_handle(args->image);
+   if (img) {
+      vkr_sparse_residency_destroy(dispatch->data, img->sparse);
+      img->sparse = NULL;
+   }
+
    vkr_image_destroy_and_remove(dispatch->data, args);
 }
 
@@ -48,9 +69,19 @@ vkr_dispatch_vkGetImageMemoryRequirements(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_image *img = vkr_image_from_handle(args->image);
+   VkMemoryRequirements2 reqs = { .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2 };
+
+   if (vkr_memory_requirements_read(dev, img->memory_requirements, &reqs)) {
+      *args->pMemoryRequirements = reqs.memoryRequirements;
+      return;
+   }
 
    vn_replace_vkGetImageMemoryRequirements_args_handle(args);
    vk->GetImageMemoryRequirements(args->device, args->image, args->pMemoryRequirements);
+
+   reqs.memoryRequirements = *args->pMemoryRequirements;
+   vkr_memory_requirements_write(dev, img->memory_requirements, &reqs);
 }
 
 static void
@@ -60,9 +91,18 @@ vkr_dispatch_vkGetImageMemoryRequirements2(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   /* nothing chained to pInfo selects a part of the image */
+   struct vkr_memory_requirements_entry *entry =
+      args->pInfo->pNext ? NULL
+                         : vkr_image_from_handle(args->pInfo->image)->memory_requirements;
+
+   if (vkr_memory_requirements_read(dev, entry, args->pMemoryRequirements))
+      return;
 
    vn_replace_vkGetImageMemoryRequirements2_args_handle(args);
    vk->GetImageMemoryRequirements2(args->device, args->pInfo, args->pMemoryRequirements);
+
+   vkr_memory_requirements_write(dev, entry, args->pMemoryRequirements);
 }
 
 static void
@@ -100,6 +140,7 @@ vkr_dispatch_vkBindImageMemory(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   args->memoryOffset += vkr_device_memory_get_block_offset(args->memory);
    vn_replace_vkBindImageMemory_args_handle(args);
    args->ret =
       vk->BindImageMemory(args->device, args->image, args->memory, args->memoryOffset);
@@ -112,6 +153,10 @@ vkr_dispatch_vkBindImageMemory2(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   for (uint32_t i = 0; i < args->bindInfoCount; i++) {
+      VkBindImageMemoryInfo *info = (VkBindImageMemoryInfo *)&args->pBindInfos[i];
+      info->memoryOffset += vkr_device_memory_get_block_offset(info->memory);
+   }
    vn_replace_vkBindImageMemory2_args_handle(args);
    args->ret = vk->BindImageMemory2(args->device, args->bindInfoCount, args->pBindInfos);
 }
@@ -181,18 +226,72 @@ vkr_dispatch_vkDestroyImageView(struct vn_dispatch_context *dispatch,
    vkr_image_view_destroy_and_remove(dispatch->data, args);
 }
 
+/* samplers with chained structs, like YCbCr conversions, are not shared */
+static bool
+vkr_sampler_init_key(struct vkr_shared_key *key, const VkSamplerCreateInfo *info)
+{
+   memset(key, 0, sizeof(*key));
+   if (info->pNext)
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD_MEMBERS(key, VkSamplerCreateInfo, info, flags,
+                              unnormalizedCoordinates);
+
+   return !key->failed;
+}
+
 static void
 vkr_dispatch_vkCreateSampler(struct vn_dispatch_context *dispatch,
                              struct vn_command_vkCreateSampler *args)
 {
-   vkr_sampler_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   struct vkr_shared_key key = { 0 };
+   if (!dev->shared_objects || !vkr_sampler_init_key(&key, args->pCreateInfo)) {
+      vkr_shared_key_fini(&key);
+      vkr_sampler_create_and_add(ctx, args);
+      return;
+   }
+
+   struct vkr_sampler *sampler = vkr_context_alloc_object(
+      ctx, sizeof(*sampler), VK_OBJECT_TYPE_SAMPLER, args->pSampler);
+   if (!sampler) {
+      vkr_shared_key_fini(&key);
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   sampler->shared = vkr_shared_object_get(dev, &key);
+   if (sampler->shared) {
+      sampler->base.handle.u64 = sampler->shared->handle;
+      args->ret = VK_SUCCESS;
+   } else if (vkr_sampler_create_driver_handle(ctx, args, sampler) == VK_SUCCESS) {
+      sampler->shared = vkr_shared_object_add(dev, &key, sampler->base.handle.u64);
+   } else {
+      vkr_shared_key_fini(&key);
+      free(sampler);
+      return;
+   }
+   vkr_shared_key_fini(&key);
+
+   vkr_device_add_object(ctx, dev, &sampler->base);
 }
 
 static void
 vkr_dispatch_vkDestroySampler(struct vn_dispatch_context *dispatch,
                               struct vn_command_vkDestroySampler *args)
 {
-   vkr_sampler_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_sampler *sampler = vkr_sampler_from_handle(args->sampler);
+   if (sampler && !vkr_shared_object_release(dev, &sampler->base)) {
+      vkr_device_remove_object(ctx, dev, &sampler->base);
+      return;
+   }
+
+   vkr_sampler_destroy_and_remove(ctx, args);
 }
 
 static void
@@ -218,10 +317,17 @@ vkr_dispatch_vkGetDeviceImageMemoryRequirements(
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_memory_requirements_entry *entry =
+      vkr_memory_requirements_get_image_entry(dev, args->pInfo->pCreateInfo);
+
+   if (vkr_memory_requirements_read(dev, entry, args->pMemoryRequirements))
+      return;
 
    vn_replace_vkGetDeviceImageMemoryRequirements_args_handle(args);
    vk->GetDeviceImageMemoryRequirements(args->device, args->pInfo,
                                         args->pMemoryRequirements);
+
+   vkr_memory_requirements_write(dev, entry, args->pMemoryRequirements);
 }
 
 static void
@@ -10,6 +10,12 @@
 
 struct vkr_image {
    struct vkr_object base;
+
+   /* for images created with VK_IMAGE_CREATE_SPARSE_BINDING_BIT */
+   struct vkr_sparse_residency *sparse;
+
+   /* see vkr_memory_requirements.h, NULL when not cached */
+   struct vkr_memory_requirements_entry *memory_requirements;
 };
 VKR_DEFINE_OBJECT_CAST(image, VK_OBJECT_TYPE_IMAGE, VkImage)
 
@@ -20,6 +26,9 @@ VKR_DEFINE_OBJECT_CAST(image_view, VK_OBJECT_TYPE_IMAGE_VIEW, VkImageView)
 
 struct vkr_sampler {
    struct vkr_object base;
+
+   /* NULL when the driver sampler is not shared, see vkr_shared_object.h */
+   struct vkr_shared_object *shared;
 };
 VKR_DEFINE_OBJECT_CAST(sampler, VK_OBJECT_TYPE_SAMPLER, VkSampler)
 
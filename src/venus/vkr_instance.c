@@ -8,6 +8,7 @@
 #include "venus-protocol/vn_protocol_renderer_instance.h"
 
 #include "vkr_context.h"
+#include "vkr_instance_pool.h"
 #include "vkr_physical_device.h"
 
 static void
@@ -123,6 +124,9 @@ vkr_dispatch_vkCreateInstance(struct vn_dispatch_context *dispatch,
    }
 
    VkInstanceCreateInfo *create_info = (VkInstanceCreateInfo *)args->pCreateInfo;
+   /* pooled instances have no validation nor chained structs */
+   const bool poolable = ctx->validate_level == VKR_CONTEXT_VALIDATE_NONE &&
+                         !create_info->pNext && !create_info->flags;
    const char *layer_names[8];
    const char *ext_names[8];
    uint32_t layer_count = 0;
@@ -213,7 +217,12 @@ vkr_dispatch_vkCreateInstance(struct vn_dispatch_context *dispatch,
    instance->api_version = app_info.apiVersion;
 
    vn_replace_vkCreateInstance_args_handle(args);
-   args->ret = vk->CreateInstance(create_info, NULL, &instance->base.handle.instance);
+   instance->base.handle.instance =
+      poolable ? vkr_instance_pool_take(ctx->get_proc_addr, &app_info) : VK_NULL_HANDLE;
+   if (instance->base.handle.instance)
+      args->ret = VK_SUCCESS;
+   else
+      args->ret = vk->CreateInstance(create_info, NULL, &instance->base.handle.instance);
    if (args->ret != VK_SUCCESS) {
       free(instance);
       return;
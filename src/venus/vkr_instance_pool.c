@@ -0,0 +1,332 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_instance_pool.h"
+
+#include "vkr_library.h"
+
+#define VKR_INSTANCE_POOL_MAX_COUNT 8
+/* longer names are not pooled */
+#define VKR_INSTANCE_POOL_NAME_SIZE 128
+
+/* VkApplicationInfo without pointers, zero-filled to be compared with memcmp */
+struct vkr_instance_pool_key {
+   bool has_application_name;
+   bool has_engine_name;
+   char application_name[VKR_INSTANCE_POOL_NAME_SIZE];
+   char engine_name[VKR_INSTANCE_POOL_NAME_SIZE];
+   uint32_t application_version;
+   uint32_t engine_version;
+   uint32_t api_version;
+};
+
+struct vkr_instance_pool_entry {
+   struct list_head head;
+   VkInstance instance;
+};
+
+static struct {
+   once_flag init_once;
+   bool init_ok;
+
+   mtx_t mutex;
+   /* signaled when an instance is taken, or on quit */
+   cnd_t cond;
+
+   struct vulkan_library library;
+   PFN_vkCreateInstance create_instance;
+
+   bool started;
+   bool quit;
+   thrd_t thread;
+
+   /* the instances are created with the key of the last take */
+   bool has_key;
+   struct vkr_instance_pool_key key;
+   uint64_t key_generation;
+
+   struct list_head entries;
+   uint32_t entry_count;
+   /* entries of older keys, destroyed by the pool thread */
+   struct list_head stale_entries;
+} vkr_instance_pool = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static bool
+vkr_instance_pool_init_key(struct vkr_instance_pool_key *key,
+                           const VkApplicationInfo *app_info)
+{
+   memset(key, 0, sizeof(*key));
+
+   if (app_info->pNext)
+      return false;
+
+   if (app_info->pApplicationName) {
+      const size_t len = strlen(app_info->pApplicationName);
+      if (len >= VKR_INSTANCE_POOL_NAME_SIZE)
+         return false;
+      memcpy(key->application_name, app_info->pApplicationName, len);
+      key->has_application_name = true;
+   }
+
+   if (app_info->pEngineName) {
+      const size_t len = strlen(app_info->pEngineName);
+      if (len >= VKR_INSTANCE_POOL_NAME_SIZE)
+         return false;
+      memcpy(key->engine_name, app_info->pEngineName, len);
+      key->has_engine_name = true;
+   }
+
+   key->application_version = app_info->applicationVersion;
+   key->engine_version = app_info->engineVersion;
+   key->api_version = app_info->apiVersion;
+
+   return true;
+}
+
+static VkInstance
+vkr_instance_pool_create_instance(const struct vkr_instance_pool_key *key)
+{
+   const VkApplicationInfo app_info = {
+      .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+      .pApplicationName = key->has_application_name ? key->application_name : NULL,
+      .applicationVersion = key->application_version,
+      .pEngineName = key->has_engine_name ? key->engine_name : NULL,
+      .engineVersion = key->engine_version,
+      .apiVersion = key->api_version,
+   };
+   VkInstanceCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+      .pApplicationInfo = &app_info,
+   };
+
+   /* this must match vkr_dispatch_vkCreateInstance */
+#ifdef __APPLE__
+   const char *ext_names[] = { VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME };
+   create_info.flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
+   create_info.enabledExtensionCount = ARRAY_SIZE(ext_names);
+   create_info.ppEnabledExtensionNames = ext_names;
+#endif
+
+   VkInstance instance;
+   if (vkr_instance_pool.create_instance(&create_info, NULL, &instance) != VK_SUCCESS)
+      return VK_NULL_HANDLE;
+
+   return instance;
+}
+
+static void
+vkr_instance_pool_destroy_instance(VkInstance instance)
+{
+   PFN_vkDestroyInstance destroy_instance =
+      (PFN_vkDestroyInstance)vkr_instance_pool.library.GetInstanceProcAddr(
+         instance, "vkDestroyInstance");
+   destroy_instance(instance, NULL);
+}
+
+static void
+vkr_instance_pool_destroy_entries(struct list_head *entries)
+{
+   list_for_each_entry_safe (struct vkr_instance_pool_entry, entry, entries, head) {
+      vkr_instance_pool_destroy_instance(entry->instance);
+      free(entry);
+   }
+   list_inithead(entries);
+}
+
+static inline bool
+vkr_instance_pool_needs_fill_locked(void)
+{
+   return vkr_instance_pool.has_key &&
+          vkr_instance_pool.entry_count <
+             MIN2(vkr_instance_pool_size, VKR_INSTANCE_POOL_MAX_COUNT);
+}
+
+static bool
+vkr_instance_pool_has_work_locked(void)
+{
+   return vkr_instance_pool.quit || !list_is_empty(&vkr_instance_pool.stale_entries) ||
+          vkr_instance_pool_needs_fill_locked();
+}
+
+static int
+vkr_instance_pool_thread(UNUSED void *arg)
+{
+   mtx_lock(&vkr_instance_pool.mutex);
+
+   while (true) {
+      while (!vkr_instance_pool_has_work_locked())
+         cnd_wait(&vkr_instance_pool.cond, &vkr_instance_pool.mutex);
+      if (vkr_instance_pool.quit)
+         break;
+
+      struct list_head stale_entries;
+      list_replace(&vkr_instance_pool.stale_entries, &stale_entries);
+      list_inithead(&vkr_instance_pool.stale_entries);
+
+      const bool fill = vkr_instance_pool_needs_fill_locked();
+      const struct vkr_instance_pool_key key = vkr_instance_pool.key;
+      const uint64_t key_generation = vkr_instance_pool.key_generation;
+
+      mtx_unlock(&vkr_instance_pool.mutex);
+
+      vkr_instance_pool_destroy_entries(&stale_entries);
+
+      struct vkr_instance_pool_entry *entry = NULL;
+      if (fill) {
+         entry = calloc(1, sizeof(*entry));
+         if (entry) {
+            entry->instance = vkr_instance_pool_create_instance(&key);
+            if (!entry->instance) {
+               free(entry);
+               entry = NULL;
+            }
+         }
+      }
+
+      mtx_lock(&vkr_instance_pool.mutex);
+
+      if (!fill)
+         continue;
+
+      if (!entry) {
+         /* retry on the next take */
+         vkr_log("failed to create a pooled instance");
+         if (vkr_instance_pool.key_generation == key_generation)
+            vkr_instance_pool.has_key = false;
+         continue;
+      }
+
+      if (vkr_instance_pool.key_generation == key_generation) {
+         list_addtail(&entry->head, &vkr_instance_pool.entries);
+         vkr_instance_pool.entry_count++;
+      } else {
+         list_addtail(&entry->head, &vkr_instance_pool.stale_entries);
+      }
+   }
+
+   mtx_unlock(&vkr_instance_pool.mutex);
+
+   return 0;
+}
+
+static void
+vkr_instance_pool_init_once(void)
+{
+   if (mtx_init(&vkr_instance_pool.mutex, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vkr_instance_pool.cond) != thrd_success) {
+      mtx_destroy(&vkr_instance_pool.mutex);
+      return;
+   }
+
+   list_inithead(&vkr_instance_pool.entries);
+   list_inithead(&vkr_instance_pool.stale_entries);
+   vkr_instance_pool.init_ok = true;
+}
+
+static bool
+vkr_instance_pool_start_locked(void)
+{
+   if (vkr_instance_pool.started)
+      return true;
+
+   /* the pool keeps its own reference to the library */
+   if (!vkr_library_load(&vkr_instance_pool.library))
+      return false;
+
+   vkr_instance_pool.create_instance =
+      (PFN_vkCreateInstance)vkr_instance_pool.library.GetInstanceProcAddr(
+         VK_NULL_HANDLE, "vkCreateInstance");
+   if (!vkr_instance_pool.create_instance ||
+       thrd_create(&vkr_instance_pool.thread, vkr_instance_pool_thread, NULL) !=
+          thrd_success) {
+      vkr_library_unload(&vkr_instance_pool.library);
+      return false;
+   }
+
+   vkr_instance_pool.started = true;
+   return true;
+}
+
+VkInstance
+vkr_instance_pool_take(PFN_vkGetInstanceProcAddr get_proc_addr,
+                       const VkApplicationInfo *app_info)
+{
+   if (!vkr_instance_pool_size)
+      return VK_NULL_HANDLE;
+
+   struct vkr_instance_pool_key key;
+   if (!vkr_instance_pool_init_key(&key, app_info))
+      return VK_NULL_HANDLE;
+
+   call_once(&vkr_instance_pool.init_once, vkr_instance_pool_init_once);
+   if (!vkr_instance_pool.init_ok)
+      return VK_NULL_HANDLE;
+
+   VkInstance instance = VK_NULL_HANDLE;
+
+   mtx_lock(&vkr_instance_pool.mutex);
+
+   if (vkr_instance_pool.quit || !vkr_instance_pool_start_locked()) {
+      mtx_unlock(&vkr_instance_pool.mutex);
+      return VK_NULL_HANDLE;
+   }
+
+   if (vkr_instance_pool.has_key && !memcmp(&vkr_instance_pool.key, &key, sizeof(key))) {
+      /* a pooled instance is only usable with the same library */
+      if (!list_is_empty(&vkr_instance_pool.entries) &&
+          get_proc_addr == vkr_instance_pool.library.GetInstanceProcAddr) {
+         struct vkr_instance_pool_entry *entry = list_first_entry(
+            &vkr_instance_pool.entries, struct vkr_instance_pool_entry, head);
+         list_del(&entry->head);
+         vkr_instance_pool.entry_count--;
+
+         instance = entry->instance;
+         free(entry);
+      }
+   } else {
+      list_splicetail(&vkr_instance_pool.entries, &vkr_instance_pool.stale_entries);
+      list_inithead(&vkr_instance_pool.entries);
+      vkr_instance_pool.entry_count = 0;
+
+      vkr_instance_pool.key = key;
+      vkr_instance_pool.key_generation++;
+   }
+   vkr_instance_pool.has_key = true;
+
+   cnd_signal(&vkr_instance_pool.cond);
+   mtx_unlock(&vkr_instance_pool.mutex);
+
+   return instance;
+}
+
+void
+vkr_instance_pool_fini(void)
+{
+   if (!vkr_instance_pool.init_ok)
+      return;
+
+   mtx_lock(&vkr_instance_pool.mutex);
+   const bool started = vkr_instance_pool.started;
+   vkr_instance_pool.quit = true;
+   cnd_signal(&vkr_instance_pool.cond);
+   mtx_unlock(&vkr_instance_pool.mutex);
+
+   if (!started)
+      return;
+
+   thrd_join(vkr_instance_pool.thread, NULL);
+
+   vkr_instance_pool_destroy_entries(&vkr_instance_pool.entries);
+   vkr_instance_pool_destroy_entries(&vkr_instance_pool.stale_entries);
+   vkr_instance_pool.entry_count = 0;
+   vkr_instance_pool.has_key = false;
+
+   vkr_library_unload(&vkr_instance_pool.library);
+   vkr_instance_pool.started = false;
+   vkr_instance_pool.quit = false;
+}
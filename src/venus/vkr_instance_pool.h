@@ -0,0 +1,32 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_INSTANCE_POOL_H
+#define VKR_INSTANCE_POOL_H
+
+#include "vkr_common.h"
+
+/* Instances created ahead of the guests asking for them.
+ *
+ * vkCreateInstance loads and initializes the host drivers, which takes tens
+ * of milliseconds.  With VKR_INSTANCE_POOL=n, a pool thread keeps up to n
+ * instances ready, created with the application info of the last instance a
+ * guest asked for.  An instance with the same application info is then taken
+ * from the pool instead of being created.  The pool only helps the contexts
+ * of the process it lives in.
+ */
+
+/* Returns a pooled instance created with app_info, without validation nor
+ * chained structs, or VK_NULL_HANDLE.  The instance belongs to the caller.
+ */
+VkInstance
+vkr_instance_pool_take(PFN_vkGetInstanceProcAddr get_proc_addr,
+                       const VkApplicationInfo *app_info);
+
+/* stops the pool thread and destroys the pooled instances */
+void
+vkr_instance_pool_fini(void);
+
+#endif /* VKR_INSTANCE_POOL_H */
@@ -8,17 +8,11 @@
 
 #include <dlfcn.h>
 
-void
-vkr_library_preload_icd(void)
+static void
+vkr_library_load_icd(const struct vulkan_library *lib)
 {
-#ifdef ENABLE_VULKAN_PRELOAD
-   struct vulkan_library lib = { 0 };
-
-   if (!vkr_library_load(&lib))
-      return;
-
    /* Get vkGetInstanceProcAddr from libvulkan */
-   PFN_vkGetInstanceProcAddr get_proc_addr = lib.GetInstanceProcAddr;
+   PFN_vkGetInstanceProcAddr get_proc_addr = lib->GetInstanceProcAddr;
 
    PFN_vkEnumerateInstanceExtensionProperties enumerate_inst_ext_props =
       (PFN_vkEnumerateInstanceExtensionProperties)get_proc_addr(
@@ -28,11 +22,35 @@ vkr_library_preload_icd(void)
       uint32_t unused_count;
       enumerate_inst_ext_props(NULL, &unused_count, NULL);
    }
+}
+
+void
+vkr_library_preload_icd(void)
+{
+#ifdef ENABLE_VULKAN_PRELOAD
+   struct vulkan_library lib = { 0 };
+
+   if (!vkr_library_load(&lib))
+      return;
+
+   vkr_library_load_icd(&lib);
 
    vkr_library_unload(&lib);
 #endif
 }
 
+void
+vkr_library_warm_up(void)
+{
+   /* never unloaded */
+   static struct vulkan_library lib;
+
+   if (!vkr_library_load(&lib))
+      return;
+
+   vkr_library_load_icd(&lib);
+}
+
 #if defined(ENABLE_VULKAN_DLOAD)
 
 bool
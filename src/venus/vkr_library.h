@@ -18,6 +18,12 @@ struct vulkan_library {
 void
 vkr_library_preload_icd(void);
 
+/* Loads libvulkan and the ICDs ahead of the first context of a process.
+ * libvulkan is kept loaded for the rest of the process.
+ */
+void
+vkr_library_warm_up(void);
+
 #if defined(ENABLE_VULKAN_DLOAD)
 
 bool
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_memory_requirements.h"
+
+#include "vkr_device.h"
+
+/* create infos with larger keys are not cached */
+#define VKR_MEMORY_REQUIREMENTS_KEY_MAX_SIZE 256
+/* no entry is added to a device that has this many */
+#define VKR_MEMORY_REQUIREMENTS_MAX_ENTRIES 4096
+
+struct vkr_memory_requirements_key {
+   uint32_t size;
+   uint8_t data[VKR_MEMORY_REQUIREMENTS_KEY_MAX_SIZE];
+};
+
+struct vkr_memory_requirements_entry {
+   struct vkr_memory_requirements_key key;
+
+   /* whether requirements, and dedicated, have been filled */
+   bool valid;
+   bool dedicated_valid;
+   VkMemoryRequirements requirements;
+   VkMemoryDedicatedRequirements dedicated;
+};
+
+static bool
+vkr_memory_requirements_key_add(struct vkr_memory_requirements_key *key,
+                                const void *data,
+                                size_t size)
+{
+   if (size > sizeof(key->data) - key->size)
+      return false;
+
+   memcpy(key->data + key->size, data, size);
+   key->size += size;
+   return true;
+}
+
+#define VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, val)                                        \
+   vkr_memory_requirements_key_add(key, &(val), sizeof(val))
+
+static bool
+vkr_memory_requirements_key_add_queue_families(struct vkr_memory_requirements_key *key,
+                                               VkSharingMode sharing_mode,
+                                               uint32_t count,
+                                               const uint32_t *indices)
+{
+   if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, sharing_mode))
+      return false;
+   if (sharing_mode != VK_SHARING_MODE_CONCURRENT)
+      return true;
+
+   return VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, count) &&
+          vkr_memory_requirements_key_add(key, indices, sizeof(*indices) * count);
+}
+
+static bool
+vkr_memory_requirements_init_buffer_key(struct vkr_memory_requirements_key *key,
+                                        const VkBufferCreateInfo *info)
+{
+   key->size = 0;
+   if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->sType) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->flags) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->size) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->usage) ||
+       !vkr_memory_requirements_key_add_queue_families(key, info->sharingMode,
+                                                       info->queueFamilyIndexCount,
+                                                       info->pQueueFamilyIndices))
+      return false;
+
+   for (const VkBaseInStructure *s = info->pNext; s; s = s->pNext) {
+      switch (s->sType) {
+      case VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO: {
+         const VkExternalMemoryBufferCreateInfo *ext = (const void *)s;
+         if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, ext->sType) ||
+             !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, ext->handleTypes))
+            return false;
+         break;
+      }
+      default:
+         return false;
+      }
+   }
+
+   return true;
+}
+
+static bool
+vkr_memory_requirements_init_image_key(struct vkr_memory_requirements_key *key,
+                                       const VkImageCreateInfo *info)
+{
+   /* the planes of disjoint images have requirements of their own, and the
+    * layout of modifier images is picked by the driver
+    */
+   if ((info->flags & VK_IMAGE_CREATE_DISJOINT_BIT) ||
+       info->tiling == VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT)
+      return false;
+
+   key->size = 0;
+   if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->sType) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->flags) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->imageType) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->format) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->extent) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->mipLevels) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->arrayLayers) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->samples) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->tiling) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->usage) ||
+       !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, info->initialLayout) ||
+       !vkr_memory_requirements_key_add_queue_families(key, info->sharingMode,
+                                                       info->queueFamilyIndexCount,
+                                                       info->pQueueFamilyIndices))
+      return false;
+
+   for (const VkBaseInStructure *s = info->pNext; s; s = s->pNext) {
+      switch (s->sType) {
+      case VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO: {
+         const VkExternalMemoryImageCreateInfo *ext = (const void *)s;
+         if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, ext->sType) ||
+             !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, ext->handleTypes))
+            return false;
+         break;
+      }
+      case VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO: {
+         const VkImageFormatListCreateInfo *list = (const void *)s;
+         if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, list->sType) ||
+             !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, list->viewFormatCount) ||
+             !vkr_memory_requirements_key_add(key, list->pViewFormats,
+                                              sizeof(*list->pViewFormats) *
+                                                 list->viewFormatCount))
+            return false;
+         break;
+      }
+      case VK_STRUCTURE_TYPE_IMAGE_STENCIL_USAGE_CREATE_INFO: {
+         const VkImageStencilUsageCreateInfo *stencil = (const void *)s;
+         if (!VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, stencil->sType) ||
+             !VKR_MEMORY_REQUIREMENTS_KEY_ADD(key, stencil->stencilUsage))
+            return false;
+         break;
+      }
+      default:
+         return false;
+      }
+   }
+
+   return true;
+}
+
+static uint32_t
+vkr_memory_requirements_key_hash(const void *key)
+{
+   const struct vkr_memory_requirements_key *k = key;
+   return _mesa_hash_data(k->data, k->size);
+}
+
+static bool
+vkr_memory_requirements_key_equal(const void *a, const void *b)
+{
+   const struct vkr_memory_requirements_key *ka = a;
+   const struct vkr_memory_requirements_key *kb = b;
+   return ka->size == kb->size && !memcmp(ka->data, kb->data, ka->size);
+}
+
+static void
+vkr_memory_requirements_free_entry(struct hash_entry *entry)
+{
+   free(entry->data);
+}
+
+void
+vkr_device_init_memory_requirements_cache(struct vkr_device *dev)
+{
+   dev->memory_requirements = NULL;
+   if (mtx_init(&dev->memory_requirements_mutex, mtx_plain) != thrd_success)
+      return;
+
+   dev->memory_requirements = _mesa_hash_table_create(
+      NULL, vkr_memory_requirements_key_hash, vkr_memory_requirements_key_equal);
+   if (!dev->memory_requirements)
+      mtx_destroy(&dev->memory_requirements_mutex);
+}
+
+void
+vkr_device_fini_memory_requirements_cache(struct vkr_device *dev)
+{
+   if (!dev->memory_requirements)
+      return;
+
+   _mesa_hash_table_destroy(dev->memory_requirements, vkr_memory_requirements_free_entry);
+   dev->memory_requirements = NULL;
+   mtx_destroy(&dev->memory_requirements_mutex);
+}
+
+static struct vkr_memory_requirements_entry *
+vkr_memory_requirements_get_entry(struct vkr_device *dev,
+                                  const struct vkr_memory_requirements_key *key)
+{
+   mtx_lock(&dev->memory_requirements_mutex);
+
+   struct vkr_memory_requirements_entry *entry = NULL;
+   const uint32_t hash = vkr_memory_requirements_key_hash(key);
+   struct hash_entry *he =
+      _mesa_hash_table_search_pre_hashed(dev->memory_requirements, hash, key);
+   if (he) {
+      entry = he->data;
+   } else if (dev->memory_requirements->entries < VKR_MEMORY_REQUIREMENTS_MAX_ENTRIES) {
+      entry = calloc(1, sizeof(*entry));
+      if (entry) {
+         entry->key.size = key->size;
+         memcpy(entry->key.data, key->data, key->size);
+         if (!_mesa_hash_table_insert_pre_hashed(dev->memory_requirements, hash,
+                                                 &entry->key, entry)) {
+            free(entry);
+            entry = NULL;
+         }
+      }
+   }
+
+   mtx_unlock(&dev->memory_requirements_mutex);
+
+   return entry;
+}
+
+struct vkr_memory_requirements_entry *
+vkr_memory_requirements_get_buffer_entry(struct vkr_device *dev,
+                                         const VkBufferCreateInfo *info)
+{
+   struct vkr_memory_requirements_key key;
+   if (!dev->memory_requirements || !vkr_memory_requirements_init_buffer_key(&key, info))
+      return NULL;
+
+   return vkr_memory_requirements_get_entry(dev, &key);
+}
+
+struct vkr_memory_requirements_entry *
+vkr_memory_requirements_get_image_entry(struct vkr_device *dev,
+                                        const VkImageCreateInfo *info)
+{
+   struct vkr_memory_requirements_key key;
+   if (!dev->memory_requirements || !vkr_memory_requirements_init_image_key(&key, info))
+      return NULL;
+
+   return vkr_memory_requirements_get_entry(dev, &key);
+}
+
+/* returns the VkMemoryDedicatedRequirements chained to reqs, or false when
+ * something else is chained
+ */
+static bool
+vkr_memory_requirements_get_dedicated(const VkMemoryRequirements2 *reqs,
+                                      VkMemoryDedicatedRequirements **dedicated)
+{
+   *dedicated = NULL;
+   for (VkBaseOutStructure *s = reqs->pNext; s; s = s->pNext) {
+      if (s->sType != VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS)
+         return false;
+      *dedicated = (VkMemoryDedicatedRequirements *)s;
+   }
+   return true;
+}
+
+bool
+vkr_memory_requirements_read(struct vkr_device *dev,
+                             const struct vkr_memory_requirements_entry *entry,
+                             VkMemoryRequirements2 *reqs)
+{
+   VkMemoryDedicatedRequirements *dedicated;
+   if (!entry || !vkr_memory_requirements_get_dedicated(reqs, &dedicated))
+      return false;
+
+   mtx_lock(&dev->memory_requirements_mutex);
+
+   const bool hit = entry->valid && (!dedicated || entry->dedicated_valid);
+   if (hit) {
+      reqs->memoryRequirements = entry->requirements;
+      if (dedicated) {
+         dedicated->prefersDedicatedAllocation =
+            entry->dedicated.prefersDedicatedAllocation;
+         dedicated->requiresDedicatedAllocation =
+            entry->dedicated.requiresDedicatedAllocation;
+      }
+   }
+
+   mtx_unlock(&dev->memory_requirements_mutex);
+
+   return hit;
+}
+
+void
+vkr_memory_requirements_write(struct vkr_device *dev,
+                              struct vkr_memory_requirements_entry *entry,
+                              const VkMemoryRequirements2 *reqs)
+{
+   VkMemoryDedicatedRequirements *dedicated;
+   if (!entry || !vkr_memory_requirements_get_dedicated(reqs, &dedicated))
+      return;
+
+   mtx_lock(&dev->memory_requirements_mutex);
+
+   entry->requirements = reqs->memoryRequirements;
+   entry->valid = true;
+   if (dedicated) {
+      entry->dedicated = *dedicated;
+      entry->dedicated.pNext = NULL;
+      entry->dedicated_valid = true;
+   }
+
+   mtx_unlock(&dev->memory_requirements_mutex);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_MEMORY_REQUIREMENTS_H
+#define VKR_MEMORY_REQUIREMENTS_H
+
+#include "vkr_common.h"
+
+/* Per-device cache of the memory requirements of buffers and images.
+ *
+ * Buffers and images created with identical create infos have identical
+ * memory requirements, which are also what the vkGetDevice*MemoryRequirements
+ * of the create infos return.  Entries are keyed by the create info and the
+ * structs chained to it, and are only made for chains of known structs that
+ * do not select a memory layout of their own.  Buffers and images point to
+ * their entry, which is filled by the first query of the requirements and
+ * answers the later ones.
+ */
+
+struct vkr_memory_requirements_entry;
+
+void
+vkr_device_init_memory_requirements_cache(struct vkr_device *dev);
+
+void
+vkr_device_fini_memory_requirements_cache(struct vkr_device *dev);
+
+/* Returns NULL when the create info is not cached. */
+struct vkr_memory_requirements_entry *
+vkr_memory_requirements_get_buffer_entry(struct vkr_device *dev,
+                                         const VkBufferCreateInfo *info);
+
+struct vkr_memory_requirements_entry *
+vkr_memory_requirements_get_image_entry(struct vkr_device *dev,
+                                        const VkImageCreateInfo *info);
+
+/* Returns true when reqs has been filled from the entry. */
+bool
+vkr_memory_requirements_read(struct vkr_device *dev,
+                             const struct vkr_memory_requirements_entry *entry,
+                             VkMemoryRequirements2 *reqs);
+
+/* stores reqs, as returned by the driver, to the entry */
+void
+vkr_memory_requirements_write(struct vkr_device *dev,
+                              struct vkr_memory_requirements_entry *entry,
+                              const VkMemoryRequirements2 *reqs);
+
+#endif /* VKR_MEMORY_REQUIREMENTS_H */
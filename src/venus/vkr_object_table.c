@@ -0,0 +1,233 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_object_table.h"
+
+#define VKR_OBJECT_TABLE_MIN_ORDER 6
+
+static struct vkr_object_table_array *
+vkr_object_table_array_create(uint32_t order)
+{
+   struct vkr_object_table_array *array =
+      calloc(1, sizeof(*array) + sizeof(array->slots[0]) * (1u << order));
+   if (!array)
+      return NULL;
+
+   array->order = order;
+   array->mask = (1u << order) - 1;
+
+   return array;
+}
+
+static struct vkr_object_table_slot *
+vkr_object_table_find_slot(struct vkr_object_table_array *array, vkr_object_id id)
+{
+   for (uint32_t i = vkr_object_table_hash(array, id);; i = (i + 1) & array->mask) {
+      struct vkr_object_table_slot *slot = &array->slots[i];
+      const vkr_object_id slot_id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+      if (slot_id == id)
+         return slot;
+      if (!slot_id)
+         return NULL;
+   }
+}
+
+static void
+vkr_object_table_reclaim_locked(struct vkr_object_table *table)
+{
+   if (!table->retired)
+      return;
+
+   /* a reader that is not active will load the current array next time */
+   list_for_each_entry (struct vkr_object_table_reader, reader, &table->readers, head) {
+      if (atomic_load(&reader->active))
+         return;
+   }
+
+   while (table->retired) {
+      struct vkr_object_table_array *array = table->retired;
+      table->retired = array->retired_next;
+      free(array);
+   }
+}
+
+/* Moves the live objects to a new array, sized for twice as many objects as
+ * there are now.  The removed ones are dropped.
+ */
+static bool
+vkr_object_table_rehash_locked(struct vkr_object_table *table)
+{
+   struct vkr_object_table_array *old_array = atomic_load(&table->array);
+
+   uint32_t order = VKR_OBJECT_TABLE_MIN_ORDER;
+   while ((1u << order) < (table->count + 1) * 4) {
+      if (++order >= 32)
+         return false;
+   }
+
+   struct vkr_object_table_array *array = vkr_object_table_array_create(order);
+   if (!array)
+      return false;
+
+   for (uint32_t i = 0; i <= old_array->mask; i++) {
+      struct vkr_object *obj =
+         atomic_load_explicit(&old_array->slots[i].obj, memory_order_relaxed);
+      if (!obj)
+         continue;
+
+      uint32_t j = vkr_object_table_hash(array, obj->id);
+      while (array->slots[j].id)
+         j = (j + 1) & array->mask;
+      array->slots[j].id = obj->id;
+      array->slots[j].obj = obj;
+   }
+
+   /* readers see the filled array or the old one */
+   atomic_store(&table->array, array);
+   table->used = table->count;
+
+   old_array->retired_next = table->retired;
+   table->retired = old_array;
+
+   return true;
+}
+
+bool
+vkr_object_table_init(struct vkr_object_table *table)
+{
+   memset(table, 0, sizeof(*table));
+
+   if (mtx_init(&table->mutex, mtx_plain) != thrd_success)
+      return false;
+
+   table->array = vkr_object_table_array_create(VKR_OBJECT_TABLE_MIN_ORDER);
+   if (!table->array) {
+      mtx_destroy(&table->mutex);
+      return false;
+   }
+
+   list_inithead(&table->readers);
+
+   return true;
+}
+
+void
+vkr_object_table_fini(struct vkr_object_table *table)
+{
+   struct vkr_object_table_array *array = atomic_load(&table->array);
+
+   for (uint32_t i = 0; i <= array->mask; i++)
+      free(array->slots[i].obj);
+   free(array);
+
+   while (table->retired) {
+      array = table->retired;
+      table->retired = array->retired_next;
+      free(array);
+   }
+
+   mtx_destroy(&table->mutex);
+}
+
+void
+vkr_object_table_add_reader(struct vkr_object_table *table,
+                            struct vkr_object_table_reader *reader)
+{
+   atomic_init(&reader->active, false);
+
+   mtx_lock(&table->mutex);
+   list_addtail(&reader->head, &table->readers);
+   mtx_unlock(&table->mutex);
+}
+
+void
+vkr_object_table_remove_reader(struct vkr_object_table *table,
+                               struct vkr_object_table_reader *reader)
+{
+   mtx_lock(&table->mutex);
+   list_del(&reader->head);
+   mtx_unlock(&table->mutex);
+}
+
+struct vkr_object *
+vkr_object_table_search_locked(struct vkr_object_table *table, vkr_object_id id)
+{
+   if (!id)
+      return NULL;
+
+   struct vkr_object_table_slot *slot =
+      vkr_object_table_find_slot(atomic_load(&table->array), id);
+   return slot ? atomic_load_explicit(&slot->obj, memory_order_relaxed) : NULL;
+}
+
+bool
+vkr_object_table_insert_locked(struct vkr_object_table *table, struct vkr_object *obj)
+{
+   struct vkr_object_table_array *array = atomic_load(&table->array);
+
+   assert(obj->id);
+   assert(!vkr_object_table_search_locked(table, obj->id));
+
+   /* reuse the slot of the same id, or the first one of a removed object */
+   struct vkr_object_table_slot *target = NULL;
+   uint32_t i = vkr_object_table_hash(array, obj->id);
+   for (;; i = (i + 1) & array->mask) {
+      struct vkr_object_table_slot *slot = &array->slots[i];
+      const vkr_object_id slot_id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+      if (!slot_id)
+         break;
+      if (slot_id == obj->id) {
+         target = slot;
+         break;
+      }
+      if (!target && !atomic_load_explicit(&slot->obj, memory_order_relaxed))
+         target = slot;
+   }
+
+   if (!target) {
+      /* keep at least half of the slots empty */
+      if ((table->used + 1) * 2 > array->mask + 1) {
+         if (vkr_object_table_rehash_locked(table)) {
+            vkr_object_table_reclaim_locked(table);
+            return vkr_object_table_insert_locked(table, obj);
+         }
+         /* a lookup must always reach an empty slot */
+         if (table->used + 1 > array->mask)
+            return false;
+      }
+
+      target = &array->slots[i];
+      table->used++;
+   }
+
+   /* the object is visible once its id and pointer are both stored */
+   if (atomic_load_explicit(&target->id, memory_order_relaxed) != obj->id) {
+      atomic_store_explicit(&target->obj, NULL, memory_order_relaxed);
+      atomic_store_explicit(&target->id, obj->id, memory_order_release);
+   }
+   atomic_store_explicit(&target->obj, obj, memory_order_release);
+   table->count++;
+
+   return true;
+}
+
+struct vkr_object *
+vkr_object_table_remove_locked(struct vkr_object_table *table, vkr_object_id id)
+{
+   struct vkr_object_table_slot *slot =
+      vkr_object_table_find_slot(atomic_load(&table->array), id);
+   struct vkr_object *obj =
+      slot ? atomic_load_explicit(&slot->obj, memory_order_relaxed) : NULL;
+   if (!obj)
+      return NULL;
+
+   atomic_store_explicit(&slot->obj, NULL, memory_order_release);
+   atomic_fetch_add_explicit(&table->generation, 1, memory_order_release);
+   table->count--;
+
+   vkr_object_table_reclaim_locked(table);
+
+   return obj;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_OBJECT_TABLE_H
+#define VKR_OBJECT_TABLE_H
+
+#include "vkr_common.h"
+
+/* The objects of a context, keyed by their ids.
+ *
+ * Decoders look objects up without taking a lock, so that rings can decode in
+ * parallel.  Everything else holds the table mutex.  The table uses open
+ * addressing.  A removed object leaves its id in the slot, so a lookup
+ * running next to a writer always ends at an empty slot.  When the table
+ * grows, the old slots stay allocated until no reader is inside a lookup.
+ */
+
+struct vkr_object_table_slot {
+   atomic_uint_least64_t id;
+   struct vkr_object *_Atomic obj;
+};
+
+struct vkr_object_table_array {
+   struct vkr_object_table_array *retired_next;
+   uint32_t order;
+   uint32_t mask;
+   struct vkr_object_table_slot slots[];
+};
+
+/* a thread that looks objects up without the table mutex */
+struct vkr_object_table_reader {
+   struct list_head head;
+   atomic_bool active;
+};
+
+struct vkr_object_table {
+   /* held by everything but vkr_object_table_lookup */
+   mtx_t mutex;
+
+   struct vkr_object_table_array *_Atomic array;
+   /* arrays that were replaced, freed once the readers are done with them */
+   struct vkr_object_table_array *retired;
+
+   /* live objects and slots that are not empty */
+   uint32_t count;
+   uint32_t used;
+
+   /* incremented whenever an object is removed, cached lookups are valid
+    * while it does not change
+    */
+   atomic_uint_least64_t generation;
+
+   struct list_head readers;
+};
+
+bool
+vkr_object_table_init(struct vkr_object_table *table);
+
+/* frees the objects still in the table */
+void
+vkr_object_table_fini(struct vkr_object_table *table);
+
+void
+vkr_object_table_add_reader(struct vkr_object_table *table,
+                            struct vkr_object_table_reader *reader);
+
+void
+vkr_object_table_remove_reader(struct vkr_object_table *table,
+                               struct vkr_object_table_reader *reader);
+
+struct vkr_object *
+vkr_object_table_search_locked(struct vkr_object_table *table, vkr_object_id id);
+
+bool
+vkr_object_table_insert_locked(struct vkr_object_table *table, struct vkr_object *obj);
+
+/* returns the removed object, which the caller frees */
+struct vkr_object *
+vkr_object_table_remove_locked(struct vkr_object_table *table, vkr_object_id id);
+
+static inline uint64_t
+vkr_object_table_generation(const struct vkr_object_table *table)
+{
+   return atomic_load_explicit(&table->generation, memory_order_acquire);
+}
+
+static inline uint32_t
+vkr_object_table_hash(const struct vkr_object_table_array *array, vkr_object_id id)
+{
+   /* ids are mostly sequential, fibonacci hashing spreads them well */
+   return (id * 0x9e3779b97f4a7c15ull) >> (64 - array->order);
+}
+
+static inline struct vkr_object *
+vkr_object_table_lookup(struct vkr_object_table *table,
+                        struct vkr_object_table_reader *reader,
+                        vkr_object_id id)
+{
+   struct vkr_object *obj = NULL;
+
+   /* pairs with the array store and the reader check of the writers, the
+    * array cannot be retired and freed between the two loads below
+    */
+   atomic_store(&reader->active, true);
+   const struct vkr_object_table_array *array = atomic_load(&table->array);
+
+   for (uint32_t i = vkr_object_table_hash(array, id);; i = (i + 1) & array->mask) {
+      const vkr_object_id slot_id =
+         atomic_load_explicit(&array->slots[i].id, memory_order_acquire);
+      if (slot_id == id) {
+         obj = atomic_load_explicit(&array->slots[i].obj, memory_order_acquire);
+         break;
+      }
+      if (!slot_id)
+         break;
+   }
+
+   atomic_store_explicit(&reader->active, false, memory_order_release);
+
+   return obj;
+}
+
+#endif /* VKR_OBJECT_TABLE_H */
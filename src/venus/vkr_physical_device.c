@@ -232,7 +232,11 @@ vkr_physical_device_init_memory_properties(struct vkr_physical_device *physical_
          (props.externalMemoryProperties.exportFromImportedHandleTypes &
           VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT);
    }
+}
 
+static void
+vkr_physical_device_init_memory_allocators(struct vkr_physical_device *physical_dev)
+{
    /* fallback to gbm allocation with dma-buf import */
    if (!physical_dev->is_dma_buf_fd_export_supported &&
        !physical_dev->is_opaque_fd_export_supported &&
@@ -409,6 +413,482 @@ vkr_physical_device_init_queue_family_properties(struct vkr_physical_device *phy
    physical_dev->queue_family_properties = props;
 }
 
+/* The results of the physical device queries that cannot change are shared by
+ * all contexts of the process.  A cache is keyed by the device and driver UUIDs,
+ * and lives until vkr_physical_device_fini_caches.
+ */
+#define VKR_PHYSICAL_DEVICE_CACHE_MAX_FORMATS 4096
+
+struct vkr_physical_device_format_entry {
+   VkFormat format;
+   VkFormatProperties props;
+};
+
+struct vkr_physical_device_image_format_key {
+   VkFormat format;
+   VkImageType type;
+   VkImageTiling tiling;
+   VkImageUsageFlags usage;
+   VkImageCreateFlags flags;
+};
+
+struct vkr_physical_device_image_format_entry {
+   struct vkr_physical_device_image_format_key key;
+   VkResult result;
+   VkImageFormatProperties props;
+};
+
+struct vkr_physical_device_cache {
+   struct list_head head;
+   uint8_t device_uuid[VK_UUID_SIZE];
+   uint8_t driver_uuid[VK_UUID_SIZE];
+
+   /* set when the cache is created */
+   VkPhysicalDeviceProperties properties;
+   VkExtensionProperties *extensions;
+   uint32_t extension_count;
+   bool KHR_external_memory_fd;
+   bool EXT_external_memory_dma_buf;
+   bool EXT_external_memory_host;
+   bool EXT_image_drm_format_modifier;
+   bool use_host_pointer_import;
+   VkDeviceSize min_imported_host_pointer_alignment;
+   bool KHR_external_fence_fd;
+   VkPhysicalDeviceMemoryProperties memory_properties;
+   bool is_dma_buf_fd_export_supported;
+   bool is_opaque_fd_export_supported;
+   VkQueueFamilyProperties *queue_family_properties;
+   uint32_t queue_family_property_count;
+
+   /* filled as the formats are queried */
+   mtx_t mutex;
+   struct hash_table *format_properties;
+   struct hash_table *image_format_properties;
+
+   /* filled as devices are created */
+   struct list_head device_proc_tables;
+   uint32_t device_proc_table_count;
+};
+
+/* the entry points resolved for a device with the API version and extensions */
+struct vkr_physical_device_proc_table {
+   struct list_head head;
+   uint32_t api_version;
+   struct vn_info_extension_table ext_table;
+   struct vn_device_proc_table proc_table;
+};
+
+/* a cache only keeps this many device proc tables */
+#define VKR_PHYSICAL_DEVICE_MAX_PROC_TABLES 8
+
+static struct {
+   once_flag init_once;
+   bool init_ok;
+
+   mtx_t mutex;
+   struct list_head caches;
+} vkr_physical_device_caches = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static void
+vkr_physical_device_caches_init_once(void)
+{
+   if (mtx_init(&vkr_physical_device_caches.mutex, mtx_plain) != thrd_success)
+      return;
+
+   list_inithead(&vkr_physical_device_caches.caches);
+   vkr_physical_device_caches.init_ok = true;
+}
+
+static uint32_t
+vkr_physical_device_image_format_key_hash(const void *key)
+{
+   return _mesa_hash_data(key, sizeof(struct vkr_physical_device_image_format_key));
+}
+
+static bool
+vkr_physical_device_image_format_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vkr_physical_device_image_format_key));
+}
+
+static void
+vkr_physical_device_cache_free_entry(struct hash_entry *entry)
+{
+   free(entry->data);
+}
+
+static void
+vkr_physical_device_cache_destroy(struct vkr_physical_device_cache *cache)
+{
+   list_for_each_entry_safe (struct vkr_physical_device_proc_table, table,
+                             &cache->device_proc_tables, head)
+      free(table);
+
+   _mesa_hash_table_destroy(cache->image_format_properties,
+                            vkr_physical_device_cache_free_entry);
+   _mesa_hash_table_destroy(cache->format_properties,
+                            vkr_physical_device_cache_free_entry);
+   mtx_destroy(&cache->mutex);
+
+   free(cache->queue_family_properties);
+   free(cache->extensions);
+   free(cache);
+}
+
+static void *
+vkr_physical_device_cache_dup(const void *src, size_t size)
+{
+   if (!size)
+      return NULL;
+
+   void *dst = malloc(size);
+   if (dst)
+      memcpy(dst, src, size);
+   return dst;
+}
+
+static struct vkr_physical_device_cache *
+vkr_physical_device_cache_create(const struct vkr_physical_device *physical_dev)
+{
+   struct vkr_physical_device_cache *cache = calloc(1, sizeof(*cache));
+   if (!cache)
+      return NULL;
+
+   list_inithead(&cache->device_proc_tables);
+
+   if (mtx_init(&cache->mutex, mtx_plain) != thrd_success) {
+      free(cache);
+      return NULL;
+   }
+
+   cache->format_properties =
+      _mesa_hash_table_create(NULL, _mesa_hash_u32, _mesa_key_u32_equal);
+   cache->image_format_properties =
+      _mesa_hash_table_create(NULL, vkr_physical_device_image_format_key_hash,
+                              vkr_physical_device_image_format_key_equal);
+   cache->extensions = vkr_physical_device_cache_dup(
+      physical_dev->extensions,
+      sizeof(*physical_dev->extensions) * physical_dev->extension_count);
+   cache->queue_family_properties = vkr_physical_device_cache_dup(
+      physical_dev->queue_family_properties,
+      sizeof(*physical_dev->queue_family_properties) *
+         physical_dev->queue_family_property_count);
+   if (!cache->format_properties || !cache->image_format_properties ||
+       (physical_dev->extension_count && !cache->extensions) ||
+       (physical_dev->queue_family_property_count && !cache->queue_family_properties)) {
+      vkr_physical_device_cache_destroy(cache);
+      return NULL;
+   }
+
+   memcpy(cache->device_uuid, physical_dev->id_properties.deviceUUID, VK_UUID_SIZE);
+   memcpy(cache->driver_uuid, physical_dev->id_properties.driverUUID, VK_UUID_SIZE);
+
+   cache->properties = physical_dev->properties;
+   cache->extension_count = physical_dev->extension_count;
+   cache->KHR_external_memory_fd = physical_dev->KHR_external_memory_fd;
+   cache->EXT_external_memory_dma_buf = physical_dev->EXT_external_memory_dma_buf;
+   cache->EXT_external_memory_host = physical_dev->EXT_external_memory_host;
+   cache->EXT_image_drm_format_modifier = physical_dev->EXT_image_drm_format_modifier;
+   cache->use_host_pointer_import = physical_dev->use_host_pointer_import;
+   cache->min_imported_host_pointer_alignment =
+      physical_dev->min_imported_host_pointer_alignment;
+   cache->KHR_external_fence_fd = physical_dev->KHR_external_fence_fd;
+   cache->memory_properties = physical_dev->memory_properties;
+   cache->is_dma_buf_fd_export_supported = physical_dev->is_dma_buf_fd_export_supported;
+   cache->is_opaque_fd_export_supported = physical_dev->is_opaque_fd_export_supported;
+   cache->queue_family_property_count = physical_dev->queue_family_property_count;
+
+   return cache;
+}
+
+static void
+vkr_physical_device_cache_load(const struct vkr_physical_device_cache *cache,
+                               struct vkr_physical_device *physical_dev)
+{
+   physical_dev->properties = cache->properties;
+
+   physical_dev->extensions = vkr_physical_device_cache_dup(
+      cache->extensions, sizeof(*cache->extensions) * cache->extension_count);
+   if (physical_dev->extensions)
+      physical_dev->extension_count = cache->extension_count;
+
+   physical_dev->KHR_external_memory_fd = cache->KHR_external_memory_fd;
+   physical_dev->EXT_external_memory_dma_buf = cache->EXT_external_memory_dma_buf;
+   physical_dev->EXT_external_memory_host = cache->EXT_external_memory_host;
+   physical_dev->EXT_image_drm_format_modifier = cache->EXT_image_drm_format_modifier;
+   physical_dev->use_host_pointer_import = cache->use_host_pointer_import;
+   physical_dev->min_imported_host_pointer_alignment =
+      cache->min_imported_host_pointer_alignment;
+   physical_dev->KHR_external_fence_fd = cache->KHR_external_fence_fd;
+   physical_dev->memory_properties = cache->memory_properties;
+   physical_dev->is_dma_buf_fd_export_supported = cache->is_dma_buf_fd_export_supported;
+   physical_dev->is_opaque_fd_export_supported = cache->is_opaque_fd_export_supported;
+
+   physical_dev->queue_family_properties = vkr_physical_device_cache_dup(
+      cache->queue_family_properties,
+      sizeof(*cache->queue_family_properties) * cache->queue_family_property_count);
+   if (physical_dev->queue_family_properties)
+      physical_dev->queue_family_property_count = cache->queue_family_property_count;
+}
+
+static struct vkr_physical_device_cache *
+vkr_physical_device_cache_lookup_locked(const struct vkr_physical_device *physical_dev)
+{
+   const VkPhysicalDeviceIDProperties *id_props = &physical_dev->id_properties;
+
+   list_for_each_entry (struct vkr_physical_device_cache, cache,
+                        &vkr_physical_device_caches.caches, head) {
+      if (!memcmp(cache->device_uuid, id_props->deviceUUID, VK_UUID_SIZE) &&
+          !memcmp(cache->driver_uuid, id_props->driverUUID, VK_UUID_SIZE))
+         return cache;
+   }
+   return NULL;
+}
+
+static bool
+vkr_physical_device_has_uuids(const struct vkr_physical_device *physical_dev)
+{
+   static const uint8_t zero_uuid[VK_UUID_SIZE];
+   const VkPhysicalDeviceIDProperties *id_props = &physical_dev->id_properties;
+
+   /* without them, different devices cannot be told apart */
+   return memcmp(id_props->deviceUUID, zero_uuid, VK_UUID_SIZE) ||
+          memcmp(id_props->driverUUID, zero_uuid, VK_UUID_SIZE);
+}
+
+static void
+vkr_physical_device_init_queried_info(struct vkr_physical_device *physical_dev)
+{
+   vkr_physical_device_init_properties(physical_dev);
+   vkr_physical_device_init_extensions(physical_dev);
+   vkr_physical_device_init_memory_properties(physical_dev);
+   vkr_physical_device_init_queue_family_properties(physical_dev);
+}
+
+/* Initializes the properties, extensions, memory and queue family properties,
+ * from the cache of the device when another context has queried them already.
+ */
+static void
+vkr_physical_device_init_info(struct vkr_physical_device *physical_dev)
+{
+   vkr_physical_device_init_id_properties(physical_dev);
+
+   call_once(&vkr_physical_device_caches.init_once, vkr_physical_device_caches_init_once);
+   if (!vkr_physical_device_caches.init_ok ||
+       !vkr_physical_device_has_uuids(physical_dev)) {
+      vkr_physical_device_init_queried_info(physical_dev);
+      vkr_physical_device_init_memory_allocators(physical_dev);
+      return;
+   }
+
+   mtx_lock(&vkr_physical_device_caches.mutex);
+   struct vkr_physical_device_cache *cache =
+      vkr_physical_device_cache_lookup_locked(physical_dev);
+   if (cache) {
+      vkr_physical_device_cache_load(cache, physical_dev);
+   } else {
+      vkr_physical_device_init_queried_info(physical_dev);
+      cache = vkr_physical_device_cache_create(physical_dev);
+      if (cache)
+         list_addtail(&cache->head, &vkr_physical_device_caches.caches);
+   }
+   mtx_unlock(&vkr_physical_device_caches.mutex);
+
+   physical_dev->cache = cache;
+
+   vkr_physical_device_init_memory_allocators(physical_dev);
+}
+
+void
+vkr_physical_device_fini_caches(void)
+{
+   if (!vkr_physical_device_caches.init_ok)
+      return;
+
+   mtx_lock(&vkr_physical_device_caches.mutex);
+   list_for_each_entry_safe (struct vkr_physical_device_cache, cache,
+                             &vkr_physical_device_caches.caches, head)
+      vkr_physical_device_cache_destroy(cache);
+   list_inithead(&vkr_physical_device_caches.caches);
+   mtx_unlock(&vkr_physical_device_caches.mutex);
+}
+
+static bool
+vkr_physical_device_proc_table_matches(const struct vn_device_proc_table *proc_table,
+                                       VkDevice dev,
+                                       PFN_vkGetDeviceProcAddr get_proc_addr)
+{
+   /* A driver is free to return entry points specific to a device.  Those
+    * that do are expected to do it for these as well.
+    */
+   return (PFN_vkQueueSubmit)get_proc_addr(dev, "vkQueueSubmit") ==
+             proc_table->QueueSubmit &&
+          (PFN_vkCreateBuffer)get_proc_addr(dev, "vkCreateBuffer") ==
+             proc_table->CreateBuffer &&
+          (PFN_vkCmdDraw)get_proc_addr(dev, "vkCmdDraw") == proc_table->CmdDraw &&
+          (PFN_vkDestroyDevice)get_proc_addr(dev, "vkDestroyDevice") ==
+             proc_table->DestroyDevice;
+}
+
+bool
+vkr_physical_device_load_device_proc_table(struct vkr_physical_device *physical_dev,
+                                           VkDevice dev,
+                                           uint32_t api_version,
+                                           const struct vn_info_extension_table *ext_table,
+                                           struct vn_device_proc_table *proc_table)
+{
+   struct vkr_physical_device_cache *cache = physical_dev->cache;
+   if (!cache)
+      return false;
+
+   bool found = false;
+   mtx_lock(&cache->mutex);
+   list_for_each_entry (struct vkr_physical_device_proc_table, table,
+                        &cache->device_proc_tables, head) {
+      if (table->api_version == api_version &&
+          !memcmp(&table->ext_table, ext_table, sizeof(*ext_table))) {
+         *proc_table = table->proc_table;
+         found = true;
+         break;
+      }
+   }
+   mtx_unlock(&cache->mutex);
+
+   return found && vkr_physical_device_proc_table_matches(
+                      proc_table, dev, physical_dev->proc_table.GetDeviceProcAddr);
+}
+
+void
+vkr_physical_device_store_device_proc_table(
+   struct vkr_physical_device *physical_dev,
+   uint32_t api_version,
+   const struct vn_info_extension_table *ext_table,
+   const struct vn_device_proc_table *proc_table)
+{
+   struct vkr_physical_device_cache *cache = physical_dev->cache;
+   if (!cache)
+      return;
+
+   mtx_lock(&cache->mutex);
+   if (cache->device_proc_table_count < VKR_PHYSICAL_DEVICE_MAX_PROC_TABLES) {
+      struct vkr_physical_device_proc_table *table = malloc(sizeof(*table));
+      if (table) {
+         table->api_version = api_version;
+         table->ext_table = *ext_table;
+         table->proc_table = *proc_table;
+         list_addtail(&table->head, &cache->device_proc_tables);
+         cache->device_proc_table_count++;
+      }
+   }
+   mtx_unlock(&cache->mutex);
+}
+
+static void
+vkr_physical_device_get_format_properties(struct vkr_physical_device *physical_dev,
+                                          VkFormat format,
+                                          VkFormatProperties *props)
+{
+   struct vkr_physical_device_cache *cache = physical_dev->cache;
+   struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
+   VkPhysicalDevice handle = physical_dev->base.handle.physical_device;
+
+   if (!cache) {
+      vk->GetPhysicalDeviceFormatProperties(handle, format, props);
+      return;
+   }
+
+   mtx_lock(&cache->mutex);
+   const struct hash_entry *entry =
+      _mesa_hash_table_search(cache->format_properties, &format);
+   if (entry) {
+      const struct vkr_physical_device_format_entry *format_entry = entry->data;
+      *props = format_entry->props;
+   }
+   mtx_unlock(&cache->mutex);
+   if (entry)
+      return;
+
+   vk->GetPhysicalDeviceFormatProperties(handle, format, props);
+
+   struct vkr_physical_device_format_entry *format_entry = malloc(sizeof(*format_entry));
+   if (!format_entry)
+      return;
+   format_entry->format = format;
+   format_entry->props = *props;
+
+   /* another context might have raced us */
+   mtx_lock(&cache->mutex);
+   if (_mesa_hash_table_num_entries(cache->format_properties) <
+          VKR_PHYSICAL_DEVICE_CACHE_MAX_FORMATS &&
+       !_mesa_hash_table_search(cache->format_properties, &format)) {
+      _mesa_hash_table_insert(cache->format_properties, &format_entry->format,
+                              format_entry);
+      format_entry = NULL;
+   }
+   mtx_unlock(&cache->mutex);
+
+   free(format_entry);
+}
+
+static VkResult
+vkr_physical_device_get_image_format_properties(
+   struct vkr_physical_device *physical_dev,
+   const struct vkr_physical_device_image_format_key *key,
+   VkImageFormatProperties *props)
+{
+   struct vkr_physical_device_cache *cache = physical_dev->cache;
+   struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
+   VkPhysicalDevice handle = physical_dev->base.handle.physical_device;
+
+   if (!cache) {
+      return vk->GetPhysicalDeviceImageFormatProperties(
+         handle, key->format, key->type, key->tiling, key->usage, key->flags, props);
+   }
+
+   VkResult result = VK_SUCCESS;
+   mtx_lock(&cache->mutex);
+   const struct hash_entry *entry =
+      _mesa_hash_table_search(cache->image_format_properties, key);
+   if (entry) {
+      const struct vkr_physical_device_image_format_entry *image_entry = entry->data;
+      result = image_entry->result;
+      *props = image_entry->props;
+   }
+   mtx_unlock(&cache->mutex);
+   if (entry)
+      return result;
+
+   result = vk->GetPhysicalDeviceImageFormatProperties(
+      handle, key->format, key->type, key->tiling, key->usage, key->flags, props);
+   /* out of memory errors are transient */
+   if (result != VK_SUCCESS && result != VK_ERROR_FORMAT_NOT_SUPPORTED)
+      return result;
+
+   struct vkr_physical_device_image_format_entry *image_entry =
+      malloc(sizeof(*image_entry));
+   if (!image_entry)
+      return result;
+   image_entry->key = *key;
+   image_entry->result = result;
+   image_entry->props = *props;
+
+   mtx_lock(&cache->mutex);
+   if (_mesa_hash_table_num_entries(cache->image_format_properties) <
+          VKR_PHYSICAL_DEVICE_CACHE_MAX_FORMATS &&
+       !_mesa_hash_table_search(cache->image_format_properties, key)) {
+      _mesa_hash_table_insert(cache->image_format_properties, &image_entry->key,
+                              image_entry);
+      image_entry = NULL;
+   }
+   mtx_unlock(&cache->mutex);
+
+   free(image_entry);
+
+   return result;
+}
+
 static void
 vkr_dispatch_vkEnumeratePhysicalDevices(struct vn_dispatch_context *dispatch,
                                         struct vn_command_vkEnumeratePhysicalDevices *args)
@@ -481,23 +961,17 @@ vkr_dispatch_vkEnumeratePhysicalDevices(struct vn_dispatch_context *dispatch,
 
       vkr_physical_device_init_proc_table(physical_dev, instance);
       VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_proc_table done\n");
-      vkr_physical_device_init_properties(physical_dev);
-      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_properties done apiVer=%u.%u.%u\n",
+      vkr_physical_device_init_info(physical_dev);
+      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_info done "
+                       "apiVer=%u.%u.%u extensions=%u queue_families=%u cached=%d\n",
                        VK_API_VERSION_MAJOR(physical_dev->properties.apiVersion),
                        VK_API_VERSION_MINOR(physical_dev->properties.apiVersion),
-                       VK_API_VERSION_PATCH(physical_dev->properties.apiVersion));
+                       VK_API_VERSION_PATCH(physical_dev->properties.apiVersion),
+                       physical_dev->extension_count,
+                       physical_dev->queue_family_property_count,
+                       physical_dev->cache != NULL);
       physical_dev->api_version =
          MIN2(physical_dev->properties.apiVersion, instance->api_version);
-      vkr_physical_device_init_extensions(physical_dev);
-      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_extensions done count=%u\n",
-                       physical_dev->extension_count);
-      vkr_physical_device_init_memory_properties(physical_dev);
-      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_memory_properties done\n");
-      vkr_physical_device_init_id_properties(physical_dev);
-      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_id_properties done\n");
-      vkr_physical_device_init_queue_family_properties(physical_dev);
-      VKR_STDERR_DEBUG("vkr_dispatch_vkEnumeratePhysicalDevices: init_queue_family_properties done count=%u\n",
-                       physical_dev->queue_family_property_count);
 
       list_inithead(&physical_dev->devices);
 
@@ -658,6 +1132,18 @@ vkr_dispatch_vkGetPhysicalDeviceQueueFamilyProperties(
       vkr_physical_device_from_handle(args->physicalDevice);
    struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
 
+   if (physical_dev->queue_family_properties) {
+      const uint32_t count = physical_dev->queue_family_property_count;
+      if (args->pQueueFamilyProperties) {
+         *args->pQueueFamilyPropertyCount = MIN2(*args->pQueueFamilyPropertyCount, count);
+         memcpy(args->pQueueFamilyProperties, physical_dev->queue_family_properties,
+                sizeof(*args->pQueueFamilyProperties) * *args->pQueueFamilyPropertyCount);
+      } else {
+         *args->pQueueFamilyPropertyCount = count;
+      }
+      return;
+   }
+
    vn_replace_vkGetPhysicalDeviceQueueFamilyProperties_args_handle(args);
    vk->GetPhysicalDeviceQueueFamilyProperties(args->physicalDevice,
                                               args->pQueueFamilyPropertyCount,
@@ -681,11 +1167,9 @@ vkr_dispatch_vkGetPhysicalDeviceFormatProperties(
 {
    struct vkr_physical_device *physical_dev =
       vkr_physical_device_from_handle(args->physicalDevice);
-   struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
 
-   vn_replace_vkGetPhysicalDeviceFormatProperties_args_handle(args);
-   vk->GetPhysicalDeviceFormatProperties(args->physicalDevice, args->format,
-                                         args->pFormatProperties);
+   vkr_physical_device_get_format_properties(physical_dev, args->format,
+                                             args->pFormatProperties);
 }
 
 static void
@@ -695,12 +1179,16 @@ vkr_dispatch_vkGetPhysicalDeviceImageFormatProperties(
 {
    struct vkr_physical_device *physical_dev =
       vkr_physical_device_from_handle(args->physicalDevice);
-   struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
 
-   vn_replace_vkGetPhysicalDeviceImageFormatProperties_args_handle(args);
-   args->ret = vk->GetPhysicalDeviceImageFormatProperties(
-      args->physicalDevice, args->format, args->type, args->tiling, args->usage,
-      args->flags, args->pImageFormatProperties);
+   const struct vkr_physical_device_image_format_key key = {
+      .format = args->format,
+      .type = args->type,
+      .tiling = args->tiling,
+      .usage = args->usage,
+      .flags = args->flags,
+   };
+   args->ret = vkr_physical_device_get_image_format_properties(
+      physical_dev, &key, args->pImageFormatProperties);
 }
 
 static void
@@ -761,9 +1249,10 @@ vkr_dispatch_vkGetPhysicalDeviceQueueFamilyProperties2(
 
 static void
 vkr_dispatch_vkGetPhysicalDeviceMemoryProperties2(
-   UNUSED struct vn_dispatch_context *dispatch,
+   struct vn_dispatch_context *dispatch,
    struct vn_command_vkGetPhysicalDeviceMemoryProperties2 *args)
 {
+   struct vkr_context *ctx = dispatch->data;
    struct vkr_physical_device *physical_dev =
       vkr_physical_device_from_handle(args->physicalDevice);
    struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
@@ -773,10 +1262,24 @@ vkr_dispatch_vkGetPhysicalDeviceMemoryProperties2(
        * invariant. Return the cached properties.
        */
       args->pMemoryProperties->memoryProperties = physical_dev->memory_properties;
-   } else {
-      vn_replace_vkGetPhysicalDeviceMemoryProperties2_args_handle(args);
-      vk->GetPhysicalDeviceMemoryProperties2(args->physicalDevice,
-                                             args->pMemoryProperties);
+      return;
+   }
+
+   vn_replace_vkGetPhysicalDeviceMemoryProperties2_args_handle(args);
+   vk->GetPhysicalDeviceMemoryProperties2(args->physicalDevice, args->pMemoryProperties);
+
+   /* no heap can grow past what is left of the budget of the context */
+   VkPhysicalDeviceMemoryBudgetPropertiesEXT *budget = vkr_find_struct(
+      args->pMemoryProperties->pNext,
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT);
+   const uint64_t available = virgl_memory_budget_available(&ctx->memory_budget);
+   if (budget && available != UINT64_MAX) {
+      const VkPhysicalDeviceMemoryProperties *props =
+         &args->pMemoryProperties->memoryProperties;
+      for (uint32_t i = 0; i < props->memoryHeapCount; i++) {
+         const VkDeviceSize limit = budget->heapUsage[i] + available;
+         budget->heapBudget[i] = MIN2(budget->heapBudget[i], limit);
+      }
    }
 }
 
@@ -789,6 +1292,13 @@ vkr_dispatch_vkGetPhysicalDeviceFormatProperties2(
       vkr_physical_device_from_handle(args->physicalDevice);
    struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
 
+   /* without a chain, the query is the same as vkGetPhysicalDeviceFormatProperties */
+   if (!args->pFormatProperties->pNext) {
+      vkr_physical_device_get_format_properties(
+         physical_dev, args->format, &args->pFormatProperties->formatProperties);
+      return;
+   }
+
    vn_replace_vkGetPhysicalDeviceFormatProperties2_args_handle(args);
    vk->GetPhysicalDeviceFormatProperties2(args->physicalDevice, args->format,
                                           args->pFormatProperties);
@@ -803,6 +1313,23 @@ vkr_dispatch_vkGetPhysicalDeviceImageFormatProperties2(
       vkr_physical_device_from_handle(args->physicalDevice);
    struct vn_physical_device_proc_table *vk = &physical_dev->proc_table;
 
+   /* without chains, the query is the same as
+    * vkGetPhysicalDeviceImageFormatProperties
+    */
+   const VkPhysicalDeviceImageFormatInfo2 *info = args->pImageFormatInfo;
+   if (!info->pNext && !args->pImageFormatProperties->pNext) {
+      const struct vkr_physical_device_image_format_key key = {
+         .format = info->format,
+         .type = info->type,
+         .tiling = info->tiling,
+         .usage = info->usage,
+         .flags = info->flags,
+      };
+      args->ret = vkr_physical_device_get_image_format_properties(
+         physical_dev, &key, &args->pImageFormatProperties->imageFormatProperties);
+      return;
+   }
+
    vn_replace_vkGetPhysicalDeviceImageFormatProperties2_args_handle(args);
    args->ret = vk->GetPhysicalDeviceImageFormatProperties2(
       args->physicalDevice, args->pImageFormatInfo, args->pImageFormatProperties);
@@ -10,6 +10,8 @@
 
 #include "venus-protocol/vn_protocol_renderer_util.h"
 
+struct vkr_physical_device_cache;
+
 struct vkr_physical_device {
    struct vkr_object base;
 
@@ -41,6 +43,9 @@ struct vkr_physical_device {
    VkQueueFamilyProperties *queue_family_properties;
    uint32_t queue_family_property_count;
 
+   /* the process-wide results of the invariant queries, or NULL */
+   struct vkr_physical_device_cache *cache;
+
    struct list_head devices;
 };
 VKR_DEFINE_OBJECT_CAST(physical_device, VK_OBJECT_TYPE_PHYSICAL_DEVICE, VkPhysicalDevice)
@@ -52,4 +57,26 @@ void
 vkr_physical_device_destroy(struct vkr_context *ctx,
                             struct vkr_physical_device *physical_dev);
 
+/* Initializes proc_table from the entry points resolved for an earlier
+ * device with the same API version and extensions, in this or another
+ * context.  Returns false when the entry points must be resolved.
+ */
+bool
+vkr_physical_device_load_device_proc_table(struct vkr_physical_device *physical_dev,
+                                           VkDevice dev,
+                                           uint32_t api_version,
+                                           const struct vn_info_extension_table *ext_table,
+                                           struct vn_device_proc_table *proc_table);
+
+void
+vkr_physical_device_store_device_proc_table(
+   struct vkr_physical_device *physical_dev,
+   uint32_t api_version,
+   const struct vn_info_extension_table *ext_table,
+   const struct vn_device_proc_table *proc_table);
+
+/* frees the query results cached for all physical devices */
+void
+vkr_physical_device_fini_caches(void);
+
 #endif /* VKR_PHYSICAL_DEVICE_H */
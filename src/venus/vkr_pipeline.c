@@ -5,7 +5,128 @@
 
 #include "vkr_pipeline.h"
 
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "vkr_descriptor_set.h"
+#include "vkr_physical_device.h"
 #include "vkr_pipeline_gen.h"
+#include "vkr_shared_object.h"
+
+/* a cache growing past this is not persisted anymore */
+#define VKR_HOST_PIPELINE_CACHE_MAX_SIZE (256u * 1024 * 1024)
+
+static bool
+vkr_host_pipeline_cache_path(const struct vkr_device *dev, char *path, size_t size)
+{
+   /* the driver rejects data of another device or build, but there is no
+    * reason to have them overwrite each other
+    */
+   const VkPhysicalDeviceProperties *props = &dev->physical_device->properties;
+   char uuid[VK_UUID_SIZE * 2 + 1];
+   for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+      snprintf(uuid + i * 2, 3, "%02x", props->pipelineCacheUUID[i]);
+
+   const int len = snprintf(path, size, "%s/venus-%04x-%04x-%08x-%s.cache",
+                            vkr_pipeline_cache_dir, props->vendorID, props->deviceID,
+                            props->driverVersion, uuid);
+   return len > 0 && (size_t)len < size;
+}
+
+void
+vkr_device_init_host_pipeline_cache(struct vkr_device *dev)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   char path[PATH_MAX];
+
+   dev->host_pipeline_cache = VK_NULL_HANDLE;
+   if (!vkr_pipeline_cache_dir || !vkr_host_pipeline_cache_path(dev, path, sizeof(path)))
+      return;
+
+   if (mtx_init(&dev->host_pipeline_cache_mutex, mtx_plain) != thrd_success)
+      return;
+
+   /* a missing or stale file gives an empty cache */
+   size_t data_size = 0;
+   char *data = os_read_file(path, &data_size);
+
+   const VkPipelineCacheCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .initialDataSize = data ? data_size : 0,
+      .pInitialData = data,
+   };
+   VkResult result = vk->CreatePipelineCache(dev->base.handle.device, &create_info, NULL,
+                                             &dev->host_pipeline_cache);
+   free(data);
+
+   if (result != VK_SUCCESS) {
+      vkr_log("failed to create host pipeline cache (vk ret %d)", result);
+      dev->host_pipeline_cache = VK_NULL_HANDLE;
+      mtx_destroy(&dev->host_pipeline_cache_mutex);
+   }
+}
+
+static void
+vkr_device_store_host_pipeline_cache(struct vkr_device *dev)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   char path[PATH_MAX];
+   char tmp_path[PATH_MAX + 16];
+
+   size_t data_size = 0;
+   VkResult result = vk->GetPipelineCacheData(
+      dev->base.handle.device, dev->host_pipeline_cache, &data_size, NULL);
+   if (result != VK_SUCCESS || !data_size)
+      return;
+   if (data_size > VKR_HOST_PIPELINE_CACHE_MAX_SIZE) {
+      vkr_log("host pipeline cache too large (%zu bytes), not stored", data_size);
+      return;
+   }
+
+   void *data = malloc(data_size);
+   if (!data)
+      return;
+
+   result = vk->GetPipelineCacheData(dev->base.handle.device, dev->host_pipeline_cache,
+                                     &data_size, data);
+   if (result != VK_SUCCESS || !vkr_host_pipeline_cache_path(dev, path, sizeof(path))) {
+      free(data);
+      return;
+   }
+
+   /* other contexts may store the same cache, the rename is atomic */
+   snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+   FILE *file = os_file_create_unique(tmp_path, 0600);
+   if (!file) {
+      vkr_log("failed to create %s", tmp_path);
+      free(data);
+      return;
+   }
+
+   const size_t written = fwrite(data, 1, data_size, file);
+   const bool closed = !fclose(file);
+   free(data);
+
+   if (written != data_size || !closed || rename(tmp_path, path)) {
+      vkr_log("failed to store host pipeline cache to %s", path);
+      unlink(tmp_path);
+   }
+}
+
+void
+vkr_device_fini_host_pipeline_cache(struct vkr_device *dev)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   if (!dev->host_pipeline_cache)
+      return;
+
+   vkr_device_store_host_pipeline_cache(dev);
+
+   vk->DestroyPipelineCache(dev->base.handle.device, dev->host_pipeline_cache, NULL);
+   mtx_destroy(&dev->host_pipeline_cache_mutex);
+}
 
 static void
 vkr_dispatch_vkCreateShaderModule(struct vn_dispatch_context *dispatch,
@@ -51,31 +172,120 @@ vkr_dispatch_vkDestroyShaderModule(struct vn_dispatch_context *dispatch,
    vkr_shader_module_destroy_and_remove(dispatch->data, args);
 }
 
+/* the set layouts are either shared or keyed by their ids */
+static bool
+vkr_pipeline_layout_init_key(struct vkr_shared_key *key,
+                             const VkPipelineLayoutCreateInfo *info)
+{
+   memset(key, 0, sizeof(*key));
+   if (info->pNext)
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD(key, info->flags);
+
+   VKR_SHARED_KEY_ADD(key, info->setLayoutCount);
+   for (uint32_t i = 0; i < info->setLayoutCount; i++) {
+      /* VK_NULL_HANDLE is valid with independent sets */
+      const struct vkr_descriptor_set_layout *layout =
+         vkr_descriptor_set_layout_from_handle(info->pSetLayouts[i]);
+      vkr_shared_key_add_ref(key, layout ? &layout->base : NULL);
+   }
+
+   VKR_SHARED_KEY_ADD_ARRAY(key, info->pushConstantRangeCount,
+                            info->pPushConstantRanges);
+
+   return !key->failed;
+}
+
 static void
 vkr_dispatch_vkCreatePipelineLayout(struct vn_dispatch_context *dispatch,
                                     struct vn_command_vkCreatePipelineLayout *args)
 {
-   vkr_pipeline_layout_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   struct vkr_shared_key key = { 0 };
+   if (!dev->shared_objects || !vkr_pipeline_layout_init_key(&key, args->pCreateInfo)) {
+      vkr_shared_key_fini(&key);
+      vkr_pipeline_layout_create_and_add(ctx, args);
+      return;
+   }
+
+   struct vkr_pipeline_layout *layout = vkr_context_alloc_object(
+      ctx, sizeof(*layout), VK_OBJECT_TYPE_PIPELINE_LAYOUT, args->pPipelineLayout);
+   if (!layout) {
+      vkr_shared_key_fini(&key);
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   layout->shared = vkr_shared_object_get(dev, &key);
+   if (layout->shared) {
+      layout->base.handle.u64 = layout->shared->handle;
+      args->ret = VK_SUCCESS;
+   } else if (vkr_pipeline_layout_create_driver_handle(ctx, args, layout) == VK_SUCCESS) {
+      layout->shared = vkr_shared_object_add(dev, &key, layout->base.handle.u64);
+   } else {
+      vkr_shared_key_fini(&key);
+      free(layout);
+      return;
+   }
+   vkr_shared_key_fini(&key);
+
+   vkr_device_add_object(ctx, dev, &layout->base);
 }
 
 static void
 vkr_dispatch_vkDestroyPipelineLayout(struct vn_dispatch_context *dispatch,
                                      struct vn_command_vkDestroyPipelineLayout *args)
 {
-   vkr_pipeline_layout_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_pipeline_layout *layout =
+      vkr_pipeline_layout_from_handle(args->pipelineLayout);
+   if (layout && !vkr_shared_object_release(dev, &layout->base)) {
+      vkr_device_remove_object(ctx, dev, &layout->base);
+      return;
+   }
+
+   vkr_pipeline_layout_destroy_and_remove(ctx, args);
 }
 
 static void
 vkr_dispatch_vkCreatePipelineCache(struct vn_dispatch_context *dispatch,
                                    struct vn_command_vkCreatePipelineCache *args)
 {
-   vkr_pipeline_cache_create_and_add(dispatch->data, args);
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   struct vkr_pipeline_cache *cache =
+      vkr_pipeline_cache_create_and_add(dispatch->data, args);
+   if (!cache || !dev->host_pipeline_cache)
+      return;
+
+   /* seed the new cache with what has been compiled before, failing is harmless */
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   mtx_lock(&dev->host_pipeline_cache_mutex);
+   vk->MergePipelineCaches(dev->base.handle.device, cache->base.handle.pipeline_cache, 1,
+                           &dev->host_pipeline_cache);
+   mtx_unlock(&dev->host_pipeline_cache_mutex);
 }
 
 static void
 vkr_dispatch_vkDestroyPipelineCache(struct vn_dispatch_context *dispatch,
                                     struct vn_command_vkDestroyPipelineCache *args)
 {
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_pipeline_cache *cache = vkr_pipeline_cache_from_handle(args->pipelineCache);
+
+   if (cache && dev->host_pipeline_cache) {
+      struct vn_device_proc_table *vk = &dev->proc_table;
+      mtx_lock(&dev->host_pipeline_cache_mutex);
+      vk->MergePipelineCaches(dev->base.handle.device, dev->host_pipeline_cache, 1,
+                              &cache->base.handle.pipeline_cache);
+      mtx_unlock(&dev->host_pipeline_cache_mutex);
+   }
+
    vkr_pipeline_cache_destroy_and_remove(dispatch->data, args);
 }
 
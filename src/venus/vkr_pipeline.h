@@ -15,6 +15,9 @@ VKR_DEFINE_OBJECT_CAST(shader_module, VK_OBJECT_TYPE_SHADER_MODULE, VkShaderModu
 
 struct vkr_pipeline_layout {
    struct vkr_object base;
+
+   /* NULL when the driver layout is not shared, see vkr_shared_object.h */
+   struct vkr_shared_object *shared;
 };
 VKR_DEFINE_OBJECT_CAST(pipeline_layout, VK_OBJECT_TYPE_PIPELINE_LAYOUT, VkPipelineLayout)
 
@@ -28,6 +31,12 @@ struct vkr_pipeline {
 };
 VKR_DEFINE_OBJECT_CAST(pipeline, VK_OBJECT_TYPE_PIPELINE, VkPipeline)
 
+void
+vkr_device_init_host_pipeline_cache(struct vkr_device *dev);
+
+void
+vkr_device_fini_host_pipeline_cache(struct vkr_device *dev);
+
 void
 vkr_context_init_shader_module_dispatch(struct vkr_context *ctx);
 
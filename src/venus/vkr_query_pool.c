@@ -7,17 +7,174 @@
 
 #include "vkr_query_pool_gen.h"
 
+/* pools with more queries are not cached */
+#define VKR_QUERY_POOL_RESULTS_MAX_QUERIES (64 * 1024)
+
+static struct vkr_query_pool_results *
+vkr_query_pool_results_create(const VkQueryPoolCreateInfo *info)
+{
+   if (info->queryType != VK_QUERY_TYPE_TIMESTAMP &&
+       info->queryType != VK_QUERY_TYPE_OCCLUSION)
+      return NULL;
+   if (!info->queryCount || info->queryCount > VKR_QUERY_POOL_RESULTS_MAX_QUERIES)
+      return NULL;
+
+   struct vkr_query_pool_results *results = calloc(1, sizeof(*results));
+   if (!results)
+      return NULL;
+
+   results->query_count = info->queryCount;
+   results->values = malloc(sizeof(*results->values) * info->queryCount);
+   results->available =
+      calloc((info->queryCount + 31) / 32, sizeof(*results->available));
+   if (!results->values || !results->available ||
+       mtx_init(&results->mutex, mtx_plain) != thrd_success) {
+      free(results->values);
+      free(results->available);
+      free(results);
+      return NULL;
+   }
+
+   return results;
+}
+
+static inline bool
+vkr_query_pool_results_is_available(const struct vkr_query_pool_results *results,
+                                    uint32_t query)
+{
+   return results->available[query / 32] & (1u << (query % 32));
+}
+
+static inline void
+vkr_query_pool_results_set_available(struct vkr_query_pool_results *results,
+                                     uint32_t query,
+                                     bool available)
+{
+   if (available)
+      results->available[query / 32] |= 1u << (query % 32);
+   else
+      results->available[query / 32] &= ~(1u << (query % 32));
+}
+
+static bool
+vkr_query_pool_results_check_range(const struct vkr_query_pool_results *results,
+                                   const struct vn_command_vkGetQueryPoolResults *args)
+{
+   const size_t value_size = args->flags & VK_QUERY_RESULT_64_BIT ? 8 : 4;
+   const size_t query_size =
+      value_size * (args->flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT ? 2 : 1);
+
+   if (!args->pData || !args->queryCount || args->firstQuery > results->query_count ||
+       args->queryCount > results->query_count - args->firstQuery)
+      return false;
+
+   return (uint64_t)(args->queryCount - 1) * args->stride + query_size <= args->dataSize;
+}
+
+/* Writes the results to pData when all of the queries are available. */
+static bool
+vkr_query_pool_results_read(struct vkr_query_pool_results *results,
+                            const struct vn_command_vkGetQueryPoolResults *args)
+{
+   if (!vkr_query_pool_results_check_range(results, args))
+      return false;
+
+   mtx_lock(&results->mutex);
+
+   bool hit = !results->device_reset;
+   for (uint32_t i = 0; hit && i < args->queryCount; i++)
+      hit = vkr_query_pool_results_is_available(results, args->firstQuery + i);
+
+   if (hit) {
+      for (uint32_t i = 0; i < args->queryCount; i++) {
+         const uint64_t value = results->values[args->firstQuery + i];
+         uint8_t *dst = (uint8_t *)args->pData + args->stride * i;
+
+         if (args->flags & VK_QUERY_RESULT_64_BIT) {
+            const uint64_t data[2] = { value, 1 };
+            memcpy(dst, data, args->flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT
+                                 ? sizeof(data)
+                                 : sizeof(data[0]));
+         } else {
+            const uint32_t data[2] = { (uint32_t)value, 1 };
+            memcpy(dst, data, args->flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT
+                                 ? sizeof(data)
+                                 : sizeof(data[0]));
+         }
+      }
+   }
+
+   mtx_unlock(&results->mutex);
+
+   return hit;
+}
+
+/* Stores the results the driver wrote to pData. */
+static void
+vkr_query_pool_results_write(struct vkr_query_pool_results *results,
+                             const struct vn_command_vkGetQueryPoolResults *args)
+{
+   /* VK_SUCCESS means that all of the queries are available */
+   if (args->ret != VK_SUCCESS || !(args->flags & VK_QUERY_RESULT_64_BIT) ||
+       !vkr_query_pool_results_check_range(results, args))
+      return;
+
+   mtx_lock(&results->mutex);
+
+   if (!results->device_reset) {
+      for (uint32_t i = 0; i < args->queryCount; i++) {
+         const uint8_t *src = (const uint8_t *)args->pData + args->stride * i;
+         memcpy(&results->values[args->firstQuery + i], src, sizeof(uint64_t));
+         vkr_query_pool_results_set_available(results, args->firstQuery + i, true);
+      }
+   }
+
+   mtx_unlock(&results->mutex);
+}
+
+void
+vkr_query_pool_device_reset(struct vkr_query_pool *pool)
+{
+   struct vkr_query_pool_results *results = pool->results;
+   if (!results)
+      return;
+
+   mtx_lock(&results->mutex);
+   results->device_reset = true;
+   mtx_unlock(&results->mutex);
+}
+
+void
+vkr_query_pool_release(struct vkr_query_pool *pool)
+{
+   struct vkr_query_pool_results *results = pool->results;
+   if (!results)
+      return;
+
+   mtx_destroy(&results->mutex);
+   free(results->values);
+   free(results->available);
+   free(results);
+   pool->results = NULL;
+}
+
 static void
 vkr_dispatch_vkCreateQueryPool(struct vn_dispatch_context *dispatch,
                                struct vn_command_vkCreateQueryPool *args)
 {
-   vkr_query_pool_create_and_add(dispatch->data, args);
+   struct vkr_query_pool *pool = vkr_query_pool_create_and_add(dispatch->data, args);
+   if (pool)
+      pool->results = vkr_query_pool_results_create(args->pCreateInfo);
 }
 
 static void
 vkr_dispatch_vkDestroyQueryPool(struct vn_dispatch_context *dispatch,
                                 struct vn_command_vkDestroyQueryPool *args)
 {
+   struct vkr_query_pool *pool = vkr_query_pool_from_handle(args->queryPool);
+   if (pool)
+      vkr_query_pool_release(pool);
+
    vkr_query_pool_destroy_and_remove(dispatch->data, args);
 }
 
@@ -27,11 +184,20 @@ vkr_dispatch_vkGetQueryPoolResults(UNUSED struct vn_dispatch_context *dispatch,
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_query_pool *pool = vkr_query_pool_from_handle(args->queryPool);
+
+   if (pool->results && vkr_query_pool_results_read(pool->results, args)) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
 
    vn_replace_vkGetQueryPoolResults_args_handle(args);
    args->ret = vk->GetQueryPoolResults(args->device, args->queryPool, args->firstQuery,
                                        args->queryCount, args->dataSize, args->pData,
                                        args->stride, args->flags);
+
+   if (pool->results)
+      vkr_query_pool_results_write(pool->results, args);
 }
 
 static void
@@ -40,6 +206,19 @@ vkr_dispatch_vkResetQueryPool(UNUSED struct vn_dispatch_context *dispatch,
 {
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_query_pool_results *results =
+      vkr_query_pool_from_handle(args->queryPool)->results;
+
+   if (results) {
+      mtx_lock(&results->mutex);
+      for (uint32_t i = 0; i < args->queryCount; i++) {
+         const uint64_t query = (uint64_t)args->firstQuery + i;
+         if (query >= results->query_count)
+            break;
+         vkr_query_pool_results_set_available(results, query, false);
+      }
+      mtx_unlock(&results->mutex);
+   }
 
    vn_replace_vkResetQueryPool_args_handle(args);
    vk->ResetQueryPool(args->device, args->queryPool, args->firstQuery, args->queryCount);
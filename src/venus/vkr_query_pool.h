@@ -8,12 +8,41 @@
 
 #include "vkr_common.h"
 
+/* The results of the queries that were seen available.
+ *
+ * Guests poll vkGetQueryPoolResults until the queries are available, and
+ * often get the same results again later.  The results of timestamp and
+ * occlusion queries stay valid until the queries are reset.  Host resets are
+ * tracked, but device resets are not, so the results of a pool stop being
+ * cached once a vkCmdResetQueryPool on it is recorded.
+ */
+struct vkr_query_pool_results {
+   mtx_t mutex;
+
+   /* a vkCmdResetQueryPool on the pool has been recorded */
+   bool device_reset;
+
+   uint32_t query_count;
+   uint64_t *values;
+   /* one bit per query */
+   uint32_t *available;
+};
+
 struct vkr_query_pool {
    struct vkr_object base;
+
+   struct vkr_query_pool_results *results;
 };
 VKR_DEFINE_OBJECT_CAST(query_pool, VK_OBJECT_TYPE_QUERY_POOL, VkQueryPool)
 
 void
 vkr_context_init_query_pool_dispatch(struct vkr_context *ctx);
 
+/* called when a vkCmdResetQueryPool on the pool is recorded */
+void
+vkr_query_pool_device_reset(struct vkr_query_pool *pool);
+
+void
+vkr_query_pool_release(struct vkr_query_pool *pool);
+
 #endif /* VKR_QUERY_POOL_H */
@@ -8,8 +8,28 @@
 #include "venus-protocol/vn_protocol_renderer_queue.h"
 
 #include "vkr_context.h"
+#include "vkr_device_memory.h"
 #include "vkr_physical_device.h"
 #include "vkr_queue_gen.h"
+#include "vkr_sparse.h"
+
+#include "virgl_numa.h"
+
+/* the deferred calls are submitted at the latest when this many infos pile up */
+#define VKR_QUEUE_SPARSE_BINDS_MAX_INFOS 256
+
+struct vkr_queue_sparse_binds {
+   struct vkr_queue *queue;
+
+   VkBindSparseInfo *infos;
+   uint32_t info_count;
+   uint32_t info_capacity;
+
+   /* the arrays the infos point to, one block per deferred call */
+   void **blocks;
+   uint32_t block_count;
+   uint32_t block_capacity;
+};
 
 static struct vkr_queue_sync *
 vkr_device_alloc_queue_sync(struct vkr_device *dev,
@@ -28,29 +48,34 @@ vkr_device_alloc_queue_sync(struct vkr_device *dev,
       if (!sync)
          return NULL;
 
-      const VkExportFenceCreateInfo export_info = {
-         .sType = VK_STRUCTURE_TYPE_EXPORT_FENCE_CREATE_INFO,
-         .handleTypes = VK_EXTERNAL_FENCE_HANDLE_TYPE_SYNC_FD_BIT,
-      };
-      const struct VkFenceCreateInfo create_info = {
-         .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-         .pNext = dev->physical_device->KHR_external_fence_fd ? &export_info : NULL,
-      };
-      VkResult result =
-         vk->CreateFence(dev->base.handle.device, &create_info, NULL, &sync->fence);
-      if (result != VK_SUCCESS) {
-         free(sync);
-         vkr_log("failed to create sync fence for fence_id %" PRIu64, fence_id);
-         return NULL;
+      sync->fence = VK_NULL_HANDLE;
+      if (!dev->use_timeline_sync) {
+         const VkExportFenceCreateInfo export_info = {
+            .sType = VK_STRUCTURE_TYPE_EXPORT_FENCE_CREATE_INFO,
+            .handleTypes = VK_EXTERNAL_FENCE_HANDLE_TYPE_SYNC_FD_BIT,
+         };
+         const struct VkFenceCreateInfo create_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .pNext = dev->physical_device->KHR_external_fence_fd ? &export_info : NULL,
+         };
+         VkResult result =
+            vk->CreateFence(dev->base.handle.device, &create_info, NULL, &sync->fence);
+         if (result != VK_SUCCESS) {
+            free(sync);
+            vkr_log("failed to create sync fence for fence_id %" PRIu64, fence_id);
+            return NULL;
+         }
       }
    } else {
       sync = LIST_ENTRY(struct vkr_queue_sync, dev->free_syncs.next, head);
       list_del(&sync->head);
       mtx_unlock(&dev->free_sync_mutex);
 
-      vk->ResetFences(dev->base.handle.device, 1, &sync->fence);
+      if (!dev->use_timeline_sync)
+         vk->ResetFences(dev->base.handle.device, 1, &sync->fence);
    }
 
+   sync->timeline_value = 0;
    sync->device_lost = false;
    sync->flags = fence_flags;
    sync->ring_idx = ring_idx;
@@ -71,7 +96,7 @@ static inline void
 vkr_queue_sync_retire(struct vkr_queue *queue, struct vkr_queue_sync *sync)
 {
    TRACE_FUNC();
-   queue->context->retire_fence(queue->context->ctx_id, sync->ring_idx, sync->fence_id);
+   vkr_context_retire_fence(queue->context, sync->ring_idx, sync->fence_id);
    vkr_device_free_queue_sync(queue->device, sync);
 }
 
@@ -84,14 +109,36 @@ vkr_queue_sync_submit(struct vkr_queue *queue,
    TRACE_FUNC();
    struct vkr_device *dev = queue->device;
    struct vn_device_proc_table *vk = &dev->proc_table;
+   struct vkr_queue_sync_thread *thread = queue->sync_thread;
 
    struct vkr_queue_sync *sync =
       vkr_device_alloc_queue_sync(dev, flags, ring_idx, fence_id);
    if (!sync)
       return false;
 
+   VkResult result;
    mtx_lock(&queue->vk_mutex);
-   VkResult result = vk->QueueSubmit(queue->base.handle.queue, 0, NULL, sync->fence);
+   if (queue->timeline) {
+      const uint64_t value = queue->timeline_value + 1;
+      const VkTimelineSemaphoreSubmitInfo timeline_info = {
+         .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+         .signalSemaphoreValueCount = 1,
+         .pSignalSemaphoreValues = &value,
+      };
+      const VkSubmitInfo submit_info = {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .pNext = &timeline_info,
+         .signalSemaphoreCount = 1,
+         .pSignalSemaphores = &queue->timeline,
+      };
+      result = vk->QueueSubmit(queue->base.handle.queue, 1, &submit_info, VK_NULL_HANDLE);
+      if (result == VK_SUCCESS) {
+         queue->timeline_value = value;
+         sync->timeline_value = value;
+      }
+   } else {
+      result = vk->QueueSubmit(queue->base.handle.queue, 0, NULL, sync->fence);
+   }
    mtx_unlock(&queue->vk_mutex);
 
    if (result == VK_ERROR_DEVICE_LOST) {
@@ -103,124 +150,328 @@ vkr_queue_sync_submit(struct vkr_queue *queue,
       return false;
    }
 
-   mtx_lock(&queue->sync_thread.mutex);
-   list_addtail(&sync->head, &queue->sync_thread.syncs);
-   cnd_signal(&queue->sync_thread.cond);
-   mtx_unlock(&queue->sync_thread.mutex);
+   TRACE_FENCE(TRACE_FENCE_SUBMIT, queue->context->ctx_id, ring_idx, fence_id);
+
+   mtx_lock(&thread->mutex);
+   if (list_is_empty(&queue->syncs)) {
+      /* the thread only waits for the queues that were busy when it started */
+      if (thread->wake && !list_is_empty(&thread->busy_queues)) {
+         const VkSemaphoreSignalInfo signal_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+            .semaphore = thread->wake,
+            .value = ++thread->wake_value,
+         };
+         vk->SignalSemaphore(dev->base.handle.device, &signal_info);
+      }
+      list_addtail(&queue->busy_head, &thread->busy_queues);
+   }
+   list_addtail(&sync->head, &queue->syncs);
+   cnd_signal(&thread->cond);
+   mtx_unlock(&thread->mutex);
 
    return true;
 }
 
 static void
-vkr_queue_sync_thread_fini(struct vkr_queue *queue)
+vkr_queue_sync_thread_retire_first(struct vkr_queue *queue)
 {
-   /* vkDeviceWaitIdle has been called */
-   mtx_lock(&queue->sync_thread.mutex);
-   queue->sync_thread.join = true;
-   cnd_signal(&queue->sync_thread.cond);
-   mtx_unlock(&queue->sync_thread.mutex);
+   struct vkr_queue_sync *sync =
+      list_first_entry(&queue->syncs, struct vkr_queue_sync, head);
+   list_del(&sync->head);
+   vkr_queue_sync_retire(queue, sync);
+
+   if (list_is_empty(&queue->syncs))
+      list_del(&queue->busy_head);
+}
 
-   thrd_join(queue->sync_thread.thread, NULL);
+/* Waits for the first sync of the only busy queue.  Called with thread->mutex held. */
+static void
+vkr_queue_sync_thread_wait_fence(struct vkr_queue_sync_thread *thread)
+{
+   struct vkr_device *dev = thread->device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   const uint64_t ns_per_sec = 1000000000llu;
+
+   struct vkr_queue *queue =
+      list_first_entry(&thread->busy_queues, struct vkr_queue, busy_head);
+   struct vkr_queue_sync *sync =
+      list_first_entry(&queue->syncs, struct vkr_queue_sync, head);
+
+   mtx_unlock(&thread->mutex);
+
+   VkResult result;
+   if (sync->device_lost) {
+      result = VK_ERROR_DEVICE_LOST;
+   } else {
+      result =
+         vk->WaitForFences(dev->base.handle.device, 1, &sync->fence, true, ns_per_sec * 3);
+   }
 
-   list_for_each_entry_safe (struct vkr_queue_sync, sync, &queue->sync_thread.syncs, head)
-      vkr_queue_sync_retire(queue, sync);
+   mtx_lock(&thread->mutex);
 
-   mtx_destroy(&queue->sync_thread.mutex);
-   cnd_destroy(&queue->sync_thread.cond);
+   if (result == VK_TIMEOUT)
+      return;
+
+   vkr_queue_sync_thread_retire_first(queue);
 }
 
-void
-vkr_queue_destroy(struct vkr_context *ctx, struct vkr_queue *queue)
+static bool
+vkr_queue_sync_thread_reserve(struct vkr_queue_sync_thread *thread, uint32_t count)
 {
-   vkr_queue_sync_thread_fini(queue);
+   if (count <= thread->wait_capacity)
+      return true;
 
-   list_del(&queue->base.track_head);
-
-   mtx_destroy(&queue->vk_mutex);
+   const uint32_t capacity = MAX2(count, thread->wait_capacity * 2);
+   VkSemaphore *semaphores =
+      realloc(thread->wait_semaphores, sizeof(*semaphores) * capacity);
+   if (!semaphores)
+      return false;
+   thread->wait_semaphores = semaphores;
 
-   if (queue->ring_idx > 0)
-      ctx->sync_queues[queue->ring_idx] = NULL;
+   uint64_t *values = realloc(thread->wait_values, sizeof(*values) * capacity);
+   if (!values)
+      return false;
+   thread->wait_values = values;
 
-   if (queue->base.id)
-      vkr_context_remove_object(ctx, &queue->base);
-   else
-      free(queue);
+   thread->wait_capacity = capacity;
+   return true;
 }
 
-static int
-vkr_queue_thread(void *arg)
+/* Waits for the first sync of any busy queue, and retires the syncs that
+ * each queue timeline covers.  Called with thread->mutex held.
+ */
+static void
+vkr_queue_sync_thread_wait_timelines(struct vkr_queue_sync_thread *thread)
 {
-   struct vkr_queue *queue = arg;
-   struct vkr_context *ctx = queue->context;
-   struct vkr_device *dev = queue->device;
+   struct vkr_device *dev = thread->device;
    struct vn_device_proc_table *vk = &dev->proc_table;
    const uint64_t ns_per_sec = 1000000000llu;
-   char thread_name[16];
 
-   snprintf(thread_name, ARRAY_SIZE(thread_name), "vkr-queue-%d", ctx->ctx_id);
-   u_thread_setname(thread_name);
-
-   mtx_lock(&queue->sync_thread.mutex);
-   while (true) {
-      while (list_is_empty(&queue->sync_thread.syncs) && !queue->sync_thread.join)
-         cnd_wait(&queue->sync_thread.cond, &queue->sync_thread.mutex);
+   uint32_t count = 1;
+   list_for_each_entry (struct vkr_queue, queue, &thread->busy_queues, busy_head)
+      count++;
+
+   /* without memory for all of them, wait for the first busy queue only */
+   VkSemaphore fallback_semaphores[2];
+   uint64_t fallback_values[2];
+   VkSemaphore *semaphores = fallback_semaphores;
+   uint64_t *values = fallback_values;
+   if (vkr_queue_sync_thread_reserve(thread, count)) {
+      semaphores = thread->wait_semaphores;
+      values = thread->wait_values;
+   } else {
+      count = ARRAY_SIZE(fallback_semaphores);
+   }
 
-      if (queue->sync_thread.join)
+   semaphores[0] = thread->wake;
+   values[0] = thread->wake_value + 1;
+   uint32_t i = 1;
+   list_for_each_entry (struct vkr_queue, queue, &thread->busy_queues, busy_head) {
+      if (i == count)
          break;
+      /* syncs that hit device lost have value 0 and are ready */
+      const struct vkr_queue_sync *sync =
+         list_first_entry(&queue->syncs, struct vkr_queue_sync, head);
+      semaphores[i] = queue->timeline;
+      values[i] = sync->timeline_value;
+      i++;
+   }
 
-      struct vkr_queue_sync *sync =
-         list_first_entry(&queue->sync_thread.syncs, struct vkr_queue_sync, head);
+   /* busy queues and their first syncs stay until this thread retires them */
+   const VkSemaphoreWaitInfo wait_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .flags = VK_SEMAPHORE_WAIT_ANY_BIT,
+      .semaphoreCount = count,
+      .pSemaphores = semaphores,
+      .pValues = values,
+   };
+   mtx_unlock(&thread->mutex);
+   VkResult result =
+      vk->WaitSemaphores(dev->base.handle.device, &wait_info, ns_per_sec * 3);
+   mtx_lock(&thread->mutex);
 
-      mtx_unlock(&queue->sync_thread.mutex);
+   if (result == VK_TIMEOUT)
+      return;
 
-      VkResult result;
-      if (sync->device_lost) {
-         result = VK_ERROR_DEVICE_LOST;
-      } else {
-         result = vk->WaitForFences(dev->base.handle.device, 1, &sync->fence, true,
-                                    ns_per_sec * 3);
+   list_for_each_entry_safe (struct vkr_queue, queue, &thread->busy_queues, busy_head) {
+      uint64_t counter = 0;
+      if (result == VK_SUCCESS) {
+         result = vk->GetSemaphoreCounterValue(dev->base.handle.device, queue->timeline,
+                                               &counter);
       }
 
-      mtx_lock(&queue->sync_thread.mutex);
-
-      if (result == VK_TIMEOUT)
+      if (result != VK_SUCCESS) {
+         vkr_queue_sync_thread_retire_first(queue);
          continue;
+      }
 
-      list_del(&sync->head);
+      /* the counter covers the first sync and possibly many after it */
+      list_for_each_entry_safe (struct vkr_queue_sync, sync, &queue->syncs, head) {
+         if (sync->timeline_value > counter)
+            break;
+         list_del(&sync->head);
+         vkr_queue_sync_retire(queue, sync);
+      }
 
-      vkr_queue_sync_retire(queue, sync);
+      if (list_is_empty(&queue->syncs))
+         list_del(&queue->busy_head);
    }
-   mtx_unlock(&queue->sync_thread.mutex);
+}
+
+static int
+vkr_queue_thread(void *arg)
+{
+   struct vkr_queue_sync_thread *thread = arg;
+   char thread_name[16];
+
+   snprintf(thread_name, ARRAY_SIZE(thread_name), "vkr-queue-%d", thread->context->ctx_id);
+   u_thread_setname(thread_name);
+   virgl_numa_bind_thread();
+
+   mtx_lock(&thread->mutex);
+   while (true) {
+      while (list_is_empty(&thread->busy_queues) && !thread->join)
+         cnd_wait(&thread->cond, &thread->mutex);
+
+      if (thread->join)
+         break;
+
+      if (thread->wake)
+         vkr_queue_sync_thread_wait_timelines(thread);
+      else
+         vkr_queue_sync_thread_wait_fence(thread);
+   }
+   mtx_unlock(&thread->mutex);
 
    return 0;
 }
 
-static int
-vkr_queue_sync_thread_init(struct vkr_queue *queue)
+static VkSemaphore
+vkr_device_create_timeline(struct vkr_device *dev)
 {
-   STATIC_ASSERT(thrd_success == 0);
+   struct vn_device_proc_table *vk = &dev->proc_table;
 
-   int ret = mtx_init(&queue->sync_thread.mutex, mtx_plain);
-   if (ret != thrd_success)
-      return ret;
+   const VkSemaphoreTypeCreateInfo type_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0,
+   };
+   const VkSemaphoreCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &type_info,
+   };
+   VkSemaphore timeline;
+   VkResult result =
+      vk->CreateSemaphore(dev->base.handle.device, &create_info, NULL, &timeline);
+   if (result != VK_SUCCESS) {
+      vkr_log("failed to create timeline (vk ret %d)", result);
+      return VK_NULL_HANDLE;
+   }
 
-   ret = cnd_init(&queue->sync_thread.cond);
-   if (ret != thrd_success)
-      goto fail_cnd_init;
+   return timeline;
+}
+
+struct vkr_queue_sync_thread *
+vkr_queue_sync_thread_create(struct vkr_context *ctx, struct vkr_device *dev, bool shared)
+{
+   struct vkr_queue_sync_thread *thread = calloc(1, sizeof(*thread));
+   if (!thread)
+      return NULL;
+
+   thread->context = ctx;
+   thread->device = dev;
+   list_inithead(&thread->busy_queues);
+
+   if (shared) {
+      thread->wake = vkr_device_create_timeline(dev);
+      if (!thread->wake)
+         goto fail_wake;
+   }
+
+   if (mtx_init(&thread->mutex, mtx_plain) != thrd_success)
+      goto fail_mtx_init;
 
-   list_inithead(&queue->sync_thread.syncs);
+   if (cnd_init(&thread->cond) != thrd_success)
+      goto fail_cnd_init;
 
-   ret = thrd_create(&queue->sync_thread.thread, vkr_queue_thread, queue);
-   if (ret != thrd_success)
+   if (thrd_create(&thread->thread, vkr_queue_thread, thread) != thrd_success)
       goto fail_thrd_create;
 
-   return 0;
+   return thread;
 
 fail_thrd_create:
-   mtx_destroy(&queue->sync_thread.mutex);
+   cnd_destroy(&thread->cond);
 fail_cnd_init:
-   cnd_destroy(&queue->sync_thread.cond);
-   return ret;
+   mtx_destroy(&thread->mutex);
+fail_mtx_init:
+   if (thread->wake)
+      dev->proc_table.DestroySemaphore(dev->base.handle.device, thread->wake, NULL);
+fail_wake:
+   free(thread);
+   return NULL;
+}
+
+void
+vkr_queue_sync_thread_destroy(struct vkr_queue_sync_thread *thread)
+{
+   struct vkr_device *dev = thread->device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   /* vkDeviceWaitIdle has been called */
+   mtx_lock(&thread->mutex);
+   thread->join = true;
+   if (thread->wake) {
+      const VkSemaphoreSignalInfo signal_info = {
+         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+         .semaphore = thread->wake,
+         .value = ++thread->wake_value,
+      };
+      vk->SignalSemaphore(dev->base.handle.device, &signal_info);
+   }
+   cnd_signal(&thread->cond);
+   mtx_unlock(&thread->mutex);
+
+   thrd_join(thread->thread, NULL);
+
+   list_for_each_entry_safe (struct vkr_queue, queue, &thread->busy_queues, busy_head) {
+      list_for_each_entry_safe (struct vkr_queue_sync, sync, &queue->syncs, head)
+         vkr_queue_sync_retire(queue, sync);
+      list_inithead(&queue->syncs);
+   }
+
+   if (thread->wake)
+      vk->DestroySemaphore(dev->base.handle.device, thread->wake, NULL);
+   free(thread->wait_semaphores);
+   free(thread->wait_values);
+
+   mtx_destroy(&thread->mutex);
+   cnd_destroy(&thread->cond);
+   free(thread);
+}
+
+void
+vkr_queue_destroy(struct vkr_context *ctx, struct vkr_queue *queue)
+{
+   /* the shared thread of queues with a timeline is destroyed by the device */
+   if (!queue->timeline)
+      vkr_queue_sync_thread_destroy(queue->sync_thread);
+
+   if (queue->timeline) {
+      struct vn_device_proc_table *vk = &queue->device->proc_table;
+      vk->DestroySemaphore(queue->device->base.handle.device, queue->timeline, NULL);
+   }
+
+   list_del(&queue->base.track_head);
+
+   mtx_destroy(&queue->vk_mutex);
+
+   if (queue->ring_idx > 0)
+      ctx->sync_queues[queue->ring_idx] = NULL;
+
+   if (queue->base.id)
+      vkr_context_remove_object(ctx, &queue->base);
+   else
+      free(queue);
 }
 
 struct vkr_queue *
@@ -244,15 +495,28 @@ vkr_queue_create(struct vkr_context *ctx,
    queue->family = family;
    queue->index = index;
 
+   list_inithead(&queue->syncs);
+
    if (mtx_init(&queue->vk_mutex, mtx_plain)) {
       free(queue);
       return NULL;
    }
 
-   if (vkr_queue_sync_thread_init(queue)) {
-      mtx_destroy(&queue->vk_mutex);
-      free(queue);
-      return NULL;
+   if (dev->sync_thread) {
+      queue->timeline = vkr_device_create_timeline(dev);
+      if (!queue->timeline) {
+         mtx_destroy(&queue->vk_mutex);
+         free(queue);
+         return NULL;
+      }
+      queue->sync_thread = dev->sync_thread;
+   } else {
+      queue->sync_thread = vkr_queue_sync_thread_create(ctx, dev, false);
+      if (!queue->sync_thread) {
+         mtx_destroy(&queue->vk_mutex);
+         free(queue);
+         return NULL;
+      }
    }
 
    list_inithead(&queue->base.track_head);
@@ -378,6 +642,14 @@ vkr_dispatch_vkGetDeviceQueue(struct vn_dispatch_context *dispatch,
    return;
 }
 
+static inline void
+vkr_fence_reset_signaled(VkFence handle)
+{
+   struct vkr_fence *fence = vkr_fence_from_handle(handle);
+   if (fence)
+      atomic_store_explicit(&fence->signaled, false, memory_order_relaxed);
+}
+
 static void
 vkr_dispatch_vkQueueSubmit(UNUSED struct vn_dispatch_context *dispatch,
                            struct vn_command_vkQueueSubmit *args)
@@ -387,6 +659,7 @@ vkr_dispatch_vkQueueSubmit(UNUSED struct vn_dispatch_context *dispatch,
    struct vn_device_proc_table *vk = &queue->device->proc_table;
 
    VkFence guest_fence = args->fence;  /* before handle replacement */
+   vkr_fence_reset_signaled(args->fence);
    vn_replace_vkQueueSubmit_args_handle(args);
    VkFence host_fence = args->fence;   /* after handle replacement */
 
@@ -401,16 +674,271 @@ vkr_dispatch_vkQueueSubmit(UNUSED struct vn_dispatch_context *dispatch,
    fprintf(stderr, "[VKR] vkQueueSubmit: ret=%d\n", args->ret);
 }
 
+/* offsets the binds of suballocated memories, see vkr_memory_suballoc */
+static void
+vkr_queue_apply_sparse_block_offsets(uint32_t count, const VkBindSparseInfo *infos)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      const VkBindSparseInfo *info = &infos[i];
+
+      for (uint32_t j = 0; j < info->bufferBindCount; j++) {
+         const VkSparseBufferMemoryBindInfo *bind_info = &info->pBufferBinds[j];
+         for (uint32_t k = 0; k < bind_info->bindCount; k++) {
+            VkSparseMemoryBind *bind = (VkSparseMemoryBind *)&bind_info->pBinds[k];
+            bind->memoryOffset += vkr_device_memory_get_block_offset(bind->memory);
+         }
+      }
+
+      for (uint32_t j = 0; j < info->imageOpaqueBindCount; j++) {
+         const VkSparseImageOpaqueMemoryBindInfo *bind_info = &info->pImageOpaqueBinds[j];
+         for (uint32_t k = 0; k < bind_info->bindCount; k++) {
+            VkSparseMemoryBind *bind = (VkSparseMemoryBind *)&bind_info->pBinds[k];
+            bind->memoryOffset += vkr_device_memory_get_block_offset(bind->memory);
+         }
+      }
+
+      for (uint32_t j = 0; j < info->imageBindCount; j++) {
+         const VkSparseImageMemoryBindInfo *bind_info = &info->pImageBinds[j];
+         for (uint32_t k = 0; k < bind_info->bindCount; k++) {
+            VkSparseImageMemoryBind *bind =
+               (VkSparseImageMemoryBind *)&bind_info->pBinds[k];
+            bind->memoryOffset += vkr_device_memory_get_block_offset(bind->memory);
+         }
+      }
+   }
+}
+
+static bool
+vkr_queue_can_defer_sparse_bind_info(const VkBindSparseInfo *info)
+{
+   const VkBaseInStructure *pnext = info->pNext;
+   return !pnext ||
+          (pnext->sType == VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO && !pnext->pNext);
+}
+
+static size_t
+vkr_queue_get_sparse_bind_info_size(const VkBindSparseInfo *info)
+{
+   size_t size = sizeof(VkSemaphore) * (info->waitSemaphoreCount + info->signalSemaphoreCount);
+
+   if (info->pNext) {
+      const VkTimelineSemaphoreSubmitInfo *timeline = info->pNext;
+      size += sizeof(*timeline) + sizeof(uint64_t) * (timeline->waitSemaphoreValueCount +
+                                                      timeline->signalSemaphoreValueCount);
+   }
+
+   size += sizeof(*info->pBufferBinds) * info->bufferBindCount;
+   for (uint32_t i = 0; i < info->bufferBindCount; i++)
+      size += sizeof(VkSparseMemoryBind) * info->pBufferBinds[i].bindCount;
+
+   size += sizeof(*info->pImageOpaqueBinds) * info->imageOpaqueBindCount;
+   for (uint32_t i = 0; i < info->imageOpaqueBindCount; i++)
+      size += sizeof(VkSparseMemoryBind) * info->pImageOpaqueBinds[i].bindCount;
+
+   size += sizeof(*info->pImageBinds) * info->imageBindCount;
+   for (uint32_t i = 0; i < info->imageBindCount; i++)
+      size += sizeof(VkSparseImageMemoryBind) * info->pImageBinds[i].bindCount;
+
+   return size;
+}
+
+/* all the copied structs have 8-byte members, so the block stays aligned */
+static void *
+vkr_queue_copy_sparse_array(uint8_t **ptr, const void *src, size_t size)
+{
+   void *dst = *ptr;
+   if (size)
+      memcpy(dst, src, size);
+   *ptr += size;
+   return dst;
+}
+
+static void
+vkr_queue_copy_sparse_bind_info(VkBindSparseInfo *dst,
+                                const VkBindSparseInfo *src,
+                                uint8_t **ptr)
+{
+   *dst = *src;
+
+   dst->pWaitSemaphores = vkr_queue_copy_sparse_array(
+      ptr, src->pWaitSemaphores, sizeof(VkSemaphore) * src->waitSemaphoreCount);
+   dst->pSignalSemaphores = vkr_queue_copy_sparse_array(
+      ptr, src->pSignalSemaphores, sizeof(VkSemaphore) * src->signalSemaphoreCount);
+
+   if (src->pNext) {
+      const VkTimelineSemaphoreSubmitInfo *timeline = src->pNext;
+      VkTimelineSemaphoreSubmitInfo *copy =
+         vkr_queue_copy_sparse_array(ptr, timeline, sizeof(*timeline));
+      copy->pWaitSemaphoreValues =
+         vkr_queue_copy_sparse_array(ptr, timeline->pWaitSemaphoreValues,
+                                     sizeof(uint64_t) * timeline->waitSemaphoreValueCount);
+      copy->pSignalSemaphoreValues =
+         vkr_queue_copy_sparse_array(ptr, timeline->pSignalSemaphoreValues,
+                                     sizeof(uint64_t) * timeline->signalSemaphoreValueCount);
+      dst->pNext = copy;
+   }
+
+   VkSparseBufferMemoryBindInfo *buffer_binds = vkr_queue_copy_sparse_array(
+      ptr, src->pBufferBinds, sizeof(*src->pBufferBinds) * src->bufferBindCount);
+   for (uint32_t i = 0; i < src->bufferBindCount; i++) {
+      buffer_binds[i].pBinds = vkr_queue_copy_sparse_array(
+         ptr, buffer_binds[i].pBinds, sizeof(VkSparseMemoryBind) * buffer_binds[i].bindCount);
+   }
+   dst->pBufferBinds = buffer_binds;
+
+   VkSparseImageOpaqueMemoryBindInfo *opaque_binds = vkr_queue_copy_sparse_array(
+      ptr, src->pImageOpaqueBinds, sizeof(*src->pImageOpaqueBinds) * src->imageOpaqueBindCount);
+   for (uint32_t i = 0; i < src->imageOpaqueBindCount; i++) {
+      opaque_binds[i].pBinds = vkr_queue_copy_sparse_array(
+         ptr, opaque_binds[i].pBinds, sizeof(VkSparseMemoryBind) * opaque_binds[i].bindCount);
+   }
+   dst->pImageOpaqueBinds = opaque_binds;
+
+   VkSparseImageMemoryBindInfo *image_binds = vkr_queue_copy_sparse_array(
+      ptr, src->pImageBinds, sizeof(*src->pImageBinds) * src->imageBindCount);
+   for (uint32_t i = 0; i < src->imageBindCount; i++) {
+      image_binds[i].pBinds =
+         vkr_queue_copy_sparse_array(ptr, image_binds[i].pBinds,
+                                     sizeof(VkSparseImageMemoryBind) * image_binds[i].bindCount);
+   }
+   dst->pImageBinds = image_binds;
+}
+
+void
+vkr_queue_flush_sparse_binds(struct vkr_cs_decoder *dec)
+{
+   struct vkr_queue_sparse_binds *binds = dec->sparse_binds;
+   if (!binds || !binds->info_count)
+      return;
+
+   TRACE_FUNC();
+   struct vkr_queue *queue = binds->queue;
+   struct vn_device_proc_table *vk = &queue->device->proc_table;
+
+   mtx_lock(&queue->vk_mutex);
+   const VkResult result =
+      vk->QueueBindSparse(queue->base.handle.queue, binds->info_count, binds->infos,
+                          VK_NULL_HANDLE);
+   mtx_unlock(&queue->vk_mutex);
+   if (result != VK_SUCCESS)
+      vkr_log("vkQueueBindSparse of %u deferred infos failed(%d)", binds->info_count,
+              (int32_t)result);
+
+   for (uint32_t i = 0; i < binds->block_count; i++)
+      free(binds->blocks[i]);
+   binds->block_count = 0;
+   binds->info_count = 0;
+   binds->queue = NULL;
+}
+
+bool
+vkr_queue_has_sparse_binds(const struct vkr_cs_decoder *dec)
+{
+   return dec->sparse_binds && dec->sparse_binds->info_count;
+}
+
+void
+vkr_queue_fini_sparse_binds(struct vkr_cs_decoder *dec)
+{
+   struct vkr_queue_sparse_binds *binds = dec->sparse_binds;
+   if (!binds)
+      return;
+
+   /* the queue might be gone, and the guest cannot wait for the binds anymore */
+   for (uint32_t i = 0; i < binds->block_count; i++)
+      free(binds->blocks[i]);
+   free(binds->blocks);
+   free(binds->infos);
+   free(binds);
+   dec->sparse_binds = NULL;
+}
+
+/* Copies the binds to be submitted together with the following fence-less
+ * vkQueueBindSparse calls on the same queue.  Nothing can observe them before
+ * a later command is dispatched, and any other command submits them first.
+ */
+static bool
+vkr_queue_defer_sparse_binds(struct vkr_cs_decoder *dec,
+                             struct vkr_queue *queue,
+                             uint32_t count,
+                             const VkBindSparseInfo *infos)
+{
+   size_t size = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      if (!vkr_queue_can_defer_sparse_bind_info(&infos[i]))
+         return false;
+      size += vkr_queue_get_sparse_bind_info_size(&infos[i]);
+   }
+
+   if (!dec->sparse_binds) {
+      dec->sparse_binds = calloc(1, sizeof(*dec->sparse_binds));
+      if (!dec->sparse_binds)
+         return false;
+   }
+   struct vkr_queue_sparse_binds *binds = dec->sparse_binds;
+
+   if (binds->queue != queue ||
+       binds->info_count + count > VKR_QUEUE_SPARSE_BINDS_MAX_INFOS)
+      vkr_queue_flush_sparse_binds(dec);
+   if (count > VKR_QUEUE_SPARSE_BINDS_MAX_INFOS)
+      return false;
+
+   if (binds->info_count + count > binds->info_capacity) {
+      VkBindSparseInfo *new_infos =
+         realloc(binds->infos, sizeof(*new_infos) * VKR_QUEUE_SPARSE_BINDS_MAX_INFOS);
+      if (!new_infos)
+         return false;
+      binds->infos = new_infos;
+      binds->info_capacity = VKR_QUEUE_SPARSE_BINDS_MAX_INFOS;
+   }
+
+   if (binds->block_count == binds->block_capacity) {
+      const uint32_t capacity = MAX2(binds->block_capacity * 2, 16);
+      void **new_blocks = realloc(binds->blocks, sizeof(*new_blocks) * capacity);
+      if (!new_blocks)
+         return false;
+      binds->blocks = new_blocks;
+      binds->block_capacity = capacity;
+   }
+
+   uint8_t *block = malloc(MAX2(size, 1));
+   if (!block)
+      return false;
+   binds->blocks[binds->block_count++] = block;
+
+   for (uint32_t i = 0; i < count; i++)
+      vkr_queue_copy_sparse_bind_info(&binds->infos[binds->info_count++], &infos[i], &block);
+   binds->queue = queue;
+
+   return true;
+}
+
 static void
-vkr_dispatch_vkQueueBindSparse(UNUSED struct vn_dispatch_context *dispatch,
+vkr_dispatch_vkQueueBindSparse(struct vn_dispatch_context *dispatch,
                                struct vn_command_vkQueueBindSparse *args)
 {
    TRACE_FUNC();
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
    struct vkr_queue *queue = vkr_queue_from_handle(args->queue);
    struct vn_device_proc_table *vk = &queue->device->proc_table;
 
+   /* the residency is tracked by the vkr objects */
+   for (uint32_t i = 0; i < args->bindInfoCount; i++)
+      vkr_sparse_residency_bind(ctx, &args->pBindInfo[i]);
+
+   vkr_queue_apply_sparse_block_offsets(args->bindInfoCount, args->pBindInfo);
+   vkr_fence_reset_signaled(args->fence);
    vn_replace_vkQueueBindSparse_args_handle(args);
 
+   /* a reply needs the result, and a fence is waited for by the guest */
+   if (!dec->sparse_bind_reply && args->fence == VK_NULL_HANDLE &&
+       vkr_queue_defer_sparse_binds(dec, queue, args->bindInfoCount, args->pBindInfo)) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
+   vkr_queue_flush_sparse_binds(dec);
+
    mtx_lock(&queue->vk_mutex);
    args->ret =
       vk->QueueBindSparse(args->queue, args->bindInfoCount, args->pBindInfo, args->fence);
@@ -434,6 +962,7 @@ vkr_dispatch_vkQueueSubmit2(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_queue *queue = vkr_queue_from_handle(args->queue);
    struct vn_device_proc_table *vk = &queue->device->proc_table;
 
+   vkr_fence_reset_signaled(args->fence);
    vn_replace_vkQueueSubmit2_args_handle(args);
 
    mtx_lock(&queue->vk_mutex);
@@ -471,6 +1000,9 @@ vkr_dispatch_vkResetFences(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   for (uint32_t i = 0; i < args->fenceCount; i++)
+      vkr_fence_reset_signaled(args->pFences[i]);
+
    vn_replace_vkResetFences_args_handle(args);
    args->ret = vk->ResetFences(args->device, args->fenceCount, args->pFences);
 }
@@ -482,8 +1014,17 @@ vkr_dispatch_vkGetFenceStatus(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   struct vkr_fence *fence = vkr_fence_from_handle(args->fence);
+
+   if (atomic_load_explicit(&fence->signaled, memory_order_relaxed)) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    vn_replace_vkGetFenceStatus_args_handle(args);
    args->ret = vk->GetFenceStatus(args->device, args->fence);
+   if (args->ret == VK_SUCCESS)
+      atomic_store_explicit(&fence->signaled, true, memory_order_relaxed);
 }
 
 static void
@@ -493,6 +1034,21 @@ vkr_dispatch_vkWaitForFences(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   /* the handles are replaced in place */
+   struct vkr_fence *single_fence =
+      args->fenceCount == 1 ? vkr_fence_from_handle(args->pFences[0]) : NULL;
+
+   uint32_t signaled_count = 0;
+   for (uint32_t i = 0; i < args->fenceCount; i++) {
+      const struct vkr_fence *fence = vkr_fence_from_handle(args->pFences[i]);
+      if (atomic_load_explicit(&fence->signaled, memory_order_relaxed))
+         signaled_count++;
+   }
+   if (signaled_count && (!args->waitAll || signaled_count == args->fenceCount)) {
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    fprintf(stderr, "[VKR] vkWaitForFences: fenceCount=%u timeout=%llu\n",
            args->fenceCount, (unsigned long long)args->timeout);
 
@@ -505,6 +1061,9 @@ vkr_dispatch_vkWaitForFences(UNUSED struct vn_dispatch_context *dispatch,
                                  args->waitAll, args->timeout);
 
    fprintf(stderr, "[VKR] vkWaitForFences: ret=%d\n", args->ret);
+
+   if (single_fence && args->ret == VK_SUCCESS)
+      atomic_store_explicit(&single_fence->signaled, true, memory_order_relaxed);
 }
 
 static void
@@ -516,6 +1075,9 @@ vkr_dispatch_vkResetFenceResourceMESA(struct vn_dispatch_context *dispatch,
    struct vn_device_proc_table *vk = &dev->proc_table;
    int fd = -1;
 
+   /* exporting a sync_fd resets the fence */
+   vkr_fence_reset_signaled(args->fence);
+
    vn_replace_vkResetFenceResourceMESA_args_handle(args);
 
    const VkFenceGetFdInfoKHR info = {
@@ -8,8 +8,13 @@
 
 #include "vkr_common.h"
 
+struct vkr_cs_decoder;
+
 struct vkr_queue_sync {
+   /* VK_NULL_HANDLE when the device uses timeline syncs */
    VkFence fence;
+   /* the value of vkr_queue::timeline that signals the sync */
+   uint64_t timeline_value;
    bool device_lost;
 
    uint32_t flags;
@@ -19,6 +24,28 @@ struct vkr_queue_sync {
    struct list_head head;
 };
 
+struct vkr_queue_sync_thread {
+   struct vkr_context *context;
+   struct vkr_device *device;
+
+   mtx_t mutex;
+   cnd_t cond;
+   thrd_t thread;
+   bool join;
+
+   /* queues with syncs to retire */
+   struct list_head busy_queues;
+
+   /* Shared threads wait for any of the queue timelines.  The wake timeline is
+    * signaled from the host to stop the wait when another queue becomes busy.
+    */
+   VkSemaphore wake;
+   uint64_t wake_value;
+   VkSemaphore *wait_semaphores;
+   uint64_t *wait_values;
+   uint32_t wait_capacity;
+};
+
 struct vkr_queue {
    struct vkr_object base;
 
@@ -37,22 +64,32 @@ struct vkr_queue {
     */
    mtx_t vk_mutex;
 
-   /* Submitted fences are added to sync_thread.syncs first. With required
-    * VKR_RENDERER_THREAD_SYNC and VKR_RENDERER_ASYNC_FENCE_CB in render server, the sync
-    * thread calls vkWaitForFences and retires signaled fences in order.
+   /* With vkr_device::use_timeline_sync, each sync submit signals the next value of
+    * the timeline semaphore instead of a fence.  The last value is protected by
+    * vk_mutex.
     */
-   struct {
-      mtx_t mutex;
-      cnd_t cond;
-      struct list_head syncs;
-      thrd_t thread;
-      bool join;
-   } sync_thread;
+   VkSemaphore timeline;
+   uint64_t timeline_value;
+
+   /* Submitted syncs are added to syncs first.  With required VKR_RENDERER_THREAD_SYNC
+    * and VKR_RENDERER_ASYNC_FENCE_CB in render server, the sync thread waits for them
+    * and retires signaled syncs in order.  The thread is shared by all queues of a
+    * device with timeline syncs, and owned by the queue otherwise.
+    */
+   struct vkr_queue_sync_thread *sync_thread;
+   /* protected by sync_thread->mutex */
+   struct list_head syncs;
+   struct list_head busy_head;
 };
 VKR_DEFINE_OBJECT_CAST(queue, VK_OBJECT_TYPE_QUEUE, VkQueue)
 
 struct vkr_fence {
    struct vkr_object base;
+
+   /* A fence stays signaled until it is reset, or submitted again.  Once the
+    * driver reports it signaled, status queries are answered from here.
+    */
+   atomic_bool signaled;
 };
 VKR_DEFINE_OBJECT_CAST(fence, VK_OBJECT_TYPE_FENCE, VkFence)
 
@@ -89,10 +126,32 @@ vkr_queue_create(struct vkr_context *ctx,
 void
 vkr_queue_destroy(struct vkr_context *ctx, struct vkr_queue *queue);
 
+struct vkr_queue_sync_thread *
+vkr_queue_sync_thread_create(struct vkr_context *ctx, struct vkr_device *dev, bool shared);
+
+/* retires the syncs that are left */
+void
+vkr_queue_sync_thread_destroy(struct vkr_queue_sync_thread *thread);
+
 bool
 vkr_queue_sync_submit(struct vkr_queue *queue,
                       uint32_t flags,
                       uint32_t ring_idx,
                       uint64_t fence_id);
 
+/* Submits the vkQueueBindSparse calls deferred by the decoder.  Consecutive
+ * fence-less calls on a queue are merged into one driver call, which is made
+ * before the next command other than vkQueueBindSparse is dispatched, and at
+ * the end of each submission.
+ */
+void
+vkr_queue_flush_sparse_binds(struct vkr_cs_decoder *dec);
+
+bool
+vkr_queue_has_sparse_binds(const struct vkr_cs_decoder *dec);
+
+/* drops the deferred vkQueueBindSparse calls */
+void
+vkr_queue_fini_sparse_binds(struct vkr_cs_decoder *dec);
+
 #endif /* VKR_QUEUE_H */
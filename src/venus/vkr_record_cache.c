@@ -0,0 +1,164 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_record_cache.h"
+
+#include "vkr_command_buffer.h"
+#include "vkr_context.h"
+#include "vkr_cs.h"
+#include "vkr_dispatch.h"
+
+/* larger recordings are decoded every time */
+#define VKR_RECORD_CACHE_MAX_SIZE (256 * 1024)
+
+static void
+vkr_record_cache_end_capture(struct vkr_cs_decoder *dec)
+{
+   dec->record_capture.cmd = NULL;
+   dec->record_capture.size = 0;
+}
+
+bool
+vkr_record_cache_begin_command(struct vn_dispatch_context *dispatch)
+{
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+   struct vkr_command_buffer *capture_cmd = dec->record_capture.cmd;
+
+   const vkr_object_id cmd_id = vkr_dispatch_get_recording_command_buffer(dec);
+   /* the command type and flags */
+   uint32_t header[2] = { 0, 0 };
+   if (cmd_id)
+      memcpy(header, dec->cur, sizeof(header));
+   const uint32_t type = header[0];
+
+   /* anything else in the middle of the recording ends the capture, and so
+    * does a command that asks for a reply
+    */
+   if (capture_cmd) {
+      if (cmd_id == capture_cmd->base.id &&
+          !(header[1] & VK_COMMAND_GENERATE_REPLY_BIT_EXT)) {
+         dec->record_capture.command = dec->cur;
+         dec->record_capture.end = type == VK_COMMAND_TYPE_vkEndCommandBuffer_EXT;
+         return false;
+      }
+      vkr_record_cache_end_capture(dec);
+   }
+
+   if (!cmd_id || type != VK_COMMAND_TYPE_vkBeginCommandBuffer_EXT)
+      return false;
+
+   struct vkr_command_buffer *cmd = (struct vkr_command_buffer *)vkr_cs_decoder_lookup_object(
+      dec, cmd_id, VK_OBJECT_TYPE_COMMAND_BUFFER);
+   /* the decoder is fatal, nothing is dispatched anymore */
+   if (!cmd)
+      return true;
+
+   /* the cached recordings have no command that asks for a reply, so none
+    * is lost by skipping them
+    */
+   const uint64_t epoch = atomic_load(&ctx->record_cache_epoch);
+   const struct vkr_record_cache_entry *entry = cmd->record_cache;
+   if (entry && entry->epoch == epoch && (size_t)(dec->end - dec->cur) >= entry->size &&
+       !memcmp(dec->cur, entry->data, entry->size)) {
+      dec->cur += entry->size;
+      return true;
+   }
+
+   if (header[1] & VK_COMMAND_GENERATE_REPLY_BIT_EXT)
+      return false;
+
+   dec->record_capture.cmd = cmd;
+   dec->record_capture.command = dec->cur;
+   dec->record_capture.size = 0;
+   dec->record_capture.epoch = epoch;
+   dec->record_capture.end = false;
+
+   return false;
+}
+
+/* copies the command that was just dispatched, while the stream still holds it */
+static bool
+vkr_record_cache_append_command(struct vkr_cs_decoder *dec)
+{
+   const size_t size = dec->cur - dec->record_capture.command;
+   const size_t total = dec->record_capture.size + size;
+   if (total > VKR_RECORD_CACHE_MAX_SIZE)
+      return false;
+
+   if (total > dec->record_capture.capacity) {
+      const size_t capacity = MIN2(MAX2(total, dec->record_capture.capacity * 2),
+                                   VKR_RECORD_CACHE_MAX_SIZE);
+      uint8_t *data = realloc(dec->record_capture.data, capacity);
+      if (!data)
+         return false;
+      dec->record_capture.data = data;
+      dec->record_capture.capacity = capacity;
+   }
+
+   memcpy(dec->record_capture.data + dec->record_capture.size,
+          dec->record_capture.command, size);
+   dec->record_capture.size = total;
+   return true;
+}
+
+void
+vkr_record_cache_end_command(struct vn_dispatch_context *dispatch)
+{
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+   struct vkr_command_buffer *cmd = dec->record_capture.cmd;
+
+   if (!cmd)
+      return;
+
+   if (vkr_cs_decoder_get_fatal(dec) || !cmd->record_cacheable ||
+       !vkr_record_cache_append_command(dec)) {
+      vkr_record_cache_end_capture(dec);
+      return;
+   }
+
+   if (!dec->record_capture.end)
+      return;
+
+   /* an object can be destroyed by another ring of the context meanwhile */
+   const size_t size = dec->record_capture.size;
+   vkr_record_cache_end_capture(dec);
+   if (atomic_load(&ctx->record_cache_epoch) != dec->record_capture.epoch)
+      return;
+
+   struct vkr_record_cache_entry *entry = malloc(sizeof(*entry) + size);
+   if (!entry)
+      return;
+
+   entry->epoch = dec->record_capture.epoch;
+   entry->size = size;
+   memcpy(entry->data, dec->record_capture.data, size);
+
+   free(cmd->record_cache);
+   cmd->record_cache = entry;
+}
+
+void
+vkr_record_cache_fini_decoder(struct vkr_cs_decoder *dec)
+{
+   free(dec->record_capture.data);
+   dec->record_capture.data = NULL;
+   dec->record_capture.capacity = 0;
+}
+
+void
+vkr_record_cache_invalidate(struct vkr_context *ctx)
+{
+   if (vkr_record_cache)
+      atomic_fetch_add(&ctx->record_cache_epoch, 1);
+}
+
+void
+vkr_record_cache_drop(struct vkr_command_buffer *cmd)
+{
+   free(cmd->record_cache);
+   cmd->record_cache = NULL;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_RECORD_CACHE_H
+#define VKR_RECORD_CACHE_H
+
+#include "vkr_common.h"
+
+#include "venus-protocol/vn_protocol_renderer_defines.h"
+
+struct vkr_cs_decoder;
+
+/* The cache of command buffer recordings, enabled with VKR_RECORD_CACHE.
+ *
+ * Guests often re-record a command buffer with the exact same commands every
+ * frame.  When a stream records a command buffer from vkBeginCommandBuffer to
+ * vkEndCommandBuffer with nothing else in between, the bytes of the recording
+ * are kept with the command buffer.  When the next recording of the command
+ * buffer is the same bytes, the host command buffer still holds what they
+ * record and they are skipped without being decoded.
+ *
+ * The bytes include the ids of the objects the commands reference.  A cached
+ * recording is dropped when the command buffer is reset, and all of them are
+ * stale once an object other than a command buffer is destroyed or a
+ * descriptor set is updated.  Recordings begun with
+ * VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, those executing secondary
+ * command buffers, and those with a command that asks for a reply, which
+ * would not be sent when the recording is skipped, are not cached.
+ */
+
+struct vkr_record_cache_entry {
+   /* the value of vkr_context::record_cache_epoch when it was recorded */
+   uint64_t epoch;
+   size_t size;
+   uint8_t data[];
+};
+
+/* Called before the next command is dispatched.  Returns true when the
+ * command begins a cached recording, which was skipped.
+ */
+bool
+vkr_record_cache_begin_command(struct vn_dispatch_context *dispatch);
+
+/* called after the command is dispatched */
+void
+vkr_record_cache_end_command(struct vn_dispatch_context *dispatch);
+
+void
+vkr_record_cache_fini_decoder(struct vkr_cs_decoder *dec);
+
+/* makes all cached recordings of the context stale */
+void
+vkr_record_cache_invalidate(struct vkr_context *ctx);
+
+void
+vkr_record_cache_drop(struct vkr_command_buffer *cmd);
+
+#endif /* VKR_RECORD_CACHE_H */
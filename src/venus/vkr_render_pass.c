@@ -5,13 +5,199 @@
 
 #include "vkr_render_pass.h"
 
+#include "vkr_image.h"
 #include "vkr_render_pass_gen.h"
+#include "vkr_shared_object.h"
+
+static bool
+vkr_render_pass_init_key(struct vkr_shared_key *key,
+                         const VkRenderPassCreateInfo *info)
+{
+   memset(key, 0, sizeof(*key));
+   if (info->pNext)
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD(key, info->flags);
+   VKR_SHARED_KEY_ADD_ARRAY(key, info->attachmentCount, info->pAttachments);
+
+   VKR_SHARED_KEY_ADD(key, info->subpassCount);
+   for (uint32_t i = 0; i < info->subpassCount; i++) {
+      const VkSubpassDescription *subpass = &info->pSubpasses[i];
+      VKR_SHARED_KEY_ADD(key, subpass->flags);
+      VKR_SHARED_KEY_ADD(key, subpass->pipelineBindPoint);
+      VKR_SHARED_KEY_ADD_ARRAY(key, subpass->inputAttachmentCount,
+                                    subpass->pInputAttachments);
+      VKR_SHARED_KEY_ADD_ARRAY(key, subpass->colorAttachmentCount,
+                                    subpass->pColorAttachments);
+      vkr_shared_key_add_optional(key, subpass->pResolveAttachments,
+                                       sizeof(*subpass->pResolveAttachments) *
+                                          subpass->colorAttachmentCount);
+      vkr_shared_key_add_optional(key, subpass->pDepthStencilAttachment,
+                                       sizeof(*subpass->pDepthStencilAttachment));
+      VKR_SHARED_KEY_ADD_ARRAY(key, subpass->preserveAttachmentCount,
+                                    subpass->pPreserveAttachments);
+   }
+
+   VKR_SHARED_KEY_ADD_ARRAY(key, info->dependencyCount, info->pDependencies);
+
+   return !key->failed;
+}
+
+static bool
+vkr_render_pass_key_add_reference2(struct vkr_shared_key *key,
+                                   const VkAttachmentReference2 *ref)
+{
+   if (ref->pNext)
+      return false;
+
+   VKR_SHARED_KEY_ADD_MEMBERS(key, VkAttachmentReference2, ref, attachment,
+                                   aspectMask);
+   return true;
+}
+
+static bool
+vkr_render_pass_key_add_references2(struct vkr_shared_key *key,
+                                    uint32_t count,
+                                    const VkAttachmentReference2 *refs)
+{
+   const bool present = refs;
+   VKR_SHARED_KEY_ADD(key, present);
+   if (!present)
+      return true;
+
+   VKR_SHARED_KEY_ADD(key, count);
+   for (uint32_t i = 0; i < count; i++) {
+      if (!vkr_render_pass_key_add_reference2(key, &refs[i]))
+         return false;
+   }
+   return true;
+}
+
+static bool
+vkr_render_pass_init_key2(struct vkr_shared_key *key,
+                          const VkRenderPassCreateInfo2 *info)
+{
+   memset(key, 0, sizeof(*key));
+   if (info->pNext)
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD(key, info->flags);
+
+   VKR_SHARED_KEY_ADD(key, info->attachmentCount);
+   for (uint32_t i = 0; i < info->attachmentCount; i++) {
+      const VkAttachmentDescription2 *att = &info->pAttachments[i];
+      if (att->pNext)
+         return false;
+      VKR_SHARED_KEY_ADD_MEMBERS(key, VkAttachmentDescription2, att, flags,
+                                      finalLayout);
+   }
+
+   VKR_SHARED_KEY_ADD(key, info->subpassCount);
+   for (uint32_t i = 0; i < info->subpassCount; i++) {
+      const VkSubpassDescription2 *subpass = &info->pSubpasses[i];
+      if (subpass->pNext)
+         return false;
+      VKR_SHARED_KEY_ADD(key, subpass->flags);
+      VKR_SHARED_KEY_ADD(key, subpass->pipelineBindPoint);
+      VKR_SHARED_KEY_ADD(key, subpass->viewMask);
+      if (!vkr_render_pass_key_add_references2(key, subpass->inputAttachmentCount,
+                                               subpass->pInputAttachments) ||
+          !vkr_render_pass_key_add_references2(key, subpass->colorAttachmentCount,
+                                               subpass->pColorAttachments) ||
+          !vkr_render_pass_key_add_references2(key, subpass->colorAttachmentCount,
+                                               subpass->pResolveAttachments) ||
+          !vkr_render_pass_key_add_references2(key, 1, subpass->pDepthStencilAttachment))
+         return false;
+      VKR_SHARED_KEY_ADD_ARRAY(key, subpass->preserveAttachmentCount,
+                                    subpass->pPreserveAttachments);
+   }
+
+   VKR_SHARED_KEY_ADD(key, info->dependencyCount);
+   for (uint32_t i = 0; i < info->dependencyCount; i++) {
+      const VkSubpassDependency2 *dep = &info->pDependencies[i];
+      if (dep->pNext)
+         return false;
+      VKR_SHARED_KEY_ADD_MEMBERS(key, VkSubpassDependency2, dep, srcSubpass,
+                                      viewOffset);
+   }
+
+   VKR_SHARED_KEY_ADD_ARRAY(key, info->correlatedViewMaskCount,
+                                 info->pCorrelatedViewMasks);
+
+   return !key->failed;
+}
+
+/* Framebuffers are only shared when their render pass is, and are keyed by the
+ * ids of their attachments.
+ */
+static bool
+vkr_framebuffer_init_key(struct vkr_shared_key *key,
+                         const VkFramebufferCreateInfo *info)
+{
+   memset(key, 0, sizeof(*key));
+
+   /* imageless framebuffers chain their attachment infos */
+   const struct vkr_render_pass *pass = vkr_render_pass_from_handle(info->renderPass);
+   if (info->pNext || !pass || !pass->shared)
+      return false;
+
+   VKR_SHARED_KEY_ADD(key, info->sType);
+   VKR_SHARED_KEY_ADD(key, info->flags);
+   VKR_SHARED_KEY_ADD(key, pass->shared->serial);
+   VKR_SHARED_KEY_ADD(key, info->width);
+   VKR_SHARED_KEY_ADD(key, info->height);
+   VKR_SHARED_KEY_ADD(key, info->layers);
+
+   VKR_SHARED_KEY_ADD(key, info->attachmentCount);
+   for (uint32_t i = 0; i < info->attachmentCount; i++) {
+      const struct vkr_image_view *view = vkr_image_view_from_handle(info->pAttachments[i]);
+      if (!view)
+         return false;
+      VKR_SHARED_KEY_ADD(key, view->base.id);
+   }
+
+   return !key->failed;
+}
 
 static void
 vkr_dispatch_vkCreateRenderPass(struct vn_dispatch_context *dispatch,
                                 struct vn_command_vkCreateRenderPass *args)
 {
-   vkr_render_pass_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   struct vkr_shared_key key = { 0 };
+   if (!dev->shared_objects || !vkr_render_pass_init_key(&key, args->pCreateInfo)) {
+      vkr_shared_key_fini(&key);
+      vkr_render_pass_create_and_add(ctx, args);
+      return;
+   }
+
+   struct vkr_render_pass *pass = vkr_context_alloc_object(
+      ctx, sizeof(*pass), VK_OBJECT_TYPE_RENDER_PASS, args->pRenderPass);
+   if (!pass) {
+      vkr_shared_key_fini(&key);
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   pass->shared = vkr_shared_object_get(dev, &key);
+   if (pass->shared) {
+      pass->base.handle.u64 = pass->shared->handle;
+      args->ret = VK_SUCCESS;
+   } else if (vkr_render_pass_create_driver_handle(ctx, args, pass) == VK_SUCCESS) {
+      pass->shared = vkr_shared_object_add(dev, &key,
+                                                pass->base.handle.u64);
+   } else {
+      vkr_shared_key_fini(&key);
+      free(pass);
+      return;
+   }
+   vkr_shared_key_fini(&key);
+
+   vkr_device_add_object(ctx, dev, &pass->base);
 }
 
 static void
@@ -22,21 +208,44 @@ vkr_dispatch_vkCreateRenderPass2(struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   struct vkr_shared_key key = { 0 };
+   const bool shareable =
+      dev->shared_objects && vkr_render_pass_init_key2(&key, args->pCreateInfo);
+
    struct vkr_render_pass *pass = vkr_context_alloc_object(
       ctx, sizeof(*pass), VK_OBJECT_TYPE_RENDER_PASS, args->pRenderPass);
    if (!pass) {
+      vkr_shared_key_fini(&key);
       args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
       return;
    }
 
+   if (shareable) {
+      pass->shared = vkr_shared_object_get(dev, &key);
+      if (pass->shared) {
+         vkr_shared_key_fini(&key);
+         pass->base.handle.u64 = pass->shared->handle;
+         args->ret = VK_SUCCESS;
+         vkr_device_add_object(ctx, dev, &pass->base);
+         return;
+      }
+   }
+
    vn_replace_vkCreateRenderPass2_args_handle(args);
    args->ret = vk->CreateRenderPass2(args->device, args->pCreateInfo, NULL,
                                      &pass->base.handle.render_pass);
    if (args->ret != VK_SUCCESS) {
+      vkr_shared_key_fini(&key);
       free(pass);
       return;
    }
 
+   if (shareable) {
+      pass->shared = vkr_shared_object_add(dev, &key,
+                                                pass->base.handle.u64);
+   }
+   vkr_shared_key_fini(&key);
+
    vkr_device_add_object(ctx, dev, &pass->base);
 }
 
@@ -44,7 +253,15 @@ static void
 vkr_dispatch_vkDestroyRenderPass(struct vn_dispatch_context *dispatch,
                                  struct vn_command_vkDestroyRenderPass *args)
 {
-   vkr_render_pass_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_render_pass *pass = vkr_render_pass_from_handle(args->renderPass);
+   if (pass && !vkr_shared_object_release(dev, &pass->base)) {
+      vkr_device_remove_object(ctx, dev, &pass->base);
+      return;
+   }
+
+   vkr_render_pass_destroy_and_remove(ctx, args);
 }
 
 static void
@@ -75,14 +292,55 @@ static void
 vkr_dispatch_vkCreateFramebuffer(struct vn_dispatch_context *dispatch,
                                  struct vn_command_vkCreateFramebuffer *args)
 {
-   vkr_framebuffer_create_and_add(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+
+   /* the key is made of object ids, before the handles are replaced */
+   struct vkr_shared_key key = { 0 };
+   if (!dev->shared_objects || !vkr_framebuffer_init_key(&key, args->pCreateInfo)) {
+      vkr_shared_key_fini(&key);
+      vkr_framebuffer_create_and_add(ctx, args);
+      return;
+   }
+
+   struct vkr_framebuffer *fb = vkr_context_alloc_object(
+      ctx, sizeof(*fb), VK_OBJECT_TYPE_FRAMEBUFFER, args->pFramebuffer);
+   if (!fb) {
+      vkr_shared_key_fini(&key);
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return;
+   }
+
+   fb->shared = vkr_shared_object_get(dev, &key);
+   if (fb->shared) {
+      fb->base.handle.u64 = fb->shared->handle;
+      args->ret = VK_SUCCESS;
+   } else if (vkr_framebuffer_create_driver_handle(ctx, args, fb) == VK_SUCCESS) {
+      fb->shared =
+         vkr_shared_object_add(dev, &key, fb->base.handle.u64);
+   } else {
+      vkr_shared_key_fini(&key);
+      free(fb);
+      return;
+   }
+   vkr_shared_key_fini(&key);
+
+   vkr_device_add_object(ctx, dev, &fb->base);
 }
 
 static void
 vkr_dispatch_vkDestroyFramebuffer(struct vn_dispatch_context *dispatch,
                                   struct vn_command_vkDestroyFramebuffer *args)
 {
-   vkr_framebuffer_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_framebuffer *fb = vkr_framebuffer_from_handle(args->framebuffer);
+   if (fb && !vkr_shared_object_release(dev, &fb->base)) {
+      vkr_device_remove_object(ctx, dev, &fb->base);
+      return;
+   }
+
+   vkr_framebuffer_destroy_and_remove(ctx, args);
 }
 
 void
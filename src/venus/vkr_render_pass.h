@@ -8,13 +8,21 @@
 
 #include "vkr_common.h"
 
+struct vkr_shared_object;
+
 struct vkr_render_pass {
    struct vkr_object base;
+
+   /* NULL when the driver render pass is not shared, see vkr_shared_object.h */
+   struct vkr_shared_object *shared;
 };
 VKR_DEFINE_OBJECT_CAST(render_pass, VK_OBJECT_TYPE_RENDER_PASS, VkRenderPass)
 
 struct vkr_framebuffer {
    struct vkr_object base;
+
+   /* NULL when the driver framebuffer is not shared */
+   struct vkr_shared_object *shared;
 };
 VKR_DEFINE_OBJECT_CAST(framebuffer, VK_OBJECT_TYPE_FRAMEBUFFER, VkFramebuffer)
 
@@ -10,12 +10,35 @@
 #include "venus_hw.h"
 
 #include "vkr_context.h"
+#include "vkr_host_copy.h"
+#include "vkr_instance_pool.h"
+#include "vkr_physical_device.h"
+#include "vkr_ring_monitor.h"
+#include "vkr_stream_pool.h"
 
 struct vkr_renderer_state {
    const struct vkr_renderer_callbacks *cbs;
+   bool on_worker_thread;
 
    /* track the vkr_context */
    struct list_head contexts;
+
+   /* With worker threads, the destroyed contexts are torn down on a thread
+    * so that the server is not blocked by vkDeviceWaitIdle and the driver
+    * teardown.  The contexts are detached first, they no longer retire
+    * fences and their ids can be reused right away.
+    */
+   struct {
+      bool init_ok;
+      mtx_t mutex;
+      /* signaled when a context is queued, or on quit */
+      cnd_t cond;
+      struct list_head contexts;
+
+      bool started;
+      bool quit;
+      thrd_t thread;
+   } teardown;
 };
 
 struct vkr_renderer_state vkr_state;
@@ -57,6 +80,94 @@ vkr_get_capset(void *capset, uint32_t flags)
    return sizeof(*c);
 }
 
+static int
+vkr_renderer_teardown_thread(UNUSED void *arg)
+{
+   u_thread_setname("vkr-teardown");
+
+   mtx_lock(&vkr_state.teardown.mutex);
+   while (true) {
+      if (list_is_empty(&vkr_state.teardown.contexts)) {
+         if (vkr_state.teardown.quit)
+            break;
+         cnd_wait(&vkr_state.teardown.cond, &vkr_state.teardown.mutex);
+         continue;
+      }
+
+      struct vkr_context *ctx =
+         list_first_entry(&vkr_state.teardown.contexts, struct vkr_context, head);
+      list_del(&ctx->head);
+      mtx_unlock(&vkr_state.teardown.mutex);
+
+      vkr_context_destroy(ctx);
+
+      mtx_lock(&vkr_state.teardown.mutex);
+   }
+   mtx_unlock(&vkr_state.teardown.mutex);
+
+   return 0;
+}
+
+static void
+vkr_renderer_teardown_init(void)
+{
+   if (mtx_init(&vkr_state.teardown.mutex, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vkr_state.teardown.cond) != thrd_success) {
+      mtx_destroy(&vkr_state.teardown.mutex);
+      return;
+   }
+
+   list_inithead(&vkr_state.teardown.contexts);
+   vkr_state.teardown.started = false;
+   vkr_state.teardown.quit = false;
+   vkr_state.teardown.init_ok = true;
+}
+
+/* waits for the queued contexts */
+static void
+vkr_renderer_teardown_fini(void)
+{
+   if (!vkr_state.teardown.init_ok)
+      return;
+
+   if (vkr_state.teardown.started) {
+      mtx_lock(&vkr_state.teardown.mutex);
+      vkr_state.teardown.quit = true;
+      cnd_signal(&vkr_state.teardown.cond);
+      mtx_unlock(&vkr_state.teardown.mutex);
+
+      thrd_join(vkr_state.teardown.thread, NULL);
+   }
+
+   cnd_destroy(&vkr_state.teardown.cond);
+   mtx_destroy(&vkr_state.teardown.mutex);
+   vkr_state.teardown.init_ok = false;
+}
+
+static bool
+vkr_renderer_teardown_queue(struct vkr_context *ctx)
+{
+   if (!vkr_state.teardown.init_ok)
+      return false;
+
+   if (!vkr_state.teardown.started) {
+      if (thrd_create(&vkr_state.teardown.thread, vkr_renderer_teardown_thread, NULL) !=
+          thrd_success)
+         return false;
+      vkr_state.teardown.started = true;
+   }
+
+   vkr_context_detach(ctx);
+
+   mtx_lock(&vkr_state.teardown.mutex);
+   list_addtail(&ctx->head, &vkr_state.teardown.contexts);
+   cnd_signal(&vkr_state.teardown.cond);
+   mtx_unlock(&vkr_state.teardown.mutex);
+
+   return true;
+}
+
 bool
 vkr_renderer_init(uint32_t flags, const struct vkr_renderer_callbacks *cbs)
 {
@@ -72,8 +183,12 @@ vkr_renderer_init(uint32_t flags, const struct vkr_renderer_callbacks *cbs)
    virgl_log_set_handler(cbs->debug_logger, NULL, NULL);
 
    vkr_state.cbs = cbs;
+   vkr_state.on_worker_thread = flags & VKR_RENDERER_WORKER_THREAD;
    list_inithead(&vkr_state.contexts);
 
+   if (vkr_state.on_worker_thread)
+      vkr_renderer_teardown_init();
+
    return true;
 }
 
@@ -85,6 +200,14 @@ vkr_renderer_fini(void)
 
    list_inithead(&vkr_state.contexts);
 
+   vkr_renderer_teardown_fini();
+
+   vkr_host_copy_fini();
+   vkr_ring_monitor_fini();
+   vkr_stream_pool_fini();
+   vkr_instance_pool_fini();
+   vkr_physical_device_fini_caches();
+
    vkr_state.cbs = NULL;
 }
 
@@ -119,7 +242,8 @@ vkr_renderer_create_context(uint32_t ctx_id,
    if (ctx)
       return false;
 
-   ctx = vkr_context_create(ctx_id, vkr_state.cbs->retire_fence, nlen, name);
+   ctx = vkr_context_create(ctx_id, vkr_state.cbs->retire_fence, nlen, name,
+                            vkr_state.on_worker_thread);
    if (!ctx)
       return false;
 
@@ -138,7 +262,8 @@ vkr_renderer_destroy_context(uint32_t ctx_id)
       return;
 
    list_del(&ctx->head);
-   vkr_context_destroy(ctx);
+   if (!vkr_renderer_teardown_queue(ctx))
+      vkr_context_destroy(ctx);
 }
 
 bool
@@ -238,3 +363,16 @@ vkr_renderer_destroy_resource(uint32_t ctx_id, uint32_t res_id)
    if (ctx)
       vkr_context_destroy_resource(ctx, res_id);
 }
+
+bool
+vkr_renderer_get_context_stats(uint32_t ctx_id, struct virgl_renderer_stats *stats)
+{
+   TRACE_FUNC();
+
+   struct vkr_context *ctx = vkr_renderer_lookup_context(ctx_id);
+   if (!ctx)
+      return false;
+
+   vkr_context_get_stats(ctx, stats);
+   return true;
+}
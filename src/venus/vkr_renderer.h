@@ -16,6 +16,8 @@
 
 #define VKR_RENDERER_THREAD_SYNC (1u << 0)
 #define VKR_RENDERER_ASYNC_FENCE_CB (1u << 1)
+/* contexts are serviced by threads of a process that outlives them */
+#define VKR_RENDERER_WORKER_THREAD (1u << 2)
 
 typedef void (*vkr_renderer_retire_fence_callback_type)(uint32_t ctx_id,
                                                         uint32_t ring_idx,
@@ -74,4 +76,8 @@ vkr_renderer_import_resource(uint32_t ctx_id,
 void
 vkr_renderer_destroy_resource(uint32_t ctx_id, uint32_t res_id);
 
+/* adds the counters of the context to stats */
+bool
+vkr_renderer_get_context_stats(uint32_t ctx_id, struct virgl_renderer_stats *stats);
+
 #endif /* VKR_RENDERER_H */
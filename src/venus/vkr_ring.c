@@ -9,9 +9,18 @@
 #include <sys/resource.h>
 #include <time.h>
 
-#include "venus-protocol/vn_protocol_renderer_dispatches.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
+#include "vkr_command_buffer.h"
 #include "vkr_context.h"
+#include "vkr_dispatch.h"
+#include "vkr_queue.h"
+
+#include "virgl_numa.h"
 
 static inline void *
 get_resource_pointer(const struct vkr_resource *res, size_t offset)
@@ -81,23 +90,44 @@ vkr_ring_unset_status_bits(struct vkr_ring *ring, uint32_t mask)
    atomic_fetch_and_explicit(ring->control.status, ~mask, memory_order_seq_cst);
 }
 
-static void
-vkr_ring_read_buffer(struct vkr_ring *ring, void *data, uint32_t size)
+/* Returns the next size bytes of the buffer region, or NULL when out of
+ * memory.  They are decoded in place unless they wrap around, in which case
+ * they are copied to ring->cmd first.  ring->cmd grows to the largest
+ * wrapped batch seen so far, which is usually far smaller than the ring.
+ * The decoder copies out every value it reads, and snapshots those
+ * it peeks, so the driver modifying the commands while they are decoded can
+ * only produce invalid commands.
+ */
+static const uint8_t *
+vkr_ring_consume_buffer(struct vkr_ring *ring, uint32_t size)
 {
    struct vkr_ring_buffer *buf = &ring->buffer;
+   const uint8_t *data;
 
    const size_t offset = buf->cur & buf->mask;
    assert(size <= buf->size);
    if (offset + size <= buf->size) {
-      memcpy(data, buf->data + offset, size);
+      data = buf->data + offset;
    } else {
+      if (size > ring->cmd_size) {
+         const uint32_t cmd_size = util_next_power_of_two(size);
+         void *cmd = realloc(ring->cmd, cmd_size);
+         if (!cmd)
+            return NULL;
+         ring->cmd = cmd;
+         ring->cmd_size = cmd_size;
+      }
+
       const size_t s = buf->size - offset;
-      memcpy(data, buf->data + offset, s);
-      memcpy((uint8_t *)data + s, buf->data, size - s);
+      memcpy(ring->cmd, buf->data + offset, s);
+      memcpy((uint8_t *)ring->cmd + s, buf->data, size - s);
+      data = ring->cmd;
    }
 
    /* advance cur */
    buf->cur += size;
+
+   return data;
 }
 
 static inline void
@@ -125,10 +155,6 @@ vkr_ring_create(const struct vkr_ring_layout *layout,
    vkr_ring_init_buffer(ring, layout);
    vkr_ring_init_extra(ring, layout);
 
-   ring->cmd = malloc(ring->buffer.size);
-   if (!ring->cmd)
-      goto err_cmd_malloc;
-
    if (vkr_cs_decoder_init(&ring->decoder, ctx))
       goto err_cs_decoder_init;
 
@@ -137,7 +163,13 @@ vkr_ring_create(const struct vkr_ring_layout *layout,
 
    vkr_ring_init_dispatch(ring, ctx);
 
-   ring->idle_timeout = idle_timeout;
+   ring->wait_mode = vkr_ring_wait_mode;
+#ifndef __linux__
+   if (ring->wait_mode == VKR_RING_WAIT_FUTEX)
+      ring->wait_mode = VKR_RING_WAIT_RELAX;
+#endif
+   /* the thread goes idle as soon as the ring is empty */
+   ring->idle_timeout = ring->wait_mode == VKR_RING_WAIT_NOTIFY ? 0 : idle_timeout;
 
    if (mtx_init(&ring->mutex, mtx_plain) != thrd_success)
       goto err_mtx_init;
@@ -155,7 +187,6 @@ err_cs_encoder_init:
    vkr_cs_decoder_fini(&ring->decoder);
 err_cs_decoder_init:
    free(ring->cmd);
-err_cmd_malloc:
 err_init_control:
    free(ring);
    return NULL;
@@ -167,6 +198,15 @@ vkr_ring_destroy(struct vkr_ring *ring)
    list_del(&ring->head);
 
    assert(!ring->started);
+
+   if (VKR_DEBUG(RING_STATS)) {
+      const struct vkr_ring_stats *stats = &ring->stats;
+      vkr_log("ring %" PRIu64 ": %" PRIu64 " submits, exec %" PRIu64 " us, spin %" PRIu64
+              " us, sleep %" PRIu64 " us, idle %" PRIu64 " us",
+              ring->id, stats->submit_count, stats->exec_time / 1000,
+              stats->spin_time / 1000, stats->sleep_time / 1000, stats->idle_time / 1000);
+   }
+
    vkr_cs_decoder_fini(&ring->decoder);
    vkr_cs_encoder_fini(&ring->encoder);
    mtx_destroy(&ring->mutex);
@@ -186,24 +226,23 @@ vkr_ring_now(void)
 }
 
 static void
-vkr_ring_relax(uint32_t *iter)
+vkr_ring_sleep(struct vkr_ring *ring, uint64_t ns)
 {
-   /* TODO do better */
-   const uint32_t busy_wait_order = 4;
-   const uint32_t base_sleep_us = 10;
+   const struct timespec ts = {
+      .tv_sec = ns / 1000000000,
+      .tv_nsec = ns % 1000000000,
+   };
 
-   (*iter)++;
-   if (*iter < (1u << busy_wait_order)) {
-      thrd_yield();
+#ifdef __linux__
+   if (ring->wait_mode == VKR_RING_WAIT_FUTEX) {
+      /* returns early when the tail has moved already or on FUTEX_WAKE */
+      syscall(SYS_futex, ring->control.tail, FUTEX_WAIT, ring->buffer.cur, &ts, NULL, 0);
       return;
    }
+#else
+   (void)ring;
+#endif
 
-   const uint32_t shift = util_last_bit(*iter) - busy_wait_order - 1;
-   const uint32_t us = base_sleep_us << shift;
-   const struct timespec ts = {
-      .tv_sec = us / 1000000,
-      .tv_nsec = (us % 1000000) * 1000,
-   };
 #ifdef __APPLE__
    /* macOS doesn't have clock_nanosleep, use nanosleep instead */
    nanosleep(&ts, NULL);
@@ -212,6 +251,57 @@ vkr_ring_relax(uint32_t *iter)
 #endif
 }
 
+static void
+vkr_ring_wake(struct vkr_ring *ring)
+{
+#ifdef __linux__
+   if (ring->wait_mode == VKR_RING_WAIT_FUTEX)
+      syscall(SYS_futex, ring->control.tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+   (void)ring;
+#endif
+}
+
+/* Waits a little for new commands, returns false when it only yielded */
+static bool
+vkr_ring_relax(struct vkr_ring *ring, uint32_t *iter, uint64_t waited)
+{
+   const uint32_t busy_wait_order = 4;
+   const uint64_t base_sleep_ns = 10000;
+
+   /* Spin while the next submit is expected within the spin limit and sleep
+    * until shortly before it is expected otherwise.  Once it is late, fall
+    * back to the exponential backoff.
+    */
+   if (ring->wait_mode == VKR_RING_WAIT_ADAPTIVE && waited < ring->submit_interval) {
+      const uint64_t max_spin_ns = 50000;
+      if (ring->submit_interval <= max_spin_ns) {
+         thrd_yield();
+         return false;
+      }
+
+      vkr_ring_sleep(ring, MAX2((ring->submit_interval - waited) / 2, base_sleep_ns));
+      return true;
+   }
+
+   (*iter)++;
+   if (*iter < (1u << busy_wait_order)) {
+      thrd_yield();
+      return false;
+   }
+
+   const uint32_t shift = util_last_bit(*iter) - busy_wait_order - 1;
+   vkr_ring_sleep(ring, base_sleep_ns << shift);
+   return true;
+}
+
+static void
+vkr_ring_update_submit_interval(struct vkr_ring *ring, uint64_t interval)
+{
+   /* exponential moving average with a weight of 1/8 for new samples */
+   ring->submit_interval = ring->submit_interval - ring->submit_interval / 8 + interval / 8;
+}
+
 static bool
 vkr_ring_submit_cmd(struct vkr_ring *ring,
                     const uint8_t *buffer,
@@ -227,20 +317,35 @@ vkr_ring_submit_cmd(struct vkr_ring *ring,
    vkr_cs_decoder_set_buffer_stream(dec, buffer, size);
 
    while (vkr_cs_decoder_has_command(dec)) {
-      vn_dispatch_command(&ring->dispatch);
+      vkr_dispatch_command(&ring->dispatch);
       if (vkr_cs_decoder_get_fatal(dec)) {
          vkr_log("ring_submit_cmd: vn_dispatch_command failed");
 
+         vkr_queue_flush_sparse_binds(dec);
+         vkr_command_buffer_flush_builds(dec);
          vkr_cs_decoder_reset(dec);
          return false;
       }
 
+      /* the guest must not see deferred binds as done */
+      if (vkr_queue_has_sparse_binds(dec))
+         continue;
+
       /* update the ring head intra-cs to optimize ring space */
       const uint32_t cur_ring_head = ring_head + (dec->cur - buffer);
       vkr_ring_store_head(ring, cur_ring_head);
       vkr_context_on_ring_seqno_update(ring->dispatch.data, ring->id, cur_ring_head);
    }
 
+   if (vkr_queue_has_sparse_binds(dec)) {
+      vkr_queue_flush_sparse_binds(dec);
+
+      const uint32_t cur_ring_head = ring_head + (dec->cur - buffer);
+      vkr_ring_store_head(ring, cur_ring_head);
+      vkr_context_on_ring_seqno_update(ring->dispatch.data, ring->id, cur_ring_head);
+   }
+
+   vkr_command_buffer_flush_builds(dec);
    vkr_cs_decoder_reset(dec);
    return true;
 }
@@ -254,6 +359,7 @@ vkr_ring_thread(void *arg)
 
    snprintf(thread_name, ARRAY_SIZE(thread_name), "vkr-ring-%d", ctx->ctx_id);
    u_thread_setname(thread_name);
+   virgl_numa_bind_thread();
    if (ring->prio_valid && setpriority(PRIO_PROCESS, 0, ring->prio)) {
 #ifdef DEBUG
       /* Currently venus doesn't forward the CAP_SYS_NICE request upon forking, so
@@ -266,6 +372,7 @@ vkr_ring_thread(void *arg)
 
    uint64_t last_submit = vkr_ring_now();
    uint32_t relax_iter = 0;
+   bool woken = true;
    int ret = 0;
    while (ring->started) {
       bool wait = false;
@@ -280,6 +387,7 @@ vkr_ring_thread(void *arg)
       if (wait) {
          TRACE_SCOPE("ring idle");
 
+         const uint64_t idle_begin = vkr_ring_now();
          mtx_lock(&ring->mutex);
          if (ring->started && !ring->pending_notify)
             cnd_wait(&ring->cond, &ring->mutex);
@@ -290,7 +398,9 @@ vkr_ring_thread(void *arg)
             break;
 
          last_submit = vkr_ring_now();
+         ring->stats.idle_time += last_submit - idle_begin;
          relax_iter = 0;
+         woken = true;
       }
 
       const uint32_t cmd_size = vkr_ring_load_tail(ring) - ring->buffer.cur;
@@ -302,16 +412,31 @@ vkr_ring_thread(void *arg)
             break;
          }
 
+         const uint64_t exec_begin = vkr_ring_now();
+         /* the interval to a submit that woke the thread up says nothing
+          * about how soon the next one can be expected
+          */
+         if (!woken)
+            vkr_ring_update_submit_interval(ring, exec_begin - last_submit);
+
          const uint32_t ring_head = ring->buffer.cur;
-         vkr_ring_read_buffer(ring, ring->cmd, cmd_size);
+         const uint8_t *cmd = vkr_ring_consume_buffer(ring, cmd_size);
+         if (!cmd) {
+            vkr_log("%s: failed to copy %u bytes of wrapped commands", __func__, cmd_size);
+            ret = -ENOMEM;
+            break;
+         }
 
-         if (!vkr_ring_submit_cmd(ring, ring->cmd, cmd_size, ring_head)) {
+         if (!vkr_ring_submit_cmd(ring, cmd, cmd_size, ring_head)) {
             ret = -EINVAL;
             break;
          }
 
          last_submit = vkr_ring_now();
+         ring->stats.exec_time += last_submit - exec_begin;
+         ring->stats.submit_count++;
          relax_iter = 0;
+         woken = false;
       } else {
          /* Get the active wait_ring seqno first to ensure ordering. */
          uint32_t wait_ring_seqno = 0;
@@ -329,7 +454,13 @@ vkr_ring_thread(void *arg)
             }
          }
 
-         vkr_ring_relax(&relax_iter);
+         const uint64_t relax_begin = vkr_ring_now();
+         const bool slept = vkr_ring_relax(ring, &relax_iter, relax_begin - last_submit);
+         const uint64_t relax_time = vkr_ring_now() - relax_begin;
+         if (slept)
+            ring->stats.sleep_time += relax_time;
+         else
+            ring->stats.spin_time += relax_time;
       }
    }
 
@@ -365,6 +496,7 @@ vkr_ring_stop(struct vkr_ring *ring)
    ring->started = false;
    cnd_signal(&ring->cond);
    mtx_unlock(&ring->mutex);
+   vkr_ring_wake(ring);
 
    thrd_join(ring->thread, NULL);
 
@@ -378,6 +510,7 @@ vkr_ring_notify(struct vkr_ring *ring)
    ring->pending_notify = true;
    cnd_signal(&ring->cond);
    mtx_unlock(&ring->mutex);
+   vkr_ring_wake(ring);
 
    {
       TRACE_SCOPE("ring notify done");
@@ -10,14 +10,13 @@
 
 #include "venus-protocol/vn_protocol_renderer_defines.h"
 
-/* We read from the ring buffer to a temporary buffer for
- * vkr_context_submit_cmd.  Until that is changed, we want to put a limit
- * on the size of the temporary buffer.  It also makes no sense to have huge
- * rings.
+/* Commands are decoded in place and the head advances after each of them,
+ * only commands that wrap around the end of the ring buffer are copied to a
+ * temporary buffer first.  It still makes no sense to have huge rings.
  *
  * This must not exceed UINT32_MAX because the ring head and tail are 32-bit.
  */
-#define VKR_RING_BUFFER_MAX_SIZE (16u * 1024 * 1024)
+#define VKR_RING_BUFFER_MAX_SIZE (256u * 1024 * 1024)
 
 /* The layout of a ring in a vkr_resource. This is parsed and
  * discarded by vkr_ring_create.
@@ -73,6 +72,15 @@ struct vkr_ring_extra {
    volatile atomic_uint *cached_data;
 };
 
+/* time spent by a ring thread, in nanoseconds */
+struct vkr_ring_stats {
+   uint64_t spin_time;
+   uint64_t sleep_time;
+   uint64_t idle_time;
+   uint64_t exec_time;
+   uint64_t submit_count;
+};
+
 struct vkr_ring {
    /* used by the caller */
    vkr_object_id id;
@@ -91,7 +99,15 @@ struct vkr_ring {
 
    /* ring thread */
    uint64_t idle_timeout;
+   enum vkr_ring_wait_mode wait_mode;
+   /* moving average of the time between the end of a submit and the arrival
+    * of the next one, used by VKR_RING_WAIT_ADAPTIVE
+    */
+   uint64_t submit_interval;
+   struct vkr_ring_stats stats;
+   /* wrapped commands are copied here */
    void *cmd;
+   uint32_t cmd_size;
 
    mtx_t mutex;
    cnd_t cond;
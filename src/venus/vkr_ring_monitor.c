@@ -0,0 +1,236 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_ring_monitor.h"
+
+#include <time.h>
+
+#include "vkr_context.h"
+#include "vkr_ring.h"
+
+#define NS_PER_US 1000ull
+#define NS_PER_SEC 1000000000ull
+
+/* a group due within this fraction of its period is marked early */
+#define VKR_RING_MONITOR_SLACK_DIVISOR 8
+
+struct vkr_ring_monitor_group {
+   struct list_head head;
+   uint32_t period_us;
+   /* CLOCK_MONOTONIC time the rings must be marked by */
+   uint64_t deadline;
+   struct list_head contexts;
+};
+
+static struct {
+   once_flag init_once;
+   bool init_ok;
+
+   mtx_t mutex;
+   /* signaled when a context is added, or on quit */
+   cnd_t cond;
+   struct list_head groups;
+
+   bool started;
+   bool quit;
+   thrd_t thread;
+} vkr_ring_monitor = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static uint64_t
+vkr_ring_monitor_now(clockid_t clock)
+{
+   struct timespec ts;
+   clock_gettime(clock, &ts);
+   return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void
+vkr_ring_monitor_init_once(void)
+{
+   if (mtx_init(&vkr_ring_monitor.mutex, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vkr_ring_monitor.cond) != thrd_success) {
+      mtx_destroy(&vkr_ring_monitor.mutex);
+      return;
+   }
+
+   list_inithead(&vkr_ring_monitor.groups);
+   vkr_ring_monitor.init_ok = true;
+}
+
+static void
+vkr_ring_monitor_mark_context(struct vkr_context *ctx)
+{
+   mtx_lock(&ctx->ring_mutex);
+   list_for_each_entry (struct vkr_ring, ring, &ctx->rings, head) {
+      if (ring->monitor)
+         vkr_ring_set_status_bits(ring, VK_RING_STATUS_ALIVE_BIT_MESA);
+   }
+   mtx_unlock(&ctx->ring_mutex);
+}
+
+/* marks the groups that are due, and returns the next deadline */
+static uint64_t
+vkr_ring_monitor_mark_groups(uint64_t now)
+{
+   uint64_t next = UINT64_MAX;
+
+   list_for_each_entry (struct vkr_ring_monitor_group, group, &vkr_ring_monitor.groups,
+                        head) {
+      const uint64_t period = group->period_us * NS_PER_US;
+      if (group->deadline <= now + period / VKR_RING_MONITOR_SLACK_DIVISOR) {
+         list_for_each_entry (struct vkr_context, ctx, &group->contexts, ring_monitor.head)
+            vkr_ring_monitor_mark_context(ctx);
+         group->deadline = now + period;
+      }
+      next = MIN2(next, group->deadline);
+   }
+
+   return next;
+}
+
+static int
+vkr_ring_monitor_thread(UNUSED void *arg)
+{
+   u_thread_setname("vkr-ringmon");
+
+   mtx_lock(&vkr_ring_monitor.mutex);
+   while (!vkr_ring_monitor.quit) {
+      const uint64_t now = vkr_ring_monitor_now(CLOCK_MONOTONIC);
+      const uint64_t next = vkr_ring_monitor_mark_groups(now);
+      if (next == UINT64_MAX) {
+         cnd_wait(&vkr_ring_monitor.cond, &vkr_ring_monitor.mutex);
+         continue;
+      }
+
+      /* cnd_timedwait takes a CLOCK_REALTIME time */
+      const uint64_t abs = vkr_ring_monitor_now(CLOCK_REALTIME) + (next - now);
+      const struct timespec ts = {
+         .tv_sec = abs / NS_PER_SEC,
+         .tv_nsec = abs % NS_PER_SEC,
+      };
+      cnd_timedwait(&vkr_ring_monitor.cond, &vkr_ring_monitor.mutex, &ts);
+   }
+   mtx_unlock(&vkr_ring_monitor.mutex);
+
+   return 0;
+}
+
+static struct vkr_ring_monitor_group *
+vkr_ring_monitor_get_group(uint32_t period_us)
+{
+   list_for_each_entry (struct vkr_ring_monitor_group, group, &vkr_ring_monitor.groups,
+                        head) {
+      if (group->period_us == period_us)
+         return group;
+   }
+
+   struct vkr_ring_monitor_group *group = calloc(1, sizeof(*group));
+   if (!group)
+      return NULL;
+
+   group->period_us = period_us;
+   list_inithead(&group->contexts);
+   list_addtail(&group->head, &vkr_ring_monitor.groups);
+   return group;
+}
+
+static void
+vkr_ring_monitor_unlink_context(struct vkr_context *ctx)
+{
+   struct vkr_ring_monitor_group *group = ctx->ring_monitor.group;
+
+   list_del(&ctx->ring_monitor.head);
+   ctx->ring_monitor.group = NULL;
+
+   if (list_is_empty(&group->contexts)) {
+      list_del(&group->head);
+      free(group);
+   }
+}
+
+bool
+vkr_ring_monitor_add_context(struct vkr_context *ctx, uint32_t report_period_us)
+{
+   assert(report_period_us > 0);
+
+   call_once(&vkr_ring_monitor.init_once, vkr_ring_monitor_init_once);
+   if (!vkr_ring_monitor.init_ok)
+      return false;
+
+   mtx_lock(&vkr_ring_monitor.mutex);
+
+   struct vkr_ring_monitor_group *old_group = ctx->ring_monitor.group;
+   if (old_group && old_group->period_us <= report_period_us) {
+      mtx_unlock(&vkr_ring_monitor.mutex);
+      return true;
+   }
+
+   if (!vkr_ring_monitor.started) {
+      vkr_ring_monitor.quit = false;
+      if (thrd_create(&vkr_ring_monitor.thread, vkr_ring_monitor_thread, NULL) !=
+          thrd_success) {
+         mtx_unlock(&vkr_ring_monitor.mutex);
+         return false;
+      }
+      vkr_ring_monitor.started = true;
+   }
+
+   struct vkr_ring_monitor_group *group = vkr_ring_monitor_get_group(report_period_us);
+   if (!group) {
+      mtx_unlock(&vkr_ring_monitor.mutex);
+      return false;
+   }
+
+   if (old_group)
+      vkr_ring_monitor_unlink_context(ctx);
+   list_addtail(&ctx->ring_monitor.head, &group->contexts);
+   ctx->ring_monitor.group = group;
+
+   /* mark the rings before the first driver check at the new period */
+   vkr_ring_monitor_mark_context(ctx);
+   if (list_is_singular(&group->contexts)) {
+      group->deadline =
+         vkr_ring_monitor_now(CLOCK_MONOTONIC) + report_period_us * NS_PER_US;
+      cnd_signal(&vkr_ring_monitor.cond);
+   }
+
+   mtx_unlock(&vkr_ring_monitor.mutex);
+
+   return true;
+}
+
+void
+vkr_ring_monitor_remove_context(struct vkr_context *ctx)
+{
+   if (!ctx->ring_monitor.group)
+      return;
+
+   /* the context is only marked with the mutex held */
+   mtx_lock(&vkr_ring_monitor.mutex);
+   vkr_ring_monitor_unlink_context(ctx);
+   mtx_unlock(&vkr_ring_monitor.mutex);
+}
+
+void
+vkr_ring_monitor_fini(void)
+{
+   if (!vkr_ring_monitor.init_ok)
+      return;
+
+   mtx_lock(&vkr_ring_monitor.mutex);
+   const bool started = vkr_ring_monitor.started;
+   vkr_ring_monitor.quit = true;
+   cnd_signal(&vkr_ring_monitor.cond);
+   mtx_unlock(&vkr_ring_monitor.mutex);
+
+   if (!started)
+      return;
+
+   thrd_join(vkr_ring_monitor.thread, NULL);
+   vkr_ring_monitor.started = false;
+}
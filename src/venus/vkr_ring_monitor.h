@@ -0,0 +1,34 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_RING_MONITOR_H
+#define VKR_RING_MONITOR_H
+
+#include "vkr_common.h"
+
+/* The process-wide service that sets VK_RING_STATUS_ALIVE_BIT_MESA on the
+ * monitored rings.
+ *
+ * A single thread serves all contexts.  The contexts are grouped by their
+ * reporting period, and the rings of a group are all marked at once.  Groups
+ * that are due shortly after are marked on the same wakeup, which is never
+ * later than their period requires.
+ */
+
+/* Adds the context to the service, or lowers its reporting period, which
+ * marks its rings right away.  The context reports at the smallest period it
+ * was added with.
+ */
+bool
+vkr_ring_monitor_add_context(struct vkr_context *ctx, uint32_t report_period_us);
+
+/* must be called before the rings of the context are destroyed */
+void
+vkr_ring_monitor_remove_context(struct vkr_context *ctx);
+
+void
+vkr_ring_monitor_fini(void);
+
+#endif /* VKR_RING_MONITOR_H */
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_shared_object.h"
+
+#include "vkr_descriptor_set.h"
+#include "vkr_device.h"
+#include "vkr_image.h"
+#include "vkr_pipeline.h"
+#include "vkr_render_pass.h"
+
+void
+vkr_shared_key_add(struct vkr_shared_key *key, const void *data, size_t size)
+{
+   if (key->failed || !size)
+      return;
+
+   if (size > VKR_SHARED_KEY_MAX_SIZE - key->size) {
+      key->failed = true;
+      return;
+   }
+
+   if (key->size + size > key->capacity) {
+      uint32_t capacity = key->capacity ? key->capacity : 256;
+      while (capacity < key->size + size)
+         capacity *= 2;
+
+      uint8_t *data = realloc(key->data, capacity);
+      if (!data) {
+         key->failed = true;
+         return;
+      }
+      key->data = data;
+      key->capacity = capacity;
+   }
+
+   memcpy(key->data + key->size, data, size);
+   key->size += size;
+}
+
+void
+vkr_shared_key_add_optional(struct vkr_shared_key *key, const void *data, size_t size)
+{
+   const bool present = data;
+   VKR_SHARED_KEY_ADD(key, present);
+   if (present)
+      vkr_shared_key_add(key, data, size);
+}
+
+void
+vkr_shared_key_add_ref(struct vkr_shared_key *key, const struct vkr_object *obj)
+{
+   const struct vkr_shared_object *shared = obj ? vkr_shared_object_of(obj) : NULL;
+   const uint8_t kind = !obj ? 0 : shared ? 1 : 2;
+
+   VKR_SHARED_KEY_ADD(key, kind);
+   if (shared)
+      VKR_SHARED_KEY_ADD(key, shared->serial);
+   else if (obj)
+      VKR_SHARED_KEY_ADD(key, obj->id);
+}
+
+void
+vkr_shared_key_fini(struct vkr_shared_key *key)
+{
+   free(key->data);
+}
+
+static uint32_t
+vkr_shared_key_hash(const void *key)
+{
+   const struct vkr_shared_key *k = key;
+   return _mesa_hash_data(k->data, k->size);
+}
+
+static bool
+vkr_shared_key_equal(const void *a, const void *b)
+{
+   const struct vkr_shared_key *ka = a;
+   const struct vkr_shared_key *kb = b;
+   return ka->size == kb->size && !memcmp(ka->data, kb->data, ka->size);
+}
+
+static void
+vkr_shared_object_free(struct hash_entry *entry)
+{
+   struct vkr_shared_object *shared = entry->data;
+   vkr_shared_key_fini(&shared->key);
+   free(shared);
+}
+
+void
+vkr_device_init_shared_objects(struct vkr_device *dev)
+{
+   dev->shared_objects = NULL;
+   dev->shared_object_serial = 0;
+   if (mtx_init(&dev->shared_object_mutex, mtx_plain) != thrd_success)
+      return;
+
+   dev->shared_objects =
+      _mesa_hash_table_create(NULL, vkr_shared_key_hash, vkr_shared_key_equal);
+   if (!dev->shared_objects)
+      mtx_destroy(&dev->shared_object_mutex);
+}
+
+void
+vkr_device_fini_shared_objects(struct vkr_device *dev)
+{
+   if (!dev->shared_objects)
+      return;
+
+   /* the objects have been destroyed and the table is empty */
+   _mesa_hash_table_destroy(dev->shared_objects, vkr_shared_object_free);
+   dev->shared_objects = NULL;
+   mtx_destroy(&dev->shared_object_mutex);
+}
+
+struct vkr_shared_object *
+vkr_shared_object_get(struct vkr_device *dev, const struct vkr_shared_key *key)
+{
+   mtx_lock(&dev->shared_object_mutex);
+   struct hash_entry *entry = _mesa_hash_table_search(dev->shared_objects, key);
+   struct vkr_shared_object *shared = entry ? entry->data : NULL;
+   if (shared)
+      shared->refcount++;
+   mtx_unlock(&dev->shared_object_mutex);
+
+   return shared;
+}
+
+struct vkr_shared_object *
+vkr_shared_object_add(struct vkr_device *dev, struct vkr_shared_key *key, uint64_t handle)
+{
+   struct vkr_shared_object *shared = calloc(1, sizeof(*shared));
+   if (!shared)
+      return NULL;
+
+   shared->key = *key;
+   shared->refcount = 1;
+   shared->handle = handle;
+
+   mtx_lock(&dev->shared_object_mutex);
+   shared->serial = ++dev->shared_object_serial;
+   /* an identical object created concurrently keeps its place */
+   const bool added = !_mesa_hash_table_search(dev->shared_objects, &shared->key) &&
+                      _mesa_hash_table_insert(dev->shared_objects, &shared->key, shared);
+   mtx_unlock(&dev->shared_object_mutex);
+
+   if (!added) {
+      free(shared);
+      return NULL;
+   }
+
+   memset(key, 0, sizeof(*key));
+   return shared;
+}
+
+struct vkr_shared_object *
+vkr_shared_object_of(const struct vkr_object *obj)
+{
+   switch (obj->type) {
+   case VK_OBJECT_TYPE_RENDER_PASS:
+      return ((const struct vkr_render_pass *)obj)->shared;
+   case VK_OBJECT_TYPE_FRAMEBUFFER:
+      return ((const struct vkr_framebuffer *)obj)->shared;
+   case VK_OBJECT_TYPE_SAMPLER:
+      return ((const struct vkr_sampler *)obj)->shared;
+   case VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT:
+      return ((const struct vkr_descriptor_set_layout *)obj)->shared;
+   case VK_OBJECT_TYPE_PIPELINE_LAYOUT:
+      return ((const struct vkr_pipeline_layout *)obj)->shared;
+   default:
+      return NULL;
+   }
+}
+
+bool
+vkr_shared_object_release(struct vkr_device *dev, struct vkr_object *obj)
+{
+   struct vkr_shared_object *shared = vkr_shared_object_of(obj);
+   if (!shared)
+      return true;
+
+   mtx_lock(&dev->shared_object_mutex);
+   const bool last = !--shared->refcount;
+   if (last) {
+      struct hash_entry *entry =
+         _mesa_hash_table_search(dev->shared_objects, &shared->key);
+      assert(entry && entry->data == shared);
+      _mesa_hash_table_remove(dev->shared_objects, entry);
+   }
+   mtx_unlock(&dev->shared_object_mutex);
+
+   if (last) {
+      vkr_shared_key_fini(&shared->key);
+      free(shared);
+   }
+
+   return last;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_SHARED_OBJECT_H
+#define VKR_SHARED_OBJECT_H
+
+#include "vkr_common.h"
+
+/* A driver object shared by the identical immutable objects of a device.
+ *
+ * Guests create many identical render passes, framebuffers, samplers and
+ * layouts.  Objects whose create infos are identical share one driver object,
+ * which is destroyed with the last of them.  Besides saving the creation,
+ * this lets the driver caches keyed on the identity of layouts hit more
+ * often.
+ *
+ * The keys are the create infos serialized with the handles they refer to
+ * replaced by vkr_shared_key_add_ref, before the handles of the command are
+ * replaced.  The keys start with the sType of the create info, so that all
+ * the types share one table.
+ */
+
+/* create infos with larger keys are not shared */
+#define VKR_SHARED_KEY_MAX_SIZE (64 * 1024)
+
+struct vkr_shared_key {
+   uint8_t *data;
+   uint32_t size;
+   uint32_t capacity;
+   bool failed;
+};
+
+struct vkr_shared_object {
+   struct vkr_shared_key key;
+
+   uint32_t refcount;
+   /* identifies the driver object in the keys of other objects */
+   uint64_t serial;
+   uint64_t handle;
+};
+
+void
+vkr_shared_key_add(struct vkr_shared_key *key, const void *data, size_t size);
+
+#define VKR_SHARED_KEY_ADD(key, val) vkr_shared_key_add(key, &(val), sizeof(val))
+
+#define VKR_SHARED_KEY_ADD_ARRAY(key, count, array)                                      \
+   do {                                                                                  \
+      VKR_SHARED_KEY_ADD(key, count);                                                    \
+      vkr_shared_key_add(key, array, sizeof(*(array)) * (count));                        \
+   } while (0)
+
+/* adds the members from first to last, which are all 32-bit */
+#define VKR_SHARED_KEY_ADD_MEMBERS(key, type, s, first, last)                            \
+   vkr_shared_key_add(key, &(s)->first,                                                  \
+                      offsetof(type, last) + sizeof((s)->last) - offsetof(type, first))
+
+void
+vkr_shared_key_add_optional(struct vkr_shared_key *key, const void *data, size_t size);
+
+/* Adds a reference to obj, which may be NULL.  Shared objects are identified
+ * by the serial of their driver object, the others by their id.  Unlike
+ * driver handles, neither is ever reused.
+ */
+void
+vkr_shared_key_add_ref(struct vkr_shared_key *key, const struct vkr_object *obj);
+
+void
+vkr_shared_key_fini(struct vkr_shared_key *key);
+
+void
+vkr_device_init_shared_objects(struct vkr_device *dev);
+
+void
+vkr_device_fini_shared_objects(struct vkr_device *dev);
+
+/* Returns the shared driver object with a reference added, or NULL. */
+struct vkr_shared_object *
+vkr_shared_object_get(struct vkr_device *dev, const struct vkr_shared_key *key);
+
+/* Shares a newly created driver object.  key is moved into the shared object
+ * on success.
+ */
+struct vkr_shared_object *
+vkr_shared_object_add(struct vkr_device *dev, struct vkr_shared_key *key, uint64_t handle);
+
+/* returns the shared driver object of obj, or NULL */
+struct vkr_shared_object *
+vkr_shared_object_of(const struct vkr_object *obj);
+
+/* Drops the reference of obj to its driver object.  Returns false when the
+ * driver object is still used by other objects and must not be destroyed.
+ */
+bool
+vkr_shared_object_release(struct vkr_device *dev, struct vkr_object *obj);
+
+#endif /* VKR_SHARED_OBJECT_H */
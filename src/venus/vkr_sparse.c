@@ -0,0 +1,502 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_sparse.h"
+
+#include "vkr_buffer.h"
+#include "vkr_context.h"
+#include "vkr_device.h"
+#include "vkr_image.h"
+
+#define VKR_SPARSE_MAX_ASPECTS 3
+#define VKR_SPARSE_MAX_LEVELS 32
+
+struct vkr_sparse_range {
+   VkDeviceSize begin;
+   VkDeviceSize end;
+};
+
+/* the blocks of the levels of an aspect that are not in the mip tail */
+struct vkr_sparse_aspect {
+   VkSparseImageMemoryRequirements req;
+   /* the first block of each level in the blocks of a layer */
+   uint32_t level_offsets[VKR_SPARSE_MAX_LEVELS];
+   uint32_t layer_block_count;
+   /* one bit per block, layer after layer */
+   uint32_t *bound;
+};
+
+struct vkr_sparse_residency {
+   mtx_t mutex;
+
+   /* the bound opaque ranges, sorted and merged */
+   struct vkr_sparse_range *ranges;
+   uint32_t range_count;
+   uint32_t range_capacity;
+   VkDeviceSize committed_size;
+
+   /* images only */
+   VkDeviceSize opaque_size;
+   VkDeviceSize block_size;
+   VkExtent3D extent;
+   uint32_t array_layers;
+   uint32_t aspect_count;
+   struct vkr_sparse_aspect aspects[VKR_SPARSE_MAX_ASPECTS];
+};
+
+static struct vkr_sparse_residency *
+vkr_sparse_residency_alloc(void)
+{
+   struct vkr_sparse_residency *res = calloc(1, sizeof(*res));
+   if (!res)
+      return NULL;
+
+   if (mtx_init(&res->mutex, mtx_plain) != thrd_success) {
+      free(res);
+      return NULL;
+   }
+
+   return res;
+}
+
+struct vkr_sparse_residency *
+vkr_sparse_residency_create_buffer(void)
+{
+   return vkr_sparse_residency_alloc();
+}
+
+static VkExtent3D
+vkr_sparse_level_blocks(const struct vkr_sparse_residency *res,
+                        const struct vkr_sparse_aspect *aspect,
+                        uint32_t level)
+{
+   const VkExtent3D *granularity = &aspect->req.formatProperties.imageGranularity;
+
+   return (VkExtent3D){
+      .width = DIV_ROUND_UP(u_minify(res->extent.width, level), granularity->width),
+      .height = DIV_ROUND_UP(u_minify(res->extent.height, level), granularity->height),
+      .depth = DIV_ROUND_UP(u_minify(res->extent.depth, level), granularity->depth),
+   };
+}
+
+static bool
+vkr_sparse_aspect_init(struct vkr_sparse_residency *res,
+                       struct vkr_sparse_aspect *aspect,
+                       const VkSparseImageMemoryRequirements *req,
+                       uint32_t mip_levels)
+{
+   const VkExtent3D *granularity = &req->formatProperties.imageGranularity;
+   if (!granularity->width || !granularity->height || !granularity->depth)
+      return false;
+
+   aspect->req = *req;
+
+   const uint32_t level_count = MIN3(req->imageMipTailFirstLod, mip_levels,
+                                     VKR_SPARSE_MAX_LEVELS);
+   uint64_t block_count = 0;
+   for (uint32_t level = 0; level < level_count; level++) {
+      const VkExtent3D blocks = vkr_sparse_level_blocks(res, aspect, level);
+      aspect->level_offsets[level] = block_count;
+      block_count += (uint64_t)blocks.width * blocks.height * blocks.depth;
+      if (block_count > UINT32_MAX)
+         return false;
+   }
+   aspect->req.imageMipTailFirstLod = level_count;
+   aspect->layer_block_count = block_count;
+
+   const uint64_t bit_count = block_count * res->array_layers;
+   if (!bit_count)
+      return true;
+
+   aspect->bound = calloc(DIV_ROUND_UP(bit_count, 32), sizeof(*aspect->bound));
+   return aspect->bound;
+}
+
+struct vkr_sparse_residency *
+vkr_sparse_residency_create_image(struct vkr_device *dev,
+                                  VkImage image,
+                                  const VkImageCreateInfo *info)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   VkDevice device = dev->base.handle.device;
+
+   struct vkr_sparse_residency *res = vkr_sparse_residency_alloc();
+   if (!res)
+      return NULL;
+
+   VkMemoryRequirements mem_reqs;
+   vk->GetImageMemoryRequirements(device, image, &mem_reqs);
+   res->opaque_size = mem_reqs.size;
+   res->block_size = mem_reqs.alignment;
+   res->extent = info->extent;
+   res->array_layers = info->arrayLayers;
+
+   if (!(info->flags & VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT))
+      return res;
+
+   uint32_t req_count = 0;
+   vk->GetImageSparseMemoryRequirements(device, image, &req_count, NULL);
+
+   STACK_ARRAY(VkSparseImageMemoryRequirements, reqs, req_count);
+   vk->GetImageSparseMemoryRequirements(device, image, &req_count, reqs);
+
+   bool ok = true;
+   for (uint32_t i = 0; i < req_count && ok; i++) {
+      /* the metadata is only ever bound as opaque ranges */
+      if (reqs[i].formatProperties.aspectMask & VK_IMAGE_ASPECT_METADATA_BIT)
+         continue;
+
+      if (res->aspect_count == VKR_SPARSE_MAX_ASPECTS) {
+         ok = false;
+         break;
+      }
+      ok = vkr_sparse_aspect_init(res, &res->aspects[res->aspect_count++], &reqs[i],
+                                  info->mipLevels);
+   }
+
+   STACK_ARRAY_FINISH(reqs);
+
+   if (!ok) {
+      vkr_sparse_residency_destroy(NULL, res);
+      return NULL;
+   }
+
+   return res;
+}
+
+void
+vkr_sparse_residency_destroy(struct vkr_context *ctx, struct vkr_sparse_residency *res)
+{
+   if (!res)
+      return;
+
+   if (ctx)
+      atomic_fetch_sub(&ctx->sparse_committed_size, res->committed_size);
+
+   for (uint32_t i = 0; i < res->aspect_count; i++)
+      free(res->aspects[i].bound);
+   free(res->ranges);
+   mtx_destroy(&res->mutex);
+   free(res);
+}
+
+static bool
+vkr_sparse_ranges_reserve(struct vkr_sparse_residency *res, uint32_t count)
+{
+   if (count <= res->range_capacity)
+      return true;
+
+   const uint32_t capacity = MAX2(count, res->range_capacity * 2);
+   struct vkr_sparse_range *ranges = realloc(res->ranges, capacity * sizeof(*ranges));
+   if (!ranges)
+      return false;
+
+   res->ranges = ranges;
+   res->range_capacity = capacity;
+   return true;
+}
+
+/* Removes [begin, end) from the bound ranges, and adds it back when bind is
+ * set.  Returns the change of the bound size.
+ */
+static int64_t
+vkr_sparse_ranges_update(struct vkr_sparse_residency *res,
+                         VkDeviceSize begin,
+                         VkDeviceSize end,
+                         bool bind)
+{
+   /* splitting a range takes one more entry */
+   if (begin >= end || !vkr_sparse_ranges_reserve(res, res->range_count + 1))
+      return 0;
+
+   /* the ranges in [first, last) overlap [begin, end), or touch it */
+   uint32_t first = 0;
+   while (first < res->range_count && res->ranges[first].end < begin)
+      first++;
+   uint32_t last = first;
+   while (last < res->range_count && res->ranges[last].begin <= end)
+      last++;
+
+   int64_t delta = 0;
+   struct vkr_sparse_range pieces[2];
+   uint32_t piece_count = 0;
+   if (bind) {
+      struct vkr_sparse_range merged = { begin, end };
+      for (uint32_t i = first; i < last; i++) {
+         const struct vkr_sparse_range *range = &res->ranges[i];
+         delta -= range->end - range->begin;
+         merged.begin = MIN2(merged.begin, range->begin);
+         merged.end = MAX2(merged.end, range->end);
+      }
+      delta += merged.end - merged.begin;
+      pieces[piece_count++] = merged;
+   } else {
+      for (uint32_t i = first; i < last; i++) {
+         const struct vkr_sparse_range *range = &res->ranges[i];
+         if (range->end > begin && range->begin < end)
+            delta -= MIN2(range->end, end) - MAX2(range->begin, begin);
+      }
+      if (first < last && res->ranges[first].begin < begin)
+         pieces[piece_count++] = (struct vkr_sparse_range){ res->ranges[first].begin, begin };
+      if (first < last && res->ranges[last - 1].end > end)
+         pieces[piece_count++] = (struct vkr_sparse_range){ end, res->ranges[last - 1].end };
+   }
+
+   memmove(&res->ranges[first + piece_count], &res->ranges[last],
+           (res->range_count - last) * sizeof(*res->ranges));
+   memcpy(&res->ranges[first], pieces, piece_count * sizeof(*pieces));
+   res->range_count = res->range_count - (last - first) + piece_count;
+
+   return delta;
+}
+
+static bool
+vkr_sparse_ranges_cover(const struct vkr_sparse_residency *res,
+                        VkDeviceSize begin,
+                        VkDeviceSize end)
+{
+   if (begin >= end)
+      return true;
+
+   /* the ranges are merged, so a single one has to cover it */
+   for (uint32_t i = 0; i < res->range_count; i++) {
+      const struct vkr_sparse_range *range = &res->ranges[i];
+      if (range->begin > begin)
+         break;
+      if (range->end >= end)
+         return true;
+   }
+   return false;
+}
+
+static struct vkr_sparse_aspect *
+vkr_sparse_find_aspect(struct vkr_sparse_residency *res, VkImageAspectFlags aspect_mask)
+{
+   for (uint32_t i = 0; i < res->aspect_count; i++) {
+      if (res->aspects[i].req.formatProperties.aspectMask & aspect_mask)
+         return &res->aspects[i];
+   }
+   return NULL;
+}
+
+/* Calls func for each block of the region, until it returns false.  Returns
+ * false when func did.
+ */
+static bool
+vkr_sparse_foreach_block(struct vkr_sparse_residency *res,
+                         struct vkr_sparse_aspect *aspect,
+                         uint32_t layer,
+                         uint32_t level,
+                         VkOffset3D offset,
+                         VkExtent3D extent,
+                         bool (*func)(struct vkr_sparse_residency *res,
+                                      struct vkr_sparse_aspect *aspect,
+                                      uint64_t bit,
+                                      void *data),
+                         void *data)
+{
+   const VkExtent3D *granularity = &aspect->req.formatProperties.imageGranularity;
+   const VkExtent3D blocks = vkr_sparse_level_blocks(res, aspect, level);
+
+   if (offset.x < 0 || offset.y < 0 || offset.z < 0)
+      return true;
+
+   const uint32_t x0 = offset.x / granularity->width;
+   const uint32_t y0 = offset.y / granularity->height;
+   const uint32_t z0 = offset.z / granularity->depth;
+   const uint32_t x1 =
+      MIN2(DIV_ROUND_UP((uint64_t)offset.x + extent.width, granularity->width), blocks.width);
+   const uint32_t y1 = MIN2(
+      DIV_ROUND_UP((uint64_t)offset.y + extent.height, granularity->height), blocks.height);
+   const uint32_t z1 =
+      MIN2(DIV_ROUND_UP((uint64_t)offset.z + extent.depth, granularity->depth), blocks.depth);
+
+   const uint64_t base =
+      (uint64_t)layer * aspect->layer_block_count + aspect->level_offsets[level];
+   for (uint32_t z = z0; z < z1; z++) {
+      for (uint32_t y = y0; y < y1; y++) {
+         for (uint32_t x = x0; x < x1; x++) {
+            const uint64_t bit =
+               base + ((uint64_t)z * blocks.height + y) * blocks.width + x;
+            if (!func(res, aspect, bit, data))
+               return false;
+         }
+      }
+   }
+   return true;
+}
+
+static bool
+vkr_sparse_update_block(struct vkr_sparse_residency *res,
+                        struct vkr_sparse_aspect *aspect,
+                        uint64_t bit,
+                        void *data)
+{
+   const bool bind = *(const bool *)data;
+   uint32_t *word = &aspect->bound[bit / 32];
+   const uint32_t mask = 1u << (bit % 32);
+
+   if (!!(*word & mask) != bind) {
+      *word ^= mask;
+      if (bind)
+         res->committed_size += res->block_size;
+      else
+         res->committed_size -= res->block_size;
+   }
+   return true;
+}
+
+static bool
+vkr_sparse_is_block_bound(UNUSED struct vkr_sparse_residency *res,
+                          struct vkr_sparse_aspect *aspect,
+                          uint64_t bit,
+                          UNUSED void *data)
+{
+   return aspect->bound[bit / 32] & (1u << (bit % 32));
+}
+
+static void
+vkr_sparse_residency_bind_opaque(struct vkr_context *ctx,
+                                 struct vkr_sparse_residency *res,
+                                 uint32_t bind_count,
+                                 const VkSparseMemoryBind *binds)
+{
+   if (!res)
+      return;
+
+   int64_t delta = 0;
+   mtx_lock(&res->mutex);
+   for (uint32_t i = 0; i < bind_count; i++) {
+      const VkSparseMemoryBind *bind = &binds[i];
+      delta += vkr_sparse_ranges_update(res, bind->resourceOffset,
+                                        bind->resourceOffset + bind->size,
+                                        bind->memory != VK_NULL_HANDLE);
+   }
+   res->committed_size += delta;
+   mtx_unlock(&res->mutex);
+
+   atomic_fetch_add(&ctx->sparse_committed_size, (uint64_t)delta);
+}
+
+static void
+vkr_sparse_residency_bind_image(struct vkr_context *ctx,
+                                struct vkr_sparse_residency *res,
+                                uint32_t bind_count,
+                                const VkSparseImageMemoryBind *binds)
+{
+   if (!res)
+      return;
+
+   mtx_lock(&res->mutex);
+   const VkDeviceSize old_size = res->committed_size;
+   for (uint32_t i = 0; i < bind_count; i++) {
+      const VkSparseImageMemoryBind *bind = &binds[i];
+      struct vkr_sparse_aspect *aspect =
+         vkr_sparse_find_aspect(res, bind->subresource.aspectMask);
+      if (!aspect || bind->subresource.mipLevel >= aspect->req.imageMipTailFirstLod ||
+          bind->subresource.arrayLayer >= res->array_layers)
+         continue;
+
+      bool bound = bind->memory != VK_NULL_HANDLE;
+      vkr_sparse_foreach_block(res, aspect, bind->subresource.arrayLayer,
+                               bind->subresource.mipLevel, bind->offset, bind->extent,
+                               vkr_sparse_update_block, &bound);
+   }
+   const VkDeviceSize new_size = res->committed_size;
+   mtx_unlock(&res->mutex);
+
+   atomic_fetch_add(&ctx->sparse_committed_size, new_size - old_size);
+}
+
+void
+vkr_sparse_residency_bind(struct vkr_context *ctx, const VkBindSparseInfo *info)
+{
+   for (uint32_t i = 0; i < info->bufferBindCount; i++) {
+      const VkSparseBufferMemoryBindInfo *bind_info = &info->pBufferBinds[i];
+      struct vkr_buffer *buf = vkr_buffer_from_handle(bind_info->buffer);
+      if (buf)
+         vkr_sparse_residency_bind_opaque(ctx, buf->sparse, bind_info->bindCount,
+                                          bind_info->pBinds);
+   }
+
+   for (uint32_t i = 0; i < info->imageOpaqueBindCount; i++) {
+      const VkSparseImageOpaqueMemoryBindInfo *bind_info = &info->pImageOpaqueBinds[i];
+      struct vkr_image *img = vkr_image_from_handle(bind_info->image);
+      if (img)
+         vkr_sparse_residency_bind_opaque(ctx, img->sparse, bind_info->bindCount,
+                                          bind_info->pBinds);
+   }
+
+   for (uint32_t i = 0; i < info->imageBindCount; i++) {
+      const VkSparseImageMemoryBindInfo *bind_info = &info->pImageBinds[i];
+      struct vkr_image *img = vkr_image_from_handle(bind_info->image);
+      if (img)
+         vkr_sparse_residency_bind_image(ctx, img->sparse, bind_info->bindCount,
+                                         bind_info->pBinds);
+   }
+}
+
+static bool
+vkr_sparse_is_layer_resident(struct vkr_sparse_residency *res,
+                             VkImageAspectFlags aspect_mask,
+                             uint32_t layer,
+                             uint32_t level,
+                             VkOffset3D offset,
+                             VkExtent3D extent)
+{
+   struct vkr_sparse_aspect *aspect = vkr_sparse_find_aspect(res, aspect_mask);
+   if (!aspect)
+      return false;
+
+   if (level < aspect->req.imageMipTailFirstLod) {
+      return vkr_sparse_foreach_block(res, aspect, layer, level, offset, extent,
+                                      vkr_sparse_is_block_bound, NULL);
+   }
+
+   VkDeviceSize tail_offset = aspect->req.imageMipTailOffset;
+   if (!(aspect->req.formatProperties.flags & VK_SPARSE_IMAGE_FORMAT_SINGLE_MIPTAIL_BIT))
+      tail_offset += layer * aspect->req.imageMipTailStride;
+   return vkr_sparse_ranges_cover(res, tail_offset,
+                                  tail_offset + aspect->req.imageMipTailSize);
+}
+
+bool
+vkr_sparse_residency_is_region_resident(struct vkr_sparse_residency *res,
+                                        const VkImageSubresourceLayers *subresource,
+                                        VkOffset3D offset,
+                                        VkExtent3D extent)
+{
+   if (!res)
+      return true;
+
+   mtx_lock(&res->mutex);
+
+   /* the whole image may be bound with opaque binds */
+   bool resident = vkr_sparse_ranges_cover(res, 0, res->opaque_size);
+   if (resident || !res->aspect_count) {
+      mtx_unlock(&res->mutex);
+      return resident;
+   }
+
+   const uint32_t layer_count = subresource->layerCount == VK_REMAINING_ARRAY_LAYERS
+                                   ? res->array_layers - subresource->baseArrayLayer
+                                   : subresource->layerCount;
+   const uint32_t layer_end =
+      MIN2((uint64_t)subresource->baseArrayLayer + layer_count, res->array_layers);
+
+   resident = true;
+   uint32_t aspects = subresource->aspectMask;
+   while (aspects && resident) {
+      const VkImageAspectFlags aspect_mask = 1u << u_bit_scan(&aspects);
+      for (uint32_t layer = subresource->baseArrayLayer; layer < layer_end && resident;
+           layer++) {
+         resident = vkr_sparse_is_layer_resident(res, aspect_mask, layer,
+                                                 subresource->mipLevel, offset, extent);
+      }
+   }
+
+   mtx_unlock(&res->mutex);
+   return resident;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_SPARSE_H
+#define VKR_SPARSE_H
+
+#include "vkr_common.h"
+
+/* Residency of the sparse buffers and images.
+ *
+ * Which parts of a sparse resource are backed by memory is only known from the
+ * binds the guest submits with vkQueueBindSparse.  They are recorded when they
+ * are submitted: the opaque ranges as sorted and merged intervals, and the
+ * blocks of sparse residency images as a bitmap per subresource.  Host copies
+ * skip the regions that are not bound, which the drivers are not required to
+ * handle, and the committed size is part of the context statistics.
+ */
+
+struct vkr_sparse_residency;
+
+struct vkr_sparse_residency *
+vkr_sparse_residency_create_buffer(void);
+
+struct vkr_sparse_residency *
+vkr_sparse_residency_create_image(struct vkr_device *dev,
+                                  VkImage image,
+                                  const VkImageCreateInfo *info);
+
+void
+vkr_sparse_residency_destroy(struct vkr_context *ctx, struct vkr_sparse_residency *res);
+
+/* records the binds of info, before its handles are replaced */
+void
+vkr_sparse_residency_bind(struct vkr_context *ctx, const VkBindSparseInfo *info);
+
+/* whether memory is bound to the region of a sparse image */
+bool
+vkr_sparse_residency_is_region_resident(struct vkr_sparse_residency *res,
+                                        const VkImageSubresourceLayers *subresource,
+                                        VkOffset3D offset,
+                                        VkExtent3D extent);
+
+#endif /* VKR_SPARSE_H */
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vkr_stream_pool.h"
+
+#include <unistd.h>
+
+#include "vkr_command_buffer.h"
+#include "vkr_context.h"
+#include "vkr_cs.h"
+#include "vkr_dispatch.h"
+
+#define VKR_STREAM_POOL_THREAD_MAX 4
+/* below this, handing the streams to other threads costs more than it saves */
+#define VKR_STREAM_POOL_MIN_SIZE (64 * 1024)
+/* the streams are copied, larger ones are executed in place */
+#define VKR_STREAM_POOL_MAX_SIZE (64 * 1024 * 1024)
+
+struct vkr_stream_job {
+   struct vn_dispatch_context *dispatch;
+   const VkCommandStreamDescriptionMESA *streams;
+   uint32_t stream_count;
+
+   /* the copies of the streams, one after the other */
+   uint8_t *data;
+   size_t *offsets;
+   /* the command buffer each stream records into */
+   vkr_object_id *cmd_ids;
+   /* how far each stream was decoded by the workers */
+   size_t *done_sizes;
+
+   atomic_uint next_stream;
+   /* the tasks that are queued or running, protected by the pool mutex */
+   uint32_t pending;
+};
+
+struct vkr_stream_task {
+   struct list_head head;
+   struct vkr_stream_job *job;
+   struct vkr_cs_decoder *dec;
+};
+
+static struct {
+   once_flag init_once;
+   bool init_ok;
+
+   mtx_t mutex;
+   /* signaled when a task is queued, or on quit */
+   cnd_t task_cond;
+   /* signaled when a job is done */
+   cnd_t job_cond;
+   struct list_head tasks;
+
+   bool started;
+   bool quit;
+   uint32_t thread_count;
+   thrd_t threads[VKR_STREAM_POOL_THREAD_MAX];
+} vkr_stream_pool = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static void
+vkr_stream_pool_init_once(void)
+{
+   if (mtx_init(&vkr_stream_pool.mutex, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vkr_stream_pool.task_cond) != thrd_success) {
+      mtx_destroy(&vkr_stream_pool.mutex);
+      return;
+   }
+   if (cnd_init(&vkr_stream_pool.job_cond) != thrd_success) {
+      cnd_destroy(&vkr_stream_pool.task_cond);
+      mtx_destroy(&vkr_stream_pool.mutex);
+      return;
+   }
+
+   list_inithead(&vkr_stream_pool.tasks);
+   vkr_stream_pool.init_ok = true;
+}
+
+/* decodes the streams of the job that are left, as far as they record */
+static void
+vkr_stream_job_run(struct vkr_stream_job *job, struct vkr_cs_decoder *dec)
+{
+   struct vn_dispatch_context dispatch = *job->dispatch;
+   dispatch.decoder = (struct vn_cs_decoder *)dec;
+
+   while (!vkr_cs_decoder_get_fatal(dec)) {
+      const uint32_t i = atomic_fetch_add(&job->next_stream, 1);
+      if (i >= job->stream_count)
+         break;
+
+      const uint8_t *data = job->data + job->offsets[i];
+      vkr_cs_decoder_set_buffer_stream(dec, data, job->streams[i].size);
+      while (vkr_cs_decoder_has_command(dec) && !vkr_cs_decoder_get_fatal(dec)) {
+         if (!vkr_dispatch_recording_command(&dispatch, job->cmd_ids[i]))
+            break;
+      }
+      /* the rest of the stream is dispatched by another decoder */
+      vkr_command_buffer_flush_builds(dec);
+      job->done_sizes[i] = dec->cur - data;
+   }
+}
+
+static int
+vkr_stream_pool_thread(UNUSED void *arg)
+{
+   u_thread_setname("vkr-stream");
+
+   mtx_lock(&vkr_stream_pool.mutex);
+   while (true) {
+      while (!vkr_stream_pool.quit && list_is_empty(&vkr_stream_pool.tasks))
+         cnd_wait(&vkr_stream_pool.task_cond, &vkr_stream_pool.mutex);
+      if (vkr_stream_pool.quit)
+         break;
+
+      struct vkr_stream_task *task =
+         list_first_entry(&vkr_stream_pool.tasks, struct vkr_stream_task, head);
+      /* unlinked, so that the caller does not take it back */
+      list_del(&task->head);
+      mtx_unlock(&vkr_stream_pool.mutex);
+
+      vkr_stream_job_run(task->job, task->dec);
+      vkr_cs_decoder_reset(task->dec);
+
+      mtx_lock(&vkr_stream_pool.mutex);
+      if (!--task->job->pending)
+         cnd_broadcast(&vkr_stream_pool.job_cond);
+   }
+   mtx_unlock(&vkr_stream_pool.mutex);
+
+   return 0;
+}
+
+/* returns the number of pool threads, the threads are started on first use */
+static uint32_t
+vkr_stream_pool_get_thread_count(void)
+{
+   call_once(&vkr_stream_pool.init_once, vkr_stream_pool_init_once);
+   if (!vkr_stream_pool.init_ok)
+      return 0;
+
+   mtx_lock(&vkr_stream_pool.mutex);
+   if (!vkr_stream_pool.started) {
+      const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+      const uint32_t count =
+         cpu_count > 1 ? MIN2((uint32_t)cpu_count - 1, VKR_STREAM_POOL_THREAD_MAX) : 0;
+
+      vkr_stream_pool.quit = false;
+      vkr_stream_pool.thread_count = 0;
+      for (uint32_t i = 0; i < count; i++) {
+         if (thrd_create(&vkr_stream_pool.threads[i], vkr_stream_pool_thread, NULL) !=
+             thrd_success)
+            break;
+         vkr_stream_pool.thread_count++;
+      }
+      vkr_stream_pool.started = true;
+   }
+   const uint32_t thread_count = vkr_stream_pool.thread_count;
+   mtx_unlock(&vkr_stream_pool.mutex);
+
+   return thread_count;
+}
+
+/* the decoders of the pool threads are per calling decoder, which executes one
+ * job at a time
+ */
+static bool
+vkr_stream_pool_init_helpers(struct vkr_cs_decoder *dec,
+                             struct vkr_context *ctx,
+                             uint32_t count)
+{
+   if (dec->stream_helper_count >= count)
+      return true;
+
+   struct vkr_cs_decoder *helpers =
+      realloc(dec->stream_helpers, sizeof(*helpers) * count);
+   if (!helpers)
+      return false;
+   dec->stream_helpers = helpers;
+
+   while (dec->stream_helper_count < count) {
+      if (vkr_cs_decoder_init(&helpers[dec->stream_helper_count], ctx))
+         return false;
+      dec->stream_helper_count++;
+   }
+
+   return true;
+}
+
+/* copies the streams and checks that they can be executed in parallel */
+static bool
+vkr_stream_job_init(struct vkr_stream_job *job,
+                    struct vn_dispatch_context *dispatch,
+                    const struct vn_command_vkExecuteCommandStreamsMESA *args)
+{
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+   const uint32_t count = args->streamCount;
+
+   /* replies are written in stream order */
+   if (count < 2 || args->pReplyPositions)
+      return false;
+
+   size_t total_size = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      if (args->pStreams[i].size > VKR_STREAM_POOL_MAX_SIZE)
+         return false;
+      total_size += args->pStreams[i].size;
+   }
+   if (total_size < VKR_STREAM_POOL_MIN_SIZE || total_size > VKR_STREAM_POOL_MAX_SIZE)
+      return false;
+
+   const uint32_t thread_count = vkr_stream_pool_get_thread_count();
+   if (!thread_count || !vkr_stream_pool_init_helpers(dec, ctx, thread_count))
+      return false;
+
+   *job = (struct vkr_stream_job){
+      .dispatch = dispatch,
+      .streams = args->pStreams,
+      .stream_count = count,
+   };
+
+   const size_t array_size =
+      (sizeof(*job->offsets) + sizeof(*job->cmd_ids) + sizeof(*job->done_sizes) +
+       sizeof(struct vkr_command_pool *)) *
+      count;
+   uint8_t *storage = malloc(array_size + total_size);
+   if (!storage)
+      return false;
+
+   job->offsets = (size_t *)storage;
+   job->cmd_ids = (vkr_object_id *)(job->offsets + count);
+   job->done_sizes = (size_t *)(job->cmd_ids + count);
+   struct vkr_command_pool **pools = (struct vkr_command_pool **)(job->done_sizes + count);
+   job->data = (uint8_t *)(pools + count);
+
+   size_t offset = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      const VkCommandStreamDescriptionMESA *stream = &args->pStreams[i];
+
+      job->offsets[i] = offset;
+      job->cmd_ids[i] = 0;
+      job->done_sizes[i] = 0;
+      pools[i] = NULL;
+      if (!stream->size)
+         continue;
+
+      /* the guest can modify the shared stream while it is decoded */
+      if (!vkr_cs_decoder_set_resource_stream(dec, ctx, stream->resourceId, stream->offset,
+                                              stream->size))
+         goto fail;
+      memcpy(job->data + offset, dec->cur, stream->size);
+
+      vkr_cs_decoder_set_buffer_stream(dec, job->data + offset, stream->size);
+      offset += stream->size;
+
+      job->cmd_ids[i] = vkr_dispatch_get_recording_command_buffer(dec);
+      const struct vkr_command_buffer *cmd =
+         job->cmd_ids[i] ? (struct vkr_command_buffer *)vkr_cs_decoder_lookup_object(
+                              dec, job->cmd_ids[i], VK_OBJECT_TYPE_COMMAND_BUFFER)
+                         : NULL;
+      if (!cmd || vkr_cs_decoder_get_fatal(dec))
+         goto fail;
+
+      /* a pool is externally synchronized */
+      for (uint32_t j = 0; j < i; j++) {
+         if (pools[j] == cmd->pool)
+            goto fail;
+      }
+      pools[i] = cmd->pool;
+   }
+
+   /* only the copies are decoded from here on */
+   mtx_lock(&dec->resource_mutex);
+   dec->resource = NULL;
+   mtx_unlock(&dec->resource_mutex);
+
+   return true;
+
+fail:
+   free(storage);
+   return false;
+}
+
+bool
+vkr_stream_pool_execute(struct vn_dispatch_context *dispatch,
+                        const struct vn_command_vkExecuteCommandStreamsMESA *args)
+{
+   struct vkr_cs_decoder *dec = (struct vkr_cs_decoder *)dispatch->decoder;
+
+   struct vkr_stream_job job;
+   if (!vkr_stream_job_init(&job, dispatch, args))
+      return false;
+
+   const uint32_t task_count = MIN2(dec->stream_helper_count, job.stream_count - 1);
+   struct vkr_stream_task tasks[VKR_STREAM_POOL_THREAD_MAX];
+
+   mtx_lock(&vkr_stream_pool.mutex);
+   for (uint32_t i = 0; i < task_count; i++) {
+      tasks[i] = (struct vkr_stream_task){
+         .job = &job,
+         .dec = &dec->stream_helpers[i],
+      };
+      list_addtail(&tasks[i].head, &vkr_stream_pool.tasks);
+   }
+   job.pending = task_count;
+   cnd_broadcast(&vkr_stream_pool.task_cond);
+   mtx_unlock(&vkr_stream_pool.mutex);
+
+   vkr_stream_job_run(&job, dec);
+
+   /* take back the tasks no thread got to, the streams are all claimed */
+   mtx_lock(&vkr_stream_pool.mutex);
+   for (uint32_t i = 0; i < task_count; i++) {
+      if (list_is_linked(&tasks[i].head)) {
+         list_del(&tasks[i].head);
+         job.pending--;
+      }
+   }
+   while (job.pending)
+      cnd_wait(&vkr_stream_pool.job_cond, &vkr_stream_pool.mutex);
+   mtx_unlock(&vkr_stream_pool.mutex);
+
+   /* the rest of the streams, in order */
+   for (uint32_t i = 0; i < job.stream_count && !vkr_cs_decoder_get_fatal(dec); i++) {
+      const size_t done_size = job.done_sizes[i];
+      const size_t size = job.streams[i].size;
+      if (done_size == size)
+         continue;
+
+      vkr_cs_decoder_set_buffer_stream(dec, job.data + job.offsets[i] + done_size,
+                                       size - done_size);
+      while (vkr_cs_decoder_has_command(dec) && !vkr_cs_decoder_get_fatal(dec))
+         vkr_dispatch_command(dispatch);
+   }
+
+   free(job.offsets);
+   return true;
+}
+
+void
+vkr_stream_pool_fini_decoder(struct vkr_cs_decoder *dec)
+{
+   for (uint32_t i = 0; i < dec->stream_helper_count; i++)
+      vkr_cs_decoder_fini(&dec->stream_helpers[i]);
+   free(dec->stream_helpers);
+
+   dec->stream_helpers = NULL;
+   dec->stream_helper_count = 0;
+}
+
+void
+vkr_stream_pool_fini(void)
+{
+   if (!vkr_stream_pool.init_ok)
+      return;
+
+   mtx_lock(&vkr_stream_pool.mutex);
+   const bool started = vkr_stream_pool.started;
+   vkr_stream_pool.quit = true;
+   cnd_broadcast(&vkr_stream_pool.task_cond);
+   mtx_unlock(&vkr_stream_pool.mutex);
+
+   if (!started)
+      return;
+
+   for (uint32_t i = 0; i < vkr_stream_pool.thread_count; i++)
+      thrd_join(vkr_stream_pool.threads[i], NULL);
+
+   vkr_stream_pool.thread_count = 0;
+   vkr_stream_pool.started = false;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VKR_STREAM_POOL_H
+#define VKR_STREAM_POOL_H
+
+#include "vkr_common.h"
+
+#include "venus-protocol/vn_protocol_renderer_defines.h"
+
+/* Parallel execution of the streams of vkExecuteCommandStreamsMESA.
+ *
+ * Guests record each command buffer in a stream of its own.  When every stream
+ * of a call starts recording into a command buffer, and the command buffers
+ * are from distinct pools, the streams are copied out of the shared memory and
+ * decoded by the pool threads and the calling thread, each with a decoder of
+ * its own.  A stream is decoded only as far as it records into its command
+ * buffer.  The rest of it is executed by the calling thread, in stream order,
+ * once all streams are done, so that commands on shared objects still see the
+ * recording of the streams before them.
+ */
+
+/* Returns false, with nothing executed, when the streams are to be executed
+ * one after the other by the caller.
+ */
+bool
+vkr_stream_pool_execute(struct vn_dispatch_context *dispatch,
+                        const struct vn_command_vkExecuteCommandStreamsMESA *args);
+
+/* frees the decoders that helped dec */
+void
+vkr_stream_pool_fini_decoder(struct vkr_cs_decoder *dec);
+
+void
+vkr_stream_pool_fini(void);
+
+#endif /* VKR_STREAM_POOL_H */
@@ -5,11 +5,13 @@
 
 #include "vkr_transport.h"
 
-#include "venus-protocol/vn_protocol_renderer_dispatches.h"
 #include "venus-protocol/vn_protocol_renderer_transport.h"
 
 #include "vkr_context.h"
+#include "vkr_dispatch.h"
 #include "vkr_ring.h"
+#include "vkr_ring_monitor.h"
+#include "vkr_stream_pool.h"
 
 static void
 vkr_dispatch_vkSetReplyCommandStreamMESA(
@@ -62,6 +64,11 @@ vkr_dispatch_vkExecuteCommandStreamsMESA(
 
    vkr_cs_decoder_save_state(dec);
 
+   if (vkr_stream_pool_execute(dispatch, args)) {
+      vkr_cs_decoder_restore_state(dec);
+      return;
+   }
+
    for (uint32_t i = 0; i < args->streamCount; i++) {
       const VkCommandStreamDescriptionMESA *stream = &args->pStreams[i];
 
@@ -80,7 +87,7 @@ vkr_dispatch_vkExecuteCommandStreamsMESA(
       }
 
       while (vkr_cs_decoder_has_command(dec)) {
-         vn_dispatch_command(dispatch);
+         vkr_dispatch_command(dispatch);
          if (vkr_context_get_fatal(ctx))
             break;
       }
@@ -231,26 +238,15 @@ vkr_dispatch_vkCreateRingMESA(struct vn_dispatch_context *dispatch,
          return;
       }
 
-      /* Start the ring monitoring thread or update the reporting rate of the running
-       * thread to the smallest maxReportingPeriodMicroseconds recieved so far, and wake
-       * it to begin reporting at the faster rate before the first driver check occurs.
+      /* Mark the ring before adding the context, so that it is reported right
+       * away at the smallest maxReportingPeriodMicroseconds received so far.
        */
-      if (!ctx->ring_monitor.started) {
-         if (!vkr_context_ring_monitor_init(
-                ctx, monitor_info->maxReportingPeriodMicroseconds)) {
-            vkr_context_set_fatal(ctx);
-            return;
-         }
-      } else if (monitor_info->maxReportingPeriodMicroseconds <
-                 ctx->ring_monitor.report_period_us) {
-         mtx_lock(&ctx->ring_monitor.mutex);
-         ctx->ring_monitor.report_period_us =
-            monitor_info->maxReportingPeriodMicroseconds;
-         cnd_signal(&ctx->ring_monitor.cond);
-         mtx_unlock(&ctx->ring_monitor.mutex);
-      }
-
       ring->monitor = true;
+      if (!vkr_ring_monitor_add_context(ctx,
+                                        monitor_info->maxReportingPeriodMicroseconds)) {
+         vkr_context_set_fatal(ctx);
+         return;
+      }
    }
 
    const VkRingPriorityInfoMESA *priority_info =
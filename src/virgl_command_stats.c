@@ -0,0 +1,111 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_command_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+#include "util/u_math.h"
+
+bool virgl_command_stats_enabled;
+
+struct virgl_command_stats *
+virgl_command_stats_create(uint32_t command_count)
+{
+   struct virgl_command_stats *stats =
+      calloc(1, sizeof(*stats) + sizeof(stats->entries[0]) * command_count);
+   if (!stats)
+      return NULL;
+
+   stats->command_count = command_count;
+
+   return stats;
+}
+
+void
+virgl_command_stats_destroy(struct virgl_command_stats *stats)
+{
+   if (!stats)
+      return;
+
+   for (uint32_t i = 0; i < stats->command_count; i++)
+      free(stats->entries[i]);
+   free(stats);
+}
+
+void
+virgl_command_stats_add(struct virgl_command_stats *stats,
+                        uint32_t command,
+                        const char *name,
+                        uint64_t time_ns)
+{
+   if (command >= stats->command_count)
+      return;
+
+   struct virgl_command_stats_entry *entry = stats->entries[command];
+   if (!entry) {
+      entry = calloc(1, sizeof(*entry));
+      if (!entry)
+         return;
+      entry->name = name;
+      stats->entries[command] = entry;
+   }
+
+   const uint32_t bucket =
+      MIN2(time_ns ? util_logbase2_64(time_ns) : 0, VIRGL_COMMAND_STATS_BUCKET_COUNT - 1);
+
+   entry->count++;
+   entry->total_ns += time_ns;
+   entry->buckets[bucket]++;
+}
+
+uint64_t
+virgl_command_stats_entry_percentile(const struct virgl_command_stats_entry *entry,
+                                     uint32_t percentile)
+{
+   const uint64_t target = (entry->count * MIN2(percentile, 100) + 99) / 100;
+   uint64_t count = 0;
+
+   for (uint32_t i = 0; i < VIRGL_COMMAND_STATS_BUCKET_COUNT; i++) {
+      count += entry->buckets[i];
+      if (count >= target)
+         return i < VIRGL_COMMAND_STATS_BUCKET_COUNT - 1 ? 2ull << i : UINT64_MAX;
+   }
+
+   return UINT64_MAX;
+}
+
+int
+virgl_command_stats_get(const struct virgl_command_stats *stats,
+                        struct virgl_renderer_command_stats *out,
+                        uint32_t *count)
+{
+   uint32_t total = 0;
+
+   for (uint32_t i = 0; i < stats->command_count; i++) {
+      const struct virgl_command_stats_entry *entry = stats->entries[i];
+      if (!entry)
+         continue;
+
+      if (out && total < *count) {
+         struct virgl_renderer_command_stats *dst = &out[total];
+
+         dst->command = i;
+         dst->name = entry->name;
+         dst->count = entry->count;
+         dst->total_ns = entry->total_ns;
+         memcpy(dst->histogram, entry->buckets, sizeof(dst->histogram));
+      }
+      total++;
+   }
+
+   const bool incomplete = out && total > *count;
+   *count = total;
+
+   return incomplete ? ENOSPC : 0;
+}
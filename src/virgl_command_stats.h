@@ -0,0 +1,86 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_COMMAND_STATS_H
+#define VIRGL_COMMAND_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "virglrenderer.h"
+
+#define VIRGL_COMMAND_STATS_BUCKET_COUNT VIRGL_RENDERER_COMMAND_STATS_BUCKET_COUNT
+
+struct virgl_command_stats_entry {
+   const char *name;
+   uint64_t count;
+   uint64_t total_ns;
+   /* see virgl_renderer_command_stats::histogram */
+   uint64_t buckets[VIRGL_COMMAND_STATS_BUCKET_COUNT];
+};
+
+/*
+ * Call counts and latency histograms of the commands of a context, indexed
+ * by the command ids of the context type.  The entries are allocated on the
+ * first call of each command.  They are not thread-safe.
+ */
+struct virgl_command_stats {
+   uint32_t command_count;
+   struct virgl_command_stats_entry *entries[];
+};
+
+/* set by virgl_renderer_init with VIRGL_RENDERER_COMMAND_STATS */
+extern bool virgl_command_stats_enabled;
+
+struct virgl_command_stats *
+virgl_command_stats_create(uint32_t command_count);
+
+void
+virgl_command_stats_destroy(struct virgl_command_stats *stats);
+
+void
+virgl_command_stats_add(struct virgl_command_stats *stats,
+                        uint32_t command,
+                        const char *name,
+                        uint64_t time_ns);
+
+/* returns an exclusive upper bound of the given percentile, in ns */
+uint64_t
+virgl_command_stats_entry_percentile(const struct virgl_command_stats_entry *entry,
+                                     uint32_t percentile);
+
+int
+virgl_command_stats_get(const struct virgl_command_stats *stats,
+                        struct virgl_renderer_command_stats *out,
+                        uint32_t *count);
+
+static inline uint64_t
+virgl_command_stats_now(void)
+{
+   struct timespec now;
+   if (clock_gettime(CLOCK_MONOTONIC, &now))
+      return 0;
+   return 1000000000llu * now.tv_sec + now.tv_nsec;
+}
+
+/* returns the begin time to pass to virgl_command_stats_end, or 0 */
+static inline uint64_t
+virgl_command_stats_begin(const struct virgl_command_stats *stats)
+{
+   return stats ? virgl_command_stats_now() : 0;
+}
+
+static inline void
+virgl_command_stats_end(struct virgl_command_stats *stats,
+                        uint32_t command,
+                        const char *name,
+                        uint64_t begin)
+{
+   if (stats)
+      virgl_command_stats_add(stats, command, name, virgl_command_stats_now() - begin);
+}
+
+#endif /* VIRGL_COMMAND_STATS_H */
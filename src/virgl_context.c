@@ -29,12 +29,15 @@
 #ifndef WIN32
 #include "util/libsync.h"
 #endif
+#include "util/hash_table.h"
 #include "util/os_misc.h"
 #include "util/u_hash_table.h"
 #include "util/u_pointer.h"
 #include "virgl_util.h"
 
 static struct util_hash_table *virgl_context_table;
+/* the contexts by fencing fd */
+static struct hash_table_u64 *virgl_context_fencing_table;
 
 static void
 virgl_context_destroy_func(void *val)
@@ -53,7 +56,17 @@ virgl_context_table_init(void)
    virgl_context_table = util_hash_table_create(hash_func_u32,
                                                 equal_func,
                                                 virgl_context_destroy_func);
-   return virgl_context_table ? 0 : ENOMEM;
+   if (!virgl_context_table)
+      return ENOMEM;
+
+   virgl_context_fencing_table = _mesa_hash_table_u64_create(NULL);
+   if (!virgl_context_fencing_table) {
+      util_hash_table_destroy(virgl_context_table);
+      virgl_context_table = NULL;
+      return ENOMEM;
+   }
+
+   return 0;
 }
 
 void
@@ -61,12 +74,16 @@ virgl_context_table_cleanup(void)
 {
    util_hash_table_destroy(virgl_context_table);
    virgl_context_table = NULL;
+
+   _mesa_hash_table_u64_destroy(virgl_context_fencing_table, NULL);
+   virgl_context_fencing_table = NULL;
 }
 
 void
 virgl_context_table_reset(void)
 {
    util_hash_table_clear(virgl_context_table);
+   _mesa_hash_table_u64_clear(virgl_context_fencing_table);
 }
 
 int
@@ -80,6 +97,10 @@ virgl_context_add(struct virgl_context *ctx)
 void
 virgl_context_remove(uint32_t ctx_id)
 {
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (ctx && ctx->fencing_fd >= 0)
+      _mesa_hash_table_u64_remove(virgl_context_fencing_table, ctx->fencing_fd);
+
    util_hash_table_remove(virgl_context_table, uintptr_to_pointer(ctx_id));
 }
 
@@ -90,6 +111,24 @@ virgl_context_lookup(uint32_t ctx_id)
                               uintptr_to_pointer(ctx_id));
 }
 
+void
+virgl_context_set_fencing_fd(struct virgl_context *ctx, int fd)
+{
+   assert(ctx->fencing_fd < 0 && fd >= 0);
+
+   _mesa_hash_table_u64_insert(virgl_context_fencing_table, fd, ctx);
+   ctx->fencing_fd = fd;
+}
+
+struct virgl_context *
+virgl_context_lookup_fencing_fd(int fd)
+{
+   if (fd < 0)
+      return NULL;
+
+   return _mesa_hash_table_u64_search(virgl_context_fencing_table, fd);
+}
+
 static enum pipe_error
 virgl_context_foreach_func(UNUSED void *key, void *val, void *data)
 {
@@ -36,6 +36,9 @@
 
 struct vrend_transfer_info;
 struct pipe_resource;
+struct virgl_command_stats;
+struct virgl_flight_recorder;
+struct virgl_renderer_stats;
 
 struct virgl_context_blob {
    /* valid fd or pipe resource */
@@ -51,6 +54,25 @@ struct virgl_context_blob {
    struct virgl_resource_vulkan_info vulkan_info;
 };
 
+/* The arguments of a get_blob call, for get_blobs. */
+struct virgl_context_blob_request {
+   uint32_t res_id;
+   uint64_t blob_id;
+   uint64_t blob_size;
+   uint32_t blob_flags;
+};
+
+/* A command stream and an optional fence, for submit_batch. */
+struct virgl_context_submit {
+   const void *buffer;
+   size_t size;
+
+   bool fence;
+   uint32_t fence_flags;
+   uint32_t ring_idx;
+   uint64_t fence_id;
+};
+
 struct virgl_context;
 
 typedef void (*virgl_context_fence_retire)(struct virgl_context *ctx,
@@ -66,6 +88,9 @@ struct virgl_context {
 
    int in_fence_fd;
 
+   /* the fd set with virgl_context_set_fencing_fd, or -1 */
+   int fencing_fd;
+
    uint32_t capset_id;
 
    /*
@@ -80,6 +105,11 @@ struct virgl_context {
 
    bool supports_fence_sharing;
 
+   /* with VIRGL_RENDERER_COMMAND_STATS, owned by the context when not NULL */
+   struct virgl_command_stats *command_stats;
+   /* the last commands of the context, owned by the context when not NULL */
+   struct virgl_flight_recorder *flight_recorder;
+
    void (*destroy)(struct virgl_context *ctx);
 
    void (*attach_resource)(struct virgl_context *ctx,
@@ -110,6 +140,14 @@ struct virgl_context {
                    uint32_t blob_flags,
                    struct virgl_context_blob *blob);
 
+   /* optional, same as get_blob for each request in order, until one fails.
+    * Returns the number of blobs.
+    */
+   uint32_t (*get_blobs)(struct virgl_context *ctx,
+                         const struct virgl_context_blob_request *reqs,
+                         uint32_t count,
+                         struct virgl_context_blob *blobs);
+
    int (*submit_cmd)(struct virgl_context *ctx,
                      const void *buffer,
                      size_t size);
@@ -129,6 +167,21 @@ struct virgl_context {
                        uint32_t ring_idx,
                        uint64_t fence_id);
 
+   /* optional, same as submit_cmd followed by submit_fence */
+   int (*submit_cmd_with_fence)(struct virgl_context *ctx,
+                                const void *buffer,
+                                size_t size,
+                                uint32_t flags,
+                                uint32_t ring_idx,
+                                uint64_t fence_id);
+
+   /* optional, same as submit_cmd_with_fence, or submit_cmd when the
+    * submission has no fence, for each submission in order
+    */
+   int (*submit_batch)(struct virgl_context *ctx,
+                       const struct virgl_context_submit *submits,
+                       uint32_t count);
+
    /* For DRM native contexts, return the device fd: */
    int (*get_device_fd)(struct virgl_context *ctx);
 
@@ -138,6 +191,17 @@ struct virgl_context {
                           void *addr,
                           int32_t prot,
                           int32_t flags);
+
+   /* optional, unmaps what resource_map returned for a NULL addr */
+   int (*resource_unmap)(struct virgl_context *ctx,
+                         struct virgl_resource *res,
+                         void *map);
+
+   /* optional, see virgl_renderer_context_set_weight */
+   int (*set_weight)(struct virgl_context *ctx, uint32_t weight);
+
+   /* optional, adds the context counters to stats */
+   void (*get_stats)(struct virgl_context *ctx, struct virgl_renderer_stats *stats);
 };
 
 struct virgl_context_foreach_args {
@@ -163,6 +227,15 @@ virgl_context_remove(uint32_t ctx_id);
 struct virgl_context *
 virgl_context_lookup(uint32_t ctx_id);
 
+/* Makes the context the one of fd, as returned by get_fencing_fd, for
+ * virgl_context_lookup_fencing_fd.
+ */
+void
+virgl_context_set_fencing_fd(struct virgl_context *ctx, int fd);
+
+struct virgl_context *
+virgl_context_lookup_fencing_fd(int fd);
+
 void
 virgl_context_foreach(const struct virgl_context_foreach_args *args);
 
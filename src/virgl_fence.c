@@ -6,43 +6,75 @@
 #include "virgl_fence.h"
 
 #include "c11/threads.h"
-#include "util/hash_table.h"
+#include "util/list.h"
 #include "util/macros.h"
 #include "util/os_file.h"
+#include "util/slab.h"
 
 #ifndef WIN32
 #include "util/libsync.h"
 #endif
 
+#ifdef HAVE_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "virgl_id_table.h"
 #include "virgl_util.h"
 
 #define FENCE_HUNG_CHECK_TIME_SEC   10
 
+/* The fences of a timeline signal in the order they are set. */
+struct virgl_fence_timeline {
+   uint64_t id;
+   uint64_t next_seqno;
+   struct list_head fences;
+   struct list_head head;
+};
+
 struct virgl_fence {
    uint64_t id;
    int fd; /* sync file FD */
    struct timespec timestamp; /* for hung-checking */
+
+   struct virgl_fence_timeline *timeline;
+   /* orders the fences of the timeline */
+   uint64_t seqno;
+   struct list_head head;
+   /* whether fd is in virgl_fence_epoll_fd */
+   bool registered;
 };
 
 static struct virgl_fence last_signalled_fence = { .fd = -1 };
-static struct hash_table_u64 *virgl_fence_table;
+static struct virgl_id_table virgl_fence_table;
+/* a fence is created and destroyed for every submission */
+static struct slab_pool virgl_fence_pool;
+static struct list_head virgl_fence_timelines;
+/* epoll set of the sync files, or -1 to poll the oldest fences */
+static int virgl_fence_epoll_fd = -1;
 static mtx_t virgl_fence_table_lock;
 
-static void virgl_fence_table_cleanup_cb(struct hash_entry *entry)
-{
-   struct virgl_fence *fence = entry->data;
-   if (fence->fd >= 0)
-      close(fence->fd);
-   free(fence);
-}
-
 void
 virgl_fence_table_cleanup(void)
 {
-   _mesa_hash_table_u64_destroy(virgl_fence_table,
-                                virgl_fence_table_cleanup_cb);
+   virgl_id_table_foreach(&virgl_fence_table, slot) {
+      struct virgl_fence *fence = slot->value;
+      if (fence->fd >= 0)
+         close(fence->fd);
+      slab_free(&virgl_fence_pool, fence);
+   }
+   virgl_id_table_fini(&virgl_fence_table);
+   slab_pool_fini(&virgl_fence_pool);
+
+   list_for_each_entry_safe(struct virgl_fence_timeline, timeline,
+                            &virgl_fence_timelines, head)
+      free(timeline);
+   list_inithead(&virgl_fence_timelines);
 
-   virgl_fence_table = NULL;
+   if (virgl_fence_epoll_fd >= 0) {
+      close(virgl_fence_epoll_fd);
+      virgl_fence_epoll_fd = -1;
+   }
 
    mtx_destroy(&virgl_fence_table_lock);
 
@@ -53,9 +85,21 @@ virgl_fence_table_cleanup(void)
 int
 virgl_fence_table_init(void)
 {
-   virgl_fence_table = _mesa_hash_table_u64_create(NULL);
-   if (!virgl_fence_table)
+   if (!virgl_id_table_init(&virgl_fence_table))
+      return -ENOMEM;
+
+   if (!slab_pool_init(&virgl_fence_pool, sizeof(struct virgl_fence), 64)) {
+      virgl_id_table_fini(&virgl_fence_table);
       return -ENOMEM;
+   }
+
+   list_inithead(&virgl_fence_timelines);
+
+#ifdef HAVE_EPOLL_H
+   virgl_fence_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (virgl_fence_epoll_fd < 0)
+      virgl_info("%s: epoll_create1 failed, polling fences\n", __func__);
+#endif
 
    mtx_init(&virgl_fence_table_lock, mtx_plain);
 
@@ -65,91 +109,215 @@ virgl_fence_table_init(void)
    return 0;
 }
 
-static void virgl_fence_table_retire_cb(UNUSED const void *key, void *data,
-                                        UNUSED void *arg)
+static void
+virgl_fence_destroy(struct virgl_fence *fence, bool signalled)
 {
-   struct virgl_fence *fence = data;
-   bool retire = true;
-   int err = 0;
+   if (signalled) {
+      if (last_signalled_fence.fd >= 0)
+         close(last_signalled_fence.fd);
 
-#ifndef WIN32
-   retire = !sync_wait(fence->fd, 0);
+      last_signalled_fence.id = fence->id;
+      last_signalled_fence.fd = os_dupfd_cloexec(fence->fd);
+   }
 
-   if (!retire) {
-      struct timespec now;
-      clock_gettime(CLOCK_MONOTONIC, &now);
+#ifdef HAVE_EPOLL_H
+   /* the dup above keeps the file in the set after the close */
+   if (fence->registered)
+      epoll_ctl(virgl_fence_epoll_fd, EPOLL_CTL_DEL, fence->fd, NULL);
+#endif
 
-      if (errno == ETIME && now.tv_sec - fence->timestamp.tv_sec > FENCE_HUNG_CHECK_TIME_SEC) {
-         virgl_info("%s: fence_id=%" PRIu64 " stuck for more than %d sec\n",
-                    __func__, fence->id, FENCE_HUNG_CHECK_TIME_SEC);
-         fence->timestamp = now;
-      }
+   virgl_id_table_remove(&virgl_fence_table, fence->id);
+   list_del(&fence->head);
+   close(fence->fd);
+   slab_free(&virgl_fence_pool, fence);
+}
+
+/* Retires the fences of the timeline of fence, up to and including it. */
+static void
+virgl_fence_retire(struct virgl_fence *fence, bool signalled)
+{
+   struct virgl_fence_timeline *timeline = fence->timeline;
+
+   list_for_each_entry_safe(struct virgl_fence, older, &timeline->fences, head) {
+      const bool last = older == fence;
+      virgl_fence_destroy(older, last && signalled);
+      if (last)
+         break;
+   }
+}
+
+static void
+virgl_fence_check_hung(struct virgl_fence *fence)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   if (now.tv_sec - fence->timestamp.tv_sec > FENCE_HUNG_CHECK_TIME_SEC) {
+      virgl_info("%s: fence_id=%" PRIu64 " stuck for more than %d sec\n",
+                 __func__, fence->id, FENCE_HUNG_CHECK_TIME_SEC);
+      fence->timestamp = now;
+   }
+}
+
+/* Polls the oldest fence of each timeline, only those not in the epoll set
+ * when registered_too is false.
+ */
+static void
+virgl_fence_table_poll_locked(bool registered_too)
+{
+   list_for_each_entry(struct virgl_fence_timeline, timeline,
+                       &virgl_fence_timelines, head) {
+      while (!list_is_empty(&timeline->fences)) {
+         struct virgl_fence *fence =
+            list_first_entry(&timeline->fences, struct virgl_fence, head);
+         if (fence->registered && !registered_too) {
+            virgl_fence_check_hung(fence);
+            break;
+         }
+
+#ifndef WIN32
+         if (sync_wait(fence->fd, 0)) {
+            if (errno == ETIME) {
+               virgl_fence_check_hung(fence);
+               break;
+            }
+
+            virgl_error("%s: sync_wait failed for fence_id=%" PRIu64 " err=%d\n",
+                        __func__, fence->id, -errno);
+            virgl_fence_retire(fence, false);
+            continue;
+         }
+#endif
 
-      if (errno != ETIME) {
-         retire = true;
-         err = -errno;
-         virgl_error("%s: sync_wait failed for fence_id=%" PRIu64 " err=%d\n",
-                     __func__, fence->id, err);
+         virgl_fence_retire(fence, true);
       }
    }
+}
+
+static void
+virgl_fence_table_retire_locked(void)
+{
+#ifdef HAVE_EPOLL_H
+   if (virgl_fence_epoll_fd >= 0) {
+      struct epoll_event events[16];
+      int count;
+      do {
+         count = epoll_wait(virgl_fence_epoll_fd, events, ARRAY_SIZE(events), 0);
+         for (int i = 0; i < count; i++) {
+            /* looked up by id, as retiring a fence retires the older ones */
+            struct virgl_fence *fence =
+               virgl_id_table_search(&virgl_fence_table, events[i].data.u64);
+            if (fence)
+               virgl_fence_retire(fence, !(events[i].events & EPOLLERR));
+         }
+      } while (count == ARRAY_SIZE(events));
+
+      virgl_fence_table_poll_locked(false);
+   } else
 #endif
-   if (retire) {
-      if (!err) {
-         if (last_signalled_fence.fd >= 0)
-            close(last_signalled_fence.fd);
+   {
+      virgl_fence_table_poll_locked(true);
+   }
 
-         last_signalled_fence.id = fence->id;
-         last_signalled_fence.fd = os_dupfd_cloexec(fence->fd);
+   list_for_each_entry_safe(struct virgl_fence_timeline, timeline,
+                            &virgl_fence_timelines, head) {
+      if (list_is_empty(&timeline->fences)) {
+         list_del(&timeline->head);
+         free(timeline);
       }
+   }
+}
 
-      _mesa_hash_table_u64_remove(virgl_fence_table, fence->id);
-      close(fence->fd);
-      free(fence);
+static struct virgl_fence_timeline *
+virgl_fence_get_timeline_locked(uint64_t timeline_id)
+{
+   /* there are few timelines with fences in flight */
+   list_for_each_entry(struct virgl_fence_timeline, timeline,
+                       &virgl_fence_timelines, head) {
+      if (timeline->id == timeline_id)
+         return timeline;
    }
+
+   struct virgl_fence_timeline *timeline = calloc(1, sizeof(*timeline));
+   if (!timeline)
+      return NULL;
+
+   timeline->id = timeline_id;
+   list_inithead(&timeline->fences);
+   list_addtail(&timeline->head, &virgl_fence_timelines);
+
+   return timeline;
 }
 
 static int
-virgl_fence_set_fd_locked(uint64_t fence_id, int fd)
+virgl_fence_set_fd_locked(uint64_t timeline_id, uint64_t fence_id, int fd)
 {
    struct virgl_fence *fence;
 
-   /* walk up all fences and retire signaled ones */
-   hash_table_u64_call_foreach(virgl_fence_table,
-                               virgl_fence_table_retire_cb, NULL);
+   virgl_fence_table_retire_locked();
 
-   fence = _mesa_hash_table_u64_search(virgl_fence_table, fence_id);
+   fence = virgl_id_table_search(&virgl_fence_table, fence_id);
    if (fence)
       return -EBUSY;
 
-   fence = calloc(1, sizeof(*fence));
+   struct virgl_fence_timeline *timeline = virgl_fence_get_timeline_locked(timeline_id);
+   if (!timeline)
+      return -ENOMEM;
+
+   /* an empty timeline is freed by the next retirement */
+   fence = slab_zalloc(&virgl_fence_pool);
    if (!fence)
       return -ENOMEM;
 
    fence->fd = os_dupfd_cloexec(fd);
    if (fence->fd < 0) {
-      free(fence);
-      return -errno;
+      const int err = -errno;
+      slab_free(&virgl_fence_pool, fence);
+      return err;
    }
 
    fence->id = fence_id;
+   fence->timeline = timeline;
+   fence->seqno = timeline->next_seqno++;
    clock_gettime(CLOCK_MONOTONIC, &fence->timestamp);
 
-   _mesa_hash_table_u64_insert(virgl_fence_table, fence_id, fence);
+#ifdef HAVE_EPOLL_H
+   if (virgl_fence_epoll_fd >= 0) {
+      struct epoll_event event = {
+         .events = EPOLLIN,
+         .data.u64 = fence_id,
+      };
+      fence->registered =
+         !epoll_ctl(virgl_fence_epoll_fd, EPOLL_CTL_ADD, fence->fd, &event);
+   }
+#endif
+
+   if (!virgl_id_table_insert(&virgl_fence_table, fence_id, fence)) {
+#ifdef HAVE_EPOLL_H
+      if (fence->registered)
+         epoll_ctl(virgl_fence_epoll_fd, EPOLL_CTL_DEL, fence->fd, NULL);
+#endif
+      close(fence->fd);
+      slab_free(&virgl_fence_pool, fence);
+      return -ENOMEM;
+   }
+   list_addtail(&fence->head, &timeline->fences);
 
    return 0;
 }
 
 /*
  * This function does not take ownership of the FD, caller is responsible
- * for closing it. Function is thread-safe.
+ * for closing it. The fences of a timeline must signal in the order they
+ * are set. Function is thread-safe.
  */
 int
-virgl_fence_set_fd(uint64_t fence_id, int fd)
+virgl_fence_set_fd(uint64_t timeline_id, uint64_t fence_id, int fd)
 {
    int ret;
 
    mtx_lock(&virgl_fence_table_lock);
-   ret = virgl_fence_set_fd_locked(fence_id, fd);
+   ret = virgl_fence_set_fd_locked(timeline_id, fence_id, fd);
    mtx_unlock(&virgl_fence_table_lock);
 
    if (ret)
@@ -174,7 +342,7 @@ virgl_fence_get_fd(uint64_t fence_id)
 
    mtx_lock(&virgl_fence_table_lock);
 
-   fence = _mesa_hash_table_u64_search(virgl_fence_table, fence_id);
+   fence = virgl_id_table_search(&virgl_fence_table, fence_id);
    if (fence)
       fd = os_dupfd_cloexec(fence->fd);
 
@@ -183,6 +351,57 @@ virgl_fence_get_fd(uint64_t fence_id)
    return fd;
 }
 
+/*
+ * Returns in fds the sync file FDs of the given fences, only the latest of
+ * each timeline, as it signals after the others. Fences that are not found
+ * are skipped. Caller of this function takes ownership of the returned FDs
+ * and is responsible for closing them. fds must have room for count FDs.
+ *
+ * Returns the number of FDs. Function is thread-safe.
+ */
+uint32_t
+virgl_fence_get_latest_fds(const uint64_t *fence_ids, uint32_t count, int *fds)
+{
+   struct virgl_fence **latest = malloc(sizeof(*latest) * count);
+   uint32_t latest_count = 0;
+
+   if (!latest)
+      return 0;
+
+   mtx_lock(&virgl_fence_table_lock);
+
+   for (uint32_t i = 0; i < count; i++) {
+      struct virgl_fence *fence =
+         virgl_id_table_search(&virgl_fence_table, fence_ids[i]);
+      if (!fence)
+         continue;
+
+      uint32_t j;
+      for (j = 0; j < latest_count; j++) {
+         if (latest[j]->timeline == fence->timeline)
+            break;
+      }
+
+      if (j == latest_count)
+         latest[latest_count++] = fence;
+      else if (latest[j]->seqno < fence->seqno)
+         latest[j] = fence;
+   }
+
+   uint32_t fd_count = 0;
+   for (uint32_t i = 0; i < latest_count; i++) {
+      const int fd = os_dupfd_cloexec(latest[i]->fd);
+      if (fd >= 0)
+         fds[fd_count++] = fd;
+   }
+
+   mtx_unlock(&virgl_fence_table_lock);
+
+   free(latest);
+
+   return fd_count;
+}
+
 /*
  * Returns sync file FD for the latest signalled fence. Caller of this
  * function  takes ownership of the returned FD and is responsible for
@@ -8,6 +8,7 @@
 
 int virgl_fence_table_init(void);
 void virgl_fence_table_cleanup(void);
-int virgl_fence_set_fd(uint64_t fence_id, int fd);
+int virgl_fence_set_fd(uint64_t timeline_id, uint64_t fence_id, int fd);
 int virgl_fence_get_fd(uint64_t fence_id);
+uint32_t virgl_fence_get_latest_fds(const uint64_t *fence_ids, uint32_t count, int *fds);
 int virgl_fence_get_last_signalled_fence_fd(void);
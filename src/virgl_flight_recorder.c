@@ -0,0 +1,88 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_flight_recorder.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "util/u_debug.h"
+#include "virgl_util.h"
+
+#define VIRGL_FLIGHT_RECORDER_MASK (VIRGL_FLIGHT_RECORDER_SIZE - 1)
+
+struct virgl_flight_recorder *
+virgl_flight_recorder_create(void)
+{
+   if (!debug_get_bool_option("VIRGL_FLIGHT_RECORDER", true))
+      return NULL;
+
+   struct virgl_flight_recorder *rec = calloc(1, sizeof(*rec));
+   if (!rec)
+      return NULL;
+
+   atomic_init(&rec->count, 0);
+   atomic_init(&rec->dumped, false);
+
+   return rec;
+}
+
+void
+virgl_flight_recorder_destroy(struct virgl_flight_recorder *rec)
+{
+   free(rec);
+}
+
+void
+virgl_flight_recorder_add(struct virgl_flight_recorder *rec,
+                          uint32_t command,
+                          const char *name,
+                          uint32_t size,
+                          uint64_t time_ns,
+                          uint64_t duration_ns)
+{
+   const uint64_t index = atomic_fetch_add_explicit(&rec->count, 1, memory_order_relaxed);
+   struct virgl_flight_record *record = &rec->records[index & VIRGL_FLIGHT_RECORDER_MASK];
+
+   record->name = name;
+   record->command = command;
+   record->size = size;
+   record->time_ns = time_ns;
+   record->duration_ns = duration_ns;
+}
+
+void
+virgl_flight_recorder_dump(struct virgl_flight_recorder *rec, uint32_t ctx_id)
+{
+   if (!rec)
+      return;
+
+   const uint64_t count = atomic_load(&rec->count);
+   const uint64_t first = count > VIRGL_FLIGHT_RECORDER_SIZE ?
+                          count - VIRGL_FLIGHT_RECORDER_SIZE : 0;
+   const uint64_t now = virgl_command_stats_now();
+
+   virgl_warn("context %u: last %" PRIu64 " of %" PRIu64 " commands:\n", ctx_id,
+              count - first, count);
+
+   for (uint64_t i = first; i < count; i++) {
+      const struct virgl_flight_record *record =
+         &rec->records[i & VIRGL_FLIGHT_RECORDER_MASK];
+      if (!record->name)
+         continue;
+
+      const uint64_t age = now > record->time_ns ? now - record->time_ns : 0;
+      virgl_warn("  #%" PRIu64 " %s (%u), %u bytes, %" PRIu64 " ns, %.3f ms ago\n", i,
+                 record->name, record->command, record->size, record->duration_ns,
+                 age / 1e6);
+   }
+}
+
+void
+virgl_flight_recorder_dump_once(struct virgl_flight_recorder *rec, uint32_t ctx_id)
+{
+   if (rec && !atomic_exchange(&rec->dumped, true))
+      virgl_flight_recorder_dump(rec, ctx_id);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_FLIGHT_RECORDER_H
+#define VIRGL_FLIGHT_RECORDER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "virgl_command_stats.h"
+
+/* must be a power of two */
+#define VIRGL_FLIGHT_RECORDER_SIZE 256
+
+struct virgl_flight_record {
+   /* a static string, or NULL for a free slot */
+   const char *name;
+   uint32_t command;
+   uint32_t size;
+   /* CLOCK_MONOTONIC time the command started at */
+   uint64_t time_ns;
+   uint64_t duration_ns;
+};
+
+/*
+ * The last VIRGL_FLIGHT_RECORDER_SIZE commands executed by a context, to be
+ * dumped when the context goes wrong.  Slots are claimed with an atomic
+ * increment, so that the rings of a context can record concurrently without a
+ * lock.  A dump does not stop the writers, and the records written during the
+ * dump may be inconsistent.
+ */
+struct virgl_flight_recorder {
+   /* the number of recorded commands, the next slot is count % SIZE */
+   atomic_uint_fast64_t count;
+   atomic_bool dumped;
+   struct virgl_flight_record records[VIRGL_FLIGHT_RECORDER_SIZE];
+};
+
+/* returns NULL when VIRGL_FLIGHT_RECORDER is set to false */
+struct virgl_flight_recorder *
+virgl_flight_recorder_create(void);
+
+void
+virgl_flight_recorder_destroy(struct virgl_flight_recorder *rec);
+
+void
+virgl_flight_recorder_add(struct virgl_flight_recorder *rec,
+                          uint32_t command,
+                          const char *name,
+                          uint32_t size,
+                          uint64_t time_ns,
+                          uint64_t duration_ns);
+
+/* logs the records of the context, the oldest first */
+void
+virgl_flight_recorder_dump(struct virgl_flight_recorder *rec, uint32_t ctx_id);
+
+/* same as virgl_flight_recorder_dump, but only the first time it is called, for the
+ * errors that are likely to repeat
+ */
+void
+virgl_flight_recorder_dump_once(struct virgl_flight_recorder *rec, uint32_t ctx_id);
+
+/* returns the begin time to pass to virgl_flight_recorder_end, or 0 */
+static inline uint64_t
+virgl_flight_recorder_begin(const struct virgl_flight_recorder *rec,
+                            const struct virgl_command_stats *stats)
+{
+   return rec || stats ? virgl_command_stats_now() : 0;
+}
+
+/* records the command, and adds it to stats too when not NULL */
+static inline void
+virgl_flight_recorder_end(struct virgl_flight_recorder *rec,
+                          struct virgl_command_stats *stats,
+                          uint32_t command,
+                          const char *name,
+                          uint32_t size,
+                          uint64_t begin)
+{
+   if (!rec && !stats)
+      return;
+
+   const uint64_t duration = virgl_command_stats_now() - begin;
+   if (rec)
+      virgl_flight_recorder_add(rec, command, name, size, begin, duration);
+   if (stats)
+      virgl_command_stats_add(stats, command, name, duration);
+}
+
+#endif /* VIRGL_FLIGHT_RECORDER_H */
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_id_table.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VIRGL_ID_TABLE_MIN_ORDER 4
+
+static bool
+virgl_id_table_alloc(struct virgl_id_table *table, uint32_t order)
+{
+   table->slots = calloc(1u << order, sizeof(*table->slots));
+   if (!table->slots)
+      return false;
+
+   table->order = order;
+   table->count = 0;
+   return true;
+}
+
+bool
+virgl_id_table_init(struct virgl_id_table *table)
+{
+   return virgl_id_table_alloc(table, VIRGL_ID_TABLE_MIN_ORDER);
+}
+
+void
+virgl_id_table_fini(struct virgl_id_table *table)
+{
+   free(table->slots);
+   table->slots = NULL;
+   table->count = 0;
+}
+
+static struct virgl_id_table_slot *
+virgl_id_table_find_slot(const struct virgl_id_table *table, uint64_t id)
+{
+   const uint32_t mask = (1u << table->order) - 1;
+   uint32_t i = virgl_id_table_hash(table, id);
+
+   while (table->slots[i].value && table->slots[i].id != id)
+      i = (i + 1) & mask;
+
+   return &table->slots[i];
+}
+
+/* the table is kept at most half full, the probes stay short */
+static bool
+virgl_id_table_grow(struct virgl_id_table *table)
+{
+   struct virgl_id_table old = *table;
+
+   if (!virgl_id_table_alloc(table, old.order + 1)) {
+      *table = old;
+      return false;
+   }
+
+   for (uint32_t i = 0; i < 1u << old.order; i++) {
+      if (old.slots[i].value)
+         *virgl_id_table_find_slot(table, old.slots[i].id) = old.slots[i];
+   }
+   table->count = old.count;
+
+   free(old.slots);
+   return true;
+}
+
+bool
+virgl_id_table_insert(struct virgl_id_table *table, uint64_t id, void *value)
+{
+   struct virgl_id_table_slot *slot = virgl_id_table_find_slot(table, id);
+
+   assert(value);
+
+   if (!slot->value) {
+      if ((table->count + 1) * 2 > 1u << table->order) {
+         if (!virgl_id_table_grow(table))
+            return false;
+         slot = virgl_id_table_find_slot(table, id);
+      }
+      table->count++;
+   }
+
+   slot->id = id;
+   slot->value = value;
+   return true;
+}
+
+void *
+virgl_id_table_remove(struct virgl_id_table *table, uint64_t id)
+{
+   const uint32_t mask = (1u << table->order) - 1;
+   struct virgl_id_table_slot *slot = virgl_id_table_find_slot(table, id);
+   void *value = slot->value;
+
+   if (!value)
+      return NULL;
+
+   /* Move back the following slots of the run that would not be found past
+    * the hole, instead of leaving a tombstone. */
+   uint32_t hole = slot - table->slots;
+   for (uint32_t i = (hole + 1) & mask; table->slots[i].value; i = (i + 1) & mask) {
+      const uint32_t home = virgl_id_table_hash(table, table->slots[i].id);
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+         table->slots[hole] = table->slots[i];
+         hole = i;
+      }
+   }
+   table->slots[hole].value = NULL;
+   table->count--;
+
+   return value;
+}
+
+void
+virgl_id_table_clear(struct virgl_id_table *table)
+{
+   memset(table->slots, 0, sizeof(*table->slots) << table->order);
+   table->count = 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_ID_TABLE_H
+#define VIRGL_ID_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/macros.h"
+
+/* A table of pointers keyed by integer ids, like fence or resource ids.
+ *
+ * The ids are stored inline in a flat array of slots, found by linear
+ * probing from a multiplicative hash, without the hash and compare callbacks
+ * of the generic hash tables.  A slot is empty when its value is NULL, so
+ * every id can be used, but NULL values can not be stored.
+ */
+
+struct virgl_id_table_slot {
+   uint64_t id;
+   void *value;
+};
+
+struct virgl_id_table {
+   struct virgl_id_table_slot *slots;
+   /* the slot count is 1 << order */
+   uint32_t order;
+   uint32_t count;
+};
+
+bool
+virgl_id_table_init(struct virgl_id_table *table);
+
+void
+virgl_id_table_fini(struct virgl_id_table *table);
+
+/* replaces the value of id when it is already in the table */
+bool
+virgl_id_table_insert(struct virgl_id_table *table, uint64_t id, void *value);
+
+/* returns the removed value, or NULL */
+void *
+virgl_id_table_remove(struct virgl_id_table *table, uint64_t id);
+
+void
+virgl_id_table_clear(struct virgl_id_table *table);
+
+static inline uint32_t
+virgl_id_table_hash(const struct virgl_id_table *table, uint64_t id)
+{
+   /* Fibonacci hashing, the top bits are the best mixed */
+   return (uint32_t)((id * 0x9e3779b97f4a7c15ull) >> (64 - table->order));
+}
+
+static inline void *
+virgl_id_table_search(const struct virgl_id_table *table, uint64_t id)
+{
+   const uint32_t mask = (1u << table->order) - 1;
+
+   for (uint32_t i = virgl_id_table_hash(table, id);; i = (i + 1) & mask) {
+      const struct virgl_id_table_slot *slot = &table->slots[i];
+      if (!slot->value)
+         return NULL;
+      if (slot->id == id)
+         return slot->value;
+   }
+}
+
+/* the number of slots, 0 before init and after fini */
+static inline uint32_t
+virgl_id_table_size(const struct virgl_id_table *table)
+{
+   return table->slots ? 1u << table->order : 0;
+}
+
+/* The table must not be modified during the iteration. */
+#define virgl_id_table_foreach(table, slot)                                   \
+   for (struct virgl_id_table_slot *slot = (table)->slots;                    \
+        slot < (table)->slots + virgl_id_table_size(table); slot++)           \
+      if (slot->value)
+
+#endif /* VIRGL_ID_TABLE_H */
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_memory_budget.h"
+
+#include <inttypes.h>
+
+#include "util/u_debug.h"
+#include "virgl_util.h"
+
+#define VIRGL_MEMORY_BUDGET_MIB (1024ull * 1024ull)
+
+void
+virgl_memory_budget_init(struct virgl_memory_budget *budget)
+{
+   const long soft = debug_get_num_option("VIRGL_CONTEXT_MEMORY_SOFT_BUDGET", 0);
+   const long hard = debug_get_num_option("VIRGL_CONTEXT_MEMORY_HARD_BUDGET", 0);
+
+   atomic_init(&budget->allocated, 0);
+   atomic_init(&budget->over_soft_limit, false);
+   budget->soft_limit = soft > 0 ? (uint64_t)soft * VIRGL_MEMORY_BUDGET_MIB : 0;
+   budget->hard_limit = hard > 0 ? (uint64_t)hard * VIRGL_MEMORY_BUDGET_MIB : 0;
+
+   /* a soft limit above the hard limit is never reached */
+   if (budget->hard_limit && budget->soft_limit > budget->hard_limit)
+      budget->soft_limit = budget->hard_limit;
+}
+
+bool
+virgl_memory_budget_fits(const struct virgl_memory_budget *budget, uint64_t size)
+{
+   if (!budget->hard_limit)
+      return true;
+
+   const uint64_t allocated = atomic_load(&budget->allocated);
+   return allocated <= budget->hard_limit && size <= budget->hard_limit - allocated;
+}
+
+bool
+virgl_memory_budget_charge(struct virgl_memory_budget *budget, uint64_t size)
+{
+   uint64_t allocated = atomic_load(&budget->allocated);
+   do {
+      if (budget->hard_limit &&
+          (allocated > budget->hard_limit || size > budget->hard_limit - allocated)) {
+         virgl_warn("context memory budget: %" PRIu64 " bytes over the hard limit\n",
+                    allocated + size - budget->hard_limit);
+         return false;
+      }
+   } while (!atomic_compare_exchange_weak(&budget->allocated, &allocated,
+                                          allocated + size));
+
+   if (budget->soft_limit && allocated + size > budget->soft_limit &&
+       !atomic_exchange(&budget->over_soft_limit, true)) {
+      virgl_warn("context memory budget: %" PRIu64 " bytes over the soft limit\n",
+                 allocated + size - budget->soft_limit);
+   }
+
+   return true;
+}
+
+void
+virgl_memory_budget_uncharge(struct virgl_memory_budget *budget, uint64_t size)
+{
+   const uint64_t allocated = atomic_fetch_sub(&budget->allocated, size) - size;
+
+   if (budget->soft_limit && allocated <= budget->soft_limit)
+      atomic_store(&budget->over_soft_limit, false);
+}
+
+uint64_t
+virgl_memory_budget_available(const struct virgl_memory_budget *budget)
+{
+   const uint64_t limit = budget->soft_limit ? budget->soft_limit : budget->hard_limit;
+   if (!limit)
+      return UINT64_MAX;
+
+   const uint64_t allocated = atomic_load(&budget->allocated);
+   return allocated < limit ? limit - allocated : 0;
+}
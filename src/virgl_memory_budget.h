@@ -0,0 +1,46 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_MEMORY_BUDGET_H
+#define VIRGL_MEMORY_BUDGET_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The GPU memory allocated by a context, and the limits it is held to.  The
+ * limits are global and come from VIRGL_CONTEXT_MEMORY_SOFT_BUDGET and
+ * VIRGL_CONTEXT_MEMORY_HARD_BUDGET, in MiB, where 0 or unset means no limit.
+ *
+ * Allocations over the hard limit fail.  The soft limit is only reported to
+ * the guest, which is expected to trim its caches when it gets there.
+ */
+struct virgl_memory_budget {
+   atomic_uint_fast64_t allocated;
+   uint64_t soft_limit;
+   uint64_t hard_limit;
+   atomic_bool over_soft_limit;
+};
+
+void
+virgl_memory_budget_init(struct virgl_memory_budget *budget);
+
+/* returns false, and charges nothing, when size does not fit the hard limit */
+bool
+virgl_memory_budget_charge(struct virgl_memory_budget *budget, uint64_t size);
+
+void
+virgl_memory_budget_uncharge(struct virgl_memory_budget *budget, uint64_t size);
+
+/* whether size would fit the hard limit, without charging it */
+bool
+virgl_memory_budget_fits(const struct virgl_memory_budget *budget, uint64_t size);
+
+/* the usable memory left under the soft (or hard) limit, or UINT64_MAX */
+uint64_t
+virgl_memory_budget_available(const struct virgl_memory_budget *budget);
+
+#endif /* VIRGL_MEMORY_BUDGET_H */
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "virgl_numa.h"
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "util/u_debug.h"
+#include "virgl_util.h"
+
+/* from linux/mempolicy.h, without depending on libnuma */
+#define VIRGL_MPOL_PREFERRED 1
+
+#define VIRGL_NUMA_MAX_NODES 256
+#define VIRGL_NUMA_MASK_LONGS (VIRGL_NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
+
+static struct {
+   atomic_bool probed;
+   /* published last, the other members are set when it is not -1 */
+   atomic_int node;
+
+   bool bind_threads;
+   cpu_set_t cpus;
+   unsigned long node_mask[VIRGL_NUMA_MASK_LONGS];
+} virgl_numa = {
+   .node = -1,
+};
+
+static bool
+virgl_numa_read_line(const char *path, char *buf, size_t size)
+{
+   FILE *fp = fopen(path, "re");
+   if (!fp)
+      return false;
+
+   const bool ok = fgets(buf, size, fp);
+   fclose(fp);
+   return ok;
+}
+
+/* parses a list like "0-15,32-47\n" */
+static bool
+virgl_numa_parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+   CPU_ZERO(cpus);
+
+   while (*list && *list != '\n') {
+      char *end;
+      unsigned long first = strtoul(list, &end, 10);
+      unsigned long last = first;
+
+      if (end == list)
+         return false;
+      if (*end == '-') {
+         list = end + 1;
+         last = strtoul(list, &end, 10);
+         if (end == list || last < first)
+            return false;
+      }
+
+      for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+         CPU_SET(cpu, cpus);
+
+      list = *end == ',' ? end + 1 : end;
+   }
+
+   return CPU_COUNT(cpus);
+}
+
+static int
+virgl_numa_device_node(int drm_fd)
+{
+   struct stat st;
+   char path[64];
+   char buf[32];
+
+   if (fstat(drm_fd, &st) || !S_ISCHR(st.st_mode))
+      return -1;
+
+   snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/numa_node",
+            major(st.st_rdev), minor(st.st_rdev));
+   if (!virgl_numa_read_line(path, buf, sizeof(buf)))
+      return -1;
+
+   /* -1 when the platform does not tell */
+   return atoi(buf);
+}
+
+static bool
+virgl_numa_is_multi_node(void)
+{
+   char buf[64];
+
+   /* "0" on single node hosts */
+   if (!virgl_numa_read_line("/sys/devices/system/node/online", buf, sizeof(buf)))
+      return false;
+   return strpbrk(buf, ",-");
+}
+
+static bool
+virgl_numa_affinity_is_restricted(void)
+{
+   cpu_set_t cpus;
+
+   if (sched_getaffinity(0, sizeof(cpus), &cpus))
+      return true;
+   return CPU_COUNT(&cpus) < sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+void
+virgl_numa_set_device(int drm_fd)
+{
+   char path[64];
+   char buf[1024];
+
+   if (drm_fd < 0 || atomic_exchange(&virgl_numa.probed, true))
+      return;
+
+   if (!debug_get_bool_option("VIRGL_NUMA", true) || !virgl_numa_is_multi_node())
+      return;
+
+   const int node = virgl_numa_device_node(drm_fd);
+   if (node < 0 || node >= VIRGL_NUMA_MAX_NODES)
+      return;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+   if (!virgl_numa_read_line(path, buf, sizeof(buf)) ||
+       !virgl_numa_parse_cpulist(buf, &virgl_numa.cpus))
+      return;
+
+   virgl_numa.node_mask[node / (8 * sizeof(unsigned long))] =
+      1ul << (node % (8 * sizeof(unsigned long)));
+   virgl_numa.bind_threads = !virgl_numa_affinity_is_restricted();
+
+   virgl_debug("GPU on NUMA node %d%s\n", node,
+               virgl_numa.bind_threads ? "" : ", threads left unpinned");
+
+   atomic_store(&virgl_numa.node, node);
+}
+
+int
+virgl_numa_node(void)
+{
+   return atomic_load(&virgl_numa.node);
+}
+
+void
+virgl_numa_bind_thread(void)
+{
+   if (virgl_numa_node() < 0 || !virgl_numa.bind_threads)
+      return;
+
+   /* both are hints, the thread keeps running wherever it was on failure */
+   pthread_setaffinity_np(pthread_self(), sizeof(virgl_numa.cpus), &virgl_numa.cpus);
+   syscall(SYS_set_mempolicy, VIRGL_MPOL_PREFERRED, virgl_numa.node_mask,
+           VIRGL_NUMA_MAX_NODES + 1);
+}
+
+void
+virgl_numa_bind_memory(void *ptr, size_t size)
+{
+   if (virgl_numa_node() < 0)
+      return;
+
+   const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+   const uintptr_t start = ((uintptr_t)ptr + page_size - 1) & ~(page_size - 1);
+   const uintptr_t end = ((uintptr_t)ptr + size) & ~(page_size - 1);
+   if (start >= end)
+      return;
+
+   syscall(SYS_mbind, start, end - start, VIRGL_MPOL_PREFERRED, virgl_numa.node_mask,
+           VIRGL_NUMA_MAX_NODES + 1, 0);
+}
+
+#else /* __linux__ */
+
+#include "util/macros.h"
+
+void
+virgl_numa_set_device(UNUSED int drm_fd)
+{
+}
+
+int
+virgl_numa_node(void)
+{
+   return -1;
+}
+
+void
+virgl_numa_bind_thread(void)
+{
+}
+
+void
+virgl_numa_bind_memory(UNUSED void *ptr, UNUSED size_t size)
+{
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_NUMA_H
+#define VIRGL_NUMA_H
+
+#include <stddef.h>
+
+/*
+ * Keeps the helper threads and the buffers the GPU and those threads touch
+ * all the time on the NUMA node of the GPU.
+ *
+ * The node is that of the first DRM device passed to virgl_numa_set_device,
+ * it is unknown on single node hosts, outside of Linux, and with VIRGL_NUMA
+ * set to false.  All the functions do nothing while the node is unknown.
+ */
+
+/* picks the node of the device behind the DRM fd, once */
+void
+virgl_numa_set_device(int drm_fd);
+
+/* the node of the GPU, or -1 */
+int
+virgl_numa_node(void);
+
+/* Pins the calling thread to the CPUs of the node, and makes its later
+ * allocations prefer the node.  This is skipped when the affinity of the
+ * process was restricted at the time of virgl_numa_set_device, the VMM then
+ * places the threads itself.
+ */
+void
+virgl_numa_bind_thread(void);
+
+/* makes the pages of the range that are not allocated yet prefer the node,
+ * only the whole pages within the range are affected */
+void
+virgl_numa_bind_memory(void *ptr, size_t size);
+
+#endif /* VIRGL_NUMA_H */
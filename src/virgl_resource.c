@@ -56,9 +56,9 @@ virgl_resource_destroy_func(void *val)
 int
 virgl_resource_table_init(const struct virgl_resource_pipe_callbacks *callbacks)
 {
-   virgl_resource_table = util_hash_table_create(hash_func_u32,
-                                                 equal_func,
-                                                 virgl_resource_destroy_func);
+   virgl_resource_table = util_hash_table_create_dense(hash_func_u32,
+                                                       equal_func,
+                                                       virgl_resource_destroy_func);
    if (!virgl_resource_table)
       return ENOMEM;
 
@@ -82,6 +82,13 @@ virgl_resource_table_reset(void)
    util_hash_table_clear(virgl_resource_table);
 }
 
+void
+virgl_resource_table_reserve(uint32_t max_res_id)
+{
+   /* a failure is left to virgl_resource_create */
+   util_hash_table_reserve(virgl_resource_table, uintptr_to_pointer(max_res_id));
+}
+
 static struct virgl_resource *
 virgl_resource_create(uint32_t res_id)
 {
@@ -274,3 +281,32 @@ virgl_resource_export_fd(struct virgl_resource *res, int *fd)
 
    return VIRGL_RESOURCE_FD_INVALID;
 }
+
+struct virgl_resource_stats {
+   uint32_t count;
+   uint64_t blob_size;
+};
+
+static enum pipe_error
+virgl_resource_stats_func(UNUSED void *key, void *val, void *data)
+{
+   const struct virgl_resource *res = val;
+   struct virgl_resource_stats *stats = data;
+
+   stats->count++;
+   stats->blob_size += res->map_size;
+
+   return PIPE_OK;
+}
+
+void
+virgl_resource_table_get_stats(uint32_t *count, uint64_t *blob_size)
+{
+   struct virgl_resource_stats stats = { 0 };
+
+   if (virgl_resource_table)
+      util_hash_table_foreach(virgl_resource_table, virgl_resource_stats_func, &stats);
+
+   *count = stats.count;
+   *blob_size = stats.blob_size;
+}
@@ -101,6 +101,9 @@ struct virgl_resource {
 
    uint64_t map_size;
    void *mapped;
+   /* stable mappings can be mapped several times, they are unmapped when
+    * the last user unmaps them */
+   uint32_t map_count;
    bool mapped_from_pipe_resource;
 
    struct virgl_resource_vulkan_info vulkan_info;
@@ -133,6 +136,10 @@ virgl_resource_table_cleanup(void);
 void
 virgl_resource_table_reset(void);
 
+/* grows the table once for the resources up to max_res_id */
+void
+virgl_resource_table_reserve(uint32_t max_res_id);
+
 struct virgl_resource *
 virgl_resource_create_from_pipe(uint32_t res_id,
                                 struct pipe_resource *pres,
@@ -174,4 +181,8 @@ virgl_resource_detach_iov(struct virgl_resource *res);
 enum virgl_resource_fd_type
 virgl_resource_export_fd(struct virgl_resource *res, int *fd);
 
+/* counts the resources and the size of the blob resources */
+void
+virgl_resource_table_get_stats(uint32_t *count, uint64_t *blob_size);
+
 #endif /* VIRGL_RESOURCE_H */
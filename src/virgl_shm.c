@@ -0,0 +1,94 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "virgl_shm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/anon_file.h"
+#include "util/u_debug.h"
+#include "virgl_numa.h"
+
+#define VIRGL_SHM_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_HUGETLB) && defined(MFD_HUGE_2MB)
+static int
+virgl_shm_create_hugetlb(size_t size, const char *name)
+{
+   int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB | MFD_HUGE_2MB);
+   if (fd < 0)
+      return -1;
+
+   /* hugetlb pages come from a reserved pool, allocating them all now is
+    * the only way to know the mappings will not fault with SIGBUS later
+    */
+   if (ftruncate(fd, size) || fallocate(fd, 0, 0, size)) {
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+#else
+static int
+virgl_shm_create_hugetlb(UNUSED size_t size, UNUSED const char *name)
+{
+   return -1;
+}
+#endif
+
+int
+virgl_shm_create(size_t size, const char *name)
+{
+   int fd;
+
+   if (debug_get_bool_option("VIRGL_SHM_HUGEPAGES", false) &&
+       size && !(size % VIRGL_SHM_HUGE_PAGE_SIZE)) {
+      fd = virgl_shm_create_hugetlb(size, name);
+      if (fd >= 0)
+         return fd;
+   }
+
+   fd = os_create_anonymous_file(size, name);
+   if (fd < 0)
+      return -1;
+
+#ifdef __linux__
+   /* a failure only means the pages are allocated on the first access */
+   if (debug_get_bool_option("VIRGL_SHM_PREFAULT", false))
+      fallocate(fd, 0, 0, size);
+#endif
+
+   return fd;
+}
+
+void *
+virgl_shm_map(int fd, size_t size)
+{
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (ptr == MAP_FAILED)
+      return MAP_FAILED;
+
+   /* before the pages are populated below or by the first access */
+   virgl_numa_bind_memory(ptr, size);
+
+   /* advice only, the kernel may not support it */
+#ifdef MADV_HUGEPAGE
+   if (debug_get_bool_option("VIRGL_SHM_HUGEPAGES", false))
+      madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+   if (debug_get_bool_option("VIRGL_SHM_PREFAULT", false))
+      madvise(ptr, size, MADV_POPULATE_WRITE);
+#endif
+
+   return ptr;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_SHM_H
+#define VIRGL_SHM_H
+
+#include <stddef.h>
+
+/*
+ * Shared memory for the rings and the shmem blobs the guest and the host
+ * both access all the time.
+ *
+ * With VIRGL_SHM_HUGEPAGES set, files whose size is a multiple of 2 MiB are
+ * backed by hugetlb pages when the system has some reserved, and the host
+ * mappings of the other files ask for transparent hugepages.  With
+ * VIRGL_SHM_PREFAULT set, the pages are allocated and mapped up front
+ * instead of on the first access.  Both are off by default.
+ */
+
+/* Returns a CLOEXEC file descriptor of the given size that allows sealing,
+ * or -1.
+ */
+int
+virgl_shm_create(size_t size, const char *name);
+
+/* Maps the whole file shared and read-write, returns MAP_FAILED on error */
+void *
+virgl_shm_map(int fd, size_t size);
+
+#endif /* VIRGL_SHM_H */
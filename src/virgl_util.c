@@ -39,6 +39,7 @@
 #include "util/u_string.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -267,12 +268,45 @@ void virgl_prefixed_logv(const char *domain,
    free (prefixed_fmt);
 }
 
+#ifdef ENABLE_TRACING
+static const char *const trace_fence_stage_names[] = {
+   [TRACE_FENCE_CREATE] = "fence-create",
+   [TRACE_FENCE_SUBMIT] = "fence-submit",
+   [TRACE_FENCE_SIGNAL] = "fence-signal",
+   [TRACE_FENCE_RETIRE] = "fence-retire",
+};
+
+/* the ids of the contexts and rings are small, those of the fences grow */
+static inline uint64_t
+trace_fence_flow_id(uint32_t ctx_id, uint32_t ring_idx, uint64_t fence_id)
+{
+   return (((uint64_t)ctx_id << 40) | ((uint64_t)(ring_idx & 0xff) << 32)) ^ fence_id;
+}
+#endif
+
 #if ENABLE_TRACING == TRACE_WITH_PERCETTO
 PERCETTO_CATEGORY_DEFINE(VIRGL_PERCETTO_CATEGORIES)
 
+/* tracks are static, all the counters share this one */
+PERCETTO_TRACK_DEFINE(virgl_counter, PERCETTO_TRACK_COUNTER);
+
 void trace_init(void)
 {
   PERCETTO_INIT(PERCETTO_CLOCK_DONT_CARE);
+  PERCETTO_REGISTER_TRACK(virgl_counter);
+}
+
+void trace_counter(UNUSED const char *name, int64_t value)
+{
+   TRACE_COUNTER(virgl, virgl_counter, value);
+}
+
+/* the tracks are static, the context and the ring are part of the flow */
+void trace_fence(enum trace_fence_stage stage, uint32_t ctx_id, uint32_t ring_idx,
+                 uint64_t fence_id)
+{
+   TRACE_FLOW(virgl, trace_fence_stage_names[stage],
+              trace_fence_flow_id(ctx_id, ring_idx, fence_id));
 }
 #endif
 
@@ -304,6 +338,19 @@ void trace_end(void **dummy)
    (void)dummy;
    vperfetto_min_endTrackEvent_VMM();
 }
+
+/* vperfetto-min has no counter tracks */
+void trace_counter(UNUSED const char *name, UNUSED int64_t value)
+{
+}
+
+/* nor flows, the stages are empty events */
+void trace_fence(enum trace_fence_stage stage, UNUSED uint32_t ctx_id,
+                 UNUSED uint32_t ring_idx, UNUSED uint64_t fence_id)
+{
+   vperfetto_min_beginTrackEvent_VMM(trace_fence_stage_names[stage]);
+   vperfetto_min_endTrackEvent_VMM();
+}
 #endif
 
 #if ENABLE_TRACING == TRACE_WITH_SYSPROF
@@ -336,6 +383,22 @@ void trace_end(void **func_name)
                           NULL);
    free(trace);
 }
+
+void trace_counter(const char *name, int64_t value)
+{
+   sysprof_collector_mark(SYSPROF_CAPTURE_CURRENT_TIME, 0, "virglrenderer", name,
+                          "%" PRId64, value);
+}
+
+void trace_fence(enum trace_fence_stage stage, uint32_t ctx_id, uint32_t ring_idx,
+                 uint64_t fence_id)
+{
+   sysprof_collector_mark(SYSPROF_CAPTURE_CURRENT_TIME, 0, "virglrenderer",
+                          trace_fence_stage_names[stage],
+                          "ctx %u ring %u fence %" PRIu64 " flow %" PRIx64, ctx_id,
+                          ring_idx, fence_id,
+                          trace_fence_flow_id(ctx_id, ring_idx, fence_id));
+}
 #endif
 
 #if ENABLE_TRACING == TRACE_WITH_STDERR
@@ -362,6 +425,22 @@ void trace_end(void **func_name)
       fprintf(stderr, "  ");
    fprintf(stderr, "LEAVE %s\n", (const char *) *func_name);
 }
+
+void trace_counter(const char *name, int64_t value)
+{
+   for (int i = 0; i < nesting_depth; ++i)
+      fprintf(stderr, "  ");
+   fprintf(stderr, "COUNTER %s %" PRId64 "\n", name, value);
+}
+
+void trace_fence(enum trace_fence_stage stage, uint32_t ctx_id, uint32_t ring_idx,
+                 uint64_t fence_id)
+{
+   for (int i = 0; i < nesting_depth; ++i)
+      fprintf(stderr, "  ");
+   fprintf(stderr, "FENCE %s ctx %u ring %u fence %" PRIu64 "\n",
+           trace_fence_stage_names[stage], ctx_id, ring_idx, fence_id);
+}
 #endif
 
 void set_dmabuf_name(int fd, const char *name)
@@ -112,6 +112,21 @@ static inline void PRINTFLIKE(1, 2) virgl_error(const char *fmt, ...)
    va_end(va);
 }
 
+/* The stages of a guest fence, traced as a flow identified by the context,
+ * the ring and the fence so that the latency the guest sees can be split
+ * between decoding, GPU execution and retirement.
+ */
+enum trace_fence_stage {
+   /* the fence reached virglrenderer */
+   TRACE_FENCE_CREATE,
+   /* the commands before the fence were submitted to the GPU */
+   TRACE_FENCE_SUBMIT,
+   /* the fence was seen signaled */
+   TRACE_FENCE_SIGNAL,
+   /* the fence was retired to the caller */
+   TRACE_FENCE_RETIRE,
+};
+
 #ifdef ENABLE_TRACING
 void trace_init(void);
 
@@ -148,6 +163,10 @@ void trace_end(void **scope);
 
 #endif /* ENABLE_TRACING == TRACE_WITH_PERCETTO */
 
+void trace_counter(const char *name, int64_t value);
+void trace_fence(enum trace_fence_stage stage, uint32_t ctx_id, uint32_t ring_idx,
+                 uint64_t fence_id);
+
 #define TRACE_SCOPE(SCOPE) \
    void *trace_dummy __attribute__((cleanup (trace_end), unused)) = \
    trace_begin(SCOPE)
@@ -158,6 +177,9 @@ void trace_end(void **scope);
 #endif /* DEBUG */
 #define TRACE_SCOPE_BEGIN(SCOPE) trace_begin(SCOPE)
 #define TRACE_SCOPE_END(SCOPE_OBJ)  trace_end(&SCOPE_OBJ)
+#define TRACE_COUNTER_SET(NAME, VALUE) trace_counter(NAME, VALUE)
+#define TRACE_FENCE(STAGE, CTX_ID, RING_IDX, FENCE_ID) \
+   trace_fence(STAGE, CTX_ID, RING_IDX, FENCE_ID)
 
 #else /* ENABLE_TRACING */
 #define TRACE_INIT()
@@ -166,6 +188,8 @@ void trace_end(void **scope);
 #define TRACE_SCOPE_SLOW(SCOPE)
 #define TRACE_SCOPE_BEGIN(SCOPE) NULL
 #define TRACE_SCOPE_END(SCOPE_OBJ) (void)SCOPE_OBJ
+#define TRACE_COUNTER_SET(NAME, VALUE)
+#define TRACE_FENCE(STAGE, CTX_ID, RING_IDX, FENCE_ID)
 #endif /* ENABLE_TRACING */
 
 /* Utility to name a dmabuf using DMA_BUF_SET_NAME_B. */
@@ -43,6 +43,7 @@
 #include "vkr_allocator.h"
 #include "drm_renderer.h"
 #include "proxy/proxy_renderer.h"
+#include "vrend/vrend_program_cache.h"
 #include "vrend/vrend_renderer.h"
 #include "vrend/vrend_winsys.h"
 
@@ -53,7 +54,9 @@
 #include "virglrenderer.h"
 #include "virtgpu_drm.h"
 
+#include "virgl_command_stats.h"
 #include "virgl_context.h"
+#include "virgl_flight_recorder.h"
 #include "virgl_fence.h"
 #include "virgl_resource.h"
 #include "virgl_util.h"
@@ -72,6 +75,14 @@ struct global_state {
    bool external_winsys_initialized;
    bool drm_initialized;
    bool fence_initialized;
+
+   /* reset by virgl_renderer_reset_stats */
+   struct {
+      uint64_t submit_cmd_count;
+      uint64_t submit_cmd_size;
+      uint64_t transfer_count;
+      uint64_t fence_count;
+   } stats;
 };
 
 static struct global_state state;
@@ -153,6 +164,13 @@ void *virgl_renderer_resource_get_priv(uint32_t res_handle)
    return res->private_data;
 }
 
+/* the submissions queued by vrend must run before anything else */
+static void virgl_renderer_drain_submits(void)
+{
+   if (state.vrend_initialized)
+      vrend_renderer_drain_submits();
+}
+
 static bool detach_resource(struct virgl_context *ctx, void *data)
 {
    struct virgl_resource *res = data;
@@ -201,16 +219,35 @@ static void per_context_fence_retire(struct virgl_context *ctx,
                                      uint32_t ring_idx,
                                      uint64_t fence_id)
 {
+   TRACE_FENCE(TRACE_FENCE_RETIRE, ctx->ctx_id, ring_idx, fence_id);
    state.cbs->write_context_fence(state.cookie,
                                   ctx->ctx_id,
                                   ring_idx,
                                   fence_id);
 }
 
+/* whether the fences of the context are retired by virgl_renderer_poll */
+static bool virgl_renderer_context_is_polled(const struct virgl_context *ctx)
+{
+   /* vrend contexts are polled explicitly by the caller */
+   return ctx->capset_id != VIRTGPU_DRM_CAPSET_VIRGL &&
+          ctx->capset_id != VIRTGPU_DRM_CAPSET_VIRGL2 &&
+          !(state.flags & VIRGL_RENDERER_ASYNC_FENCE_CB);
+}
+
 int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
                                              uint32_t ctx_flags,
                                              uint32_t nlen,
                                              const char *name)
+{
+   return virgl_renderer_context_create_with_sched(ctx_id, ctx_flags, nlen, name, NULL);
+}
+
+int virgl_renderer_context_create_with_sched(uint32_t ctx_id,
+                                             uint32_t ctx_flags,
+                                             uint32_t nlen,
+                                             const char *name,
+                                             const struct virgl_renderer_context_sched *sched)
 {
    uint32_t capset_id = ctx_flags & VIRGL_RENDERER_CONTEXT_FLAG_CAPSET_ID_MASK;
    struct virgl_context *ctx;
@@ -241,7 +278,7 @@ int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
    case VIRTGPU_DRM_CAPSET_VENUS:
       if (!state.proxy_initialized)
          return EINVAL;
-      ctx = proxy_context_create(ctx_id, ctx_flags, nlen, name);
+      ctx = proxy_context_create(ctx_id, ctx_flags, nlen, name, sched);
       break;
    case VIRTGPU_DRM_CAPSET_DRM:
       if (!state.drm_initialized)
@@ -260,6 +297,7 @@ int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
 
    ctx->ctx_id = ctx_id;
    ctx->in_fence_fd = -1;
+   ctx->fencing_fd = -1;
    ctx->capset_id = capset_id;
    ctx->fence_retire = per_context_fence_retire;
 
@@ -269,6 +307,12 @@ int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
       return ret;
    }
 
+   if (virgl_renderer_context_is_polled(ctx)) {
+      const int fencing_fd = ctx->get_fencing_fd(ctx);
+      if (fencing_fd >= 0)
+         virgl_context_set_fencing_fd(ctx, fencing_fd);
+   }
+
    return 0;
 }
 
@@ -283,6 +327,7 @@ int virgl_renderer_context_create(uint32_t handle, uint32_t nlen, const char *na
 void virgl_renderer_context_destroy(uint32_t handle)
 {
    TRACE_FUNC();
+   virgl_renderer_drain_submits();
    virgl_context_remove(handle);
 }
 
@@ -301,6 +346,9 @@ int virgl_renderer_submit_cmd(void *buffer,
    if (((uintptr_t)buffer & 3) != 0)
       return EFAULT;
 
+   state.stats.submit_cmd_count++;
+   state.stats.submit_cmd_size += (uint32_t)ndw * sizeof(uint32_t);
+
    return ctx->submit_cmd(ctx, buffer, (uint32_t)ndw * sizeof(uint32_t));
 }
 
@@ -331,6 +379,9 @@ int virgl_renderer_transfer_write_iov(uint32_t handle,
    transfer_info.iovec_cnt = iovec_cnt;
    transfer_info.synchronized = false;
 
+   state.stats.transfer_count++;
+   virgl_renderer_drain_submits();
+
    if (ctx_id) {
       struct virgl_context *ctx = virgl_context_lookup(ctx_id);
       if (!ctx)
@@ -370,6 +421,9 @@ int virgl_renderer_transfer_read_iov(uint32_t handle, uint32_t ctx_id,
    transfer_info.iovec_cnt = iovec_cnt;
    transfer_info.synchronized = false;
 
+   state.stats.transfer_count++;
+   virgl_renderer_drain_submits();
+
    if (ctx_id) {
       struct virgl_context *ctx = virgl_context_lookup(ctx_id);
       if (!ctx)
@@ -390,6 +444,8 @@ int virgl_renderer_resource_attach_iov(int res_handle, struct iovec *iov,
                                        int num_iovs)
 {
    TRACE_FUNC();
+   /* queued transfers still use the current backing */
+   virgl_renderer_drain_submits();
    struct virgl_resource *res = virgl_resource_lookup(res_handle);
    if (!res)
       return EINVAL;
@@ -400,6 +456,8 @@ int virgl_renderer_resource_attach_iov(int res_handle, struct iovec *iov,
 void virgl_renderer_resource_detach_iov(int res_handle, struct iovec **iov_p, int *num_iovs_p)
 {
    TRACE_FUNC();
+   /* queued transfers still use the current backing */
+   virgl_renderer_drain_submits();
    struct virgl_resource *res = virgl_resource_lookup(res_handle);
    if (!res)
       return;
@@ -416,8 +474,12 @@ int virgl_renderer_create_fence(int client_fence_id, UNUSED uint32_t ctx_id)
 {
    TRACE_FUNC();
    const uint32_t fence_id = (uint32_t)client_fence_id;
-   if (state.vrend_initialized)
+   TRACE_FENCE(TRACE_FENCE_CREATE, 0, 0, fence_id);
+   if (state.vrend_initialized) {
+      state.stats.fence_count++;
+      vrend_renderer_drain_submits();
       return vrend_renderer_create_ctx0_fence(fence_id);
+   }
    return EINVAL;
 }
 
@@ -432,6 +494,8 @@ int virgl_renderer_context_create_fence(uint32_t ctx_id,
       return -EINVAL;
 
    assert(state.cbs->version >= 3 && state.cbs->write_context_fence);
+   state.stats.fence_count++;
+   TRACE_FENCE(TRACE_FENCE_CREATE, ctx_id, ring_idx, fence_id);
    return ctx->submit_fence(ctx, flags, ring_idx, fence_id);
 }
 
@@ -456,8 +520,21 @@ int virgl_renderer_context_get_poll_fd(uint32_t ctx_id)
 
 void virgl_renderer_force_ctx_0(void)
 {
-   if (state.vrend_initialized)
+   if (state.vrend_initialized) {
+      vrend_renderer_drain_submits();
       vrend_renderer_force_ctx_0();
+   }
+}
+
+int virgl_renderer_d3d11_signal_fence(void **d3d11_fence, uint64_t *value)
+{
+   TRACE_FUNC();
+
+   if (!state.vrend_initialized)
+      return ENOTSUP;
+
+   vrend_renderer_drain_submits();
+   return vrend_renderer_d3d11_signal_fence(d3d11_fence, value);
 }
 
 void virgl_renderer_ctx_attach_resource(int ctx_id, int res_handle)
@@ -591,6 +668,7 @@ void virgl_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int nu
    if (!res || !res->pipe_resource)
       return;
 
+   vrend_renderer_drain_submits();
    vrend_renderer_get_rect(res->pipe_resource, iov, num_iovs, offset, x, y,
                            width, height);
 }
@@ -601,6 +679,7 @@ static void ctx0_fence_retire(uint64_t fence_id, UNUSED void *retire_data)
    // ctx0 fence_id is created from uint32_t but stored internally as uint64_t,
    // so casting back to uint32_t doesn't result in data loss.
    assert((fence_id >> 32) == 0);
+   TRACE_FENCE(TRACE_FENCE_RETIRE, 0, 0, fence_id);
    state.cbs->write_fence(state.cookie, (uint32_t)fence_id);
 }
 
@@ -727,21 +806,29 @@ void *virgl_renderer_get_cursor_data(uint32_t resource_id, uint32_t *width, uint
    if (!res || !res->pipe_resource)
       return NULL;
 
-   vrend_renderer_force_ctx_0();
+   vrend_renderer_drain_submits();
    return vrend_renderer_get_cursor_contents(res->pipe_resource,
                                              width,
                                              height);
 }
 
+int virgl_renderer_read_cursor_data(uint32_t resource_id, void *data, uint32_t size,
+                                    uint32_t *width, uint32_t *height)
+{
+   struct virgl_resource *res = virgl_resource_lookup(resource_id);
+   if (!res || !res->pipe_resource || !data)
+      return EINVAL;
+
+   vrend_renderer_drain_submits();
+   return vrend_renderer_read_cursor_contents(res->pipe_resource, data, size,
+                                              width, height);
+}
+
 static bool
 virgl_context_foreach_retire_fences(struct virgl_context *ctx,
                                     UNUSED void* data)
 {
-   /* vrend contexts are polled explicitly by the caller */
-   if (ctx->capset_id != VIRTGPU_DRM_CAPSET_VIRGL &&
-       ctx->capset_id != VIRTGPU_DRM_CAPSET_VIRGL2 &&
-       !(state.flags & VIRGL_RENDERER_ASYNC_FENCE_CB))
-   {
+   if (virgl_renderer_context_is_polled(ctx)) {
       assert(ctx->retire_fences);
       ctx->retire_fences(ctx);
    }
@@ -751,14 +838,26 @@ virgl_context_foreach_retire_fences(struct virgl_context *ctx,
 void virgl_renderer_poll(void)
 {
    TRACE_FUNC();
-   if (state.vrend_initialized)
+   if (state.vrend_initialized) {
+      vrend_renderer_drain_submits();
       vrend_renderer_poll();
+   }
 
    struct virgl_context_foreach_args args;
    args.callback = virgl_context_foreach_retire_fences;
    virgl_context_foreach(&args);
 }
 
+void virgl_renderer_poll_fds(const int *fds, uint32_t count)
+{
+   TRACE_FUNC();
+   for (uint32_t i = 0; i < count; i++) {
+      struct virgl_context *ctx = virgl_context_lookup_fencing_fd(fds[i]);
+      if (ctx)
+         ctx->retire_fences(ctx);
+   }
+}
+
 void virgl_renderer_cleanup(UNUSED void *cookie)
 {
    TRACE_FUNC();
@@ -789,6 +888,7 @@ void virgl_renderer_cleanup(UNUSED void *cookie)
    /* vkr_allocator_init is called on-demand upon the first map */
    vkr_allocator_fini();
 
+   virgl_command_stats_enabled = false;
    memset(&state, 0, sizeof(state));
 }
 
@@ -822,6 +922,8 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       state.flags = flags;
       state.cbs = cbs;
       state.client_initialized = true;
+
+      virgl_command_stats_enabled = flags & VIRGL_RENDERER_COMMAND_STATS;
    }
 
    if (!state.resource_initialized) {
@@ -1133,15 +1235,11 @@ int virgl_renderer_execute(void *execute_args, uint32_t execute_size)
    }
 }
 
-int virgl_renderer_resource_create_blob(const struct virgl_renderer_resource_create_blob_args *args)
+static int virgl_renderer_validate_blob_args(const struct virgl_renderer_resource_create_blob_args *args,
+                                             bool *out_has_host_storage)
 {
-   TRACE_FUNC();
-   struct virgl_resource *res;
-   struct virgl_context *ctx;
-   struct virgl_context_blob blob;
    bool has_host_storage;
    bool has_guest_storage;
-   int ret;
 
    switch (args->blob_mem) {
    case VIRGL_RENDERER_BLOB_MEM_GUEST:
@@ -1179,6 +1277,58 @@ int virgl_renderer_resource_create_blob(const struct virgl_renderer_resource_cre
          return -EINVAL;
    }
 
+   *out_has_host_storage = has_host_storage;
+   return 0;
+}
+
+static int virgl_renderer_create_blob_resource(const struct virgl_renderer_resource_create_blob_args *args,
+                                               struct virgl_context *ctx,
+                                               struct virgl_context_blob *blob)
+{
+   struct virgl_resource *res;
+
+   if (blob->type == VIRGL_RESOURCE_OPAQUE_HANDLE) {
+      assert(!(args->blob_flags & VIRGL_RENDERER_BLOB_FLAG_USE_SHAREABLE));
+      res = virgl_resource_create_from_opaque_handle(ctx, args->res_handle, blob->u.opaque_handle);
+      if (!res)
+         return -ENOMEM;
+   } else if (blob->type != VIRGL_RESOURCE_FD_INVALID) {
+      res = virgl_resource_create_from_fd(args->res_handle,
+                                          blob->type,
+                                          blob->u.fd,
+                                          args->iovecs,
+                                          args->num_iovs,
+                                          &blob->vulkan_info);
+      if (!res)
+         return -ENOMEM;
+   } else {
+      res = virgl_resource_create_from_pipe(args->res_handle,
+                                            blob->u.pipe_resource,
+                                            args->iovecs,
+                                            args->num_iovs);
+      if (!res)
+         return -ENOMEM;
+   }
+
+   res->map_info = blob->map_info;
+   res->map_size = args->size;
+
+   return 0;
+}
+
+int virgl_renderer_resource_create_blob(const struct virgl_renderer_resource_create_blob_args *args)
+{
+   TRACE_FUNC();
+   struct virgl_resource *res;
+   struct virgl_context *ctx;
+   struct virgl_context_blob blob;
+   bool has_host_storage;
+   int ret;
+
+   ret = virgl_renderer_validate_blob_args(args, &has_host_storage);
+   if (ret)
+      return ret;
+
    if (!has_host_storage) {
       res = virgl_resource_create_from_iov(args->res_handle,
                                            args->iovecs,
@@ -1198,33 +1348,111 @@ int virgl_renderer_resource_create_blob(const struct virgl_renderer_resource_cre
    if (ret)
       return ret;
 
-   if (blob.type == VIRGL_RESOURCE_OPAQUE_HANDLE) {
-      assert(!(args->blob_flags & VIRGL_RENDERER_BLOB_FLAG_USE_SHAREABLE));
-      res = virgl_resource_create_from_opaque_handle(ctx, args->res_handle, blob.u.opaque_handle);
-      if (!res)
-         return -ENOMEM;
-   } else if (blob.type != VIRGL_RESOURCE_FD_INVALID) {
-      res = virgl_resource_create_from_fd(args->res_handle,
-                                          blob.type,
-                                          blob.u.fd,
-                                          args->iovecs,
-                                          args->num_iovs,
-                                          &blob.vulkan_info);
-      if (!res)
-         return -ENOMEM;
-   } else {
-      res = virgl_resource_create_from_pipe(args->res_handle,
-                                            blob.u.pipe_resource,
-                                            args->iovecs,
-                                            args->num_iovs);
-      if (!res)
-         return -ENOMEM;
+   return virgl_renderer_create_blob_resource(args, ctx, &blob);
+}
+
+#define CREATE_BLOBS_MAX_BATCH 16
+
+/* Returns the number of consecutive host blobs of the context of the first
+ * one that can be gotten at once.
+ */
+static uint32_t virgl_renderer_get_blob_batch_count(const struct virgl_renderer_resource_create_blob_args *args,
+                                                    uint32_t count,
+                                                    struct virgl_context *ctx)
+{
+   if (!ctx || !ctx->get_blobs)
+      return 0;
+
+   uint32_t batch_count = 0;
+   while (batch_count < count && batch_count < CREATE_BLOBS_MAX_BATCH) {
+      const struct virgl_renderer_resource_create_blob_args *entry = &args[batch_count];
+      bool has_host_storage;
+      if (entry->ctx_id != ctx->ctx_id ||
+          virgl_renderer_validate_blob_args(entry, &has_host_storage) ||
+          !has_host_storage)
+         break;
+
+      /* the ids must be unique within the batch too */
+      uint32_t i;
+      for (i = 0; i < batch_count; i++) {
+         if (args[i].res_handle == entry->res_handle)
+            break;
+      }
+      if (i < batch_count)
+         break;
+
+      batch_count++;
    }
 
-   res->map_info = blob.map_info;
-   res->map_size = args->size;
+   return batch_count;
+}
 
-   return 0;
+int virgl_renderer_resource_create_blobs(const struct virgl_renderer_resource_create_blob_args *args,
+                                         uint32_t count,
+                                         uint32_t *created)
+{
+   TRACE_FUNC();
+   struct virgl_context_blob_request reqs[CREATE_BLOBS_MAX_BATCH];
+   struct virgl_context_blob blobs[CREATE_BLOBS_MAX_BATCH];
+   uint32_t done = 0;
+   int ret = 0;
+
+   uint32_t max_res_handle = 0;
+   for (uint32_t i = 0; i < count; i++)
+      max_res_handle = MAX2(max_res_handle, args[i].res_handle);
+   virgl_resource_table_reserve(max_res_handle);
+
+   while (done < count && !ret) {
+      const struct virgl_renderer_resource_create_blob_args *batch_args = &args[done];
+      struct virgl_context *ctx = virgl_context_lookup(batch_args->ctx_id);
+      const uint32_t batch_count =
+         virgl_renderer_get_blob_batch_count(batch_args, count - done, ctx);
+
+      if (batch_count < 2) {
+         ret = virgl_renderer_resource_create_blob(batch_args);
+         if (ret)
+            break;
+
+         virgl_renderer_ctx_attach_resource(batch_args->ctx_id, batch_args->res_handle);
+         done++;
+         continue;
+      }
+
+      for (uint32_t i = 0; i < batch_count; i++) {
+         reqs[i] = (struct virgl_context_blob_request){
+            .res_id = batch_args[i].res_handle,
+            .blob_id = batch_args[i].blob_id,
+            .blob_size = batch_args[i].size,
+            .blob_flags = batch_args[i].blob_flags,
+         };
+      }
+
+      const uint32_t blob_count = ctx->get_blobs(ctx, reqs, batch_count, blobs);
+      for (uint32_t i = 0; i < blob_count; i++) {
+         if (ret) {
+            /* the resources take ownership of the fds */
+            if (blobs[i].type != VIRGL_RESOURCE_FD_INVALID &&
+                blobs[i].type != VIRGL_RESOURCE_OPAQUE_HANDLE)
+               close(blobs[i].u.fd);
+            continue;
+         }
+
+         ret = virgl_renderer_create_blob_resource(&batch_args[i], ctx, &blobs[i]);
+         if (ret)
+            continue;
+
+         ctx->attach_resource(ctx, virgl_resource_lookup(batch_args[i].res_handle));
+         done++;
+      }
+
+      if (!ret && blob_count < batch_count)
+         ret = -EINVAL;
+   }
+
+   if (created)
+      *created = done;
+
+   return ret;
 }
 
 int virgl_renderer_resource_map(uint32_t res_handle, void **out_map, uint64_t *out_size)
@@ -1235,9 +1463,20 @@ int virgl_renderer_resource_map(uint32_t res_handle, void **out_map, uint64_t *o
    uint64_t map_size = 0;
    struct virgl_context *ctx = NULL;
    struct virgl_resource *res = virgl_resource_lookup(res_handle);
-   if (!res || res->mapped)
+   if (!res)
       return -EINVAL;
 
+   if (res->mapped) {
+      if (!res->mapped_from_pipe_resource ||
+          !vrend_renderer_resource_map_is_stable(res->pipe_resource))
+         return -EINVAL;
+
+      res->map_count++;
+      *out_map = res->mapped;
+      *out_size = res->map_size;
+      return 0;
+   }
+
    if (res->pipe_resource) {
       ret = vrend_renderer_resource_map(res->pipe_resource, &map, &map_size);
       if (!ret) {
@@ -1288,6 +1527,7 @@ int virgl_renderer_resource_map(uint32_t res_handle, void **out_map, uint64_t *o
       return -EINVAL;
 
    res->mapped = map;
+   res->map_count = 1;
    *out_map = map;
    *out_size = map_size;
    return ret;
@@ -1295,17 +1535,26 @@ int virgl_renderer_resource_map(uint32_t res_handle, void **out_map, uint64_t *o
 
 int virgl_renderer_resource_map_fixed(uint32_t res_handle, void *addr)
 {
+   TRACE_FUNC();
    void *map = NULL;
    struct virgl_context *ctx = NULL;
    struct virgl_resource *res = virgl_resource_lookup(res_handle);
+   if (!res)
+      return -EINVAL;
+
    enum virgl_resource_fd_type fd_type = res->fd_type;
    enum virgl_resource_fd_type export_fd_type = res->fd_type;
    int fd = res->fd;
 
-   if (!res)
-      return -EINVAL;
+   if (res->pipe_resource) {
+      int ret = vrend_renderer_resource_map_fixed(res->pipe_resource, addr);
+      if (ret != -EOPNOTSUPP)
+         return ret;
 
-   if (fd_type == VIRGL_RESOURCE_OPAQUE_HANDLE) {
+      /* resources backed by a dmabuf can still be mapped through it */
+      fd_type = VIRGL_RESOURCE_FD_INVALID;
+      export_fd_type = virgl_resource_export_fd(res, &fd);
+   } else if (fd_type == VIRGL_RESOURCE_OPAQUE_HANDLE) {
       ctx = virgl_context_lookup(res->opaque_handle_context_id);
       if (!ctx)
          return -EINVAL;
@@ -1327,6 +1576,11 @@ int virgl_renderer_resource_map_fixed(uint32_t res_handle, void *addr)
                                  MAP_FIXED | MAP_SHARED);
          break;
       case VIRGL_RESOURCE_FD_OPAQUE:
+         if (vkr_allocator_resource_map_fixed(res, addr))
+            map = NULL;
+         else
+            map = addr;
+         break;
       case VIRGL_RESOURCE_FD_INVALID:
          /* Avoid a default case so that -Wswitch will tell us at compile time
           * if a new virgl resource type is added without being handled here.
@@ -1334,7 +1588,7 @@ int virgl_renderer_resource_map_fixed(uint32_t res_handle, void *addr)
       break;
    }
 
-   if (export_fd_type != fd_type)
+   if (export_fd_type != fd_type && export_fd_type != VIRGL_RESOURCE_FD_INVALID)
       close(fd);
 
    if (!map)
@@ -1354,16 +1608,28 @@ int virgl_renderer_resource_unmap(uint32_t res_handle)
    if (!res || !res->mapped)
       return -EINVAL;
 
+   if (--res->map_count)
+      return 0;
+
    if (res->mapped_from_pipe_resource) {
       assert(res->pipe_resource);
       ret = vrend_renderer_resource_unmap(res->pipe_resource);
    } else {
+      struct virgl_context *ctx = NULL;
+      if (res->fd_type == VIRGL_RESOURCE_OPAQUE_HANDLE)
+         ctx = virgl_context_lookup(res->opaque_handle_context_id);
+
       switch (res->fd_type) {
       case VIRGL_RESOURCE_FD_DMABUF:
       case VIRGL_RESOURCE_FD_SHM:
-      case VIRGL_RESOURCE_OPAQUE_HANDLE:
          ret = munmap(res->mapped, res->map_size);
          break;
+      case VIRGL_RESOURCE_OPAQUE_HANDLE:
+         if (ctx && ctx->resource_unmap)
+            ret = ctx->resource_unmap(ctx, res, res->mapped);
+         else
+            ret = munmap(res->mapped, res->map_size);
+         break;
       case VIRGL_RESOURCE_FD_OPAQUE:
          ret = vkr_allocator_resource_unmap(res);
          break;
@@ -1381,6 +1647,18 @@ int virgl_renderer_resource_unmap(uint32_t res_handle)
    return ret;
 }
 
+int virgl_renderer_resource_is_map_stable(uint32_t res_handle, bool *stable)
+{
+   TRACE_FUNC();
+   struct virgl_resource *res = virgl_resource_lookup(res_handle);
+   if (!res)
+      return -EINVAL;
+
+   *stable = res->pipe_resource &&
+             vrend_renderer_resource_map_is_stable(res->pipe_resource);
+   return 0;
+}
+
 int virgl_renderer_resource_get_map_info(uint32_t res_handle, uint32_t *map_info)
 {
    TRACE_FUNC();
@@ -1533,13 +1811,24 @@ int virgl_renderer_get_fence_fd(uint64_t fence_id)
    return virgl_fence_get_fd(fence_id);
 }
 
-static int virgl_renderer_context_attach_in_fence(struct virgl_context *ctx,
-                                                  uint64_t fence_id)
+static int virgl_renderer_context_attach_in_fences(struct virgl_context *ctx,
+                                                   uint64_t *fence_ids,
+                                                   uint32_t num_fences)
 {
-   int ret;
+   TRACE_FUNC();
+
+   if (!ctx->supports_fence_sharing)
+      return -EINVAL;
+
+   int *fds = malloc(sizeof(*fds) * num_fences);
+   if (!fds)
+      return -ENOMEM;
 
    /*
-    * FD will be -1 in two cases:
+    * Only the latest fence of each timeline is merged, as it signals after
+    * the others of its timeline.
+    *
+    * Fences are skipped in two cases:
     *
     *    1. Fence was signalled and retired.
     *    2. Fence ID is invalid. Virglrenderer doesn't take responsibility
@@ -1547,34 +1836,23 @@ static int virgl_renderer_context_attach_in_fence(struct virgl_context *ctx,
     *       IDs are always valid. It's caller's responsibility to validate
     *       fence IDs.
     */
-   int fd = virgl_fence_get_fd(fence_id);
-   if (fd < 0)
-      return 0;
-
-   ret = attach_in_fence_fd(ctx, fd);
-   if (ret)
-      virgl_error("%s: sync_accumulate failed for fence_id=%" PRIu64 " err=%d\n",
-                  __func__, fence_id, ret);
-
-   return ret;
-}
+   const uint32_t fd_count = virgl_fence_get_latest_fds(fence_ids, num_fences, fds);
 
-static int virgl_renderer_context_attach_in_fences(struct virgl_context *ctx,
-                                                   uint64_t *fence_ids,
-                                                   uint32_t num_fences)
-{
-   TRACE_FUNC();
-
-   if (!ctx->supports_fence_sharing)
-      return -EINVAL;
+   int ret = 0;
+   for (uint32_t i = 0; i < fd_count; i++) {
+      if (ret) {
+         close(fds[i]);
+         continue;
+      }
 
-   for (uint32_t i = 0; i < num_fences; i++) {
-      int ret = virgl_renderer_context_attach_in_fence(ctx, fence_ids[i]);
+      ret = attach_in_fence_fd(ctx, fds[i]);
       if (ret)
-         return ret;
+         virgl_error("%s: sync_accumulate failed err=%d\n", __func__, ret);
    }
 
-   return 0;
+   free(fds);
+
+   return ret;
 }
 
 int virgl_renderer_submit_cmd2(void *buffer,
@@ -1600,9 +1878,311 @@ int virgl_renderer_submit_cmd2(void *buffer,
          return err;
    }
 
+   state.stats.submit_cmd_count++;
+   state.stats.submit_cmd_size += (uint32_t)ndw * sizeof(uint32_t);
+
    return ctx->submit_cmd(ctx, buffer, (uint32_t)ndw * sizeof(uint32_t));
 }
 
+int virgl_renderer_submit_cmd_with_fence(void *buffer,
+                                         int ctx_id,
+                                         int ndw,
+                                         uint64_t *in_fence_ids,
+                                         uint32_t num_in_fences,
+                                         uint32_t fence_flags,
+                                         uint32_t ring_idx,
+                                         uint64_t fence_id)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   if (((uintptr_t)buffer & 3) != 0)
+      return EFAULT;
+
+   if (ndw < 0 || (unsigned)ndw > UINT32_MAX / sizeof(uint32_t))
+      return EINVAL;
+
+   if (num_in_fences) {
+      int err = virgl_renderer_context_attach_in_fences(ctx, in_fence_ids, num_in_fences);
+      if (err)
+         return err;
+   }
+
+   assert(state.cbs->version >= 3 && state.cbs->write_context_fence);
+
+   const size_t size = (uint32_t)ndw * sizeof(uint32_t);
+
+   state.stats.submit_cmd_count++;
+   state.stats.submit_cmd_size += size;
+   state.stats.fence_count++;
+   TRACE_FENCE(TRACE_FENCE_CREATE, ctx->ctx_id, ring_idx, fence_id);
+
+   if (ctx->submit_cmd_with_fence)
+      return ctx->submit_cmd_with_fence(ctx, buffer, size, fence_flags, ring_idx,
+                                        fence_id);
+
+   int ret = ctx->submit_cmd(ctx, buffer, size);
+   if (ret)
+      return ret;
+
+   return ctx->submit_fence(ctx, fence_flags, ring_idx, fence_id);
+}
+
+#define SUBMIT_CMDV_MAX_BATCH 16
+
+static int virgl_renderer_submit_batch(struct virgl_context *ctx,
+                                       const struct virgl_context_submit *submits,
+                                       uint32_t count)
+{
+   if (ctx->submit_batch)
+      return ctx->submit_batch(ctx, submits, count);
+
+   for (uint32_t i = 0; i < count; i++) {
+      const struct virgl_context_submit *submit = &submits[i];
+      int ret;
+
+      if (!submit->fence) {
+         ret = ctx->submit_cmd(ctx, submit->buffer, submit->size);
+      } else if (ctx->submit_cmd_with_fence) {
+         ret = ctx->submit_cmd_with_fence(ctx, submit->buffer, submit->size,
+                                          submit->fence_flags, submit->ring_idx,
+                                          submit->fence_id);
+      } else {
+         ret = ctx->submit_cmd(ctx, submit->buffer, submit->size);
+         if (!ret)
+            ret = ctx->submit_fence(ctx, submit->fence_flags, submit->ring_idx,
+                                    submit->fence_id);
+      }
+
+      if (ret)
+         return ret;
+   }
+
+   return 0;
+}
+
+int virgl_renderer_submit_cmdv(const struct virgl_renderer_submit_cmd_entry *entries,
+                               uint32_t count,
+                               uint32_t *submitted)
+{
+   TRACE_FUNC();
+   struct virgl_context_submit submits[SUBMIT_CMDV_MAX_BATCH];
+   uint32_t done = 0;
+   int ret = 0;
+
+   while (done < count) {
+      const struct virgl_renderer_submit_cmd_entry *first = &entries[done];
+      struct virgl_context *ctx = virgl_context_lookup(first->ctx_id);
+      if (!ctx) {
+         ret = EINVAL;
+         break;
+      }
+
+      /* Batch the following entries of the context.  Only the first entry
+       * may wait for in-fences, as they could be signalled by the entries
+       * before them.
+       */
+      uint32_t batch_count = 0;
+      while (done + batch_count < count && batch_count < SUBMIT_CMDV_MAX_BATCH) {
+         const struct virgl_renderer_submit_cmd_entry *entry = &entries[done + batch_count];
+         if (batch_count &&
+             (entry->ctx_id != first->ctx_id || entry->num_in_fences))
+            break;
+
+         if (((uintptr_t)entry->buffer & 3) != 0) {
+            ret = EFAULT;
+            break;
+         }
+
+         if (entry->ndw < 0 || (unsigned)entry->ndw > UINT32_MAX / sizeof(uint32_t)) {
+            ret = EINVAL;
+            break;
+         }
+
+         const bool fence = entry->flags & VIRGL_RENDERER_SUBMIT_CMD_FLAG_FENCE;
+         if (fence)
+            assert(state.cbs->version >= 3 && state.cbs->write_context_fence);
+
+         submits[batch_count++] = (struct virgl_context_submit){
+            .buffer = entry->buffer,
+            .size = (uint32_t)entry->ndw * sizeof(uint32_t),
+            .fence = fence,
+            .fence_flags = entry->fence_flags,
+            .ring_idx = entry->ring_idx,
+            .fence_id = entry->fence_id,
+         };
+      }
+
+      /* submit the valid entries before an invalid one */
+      if (!batch_count)
+         break;
+
+      if (first->num_in_fences) {
+         int err = virgl_renderer_context_attach_in_fences(ctx, first->in_fence_ids,
+                                                           first->num_in_fences);
+         if (err) {
+            ret = err;
+            break;
+         }
+      }
+
+      for (uint32_t i = 0; i < batch_count; i++) {
+         state.stats.submit_cmd_count++;
+         state.stats.submit_cmd_size += submits[i].size;
+         if (submits[i].fence) {
+            state.stats.fence_count++;
+            TRACE_FENCE(TRACE_FENCE_CREATE, ctx->ctx_id, submits[i].ring_idx,
+                        submits[i].fence_id);
+         }
+      }
+
+      int err = virgl_renderer_submit_batch(ctx, submits, batch_count);
+      if (err) {
+         ret = err;
+         break;
+      }
+
+      done += batch_count;
+      if (ret)
+         break;
+   }
+
+   if (submitted)
+      *submitted = done;
+
+   return ret;
+}
+
+int virgl_renderer_context_set_weight(uint32_t ctx_id, uint32_t weight)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx || !weight)
+      return EINVAL;
+
+   if (!ctx->set_weight)
+      return ENOTSUP;
+
+   return ctx->set_weight(ctx, weight);
+}
+
+int virgl_renderer_context_get_command_stats(uint32_t ctx_id,
+                                             struct virgl_renderer_command_stats *stats,
+                                             uint32_t *count)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx || !count)
+      return EINVAL;
+
+   if (!ctx->command_stats)
+      return ENOTSUP;
+
+   return virgl_command_stats_get(ctx->command_stats, stats, count);
+}
+
+static bool
+virgl_renderer_get_context_stats(struct virgl_context *ctx, void *data)
+{
+   struct virgl_renderer_stats *stats = data;
+
+   stats->context_count++;
+   if (ctx->get_stats)
+      ctx->get_stats(ctx, stats);
+
+   return true;
+}
+
+/* the size of the fields of a version, which the caller struct may end at */
+static size_t
+virgl_renderer_stats_size(uint32_t version)
+{
+   switch (version) {
+   case 1:
+      return offsetof(struct virgl_renderer_stats, gpu_batch_time);
+   case 2:
+      return offsetof(struct virgl_renderer_stats, sparse_committed_size);
+   default:
+      return sizeof(struct virgl_renderer_stats);
+   }
+}
+
+int virgl_renderer_get_stats(struct virgl_renderer_stats *stats)
+{
+   TRACE_FUNC();
+   if (!stats || !stats->version)
+      return EINVAL;
+
+   const uint32_t version = MIN2(stats->version, VIRGL_RENDERER_STATS_VERSION);
+   struct virgl_renderer_stats all = { .version = version };
+
+   virgl_resource_table_get_stats(&all.resource_count, &all.blob_size);
+
+   if (state.context_initialized) {
+      struct virgl_context_foreach_args args = {
+         .callback = virgl_renderer_get_context_stats,
+         .data = &all,
+      };
+      virgl_context_foreach(&args);
+   }
+
+   all.submit_cmd_count = state.stats.submit_cmd_count;
+   all.submit_cmd_size = state.stats.submit_cmd_size;
+   all.transfer_count = state.stats.transfer_count;
+   all.fence_count = state.stats.fence_count;
+   vrend_program_cache_get_stats(&all.program_cache_hit_count,
+                                 &all.program_cache_miss_count);
+   vrend_renderer_get_gpu_time_stats(&all.gpu_batch_time, &all.gpu_blit_time,
+                                     &all.gpu_clear_time);
+
+   memcpy(stats, &all, virgl_renderer_stats_size(version));
+
+   return 0;
+}
+
+void virgl_renderer_reset_stats(void)
+{
+   TRACE_FUNC();
+   memset(&state.stats, 0, sizeof(state.stats));
+   vrend_program_cache_reset_stats();
+   vrend_renderer_reset_gpu_time_stats();
+}
+
+int virgl_renderer_context_dump_commands(uint32_t ctx_id)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   if (!ctx->flight_recorder)
+      return ENOTSUP;
+
+   virgl_flight_recorder_dump(ctx->flight_recorder, ctx->ctx_id);
+   return 0;
+}
+
+static bool
+virgl_renderer_dump_context_commands(struct virgl_context *ctx, UNUSED void *data)
+{
+   virgl_flight_recorder_dump(ctx->flight_recorder, ctx->ctx_id);
+   return true;
+}
+
+void virgl_renderer_dump_commands(void)
+{
+   TRACE_FUNC();
+   if (!state.context_initialized)
+      return;
+
+   struct virgl_context_foreach_args args = {
+      .callback = virgl_renderer_dump_context_commands,
+   };
+   virgl_context_foreach(&args);
+}
+
 int virgl_renderer_get_dev_fd(int ctx_id)
 {
    struct virgl_context *ctx = virgl_context_lookup(ctx_id);
@@ -169,12 +169,24 @@ struct virgl_renderer_callbacks {
 /* Blob allocations must be done by guest from dedicated heap (Host visible memory). */
 #define VIRGL_RENDERER_USE_GUEST_VRAM (1 << 14)
 
+/* Record the call counts and latencies of the commands of the contexts, see
+ * virgl_renderer_context_get_command_stats().
+ */
+#define VIRGL_RENDERER_COMMAND_STATS (1 << 15)
+
 VIRGL_EXPORT int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cb);
 VIRGL_EXPORT void virgl_renderer_poll(void); /* force fences */
 
 /* we need to give qemu the cursor resource contents */
 VIRGL_EXPORT void *virgl_renderer_get_cursor_data(uint32_t resource_id, uint32_t *width, uint32_t *height);
 
+/* Same as virgl_renderer_get_cursor_data, into a buffer of the caller.  The
+ * contents are kept until the resource is written, so reading an unchanged
+ * cursor doesn't wait for the GPU.  Returns ENOSPC when size is too small,
+ * with the size of the cursor in width and height. */
+VIRGL_EXPORT int virgl_renderer_read_cursor_data(uint32_t resource_id, void *data, uint32_t size,
+                                                 uint32_t *width, uint32_t *height);
+
 VIRGL_EXPORT void virgl_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int num_iovs,
                                           uint32_t offset, int x, int y, int width, int height);
 
@@ -424,6 +436,14 @@ VIRGL_EXPORT int virgl_renderer_resource_map(uint32_t res_handle, void **map, ui
 
 VIRGL_EXPORT int virgl_renderer_resource_unmap(uint32_t res_handle);
 
+/* Tells whether virgl_renderer_resource_map() returns the same pointer for
+ * the resource until it is destroyed, even across unmaps.  Mapping such a
+ * resource again while it is mapped returns the same pointer too, and the
+ * mapping goes away when it has been unmapped as many times.  A VMM can keep
+ * the guest memory region of a stable mapping instead of remapping it.
+ */
+VIRGL_EXPORT int virgl_renderer_resource_is_map_stable(uint32_t res_handle, bool *stable);
+
 #define VIRGL_RENDERER_MAP_CACHE_MASK      0x0f
 #define VIRGL_RENDERER_MAP_CACHE_NONE      0x00
 #define VIRGL_RENDERER_MAP_CACHE_CACHED    0x01
@@ -460,6 +480,12 @@ VIRGL_EXPORT int virgl_renderer_context_create_fence(uint32_t ctx_id,
 VIRGL_EXPORT void virgl_renderer_context_poll(uint32_t ctx_id); /* force fences */
 VIRGL_EXPORT int virgl_renderer_context_get_poll_fd(uint32_t ctx_id);
 
+/* Retire the fences of the contexts whose poll fds, as returned by
+ * virgl_renderer_context_get_poll_fd(), are readable.  Unlike
+ * virgl_renderer_poll(), the other contexts are not polled.
+ */
+VIRGL_EXPORT void virgl_renderer_poll_fds(const int *fds, uint32_t count);
+
 /* Map a resource to an specific userspace address. If successful, the
  * mapping is owned by the caller and is its responsibility to unmap
  * the resource by its own means (i.e. overriding the map with
@@ -484,6 +510,54 @@ virgl_renderer_export_fence(uint64_t client_fence_id, int *fd);
 VIRGL_EXPORT int
 virgl_renderer_export_signalled_fence(void);
 
+#define VIRGL_RENDERER_CONTEXT_SCHED_MAX_CPUS 256
+
+/* Scheduling of the host threads of a context.
+ *
+ * When cpu_mask is not all zeros, the threads are restricted to the CPUs in
+ * cpu_mask, such as the CPUs of the NUMA node of the VM.
+ *
+ * policy is SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or SCHED_RR, or
+ * -1 to keep the policy.  priority is the nice value with SCHED_OTHER and
+ * SCHED_BATCH, and the static priority with SCHED_FIFO and SCHED_RR.
+ *
+ * This is only honored by the contexts in the render server, where it applies
+ * to the worker and to the threads it creates, such as the ring threads and
+ * the queue sync threads.  It is best effort and failures are only logged.
+ */
+struct virgl_renderer_context_sched {
+   uint64_t cpu_mask[VIRGL_RENDERER_CONTEXT_SCHED_MAX_CPUS / 64];
+   int32_t policy;
+   int32_t priority;
+};
+
+/* Same as virgl_renderer_context_create_with_flags(), but also chooses the
+ * scheduling of the context.  sched can be NULL.
+ */
+VIRGL_EXPORT int
+virgl_renderer_context_create_with_sched(uint32_t ctx_id,
+                                         uint32_t ctx_flags,
+                                         uint32_t nlen,
+                                         const char *name,
+                                         const struct virgl_renderer_context_sched *sched);
+
+#define VIRGL_RENDERER_CONTEXT_WEIGHT_DEFAULT 100
+
+/* Set the share of the renderer that a context gets while other contexts
+ * compete for it, relative to their weights.  The contexts start with
+ * VIRGL_RENDERER_CONTEXT_WEIGHT_DEFAULT, and weight must not be 0.
+ *
+ * This is only honored by the virgl contexts.  Their submissions are queued
+ * once a weight is set, as with VREND_SCHED_SUBMITS, and the queued
+ * submissions of the context that used the least decode CPU time and GPU
+ * time, divided by its weight, run first.  The GPU time is only accounted
+ * with VREND_GPU_TIMESTAMPS set.  ENOTSUP is returned for the other contexts,
+ * whose threads in the render server are scheduled by
+ * virgl_renderer_context_create_with_sched instead.
+ */
+VIRGL_EXPORT int
+virgl_renderer_context_set_weight(uint32_t ctx_id, uint32_t weight);
+
 /* Submit a command buffer for execution.  ctx_id is the context ID.
  * ndw is the length of the buffer in 4-byte words.
  *
@@ -510,6 +584,177 @@ virgl_renderer_submit_cmd2(void *buffer,
                            uint64_t *in_fence_ids,
                            uint32_t num_in_fences);
 
+/* Same as virgl_renderer_submit_cmd2() followed by
+ * virgl_renderer_context_create_fence(), but lets the renderer submit the
+ * commands and the fence together.  The fence is not created when the
+ * submission fails.
+ */
+VIRGL_EXPORT int
+virgl_renderer_submit_cmd_with_fence(void *buffer,
+                                     int ctx_id,
+                                     int ndw,
+                                     uint64_t *in_fence_ids,
+                                     uint32_t num_in_fences,
+                                     uint32_t fence_flags,
+                                     uint32_t ring_idx,
+                                     uint64_t fence_id);
+
+/* Same as virgl_renderer_resource_create_blob() followed by
+ * virgl_renderer_ctx_attach_resource() with the ctx_id of the args, for each
+ * args in order, but lets the renderer create the resources of a context
+ * together.
+ *
+ * Resources are created until one fails.  The number of created resources
+ * is returned in created.
+ */
+VIRGL_EXPORT int
+virgl_renderer_resource_create_blobs(const struct virgl_renderer_resource_create_blob_args *args,
+                                     uint32_t count,
+                                     uint32_t *created);
+
+#define VIRGL_RENDERER_SUBMIT_CMD_FLAG_FENCE (1 << 0)
+
+struct virgl_renderer_submit_cmd_entry {
+   void *buffer;
+   int ctx_id;
+   int ndw;
+   uint64_t *in_fence_ids;
+   uint32_t num_in_fences;
+
+   /* VIRGL_RENDERER_SUBMIT_CMD_FLAG_FENCE creates the fence below */
+   uint32_t flags;
+   uint32_t fence_flags;
+   uint32_t ring_idx;
+   uint64_t fence_id;
+};
+
+/* Same as virgl_renderer_submit_cmd2(), or
+ * virgl_renderer_submit_cmd_with_fence() when the entry has
+ * VIRGL_RENDERER_SUBMIT_CMD_FLAG_FENCE set, for each entry in order, but
+ * lets the renderer submit consecutive entries of a context together.
+ *
+ * Entries are submitted until one fails.  The number of submitted entries
+ * is returned in submitted.
+ */
+VIRGL_EXPORT int
+virgl_renderer_submit_cmdv(const struct virgl_renderer_submit_cmd_entry *entries,
+                           uint32_t count,
+                           uint32_t *submitted);
+
+#define VIRGL_RENDERER_COMMAND_STATS_BUCKET_COUNT 32
+
+struct virgl_renderer_command_stats {
+   /* the command id, specific to the capset of the context */
+   uint32_t command;
+   const char *name;
+
+   uint64_t count;
+   uint64_t total_ns;
+   /* histogram[i] counts the commands that took from 2^i to 2^(i+1) - 1 ns.
+    * The first bucket also counts the commands that took 0 ns, and the last
+    * bucket the commands that took longer.
+    */
+   uint64_t histogram[VIRGL_RENDERER_COMMAND_STATS_BUCKET_COUNT];
+};
+
+/* Get the statistics of the commands a context has executed, when the
+ * renderer was initialized with VIRGL_RENDERER_COMMAND_STATS.  *count is the
+ * size of stats, and is set to the number of executed commands.  stats can be
+ * NULL to query the count.  ENOSPC is returned when stats is too small, and
+ * ENOTSUP when the context does not record statistics.  The contexts running
+ * in the render server do not.
+ *
+ * This must not be called concurrently with the submissions to the context.
+ */
+VIRGL_EXPORT int
+virgl_renderer_context_get_command_stats(uint32_t ctx_id,
+                                         struct virgl_renderer_command_stats *stats,
+                                         uint32_t *count);
+
+#define VIRGL_RENDERER_STATS_VERSION 3
+
+/* Fields are only ever appended, and version is bumped when they are. */
+struct virgl_renderer_stats {
+   /* Set to VIRGL_RENDERER_STATS_VERSION by the caller.  Only the fields of
+    * that version are written, and version is lowered to the one of
+    * virglrenderer when it is older.
+    */
+   uint32_t version;
+
+   /* current values */
+   uint32_t context_count;
+   uint32_t resource_count;
+   /* venus rings of the live contexts */
+   uint32_t ring_count;
+   /* the size of the blob resources */
+   uint64_t blob_size;
+   /* the memory held by the venus decoder temp pools */
+   uint64_t temp_pool_size;
+
+   /* since virgl_renderer_init or virgl_renderer_reset_stats */
+   uint64_t submit_cmd_count;
+   uint64_t submit_cmd_size;
+   uint64_t transfer_count;
+   uint64_t fence_count;
+   uint64_t program_cache_hit_count;
+   uint64_t program_cache_miss_count;
+
+   /* since the creation of the venus rings of the live contexts, in ns */
+   uint64_t ring_idle_time;
+   uint64_t ring_exec_time;
+
+   /* version 2 */
+
+   /* GPU time of the vrend command batches, blits and clears, in ns, since
+    * virgl_renderer_init or virgl_renderer_reset_stats.  They are only
+    * measured with VREND_GPU_TIMESTAMPS set in the environment.
+    */
+   uint64_t gpu_batch_time;
+   uint64_t gpu_blit_time;
+   uint64_t gpu_clear_time;
+
+   /* version 3 */
+
+   /* current size of the memory bound to the venus sparse resources */
+   uint64_t sparse_committed_size;
+};
+
+/* Get the counters aggregated over all contexts, including those running in
+ * the render server.  The ring times are sampled while the rings run, and can
+ * be slightly behind.  EINVAL is returned when version is not set.
+ */
+VIRGL_EXPORT int
+virgl_renderer_get_stats(struct virgl_renderer_stats *stats);
+
+/* reset the counters that are since virgl_renderer_init */
+VIRGL_EXPORT void
+virgl_renderer_reset_stats(void);
+
+/* Log the last commands a context has executed, with their sizes, start times
+ * and durations.  The contexts record them unless VIRGL_FLIGHT_RECORDER is set
+ * to false in the environment, and dump them on their own on the first
+ * dispatch error.  ENOTSUP is returned when the context does not record them.
+ * The contexts running in the render server do not, they only dump on a fatal
+ * decoder error.
+ */
+VIRGL_EXPORT int
+virgl_renderer_context_dump_commands(uint32_t ctx_id);
+
+/* same as virgl_renderer_context_dump_commands, for all the contexts */
+VIRGL_EXPORT void
+virgl_renderer_dump_commands(void);
+
+/* Flush the GL work submitted so far and queue a signal of a shared
+ * ID3D11Fence behind it.  With VIRGL_RENDERER_D3D11_SHARE_TEXTURE, the VMM
+ * can wait for the value on its own device before presenting from the D3D11
+ * textures of the resources, instead of waiting for the GL work on the CPU.
+ * The fence is owned by the renderer and the same for all the calls, the
+ * values grow.  ENOTSUP is returned when the D3D11 device has no fences,
+ * and on other hosts.
+ */
+VIRGL_EXPORT int
+virgl_renderer_d3d11_signal_fence(void **d3d11_fence, uint64_t *value);
+
 /* vtest semi-private APIs: */
 VIRGL_EXPORT int virgl_renderer_attach_fence(int ctx_id, int fence_fd);
 VIRGL_EXPORT int virgl_renderer_get_fence_fd(uint64_t fence_id);
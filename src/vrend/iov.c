@@ -202,3 +202,188 @@ out:
 
   return ret;
 }
+
+/**
+ * Build the prefix sums of the iovec lengths.
+ *
+ * \return  An array of iovlen + 1 entries, entry i is the offset iov[i]
+ *          starts at and the last entry is the total size, or NULL on
+ *          allocation failure.  To be freed with free().
+ */
+size_t *vrend_iovec_build_offsets(const struct iovec *iov, int iovlen)
+{
+  size_t *offsets = malloc((iovlen + 1) * sizeof(*offsets));
+  size_t offset = 0;
+
+  if (!offsets)
+    return NULL;
+
+  for (int i = 0; i < iovlen; i++) {
+    offsets[i] = offset;
+    offset += iov[i].iov_len;
+  }
+  offsets[iovlen] = offset;
+
+  return offsets;
+}
+
+void vrend_iov_cursor_init(struct vrend_iov_cursor *cursor,
+			   const struct iovec *iov, int iovlen,
+			   const size_t *offsets)
+{
+  cursor->iov = iov;
+  cursor->iovlen = iovlen;
+  cursor->offsets = offsets;
+  cursor->index = 0;
+  cursor->start = 0;
+}
+
+/* Move the cursor to the iovec entry containing offset */
+static bool vrend_iov_cursor_seek(struct vrend_iov_cursor *cursor, size_t offset)
+{
+  if (cursor->index < cursor->iovlen &&
+      offset >= cursor->start &&
+      offset - cursor->start < cursor->iov[cursor->index].iov_len)
+    return true;
+
+  if (cursor->offsets) {
+    int lo = 0, hi = cursor->iovlen;
+
+    if (offset >= cursor->offsets[cursor->iovlen])
+      return false;
+
+    /* find the last entry starting at or before offset, the entries
+     * before it that start at the same offset are empty */
+    while (hi - lo > 1) {
+      int mid = lo + (hi - lo) / 2;
+      if (cursor->offsets[mid] <= offset)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    cursor->index = lo;
+    cursor->start = cursor->offsets[lo];
+    return true;
+  }
+
+  if (offset < cursor->start) {
+    cursor->index = 0;
+    cursor->start = 0;
+  }
+
+  while (cursor->index < cursor->iovlen &&
+         offset - cursor->start >= cursor->iov[cursor->index].iov_len) {
+    cursor->start += cursor->iov[cursor->index].iov_len;
+    cursor->index++;
+  }
+
+  return cursor->index < cursor->iovlen;
+}
+
+/* Copy between buf and the iovec starting at offset.  The cursor is left on
+ * the last entry that was accessed, so the next access can continue from
+ * there. */
+static size_t vrend_iov_cursor_copy(struct vrend_iov_cursor *cursor, size_t offset,
+				    char *buf, size_t count, bool to_iov)
+{
+  size_t copied = 0;
+
+  if (!count || !vrend_iov_cursor_seek(cursor, offset))
+    return 0;
+
+  offset -= cursor->start;
+
+  while (true) {
+    const struct iovec *iov = &cursor->iov[cursor->index];
+    size_t len = iov->iov_len - offset;
+
+    if (count < len) len = count;
+
+    if (to_iov)
+      memcpy((char*)iov->iov_base + offset, buf, len);
+    else
+      memcpy(buf, (char*)iov->iov_base + offset, len);
+
+    copied += len;
+    buf += len;
+    count -= len;
+
+    if (!count || cursor->index + 1 == cursor->iovlen)
+      break;
+
+    cursor->start += iov->iov_len;
+    cursor->index++;
+    offset = 0;
+  }
+
+  return copied;
+}
+
+size_t vrend_iov_cursor_read(struct vrend_iov_cursor *cursor, size_t offset,
+			     char *buf, size_t count)
+{
+  return vrend_iov_cursor_copy(cursor, offset, buf, count, false);
+}
+
+size_t vrend_iov_cursor_write(struct vrend_iov_cursor *cursor, size_t offset,
+			      const char *buf, size_t count)
+{
+  return vrend_iov_cursor_copy(cursor, offset, (char *)buf, count, true);
+}
+
+/**
+ * Copy a box of rows between a tightly packed buffer and an iovec.
+ *
+ * The rows of a layer are stride bytes apart in the iovec and the layers
+ * layer_stride bytes apart, starting at offset.  In buf they are packed.
+ * The iovec is walked once from the start of the box, a box that is
+ * contiguous in the iovec is copied at once.
+ *
+ * \param invert     Store the rows of each layer in reverse order in buf.
+ * \param to_iov     Copy from buf into the iovec instead of the other way.
+ * \return           The number of bytes copied.
+ */
+size_t vrend_iov_copy_box(const struct iovec *iov, int iovlen,
+			  const size_t *offsets, size_t offset,
+			  char *buf, size_t row_size, uint32_t rows,
+			  size_t stride, uint32_t layers, size_t layer_stride,
+			  bool invert, bool to_iov)
+{
+  struct vrend_iov_cursor cursor;
+  size_t copied = 0;
+
+  vrend_iov_cursor_init(&cursor, iov, iovlen, offsets);
+
+  if (!invert && stride == row_size &&
+      (layers == 1 || layer_stride == rows * row_size))
+    return vrend_iov_cursor_copy(&cursor, offset, buf,
+				 row_size * rows * layers, to_iov);
+
+  for (uint32_t d = 0; d < layers; d++) {
+    size_t row_offset = offset + d * layer_stride;
+    char *layer = buf + d * rows * row_size;
+
+    for (uint32_t h = 0; h < rows; h++) {
+      char *ptr = layer + (invert ? rows - 1 - h : h) * row_size;
+      const struct iovec *entry = &iov[cursor.index];
+
+      /* most rows are inside the entry the previous one ended in */
+      if (cursor.index < iovlen && row_offset >= cursor.start &&
+	  row_offset - cursor.start + row_size <= entry->iov_len) {
+	char *base = (char*)entry->iov_base + (row_offset - cursor.start);
+	if (to_iov)
+	  memcpy(base, ptr, row_size);
+	else
+	  memcpy(ptr, base, row_size);
+	copied += row_size;
+      } else {
+	copied += vrend_iov_cursor_copy(&cursor, row_offset, ptr, row_size, to_iov);
+      }
+
+      row_offset += stride;
+    }
+  }
+
+  return copied;
+}
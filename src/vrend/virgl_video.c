@@ -44,6 +44,8 @@
  *   - virgl_video_decode_bitstream()
  *     It constructs the decoding-related VABuffers according to the picture
  *     description information, and then calls vaRenderPicture() for decoding.
+ *     For H.264 and H.265, the VABuffers are queued instead, and all those
+ *     of a frame are rendered at once in virgl_video_end_frame().
  *   - virgl_video_encode_bitstream()
  *     It constructs the encoding-related VABuffers according to the picture
  *     description information, and then calls vaRenderPicture() for encoding.
@@ -57,11 +59,14 @@
  */
 
 
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <epoxy/gl.h>
 #include <epoxy/egl.h>
@@ -78,6 +83,9 @@
 #include "virgl_util.h"
 #include "virgl_video.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
 /*
  * The max size of codec buffer is approximately:
  *   num_of_macroblocks * max_size_of_per_macroblock + size_of_some_headers
@@ -88,6 +96,18 @@
 #define CODED_BUF_DEFAULT_SIZE(width, height) \
     ((width) * (height) / (16 * 16) * 512)
 
+/*
+ * Decode VABuffers rendered in a frame are kept for the following frames,
+ * as the parameter buffers have the same size every frame.
+ */
+#define FRAME_BUF_POOL_SIZE 32
+
+struct virgl_video_frame_buf {
+    VABufferID id;
+    VABufferType type;
+    unsigned size;
+};
+
 struct virgl_video_buffer {
     enum pipe_format format;
     uint32_t width;
@@ -113,6 +133,16 @@ struct virgl_video_codec {
    struct virgl_video_buffer *ref_pic_list[32]; /* Enc: reference pictures */
    VABufferID  va_coded_buf;                    /* Enc: VACodedBuffer */
    void *opaque;                                /* User opaque data */
+
+   /* Dec: VABuffers of the current frame, rendered before vaEndPicture() */
+   VABufferID *frame_buf_ids;
+   struct virgl_video_frame_buf *frame_bufs;
+   unsigned num_frame_bufs;
+   unsigned max_frame_bufs;
+
+   /* Dec: VABuffers of the previous frames, reused by type and size */
+   struct virgl_video_frame_buf buf_pool[FRAME_BUF_POOL_SIZE];
+   unsigned num_pooled_bufs;
 };
 
 struct virgl_video_supported_entry {
@@ -124,6 +154,29 @@ static VADisplay va_dpy;
 
 static struct virgl_video_callbacks *callbacks = NULL;
 
+#define VIDEO_CAPS_CACHE_MAGIC 0x31435656 /* "VVC1" */
+#define VIDEO_CAPS_CACHE_MAX 32
+
+struct video_caps_cache_header {
+    uint32_t magic;
+    uint32_t num_caps;
+    uint64_t key;
+};
+
+/*
+ * The capabilities probed from the VA driver, identified by the VA-API
+ * version and the vendor string, which carries the driver version.  They are
+ * probed once per process, and with a cache directory, stored there for the
+ * next processes, which then skip the probing.
+ */
+static struct {
+    const char *dir;
+    uint64_t key;
+    bool valid;
+    uint32_t num_caps;
+    struct virgl_video_caps caps[VIDEO_CAPS_CACHE_MAX];
+} caps_cache;
+
 static enum pipe_video_profile pipe_profile_from_va(VAProfile profile)
 {
    switch (profile) {
@@ -579,6 +632,13 @@ int virgl_video_init(int drm_fd,
         return -1;
     }
 
+    const int version[2] = { major_ver, minor_ver };
+    const uint64_t key = XXH64(driver, strlen(driver), XXH64(version, sizeof(version), 0));
+    if (caps_cache.key != key) {
+        caps_cache.key = key;
+        caps_cache.valid = false;
+    }
+
     callbacks = cbs;
 
     return 0;
@@ -689,16 +749,95 @@ static int fill_vcaps_entry(VAProfile profile, VAEntrypoint entrypoint,
     return 0;
 }
 
-int virgl_video_fill_caps(union virgl_caps *caps)
+void virgl_video_set_cache_dir(const char *dir)
+{
+    caps_cache.dir = dir;
+}
+
+static void caps_cache_path(char *path, size_t len)
+{
+    snprintf(path, len, "%s/video-caps-%016" PRIx64, caps_cache.dir, caps_cache.key);
+}
+
+static bool caps_cache_load(void)
+{
+    struct video_caps_cache_header hdr;
+    char path[PATH_MAX];
+    struct stat st;
+    bool ok = false;
+
+    if (!caps_cache.dir)
+        return false;
+
+    caps_cache_path(path, sizeof(path));
+    FILE *fp = fopen(path, "rbe");
+    if (!fp)
+        return false;
+
+    if (fstat(fileno(fp), &st) || fread(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto out;
+
+    if (hdr.magic != VIDEO_CAPS_CACHE_MAGIC || hdr.key != caps_cache.key ||
+        hdr.num_caps > VIDEO_CAPS_CACHE_MAX ||
+        (uint64_t)st.st_size != sizeof(hdr) + hdr.num_caps * sizeof(caps_cache.caps[0]))
+        goto out;
+
+    if (fread(caps_cache.caps, sizeof(caps_cache.caps[0]), hdr.num_caps, fp) !=
+        hdr.num_caps)
+        goto out;
+
+    caps_cache.num_caps = hdr.num_caps;
+    ok = true;
+
+    virgl_debug("Loaded %u video caps from %s\n", caps_cache.num_caps, path);
+
+out:
+    fclose(fp);
+    return ok;
+}
+
+static void caps_cache_store(void)
+{
+    const struct video_caps_cache_header hdr = {
+        .magic = VIDEO_CAPS_CACHE_MAGIC,
+        .num_caps = caps_cache.num_caps,
+        .key = caps_cache.key,
+    };
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+
+    if (!caps_cache.dir)
+        return;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", caps_cache.dir);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+        return;
+
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+              fwrite(caps_cache.caps, sizeof(caps_cache.caps[0]), caps_cache.num_caps,
+                     fp) == caps_cache.num_caps;
+    ok &= !fclose(fp);
+
+    /* concurrent processes store the same caps */
+    caps_cache_path(path, sizeof(path));
+    if (!ok || rename(tmp_path, path))
+        unlink(tmp_path);
+}
+
+static int probe_caps(void)
 {
     int i, j;
     int num_profiles, num_entrypoints;
     VAProfile *profiles = NULL;
     VAEntrypoint *entrypoints = NULL;
 
-    if (!va_dpy || !caps)
-        return -1;
-
     num_entrypoints = vaMaxNumEntrypoints(va_dpy);
     entrypoints = calloc(num_entrypoints, sizeof(VAEntrypoint));
     if (!entrypoints)
@@ -712,19 +851,19 @@ int virgl_video_fill_caps(union virgl_caps *caps)
     }
 
     vaQueryConfigProfiles(va_dpy, profiles, &num_profiles);
-    for (i = 0, caps->v2.num_video_caps = 0; i < num_profiles; i++) {
+    for (i = 0, caps_cache.num_caps = 0; i < num_profiles; i++) {
         if (!is_supported(profiles[i], VAEntrypointNone))
 		continue;
 
         vaQueryConfigEntrypoints(va_dpy, profiles[i],
                                  entrypoints, &num_entrypoints);
         for (j = 0; j < num_entrypoints &&
-             caps->v2.num_video_caps < ARRAY_SIZE(caps->v2.video_caps); j++) {
+             caps_cache.num_caps < ARRAY_SIZE(caps_cache.caps); j++) {
 	    if (!is_supported(profiles[i], entrypoints[j]))
 		continue;
 
             fill_vcaps_entry(profiles[i], entrypoints[j],
-                    &caps->v2.video_caps[caps->v2.num_video_caps++]);
+                    &caps_cache.caps[caps_cache.num_caps++]);
         }
     }
 
@@ -734,6 +873,152 @@ int virgl_video_fill_caps(union virgl_caps *caps)
     return 0;
 }
 
+int virgl_video_fill_caps(union virgl_caps *caps)
+{
+    if (!va_dpy || !caps)
+        return -1;
+
+    if (!caps_cache.valid) {
+        if (!caps_cache_load()) {
+            if (probe_caps())
+                return -1;
+            caps_cache_store();
+        }
+        caps_cache.valid = true;
+    }
+
+    caps->v2.num_video_caps = MIN2(caps_cache.num_caps, ARRAY_SIZE(caps->v2.video_caps));
+    memcpy(caps->v2.video_caps, caps_cache.caps,
+           caps->v2.num_video_caps * sizeof(caps->v2.video_caps[0]));
+
+    return 0;
+}
+
+static int reuse_pooled_buffer(struct virgl_video_codec *codec,
+                               VABufferType type, unsigned size,
+                               const void *data, VABufferID *id)
+{
+    unsigned i;
+    void *map;
+
+    for (i = 0; i < codec->num_pooled_bufs; i++) {
+        if (codec->buf_pool[i].type == type && codec->buf_pool[i].size == size)
+            break;
+    }
+    if (i == codec->num_pooled_bufs)
+        return -1;
+
+    *id = codec->buf_pool[i].id;
+    codec->buf_pool[i] = codec->buf_pool[--codec->num_pooled_bufs];
+
+    if (VA_STATUS_SUCCESS != vaMapBuffer(va_dpy, *id, &map)) {
+        vaDestroyBuffer(va_dpy, *id);
+        return -1;
+    }
+    memcpy(map, data, size);
+    vaUnmapBuffer(va_dpy, *id);
+
+    return 0;
+}
+
+/*
+ * Adds a VABuffer holding data to the current frame. The buffers of a frame
+ * are rendered with a single vaRenderPicture() in render_frame_buffers().
+ */
+static int queue_frame_buffer(struct virgl_video_codec *codec,
+                              VABufferType type, unsigned size,
+                              const void *data)
+{
+    VAStatus va_stat;
+    VABufferID id;
+    struct virgl_video_frame_buf *buf;
+
+    if (codec->num_frame_bufs == codec->max_frame_bufs) {
+        unsigned max_bufs = codec->max_frame_bufs ? codec->max_frame_bufs * 2 : 16;
+        VABufferID *ids;
+        struct virgl_video_frame_buf *bufs;
+
+        ids = realloc(codec->frame_buf_ids, max_bufs * sizeof(*ids));
+        if (!ids)
+            return -1;
+        codec->frame_buf_ids = ids;
+
+        bufs = realloc(codec->frame_bufs, max_bufs * sizeof(*bufs));
+        if (!bufs)
+            return -1;
+        codec->frame_bufs = bufs;
+
+        codec->max_frame_bufs = max_bufs;
+    }
+
+    if (reuse_pooled_buffer(codec, type, size, data, &id)) {
+        va_stat = vaCreateBuffer(va_dpy, codec->va_ctx, type, size, 1,
+                                 (void *)data, &id);
+        if (VA_STATUS_SUCCESS != va_stat) {
+            virgl_error("create buffer failed, err = 0x%x\n", va_stat);
+            return -1;
+        }
+    }
+
+    buf = &codec->frame_bufs[codec->num_frame_bufs];
+    buf->id = id;
+    buf->type = type;
+    buf->size = size;
+    codec->frame_buf_ids[codec->num_frame_bufs++] = id;
+
+    return 0;
+}
+
+/* Moves the buffers of the current frame to the pool, or destroys them */
+static void release_frame_buffers(struct virgl_video_codec *codec)
+{
+    unsigned i;
+
+    for (i = 0; i < codec->num_frame_bufs; i++) {
+        if (codec->num_pooled_bufs < FRAME_BUF_POOL_SIZE)
+            codec->buf_pool[codec->num_pooled_bufs++] = codec->frame_bufs[i];
+        else
+            vaDestroyBuffer(va_dpy, codec->frame_bufs[i].id);
+    }
+
+    codec->num_frame_bufs = 0;
+}
+
+static int render_frame_buffers(struct virgl_video_codec *codec)
+{
+    VAStatus va_stat;
+    int err = 0;
+
+    if (!codec->num_frame_bufs)
+        return 0;
+
+    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, codec->frame_buf_ids,
+                              codec->num_frame_bufs);
+    if (VA_STATUS_SUCCESS != va_stat) {
+        virgl_error("render frame buffers failed, err = 0x%x\n", va_stat);
+        err = -1;
+    }
+
+    release_frame_buffers(codec);
+
+    return err;
+}
+
+static void destroy_frame_buffers(struct virgl_video_codec *codec)
+{
+    unsigned i;
+
+    for (i = 0; i < codec->num_frame_bufs; i++)
+        vaDestroyBuffer(va_dpy, codec->frame_bufs[i].id);
+    for (i = 0; i < codec->num_pooled_bufs; i++)
+        vaDestroyBuffer(va_dpy, codec->buf_pool[i].id);
+
+    codec->num_frame_bufs = 0;
+    codec->num_pooled_bufs = 0;
+    free(codec->frame_buf_ids);
+    free(codec->frame_bufs);
+}
+
 struct virgl_video_codec *virgl_video_create_codec(
         const struct virgl_video_create_codec_args *args)
 {
@@ -821,6 +1106,8 @@ void virgl_video_destroy_codec(struct virgl_video_codec *codec)
     if (codec->va_coded_buf)
         vaDestroyBuffer(va_dpy, codec->va_coded_buf);
 
+    destroy_frame_buffers(codec);
+
     for (i = 0; i < ARRAY_SIZE(codec->ref_pic_list); i++) {
         if (codec->ref_pic_list[i])
             free(codec->ref_pic_list[i]);
@@ -912,6 +1199,9 @@ int virgl_video_begin_frame(struct virgl_video_codec *codec,
     if (codec->entrypoint == PIPE_VIDEO_ENTRYPOINT_ENCODE)
         encode_upload_picture(codec, target);
 
+    /* drop what a failed frame left behind */
+    release_frame_buffers(codec);
+
     codec->buffer = target;
     va_stat = vaBeginPicture(va_dpy, codec->va_ctx, target->va_sfc);
     if (VA_STATUS_SUCCESS != va_stat) {
@@ -1382,75 +1672,33 @@ static int h264_decode_bitstream(struct virgl_video_codec *codec,
                                  const unsigned *sizes)
 {
     unsigned i;
-    int err = 0;
-    VAStatus va_stat;
-    VABufferID *slice_data_buf, pic_param_buf, iq_matrix_buf, slice_param_buf;
     VAPictureParameterBufferH264 pic_param;
     VAIQMatrixBufferH264 iq_matrix;
     VASliceParameterBufferH264 slice_param;
 
-    slice_data_buf = calloc(num_buffers, sizeof(VABufferID));
-    if (!slice_data_buf) {
-        virgl_error("alloc slice data buffer id failed\n");
-        return -1;
-    }
-
+    /* the buffers are rendered with the rest of the frame in end_frame */
     h264_fill_picture_param(codec, target, desc, &pic_param);
-    vaCreateBuffer(va_dpy, codec->va_ctx, VAPictureParameterBufferType,
-                   sizeof(pic_param), 1, &pic_param, &pic_param_buf);
+    if (queue_frame_buffer(codec, VAPictureParameterBufferType,
+                           sizeof(pic_param), &pic_param))
+        return -1;
 
     h264_fill_iq_matrix(desc, &iq_matrix);
-    vaCreateBuffer(va_dpy, codec->va_ctx, VAIQMatrixBufferType,
-                   sizeof(iq_matrix), 1, &iq_matrix, &iq_matrix_buf);
+    if (queue_frame_buffer(codec, VAIQMatrixBufferType,
+                           sizeof(iq_matrix), &iq_matrix))
+        return -1;
 
     h264_fill_slice_param(desc, &slice_param);
-    vaCreateBuffer(va_dpy, codec->va_ctx, VASliceParameterBufferType,
-                   sizeof(slice_param), 1, &slice_param, &slice_param_buf);
-
-    for (i = 0; i < num_buffers; i++) {
-        vaCreateBuffer(va_dpy, codec->va_ctx, VASliceDataBufferType,
-                      sizes[i], 1, (void *)(buffers[i]), &slice_data_buf[i]);
-    }
-
-    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &pic_param_buf, 1);
-    if (VA_STATUS_SUCCESS != va_stat) {
-        virgl_error("render picture param failed, err = 0x%x\n", va_stat);
-        err = -1;
-        goto err;
-    }
-
-    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &iq_matrix_buf, 1);
-    if (VA_STATUS_SUCCESS != va_stat) {
-        virgl_error("render iq matrix failed, err = 0x%x\n", va_stat);
-        err = -1;
-        goto err;
-    }
-
-    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &slice_param_buf, 1);
-    if (VA_STATUS_SUCCESS != va_stat) {
-        virgl_error("render slice param failed, err = 0x%x\n", va_stat);
-        err = -1;
-        goto err;
-    }
+    if (queue_frame_buffer(codec, VASliceParameterBufferType,
+                           sizeof(slice_param), &slice_param))
+        return -1;
 
     for (i = 0; i < num_buffers; i++) {
-        va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &slice_data_buf[i], 1);
-
-        if (VA_STATUS_SUCCESS != va_stat) {
-            virgl_error("render slice data failed, err = 0x%x\n", va_stat);
-            err = -1;
-        }
+        if (queue_frame_buffer(codec, VASliceDataBufferType,
+                               sizes[i], buffers[i]))
+            return -1;
     }
 
-err:
-    vaDestroyBuffer(va_dpy, pic_param_buf);
-    vaDestroyBuffer(va_dpy, iq_matrix_buf);
-    vaDestroyBuffer(va_dpy, slice_param_buf);
-    for (i = 0; i < num_buffers; i++)
-        vaDestroyBuffer(va_dpy, slice_data_buf[i]);
-    free(slice_data_buf);
-
-    return err;
+    return 0;
 }
 
 static int h264_encode_render_sequence(
@@ -2099,62 +2347,27 @@ static int h265_decode_bitstream(struct virgl_video_codec *codec,
                                  const unsigned *sizes)
 {
     unsigned i;
-    int err = 0;
-    VAStatus va_stat;
-    VABufferID *slice_data_buf, pic_param_buf, slice_param_buf;
     VAPictureParameterBufferHEVC pic_param = {0};
     VASliceParameterBufferHEVC slice_param = {0};
 
-    slice_data_buf = calloc(num_buffers, sizeof(VABufferID));
-    if (!slice_data_buf) {
-        virgl_error("alloc slice data buffer id failed\n");
-        return -1;
-    }
-
+    /* the buffers are rendered with the rest of the frame in end_frame */
     h265_fill_picture_param(codec, target, desc, &pic_param);
-    vaCreateBuffer(va_dpy, codec->va_ctx, VAPictureParameterBufferType,
-                   sizeof(pic_param), 1, &pic_param, &pic_param_buf);
+    if (queue_frame_buffer(codec, VAPictureParameterBufferType,
+                           sizeof(pic_param), &pic_param))
+        return -1;
 
     h265_fill_slice_param(desc, &slice_param);
-    vaCreateBuffer(va_dpy, codec->va_ctx, VASliceParameterBufferType,
-                   sizeof(slice_param), 1, &slice_param, &slice_param_buf);
-
-    for (i = 0; i < num_buffers; i++) {
-        vaCreateBuffer(va_dpy, codec->va_ctx, VASliceDataBufferType,
-                      sizes[i], 1, (void *)(buffers[i]), &slice_data_buf[i]);
-    }
-
-    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &pic_param_buf, 1);
-    if (VA_STATUS_SUCCESS != va_stat) {
-        virgl_error("render picture param failed, err = 0x%x\n", va_stat);
-        err = -1;
-        goto err;
-    }
-
-    va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &slice_param_buf, 1);
-    if (VA_STATUS_SUCCESS != va_stat) {
-        virgl_error("render slice param failed, err = 0x%x\n", va_stat);
-        err = -1;
-        goto err;
-    }
+    if (queue_frame_buffer(codec, VASliceParameterBufferType,
+                           sizeof(slice_param), &slice_param))
+        return -1;
 
     for (i = 0; i < num_buffers; i++) {
-        va_stat = vaRenderPicture(va_dpy, codec->va_ctx, &slice_data_buf[i], 1);
-
-        if (VA_STATUS_SUCCESS != va_stat) {
-            virgl_error("render slice data failed, err = 0x%x\n", va_stat);
-            err = -1;
-        }
+        if (queue_frame_buffer(codec, VASliceDataBufferType,
+                               sizes[i], buffers[i]))
+            return -1;
     }
 
-err:
-    vaDestroyBuffer(va_dpy, pic_param_buf);
-    vaDestroyBuffer(va_dpy, slice_param_buf);
-    for (i = 0; i < num_buffers; i++)
-        vaDestroyBuffer(va_dpy, slice_data_buf[i]);
-    free(slice_data_buf);
-
-    return err;
+    return 0;
 }
 
 static int h265_encode_render_sequence(
@@ -3176,31 +3389,67 @@ int virgl_video_encode_bitstream(struct virgl_video_codec *codec,
     return -1;
 }
 
-int virgl_video_end_frame(struct virgl_video_codec *codec,
-                          struct virgl_video_buffer *target)
+int virgl_video_submit_frame(struct virgl_video_codec *codec,
+                             struct virgl_video_buffer *target)
 {
     VAStatus va_stat;
 
     if (!va_dpy || !codec || !target)
         return -1;
 
+    if (render_frame_buffers(codec)) {
+        vaEndPicture(va_dpy, codec->va_ctx);
+        return -1;
+    }
+
     va_stat = vaEndPicture(va_dpy, codec->va_ctx);
     if (VA_STATUS_SUCCESS != va_stat) {
         virgl_error("end picture failed, err = 0x%x\n", va_stat);
         return -1;
     }
 
-    va_stat = vaSyncSurface(va_dpy, target->va_sfc);
+    return 0;
+}
+
+int virgl_video_sync_buffer(struct virgl_video_buffer *buffer)
+{
+    VAStatus va_stat;
+
+    if (!va_dpy || !buffer)
+        return -1;
+
+    va_stat = vaSyncSurface(va_dpy, buffer->va_sfc);
     if (VA_STATUS_SUCCESS != va_stat) {
         virgl_error("sync surface failed, err = 0x%x\n", va_stat);
         return -1;
     }
 
+    return 0;
+}
+
+void virgl_video_complete_frame(struct virgl_video_codec *codec,
+                                struct virgl_video_buffer *target)
+{
     if (codec->entrypoint != PIPE_VIDEO_ENTRYPOINT_ENCODE) {
         decode_completed(codec, target);
     } else {
         encode_completed(codec, target);
     }
+}
+
+bool virgl_video_codec_is_decoder(const struct virgl_video_codec *codec)
+{
+    return codec->entrypoint != PIPE_VIDEO_ENTRYPOINT_ENCODE;
+}
+
+int virgl_video_end_frame(struct virgl_video_codec *codec,
+                          struct virgl_video_buffer *target)
+{
+    if (virgl_video_submit_frame(codec, target) ||
+        virgl_video_sync_buffer(target))
+        return -1;
+
+    virgl_video_complete_frame(codec, target);
 
     return 0;
 }
@@ -130,6 +130,11 @@ int virgl_video_init(int drm_fd,
                      unsigned int flags);
 void virgl_video_destroy(void);
 
+/* The probed caps are stored in dir, when not NULL, and reused by the next
+ * processes with the same VA driver.  dir must outlive the video interface.
+ */
+void virgl_video_set_cache_dir(const char *dir);
+
 int virgl_video_fill_caps(union virgl_caps *caps);
 
 struct virgl_video_codec *virgl_video_create_codec(
@@ -159,5 +164,18 @@ int virgl_video_encode_bitstream(struct virgl_video_codec *codec,
 int virgl_video_end_frame(struct virgl_video_codec *codec,
                           struct virgl_video_buffer *target);
 
+/*
+ * virgl_video_end_frame in three steps, so that the frame can be waited for
+ * on another thread: virgl_video_sync_buffer can be called from any thread,
+ * virgl_video_complete_frame calls the callbacks on the thread of the GL
+ * context.
+ */
+int virgl_video_submit_frame(struct virgl_video_codec *codec,
+                             struct virgl_video_buffer *target);
+int virgl_video_sync_buffer(struct virgl_video_buffer *buffer);
+void virgl_video_complete_frame(struct virgl_video_codec *codec,
+                                struct virgl_video_buffer *target);
+bool virgl_video_codec_is_decoder(const struct virgl_video_codec *codec);
+
 #endif /* VIRGL_VIDEO_H */
 
@@ -25,23 +25,29 @@
 /* gallium blitter implementation in GL */
 /* for when we can't use glBlitFramebuffer */
 
+#include <stdatomic.h>
 #include <stdio.h>
 
+#include "c11/threads.h"
 #include "util/hash_table.h"
 #include "util/macros.h"
+#include "util/u_debug.h"
 #include "util/u_memory.h"
 #include "util/u_format.h"
 #include "util/u_pointer.h"
 #include "util/u_texture.h"
+#include "util/u_thread.h"
 
 #include "vrend_shader.h"
 #include "vrend_renderer.h"
 #include "vrend_blitter.h"
+#include "vrend_program_cache.h"
 
 #define XXH_INLINE_ALL
 #include "util/xxhash.h"
 
 #define DEST_SWIZZLE_SNIPPET_SIZE 64
+#define BLIT_SHADER_BUF_SIZE 4096
 
 #define BLIT_USE_GLES           (1 << 0)
 #define BLIT_USE_MSAA           (1 << 1)
@@ -62,10 +68,18 @@ struct vrend_blitter_ctx {
    virgl_gl_context gl_context;
    bool initialised;
    bool use_gles;
+   bool use_compute;
 
    GLuint vaoid;
 
+   /* blit_programs is shared with the prewarm thread */
    struct hash_table_u64 *blit_programs;
+   mtx_t programs_mutex;
+
+   thrd_t prewarm_thread;
+   virgl_gl_context prewarm_gl_context;
+   bool prewarm_running;
+   atomic_bool stop_prewarm;
 
    GLuint vs;
    GLuint fb_id;
@@ -100,11 +114,15 @@ struct PACKED blit_prog_key {
    uint8_t num_samples;
    struct {
       bool has_swizzle: 1;
-      enum virgl_formats src_format: 9;
+      /* the shader only depends on the return type of the source format */
+      enum tgsi_return_type src_ret: 3;
       enum pipe_swizzle swizzle1: 3;
       enum pipe_swizzle swizzle2: 3;
       enum pipe_swizzle swizzle3: 3;
       enum pipe_swizzle swizzle4: 3;
+      /* compute programs write an image of blit_image_formats[image_format] */
+      bool is_compute: 1;
+      unsigned image_format: 4;
    } texcol;
 };
 #pragma pack(pop)
@@ -119,10 +137,45 @@ prog_key_to_uint64( struct blit_prog_key prog_key )
       struct blit_prog_key prog_key;
       uint64_t u;
    } pu;
+   /* the key is smaller than the integer */
+   pu.u = 0;
    pu.prog_key = prog_key;
    return pu.u;
 }
 
+/* the image formats that both GL 4.3 and GLES 3.1 can store to */
+static const struct {
+   GLenum internalformat;
+   const char *qualifier;
+   enum tgsi_return_type ret;
+} blit_image_formats[] = {
+   { GL_RGBA8, "rgba8", TGSI_RETURN_TYPE_UNORM },
+   { GL_RGBA8_SNORM, "rgba8_snorm", TGSI_RETURN_TYPE_UNORM },
+   { GL_RGBA16F, "rgba16f", TGSI_RETURN_TYPE_UNORM },
+   { GL_RGBA32F, "rgba32f", TGSI_RETURN_TYPE_UNORM },
+   { GL_R32F, "r32f", TGSI_RETURN_TYPE_UNORM },
+   { GL_RGBA8UI, "rgba8ui", TGSI_RETURN_TYPE_UINT },
+   { GL_RGBA16UI, "rgba16ui", TGSI_RETURN_TYPE_UINT },
+   { GL_RGBA32UI, "rgba32ui", TGSI_RETURN_TYPE_UINT },
+   { GL_R32UI, "r32ui", TGSI_RETURN_TYPE_UINT },
+   { GL_RGBA8I, "rgba8i", TGSI_RETURN_TYPE_SINT },
+   { GL_RGBA16I, "rgba16i", TGSI_RETURN_TYPE_SINT },
+   { GL_RGBA32I, "rgba32i", TGSI_RETURN_TYPE_SINT },
+   { GL_R32I, "r32i", TGSI_RETURN_TYPE_SINT },
+};
+
+static_assert(ARRAY_SIZE(blit_image_formats) <= 16,
+              "the image format index needs to fit into struct blit_prog_key");
+
+static int blit_image_format_index(GLenum internalformat)
+{
+   for (unsigned i = 0; i < ARRAY_SIZE(blit_image_formats); i++) {
+      if (blit_image_formats[i].internalformat == internalformat)
+         return i;
+   }
+   return -1;
+}
+
 static GLint blit_shader_build_and_check(GLenum shader_type, const char *buf)
 {
    GLint param;
@@ -272,14 +325,14 @@ static void blit_get_swizzle(enum tgsi_texture_type tgsi_tex_target, unsigned fl
    }
 }
 
-static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
-                                      enum tgsi_texture_type tgsi_tex_target,
-                                      enum tgsi_return_type tgsi_ret,
-                                      const enum pipe_swizzle swizzle[4],
-                                      int nr_samples,
-                                      uint32_t flags)
+static void blit_write_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                    char shader_buf[BLIT_SHADER_BUF_SIZE],
+                                    enum tgsi_texture_type tgsi_tex_target,
+                                    enum tgsi_return_type tgsi_ret,
+                                    const enum pipe_swizzle swizzle[4],
+                                    int nr_samples,
+                                    uint32_t flags)
 {
-   char shader_buf[4096];
    struct blit_swizzle_and_type swizzle_and_type;
    unsigned swizzle_flags = 0;
    char dest_swizzle_snippet[DEST_SWIZZLE_SNIPPET_SIZE] = "texel";
@@ -309,7 +362,7 @@ static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
    bool needs_manual_srgb_encode = has_bit(flags, BLIT_MANUAL_SRGB_ENCODE);
 
    if (msaa)
-      snprintf(shader_buf, 4096, blit_ctx->use_gles ?
+      snprintf(shader_buf, BLIT_SHADER_BUF_SIZE, blit_ctx->use_gles ?
                                  (swizzle_and_type.is_array ? FS_TEXFETCH_COL_MSAA_ARRAY_GLES
                                                    : FS_TEXFETCH_COL_MSAA_GLES)
                                  : FS_TEXFETCH_COL_MSAA_GL,
@@ -322,7 +375,7 @@ static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
          vrend_shader_samplertypeconv(blit_ctx->use_gles, tgsi_tex_target),
          nr_samples, swizzle_and_type.type, swizzle_and_type.swizzle, dest_swizzle_snippet);
    else
-      snprintf(shader_buf, 4096, blit_ctx->use_gles ?
+      snprintf(shader_buf, BLIT_SHADER_BUF_SIZE, blit_ctx->use_gles ?
                                  (tgsi_tex_target == TGSI_TEXTURE_1D ?
                                     FS_TEXFETCH_COL_GLES_1D : FS_TEXFETCH_COL_GLES)
                                  : FS_TEXFETCH_COL_GL,
@@ -337,13 +390,12 @@ static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
 
    VREND_DEBUG(dbg_blit, NULL, "-- Blit FS color shader MSAA: %d -----------------\n"
                "%s\n---------------------------------------\n", msaa, shader_buf);
-
-   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf);
 }
 
-static GLuint blit_build_frag_depth(struct vrend_blitter_ctx *blit_ctx, enum tgsi_texture_type tgsi_tex_target, bool msaa)
+static void blit_write_frag_depth(struct vrend_blitter_ctx *blit_ctx,
+                                  char shader_buf[BLIT_SHADER_BUF_SIZE],
+                                  enum tgsi_texture_type tgsi_tex_target, bool msaa)
 {
-   char shader_buf[4096];
    struct blit_swizzle_and_type swizzle_and_type;
    unsigned flags = BLIT_USE_DEPTH;
 
@@ -353,54 +405,203 @@ static GLuint blit_build_frag_depth(struct vrend_blitter_ctx *blit_ctx, enum tgs
    blit_get_swizzle(tgsi_tex_target, flags, &swizzle_and_type);
 
    if (msaa)
-      snprintf(shader_buf, 4096, blit_ctx->use_gles ?
+      snprintf(shader_buf, BLIT_SHADER_BUF_SIZE, blit_ctx->use_gles ?
                                  (swizzle_and_type.is_array ?  FS_TEXFETCH_DS_MSAA_ARRAY_GLES :  FS_TEXFETCH_DS_MSAA_GLES)
                                  : FS_TEXFETCH_DS_MSAA_GL,
          vrend_shader_samplertypeconv(blit_ctx->use_gles, tgsi_tex_target), swizzle_and_type.type, swizzle_and_type.swizzle);
    else
-      snprintf(shader_buf, 4096, blit_ctx->use_gles ? FS_TEXFETCH_DS_GLES : FS_TEXFETCH_DS_GL,
+      snprintf(shader_buf, BLIT_SHADER_BUF_SIZE, blit_ctx->use_gles ? FS_TEXFETCH_DS_GLES : FS_TEXFETCH_DS_GL,
          vrend_shader_samplertypeconv(blit_ctx->use_gles, tgsi_tex_target), swizzle_and_type.swizzle);
 
    VREND_DEBUG(dbg_blit, NULL, "-- Blit FS depth shader MSAA: %d -----------------\n"
                "%s\n---------------------------------------\n", msaa, shader_buf);
+}
 
-   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf);
+static void blit_write_comp_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                    char shader_buf[BLIT_SHADER_BUF_SIZE],
+                                    enum tgsi_texture_type tgsi_tex_target,
+                                    enum tgsi_return_type tgsi_ret,
+                                    const enum pipe_swizzle swizzle[4],
+                                    unsigned image_format,
+                                    uint32_t flags)
+{
+   char dest_swizzle_snippet[DEST_SWIZZLE_SNIPPET_SIZE] = "texel";
+   enum tgsi_return_type image_ret = blit_image_formats[image_format].ret;
+   bool needs_manual_srgb_decode = has_bit(flags, BLIT_MANUAL_SRGB_DECODE);
+   bool needs_manual_srgb_encode = has_bit(flags, BLIT_MANUAL_SRGB_ENCODE);
+
+   create_dest_swizzle_snippet(swizzle, dest_swizzle_snippet);
+
+   snprintf(shader_buf, BLIT_SHADER_BUF_SIZE,
+            blit_ctx->use_gles ? CS_TEXFETCH_COL_GLES : CS_TEXFETCH_COL_GL,
+            vec4_type_for_tgsi_ret(tgsi_ret),
+            needs_manual_srgb_decode ? FS_FUNC_COL_SRGB_DECODE : "",
+            needs_manual_srgb_encode ? FS_FUNC_COL_SRGB_ENCODE : "",
+            needs_manual_srgb_decode ? "srgb_decode" : "",
+            needs_manual_srgb_encode ? "srgb_encode" : "",
+            vrend_shader_samplerreturnconv(tgsi_ret),
+            vrend_shader_samplertypeconv(blit_ctx->use_gles, tgsi_tex_target),
+            blit_image_formats[image_format].qualifier,
+            vrend_shader_samplerreturnconv(image_ret),
+            tgsi_tex_target == TGSI_TEXTURE_2D_ARRAY ? "vec3(tc, layer)" : "tc",
+            vec4_type_for_tgsi_ret(image_ret), dest_swizzle_snippet);
+
+   VREND_DEBUG(dbg_blit, NULL, "-- Blit CS color shader -----------------\n"
+               "%s\n---------------------------------------\n", shader_buf);
 }
 
-static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, enum pipe_texture_target pipe_tex_target, unsigned nr_samples)
+/* Links a program from the fragment or compute shader source, or loads it from
+ * the program binary cache, which is how the blit programs persist across runs.
+ * vs is only used with fragment shaders.
+ */
+static GLuint blit_link_program(struct vrend_blitter_ctx *blit_ctx, GLuint vs,
+                                uint64_t key, GLenum shader_type, const char *source)
 {
-   struct blit_prog_key key = {
-         .is_color = false,
-         .is_msaa = nr_samples > 1,
-         .num_samples = nr_samples,
-         .pipe_tex_target = pipe_tex_target,
+   struct vrend_program_cache_key cache_key;
+   const bool use_cache = vrend_program_cache_enabled();
+   const bool use_vs = shader_type == GL_FRAGMENT_SHADER;
+   GLuint prog_id = glCreateProgram();
+
+   if (use_cache) {
+      vrend_program_cache_key_init(&cache_key);
+      vrend_program_cache_key_append(&cache_key, "blit", 4);
+      vrend_program_cache_key_append(&cache_key, &key, sizeof(key));
+      if (use_vs) {
+         const char *vs_source = blit_ctx->use_gles ? VS_PASSTHROUGH_GLES
+                                                    : VS_PASSTHROUGH_GL;
+         vrend_program_cache_key_append(&cache_key, vs_source, strlen(vs_source));
+      }
+      vrend_program_cache_key_append(&cache_key, source, strlen(source));
+      if (vrend_program_cache_load(&cache_key, prog_id))
+         return prog_id;
+
+      glProgramParameteri(prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+   }
+
+   GLuint shader_id = blit_shader_build_and_check(shader_type, source);
+   if (!shader_id) {
+      glDeleteProgram(prog_id);
+      return 0;
+   }
+
+   if (use_vs)
+      glAttachShader(prog_id, vs);
+   glAttachShader(prog_id, shader_id);
+   bool linked = blit_shader_link_and_check(prog_id);
+   glDeleteShader(shader_id);
+   if (!linked)
+      return 0;
+
+   if (use_cache)
+      vrend_program_cache_store(&cache_key, prog_id);
+   return prog_id;
+}
+
+static GLuint blit_create_program(struct vrend_blitter_ctx *blit_ctx, GLuint vs,
+                                  struct blit_prog_key key)
+{
+   char shader_buf[BLIT_SHADER_BUF_SIZE];
+   enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(key.pipe_tex_target,
+                                                               key.num_samples);
+
+   if (key.is_color) {
+      enum pipe_swizzle swizzle[4] = {
+         PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_W
       };
+      if (key.texcol.has_swizzle) {
+         swizzle[0] = key.texcol.swizzle1;
+         swizzle[1] = key.texcol.swizzle2;
+         swizzle[2] = key.texcol.swizzle3;
+         swizzle[3] = key.texcol.swizzle4;
+      }
 
-      void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
-      GLuint prog_id;
-      if (shader) {
-         prog_id = pointer_to_uintptr(shader);
-      } else {
-         prog_id = glCreateProgram();
-         glAttachShader(prog_id, blit_ctx->vs);
-         enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, key.num_samples);
-         GLuint fs_id = blit_build_frag_depth(blit_ctx, tgsi_tex, key.is_msaa);
-         glAttachShader(prog_id, fs_id);
-         if(!blit_shader_link_and_check(prog_id))
-            return 0;
-
-         glDeleteShader(fs_id);
-         _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), uintptr_to_pointer(prog_id));
+      enum tgsi_return_type tgsi_ret = key.texcol.src_ret;
+      int msaa_samples = 0;
+      if (key.is_msaa)
+         msaa_samples = tgsi_ret == TGSI_RETURN_TYPE_UNORM ? key.num_samples : 1;
+      uint32_t flags = 0;
+      flags |= key.manual_srgb_decode ? BLIT_MANUAL_SRGB_DECODE : 0;
+      flags |= key.manual_srgb_encode ? BLIT_MANUAL_SRGB_ENCODE : 0;
+
+      if (key.texcol.is_compute) {
+         blit_write_comp_tex_col(blit_ctx, shader_buf, tgsi_tex, tgsi_ret, swizzle,
+                                 key.texcol.image_format, flags);
+         return blit_link_program(blit_ctx, 0, prog_key_to_uint64(key),
+                                  GL_COMPUTE_SHADER, shader_buf);
       }
+
+      blit_write_frag_tex_col(blit_ctx, shader_buf, tgsi_tex, tgsi_ret, swizzle,
+                              msaa_samples, flags);
+   } else {
+      blit_write_frag_depth(blit_ctx, shader_buf, tgsi_tex, key.is_msaa);
+   }
+
+   return blit_link_program(blit_ctx, vs, prog_key_to_uint64(key),
+                            GL_FRAGMENT_SHADER, shader_buf);
+}
+
+static GLuint blit_lookup_program(struct vrend_blitter_ctx *blit_ctx,
+                                  struct blit_prog_key key)
+{
+   mtx_lock(&blit_ctx->programs_mutex);
+   void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs,
+                                              prog_key_to_uint64(key));
+   mtx_unlock(&blit_ctx->programs_mutex);
+
+   return pointer_to_uintptr(shader);
+}
+
+/* returns the program in the table, which is not prog_id when another thread
+ * got there first */
+static GLuint blit_insert_program(struct vrend_blitter_ctx *blit_ctx,
+                                  struct blit_prog_key key, GLuint prog_id)
+{
+   mtx_lock(&blit_ctx->programs_mutex);
+   void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs,
+                                              prog_key_to_uint64(key));
+   if (shader) {
+      glDeleteProgram(prog_id);
+      prog_id = pointer_to_uintptr(shader);
+   } else {
+      _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key),
+                                  uintptr_to_pointer(prog_id));
+   }
+   mtx_unlock(&blit_ctx->programs_mutex);
+
+   return prog_id;
+}
+
+static GLuint blit_get_program(struct vrend_blitter_ctx *blit_ctx,
+                               struct blit_prog_key key)
+{
+   GLuint prog_id = blit_lookup_program(blit_ctx, key);
+   if (prog_id)
       return prog_id;
+
+   prog_id = blit_create_program(blit_ctx, blit_ctx->vs, key);
+   if (!prog_id)
+      return 0;
+
+   return blit_insert_program(blit_ctx, key, prog_id);
 }
 
-static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
-                                       enum pipe_texture_target pipe_tex_target,
-                                       unsigned nr_samples,
-                                       const struct vrend_format_table *src_entry,
-                                       const enum pipe_swizzle swizzle[static 4],
-                                       uint32_t flags)
+static struct blit_prog_key blit_depth_prog_key(enum pipe_texture_target pipe_tex_target,
+                                                unsigned nr_samples)
+{
+   struct blit_prog_key key = {
+      .is_color = false,
+      .is_msaa = nr_samples > 1,
+      .num_samples = nr_samples,
+      .pipe_tex_target = pipe_tex_target,
+   };
+   return key;
+}
+
+static struct blit_prog_key blit_col_prog_key(enum pipe_texture_target pipe_tex_target,
+                                              unsigned nr_samples,
+                                              enum tgsi_return_type tgsi_ret,
+                                              const enum pipe_swizzle swizzle[static 4],
+                                              uint32_t flags)
 {
    bool needs_swizzle = false;
    for (unsigned i = 0; i < 4; ++i) {
@@ -419,7 +620,7 @@ static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
       .pipe_tex_target  = pipe_tex_target
    };
 
-   key.texcol.src_format = src_entry->format;
+   key.texcol.src_ret = tgsi_ret;
    key.texcol.has_swizzle = needs_swizzle;
    if (key.texcol.has_swizzle) {
       key.texcol.swizzle1 = swizzle[0];
@@ -427,30 +628,111 @@ static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
       key.texcol.swizzle3 = swizzle[2];
       key.texcol.swizzle4 = swizzle[3];
    }
+   return key;
+}
 
-   GLuint prog_id = 0;
-   void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
+static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, enum pipe_texture_target pipe_tex_target, unsigned nr_samples)
+{
+   return blit_get_program(blit_ctx, blit_depth_prog_key(pipe_tex_target, nr_samples));
+}
 
-   if (shader) {
-      prog_id = pointer_to_uintptr(shader);
-   } else {
-      prog_id = glCreateProgram();
-      glAttachShader(prog_id, blit_ctx->vs);
-      enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, key.num_samples);
-      enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
-      int msaa_samples = nr_samples > 1 ? (tgsi_ret == TGSI_RETURN_TYPE_UNORM ? nr_samples : 1) : 0;
+static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                       enum pipe_texture_target pipe_tex_target,
+                                       unsigned nr_samples,
+                                       const struct vrend_format_table *src_entry,
+                                       const enum pipe_swizzle swizzle[static 4],
+                                       uint32_t flags)
+{
+   enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   return blit_get_program(blit_ctx, blit_col_prog_key(pipe_tex_target, nr_samples,
+                                                       tgsi_ret, swizzle, flags));
+}
+
+/* Compiles the programs of the most common blits on a shared context, so that
+ * the first blits of a guest don't stall on the compiler.
+ */
+static int thread_blit_prewarm(void *arg)
+{
+   static const enum pipe_texture_target targets[] = {
+      PIPE_TEXTURE_2D, PIPE_TEXTURE_2D_ARRAY,
+   };
+   static const enum tgsi_return_type rets[] = {
+      TGSI_RETURN_TYPE_UNORM, TGSI_RETURN_TYPE_UINT, TGSI_RETURN_TYPE_SINT,
+   };
+   static const enum pipe_swizzle swizzles[][4] = {
+      { PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_W },
+      /* BGRA emulation */
+      { PIPE_SWIZZLE_Z, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_X, PIPE_SWIZZLE_W },
+      /* RGBX formats */
+      { PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_1 },
+   };
+   struct vrend_blitter_ctx *blit_ctx = arg;
+   struct blit_prog_key keys[ARRAY_SIZE(targets) *
+                             (1 + ARRAY_SIZE(rets) + ARRAY_SIZE(swizzles) - 1)];
+   unsigned num_keys = 0;
 
-      GLuint fs_id = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret,
-                                             swizzle, msaa_samples, flags);
-      glAttachShader(prog_id, fs_id);
-      if(!blit_shader_link_and_check(prog_id))
-         return 0;
+   u_thread_setname("vrend-blit");
 
-      glDeleteShader(fs_id);
-      _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), uintptr_to_pointer(prog_id));
+   for (unsigned t = 0; t < ARRAY_SIZE(targets); t++) {
+      keys[num_keys++] = blit_depth_prog_key(targets[t], 0);
+      for (unsigned r = 0; r < ARRAY_SIZE(rets); r++) {
+         keys[num_keys++] = blit_col_prog_key(targets[t], 0, rets[r], swizzles[0], 0);
+      }
+      for (unsigned s = 1; s < ARRAY_SIZE(swizzles); s++) {
+         keys[num_keys++] = blit_col_prog_key(targets[t], 0, TGSI_RETURN_TYPE_UNORM,
+                                              swizzles[s], 0);
+      }
    }
 
-   return prog_id;
+   vrend_clicbs->make_current_surfaceless(blit_ctx->prewarm_gl_context);
+
+   GLuint vs = blit_shader_build_and_check(GL_VERTEX_SHADER,
+        blit_ctx->use_gles ? VS_PASSTHROUGH_GLES : VS_PASSTHROUGH_GL);
+
+   for (unsigned i = 0; vs && i < num_keys; i++) {
+      if (atomic_load(&blit_ctx->stop_prewarm))
+         break;
+      if (blit_lookup_program(blit_ctx, keys[i]))
+         continue;
+
+      GLuint prog_id = blit_create_program(blit_ctx, vs, keys[i]);
+      if (!prog_id)
+         continue;
+
+      /* the program must be complete before the blit context uses it */
+      glFinish();
+      blit_insert_program(blit_ctx, keys[i], prog_id);
+   }
+
+   glDeleteShader(vs);
+
+   vrend_clicbs->make_current_surfaceless(NULL);
+   vrend_clicbs->destroy_gl_context_surfaceless(blit_ctx->prewarm_gl_context);
+   blit_ctx->prewarm_gl_context = NULL;
+   return 0;
+}
+
+static void vrend_blitter_start_prewarm(struct vrend_blitter_ctx *blit_ctx,
+                                        const struct virgl_gl_ctx_param *blit_ctx_params)
+{
+   struct virgl_gl_ctx_param ctx_params = *blit_ctx_params;
+
+   if (!debug_get_bool_option("VREND_BLIT_PREWARM", true))
+      return;
+
+   blit_ctx->prewarm_gl_context =
+      vrend_clicbs->create_gl_context_surfaceless(0, &ctx_params);
+   if (!blit_ctx->prewarm_gl_context)
+      return;
+
+   atomic_init(&blit_ctx->stop_prewarm, false);
+   blit_ctx->prewarm_thread = u_thread_create(thread_blit_prewarm, blit_ctx);
+   if (!blit_ctx->prewarm_thread) {
+      vrend_clicbs->destroy_gl_context_surfaceless(blit_ctx->prewarm_gl_context);
+      blit_ctx->prewarm_gl_context = NULL;
+      return;
+   }
+   blit_ctx->prewarm_running = true;
 }
 
 static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
@@ -463,6 +745,7 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
    }
 
    vrend_blit_ctx.blit_programs = _mesa_hash_table_u64_create(NULL);
+   mtx_init(&blit_ctx->programs_mutex, mtx_plain);
 
    blit_ctx->use_gles = epoxy_is_desktop_gl() == 0;
    ctx_params.shared = true;
@@ -481,6 +764,8 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
       abort();
    }
 
+   vrend_blitter_start_prewarm(blit_ctx, &ctx_params);
+
    vrend_sync_make_current(blit_ctx->gl_context);
    glGenVertexArrays(1, &blit_ctx->vaoid);
    glGenFramebuffers(1, &blit_ctx->fb_id);
@@ -500,6 +785,9 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
    if (!blit_ctx->use_gles)
       glEnable(GL_FRAMEBUFFER_SRGB);
 
+   blit_ctx->use_compute = epoxy_gl_version() >= (blit_ctx->use_gles ? 31 : 43) &&
+                           debug_get_bool_option("VREND_BLIT_COMPUTE", true);
+
    blit_ctx->initialised = true;
 }
 
@@ -697,19 +985,15 @@ static void calc_dst_deltas_from_src(const struct pipe_blit_info *info,
    dst1_delta->y = src1_delta->y * scale_y;
 }
 
-static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
-                               const struct pipe_blit_info *info,
+static void blitter_get_points(const struct pipe_blit_info *info,
                                struct vrend_resource *src_res,
-                               struct vrend_resource *dst_res,
                                struct blit_point *src0,
-                               struct blit_point *src1)
+                               struct blit_point *src1,
+                               struct blit_point *dst0,
+                               struct blit_point *dst1)
 {
-   struct blit_point dst0, dst1;
    struct blit_point src0_delta, src1_delta, dst0_delta, dst1_delta;
 
-   blit_ctx->dst_width = u_minify(dst_res->base.width0, info->dst.level);
-   blit_ctx->dst_height = u_minify(dst_res->base.height0, info->dst.level);
-
    /* Calculate src and dst points taking deltas into account */
    calc_src_deltas_for_bounds(src_res, info, &src0_delta, &src1_delta);
    calc_dst_deltas_from_src(info, &src0_delta, &src1_delta, &dst0_delta, &dst1_delta);
@@ -719,14 +1003,29 @@ static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
    src1->x = info->src.box.x + info->src.box.width + src1_delta.x;
    src1->y = info->src.box.y + info->src.box.height + src1_delta.y;
 
-   dst0.x = info->dst.box.x + dst0_delta.x;
-   dst0.y = info->dst.box.y + dst0_delta.y;
-   dst1.x = info->dst.box.x + info->dst.box.width + dst1_delta.x;
-   dst1.y = info->dst.box.y + info->dst.box.height + dst1_delta.y;
+   dst0->x = info->dst.box.x + dst0_delta.x;
+   dst0->y = info->dst.box.y + dst0_delta.y;
+   dst1->x = info->dst.box.x + info->dst.box.width + dst1_delta.x;
+   dst1->y = info->dst.box.y + info->dst.box.height + dst1_delta.y;
 
    VREND_DEBUG(dbg_blit, NULL, "Blitter src:[%3d, %3d] - [%3d, %3d] to dst:[%3d, %3d] - [%3d, %3d]\n",
                src0->x, src0->y, src1->x, src1->y,
-               dst0.x, dst0.y, dst1.x, dst1.y);
+               dst0->x, dst0->y, dst1->x, dst1->y);
+}
+
+static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
+                               const struct pipe_blit_info *info,
+                               struct vrend_resource *src_res,
+                               struct vrend_resource *dst_res,
+                               struct blit_point *src0,
+                               struct blit_point *src1)
+{
+   struct blit_point dst0, dst1;
+
+   blit_ctx->dst_width = u_minify(dst_res->base.width0, info->dst.level);
+   blit_ctx->dst_height = u_minify(dst_res->base.height0, info->dst.level);
+
+   blitter_get_points(info, src_res, src0, src1, &dst0, &dst1);
 
    blitter_set_rectangle(blit_ctx, dst0.x, dst0.y, dst1.x, dst1.y);
 }
@@ -786,6 +1085,116 @@ static void vrend_set_vertex_param(GLuint prog_id)
 }
 
 /* implement blitting using OpenGL. */
+/* The compute path writes the destination through an image, so there is no
+ * vertex setup and no framebuffer to validate. It only handles single sampled
+ * 2D and 2D array color blits to formats that can be stored to, and returns
+ * false for everything else.
+ */
+static bool blit_compute(struct vrend_blitter_ctx *blit_ctx,
+                         struct vrend_resource *src_res,
+                         struct vrend_resource *dst_res,
+                         const struct vrend_blit_info *info)
+{
+   struct blit_point src0, src1, dst0, dst1;
+
+   if (!blit_ctx->use_compute)
+      return false;
+
+   if (src_res->base.nr_samples > 1 || dst_res->base.nr_samples > 1)
+      return false;
+   if (src_res->base.target != PIPE_TEXTURE_2D &&
+       src_res->base.target != PIPE_TEXTURE_2D_ARRAY)
+      return false;
+   if (dst_res->target != GL_TEXTURE_2D && dst_res->target != GL_TEXTURE_2D_ARRAY)
+      return false;
+
+   /* the view, when there is one, has the format of the blit */
+   enum virgl_formats dst_format = info->dst_view != dst_res->gl_id ?
+                                   info->b.dst.format : dst_res->base.format;
+   const struct vrend_format_table *dst_entry = vrend_get_format_table_entry(dst_format);
+   const int image_format = blit_image_format_index(dst_entry->internalformat);
+   if (image_format < 0)
+      return false;
+
+   const struct vrend_format_table *src_entry =
+      vrend_get_format_table_entry(info->b.src.format);
+   const enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   if ((tgsi_ret == TGSI_RETURN_TYPE_UNORM) !=
+       (blit_image_formats[image_format].ret == TGSI_RETURN_TYPE_UNORM))
+      return false;
+
+   blitter_get_points(&info->b, src_res, &src0, &src1, &dst0, &dst1);
+   if (dst0.x == dst1.x || dst0.y == dst1.y)
+      return true;
+
+   int x0 = MIN2(dst0.x, dst1.x), x1 = MAX2(dst0.x, dst1.x);
+   int y0 = MIN2(dst0.y, dst1.y), y1 = MAX2(dst0.y, dst1.y);
+   if (info->b.scissor_enable) {
+      x0 = MAX2(x0, (int)info->b.scissor.minx);
+      y0 = MAX2(y0, (int)info->b.scissor.miny);
+      x1 = MIN2(x1, (int)info->b.scissor.maxx);
+      y1 = MIN2(y1, (int)info->b.scissor.maxy);
+   }
+   x0 = MAX2(x0, 0);
+   y0 = MAX2(y0, 0);
+   x1 = MIN2(x1, (int)u_minify(dst_res->base.width0, info->b.dst.level));
+   y1 = MIN2(y1, (int)u_minify(dst_res->base.height0, info->b.dst.level));
+   if (x0 >= x1 || y0 >= y1)
+      return true;
+
+   uint32_t flags = 0;
+   flags |= info->needs_manual_srgb_decode ? BLIT_MANUAL_SRGB_DECODE : 0;
+   flags |= info->needs_manual_srgb_encode ? BLIT_MANUAL_SRGB_ENCODE : 0;
+   struct blit_prog_key key = blit_col_prog_key(src_res->base.target, 0, tgsi_ret,
+                                                info->swizzle, flags);
+   key.texcol.is_compute = true;
+   key.texcol.image_format = image_format;
+
+   GLuint prog_id = blit_get_program(blit_ctx, key);
+   if (!prog_id)
+      return false;
+
+   VREND_DEBUG(dbg_blit, NULL, "BLIT: using the compute path\n");
+
+   glUseProgram(prog_id);
+   glBindTexture(src_res->target, info->src_view);
+   vrend_set_tex_param(src_res, &info->b,
+                       info->has_texture_srgb_decode &&
+                       !info->needs_manual_srgb_decode);
+
+   const float src_width = u_minify(src_res->base.width0, info->b.src.level);
+   const float src_height = u_minify(src_res->base.height0, info->b.src.level);
+   glUniform4i(glGetUniformLocation(prog_id, "dst_rect"), x0, y0, x1, y1);
+   glUniform2f(glGetUniformLocation(prog_id, "dst_origin"), dst0.x, dst0.y);
+   glUniform4f(glGetUniformLocation(prog_id, "src_map"),
+               src0.x / src_width, src0.y / src_height,
+               (src1.x - src0.x) / (float)(dst1.x - dst0.x) / src_width,
+               (src1.y - src0.y) / (float)(dst1.y - dst0.y) / src_height);
+   GLint layer_loc = glGetUniformLocation(prog_id, "layer");
+
+   for (int dst_z = 0; dst_z < info->b.dst.box.depth; dst_z++) {
+      float dst2src_scale = info->b.src.box.depth / (float)info->b.dst.box.depth;
+      float dst_offset = ((info->b.src.box.depth - 1) -
+                          (info->b.dst.box.depth - 1) * dst2src_scale) * 0.5;
+      float src_z = (dst_z + dst_offset) * dst2src_scale;
+      GLint layer = dst_res->target == GL_TEXTURE_2D_ARRAY ?
+                    info->b.dst.box.z + dst_z : 0;
+
+      glUniform1f(layer_loc, info->b.src.box.z + src_z);
+      glBindImageTexture(0, info->dst_view, info->b.dst.level, GL_FALSE, layer,
+                         GL_WRITE_ONLY, dst_entry->internalformat);
+      glDispatchCompute(DIV_ROUND_UP(x1 - x0, 8), DIV_ROUND_UP(y1 - y0, 8), 1);
+   }
+
+   /* the destination is used by the other contexts after the blit */
+   glMemoryBarrier(GL_ALL_BARRIER_BITS);
+
+   glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+   glUseProgram(0);
+   glBindTexture(src_res->target, 0);
+   return true;
+}
+
 void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
                             struct vrend_resource *src_res,
                             struct vrend_resource *dst_res,
@@ -806,6 +1215,10 @@ void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
          (info->b.mask & PIPE_MASK_Z);
 
    vrend_renderer_init_blit_ctx(blit_ctx);
+
+   if (!blit_depth && blit_compute(blit_ctx, src_res, dst_res, info))
+      return;
+
    blitter_set_points(blit_ctx, &info->b, src_res, dst_res, &src0, &src1);
 
    GLuint prog_id;
@@ -913,9 +1326,16 @@ static void delete_program_cb(struct hash_entry *entry)
 
 void vrend_blitter_fini(void)
 {
+   if (vrend_blit_ctx.prewarm_running) {
+      atomic_store(&vrend_blit_ctx.stop_prewarm, true);
+      thrd_join(vrend_blit_ctx.prewarm_thread, NULL);
+   }
+
    vrend_blit_ctx.initialised = false;
-   if (vrend_blit_ctx.blit_programs)
+   if (vrend_blit_ctx.blit_programs) {
       _mesa_hash_table_u64_destroy(vrend_blit_ctx.blit_programs, delete_program_cb);
+      mtx_destroy(&vrend_blit_ctx.programs_mutex);
+   }
    vrend_clicbs->destroy_gl_context(vrend_blit_ctx.gl_context);
    memset(&vrend_blit_ctx, 0, sizeof(vrend_blit_ctx));
 }
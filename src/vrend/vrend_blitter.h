@@ -148,6 +148,42 @@
 #define FS_TEXFETCH_COL_MSAA_GLES FS_HEADER_GLES FS_TEXFETCH_COL_MSAA_BODY
 #define FS_TEXFETCH_COL_MSAA_ARRAY_GLES FS_HEADER_GLES_MS_ARRAY FS_TEXFETCH_COL_MSAA_BODY
 
+#define CS_HEADER_GL                            \
+   "#version 430\n"                             \
+   "// Blitter\n"                               \
+
+#define CS_HEADER_GLES                          \
+   "#version 310 es\n"                          \
+   "// Blitter\n"                               \
+   "precision highp float;\n"                   \
+
+/* dst_rect is the written region, a dst pixel center maps to the src
+ * coordinate src_map.xy + (pos + 0.5 - dst_origin) * src_map.zw */
+#define CS_TEXFETCH_COL_BODY                                               \
+   "layout(local_size_x = 8, local_size_y = 8) in;\n"                     \
+   "#define cvec4 %s\n"                                                   \
+   "%s\n" /* conditional decode() */                                      \
+   "%s\n" /* conditional encode() */                                      \
+   "#define decode %s\n"                                                  \
+   "#define encode %s\n"                                                  \
+   "uniform mediump %csampler%s samp;\n"                                  \
+   "layout(%s, binding = 0) writeonly uniform highp %cimage2D img;\n"     \
+   "uniform ivec4 dst_rect;\n"                                            \
+   "uniform vec2 dst_origin;\n"                                           \
+   "uniform vec4 src_map;\n"                                              \
+   "uniform float layer;\n"                                               \
+   "void main() {\n"                                                      \
+   "   ivec2 pos = dst_rect.xy + ivec2(gl_GlobalInvocationID.xy);\n"      \
+   "   if (any(greaterThanEqual(pos, dst_rect.zw)))\n"                    \
+   "      return;\n"                                                      \
+   "   vec2 tc = src_map.xy + (vec2(pos) + 0.5 - dst_origin) * src_map.zw;\n" \
+   "   cvec4 texel = decode(cvec4(texture(samp, %s)));\n"                 \
+   "   imageStore(img, pos, %s(encode(cvec4(%s))));\n"                    \
+   "}\n"
+
+#define CS_TEXFETCH_COL_GL CS_HEADER_GL CS_TEXFETCH_COL_BODY
+#define CS_TEXFETCH_COL_GLES CS_HEADER_GLES CS_TEXFETCH_COL_BODY
+
 #define FS_TEXFETCH_DS_BODY                             \
    "uniform mediump sampler%s samp;\n"                          \
    "in vec4 tc;\n"                                      \
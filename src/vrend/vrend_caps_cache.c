@@ -0,0 +1,259 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_caps_cache.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epoxy/gl.h>
+
+#include "util/macros.h"
+#include "util/u_debug.h"
+#include "virgl_util.h"
+
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+static struct {
+   bool initialized;
+   char *dir;
+   uint64_t key;
+
+   struct {
+      void *data;
+      size_t size;
+   } entries[VREND_CAPS_CACHE_COUNT];
+} caps_cache;
+
+static uint64_t caps_cache_hash_string(const char *str, uint64_t seed)
+{
+   if (!str)
+      return seed;
+   return XXH64(str, strlen(str), seed);
+}
+
+static void caps_cache_keep(enum vrend_caps_cache_entry entry, const void *data, size_t size)
+{
+   void *copy = malloc(size);
+   if (!copy)
+      return;
+   memcpy(copy, data, size);
+
+   free(caps_cache.entries[entry].data);
+   caps_cache.entries[entry].data = copy;
+   caps_cache.entries[entry].size = size;
+}
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define CAPS_CACHE_MAGIC 0x31435643 /* "CVC1" */
+
+static const char *const caps_cache_suffixes[VREND_CAPS_CACHE_COUNT] = {
+   [VREND_CAPS_CACHE_FORMATS] = ".formats",
+   [VREND_CAPS_CACHE_CAPS] = ".caps",
+};
+
+struct caps_cache_header {
+   uint32_t magic;
+   uint32_t entry;
+   uint64_t key;
+   uint64_t size;
+};
+
+static uint64_t caps_cache_hash_environment(uint64_t seed)
+{
+   for (char **env = environ; env && *env; env++) {
+      if (!strncmp(*env, "VREND_", 6) || !strncmp(*env, "VIRGL_", 6))
+         seed = caps_cache_hash_string(*env, seed);
+   }
+   return seed;
+}
+
+static void caps_cache_entry_path(char *path, size_t len, enum vrend_caps_cache_entry entry)
+{
+   snprintf(path, len, "%s/%016" PRIx64 "%s", caps_cache.dir, caps_cache.key,
+            caps_cache_suffixes[entry]);
+}
+
+static bool caps_cache_read_full(int fd, void *data, size_t size)
+{
+   uint8_t *ptr = data;
+   while (size) {
+      ssize_t ret = read(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+static bool caps_cache_write_full(int fd, const void *data, size_t size)
+{
+   const uint8_t *ptr = data;
+   while (size) {
+      ssize_t ret = write(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+static bool caps_cache_load_file(enum vrend_caps_cache_entry entry, void *data, size_t size)
+{
+   struct caps_cache_header hdr;
+   char path[PATH_MAX];
+   bool ok = false;
+
+   caps_cache_entry_path(path, sizeof(path), entry);
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return false;
+
+   if (caps_cache_read_full(fd, &hdr, sizeof(hdr)) &&
+       hdr.magic == CAPS_CACHE_MAGIC && hdr.entry == entry &&
+       hdr.key == caps_cache.key && hdr.size == size)
+      ok = caps_cache_read_full(fd, data, size);
+
+   close(fd);
+   return ok;
+}
+
+static void caps_cache_store_file(enum vrend_caps_cache_entry entry, const void *data,
+                                  size_t size)
+{
+   const struct caps_cache_header hdr = {
+      .magic = CAPS_CACHE_MAGIC,
+      .entry = entry,
+      .key = caps_cache.key,
+      .size = size,
+   };
+   char path[PATH_MAX], tmp_path[PATH_MAX];
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", caps_cache.dir);
+   int fd = mkstemp(tmp_path);
+   if (fd < 0)
+      return;
+
+   bool ok = caps_cache_write_full(fd, &hdr, sizeof(hdr)) &&
+             caps_cache_write_full(fd, data, size);
+   close(fd);
+
+   /* rename is atomic, concurrent readers see either no file or a full one */
+   caps_cache_entry_path(path, sizeof(path), entry);
+   if (!ok || rename(tmp_path, path))
+      unlink(tmp_path);
+}
+
+static void caps_cache_init_dir(void)
+{
+   const char *dir = debug_get_option("VREND_CAPS_CACHE_DIR", NULL);
+
+   if (!dir || !*dir)
+      return;
+
+   if (mkdir(dir, 0755) && errno != EEXIST) {
+      virgl_warn("Unable to create caps cache directory %s: %s\n", dir, strerror(errno));
+      return;
+   }
+
+   caps_cache.dir = strdup(dir);
+   if (caps_cache.dir)
+      virgl_info("Caps cache enabled in %s\n", caps_cache.dir);
+}
+
+#else /* _WIN32 */
+
+static uint64_t caps_cache_hash_environment(uint64_t seed)
+{
+   return seed;
+}
+
+static bool caps_cache_load_file(UNUSED enum vrend_caps_cache_entry entry,
+                                 UNUSED void *data, UNUSED size_t size)
+{
+   return false;
+}
+
+static void caps_cache_store_file(UNUSED enum vrend_caps_cache_entry entry,
+                                  UNUSED const void *data, UNUSED size_t size)
+{
+}
+
+static void caps_cache_init_dir(void)
+{
+}
+
+#endif /* _WIN32 */
+
+void vrend_caps_cache_init(uint32_t flags, const void *features, size_t features_size)
+{
+   vrend_caps_cache_fini();
+
+   uint64_t key = caps_cache_hash_string((const char *)glGetString(GL_VENDOR), 0);
+   key = caps_cache_hash_string((const char *)glGetString(GL_RENDERER), key);
+   key = caps_cache_hash_string((const char *)glGetString(GL_VERSION), key);
+   key = XXH64(&flags, sizeof(flags), key);
+   key = XXH64(features, features_size, key);
+   caps_cache.key = caps_cache_hash_environment(key);
+
+   caps_cache_init_dir();
+   caps_cache.initialized = true;
+}
+
+void vrend_caps_cache_fini(void)
+{
+   for (uint32_t i = 0; i < VREND_CAPS_CACHE_COUNT; i++)
+      free(caps_cache.entries[i].data);
+   free(caps_cache.dir);
+   memset(&caps_cache, 0, sizeof(caps_cache));
+}
+
+bool vrend_caps_cache_load(enum vrend_caps_cache_entry entry, void *data, size_t size)
+{
+   if (!caps_cache.initialized)
+      return false;
+
+   if (caps_cache.entries[entry].data) {
+      if (caps_cache.entries[entry].size != size)
+         return false;
+      memcpy(data, caps_cache.entries[entry].data, size);
+      return true;
+   }
+
+   if (!caps_cache.dir || !caps_cache_load_file(entry, data, size))
+      return false;
+
+   caps_cache_keep(entry, data, size);
+   return true;
+}
+
+void vrend_caps_cache_store(enum vrend_caps_cache_entry entry, const void *data,
+                            size_t size)
+{
+   if (!caps_cache.initialized)
+      return;
+
+   caps_cache_keep(entry, data, size);
+   if (caps_cache.dir)
+      caps_cache_store_file(entry, data, size);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_CAPS_CACHE_H
+#define VREND_CAPS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cache of what vrend probes from the GL driver at init and caps time: the
+ * format table and the filled capset.
+ *
+ * The entries are always kept in memory for the lifetime of the renderer.
+ * They are also stored on disk when VREND_CAPS_CACHE_DIR points at a
+ * writable directory, so that later processes on the same driver, such as
+ * render server workers or vtest servers, skip the probing altogether.
+ *
+ * Entries are keyed by GL_VENDOR, GL_RENDERER and GL_VERSION, the renderer
+ * flags, the detected features and the VREND_ and VIRGL_ environment
+ * options, since those all change the outcome of the probes.
+ */
+
+enum vrend_caps_cache_entry {
+   VREND_CAPS_CACHE_FORMATS,
+   VREND_CAPS_CACHE_CAPS,
+   VREND_CAPS_CACHE_COUNT,
+};
+
+/* Must be called with a current GL context. */
+void vrend_caps_cache_init(uint32_t flags, const void *features, size_t features_size);
+
+void vrend_caps_cache_fini(void);
+
+/* Copies the entry into data and returns true when it is cached with the
+ * same size. */
+bool vrend_caps_cache_load(enum vrend_caps_cache_entry entry, void *data, size_t size);
+
+void vrend_caps_cache_store(enum vrend_caps_cache_entry entry, const void *data,
+                            size_t size);
+
+#endif
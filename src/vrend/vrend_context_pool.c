@@ -0,0 +1,138 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_context_pool.h"
+
+#include <string.h>
+
+#include "c11/threads.h"
+#include "util/u_debug.h"
+#include "util/u_thread.h"
+#include "virgl_util.h"
+
+#define CONTEXT_POOL_MAX_SIZE 16
+
+static struct {
+   bool enabled;
+   struct virgl_gl_ctx_param params;
+   long size;
+
+   thrd_t thread;
+   /* current on the thread, the new contexts share its objects */
+   virgl_gl_context thread_gl_context;
+   mtx_t mutex;
+   cnd_t cond;
+   bool stop;
+   virgl_gl_context contexts[CONTEXT_POOL_MAX_SIZE];
+   long count;
+} context_pool;
+
+static int thread_context_pool(UNUSED void *arg)
+{
+   u_thread_setname("vrend-ctx-pool");
+   vrend_clicbs->make_current_surfaceless(context_pool.thread_gl_context);
+
+   mtx_lock(&context_pool.mutex);
+   while (!context_pool.stop) {
+      if (context_pool.count >= context_pool.size) {
+         cnd_wait(&context_pool.cond, &context_pool.mutex);
+         continue;
+      }
+      mtx_unlock(&context_pool.mutex);
+
+      struct virgl_gl_ctx_param params = context_pool.params;
+      virgl_gl_context gl_context = vrend_clicbs->create_gl_context(0, &params);
+
+      mtx_lock(&context_pool.mutex);
+      if (!gl_context) {
+         virgl_warn("vrend: unable to create pooled GL context, stopping the pool\n");
+         break;
+      }
+      context_pool.contexts[context_pool.count++] = gl_context;
+   }
+   mtx_unlock(&context_pool.mutex);
+
+   vrend_clicbs->make_current_surfaceless(NULL);
+   vrend_clicbs->destroy_gl_context_surfaceless(context_pool.thread_gl_context);
+   return 0;
+}
+
+bool vrend_context_pool_init(const struct virgl_gl_ctx_param *params)
+{
+   long size = debug_get_num_option("VREND_GL_CONTEXT_POOL", 2);
+
+   if (size <= 0)
+      return false;
+
+   memset(&context_pool, 0, sizeof(context_pool));
+   context_pool.params = *params;
+   context_pool.size = MIN2(size, CONTEXT_POOL_MAX_SIZE);
+
+   /* created here, where a context of the share group is current */
+   context_pool.thread_gl_context = vrend_clicbs->create_gl_context_surfaceless(0, &context_pool.params);
+   if (!context_pool.thread_gl_context)
+      return false;
+
+   if (mtx_init(&context_pool.mutex, mtx_plain) != thrd_success)
+      goto fail_context;
+   if (cnd_init(&context_pool.cond) != thrd_success)
+      goto fail_mutex;
+
+   context_pool.thread = u_thread_create(thread_context_pool, NULL);
+   if (!context_pool.thread)
+      goto fail_cond;
+
+   context_pool.enabled = true;
+   return true;
+
+fail_cond:
+   cnd_destroy(&context_pool.cond);
+fail_mutex:
+   mtx_destroy(&context_pool.mutex);
+fail_context:
+   vrend_clicbs->destroy_gl_context_surfaceless(context_pool.thread_gl_context);
+   return false;
+}
+
+void vrend_context_pool_fini(void)
+{
+   if (!context_pool.enabled)
+      return;
+
+   mtx_lock(&context_pool.mutex);
+   context_pool.stop = true;
+   cnd_signal(&context_pool.cond);
+   mtx_unlock(&context_pool.mutex);
+   thrd_join(context_pool.thread, NULL);
+
+   while (context_pool.count)
+      vrend_clicbs->destroy_gl_context(context_pool.contexts[--context_pool.count]);
+
+   cnd_destroy(&context_pool.cond);
+   mtx_destroy(&context_pool.mutex);
+   context_pool.enabled = false;
+}
+
+virgl_gl_context vrend_context_pool_take(const struct virgl_gl_ctx_param *params)
+{
+   virgl_gl_context gl_context = NULL;
+
+   if (!context_pool.enabled ||
+       params->major_ver != context_pool.params.major_ver ||
+       params->minor_ver != context_pool.params.minor_ver ||
+       params->shared != context_pool.params.shared ||
+       params->compat_ctx != context_pool.params.compat_ctx ||
+       params->no_error != context_pool.params.no_error)
+      return NULL;
+
+   mtx_lock(&context_pool.mutex);
+   if (context_pool.count) {
+      gl_context = context_pool.contexts[--context_pool.count];
+      cnd_signal(&context_pool.cond);
+   }
+   mtx_unlock(&context_pool.mutex);
+
+   return gl_context;
+}
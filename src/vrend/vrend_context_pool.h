@@ -0,0 +1,34 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_CONTEXT_POOL_H
+#define VREND_CONTEXT_POOL_H
+
+#include <stdbool.h>
+
+#include "vrend_renderer.h"
+
+/* Shared GL contexts created ahead of time on a thread.
+ *
+ * Creating a GL context takes milliseconds, and the sub-contexts of the guest
+ * contexts create theirs on the thread that decodes the commands of all the
+ * guests.  The pool hands out contexts created with the parameters it was
+ * initialized with, and a thread creates new ones as they are taken.  The
+ * contexts are not recycled, the state a guest left in one can not be reset
+ * reliably.
+ *
+ * VREND_GL_CONTEXT_POOL sets the number of contexts kept ready, 0 disables
+ * the pool.
+ */
+
+bool vrend_context_pool_init(const struct virgl_gl_ctx_param *params);
+
+void vrend_context_pool_fini(void);
+
+/* Returns a context created with params, or NULL when the pool has none
+ * ready or was initialized with other parameters. */
+virgl_gl_context vrend_context_pool_take(const struct virgl_gl_ctx_param *params);
+
+#endif
@@ -28,10 +28,13 @@
 #include <epoxy/gl.h>
 #include <fcntl.h>
 
+#include "util/u_debug.h"
 #include "util/u_memory.h"
 #include "pipe/p_defines.h"
 #include "pipe/p_state.h"
 #include "pipe/p_shader_tokens.h"
+#include "virgl_command_stats.h"
+#include "virgl_flight_recorder.h"
 #include "virgl_context.h"
 #include "virgl_resource.h"
 #include "vrend_renderer.h"
@@ -54,8 +57,63 @@
 struct vrend_decode_ctx {
    struct virgl_context base;
    struct vrend_context *grctx;
+
+   /* queued vrend_decode_submit, oldest first */
+   struct list_head submits;
+   /* in vrend_decode_sched.contexts while submits is not empty */
+   struct list_head sched_head;
+
+   uint32_t sched_weight;
+   /* the time the context has run, scaled by the inverse of its weight */
+   uint64_t sched_vtime;
+
+   /* the private copy that the submissions which are not queued are
+    * validated and decoded from, see vrend_decode_validate_batch */
+   uint32_t *batch;
+   size_t batch_capacity;
+};
+
+/* With VREND_SCHED_SUBMITS, the submissions of the contexts are queued and run
+ * in slices, one context at a time, so that contexts interleaving small batches
+ * don't switch the GL context on every submission.  Everything but a
+ * submission drains the queues first, so only the order of the submissions of
+ * different contexts changes, and a fence still follows all the submissions
+ * before it.
+ *
+ * The context with the least decode CPU time and batch GPU time, relative to
+ * its weight, runs first.  A context that was idle starts at the time of the
+ * last context that ran, so that it does not run ahead of the others for the
+ * time it did not use.  The GPU time is only known with VREND_GPU_TIMESTAMPS,
+ * and is charged once the queries are resolved.
+ */
+struct vrend_decode_submit {
+   struct list_head head;
+   uint64_t queued_ns;
+   size_t size;
+   uint32_t data[];
 };
 
+static struct {
+   bool initialized;
+   bool enabled;
+   bool draining;
+
+   /* a context runs this many bytes of submissions before the next one */
+   size_t slice_size;
+   /* the queues are drained once they hold more, or are older */
+   size_t max_queued_size;
+   uint64_t max_latency_ns;
+
+   /* vrend_decode_ctx with queued submissions, in the order they were queued */
+   struct list_head contexts;
+   size_t queued_size;
+   /* the sched_vtime of the last context that ran */
+   uint64_t vtime;
+} vrend_decode_sched;
+
+static void vrend_decode_sched_init(void);
+static void vrend_decode_sched_discard(struct vrend_decode_ctx *gdctx);
+
 static inline uint32_t get_buf_entry(const uint32_t *buf, uint32_t offset)
 {
    return buf[offset];
@@ -320,21 +378,21 @@ static int vrend_decode_set_index_buffer(struct vrend_context *ctx, const uint32
    return 0;
 }
 
-static int vrend_decode_set_constant_buffer(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+static bool vrend_decode_validate_set_constant_buffer(const uint32_t *buf, uint32_t length)
 {
-   uint32_t shader;
+   return length >= 2 &&
+          get_buf_entry(buf, VIRGL_SET_CONSTANT_BUFFER_SHADER_TYPE) < PIPE_SHADER_TYPES;
+}
+
+static int vrend_decode_set_constant_buffer_unchecked(struct vrend_context *ctx, const uint32_t *buf,
+                                                      uint32_t length)
+{
+   uint32_t shader = get_buf_entry(buf, VIRGL_SET_CONSTANT_BUFFER_SHADER_TYPE);
    int nc = (length - 2);
    const float *data = NULL;
 
-   if (length < 2)
-      return EINVAL;
-
-   shader = get_buf_entry(buf, VIRGL_SET_CONSTANT_BUFFER_SHADER_TYPE);
    /* VIRGL_SET_CONSTANT_BUFFER_INDEX is not used */
 
-   if (shader >= PIPE_SHADER_TYPES)
-      return EINVAL;
-
    if (length > 2)
       data = get_buf_ptr(buf, VIRGL_SET_CONSTANT_BUFFER_DATA_START);
 
@@ -342,6 +400,13 @@ static int vrend_decode_set_constant_buffer(struct vrend_context *ctx, const uin
    return 0;
 }
 
+static int vrend_decode_set_constant_buffer(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+{
+   if (!vrend_decode_validate_set_constant_buffer(buf, length))
+      return EINVAL;
+   return vrend_decode_set_constant_buffer_unchecked(ctx, buf, length);
+}
+
 static int vrend_decode_set_uniform_buffer(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
 {
    if (length != VIRGL_SET_UNIFORM_BUFFER_SIZE)
@@ -363,18 +428,17 @@ static int vrend_decode_set_uniform_buffer(struct vrend_context *ctx, const uint
    return 0;
 }
 
-static int vrend_decode_set_vertex_buffers(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+static bool vrend_decode_validate_set_vertex_buffers(UNUSED const uint32_t *buf, uint32_t length)
 {
-   int num_vbo;
-   int i;
-
    /* must be a multiple of 3 */
-   if (length && (length % 3))
-      return EINVAL;
+   return !(length % 3) && length / 3 <= PIPE_MAX_ATTRIBS;
+}
 
-   num_vbo = (length / 3);
-   if (num_vbo > PIPE_MAX_ATTRIBS)
-      return EINVAL;
+static int vrend_decode_set_vertex_buffers_unchecked(struct vrend_context *ctx, const uint32_t *buf,
+                                                     uint32_t length)
+{
+   int num_vbo = (length / 3);
+   int i;
 
    for (i = 0; i < num_vbo; i++) {
       vrend_set_single_vbo(ctx, i,
@@ -386,25 +450,34 @@ static int vrend_decode_set_vertex_buffers(struct vrend_context *ctx, const uint
    return 0;
 }
 
-static int vrend_decode_set_sampler_views(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+static int vrend_decode_set_vertex_buffers(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
 {
-   uint32_t num_samps;
-   uint32_t i;
-   uint32_t shader_type;
-   uint32_t start_slot;
+   if (!vrend_decode_validate_set_vertex_buffers(buf, length))
+      return EINVAL;
+   return vrend_decode_set_vertex_buffers_unchecked(ctx, buf, length);
+}
 
+static bool vrend_decode_validate_set_sampler_views(const uint32_t *buf, uint32_t length)
+{
    if (length < 2)
-      return EINVAL;
-   num_samps = length - 2;
-   shader_type = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_SHADER_TYPE);
-   start_slot = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_START_SLOT);
+      return false;
 
-   if (shader_type >= PIPE_SHADER_TYPES)
-      return EINVAL;
+   uint32_t num_samps = length - 2;
+   uint32_t shader_type = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_SHADER_TYPE);
+   uint32_t start_slot = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_START_SLOT);
 
-   if (num_samps > PIPE_MAX_SHADER_SAMPLER_VIEWS ||
-       start_slot > (PIPE_MAX_SHADER_SAMPLER_VIEWS - num_samps))
-      return EINVAL;
+   return shader_type < PIPE_SHADER_TYPES &&
+          num_samps <= PIPE_MAX_SHADER_SAMPLER_VIEWS &&
+          start_slot <= (PIPE_MAX_SHADER_SAMPLER_VIEWS - num_samps);
+}
+
+static int vrend_decode_set_sampler_views_unchecked(struct vrend_context *ctx, const uint32_t *buf,
+                                                    uint32_t length)
+{
+   uint32_t num_samps = length - 2;
+   uint32_t shader_type = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_SHADER_TYPE);
+   uint32_t start_slot = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_START_SLOT);
+   uint32_t i;
 
    for (i = 0; i < num_samps; i++) {
       uint32_t handle = get_buf_entry(buf, VIRGL_SET_SAMPLER_VIEWS_V0_HANDLE + i);
@@ -414,6 +487,13 @@ static int vrend_decode_set_sampler_views(struct vrend_context *ctx, const uint3
    return 0;
 }
 
+static int vrend_decode_set_sampler_views(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+{
+   if (!vrend_decode_validate_set_sampler_views(buf, length))
+      return EINVAL;
+   return vrend_decode_set_sampler_views_unchecked(ctx, buf, length);
+}
+
 static void vrend_decode_transfer_common(const uint32_t *buf,
                                          uint32_t *dst_handle,
                                          struct vrend_transfer_info *info)
@@ -460,14 +540,18 @@ static int vrend_decode_resource_inline_write(struct vrend_context *ctx, const u
    return vrend_transfer_inline_write(ctx, dst_handle, &info);
 }
 
-static int vrend_decode_draw_vbo(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+static bool vrend_decode_validate_draw_vbo(UNUSED const uint32_t *buf, uint32_t length)
+{
+   return length == VIRGL_DRAW_VBO_SIZE || length == VIRGL_DRAW_VBO_SIZE_TESS ||
+          length == VIRGL_DRAW_VBO_SIZE_INDIRECT;
+}
+
+static int vrend_decode_draw_vbo_unchecked(struct vrend_context *ctx, const uint32_t *buf,
+                                           uint32_t length)
 {
    struct pipe_draw_info info;
    uint32_t cso;
    uint32_t handle = 0, indirect_draw_count_handle = 0;
-   if (length != VIRGL_DRAW_VBO_SIZE && length != VIRGL_DRAW_VBO_SIZE_TESS &&
-       length != VIRGL_DRAW_VBO_SIZE_INDIRECT)
-      return EINVAL;
    memset(&info, 0, sizeof(struct pipe_draw_info));
 
    info.start = get_buf_entry(buf, VIRGL_DRAW_VBO_START);
@@ -501,6 +585,13 @@ static int vrend_decode_draw_vbo(struct vrend_context *ctx, const uint32_t *buf,
    return vrend_draw_vbo(ctx, &info, cso, handle, indirect_draw_count_handle);
 }
 
+static int vrend_decode_draw_vbo(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+{
+   if (!vrend_decode_validate_draw_vbo(buf, length))
+      return EINVAL;
+   return vrend_decode_draw_vbo_unchecked(ctx, buf, length);
+}
+
 static int vrend_decode_create_blend(struct vrend_context *ctx, const uint32_t *buf, uint32_t handle, uint16_t length)
 {
    struct pipe_blend_state *blend_state;
@@ -1507,7 +1598,9 @@ static int vrend_decode_transfer3d(struct vrend_context *ctx, const uint32_t *bu
 static int check_copy_transfer3d_handles(struct vrend_context *ctx, uint32_t src_handle,  uint32_t dst_handle,
                                          struct vrend_resource *src_res, struct vrend_resource *dst_res)
 {
-   if (!src_res || !src_res->iov) {
+   /* blobs backed by a GL buffer are copied from on the GPU */
+   if (!src_res ||
+       (!src_res->iov && !has_bit(src_res->storage_bits, VREND_STORAGE_GL_BUFFER))) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
       return EINVAL;
    }
@@ -1642,11 +1735,14 @@ struct virgl_context *vrend_renderer_context_create(uint32_t handle,
 {
    struct vrend_decode_ctx *dctx;
 
-   dctx = malloc(sizeof(struct vrend_decode_ctx));
+   dctx = calloc(1, sizeof(struct vrend_decode_ctx));
    if (!dctx)
       return NULL;
 
    vrend_decode_ctx_init_base(dctx, handle);
+   list_inithead(&dctx->submits);
+   dctx->sched_weight = VIRGL_RENDERER_CONTEXT_WEIGHT_DEFAULT;
+   vrend_decode_sched_init();
 
    dctx->grctx = vrend_create_context(handle, nlen, debug_name);
    if (!dctx->grctx) {
@@ -1654,6 +1750,10 @@ struct virgl_context *vrend_renderer_context_create(uint32_t handle,
       return NULL;
    }
 
+   if (virgl_command_stats_enabled)
+      dctx->base.command_stats = virgl_command_stats_create(VIRGL_MAX_COMMANDS);
+   dctx->base.flight_recorder = virgl_flight_recorder_create();
+
    vrend_renderer_set_fence_retire(dctx->grctx,
                                    vrend_decode_ctx_fence_retire,
                                    dctx);
@@ -1666,7 +1766,12 @@ static void vrend_decode_ctx_destroy(struct virgl_context *ctx)
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
 
+   /* virgl_renderer_context_destroy drains the queues, this is a reset */
+   vrend_decode_sched_discard(dctx);
    vrend_destroy_context(dctx->grctx);
+   virgl_command_stats_destroy(dctx->base.command_stats);
+   virgl_flight_recorder_destroy(dctx->base.flight_recorder);
+   free(dctx->batch);
    free(dctx);
 }
 
@@ -1675,6 +1780,7 @@ static void vrend_decode_ctx_attach_resource(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   vrend_renderer_drain_submits();
    vrend_renderer_attach_res_ctx(dctx->grctx, res);
 }
 
@@ -1683,6 +1789,7 @@ static void vrend_decode_ctx_detach_resource(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   vrend_renderer_drain_submits();
    vrend_renderer_detach_res_ctx(dctx->grctx, res);
 }
 
@@ -1693,6 +1800,8 @@ static int vrend_decode_ctx_transfer_3d(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_renderer_drain_submits();
    int ret = vrend_renderer_transfer_iov(dctx->grctx, res->res_id, info,
                                          transfer_mode);
    return vrend_check_no_error(dctx->grctx) || ret ? ret : EINVAL;
@@ -1708,6 +1817,9 @@ static int vrend_decode_ctx_get_blob(struct virgl_context *ctx,
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
 
+   /* the blob is created by a submission */
+   vrend_renderer_drain_submits();
+
    blob->type = VIRGL_RESOURCE_FD_INVALID;
    /* this transfers ownership and blob_id is no longer valid */
    blob->u.pipe_resource = vrend_get_blob_pipe(dctx->grctx, blob_id);
@@ -2033,6 +2145,57 @@ static const vrend_decode_callback decode_table[VIRGL_MAX_COMMANDS] = {
    [VIRGL_CCMD_GET_PIPE_RESOURCE_LAYOUT] = vrend_decode_get_pipe_resource_layout,
 };
 
+typedef bool (*vrend_decode_validate_callback)(const uint32_t *buf, uint32_t length);
+
+/* The commands that dominate draw-heavy streams are validated for the whole
+ * batch before it runs, and then dispatched without the checks.  The handles
+ * are still looked up when the commands run, since the objects they name can
+ * be created by the commands before them.
+ */
+static const struct {
+   vrend_decode_validate_callback validate;
+   vrend_decode_callback unchecked;
+} decode_fast_table[VIRGL_MAX_COMMANDS] = {
+   [VIRGL_CCMD_DRAW_VBO] = {
+      vrend_decode_validate_draw_vbo, vrend_decode_draw_vbo_unchecked },
+   [VIRGL_CCMD_SET_VERTEX_BUFFERS] = {
+      vrend_decode_validate_set_vertex_buffers, vrend_decode_set_vertex_buffers_unchecked },
+   [VIRGL_CCMD_SET_SAMPLER_VIEWS] = {
+      vrend_decode_validate_set_sampler_views, vrend_decode_set_sampler_views_unchecked },
+   [VIRGL_CCMD_SET_CONSTANT_BUFFER] = {
+      vrend_decode_validate_set_constant_buffer, vrend_decode_set_constant_buffer_unchecked },
+};
+
+/* Checks the framing of every command, and the fields of the commands of
+ * decode_fast_table.  The batch must be a private copy, a buffer that the
+ * guest can still write to could change between the validation and the
+ * decoding.  When it fails, the batch runs through the checked handlers so
+ * that the commands before the bad one still execute.
+ */
+static bool vrend_decode_validate_batch(const uint32_t *typed_buf, uint32_t buf_total)
+{
+   uint32_t buf_offset = 0;
+
+   while (buf_offset < buf_total) {
+      const uint32_t *buf = &typed_buf[buf_offset];
+      uint32_t len = *buf >> 16;
+      uint32_t cmd = *buf & 0xff;
+
+      if (cmd >= VIRGL_MAX_COMMANDS)
+         return false;
+
+      buf_offset += len + 1;
+      if (buf_offset > buf_total)
+         return false;
+
+      if (decode_fast_table[cmd].validate &&
+          !decode_fast_table[cmd].validate(buf, len))
+         return false;
+   }
+
+   return true;
+}
+
 static void dump_command_stream_to_file(const void *buffer, size_t size)
 {
    uint64_t hash = XXH64(buffer, size, 0);
@@ -2046,21 +2209,24 @@ static void dump_command_stream_to_file(const void *buffer, size_t size)
    }
 }
 
-static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
-                                       const void *buffer,
-                                       size_t size)
+static void vrend_decode_report_draw_batch_failure(struct vrend_decode_ctx *gdctx,
+                                                   uint32_t cmd_index)
+{
+   virgl_error("context %d failed to dispatch %s (command %u)\n", gdctx->base.ctx_id,
+               vrend_get_comand_name(VIRGL_CCMD_DRAW_VBO), cmd_index);
+   virgl_flight_recorder_dump_once(gdctx->base.flight_recorder, gdctx->base.ctx_id);
+   vrend_report_buffer_error(gdctx->grctx, VIRGL_CCMD_DRAW_VBO);
+}
+
+static int vrend_decode_ctx_dispatch(struct vrend_decode_ctx *gdctx,
+                                     const void *buffer,
+                                     size_t size,
+                                     bool private_buffer)
 {
-   TRACE_FUNC();
-   struct vrend_decode_ctx *gdctx = (struct vrend_decode_ctx *)ctx;
-   bool bret;
    int ret;
 
 #define TRANSFER_HEADER_SIZE 4096
 
-   bret = vrend_hw_switch_context(gdctx->grctx, true);
-   if (bret == false)
-      return EINVAL;
-
    if (VREND_DEBUG_ENABLED &&
        vrend_debug(gdctx->grctx, dbg_dump_cmd_streams) &&
        size > TRANSFER_HEADER_SIZE) {
@@ -2071,41 +2237,306 @@ static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
    const uint32_t *typed_buf = (const uint32_t *)buffer;
    const uint32_t buf_total = (uint32_t)(size / sizeof(uint32_t));
    uint32_t buf_offset = 0;
+   const enum vrend_gl_error_check error_check = vrend_renderer_gl_error_check();
+   uint32_t cmd_index = 0;
+   uint32_t failed_draw;
+   const bool validated = private_buffer && vrend_decode_validate_batch(typed_buf, buf_total);
 
    while (buf_offset < buf_total) {
       const uint32_t cur_offset = buf_offset;
       const uint32_t *buf = &typed_buf[buf_offset];
       uint32_t len = *buf >> 16;
       uint32_t cmd = *buf & 0xff;
-
-      if (cmd >= VIRGL_MAX_COMMANDS)
+      vrend_decode_callback callback;
+
+      if (!validated && cmd >= VIRGL_MAX_COMMANDS) {
+         vrend_end_dispatch_run(gdctx->grctx);
+         vrend_flush_barriers(gdctx->grctx);
+         vrend_flush_mipmap_blits(gdctx->grctx);
+         vrend_flush_clears(gdctx->grctx);
+         if (vrend_flush_draws(gdctx->grctx))
+            vrend_take_draw_batch_failure(gdctx->grctx, &failed_draw);
          return EINVAL;
+      }
 
       buf_offset += len + 1;
 
       ret = 0;
       /* check if the guest is doing something bad */
-      if (buf_offset > buf_total) {
+      if (!validated && buf_offset > buf_total) {
          vrend_report_buffer_error(gdctx->grctx, 0);
          break;
       }
 
+      callback = decode_table[cmd];
+      if (validated && decode_fast_table[cmd].unchecked)
+         callback = decode_fast_table[cmd].unchecked;
+
       VREND_DEBUG(dbg_cmd, gdctx->grctx, "%-4d %-20s len:%d\n",
                   cur_offset, vrend_get_comand_name(cmd), len);
 
       TRACE_SCOPE_SLOW(vrend_get_comand_name(cmd));
-
-      ret = decode_table[cmd](gdctx->grctx, buf, len);
-      if (!vrend_check_no_error(gdctx->grctx) && !ret)
+      vrend_renderer_set_current_command(cmd_index++, vrend_get_comand_name(cmd));
+
+      /* consecutive draws are batched, anything that might change the state
+       * they depend on has to see them executed first, the same goes for
+       * the buffer uploads that are merged across transfers and for the
+       * merged clears, which a blit may still drop, and the blits that
+       * generate mipmaps, and the merged barriers.  The compute state is
+       * only known to be bound during a run of dispatches */
+      if (cmd != VIRGL_CCMD_LAUNCH_GRID)
+         vrend_end_dispatch_run(gdctx->grctx);
+      if (cmd != VIRGL_CCMD_MEMORY_BARRIER && cmd != VIRGL_CCMD_TEXTURE_BARRIER)
+         vrend_flush_barriers(gdctx->grctx);
+      if (cmd != VIRGL_CCMD_TRANSFER3D)
+         vrend_renderer_flush_uploads();
+      if (cmd != VIRGL_CCMD_BLIT)
+         vrend_flush_mipmap_blits(gdctx->grctx);
+      if (cmd != VIRGL_CCMD_CLEAR && cmd != VIRGL_CCMD_BLIT)
+         vrend_flush_clears(gdctx->grctx);
+      if (cmd != VIRGL_CCMD_DRAW_VBO && cmd != VIRGL_CCMD_SET_INDEX_BUFFER)
+         ret = vrend_flush_draws(gdctx->grctx);
+      if (!ret) {
+         const uint64_t begin = virgl_flight_recorder_begin(gdctx->base.flight_recorder,
+                                                            gdctx->base.command_stats);
+         ret = callback(gdctx->grctx, buf, len);
+         virgl_flight_recorder_end(gdctx->base.flight_recorder, gdctx->base.command_stats,
+                                   cmd, vrend_get_comand_name(cmd), (len + 1) * 4, begin);
+      }
+      if (error_check == VREND_GL_ERROR_CHECK_COMMAND &&
+          !vrend_check_no_error(gdctx->grctx) && !ret)
          ret = EINVAL;
-      if (ret) {
+      /* batched draws fail when they are flushed, by this command or
+       * before it, the failure is the one of the first draw of the batch
+       * and the draws queued after it did not run */
+      if (vrend_take_draw_batch_failure(gdctx->grctx, &failed_draw)) {
+         vrend_decode_report_draw_batch_failure(gdctx, failed_draw);
+         ret = ret ? ret : EINVAL;
+      } else if (ret) {
          virgl_error("context %d failed to dispatch %s: %d\n",
                gdctx->base.ctx_id, vrend_get_comand_name(cmd), ret);
+         virgl_flight_recorder_dump_once(gdctx->base.flight_recorder, gdctx->base.ctx_id);
          if (ret == EINVAL)
             vrend_report_buffer_error(gdctx->grctx, *buf);
+      }
+      if (ret) {
+         vrend_end_dispatch_run(gdctx->grctx);
+         vrend_flush_barriers(gdctx->grctx);
+         vrend_flush_mipmap_blits(gdctx->grctx);
+         vrend_flush_clears(gdctx->grctx);
+         /* the submission already failed */
+         if (vrend_flush_draws(gdctx->grctx))
+            vrend_take_draw_batch_failure(gdctx->grctx, &failed_draw);
+         vrend_renderer_set_current_command(0, NULL);
          return ret;
       }
    }
+
+   /* the batch is checked as a whole, the KHR_debug messages, when enabled,
+    * name the commands that caused the errors */
+   vrend_end_dispatch_run(gdctx->grctx);
+   vrend_flush_barriers(gdctx->grctx);
+   vrend_flush_mipmap_blits(gdctx->grctx);
+   vrend_flush_clears(gdctx->grctx);
+   ret = vrend_flush_draws(gdctx->grctx);
+   if (vrend_take_draw_batch_failure(gdctx->grctx, &failed_draw))
+      vrend_decode_report_draw_batch_failure(gdctx, failed_draw);
+   if (!vrend_check_no_error(gdctx->grctx) && !ret)
+      ret = EINVAL;
+   vrend_renderer_set_current_command(0, NULL);
+   return ret;
+}
+
+static int vrend_decode_ctx_run_cmd(struct vrend_decode_ctx *gdctx,
+                                    const void *buffer,
+                                    size_t size,
+                                    bool private_buffer)
+{
+   int ret;
+
+   if (!vrend_hw_switch_context(gdctx->grctx, true))
+      return EINVAL;
+
+   vrend_gpu_timer_begin_batch(gdctx->grctx);
+   ret = vrend_decode_ctx_dispatch(gdctx, buffer, size, private_buffer);
+   vrend_gpu_timer_end_batch(gdctx->grctx);
+
+   return ret;
+}
+
+/* runs the submission from the private copy of the context, or from the
+ * buffer with all the checks when the copy cannot be allocated */
+static int vrend_decode_ctx_run_cmd_copy(struct vrend_decode_ctx *gdctx,
+                                         const void *buffer,
+                                         size_t size)
+{
+   if (size > gdctx->batch_capacity) {
+      uint32_t *batch = realloc(gdctx->batch, size);
+      if (!batch)
+         return vrend_decode_ctx_run_cmd(gdctx, buffer, size, false);
+
+      gdctx->batch = batch;
+      gdctx->batch_capacity = size;
+   }
+
+   memcpy(gdctx->batch, buffer, size);
+   return vrend_decode_ctx_run_cmd(gdctx, gdctx->batch, size, true);
+}
+
+static void vrend_decode_sched_init(void)
+{
+   if (vrend_decode_sched.initialized)
+      return;
+
+   vrend_decode_sched.enabled = debug_get_bool_option("VREND_SCHED_SUBMITS", false);
+   vrend_decode_sched.slice_size =
+      debug_get_num_option("VREND_SCHED_SLICE_KB", 256) * 1024;
+   vrend_decode_sched.max_queued_size =
+      debug_get_num_option("VREND_SCHED_MAX_QUEUED_KB", 1024) * 1024;
+   vrend_decode_sched.max_latency_ns =
+      debug_get_num_option("VREND_SCHED_MAX_LATENCY_US", 2000) * 1000;
+   list_inithead(&vrend_decode_sched.contexts);
+   vrend_decode_sched.initialized = true;
+}
+
+static void vrend_decode_sched_charge(struct vrend_decode_ctx *gdctx, uint64_t time)
+{
+   gdctx->sched_vtime += time * VIRGL_RENDERER_CONTEXT_WEIGHT_DEFAULT / gdctx->sched_weight;
+}
+
+/* runs at least one submission of the context, and up to a slice */
+static void vrend_decode_sched_run_slice(struct vrend_decode_ctx *gdctx)
+{
+   const uint64_t begin = virgl_command_stats_now();
+   size_t run_size = 0;
+
+   vrend_decode_sched.vtime = gdctx->sched_vtime;
+
+   while (!list_is_empty(&gdctx->submits) &&
+          run_size < vrend_decode_sched.slice_size) {
+      struct vrend_decode_submit *submit =
+         list_first_entry(&gdctx->submits, struct vrend_decode_submit, head);
+      list_del(&submit->head);
+      vrend_decode_sched.queued_size -= submit->size;
+      run_size += submit->size;
+
+      /* the errors are reported to the guest through the context */
+      int ret = vrend_decode_ctx_run_cmd(gdctx, submit->data, submit->size, true);
+      if (ret)
+         virgl_debug("queued submission of context %u failed: %d\n",
+                     gdctx->base.ctx_id, ret);
+      free(submit);
+   }
+
+   vrend_decode_sched_charge(gdctx, virgl_command_stats_now() - begin +
+                                    vrend_context_take_gpu_time(gdctx->grctx));
+
+   list_del(&gdctx->sched_head);
+   if (!list_is_empty(&gdctx->submits))
+      list_addtail(&gdctx->sched_head, &vrend_decode_sched.contexts);
+}
+
+static struct vrend_decode_ctx *vrend_decode_sched_next(void)
+{
+   struct vrend_decode_ctx *next = NULL;
+
+   /* there are only a few contexts with queued submissions */
+   list_for_each_entry(struct vrend_decode_ctx, gdctx, &vrend_decode_sched.contexts,
+                       sched_head) {
+      if (!next || gdctx->sched_vtime < next->sched_vtime)
+         next = gdctx;
+   }
+
+   return next;
+}
+
+void vrend_renderer_drain_submits(void)
+{
+   if (!vrend_decode_sched.initialized || vrend_decode_sched.draining)
+      return;
+
+   vrend_decode_sched.draining = true;
+   while (!list_is_empty(&vrend_decode_sched.contexts))
+      vrend_decode_sched_run_slice(vrend_decode_sched_next());
+   vrend_decode_sched.draining = false;
+}
+
+static void vrend_decode_sched_discard(struct vrend_decode_ctx *gdctx)
+{
+   if (list_is_empty(&gdctx->submits))
+      return;
+
+   list_for_each_entry_safe(struct vrend_decode_submit, submit, &gdctx->submits, head) {
+      vrend_decode_sched.queued_size -= submit->size;
+      free(submit);
+   }
+   list_inithead(&gdctx->submits);
+   list_del(&gdctx->sched_head);
+}
+
+static bool vrend_decode_sched_should_drain(void)
+{
+   if (vrend_decode_sched.queued_size > vrend_decode_sched.max_queued_size)
+      return true;
+
+   /* the first context has the oldest submission */
+   const struct vrend_decode_ctx *gdctx = list_first_entry(&vrend_decode_sched.contexts,
+                                                           struct vrend_decode_ctx,
+                                                           sched_head);
+   const struct vrend_decode_submit *oldest =
+      list_first_entry(&gdctx->submits, struct vrend_decode_submit, head);
+   return virgl_command_stats_now() - oldest->queued_ns >=
+          vrend_decode_sched.max_latency_ns;
+}
+
+static int vrend_decode_sched_queue(struct vrend_decode_ctx *gdctx,
+                                    const void *buffer,
+                                    size_t size)
+{
+   struct vrend_decode_submit *submit = malloc(sizeof(*submit) + size);
+   if (!submit) {
+      vrend_renderer_drain_submits();
+      return vrend_decode_ctx_run_cmd(gdctx, buffer, size, false);
+   }
+
+   submit->queued_ns = virgl_command_stats_now();
+   submit->size = size;
+   memcpy(submit->data, buffer, size);
+
+   if (list_is_empty(&gdctx->submits)) {
+      gdctx->sched_vtime = MAX2(gdctx->sched_vtime, vrend_decode_sched.vtime);
+      list_addtail(&gdctx->sched_head, &vrend_decode_sched.contexts);
+   }
+   list_addtail(&submit->head, &gdctx->submits);
+   vrend_decode_sched.queued_size += size;
+
+   if (vrend_decode_sched_should_drain())
+      vrend_renderer_drain_submits();
+
+   return 0;
+}
+
+static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
+                                       const void *buffer,
+                                       size_t size)
+{
+   TRACE_FUNC();
+   struct vrend_decode_ctx *gdctx = (struct vrend_decode_ctx *)ctx;
+
+   if (vrend_decode_sched.enabled && !vrend_decode_sched.draining)
+      return vrend_decode_sched_queue(gdctx, buffer, size);
+
+   return vrend_decode_ctx_run_cmd_copy(gdctx, buffer, size);
+}
+
+static int vrend_decode_ctx_set_weight(struct virgl_context *ctx, uint32_t weight)
+{
+   struct vrend_decode_ctx *gdctx = (struct vrend_decode_ctx *)ctx;
+
+   /* the weights only matter between queued submissions */
+   vrend_decode_sched.enabled = true;
+   gdctx->sched_weight = weight;
+
    return 0;
 }
 
@@ -2132,6 +2563,7 @@ static int vrend_decode_ctx_submit_fence(struct virgl_context *ctx,
    if (!dctx->grctx)
       return EINVAL;
 
+   vrend_renderer_drain_submits();
    return vrend_renderer_create_fence(dctx->grctx, flags, fence_id);
 }
 
@@ -2150,6 +2582,7 @@ static void vrend_decode_ctx_init_base(struct vrend_decode_ctx *dctx,
    ctx->transfer_3d = vrend_decode_ctx_transfer_3d;
    ctx->get_blob = vrend_decode_ctx_get_blob;
    ctx->submit_cmd = vrend_decode_ctx_submit_cmd;
+   ctx->set_weight = vrend_decode_ctx_set_weight;
 
    ctx->get_fencing_fd = vrend_decode_ctx_get_fencing_fd;
    ctx->retire_fences = vrend_decode_ctx_retire_fences;
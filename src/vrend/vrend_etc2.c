@@ -0,0 +1,427 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_etc2.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+
+/* Block decoding as described by the "ETC Compressed Texture Image Formats"
+ * section of the OpenGL ES 3.0 specification.  The blocks are decoded to a
+ * 4x4 array of texels, before the texels in the box are copied out.
+ */
+
+#define ETC2_TEXELS_MAX_SIZE 4
+
+static const int etc1_modifier_tables[8][4] = {
+   { 2, 8, -2, -8 },
+   { 5, 17, -5, -17 },
+   { 9, 29, -9, -29 },
+   { 13, 42, -13, -42 },
+   { 18, 60, -18, -60 },
+   { 24, 80, -24, -80 },
+   { 33, 106, -33, -106 },
+   { 47, 183, -47, -183 },
+};
+
+static const int etc2_distance_table[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+static const int eac_modifier_tables[16][8] = {
+   { -3, -6, -9, -15, 2, 5, 8, 14 },
+   { -3, -7, -10, -13, 2, 6, 9, 12 },
+   { -2, -5, -8, -13, 1, 4, 7, 12 },
+   { -2, -4, -6, -13, 1, 3, 5, 12 },
+   { -3, -6, -8, -12, 2, 5, 7, 11 },
+   { -3, -7, -9, -11, 2, 6, 8, 10 },
+   { -4, -7, -8, -11, 3, 6, 7, 10 },
+   { -3, -5, -8, -11, 2, 4, 7, 10 },
+   { -2, -6, -8, -10, 1, 5, 7, 9 },
+   { -2, -5, -8, -10, 1, 4, 7, 9 },
+   { -2, -4, -8, -10, 1, 3, 7, 9 },
+   { -2, -5, -7, -10, 1, 4, 6, 9 },
+   { -3, -4, -7, -10, 2, 3, 6, 9 },
+   { -1, -2, -3, -10, 0, 1, 2, 9 },
+   { -4, -6, -8, -9, 3, 5, 7, 8 },
+   { -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+static inline int clamp_int(int v, int min, int max)
+{
+   return v < min ? min : (v > max ? max : v);
+}
+
+static inline uint8_t extend_4(uint8_t x)
+{
+   return (x << 4) | x;
+}
+
+static inline uint8_t extend_5(uint8_t x)
+{
+   return (x << 3) | (x >> 2);
+}
+
+static inline uint8_t extend_6(uint8_t x)
+{
+   return (x << 2) | (x >> 4);
+}
+
+static inline uint8_t extend_7(uint8_t x)
+{
+   return (x << 1) | (x >> 6);
+}
+
+static inline uint32_t read_be32(const uint8_t *src)
+{
+   return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+          ((uint32_t)src[2] << 8) | src[3];
+}
+
+/* the 2-bit index of the texel at x, y, the texels are in column order */
+static inline uint32_t etc2_get_index(uint32_t indices, uint32_t x, uint32_t y)
+{
+   const uint32_t i = x * 4 + y;
+   return (((indices >> (16 + i)) & 1) << 1) | ((indices >> i) & 1);
+}
+
+static void etc2_decode_etc1(const uint8_t *src, uint8_t base[2][3],
+                             bool non_opaque, uint8_t *texels)
+{
+   const uint32_t indices = read_be32(src + 4);
+   const bool flip = src[3] & 0x1;
+   const int *modifiers[2] = {
+      etc1_modifier_tables[src[3] >> 5],
+      etc1_modifier_tables[(src[3] >> 2) & 0x7],
+   };
+
+   for (uint32_t y = 0; y < 4; y++) {
+      for (uint32_t x = 0; x < 4; x++) {
+         const uint32_t sub = flip ? y >= 2 : x >= 2;
+         const uint32_t idx = etc2_get_index(indices, x, y);
+         uint8_t *texel = texels + (y * 4 + x) * 4;
+
+         /* with punchthrough alpha, the index 2 is transparent black and
+          * the index 0 has no modifier */
+         if (non_opaque && idx == 2) {
+            memset(texel, 0, 4);
+            continue;
+         }
+
+         const int mod = non_opaque && idx == 0 ? 0 : modifiers[sub][idx];
+         for (uint32_t c = 0; c < 3; c++)
+            texel[c] = clamp_int(base[sub][c] + mod, 0, 255);
+         texel[3] = 255;
+      }
+   }
+}
+
+static void etc2_decode_paint(const uint8_t *src, int paint[4][3],
+                              bool non_opaque, uint8_t *texels)
+{
+   const uint32_t indices = read_be32(src + 4);
+
+   for (uint32_t y = 0; y < 4; y++) {
+      for (uint32_t x = 0; x < 4; x++) {
+         const uint32_t idx = etc2_get_index(indices, x, y);
+         uint8_t *texel = texels + (y * 4 + x) * 4;
+
+         if (non_opaque && idx == 2) {
+            memset(texel, 0, 4);
+            continue;
+         }
+
+         for (uint32_t c = 0; c < 3; c++)
+            texel[c] = clamp_int(paint[idx][c], 0, 255);
+         texel[3] = 255;
+      }
+   }
+}
+
+static void etc2_decode_t_mode(const uint8_t *src, bool non_opaque, uint8_t *texels)
+{
+   const int c1[3] = {
+      extend_4(((src[0] >> 1) & 0xc) | (src[0] & 0x3)),
+      extend_4(src[1] >> 4),
+      extend_4(src[1] & 0xf),
+   };
+   const int c2[3] = {
+      extend_4(src[2] >> 4),
+      extend_4(src[2] & 0xf),
+      extend_4(src[3] >> 4),
+   };
+   const int d = etc2_distance_table[((src[3] >> 1) & 0x6) | (src[3] & 0x1)];
+   int paint[4][3];
+
+   for (uint32_t c = 0; c < 3; c++) {
+      paint[0][c] = c1[c];
+      paint[1][c] = c2[c] + d;
+      paint[2][c] = c2[c];
+      paint[3][c] = c2[c] - d;
+   }
+
+   etc2_decode_paint(src, paint, non_opaque, texels);
+}
+
+static void etc2_decode_h_mode(const uint8_t *src, bool non_opaque, uint8_t *texels)
+{
+   const int c1[3] = {
+      extend_4((src[0] >> 3) & 0xf),
+      extend_4(((src[0] & 0x7) << 1) | ((src[1] >> 4) & 0x1)),
+      extend_4((src[1] & 0x8) | ((src[1] & 0x3) << 1) | (src[2] >> 7)),
+   };
+   const int c2[3] = {
+      extend_4((src[2] >> 3) & 0xf),
+      extend_4(((src[2] & 0x7) << 1) | (src[3] >> 7)),
+      extend_4((src[3] >> 3) & 0xf),
+   };
+   /* the order of the base colors holds the low bit of the distance */
+   const uint32_t v1 = (c1[0] << 16) | (c1[1] << 8) | c1[2];
+   const uint32_t v2 = (c2[0] << 16) | (c2[1] << 8) | c2[2];
+   const int d =
+      etc2_distance_table[(src[3] & 0x4) | ((src[3] & 0x1) << 1) | (v1 >= v2)];
+   int paint[4][3];
+
+   for (uint32_t c = 0; c < 3; c++) {
+      paint[0][c] = c1[c] + d;
+      paint[1][c] = c1[c] - d;
+      paint[2][c] = c2[c] + d;
+      paint[3][c] = c2[c] - d;
+   }
+
+   etc2_decode_paint(src, paint, non_opaque, texels);
+}
+
+static void etc2_decode_planar(const uint8_t *src, uint8_t *texels)
+{
+   const int o[3] = {
+      extend_6((src[0] >> 1) & 0x3f),
+      extend_7(((src[0] & 0x1) << 6) | ((src[1] >> 1) & 0x3f)),
+      extend_6(((src[1] & 0x1) << 5) | (src[2] & 0x18) | ((src[2] & 0x3) << 1) |
+               (src[3] >> 7)),
+   };
+   const int h[3] = {
+      extend_6(((src[3] >> 1) & 0x3e) | (src[3] & 0x1)),
+      extend_7(src[4] >> 1),
+      extend_6(((src[4] & 0x1) << 5) | (src[5] >> 3)),
+   };
+   const int v[3] = {
+      extend_6(((src[5] & 0x7) << 3) | (src[6] >> 5)),
+      extend_7(((src[6] & 0x1f) << 2) | (src[7] >> 6)),
+      extend_6(src[7] & 0x3f),
+   };
+
+   for (int y = 0; y < 4; y++) {
+      for (int x = 0; x < 4; x++) {
+         uint8_t *texel = texels + (y * 4 + x) * 4;
+         for (uint32_t c = 0; c < 3; c++) {
+            const int val = (x * (h[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2;
+            texel[c] = clamp_int(val, 0, 255);
+         }
+         texel[3] = 255;
+      }
+   }
+}
+
+/* Decode an ETC2 RGB block to RGBA8 texels.  With punchthrough alpha the
+ * differential bit is the opaque bit, and there is no individual mode.
+ */
+static void etc2_decode_rgb_block(const uint8_t *src, bool punchthrough, uint8_t *texels)
+{
+   const bool diff = src[3] & 0x2;
+   const bool non_opaque = punchthrough && !diff;
+   uint8_t base[2][3];
+
+   if (!punchthrough && !diff) {
+      for (uint32_t c = 0; c < 3; c++) {
+         base[0][c] = extend_4(src[c] >> 4);
+         base[1][c] = extend_4(src[c] & 0xf);
+      }
+      etc2_decode_etc1(src, base, false, texels);
+      return;
+   }
+
+   int base2[3];
+   for (uint32_t c = 0; c < 3; c++) {
+      const int delta = ((src[c] & 0x7) ^ 0x4) - 0x4;
+      base[0][c] = extend_5(src[c] >> 3);
+      base2[c] = (src[c] >> 3) + delta;
+   }
+
+   /* an overflowing base color selects one of the ETC2 modes */
+   if (base2[0] < 0 || base2[0] > 31) {
+      etc2_decode_t_mode(src, non_opaque, texels);
+   } else if (base2[1] < 0 || base2[1] > 31) {
+      etc2_decode_h_mode(src, non_opaque, texels);
+   } else if (base2[2] < 0 || base2[2] > 31) {
+      etc2_decode_planar(src, texels);
+   } else {
+      for (uint32_t c = 0; c < 3; c++)
+         base[1][c] = extend_5(base2[c]);
+      etc2_decode_etc1(src, base, non_opaque, texels);
+   }
+}
+
+static inline uint64_t eac_read_indices(const uint8_t *src)
+{
+   return ((uint64_t)read_be32(src + 2) << 16) | (src[6] << 8) | src[7];
+}
+
+/* the 3-bit index of the texel at x, y, the texels are in column order */
+static inline uint32_t eac_get_index(uint64_t indices, uint32_t x, uint32_t y)
+{
+   return (indices >> (45 - 3 * (x * 4 + y))) & 0x7;
+}
+
+/* decode an EAC block to the alpha channel of RGBA8 texels */
+static void eac_decode_alpha(const uint8_t *src, uint8_t *texels)
+{
+   const int base = src[0];
+   const int mult = src[1] >> 4;
+   const int *modifiers = eac_modifier_tables[src[1] & 0xf];
+   const uint64_t indices = eac_read_indices(src);
+
+   for (uint32_t y = 0; y < 4; y++) {
+      for (uint32_t x = 0; x < 4; x++) {
+         const int mod = modifiers[eac_get_index(indices, x, y)];
+         texels[(y * 4 + x) * 4 + 3] = clamp_int(base + mod * mult, 0, 255);
+      }
+   }
+}
+
+/* decode an EAC R11 block to 16-bit normalized values, stride bytes apart */
+static void eac_decode_r11(const uint8_t *src, bool is_signed, uint8_t *texels,
+                           uint32_t stride)
+{
+   const int mult = src[1] >> 4;
+   const int *modifiers = eac_modifier_tables[src[1] & 0xf];
+   const uint64_t indices = eac_read_indices(src);
+   int base;
+
+   if (is_signed) {
+      /* -128 is not a valid base, it is treated as -127 */
+      base = MAX2((int8_t)src[0], -127) * 8;
+   } else {
+      base = src[0] * 8 + 4;
+   }
+
+   for (uint32_t y = 0; y < 4; y++) {
+      for (uint32_t x = 0; x < 4; x++) {
+         const int mod = modifiers[eac_get_index(indices, x, y)];
+         const int val = base + (mult ? mod * mult * 8 : mod);
+         uint16_t texel;
+
+         if (is_signed) {
+            const int v = clamp_int(val, -1023, 1023);
+            const int mag = abs(v);
+            texel = (uint16_t)(int16_t)(v < 0 ? -((mag << 5) | (mag >> 5))
+                                              : (mag << 5) | (mag >> 5));
+         } else {
+            const int v = clamp_int(val, 0, 2047);
+            texel = (v << 5) | (v >> 6);
+         }
+
+         memcpy(texels + (y * 4 + x) * stride, &texel, sizeof(texel));
+      }
+   }
+}
+
+static uint32_t etc2_get_block_size(enum virgl_formats format)
+{
+   switch (format) {
+   case VIRGL_FORMAT_ETC2_RGBA8:
+   case VIRGL_FORMAT_ETC2_SRGBA8:
+   case VIRGL_FORMAT_ETC2_RG11_UNORM:
+   case VIRGL_FORMAT_ETC2_RG11_SNORM:
+      return 16;
+   default:
+      return 8;
+   }
+}
+
+static void etc2_decode_block(enum virgl_formats format, const uint8_t *src,
+                              uint8_t *texels)
+{
+   switch (format) {
+   case VIRGL_FORMAT_ETC2_RGB8:
+   case VIRGL_FORMAT_ETC2_SRGB8:
+      etc2_decode_rgb_block(src, false, texels);
+      break;
+   case VIRGL_FORMAT_ETC2_RGB8A1:
+   case VIRGL_FORMAT_ETC2_SRGB8A1:
+      etc2_decode_rgb_block(src, true, texels);
+      break;
+   case VIRGL_FORMAT_ETC2_RGBA8:
+   case VIRGL_FORMAT_ETC2_SRGBA8:
+      /* the alpha block comes first */
+      etc2_decode_rgb_block(src + 8, false, texels);
+      eac_decode_alpha(src, texels);
+      break;
+   case VIRGL_FORMAT_ETC2_R11_UNORM:
+   case VIRGL_FORMAT_ETC2_R11_SNORM:
+      eac_decode_r11(src, format == VIRGL_FORMAT_ETC2_R11_SNORM, texels, 2);
+      break;
+   case VIRGL_FORMAT_ETC2_RG11_UNORM:
+   case VIRGL_FORMAT_ETC2_RG11_SNORM:
+      eac_decode_r11(src, format == VIRGL_FORMAT_ETC2_RG11_SNORM, texels, 4);
+      eac_decode_r11(src + 8, format == VIRGL_FORMAT_ETC2_RG11_SNORM, texels + 2, 4);
+      break;
+   default:
+      UNREACHABLE("not an ETC2 format");
+   }
+}
+
+bool vrend_etc2_is_supported(enum virgl_formats format)
+{
+   return vrend_etc2_get_texel_size(format) != 0;
+}
+
+uint32_t vrend_etc2_get_texel_size(enum virgl_formats format)
+{
+   switch (format) {
+   case VIRGL_FORMAT_ETC2_RGB8:
+   case VIRGL_FORMAT_ETC2_SRGB8:
+   case VIRGL_FORMAT_ETC2_RGB8A1:
+   case VIRGL_FORMAT_ETC2_SRGB8A1:
+   case VIRGL_FORMAT_ETC2_RGBA8:
+   case VIRGL_FORMAT_ETC2_SRGBA8:
+   case VIRGL_FORMAT_ETC2_RG11_UNORM:
+   case VIRGL_FORMAT_ETC2_RG11_SNORM:
+      return 4;
+   case VIRGL_FORMAT_ETC2_R11_UNORM:
+   case VIRGL_FORMAT_ETC2_R11_SNORM:
+      return 2;
+   default:
+      return 0;
+   }
+}
+
+void vrend_etc2_decode(enum virgl_formats format, const uint8_t *src,
+                       uint32_t width, uint32_t height, uint32_t depth,
+                       uint8_t *dst)
+{
+   const uint32_t texel_size = vrend_etc2_get_texel_size(format);
+   const uint32_t block_size = etc2_get_block_size(format);
+   const uint32_t dst_stride = width * texel_size;
+   uint8_t texels[16 * ETC2_TEXELS_MAX_SIZE];
+
+   for (uint32_t z = 0; z < depth; z++) {
+      for (uint32_t y = 0; y < height; y += 4) {
+         for (uint32_t x = 0; x < width; x += 4) {
+            etc2_decode_block(format, src, texels);
+            src += block_size;
+
+            /* the blocks on the edges may be partially used */
+            const uint32_t w = MIN2(width - x, 4);
+            const uint32_t h = MIN2(height - y, 4);
+            uint8_t *row = dst + ((uint64_t)z * height + y) * dst_stride + x * texel_size;
+            for (uint32_t i = 0; i < h; i++) {
+               memcpy(row, texels + i * 4 * texel_size, w * texel_size);
+               row += dst_stride;
+            }
+         }
+      }
+   }
+}
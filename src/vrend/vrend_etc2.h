@@ -0,0 +1,34 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_ETC2_H
+#define VREND_ETC2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "virgl_hw.h"
+
+/* Decoding of ETC2/EAC textures, for hosts that can not sample them.
+ *
+ * The color formats decode to RGBA8, and the EAC R11 and RG11 formats to
+ * 16-bit normalized channels, signed or unsigned as the format.  The sRGB
+ * formats decode to the same encoded values, the host format does the
+ * conversion.
+ */
+
+bool vrend_etc2_is_supported(enum virgl_formats format);
+
+/* size of a decoded texel */
+uint32_t vrend_etc2_get_texel_size(enum virgl_formats format);
+
+/* Decode the width x height x depth texels of the tightly packed blocks in
+ * src to dst, which has tightly packed rows and layers of decoded texels.
+ */
+void vrend_etc2_decode(enum virgl_formats format, const uint8_t *src,
+                       uint32_t width, uint32_t height, uint32_t depth,
+                       uint8_t *dst);
+
+#endif /* VREND_ETC2_H */
@@ -279,6 +279,20 @@ static struct vrend_format_table etc2_formats[] = {
   {VIRGL_FORMAT_ETC2_RG11_SNORM, GL_COMPRESSED_SIGNED_RG11_EAC, GL_RG, GL_BYTE, NO_SWIZZLE, view_class_unsupported},
 };
 
+/* ETC2 textures decoded on upload by vrend_etc2, see vrend_etc2.h */
+static struct vrend_format_table etc2_emulated_formats[] = {
+  {VIRGL_FORMAT_ETC2_RGB8, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_SRGB8, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_RGB8A1, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_SRGB8A1, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_RGBA8, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_SRGBA8, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_unsupported },
+  {VIRGL_FORMAT_ETC2_R11_UNORM, GL_R16, GL_RED, GL_UNSIGNED_SHORT, NO_SWIZZLE, view_class_unsupported},
+  {VIRGL_FORMAT_ETC2_R11_SNORM, GL_R16_SNORM, GL_RED, GL_SHORT, NO_SWIZZLE, view_class_unsupported},
+  {VIRGL_FORMAT_ETC2_RG11_UNORM, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, NO_SWIZZLE, view_class_unsupported},
+  {VIRGL_FORMAT_ETC2_RG11_SNORM, GL_RG16_SNORM, GL_RG, GL_SHORT, NO_SWIZZLE, view_class_unsupported},
+};
+
 #define ASTC_FORMAT(size) \
   {VIRGL_FORMAT_ASTC_ ## size, GL_COMPRESSED_RGBA_ASTC_ ## size, GL_RGBA, GL_UNSIGNED_BYTE, NO_SWIZZLE, view_class_astc_## size ##_rgba}, \
   {VIRGL_FORMAT_ASTC_ ## size, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_ ## size, GL_RGBA, GL_BYTE, NO_SWIZZLE, view_class_astc_## size ##_rgba}
@@ -377,7 +391,7 @@ static bool color_format_can_readback(struct vrend_format_table *virgl_format, i
        return true;
 
    if ((virgl_format->format == VIRGL_FORMAT_R32G32B32A32_FLOAT) &&
-       (gles_ver >= 32 || epoxy_has_gl_extension("GL_EXT_color_buffer_float")))
+       (gles_ver >= 32 || vrend_has_gl_extension("GL_EXT_color_buffer_float")))
       return true;
 
    /* Hotfix for the CI, on GLES these formats are defined like
@@ -406,17 +420,17 @@ static bool depth_stencil_formats_can_readback(enum virgl_formats format)
    case VIRGL_FORMAT_Z32_UNORM:
    case VIRGL_FORMAT_Z32_FLOAT:
    case VIRGL_FORMAT_Z24X8_UNORM:
-      return epoxy_has_gl_extension("GL_NV_read_depth");
+      return vrend_has_gl_extension("GL_NV_read_depth");
 
    case VIRGL_FORMAT_Z24_UNORM_S8_UINT:
    case VIRGL_FORMAT_S8_UINT_Z24_UNORM:
    case VIRGL_FORMAT_Z32_FLOAT_S8X24_UINT:
-      return epoxy_has_gl_extension("GL_NV_read_depth_stencil");
+      return vrend_has_gl_extension("GL_NV_read_depth_stencil");
 
    case VIRGL_FORMAT_X24S8_UINT:
    case VIRGL_FORMAT_S8X24_UINT:
    case VIRGL_FORMAT_S8_UINT:
-      return epoxy_has_gl_extension("GL_NV_read_stencil");
+      return vrend_has_gl_extension("GL_NV_read_stencil");
 
    default:
       return false;
@@ -529,9 +543,20 @@ static void vrend_add_compressed_formats(struct vrend_format_table *table, int n
    }
 }
 
+/* The textures are decoded when they are written, they can not be read
+ * back in their compressed form. */
+static void vrend_add_emulated_compressed_formats(struct vrend_format_table *table, int num_entries)
+{
+   for (int i = 0; i < num_entries; i++) {
+      vrend_insert_format(&table[i], VIRGL_BIND_SAMPLER_VIEW,
+                          VIRGL_TEXTURE_EMULATED_COMPRESSION);
+   }
+}
+
 
 #define add_formats(x) vrend_add_formats((x), ARRAY_SIZE((x)))
 #define add_compressed_formats(x) vrend_add_compressed_formats((x), ARRAY_SIZE((x)))
+#define add_emulated_compressed_formats(x) vrend_add_emulated_compressed_formats((x), ARRAY_SIZE((x)))
 
 void vrend_build_format_list_common(void)
 {
@@ -562,19 +587,19 @@ void vrend_build_format_list_common(void)
   add_formats(snorm_la_formats);
 
   /* compressed */
-  if (epoxy_has_gl_extension("GL_S3_s3tc") ||
-      epoxy_has_gl_extension("GL_EXT_texture_compression_s3tc") ||
-      epoxy_has_gl_extension("GL_ANGLE_texture_compression_dxt")) {
+  if (vrend_has_gl_extension("GL_S3_s3tc") ||
+      vrend_has_gl_extension("GL_EXT_texture_compression_s3tc") ||
+      vrend_has_gl_extension("GL_ANGLE_texture_compression_dxt")) {
      add_compressed_formats(dxtn_formats);
      add_compressed_formats(dxtn_srgb_formats);
   }
 
-  if (epoxy_has_gl_extension("GL_ARB_texture_compression_rgtc") ||
-      epoxy_has_gl_extension("GL_EXT_texture_compression_rgtc") )
+  if (vrend_has_gl_extension("GL_ARB_texture_compression_rgtc") ||
+      vrend_has_gl_extension("GL_EXT_texture_compression_rgtc") )
      add_compressed_formats(rgtc_formats);
 
-  if (epoxy_has_gl_extension("GL_ARB_texture_compression_bptc") ||
-      epoxy_has_gl_extension("GL_EXT_texture_compression_bptc"))
+  if (vrend_has_gl_extension("GL_ARB_texture_compression_bptc") ||
+      vrend_has_gl_extension("GL_EXT_texture_compression_bptc"))
      add_compressed_formats(bptc_formats);
 
   add_formats(srgb_formats);
@@ -595,6 +620,12 @@ void vrend_build_format_list_gl(void)
   add_formats(gl_base_rgba_formats);
   add_formats(gl_bgra_formats);
   add_formats(gl_bit10_formats);
+
+  /* Android guests rely on ETC2, decode it on hosts that lack it */
+  if (vrend_has_gl_extension("GL_ARB_ES3_compatibility"))
+     add_compressed_formats(etc2_formats);
+  else
+     add_emulated_compressed_formats(etc2_emulated_formats);
 }
 
 void vrend_build_format_list_gles(void)
@@ -615,7 +646,7 @@ void vrend_build_format_list_gles(void)
   add_formats(gles_z32_format);
   add_formats(gles_bit10_formats);
 
-  if (epoxy_has_gl_extension("GL_KHR_texture_compression_astc_ldr"))
+  if (vrend_has_gl_extension("GL_KHR_texture_compression_astc_ldr"))
      add_compressed_formats(astc_formats);
 
   if (epoxy_gl_version() >= 30) {
@@ -0,0 +1,296 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_gl_state.h"
+
+#include <string.h>
+
+#include "util/macros.h"
+
+#define GL_STATE_MAX_TEXTURE_UNITS 128
+
+enum gl_state_buffer_target {
+   GL_STATE_ARRAY_BUFFER,
+   GL_STATE_COPY_READ_BUFFER,
+   GL_STATE_COPY_WRITE_BUFFER,
+   GL_STATE_PIXEL_PACK_BUFFER,
+   GL_STATE_PIXEL_UNPACK_BUFFER,
+   GL_STATE_DRAW_INDIRECT_BUFFER,
+   GL_STATE_DISPATCH_INDIRECT_BUFFER,
+   GL_STATE_PARAMETER_BUFFER,
+   GL_STATE_QUERY_BUFFER,
+   GL_STATE_TEXTURE_BUFFER,
+   GL_STATE_NUM_BUFFER_TARGETS,
+};
+
+struct gl_state_texture_unit {
+   /* 0 when unknown */
+   GLenum target;
+   GLuint id;
+};
+
+static struct {
+   uint64_t caps_known;
+   uint64_t caps_enabled;
+
+   bool active_texture_known;
+   GLenum active_texture;
+   struct gl_state_texture_unit textures[GL_STATE_MAX_TEXTURE_UNITS];
+
+   uint32_t buffers_known;
+   GLuint buffers[GL_STATE_NUM_BUFFER_TARGETS];
+
+   bool program_known;
+   GLuint program;
+   bool pipeline_known;
+   GLuint pipeline;
+
+   bool vertex_array_known;
+   GLuint vertex_array;
+
+   uint64_t elided_calls;
+} gl_state;
+
+/* Map the capabilities the renderer toggles per draw to a bit in the shadow
+ * masks, anything else returns -1 and is not shadowed. */
+static int gl_state_cap_index(GLenum cap)
+{
+   switch (cap) {
+   case GL_BLEND: return 0;
+   case GL_COLOR_LOGIC_OP: return 1;
+   case GL_CULL_FACE: return 2;
+   case GL_DEPTH_CLAMP: return 3;
+   case GL_DEPTH_TEST: return 4;
+   case GL_DITHER: return 5;
+   case GL_FRAMEBUFFER_SRGB: return 6;
+   case GL_LINE_SMOOTH: return 7;
+   case GL_MULTISAMPLE: return 8;
+   case GL_POLYGON_OFFSET_FILL: return 9;
+   case GL_POLYGON_OFFSET_LINE: return 10;
+   case GL_POLYGON_OFFSET_POINT: return 11;
+   case GL_POLYGON_SMOOTH: return 12;
+   case GL_PRIMITIVE_RESTART: return 13;
+   case GL_PRIMITIVE_RESTART_FIXED_INDEX: return 14;
+   case GL_PROGRAM_POINT_SIZE: return 15;
+   case GL_RASTERIZER_DISCARD: return 16;
+   case GL_SAMPLE_ALPHA_TO_COVERAGE: return 17;
+   case GL_SAMPLE_ALPHA_TO_ONE: return 18;
+   case GL_SAMPLE_MASK: return 19;
+   case GL_SAMPLE_SHADING: return 20;
+   case GL_SCISSOR_TEST: return 21;
+   case GL_STENCIL_TEST: return 22;
+   case GL_TEXTURE_CUBE_MAP_SEAMLESS: return 23;
+   default: return -1;
+   }
+}
+
+static int gl_state_buffer_index(GLenum target)
+{
+   switch (target) {
+   case GL_ARRAY_BUFFER: return GL_STATE_ARRAY_BUFFER;
+   case GL_COPY_READ_BUFFER: return GL_STATE_COPY_READ_BUFFER;
+   case GL_COPY_WRITE_BUFFER: return GL_STATE_COPY_WRITE_BUFFER;
+   case GL_PIXEL_PACK_BUFFER: return GL_STATE_PIXEL_PACK_BUFFER;
+   case GL_PIXEL_UNPACK_BUFFER: return GL_STATE_PIXEL_UNPACK_BUFFER;
+   case GL_DRAW_INDIRECT_BUFFER: return GL_STATE_DRAW_INDIRECT_BUFFER;
+   case GL_DISPATCH_INDIRECT_BUFFER: return GL_STATE_DISPATCH_INDIRECT_BUFFER;
+   case GL_PARAMETER_BUFFER_ARB: return GL_STATE_PARAMETER_BUFFER;
+   case GL_QUERY_BUFFER: return GL_STATE_QUERY_BUFFER;
+   case GL_TEXTURE_BUFFER: return GL_STATE_TEXTURE_BUFFER;
+   /* the element array binding is vertex array state and the indexed
+    * targets are also changed by glBindBufferBase/Range */
+   default: return -1;
+   }
+}
+
+void vrend_gl_state_invalidate(void)
+{
+   uint64_t elided_calls = gl_state.elided_calls;
+   memset(&gl_state, 0, sizeof(gl_state));
+   gl_state.elided_calls = elided_calls;
+}
+
+void vrend_gl_state_forget_texture(GLuint id)
+{
+   for (unsigned i = 0; i < ARRAY_SIZE(gl_state.textures); i++) {
+      if (gl_state.textures[i].id == id)
+         gl_state.textures[i].target = 0;
+   }
+}
+
+void vrend_gl_state_forget_buffer(GLuint id)
+{
+   for (unsigned i = 0; i < GL_STATE_NUM_BUFFER_TARGETS; i++) {
+      if (gl_state.buffers[i] == id)
+         gl_state.buffers_known &= ~(1u << i);
+   }
+}
+
+void vrend_gl_state_forget_program(GLuint id)
+{
+   if (gl_state.program == id)
+      gl_state.program_known = false;
+   if (gl_state.pipeline == id)
+      gl_state.pipeline_known = false;
+}
+
+void vrend_gl_state_forget_vertex_array(GLuint id)
+{
+   if (gl_state.vertex_array == id)
+      gl_state.vertex_array_known = false;
+}
+
+void vrend_gl_enable(GLenum cap, bool enable)
+{
+   int index = gl_state_cap_index(cap);
+
+   if (index >= 0) {
+      uint64_t bit = 1ull << index;
+      if ((gl_state.caps_known & bit) &&
+          !!(gl_state.caps_enabled & bit) == enable) {
+         gl_state.elided_calls++;
+         return;
+      }
+      gl_state.caps_known |= bit;
+      if (enable)
+         gl_state.caps_enabled |= bit;
+      else
+         gl_state.caps_enabled &= ~bit;
+   }
+
+   if (enable)
+      glEnable(cap);
+   else
+      glDisable(cap);
+}
+
+void vrend_gl_enable_indexed(GLenum cap, GLuint index, bool enable)
+{
+   int cap_index = gl_state_cap_index(cap);
+
+   if (cap_index >= 0)
+      gl_state.caps_known &= ~(1ull << cap_index);
+
+   if (enable)
+      glEnableIndexedEXT(cap, index);
+   else
+      glDisableIndexedEXT(cap, index);
+}
+
+void vrend_gl_active_texture(GLenum unit)
+{
+   if (gl_state.active_texture_known && gl_state.active_texture == unit) {
+      gl_state.elided_calls++;
+      return;
+   }
+
+   gl_state.active_texture_known = true;
+   gl_state.active_texture = unit;
+   glActiveTexture(unit);
+}
+
+void vrend_gl_bind_texture(GLenum target, GLuint id)
+{
+   struct gl_state_texture_unit *tex = NULL;
+
+   if (gl_state.active_texture_known &&
+       gl_state.active_texture - GL_TEXTURE0 < GL_STATE_MAX_TEXTURE_UNITS)
+      tex = &gl_state.textures[gl_state.active_texture - GL_TEXTURE0];
+
+   if (tex) {
+      if (tex->target == target && tex->id == id) {
+         gl_state.elided_calls++;
+         return;
+      }
+      /* a unit has one binding per target, only the last one is kept */
+      tex->target = target;
+      tex->id = id;
+   }
+
+   glBindTexture(target, id);
+}
+
+void vrend_gl_bind_textures(GLuint first, GLsizei count,
+                            const GLenum *targets, const GLuint *ids)
+{
+   GLsizei i;
+
+   if (first + count <= GL_STATE_MAX_TEXTURE_UNITS) {
+      for (i = 0; i < count; i++) {
+         const struct gl_state_texture_unit *tex = &gl_state.textures[first + i];
+         if (tex->target != targets[i] || tex->id != ids[i])
+            break;
+      }
+      if (i == count) {
+         gl_state.elided_calls++;
+         return;
+      }
+   }
+
+   for (i = 0; i < count && first + i < GL_STATE_MAX_TEXTURE_UNITS; i++) {
+      gl_state.textures[first + i].target = targets[i];
+      gl_state.textures[first + i].id = ids[i];
+   }
+
+   glBindTextures(first, count, ids);
+}
+
+void vrend_gl_bind_buffer(GLenum target, GLuint id)
+{
+   int index = gl_state_buffer_index(target);
+
+   if (index >= 0) {
+      uint32_t bit = 1u << index;
+      if ((gl_state.buffers_known & bit) && gl_state.buffers[index] == id) {
+         gl_state.elided_calls++;
+         return;
+      }
+      gl_state.buffers_known |= bit;
+      gl_state.buffers[index] = id;
+   }
+
+   glBindBuffer(target, id);
+}
+
+void vrend_gl_use_program(GLuint id)
+{
+   if (gl_state.program_known && gl_state.program == id) {
+      gl_state.elided_calls++;
+      return;
+   }
+
+   gl_state.program_known = true;
+   gl_state.program = id;
+   glUseProgram(id);
+}
+
+void vrend_gl_bind_program_pipeline(GLuint id)
+{
+   if (gl_state.pipeline_known && gl_state.pipeline == id) {
+      gl_state.elided_calls++;
+      return;
+   }
+
+   gl_state.pipeline_known = true;
+   gl_state.pipeline = id;
+   glBindProgramPipeline(id);
+}
+
+void vrend_gl_bind_vertex_array(GLuint id)
+{
+   if (gl_state.vertex_array_known && gl_state.vertex_array == id) {
+      gl_state.elided_calls++;
+      return;
+   }
+
+   gl_state.vertex_array_known = true;
+   gl_state.vertex_array = id;
+   glBindVertexArray(id);
+}
+
+uint64_t vrend_gl_state_elided_calls(void)
+{
+   return gl_state.elided_calls;
+}
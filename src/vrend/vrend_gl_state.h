@@ -0,0 +1,64 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_GL_STATE_H
+#define VREND_GL_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <epoxy/gl.h>
+
+/* Shadow of the GL state of the current context.
+ *
+ * The wrappers below skip calls that would set a piece of state to the value
+ * it already has.  Only state that is exclusively changed through these
+ * wrappers is shadowed: capabilities, the texture bound to each unit, the
+ * non-indexed buffer bindings, the program and the vertex array.  Anything
+ * else is passed straight to GL.
+ *
+ * The shadow describes whichever context is current, so it has to be
+ * invalidated whenever a different GL context is made current, and objects
+ * have to be forgotten when they are deleted because their names may be
+ * reused.
+ */
+
+void vrend_gl_state_invalidate(void);
+
+void vrend_gl_state_forget_texture(GLuint id);
+
+void vrend_gl_state_forget_buffer(GLuint id);
+
+void vrend_gl_state_forget_program(GLuint id);
+
+void vrend_gl_state_forget_vertex_array(GLuint id);
+
+void vrend_gl_enable(GLenum cap, bool enable);
+
+/* Indexed enables also change the non-indexed value, so they drop the
+ * shadowed value of the capability. */
+void vrend_gl_enable_indexed(GLenum cap, GLuint index, bool enable);
+
+void vrend_gl_active_texture(GLenum unit);
+
+void vrend_gl_bind_texture(GLenum target, GLuint id);
+
+/* glBindTextures, the targets are those of the textures, which the call
+ * doesn't take but the shadow tracks. */
+void vrend_gl_bind_textures(GLuint first, GLsizei count,
+                            const GLenum *targets, const GLuint *ids);
+
+void vrend_gl_bind_buffer(GLenum target, GLuint id);
+
+void vrend_gl_use_program(GLuint id);
+
+void vrend_gl_bind_program_pipeline(GLuint id);
+
+void vrend_gl_bind_vertex_array(GLuint id);
+
+/* Number of GL calls the shadow filtered out, for debugging */
+uint64_t vrend_gl_state_elided_calls(void);
+
+#endif
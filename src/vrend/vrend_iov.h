@@ -72,4 +72,36 @@ int vrend_copy_iovec(const struct iovec *src_iov, int src_iovlen, size_t src_off
                      const struct iovec *dst_iov, int dst_iovlen, size_t dst_offset,
                      size_t count, char *buf);
 
+size_t *vrend_iovec_build_offsets(const struct iovec *iov, int iovlen);
+
+/* Position in an iovec that accesses continue from, so that walking an
+ * iovec row by row does not rescan it from the first entry each time.
+ * With the offsets from vrend_iovec_build_offsets, seeking backwards or
+ * far ahead is a binary search, without them the cursor walks the
+ * entries from where it is, or from the start when seeking backwards. */
+struct vrend_iov_cursor {
+   const struct iovec *iov;
+   int iovlen;
+   const size_t *offsets;
+   int index;
+   /* offset of iov[index] */
+   size_t start;
+};
+
+void vrend_iov_cursor_init(struct vrend_iov_cursor *cursor,
+                           const struct iovec *iov, int iovlen,
+                           const size_t *offsets);
+
+size_t vrend_iov_cursor_read(struct vrend_iov_cursor *cursor, size_t offset,
+                             char *buf, size_t count);
+
+size_t vrend_iov_cursor_write(struct vrend_iov_cursor *cursor, size_t offset,
+                              const char *buf, size_t count);
+
+size_t vrend_iov_copy_box(const struct iovec *iov, int iovlen,
+                          const size_t *offsets, size_t offset,
+                          char *buf, size_t row_size, uint32_t rows,
+                          size_t stride, uint32_t layers, size_t layer_stride,
+                          bool invert, bool to_iov);
+
 #endif
@@ -61,7 +61,7 @@ static void free_object(void *value)
 struct util_hash_table *vrend_object_init_ctx_table(void)
 {
    struct util_hash_table *ctx_hash;
-   ctx_hash = util_hash_table_create(hash_func_u32, equal_func, free_object);
+   ctx_hash = util_hash_table_create_dense(hash_func_u32, equal_func, free_object);
    return ctx_hash;
 }
 
@@ -81,9 +81,9 @@ static void vrend_ctx_resource_destroy_func(UNUSED void *val)
 struct util_hash_table *
 vrend_ctx_resource_init_table(void)
 {
-   return util_hash_table_create(hash_func_u32,
-                                 equal_func,
-                                 vrend_ctx_resource_destroy_func);
+   return util_hash_table_create_dense(hash_func_u32,
+                                       equal_func,
+                                       vrend_ctx_resource_destroy_func);
 }
 
 void vrend_ctx_resource_fini_table(struct util_hash_table *res_hash)
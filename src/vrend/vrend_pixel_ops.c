@@ -0,0 +1,426 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_pixel_ops.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/macros.h"
+#include "util/u_cpu_detect.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_OPS_HAVE_X86 1
+#include <immintrin.h>
+#define PIXEL_OPS_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(__ARM_NEON)
+#define PIXEL_OPS_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*pixel_op_func)(uint64_t size, void *data);
+
+struct pixel_ops {
+   pixel_op_func swizzle_bgra;
+   pixel_op_func swizzle_and_collapse_bgrx;
+   pixel_op_func collapse_r8g8b8x8;
+   pixel_op_func collapse_r16g16b16x16;
+};
+
+static void swizzle_data_bgra_scalar(uint64_t size, void *data) {
+   const size_t bpp = 4;
+   const size_t num_pixels = size / bpp;
+   for (size_t i = 0; i < num_pixels; ++i) {
+      unsigned char *pixel = ((unsigned char*)data) + i * bpp;
+      unsigned char first  = *pixel;
+      *pixel = *(pixel + 2);
+      *(pixel + 2) = first;
+   }
+}
+
+static void swizzle_and_collapse_data_bgrx_scalar(uint64_t size, void *data) {
+   const size_t in_bpp = 4;
+   const size_t out_bpp = 3;
+
+   uint8_t *in_pixel, *out_pixel;
+   in_pixel = out_pixel = data;
+
+   // in-place modification, so output cursor must not lead
+   assert(in_bpp >= out_bpp);
+
+   uint8_t r, g, b;
+   const size_t num_pixels = size / in_bpp;
+   for (size_t i = 0; i < num_pixels; ++i) {
+      b = *(in_pixel + 0);
+      g = *(in_pixel + 1);
+      r = *(in_pixel + 2);
+
+      *(out_pixel + 0) = r;
+      *(out_pixel + 1) = g;
+      *(out_pixel + 2) = b;
+
+      in_pixel += in_bpp;
+      out_pixel += out_bpp;
+   }
+}
+
+static void collapse_data_r8g8b8x8_scalar(uint64_t size, void *data) {
+   const size_t in_bpp = 4;
+   const size_t out_bpp = 3;
+
+   uint8_t *in_pixel, *out_pixel;
+   in_pixel = out_pixel = data;
+
+   // in-place modification, so output cursor must not lead
+   assert(in_bpp >= out_bpp);
+
+   const size_t num_pixels = size / in_bpp;
+   for (size_t i = 0; i < num_pixels; ++i) {
+      *(out_pixel + 0) = *(in_pixel + 0);
+      *(out_pixel + 1) = *(in_pixel + 1);
+      *(out_pixel + 2) = *(in_pixel + 2);
+
+      in_pixel += in_bpp;
+      out_pixel += out_bpp;
+   }
+}
+
+static void collapse_data_r16g16b16x16_scalar(uint64_t size, void *data) {
+   const size_t in_channels = 4;
+   const size_t out_channels = 3;
+
+   uint16_t *in_pixel, *out_pixel;
+   in_pixel = out_pixel = data;
+
+   // in-place modification, so output cursor must not lead
+   assert(in_channels >= out_channels);
+
+   const size_t num_pixels = size / in_channels / 2;
+   for (size_t i = 0; i < num_pixels; ++i) {
+      *(out_pixel + 0) = *(in_pixel + 0);
+      *(out_pixel + 1) = *(in_pixel + 1);
+      *(out_pixel + 2) = *(in_pixel + 2);
+
+      in_pixel += in_channels;
+      out_pixel += out_channels;
+   }
+}
+
+/* The vectorized collapse loops work in place as well: a block is loaded
+ * before the shorter result is stored at or behind it, and the bytes stored
+ * past the result of a block are overwritten by the next block or the
+ * scalar tail, which both only read input past the current block.  The tail
+ * is handed to the scalar version on the remaining input. */
+
+#ifdef PIXEL_OPS_HAVE_X86
+
+#define SHUF_BGRA 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+#define SHUF_BGRX 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+#define SHUF_RGBX 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+#define SHUF_RGBX16 0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1
+
+PIXEL_OPS_TARGET("sse4.1")
+static void swizzle_data_bgra_sse41(uint64_t size, void *data)
+{
+   const __m128i shuf = _mm_setr_epi8(SHUF_BGRA);
+   uint8_t *ptr = data;
+   uint64_t i = 0;
+
+   for (; i + 16 <= size; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(ptr + i));
+      _mm_storeu_si128((__m128i *)(ptr + i), _mm_shuffle_epi8(v, shuf));
+   }
+
+   swizzle_data_bgra_scalar(size - i, ptr + i);
+}
+
+/* shared by the 4 to 3 byte collapses, 16 bytes in, 12 bytes out */
+PIXEL_OPS_TARGET("sse4.1")
+static uint64_t collapse_sse41(uint64_t size, uint8_t *ptr, __m128i shuf, uint64_t *out)
+{
+   uint64_t i = 0, o = 0;
+
+   for (; i + 16 <= size; i += 16, o += 12) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(ptr + i));
+      _mm_storeu_si128((__m128i *)(ptr + o), _mm_shuffle_epi8(v, shuf));
+   }
+
+   *out = o;
+   return i;
+}
+
+PIXEL_OPS_TARGET("sse4.1")
+static void swizzle_and_collapse_data_bgrx_sse41(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_sse41(size, ptr, _mm_setr_epi8(SHUF_BGRX), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   swizzle_and_collapse_data_bgrx_scalar(size - in, ptr + out);
+}
+
+PIXEL_OPS_TARGET("sse4.1")
+static void collapse_data_r8g8b8x8_sse41(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_sse41(size, ptr, _mm_setr_epi8(SHUF_RGBX), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   collapse_data_r8g8b8x8_scalar(size - in, ptr + out);
+}
+
+PIXEL_OPS_TARGET("sse4.1")
+static void collapse_data_r16g16b16x16_sse41(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_sse41(size, ptr, _mm_setr_epi8(SHUF_RGBX16), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   collapse_data_r16g16b16x16_scalar(size - in, ptr + out);
+}
+
+PIXEL_OPS_TARGET("avx2")
+static void swizzle_data_bgra_avx2(uint64_t size, void *data)
+{
+   const __m256i shuf = _mm256_setr_epi8(SHUF_BGRA, SHUF_BGRA);
+   uint8_t *ptr = data;
+   uint64_t i = 0;
+
+   for (; i + 32 <= size; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(ptr + i));
+      _mm256_storeu_si256((__m256i *)(ptr + i), _mm256_shuffle_epi8(v, shuf));
+   }
+
+   swizzle_data_bgra_scalar(size - i, ptr + i);
+}
+
+/* 32 bytes in, 24 bytes out: the shuffle works per 128 bit lane, the
+ * permute moves the 12 bytes of the upper lane next to the lower ones */
+PIXEL_OPS_TARGET("avx2")
+static uint64_t collapse_avx2(uint64_t size, uint8_t *ptr, __m256i shuf, uint64_t *out)
+{
+   const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+   uint64_t i = 0, o = 0;
+
+   for (; i + 32 <= size; i += 32, o += 24) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(ptr + i));
+      v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+      _mm256_storeu_si256((__m256i *)(ptr + o), v);
+   }
+
+   *out = o;
+   return i;
+}
+
+PIXEL_OPS_TARGET("avx2")
+static void swizzle_and_collapse_data_bgrx_avx2(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_avx2(size, ptr, _mm256_setr_epi8(SHUF_BGRX, SHUF_BGRX), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   swizzle_and_collapse_data_bgrx_scalar(size - in, ptr + out);
+}
+
+PIXEL_OPS_TARGET("avx2")
+static void collapse_data_r8g8b8x8_avx2(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_avx2(size, ptr, _mm256_setr_epi8(SHUF_RGBX, SHUF_RGBX), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   collapse_data_r8g8b8x8_scalar(size - in, ptr + out);
+}
+
+PIXEL_OPS_TARGET("avx2")
+static void collapse_data_r16g16b16x16_avx2(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t out;
+   uint64_t in = collapse_avx2(size, ptr, _mm256_setr_epi8(SHUF_RGBX16, SHUF_RGBX16), &out);
+
+   memmove(ptr + out, ptr + in, size - in);
+   collapse_data_r16g16b16x16_scalar(size - in, ptr + out);
+}
+
+#endif /* PIXEL_OPS_HAVE_X86 */
+
+#ifdef PIXEL_OPS_HAVE_NEON
+
+static void swizzle_data_bgra_neon(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t i = 0;
+
+   for (; i + 64 <= size; i += 64) {
+      uint8x16x4_t v = vld4q_u8(ptr + i);
+      uint8x16_t tmp = v.val[0];
+      v.val[0] = v.val[2];
+      v.val[2] = tmp;
+      vst4q_u8(ptr + i, v);
+   }
+
+   swizzle_data_bgra_scalar(size - i, ptr + i);
+}
+
+static void swizzle_and_collapse_data_bgrx_neon(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t i = 0, o = 0;
+
+   for (; i + 64 <= size; i += 64, o += 48) {
+      uint8x16x4_t v = vld4q_u8(ptr + i);
+      uint8x16x3_t res = { { v.val[2], v.val[1], v.val[0] } };
+      vst3q_u8(ptr + o, res);
+   }
+
+   memmove(ptr + o, ptr + i, size - i);
+   swizzle_and_collapse_data_bgrx_scalar(size - i, ptr + o);
+}
+
+static void collapse_data_r8g8b8x8_neon(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t i = 0, o = 0;
+
+   for (; i + 64 <= size; i += 64, o += 48) {
+      uint8x16x4_t v = vld4q_u8(ptr + i);
+      uint8x16x3_t res = { { v.val[0], v.val[1], v.val[2] } };
+      vst3q_u8(ptr + o, res);
+   }
+
+   memmove(ptr + o, ptr + i, size - i);
+   collapse_data_r8g8b8x8_scalar(size - i, ptr + o);
+}
+
+static void collapse_data_r16g16b16x16_neon(uint64_t size, void *data)
+{
+   uint8_t *ptr = data;
+   uint64_t i = 0, o = 0;
+
+   for (; i + 64 <= size; i += 64, o += 48) {
+      uint16x8x4_t v = vld4q_u16((const uint16_t *)(ptr + i));
+      uint16x8x3_t res = { { v.val[0], v.val[1], v.val[2] } };
+      vst3q_u16((uint16_t *)(ptr + o), res);
+   }
+
+   memmove(ptr + o, ptr + i, size - i);
+   collapse_data_r16g16b16x16_scalar(size - i, ptr + o);
+}
+
+#endif /* PIXEL_OPS_HAVE_NEON */
+
+static const struct pixel_ops pixel_ops_impls[VREND_PIXEL_OPS_NUM_IMPLS] = {
+   [VREND_PIXEL_OPS_SCALAR] = {
+      swizzle_data_bgra_scalar,
+      swizzle_and_collapse_data_bgrx_scalar,
+      collapse_data_r8g8b8x8_scalar,
+      collapse_data_r16g16b16x16_scalar,
+   },
+#ifdef PIXEL_OPS_HAVE_X86
+   [VREND_PIXEL_OPS_SSE41] = {
+      swizzle_data_bgra_sse41,
+      swizzle_and_collapse_data_bgrx_sse41,
+      collapse_data_r8g8b8x8_sse41,
+      collapse_data_r16g16b16x16_sse41,
+   },
+   [VREND_PIXEL_OPS_AVX2] = {
+      swizzle_data_bgra_avx2,
+      swizzle_and_collapse_data_bgrx_avx2,
+      collapse_data_r8g8b8x8_avx2,
+      collapse_data_r16g16b16x16_avx2,
+   },
+#endif
+#ifdef PIXEL_OPS_HAVE_NEON
+   [VREND_PIXEL_OPS_NEON] = {
+      swizzle_data_bgra_neon,
+      swizzle_and_collapse_data_bgrx_neon,
+      collapse_data_r8g8b8x8_neon,
+      collapse_data_r16g16b16x16_neon,
+   },
+#endif
+};
+
+static struct pixel_ops pixel_ops = {
+   swizzle_data_bgra_scalar,
+   swizzle_and_collapse_data_bgrx_scalar,
+   collapse_data_r8g8b8x8_scalar,
+   collapse_data_r16g16b16x16_scalar,
+};
+
+static bool pixel_ops_supported(enum vrend_pixel_ops_impl impl)
+{
+   if (impl >= VREND_PIXEL_OPS_NUM_IMPLS || !pixel_ops_impls[impl].swizzle_bgra)
+      return false;
+
+   util_cpu_detect();
+
+   switch (impl) {
+   case VREND_PIXEL_OPS_SSE41:
+      return util_get_cpu_caps()->has_sse4_1;
+   case VREND_PIXEL_OPS_AVX2:
+      return util_get_cpu_caps()->has_avx2;
+   case VREND_PIXEL_OPS_NEON:
+      return util_get_cpu_caps()->has_neon;
+   default:
+      return true;
+   }
+}
+
+void vrend_pixel_ops_init(void)
+{
+   for (int impl = VREND_PIXEL_OPS_NUM_IMPLS - 1; impl >= 0; impl--) {
+      if (vrend_pixel_ops_select(impl))
+         return;
+   }
+}
+
+bool vrend_pixel_ops_select(enum vrend_pixel_ops_impl impl)
+{
+   if (!pixel_ops_supported(impl))
+      return false;
+
+   pixel_ops = pixel_ops_impls[impl];
+   return true;
+}
+
+const char *vrend_pixel_ops_impl_name(enum vrend_pixel_ops_impl impl)
+{
+   switch (impl) {
+   case VREND_PIXEL_OPS_SCALAR: return "scalar";
+   case VREND_PIXEL_OPS_SSE41: return "sse4.1";
+   case VREND_PIXEL_OPS_AVX2: return "avx2";
+   case VREND_PIXEL_OPS_NEON: return "neon";
+   default: return "unknown";
+   }
+}
+
+void vrend_swizzle_data_bgra(uint64_t size, void *data)
+{
+   pixel_ops.swizzle_bgra(size, data);
+}
+
+void vrend_swizzle_and_collapse_data_bgrx(uint64_t size, void *data)
+{
+   pixel_ops.swizzle_and_collapse_bgrx(size, data);
+}
+
+void vrend_collapse_data_r8g8b8x8(uint64_t size, void *data)
+{
+   pixel_ops.collapse_r8g8b8x8(size, data);
+}
+
+void vrend_collapse_data_r16g16b16x16(uint64_t size, void *data)
+{
+   pixel_ops.collapse_r16g16b16x16(size, data);
+}
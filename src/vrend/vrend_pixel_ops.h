@@ -0,0 +1,48 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_PIXEL_OPS_H
+#define VREND_PIXEL_OPS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* In-place pixel conversions of the transfer paths.
+ *
+ * Each operation has a scalar implementation and, depending on the
+ * architecture, vectorized ones.  vrend_pixel_ops_init selects the fastest
+ * one the CPU supports, until then the scalar ones are used.  The collapse
+ * operations leave the bytes past the converted data undefined.
+ */
+
+enum vrend_pixel_ops_impl {
+   VREND_PIXEL_OPS_SCALAR,
+   VREND_PIXEL_OPS_SSE41,
+   VREND_PIXEL_OPS_AVX2,
+   VREND_PIXEL_OPS_NEON,
+   VREND_PIXEL_OPS_NUM_IMPLS,
+};
+
+void vrend_pixel_ops_init(void);
+
+/* Select a specific implementation, for tests and benchmarks.  Returns false
+ * when it is not available on this CPU or build. */
+bool vrend_pixel_ops_select(enum vrend_pixel_ops_impl impl);
+
+const char *vrend_pixel_ops_impl_name(enum vrend_pixel_ops_impl impl);
+
+/* swap the r and b channels of 32bpp pixels */
+void vrend_swizzle_data_bgra(uint64_t size, void *data);
+
+/* swap the r and b channels of 32bpp pixels and drop the x channel */
+void vrend_swizzle_and_collapse_data_bgrx(uint64_t size, void *data);
+
+/* drop the x channel of 32bpp pixels */
+void vrend_collapse_data_r8g8b8x8(uint64_t size, void *data);
+
+/* drop the x channel of 64bpp pixels */
+void vrend_collapse_data_r16g16b16x16(uint64_t size, void *data);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_program_cache.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c11/threads.h"
+#include "util/macros.h"
+#include "util/u_debug.h"
+#include "virgl_util.h"
+
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+/* lookups of an enabled cache, where a stale binary is a miss */
+static struct {
+   uint64_t hit_count;
+   uint64_t miss_count;
+} program_cache_stats;
+
+#ifndef _WIN32
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROGRAM_CACHE_MAGIC 0x31435056 /* "VPC1" */
+#define PROGRAM_CACHE_DEFAULT_MAX_SIZE (256 * 1024 * 1024)
+#define PROGRAM_CACHE_SUFFIX ".bin"
+/* 32 hex digits for the key plus the suffix */
+#define PROGRAM_CACHE_NAME_LEN (32 + sizeof(PROGRAM_CACHE_SUFFIX) - 1)
+
+struct program_cache_header {
+   uint32_t magic;
+   uint32_t binary_format;
+   uint64_t driver_id;
+   uint64_t key[2];
+   uint32_t binary_size;
+   uint32_t padding;
+};
+
+struct program_cache_entry {
+   char name[PROGRAM_CACHE_NAME_LEN + 1];
+   uint64_t size;
+   struct timespec mtime;
+};
+
+static struct {
+   bool enabled;
+   char *dir;
+   uint64_t driver_id;
+   uint64_t max_size;
+   /* Estimate of the directory size, other processes sharing the directory
+    * are only accounted for when the directory is rescanned. */
+   uint64_t total_size;
+   /* loads and stores also come from the blitter prewarm thread */
+   mtx_t mutex;
+} program_cache;
+
+static void program_cache_entry_path(char *path, size_t len, const struct vrend_program_cache_key *key)
+{
+   snprintf(path, len, "%s/%016" PRIx64 "%016" PRIx64 PROGRAM_CACHE_SUFFIX,
+            program_cache.dir, key->hash[0], key->hash[1]);
+}
+
+static bool program_cache_is_entry_name(const char *name)
+{
+   size_t len = strlen(name);
+   return len == PROGRAM_CACHE_NAME_LEN &&
+          !strcmp(name + len - strlen(PROGRAM_CACHE_SUFFIX), PROGRAM_CACHE_SUFFIX);
+}
+
+static int program_cache_entry_compare(const void *a, const void *b)
+{
+   const struct program_cache_entry *ea = a, *eb = b;
+   if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+      return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+   if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+      return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+   return 0;
+}
+
+/* Rescan the directory and, when there is not enough room for "needed"
+ * more bytes, drop the least recently used entries until the directory is
+ * down to three quarters of the cap. */
+static void program_cache_evict(uint64_t needed)
+{
+   struct program_cache_entry *entries = NULL;
+   uint32_t num_entries = 0, max_entries = 0;
+   uint64_t total = 0;
+   struct dirent *dent;
+
+   DIR *dir = opendir(program_cache.dir);
+   if (!dir)
+      return;
+
+   while ((dent = readdir(dir))) {
+      struct stat st;
+
+      if (!program_cache_is_entry_name(dent->d_name))
+         continue;
+      if (fstatat(dirfd(dir), dent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+         continue;
+
+      if (num_entries == max_entries) {
+         uint32_t new_max = max_entries ? max_entries * 2 : 64;
+         struct program_cache_entry *tmp = realloc(entries, new_max * sizeof(*entries));
+         if (!tmp)
+            break;
+         entries = tmp;
+         max_entries = new_max;
+      }
+
+      struct program_cache_entry *entry = &entries[num_entries++];
+      memcpy(entry->name, dent->d_name, PROGRAM_CACHE_NAME_LEN + 1);
+      entry->size = st.st_size;
+#ifdef __APPLE__
+      entry->mtime = st.st_mtimespec;
+#else
+      entry->mtime = st.st_mtim;
+#endif
+      total += st.st_size;
+   }
+
+   if (total + needed > program_cache.max_size) {
+      uint64_t target = program_cache.max_size / 4 * 3;
+
+      qsort(entries, num_entries, sizeof(*entries), program_cache_entry_compare);
+      for (uint32_t i = 0; i < num_entries && total + needed > target; i++) {
+         /* another process might already have removed it */
+         if (!unlinkat(dirfd(dir), entries[i].name, 0) || errno == ENOENT)
+            total -= entries[i].size;
+      }
+   }
+
+   program_cache.total_size = total;
+
+   closedir(dir);
+   free(entries);
+}
+
+static bool program_cache_read_full(int fd, void *data, size_t size)
+{
+   uint8_t *ptr = data;
+   while (size) {
+      ssize_t ret = read(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+static bool program_cache_write_full(int fd, const void *data, size_t size)
+{
+   const uint8_t *ptr = data;
+   while (size) {
+      ssize_t ret = write(fd, ptr, size);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+static uint64_t program_cache_hash_string(const char *str, uint64_t seed)
+{
+   if (!str)
+      return seed;
+   return XXH64(str, strlen(str), seed);
+}
+
+bool vrend_program_cache_init(void)
+{
+   const char *dir = debug_get_option("VREND_PROGRAM_CACHE_DIR", NULL);
+   GLint num_formats = 0;
+
+   if (!dir || !*dir)
+      return false;
+
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+   if (num_formats <= 0) {
+      virgl_warn("Program binary cache requested but the driver has no binary formats\n");
+      return false;
+   }
+
+   if (mkdir(dir, 0755) && errno != EEXIST) {
+      virgl_warn("Unable to create program binary cache directory %s: %s\n",
+                 dir, strerror(errno));
+      return false;
+   }
+
+   program_cache.dir = strdup(dir);
+   if (!program_cache.dir)
+      return false;
+
+   uint64_t id = program_cache_hash_string((const char *)glGetString(GL_VENDOR), 0);
+   id = program_cache_hash_string((const char *)glGetString(GL_RENDERER), id);
+   id = program_cache_hash_string((const char *)glGetString(GL_VERSION), id);
+   program_cache.driver_id = id;
+
+   long max_size = debug_get_num_option("VREND_PROGRAM_CACHE_MAX_SIZE",
+                                        PROGRAM_CACHE_DEFAULT_MAX_SIZE);
+   program_cache.max_size = max_size > 0 ? (uint64_t)max_size : PROGRAM_CACHE_DEFAULT_MAX_SIZE;
+
+   program_cache_evict(0);
+   mtx_init(&program_cache.mutex, mtx_plain);
+   program_cache.enabled = true;
+
+   virgl_info("Program binary cache enabled in %s (%" PRIu64 " of %" PRIu64 " bytes used)\n",
+              program_cache.dir, program_cache.total_size, program_cache.max_size);
+   return true;
+}
+
+void vrend_program_cache_fini(void)
+{
+   if (program_cache.enabled)
+      mtx_destroy(&program_cache.mutex);
+   free(program_cache.dir);
+   memset(&program_cache, 0, sizeof(program_cache));
+}
+
+bool vrend_program_cache_enabled(void)
+{
+   return program_cache.enabled;
+}
+
+const char *vrend_program_cache_dir(void)
+{
+   return program_cache.enabled ? program_cache.dir : NULL;
+}
+
+static bool program_cache_load_locked(const struct vrend_program_cache_key *key,
+                                      GLuint prog_id)
+{
+   struct program_cache_header hdr;
+   char path[PATH_MAX];
+   struct stat st;
+   void *data = NULL;
+   GLint status = GL_FALSE;
+
+   program_cache_entry_path(path, sizeof(path), key);
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      program_cache_stats.miss_count++;
+      return false;
+   }
+
+   if (fstat(fd, &st) || (uint64_t)st.st_size < sizeof(hdr))
+      goto out;
+
+   if (!program_cache_read_full(fd, &hdr, sizeof(hdr)))
+      goto out;
+
+   if (hdr.magic != PROGRAM_CACHE_MAGIC ||
+       hdr.driver_id != program_cache.driver_id ||
+       hdr.key[0] != key->hash[0] || hdr.key[1] != key->hash[1] ||
+       hdr.binary_size != st.st_size - sizeof(hdr))
+      goto out;
+
+   data = malloc(hdr.binary_size);
+   if (!data || !program_cache_read_full(fd, data, hdr.binary_size))
+      goto out;
+
+   glProgramBinary(prog_id, hdr.binary_format, data, hdr.binary_size);
+   glGetProgramiv(prog_id, GL_LINK_STATUS, &status);
+
+   if (status == GL_TRUE) {
+      /* bump the modification time, it is what the LRU eviction sorts by */
+      futimens(fd, NULL);
+   } else {
+      virgl_debug("Dropping stale program binary %s\n", path);
+      unlink(path);
+   }
+
+out:
+   if (status == GL_TRUE)
+      program_cache_stats.hit_count++;
+   else
+      program_cache_stats.miss_count++;
+
+   free(data);
+   close(fd);
+   return status == GL_TRUE;
+}
+
+bool vrend_program_cache_load(const struct vrend_program_cache_key *key, GLuint prog_id)
+{
+   if (!program_cache.enabled)
+      return false;
+
+   mtx_lock(&program_cache.mutex);
+   bool ret = program_cache_load_locked(key, prog_id);
+   mtx_unlock(&program_cache.mutex);
+   return ret;
+}
+
+static void program_cache_store_locked(const struct vrend_program_cache_key *key,
+                                       GLuint prog_id)
+{
+   struct program_cache_header *hdr;
+   char path[PATH_MAX], tmp_path[PATH_MAX];
+   GLint length = 0;
+   GLsizei written = 0;
+   GLenum format;
+
+   glGetProgramiv(prog_id, GL_PROGRAM_BINARY_LENGTH, &length);
+   if (length <= 0)
+      return;
+
+   uint64_t entry_size = sizeof(*hdr) + length;
+   if (entry_size > program_cache.max_size)
+      return;
+
+   hdr = calloc(1, entry_size);
+   if (!hdr)
+      return;
+
+   glGetProgramBinary(prog_id, length, &written, &format, hdr + 1);
+   if (written <= 0)
+      goto out;
+
+   hdr->magic = PROGRAM_CACHE_MAGIC;
+   hdr->binary_format = format;
+   hdr->driver_id = program_cache.driver_id;
+   hdr->key[0] = key->hash[0];
+   hdr->key[1] = key->hash[1];
+   hdr->binary_size = written;
+   entry_size = sizeof(*hdr) + written;
+
+   if (program_cache.total_size + entry_size > program_cache.max_size)
+      program_cache_evict(entry_size);
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", program_cache.dir);
+   int fd = mkstemp(tmp_path);
+   if (fd < 0)
+      goto out;
+
+   bool ok = program_cache_write_full(fd, hdr, entry_size);
+   close(fd);
+
+   /* rename is atomic, concurrent readers see either no file or a full one */
+   program_cache_entry_path(path, sizeof(path), key);
+   if (!ok || rename(tmp_path, path)) {
+      unlink(tmp_path);
+      goto out;
+   }
+
+   program_cache.total_size += entry_size;
+
+out:
+   free(hdr);
+}
+
+void vrend_program_cache_store(const struct vrend_program_cache_key *key, GLuint prog_id)
+{
+   if (!program_cache.enabled)
+      return;
+
+   mtx_lock(&program_cache.mutex);
+   program_cache_store_locked(key, prog_id);
+   mtx_unlock(&program_cache.mutex);
+}
+
+void vrend_program_cache_key_init(struct vrend_program_cache_key *key)
+{
+   key->hash[0] = program_cache.driver_id;
+   key->hash[1] = ~program_cache.driver_id;
+}
+
+void vrend_program_cache_key_append(struct vrend_program_cache_key *key,
+                                    const void *data, size_t size)
+{
+   key->hash[0] = XXH64(data, size, key->hash[0]);
+   key->hash[1] = XXH64(data, size, key->hash[1]);
+}
+
+#else /* _WIN32 */
+
+bool vrend_program_cache_init(void)
+{
+   return false;
+}
+
+void vrend_program_cache_fini(void)
+{
+}
+
+bool vrend_program_cache_enabled(void)
+{
+   return false;
+}
+
+const char *vrend_program_cache_dir(void)
+{
+   return NULL;
+}
+
+bool vrend_program_cache_load(UNUSED const struct vrend_program_cache_key *key,
+                              UNUSED GLuint prog_id)
+{
+   return false;
+}
+
+void vrend_program_cache_store(UNUSED const struct vrend_program_cache_key *key,
+                               UNUSED GLuint prog_id)
+{
+}
+
+void vrend_program_cache_key_init(struct vrend_program_cache_key *key)
+{
+   memset(key, 0, sizeof(*key));
+}
+
+void vrend_program_cache_key_append(UNUSED struct vrend_program_cache_key *key,
+                                    UNUSED const void *data, UNUSED size_t size)
+{
+}
+
+#endif /* _WIN32 */
+
+void vrend_program_cache_get_stats(uint64_t *hit_count, uint64_t *miss_count)
+{
+   *hit_count = program_cache_stats.hit_count;
+   *miss_count = program_cache_stats.miss_count;
+}
+
+void vrend_program_cache_reset_stats(void)
+{
+   memset(&program_cache_stats, 0, sizeof(program_cache_stats));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_PROGRAM_CACHE_H
+#define VREND_PROGRAM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <epoxy/gl.h>
+
+/* Persistent on-disk cache of linked GLSL program binaries.
+ *
+ * The cache is opt-in and enabled by pointing VREND_PROGRAM_CACHE_DIR at a
+ * writable directory.  VREND_PROGRAM_CACHE_MAX_SIZE caps the total size of
+ * the directory in bytes; the least recently used entries are evicted when
+ * the cap is exceeded.
+ *
+ * Entries are written to a temporary file and renamed into place, so a
+ * single directory can be shared by several processes.
+ */
+
+struct vrend_program_cache_key {
+   uint64_t hash[2];
+};
+
+/* Must be called with a current GL context, the driver identity is derived
+ * from GL_VENDOR, GL_RENDERER and GL_VERSION. */
+bool vrend_program_cache_init(void);
+
+void vrend_program_cache_fini(void);
+
+bool vrend_program_cache_enabled(void);
+
+/* The cache directory, or NULL when the cache is disabled */
+const char *vrend_program_cache_dir(void);
+
+/* Keys are seeded with the driver identity so that binaries never cross
+ * driver boundaries. */
+void vrend_program_cache_key_init(struct vrend_program_cache_key *key);
+
+void vrend_program_cache_key_append(struct vrend_program_cache_key *key,
+                                    const void *data, size_t size);
+
+/* Try to restore a previously stored binary into prog_id.  Returns true if
+ * the program is linked afterwards. */
+bool vrend_program_cache_load(const struct vrend_program_cache_key *key, GLuint prog_id);
+
+void vrend_program_cache_store(const struct vrend_program_cache_key *key, GLuint prog_id);
+
+void vrend_program_cache_get_stats(uint64_t *hit_count, uint64_t *miss_count);
+
+void vrend_program_cache_reset_stats(void);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_program_predictor.h"
+
+#include "util/macros.h"
+
+#ifndef _WIN32
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "c11/threads.h"
+#include "util/list.h"
+#include "vrend_program_cache.h"
+#include "virgl_util.h"
+
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+#define PREDICTOR_MAGIC 0x31505056 /* "VPP1" */
+#define PREDICTOR_SUFFIX ".combos"
+/* once full, the oldest combinations are replaced */
+#define PREDICTOR_MAX_COMBOS 4096
+
+struct predictor_file_header {
+   uint32_t magic;
+   uint32_t num_combos;
+   uint64_t app_hash;
+};
+
+struct vrend_program_predictor {
+   struct list_head head;
+   uint64_t app_hash;
+   /* protected by the mutex of the list */
+   uint32_t refcount;
+
+   mtx_t mutex;
+   struct vrend_program_combo *combos;
+   uint32_t num_combos;
+   uint32_t max_combos;
+   /* the next combination to replace when full */
+   uint32_t next;
+   bool dirty;
+};
+
+static struct {
+   once_flag init_once;
+   mtx_t mutex;
+   struct list_head predictors;
+} program_predictors = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static void program_predictors_init_once(void)
+{
+   mtx_init(&program_predictors.mutex, mtx_plain);
+   list_inithead(&program_predictors.predictors);
+}
+
+static void predictor_path(char *path, size_t len, const char *dir, uint64_t app_hash)
+{
+   snprintf(path, len, "%s/%016" PRIx64 PREDICTOR_SUFFIX, dir, app_hash);
+}
+
+static void predictor_load(struct vrend_program_predictor *pred)
+{
+   const char *dir = vrend_program_cache_dir();
+   struct predictor_file_header hdr;
+   char path[PATH_MAX];
+   struct stat st;
+
+   if (!dir)
+      return;
+
+   predictor_path(path, sizeof(path), dir, pred->app_hash);
+   FILE *fp = fopen(path, "rbe");
+   if (!fp)
+      return;
+
+   if (fstat(fileno(fp), &st) || fread(&hdr, sizeof(hdr), 1, fp) != 1)
+      goto out;
+
+   if (hdr.magic != PREDICTOR_MAGIC || hdr.app_hash != pred->app_hash ||
+       hdr.num_combos > PREDICTOR_MAX_COMBOS ||
+       (uint64_t)st.st_size != sizeof(hdr) + hdr.num_combos * sizeof(*pred->combos))
+      goto out;
+
+   pred->combos = malloc(hdr.num_combos * sizeof(*pred->combos));
+   if (!pred->combos)
+      goto out;
+
+   if (fread(pred->combos, sizeof(*pred->combos), hdr.num_combos, fp) != hdr.num_combos) {
+      free(pred->combos);
+      pred->combos = NULL;
+      goto out;
+   }
+
+   pred->num_combos = hdr.num_combos;
+   pred->max_combos = hdr.num_combos;
+
+   virgl_debug("Loaded %u program combinations from %s\n", pred->num_combos, path);
+
+out:
+   fclose(fp);
+}
+
+static void predictor_store(struct vrend_program_predictor *pred)
+{
+   const char *dir = vrend_program_cache_dir();
+   struct predictor_file_header hdr = {
+      .magic = PREDICTOR_MAGIC,
+      .num_combos = pred->num_combos,
+      .app_hash = pred->app_hash,
+   };
+   char path[PATH_MAX], tmp_path[PATH_MAX];
+
+   if (!dir || !pred->dirty)
+      return;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", dir);
+   int fd = mkstemp(tmp_path);
+   if (fd < 0)
+      return;
+
+   FILE *fp = fdopen(fd, "wb");
+   if (!fp) {
+      close(fd);
+      unlink(tmp_path);
+      return;
+   }
+
+   bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(pred->combos, sizeof(*pred->combos), pred->num_combos, fp) ==
+                pred->num_combos;
+   ok &= !fclose(fp);
+
+   /* a concurrent run of the same application keeps either file */
+   predictor_path(path, sizeof(path), dir, pred->app_hash);
+   if (!ok || rename(tmp_path, path))
+      unlink(tmp_path);
+   else
+      pred->dirty = false;
+}
+
+struct vrend_program_predictor *
+vrend_program_predictor_get(const char *app_name)
+{
+   struct vrend_program_predictor *pred = NULL;
+
+   if (!app_name || !*app_name)
+      return NULL;
+
+   call_once(&program_predictors.init_once, program_predictors_init_once);
+
+   const uint64_t app_hash = XXH64(app_name, strlen(app_name), 0);
+
+   mtx_lock(&program_predictors.mutex);
+
+   list_for_each_entry(struct vrend_program_predictor, iter,
+                       &program_predictors.predictors, head) {
+      if (iter->app_hash == app_hash) {
+         pred = iter;
+         pred->refcount++;
+         break;
+      }
+   }
+
+   if (!pred) {
+      pred = calloc(1, sizeof(*pred));
+      if (pred) {
+         pred->app_hash = app_hash;
+         pred->refcount = 1;
+         mtx_init(&pred->mutex, mtx_plain);
+         predictor_load(pred);
+         list_add(&pred->head, &program_predictors.predictors);
+      }
+   }
+
+   mtx_unlock(&program_predictors.mutex);
+
+   return pred;
+}
+
+void
+vrend_program_predictor_put(struct vrend_program_predictor *pred)
+{
+   if (!pred)
+      return;
+
+   mtx_lock(&program_predictors.mutex);
+   if (--pred->refcount) {
+      mtx_unlock(&program_predictors.mutex);
+      return;
+   }
+   list_del(&pred->head);
+   mtx_unlock(&program_predictors.mutex);
+
+   predictor_store(pred);
+
+   mtx_destroy(&pred->mutex);
+   free(pred->combos);
+   free(pred);
+}
+
+static bool predictor_combo_equal(const struct vrend_program_combo *a,
+                                  const struct vrend_program_combo *b)
+{
+   return !memcmp(a->stages, b->stages, sizeof(a->stages)) && a->dual_src == b->dual_src;
+}
+
+void
+vrend_program_predictor_record(struct vrend_program_predictor *pred,
+                               const struct vrend_program_combo *combo)
+{
+   mtx_lock(&pred->mutex);
+
+   /* new programs are rare enough for a linear search */
+   for (uint32_t i = 0; i < pred->num_combos; i++) {
+      if (predictor_combo_equal(&pred->combos[i], combo)) {
+         mtx_unlock(&pred->mutex);
+         return;
+      }
+   }
+
+   if (pred->num_combos == pred->max_combos && pred->max_combos < PREDICTOR_MAX_COMBOS) {
+      uint32_t new_max = MIN2(MAX2(pred->max_combos * 2, 64), PREDICTOR_MAX_COMBOS);
+      struct vrend_program_combo *combos =
+         realloc(pred->combos, new_max * sizeof(*combos));
+      if (combos) {
+         pred->combos = combos;
+         pred->max_combos = new_max;
+      }
+   }
+
+   if (pred->num_combos < pred->max_combos) {
+      pred->combos[pred->num_combos++] = *combo;
+   } else if (pred->num_combos) {
+      pred->combos[pred->next] = *combo;
+      pred->next = (pred->next + 1) % pred->num_combos;
+   }
+   pred->dirty = true;
+
+   mtx_unlock(&pred->mutex);
+}
+
+uint32_t
+vrend_program_predictor_find(struct vrend_program_predictor *pred,
+                             uint32_t stage, uint64_t hash,
+                             struct vrend_program_combo *combos,
+                             uint32_t max_combos)
+{
+   uint32_t count = 0;
+
+   mtx_lock(&pred->mutex);
+   for (uint32_t i = 0; i < pred->num_combos && count < max_combos; i++) {
+      if (pred->combos[i].stages[stage] == hash)
+         combos[count++] = pred->combos[i];
+   }
+   mtx_unlock(&pred->mutex);
+
+   return count;
+}
+
+#else /* _WIN32 */
+
+struct vrend_program_predictor *
+vrend_program_predictor_get(UNUSED const char *app_name)
+{
+   return NULL;
+}
+
+void
+vrend_program_predictor_put(UNUSED struct vrend_program_predictor *pred)
+{
+}
+
+void
+vrend_program_predictor_record(UNUSED struct vrend_program_predictor *pred,
+                               UNUSED const struct vrend_program_combo *combo)
+{
+}
+
+uint32_t
+vrend_program_predictor_find(UNUSED struct vrend_program_predictor *pred,
+                             UNUSED uint32_t stage, UNUSED uint64_t hash,
+                             UNUSED struct vrend_program_combo *combos,
+                             UNUSED uint32_t max_combos)
+{
+   return 0;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_PROGRAM_PREDICTOR_H
+#define VREND_PROGRAM_PREDICTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Remembers the combinations of shader stages that the contexts of a guest
+ * application linked into programs, so that the programs of a later run can
+ * be linked as soon as their stages exist instead of at their first draw.
+ *
+ * The combinations are shared by the contexts with the same debug name.
+ * With the program cache enabled, they are stored next to the program
+ * binaries when the last of those contexts is destroyed, and loaded again
+ * by the first context of the next run.
+ */
+
+/* vertex, fragment, geometry, tess ctrl and tess eval, in the
+ * pipe_shader_type order */
+#define VREND_PROGRAM_COMBO_STAGES 5
+
+/* the stages are identified by a hash of their variant, 0 when unused */
+struct vrend_program_combo {
+   uint64_t stages[VREND_PROGRAM_COMBO_STAGES];
+   uint32_t dual_src;
+   uint32_t padding;
+};
+
+struct vrend_program_predictor;
+
+/* returns NULL for unnamed applications and outside of POSIX systems */
+struct vrend_program_predictor *
+vrend_program_predictor_get(const char *app_name);
+
+void
+vrend_program_predictor_put(struct vrend_program_predictor *pred);
+
+void
+vrend_program_predictor_record(struct vrend_program_predictor *pred,
+                               const struct vrend_program_combo *combo);
+
+/* copies up to max_combos of the recorded combinations that use the
+ * variant hash in the stage, returns the number copied */
+uint32_t
+vrend_program_predictor_find(struct vrend_program_predictor *pred,
+                             uint32_t stage, uint64_t hash,
+                             struct vrend_program_combo *combos,
+                             uint32_t max_combos);
+
+#endif /* VREND_PROGRAM_PREDICTOR_H */
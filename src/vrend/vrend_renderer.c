@@ -39,6 +39,7 @@
 #include "util/u_dual_blend.h"
 #include "util/hash_table.h"
 #include "util/ralloc.h"
+#include "util/slab.h"
 
 #include "util/u_thread.h"
 #include "util/u_format.h"
@@ -51,8 +52,19 @@
 #include "vrend_renderer.h"
 #include "vrend_blitter.h"
 #include "vrend_debug.h"
+#include "vrend_etc2.h"
+#include "vrend_gl_state.h"
+#include "vrend_pixel_ops.h"
 #include "vrend_winsys.h"
 #include "vrend_blitter.h"
+#include "vrend_caps_cache.h"
+#include "vrend_context_pool.h"
+#include "vrend_program_cache.h"
+#include "vrend_program_predictor.h"
+#include "vrend_shader_cache.h"
+#include "vrend_staging_pool.h"
+#include "vrend_texture_pool.h"
+#include "vrend_upload_ring.h"
 
 #include "virgl_util.h"
 
@@ -61,14 +73,29 @@
 #include "virglrenderer.h"
 #include "virgl_protocol.h"
 #include "virgl_fence.h"
+#include "virgl_id_table.h"
+#include "virgl_memory_budget.h"
+#include "virgl_command_stats.h"
+#include "virgl_numa.h"
 #include "virtgpu_drm.h"
 
 #include "tgsi/tgsi_text.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
 #ifdef HAVE_EPOXY_GLX_H
 #include <epoxy/glx.h>
 #endif
 
+#ifdef HAVE_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #ifdef ENABLE_VIDEO
 #include "vrend_video.h"
 #endif
@@ -100,6 +127,8 @@ struct vrend_fence {
     * valid.
     */
    struct vrend_context *ctx;
+   /* the GL context the fence was created in */
+   virgl_gl_context gl_context;
    uint32_t flags;
    uint64_t fence_id;
 
@@ -110,6 +139,36 @@ struct vrend_fence {
 #endif
    };
    struct list_head fences;
+   /* readbacks queued before the fence was created */
+   uint64_t readback_seqno;
+#ifdef ENABLE_VIDEO
+   /* decoded frames submitted before the fence was created */
+   uint64_t video_seqno;
+#endif
+   /* position of the fence among all fences created */
+   uint64_t seqno;
+   /* exported sync file registered in the fence epoll set, or -1 */
+   int sync_fd;
+   /* set when the sync file was reported readable */
+   bool signaled;
+};
+
+/* A transfer from host whose data is still on its way into a PBO, it is
+ * copied into the resource's iovec when the GL fence signals and at the
+ * latest before a guest fence created after it is retired. */
+struct vrend_readback {
+   struct list_head head;
+   uint64_t seqno;
+   struct vrend_resource *res;
+   GLuint pbo_id;
+   GLsync sync;
+   uint32_t size;
+   uint32_t data_offset;
+   uint32_t stride;
+   struct pipe_box box;
+   uint32_t level;
+   uint64_t offset;
+   bool invert;
 };
 
 struct vrend_query {
@@ -123,6 +182,44 @@ struct vrend_query {
    int sub_ctx_id;
    struct vrend_resource *res;
    bool fake_samples_passed;
+   /* seqno of the first fence created after the query started waiting */
+   uint64_t fence_seqno;
+
+   /* slot of the query buffer the result is resolved into, or -1 when the
+    * result is polled */
+   int32_t slot;
+   /* a resolve was issued and its result has not been seen yet */
+   bool resolve_pending;
+   /* the query was begun again after the pending resolve was issued */
+   bool resolve_stale;
+};
+
+#define VREND_QUERY_SLOTS 1024
+
+/* a query result and its availability, written by the GPU */
+struct vrend_query_slot {
+   uint64_t result;
+   uint64_t available;
+};
+
+enum vrend_gpu_timer_type {
+   VREND_GPU_TIMER_BATCH,
+   VREND_GPU_TIMER_BLIT,
+   VREND_GPU_TIMER_CLEAR,
+   VREND_GPU_TIMER_TYPE_COUNT,
+};
+
+/* A pair of GL_TIMESTAMP queries around some work of a sub context.  They
+ * are resolved with the waiting queries, and then go back to the free list
+ * of the sub context.
+ */
+struct vrend_gpu_timer {
+   struct list_head head;
+
+   enum vrend_gpu_timer_type type;
+   struct vrend_context *ctx;
+   int sub_ctx_id;
+   GLuint queries[2];
 };
 
 struct global_error_state {
@@ -174,6 +271,7 @@ enum features_id
    feat_indep_blend_func,
    feat_indirect_draw,
    feat_indirect_params,
+   feat_invalidate_subdata,
    feat_khr_debug,
    feat_memory_object,
    feat_memory_object_fd,
@@ -189,6 +287,7 @@ enum features_id
    feat_occlusion_query,
    feat_occlusion_query_boolean,
    feat_pipeline_statistics_query,
+   feat_program_binary,
    feat_qbo,
    feat_robust_buffer_access,
    feat_sample_mask,
@@ -229,6 +328,8 @@ enum features_id
    feat_seamless_cubemap_per_texture,
    feat_vs_layer_viewport,
    feat_vs_viewport_index,
+   feat_parallel_shader_compile,
+   feat_multi_draw,
    feat_last,
 };
 
@@ -252,7 +353,7 @@ static const  struct {
    FEAT(atomic_counters, 42, 31,  "GL_ARB_shader_atomic_counters" ),
    FEAT(base_instance, 42, UNAVAIL,  "GL_ARB_base_instance", "GL_EXT_base_instance" ),
    FEAT(barrier, 42, 31, "GL_ARB_shader_image_load_store"),
-   FEAT(bind_vertex_buffers, 44, UNAVAIL, NULL),
+   FEAT(bind_vertex_buffers, 44, UNAVAIL, "GL_ARB_multi_bind"),
    FEAT(bit_encoding, 33, UNAVAIL,  "GL_ARB_shader_bit_encoding" ),
    FEAT(blend_equation_advanced, UNAVAIL, 32,  "GL_KHR_blend_equation_advanced" ),
    FEAT(clear_texture, 44, UNAVAIL, "GL_ARB_clear_texture", "GL_EXT_clear_texture"),
@@ -287,6 +388,7 @@ static const  struct {
    FEAT(indep_blend_func, 40, 32,  "GL_ARB_draw_buffers_blend", "GL_OES_draw_buffers_indexed"),
    FEAT(indirect_draw, 40, 31,  "GL_ARB_draw_indirect" ),
    FEAT(indirect_params, 46, UNAVAIL,  "GL_ARB_indirect_parameters" ),
+   FEAT(invalidate_subdata, 43, 30,  "GL_ARB_invalidate_subdata" ),
    FEAT(khr_debug, 43, 32,  "GL_KHR_debug" ),
    FEAT(memory_object, UNAVAIL, UNAVAIL, "GL_EXT_memory_object"),
    FEAT(memory_object_fd, UNAVAIL, UNAVAIL, "GL_EXT_memory_object_fd"),
@@ -299,6 +401,7 @@ static const  struct {
    FEAT(shader_noperspective_interpolation, 31, UNAVAIL, "GL_NV_shader_noperspective_interpolation", "GL_EXT_gpu_shader4"),
    FEAT(nvx_gpu_memory_info, UNAVAIL, UNAVAIL, "GL_NVX_gpu_memory_info" ),
    FEAT(pipeline_statistics_query, 46, UNAVAIL, "GL_ARB_pipeline_statistics_query"),
+   FEAT(program_binary, 41, 30, "GL_ARB_get_program_binary", "GL_OES_get_program_binary"),
    FEAT(polygon_offset_clamp, 46, UNAVAIL,  "GL_ARB_polygon_offset_clamp", "GL_EXT_polygon_offset_clamp"),
    FEAT(occlusion_query, 15, UNAVAIL, "GL_ARB_occlusion_query"),
    FEAT(occlusion_query_boolean, 33, 30, "GL_EXT_occlusion_query_boolean", "GL_ARB_occlusion_query2"),
@@ -342,17 +445,55 @@ static const  struct {
    FEAT(seamless_cubemap_per_texture, UNAVAIL, UNAVAIL,  "GL_AMD_seamless_cubemap_per_texture" ),
    FEAT(vs_layer_viewport, UNAVAIL, UNAVAIL, "GL_AMD_vertex_shader_layer"),
    FEAT(vs_viewport_index, UNAVAIL, UNAVAIL, "GL_AMD_vertex_shader_viewport_index"),
+   FEAT(parallel_shader_compile, UNAVAIL, UNAVAIL, "GL_KHR_parallel_shader_compile", "GL_ARB_parallel_shader_compile"),
+   FEAT(multi_draw, 32, UNAVAIL, NULL),
 };
 
+#define VREND_MAX_SHADER_THREADS 8
+
 struct global_renderer_state {
    struct vrend_context *ctx0;
    struct vrend_context *current_ctx;
    struct vrend_context *current_hw_ctx;
+   virgl_gl_context current_gl_context;
 
    struct list_head waiting_query_list;
+   struct list_head gpu_timer_list;
+   /* with use_query_buffer, the results of the queries are resolved on the
+    * GPU into a persistently mapped buffer */
+   GLuint query_buffer_id;
+   volatile struct vrend_query_slot *query_slots;
+   uint32_t free_query_slots[VREND_QUERY_SLOTS];
+   uint32_t num_free_query_slots;
+   /* slots of destroyed queries that still have a resolve in flight */
+   uint32_t busy_query_slots[VREND_QUERY_SLOTS];
+   uint32_t num_busy_query_slots;
+   /* with use_gpu_timestamps, since init or the last reset, in ns */
+   uint64_t gpu_time[VREND_GPU_TIMER_TYPE_COUNT];
+   struct list_head readback_list;
+   uint64_t num_readbacks;
+   struct list_head pending_upload_list;
+   uint64_t num_queued_uploads;
+   uint64_t num_issued_uploads;
+   /* with use_buffer_eviction, the GL buffers with mutable storage, see
+    * vrend_renderer_check_memory_pressure */
+   struct list_head evictable_buffers;
+   uint32_t num_evicted_buffers;
+   /* advanced every VREND_EVICT_PERIOD_NS, the resources remember the epoch
+    * they were last used in */
+   uint32_t evict_epoch;
+   uint64_t evict_epoch_start;
+   uint32_t evict_cold_epochs;
+   uint64_t evict_min_free_kb;
+   /* a context went over its soft memory budget */
+   bool evict_requested;
    struct list_head fence_list;
    struct list_head fence_wait_list;
    struct vrend_fence *fence_waiting;
+   /* the fences are created by the decoder and mostly freed by the sync
+    * thread, the queries are created and destroyed with the contexts */
+   struct slab_pool fence_pool;
+   struct slab_pool query_pool;
 
    int gl_major_ver;
    int gl_minor_ver;
@@ -361,16 +502,31 @@ struct global_renderer_state {
    thrd_t sync_thread;
    virgl_gl_context sync_context;
 
+   /* asynchronous shader compile and link */
+   mtx_t shader_job_mutex;
+   cnd_t shader_job_cond;
+   cnd_t shader_job_done_cond;
+   struct list_head shader_job_list;
+   thrd_t shader_threads[VREND_MAX_SHADER_THREADS];
+   uint32_t num_shader_threads;
+
    cnd_t fence_cond;
 
-   /* only used with async fence callback */
-   atomic_bool has_waiting_queries;
+   uint64_t num_fences;
+
+   /* only used with async fence callback, fence_seqno of the oldest waiting
+    * query or UINT64_MAX */
+   atomic_uint_fast64_t waiting_query_seqno;
+   /* one past the seqno of the last retired fence */
+   atomic_uint_fast64_t retired_fence_seqno;
    bool polling;
    mtx_t poll_mutex;
    cnd_t poll_cond;
 
    float tess_factors[6];
    int eventfd;
+   /* epoll set of the exported fence sync files */
+   int fence_epoll_fd;
 
    uint32_t max_draw_buffers;
    uint32_t max_texture_buffer_size;
@@ -395,14 +551,67 @@ struct global_renderer_state {
    bool use_explicit_locations : 1;
    /* threaded sync */
    bool stop_sync_thread : 1;
+   bool stop_shader_threads : 1;
+   /* draw calls are dropped instead of waiting for pending programs */
+   bool skip_pending_programs : 1;
    /* async fence callback */
    bool use_async_fence_cb : 1;
+   /* fences are exported as sync files and polled instead of waited on */
+   bool use_fence_fds : 1;
 
 #ifdef HAVE_EPOXY_EGL_H
    bool use_egl_fence : 1;
 #endif
    bool d3d_share_texture : 1;
    bool gbm_layout_feat : 1;
+   /* GBM buffers are allocated with the modifiers EGL can import */
+   bool use_gbm_modifiers : 1;
+   /* the GBM buffers GL imports are written through GL, they live on
+    * another GPU than the renderer and mapping them is slow */
+   bool use_gbm_gpu_writes : 1;
+   bool use_program_cache : 1;
+   /* link the programs of the stage combinations seen before */
+   bool use_program_prediction : 1;
+   bool use_draw_batching : 1;
+   bool use_upload_ring : 1;
+   /* the constants of the shaders are streamed through the upload ring */
+   bool use_const_ubo : 1;
+   /* stages are linked as separable programs and combined in pipelines */
+   bool use_separable_programs : 1;
+   /* transfers from host are copied to the guest when they complete */
+   bool use_async_readback : 1;
+   /* copy transfers against GL-backed blobs stay on the GPU */
+   bool use_copy_transfer_pbo : 1;
+   /* small buffer uploads are merged before they reach GL */
+   bool use_upload_coalescing : 1;
+   /* host-only buffers the guest writes to are persistently mapped */
+   bool use_write_mapped_buffers : 1;
+   /* the GPU time of batches, blits and clears is measured */
+   bool use_gpu_timestamps : 1;
+   /* query results are resolved on the GPU, see query_buffer_id */
+   bool use_query_buffer : 1;
+   /* clears are merged and emitted before the next command, see
+    * vrend_pending_clear */
+   bool use_deferred_clears : 1;
+   /* level-to-level blits are replaced by glGenerateMipmap, see
+    * vrend_pending_mipmap */
+   bool use_mipmap_blits : 1;
+   /* barriers are merged, and dropped when no shader wrote since an
+    * identical one, see vrend_flush_barriers */
+   bool use_barrier_tracking : 1;
+   /* consecutive dispatches only bind the compute state once */
+   bool use_dispatch_runs : 1;
+   /* the GL contexts are created with KHR_no_error */
+   bool use_no_error : 1;
+   /* cold buffers are demoted to system memory under memory pressure */
+   bool use_buffer_eviction : 1;
+
+   enum vrend_gl_error_check gl_error_check;
+   /* GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT */
+   uint32_t ubo_offset_alignment;
+
+   /* GL sampler objects shared by all the identical sampler states */
+   struct hash_table *sampler_table;
 };
 
 struct sysval_uniform_block {
@@ -416,6 +625,19 @@ struct sysval_uniform_block {
 
 static struct global_renderer_state vrend_state;
 
+static void vrend_buffer_restore(struct vrend_resource *res);
+
+/* marks the resource used, an evicted buffer gets its storage back */
+static inline void vrend_resource_touch(struct vrend_resource *res)
+{
+   if (!res)
+      return;
+
+   res->last_used_epoch = vrend_state.evict_epoch;
+   if (unlikely(res->evicted_data))
+      vrend_buffer_restore(res);
+}
+
 static inline bool has_feature(enum features_id feature_id)
 {
    int slot = feature_id / 64;
@@ -443,6 +665,34 @@ static inline void clear_feature(enum features_id feature_id)
 }
 
 
+struct vrend_program_key {
+   GLuint shader_ids[PIPE_SHADER_TYPES];
+   uint32_t dual_src;
+};
+
+/* A variant translated by a shader thread ahead of its selection, into the
+ * shader cache where vrend_shader_create finds it. */
+struct vrend_shader_translation {
+   const struct vrend_context *ctx;
+   struct vrend_shader_selector *sel;
+   struct vrend_shader_key key;
+   struct vrend_shader_cache_key cache_key;
+};
+
+/* A program handed to one of the shader threads, compiles the stages that
+ * are not compiled yet and links prog_id.  Jobs with a translation only
+ * translate. */
+struct vrend_shader_job {
+   struct list_head head;
+   GLuint prog_id;
+   struct vrend_shader *ss[PIPE_SHADER_TYPES];
+   struct vrend_shader_translation *translation;
+   /* signalled in the shader thread's context once the link finished */
+   GLsync sync;
+   bool done;
+   bool link_success;
+};
+
 struct vrend_linked_shader_program {
    struct list_head head;
    struct list_head sl[PIPE_SHADER_TYPES];
@@ -454,7 +704,15 @@ struct vrend_linked_shader_program {
 
    bool dual_src_linked;
    struct vrend_shader *ss[PIPE_SHADER_TYPES];
-   uint64_t vs_fs_key;
+   struct vrend_program_key key;
+   struct vrend_sub_context *owner;
+   /* set while the program is linked asynchronously */
+   struct vrend_shader_job *link_job;
+   /* glLinkProgram was issued with parallel shader compile */
+   bool link_pending;
+   /* store the binary once the asynchronous link finished */
+   bool store_in_cache;
+   struct vrend_program_cache_key cache_key;
 
    uint32_t ubo_used_mask[PIPE_SHADER_TYPES];
    uint32_t samplers_used_mask[PIPE_SHADER_TYPES];
@@ -468,6 +726,12 @@ struct vrend_linked_shader_program {
    GLuint *shadow_samp_add_locs[PIPE_SHADER_TYPES];
 
    GLint const_location[PIPE_SHADER_TYPES];
+   /* the elements of the constants array have consecutive locations, so that
+    * a range of them can be set */
+   bool const_locations_consecutive[PIPE_SHADER_TYPES];
+   /* with use_const_ubo, the constants block and its binding point */
+   GLuint const_block_index[PIPE_SHADER_TYPES];
+   GLuint const_block_bind[PIPE_SHADER_TYPES];
 
    GLuint *attrib_locs;
 
@@ -490,22 +754,47 @@ struct vrend_linked_shader_program {
    bool reads_drawid;
 };
 
+enum vrend_shader_compile_state {
+   VREND_SHADER_COMPILE_DONE = 0,
+   /* glCompileShader is left to the shader thread linking the program */
+   VREND_SHADER_COMPILE_DEFERRED,
+   VREND_SHADER_COMPILE_RUNNING,
+   VREND_SHADER_COMPILE_FAILED,
+   /* glCompileShader was issued, the driver compiles it in parallel */
+   VREND_SHADER_COMPILE_PENDING,
+};
+
 struct vrend_shader {
-   struct vrend_shader *next_variant;
+   struct list_head variant_head;
    struct vrend_shader_selector *sel;
 
    struct vrend_variable_shader_info var_sinfo;
 
    struct vrend_strarray glsl_strings;
+   /* owns glsl_strings if set */
+   struct vrend_shader_cache_entry *cache_entry;
    GLuint id;
    GLuint program_id; /* only used for separable shaders */
    GLuint last_pipeline_id;
    bool is_compiled;
    bool is_linked; /* only used for separable shaders */
+   bool link_pending; /* only used for separable shaders */
+   /* protected by vrend_state.shader_job_mutex */
+   enum vrend_shader_compile_state compile_state;
    struct vrend_shader_key key;
+   uint32_t key_hash;
+   uint64_t last_used;
    struct list_head programs;
+   /* with use_program_prediction, identifies the variant across runs, and
+    * combo_sub_ctx tells where it is registered */
+   uint64_t combo_hash;
+   struct vrend_sub_context *combo_sub_ctx;
 };
 
+/* Upper bound of cached variants per selector, the least recently used
+ * variant is destroyed when a new one would exceed it. */
+#define VREND_SHADER_MAX_VARIANTS 64
+
 struct vrend_shader_selector {
    struct pipe_reference reference;
 
@@ -513,7 +802,15 @@ struct vrend_shader_selector {
    struct vrend_shader_info sinfo;
 
    struct vrend_shader *current;
+   /* all variants, current included, indexed by their vrend_shader_key */
+   struct list_head variants;
+   struct hash_table *variant_table;
+   uint32_t num_variants;
+   uint64_t use_counter;
+
    struct tgsi_token *tokens;
+   /* shared by the translations of the variants, created with the first */
+   struct vrend_shader_analysis *analysis;
 
    uint32_t req_local_mem;
 };
@@ -525,6 +822,15 @@ struct vrend_long_shader_buffer {
    char *tmp_buf;
    uint32_t total_length;
    uint32_t current_length;
+
+   /* the text is parsed as its chunks arrive, into the tokens sized by the
+    * first chunk.  The parser is dropped on a failure, the complete text is
+    * then parsed again once all of it arrived. */
+   struct tgsi_text_parser *parser;
+   struct tgsi_token *tokens;
+   uint32_t num_tokens;
+   /* the text before this offset was fed to the parser */
+   uint32_t parsed_length;
 };
 
 struct vrend_texture {
@@ -546,10 +852,20 @@ struct vrend_surface {
    struct vrend_resource *texture;
 };
 
+/* The pair of GL samplers for one pipe_sampler_state, the first skips the
+ * sRGB decode, the second does it. */
+struct vrend_sampler_object {
+   struct pipe_sampler_state key;
+   uint32_t refcount;
+   GLuint ids[2];
+   /* the border color is swizzled for an emulated alpha format */
+   bool alpha_border;
+};
+
 struct vrend_sampler_state {
    struct pipe_sampler_state base;
    struct vrend_sub_context *sub_ctx;
-   GLuint ids[2];
+   struct vrend_sampler_object *object;
 };
 
 struct vrend_depth_stencil_alpha_state {
@@ -643,6 +959,15 @@ struct vrend_constants {
    unsigned int *consts;
    uint32_t num_consts;
    uint32_t num_allocated_consts;
+   /* the range of consts that changed since they were last uploaded, valid
+    * while the constants of the stage are dirty */
+   uint32_t dirty_start;
+   uint32_t dirty_end;
+
+   /* with use_const_ubo, where the constants were last streamed to */
+   uint64_t ring_generation;
+   uint32_t ring_offset;
+   uint32_t ring_size;
 };
 
 // bound sampler view (texture) state associated with the current
@@ -671,11 +996,17 @@ struct vrend_viewport {
    GLclampd near_val, far_val;
 };
 
+/* the target handles a streamout object was created for, unused handles
+ * are zero */
+struct vrend_streamout_key {
+   uint32_t num_targets;
+   uint32_t handles[16];
+};
+
 /* create a streamout object to support pause/resume */
 struct vrend_streamout_object {
    GLuint id;
-   uint32_t num_targets;
-   uint32_t handles[16];
+   struct vrend_streamout_key key;
    struct list_head head;
    int xfb_state;
    struct vrend_so_target *so_targets[16];
@@ -691,8 +1022,116 @@ struct vrend_vertex_buffer {
    uint32_t res_id;
 };
 
-#define VREND_PROGRAM_NQUEUES (1 << 8)
-#define VREND_PROGRAM_NQUEUE_MASK (VREND_PROGRAM_NQUEUES - 1)
+#define VREND_VAO_CACHE_SIZE 32
+
+/* A vertex array is fully described by the vertex elements and, for each
+ * element, the buffer range it reads from and the attribute location. */
+struct vrend_vao_key {
+   const struct vrend_vertex_element_array *ve;
+   uint32_t num_attribs;
+   struct {
+      struct vrend_resource *res;
+      uint32_t offset;
+      uint32_t stride;
+      GLint loc;
+   } attribs[PIPE_MAX_ATTRIBS];
+};
+
+struct vrend_vao {
+   /* does not hold references on the resources, the vertex arrays that use
+    * a buffer are destroyed when it is detached from the context */
+   struct vrend_vao_key key;
+   struct list_head head;
+   GLuint id;
+};
+
+#define VREND_FBO_CACHE_SIZE 16
+
+/* layering and sample count are properties of the surfaces */
+struct vrend_fbo_key {
+   uint32_t nr_cbufs;
+   struct vrend_surface *surf[PIPE_MAX_COLOR_BUFS];
+   struct vrend_surface *zsurf;
+};
+
+struct vrend_fbo {
+   /* holds a reference on the surfaces, so their textures can not go away
+    * or have their names reused while the framebuffer points at them */
+   struct vrend_fbo_key key;
+   struct list_head head;
+   GLuint id;
+};
+
+#define VREND_DRAW_BATCH_MAX 64
+
+struct vrend_draw_batch_entry {
+   struct pipe_draw_info info;
+   uint32_t ib_offset;
+};
+
+/* Consecutive direct draws that only differ in their ranges, they are
+ * emitted as one multi draw when the next command is not a draw. */
+struct vrend_draw_batch {
+   uint32_t num_draws;
+   /* draw i has drawid draws[0].drawid + i, gl_DrawID matches then */
+   bool sequential_drawid;
+   /* the command of the first draw, the draws share all their state, so a
+    * failure of the batch is a failure of that draw */
+   uint32_t cmd_index;
+   const char *cmd_name;
+   /* set when the last flush failed, until the decoder takes it */
+   bool failed;
+   struct vrend_draw_batch_entry draws[VREND_DRAW_BATCH_MAX];
+};
+
+/* the command being decoded on this thread, for the KHR_debug messages */
+static _Thread_local struct {
+   uint32_t index;
+   const char *name;
+} vrend_current_command;
+
+void vrend_renderer_set_current_command(uint32_t index, const char *name)
+{
+   vrend_current_command.index = index;
+   vrend_current_command.name = name;
+}
+
+/* A clear of the bound framebuffer that is not emitted yet.  Consecutive
+ * clears are merged into one, and a blit that replaces a cleared colour
+ * buffer completely drops its clear, the buffer is invalidated instead. */
+struct vrend_pending_clear {
+   unsigned buffers;
+   union pipe_color_union color;
+   double depth;
+   unsigned stencil;
+   /* colour buffers whose clear was dropped, PIPE_CLEAR_COLOR bits */
+   unsigned discarded;
+};
+
+/* A passthrough TCS injected for a TES that runs without a TCS on GLES, it
+ * is reused as long as the VS and the state it was generated for do not
+ * change, so the TCS and the program are not built again on every program
+ * selection. */
+#define VREND_INJECTED_TCS_CACHE_SIZE 8
+
+struct vrend_injected_tcs {
+   struct list_head head;
+   /* referenced, the generated TCS passes the outputs of the VS through */
+   struct vrend_shader_selector *vs;
+   struct vrend_shader_selector *sel;
+   uint8_t vertices_per_patch;
+   float tess_factors[6];
+};
+
+/* Blits of a texture level onto the next one that are not emitted yet, as
+ * guests generate mipmaps with one blit per level.  A chain of them is
+ * replaced by one glGenerateMipmap. */
+struct vrend_pending_mipmap {
+   uint32_t handle;
+   /* the blit of the base level */
+   struct pipe_blit_info info;
+   uint32_t num_levels;
+};
 
 struct vrend_sub_context {
    struct list_head head;
@@ -704,12 +1143,25 @@ struct vrend_sub_context {
    GLuint vaoid;
    uint32_t enabled_attribs_bitmask;
 
-   /* Using an array of lists only adds VREND_PROGRAM_NQUEUES - 1 list_head
-    * structures to the consumed memory, but looking up the program can
-    * be spead up by the factor VREND_PROGRAM_NQUEUES which makes this
-    * worthwile. */
-   struct list_head gl_programs[VREND_PROGRAM_NQUEUES];
+   /* Vertex arrays for previously used vertex layouts in most recently used
+    * order, vaoid is only used for layouts that can not be cached. */
+   struct list_head vaos;
+   struct hash_table *vao_table;
+   uint32_t num_vaos;
+   struct vrend_vao *current_vao;
+
+   /* Linked programs in most recently used order, lookups go through
+    * program_table which is keyed by the full set of shader ids. */
+   struct list_head gl_programs;
    struct list_head cs_programs;
+   /* in most recently used order */
+   struct list_head injected_tcs;
+   uint32_t num_injected_tcs;
+   struct hash_table *program_table;
+   uint64_t program_lookup_hits;
+   uint64_t program_lookup_misses;
+   /* the compiled variants by their combo_hash */
+   struct virgl_id_table combo_variants;
    struct util_hash_table *object_hash;
 
    struct vrend_vertex_element_array *ve;
@@ -719,6 +1171,22 @@ struct vrend_sub_context {
 
    struct pipe_index_buffer ib;
 
+   struct vrend_draw_batch draw_batch;
+   struct vrend_pending_clear pending_clear;
+   struct vrend_pending_mipmap pending_mipmap;
+   /* glMemoryBarrier bits not emitted yet, and those emitted since the
+    * last draw or dispatch that could write from the shaders */
+   GLbitfield pending_barriers;
+   GLbitfield done_barriers;
+   /* PIPE_TEXTURE_BARRIER_* not emitted yet */
+   unsigned pending_texture_barriers;
+   /* the compute state is bound, from a dispatch until the next command
+    * that is not a dispatch */
+   bool cs_bindings_current;
+
+   /* the eviction epoch the bound buffers were last marked used in */
+   uint32_t buffers_touched_epoch;
+
    bool vbo_dirty;
    bool shader_dirty;
    bool cs_shader_dirty;
@@ -740,6 +1208,12 @@ struct vrend_sub_context {
    uint32_t const_bufs_used_mask[PIPE_SHADER_TYPES];
    uint32_t const_bufs_dirty[PIPE_SHADER_TYPES];
 
+   /* Framebuffer objects for previously used attachment sets in most
+    * recently used order, fb_id is the one of current_fbo. */
+   struct list_head fbos;
+   struct hash_table *fbo_table;
+   uint32_t num_fbos;
+   struct vrend_fbo *current_fbo;
    uint32_t fb_id;
    uint32_t nr_cbufs;
    struct vrend_surface *zsurf;
@@ -782,6 +1256,8 @@ struct vrend_sub_context {
    struct pipe_blend_state hw_blend_state;
 
    struct list_head streamout_list;
+   /* the streamout objects by vrend_streamout_key */
+   struct hash_table *streamout_table;
    struct vrend_streamout_object *current_so;
 
    struct pipe_blend_color blend_color;
@@ -791,13 +1267,16 @@ struct vrend_sub_context {
 
    struct vrend_image_view image_views[PIPE_SHADER_TYPES][PIPE_MAX_SHADER_IMAGES];
    uint32_t images_used_mask[PIPE_SHADER_TYPES];
+   uint32_t images_dirty_mask[PIPE_SHADER_TYPES];
 
    struct vrend_ssbo ssbo[PIPE_SHADER_TYPES][PIPE_MAX_SHADER_BUFFERS];
    uint32_t ssbo_used_mask[PIPE_SHADER_TYPES];
+   uint32_t ssbo_dirty_mask[PIPE_SHADER_TYPES];
    uint32_t ssbo_binding_offset[PIPE_SHADER_TYPES];
 
    struct vrend_abo abo[PIPE_MAX_HW_ATOMIC_BUFFERS];
    uint32_t abo_used_mask;
+   uint32_t abo_dirty_mask;
    struct vrend_context_tweaks tweaks;
    uint8_t swizzle_output_rgb_to_bgr;
    uint8_t needs_manual_srgb_encode_bitmask;
@@ -810,6 +1289,10 @@ struct vrend_sub_context {
    uint32_t sysvalue_data_cookie;
    uint32_t current_program_id;
    uint32_t current_pipeline_id;
+
+   /* with use_gpu_timestamps, around the current batch */
+   struct vrend_gpu_timer *batch_timer;
+   struct list_head gpu_timer_free_list;
 };
 
 struct vrend_untyped_resource {
@@ -839,6 +1322,8 @@ struct vrend_context {
 
    /* resource bounds to this context */
    struct util_hash_table *res_hash;
+   /* the estimated size of the resources in res_hash */
+   struct virgl_memory_budget memory_budget;
 
    /*
     * vrend_context only works with typed virgl_resources.  More specifically,
@@ -862,14 +1347,23 @@ struct vrend_context {
    struct virgl_resource *untyped_resource_cache;
 
    struct vrend_shader_cfg shader_cfg;
+   /* with use_program_prediction, shared by the contexts of the application */
+   struct vrend_program_predictor *predictor;
 
    unsigned debug_flags;
 
    vrend_context_fence_retire fence_retire;
    void *fence_retire_data;
+   /* an older fence of the context has not signaled yet */
+   bool fences_stalled;
+
+   /* the resolved GPU time of the batches, until taken by the scheduler */
+   uint64_t gpu_batch_time;
 
 #ifdef ENABLE_TRACING
    struct hash_table *active_markers;
+   /* the trace counter of the GPU time of the batches */
+   char gpu_time_counter_name[32];
 #endif
 };
 
@@ -879,14 +1373,17 @@ static void vrend_update_viewport_state(struct vrend_sub_context *sub_ctx);
 static void vrend_update_scissor_state(struct vrend_sub_context *sub_ctx);
 static void vrend_destroy_query_object(void *obj_ptr);
 static void vrend_finish_context_switch(struct vrend_context *ctx);
+static struct vrend_gpu_timer *vrend_gpu_timer_begin(struct vrend_context *ctx,
+                                                     enum vrend_gpu_timer_type type);
+static void vrend_gpu_timer_end(struct vrend_gpu_timer *timer);
 static void vrend_patch_blend_state(struct vrend_sub_context *sub_ctx);
 static void vrend_update_frontface_state(struct vrend_sub_context *ctx);
 static void vrend_destroy_program(struct vrend_linked_shader_program *ent);
-static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
-                                      struct vrend_resource *res,
-                                      struct vrend_sampler_state *sampler_state,
-                                      GLuint sampler_id,
-                                      struct vrend_sampler_view *tview);
+static uint64_t vrend_resource_memory_size(const struct vrend_resource *res);
+static GLuint vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
+                                        struct vrend_resource *res,
+                                        struct vrend_sampler_state *sampler_state,
+                                        struct vrend_sampler_view *tview);
 static void vrend_object_bind_dsa_to_sub_context(struct vrend_sub_context *sub_ctx,
                                                  uint32_t handle);
 static GLenum tgsitargettogltarget(const enum pipe_texture_target target, int nr_samples);
@@ -922,6 +1419,11 @@ static inline bool vrend_format_can_readback(enum virgl_formats format)
    return tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_READBACK;
 }
 
+static inline bool vrend_format_is_emulated_compression(enum virgl_formats format)
+{
+   return tex_conv_table[format].flags & VIRGL_TEXTURE_EMULATED_COMPRESSION;
+}
+
 static inline bool vrend_format_can_multisample(enum virgl_formats format)
 {
    return tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_MULTISAMPLE;
@@ -1232,6 +1734,76 @@ static void vrend_dump_tgsi(const struct tgsi_token *tokens,
    strbuf_free(&logger_buffer);
 }
 
+/* Extensions of the host driver, gathered once so that looking them up does
+ * not walk the driver list again for every name, which is what
+ * epoxy_has_gl_extension does on core and GLES 3 contexts.
+ */
+static struct {
+   struct hash_table *names;
+   char *storage;
+} gl_extensions;
+
+static void vrend_gl_extensions_fini(void)
+{
+   _mesa_hash_table_destroy(gl_extensions.names, NULL);
+   free(gl_extensions.storage);
+   gl_extensions.names = NULL;
+   gl_extensions.storage = NULL;
+}
+
+static void vrend_gl_extensions_init(int gl_ver)
+{
+   GLint count = 0;
+   size_t size = 0;
+   char *cur;
+
+   vrend_gl_extensions_fini();
+
+   if (gl_ver >= 30) {
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+      for (GLint i = 0; i < count; i++) {
+         const char *name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+         size += name ? strlen(name) + 1 : 0;
+      }
+   } else {
+      const char *names = (const char *)glGetString(GL_EXTENSIONS);
+      size = names ? strlen(names) + 1 : 0;
+   }
+   if (!size)
+      return;
+
+   gl_extensions.storage = malloc(size);
+   gl_extensions.names = _mesa_hash_table_create(NULL, _mesa_hash_string,
+                                                 _mesa_key_string_equal);
+   if (!gl_extensions.storage || !gl_extensions.names) {
+      vrend_gl_extensions_fini();
+      return;
+   }
+
+   cur = gl_extensions.storage;
+   if (gl_ver >= 30) {
+      for (GLint i = 0; i < count; i++) {
+         const char *name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+         if (!name)
+            continue;
+         strcpy(cur, name);
+         _mesa_hash_table_insert(gl_extensions.names, cur, cur);
+         cur += strlen(cur) + 1;
+      }
+   } else {
+      strcpy(cur, (const char *)glGetString(GL_EXTENSIONS));
+      for (char *name = strtok(cur, " "); name; name = strtok(NULL, " "))
+         _mesa_hash_table_insert(gl_extensions.names, name, name);
+   }
+}
+
+bool vrend_has_gl_extension(const char *name)
+{
+   if (!gl_extensions.names)
+      return epoxy_has_gl_extension(name);
+   return _mesa_hash_table_search(gl_extensions.names, name) != NULL;
+}
+
 static void init_features(int gl_ver, int gles_ver)
 {
    for (enum features_id id = 0; id < feat_last; id++) {
@@ -1245,7 +1817,7 @@ static void init_features(int gl_ver, int gles_ver)
          for (uint32_t i = 0; i < FEAT_MAX_EXTS; i++) {
             if (!feature_list[id].gl_ext[i])
                break;
-            if (epoxy_has_gl_extension(feature_list[id].gl_ext[i])) {
+            if (vrend_has_gl_extension(feature_list[id].gl_ext[i])) {
                set_feature(id);
                VREND_DEBUG(dbg_features, NULL,
                            "Host feature %s provide by %s\n", feature_list[id].log_name,
@@ -1259,8 +1831,10 @@ static void init_features(int gl_ver, int gles_ver)
 
 static void vrend_destroy_surface(struct vrend_surface *surf)
 {
-   if (surf->gl_id != surf->texture->gl_id)
+   if (surf->gl_id != surf->texture->gl_id) {
+      vrend_gl_state_forget_texture(surf->gl_id);
       glDeleteTextures(1, &surf->gl_id);
+   }
    vrend_resource_reference(&surf->texture, NULL);
    free(surf);
 }
@@ -1277,8 +1851,10 @@ vrend_surface_reference(struct vrend_surface **ptr, struct vrend_surface *surf)
 
 static void vrend_destroy_sampler_view(struct vrend_sampler_view *samp)
 {
-   if (samp->texture->gl_id != samp->gl_id)
+   if (samp->texture->gl_id != samp->gl_id) {
+      vrend_gl_state_forget_texture(samp->gl_id);
       glDeleteTextures(1, &samp->gl_id);
+   }
    vrend_resource_reference(&samp->texture, NULL);
    free(samp);
 }
@@ -1327,22 +1903,31 @@ static void vrend_shader_destroy(struct vrend_shader *shader)
    list_for_each_entry_safe(struct vrend_linked_shader_program, ent, &shader->programs, sl[shader->sel->type])
       vrend_destroy_program(ent);
 
-   if (shader->sel->sinfo.separable_program)
+   /* another variant with the same hash might have replaced it */
+   if (shader->combo_sub_ctx) {
+      struct virgl_id_table *table = &shader->combo_sub_ctx->combo_variants;
+      if (virgl_id_table_search(table, shader->combo_hash) == shader)
+         virgl_id_table_remove(table, shader->combo_hash);
+   }
+
+   if (shader->sel->sinfo.separable_program) {
+       vrend_gl_state_forget_program(shader->program_id);
        glDeleteProgram(shader->program_id);
+   }
    glDeleteShader(shader->id);
-   strarray_free(&shader->glsl_strings, true);
+   if (shader->cache_entry)
+      vrend_shader_cache_entry_unref(shader->cache_entry);
+   else
+      vrend_shader_strings_free(&shader->glsl_strings);
    free(shader);
 }
 
 static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
 {
-   struct vrend_shader *p = sel->current, *c;
    unsigned i;
-   while (p) {
-      c = p->next_variant;
-      vrend_shader_destroy(p);
-      p = c;
-   }
+   list_for_each_entry_safe(struct vrend_shader, shader, &sel->variants, variant_head)
+      vrend_shader_destroy(shader);
+   _mesa_hash_table_destroy(sel->variant_table, NULL);
    if (sel->sinfo.so_names)
       for (i = 0; i < sel->sinfo.so_info.num_outputs; i++)
          free(sel->sinfo.so_names[i]);
@@ -1350,6 +1935,7 @@ static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
    free(sel->sinfo.sampler_arrays);
    free(sel->sinfo.image_arrays);
    free(sel->tokens);
+   free(sel->analysis);
    free(sel);
 }
 
@@ -1366,6 +1952,9 @@ vrend_shader_state_reference(struct vrend_shader_selector **ptr, struct vrend_sh
 static void vrend_destroy_long_shader_buffer(struct vrend_long_shader_buffer *lsbuf)
 {
    vrend_shader_state_reference(&lsbuf->sel, NULL);
+   if (lsbuf->parser)
+      tgsi_text_parser_destroy(lsbuf->parser);
+   free(lsbuf->tokens);
    free(lsbuf->tmp_buf);
    free(lsbuf);
 }
@@ -1384,18 +1973,11 @@ static inline int conv_shader_type(int type)
    };
 }
 
-static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
-                                 struct vrend_shader *shader)
+static bool vrend_check_compile_status(struct vrend_sub_context *sub_ctx,
+                                       struct vrend_shader *shader)
 {
    GLint param;
-   const char *shader_parts[SHADER_MAX_STRINGS];
-
-   for (int i = 0; i < shader->glsl_strings.num_strings; i++)
-      shader_parts[i] = shader->glsl_strings.strings[i].buf;
 
-   shader->id = glCreateShader(conv_shader_type(shader->sel->type));
-   glShaderSource(shader->id, shader->glsl_strings.num_strings, shader_parts, NULL);
-   glCompileShader(shader->id);
    glGetShaderiv(shader->id, GL_COMPILE_STATUS, &param);
    if (param == GL_FALSE) {
       char infolog[65536];
@@ -1404,9 +1986,51 @@ static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
       vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
       virgl_error("Shader failed to compile\n%s\n", infolog);
       vrend_shader_dump(shader);
+      shader->compile_state = VREND_SHADER_COMPILE_FAILED;
       return false;
    }
 
+   shader->compile_state = VREND_SHADER_COMPILE_DONE;
+   return true;
+}
+
+/* Collect the status of a compile started with parallel shader compile */
+static bool vrend_finish_compile(struct vrend_sub_context *sub_ctx,
+                                 struct vrend_shader *shader)
+{
+   if (shader->compile_state == VREND_SHADER_COMPILE_PENDING)
+      return vrend_check_compile_status(sub_ctx, shader);
+   return shader->compile_state != VREND_SHADER_COMPILE_FAILED;
+}
+
+static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
+                                 struct vrend_shader *shader)
+{
+   const char *shader_parts[SHADER_MAX_STRINGS];
+
+   for (int i = 0; i < shader->glsl_strings.num_strings; i++)
+      shader_parts[i] = shader->glsl_strings.strings[i].buf;
+
+   shader->id = glCreateShader(conv_shader_type(shader->sel->type));
+   glShaderSource(shader->id, shader->glsl_strings.num_strings, shader_parts, NULL);
+
+   /* Compilation errors are reported when the program fails to link */
+   if (vrend_state.num_shader_threads && shader->sel->type != PIPE_SHADER_COMPUTE &&
+       !shader->sel->sinfo.separable_program) {
+      shader->compile_state = VREND_SHADER_COMPILE_DEFERRED;
+      shader->is_compiled = true;
+      return true;
+   }
+
+   glCompileShader(shader->id);
+
+   /* Don't wait for the driver, the status is checked before the first use
+    * of the program. */
+   if (has_feature(feat_parallel_shader_compile) && shader->sel->type != PIPE_SHADER_COMPUTE)
+      shader->compile_state = VREND_SHADER_COMPILE_PENDING;
+   else if (!vrend_check_compile_status(sub_ctx, shader))
+      return false;
+
    if (shader->sel->sinfo.separable_program) {
        shader->program_id = glCreateProgram();
        shader->last_pipeline_id = 0xffffffff;
@@ -1456,12 +2080,12 @@ static void vrend_use_program(struct vrend_linked_shader_program *program)
                           program->is_pipeline ? program->id.pipeline :
                                                  program->id.program;
    if (program && program->is_pipeline) {
-      glUseProgram(0);
-      glBindProgramPipeline(id);
+      vrend_gl_use_program(0);
+      vrend_gl_bind_program_pipeline(id);
    } else {
        if (has_feature(feat_separate_shader_objects))
-          glBindProgramPipeline(0);
-       glUseProgram(id);
+          vrend_gl_bind_program_pipeline(0);
+       vrend_gl_use_program(id);
    }
 }
 
@@ -1470,9 +2094,9 @@ static void vrend_depth_test_enable(struct vrend_sub_context *sub_ctx, bool dept
    if (sub_ctx->depth_test_enabled != depth_test_enable) {
       sub_ctx->depth_test_enabled = depth_test_enable;
       if (depth_test_enable)
-         glEnable(GL_DEPTH_TEST);
+         vrend_gl_enable(GL_DEPTH_TEST, true);
       else
-         glDisable(GL_DEPTH_TEST);
+         vrend_gl_enable(GL_DEPTH_TEST, false);
    }
 }
 
@@ -1485,9 +2109,9 @@ static void vrend_alpha_test_enable(struct vrend_sub_context *sub_ctx, bool alph
    if (sub_ctx->alpha_test_enabled != alpha_test_enable) {
       sub_ctx->alpha_test_enabled = alpha_test_enable;
       if (alpha_test_enable)
-         glEnable(GL_ALPHA_TEST);
+         vrend_gl_enable(GL_ALPHA_TEST, true);
       else
-         glDisable(GL_ALPHA_TEST);
+         vrend_gl_enable(GL_ALPHA_TEST, false);
    }
 }
 
@@ -1496,9 +2120,9 @@ static void vrend_stencil_test_enable(struct vrend_sub_context *sub_ctx, bool st
    if (sub_ctx->stencil_test_enabled != stencil_test_enable) {
       sub_ctx->stencil_test_enabled = stencil_test_enable;
       if (stencil_test_enable)
-         glEnable(GL_STENCIL_TEST);
+         vrend_gl_enable(GL_STENCIL_TEST, true);
       else
-         glDisable(GL_STENCIL_TEST);
+         vrend_gl_enable(GL_STENCIL_TEST, false);
    }
 }
 
@@ -1683,18 +2307,6 @@ static int bind_sampler_locs(struct vrend_linked_shader_program *sprog,
    return next_sampler_id;
 }
 
-static void bind_const_locs(struct vrend_linked_shader_program *sprog,
-                            enum pipe_shader_type shader_type)
-{
-  if (sprog->ss[shader_type]->sel->sinfo.num_consts) {
-     char name[32];
-     snprintf(name, 32, "%sconst0", pipe_shader_to_prefix(shader_type));
-     sprog->const_location[shader_type] = vrend_get_uniform_location(sprog, name,
-                                                                     shader_type);
-  } else
-     sprog->const_location[shader_type] = -1;
-}
-
 static inline GLuint
 vrend_get_uniform_block_index(struct vrend_linked_shader_program *sprog,
                               char *name, int shader_type)
@@ -1721,6 +2333,36 @@ vrend_uniform_block_binding(struct vrend_linked_shader_program *sprog,
     glUniformBlockBinding(id, loc, value);
 }
 
+static void bind_const_locs(struct vrend_linked_shader_program *sprog,
+                            enum pipe_shader_type shader_type)
+{
+  sprog->const_location[shader_type] = -1;
+  sprog->const_locations_consecutive[shader_type] = false;
+  sprog->const_block_index[shader_type] = GL_INVALID_INDEX;
+  sprog->const_block_bind[shader_type] = GL_INVALID_INDEX;
+
+  if (sprog->ss[shader_type]->sel->sinfo.num_consts) {
+     char name[32];
+     if (vrend_state.use_const_ubo) {
+        snprintf(name, 32, "%sconstbuf", pipe_shader_to_prefix(shader_type));
+        sprog->const_block_index[shader_type] = vrend_get_uniform_block_index(sprog, name,
+                                                                              shader_type);
+     } else {
+        uint32_t last = sprog->ss[shader_type]->sel->sinfo.num_consts - 1;
+        snprintf(name, 32, "%sconst0", pipe_shader_to_prefix(shader_type));
+        sprog->const_location[shader_type] = vrend_get_uniform_location(sprog, name,
+                                                                        shader_type);
+        /* the locations of the elements are only guaranteed to follow each
+         * other with explicit locations, check the last one */
+        snprintf(name, 32, "%sconst0[%u]", pipe_shader_to_prefix(shader_type), last);
+        sprog->const_locations_consecutive[shader_type] =
+           sprog->const_location[shader_type] != -1 &&
+           vrend_get_uniform_location(sprog, name, shader_type) ==
+           sprog->const_location[shader_type] + (GLint)last;
+     }
+  }
+}
+
 static unsigned bind_ubo_locs(struct vrend_linked_shader_program *sprog,
                               enum pipe_shader_type shader_type, GLuint next_ubo_id)
 {
@@ -1778,13 +2420,28 @@ static void bind_virgl_block_loc(struct vrend_linked_shader_program *sprog,
       assert((size_t) virgl_block_size >= sizeof(struct sysval_uniform_block));
 
       if (created_virgl_block_buffer) {
-         glBindBuffer(GL_UNIFORM_BUFFER, sprog->ubo_sysval_buffer_id);
+         vrend_gl_bind_buffer(GL_UNIFORM_BUFFER, sprog->ubo_sysval_buffer_id);
          glBufferData(GL_UNIFORM_BUFFER, virgl_block_size, NULL, GL_DYNAMIC_DRAW);
-         glBindBuffer(GL_UNIFORM_BUFFER, 0);
+         vrend_gl_bind_buffer(GL_UNIFORM_BUFFER, 0);
       }
    }
 }
 
+static GLuint bind_const_block_loc(struct vrend_linked_shader_program *sprog,
+                                   enum pipe_shader_type shader_type,
+                                   GLuint next_ubo_id)
+{
+   if (sprog->const_block_index[shader_type] == GL_INVALID_INDEX) {
+      sprog->const_block_bind[shader_type] = GL_INVALID_INDEX;
+      return next_ubo_id;
+   }
+
+   vrend_uniform_block_binding(sprog, shader_type,
+                               sprog->const_block_index[shader_type], next_ubo_id);
+   sprog->const_block_bind[shader_type] = next_ubo_id;
+   return next_ubo_id + 1;
+}
+
 static void rebind_ubo_and_sampler_locs(struct vrend_linked_shader_program *sprog,
                                         enum pipe_shader_type last_shader)
 {
@@ -1814,6 +2471,19 @@ static void rebind_ubo_and_sampler_locs(struct vrend_linked_shader_program *spro
 
       bind_virgl_block_loc(sprog, shader_type, next_ubo_id);
    }
+
+   /* the constants blocks come after it */
+   if (sprog->virgl_block_bind != GL_INVALID_INDEX)
+      next_ubo_id++;
+   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
+        shader_type <= last_shader;
+        shader_type++) {
+      if (!sprog->ss[shader_type])
+         continue;
+
+      vrend_set_active_pipeline_stage(sprog, shader_type);
+      next_ubo_id = bind_const_block_loc(sprog, shader_type, next_ubo_id);
+   }
 }
 
 static void bind_ssbo_locs(struct vrend_linked_shader_program *sprog,
@@ -1874,10 +2544,9 @@ static void bind_image_locs(struct vrend_linked_shader_program *sprog,
    sprog->images_used_mask[shader_type] = mask;
 }
 
-static bool vrend_link(GLuint id)
+static bool vrend_check_link_status(GLuint id)
 {
    GLint lret;
-   glLinkProgram(id);
    glGetProgramiv(id, GL_LINK_STATUS, &lret);
    if (lret == GL_FALSE) {
       char infolog[65536];
@@ -1889,55 +2558,430 @@ static bool vrend_link(GLuint id)
    return true;
 }
 
-static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
-                                        struct vrend_shader *shader, int type)
+static bool vrend_link(GLuint id)
 {
-   int i;
-   char name[64];
+   glLinkProgram(id);
+   return vrend_check_link_status(id);
+}
 
-   if (type == PIPE_SHADER_VERTEX || type == PIPE_SHADER_GEOMETRY ||
-       type == PIPE_SHADER_TESS_EVAL)
-       set_stream_out_varyings(sub_ctx, shader->program_id, &shader->sel->sinfo);
+/* Called on a shader thread, only the GL objects are touched here since the
+ * rest of the shader state belongs to the decode thread. */
+static bool vrend_shader_job_compile(struct vrend_shader *shader)
+{
+   bool compile;
+   GLint param;
 
-   if (type == PIPE_SHADER_FRAGMENT && shader->sel->sinfo.num_outputs > 1) {
-      bool dual_src_linked = util_blend_state_is_dual(&sub_ctx->blend_state, 0);
-      if (dual_src_linked) {
-         if (has_feature(feat_dual_src_blend)) {
-            if (!vrend_state.use_gles) {
-               glBindFragDataLocationIndexed(shader->program_id, 0, 0, "fsout_c0");
-               glBindFragDataLocationIndexed(shader->program_id, 0, 1, "fsout_c1");
-            } else {
-               glBindFragDataLocationIndexedEXT(shader->program_id, 0, 0, "fsout_c0");
-               glBindFragDataLocationIndexedEXT(shader->program_id, 0, 1, "fsout_c1");
-            }
-         } else {
-            vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_DUAL_SRC_BLEND, 0);
-         }
-      } else if (!vrend_state.use_gles && has_feature(feat_dual_src_blend)) {
-         /* On GLES without dual source blending we emit the layout directly in the shader
-          * so there is no need to define the binding here */
-         for (int i = 0; i < shader->sel->sinfo.num_outputs; ++i) {
-            if (shader->sel->sinfo.fs_output_layout[i] >= 0) {
-               char buf[64];
-               snprintf(buf, sizeof(buf), "fsout_c%d",
-                        shader->sel->sinfo.fs_output_layout[i]);
-               glBindFragDataLocationIndexed(shader->program_id,
-                                             shader->sel->sinfo.fs_output_layout[i],
-                                             0, buf);
-            }
-         }
-      }
-   }
+   mtx_lock(&vrend_state.shader_job_mutex);
+   /* another thread is compiling it for a different program */
+   while (shader->compile_state == VREND_SHADER_COMPILE_RUNNING)
+      cnd_wait(&vrend_state.shader_job_done_cond, &vrend_state.shader_job_mutex);
+   compile = shader->compile_state == VREND_SHADER_COMPILE_DEFERRED;
+   if (compile)
+      shader->compile_state = VREND_SHADER_COMPILE_RUNNING;
+   else
+      param = shader->compile_state == VREND_SHADER_COMPILE_DONE;
+   mtx_unlock(&vrend_state.shader_job_mutex);
 
-   if (type == PIPE_SHADER_VERTEX && has_feature(feat_gles31_vertex_attrib_binding)) {
-      uint32_t mask = shader->sel->sinfo.attrib_input_mask;
-      while (mask) {
-         i = u_bit_scan(&mask);
+   if (!compile)
+      return param;
+
+   glCompileShader(shader->id);
+   glGetShaderiv(shader->id, GL_COMPILE_STATUS, &param);
+   if (param == GL_FALSE) {
+      char infolog[65536];
+      int len;
+      glGetShaderInfoLog(shader->id, 65536, &len, infolog);
+      virgl_error("Shader failed to compile\n%s\n", infolog);
+   }
+
+   mtx_lock(&vrend_state.shader_job_mutex);
+   shader->compile_state = param == GL_FALSE ? VREND_SHADER_COMPILE_FAILED :
+                                               VREND_SHADER_COMPILE_DONE;
+   cnd_broadcast(&vrend_state.shader_job_done_cond);
+   mtx_unlock(&vrend_state.shader_job_mutex);
+
+   return param != GL_FALSE;
+}
+
+/* Only reads the selector, the decode thread waits for the translations
+ * before it goes on with the selection. */
+static void vrend_shader_job_translate(struct vrend_shader_translation *translation)
+{
+   const struct vrend_shader_selector *sel = translation->sel;
+   struct vrend_shader_info sinfo = sel->sinfo;
+   struct vrend_variable_shader_info var_sinfo;
+   struct vrend_strarray glsl;
+
+   /* the arrays are replaced by the translation, those of the selector stay */
+   sinfo.so_names = NULL;
+   sinfo.sampler_arrays = NULL;
+   sinfo.image_arrays = NULL;
+   memset(&var_sinfo, 0, sizeof(var_sinfo));
+
+   if (!strarray_alloc(&glsl, SHADER_MAX_STRINGS))
+      return;
+
+   struct vrend_shader_cache_entry *entry = NULL;
+   if (vrend_convert_shader(translation->ctx, &translation->ctx->shader_cfg, sel->tokens,
+                            sel->analysis, sel->req_local_mem, &translation->key, &sinfo,
+                            &var_sinfo, &glsl))
+      entry = vrend_shader_cache_insert(&translation->cache_key, &sinfo, &var_sinfo, &glsl);
+
+   if (entry)
+      vrend_shader_cache_entry_unref(entry);
+   else
+      vrend_shader_strings_free(&glsl);
+
+   if (sinfo.so_names) {
+      for (unsigned i = 0; i < sinfo.so_info.num_outputs; i++)
+         free(sinfo.so_names[i]);
+      free(sinfo.so_names);
+   }
+   free(sinfo.sampler_arrays);
+   free(sinfo.image_arrays);
+}
+
+static void vrend_shader_job_run(struct vrend_shader_job *job)
+{
+   bool success = true;
+
+   if (job->translation) {
+      vrend_shader_job_translate(job->translation);
+      return;
+   }
+
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+      if (job->ss[type])
+         success &= vrend_shader_job_compile(job->ss[type]);
+   }
+
+   if (success)
+      success = vrend_link(job->prog_id);
+
+   job->link_success = success;
+   job->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   glFlush();
+}
+
+static int thread_shader(void *arg)
+{
+   virgl_gl_context gl_context = arg;
+
+   u_thread_setname("vrend-shader");
+   virgl_numa_bind_thread();
+
+   vrend_clicbs->make_current_surfaceless(gl_context);
+
+   mtx_lock(&vrend_state.shader_job_mutex);
+   while (!vrend_state.stop_shader_threads) {
+      if (list_is_empty(&vrend_state.shader_job_list)) {
+         if (cnd_wait(&vrend_state.shader_job_cond, &vrend_state.shader_job_mutex) != 0) {
+            virgl_warn("Error while waiting on condition\n");
+            break;
+         }
+         continue;
+      }
+
+      struct vrend_shader_job *job = list_first_entry(&vrend_state.shader_job_list,
+                                                      struct vrend_shader_job, head);
+      /* an empty head tells vrend_shader_job_destroy that the job is running */
+      list_delinit(&job->head);
+      mtx_unlock(&vrend_state.shader_job_mutex);
+
+      vrend_shader_job_run(job);
+
+      mtx_lock(&vrend_state.shader_job_mutex);
+      job->done = true;
+      cnd_broadcast(&vrend_state.shader_job_done_cond);
+   }
+   mtx_unlock(&vrend_state.shader_job_mutex);
+
+   vrend_shader_free_scratch();
+   vrend_clicbs->make_current_surfaceless(NULL);
+   vrend_clicbs->destroy_gl_context_surfaceless(gl_context);
+   return 0;
+}
+
+static void vrend_shader_job_queue(struct vrend_shader_job *job)
+{
+   mtx_lock(&vrend_state.shader_job_mutex);
+   list_addtail(&job->head, &vrend_state.shader_job_list);
+   cnd_signal(&vrend_state.shader_job_cond);
+   mtx_unlock(&vrend_state.shader_job_mutex);
+}
+
+static struct vrend_shader_job *
+vrend_shader_job_submit(GLuint prog_id, struct vrend_shader **ss)
+{
+   struct vrend_shader_job *job = CALLOC_STRUCT(vrend_shader_job);
+   if (!job)
+      return NULL;
+
+   job->prog_id = prog_id;
+   memcpy(job->ss, ss, sizeof(job->ss));
+
+   /* The program was created, and its shaders attached and its locations
+    * bound, on this context.  Another context is only guaranteed to see
+    * that state after a flush, like the result of the job is flushed for
+    * this context in vrend_shader_job_run. */
+   glFlush();
+   vrend_shader_job_queue(job);
+
+   return job;
+}
+
+static struct vrend_shader_job *
+vrend_shader_job_submit_translation(struct vrend_shader_translation *translation)
+{
+   struct vrend_shader_job *job = CALLOC_STRUCT(vrend_shader_job);
+   if (!job)
+      return NULL;
+
+   job->translation = translation;
+   vrend_shader_job_queue(job);
+
+   return job;
+}
+
+static bool vrend_shader_job_is_done(struct vrend_shader_job *job, bool wait)
+{
+   mtx_lock(&vrend_state.shader_job_mutex);
+   while (wait && !job->done)
+      cnd_wait(&vrend_state.shader_job_done_cond, &vrend_state.shader_job_mutex);
+   bool done = job->done;
+   mtx_unlock(&vrend_state.shader_job_mutex);
+   return done;
+}
+
+static void vrend_shader_job_destroy(struct vrend_shader_job *job)
+{
+   mtx_lock(&vrend_state.shader_job_mutex);
+   if (!list_is_empty(&job->head)) {
+      /* not picked up by a shader thread yet */
+      list_del(&job->head);
+   } else {
+      while (!job->done)
+         cnd_wait(&vrend_state.shader_job_done_cond, &vrend_state.shader_job_mutex);
+   }
+   mtx_unlock(&vrend_state.shader_job_mutex);
+
+   if (job->sync)
+      glDeleteSync(job->sync);
+   free(job);
+}
+
+/* Runs the jobs that no shader thread picked up yet on the calling thread,
+ * then waits for the others and destroys all of them. */
+static void vrend_shader_jobs_finish(struct vrend_shader_job **jobs, uint32_t count)
+{
+   /* the shader threads take the jobs from the front */
+   for (uint32_t i = count; i-- > 0;) {
+      struct vrend_shader_job *job = jobs[i];
+
+      mtx_lock(&vrend_state.shader_job_mutex);
+      bool queued = !list_is_empty(&job->head);
+      if (queued)
+         list_delinit(&job->head);
+      mtx_unlock(&vrend_state.shader_job_mutex);
+
+      if (queued) {
+         vrend_shader_job_run(job);
+         job->done = true;
+      }
+   }
+
+   for (uint32_t i = 0; i < count; i++)
+      vrend_shader_job_destroy(jobs[i]);
+}
+
+static void vrend_free_shader_threads(void)
+{
+   if (!vrend_state.num_shader_threads)
+      return;
+
+   mtx_lock(&vrend_state.shader_job_mutex);
+   vrend_state.stop_shader_threads = true;
+   cnd_broadcast(&vrend_state.shader_job_cond);
+   mtx_unlock(&vrend_state.shader_job_mutex);
+
+   for (uint32_t i = 0; i < vrend_state.num_shader_threads; i++)
+      thrd_join(vrend_state.shader_threads[i], NULL);
+   vrend_state.num_shader_threads = 0;
+
+   /* all programs are gone by now, and with them their jobs */
+   assert(list_is_empty(&vrend_state.shader_job_list));
+
+   cnd_destroy(&vrend_state.shader_job_done_cond);
+   cnd_destroy(&vrend_state.shader_job_cond);
+   mtx_destroy(&vrend_state.shader_job_mutex);
+}
+
+/* Emits the constants of the shaders as a uniform block, streamed through the
+ * upload ring, instead of as uniforms set with glUniform4uiv.  The block takes
+ * one of the uniform blocks of the stages away from the guest, and it is only
+ * used when the constants the guest may use fit in a block.
+ */
+static void vrend_renderer_use_const_ubo(void)
+{
+   GLint max_block_size = 0, max_components = 0, alignment = 0;
+
+   glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+   glGetIntegerv(GL_MAX_VERTEX_UNIFORM_COMPONENTS, &max_components);
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+   if (max_block_size < max_components * 4 || alignment <= 0 ||
+       !util_is_power_of_two_nonzero(alignment)) {
+      virgl_warn("vrend: constants can not be streamed as uniform blocks\n");
+      return;
+   }
+
+   vrend_state.ubo_offset_alignment = alignment;
+   vrend_state.use_const_ubo = true;
+   virgl_info("vrend: streaming the shader constants as uniform blocks\n");
+}
+
+/* The sub-contexts of the guest contexts take their GL contexts from the pool,
+ * with the parameters they use in vrend_renderer_create_sub_ctx. */
+static void vrend_renderer_use_context_pool(void)
+{
+   struct virgl_gl_ctx_param ctx_params = {0};
+
+   ctx_params.shared = true;
+   ctx_params.major_ver = vrend_state.gl_major_ver;
+   ctx_params.minor_ver = vrend_state.gl_minor_ver;
+   ctx_params.compat_ctx = !vrend_state.use_core_profile && !vrend_state.use_gles;
+   ctx_params.no_error = vrend_state.use_no_error;
+
+   if (vrend_context_pool_init(&ctx_params))
+      virgl_info("vrend: creating the GL contexts of new contexts ahead of time\n");
+}
+
+/* VREND_ASYNC_SHADERS sets the number of threads that compile and link
+ * programs on shared contexts. */
+static void vrend_renderer_use_shader_threads(void)
+{
+   struct virgl_gl_ctx_param ctx_params = {0};
+   long num_threads = debug_get_num_option("VREND_ASYNC_SHADERS", 0);
+
+   if (num_threads <= 0)
+      return;
+   if (num_threads > VREND_MAX_SHADER_THREADS)
+      num_threads = VREND_MAX_SHADER_THREADS;
+
+   ctx_params.shared = true;
+   ctx_params.major_ver = vrend_state.gl_major_ver;
+   ctx_params.minor_ver = vrend_state.gl_minor_ver;
+   ctx_params.compat_ctx = !vrend_state.use_core_profile && !vrend_state.use_gles;
+   ctx_params.no_error = vrend_state.use_no_error;
+
+   mtx_init(&vrend_state.shader_job_mutex, mtx_plain);
+   cnd_init(&vrend_state.shader_job_cond);
+   cnd_init(&vrend_state.shader_job_done_cond);
+   list_inithead(&vrend_state.shader_job_list);
+   vrend_state.stop_shader_threads = false;
+
+   for (long i = 0; i < num_threads; i++) {
+      virgl_gl_context gl_context = vrend_clicbs->create_gl_context_surfaceless(0, &ctx_params);
+      if (!gl_context) {
+         virgl_error("Failed to create shader opengl context\n");
+         break;
+      }
+
+      thrd_t thread = u_thread_create(thread_shader, gl_context);
+      if (!thread) {
+         vrend_clicbs->destroy_gl_context_surfaceless(gl_context);
+         break;
+      }
+
+      vrend_state.shader_threads[vrend_state.num_shader_threads++] = thread;
+   }
+
+   if (!vrend_state.num_shader_threads) {
+      cnd_destroy(&vrend_state.shader_job_done_cond);
+      cnd_destroy(&vrend_state.shader_job_cond);
+      mtx_destroy(&vrend_state.shader_job_mutex);
+      return;
+   }
+
+   virgl_info("Compiling shaders on %u threads\n", vrend_state.num_shader_threads);
+}
+
+static inline void
+vrend_link_stage_start(struct vrend_shader *stage) {
+   if (!stage->is_linked && !stage->link_pending) {
+      glLinkProgram(stage->program_id);
+      stage->link_pending = true;
+   }
+}
+
+static inline bool
+vrend_link_stage(struct vrend_sub_context *sub_ctx, struct vrend_shader *stage) {
+   if (stage->link_pending) {
+      stage->link_pending = false;
+      stage->is_linked = vrend_finish_compile(sub_ctx, stage) &&
+                         vrend_check_link_status(stage->program_id);
+   } else if (!stage->is_linked) {
+      stage->is_linked = vrend_finish_compile(sub_ctx, stage) &&
+                         vrend_link(stage->program_id);
+   }
+   return stage->is_linked;
+}
+
+static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
+                                        struct vrend_shader *shader, int type)
+{
+   int i;
+   char name[64];
+
+   if (type == PIPE_SHADER_VERTEX || type == PIPE_SHADER_GEOMETRY ||
+       type == PIPE_SHADER_TESS_EVAL)
+       set_stream_out_varyings(sub_ctx, shader->program_id, &shader->sel->sinfo);
+
+   if (type == PIPE_SHADER_FRAGMENT && shader->sel->sinfo.num_outputs > 1) {
+      bool dual_src_linked = util_blend_state_is_dual(&sub_ctx->blend_state, 0);
+      if (dual_src_linked) {
+         if (has_feature(feat_dual_src_blend)) {
+            if (!vrend_state.use_gles) {
+               glBindFragDataLocationIndexed(shader->program_id, 0, 0, "fsout_c0");
+               glBindFragDataLocationIndexed(shader->program_id, 0, 1, "fsout_c1");
+            } else {
+               glBindFragDataLocationIndexedEXT(shader->program_id, 0, 0, "fsout_c0");
+               glBindFragDataLocationIndexedEXT(shader->program_id, 0, 1, "fsout_c1");
+            }
+         } else {
+            vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_DUAL_SRC_BLEND, 0);
+         }
+      } else if (!vrend_state.use_gles && has_feature(feat_dual_src_blend)) {
+         /* On GLES without dual source blending we emit the layout directly in the shader
+          * so there is no need to define the binding here */
+         for (int i = 0; i < shader->sel->sinfo.num_outputs; ++i) {
+            if (shader->sel->sinfo.fs_output_layout[i] >= 0) {
+               char buf[64];
+               snprintf(buf, sizeof(buf), "fsout_c%d",
+                        shader->sel->sinfo.fs_output_layout[i]);
+               glBindFragDataLocationIndexed(shader->program_id,
+                                             shader->sel->sinfo.fs_output_layout[i],
+                                             0, buf);
+            }
+         }
+      }
+   }
+
+   if (type == PIPE_SHADER_VERTEX && has_feature(feat_gles31_vertex_attrib_binding)) {
+      uint32_t mask = shader->sel->sinfo.attrib_input_mask;
+      while (mask) {
+         i = u_bit_scan(&mask);
          snprintf(name, 32, "in_%d", i);
          glBindAttribLocation(shader->program_id, i, name);
       }
    }
 
+   /* the status is collected when the program pipeline is created */
+   if (has_feature(feat_parallel_shader_compile)) {
+      vrend_link_stage_start(shader);
+      return true;
+   }
+
    shader->is_linked = vrend_link(shader->program_id);
 
    if (!shader->is_linked) {
@@ -1949,6 +2993,53 @@ static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
    return shader->is_linked;
 }
 
+static uint32_t vrend_program_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct vrend_program_key), 0);
+}
+
+static bool vrend_program_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vrend_program_key));
+}
+
+static void vrend_program_key_init(struct vrend_program_key *key,
+                                   const GLuint *shader_ids, bool dual_src)
+{
+   memset(key, 0, sizeof(*key));
+   if (shader_ids)
+      memcpy(key->shader_ids, shader_ids, sizeof(key->shader_ids));
+   key->dual_src = dual_src;
+}
+
+static void vrend_program_insert(struct vrend_sub_context *sub_ctx,
+                                 struct vrend_linked_shader_program *sprog)
+{
+   sprog->owner = sub_ctx;
+   _mesa_hash_table_insert(sub_ctx->program_table, &sprog->key, sprog);
+}
+
+static struct vrend_linked_shader_program *
+vrend_program_lookup(struct vrend_sub_context *sub_ctx,
+                     struct list_head *programs,
+                     const struct vrend_program_key *key)
+{
+   struct hash_entry *entry = _mesa_hash_table_search(sub_ctx->program_table, key);
+   if (!entry) {
+      sub_ctx->program_lookup_misses++;
+      return NULL;
+   }
+
+   struct vrend_linked_shader_program *ent = entry->data;
+   /* put the entry in front */
+   if (programs->next != &ent->head) {
+      list_del(&ent->head);
+      list_add(&ent->head, programs);
+   }
+   sub_ctx->program_lookup_hits++;
+   return ent;
+}
+
 static struct vrend_linked_shader_program *add_cs_shader_program(struct vrend_context *ctx,
                                                                  struct vrend_shader *cs)
 {
@@ -1969,23 +3060,183 @@ static struct vrend_linked_shader_program *add_cs_shader_program(struct vrend_co
 
    list_add(&sprog->sl[PIPE_SHADER_COMPUTE], &cs->programs);
    sprog->id.program = prog_id;
-   list_addtail(&sprog->head, &ctx->sub->cs_programs);
+   list_add(&sprog->head, &ctx->sub->cs_programs);
+
+   vrend_program_key_init(&sprog->key, NULL, 0);
+   sprog->key.shader_ids[PIPE_SHADER_COMPUTE] = cs->id;
+   vrend_program_insert(ctx->sub, sprog);
 
    vrend_use_program(sprog);
 
    bind_sampler_locs(sprog, PIPE_SHADER_COMPUTE, 0);
-   bind_ubo_locs(sprog, PIPE_SHADER_COMPUTE, 0);
+   GLuint next_ubo_id = bind_ubo_locs(sprog, PIPE_SHADER_COMPUTE, 0);
    bind_ssbo_locs(sprog, PIPE_SHADER_COMPUTE);
    bind_const_locs(sprog, PIPE_SHADER_COMPUTE);
+   bind_const_block_loc(sprog, PIPE_SHADER_COMPUTE, next_ubo_id);
    bind_image_locs(sprog, PIPE_SHADER_COMPUTE);
    return sprog;
 }
 
-static inline bool
-vrend_link_stage(struct vrend_shader *stage) {
-   if (!stage->is_linked)
-      stage->is_linked = vrend_link(stage->program_id);
-   return stage->is_linked;
+static void vrend_program_cache_key_append_shader(struct vrend_program_cache_key *key,
+                                                  const struct vrend_shader *shader)
+{
+   const struct vrend_shader_selector *sel = shader->sel;
+   const struct pipe_stream_output_info *so_info = &sel->sinfo.so_info;
+   uint32_t header[3] = { sel->type, sel->req_local_mem, so_info->num_outputs };
+
+   vrend_program_cache_key_append(key, header, sizeof(header));
+
+   /* The passthrough TCS injected on GLES has no tokens */
+   if (sel->tokens) {
+      vrend_program_cache_key_append(key, sel->tokens,
+                                     tgsi_num_tokens(sel->tokens) * sizeof(struct tgsi_token));
+   } else {
+      uint64_t preamble_hash = vrend_shader_preamble_hash(&shader->glsl_strings);
+      vrend_program_cache_key_append(key, &preamble_hash, sizeof(preamble_hash));
+      for (int i = SHADER_STRING_VER_EXT + 1; i < shader->glsl_strings.num_strings; i++)
+         vrend_program_cache_key_append(key, shader->glsl_strings.strings[i].buf,
+                                        shader->glsl_strings.strings[i].size);
+   }
+
+   vrend_program_cache_key_append(key, &shader->key, sizeof(shader->key));
+
+   /* The stream output info is not fully initialized by the decoder, so only
+    * hash the fields that are actually set. */
+   if (so_info->num_outputs) {
+      vrend_program_cache_key_append(key, so_info->stride, sizeof(so_info->stride));
+      for (unsigned i = 0; i < so_info->num_outputs; i++) {
+         const struct pipe_stream_output *out = &so_info->output[i];
+         uint32_t so_out[7] = { out->register_index, out->start_component, out->num_components,
+                                out->output_buffer, out->dst_offset, out->stream, out->need_temp };
+         vrend_program_cache_key_append(key, so_out, sizeof(so_out));
+      }
+   }
+}
+
+static void vrend_program_cache_key_for_program(struct vrend_program_cache_key *key,
+                                                struct vrend_sub_context *sub_ctx,
+                                                struct vrend_shader **stages,
+                                                bool dual_src_linked)
+{
+   vrend_program_cache_key_init(key);
+   vrend_program_cache_key_append(key, &sub_ctx->parent->shader_cfg,
+                                  sizeof(sub_ctx->parent->shader_cfg));
+   vrend_program_cache_key_append(key, &dual_src_linked, sizeof(dual_src_linked));
+
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+      if (stages[type])
+         vrend_program_cache_key_append_shader(key, stages[type]);
+   }
+}
+
+static void vrend_dump_program_shaders(struct vrend_linked_shader_program *sprog)
+{
+   vrend_shader_dump(sprog->ss[PIPE_SHADER_VERTEX]);
+   if (sprog->ss[PIPE_SHADER_TESS_CTRL])
+      vrend_shader_dump(sprog->ss[PIPE_SHADER_TESS_CTRL]);
+   if (sprog->ss[PIPE_SHADER_TESS_EVAL])
+      vrend_shader_dump(sprog->ss[PIPE_SHADER_TESS_EVAL]);
+   if (sprog->ss[PIPE_SHADER_GEOMETRY])
+      vrend_shader_dump(sprog->ss[PIPE_SHADER_GEOMETRY]);
+   vrend_shader_dump(sprog->ss[PIPE_SHADER_FRAGMENT]);
+}
+
+/* Query the resource locations of a freshly linked program */
+static void vrend_setup_linked_program(struct vrend_linked_shader_program *sprog)
+{
+   struct vrend_shader *vs = sprog->ss[PIPE_SHADER_VERTEX];
+   GLuint vs_id = sprog->is_pipeline ? vs->program_id : sprog->id.program;
+   enum pipe_shader_type last_shader;
+   char name[64];
+
+   last_shader = sprog->ss[PIPE_SHADER_TESS_EVAL] ? PIPE_SHADER_TESS_EVAL :
+                 (sprog->ss[PIPE_SHADER_GEOMETRY] ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
+
+   vrend_use_program(sprog);
+
+   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
+        shader_type <= last_shader;
+        shader_type++) {
+      if (!sprog->ss[shader_type])
+         continue;
+
+      bind_const_locs(sprog, shader_type);
+      bind_image_locs(sprog, shader_type);
+      bind_ssbo_locs(sprog, shader_type);
+
+      if (sprog->ss[shader_type]->sel->sinfo.reads_drawid)
+         sprog->reads_drawid = true;
+   }
+   rebind_ubo_and_sampler_locs(sprog, last_shader);
+
+   if (!has_feature(feat_gles31_vertex_attrib_binding)) {
+      if (vs->sel->sinfo.num_inputs) {
+         sprog->attrib_locs = calloc(vs->sel->sinfo.num_inputs, sizeof(uint32_t));
+         if (sprog->attrib_locs) {
+            for (int i = 0; i < vs->sel->sinfo.num_inputs; i++) {
+               snprintf(name, 32, "in_%d", i);
+               sprog->attrib_locs[i] = glGetAttribLocation(vs_id, name);
+            }
+         }
+      } else
+         sprog->attrib_locs = NULL;
+   }
+}
+
+static bool vrend_shader_program_is_linked(struct vrend_linked_shader_program *sprog,
+                                           bool wait)
+{
+   GLint complete;
+
+   if (sprog->link_job)
+      return vrend_shader_job_is_done(sprog->link_job, wait);
+
+   /* querying the link status blocks until the driver is done */
+   if (wait)
+      return true;
+
+   glGetProgramiv(sprog->id.program, GL_COMPLETION_STATUS_KHR, &complete);
+   return complete == GL_TRUE;
+}
+
+/* Called once the program is linked, either by a shader thread or by the
+ * driver with parallel shader compile.  A program that failed to link is
+ * destroyed. */
+static bool vrend_finish_shader_program(struct vrend_sub_context *sub_ctx,
+                                        struct vrend_linked_shader_program *sprog)
+{
+   struct vrend_shader_job *job = sprog->link_job;
+   bool link_success = true;
+
+   if (job) {
+      /* make the shader thread's link visible to this context */
+      glWaitSync(job->sync, 0, GL_TIMEOUT_IGNORED);
+      link_success = job->link_success;
+
+      sprog->link_job = NULL;
+      vrend_shader_job_destroy(job);
+   } else {
+      for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+         if (sprog->ss[type])
+            link_success &= vrend_finish_compile(sub_ctx, sprog->ss[type]);
+      }
+      if (link_success)
+         link_success = vrend_check_link_status(sprog->id.program);
+      sprog->link_pending = false;
+   }
+
+   if (link_success && sprog->store_in_cache)
+      vrend_program_cache_store(&sprog->cache_key, sprog->id.program);
+
+   if (!link_success) {
+      vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
+      vrend_dump_program_shaders(sprog);
+      vrend_destroy_program(sprog);
+      return false;
+   }
+
+   vrend_setup_linked_program(sprog);
+   return true;
 }
 
 static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_context *sub_ctx,
@@ -1994,6 +3245,7 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
                                                               struct vrend_shader *gs,
                                                               struct vrend_shader *tcs,
                                                               struct vrend_shader *tes,
+                                                              bool dual_src,
                                                               bool separable)
 {
    struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
@@ -2001,10 +3253,19 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
    GLuint prog_id = 0;
    GLuint pipeline_id = 0;
    GLuint vs_id, fs_id, gs_id, tes_id = 0;
-   enum pipe_shader_type last_shader;
    if (!sprog)
       return NULL;
 
+   sprog->virgl_block_bind = GL_INVALID_INDEX;
+   sprog->ubo_sysval_buffer_id = GL_INVALID_INDEX;
+   sprog->sysvalue_data_cookie = UINT32_MAX;
+
+   sprog->ss[PIPE_SHADER_VERTEX] = vs;
+   sprog->ss[PIPE_SHADER_FRAGMENT] = fs;
+   sprog->ss[PIPE_SHADER_GEOMETRY] = gs;
+   sprog->ss[PIPE_SHADER_TESS_CTRL] = tcs;
+   sprog->ss[PIPE_SHADER_TESS_EVAL] = tes;
+
    if (separable) {
        glGenProgramPipelines(1, &pipeline_id);
 
@@ -2043,7 +3304,7 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
       set_stream_out_varyings(sub_ctx, vs_id, &vs->sel->sinfo);
 
    if (fs->sel->sinfo.num_outputs > 1) {
-      sprog->dual_src_linked = util_blend_state_is_dual(&sub_ctx->blend_state, 0);
+      sprog->dual_src_linked = dual_src;
       if (sprog->dual_src_linked) {
          if (has_feature(feat_dual_src_blend)) {
             if (!vrend_state.use_gles) {
@@ -2079,15 +3340,45 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
       }
    }
 
-   bool link_success;
+   bool link_success = true;
    if (separable) { /* separable programs */
-      link_success = vrend_link_stage(vs);
-      link_success &= vrend_link_stage(fs);
-      if (gs) link_success &= vrend_link_stage(gs);
-      if (tcs) link_success &= vrend_link_stage(tcs);
-      if (tes) link_success &= vrend_link_stage(tes);
+      /* start all links before waiting on any of them */
+      if (has_feature(feat_parallel_shader_compile)) {
+         for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+            if (sprog->ss[type])
+               vrend_link_stage_start(sprog->ss[type]);
+         }
+      }
+      for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+         if (sprog->ss[type])
+            link_success &= vrend_link_stage(sub_ctx, sprog->ss[type]);
+      }
    } else { /* non-separable programs */
-      link_success = vrend_link(prog_id);
+      bool cache_hit = false;
+
+      if (vrend_state.use_program_cache) {
+         vrend_program_cache_key_for_program(&sprog->cache_key, sub_ctx, sprog->ss,
+                                             sprog->dual_src_linked);
+         cache_hit = vrend_program_cache_load(&sprog->cache_key, prog_id);
+         if (!cache_hit) {
+            glProgramParameteri(prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            sprog->store_in_cache = true;
+         }
+      }
+
+      if (cache_hit) {
+         link_success = true;
+      } else if (vrend_state.num_shader_threads) {
+         sprog->link_job = vrend_shader_job_submit(prog_id, sprog->ss);
+         link_success = sprog->link_job != NULL;
+      } else if (has_feature(feat_parallel_shader_compile)) {
+         glLinkProgram(prog_id);
+         sprog->link_pending = true;
+      } else {
+         link_success = vrend_link(prog_id);
+         if (link_success && sprog->store_in_cache)
+            vrend_program_cache_store(&sprog->cache_key, prog_id);
+      }
    }
 
    if (!link_success) {
@@ -2097,18 +3388,10 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
          glDeleteProgram(prog_id);
       }
 
-      free(sprog);
-
       /* dump shaders */
       vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
-      vrend_shader_dump(vs);
-      if (tcs)
-         vrend_shader_dump(tcs);
-      if (tes)
-         vrend_shader_dump(tes);
-      if (gs)
-         vrend_shader_dump(gs);
-      vrend_shader_dump(fs);
+      vrend_dump_program_shaders(sprog);
+      free(sprog);
       return NULL;
    }
 
@@ -2127,14 +3410,9 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
        }
    }
 
-   sprog->ss[PIPE_SHADER_VERTEX] = vs;
-   sprog->ss[PIPE_SHADER_FRAGMENT] = fs;
-   sprog->vs_fs_key = (((uint64_t)fs->id) << 32) | (vs->id & ~VREND_PROGRAM_NQUEUE_MASK) |
-                      (sprog->dual_src_linked ? 1 : 0);
-
-   sprog->ss[PIPE_SHADER_GEOMETRY] = gs;
-   sprog->ss[PIPE_SHADER_TESS_CTRL] = tcs;
-   sprog->ss[PIPE_SHADER_TESS_EVAL] = tes;
+   vrend_program_key_init(&sprog->key, NULL, sprog->dual_src_linked);
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++)
+      sprog->key.shader_ids[type] = sprog->ss[type] ? sprog->ss[type]->id : 0;
 
    list_add(&sprog->sl[PIPE_SHADER_VERTEX], &vs->programs);
    list_add(&sprog->sl[PIPE_SHADER_FRAGMENT], &fs->programs);
@@ -2145,49 +3423,25 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
    if (tes)
       list_add(&sprog->sl[PIPE_SHADER_TESS_EVAL], &tes->programs);
 
-   last_shader = tes ? PIPE_SHADER_TESS_EVAL : (gs ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
-
    sprog->is_pipeline = separable;
    if (sprog->is_pipeline)
        sprog->id.pipeline = pipeline_id;
    else
        sprog->id.program = prog_id;
 
-   list_addtail(&sprog->head, &sub_ctx->gl_programs[vs->id & VREND_PROGRAM_NQUEUE_MASK]);
-
-   sprog->virgl_block_bind = GL_INVALID_INDEX;
-   sprog->ubo_sysval_buffer_id = GL_INVALID_INDEX;
-   sprog->sysvalue_data_cookie = UINT32_MAX;
-
-   vrend_use_program(sprog);
-
-   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
-        shader_type <= last_shader;
-        shader_type++) {
-      if (!sprog->ss[shader_type])
-         continue;
-
-      bind_const_locs(sprog, shader_type);
-      bind_image_locs(sprog, shader_type);
-      bind_ssbo_locs(sprog, shader_type);
-
-      if (sprog->ss[shader_type]->sel->sinfo.reads_drawid)
-         sprog->reads_drawid = true;
+   /* the draws emulate the texture level queries of these stages */
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+      if (vrend_state.use_gles && sprog->ss[type] &&
+          sprog->ss[type]->sel->sinfo.gles_use_tex_query_level)
+         sprog->gles_use_query_texturelevel_mask |= 1 << type;
    }
-   rebind_ubo_and_sampler_locs(sprog, last_shader);
 
-   if (!has_feature(feat_gles31_vertex_attrib_binding)) {
-      if (vs->sel->sinfo.num_inputs) {
-         sprog->attrib_locs = calloc(vs->sel->sinfo.num_inputs, sizeof(uint32_t));
-         if (sprog->attrib_locs) {
-            for (int i = 0; i < vs->sel->sinfo.num_inputs; i++) {
-               snprintf(name, 32, "in_%d", i);
-               sprog->attrib_locs[i] = glGetAttribLocation(vs_id, name);
-            }
-         }
-      } else
-         sprog->attrib_locs = NULL;
-   }
+   list_add(&sprog->head, &sub_ctx->gl_programs);
+   vrend_program_insert(sub_ctx, sprog);
+
+   /* the locations are queried once the asynchronous link finished */
+   if (!sprog->link_job && !sprog->link_pending)
+      vrend_setup_linked_program(sprog);
 
    return sprog;
 }
@@ -2195,14 +3449,11 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
 static struct vrend_linked_shader_program *lookup_cs_shader_program(struct vrend_context *ctx,
                                                                     GLuint cs_id)
 {
-   list_for_each_entry(struct vrend_linked_shader_program, ent, &ctx->sub->cs_programs, head) {
-      if (ent->ss[PIPE_SHADER_COMPUTE]->id == cs_id) {
-         list_del(&ent->head);
-         list_add(&ent->head, &ctx->sub->cs_programs);
-         return ent;
-      }
-   }
-   return NULL;
+   struct vrend_program_key key;
+
+   vrend_program_key_init(&key, NULL, false);
+   key.shader_ids[PIPE_SHADER_COMPUTE] = cs_id;
+   return vrend_program_lookup(ctx->sub, &ctx->sub->cs_programs, &key);
 }
 
 static struct vrend_linked_shader_program *lookup_shader_program(struct vrend_sub_context *sub_ctx,
@@ -2213,31 +3464,111 @@ static struct vrend_linked_shader_program *lookup_shader_program(struct vrend_su
                                                                  GLuint tes_id,
                                                                  bool dual_src)
 {
-   uint64_t vs_fs_key = (((uint64_t)fs_id) << 32) | (vs_id & ~VREND_PROGRAM_NQUEUE_MASK) |
-                        (dual_src ? 1 : 0);
+   const GLuint shader_ids[PIPE_SHADER_TYPES] = {
+      [PIPE_SHADER_VERTEX] = vs_id,
+      [PIPE_SHADER_FRAGMENT] = fs_id,
+      [PIPE_SHADER_GEOMETRY] = gs_id,
+      [PIPE_SHADER_TESS_CTRL] = tcs_id,
+      [PIPE_SHADER_TESS_EVAL] = tes_id,
+   };
+   struct vrend_program_key key;
 
-   struct list_head *programs = &sub_ctx->gl_programs[vs_id & VREND_PROGRAM_NQUEUE_MASK];
-   list_for_each_entry(struct vrend_linked_shader_program, ent, programs, head) {
-      if (likely(ent->vs_fs_key != vs_fs_key))
-         continue;
-      if (ent->ss[PIPE_SHADER_GEOMETRY] &&
-          ent->ss[PIPE_SHADER_GEOMETRY]->id != gs_id)
-        continue;
-      if (ent->ss[PIPE_SHADER_TESS_CTRL] &&
-          ent->ss[PIPE_SHADER_TESS_CTRL]->id != tcs_id)
+   vrend_program_key_init(&key, shader_ids, dual_src);
+   return vrend_program_lookup(sub_ctx, &sub_ctx->gl_programs, &key);
+}
+
+/* At most this many programs are linked ahead for a new variant */
+#define VREND_MAX_PREDICTED_PROGRAMS 16
+
+/* Makes a compiled variant findable by the stage combinations of the
+ * predictor, the hash covers everything the program cache key covers. */
+static void vrend_register_combo_variant(struct vrend_sub_context *sub_ctx,
+                                         struct vrend_shader *shader)
+{
+   struct vrend_program_cache_key key;
+
+   if (!sub_ctx->parent->predictor || shader->combo_sub_ctx ||
+       shader->sel->type == PIPE_SHADER_COMPUTE)
+      return;
+
+   vrend_program_cache_key_init(&key);
+   vrend_program_cache_key_append_shader(&key, shader);
+   /* 0 is for the unused stages */
+   shader->combo_hash = key.hash[0] ? key.hash[0] : 1;
+
+   if (virgl_id_table_insert(&sub_ctx->combo_variants, shader->combo_hash, shader))
+      shader->combo_sub_ctx = sub_ctx;
+}
+
+static void vrend_record_program_combo(struct vrend_sub_context *sub_ctx,
+                                       const struct vrend_linked_shader_program *sprog)
+{
+   struct vrend_program_combo combo;
+
+   if (!sub_ctx->parent->predictor || sprog->is_pipeline)
+      return;
+
+   memset(&combo, 0, sizeof(combo));
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+      if (!sprog->ss[type])
          continue;
-      if (ent->ss[PIPE_SHADER_TESS_EVAL] &&
-          ent->ss[PIPE_SHADER_TESS_EVAL]->id != tes_id)
+      /* not registered when the table could not grow */
+      if (!sprog->ss[type]->combo_sub_ctx)
+         return;
+      combo.stages[type] = sprog->ss[type]->combo_hash;
+   }
+   combo.dual_src = sprog->dual_src_linked;
+
+   vrend_program_predictor_record(sub_ctx->parent->predictor, &combo);
+}
+
+/* Hands the programs that the application linked with the variant before
+ * to the shader threads, once the other stages of a program are compiled
+ * as well, so that the first draw with them finds them linked. */
+static void vrend_link_predicted_programs(struct vrend_sub_context *sub_ctx,
+                                          struct vrend_shader *shader)
+{
+   struct vrend_program_combo combos[VREND_MAX_PREDICTED_PROGRAMS];
+
+   if (!shader->combo_sub_ctx)
+      return;
+
+   uint32_t count = vrend_program_predictor_find(sub_ctx->parent->predictor,
+                                                 shader->sel->type, shader->combo_hash,
+                                                 combos, ARRAY_SIZE(combos));
+
+   for (uint32_t i = 0; i < count; i++) {
+      struct vrend_shader *ss[PIPE_SHADER_TYPES] = { NULL };
+      bool complete = true;
+
+      if (combos[i].dual_src && !has_feature(feat_dual_src_blend))
          continue;
-      /* put the entry in front */
-      if (programs->next != &ent->head) {
-         list_del(&ent->head);
-         list_add(&ent->head, programs);
+
+      for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+         if (!combos[i].stages[type])
+            continue;
+         ss[type] = virgl_id_table_search(&sub_ctx->combo_variants, combos[i].stages[type]);
+         if (!ss[type] || ss[type]->sel->type != type ||
+             ss[type]->sel->sinfo.separable_program) {
+            complete = false;
+            break;
+         }
       }
-      return ent;
-   }
+      if (!complete || !ss[PIPE_SHADER_VERTEX] || !ss[PIPE_SHADER_FRAGMENT])
+         continue;
 
-   return NULL;
+      struct vrend_program_key key;
+      vrend_program_key_init(&key, NULL, combos[i].dual_src);
+      for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++)
+         key.shader_ids[type] = ss[type] ? ss[type]->id : 0;
+      if (_mesa_hash_table_search(sub_ctx->program_table, &key))
+         continue;
+
+      VREND_DEBUG(dbg_shader, sub_ctx->parent, "Linking predicted program\n");
+      add_shader_program(sub_ctx, ss[PIPE_SHADER_VERTEX], ss[PIPE_SHADER_FRAGMENT],
+                         ss[PIPE_SHADER_GEOMETRY], ss[PIPE_SHADER_TESS_CTRL],
+                         ss[PIPE_SHADER_TESS_EVAL], combos[i].dual_src, false);
+   }
 }
 
 static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
@@ -2246,16 +3577,29 @@ static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
    if (ent->ref_context && ent->ref_context->prog == ent)
       ent->ref_context->prog = NULL;
 
+   /* the shader thread must be done with the program before it is deleted */
+   if (ent->link_job)
+      vrend_shader_job_destroy(ent->link_job);
+
    if (ent->ubo_sysval_buffer_id != GL_INVALID_INDEX) {
+       vrend_gl_state_forget_buffer(ent->ubo_sysval_buffer_id);
        glDeleteBuffers(1, &ent->ubo_sysval_buffer_id);
    }
 
-   if (ent->is_pipeline)
+   if (ent->is_pipeline) {
+       vrend_gl_state_forget_program(ent->id.pipeline);
        glDeleteProgramPipelines(1, &ent->id.pipeline);
-   else
+   } else {
+       vrend_gl_state_forget_program(ent->id.program);
        glDeleteProgram(ent->id.program);
+   }
 
    list_del(&ent->head);
+   if (ent->owner) {
+      struct hash_entry *entry = _mesa_hash_table_search(ent->owner->program_table, &ent->key);
+      if (entry && entry->data == ent)
+         _mesa_hash_table_remove(ent->owner->program_table, entry);
+   }
 
    for (i = PIPE_SHADER_VERTEX; i <= PIPE_SHADER_COMPUTE; i++) {
       if (ent->ss[i]) {
@@ -2280,32 +3624,68 @@ static void vrend_free_programs(struct vrend_sub_context *sub)
          vrend_destroy_program(ent);
    }
 
-   for (unsigned i = 0; i < VREND_PROGRAM_NQUEUES; ++i) {
-      if (!list_is_empty(&sub->gl_programs[i])) {
-         list_for_each_entry_safe(struct vrend_linked_shader_program, ent, &sub->gl_programs[i], head)
-            vrend_destroy_program(ent);
-      }
+   if (!list_is_empty(&sub->gl_programs)) {
+      list_for_each_entry_safe(struct vrend_linked_shader_program, ent, &sub->gl_programs, head)
+         vrend_destroy_program(ent);
    }
+
+   VREND_DEBUG(dbg_shader, sub->parent, "sub context %d program lookups: %" PRIu64 " hits, %" PRIu64 " misses\n",
+               sub->sub_ctx_id, sub->program_lookup_hits, sub->program_lookup_misses);
+}
+
+static uint32_t vrend_streamout_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct vrend_streamout_key), 0);
+}
+
+static bool vrend_streamout_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vrend_streamout_key));
 }
 
-static void vrend_destroy_streamout_object(struct vrend_streamout_object *obj)
+static void vrend_destroy_streamout_object(struct vrend_sub_context *sub_ctx,
+                                           struct vrend_streamout_object *obj)
 {
    unsigned i;
+   if (sub_ctx->streamout_table)
+      _mesa_hash_table_remove_key(sub_ctx->streamout_table, &obj->key);
    list_del(&obj->head);
-   for (i = 0; i < obj->num_targets; i++)
+   for (i = 0; i < obj->key.num_targets; i++)
       vrend_so_target_reference(&obj->so_targets[i], NULL);
    if (has_feature(feat_transform_feedback2))
       glDeleteTransformFeedbacks(1, &obj->id);
    FREE(obj);
 }
 
+static void vrend_make_current(virgl_gl_context gl_context)
+{
+   if (vrend_state.use_upload_ring)
+      vrend_upload_ring_flush();
+   vrend_clicbs->make_current(gl_context);
+   vrend_state.current_gl_context = gl_context;
+   /* the shadowed state belonged to the previously current context */
+   vrend_gl_state_invalidate();
+}
+
 void vrend_sync_make_current(virgl_gl_context gl_cxt) {
    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-   vrend_clicbs->make_current(gl_cxt);
+   vrend_make_current(gl_cxt);
    glWaitSync(sync, 0, GL_TIMEOUT_IGNORED);
    glDeleteSync(sync);
 }
 
+static inline void vrend_resource_invalidate_cursor(struct vrend_resource *res)
+{
+   free(res->cursor_data);
+   res->cursor_data = NULL;
+}
+
+static inline void vrend_resource_mark_gpu_written(struct vrend_resource *res)
+{
+   res->gpu_written = true;
+   vrend_resource_invalidate_cursor(res);
+}
+
 int vrend_create_surface(struct vrend_context *ctx,
                          uint32_t handle, struct vrend_resource *res,
                          enum virgl_formats format, uint32_t level,
@@ -2383,6 +3763,7 @@ int vrend_create_surface(struct vrend_context *ctx,
    pipe_reference_init(&surf->reference, 1);
 
    vrend_resource_reference(&surf->texture, res);
+   vrend_resource_mark_gpu_written(res);
 
    ret_handle = vrend_renderer_object_insert(ctx, surf, handle, VIRGL_OBJECT_SURFACE);
    if (ret_handle == 0) {
@@ -2436,7 +3817,7 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
    unsigned i;
 
    list_for_each_entry_safe(struct vrend_streamout_object, obj, &sub_ctx->streamout_list, head) {
-      for (i = 0; i < obj->num_targets; i++) {
+      for (i = 0; i < obj->key.num_targets; i++) {
          if (obj->so_targets[i] == target) {
             if (obj == sub_ctx->current_so)
                sub_ctx->current_so = NULL;
@@ -2447,7 +3828,7 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
                if (sub_ctx->current_so && has_feature(feat_transform_feedback2))
                   glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, sub_ctx->current_so->id);
             }
-            vrend_destroy_streamout_object(obj);
+            vrend_destroy_streamout_object(sub_ctx, obj);
             break;
          }
       }
@@ -2456,6 +3837,66 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
    vrend_so_target_reference(&target, NULL);
 }
 
+static uint32_t vrend_vao_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct vrend_vao_key), 0);
+}
+
+static bool vrend_vao_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vrend_vao_key));
+}
+
+static void vrend_vao_destroy(struct vrend_sub_context *sub_ctx, struct vrend_vao *vao)
+{
+   if (sub_ctx->vao_table)
+      _mesa_hash_table_remove_key(sub_ctx->vao_table, &vao->key);
+   list_del(&vao->head);
+   sub_ctx->num_vaos--;
+   if (sub_ctx->current_vao == vao)
+      sub_ctx->current_vao = NULL;
+
+   vrend_gl_state_forget_vertex_array(vao->id);
+   glDeleteVertexArrays(1, &vao->id);
+   FREE(vao);
+}
+
+static bool vrend_vao_uses_resource(const struct vrend_vao *vao,
+                                    const struct vrend_resource *res)
+{
+   for (uint32_t i = 0; i < vao->key.num_attribs; i++) {
+      if (vao->key.attribs[i].res == res)
+         return true;
+   }
+   return false;
+}
+
+/* Destroys the vertex arrays of all the sub contexts that read from a buffer
+ * being detached, they are the only ones that still point at it once the
+ * vertex buffer bindings are gone. */
+static void vrend_vao_forget_resource(struct vrend_context *ctx,
+                                      const struct vrend_resource *res)
+{
+   virgl_gl_context gl_context = vrend_state.current_gl_context;
+
+   list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
+      list_for_each_entry_safe(struct vrend_vao, vao, &sub->vaos, head) {
+         if (!vrend_vao_uses_resource(vao, res))
+            continue;
+
+         if (vrend_state.current_gl_context != sub->gl_context)
+            vrend_make_current(sub->gl_context);
+         /* the fallback vertex array needs its bindings set up again */
+         if (sub->current_vao == vao)
+            sub->vbo_dirty = true;
+         vrend_vao_destroy(sub, vao);
+      }
+   }
+
+   if (vrend_state.current_gl_context != gl_context)
+      vrend_make_current(gl_context);
+}
+
 static void vrend_destroy_vertex_elements_object(void *obj_ptr)
 {
    struct vrend_vertex_element_array *v = obj_ptr;
@@ -2463,18 +3904,44 @@ static void vrend_destroy_vertex_elements_object(void *obj_ptr)
    if (v == v->owning_sub->ve)
       v->owning_sub->ve = NULL;
 
+   list_for_each_entry_safe(struct vrend_vao, vao, &v->owning_sub->vaos, head) {
+      if (vao->key.ve == v)
+         vrend_vao_destroy(v->owning_sub, vao);
+   }
+
    if (has_feature(feat_gles31_vertex_attrib_binding)) {
+      vrend_gl_state_forget_vertex_array(v->id);
       glDeleteVertexArrays(1, &v->id);
    }
    FREE(v);
 }
 
+static uint32_t vrend_sampler_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct pipe_sampler_state), 0);
+}
+
+static bool vrend_sampler_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct pipe_sampler_state));
+}
+
+static void vrend_sampler_object_unref(struct vrend_sampler_object *object)
+{
+   if (--object->refcount)
+      return;
+
+   _mesa_hash_table_remove_key(vrend_state.sampler_table, &object->key);
+   glDeleteSamplers(2, object->ids);
+   FREE(object);
+}
+
 static void vrend_destroy_sampler_state_object(void *obj_ptr)
 {
    struct vrend_sampler_state *state = obj_ptr;
 
-   if (has_feature(feat_samplers))
-      glDeleteSamplers(2, state->ids);
+   if (state->object)
+      vrend_sampler_object_unref(state->object);
 
    if (state->sub_ctx) {
       struct vrend_sub_context *sub_ctx = state->sub_ctx;
@@ -2585,6 +4052,69 @@ static void apply_sampler_border_color(GLuint sampler,
    }
 }
 
+static struct vrend_sampler_object *
+vrend_sampler_object_get(struct vrend_context *ctx,
+                         const struct pipe_sampler_state *templ)
+{
+   struct vrend_sampler_object *object;
+   struct pipe_sampler_state key = *templ;
+   struct hash_entry *entry;
+
+   /* the decoder doesn't fill the padding */
+   key.pad = 0;
+
+   if (!vrend_state.sampler_table) {
+      vrend_state.sampler_table = _mesa_hash_table_create(NULL, vrend_sampler_key_hash,
+                                                          vrend_sampler_key_equal);
+      if (!vrend_state.sampler_table)
+         return NULL;
+   }
+
+   entry = _mesa_hash_table_search(vrend_state.sampler_table, &key);
+   if (entry) {
+      object = entry->data;
+      object->refcount++;
+      return object;
+   }
+
+   object = CALLOC_STRUCT(vrend_sampler_object);
+   if (!object)
+      return NULL;
+
+   object->key = key;
+   object->refcount = 1;
+   glGenSamplers(2, object->ids);
+
+   for (int i = 0; i < 2; ++i) {
+      glSamplerParameteri(object->ids[i], GL_TEXTURE_WRAP_S, convert_wrap(ctx, templ->wrap_s));
+      glSamplerParameteri(object->ids[i], GL_TEXTURE_WRAP_T, convert_wrap(ctx, templ->wrap_t));
+      glSamplerParameteri(object->ids[i], GL_TEXTURE_WRAP_R, convert_wrap(ctx, templ->wrap_r));
+      glSamplerParameterf(object->ids[i], GL_TEXTURE_MIN_FILTER, convert_min_filter(templ->min_img_filter, templ->min_mip_filter));
+      glSamplerParameterf(object->ids[i], GL_TEXTURE_MAG_FILTER, convert_mag_filter(templ->mag_img_filter));
+      glSamplerParameterf(object->ids[i], GL_TEXTURE_MIN_LOD, templ->min_lod);
+      glSamplerParameterf(object->ids[i], GL_TEXTURE_MAX_LOD, templ->max_lod);
+      glSamplerParameteri(object->ids[i], GL_TEXTURE_COMPARE_MODE, templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE);
+      glSamplerParameteri(object->ids[i], GL_TEXTURE_COMPARE_FUNC, GL_NEVER + templ->compare_func);
+      if (!vrend_state.use_gles)
+         glSamplerParameterf(object->ids[i], GL_TEXTURE_LOD_BIAS, templ->lod_bias);
+
+      if (!vrend_state.use_gles && has_feature(feat_seamless_cubemap_per_texture))
+         glSamplerParameteri(object->ids[i], GL_TEXTURE_CUBE_MAP_SEAMLESS, templ->seamless_cube_map);
+
+      apply_sampler_border_color(object->ids[i], templ->border_color.ui);
+      if (has_feature(feat_texture_srgb_decode))
+         glSamplerParameteri(object->ids[i], GL_TEXTURE_SRGB_DECODE_EXT,
+                             i == 0 ? GL_SKIP_DECODE_EXT : GL_DECODE_EXT);
+   }
+
+   if (!_mesa_hash_table_insert(vrend_state.sampler_table, &object->key, object)) {
+      glDeleteSamplers(2, object->ids);
+      FREE(object);
+      return NULL;
+   }
+   return object;
+}
+
 int vrend_create_sampler_state(struct vrend_context *ctx,
                                uint32_t handle,
                                struct pipe_sampler_state *templ)
@@ -2597,46 +4127,25 @@ int vrend_create_sampler_state(struct vrend_context *ctx,
 
    state->base = *templ;
 
-   if (has_feature(feat_samplers)) {
-      glGenSamplers(2, state->ids);
-
-      for (int i = 0; i < 2; ++i) {
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_S, convert_wrap(ctx, templ->wrap_s));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_T, convert_wrap(ctx, templ->wrap_t));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_R, convert_wrap(ctx, templ->wrap_r));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_FILTER, convert_min_filter(templ->min_img_filter, templ->min_mip_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAG_FILTER, convert_mag_filter(templ->mag_img_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_LOD, templ->min_lod);
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAX_LOD, templ->max_lod);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_MODE, templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_FUNC, GL_NEVER + templ->compare_func);
-         if (vrend_state.use_gles) {
-            if (templ->lod_bias)
-               report_gles_warn(ctx, GLES_WARN_LOD_BIAS);
-         } else
-            glSamplerParameterf(state->ids[i], GL_TEXTURE_LOD_BIAS, templ->lod_bias);
-
-         if (vrend_state.use_gles) {
-            if (templ->seamless_cube_map != 0) {
-               report_gles_warn(ctx, GLES_WARN_SEAMLESS_CUBE_MAP);
-            }
-         } else {
-            if (has_feature(feat_seamless_cubemap_per_texture)) {
-               glSamplerParameteri(state->ids[i], GL_TEXTURE_CUBE_MAP_SEAMLESS, templ->seamless_cube_map);
-            }
-         }
+   if (vrend_state.use_gles) {
+      if (templ->lod_bias)
+         report_gles_warn(ctx, GLES_WARN_LOD_BIAS);
+      if (templ->seamless_cube_map != 0)
+         report_gles_warn(ctx, GLES_WARN_SEAMLESS_CUBE_MAP);
+   }
 
-         apply_sampler_border_color(state->ids[i], templ->border_color.ui);
-         if (has_feature(feat_texture_srgb_decode))
-            glSamplerParameteri(state->ids[i], GL_TEXTURE_SRGB_DECODE_EXT,
-                                i == 0 ? GL_SKIP_DECODE_EXT : GL_DECODE_EXT);
+   if (has_feature(feat_samplers)) {
+      state->object = vrend_sampler_object_get(ctx, templ);
+      if (!state->object) {
+         FREE(state);
+         return ENOMEM;
       }
    }
    ret_handle = vrend_renderer_object_insert(ctx, state, handle,
                                              VIRGL_OBJECT_SAMPLER_STATE);
    if (!ret_handle) {
-      if (has_feature(feat_samplers))
-         glDeleteSamplers(2, state->ids);
+      if (state->object)
+         vrend_sampler_object_unref(state->object);
       FREE(state);
       return ENOMEM;
    }
@@ -2850,7 +4359,7 @@ int vrend_create_sampler_view(struct vrend_context *ctx,
                       view->u.tex.first_level, view->levels,
                       view->u.tex.first_layer, num_layers);
 
-        glBindTexture(view->target, view->gl_id);
+        vrend_gl_bind_texture(view->target, view->gl_id);
 
         if (util_format_is_depth_or_stencil(view->format)) {
            if (vrend_state.use_core_profile == false) {
@@ -2878,14 +4387,14 @@ int vrend_create_sampler_view(struct vrend_context *ctx,
            glTexParameteri(view->target, GL_TEXTURE_SRGB_DECODE_EXT,
                             view->srgb_decode);
         }
-        glBindTexture(view->target, 0);
+        vrend_gl_bind_texture(view->target, 0);
       } else if (needs_view && view->u.buf.first_element < ARRAY_SIZE(res->aux_plane_egl_image) &&
             res->aux_plane_egl_image[view->u.buf.first_element]) {
         void *image = res->aux_plane_egl_image[view->u.buf.first_element];
         glGenTextures(1, &view->gl_id);
-        glBindTexture(view->target, view->gl_id);
+        vrend_gl_bind_texture(view->target, view->gl_id);
         glEGLImageTargetTexture2DOES(view->target, (GLeglImageOES) image);
-        glBindTexture(view->target, 0);
+        vrend_gl_bind_texture(view->target, 0);
       }
    }
 
@@ -3043,59 +4552,30 @@ void vrend_fb_bind_texture(struct vrend_resource *res,
    vrend_fb_bind_texture_id(res, res->gl_id, idx, level, layer, 0);
 }
 
-static void vrend_hw_set_zsurf_texture(struct vrend_context *ctx)
+/* the framebuffer objects start out without attachments, so only the
+ * surfaces that are set are attached */
+static void vrend_hw_set_zsurf_texture(struct vrend_surface *surf)
 {
-   struct vrend_surface *surf = ctx->sub->zsurf;
-
-   if (!surf) {
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                             GL_TEXTURE_2D, 0, 0);
-   } else {
-      if (!surf->texture)
-         return;
+   if (!surf->texture)
+      return;
 
-      vrend_fb_bind_texture_id(surf->texture, surf->gl_id, 0, surf->level,
-                               surf->first_layer != surf->last_layer ? -1 :
-                               (GLint)surf->first_layer, surf->nr_samples);
-   }
+   vrend_fb_bind_texture_id(surf->texture, surf->gl_id, 0, surf->level,
+                            surf->first_layer != surf->last_layer ? -1 :
+                            (GLint)surf->first_layer, surf->nr_samples);
 }
 
-static void vrend_hw_set_color_surface(struct vrend_sub_context *sub_ctx, GLuint index)
+static void vrend_hw_set_color_surface(struct vrend_surface *surf, GLuint index)
 {
-   struct vrend_surface *surf = sub_ctx->surf[index];
-
-   if (!surf) {
-      GLenum attachment = GL_COLOR_ATTACHMENT0 + index;
-
-      glFramebufferTexture2D(GL_FRAMEBUFFER, attachment,
-                             GL_TEXTURE_2D, 0, 0);
-   } else {
-      uint32_t first_layer = sub_ctx->surf[index]->first_layer;
-      uint32_t last_layer = sub_ctx->surf[index]->last_layer;
-
-      vrend_fb_bind_texture_id(surf->texture, surf->gl_id, index, surf->level,
-                               first_layer != last_layer ? -1 : (GLint)first_layer,
-                               surf->nr_samples);
-   }
+   vrend_fb_bind_texture_id(surf->texture, surf->gl_id, index, surf->level,
+                            surf->first_layer != surf->last_layer ? -1 :
+                            (GLint)surf->first_layer, surf->nr_samples);
 }
 
 static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
 {
-   static const GLenum buffers[8] = {
-      GL_COLOR_ATTACHMENT0,
-      GL_COLOR_ATTACHMENT1,
-      GL_COLOR_ATTACHMENT2,
-      GL_COLOR_ATTACHMENT3,
-      GL_COLOR_ATTACHMENT4,
-      GL_COLOR_ATTACHMENT5,
-      GL_COLOR_ATTACHMENT6,
-      GL_COLOR_ATTACHMENT7,
-   };
-
    if (sub_ctx->nr_cbufs == 0) {
-      glReadBuffer(GL_NONE);
       if (has_feature(feat_srgb_write_control)) {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_gl_enable(GL_FRAMEBUFFER_SRGB_EXT, false);
          sub_ctx->framebuffer_srgb_enabled = false;
       }
    } else if (has_feature(feat_srgb_write_control)) {
@@ -3111,9 +4591,9 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
          }
       }
       if (use_srgb) {
-         glEnable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_gl_enable(GL_FRAMEBUFFER_SRGB_EXT, true);
       } else {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_gl_enable(GL_FRAMEBUFFER_SRGB_EXT, false);
       }
       sub_ctx->framebuffer_srgb_enabled = use_srgb;
    }
@@ -3146,63 +4626,181 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
          sub_ctx->needs_manual_srgb_encode_bitmask |= 1 << i;
       }
    }
+}
+
+static uint32_t vrend_fbo_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct vrend_fbo_key), 0);
+}
+
+static bool vrend_fbo_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vrend_fbo_key));
+}
+
+static void vrend_fbo_destroy(struct vrend_sub_context *sub_ctx, struct vrend_fbo *fbo)
+{
+   if (sub_ctx->fbo_table)
+      _mesa_hash_table_remove_key(sub_ctx->fbo_table, &fbo->key);
+   list_del(&fbo->head);
+   sub_ctx->num_fbos--;
+   if (sub_ctx->current_fbo == fbo) {
+      sub_ctx->current_fbo = NULL;
+      sub_ctx->fb_id = 0;
+   }
+
+   glDeleteFramebuffers(1, &fbo->id);
+
+   for (uint32_t i = 0; i < fbo->key.nr_cbufs; i++)
+      vrend_surface_reference(&fbo->key.surf[i], NULL);
+   vrend_surface_reference(&fbo->key.zsurf, NULL);
+   FREE(fbo);
+}
+
+static struct vrend_fbo *vrend_fbo_create(struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_fbo_key *key)
+{
+   static const GLenum buffers[8] = {
+      GL_COLOR_ATTACHMENT0,
+      GL_COLOR_ATTACHMENT1,
+      GL_COLOR_ATTACHMENT2,
+      GL_COLOR_ATTACHMENT3,
+      GL_COLOR_ATTACHMENT4,
+      GL_COLOR_ATTACHMENT5,
+      GL_COLOR_ATTACHMENT6,
+      GL_COLOR_ATTACHMENT7,
+   };
+   struct vrend_fbo *fbo;
+   GLenum status;
+
+   if (sub_ctx->num_fbos >= VREND_FBO_CACHE_SIZE)
+      vrend_fbo_destroy(sub_ctx, list_last_entry(&sub_ctx->fbos, struct vrend_fbo, head));
+
+   fbo = CALLOC_STRUCT(vrend_fbo);
+   if (!fbo)
+      return NULL;
+
+   fbo->key.nr_cbufs = key->nr_cbufs;
+   glGenFramebuffers(1, &fbo->id);
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo->id);
+
+   if (key->zsurf) {
+      vrend_surface_reference(&fbo->key.zsurf, key->zsurf);
+      vrend_hw_set_zsurf_texture(key->zsurf);
+   }
+   for (uint32_t i = 0; i < key->nr_cbufs; i++) {
+      if (!key->surf[i])
+         continue;
+      vrend_surface_reference(&fbo->key.surf[i], key->surf[i]);
+      vrend_hw_set_color_surface(key->surf[i], i);
+   }
+
+   if (key->nr_cbufs == 0)
+      glReadBuffer(GL_NONE);
+   glDrawBuffers(key->nr_cbufs, buffers);
+
+   /* the attachments never change, so completeness is only checked once */
+   if (key->nr_cbufs > 0 || key->zsurf) {
+      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      if (status != GL_FRAMEBUFFER_COMPLETE)
+         virgl_error("Failed to complete framebuffer 0x%x %s\n", status,
+                     sub_ctx->parent->debug_name);
+   }
+
+   _mesa_hash_table_insert(sub_ctx->fbo_table, &fbo->key, fbo);
+   list_add(&fbo->head, &sub_ctx->fbos);
+   sub_ctx->num_fbos++;
+   return fbo;
+}
+
+static struct vrend_fbo *vrend_fbo_lookup(struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_fbo_key *key)
+{
+   struct hash_entry *entry = _mesa_hash_table_search(sub_ctx->fbo_table, key);
+   if (!entry)
+      return vrend_fbo_create(sub_ctx, key);
+
+   struct vrend_fbo *fbo = entry->data;
+   /* put the entry in front */
+   if (sub_ctx->fbos.next != &fbo->head) {
+      list_del(&fbo->head);
+      list_add(&fbo->head, &sub_ctx->fbos);
+   }
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo->id);
+   return fbo;
+}
 
-   glDrawBuffers(sub_ctx->nr_cbufs, buffers);
+/* The framebuffers a destroyed surface is attached to can not be used again,
+ * the current one goes away when it is replaced. */
+static void vrend_fbo_forget_surface(struct vrend_sub_context *sub_ctx,
+                                     const struct vrend_surface *surf)
+{
+   list_for_each_entry_safe(struct vrend_fbo, fbo, &sub_ctx->fbos, head) {
+      if (fbo == sub_ctx->current_fbo)
+         continue;
+      if (fbo->key.zsurf == surf) {
+         vrend_fbo_destroy(sub_ctx, fbo);
+         continue;
+      }
+      for (uint32_t i = 0; i < fbo->key.nr_cbufs; i++) {
+         if (fbo->key.surf[i] == surf) {
+            vrend_fbo_destroy(sub_ctx, fbo);
+            break;
+         }
+      }
+   }
 }
 
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
                                  uint32_t nr_cbufs, uint32_t surf_handle[PIPE_MAX_COLOR_BUFS],
                                  uint32_t zsurf_handle)
 {
-   struct vrend_surface *surf, *zsurf;
+   struct vrend_surface *surf;
+   struct vrend_fbo_key key;
+   struct vrend_fbo *fbo;
    uint32_t old_num;
-   GLenum status;
    GLint new_height = -1;
    bool new_fbo_origin_upper_left = false;
 
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
-   glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
-
+   memset(&key, 0, sizeof(key));
    if (zsurf_handle) {
-      zsurf = vrend_object_lookup(sub_ctx->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
-      if (!zsurf) {
+      key.zsurf = vrend_object_lookup(sub_ctx->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
+      if (!key.zsurf) {
          vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, zsurf_handle);
          return;
       }
-   } else
-      zsurf = NULL;
-
-   if (sub_ctx->zsurf != zsurf) {
-      vrend_surface_reference(&sub_ctx->zsurf, zsurf);
-      vrend_hw_set_zsurf_texture(ctx);
    }
 
-   old_num = sub_ctx->nr_cbufs;
-   sub_ctx->nr_cbufs = nr_cbufs;
-
+   key.nr_cbufs = nr_cbufs;
    for (uint32_t i = 0; i < nr_cbufs; i++) {
       if (surf_handle[i] != 0) {
-         surf = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
-         if (!surf) {
+         key.surf[i] = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
+         if (!key.surf[i]) {
             vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, surf_handle[i]);
             return;
          }
-      } else
-         surf = NULL;
-
-      if (sub_ctx->surf[i] != surf) {
-         vrend_surface_reference(&sub_ctx->surf[i], surf);
-         vrend_hw_set_color_surface(sub_ctx, i);
       }
    }
 
-   if (old_num > sub_ctx->nr_cbufs) {
-      for (uint32_t i = sub_ctx->nr_cbufs; i < old_num; i++) {
-         vrend_surface_reference(&sub_ctx->surf[i], NULL);
-         vrend_hw_set_color_surface(sub_ctx, i);
-      }
+   fbo = vrend_fbo_lookup(sub_ctx, &key);
+   if (!fbo) {
+      virgl_error("Failed to allocate a framebuffer %s\n", ctx->debug_name);
+      glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
+      return;
    }
+   sub_ctx->current_fbo = fbo;
+   sub_ctx->fb_id = fbo->id;
+
+   vrend_surface_reference(&sub_ctx->zsurf, key.zsurf);
+
+   old_num = sub_ctx->nr_cbufs;
+   sub_ctx->nr_cbufs = nr_cbufs;
+   for (uint32_t i = 0; i < nr_cbufs; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], key.surf[i]);
+   for (uint32_t i = nr_cbufs; i < old_num; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], NULL);
 
    /* find a buffer to set fb_height from */
    if (sub_ctx->nr_cbufs == 0 && !sub_ctx->zsurf) {
@@ -3239,12 +4837,6 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
 
    vrend_hw_emit_framebuffer_state(sub_ctx);
 
-   if (sub_ctx->nr_cbufs > 0 || sub_ctx->zsurf) {
-      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE)
-         virgl_error("Failed to complete framebuffer 0x%x %s\n", status, ctx->debug_name);
-   }
-
    sub_ctx->shader_dirty = true;
    sub_ctx->blend_state_dirty = true;
 }
@@ -3457,7 +5049,7 @@ void vrend_bind_vertex_elements_state(struct vrend_context *ctx,
 
    if (has_feature(feat_gles31_vertex_attrib_binding) && v->id == 0) {
       glGenVertexArrays(1, &v->id);
-      glBindVertexArray(v->id);
+      vrend_gl_bind_vertex_array(v->id);
       for (uint32_t i = 0; i < v->count; i++) {
          struct vrend_vertex_element *ve = &v->elements[i];
          GLint size = !vrend_state.use_gles && (v->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
@@ -3483,26 +5075,48 @@ void vrend_set_constants(struct vrend_context *ctx,
                          const float *data)
 {
    struct vrend_constants *consts;
+   const uint32_t *values = (const uint32_t *)data;
+   uint32_t start = 0, end = num_constant;
 
    consts = &ctx->sub->consts[shader];
-   ctx->sub->const_dirty[shader] = true;
 
-   /* avoid reallocations by only growing the buffer */
-   if (consts->num_allocated_consts < num_constant) {
-      free(consts->consts);
-      consts->consts = malloc(num_constant * sizeof(float));
-      if (!consts->consts) {
-         consts->num_allocated_consts = 0;
+   /* guests often send all of the constants again after changing a few of
+    * them, only the range that differs has to be copied and uploaded */
+   if (consts->consts && consts->num_consts == num_constant) {
+      while (start < end && consts->consts[start] == values[start])
+         start++;
+      while (end > start && consts->consts[end - 1] == values[end - 1])
+         end--;
+      if (start == end)
          return;
-      }
+   } else {
+      /* avoid reallocations by only growing the buffer */
+      if (consts->num_allocated_consts < num_constant) {
+         free(consts->consts);
+         consts->consts = malloc(num_constant * sizeof(float));
+         if (!consts->consts) {
+            consts->num_allocated_consts = 0;
+            consts->num_consts = 0;
+            ctx->sub->const_dirty[shader] = true;
+            return;
+         }
 
-      consts->num_allocated_consts = num_constant;
+         consts->num_allocated_consts = num_constant;
+      }
+      consts->num_consts = num_constant;
    }
 
-   if (num_constant > 0)
-      memcpy(consts->consts, data, num_constant * sizeof(unsigned int));
+   if (end > start)
+      memcpy(consts->consts + start, values + start, (end - start) * sizeof(unsigned int));
 
-   consts->num_consts = num_constant;
+   if (ctx->sub->const_dirty[shader]) {
+      consts->dirty_start = MIN2(consts->dirty_start, start);
+      consts->dirty_end = MAX2(consts->dirty_end, end);
+   } else {
+      consts->dirty_start = start;
+      consts->dirty_end = end;
+   }
+   ctx->sub->const_dirty[shader] = true;
 }
 
 void vrend_set_uniform_buffer(struct vrend_context *ctx,
@@ -3543,12 +5157,21 @@ void vrend_set_index_buffer(struct vrend_context *ctx,
                             uint32_t index_size,
                             uint32_t offset)
 {
-   struct vrend_resource *res;
+   struct vrend_resource *res = res_handle ? vrend_renderer_ctx_res_lookup(ctx, res_handle) : NULL;
+   struct vrend_draw_batch *batch = &ctx->sub->draw_batch;
+
+   /* batched draws only record their offset into the index buffer, and an
+    * invalid handle puts the context in error */
+   if (batch->num_draws &&
+       ((res_handle && !res) ||
+        (batch->draws[0].info.indexed &&
+         (index_size != ctx->sub->ib.index_size ||
+          res != (struct vrend_resource *)ctx->sub->ib.buffer))))
+      vrend_flush_draws(ctx);
 
    ctx->sub->ib.index_size = index_size;
    ctx->sub->ib.offset = offset;
    if (res_handle) {
-      res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
       if ((struct vrend_resource *)ctx->sub->ib.buffer != res) {
          if (!res || !res->gl_id) {
             vrend_resource_reference((struct vrend_resource **)&ctx->sub->ib.buffer, NULL);
@@ -3693,7 +5316,7 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
 
       if (!has_bit(view->texture->storage_bits, VREND_STORAGE_GL_BUFFER)) {
          if (view->texture->gl_id == view->gl_id) {
-            glBindTexture(view->target, view->gl_id);
+            vrend_gl_bind_texture(view->target, view->gl_id);
 
             if (util_format_is_depth_or_stencil(view->format)) {
                if (vrend_state.use_core_profile == false) {
@@ -3746,7 +5369,7 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
          if (!view->texture->tbo_tex_id)
             glGenTextures(1, &view->texture->tbo_tex_id);
 
-         glBindTexture(GL_TEXTURE_BUFFER, view->texture->tbo_tex_id);
+         vrend_gl_bind_texture(GL_TEXTURE_BUFFER, view->texture->tbo_tex_id);
          internalformat = tex_conv_table[view->format].internalformat;
          ctx->sub->shader_dirty = true;
 
@@ -3829,10 +5452,13 @@ int vrend_set_single_image_view(struct vrend_context *ctx,
 
 
       vrend_resource_reference(&iview->texture, res);
+      if (access & PIPE_IMAGE_ACCESS_WRITE)
+         vrend_resource_mark_gpu_written(res);
       iview->vformat = format;
       iview->format = tex_conv_table[format].internalformat;
       iview->access = access;
       ctx->sub->images_used_mask[shader_type] |= (1u << index);
+      ctx->sub->images_dirty_mask[shader_type] |= (1u << index);
    } else {
       vrend_resource_reference(&iview->texture, NULL);
       iview->format = 0;
@@ -3870,6 +5496,7 @@ void vrend_set_single_ssbo(struct vrend_context *ctx,
       ssbo->buffer_offset = offset;
       ssbo->buffer_size = length;
       ctx->sub->ssbo_used_mask[shader_type] |= (1u << index);
+      ctx->sub->ssbo_dirty_mask[shader_type] |= (1u << index);
    } else {
       vrend_resource_reference(&ssbo->res, NULL);
       ssbo->buffer_offset = 0;
@@ -3900,6 +5527,7 @@ void vrend_set_single_abo(struct vrend_context *ctx,
       abo->buffer_offset = offset;
       abo->buffer_size = length;
       ctx->sub->abo_used_mask |= (1u << index);
+      ctx->sub->abo_dirty_mask |= (1u << index);
    } else {
       vrend_resource_reference(&abo->res, NULL);
       abo->buffer_offset = 0;
@@ -3908,7 +5536,49 @@ void vrend_set_single_abo(struct vrend_context *ctx,
    }
 }
 
-void vrend_memory_barrier(UNUSED struct vrend_context *ctx,
+/* Image stores, SSBO writes and atomic counters are the only writes that
+ * need barriers, a draw or dispatch that may do them makes the barriers
+ * emitted so far insufficient. */
+static void vrend_track_shader_writes(struct vrend_sub_context *sub_ctx,
+                                      int first, int last)
+{
+   bool writes = sub_ctx->abo_used_mask != 0;
+
+   for (int i = first; i <= last && !writes; i++) {
+      writes = (sub_ctx->images_used_mask[i] & sub_ctx->prog->images_used_mask[i]) ||
+               (sub_ctx->ssbo_used_mask[i] & sub_ctx->prog->ssbo_used_mask[i]);
+   }
+
+   if (writes)
+      sub_ctx->done_barriers = 0;
+}
+
+void vrend_end_dispatch_run(struct vrend_context *ctx)
+{
+   ctx->sub->cs_bindings_current = false;
+}
+
+void vrend_flush_barriers(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+
+   if (sub_ctx->pending_barriers) {
+      glMemoryBarrier(sub_ctx->pending_barriers);
+      sub_ctx->done_barriers |= sub_ctx->pending_barriers;
+      sub_ctx->pending_barriers = 0;
+   }
+
+   if (sub_ctx->pending_texture_barriers) {
+      const unsigned flags = sub_ctx->pending_texture_barriers;
+      sub_ctx->pending_texture_barriers = 0;
+      if (has_feature(feat_texture_barrier) && (flags & PIPE_TEXTURE_BARRIER_SAMPLER))
+         glTextureBarrier();
+      if (has_feature(feat_blend_equation_advanced) && (flags & PIPE_TEXTURE_BARRIER_FRAMEBUFFER))
+         glBlendBarrierKHR();
+   }
+}
+
+void vrend_memory_barrier(struct vrend_context *ctx,
                           unsigned flags)
 {
    GLbitfield gl_barrier = 0;
@@ -3949,12 +5619,25 @@ void vrend_memory_barrier(UNUSED struct vrend_context *ctx,
       if (has_feature(feat_qbo) && (flags & PIPE_BARRIER_QUERY_BUFFER))
          gl_barrier |= GL_QUERY_BUFFER_BARRIER_BIT;
    }
+
+   if (vrend_state.use_barrier_tracking) {
+      /* the whole request is kept, all the bits are not valid on their own */
+      if (gl_barrier & ~ctx->sub->done_barriers)
+         ctx->sub->pending_barriers |= gl_barrier;
+      return;
+   }
+
    glMemoryBarrier(gl_barrier);
 }
 
-void vrend_texture_barrier(UNUSED struct vrend_context *ctx,
+void vrend_texture_barrier(struct vrend_context *ctx,
                            unsigned flags)
 {
+   if (vrend_state.use_barrier_tracking) {
+      ctx->sub->pending_texture_barriers |= flags;
+      return;
+   }
+
    if (has_feature(feat_texture_barrier) && (flags & PIPE_TEXTURE_BARRIER_SAMPLER))
       glTextureBarrier();
    if (has_feature(feat_blend_equation_advanced) && (flags & PIPE_TEXTURE_BARRIER_FRAMEBUFFER))
@@ -4347,13 +6030,44 @@ static int vrend_shader_create(struct vrend_context *ctx,
       VREND_DEBUG_EXT(dbg_shader_tgsi, ctx, vrend_dump_tgsi(shader->sel->tokens, 0));
       VREND_DEBUG(dbg_shader_tgsi, ctx, "\n");
 
+      struct vrend_shader_cache_key cache_key;
+      vrend_shader_cache_key_init(&cache_key, &ctx->shader_cfg, shader->sel->tokens,
+                                  shader->sel->req_local_mem, key, &shader->sel->sinfo);
+
+      struct vrend_shader_cache_entry *entry = vrend_shader_cache_lookup(&cache_key);
+      if (entry) {
+         struct vrend_strarray glsl_strings;
+         if (vrend_shader_cache_entry_apply(entry, &shader->sel->sinfo, &shader->var_sinfo,
+                                            &glsl_strings)) {
+            VREND_DEBUG(dbg_shader, ctx, "Reusing cached translation\n");
+            vrend_shader_strings_free(&shader->glsl_strings);
+            shader->glsl_strings = glsl_strings;
+            shader->cache_entry = entry;
+            vrend_shader_cache_key_fini(&cache_key);
+            shader->key = *key;
+            return 0;
+         }
+         vrend_shader_cache_entry_unref(entry);
+      }
+
+      /* the variants only differ in their keys, the passes over the tokens
+       * that do not depend on it are done once */
+      if (!shader->sel->analysis)
+         shader->sel->analysis = vrend_shader_analyze(shader->sel->tokens);
+
       bool ret = vrend_convert_shader(ctx, &ctx->shader_cfg, shader->sel->tokens,
+                                      shader->sel->analysis,
                                       shader->sel->req_local_mem, key, &shader->sel->sinfo,
                                       &shader->var_sinfo, &shader->glsl_strings);
       if (!ret) {
+         vrend_shader_cache_key_fini(&cache_key);
          vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, shader->sel->type);
          return -1;
       }
+
+      shader->cache_entry = vrend_shader_cache_insert(&cache_key, &shader->sel->sinfo,
+                                                      &shader->var_sinfo, &shader->glsl_strings);
+      vrend_shader_cache_key_fini(&cache_key);
    } else if (!ctx->shader_cfg.use_gles && shader->sel->type != PIPE_SHADER_TESS_CTRL) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, shader->sel->type);
       return -1;
@@ -4363,6 +6077,59 @@ static int vrend_shader_create(struct vrend_context *ctx,
    return 0;
 }
 
+static uint32_t vrend_shader_key_hash(const void *key)
+{
+   return XXH32(key, sizeof(struct vrend_shader_key), 0);
+}
+
+static bool vrend_shader_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct vrend_shader_key));
+}
+
+static void vrend_shader_add_variant(struct vrend_shader_selector *sel,
+                                     struct vrend_shader *shader)
+{
+   list_addtail(&shader->variant_head, &sel->variants);
+   sel->num_variants++;
+   _mesa_hash_table_insert_pre_hashed(sel->variant_table, shader->key_hash,
+                                      &shader->key, shader);
+}
+
+static void vrend_shader_remove_variant(struct vrend_shader_selector *sel,
+                                        struct vrend_shader *shader)
+{
+   struct hash_entry *entry =
+      _mesa_hash_table_search_pre_hashed(sel->variant_table, shader->key_hash, &shader->key);
+   if (entry && entry->data == shader)
+      _mesa_hash_table_remove(sel->variant_table, entry);
+   list_del(&shader->variant_head);
+   sel->num_variants--;
+   if (sel->current == shader)
+      sel->current = NULL;
+}
+
+/* Drop the least recently used variant that isn't part of the program that
+ * is currently bound. */
+static void vrend_shader_evict_variant(struct vrend_sub_context *sub_ctx,
+                                       struct vrend_shader_selector *sel)
+{
+   struct vrend_shader *victim = NULL;
+
+   list_for_each_entry(struct vrend_shader, shader, &sel->variants, variant_head) {
+      if (shader == sel->current ||
+          (sub_ctx->prog && sub_ctx->prog->ss[sel->type] == shader))
+         continue;
+      if (!victim || shader->last_used < victim->last_used)
+         victim = shader;
+   }
+
+   if (victim) {
+      vrend_shader_remove_variant(sel, victim);
+      vrend_shader_destroy(victim);
+   }
+}
+
 static int vrend_shader_select(struct vrend_sub_context *sub_ctx,
                                struct vrend_shader_selector *sel,
                                bool *dirty)
@@ -4373,25 +6140,22 @@ static int vrend_shader_select(struct vrend_sub_context *sub_ctx,
 
    memset(&key, 0, sizeof(key));
    vrend_fill_shader_key(sub_ctx, sel, &key);
+   uint32_t key_hash = vrend_shader_key_hash(&key);
 
-   if (sel->current) {
-      if (!memcmp(&sel->current->key, &key, sizeof(key)))
-         return 0;
-
-      struct vrend_shader *p = sel->current;
-      struct vrend_shader *c = p->next_variant;
+   /* fast path: the key didn't change since the last draw */
+   if (sel->current && sel->current->key_hash == key_hash &&
+       vrend_shader_key_equal(&sel->current->key, &key))
+      return 0;
 
-      while (c && memcmp(&c->key, &key, sizeof(key)) != 0) {
-         p = c;
-         c = c->next_variant;
-      }
-      if (c) {
-         p->next_variant = c->next_variant;
-         shader = c;
-      }
-   }
+   struct hash_entry *entry =
+      _mesa_hash_table_search_pre_hashed(sel->variant_table, key_hash, &key);
+   if (entry)
+      shader = entry->data;
 
    if (!shader) {
+      if (sel->num_variants >= VREND_SHADER_MAX_VARIANTS)
+         vrend_shader_evict_variant(sub_ctx, sel);
+
       shader = CALLOC_STRUCT(vrend_shader);
       shader->sel = sel;
       list_inithead(&shader->programs);
@@ -4400,15 +6164,17 @@ static int vrend_shader_select(struct vrend_sub_context *sub_ctx,
       r = vrend_shader_create(sub_ctx->parent, shader, &key);
       if (r) {
          sel->current = NULL;
-         strarray_free(&shader->glsl_strings, true);
+         vrend_shader_strings_free(&shader->glsl_strings);
          FREE(shader);
          return r;
       }
+      shader->key_hash = key_hash;
+      vrend_shader_add_variant(sel, shader);
    }
    if (dirty)
       *dirty = true;
 
-   shader->next_variant = sel->current;
+   shader->last_used = ++sel->use_counter;
    sel->current = shader;
    return 0;
 }
@@ -4422,19 +6188,28 @@ static void *vrend_create_shader_state(const struct pipe_stream_output_info *so_
    if (!sel)
       return NULL;
 
+   sel->variant_table = _mesa_hash_table_create(NULL, vrend_shader_key_hash,
+                                                vrend_shader_key_equal);
+   if (!sel->variant_table) {
+      FREE(sel);
+      return NULL;
+   }
+
    sel->req_local_mem = req_local_mem;
    sel->type = pipe_shader_type;
    sel->sinfo.so_info = *so_info;
+   list_inithead(&sel->variants);
    pipe_reference_init(&sel->reference, 1);
 
    return sel;
 }
 
+/* takes over the tokens, they are freed with the selector */
 static int vrend_finish_shader(struct vrend_context *ctx,
                                struct vrend_shader_selector *sel,
-                               const struct tgsi_token *tokens)
+                               struct tgsi_token *tokens)
 {
-   sel->tokens = tgsi_dup_tokens(tokens);
+   sel->tokens = tokens;
 
    if (!ctx->shader_cfg.use_gles && sel->type != PIPE_SHADER_COMPUTE)
       sel->sinfo.separable_program =
@@ -4443,6 +6218,11 @@ static int vrend_finish_shader(struct vrend_context *ctx,
    return vrend_shader_select(ctx->sub, sel, NULL) ? EINVAL : 0;
 }
 
+static bool vrend_shader_text_terminated(const char *shader_buf, uint32_t length)
+{
+   return length >= 4 && memchr(shader_buf + length - 4, '\0', 4);
+}
+
 static int vrend_shader_assign_tgsi(struct vrend_context *ctx,
                                     struct vrend_shader_selector *sel,
                                     const char *shader_buf,
@@ -4452,7 +6232,7 @@ static int vrend_shader_assign_tgsi(struct vrend_context *ctx,
    struct tgsi_token *tokens;
 
    /* check for null termination */
-   if (current_length < 4 || !memchr(shader_buf + current_length - 4, '\0', 4))
+   if (!vrend_shader_text_terminated(shader_buf, current_length))
       return EINVAL;
 
    tokens = calloc(num_tokens + 10, sizeof(struct tgsi_token));
@@ -4464,13 +6244,58 @@ static int vrend_shader_assign_tgsi(struct vrend_context *ctx,
       return EINVAL;
    }
 
-   if (vrend_finish_shader(ctx, sel, tokens)) {
-      free(tokens);
+   return vrend_finish_shader(ctx, sel, tokens) ? EINVAL : 0;
+}
+
+static void vrend_long_shader_drop_parser(struct vrend_long_shader_buffer *lsbuf)
+{
+   tgsi_text_parser_destroy(lsbuf->parser);
+   lsbuf->parser = NULL;
+   free(lsbuf->tokens);
+   lsbuf->tokens = NULL;
+}
+
+/* feeds the complete lines received so far to the parser, the last one may
+ * continue in the next chunk */
+static void vrend_long_shader_parse(struct vrend_long_shader_buffer *lsbuf)
+{
+   uint32_t end = lsbuf->current_length;
+
+   if (!lsbuf->parser)
+      return;
+
+   while (end > lsbuf->parsed_length && lsbuf->tmp_buf[end - 1] != '\n')
+      end--;
+   if (end == lsbuf->parsed_length)
+      return;
+
+   /* the parser stops at the newline and eats it with the next feed */
+   lsbuf->tmp_buf[end - 1] = '\0';
+   bool ok = tgsi_text_parser_feed(lsbuf->parser);
+   lsbuf->tmp_buf[end - 1] = '\n';
+   lsbuf->parsed_length = end;
+
+   if (!ok)
+      vrend_long_shader_drop_parser(lsbuf);
+}
+
+static int vrend_long_shader_assign_tgsi(struct vrend_context *ctx,
+                                         struct vrend_long_shader_buffer *lsbuf,
+                                         uint32_t num_tokens)
+{
+   if (!vrend_shader_text_terminated(lsbuf->tmp_buf, lsbuf->current_length))
       return EINVAL;
+
+   if (lsbuf->parser && lsbuf->num_tokens == num_tokens &&
+       tgsi_text_parser_finish(lsbuf->parser)) {
+      struct tgsi_token *tokens = lsbuf->tokens;
+      lsbuf->tokens = NULL;
+      return vrend_finish_shader(ctx, lsbuf->sel, tokens) ? EINVAL : 0;
    }
 
-   free(tokens);
-   return 0;
+   return vrend_shader_assign_tgsi(ctx, lsbuf->sel,
+                                   lsbuf->tmp_buf, lsbuf->current_length,
+                                   num_tokens);
 }
 
 static int vrend_shader_store_long_shader(uint32_t handle,
@@ -4478,6 +6303,7 @@ static int vrend_shader_store_long_shader(uint32_t handle,
                                           uint32_t pkt_length_bytes,
                                           uint32_t expected_token_count,
                                           const char *shd_text,
+                                          uint32_t num_tokens,
                                           struct vrend_long_shader_buffer **lsb)
 {
    /* We only got a partial shader, start a long shader transfer */
@@ -4496,6 +6322,18 @@ static int vrend_shader_store_long_shader(uint32_t handle,
    }
 
    memcpy(lsbuf->tmp_buf, shd_text, pkt_length_bytes);
+
+   /* without them, the text is only parsed once complete */
+   lsbuf->num_tokens = num_tokens;
+   lsbuf->tokens = calloc(num_tokens + 10, sizeof(struct tgsi_token));
+   if (lsbuf->tokens)
+      lsbuf->parser = tgsi_text_parser_create(lsbuf->tmp_buf, lsbuf->tokens, num_tokens + 10);
+   if (!lsbuf->parser) {
+      free(lsbuf->tokens);
+      lsbuf->tokens = NULL;
+   }
+   vrend_long_shader_parse(lsbuf);
+
    *lsb = lsbuf;
    return 0;
 }
@@ -4580,7 +6418,7 @@ int vrend_create_shader(struct vrend_context *ctx,
          /* We only got a partial shader, start a long shader transfer */
          int ret = vrend_shader_store_long_shader(handle, sel,
                                                   pkt_length_bytes, expected_token_count,
-                                                  shd_text,
+                                                  shd_text, num_tokens,
                                                   &sub_ctx->long_shader_in_progress[type]);
          if (ret != 0) {
             vrend_renderer_object_destroy(ctx, handle);
@@ -4626,10 +6464,10 @@ int vrend_create_shader(struct vrend_context *ctx,
 
       memcpy(lsbuf->tmp_buf + lsbuf->current_length, shd_text, pkt_length_bytes);
       lsbuf->current_length += pkt_length_bytes;
-      if (lsbuf->current_length == lsbuf->total_length) {
-         int ret = vrend_shader_assign_tgsi(ctx, lsbuf->sel,
-                                            lsbuf->tmp_buf, lsbuf->current_length,
-                                            num_tokens);
+      if (lsbuf->current_length < lsbuf->total_length) {
+         vrend_long_shader_parse(lsbuf);
+      } else {
+         int ret = vrend_long_shader_assign_tgsi(ctx, lsbuf, num_tokens);
          sub_ctx->long_shader_in_progress[type] = NULL;
          vrend_destroy_long_shader_buffer(lsbuf);
          if (ret != 0) {
@@ -4745,7 +6583,7 @@ static void vrend_clear_prepare(struct vrend_sub_context *sub_ctx,
    }
 
    if (sub_ctx->hw_rs_state.rasterizer_discard)
-      glDisable(GL_RASTERIZER_DISCARD);
+      vrend_gl_enable(GL_RASTERIZER_DISCARD, false);
 }
 
 static void vrend_clear_finish(struct vrend_sub_context *sub_ctx,
@@ -4755,7 +6593,7 @@ static void vrend_clear_finish(struct vrend_sub_context *sub_ctx,
     * didn't forward them before calling the clear command
     */
    if (sub_ctx->hw_rs_state.rasterizer_discard)
-       glEnable(GL_RASTERIZER_DISCARD);
+       vrend_gl_enable(GL_RASTERIZER_DISCARD, true);
 
    if (buffers & PIPE_CLEAR_DEPTH) {
       if (!sub_ctx->dsa_state.depth.writemask)
@@ -4790,14 +6628,14 @@ static void vrend_clear_finish(struct vrend_sub_context *sub_ctx,
 
    /* Restore previous scissor state */
    if (sub_ctx->hw_rs_state.scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, true);
    else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, false);
 }
 
-void vrend_clear(struct vrend_context *ctx, unsigned buffers,
-                 const union pipe_color_union *color, double depth,
-                 unsigned stencil) {
+static void vrend_clear_emit(struct vrend_context *ctx, unsigned buffers,
+                             const union pipe_color_union *color, double depth,
+                             unsigned stencil) {
    GLbitfield bits = 0;
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
@@ -4817,11 +6655,13 @@ void vrend_clear(struct vrend_context *ctx, unsigned buffers,
 
    vrend_use_program(NULL);
 
-   glDisable(GL_SCISSOR_TEST);
+   vrend_gl_enable(GL_SCISSOR_TEST, false);
 
    float colorf[4];
    memcpy(colorf, color->f, sizeof(colorf));
 
+   struct vrend_gpu_timer *timer = vrend_gpu_timer_begin(ctx, VREND_GPU_TIMER_CLEAR);
+
    vrend_clear_prepare(sub_ctx, sub_ctx->nr_cbufs ? sub_ctx->surf[0] : NULL,
                        buffers, colorf, depth, stencil);
 
@@ -4858,6 +6698,124 @@ void vrend_clear(struct vrend_context *ctx, unsigned buffers,
       glClear(bits);
 
    vrend_clear_finish(sub_ctx, buffers);
+
+   vrend_gpu_timer_end(timer);
+}
+
+/* The previous contents of the buffers are dead, tilers can skip loading
+ * them into the tile memory. */
+static void vrend_invalidate_framebuffer(struct vrend_sub_context *sub_ctx,
+                                         unsigned buffers)
+{
+   GLenum attachments[PIPE_MAX_COLOR_BUFS + 2];
+   GLsizei num_attachments = 0;
+   unsigned mask = (buffers & PIPE_CLEAR_COLOR) >> 2;
+
+   if (!has_feature(feat_invalidate_subdata))
+      return;
+
+   while (mask) {
+      int i = u_bit_scan(&mask);
+      if (i < (int)sub_ctx->nr_cbufs && sub_ctx->surf[i])
+         attachments[num_attachments++] = GL_COLOR_ATTACHMENT0 + i;
+   }
+   if (sub_ctx->zsurf) {
+      if (buffers & PIPE_CLEAR_DEPTH)
+         attachments[num_attachments++] = GL_DEPTH_ATTACHMENT;
+      if ((buffers & PIPE_CLEAR_STENCIL) &&
+          util_format_has_stencil(util_format_description(sub_ctx->zsurf->format)))
+         attachments[num_attachments++] = GL_STENCIL_ATTACHMENT;
+   }
+
+   if (num_attachments)
+      glInvalidateFramebuffer(GL_FRAMEBUFFER, num_attachments, attachments);
+}
+
+void vrend_clear(struct vrend_context *ctx, unsigned buffers,
+                 const union pipe_color_union *color, double depth,
+                 unsigned stencil) {
+   struct vrend_pending_clear *clear = &ctx->sub->pending_clear;
+   unsigned color_buffers = buffers & PIPE_CLEAR_COLOR;
+
+   if (ctx->in_error)
+      return;
+
+   if (!vrend_state.use_deferred_clears) {
+      vrend_clear_emit(ctx, buffers, color, depth, stencil);
+      return;
+   }
+
+   /* one glClear only takes one colour, buffers that keep a different one
+    * have to be cleared first */
+   if (color_buffers && (clear->buffers & PIPE_CLEAR_COLOR & ~color_buffers) &&
+       memcmp(&clear->color, color, sizeof(*color)))
+      vrend_flush_clears(ctx);
+
+   clear->buffers |= buffers;
+   clear->discarded &= ~color_buffers;
+   if (color_buffers)
+      clear->color = *color;
+   if (buffers & PIPE_CLEAR_DEPTH)
+      clear->depth = depth;
+   if (buffers & PIPE_CLEAR_STENCIL)
+      clear->stencil = stencil;
+}
+
+void vrend_flush_clears(struct vrend_context *ctx)
+{
+   struct vrend_pending_clear *clear = &ctx->sub->pending_clear;
+   struct vrend_pending_clear pending = *clear;
+
+   if (!pending.buffers && !pending.discarded)
+      return;
+
+   memset(clear, 0, sizeof(*clear));
+   if (ctx->in_error)
+      return;
+
+   if (ctx->ctx_switch_pending)
+      vrend_finish_context_switch(ctx);
+
+   /* the clears ignore the scissor, so every cleared buffer is replaced */
+   vrend_invalidate_framebuffer(ctx->sub, pending.buffers | pending.discarded);
+   if (pending.buffers)
+      vrend_clear_emit(ctx, pending.buffers, &pending.color, pending.depth,
+                       pending.stencil);
+}
+
+/* A blit that replaces a cleared colour buffer completely makes its clear
+ * dead work. */
+static void vrend_drop_overwritten_clears(struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_resource *src_res,
+                                          const struct vrend_resource *dst_res,
+                                          const struct pipe_blit_info *info)
+{
+   struct vrend_pending_clear *clear = &sub_ctx->pending_clear;
+   unsigned mask = (clear->buffers & PIPE_CLEAR_COLOR) >> 2;
+
+   if (!mask || src_res == dst_res || info->scissor_enable || info->alpha_blend ||
+       (info->mask & PIPE_MASK_RGBA) != PIPE_MASK_RGBA ||
+       (info->render_condition_enable && sub_ctx->cond_render_gl_mode))
+      return;
+
+   if (info->dst.box.x || info->dst.box.y ||
+       info->dst.box.width != (int)u_minify(dst_res->base.width0, info->dst.level) ||
+       info->dst.box.height != (int)u_minify(dst_res->base.height0, info->dst.level))
+      return;
+
+   while (mask) {
+      int i = u_bit_scan(&mask);
+      const struct vrend_surface *surf = sub_ctx->surf[i];
+
+      if (i >= (int)sub_ctx->nr_cbufs || !surf || surf->texture != dst_res ||
+          surf->level != info->dst.level ||
+          info->dst.box.z > (int)surf->first_layer ||
+          info->dst.box.z + info->dst.box.depth <= (int)surf->last_layer)
+         continue;
+
+      clear->buffers &= ~(PIPE_CLEAR_COLOR0 << i);
+      clear->discarded |= PIPE_CLEAR_COLOR0 << i;
+   }
 }
 
 int vrend_clear_texture(struct vrend_context* ctx,
@@ -4882,6 +6840,8 @@ int vrend_clear_texture(struct vrend_context* ctx,
       ((uint8_t*)data)[2] = temp;
    }
 
+   vrend_resource_invalidate_cursor(res);
+
    if (vrend_state.use_gles) {
       glClearTexSubImageEXT(res->gl_id, level,
                             box->x, box->y, box->z,
@@ -4922,8 +6882,10 @@ void vrend_clear_surface(struct vrend_context *ctx, uint32_t surf_handle,
    if (render_condition_enabled == false)
       vrend_pause_render_condition(ctx, true);
 
+   struct vrend_gpu_timer *timer = vrend_gpu_timer_begin(ctx, VREND_GPU_TIMER_CLEAR);
+
    glScissor(dstx, dsty, width, height);
-   glEnable(GL_SCISSOR_TEST);
+   vrend_gl_enable(GL_SCISSOR_TEST, true);
    ctx->sub->scissor_state_dirty = (1 << 0);
 
    // Do clear on blit framebuffer to avoid messing with main fb
@@ -4961,6 +6923,8 @@ void vrend_clear_surface(struct vrend_context *ctx, uint32_t surf_handle,
                           GL_TEXTURE_2D, 0, 0);
    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->fb_id);
 
+   vrend_gpu_timer_end(timer);
+
    if (render_condition_enabled == false)
       vrend_pause_render_condition(ctx, false);
 }
@@ -5036,42 +7000,192 @@ static GLenum get_gs_xfb_mode(GLenum mode)
    }
 }
 
-static GLenum get_tess_xfb_mode(int mode, bool is_point_mode)
+static GLenum get_tess_xfb_mode(int mode, bool is_point_mode)
+{
+   if (is_point_mode)
+       return GL_POINTS;
+   switch (mode) {
+   case GL_QUADS:
+   case GL_TRIANGLES:
+      return GL_TRIANGLES;
+   case GL_LINES:
+      return GL_LINES;
+   default:
+      virgl_warn("Illegal gs transform feedback mode %d\n", mode);
+      return GL_POINTS;
+   }
+}
+
+static GLenum get_xfb_mode(GLenum mode)
+{
+   switch (mode) {
+   case GL_POINTS:
+      return GL_POINTS;
+   case GL_TRIANGLES:
+   case GL_TRIANGLE_STRIP:
+   case GL_TRIANGLE_FAN:
+   case GL_QUADS:
+   case GL_QUAD_STRIP:
+   case GL_POLYGON:
+      return GL_TRIANGLES;
+   case GL_LINES:
+   case GL_LINE_LOOP:
+   case GL_LINE_STRIP:
+      return GL_LINES;
+   default:
+      virgl_warn("Failed to translate TFB %d\n", mode);
+      return GL_POINTS;
+   }
+}
+
+/* Returns false for layouts that are not cached: the ones that reference
+ * missing buffers or locations, and, when attributes are set up with
+ * pointers, the ones with zero stride buffers that are emitted as constant
+ * attribute values. */
+static bool vrend_vao_key_init(struct vrend_sub_context *sub_ctx,
+                               const struct vrend_vertex_element_array *va,
+                               bool legacy,
+                               struct vrend_vao_key *key)
+{
+   uint32_t num_attribs = va->count;
+
+   if (!num_attribs)
+      return false;
+
+   if (legacy)
+      num_attribs = MIN2(num_attribs, (uint32_t)sub_ctx->prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs);
+
+   memset(key, 0, sizeof(*key));
+   key->ve = va;
+   key->num_attribs = num_attribs;
+
+   for (uint32_t i = 0; i < num_attribs; i++) {
+      const struct vrend_vertex_element *ve = &va->elements[i];
+      const struct vrend_vertex_buffer *vbo = &sub_ctx->vbo[ve->base.vertex_buffer_index];
+      GLint loc = i;
+
+      if (legacy && !vrend_state.use_explicit_locations)
+         loc = sub_ctx->prog->attrib_locs ? sub_ctx->prog->attrib_locs[i] : -1;
+
+      if (!vbo->base.buffer || loc == -1 || ve->type == GL_FALSE ||
+          (legacy && vbo->base.stride == 0))
+         return false;
+
+      key->attribs[i].res = (struct vrend_resource *)vbo->base.buffer;
+      key->attribs[i].offset = vbo->base.buffer_offset;
+      key->attribs[i].stride = vbo->base.stride;
+      key->attribs[i].loc = loc;
+   }
+
+   return true;
+}
+
+static struct vrend_vao *vrend_vao_create(struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_vao_key *key,
+                                          bool legacy)
+{
+   const struct vrend_vertex_element_array *va = key->ve;
+   struct vrend_vao *vao;
+
+   if (sub_ctx->num_vaos >= VREND_VAO_CACHE_SIZE)
+      vrend_vao_destroy(sub_ctx, list_last_entry(&sub_ctx->vaos, struct vrend_vao, head));
+
+   vao = CALLOC_STRUCT(vrend_vao);
+   if (!vao)
+      return NULL;
+
+   vao->key = *key;
+   glGenVertexArrays(1, &vao->id);
+   vrend_gl_bind_vertex_array(vao->id);
+
+   for (uint32_t i = 0; i < key->num_attribs; i++) {
+      const struct vrend_vertex_element *ve = &va->elements[i];
+      struct vrend_resource *res = key->attribs[i].res;
+      GLint loc = key->attribs[i].loc;
+      GLint size = !vrend_state.use_gles && (va->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
+
+      if (legacy) {
+         void *pointer = (void *)(uintptr_t)(ve->base.src_offset + key->attribs[i].offset);
+
+         vrend_gl_bind_buffer(GL_ARRAY_BUFFER, res->gl_id);
+         if (util_format_is_pure_integer(ve->base.src_format))
+            glVertexAttribIPointer(loc, size, ve->type, key->attribs[i].stride, pointer);
+         else
+            glVertexAttribPointer(loc, size, ve->type, ve->norm, key->attribs[i].stride, pointer);
+         glVertexAttribDivisorARB(loc, ve->base.instance_divisor);
+      } else {
+         /* same setup as the per vertex elements array */
+         if (util_format_is_pure_integer(ve->base.src_format))
+            glVertexAttribIFormat(i, size, ve->type, ve->base.src_offset);
+         else
+            glVertexAttribFormat(i, size, ve->type, ve->norm, ve->base.src_offset);
+         glVertexAttribBinding(i, ve->base.vertex_buffer_index);
+         glVertexBindingDivisor(i, ve->base.instance_divisor);
+         glBindVertexBuffer(ve->base.vertex_buffer_index, res->gl_id,
+                            key->attribs[i].offset, key->attribs[i].stride);
+      }
+      glEnableVertexAttribArray(loc);
+   }
+
+   _mesa_hash_table_insert(sub_ctx->vao_table, &vao->key, vao);
+   list_add(&vao->head, &sub_ctx->vaos);
+   sub_ctx->num_vaos++;
+   return vao;
+}
+
+static struct vrend_vao *vrend_vao_lookup(struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_vao_key *key,
+                                          bool legacy)
+{
+   struct hash_entry *entry = _mesa_hash_table_search(sub_ctx->vao_table, key);
+   if (!entry)
+      return vrend_vao_create(sub_ctx, key, legacy);
+
+   struct vrend_vao *vao = entry->data;
+   /* put the entry in front */
+   if (sub_ctx->vaos.next != &vao->head) {
+      list_del(&vao->head);
+      list_add(&vao->head, &sub_ctx->vaos);
+   }
+   return vao;
+}
+
+static void vrend_wait_sync(GLsync sync)
 {
-   if (is_point_mode)
-       return GL_POINTS;
-   switch (mode) {
-   case GL_QUADS:
-   case GL_TRIANGLES:
-      return GL_TRIANGLES;
-   case GL_LINES:
-      return GL_LINES;
-   default:
-      virgl_warn("Illegal gs transform feedback mode %d\n", mode);
-      return GL_POINTS;
-   }
+   GLenum ret;
+
+   do {
+      ret = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+   } while (ret == GL_TIMEOUT_EXPIRED);
+
+   if (ret == GL_WAIT_FAILED)
+      virgl_warn("Wait sync failed: illegal buffer fence object %p\n", (void*) sync);
+
+   glDeleteSync(sync);
 }
 
-static GLenum get_xfb_mode(GLenum mode)
+/* Maps a buffer bound to target for reading.  Persistently mapped buffers
+ * can't be mapped again, they are read through their mapping once the GPU
+ * is done with them. */
+static void *vrend_buffer_map_read(struct vrend_resource *res, GLenum target,
+                                   GLintptr offset, GLsizeiptr length)
 {
-   switch (mode) {
-   case GL_POINTS:
-      return GL_POINTS;
-   case GL_TRIANGLES:
-   case GL_TRIANGLE_STRIP:
-   case GL_TRIANGLE_FAN:
-   case GL_QUADS:
-   case GL_QUAD_STRIP:
-   case GL_POLYGON:
-      return GL_TRIANGLES;
-   case GL_LINES:
-   case GL_LINE_LOOP:
-   case GL_LINE_STRIP:
-      return GL_LINES;
-   default:
-      virgl_warn("Failed to translate TFB %d\n", mode);
-      return GL_POINTS;
+   void *map = res->write_map ? res->write_map : res->blob_map;
+
+   if (map) {
+      if (has_feature(feat_barrier))
+         glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+      vrend_wait_sync(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+      return (char *)map + offset;
    }
+
+   return glMapBufferRange(target, offset, length, GL_MAP_READ_BIT);
+}
+
+static void vrend_buffer_unmap_read(struct vrend_resource *res, GLenum target)
+{
+   if (!res->write_map && !res->blob_map)
+      glUnmapBuffer(target);
 }
 
 static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
@@ -5079,8 +7193,24 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
 {
    uint32_t enable_bitmask;
    uint32_t disable_bitmask;
+   struct vrend_vao_key key;
    int i;
 
+   if (vrend_vao_key_init(ctx->sub, va, true, &key)) {
+      struct vrend_vao *vao = ctx->sub->current_vao;
+      if (!vao || !vrend_vao_key_equal(&vao->key, &key))
+         vao = vrend_vao_lookup(ctx->sub, &key, true);
+      ctx->sub->current_vao = vao;
+      if (vao) {
+         vrend_gl_bind_vertex_array(vao->id);
+         return;
+      }
+   }
+
+   /* the enabled_attribs_bitmask tracks the state of this one */
+   ctx->sub->current_vao = NULL;
+   vrend_gl_bind_vertex_array(ctx->sub->vaoid);
+
    enable_bitmask = 0;
    disable_bitmask = ~((1ull << va->count) - 1);
    for (i = 0; i < (int)va->count; i++) {
@@ -5122,14 +7252,14 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
          return;
       }
 
-      glBindBuffer(GL_ARRAY_BUFFER, res->gl_id);
+      vrend_gl_bind_buffer(GL_ARRAY_BUFFER, res->gl_id);
 
       struct vrend_vertex_buffer *vbo = &ctx->sub->vbo[vbo_index];
 
       if (vbo->base.stride == 0) {
          void *data;
          /* for 0 stride we are kinda screwed */
-         data = glMapBufferRange(GL_ARRAY_BUFFER, vbo->base.buffer_offset, ve->nr_chan * sizeof(GLfloat), GL_MAP_READ_BIT);
+         data = vrend_buffer_map_read(res, GL_ARRAY_BUFFER, vbo->base.buffer_offset, ve->nr_chan * sizeof(GLfloat));
 
          switch (ve->nr_chan) {
          case 1:
@@ -5145,7 +7275,7 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
             glVertexAttrib4fv(loc, data);
             break;
          }
-         glUnmapBuffer(GL_ARRAY_BUFFER);
+         vrend_buffer_unmap_read(res, GL_ARRAY_BUFFER);
          disable_bitmask |= (1 << loc);
       } else {
          GLint size = !vrend_state.use_gles && (va->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
@@ -5183,7 +7313,19 @@ static void vrend_draw_bind_vertex_binding(struct vrend_context *ctx,
 {
    int i;
 
-   glBindVertexArray(va->id);
+   if (ctx->sub->vbo_dirty) {
+      struct vrend_vao_key key;
+      ctx->sub->current_vao = vrend_vao_key_init(ctx->sub, va, false, &key) ?
+                              vrend_vao_lookup(ctx->sub, &key, false) : NULL;
+   }
+
+   if (ctx->sub->current_vao) {
+      vrend_gl_bind_vertex_array(ctx->sub->current_vao->id);
+      ctx->sub->vbo_dirty = false;
+      return;
+   }
+
+   vrend_gl_bind_vertex_array(va->id);
 
    if (ctx->sub->vbo_dirty) {
       struct vrend_vertex_buffer *vbo = &ctx->sub->vbo[0];
@@ -5231,6 +7373,48 @@ static void vrend_draw_bind_vertex_binding(struct vrend_context *ctx,
    }
 }
 
+/* ARB_multi_bind, which brings glBindVertexBuffers, also binds textures,
+ * samplers and buffer ranges to consecutive units in one call */
+static inline bool vrend_use_multi_bind(void)
+{
+   return has_feature(feat_bind_vertex_buffers) && has_feature(feat_samplers);
+}
+
+/* Binds the GL samplers of the consecutive units [first, first + count), and
+ * the textures too with multi-bind, otherwise they were bound one by one. */
+static void vrend_bind_texture_units(GLuint first, GLsizei count,
+                                     const GLenum *targets,
+                                     const GLuint *textures,
+                                     const GLuint *samplers)
+{
+   if (!count)
+      return;
+
+   if (vrend_use_multi_bind()) {
+      vrend_gl_bind_textures(first, count, targets, textures);
+      glBindSamplers(first, count, samplers);
+   } else if (has_feature(feat_samplers)) {
+      for (GLsizei i = 0; i < count; i++)
+         glBindSampler(first + i, samplers[i]);
+   }
+}
+
+static void vrend_bind_buffer_ranges(GLenum target, GLuint first, GLsizei count,
+                                     const GLuint *buffers,
+                                     const GLintptr *offsets,
+                                     const GLsizeiptr *sizes)
+{
+   if (!count)
+      return;
+
+   if (vrend_use_multi_bind()) {
+      glBindBuffersRange(target, first, count, buffers, offsets, sizes);
+   } else {
+      for (GLsizei i = 0; i < count; i++)
+         glBindBufferRange(target, first + i, buffers[i], offsets[i], sizes[i]);
+   }
+}
+
 static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
                                               int shader_type,
                                               GLuint next_sampler_id)
@@ -5242,12 +7426,22 @@ static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
    uint32_t dirty = shader_view->dirty_mask;
    uint32_t mask = sprog->samplers_used_mask[shader_type];
 
+   /* the units that are updated, bound in one call per consecutive run */
+   bool multi_bind = vrend_use_multi_bind();
+   GLenum targets[PIPE_MAX_SAMPLERS];
+   GLuint textures[PIPE_MAX_SAMPLERS];
+   GLuint samplers[PIPE_MAX_SAMPLERS];
+   GLuint first_unit = 0;
+   GLsizei num_units = 0;
+
    while (mask) {
       int i = u_bit_scan(&mask);
       struct vrend_sampler_view *tview = shader_view->views[i];
+      bool bound = false;
 
       if ((dirty & (1 << i)) && tview) {
-         glActiveTexture(GL_TEXTURE0 + next_sampler_id);
+         if (!multi_bind)
+            vrend_gl_active_texture(GL_TEXTURE0 + next_sampler_id);
          glUniform1i(sprog->sampler_locs[shader_type][sampler_index], next_sampler_id);
 
          if (sprog->shadow_samp_mask[shader_type] & (1 << i)) {
@@ -5259,6 +7453,10 @@ static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
              * not be applied, therefore, reset the swizzled to the default */
             static const GLint swizzle[] = {GL_RED,GL_GREEN,GL_BLUE,GL_ALPHA};
             if (memcmp(tex->cur_swizzle, swizzle, 4 * sizeof(GLint))) {
+               if (multi_bind) {
+                  vrend_gl_active_texture(GL_TEXTURE0 + next_sampler_id);
+                  vrend_gl_bind_texture(tview->target, tview->gl_id);
+               }
                if (vrend_state.use_gles) {
                   for (unsigned int i = 0; i < 4; ++i) {
                      glTexParameteri(tview->texture->target, GL_TEXTURE_SWIZZLE_R + i, swizzle[i]);
@@ -5292,10 +7490,17 @@ static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
                target = GL_TEXTURE_BUFFER;
             }
 
-            glBindTexture(target, id);
-            vrend_apply_sampler_state(sub_ctx, tview->texture,
-                                      shader_view->samplers[i],
-                                      next_sampler_id, tview);
+            if (!num_units)
+               first_unit = next_sampler_id;
+            if (!multi_bind)
+               vrend_gl_bind_texture(target, id);
+            targets[num_units] = target;
+            textures[num_units] = id;
+            samplers[num_units] = vrend_apply_sampler_state(sub_ctx, tview->texture,
+                                                            shader_view->samplers[i],
+                                                            tview);
+            num_units++;
+            bound = true;
 
             if (vrend_state.use_gles) {
                const unsigned levels = tview->levels ? tview->levels : tview->texture->base.last_level + 1u;
@@ -5303,9 +7508,15 @@ static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
             }
          }
       }
+
+      if (!bound) {
+         vrend_bind_texture_units(first_unit, num_units, targets, textures, samplers);
+         num_units = 0;
+      }
       sampler_index++;
       next_sampler_id++;
    }
+   vrend_bind_texture_units(first_unit, num_units, targets, textures, samplers);
 
    shader_view->num_used_views = sampler_index;
    shader_view->dirty_mask = 0;
@@ -5313,7 +7524,7 @@ static GLuint vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
    // Since we use a dirty mask to elide some unnecessary state update API
    // calls, we must ensure that a later glBindTexture() used for another reason
    // (such as texture allocation) doesn't affect our fragile sampler bindings.
-   glActiveTexture(GL_TEXTURE0 + vrend_state.max_texture_units - 1);
+   vrend_gl_active_texture(GL_TEXTURE0 + vrend_state.max_texture_units - 1);
 
    return next_sampler_id;
 }
@@ -5332,6 +7543,12 @@ static GLuint vrend_draw_bind_ubo_shader(struct vrend_sub_context *sub_ctx,
    if (!update)
       return next_ubo_id + util_bitcount(mask);
 
+   GLuint buffers[PIPE_MAX_CONSTANT_BUFFERS];
+   GLintptr offsets[PIPE_MAX_CONSTANT_BUFFERS];
+   GLsizeiptr sizes[PIPE_MAX_CONSTANT_BUFFERS];
+   GLuint first_ubo_id = 0;
+   GLsizei num_ubos = 0;
+
    while (mask) {
       /* The const_bufs_used_mask stores the gallium uniform buffer indices */
       int i = u_bit_scan(&mask);
@@ -5341,35 +7558,117 @@ static GLuint vrend_draw_bind_ubo_shader(struct vrend_sub_context *sub_ctx,
          cb = &sub_ctx->cbs[shader_type][i];
          res = (struct vrend_resource *)cb->buffer;
 
-         glBindBufferRange(GL_UNIFORM_BUFFER, next_ubo_id, res->gl_id,
-                           cb->buffer_offset, cb->buffer_size);
+         if (!num_ubos)
+            first_ubo_id = next_ubo_id;
+         buffers[num_ubos] = res->gl_id;
+         offsets[num_ubos] = cb->buffer_offset;
+         sizes[num_ubos] = cb->buffer_size;
+         num_ubos++;
          dirty &= ~(1 << i);
+      } else {
+         vrend_bind_buffer_ranges(GL_UNIFORM_BUFFER, first_ubo_id, num_ubos,
+                                  buffers, offsets, sizes);
+         num_ubos = 0;
       }
       next_ubo_id++;
    }
+   vrend_bind_buffer_ranges(GL_UNIFORM_BUFFER, first_ubo_id, num_ubos,
+                            buffers, offsets, sizes);
    sub_ctx->const_bufs_dirty[shader_type] = dirty;
 
    return next_ubo_id;
 }
 
+/* Streams the constants to the upload ring when they changed, or when the
+ * copy there was overwritten or is too small for the program, and binds it.
+ * Switching between programs only binds the copy again.
+ */
+static void vrend_draw_bind_const_block(struct vrend_sub_context *sub_ctx,
+                                        int shader_type)
+{
+   struct vrend_constants *consts = &sub_ctx->consts[shader_type];
+   GLuint bind = sub_ctx->prog->const_block_bind[shader_type];
+   uint32_t size;
+
+   if (!sub_ctx->shaders[shader_type])
+      return;
+
+   size = sub_ctx->shaders[shader_type]->sinfo.num_consts * 4 * sizeof(uint32_t);
+
+   if (sub_ctx->const_dirty[shader_type] || consts->ring_size < size ||
+       !vrend_upload_ring_is_live(consts->ring_generation)) {
+      uint32_t copy_size = consts->consts ?
+                           MIN2(consts->num_consts * sizeof(uint32_t), size) : 0;
+      uint32_t offset;
+      uint8_t *data = vrend_upload_ring_alloc_aligned(size, vrend_state.ubo_offset_alignment,
+                                                      &offset);
+      if (!data) {
+         virgl_error("Unable to stream %u bytes of constants\n", size);
+         return;
+      }
+
+      if (copy_size)
+         memcpy(data, consts->consts, copy_size);
+      memset(data + copy_size, 0, size - copy_size);
+
+      consts->ring_generation = vrend_upload_ring_generation();
+      consts->ring_offset = offset;
+      consts->ring_size = size;
+      sub_ctx->const_dirty[shader_type] = false;
+   }
+
+   glBindBufferRange(GL_UNIFORM_BUFFER, bind, vrend_upload_ring_buffer(),
+                     consts->ring_offset, consts->ring_size);
+}
+
 static void vrend_draw_bind_const_shader(struct vrend_sub_context *sub_ctx,
                                          int shader_type, bool new_program)
 {
-   if (sub_ctx->consts[shader_type].consts &&
+   if (sub_ctx->prog->const_block_bind[shader_type] != GL_INVALID_INDEX) {
+      vrend_draw_bind_const_block(sub_ctx, shader_type);
+      return;
+   }
+
+   const struct vrend_constants *consts = &sub_ctx->consts[shader_type];
+
+   if (consts->consts &&
        sub_ctx->shaders[shader_type] &&
        (sub_ctx->prog->const_location[shader_type] != -1) &&
        (sub_ctx->const_dirty[shader_type] || new_program)) {
-      glUniform4uiv(sub_ctx->prog->const_location[shader_type],
-            sub_ctx->shaders[shader_type]->sinfo.num_consts,
-            sub_ctx->consts[shader_type].consts);
+      GLint location = sub_ctx->prog->const_location[shader_type];
+      uint32_t num_vec4 = sub_ctx->shaders[shader_type]->sinfo.num_consts;
+      uint32_t first = 0;
+
+      /* the program still holds the constants that did not change */
+      if (!new_program && sub_ctx->prog->const_locations_consecutive[shader_type]) {
+         first = MIN2(consts->dirty_start / 4, num_vec4);
+         num_vec4 = MIN2(DIV_ROUND_UP(consts->dirty_end, 4), num_vec4) - first;
+      }
+
+      if (num_vec4)
+         glUniform4uiv(location + first, num_vec4, consts->consts + first * 4);
       sub_ctx->const_dirty[shader_type] = false;
    }
 }
 
+/* Images, SSBOs and atomic buffers are bound to indices that are shared by
+ * all stages and by compute, so they have to be emitted again whenever
+ * another program may have bound something else there. */
+static void vrend_mark_shader_buffers_dirty(struct vrend_sub_context *sub_ctx,
+                                            enum pipe_shader_type first,
+                                            enum pipe_shader_type last)
+{
+   for (enum pipe_shader_type type = first; type <= last; type++) {
+      sub_ctx->images_dirty_mask[type] = ~0u;
+      sub_ctx->ssbo_dirty_mask[type] = ~0u;
+   }
+   sub_ctx->abo_dirty_mask = ~0u;
+}
+
 static void vrend_draw_bind_ssbo_shader(struct vrend_sub_context *sub_ctx,
                                         int shader_type)
 {
-   uint32_t mask;
+   uint32_t mask, dirty = sub_ctx->ssbo_dirty_mask[shader_type];
    struct vrend_ssbo *ssbo;
    struct vrend_resource *res;
 
@@ -5385,14 +7684,25 @@ static void vrend_draw_bind_ssbo_shader(struct vrend_sub_context *sub_ctx,
    uint32_t offset = sub_ctx->shaders[shader_type]->sinfo.ssbo_binding_offset;
    mask = sub_ctx->ssbo_used_mask[shader_type] &
          sub_ctx->prog->ssbo_used_mask[shader_type];
+   sub_ctx->ssbo_dirty_mask[shader_type] &= ~mask;
+   mask &= dirty;
 
    while (mask) {
-      int i = u_bit_scan(&mask);
+      GLuint buffers[PIPE_MAX_SHADER_BUFFERS];
+      GLintptr offsets[PIPE_MAX_SHADER_BUFFERS];
+      GLsizeiptr sizes[PIPE_MAX_SHADER_BUFFERS];
+      int start, count;
 
-      ssbo = &sub_ctx->ssbo[shader_type][i];
-      res = (struct vrend_resource *)ssbo->res;
-      glBindBufferRange(GL_SHADER_STORAGE_BUFFER, i + offset, res->gl_id,
-                        ssbo->buffer_offset, ssbo->buffer_size);
+      u_bit_scan_consecutive_range(&mask, &start, &count);
+      for (int i = 0; i < count; i++) {
+         ssbo = &sub_ctx->ssbo[shader_type][start + i];
+         res = (struct vrend_resource *)ssbo->res;
+         buffers[i] = res->gl_id;
+         offsets[i] = ssbo->buffer_offset;
+         sizes[i] = ssbo->buffer_size;
+      }
+      vrend_bind_buffer_ranges(GL_SHADER_STORAGE_BUFFER, start + offset, count,
+                               buffers, offsets, sizes);
    }
 }
 
@@ -5406,7 +7716,8 @@ static void vrend_draw_bind_abo_shader(struct vrend_sub_context *sub_ctx)
    if (!has_feature(feat_atomic_counters))
       return;
 
-   mask = sub_ctx->abo_used_mask;
+   mask = sub_ctx->abo_used_mask & sub_ctx->abo_dirty_mask;
+   sub_ctx->abo_dirty_mask &= ~sub_ctx->abo_used_mask;
    while (mask) {
       i = u_bit_scan(&mask);
 
@@ -5435,6 +7746,9 @@ static void vrend_draw_bind_images_shader(struct vrend_sub_context *sub_ctx, int
       return;
 
    mask = sub_ctx->images_used_mask[shader_type] & sub_ctx->prog->images_used_mask[shader_type];
+   uint32_t dirty = sub_ctx->images_dirty_mask[shader_type];
+   sub_ctx->images_dirty_mask[shader_type] &= ~mask;
+   mask &= dirty;
 
    while (mask) {
       unsigned i = u_bit_scan(&mask);
@@ -5478,8 +7792,8 @@ static void vrend_draw_bind_images_shader(struct vrend_sub_context *sub_ctx, int
             format = GL_R8UI;
          }
 
-         glBindBufferARB(GL_TEXTURE_BUFFER, iview->texture->gl_id);
-         glBindTexture(GL_TEXTURE_BUFFER, iview->texture->tbo_tex_id);
+         vrend_gl_bind_buffer(GL_TEXTURE_BUFFER, iview->texture->gl_id);
+         vrend_gl_bind_texture(GL_TEXTURE_BUFFER, iview->texture->tbo_tex_id);
 
          if (has_feature(feat_arb_or_gles_ext_texture_buffer)) {
             if (has_feature(feat_texture_buffer_range)) {
@@ -5516,8 +7830,10 @@ static void vrend_draw_bind_images_shader(struct vrend_sub_context *sub_ctx, int
              (iview->u.tex.first_layer != 0 ||
               num_layers != MAX2(iview->texture->base.array_size,  iview->texture->base.depth0))) {
 
-            if (iview->view_id)
+            if (iview->view_id) {
+               vrend_gl_state_forget_texture(iview->view_id);
                glDeleteTextures(1, &iview->view_id);
+            }
 
             glGenTextures(1, &iview->view_id);
             glTextureView(iview->view_id, iview->texture->target, iview->texture->gl_id,
@@ -5557,10 +7873,10 @@ vrend_fill_sysval_uniform_block (struct vrend_sub_context *sub_ctx)
       return;
 
    if (sub_ctx->sysvalue_data_cookie != sub_ctx->prog->sysvalue_data_cookie) {
-      glBindBuffer(GL_UNIFORM_BUFFER, sub_ctx->prog->ubo_sysval_buffer_id);
+      vrend_gl_bind_buffer(GL_UNIFORM_BUFFER, sub_ctx->prog->ubo_sysval_buffer_id);
       glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(struct sysval_uniform_block),
                       &sub_ctx->sysvalue_data);
-      glBindBuffer(GL_UNIFORM_BUFFER, 0);
+      vrend_gl_bind_buffer(GL_UNIFORM_BUFFER, 0);
       sub_ctx->prog->sysvalue_data_cookie = sub_ctx->sysvalue_data_cookie;
    }
 }
@@ -5594,14 +7910,83 @@ static void vrend_draw_bind_objects(struct vrend_sub_context *sub_ctx, bool new_
                         0, sizeof(struct sysval_uniform_block));
 
    vrend_draw_bind_abo_shader(sub_ctx);
+   vrend_track_shader_writes(sub_ctx, PIPE_SHADER_VERTEX, sub_ctx->last_shader_idx);
+
+   /* the next dispatch has to restore the compute bindings */
+   vrend_mark_shader_buffers_dirty(sub_ctx, PIPE_SHADER_COMPUTE, PIPE_SHADER_COMPUTE);
 
    vrend_set_active_pipeline_stage(sub_ctx->prog, PIPE_SHADER_FRAGMENT);
 }
 
+static void
+vrend_destroy_injected_tcs(struct vrend_sub_context *sub_ctx,
+                           struct vrend_injected_tcs *tcs)
+{
+   list_del(&tcs->head);
+   sub_ctx->num_injected_tcs--;
+   vrend_shader_state_reference(&tcs->vs, NULL);
+   vrend_shader_state_reference(&tcs->sel, NULL);
+   free(tcs);
+}
+
+static struct vrend_shader_selector *
+vrend_lookup_injected_tcs(struct vrend_sub_context *sub_ctx,
+                          uint8_t vertices_per_patch,
+                          const struct vrend_shader_key *key)
+{
+   list_for_each_entry(struct vrend_injected_tcs, tcs, &sub_ctx->injected_tcs, head) {
+      if (tcs->vs == sub_ctx->shaders[PIPE_SHADER_VERTEX] &&
+          tcs->vertices_per_patch == vertices_per_patch &&
+          !memcmp(tcs->tess_factors, vrend_state.tess_factors, sizeof(tcs->tess_factors)) &&
+          vrend_shader_key_equal(&tcs->sel->current->key, key)) {
+         list_del(&tcs->head);
+         list_add(&tcs->head, &sub_ctx->injected_tcs);
+         return tcs->sel;
+      }
+   }
+   return NULL;
+}
+
+static void
+vrend_add_injected_tcs(struct vrend_sub_context *sub_ctx,
+                       struct vrend_shader_selector *sel,
+                       uint8_t vertices_per_patch)
+{
+   struct vrend_injected_tcs *tcs = CALLOC_STRUCT(vrend_injected_tcs);
+   if (!tcs)
+      return;
+
+   if (sub_ctx->num_injected_tcs >= VREND_INJECTED_TCS_CACHE_SIZE)
+      vrend_destroy_injected_tcs(sub_ctx,
+                                 list_last_entry(&sub_ctx->injected_tcs,
+                                                 struct vrend_injected_tcs, head));
+
+   vrend_shader_state_reference(&tcs->vs, sub_ctx->shaders[PIPE_SHADER_VERTEX]);
+   vrend_shader_state_reference(&tcs->sel, sel);
+   tcs->vertices_per_patch = vertices_per_patch;
+   memcpy(tcs->tess_factors, vrend_state.tess_factors, sizeof(tcs->tess_factors));
+   list_add(&tcs->head, &sub_ctx->injected_tcs);
+   sub_ctx->num_injected_tcs++;
+}
+
 static bool
 vrend_inject_tcs(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
 {
    struct pipe_stream_output_info so_info;
+   struct vrend_shader_key key;
+
+   /* the key only depends on the type of the selector and on the other
+    * stages, a new selector has no shader info yet */
+   struct vrend_shader_selector probe = { .type = PIPE_SHADER_TESS_CTRL };
+   memset(&key, 0, sizeof(key));
+   vrend_fill_shader_key(sub_ctx, &probe, &key);
+
+   struct vrend_shader_selector *cached =
+      vrend_lookup_injected_tcs(sub_ctx, vertices_per_patch, &key);
+   if (cached) {
+      vrend_shader_state_reference(&sub_ctx->shaders[PIPE_SHADER_TESS_CTRL], cached);
+      return true;
+   }
 
    memset(&so_info, 0, sizeof(so_info));
    struct vrend_shader_selector *sel = vrend_create_shader_state(&so_info,
@@ -5615,7 +8000,7 @@ vrend_inject_tcs(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
       return false;
    }
 
-   vrend_fill_shader_key(sub_ctx, sel, &shader->key);
+   shader->key = key;
 
    shader->sel = sel;
    list_inithead(&shader->programs);
@@ -5625,7 +8010,7 @@ vrend_inject_tcs(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
                                             sub_ctx->shaders[PIPE_SHADER_VERTEX]->tokens,
                                             &shader->key, vrend_state.tess_factors, &sel->sinfo,
                                             &shader->glsl_strings, vertices_per_patch)) {
-      strarray_free(&shader->glsl_strings, true);
+      vrend_shader_strings_free(&shader->glsl_strings);
       FREE(shader);
       vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_SHADER, sel->type);
       vrend_destroy_shader_selector(sel);
@@ -5634,8 +8019,14 @@ vrend_inject_tcs(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
    // Need to add inject the selected shader to the shader selector and then the code below
    // can continue
    sel->tokens = NULL;
+   shader->key_hash = vrend_shader_key_hash(&shader->key);
+   vrend_shader_add_variant(sel, shader);
    sel->current = shader;
+
+   /* the selector is owned by the TCS binding, and by the cache */
+   vrend_shader_state_reference(&sub_ctx->shaders[PIPE_SHADER_TESS_CTRL], NULL);
    sub_ctx->shaders[PIPE_SHADER_TESS_CTRL] = sel;
+   vrend_add_injected_tcs(sub_ctx, sel, vertices_per_patch);
 
    vrend_compile_shader(sub_ctx, shader);
    return true;
@@ -5644,11 +8035,79 @@ vrend_inject_tcs(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
 enum select_program_result {
     PROGRAMM_ERROR,
     PROGRAMM_NO_CHANGE,
-    PROGRAMM_NEW
+    PROGRAMM_NEW,
+    /* still being linked by a shader thread */
+    PROGRAMM_PENDING
 };
 
+/* The selection below translates the new variants one stage after the
+ * other, since the key of a stage depends on the translations of its
+ * neighbours.  With the shader threads, the variants for the keys that the
+ * stages have before the selection are translated concurrently into the
+ * shader cache first.  The selection then only translates the stages whose
+ * key changed with the translation of a neighbour, and finds the others in
+ * the cache. */
+static void vrend_translate_stages_ahead(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_shader_translation translations[PIPE_SHADER_COMPUTE];
+   struct vrend_shader_job *jobs[PIPE_SHADER_COMPUTE];
+   uint32_t num_translations = 0;
+   uint32_t num_jobs = 0;
+
+   for (enum pipe_shader_type type = PIPE_SHADER_VERTEX; type < PIPE_SHADER_COMPUTE; type++) {
+      struct vrend_shader_selector *sel = sub_ctx->shaders[type];
+      struct vrend_shader_translation *translation = &translations[num_translations];
+
+      /* the injected TCS has no tokens */
+      if (!sel || !sel->tokens)
+         continue;
+
+      memset(&translation->key, 0, sizeof(translation->key));
+      sub_ctx->drawing = type == PIPE_SHADER_VERTEX;
+      vrend_fill_shader_key(sub_ctx, sel, &translation->key);
+      sub_ctx->drawing = false;
+
+      uint32_t key_hash = vrend_shader_key_hash(&translation->key);
+      if (_mesa_hash_table_search_pre_hashed(sel->variant_table, key_hash, &translation->key))
+         continue;
+
+      if (!vrend_shader_cache_key_init(&translation->cache_key, &sub_ctx->parent->shader_cfg,
+                                       sel->tokens, sel->req_local_mem, &translation->key,
+                                       &sel->sinfo))
+         continue;
+
+      struct vrend_shader_cache_entry *entry = vrend_shader_cache_lookup(&translation->cache_key);
+      if (entry) {
+         vrend_shader_cache_entry_unref(entry);
+         vrend_shader_cache_key_fini(&translation->cache_key);
+         continue;
+      }
+
+      if (!sel->analysis)
+         sel->analysis = vrend_shader_analyze(sel->tokens);
+
+      translation->ctx = sub_ctx->parent;
+      translation->sel = sel;
+      num_translations++;
+   }
+
+   /* a single translation is left to the selection */
+   if (num_translations > 1) {
+      for (uint32_t i = 0; i < num_translations; i++) {
+         struct vrend_shader_job *job = vrend_shader_job_submit_translation(&translations[i]);
+         if (job)
+            jobs[num_jobs++] = job;
+      }
+      vrend_shader_jobs_finish(jobs, num_jobs);
+   }
+
+   for (uint32_t i = 0; i < num_translations; i++)
+      vrend_shader_cache_key_fini(&translations[i].cache_key);
+}
+
 static enum select_program_result
-vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
+vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch,
+                     bool early_link)
 {
    struct vrend_linked_shader_program *prog;
    bool fs_dirty, vs_dirty, gs_dirty, tcs_dirty, tes_dirty;
@@ -5661,6 +8120,9 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
       return PROGRAMM_ERROR;
    }
 
+   if (vrend_state.num_shader_threads)
+      vrend_translate_stages_ahead(sub_ctx);
+
    // For some GPU, we'd like to use integer variable in generated GLSL if
    // the input buffers are integer formats. But we actually don't know the
    // buffer formats when the shader is created, we only know it here.
@@ -5705,8 +8167,6 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
    vrend_shader_select(sub_ctx, shaders[PIPE_SHADER_VERTEX], &vs_dirty);
    sub_ctx->drawing = false;
 
-   uint8_t gles_emulate_query_texture_levels_mask = 0;
-
    for (enum pipe_shader_type i = 0; i < PIPE_SHADER_TYPES; i++) {
       struct vrend_shader_selector *sel = shaders[i];
       if (!sel)
@@ -5717,8 +8177,23 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
          if (!vrend_compile_shader(sub_ctx, shader))
             return PROGRAMM_ERROR;
       }
-      if (vrend_state.use_gles && sel->sinfo.gles_use_tex_query_level)
-         gles_emulate_query_texture_levels_mask |= 1 << i;
+   }
+
+   /* the variants that are new, or the injected TCS, are registered once
+    * all the stages of the draw are compiled */
+   if (sub_ctx->parent->predictor) {
+      uint32_t new_mask = 0;
+
+      for (enum pipe_shader_type i = PIPE_SHADER_VERTEX; i < PIPE_SHADER_COMPUTE; i++) {
+         if (shaders[i] && shaders[i]->current && !shaders[i]->current->combo_sub_ctx) {
+            vrend_register_combo_variant(sub_ctx, shaders[i]->current);
+            new_mask |= 1 << i;
+         }
+      }
+      while (new_mask) {
+         enum pipe_shader_type i = u_bit_scan(&new_mask);
+         vrend_link_predicted_programs(sub_ctx, shaders[i]->current);
+      }
    }
 
    if (!shaders[PIPE_SHADER_VERTEX]->current ||
@@ -5766,10 +8241,10 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
                                    gs_id ? sub_ctx->shaders[PIPE_SHADER_GEOMETRY]->current : NULL,
                                    tcs_id ? sub_ctx->shaders[PIPE_SHADER_TESS_CTRL]->current : NULL,
                                    tes_id ? sub_ctx->shaders[PIPE_SHADER_TESS_EVAL]->current : NULL,
-                                   separable);
+                                   dual_src, separable);
          if (!prog)
             return PROGRAMM_ERROR;
-         prog->gles_use_query_texturelevel_mask = gles_emulate_query_texture_levels_mask;
+         vrend_record_program_combo(sub_ctx, prog);
       } else if (separable) {
           /* UBO block bindings are reset to zero if the programs are
            * re-linked.  With separable shaders, the program can be relinked
@@ -5795,6 +8270,14 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
           }
       }
 
+      if (prog->link_job || prog->link_pending) {
+         bool wait = !early_link && !vrend_state.skip_pending_programs;
+         if (!vrend_shader_program_is_linked(prog, wait))
+            return PROGRAMM_PENDING;
+         if (!vrend_finish_shader_program(sub_ctx, prog))
+            return PROGRAMM_ERROR;
+      }
+
       sub_ctx->last_shader_idx = sub_ctx->shaders[PIPE_SHADER_TESS_EVAL] ? PIPE_SHADER_TESS_EVAL : (sub_ctx->shaders[PIPE_SHADER_GEOMETRY] ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
    } else
       prog = sub_ctx->prog;
@@ -5815,6 +8298,7 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
          sub_ctx->const_bufs_dirty[stage] = ~0;
          sub_ctx->views[stage].dirty_mask = ~0;
       }
+      vrend_mark_shader_buffers_dirty(sub_ctx, PIPE_SHADER_VERTEX, PIPE_SHADER_TESS_EVAL);
 
       prog->ref_context = sub_ctx;
    }
@@ -5866,30 +8350,210 @@ void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles)
        if (ctx->sub->shaders[type] && ctx->sub->shaders[type]->sinfo.separable_program) {
            if (!ctx->sub->shaders[type]->current->is_compiled)
                vrend_compile_shader(ctx->sub, ctx->sub->shaders[type]->current);
-           if (!ctx->sub->shaders[type]->current->is_linked)
+           if (!ctx->sub->shaders[type]->current->is_linked &&
+               !ctx->sub->shaders[type]->current->link_pending)
                vrend_link_separable_shader(ctx->sub, ctx->sub->shaders[type]->current, type);
        }
    }
 
-   /* Force early-link of the whole shader program. */
-   vrend_select_program(ctx->sub, 1);
+   /* Force early-link of the whole shader program, with shader threads the
+    * link is only started here. */
+   vrend_select_program(ctx->sub, 1, true);
 
    ctx->sub->shader_dirty = true;
    ctx->sub->cs_shader_dirty = true;
 
-   /* undo state changes */
-   for (enum pipe_shader_type type = 0; type < PIPE_SHADER_TYPES; ++type) {
-      vrend_shader_state_reference(&ctx->sub->shaders[type], prev_handles[type]);
-      vrend_shader_state_reference(&prev_handles[type], NULL);
+   /* undo state changes */
+   for (enum pipe_shader_type type = 0; type < PIPE_SHADER_TYPES; ++type) {
+      vrend_shader_state_reference(&ctx->sub->shaders[type], prev_handles[type]);
+      vrend_shader_state_reference(&prev_handles[type], NULL);
+   }
+   memcpy(ctx->sub->prog_ids, prev_shader_ids, PIPE_SHADER_TYPES * sizeof(uint32_t));
+   ctx->sub->prog = prev_prog;
+}
+
+static GLenum vrend_index_size_to_gl(uint32_t index_size)
+{
+   switch (index_size) {
+   case 1:
+      return GL_UNSIGNED_BYTE;
+   case 2:
+      return GL_UNSIGNED_SHORT;
+   case 4:
+   default:
+      return GL_UNSIGNED_INT;
+   }
+}
+
+static void vrend_emit_draw(struct vrend_sub_context *sub_ctx,
+                            const struct pipe_draw_info *info,
+                            uint32_t cso, bool indirect, bool indirect_params,
+                            uint32_t ib_offset)
+{
+   if (!info->indexed) {
+      GLenum mode = info->mode;
+      int count = cso ? cso : info->count;
+      int start = cso ? 0 : info->start;
+
+      if (indirect) {
+         if (indirect_params)
+            glMultiDrawArraysIndirectCountARB(mode, (GLvoid const *)(uintptr_t)info->indirect.offset,
+                                              info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
+         else if (info->indirect.draw_count > 1)
+            glMultiDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
+         else
+            glDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset);
+      } else if (info->instance_count > 0) {
+         if (info->start_instance > 0)
+            glDrawArraysInstancedBaseInstance(mode, start, count, info->instance_count, info->start_instance);
+         else
+            glDrawArraysInstancedARB(mode, start, count, info->instance_count);
+      } else
+         glDrawArrays(mode, start, count);
+   } else {
+      GLenum elsz = vrend_index_size_to_gl(sub_ctx->ib.index_size);
+      GLenum mode = info->mode;
+
+      if (indirect) {
+         if (indirect_params)
+            glMultiDrawElementsIndirectCountARB(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset,
+                                                info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
+         else if (info->indirect.draw_count > 1)
+            glMultiDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
+         else
+            glDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset);
+      } else if (info->index_bias) {
+         if (info->instance_count > 0) {
+            if (info->start_instance > 0)
+               glDrawElementsInstancedBaseVertexBaseInstance(mode, info->count, elsz, (void *)(uintptr_t)ib_offset,
+                                                             info->instance_count, info->index_bias, info->start_instance);
+            else
+               glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)ib_offset, info->instance_count, info->index_bias);
+
+
+         } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
+            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)ib_offset, info->index_bias);
+         else
+            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)ib_offset, info->index_bias);
+      } else if (info->instance_count > 0) {
+         if (info->start_instance > 0) {
+            glDrawElementsInstancedBaseInstance(mode, info->count, elsz, (void *)(uintptr_t)ib_offset, info->instance_count, info->start_instance);
+         } else
+            glDrawElementsInstancedARB(mode, info->count, elsz, (void *)(uintptr_t)ib_offset, info->instance_count);
+      } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
+         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)ib_offset);
+      else
+         glDrawElements(mode, info->count, elsz, (void *)(uintptr_t)ib_offset);
+   }
+}
+
+static void vrend_emit_draw_batch(struct vrend_sub_context *sub_ctx,
+                                  const struct vrend_draw_batch *batch)
+{
+   const struct pipe_draw_info *first = &batch->draws[0].info;
+   struct vrend_resource *ib = (struct vrend_resource *)sub_ctx->ib.buffer;
+   bool drawid_uniform = has_feature(feat_draw_parameters) && sub_ctx->prog->reads_drawid;
+   bool multi_draw = batch->num_draws > 1 && has_feature(feat_multi_draw) &&
+                     (!drawid_uniform || batch->sequential_drawid);
+   GLint starts[VREND_DRAW_BATCH_MAX];
+   GLsizei counts[VREND_DRAW_BATCH_MAX];
+   const GLvoid *indices[VREND_DRAW_BATCH_MAX];
+   GLint index_biases[VREND_DRAW_BATCH_MAX];
+   GLsizei num_draws = 0;
+
+   for (uint32_t i = 0; i < batch->num_draws; i++) {
+      const struct vrend_draw_batch_entry *draw = &batch->draws[i];
+
+      if (first->indexed) {
+         uint32_t expected_size = sub_ctx->ib.index_size * draw->info.count + draw->ib_offset;
+         if (expected_size > ib->base.width0) {
+            virgl_error("Indexed array buffer (%u) not large enough for draw operation "
+                        "(req. %u\n", ib->base.width0, expected_size);
+            continue;
+         }
+      }
+
+      if (!multi_draw) {
+         if (drawid_uniform && sub_ctx->sysvalue_data.drawid_base != (int)draw->info.drawid) {
+            sub_ctx->sysvalue_data.drawid_base = draw->info.drawid;
+            sub_ctx->sysvalue_data_cookie++;
+            vrend_fill_sysval_uniform_block(sub_ctx);
+         }
+         vrend_emit_draw(sub_ctx, &draw->info, 0, false, false, draw->ib_offset);
+         continue;
+      }
+
+      starts[num_draws] = draw->info.start;
+      counts[num_draws] = draw->info.count;
+      indices[num_draws] = (const GLvoid *)(uintptr_t)draw->ib_offset;
+      index_biases[num_draws] = draw->info.index_bias;
+      num_draws++;
+   }
+
+   if (!num_draws)
+      return;
+
+   if (first->indexed)
+      glMultiDrawElementsBaseVertex(first->mode, counts,
+                                    vrend_index_size_to_gl(sub_ctx->ib.index_size),
+                                    indices, num_draws, index_biases);
+   else
+      glMultiDrawArrays(first->mode, starts, counts, num_draws);
+}
+
+/* the bound buffers are used by the draws without being looked up again,
+ * they are marked used once per eviction epoch, and restored when evicted */
+static void vrend_sub_ctx_touch_buffers(struct vrend_sub_context *sub_ctx)
+{
+   if (likely(sub_ctx->buffers_touched_epoch == vrend_state.evict_epoch &&
+              !vrend_state.num_evicted_buffers))
+      return;
+
+   sub_ctx->buffers_touched_epoch = vrend_state.evict_epoch;
+
+   for (int i = 0; i < sub_ctx->num_vbos; i++)
+      vrend_resource_touch((struct vrend_resource *)sub_ctx->vbo[i].base.buffer);
+   vrend_resource_touch((struct vrend_resource *)sub_ctx->ib.buffer);
+
+   for (int shader = 0; shader < PIPE_SHADER_TYPES; shader++) {
+      uint32_t mask = sub_ctx->const_bufs_used_mask[shader];
+      while (mask) {
+         const int i = u_bit_scan(&mask);
+         vrend_resource_touch((struct vrend_resource *)sub_ctx->cbs[shader][i].buffer);
+      }
+
+      mask = sub_ctx->ssbo_used_mask[shader];
+      while (mask)
+         vrend_resource_touch(sub_ctx->ssbo[shader][u_bit_scan(&mask)].res);
+
+      mask = sub_ctx->images_used_mask[shader];
+      while (mask)
+         vrend_resource_touch(sub_ctx->image_views[shader][u_bit_scan(&mask)].texture);
+
+      for (int i = 0; i < sub_ctx->views[shader].max_num_views; i++) {
+         const struct vrend_sampler_view *view = sub_ctx->views[shader].views[i];
+         if (view)
+            vrend_resource_touch(view->texture);
+      }
+   }
+
+   uint32_t mask = sub_ctx->abo_used_mask;
+   while (mask)
+      vrend_resource_touch(sub_ctx->abo[u_bit_scan(&mask)].res);
+
+   if (sub_ctx->current_so) {
+      for (uint32_t i = 0; i < sub_ctx->current_so->key.num_targets; i++)
+         vrend_resource_touch(sub_ctx->current_so->so_targets[i]->buffer);
    }
-   memcpy(ctx->sub->prog_ids, prev_shader_ids, PIPE_SHADER_TYPES * sizeof(uint32_t));
-   ctx->sub->prog = prev_prog;
 }
 
-int vrend_draw_vbo(struct vrend_context *ctx,
-                   const struct pipe_draw_info *info,
-                   uint32_t cso, uint32_t indirect_handle,
-                   uint32_t indirect_draw_count_handle)
+/* With a batch, info is the first draw of the batch and all the state but
+ * the ranges is taken from it. */
+static int vrend_draw_vbo_emit(struct vrend_context *ctx,
+                               const struct pipe_draw_info *info,
+                               uint32_t cso, uint32_t indirect_handle,
+                               uint32_t indirect_draw_count_handle,
+                               const struct vrend_draw_batch *batch)
 {
    enum select_program_result program_select_result = PROGRAMM_NO_CHANGE;
    struct vrend_resource *indirect_res = NULL;
@@ -5899,6 +8563,8 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (ctx->in_error)
       return ENOTRECOVERABLE;
 
+   vrend_sub_ctx_touch_buffers(sub_ctx);
+
    if (info->instance_count && !has_feature(feat_draw_instance))
       return EINVAL;
 
@@ -5955,9 +8621,15 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       sub_ctx->prim_mode = (int)info->mode;
    }
 
-   if (sub_ctx->shader_dirty || sub_ctx->swizzle_output_rgb_to_bgr ||
-       sub_ctx->needs_manual_srgb_encode_bitmask || sub_ctx->vbo_dirty)
-      program_select_result = vrend_select_program(sub_ctx, info->vertices_per_patch);
+   /* the output swizzles and sRGB encodes only change with the framebuffer,
+    * which marks the shaders dirty */
+   if (sub_ctx->shader_dirty || sub_ctx->vbo_dirty)
+      program_select_result = vrend_select_program(sub_ctx, info->vertices_per_patch, false);
+
+   if (program_select_result == PROGRAMM_PENDING) {
+      VREND_DEBUG(dbg_shader, ctx, "Skipping draw, program is still being linked\n");
+      return 0;
+   }
 
    if (!sub_ctx->prog || program_select_result == PROGRAMM_ERROR) {
       virgl_error("Dropping rendering due to missing shaders: %s\n", ctx->debug_name);
@@ -5996,7 +8668,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       if (sub_ctx->ve) {
          vrend_draw_bind_vertex_binding(ctx, sub_ctx->ve);
       } else {
-         glBindVertexArray(sub_ctx->vaoid);
+         vrend_gl_bind_vertex_array(sub_ctx->vaoid);
       }
    } else {
       if (sub_ctx->ve) {
@@ -6015,7 +8687,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
          return 0;
       }
 
-      if (!indirect_handle) {
+      if (!indirect_handle && !batch) {
          uint32_t expected_size = sub_ctx->ib.index_size * info->count + sub_ctx->ib.offset;
          if (expected_size > res->base.width0) {
             virgl_error("Indexed array buffer (%u) not large enough for draw operation "
@@ -6024,9 +8696,9 @@ int vrend_draw_vbo(struct vrend_context *ctx,
          }
       }
 
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, res->gl_id);
+      vrend_gl_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, res->gl_id);
    } else
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+      vrend_gl_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
    if (sub_ctx->current_so) {
       if (sub_ctx->current_so->xfb_state == XFB_STATE_STARTED_NEED_BEGIN) {
@@ -6046,9 +8718,9 @@ int vrend_draw_vbo(struct vrend_context *ctx,
 
    if (info->primitive_restart) {
       if (vrend_state.use_gles) {
-         glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+         vrend_gl_enable(GL_PRIMITIVE_RESTART_FIXED_INDEX, true);
       } else if (has_feature(feat_gl_prim_restart)) {
-         glEnable(GL_PRIMITIVE_RESTART);
+         vrend_gl_enable(GL_PRIMITIVE_RESTART, true);
          glPrimitiveRestartIndex(info->restart_index);
       } else if (has_feature(feat_nv_prim_restart)) {
          glEnableClientState(GL_PRIMITIVE_RESTART_NV);
@@ -6058,11 +8730,11 @@ int vrend_draw_vbo(struct vrend_context *ctx,
 
    if (has_feature(feat_indirect_draw)) {
       GLint buf = indirect_res ? indirect_res->gl_id : 0;
-      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buf);
+      vrend_gl_bind_buffer(GL_DRAW_INDIRECT_BUFFER, buf);
 
       if (has_feature(feat_indirect_params)) {
          GLint buf = indirect_params_res ? indirect_params_res->gl_id : 0;
-         glBindBuffer(GL_PARAMETER_BUFFER_ARB, buf);
+         vrend_gl_bind_buffer(GL_PARAMETER_BUFFER_ARB, buf);
       }
    }
 
@@ -6085,83 +8757,20 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (use_advanced_blending) {
       GLenum blend = translate_blend_func_advanced(blend_mode);
       glBlendEquation(blend);
-      glEnable(GL_BLEND);
+      vrend_gl_enable(GL_BLEND, true);
    }
 
-   /* set the vertex state up now on a delay */
-   if (!info->indexed) {
-      GLenum mode = info->mode;
-      int count = cso ? cso : info->count;
-      int start = cso ? 0 : info->start;
-
-      if (indirect_handle) {
-         if (indirect_params_res)
-            glMultiDrawArraysIndirectCountARB(mode, (GLvoid const *)(uintptr_t)info->indirect.offset,
-                                              info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
-         else if (info->indirect.draw_count > 1)
-            glMultiDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
-         else
-            glDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset);
-      } else if (info->instance_count > 0) {
-         if (info->start_instance > 0)
-            glDrawArraysInstancedBaseInstance(mode, start, count, info->instance_count, info->start_instance);
-         else
-            glDrawArraysInstancedARB(mode, start, count, info->instance_count);
-      } else
-         glDrawArrays(mode, start, count);
-   } else {
-      GLenum elsz;
-      GLenum mode = info->mode;
-      switch (sub_ctx->ib.index_size) {
-      case 1:
-         elsz = GL_UNSIGNED_BYTE;
-         break;
-      case 2:
-         elsz = GL_UNSIGNED_SHORT;
-         break;
-      case 4:
-      default:
-         elsz = GL_UNSIGNED_INT;
-         break;
-      }
-
-      if (indirect_handle) {
-         if (indirect_params_res)
-            glMultiDrawElementsIndirectCountARB(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset,
-                                                info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
-         else if (info->indirect.draw_count > 1)
-            glMultiDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
-         else
-            glDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset);
-      } else if (info->index_bias) {
-         if (info->instance_count > 0) {
-            if (info->start_instance > 0)
-               glDrawElementsInstancedBaseVertexBaseInstance(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset,
-                                                             info->instance_count, info->index_bias, info->start_instance);
-            else
-               glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset, info->instance_count, info->index_bias);
-
-
-         } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset, info->index_bias);
-         else
-            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset, info->index_bias);
-      } else if (info->instance_count > 0) {
-         if (info->start_instance > 0) {
-            glDrawElementsInstancedBaseInstance(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset, info->instance_count, info->start_instance);
-         } else
-            glDrawElementsInstancedARB(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset, info->instance_count);
-      } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset);
-      else
-         glDrawElements(mode, info->count, elsz, (void *)(uintptr_t)sub_ctx->ib.offset);
-   }
+   if (batch)
+      vrend_emit_draw_batch(sub_ctx, batch);
+   else
+      vrend_emit_draw(sub_ctx, info, cso, indirect_handle != 0,
+                      indirect_params_res != NULL, sub_ctx->ib.offset);
 
    if (info->primitive_restart) {
       if (vrend_state.use_gles) {
-         glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+         vrend_gl_enable(GL_PRIMITIVE_RESTART_FIXED_INDEX, false);
       } else if (has_feature(feat_gl_prim_restart)) {
-         glDisable(GL_PRIMITIVE_RESTART);
+         vrend_gl_enable(GL_PRIMITIVE_RESTART, false);
       } else if (has_feature(feat_nv_prim_restart)) {
          glDisableClientState(GL_PRIMITIVE_RESTART_NV);
       }
@@ -6175,10 +8784,108 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    }
 
    if (use_advanced_blending)
-      glDisable(GL_BLEND);
+      vrend_gl_enable(GL_BLEND, false);
+   return 0;
+}
+
+static bool vrend_draw_is_batchable(const struct vrend_context *ctx,
+                                    const struct pipe_draw_info *info,
+                                    uint32_t cso, uint32_t indirect_handle,
+                                    uint32_t indirect_draw_count_handle)
+{
+   /* anything vrend_draw_vbo_emit would reject is left to it */
+   return vrend_state.use_draw_batching && !ctx->in_error &&
+          !cso && !indirect_handle && !indirect_draw_count_handle &&
+          !info->indirect.draw_count && !info->start_instance &&
+          (info->instance_count == 0 ||
+           (info->instance_count == 1 && has_feature(feat_draw_instance)));
+}
+
+/* index buffer changes flush the batch in vrend_set_index_buffer, every
+ * other state change goes through a command that flushes it first */
+static bool vrend_draw_batch_accepts(const struct vrend_draw_batch *batch,
+                                     const struct pipe_draw_info *info)
+{
+   const struct pipe_draw_info *first = &batch->draws[0].info;
+
+   return batch->num_draws < VREND_DRAW_BATCH_MAX &&
+          info->mode == first->mode &&
+          info->indexed == first->indexed &&
+          info->primitive_restart == first->primitive_restart &&
+          (!info->primitive_restart || info->restart_index == first->restart_index) &&
+          info->vertices_per_patch == first->vertices_per_patch;
+}
+
+int vrend_draw_vbo(struct vrend_context *ctx,
+                   const struct pipe_draw_info *info,
+                   uint32_t cso, uint32_t indirect_handle,
+                   uint32_t indirect_draw_count_handle)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+   struct vrend_draw_batch *batch = &sub_ctx->draw_batch;
+   int ret;
+
+   if (!vrend_draw_is_batchable(ctx, info, cso, indirect_handle, indirect_draw_count_handle)) {
+      ret = vrend_flush_draws(ctx);
+      if (ret)
+         return ret;
+      return vrend_draw_vbo_emit(ctx, info, cso, indirect_handle, indirect_draw_count_handle, NULL);
+   }
+
+   if (batch->num_draws && !vrend_draw_batch_accepts(batch, info)) {
+      ret = vrend_flush_draws(ctx);
+      if (ret)
+         return ret;
+   }
+
+   struct vrend_draw_batch_entry *draw = &batch->draws[batch->num_draws];
+   draw->info = *info;
+   draw->ib_offset = sub_ctx->ib.offset;
+
+   if (!batch->num_draws) {
+      batch->sequential_drawid = true;
+      batch->cmd_index = vrend_current_command.index;
+      batch->cmd_name = vrend_current_command.name;
+   } else if (info->drawid != batch->draws[0].info.drawid + batch->num_draws)
+      batch->sequential_drawid = false;
+   batch->num_draws++;
+
    return 0;
 }
 
+int vrend_flush_draws(struct vrend_context *ctx)
+{
+   struct vrend_draw_batch *batch = &ctx->sub->draw_batch;
+   int ret;
+
+   if (!batch->num_draws)
+      return 0;
+
+   /* the GL errors of the batch are those of its first draw */
+   const uint32_t cur_index = vrend_current_command.index;
+   const char *cur_name = vrend_current_command.name;
+   vrend_renderer_set_current_command(batch->cmd_index, batch->cmd_name);
+
+   ret = vrend_draw_vbo_emit(ctx, &batch->draws[0].info, 0, 0, 0, batch);
+   batch->num_draws = 0;
+   batch->failed = ret != 0;
+
+   vrend_renderer_set_current_command(cur_index, cur_name);
+   return ret;
+}
+
+bool vrend_take_draw_batch_failure(struct vrend_context *ctx, uint32_t *cmd_index)
+{
+   struct vrend_draw_batch *batch = &ctx->sub->draw_batch;
+
+   if (!batch->failed)
+      return false;
+
+   batch->failed = false;
+   *cmd_index = batch->cmd_index;
+   return true;
+}
+
 void vrend_launch_grid(struct vrend_context *ctx,
                        UNUSED uint32_t *block,
                        uint32_t *grid,
@@ -6193,6 +8900,8 @@ void vrend_launch_grid(struct vrend_context *ctx,
 
     struct vrend_sub_context *sub_ctx = ctx->sub;
 
+   vrend_sub_ctx_touch_buffers(sub_ctx);
+
    if (sub_ctx->cs_shader_dirty) {
       struct vrend_linked_shader_program *prog;
       bool cs_dirty;
@@ -6240,15 +8949,25 @@ void vrend_launch_grid(struct vrend_context *ctx,
       return;
    }
 
-   vrend_use_program(sub_ctx->prog);
+   /* nothing can have changed the state since the previous dispatch of
+    * the run */
+   if (!sub_ctx->cs_bindings_current || new_program) {
+      vrend_use_program(sub_ctx->prog);
 
-   vrend_set_active_pipeline_stage(sub_ctx->prog, PIPE_SHADER_COMPUTE);
-   vrend_draw_bind_ubo_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
-   vrend_draw_bind_const_shader(sub_ctx, PIPE_SHADER_COMPUTE, new_program);
-   vrend_draw_bind_samplers_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
-   vrend_draw_bind_images_shader(sub_ctx, PIPE_SHADER_COMPUTE);
-   vrend_draw_bind_ssbo_shader(sub_ctx, PIPE_SHADER_COMPUTE);
-   vrend_draw_bind_abo_shader(sub_ctx);
+      vrend_set_active_pipeline_stage(sub_ctx->prog, PIPE_SHADER_COMPUTE);
+      vrend_draw_bind_ubo_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
+      vrend_draw_bind_const_shader(sub_ctx, PIPE_SHADER_COMPUTE, new_program);
+      vrend_draw_bind_samplers_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
+      if (new_program)
+         vrend_mark_shader_buffers_dirty(sub_ctx, PIPE_SHADER_COMPUTE, PIPE_SHADER_COMPUTE);
+      vrend_draw_bind_images_shader(sub_ctx, PIPE_SHADER_COMPUTE);
+      vrend_draw_bind_ssbo_shader(sub_ctx, PIPE_SHADER_COMPUTE);
+      vrend_draw_bind_abo_shader(sub_ctx);
+      /* the dispatch overwrote the bindings of the graphics stages */
+      vrend_mark_shader_buffers_dirty(sub_ctx, PIPE_SHADER_VERTEX, PIPE_SHADER_TESS_EVAL);
+      sub_ctx->cs_bindings_current = vrend_state.use_dispatch_runs;
+   }
+   vrend_track_shader_writes(sub_ctx, PIPE_SHADER_COMPUTE, PIPE_SHADER_COMPUTE);
 
    if (indirect_handle) {
       indirect_res = vrend_renderer_ctx_res_lookup(ctx, indirect_handle);
@@ -6259,9 +8978,9 @@ void vrend_launch_grid(struct vrend_context *ctx,
    }
 
    if (indirect_res)
-      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, indirect_res->gl_id);
+      vrend_gl_bind_buffer(GL_DISPATCH_INDIRECT_BUFFER, indirect_res->gl_id);
    else
-      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+      vrend_gl_bind_buffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
    if (indirect_res) {
       glDispatchComputeIndirect(indirect_offset);
@@ -6422,10 +9141,10 @@ static void vrend_hw_emit_blend(struct vrend_sub_context *sub_ctx, struct pipe_b
          else
             report_gles_warn(sub_ctx->parent, GLES_WARN_LOGIC_OP);
       } else if (state->logicop_enable) {
-         glEnable(GL_COLOR_LOGIC_OP);
+         vrend_gl_enable(GL_COLOR_LOGIC_OP, true);
          glLogicOp(translate_logicop(state->logicop_func));
       } else {
-         glDisable(GL_COLOR_LOGIC_OP);
+         vrend_gl_enable(GL_COLOR_LOGIC_OP, false);
       }
    }
 
@@ -6450,9 +9169,9 @@ static void vrend_hw_emit_blend(struct vrend_sub_context *sub_ctx, struct pipe_b
                                     translate_blend_factor(state->rt[i].alpha_dst_factor));
             glBlendEquationSeparateiARB(i, translate_blend_func(state->rt[i].rgb_func),
                                         translate_blend_func(state->rt[i].alpha_func));
-            glEnableIndexedEXT(GL_BLEND, i);
+            vrend_gl_enable_indexed(GL_BLEND, i, true);
          } else
-            glDisableIndexedEXT(GL_BLEND, i);
+            vrend_gl_enable_indexed(GL_BLEND, i, false);
 
          if (state->rt[i].colormask != sub_ctx->hw_blend_state.rt[i].colormask) {
             sub_ctx->hw_blend_state.rt[i].colormask = state->rt[i].colormask;
@@ -6474,10 +9193,10 @@ static void vrend_hw_emit_blend(struct vrend_sub_context *sub_ctx, struct pipe_b
                              translate_blend_factor(state->rt[0].alpha_dst_factor));
          glBlendEquationSeparate(translate_blend_func(state->rt[0].rgb_func),
                                  translate_blend_func(state->rt[0].alpha_func));
-         glEnable(GL_BLEND);
+         vrend_gl_enable(GL_BLEND, true);
       }
       else
-         glDisable(GL_BLEND);
+         vrend_gl_enable(GL_BLEND, false);
 
       if (state->rt[0].colormask != sub_ctx->hw_blend_state.rt[0].colormask ||
           (sub_ctx->hw_blend_state.independent_blend_enable &&
@@ -6494,22 +9213,22 @@ static void vrend_hw_emit_blend(struct vrend_sub_context *sub_ctx, struct pipe_b
 
    if (has_feature(feat_multisample)) {
       if (state->alpha_to_coverage)
-         glEnable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+         vrend_gl_enable(GL_SAMPLE_ALPHA_TO_COVERAGE, true);
       else
-         glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+         vrend_gl_enable(GL_SAMPLE_ALPHA_TO_COVERAGE, false);
 
       if (!vrend_state.use_gles) {
          if (state->alpha_to_one)
-            glEnable(GL_SAMPLE_ALPHA_TO_ONE);
+            vrend_gl_enable(GL_SAMPLE_ALPHA_TO_ONE, true);
          else
-            glDisable(GL_SAMPLE_ALPHA_TO_ONE);
+            vrend_gl_enable(GL_SAMPLE_ALPHA_TO_ONE, false);
       }
    }
 
    if (state->dither)
-      glEnable(GL_DITHER);
+      vrend_gl_enable(GL_DITHER, true);
    else
-      glDisable(GL_DITHER);
+      vrend_gl_enable(GL_DITHER, false);
 }
 
 /* there are a few reasons we might need to patch the blend state.
@@ -6583,7 +9302,7 @@ void vrend_object_bind_blend(struct vrend_context *ctx,
 
    if (handle == 0) {
       memset(&ctx->sub->blend_state, 0, sizeof(ctx->sub->blend_state));
-      glDisable(GL_BLEND);
+      vrend_gl_enable(GL_BLEND, false);
       return;
    }
    state = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_BLEND);
@@ -6743,9 +9462,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
 
    if (has_feature(feat_depth_clamp)) {
       if (state->depth_clip)
-         glDisable(GL_DEPTH_CLAMP);
+         vrend_gl_enable(GL_DEPTH_CLAMP, false);
       else
-         glEnable(GL_DEPTH_CLAMP);
+         vrend_gl_enable(GL_DEPTH_CLAMP, true);
    }
 
    if (vrend_state.use_gles) {
@@ -6756,9 +9475,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POINT_SIZE);
       }
    } else if (state->point_size_per_vertex) {
-      glEnable(GL_PROGRAM_POINT_SIZE);
+      vrend_gl_enable(GL_PROGRAM_POINT_SIZE, true);
    } else {
-      glDisable(GL_PROGRAM_POINT_SIZE);
+      vrend_gl_enable(GL_PROGRAM_POINT_SIZE, false);
       if (state->point_size) {
          glPointSize(state->point_size);
       }
@@ -6770,9 +9489,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (state->rasterizer_discard != ctx->sub->hw_rs_state.rasterizer_discard) {
       ctx->sub->hw_rs_state.rasterizer_discard = state->rasterizer_discard;
       if (state->rasterizer_discard)
-         glEnable(GL_RASTERIZER_DISCARD);
+         vrend_gl_enable(GL_RASTERIZER_DISCARD, true);
       else
-         glDisable(GL_RASTERIZER_DISCARD);
+         vrend_gl_enable(GL_RASTERIZER_DISCARD, false);
    }
 
 
@@ -6792,9 +9511,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       report_core_warn(ctx, CORE_PROFILE_WARN_POLYGON_MODE);
 
    if (state->offset_tri) {
-      glEnable(GL_POLYGON_OFFSET_FILL);
+      vrend_gl_enable(GL_POLYGON_OFFSET_FILL, true);
    } else {
-      glDisable(GL_POLYGON_OFFSET_FILL);
+      vrend_gl_enable(GL_POLYGON_OFFSET_FILL, false);
    }
 
    if (vrend_state.use_gles) {
@@ -6802,9 +9521,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_OFFSET_LINE);
       }
    } else if (state->offset_line) {
-      glEnable(GL_POLYGON_OFFSET_LINE);
+      vrend_gl_enable(GL_POLYGON_OFFSET_LINE, true);
    } else {
-      glDisable(GL_POLYGON_OFFSET_LINE);
+      vrend_gl_enable(GL_POLYGON_OFFSET_LINE, false);
    }
 
    if (vrend_state.use_gles) {
@@ -6812,9 +9531,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_OFFSET_POINT);
       }
    } else if (state->offset_point) {
-      glEnable(GL_POLYGON_OFFSET_POINT);
+      vrend_gl_enable(GL_POLYGON_OFFSET_POINT, true);
    } else {
-      glDisable(GL_POLYGON_OFFSET_POINT);
+      vrend_gl_enable(GL_POLYGON_OFFSET_POINT, false);
    }
 
 
@@ -6860,15 +9579,15 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
 
    if (!vrend_shader_use_core(ctx)) {
       if (state->poly_stipple_enable)
-         glEnable(GL_POLYGON_STIPPLE);
+         vrend_gl_enable(GL_POLYGON_STIPPLE, true);
       else
-         glDisable(GL_POLYGON_STIPPLE);
+         vrend_gl_enable(GL_POLYGON_STIPPLE, false);
    }
 
    if (state->point_quad_rasterization) {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glEnable(GL_POINT_SPRITE);
+         vrend_gl_enable(GL_POINT_SPRITE, true);
       }
 
       if (vrend_state.use_gles == false) {
@@ -6877,7 +9596,7 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    } else {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glDisable(GL_POINT_SPRITE);
+         vrend_gl_enable(GL_POINT_SPRITE, false);
       }
    }
 
@@ -6895,25 +9614,25 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       default:
          virgl_warn("Unhandled cull-face: %x\n", state->cull_face);
       }
-      glEnable(GL_CULL_FACE);
+      vrend_gl_enable(GL_CULL_FACE, true);
    } else
-      glDisable(GL_CULL_FACE);
+      vrend_gl_enable(GL_CULL_FACE, false);
 
    /* two sided lighting handled in shader for core profile */
    if (vrend_state.use_core_profile == false) {
       if (state->light_twoside)
-         glEnable(GL_VERTEX_PROGRAM_TWO_SIDE);
+         vrend_gl_enable(GL_VERTEX_PROGRAM_TWO_SIDE, true);
       else
-         glDisable(GL_VERTEX_PROGRAM_TWO_SIDE);
+         vrend_gl_enable(GL_VERTEX_PROGRAM_TWO_SIDE, false);
    }
 
    if (state->clip_plane_enable != ctx->sub->hw_rs_state.clip_plane_enable) {
       ctx->sub->hw_rs_state.clip_plane_enable = state->clip_plane_enable;
       for (i = 0; i < 8; i++) {
          if (state->clip_plane_enable & (1 << i))
-            glEnable(GL_CLIP_PLANE0 + i);
+            vrend_gl_enable(GL_CLIP_PLANE0 + i, true);
          else
-            glDisable(GL_CLIP_PLANE0 + i);
+            vrend_gl_enable(GL_CLIP_PLANE0 + i, false);
       }
 
       ctx->sub->sysvalue_data_cookie++;
@@ -6926,9 +9645,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (vrend_state.use_core_profile == false) {
       glLineStipple(state->line_stipple_factor, state->line_stipple_pattern);
       if (state->line_stipple_enable)
-         glEnable(GL_LINE_STIPPLE);
+         vrend_gl_enable(GL_LINE_STIPPLE, true);
       else
-         glDisable(GL_LINE_STIPPLE);
+         vrend_gl_enable(GL_LINE_STIPPLE, false);
    } else if (state->line_stipple_enable) {
       if (vrend_state.use_gles)
          report_core_warn(ctx, GLES_WARN_STIPPLE);
@@ -6942,9 +9661,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_LINE_SMOOTH);
       }
    } else if (state->line_smooth) {
-      glEnable(GL_LINE_SMOOTH);
+      vrend_gl_enable(GL_LINE_SMOOTH, true);
    } else {
-      glDisable(GL_LINE_SMOOTH);
+      vrend_gl_enable(GL_LINE_SMOOTH, false);
    }
 
    if (vrend_state.use_gles) {
@@ -6952,9 +9671,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POLY_SMOOTH);
       }
    } else if (state->poly_smooth) {
-      glEnable(GL_POLYGON_SMOOTH);
+      vrend_gl_enable(GL_POLYGON_SMOOTH, true);
    } else {
-      glDisable(GL_POLYGON_SMOOTH);
+      vrend_gl_enable(GL_POLYGON_SMOOTH, false);
    }
 
    if (vrend_state.use_core_profile == false) {
@@ -6975,31 +9694,31 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (has_feature(feat_multisample)) {
       if (has_feature(feat_sample_mask)) {
          if (state->multisample)
-            glEnable(GL_SAMPLE_MASK);
+            vrend_gl_enable(GL_SAMPLE_MASK, true);
          else
-            glDisable(GL_SAMPLE_MASK);
+            vrend_gl_enable(GL_SAMPLE_MASK, false);
       }
 
       /* GLES doesn't have GL_MULTISAMPLE */
       if (!vrend_state.use_gles) {
          if (state->multisample)
-            glEnable(GL_MULTISAMPLE);
+            vrend_gl_enable(GL_MULTISAMPLE, true);
          else
-            glDisable(GL_MULTISAMPLE);
+            vrend_gl_enable(GL_MULTISAMPLE, false);
       }
 
       if (has_feature(feat_sample_shading)) {
          if (state->force_persample_interp)
-            glEnable(GL_SAMPLE_SHADING);
+            vrend_gl_enable(GL_SAMPLE_SHADING, true);
          else
-            glDisable(GL_SAMPLE_SHADING);
+            vrend_gl_enable(GL_SAMPLE_SHADING, false);
       }
    }
 
    if (state->scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, true);
    else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, false);
    ctx->sub->hw_rs_state.scissor = state->scissor;
 
 }
@@ -7062,11 +9781,12 @@ void vrend_bind_sampler_states(struct vrend_context *ctx,
    }
 }
 
-static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
-                                      struct vrend_resource *res,
-                                      struct vrend_sampler_state *sampler_state,
-                                      GLuint sampler_id,
-                                      struct vrend_sampler_view *tview)
+/* Returns the GL sampler to bind to the unit of the texture, or 0 when the
+ * sampler state was set on the texture itself. */
+static GLuint vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
+                                        struct vrend_resource *res,
+                                        struct vrend_sampler_state *sampler_state,
+                                        struct vrend_sampler_view *tview)
 {
    struct vrend_texture *tex = (struct vrend_texture *)res;
    struct pipe_sampler_state *state = &sampler_state->base;
@@ -7075,16 +9795,16 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
 
    assert(offsetof(struct vrend_sampler_state, base) == 0);
    if (!state)
-      return;
+      return 0;
 
    if (res->base.nr_samples > 1) {
       tex->state = *state;
-      return;
+      return 0;
    }
 
    if (has_bit(tex->base.storage_bits, VREND_STORAGE_GL_BUFFER)) {
       tex->state = *state;
-      return;
+      return 0;
    }
 
    /*
@@ -7094,17 +9814,25 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
     */
    bool is_emulated_alpha = vrend_format_is_emulated_alpha(tview->format);
    if (has_feature(feat_samplers)) {
-      int sampler = sampler_state->ids[tview->srgb_decode == GL_SKIP_DECODE_EXT ? 0 : 1];
+      struct vrend_sampler_object *object = sampler_state->object;
+      GLuint sampler = object->ids[tview->srgb_decode == GL_SKIP_DECODE_EXT ? 0 : 1];
+
+      /* The GL sampler is shared with the identical sampler states, so the
+       * border color is put back when it is used without the swizzle. */
       if (is_emulated_alpha) {
          union pipe_color_union border_color;
          border_color = state->border_color;
          border_color.ui[0] = border_color.ui[3];
          border_color.ui[3] = 0;
          apply_sampler_border_color(sampler, border_color.ui);
+         object->alpha_border = true;
+      } else if (object->alpha_border) {
+         apply_sampler_border_color(object->ids[0], state->border_color.ui);
+         apply_sampler_border_color(object->ids[1], state->border_color.ui);
+         object->alpha_border = false;
       }
 
-      glBindSampler(sampler_id, sampler);
-      return;
+      return sampler;
    }
 
    if (tex->state.max_lod == -1)
@@ -7151,9 +9879,9 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
     */
    if (!vrend_state.use_gles) {
       if (state->seamless_cube_map) {
-         glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+         vrend_gl_enable(GL_TEXTURE_CUBE_MAP_SEAMLESS, true);
       } else {
-         glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+         vrend_gl_enable(GL_TEXTURE_CUBE_MAP_SEAMLESS, false);
       }
    }
 
@@ -7171,6 +9899,7 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
 
    }
    tex->state = *state;
+   return 0;
 }
 
 static GLenum tgsitargettogltarget(const enum pipe_texture_target target, int nr_samples)
@@ -7222,6 +9951,14 @@ static void vrend_free_sync_thread(void)
 static void free_fence_locked(struct vrend_fence *fence)
 {
    list_del(&fence->fences);
+#ifdef HAVE_EPOLL_H
+   if (fence->sync_fd >= 0) {
+      /* the EGL sync still references the file, closing the fd alone would
+       * leave it in the epoll set */
+      epoll_ctl(vrend_state.fence_epoll_fd, EPOLL_CTL_DEL, fence->sync_fd, NULL);
+      close(fence->sync_fd);
+   }
+#endif
 #ifdef HAVE_EPOXY_EGL_H
    if (vrend_state.use_egl_fence) {
       virgl_egl_fence_destroy(egl, fence->eglsyncobj);
@@ -7230,7 +9967,7 @@ static void free_fence_locked(struct vrend_fence *fence)
    {
       glDeleteSync(fence->glsyncobj);
    }
-   free(fence);
+   slab_free(&vrend_state.fence_pool, fence);
 }
 
 static void vrend_free_fences(void)
@@ -7253,12 +9990,13 @@ static void vrend_free_fences_for_context(struct vrend_context *ctx)
             free_fence_locked(fence);
       }
       list_for_each_entry_safe(struct vrend_fence, fence, &vrend_state.fence_wait_list, fences) {
-         if (fence->ctx == ctx)
-            free_fence_locked(fence);
-      }
-      if (vrend_state.fence_waiting) {
+         if (fence->ctx != ctx)
+            continue;
          /* mark the fence invalid as the sync thread is still waiting on it */
-         vrend_state.fence_waiting->ctx = NULL;
+         if (fence == vrend_state.fence_waiting)
+            fence->ctx = NULL;
+         else
+            free_fence_locked(fence);
       }
       mtx_unlock(&vrend_state.fence_mutex);
    } else {
@@ -7269,28 +10007,95 @@ static void vrend_free_fences_for_context(struct vrend_context *ctx)
    }
 }
 
-static bool do_wait(struct vrend_fence *fence, bool can_block)
+/* timeout_ns is UINT64_MAX to wait until the fence signals */
+static bool do_wait_timeout(struct vrend_fence *fence, uint64_t timeout_ns)
 {
 #ifdef HAVE_EPOXY_EGL_H
    if (vrend_state.use_egl_fence)
-      return virgl_egl_client_wait_fence(egl, fence->eglsyncobj, can_block);
+      return virgl_egl_client_wait_fence(egl, fence->eglsyncobj, timeout_ns);
 #endif
 
    bool done = false;
-   int timeout = can_block ? 1000000000 : 0;
+   uint64_t timeout = MIN2(timeout_ns, 1000000000);
    do {
       GLenum glret = glClientWaitSync(fence->glsyncobj, 0, timeout);
       if (glret == GL_WAIT_FAILED) {
          virgl_warn("Wait sync failed: illegal fence object %p\n", (void*) fence->glsyncobj);
       }
       done = glret != GL_TIMEOUT_EXPIRED;
-   } while (!done && can_block);
+   } while (!done && timeout_ns == UINT64_MAX);
 
    return done;
 }
 
+static bool do_wait(struct vrend_fence *fence, bool can_block)
+{
+   return do_wait_timeout(fence, can_block ? UINT64_MAX : 0);
+}
+
+#ifdef HAVE_EPOLL_H
+/* Marks the fences whose sync files became readable as signaled */
+static void vrend_poll_fence_fds(void)
+{
+   struct epoll_event events[16];
+   int count;
+
+   do {
+      count = epoll_wait(vrend_state.fence_epoll_fd, events, ARRAY_SIZE(events), 0);
+      if (count < 0 && errno != EINTR) {
+         virgl_warn("Failed to poll fence fds: error=%d\n", errno);
+         return;
+      }
+
+      for (int i = 0; i < count; i++) {
+         struct vrend_fence *fence = events[i].data.ptr;
+         if (events[i].events & EPOLLERR)
+            virgl_warn("Error polling fence %" PRIu64 "\n", fence->fence_id);
+         fence->signaled = true;
+      }
+   } while (count == (int)ARRAY_SIZE(events) || (count < 0 && errno == EINTR));
+}
+
+/* Exports the fence as a sync file and adds it to the epoll set, the fence
+ * is waited on instead when this fails */
+static void vrend_register_fence_fd(struct vrend_fence *fence)
+{
+   struct epoll_event event = {
+      .events = EPOLLIN | EPOLLONESHOT,
+      .data.ptr = fence,
+   };
+
+   if (!virgl_egl_export_fence(egl, fence->eglsyncobj, &fence->sync_fd)) {
+      fence->sync_fd = -1;
+      return;
+   }
+
+   if (epoll_ctl(vrend_state.fence_epoll_fd, EPOLL_CTL_ADD, fence->sync_fd, &event)) {
+      virgl_warn("Failed to add fence fd to epoll set: error=%d\n", errno);
+      close(fence->sync_fd);
+      fence->sync_fd = -1;
+   }
+}
+#endif
+
+static bool vrend_fence_signaled(struct vrend_fence *fence)
+{
+   if (fence->signaled)
+      return true;
+   if (fence->sync_fd >= 0)
+      return false;
+   return do_wait(fence, /* can_block */ false);
+}
+
 static void vrend_renderer_check_queries(void);
 
+static void vrend_update_retired_fence_seqno(uint64_t seqno)
+{
+   /* fences are retired by a single thread */
+   if (seqno + 1 > atomic_load(&vrend_state.retired_fence_seqno))
+      atomic_store(&vrend_state.retired_fence_seqno, seqno + 1);
+}
+
 void vrend_renderer_poll(void) {
    if (vrend_state.use_async_fence_cb) {
       flush_eventfd(vrend_state.eventfd);
@@ -7308,35 +10113,79 @@ void vrend_renderer_poll(void) {
    }
 }
 
-static void wait_sync(struct vrend_fence *fence)
+/* While fences of other contexts are pending, the sync thread only blocks
+ * this long on one of them before it checks the others again. */
+#define VREND_SYNC_POLL_NS 1000000
+
+/* A run is a sequence of consecutive pending fences of one context that
+ * were created in the same GL context.  They signal in order, so the sync
+ * thread only waits for the last one and retires the whole run with it. */
+static bool sync_run_first_locked(const struct vrend_fence *fence)
 {
-   struct vrend_context *ctx = fence->ctx;
+   list_for_each_entry(struct vrend_fence, iter, &vrend_state.fence_wait_list, fences) {
+      if (iter == fence)
+         return true;
+      if (iter->ctx == fence->ctx)
+         return false;
+   }
+   return true;
+}
 
-   bool signal_poll = atomic_load(&vrend_state.has_waiting_queries);
-   do_wait(fence, /* can_block */ true);
+static struct vrend_fence *sync_run_last_locked(struct vrend_fence *first)
+{
+   struct vrend_fence *last = first;
 
-   mtx_lock(&vrend_state.fence_mutex);
-   if (vrend_state.use_async_fence_cb) {
-      /* to be able to call free_fence_locked without locking */
-      list_inithead(&fence->fences);
-   } else {
-      list_addtail(&fence->fences, &vrend_state.fence_list);
+   list_for_each_entry_from(struct vrend_fence, fence, first,
+                            &vrend_state.fence_wait_list, fences) {
+      if (fence->ctx != first->ctx)
+         continue;
+      if (fence->gl_context != first->gl_context)
+         break;
+      last = fence;
    }
-   vrend_state.fence_waiting = NULL;
-   mtx_unlock(&vrend_state.fence_mutex);
+   return last;
+}
+
+static void sync_run_retire_locked(struct vrend_fence *first,
+                                   struct vrend_fence *last,
+                                   struct list_head *retired)
+{
+   struct vrend_context *ctx = first->ctx;
+
+   list_for_each_entry_from_safe(struct vrend_fence, fence, first,
+                                 &vrend_state.fence_wait_list, fences) {
+      if (fence->ctx != ctx)
+         continue;
+      list_del(&fence->fences);
+      list_addtail(&fence->fences, retired);
+      TRACE_FENCE(TRACE_FENCE_SIGNAL, ctx->ctx_id, 0, fence->fence_id);
+      if (fence == last)
+         break;
+   }
+}
+
+static void sync_thread_retire(struct list_head *retired)
+{
+   uint64_t last_seqno = 0;
 
    if (!vrend_state.use_async_fence_cb) {
+      mtx_lock(&vrend_state.fence_mutex);
+      list_splicetail(retired, &vrend_state.fence_list);
+      mtx_unlock(&vrend_state.fence_mutex);
+
       if (write_eventfd(vrend_state.eventfd, 1))
          perror("failed to write to eventfd\n");
       return;
    }
 
-   /* If the current GL fence completed while one or more query was pending,
-    * check queries on the main thread before notifying the caller about fence
-    * completion.
-    * TODO: store seqno of first query in waiting_query_list and compare to
-    * current fence to avoid polling when it (and all later queries) are after
-    * the current fence. */
+   /* If a query that was pending before one of the fences was created is
+    * still pending, check queries on the main thread before notifying the
+    * caller about fence completion.  Queries that started waiting after the
+    * last fence was created can be left alone. */
+   list_for_each_entry(struct vrend_fence, fence, retired, fences)
+      last_seqno = MAX2(last_seqno, fence->seqno);
+   vrend_update_retired_fence_seqno(last_seqno);
+   bool signal_poll = atomic_load(&vrend_state.waiting_query_seqno) <= last_seqno;
    if (signal_poll) {
       mtx_lock(&vrend_state.poll_mutex);
       if (write_eventfd(vrend_state.eventfd, 1))
@@ -7355,24 +10204,81 @@ static void wait_sync(struct vrend_fence *fence)
       } while (vrend_state.polling && ret);
    }
 
-   /* vrend_free_fences_for_context might have marked the fence invalid
-    * by setting fence->ctx to NULL
-    */
-   if (ctx) {
-      ctx->fence_retire(fence->fence_id, ctx->fence_retire_data);
+   list_for_each_entry_safe(struct vrend_fence, fence, retired, fences) {
+      if (fence->ctx)
+         fence->ctx->fence_retire(fence->fence_id, fence->ctx->fence_retire_data);
+      free_fence_locked(fence);
    }
 
-   free_fence_locked(fence);
-
    if (signal_poll)
       mtx_unlock(&vrend_state.poll_mutex);
 }
 
+/* Retires the runs whose last fence signaled, or blocks on the run of the
+ * oldest pending fence when none did.  Called with fence_mutex held. */
+static void sync_thread_wait_locked(void)
+{
+   struct vrend_fence *target = NULL;
+   struct list_head retired;
+   uint32_t num_runs = 0;
+
+   list_inithead(&retired);
+
+   list_for_each_entry_safe(struct vrend_fence, fence, &vrend_state.fence_wait_list, fences) {
+      if (!sync_run_first_locked(fence))
+         continue;
+
+      struct vrend_fence *last = sync_run_last_locked(fence);
+      if (do_wait(last, /* can_block */ false)) {
+         sync_run_retire_locked(fence, last, &retired);
+         /* the iterator might have been moved to the retired list */
+         break;
+      }
+
+      if (!target)
+         target = last;
+      num_runs++;
+   }
+
+   if (list_is_empty(&retired)) {
+      assert(target);
+      vrend_state.fence_waiting = target;
+      mtx_unlock(&vrend_state.fence_mutex);
+      bool done = do_wait_timeout(target, num_runs > 1 ? VREND_SYNC_POLL_NS : UINT64_MAX);
+      mtx_lock(&vrend_state.fence_mutex);
+      vrend_state.fence_waiting = NULL;
+
+      /* vrend_free_fences_for_context marks the fence invalid by setting
+       * fence->ctx to NULL, the rest of its run is gone already */
+      if (!target->ctx) {
+         free_fence_locked(target);
+         return;
+      }
+
+      if (!done)
+         return;
+
+      struct vrend_fence *first = target;
+      list_for_each_entry(struct vrend_fence, fence, &vrend_state.fence_wait_list, fences) {
+         if (fence->ctx == target->ctx) {
+            first = fence;
+            break;
+         }
+      }
+      sync_run_retire_locked(first, target, &retired);
+   }
+
+   mtx_unlock(&vrend_state.fence_mutex);
+   sync_thread_retire(&retired);
+   mtx_lock(&vrend_state.fence_mutex);
+}
+
 static int thread_sync(UNUSED void *arg)
 {
    virgl_gl_context gl_context = vrend_state.sync_context;
 
    u_thread_setname("vrend-sync");
+   virgl_numa_bind_thread();
 
    mtx_lock(&vrend_state.fence_mutex);
    vrend_clicbs->make_current_surfaceless(gl_context);
@@ -7384,15 +10290,10 @@ static int thread_sync(UNUSED void *arg)
          break;
       }
 
-      list_for_each_entry_safe(struct vrend_fence, fence, &vrend_state.fence_wait_list, fences) {
-         if (vrend_state.stop_sync_thread)
-            break;
-         list_del(&fence->fences);
-         vrend_state.fence_waiting = fence;
-         mtx_unlock(&vrend_state.fence_mutex);
-         wait_sync(fence);
-         mtx_lock(&vrend_state.fence_mutex);
-      }
+      if (vrend_state.stop_sync_thread || list_is_empty(&vrend_state.fence_wait_list))
+         continue;
+
+      sync_thread_wait_locked();
    }
 
    vrend_clicbs->make_current_surfaceless(0);
@@ -7408,6 +10309,7 @@ static void vrend_renderer_use_threaded_sync(void)
    ctx_params.shared = true;
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
+   ctx_params.no_error = vrend_state.use_no_error;
 
    vrend_state.stop_sync_thread = false;
 
@@ -7446,15 +10348,72 @@ static void vrend_renderer_use_threaded_sync(void)
    }
 }
 
-static void vrend_debug_cb(UNUSED GLenum source, GLenum type, UNUSED GLuint id,
-                           UNUSED GLenum severity, UNUSED GLsizei length,
-                           UNUSED const GLchar* message, UNUSED const void* userParam)
+/* Fences are exported as sync files with EGL_ANDROID_native_fence_sync
+ * and retired when they become readable, that takes neither a sync thread
+ * nor its GL context. */
+static void vrend_renderer_use_fence_fds(void)
+{
+#if defined(HAVE_EPOXY_EGL_H) && defined(HAVE_EPOLL_H)
+   int fd;
+
+   if (!vrend_state.use_egl_fence ||
+       !debug_get_bool_option("VREND_FENCE_FDS", true))
+      return;
+
+   /* make sure the driver can export sync files at all */
+   if (!virgl_egl_export_signaled_fence(egl, &fd))
+      return;
+   close(fd);
+
+   vrend_state.fence_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (vrend_state.fence_epoll_fd == -1) {
+      virgl_warn("Failed to create fence epoll set: error=%d\n", errno);
+      return;
+   }
+
+   vrend_state.use_fence_fds = true;
+#endif
+}
+
+static void vrend_debug_cb(UNUSED GLenum source, GLenum type, UNUSED GLuint id,
+                           UNUSED GLenum severity, UNUSED GLsizei length,
+                           UNUSED const GLchar* message, UNUSED const void* userParam)
+{
+   if (type != GL_DEBUG_TYPE_ERROR) {
+      return;
+   }
+
+   if (vrend_current_command.name)
+      virgl_error("ERROR: %s (command %u, %s)\n", message, vrend_current_command.index,
+                  vrend_current_command.name);
+   else
+      virgl_error("ERROR: %s\n", message);
+}
+
+/* With CHECK_GL_ERRORS, GL errors fail the command that caused them, which
+ * needs a check after every command. Otherwise they are only logged, and
+ * one check per batch is enough, VREND_GL_ERROR_CHECK=command restores the
+ * old behavior. */
+static void vrend_renderer_init_gl_error_check(void)
+{
+#ifdef CHECK_GL_ERRORS
+   const char *def = "command";
+#else
+   const char *def = "batch";
+#endif
+   const char *check = debug_get_option("VREND_GL_ERROR_CHECK", def);
+
+   if (vrend_state.use_no_error)
+      vrend_state.gl_error_check = VREND_GL_ERROR_CHECK_NONE;
+   else if (!strcmp(check, "batch"))
+      vrend_state.gl_error_check = VREND_GL_ERROR_CHECK_BATCH;
+   else
+      vrend_state.gl_error_check = VREND_GL_ERROR_CHECK_COMMAND;
+}
+
+enum vrend_gl_error_check vrend_renderer_gl_error_check(void)
 {
-   if (type != GL_DEBUG_TYPE_ERROR) {
-      return;
-   }
-
-   virgl_error("ERROR: %s\n", message);
+   return vrend_state.gl_error_check;
 }
 
 static void vrend_pipe_resource_unref(struct pipe_resource *pres,
@@ -7475,6 +10434,12 @@ static void vrend_pipe_resource_attach_iov(struct pipe_resource *pres,
 
    res->iov = iov;
    res->num_iovs = iov_count;
+   /* backing can be attached again without a detach in between */
+   free(res->iov_offsets);
+   res->iov_offsets = NULL;
+   /* only worth it when seeking through the entries is expensive */
+   if (iov_count > 16)
+      res->iov_offsets = vrend_iovec_build_offsets(iov, iov_count);
 
    if (has_bit(res->storage_bits, VREND_STORAGE_HOST_SYSTEM_MEMORY)) {
       vrend_write_to_iovec(res->iov, res->num_iovs, 0,
@@ -7482,6 +10447,11 @@ static void vrend_pipe_resource_attach_iov(struct pipe_resource *pres,
    }
 }
 
+static void vrend_finish_readbacks(struct vrend_resource *res);
+static void vrend_free_readbacks(void);
+static void vrend_discard_pending_uploads(struct vrend_resource *res);
+static void vrend_free_pending_uploads(void);
+
 static void vrend_pipe_resource_detach_iov(struct pipe_resource *pres,
                                            UNUSED void *data)
 {
@@ -7492,6 +10462,10 @@ static void vrend_pipe_resource_detach_iov(struct pipe_resource *pres,
             res->ptr, res->base.width0);
    }
 
+   vrend_finish_readbacks(res);
+
+   free(res->iov_offsets);
+   res->iov_offsets = NULL;
    res->iov = NULL;
    res->num_iovs = 0;
 }
@@ -7518,6 +10492,9 @@ bool vrend_check_no_error(struct vrend_context *ctx)
 {
    GLenum err;
 
+   if (vrend_state.gl_error_check == VREND_GL_ERROR_CHECK_NONE)
+      return true;
+
    err = glGetError();
    if (err == GL_NO_ERROR)
       return true;
@@ -7589,6 +10566,43 @@ static bool vrend_use_gbm_layout_feature(UNUSED uint32_t flags)
 #endif
 }
 
+static bool vrend_query_buffer_init(void)
+{
+   const GLsizeiptr size = VREND_QUERY_SLOTS * sizeof(struct vrend_query_slot);
+   const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT |
+                            GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+   glGenBuffers(1, &vrend_state.query_buffer_id);
+   vrend_gl_bind_buffer(GL_QUERY_BUFFER, vrend_state.query_buffer_id);
+   glBufferStorage(GL_QUERY_BUFFER, size, NULL, flags);
+   vrend_state.query_slots = glMapBufferRange(GL_QUERY_BUFFER, 0, size, flags);
+   vrend_gl_bind_buffer(GL_QUERY_BUFFER, 0);
+
+   if (!vrend_state.query_slots) {
+      vrend_gl_state_forget_buffer(vrend_state.query_buffer_id);
+      glDeleteBuffers(1, &vrend_state.query_buffer_id);
+      vrend_state.query_buffer_id = 0;
+      return false;
+   }
+
+   for (uint32_t i = 0; i < VREND_QUERY_SLOTS; i++)
+      vrend_state.free_query_slots[i] = VREND_QUERY_SLOTS - 1 - i;
+   vrend_state.num_free_query_slots = VREND_QUERY_SLOTS;
+   vrend_state.num_busy_query_slots = 0;
+   return true;
+}
+
+static void vrend_query_buffer_fini(void)
+{
+   /* deleting the buffer also unmaps it */
+   vrend_gl_state_forget_buffer(vrend_state.query_buffer_id);
+   glDeleteBuffers(1, &vrend_state.query_buffer_id);
+   vrend_state.query_buffer_id = 0;
+   vrend_state.query_slots = NULL;
+   vrend_state.num_free_query_slots = 0;
+   vrend_state.num_busy_query_slots = 0;
+}
+
 int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
 {
    bool gles;
@@ -7607,11 +10621,23 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       vrend_init_debug_flags();
    }
 
+   vrend_pixel_ops_init();
+   vrend_staging_pool_init();
+
+   if (!slab_pool_init(&vrend_state.fence_pool, sizeof(struct vrend_fence), 64) ||
+       !slab_pool_init(&vrend_state.query_pool, sizeof(struct vrend_query), 64))
+      return ENOMEM;
+
    ctx_params.shared = false;
    if (flags & VREND_USE_COMPAT_CONTEXT) {
       ctx_params.compat_ctx = true;
    }
 
+   /* only for trusted guests, a bad command stream can crash a no_error
+    * context; all the contexts share objects, so it is all or nothing */
+   vrend_state.use_no_error = debug_get_bool_option("VREND_GL_NO_ERROR", false);
+   ctx_params.no_error = vrend_state.use_no_error;
+
    for (uint32_t i = 0; i < ARRAY_SIZE(gl_versions); i++) {
       ctx_params.major_ver = gl_versions[i].major;
       ctx_params.minor_ver = gl_versions[i].minor;
@@ -7627,11 +10653,23 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       goto fail;
    }
 
-   vrend_clicbs->make_current(gl_context);
+   vrend_make_current(gl_context);
    gl_ver = epoxy_gl_version();
+   vrend_gl_extensions_init(gl_ver);
+
+   if (vrend_state.use_no_error) {
+      GLint ctx_flags = 0;
+      glGetIntegerv(GL_CONTEXT_FLAGS, &ctx_flags);
+      if (!(ctx_flags & GL_CONTEXT_FLAG_NO_ERROR_BIT_KHR)) {
+         virgl_warn("KHR_no_error contexts are not supported, checking GL errors\n");
+         vrend_state.use_no_error = false;
+         while (glGetError() != GL_NO_ERROR);
+      }
+   }
+   vrend_renderer_init_gl_error_check();
 
    /* enable error output as early as possible */
-   if (vrend_debug(NULL, dbg_khr) && epoxy_has_gl_extension("GL_KHR_debug")) {
+   if (vrend_debug(NULL, dbg_khr) && vrend_has_gl_extension("GL_KHR_debug")) {
       glDebugMessageCallback(vrend_debug_cb, NULL);
       glEnable(GL_DEBUG_OUTPUT);
       glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
@@ -7649,7 +10687,7 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       vrend_state.use_gles = true;
       /* for now, makes the rest of the code use the most GLES 3.x like path */
       vrend_state.use_core_profile = true;
-   } else if (gl_ver > 30 && !epoxy_has_gl_extension("GL_ARB_compatibility")) {
+   } else if (gl_ver > 30 && !vrend_has_gl_extension("GL_ARB_compatibility")) {
       virgl_info("gl_version %d - core profile enabled\n", gl_ver);
       vrend_state.use_core_profile = true;
    } else {
@@ -7664,6 +10702,11 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    if (!vrend_winsys_has_gl_colorspace())
       clear_feature(feat_srgb_write_control) ;
 
+   if (has_feature(feat_program_binary))
+      vrend_state.use_program_cache = vrend_program_cache_init();
+
+   vrend_shader_cache_init();
+
    glGetIntegerv(GL_MAX_DRAW_BUFFERS, (GLint *) &vrend_state.max_draw_buffers);
 
    /* For testing we need to know maximum */
@@ -7698,19 +10741,27 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       glDisable(GL_DEBUG_OUTPUT);
    }
 
-   vrend_build_format_list_common();
+   vrend_caps_cache_init(flags, vrend_state.features, sizeof(vrend_state.features));
 
-   if (vrend_state.use_gles) {
-      vrend_build_format_list_gles();
-   } else {
-      vrend_build_format_list_gl();
-   }
+   if (!vrend_caps_cache_load(VREND_CAPS_CACHE_FORMATS, tex_conv_table,
+                              sizeof(tex_conv_table))) {
+      vrend_build_format_list_common();
+
+      if (vrend_state.use_gles) {
+         vrend_build_format_list_gles();
+      } else {
+         vrend_build_format_list_gl();
+      }
 
-   vrend_check_texture_storage(tex_conv_table);
+      vrend_check_texture_storage(tex_conv_table);
 
-   if (has_feature(feat_multisample)) {
-      vrend_check_texture_multisample(tex_conv_table,
-                                      has_feature(feat_storage_multisample));
+      if (has_feature(feat_multisample)) {
+         vrend_check_texture_multisample(tex_conv_table,
+                                         has_feature(feat_storage_multisample));
+      }
+
+      vrend_caps_cache_store(VREND_CAPS_CACHE_FORMATS, tex_conv_table,
+                             sizeof(tex_conv_table));
    }
 
    /* disable for format testing */
@@ -7722,7 +10773,12 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    list_inithead(&vrend_state.fence_list);
    list_inithead(&vrend_state.fence_wait_list);
    list_inithead(&vrend_state.waiting_query_list);
-   atomic_store(&vrend_state.has_waiting_queries, false);
+   list_inithead(&vrend_state.gpu_timer_list);
+   list_inithead(&vrend_state.readback_list);
+   list_inithead(&vrend_state.pending_upload_list);
+   list_inithead(&vrend_state.evictable_buffers);
+   vrend_state.evict_epoch = 1;
+   atomic_store(&vrend_state.waiting_query_seqno, UINT64_MAX);
 
    /* create 0 context */
    vrend_state.ctx0 = vrend_create_context(0, strlen("HOST"), "HOST");
@@ -7732,19 +10788,78 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       goto fail;
    }
 
+#ifdef HAVE_EPOXY_EGL_H
+   vrend_state.use_egl_fence = virgl_egl_supports_fences(egl);
+#endif
+
    vrend_state.eventfd = -1;
+   vrend_state.fence_epoll_fd = -1;
    if (flags & VREND_USE_THREAD_SYNC) {
       if (flags & VREND_USE_ASYNC_FENCE_CB)
          vrend_state.use_async_fence_cb = true;
-      vrend_renderer_use_threaded_sync();
+      /* the async fence callback is called from the sync thread */
+      if (!vrend_state.use_async_fence_cb)
+         vrend_renderer_use_fence_fds();
+      if (!vrend_state.use_fence_fds)
+         vrend_renderer_use_threaded_sync();
+   }
+   vrend_renderer_use_shader_threads();
+   /* Draws wait for programs that are linked asynchronously unless this is
+    * set, in which case they are dropped until the program is ready. */
+   if (vrend_state.num_shader_threads || has_feature(feat_parallel_shader_compile))
+      vrend_state.skip_pending_programs = debug_get_bool_option("VREND_ASYNC_SHADERS_SKIP", false);
+   /* The programs of the stage combinations that the application linked
+    * before are linked as soon as their stages are compiled.  This needs the
+    * shader threads, the main thread would stall on the links otherwise. */
+   if (vrend_state.num_shader_threads)
+      vrend_state.use_program_prediction = debug_get_bool_option("VREND_PROGRAM_PREDICTION", true);
+   vrend_renderer_use_context_pool();
+   if (has_feature(feat_multi_draw))
+      vrend_state.use_draw_batching = debug_get_bool_option("VREND_DRAW_BATCHING", true);
+   vrend_state.use_deferred_clears = debug_get_bool_option("VREND_DEFERRED_CLEARS", true);
+   vrend_state.use_mipmap_blits = debug_get_bool_option("VREND_MIPMAP_BLITS", true);
+   vrend_state.use_barrier_tracking = debug_get_bool_option("VREND_BARRIER_TRACKING", true);
+   vrend_state.use_dispatch_runs = debug_get_bool_option("VREND_DISPATCH_RUNS", true);
+   if (has_feature(feat_arb_buffer_storage)) {
+      vrend_state.use_upload_ring = vrend_upload_ring_init();
+      vrend_state.use_write_mapped_buffers = debug_get_bool_option("VREND_PERSISTENT_BUFFERS", true);
+   }
+   if (vrend_state.use_upload_ring && debug_get_bool_option("VREND_CONST_UBO", false))
+      vrend_renderer_use_const_ubo();
+   /* GLES wants the interfaces of separable programs to match exactly */
+   if (has_feature(feat_separate_shader_objects) && !vrend_state.use_gles)
+      vrend_state.use_separable_programs = debug_get_bool_option("VREND_SEPARABLE_SHADERS", false);
+   /* the readbacks are completed on the main thread when fences are checked,
+    * with the async fence callback fences are retired from the sync thread */
+   if (!vrend_state.use_async_fence_cb)
+      vrend_state.use_async_readback = debug_get_bool_option("VREND_ASYNC_READBACK", false);
+   vrend_state.use_copy_transfer_pbo = debug_get_bool_option("VREND_COPY_TRANSFER_PBO", true);
+   vrend_state.use_upload_coalescing = debug_get_bool_option("VREND_COALESCE_UPLOADS", true);
+   /* with VREND_BUFFER_EVICTION, buffers unused for VREND_EVICT_COLD_MS are
+    * demoted to system memory when less than VREND_EVICT_MIN_FREE_MB of video
+    * memory is left, or when a context goes over its soft budget */
+   if (debug_get_bool_option("VREND_BUFFER_EVICTION", false)) {
+      vrend_state.evict_cold_epochs =
+         DIV_ROUND_UP(debug_get_num_option("VREND_EVICT_COLD_MS", 10000), 1000);
+      vrend_state.evict_min_free_kb =
+         debug_get_num_option("VREND_EVICT_MIN_FREE_MB", 256) * 1024;
+      vrend_state.use_buffer_eviction = vrend_state.evict_cold_epochs > 0;
+   }
+   /* VREND_TEXTURE_POOL_SIZE bounds the bytes of the textures kept for reuse */
+   if (has_feature(feat_clear_texture) && has_feature(feat_texture_storage))
+      vrend_texture_pool_init(debug_get_num_option("VREND_TEXTURE_POOL_SIZE", 64 * 1024 * 1024));
+   if (has_feature(feat_qbo) && has_feature(feat_arb_buffer_storage) &&
+       debug_get_bool_option("VREND_QUERY_BUFFER", true))
+      vrend_state.use_query_buffer = vrend_query_buffer_init();
+   /* GL_TIMESTAMP queries around the batches, blits and clears, to tell the
+    * GPU time apart from the decoding */
+   if (has_feature(feat_timer_query)) {
+      vrend_state.use_gpu_timestamps =
+         debug_get_bool_option("VREND_GPU_TIMESTAMPS", false);
    }
    if (flags & VREND_USE_EXTERNAL_BLOB)
       vrend_state.use_external_blob = true;
 
-#ifdef HAVE_EPOXY_EGL_H
-   vrend_state.use_egl_fence = virgl_egl_supports_fences(egl);
-#endif
-
    if (!vrend_check_no_error(vrend_state.ctx0)) {
       virgl_error("vrend context creation resulted in errors\n");
       goto cleanup_and_fail;
@@ -7758,7 +10873,8 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
 #ifdef ENABLE_VIDEO
    if (flags & VREND_USE_VIDEO) {
         if (vrend_clicbs->get_drm_fd)
-            vrend_video_init(vrend_clicbs->get_drm_fd());
+            vrend_video_init(vrend_clicbs->get_drm_fd(),
+                             !vrend_state.use_async_fence_cb);
         else
             virgl_warn("Video disabled due to missing get_drm_fd\n");
    }
@@ -7767,11 +10883,17 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    vrend_state.d3d_share_texture = flags & VREND_D3D11_SHARE_TEXTURE;
 
    vrend_state.gbm_layout_feat = vrend_use_gbm_layout_feature(flags);
+   vrend_state.use_gbm_modifiers = debug_get_bool_option("VIRGL_GBM_MODIFIERS", true);
+   vrend_state.use_gbm_gpu_writes = vrend_winsys_different_gpu() &&
+                                    debug_get_bool_option("VIRGL_GBM_GPU_WRITES", true);
 
    return 0;
 cleanup_and_fail:
    vrend_renderer_fini();
+   return EINVAL;
 fail:
+   slab_pool_fini(&vrend_state.query_pool);
+   slab_pool_fini(&vrend_state.fence_pool);
    return EINVAL;
 }
 
@@ -7786,23 +10908,106 @@ vrend_renderer_fini(void)
    }
 
    vrend_free_fences();
+
+   if (vrend_state.fence_epoll_fd != -1) {
+      close(vrend_state.fence_epoll_fd);
+      vrend_state.fence_epoll_fd = -1;
+      vrend_state.use_fence_fds = false;
+   }
    vrend_blitter_fini();
+   vrend_texture_pool_fini();
+#if defined(WIN32) && defined(HAVE_EPOXY_EGL_H)
+   vrend_d3d_texture_pool_fini();
+#endif
+
+   vrend_caps_cache_fini();
+   vrend_gl_extensions_fini();
+   vrend_shader_free_scratch();
+
+   if (vrend_state.use_program_cache) {
+      vrend_program_cache_fini();
+      vrend_state.use_program_cache = false;
+   }
 
 #ifdef ENABLE_VIDEO
    vrend_video_fini();
 #endif
 
+   if (vrend_state.use_upload_ring || vrend_state.use_query_buffer ||
+       !list_is_empty(&vrend_state.readback_list))
+      vrend_hw_switch_context(vrend_state.ctx0, true);
+
+   vrend_free_readbacks();
+   vrend_free_pending_uploads();
+
+   if (vrend_state.num_queued_uploads)
+      virgl_debug("Merged %" PRIu64 " buffer uploads into %" PRIu64 "\n",
+                  vrend_state.num_queued_uploads, vrend_state.num_issued_uploads);
+
+   if (vrend_state.use_upload_ring) {
+      vrend_upload_ring_fini();
+      vrend_state.use_upload_ring = false;
+   }
+
+   if (vrend_state.use_query_buffer) {
+      vrend_query_buffer_fini();
+      vrend_state.use_query_buffer = false;
+   }
+
+   vrend_context_pool_fini();
    vrend_destroy_context(vrend_state.ctx0);
+   if (vrend_state.sampler_table) {
+      _mesa_hash_table_destroy(vrend_state.sampler_table, NULL);
+      vrend_state.sampler_table = NULL;
+   }
+   vrend_staging_pool_fini();
+   vrend_free_shader_threads();
+   vrend_shader_cache_fini();
+
+   virgl_debug("GL state shadow elided %" PRIu64 " calls\n", vrend_gl_state_elided_calls());
+   vrend_gl_state_invalidate();
 
    vrend_state.current_ctx = NULL;
    vrend_state.current_hw_ctx = NULL;
 
+   slab_pool_fini(&vrend_state.query_pool);
+   slab_pool_fini(&vrend_state.fence_pool);
+
    vrend_state.finishing = false;
 }
 
+static void vrend_destroy_gpu_timer(struct vrend_gpu_timer *timer)
+{
+   glDeleteQueries(ARRAY_SIZE(timer->queries), timer->queries);
+   FREE(timer);
+}
+
+static void vrend_destroy_sub_context_gpu_timers(struct vrend_sub_context *sub)
+{
+   if (sub->batch_timer) {
+      vrend_destroy_gpu_timer(sub->batch_timer);
+      sub->batch_timer = NULL;
+   }
+
+   list_for_each_entry_safe(struct vrend_gpu_timer, timer,
+                            &vrend_state.gpu_timer_list, head) {
+      if (timer->ctx == sub->parent && timer->sub_ctx_id == sub->sub_ctx_id) {
+         list_del(&timer->head);
+         vrend_destroy_gpu_timer(timer);
+      }
+   }
+
+   list_for_each_entry_safe(struct vrend_gpu_timer, timer,
+                            &sub->gpu_timer_free_list, head)
+      vrend_destroy_gpu_timer(timer);
+   list_inithead(&sub->gpu_timer_free_list);
+}
+
 static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
 {
-   vrend_clicbs->make_current(sub->gl_context);
+   vrend_make_current(sub->gl_context);
+
+   vrend_destroy_sub_context_gpu_timers(sub);
 
    if (has_feature(feat_images)) {
       for (int shader_type = PIPE_SHADER_VERTEX;
@@ -7843,13 +11048,15 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
       }
    }
 
-   if (sub->fb_id)
-      glDeleteFramebuffers(1, &sub->fb_id);
+   list_for_each_entry_safe(struct vrend_fbo, fbo, &sub->fbos, head)
+      vrend_fbo_destroy(sub, fbo);
+   _mesa_hash_table_destroy(sub->fbo_table, NULL);
+   sub->fbo_table = NULL;
 
    if (sub->blit_fb_ids[0])
       glDeleteFramebuffers(2, sub->blit_fb_ids);
 
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   vrend_gl_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
    if (!has_feature(feat_gles31_vertex_attrib_binding)) {
       while (sub->enabled_attribs_bitmask) {
@@ -7858,14 +11065,25 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
          glDisableVertexAttribArray(i);
       }
    }
+   list_for_each_entry_safe(struct vrend_vao, vao, &sub->vaos, head)
+      vrend_vao_destroy(sub, vao);
+   _mesa_hash_table_destroy(sub->vao_table, NULL);
+   sub->vao_table = NULL;
+
+   vrend_gl_state_forget_vertex_array(sub->vaoid);
    glDeleteVertexArrays(1, &sub->vaoid);
-   glBindVertexArray(0);
+   vrend_gl_bind_vertex_array(0);
 
    if (sub->current_so)
       glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
 
+   _mesa_hash_table_destroy(sub->streamout_table, NULL);
+   sub->streamout_table = NULL;
    list_for_each_entry_safe(struct vrend_streamout_object, obj, &sub->streamout_list, head)
-      vrend_destroy_streamout_object(obj);
+      vrend_destroy_streamout_object(sub, obj);
+
+   list_for_each_entry_safe(struct vrend_injected_tcs, tcs, &sub->injected_tcs, head)
+      vrend_destroy_injected_tcs(sub, tcs);
 
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_VERTEX], NULL);
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_FRAGMENT], NULL);
@@ -7890,6 +11108,7 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
          vrend_sampler_view_reference(&sub->views[type].views[i], NULL);
       }
       for (unsigned i = 0; i < PIPE_MAX_SHADER_IMAGES; i++) {
+         vrend_gl_state_forget_texture(sub->image_views[type][i].view_id);
          glDeleteTextures(1, &sub->image_views[type][i].view_id);
       }
 
@@ -7910,6 +11129,9 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
    vrend_resource_reference((struct vrend_resource **)&sub->ib.buffer, NULL);
 
    vrend_object_fini_ctx_table(sub->object_hash);
+   /* after the variants in the object table are gone */
+   virgl_id_table_fini(&sub->combo_variants);
+   _mesa_hash_table_destroy(sub->program_table, NULL);
    vrend_clicbs->destroy_gl_context(sub->gl_context);
 
    list_del(&sub->head);
@@ -7933,7 +11155,7 @@ void vrend_destroy_context(struct vrend_context *ctx)
       vrend_state.current_hw_ctx = NULL;
    }
 
-   vrend_clicbs->make_current(ctx->sub->gl_context);
+   vrend_make_current(ctx->sub->gl_context);
    /* reset references on framebuffers */
    vrend_set_framebuffer_state(ctx, 0, NULL, 0);
 
@@ -7971,6 +11193,7 @@ void vrend_destroy_context(struct vrend_context *ctx)
    list_for_each_entry_safe(struct vrend_untyped_resource, untyped_res, &ctx->untyped_resources, head)
       free(untyped_res);
    vrend_ctx_resource_fini_table(ctx->res_hash);
+   vrend_program_predictor_put(ctx->predictor);
 
 #ifdef ENABLE_TRACING
    _mesa_hash_table_destroy(ctx->active_markers, destroy_active_markers_entry);
@@ -8010,6 +11233,7 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
 
    grctx->res_hash = vrend_ctx_resource_init_table();
    list_inithead(&grctx->untyped_resources);
+   virgl_memory_budget_init(&grctx->memory_budget);
 
    grctx->shader_cfg.max_shader_patch_varyings = vrend_state.max_shader_patch_varyings;
    grctx->shader_cfg.use_gles = vrend_state.use_gles;
@@ -8028,6 +11252,12 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    grctx->shader_cfg.has_texture_shadow_lod = has_feature(feat_texture_shadow_lod);
    grctx->shader_cfg.has_vs_layer = has_feature(feat_vs_layer_viewport);
    grctx->shader_cfg.has_vs_viewport_index = has_feature(feat_vs_viewport_index);
+   grctx->shader_cfg.use_const_ubo = vrend_state.use_const_ubo;
+   grctx->shader_cfg.use_separable_programs = vrend_state.use_separable_programs;
+
+   /* ctx0 only runs the blits of the renderer */
+   if (vrend_state.use_program_prediction && grctx->ctx_id)
+      grctx->predictor = vrend_program_predictor_get(grctx->debug_name);
 
    vrend_renderer_create_sub_ctx(grctx, 0);
    vrend_renderer_set_sub_ctx(grctx, 0);
@@ -8046,6 +11276,8 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
 
 #ifdef ENABLE_TRACING
    grctx->active_markers = _mesa_hash_table_create(NULL, _mesa_hash_string, _mesa_key_string_equal);
+   snprintf(grctx->gpu_time_counter_name, sizeof(grctx->gpu_time_counter_name),
+            "vrend gpu batch time %d", id);
 #endif
 
    return grctx;
@@ -8283,6 +11515,35 @@ static int check_resource_valid(const struct vrend_renderer_resource_create_args
    return 0;
 }
 
+#define VREND_WRITE_MAP_FLAGS (GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | \
+                               GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+
+/* Gives the vertex, index and constant buffers that only the host sees
+ * storage that stays mapped, the guest rewrites these all the time and the
+ * writes then skip mapping and unmapping the buffer. */
+static bool vrend_create_write_mapped_buffer(struct vrend_resource *gr, uint32_t width)
+{
+   if (!vrend_state.use_write_mapped_buffers || !width ||
+       (gr->base.bind != VIRGL_BIND_VERTEX_BUFFER &&
+        gr->base.bind != VIRGL_BIND_INDEX_BUFFER &&
+        gr->base.bind != VIRGL_BIND_CONSTANT_BUFFER))
+      return false;
+
+   /* synchronized writes still go through glBufferSubData */
+   glBufferStorage(gr->target, width, NULL, VREND_WRITE_MAP_FLAGS | GL_DYNAMIC_STORAGE_BIT);
+   gr->write_map = glMapBufferRange(gr->target, 0, width, VREND_WRITE_MAP_FLAGS);
+   if (gr->write_map)
+      return true;
+
+   /* the storage is immutable, start over with a new buffer */
+   virgl_warn("Unable to map buffer persistently, falling back to mapping it per write\n");
+   vrend_gl_state_forget_buffer(gr->gl_id);
+   glDeleteBuffers(1, &gr->gl_id);
+   glGenBuffersARB(1, &gr->gl_id);
+   vrend_gl_bind_buffer(gr->target, gr->gl_id);
+   return false;
+}
+
 static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width, uint32_t flags)
 {
 
@@ -8302,7 +11563,7 @@ static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width, uint3
 
    gr->storage_bits |= VREND_STORAGE_GL_BUFFER;
    glGenBuffersARB(1, &gr->gl_id);
-   glBindBufferARB(gr->target, gr->gl_id);
+   vrend_gl_bind_buffer(gr->target, gr->gl_id);
 
    if (buffer_storage_flags) {
       if (has_feature(feat_arb_buffer_storage) && !vrend_state.use_external_blob) {
@@ -8346,10 +11607,12 @@ static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width, uint3
       gr->storage_bits |= VREND_STORAGE_GL_IMMUTABLE;
       gr->buffer_storage_flags = buffer_storage_flags;
       gr->size = width;
-   } else
-      glBufferData(gr->target, width, NULL, GL_STREAM_DRAW);
+   } else if (!vrend_create_write_mapped_buffer(gr, width)) {
+      gr->buffer_usage = GL_STREAM_DRAW;
+      glBufferData(gr->target, width, NULL, gr->buffer_usage);
+   }
 
-   glBindBufferARB(gr->target, 0);
+   vrend_gl_bind_buffer(gr->target, 0);
 }
 
 static int
@@ -8525,6 +11788,64 @@ static bool vrend_resource_d3d_acquire(ID3D11Texture2D* d3d_tex2d)
 }
 #endif
 
+#if defined(WIN32) && defined(HAVE_EPOXY_EGL_H)
+#define VREND_D3D_TEXTURE_POOL_SIZE 8
+
+/* The shared textures of destroyed scanout resources.  VMMs recreate their
+ * scanouts on every mode change and guests cycle through a few of them, and
+ * creating a texture with a shared NT handle and a keyed mutex is slow.  A
+ * pooled texture still holds the keyed mutex for the device of the renderer,
+ * like a new one.
+ */
+static struct {
+   struct {
+      D3D11_TEXTURE2D_DESC desc;
+      ID3D11Texture2D *tex;
+   } entries[VREND_D3D_TEXTURE_POOL_SIZE];
+   /* the most recently released comes last */
+   uint32_t count;
+} vrend_d3d_texture_pool;
+
+static ID3D11Texture2D *vrend_d3d_texture_pool_get(const D3D11_TEXTURE2D_DESC *desc)
+{
+   for (uint32_t i = vrend_d3d_texture_pool.count; i-- > 0; ) {
+      if (memcmp(&vrend_d3d_texture_pool.entries[i].desc, desc, sizeof(*desc)))
+         continue;
+
+      ID3D11Texture2D *tex = vrend_d3d_texture_pool.entries[i].tex;
+      vrend_d3d_texture_pool.count--;
+      memmove(&vrend_d3d_texture_pool.entries[i], &vrend_d3d_texture_pool.entries[i + 1],
+              sizeof(vrend_d3d_texture_pool.entries[0]) * (vrend_d3d_texture_pool.count - i));
+      return tex;
+   }
+
+   return NULL;
+}
+
+static void vrend_d3d_texture_pool_put(ID3D11Texture2D *tex)
+{
+   if (vrend_d3d_texture_pool.count == VREND_D3D_TEXTURE_POOL_SIZE) {
+      ID3D11Texture2D *oldest = vrend_d3d_texture_pool.entries[0].tex;
+      oldest->lpVtbl->Release(oldest);
+      vrend_d3d_texture_pool.count--;
+      memmove(&vrend_d3d_texture_pool.entries[0], &vrend_d3d_texture_pool.entries[1],
+              sizeof(vrend_d3d_texture_pool.entries[0]) * vrend_d3d_texture_pool.count);
+   }
+
+   tex->lpVtbl->GetDesc(tex, &vrend_d3d_texture_pool.entries[vrend_d3d_texture_pool.count].desc);
+   vrend_d3d_texture_pool.entries[vrend_d3d_texture_pool.count++].tex = tex;
+}
+
+static void vrend_d3d_texture_pool_fini(void)
+{
+   for (uint32_t i = 0; i < vrend_d3d_texture_pool.count; i++) {
+      ID3D11Texture2D *tex = vrend_d3d_texture_pool.entries[i].tex;
+      tex->lpVtbl->Release(tex);
+   }
+   vrend_d3d_texture_pool.count = 0;
+}
+#endif
+
 /*
  * When using ANGLE/D3D, this function creates a D3D Texture and
  * EGL image given certain flags.
@@ -8558,11 +11879,14 @@ static void vrend_resource_d3d_init(UNUSED struct vrend_resource *gr, UNUSED uin
    desc.Usage = virgl_usage_to_d3d_usage(gr->base.usage);
    desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED_NTHANDLE | D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX;
 
-   if (!virgl_egl_win32_create_d3d11_texture2d(egl, &desc, &d3d_tex2d))
-      goto fail;
+   d3d_tex2d = vrend_d3d_texture_pool_get(&desc);
+   if (!d3d_tex2d) {
+      if (!virgl_egl_win32_create_d3d11_texture2d(egl, &desc, &d3d_tex2d))
+         goto fail;
 
-   if (!vrend_resource_d3d_acquire(d3d_tex2d))
-      goto fail;
+      if (!vrend_resource_d3d_acquire(d3d_tex2d))
+         goto fail;
+   }
 
    gr->egl_image = virgl_egl_win32_image_from_d3d11_texture2d(egl, d3d_tex2d);
    if (!gr->egl_image)
@@ -8576,7 +11900,7 @@ static void vrend_resource_d3d_init(UNUSED struct vrend_resource *gr, UNUSED uin
 
 fail:
    if (d3d_tex2d)
-      d3d_tex2d->lpVtbl->Release(gr->d3d_tex2d);
+      d3d_tex2d->lpVtbl->Release(d3d_tex2d);
    gr->d3d_tex2d = NULL;
 #endif
 }
@@ -8625,8 +11949,16 @@ static void vrend_resource_gbm_init(struct vrend_resource *gr, uint32_t format)
    if (!gbm_device_is_format_supported(gbm->device, gbm_format, gbm_flags))
       return;
 
-   struct gbm_bo *bo = gbm_bo_create(gbm->device, gr->base.width0, gr->base.height0,
-                                     gbm_format, gbm_flags);
+   /* let the driver pick a tiled or compressed layout that GL can import back,
+    * when the consumers don't need a linear one */
+   const uint64_t *modifiers = NULL;
+   uint32_t modifier_count = 0;
+   if (vrend_state.use_gbm_modifiers && virgl_gbm_gpu_import_required(gr->base.bind))
+      modifier_count = virgl_egl_get_dmabuf_modifiers(egl, gbm_format, &modifiers);
+
+   struct gbm_bo *bo = virgl_gbm_bo_create(gbm, gr->base.width0, gr->base.height0,
+                                           gbm_format, gbm_flags, modifiers,
+                                           modifier_count);
    if (!bo)
       return;
 
@@ -8653,6 +11985,78 @@ static void vrend_resource_gbm_init(struct vrend_resource *gr, uint32_t format)
 #endif
 }
 
+/* Textures with immutable storage that nothing outside of GL can see are
+ * recycled through the texture pool. */
+static bool vrend_texture_is_recyclable(const struct vrend_resource *res)
+{
+   const uint32_t foreign_bits = VREND_STORAGE_EGL_IMAGE | VREND_STORAGE_GBM_BUFFER |
+                                 VREND_STORAGE_GL_MEMOBJ | VREND_STORAGE_D3D_TEXTURE;
+   const uint32_t shared_binds = VIRGL_BIND_DISPLAY_TARGET | VIRGL_BIND_CURSOR |
+                                 VIRGL_BIND_SCANOUT | VIRGL_BIND_SHARED;
+
+   /* the contents of the previous resource are cleared */
+   return has_feature(feat_clear_texture) &&
+          has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE) &&
+          has_bit(res->storage_bits, VREND_STORAGE_GL_IMMUTABLE) &&
+          !(res->storage_bits & foreign_bits) &&
+          !(res->base.bind & shared_binds) &&
+          !res->is_imported && !res->gbm_bo &&
+          !util_format_is_compressed(res->base.format);
+}
+
+static void vrend_texture_pool_key_init(struct vrend_texture_pool_key *key,
+                                        const struct vrend_resource *res)
+{
+   memset(key, 0, sizeof(*key));
+   key->target = res->target;
+   key->internalformat = tex_conv_table[res->base.format].internalformat;
+   key->width = res->base.width0;
+   key->height = res->base.height0;
+   key->depth = res->base.depth0;
+   key->array_size = res->base.array_size;
+   key->levels = res->base.last_level + 1;
+   key->samples = res->base.nr_samples;
+   key->bind = res->base.bind;
+}
+
+static bool vrend_resource_recycle_texture(struct vrend_resource *gr)
+{
+   static const GLint swizzle[] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
+   const GLenum glformat = tex_conv_table[gr->base.format].glformat;
+   const GLenum gltype = tex_conv_table[gr->base.format].gltype;
+   struct vrend_texture_pool_key key;
+
+   vrend_texture_pool_key_init(&key, gr);
+   gr->gl_id = vrend_texture_pool_get(&key);
+   if (!gr->gl_id)
+      return false;
+
+   /* undo the state the previous resource may have left on the texture */
+   vrend_gl_bind_texture(gr->target, gr->gl_id);
+   if (vrend_state.use_gles) {
+      for (unsigned i = 0; i < 4; ++i)
+         glTexParameteri(gr->target, GL_TEXTURE_SWIZZLE_R + i, swizzle[i]);
+   } else {
+      glTexParameteriv(gr->target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+   }
+   if (gr->base.nr_samples <= 1) {
+      glTexParameteri(gr->target, GL_TEXTURE_BASE_LEVEL, 0);
+      glTexParameteri(gr->target, GL_TEXTURE_MAX_LEVEL, 1000);
+      if (has_feature(feat_texture_srgb_decode))
+         glTexParameteri(gr->target, GL_TEXTURE_SRGB_DECODE_EXT, GL_DECODE_EXT);
+   }
+   vrend_gl_bind_texture(gr->target, 0);
+
+   /* and its contents, which belong to whoever created it */
+   for (uint32_t level = 0; level <= gr->base.last_level; level++) {
+      if (vrend_state.use_gles)
+         glClearTexImageEXT(gr->gl_id, level, glformat, gltype, NULL);
+      else
+         glClearTexImage(gr->gl_id, level, glformat, gltype, NULL);
+   }
+   return true;
+}
+
 static int vrend_resource_alloc_texture(struct vrend_resource *gr,
                                         enum virgl_formats format,
                                         void *image_oes)
@@ -8700,8 +12104,12 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
       gr->target = GL_TEXTURE_2D_ARRAY;
    }
 
+   if (!image_oes && vrend_texture_is_recyclable(gr) &&
+       vrend_resource_recycle_texture(gr))
+      goto done;
+
    glGenTextures(1, &gr->gl_id);
-   glBindTexture(gr->target, gr->gl_id);
+   vrend_gl_bind_texture(gr->target, gr->gl_id);
 
    debug_texture(__func__, gr);
 
@@ -8721,7 +12129,7 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
          }
       } else {
          virgl_error("Missing GL_OES_EGL_image extensions\n");
-         glBindTexture(gr->target, 0);
+         vrend_gl_bind_texture(gr->target, 0);
          return EINVAL;
       }
       gr->storage_bits |= VREND_STORAGE_EGL_IMAGE;
@@ -8732,7 +12140,7 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
 
       if (internalformat == 0) {
          virgl_error("Unknown format is %d\n", pr->format);
-         glBindTexture(gr->target, 0);
+         vrend_gl_bind_texture(gr->target, 0);
          return EINVAL;
       }
 
@@ -8824,7 +12232,7 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
       glTexParameteri(gr->target, GL_TEXTURE_MAX_LEVEL, pr->last_level);
    }
 
-   glBindTexture(gr->target, 0);
+   vrend_gl_bind_texture(gr->target, 0);
 
    if (image_oes && gr->gbm_bo) {
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
@@ -8838,6 +12246,7 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
 #endif
    }
 
+done:
    gt->state.max_lod = -1;
    gt->cur_swizzle[0] = gt->cur_swizzle[1] = gt->cur_swizzle[2] = gt->cur_swizzle[3] = -1;
    gt->cur_base = -1;
@@ -8896,21 +12305,56 @@ vrend_renderer_resource_create(const struct vrend_renderer_resource_create_args
       return NULL;
    }
 
+   /* the storage of the other buffers cannot be released */
+   if (vrend_state.use_buffer_eviction &&
+       has_bit(gr->storage_bits, VREND_STORAGE_GL_BUFFER) &&
+       !has_bit(gr->storage_bits, VREND_STORAGE_GL_IMMUTABLE) && !gr->write_map) {
+      gr->last_used_epoch = vrend_state.evict_epoch;
+      list_addtail(&gr->evict_head, &vrend_state.evictable_buffers);
+   }
+
    return &gr->base;
 }
 
 void vrend_renderer_resource_destroy(struct vrend_resource *res)
 {
    if (has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE)) {
-      glDeleteTextures(1, &res->gl_id);
+      for (uint32_t i = 0; i < MIN2(res->num_blit_views, VREND_MAX_BLIT_VIEWS); i++) {
+         vrend_gl_state_forget_texture(res->blit_view_ids[i]);
+         glDeleteTextures(1, &res->blit_view_ids[i]);
+      }
+      if (vrend_texture_is_recyclable(res)) {
+         struct vrend_texture_pool_key key;
+         vrend_texture_pool_key_init(&key, res);
+         vrend_texture_pool_put(&key, res->gl_id, vrend_resource_memory_size(res));
+      } else {
+         vrend_gl_state_forget_texture(res->gl_id);
+         glDeleteTextures(1, &res->gl_id);
+      }
    } else if (has_bit(res->storage_bits, VREND_STORAGE_GL_BUFFER)) {
+      if (list_is_linked(&res->evict_head))
+         list_del(&res->evict_head);
+      if (res->evicted_data) {
+         free(res->evicted_data);
+         vrend_state.num_evicted_buffers--;
+      }
+      if (res->write_sync)
+         glDeleteSync(res->write_sync);
+      /* deleting the buffer also unmaps it */
+      vrend_gl_state_forget_buffer(res->gl_id);
       glDeleteBuffers(1, &res->gl_id);
-      if (res->tbo_tex_id)
+      if (res->tbo_tex_id) {
+         vrend_gl_state_forget_texture(res->tbo_tex_id);
          glDeleteTextures(1, &res->tbo_tex_id);
+      }
    } else if (has_bit(res->storage_bits, VREND_STORAGE_HOST_SYSTEM_MEMORY)) {
       free(res->ptr);
    }
 
+   free(res->iov_offsets);
+   free(res->cursor_data);
+   vrend_discard_pending_uploads(res);
+
    if (res->rbo_id) {
       glDeleteRenderbuffers(1, &res->rbo_id);
    }
@@ -8933,7 +12377,10 @@ void vrend_renderer_resource_destroy(struct vrend_resource *res)
    if (res->gbm_bo)
       gbm_bo_destroy(res->gbm_bo);
 #endif
-#ifdef WIN32
+#if defined(WIN32) && defined(HAVE_EPOXY_EGL_H)
+   if (res->d3d_tex2d)
+      vrend_d3d_texture_pool_put(res->d3d_tex2d);
+#elif defined(WIN32)
    if (res->d3d_tex2d)
       res->d3d_tex2d->lpVtbl->Release(res->d3d_tex2d);
 #endif
@@ -8951,21 +12398,38 @@ static void iov_buffer_upload(void *cookie, uint32_t doff, void *src, int len)
    glBufferSubData(d->target, d->box->x + doff, len, src);
 }
 
+/* The depth scales are 256 and 1 / 256, so the 24-bit values are scaled by
+ * shifting them, saturated when scaled up.  The loops have no conversions
+ * or branches, and are vectorized by the compiler.
+ */
 static void vrend_scale_depth(void *ptr, int size, float scale_val)
 {
    GLuint *ival = ptr;
-   const GLfloat myscale = 1.0f / 0xffffff;
-   int i;
-   for (i = 0; i < size / 4; i++) {
-      GLuint value = ival[i];
-      GLfloat d = ((float)(value >> 8) * myscale) * scale_val;
-      d = CLAMP(d, 0.0F, 1.0F);
-      ival[i] = (GLuint)(d / myscale) << 8;
+   const int count = size / 4;
+
+   if (scale_val >= 1.0f) {
+      const unsigned shift = util_logbase2((unsigned)scale_val);
+      const GLuint max = 0xffffff >> shift;
+      for (int i = 0; i < count; i++) {
+         const GLuint value = ival[i] >> 8;
+         ival[i] = (value > max ? 0xffffff : value << shift) << 8;
+      }
+   } else {
+      const unsigned shift = util_logbase2((unsigned)(1.0f / scale_val));
+      for (int i = 0; i < count; i++)
+         ival[i] = (ival[i] >> (8 + shift)) << 8;
    }
 }
 
+static const size_t *vrend_resource_iov_offsets(const struct vrend_resource *res,
+                                                const struct iovec *iov)
+{
+   return iov == res->iov ? res->iov_offsets : NULL;
+}
+
 static void read_transfer_data(const struct iovec *iov,
                                unsigned int num_iovs,
+                               const size_t *iov_offsets,
                                char *data,
                                enum virgl_formats format,
                                uint64_t offset,
@@ -8975,41 +12439,25 @@ static void read_transfer_data(const struct iovec *iov,
                                bool invert)
 {
    int blsize = util_format_get_blocksize(format);
-   uint32_t size = vrend_get_iovec_size(iov, num_iovs);
+   uint32_t size = iov_offsets ? iov_offsets[num_iovs] : vrend_get_iovec_size(iov, num_iovs);
    uint32_t send_size = util_format_get_nblocks(format, box->width,
                                               box->height) * blsize * box->depth;
    uint32_t bwx = util_format_get_nblocksx(format, box->width) * blsize;
    int32_t bh = util_format_get_nblocksy(format, box->height);
-   int d, h;
 
    if ((send_size == size || bh == 1) && !invert && box->depth == 1)
-      vrend_read_from_iovec(iov, num_iovs, offset, data, send_size);
-   else {
-      if (invert) {
-         for (d = 0; d < box->depth; d++) {
-            uint32_t myoffset = offset + d * src_layer_stride;
-            for (h = bh - 1; h >= 0; h--) {
-               void *ptr = data + (h * bwx) + d * (bh * bwx);
-               vrend_read_from_iovec(iov, num_iovs, myoffset, ptr, bwx);
-               myoffset += src_stride;
-            }
-         }
-      } else {
-         for (d = 0; d < box->depth; d++) {
-            uint32_t myoffset = offset + d * src_layer_stride;
-            for (h = 0; h < bh; h++) {
-               void *ptr = data + (h * bwx) + d * (bh * bwx);
-               vrend_read_from_iovec(iov, num_iovs, myoffset, ptr, bwx);
-               myoffset += src_stride;
-            }
-         }
-      }
-   }
+      vrend_iov_copy_box(iov, num_iovs, iov_offsets, offset, data,
+                         send_size, 1, send_size, 1, 0, false, false);
+   else
+      vrend_iov_copy_box(iov, num_iovs, iov_offsets, offset, data,
+                         bwx, bh, src_stride, box->depth, src_layer_stride,
+                         invert, false);
 }
 
 static void write_transfer_data(struct pipe_resource *res,
                                 const struct iovec *iov,
                                 unsigned num_iovs,
+                                const size_t *iov_offsets,
                                 char *data,
                                 uint32_t dst_stride,
                                 struct pipe_box *box,
@@ -9018,35 +12466,21 @@ static void write_transfer_data(struct pipe_resource *res,
                                 bool invert)
 {
    int blsize = util_format_get_blocksize(res->format);
-   uint32_t size = vrend_get_iovec_size(iov, num_iovs);
+   uint32_t size = iov_offsets ? iov_offsets[num_iovs] : vrend_get_iovec_size(iov, num_iovs);
    uint32_t send_size = util_format_get_nblocks(res->format, box->width,
                                                 box->height) * blsize * box->depth;
    uint32_t bwx = util_format_get_nblocksx(res->format, box->width) * blsize;
    int32_t bh = util_format_get_nblocksy(res->format, box->height);
-   int d, h;
    uint32_t stride = dst_stride ? dst_stride : util_format_get_nblocksx(res->format, u_minify(res->width0, level)) * blsize;
 
-   if ((send_size == size || bh == 1) && !invert && box->depth == 1) {
-      vrend_write_to_iovec(iov, num_iovs, offset, data, send_size);
-   } else if (invert) {
-      for (d = 0; d < box->depth; d++) {
-         uint32_t myoffset = offset + d * stride * u_minify(res->height0, level);
-         for (h = bh - 1; h >= 0; h--) {
-            void *ptr = data + (h * bwx) + d * (bh * bwx);
-            vrend_write_to_iovec(iov, num_iovs, myoffset, ptr, bwx);
-            myoffset += stride;
-         }
-      }
-   } else {
-      for (d = 0; d < box->depth; d++) {
-         uint32_t myoffset = offset + d * stride * u_minify(res->height0, level);
-         for (h = 0; h < bh; h++) {
-            void *ptr = data + (h * bwx) + d * (bh * bwx);
-            vrend_write_to_iovec(iov, num_iovs, myoffset, ptr, bwx);
-            myoffset += stride;
-         }
-      }
-   }
+   if ((send_size == size || bh == 1) && !invert && box->depth == 1)
+      vrend_iov_copy_box(iov, num_iovs, iov_offsets, offset, data,
+                         send_size, 1, send_size, 1, 0, false, true);
+   else
+      vrend_iov_copy_box(iov, num_iovs, iov_offsets, offset, data,
+                         bwx, bh, stride, box->depth,
+                         (size_t)stride * u_minify(res->height0, level),
+                         invert, true);
 }
 
 static bool check_transfer_iovec(struct vrend_resource *res,
@@ -9137,12 +12571,11 @@ static uint64_t vrend_transfer_size(struct vrend_resource *vres,
    return size;
 }
 
-static bool check_iov_bounds(struct vrend_resource *res,
-                             const struct vrend_transfer_info *info,
-                             const struct iovec *iov, int num_iovs)
+static bool check_transfer_bounds(struct vrend_resource *res,
+                                  const struct vrend_transfer_info *info,
+                                  GLuint iovsize)
 {
    GLuint transfer_size;
-   GLuint iovsize = vrend_get_iovec_size(iov, num_iovs);
    GLuint valid_stride, valid_layer_stride;
 
    /* If the transfer specifies a stride, verify that it's at least as large as
@@ -9193,83 +12626,253 @@ static bool check_iov_bounds(struct vrend_resource *res,
    return true;
 }
 
-static void vrend_swizzle_data_bgra(uint64_t size, void *data) {
-   const size_t bpp = 4;
-   const size_t num_pixels = size / bpp;
-   for (size_t i = 0; i < num_pixels; ++i) {
-      unsigned char *pixel = ((unsigned char*)data) + i * bpp;
-      unsigned char first  = *pixel;
-      *pixel = *(pixel + 2);
-      *(pixel + 2) = first;
-   }
+static bool check_iov_bounds(struct vrend_resource *res,
+                             const struct vrend_transfer_info *info,
+                             const struct iovec *iov, int num_iovs)
+{
+   return check_transfer_bounds(res, info, vrend_get_iovec_size(iov, num_iovs));
 }
 
-static void vrend_swizzle_and_collapse_data_bgrx(uint64_t size, void *data) {
-   const size_t in_bpp = 4;
-   const size_t out_bpp = 3;
+/* Buffer writes that have to be ordered after the GPU work still using the
+ * buffer are staged in the upload ring and copied on the GPU, instead of
+ * letting the driver wait for that work or copy the data once more.  The ring
+ * sections are fenced, so their reuse does not wait on the GPU either.
+ * Larger writes would cycle through the ring too fast. */
+#define VREND_RING_WRITE_MAX_SIZE (64 * 1024)
 
-   uint8_t *in_pixel, *out_pixel;
-   in_pixel = out_pixel = data;
+static void *vrend_buffer_ring_alloc(uint32_t size, uint32_t *ring_offset)
+{
+   if (!vrend_state.use_upload_ring || !size || size > VREND_RING_WRITE_MAX_SIZE)
+      return NULL;
+   return vrend_upload_ring_alloc(size, ring_offset);
+}
+
+static void vrend_buffer_copy_from_ring(struct vrend_resource *res, uint32_t ring_offset,
+                                        uint32_t offset, uint32_t size)
+{
+   vrend_gl_bind_buffer(GL_COPY_READ_BUFFER, vrend_upload_ring_buffer());
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+   glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, ring_offset, offset, size);
+   vrend_gl_bind_buffer(GL_COPY_READ_BUFFER, 0);
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+static bool vrend_buffer_write_from_ring(struct vrend_resource *res,
+                                         const struct iovec *iov, int num_iovs,
+                                         const struct vrend_transfer_info *info)
+{
+   uint32_t ring_offset;
+   void *data = vrend_buffer_ring_alloc(info->box->width, &ring_offset);
+   if (!data)
+      return false;
+
+   vrend_read_from_iovec(iov, num_iovs, info->offset, data, info->box->width);
+   vrend_buffer_copy_from_ring(res, ring_offset, info->box->x, info->box->width);
+   return true;
+}
+
+static bool vrend_sync_is_signaled(GLsync sync)
+{
+   GLenum ret = glClientWaitSync(sync, 0, 0);
+   return ret == GL_ALREADY_SIGNALED || ret == GL_CONDITION_SATISFIED;
+}
 
-   // in-place modification, so output cursor must not lead
-   assert(in_bpp >= out_bpp);
+/* Writes to persistently mapped buffers.  Unsynchronized writes go straight
+ * through the mapping, synchronized ones let GL order them after the
+ * commands that still use the buffer.  The GL copy of the latter might land
+ * later, so the next direct write is ordered after it too while it is
+ * pending, and only waits for it when the ring can't take the data. */
+static void vrend_buffer_write(struct vrend_resource *res,
+                               const struct iovec *iov, int num_iovs,
+                               const struct vrend_transfer_info *info)
+{
+   if (res->write_sync && vrend_sync_is_signaled(res->write_sync)) {
+      glDeleteSync(res->write_sync);
+      res->write_sync = NULL;
+   }
+
+   if (!info->synchronized && !res->write_sync) {
+      vrend_read_from_iovec(iov, num_iovs, info->offset,
+                            (char *)res->write_map + info->box->x, info->box->width);
+      return;
+   }
 
-   uint8_t r, g, b;
-   const size_t num_pixels = size / in_bpp;
-   for (size_t i = 0; i < num_pixels; ++i) {
-      b = *(in_pixel + 0);
-      g = *(in_pixel + 1);
-      r = *(in_pixel + 2);
+   if (!vrend_buffer_write_from_ring(res, iov, num_iovs, info)) {
+      if (!info->synchronized) {
+         vrend_wait_sync(res->write_sync);
+         res->write_sync = NULL;
+         vrend_read_from_iovec(iov, num_iovs, info->offset,
+                               (char *)res->write_map + info->box->x, info->box->width);
+         return;
+      }
 
-      *(out_pixel + 0) = r;
-      *(out_pixel + 1) = g;
-      *(out_pixel + 2) = b;
+      struct virgl_sub_upload_data d;
+      d.box = info->box;
+      d.target = GL_COPY_WRITE_BUFFER;
 
-      in_pixel += in_bpp;
-      out_pixel += out_bpp;
+      vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+      vrend_read_from_iovec_cb(iov, num_iovs, info->offset, info->box->width,
+                               &iov_buffer_upload, &d);
+      vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
    }
+
+   if (res->write_sync)
+      glDeleteSync(res->write_sync);
+   res->write_sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-static void vrend_collapse_data_r8g8b8x8(uint64_t size, void *data) {
-   const size_t in_bpp = 4;
-   const size_t out_bpp = 3;
+/* Buffer uploads up to this size are staged and merged with the adjacent
+ * or overlapping ones of the same buffer, larger ones go to GL directly. */
+#define VREND_PENDING_UPLOAD_MAX_SIZE 4096
+#define VREND_PENDING_UPLOAD_MAX_RANGES 16
+#define VREND_PENDING_UPLOAD_MAX_BYTES (256 * 1024)
+
+struct vrend_pending_upload {
+   uint32_t start;
+   uint32_t end;
+   uint8_t *data;
+};
+
+/* the ranges are disjoint and not adjacent to each other */
+struct vrend_pending_uploads {
+   struct list_head head;
+   struct vrend_resource *res;
+   uint32_t num_ranges;
+   uint32_t bytes;
+   struct vrend_pending_upload ranges[VREND_PENDING_UPLOAD_MAX_RANGES];
+};
+
+static void vrend_discard_pending_uploads(struct vrend_resource *res)
+{
+   struct vrend_pending_uploads *pending = res->pending_uploads;
+
+   if (!pending)
+      return;
+
+   for (uint32_t i = 0; i < pending->num_ranges; i++)
+      free(pending->ranges[i].data);
+
+   list_del(&pending->head);
+   FREE(pending);
+   res->pending_uploads = NULL;
+}
 
-   uint8_t *in_pixel, *out_pixel;
-   in_pixel = out_pixel = data;
+static void vrend_flush_pending_uploads(struct vrend_resource *res)
+{
+   struct vrend_pending_uploads *pending = res->pending_uploads;
 
-   // in-place modification, so output cursor must not lead
-   assert(in_bpp >= out_bpp);
+   if (!pending)
+      return;
 
-   const size_t num_pixels = size / in_bpp;
-   for (size_t i = 0; i < num_pixels; ++i) {
-      *(out_pixel + 0) = *(in_pixel + 0);
-      *(out_pixel + 1) = *(in_pixel + 1);
-      *(out_pixel + 2) = *(in_pixel + 2);
+   for (uint32_t i = 0; i < pending->num_ranges; i++) {
+      struct vrend_pending_upload *range = &pending->ranges[i];
+      const uint32_t size = range->end - range->start;
+      uint32_t ring_offset;
+      void *data = vrend_buffer_ring_alloc(size, &ring_offset);
 
-      in_pixel += in_bpp;
-      out_pixel += out_bpp;
+      if (data) {
+         memcpy(data, range->data, size);
+         vrend_buffer_copy_from_ring(res, ring_offset, range->start, size);
+      } else {
+         /* the target of the resource might be part of the bound VAO */
+         vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+         glBufferSubData(GL_COPY_WRITE_BUFFER, range->start, size, range->data);
+         vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+      }
    }
+
+   vrend_state.num_issued_uploads += pending->num_ranges;
+   vrend_discard_pending_uploads(res);
+}
+
+void vrend_renderer_flush_uploads(void)
+{
+   list_for_each_entry_safe(struct vrend_pending_uploads, pending,
+                            &vrend_state.pending_upload_list, head)
+      vrend_flush_pending_uploads(pending->res);
 }
 
-static void vrend_collapse_data_r16g16b16x16(uint64_t size, void *data) {
-   const size_t in_channels = 4;
-   const size_t out_channels = 3;
+static void vrend_free_pending_uploads(void)
+{
+   list_for_each_entry_safe(struct vrend_pending_uploads, pending,
+                            &vrend_state.pending_upload_list, head)
+      vrend_discard_pending_uploads(pending->res);
+}
+
+/* Returns true when the upload was staged, the data is copied so the iovec
+ * does not have to outlive the call. */
+static bool vrend_queue_upload(struct vrend_resource *res,
+                               const struct iovec *iov, int num_iovs,
+                               const struct vrend_transfer_info *info)
+{
+   struct vrend_pending_uploads *pending = res->pending_uploads;
+   uint32_t start = info->box->x;
+   uint32_t end = start + info->box->width;
+   uint32_t merged_start = start, merged_end = end;
+   uint32_t merged_bytes = 0, num_merged = 0;
+   uint8_t *data;
+
+   if (!vrend_state.use_upload_coalescing || res->buffer_storage_flags || res->write_map ||
+       !info->box->width || info->box->width > VREND_PENDING_UPLOAD_MAX_SIZE)
+      return false;
+
+   if (pending) {
+      /* the ranges are not adjacent to each other, so only the ones that
+       * touch the new range end up merged with it */
+      for (uint32_t i = 0; i < pending->num_ranges; i++) {
+         struct vrend_pending_upload *range = &pending->ranges[i];
+         if (range->start <= end && range->end >= start) {
+            merged_start = MIN2(merged_start, range->start);
+            merged_end = MAX2(merged_end, range->end);
+            merged_bytes += range->end - range->start;
+            num_merged++;
+         }
+      }
+
+      if ((!num_merged && pending->num_ranges == VREND_PENDING_UPLOAD_MAX_RANGES) ||
+          pending->bytes - merged_bytes + (merged_end - merged_start) > VREND_PENDING_UPLOAD_MAX_BYTES) {
+         vrend_flush_pending_uploads(res);
+         return vrend_queue_upload(res, iov, num_iovs, info);
+      }
+   } else {
+      pending = CALLOC_STRUCT(vrend_pending_uploads);
+      if (!pending)
+         return false;
+      pending->res = res;
+      list_addtail(&pending->head, &vrend_state.pending_upload_list);
+      res->pending_uploads = pending;
+   }
 
-   uint16_t *in_pixel, *out_pixel;
-   in_pixel = out_pixel = data;
+   data = malloc(merged_end - merged_start);
+   if (!data) {
+      vrend_flush_pending_uploads(res);
+      return false;
+   }
 
-   // in-place modification, so output cursor must not lead
-   assert(in_channels >= out_channels);
+   for (uint32_t i = 0; i < pending->num_ranges;) {
+      struct vrend_pending_upload *range = &pending->ranges[i];
+      if (range->start <= end && range->end >= start) {
+         memcpy(data + range->start - merged_start, range->data, range->end - range->start);
+         free(range->data);
+         pending->bytes -= range->end - range->start;
+         *range = pending->ranges[--pending->num_ranges];
+      } else {
+         i++;
+      }
+   }
 
-   const size_t num_pixels = size / in_channels / 2;
-   for (size_t i = 0; i < num_pixels; ++i) {
-      *(out_pixel + 0) = *(in_pixel + 0);
-      *(out_pixel + 1) = *(in_pixel + 1);
-      *(out_pixel + 2) = *(in_pixel + 2);
+   /* the new data replaces what the merged ranges had queued before */
+   vrend_read_from_iovec(iov, num_iovs, info->offset, (char *)data + start - merged_start,
+                         info->box->width);
 
-      in_pixel += in_channels;
-      out_pixel += out_channels;
-   }
+   pending->ranges[pending->num_ranges++] = (struct vrend_pending_upload) {
+      .start = merged_start,
+      .end = merged_end,
+      .data = data,
+   };
+   pending->bytes += merged_end - merged_start;
+   vrend_state.num_queued_uploads++;
+   return true;
 }
 
 static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
@@ -9279,6 +12882,8 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
 {
    void *data;
 
+   vrend_resource_invalidate_cursor(res);
+
    if ((is_only_bit(res->storage_bits, VREND_STORAGE_GUEST_MEMORY) ||
        has_bit(res->storage_bits, VREND_STORAGE_HOST_SYSTEM_MEMORY)) && res->iov) {
       return vrend_copy_iovec(iov, num_iovs, info->offset,
@@ -9299,10 +12904,24 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       d.box = info->box;
       d.target = res->target;
 
+      if (res->write_map) {
+         vrend_buffer_write(res, iov, num_iovs, info);
+         return 0;
+      }
+
+      if (vrend_queue_upload(res, iov, num_iovs, info))
+         return 0;
+      /* the queued uploads must not land on top of this one */
+      vrend_flush_pending_uploads(res);
+
+      /* mapping would wait for the GPU */
+      if (info->synchronized && vrend_buffer_write_from_ring(res, iov, num_iovs, info))
+         return 0;
+
       if (!info->synchronized)
          map_flags |= GL_MAP_UNSYNCHRONIZED_BIT;
 
-      glBindBufferARB(res->target, res->gl_id);
+      vrend_gl_bind_buffer(res->target, res->gl_id);
       data = glMapBufferRange(res->target, info->box->x, info->box->width, map_flags);
       if (data == NULL) {
          virgl_error("Map failed for element buffer\n");
@@ -9311,7 +12930,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          vrend_read_from_iovec(iov, num_iovs, info->offset, data, info->box->width);
          glUnmapBuffer(res->target);
       }
-      glBindBufferARB(res->target, 0);
+      vrend_gl_bind_buffer(res->target, 0);
    } else {
       GLenum glformat;
       GLenum gltype;
@@ -9319,11 +12938,13 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       int elsize = util_format_get_blocksize(res->base.format);
       int x = 0, y = 0;
       bool compressed;
+      bool emulated;
       bool invert = false;
       float depth_scale;
       uint64_t send_size = 0;
       uint32_t stride = info->stride;
       uint32_t layer_stride = info->layer_stride;
+      bool use_ring = false;
 
       vrend_use_program(NULL);
 
@@ -9335,6 +12956,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
                                                 u_minify(res->base.height0, info->level));
 
       compressed = util_format_is_compressed(res->base.format);
+      emulated = vrend_format_is_emulated_compression(res->base.format);
       if (num_iovs > 1 || compressed) {
          need_temp = true;
       }
@@ -9371,13 +12993,51 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
             return EINVAL;
          }
 
-         data = malloc(send_size);
+         /* the data is gathered straight into the upload ring unless it has
+          * to be modified on the CPU after that, the ring is write-only */
+         uint32_t ring_offset = 0;
+         data = NULL;
+         if (vrend_state.use_upload_ring &&
+             !(vrend_state.use_gles && (vrend_format_is_bgra(res->base.format) ||
+                                        vrend_resource_get_internal_format_override(res) != GL_NONE)) &&
+             res->base.format != VIRGL_FORMAT_Z24X8_UNORM && !emulated) {
+            data = vrend_upload_ring_alloc(send_size, &ring_offset);
+            use_ring = data != NULL;
+         }
+
+         if (!data)
+            data = vrend_staging_alloc(send_size);
          if (!data) {
             virgl_error("Memory allocation failed for %"PRIu64"\n", send_size);
             return ENOMEM;
          }
-         read_transfer_data(iov, num_iovs, data, res->base.format, info->offset,
+         read_transfer_data(iov, num_iovs, vrend_resource_iov_offsets(res, iov),
+                            data, res->base.format, info->offset,
                             stride, layer_stride, info->box, invert);
+
+         /* only the blocks of the box are decoded, the texture keeps the
+          * texels of the previous writes */
+         if (emulated) {
+            uint64_t decoded_size = (uint64_t)info->box->width * info->box->height *
+                                    info->box->depth *
+                                    vrend_etc2_get_texel_size(res->base.format);
+            void *decoded = vrend_staging_alloc(decoded_size);
+            if (!decoded) {
+               virgl_error("Memory allocation failed for %"PRIu64"\n", decoded_size);
+               vrend_staging_free(data);
+               return ENOMEM;
+            }
+            vrend_etc2_decode(res->base.format, data, info->box->width,
+                              info->box->height, info->box->depth, decoded);
+            vrend_staging_free(data);
+            data = decoded;
+            compressed = false;
+         }
+
+         if (use_ring) {
+            vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, vrend_upload_ring_buffer());
+            data = (void *)(uintptr_t)ring_offset;
+         }
       } else {
          if (send_size > iov[0].iov_len - info->offset)
             return EINVAL;
@@ -9409,6 +13069,10 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          break;
       }
 
+      /* the decoded rows are tightly packed */
+      if (emulated)
+         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
       glformat = tex_conv_table[res->base.format].glformat;
       gltype = tex_conv_table[res->base.format].gltype;
 
@@ -9422,7 +13086,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
 
          buffers = GL_COLOR_ATTACHMENT0;
          glDrawBuffers(1, &buffers);
-         glDisable(GL_BLEND);
+         vrend_gl_enable(GL_BLEND, false);
 
          vrend_depth_test_enable(ctx->sub, false);
          vrend_alpha_test_enable(ctx->sub, false);
@@ -9435,7 +13099,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          glDeleteFramebuffers(1, &fb_id);
       } else {
          uint32_t comp_size;
-         glBindTexture(res->target, res->gl_id);
+         vrend_gl_bind_texture(res->target, res->gl_id);
 
          if (compressed) {
             glformat = tex_conv_table[res->base.format].internalformat;
@@ -9569,8 +13233,10 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
 
       glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-      if (need_temp)
-         free(data);
+      if (use_ring)
+         vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      else if (need_temp)
+         vrend_staging_free(data);
    }
    return 0;
 }
@@ -9587,6 +13253,279 @@ static uint32_t vrend_get_texture_depth(struct vrend_resource *res, uint32_t lev
    return depth;
 }
 
+static void vrend_readback_destroy(struct vrend_readback *rb)
+{
+   list_del(&rb->head);
+   if (rb->sync)
+      glDeleteSync(rb->sync);
+   vrend_gl_state_forget_buffer(rb->pbo_id);
+   glDeleteBuffers(1, &rb->pbo_id);
+   vrend_resource_reference(&rb->res, NULL);
+   FREE(rb);
+}
+
+/* Returns a readback with its PBO bound to GL_PIXEL_PACK_BUFFER, or NULL
+ * when the transfer has to complete synchronously.  Only transfers into the
+ * iovec attached to the resource are deferred, that one stays valid until
+ * the readback completes. */
+static struct vrend_readback *vrend_readback_create(struct vrend_resource *res,
+                                                    const struct iovec *iov,
+                                                    uint64_t size)
+{
+   struct vrend_readback *rb;
+
+   if (!vrend_state.use_async_readback || iov != res->iov || !size || size > UINT32_MAX)
+      return NULL;
+
+   rb = CALLOC_STRUCT(vrend_readback);
+   if (!rb)
+      return NULL;
+
+   glGenBuffers(1, &rb->pbo_id);
+   vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, rb->pbo_id);
+   glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+   rb->size = size;
+   list_inithead(&rb->head);
+   return rb;
+}
+
+static void vrend_readback_queue(struct vrend_readback *rb,
+                                 struct vrend_resource *res,
+                                 const struct vrend_transfer_info *info,
+                                 uint32_t data_offset,
+                                 bool invert)
+{
+   vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+
+   rb->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   /* get the read going, it may be waited for from another context */
+   glFlush();
+
+   vrend_resource_reference(&rb->res, res);
+   rb->data_offset = data_offset;
+   rb->stride = info->stride;
+   rb->box = *info->box;
+   rb->level = info->level;
+   rb->offset = info->offset;
+   rb->invert = invert;
+   rb->seqno = vrend_state.num_readbacks++;
+   list_addtail(&rb->head, &vrend_state.readback_list);
+}
+
+static bool vrend_readback_finish(struct vrend_readback *rb, bool can_block)
+{
+   GLenum ret;
+   char *data;
+
+   do {
+      ret = glClientWaitSync(rb->sync, GL_SYNC_FLUSH_COMMANDS_BIT, can_block ? 1000000000 : 0);
+   } while (ret == GL_TIMEOUT_EXPIRED && can_block);
+
+   if (ret == GL_TIMEOUT_EXPIRED)
+      return false;
+
+   if (ret == GL_WAIT_FAILED)
+      virgl_warn("Wait sync failed: illegal readback fence object %p\n", (void*) rb->sync);
+
+   if (rb->res->iov) {
+      vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, rb->pbo_id);
+      data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rb->size, GL_MAP_READ_BIT);
+      if (data) {
+         write_transfer_data(&rb->res->base, rb->res->iov, rb->res->num_iovs,
+                             rb->res->iov_offsets,
+                             data + rb->data_offset, rb->stride, &rb->box,
+                             rb->level, rb->offset, rb->invert);
+         glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      } else {
+         virgl_error("Unable to map readback buffer\n");
+      }
+      vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+   }
+
+   vrend_readback_destroy(rb);
+   return true;
+}
+
+/* Complete the readbacks of res, or all of them when res is NULL */
+static void vrend_finish_readbacks(struct vrend_resource *res)
+{
+   list_for_each_entry_safe(struct vrend_readback, rb, &vrend_state.readback_list, head) {
+      if (!res || rb->res == res)
+         vrend_readback_finish(rb, true);
+   }
+}
+
+#define VREND_EVICT_PERIOD_NS (1000ull * 1000 * 1000)
+/* smaller buffers are not worth the readback */
+#define VREND_EVICT_MIN_SIZE (64 * 1024)
+
+/* The contents of a cold buffer are read back to system memory, and its GL
+ * storage is replaced by an empty one.  The name stays, so the bindings and
+ * the texture buffers that refer to it stay valid, and the contents are
+ * uploaded again by vrend_resource_touch on the next use.
+ */
+static bool vrend_buffer_evict(struct vrend_resource *res)
+{
+   const uint32_t size = res->base.width0;
+   void *data = malloc(size);
+   if (!data)
+      return false;
+
+   vrend_finish_readbacks(res);
+
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+   const void *map = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, GL_MAP_READ_BIT);
+   if (map) {
+      memcpy(data, map, size);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+      glBufferData(GL_COPY_WRITE_BUFFER, 0, NULL, res->buffer_usage);
+   }
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+
+   if (!map) {
+      free(data);
+      return false;
+   }
+
+   res->evicted_data = data;
+   vrend_state.num_evicted_buffers++;
+   return true;
+}
+
+static void vrend_buffer_restore(struct vrend_resource *res)
+{
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+   glBufferData(GL_COPY_WRITE_BUFFER, res->base.width0, res->evicted_data,
+                res->buffer_usage);
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+
+   free(res->evicted_data);
+   res->evicted_data = NULL;
+   vrend_state.num_evicted_buffers--;
+}
+
+#ifdef ENABLE_TESTS
+static struct vrend_resource *vrend_renderer_lookup_evictable_buffer(uint32_t res_handle)
+{
+   struct virgl_resource *res = virgl_resource_lookup(res_handle);
+   if (!res || !res->pipe_resource)
+      return NULL;
+
+   struct vrend_resource *vres = (struct vrend_resource *)res->pipe_resource;
+   return list_is_linked(&vres->evict_head) ? vres : NULL;
+}
+
+int vrend_renderer_resource_evict(uint32_t res_handle)
+{
+   struct vrend_resource *res = vrend_renderer_lookup_evictable_buffer(res_handle);
+   if (!res || res->evicted_data)
+      return EINVAL;
+
+   vrend_renderer_force_ctx_0();
+   if (!vrend_buffer_evict(res))
+      return ENOMEM;
+
+   glFlush();
+   return 0;
+}
+
+int vrend_renderer_resource_get_buffer_storage(uint32_t res_handle, uint32_t *size,
+                                               GLenum *usage)
+{
+   struct vrend_resource *res = vrend_renderer_lookup_evictable_buffer(res_handle);
+   if (!res)
+      return EINVAL;
+
+   GLint value;
+   vrend_renderer_force_ctx_0();
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, res->gl_id);
+   glGetBufferParameteriv(GL_COPY_WRITE_BUFFER, GL_BUFFER_SIZE, &value);
+   *size = value;
+   glGetBufferParameteriv(GL_COPY_WRITE_BUFFER, GL_BUFFER_USAGE, &value);
+   *usage = value;
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+
+   return 0;
+}
+#endif
+
+/* the free video memory in KiB, or UINT64_MAX when the driver does not tell */
+static uint64_t vrend_renderer_get_free_video_memory(void)
+{
+   GLint free_kb[4] = { 0 };
+
+   if (has_feature(feat_nvx_gpu_memory_info))
+      glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, free_kb);
+   else if (has_feature(feat_ati_meminfo))
+      glGetIntegerv(GL_VBO_FREE_MEMORY_ATI, free_kb);
+   else
+      return UINT64_MAX;
+
+   return free_kb[0];
+}
+
+/* Once per epoch, the buffers that have not been used for evict_cold_epochs
+ * are evicted when the driver is short of video memory or a context went
+ * over its soft budget.
+ */
+static void vrend_renderer_check_memory_pressure(void)
+{
+   const uint64_t now = virgl_command_stats_now();
+   if (now - vrend_state.evict_epoch_start < VREND_EVICT_PERIOD_NS)
+      return;
+
+   vrend_state.evict_epoch_start = now;
+   vrend_state.evict_epoch++;
+
+   if (!vrend_state.evict_requested) {
+      if (!has_feature(feat_nvx_gpu_memory_info) && !has_feature(feat_ati_meminfo))
+         return;
+
+      vrend_renderer_force_ctx_0();
+      if (vrend_renderer_get_free_video_memory() >= vrend_state.evict_min_free_kb)
+         return;
+   } else {
+      vrend_renderer_force_ctx_0();
+      vrend_state.evict_requested = false;
+   }
+
+   uint32_t count = 0;
+   uint64_t size = 0;
+   list_for_each_entry(struct vrend_resource, res, &vrend_state.evictable_buffers, evict_head) {
+      if (res->evicted_data || res->pending_uploads ||
+          res->base.width0 < VREND_EVICT_MIN_SIZE ||
+          vrend_state.evict_epoch - res->last_used_epoch < vrend_state.evict_cold_epochs)
+         continue;
+
+      if (vrend_buffer_evict(res)) {
+         count++;
+         size += res->base.width0;
+      }
+   }
+
+   if (count) {
+      /* the other GL contexts see the released storage */
+      glFlush();
+      virgl_debug("Evicted %u cold buffers, %" PRIu64 " KiB\n", count, size / 1024);
+   }
+}
+
+static void vrend_free_readbacks(void)
+{
+   list_for_each_entry_safe(struct vrend_readback, rb, &vrend_state.readback_list, head)
+      vrend_readback_destroy(rb);
+}
+
+/* Complete the readbacks that were queued before seqno and the ones that
+ * are already done after that. */
+static void vrend_renderer_check_readbacks(uint64_t seqno)
+{
+   list_for_each_entry_safe(struct vrend_readback, rb, &vrend_state.readback_list, head) {
+      if (!vrend_readback_finish(rb, rb->seqno < seqno))
+         break;
+   }
+}
+
 static int vrend_transfer_send_getteximage(struct vrend_resource *res,
                                            const struct iovec *iov, int num_iovs,
                                            const struct vrend_transfer_info *info)
@@ -9617,9 +13556,15 @@ static int vrend_transfer_send_getteximage(struct vrend_resource *res,
       send_offset = util_format_get_nblocks(res->base.format, u_minify(res->base.width0, info->level), u_minify(res->base.height0, info->level)) * util_format_get_blocksize(res->base.format) * info->box->z;
    }
 
-   data = malloc(tex_size);
-   if (!data)
-      return ENOMEM;
+   struct vrend_readback *rb = vrend_readback_create(res, iov, tex_size);
+   if (rb) {
+      /* offset into the PBO */
+      data = NULL;
+   } else {
+      data = vrend_staging_alloc(tex_size);
+      if (!data)
+         return ENOMEM;
+   }
 
    switch (elsize) {
    case 1:
@@ -9637,7 +13582,7 @@ static int vrend_transfer_send_getteximage(struct vrend_resource *res,
       break;
    }
 
-   glBindTexture(res->target, res->gl_id);
+   vrend_gl_bind_texture(res->target, res->gl_id);
    if (res->target == GL_TEXTURE_CUBE_MAP) {
       target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + info->box->z;
    } else
@@ -9663,10 +13608,16 @@ static int vrend_transfer_send_getteximage(struct vrend_resource *res,
 
    glPixelStorei(GL_PACK_ALIGNMENT, 4);
 
-   write_transfer_data(&res->base, iov, num_iovs, data + send_offset,
+   if (rb) {
+      vrend_readback_queue(rb, res, info, send_offset, false);
+      return 0;
+   }
+
+   write_transfer_data(&res->base, iov, num_iovs, vrend_resource_iov_offsets(res, iov),
+                       data + send_offset,
                        info->stride, info->box, info->level, info->offset,
                        false);
-   free(data);
+   vrend_staging_free(data);
    return 0;
 }
 
@@ -9746,6 +13697,8 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
    float depth_scale;
    int row_stride = info->stride / elsize;
    GLint old_fbo;
+   struct vrend_readback *rb = NULL;
+   bool defer;
 
    vrend_use_program(NULL);
 
@@ -9784,7 +13737,12 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
    glPixelStorei(GL_PACK_SWAP_BYTES, 1);
 #endif
 
-   if (num_iovs > 1 || separate_invert)
+   /* formats that are still fixed up on the CPU are read synchronously */
+   defer = vrend_state.use_async_readback &&
+           !(vrend_state.use_gles && vrend_format_is_bgra(res->base.format)) &&
+           !(vrend_state.use_core_profile && res->base.format == VIRGL_FORMAT_Z24X8_UNORM);
+
+   if (num_iovs > 1 || separate_invert || defer)
       need_temp = 1;
 
    if (vrend_state.use_gles && vrend_format_is_bgra(res->base.format))
@@ -9802,10 +13760,18 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
          return EINVAL;
       }
 
-      data = malloc(send_size);
-      if (!data) {
-         virgl_error("Memory allocation failed for %"PRIu64"\n", send_size);
-         return ENOMEM;
+      if (defer)
+         rb = vrend_readback_create(res, iov, send_size);
+
+      if (rb) {
+         /* offset into the PBO */
+         data = NULL;
+      } else {
+         data = vrend_staging_alloc(send_size);
+         if (!data) {
+            virgl_error("Memory allocation failed for %"PRIu64"\n", send_size);
+            return ENOMEM;
+         }
       }
    } else {
       send_size = iov[0].iov_len - info->offset;
@@ -9882,11 +13848,13 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
    glPixelStorei(GL_PACK_SWAP_BYTES, 0);
 #endif
 
-   if (need_temp) {
-      write_transfer_data(&res->base, iov, num_iovs, data,
-                          info->stride, info->box, info->level, info->offset,
+   if (rb) {
+      vrend_readback_queue(rb, res, info, 0, separate_invert);
+   } else if (need_temp) {
+      write_transfer_data(&res->base, iov, num_iovs, vrend_resource_iov_offsets(res, iov),
+                          data, info->stride, info->box, info->level, info->offset,
                           separate_invert);
-      free(data);
+      vrend_staging_free(data);
    }
 
    glBindFramebuffer(GL_FRAMEBUFFER, old_fbo);
@@ -9945,14 +13913,14 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
    }
 
    if (has_bit(res->storage_bits, VREND_STORAGE_GL_BUFFER)) {
-      glBindBufferARB(res->target, res->gl_id);
-      void *data = glMapBufferRange(res->target, info->box->x, info->box->width, GL_MAP_READ_BIT);
+      vrend_gl_bind_buffer(res->target, res->gl_id);
+      void *data = vrend_buffer_map_read(res, res->target, info->box->x, info->box->width);
       if (!data)
          virgl_error("Unable to open buffer for reading %d\n", res->target);
       else
          vrend_write_to_iovec(iov, num_iovs, info->offset, data, info->box->width);
-      glUnmapBuffer(res->target);
-      glBindBufferARB(res->target, 0);
+      vrend_buffer_unmap_read(res, res->target);
+      vrend_gl_bind_buffer(res->target, 0);
    } else {
       int ret = -1;
       bool can_readpixels = true;
@@ -9962,9 +13930,11 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
       if (can_readpixels)
          ret = vrend_transfer_send_readpixels(ctx, res, iov, num_iovs, info);
 
-      /* Can hit this on a non-error path as well. */
+      /* Can hit this on a non-error path as well.  The texture of an
+       * emulated compressed format does not hold the blocks to get. */
       if (ret) {
-         if (!vrend_state.use_gles)
+         if (!vrend_state.use_gles &&
+             !vrend_format_is_emulated_compression(res->base.format))
             ret = vrend_transfer_send_getteximage(res, iov, num_iovs, info);
          else
             ret = vrend_transfer_send_readonly(res, iov, num_iovs, info);
@@ -9975,6 +13945,19 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
    return 0;
 }
 
+#if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
+/* Whether the writes to the GBM buffer of the resource go through its EGL
+ * image, the GPU then copies the data to the buffer, instead of the CPU
+ * writing to a mapping of the memory of the other GPU.  EGL images with
+ * BGRX format are stored with only 3bpp and are always mapped. */
+static bool vrend_resource_gbm_writes_on_gpu(const struct vrend_resource *res)
+{
+   return vrend_state.use_gbm_gpu_writes &&
+          has_bit(res->storage_bits, VREND_STORAGE_EGL_IMAGE) &&
+          res->base.format != VIRGL_FORMAT_B8G8R8X8_UNORM;
+}
+#endif
+
 static int vrend_renderer_transfer_internal(struct vrend_context *ctx,
                                             struct vrend_resource *res,
                                             const struct vrend_transfer_info *info,
@@ -9989,6 +13972,8 @@ static int vrend_renderer_transfer_internal(struct vrend_context *ctx,
    if (!vrend_hw_switch_context(ctx, true))
       return EINVAL;
 
+   vrend_resource_touch(res);
+
    assert(check_transfer_iovec(res, info));
    if (info->iovec && info->iovec_cnt) {
       iov = info->iovec;
@@ -9999,7 +13984,8 @@ static int vrend_renderer_transfer_internal(struct vrend_context *ctx,
    }
 
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
-   if (res->gbm_bo && (transfer_mode == VIRGL_TRANSFER_TO_HOST ||
+   if (res->gbm_bo && ((transfer_mode == VIRGL_TRANSFER_TO_HOST &&
+                        !vrend_resource_gbm_writes_on_gpu(res)) ||
                        !has_bit(res->storage_bits, VREND_STORAGE_EGL_IMAGE))) {
       const bool success = virgl_gbm_transfer(res->gbm_bo, transfer_mode, iov, num_iovs, info) == 0;
       if (success)
@@ -10021,8 +14007,11 @@ static int vrend_renderer_transfer_internal(struct vrend_context *ctx,
 
    switch (transfer_mode) {
    case VIRGL_TRANSFER_TO_HOST:
+      /* a pending readback must not overwrite the data that is uploaded */
+      vrend_finish_readbacks(res);
       return vrend_renderer_transfer_write_iov(ctx, res, iov, num_iovs, info);
    case VIRGL_TRANSFER_FROM_HOST:
+      vrend_flush_pending_uploads(res);
       return vrend_renderer_transfer_send_iov(ctx, res, iov, num_iovs, info);
 
    default:
@@ -10065,45 +14054,226 @@ int vrend_renderer_transfer_pipe(struct pipe_resource *pres,
    if (!check_transfer_iovec(res, info))
       return EINVAL;
 
-   return vrend_renderer_transfer_internal(vrend_state.ctx0, res, info,
-                                           transfer_mode);
+   return vrend_renderer_transfer_internal(vrend_state.ctx0, res, info,
+                                           transfer_mode);
+}
+
+int vrend_transfer_inline_write(struct vrend_context *ctx,
+                                uint32_t dst_handle,
+                                const struct vrend_transfer_info *info)
+{
+   struct vrend_resource *res;
+
+   res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
+   if (!res) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, dst_handle);
+      return EINVAL;
+   }
+
+   if (!resource_contains_box(res, info->box, info->level)) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
+      return EINVAL;
+   }
+
+   if (!check_iov_bounds(res, info, info->iovec, info->iovec_cnt)) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
+      return EINVAL;
+   }
+
+#if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
+   if (res->gbm_bo) {
+      assert(!info->synchronized);
+      return virgl_gbm_transfer(res->gbm_bo,
+                                VIRGL_TRANSFER_TO_HOST,
+                                info->iovec,
+                                info->iovec_cnt,
+                                info);
+   }
+#endif
+
+   return vrend_renderer_transfer_write_iov(ctx, res, info->iovec, info->iovec_cnt, info);
+
+}
+
+static void vrend_copy_transfer_strides(struct vrend_resource *tex,
+                                        const struct vrend_transfer_info *info,
+                                        uint32_t *stride, uint32_t *layer_stride)
+{
+   *stride = info->stride;
+   if (!*stride)
+      *stride = util_format_get_stride(tex->base.format, u_minify(tex->base.width0, info->level));
+
+   *layer_stride = info->layer_stride;
+   if (!*layer_stride)
+      *layer_stride = *stride * u_minify(tex->base.height0, info->level);
+}
+
+/* Whether a copy transfer between a texture and a blob backed by a GL buffer
+ * can use the buffer as the PBO of the transfer, the GPU then copies the
+ * data instead of the CPU going through the guest memory.  The blob has to
+ * be coherently mapped for the guest to see the copy once the fence that
+ * follows the transfer signals.  The layouts that are fixed up on the CPU
+ * keep going through the guest memory.
+ */
+static bool vrend_copy_transfer_can_use_pbo(struct vrend_resource *tex,
+                                            struct vrend_resource *buf,
+                                            const struct vrend_transfer_info *info,
+                                            bool from_host)
+{
+   const enum virgl_formats format = tex->base.format;
+   const uint32_t elsize = util_format_get_blocksize(format);
+   uint32_t stride, layer_stride;
+
+   if (!vrend_state.use_copy_transfer_pbo)
+      return false;
+
+   /* with guest memory, that holds the data the guest sees */
+   if (buf->base.target != PIPE_BUFFER || buf->iov ||
+       !has_bits(buf->storage_bits, VREND_STORAGE_GL_BUFFER | VREND_STORAGE_GL_IMMUTABLE) ||
+       !(buf->buffer_storage_flags & GL_MAP_COHERENT_BIT))
+      return false;
+
+   if (tex->base.target == PIPE_BUFFER || tex->base.nr_samples > 1 ||
+       !has_bit(tex->storage_bits, VREND_STORAGE_GL_TEXTURE) ||
+       has_bit(tex->storage_bits, VREND_STORAGE_GBM_BUFFER) ||
+       tex->y_0_top || !tex_conv_table[format].glformat ||
+       util_format_is_compressed(format) ||
+       vrend_format_is_emulated_compression(format) ||
+       format == VIRGL_FORMAT_Z24X8_UNORM ||
+       (vrend_state.use_gles && (vrend_format_is_bgra(format) ||
+                                 vrend_resource_get_internal_format_override(tex) != GL_NONE)))
+      return false;
+
+   if (from_host) {
+      if (info->box->depth != 1 ||
+          !(vrend_format_can_render(format) || vrend_format_is_ds(format)))
+         return false;
+   } else if (tex->target == GL_TEXTURE_1D && vrend_state.use_gles) {
+      return false;
+   }
+
+   /* the strides are given to GL in texels and rows */
+   vrend_copy_transfer_strides(tex, info, &stride, &layer_stride);
+   return stride % elsize == 0 && layer_stride % stride == 0 &&
+          check_transfer_bounds(tex, info, buf->base.width0);
+}
+
+static void vrend_copy_transfer_set_pixel_store(struct vrend_resource *tex,
+                                                const struct vrend_transfer_info *info,
+                                                bool pack)
+{
+   const uint32_t elsize = util_format_get_blocksize(tex->base.format);
+   uint32_t stride, layer_stride;
+   GLint alignment;
+
+   vrend_copy_transfer_strides(tex, info, &stride, &layer_stride);
+
+   switch (elsize) {
+   case 1:
+   case 3:
+      alignment = 1;
+      break;
+   case 2:
+   case 6:
+      alignment = 2;
+      break;
+   case 8:
+      alignment = 8;
+      break;
+   default:
+      alignment = 4;
+      break;
+   }
+
+   if (pack) {
+      glPixelStorei(GL_PACK_ROW_LENGTH, stride / elsize);
+      glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+   } else {
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / elsize);
+      glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, layer_stride / stride);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+   }
+}
+
+static void vrend_copy_transfer_to_host_pbo(struct vrend_resource *dst_res,
+                                            struct vrend_resource *src_res,
+                                            const struct vrend_transfer_info *info)
+{
+   const struct pipe_box *box = info->box;
+   const GLenum glformat = tex_conv_table[dst_res->base.format].glformat;
+   const GLenum gltype = tex_conv_table[dst_res->base.format].gltype;
+   const void *data = (const void *)(uintptr_t)info->offset;
+
+   vrend_resource_invalidate_cursor(dst_res);
+   /* the transfers into the blob land first */
+   vrend_flush_pending_uploads(src_res);
+
+   vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, src_res->gl_id);
+   vrend_copy_transfer_set_pixel_store(dst_res, info, false);
+   vrend_gl_bind_texture(dst_res->target, dst_res->gl_id);
+
+   switch (dst_res->target) {
+   case GL_TEXTURE_CUBE_MAP:
+      glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + box->z, info->level,
+                      box->x, box->y, box->width, box->height, glformat, gltype, data);
+      break;
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      glTexSubImage3D(dst_res->target, info->level, box->x, box->y, box->z,
+                      box->width, box->height, box->depth, glformat, gltype, data);
+      break;
+   case GL_TEXTURE_1D:
+      glTexSubImage1D(dst_res->target, info->level, box->x, box->width,
+                      glformat, gltype, data);
+      break;
+   case GL_TEXTURE_1D_ARRAY:
+      glTexSubImage2D(dst_res->target, info->level, box->x, box->z,
+                      box->width, box->depth, glformat, gltype, data);
+      break;
+   default:
+      glTexSubImage2D(dst_res->target, info->level, box->x, box->y,
+                      box->width, box->height, glformat, gltype, data);
+      break;
+   }
+
+   glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+   glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-int vrend_transfer_inline_write(struct vrend_context *ctx,
-                                uint32_t dst_handle,
-                                const struct vrend_transfer_info *info)
+static void vrend_copy_transfer_from_host_pbo(struct vrend_resource *dst_res,
+                                              struct vrend_resource *src_res,
+                                              const struct vrend_transfer_info *info)
 {
-   struct vrend_resource *res;
-
-   res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
-   if (!res) {
-      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, dst_handle);
-      return EINVAL;
-   }
-
-   if (!resource_contains_box(res, info->box, info->level)) {
-      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
-      return EINVAL;
-   }
+   const struct pipe_box *box = info->box;
+   GLint old_fbo;
 
-   if (!check_iov_bounds(res, info, info->iovec, info->iovec_cnt)) {
-      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
-      return EINVAL;
-   }
+   vrend_use_program(NULL);
+   vrend_flush_pending_uploads(dst_res);
 
-#if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
-   if (res->gbm_bo) {
-      assert(!info->synchronized);
-      return virgl_gbm_transfer(res->gbm_bo,
-                                VIRGL_TRANSFER_TO_HOST,
-                                info->iovec,
-                                info->iovec_cnt,
-                                info);
-   }
+   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &old_fbo);
+   vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, dst_res->gl_id);
+   vrend_copy_transfer_set_pixel_store(src_res, info, true);
+#if UTIL_ARCH_BIG_ENDIAN
+   glPixelStorei(GL_PACK_SWAP_BYTES, 1);
 #endif
 
-   return vrend_renderer_transfer_write_iov(ctx, res, info->iovec, info->iovec_cnt, info);
+   do_readpixels(src_res, 0, info->level, box->z, box->x, box->y,
+                 box->width, box->height,
+                 tex_conv_table[src_res->base.format].glformat,
+                 tex_conv_table[src_res->base.format].gltype,
+                 dst_res->base.width0 - info->offset,
+                 (void *)(uintptr_t)info->offset);
 
+#if UTIL_ARCH_BIG_ENDIAN
+   glPixelStorei(GL_PACK_SWAP_BYTES, 0);
+#endif
+   glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+   glBindFramebuffer(GL_FRAMEBUFFER, old_fbo);
 }
 
 int vrend_renderer_copy_transfer3d(struct vrend_context *ctx,
@@ -10118,13 +14288,19 @@ int vrend_renderer_copy_transfer3d(struct vrend_context *ctx,
       return EINVAL;
    }
 
+   if (vrend_copy_transfer_can_use_pbo(dst_res, src_res, info, false)) {
+      vrend_copy_transfer_to_host_pbo(dst_res, src_res, info);
+      return 0;
+   }
+
    if (!check_iov_bounds(dst_res, info, src_res->iov, src_res->num_iovs)) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
       return EINVAL;
    }
 
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_GBM_ALLOCATION)
-   if (dst_res->gbm_bo && !TRANSFER_NO_GBM_MAPPING(info)) {
+   if (dst_res->gbm_bo && !TRANSFER_NO_GBM_MAPPING(info) &&
+       !vrend_resource_gbm_writes_on_gpu(dst_res)) {
       bool use_gbm = true;
 
       /* The guest uses copy transfers against busy resources to avoid
@@ -10175,6 +14351,11 @@ int vrend_renderer_copy_transfer3d_from_host(struct vrend_context *ctx,
       return EINVAL;
    }
 
+   if (vrend_copy_transfer_can_use_pbo(src_res, dst_res, info, true)) {
+      vrend_copy_transfer_from_host_pbo(dst_res, src_res, info);
+      return 0;
+   }
+
    if (!check_iov_bounds(src_res, info, dst_res->iov, dst_res->num_iovs)) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, dst_handle);
       return EINVAL;
@@ -10326,7 +14507,7 @@ static void vrend_hw_emit_streamout_targets(UNUSED struct vrend_context *ctx, st
 {
    unsigned i;
 
-   for (i = 0; i < so_obj->num_targets; i++) {
+   for (i = 0; i < so_obj->key.num_targets; i++) {
       if (!so_obj->so_targets[i])
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, 0);
       else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0)
@@ -10348,14 +14529,18 @@ void vrend_set_streamout_targets(struct vrend_context *ctx,
       return;
 
    if (num_targets) {
-      list_for_each_entry(struct vrend_streamout_object, obj, &ctx->sub->streamout_list, head) {
-         if (obj->num_targets == num_targets) {
-            if (!memcmp(handles, obj->handles, num_targets * 4)) {
-               ctx->sub->current_so = obj;
-               glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
-               return;
-            }
+      struct vrend_streamout_key key = { .num_targets = num_targets };
+      memcpy(key.handles, handles, num_targets * sizeof(*handles));
+
+      /* the objects keep their pause/resume state while they are not bound */
+      struct hash_entry *entry = _mesa_hash_table_search(ctx->sub->streamout_table, &key);
+      if (entry) {
+         struct vrend_streamout_object *obj = entry->data;
+         if (ctx->sub->current_so != obj) {
+            ctx->sub->current_so = obj;
+            glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
          }
+         return;
       }
 
       struct vrend_streamout_object *obj = CALLOC_STRUCT(vrend_streamout_object);
@@ -10363,9 +14548,8 @@ void vrend_set_streamout_targets(struct vrend_context *ctx,
          glGenTransformFeedbacks(1, &obj->id);
          glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
       }
-      obj->num_targets = num_targets;
+      obj->key = key;
       for (i = 0; i < num_targets; i++) {
-         obj->handles[i] = handles[i];
          if (handles[i] == 0)
             continue;
          target = vrend_object_lookup(ctx->sub->object_hash, handles[i], VIRGL_OBJECT_STREAMOUT_TARGET);
@@ -10381,10 +14565,11 @@ void vrend_set_streamout_targets(struct vrend_context *ctx,
       }
       vrend_hw_emit_streamout_targets(ctx, obj);
       list_addtail(&obj->head, &ctx->sub->streamout_list);
+      _mesa_hash_table_insert(ctx->sub->streamout_table, &obj->key, obj);
       ctx->sub->current_so = obj;
       obj->xfb_state = XFB_STATE_STARTED_NEED_BEGIN;
    } else {
-      if (has_feature(feat_transform_feedback2))
+      if (has_feature(feat_transform_feedback2) && ctx->sub->current_so)
          glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
       ctx->sub->current_so = NULL;
    }
@@ -10396,12 +14581,12 @@ static void vrend_resource_buffer_copy(UNUSED struct vrend_context *ctx,
                                        uint32_t dstx, uint32_t srcx,
                                        uint32_t width)
 {
-   glBindBuffer(GL_COPY_READ_BUFFER, src_res->gl_id);
-   glBindBuffer(GL_COPY_WRITE_BUFFER, dst_res->gl_id);
+   vrend_gl_bind_buffer(GL_COPY_READ_BUFFER, src_res->gl_id);
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, dst_res->gl_id);
 
    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, srcx, dstx, width);
-   glBindBuffer(GL_COPY_READ_BUFFER, 0);
-   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   vrend_gl_bind_buffer(GL_COPY_READ_BUFFER, 0);
+   vrend_gl_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
 }
 
 static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
@@ -10412,6 +14597,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
                                          const struct pipe_box *src_box)
 {
    char *tptr;
+   GLuint pbo = 0;
    uint32_t total_size, src_stride, dst_stride, src_layer_stride;
    GLenum glformat, gltype;
    int elsize = util_format_get_blocksize(dst_res->base.format);
@@ -10438,9 +14624,18 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
                 util_format_get_blocksize(src_res->base.format);
    total_size = slice_size * vrend_get_texture_depth(src_res, src_level);
 
-   tptr = malloc(total_size);
-   if (!tptr)
-      return;
+   if (vrend_state.use_gles) {
+      tptr = vrend_staging_alloc(total_size);
+      if (!tptr)
+         return;
+   } else {
+      /* keep the copy on the GPU, the data is staged in a buffer object and
+       * tptr only provides the offsets into it */
+      glGenBuffers(1, &pbo);
+      vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, pbo);
+      glBufferData(GL_PIXEL_PACK_BUFFER, total_size, NULL, GL_STREAM_COPY);
+      tptr = NULL;
+   }
 
    glformat = tex_conv_table[src_res->base.format].glformat;
    gltype = tex_conv_table[src_res->base.format].gltype;
@@ -10464,12 +14659,13 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       src_layer_stride = util_format_get_2d_size(src_res->base.format,
                                                  src_stride,
                                                  u_minify(src_res->base.height0, src_level));
-      read_transfer_data(src_res->iov, src_res->num_iovs, tptr,
+      read_transfer_data(src_res->iov, src_res->num_iovs, src_res->iov_offsets, tptr,
                          src_res->base.format, src_offset,
                          src_stride, src_layer_stride, &box, false);
       /* When on GLES sync the iov that backs the dst resource because
        * we might need it in a chain copy A->B, B->C */
-      write_transfer_data(&dst_res->base, dst_res->iov, dst_res->num_iovs, tptr,
+      write_transfer_data(&dst_res->base, dst_res->iov, dst_res->num_iovs,
+                          dst_res->iov_offsets, tptr,
                           dst_stride, &box, src_level, dst_offset, false);
       /* we get values from the guest as 24-bit scaled integers
          but we give them to the host GL and it interprets them
@@ -10506,7 +14702,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
          glPixelStorei(GL_PACK_ALIGNMENT, 8);
          break;
       }
-      glBindTexture(src_res->target, src_res->gl_id);
+      vrend_gl_bind_texture(src_res->target, src_res->gl_id);
       slice_offset = 0;
       read_chunk_size = (src_res->target == GL_TEXTURE_CUBE_MAP) ? slice_size : total_size;
       for (i = 0; i < cube_slice; i++) {
@@ -10525,6 +14721,8 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
          }
          slice_offset += slice_size;
       }
+      vrend_gl_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+      vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, pbo);
    }
 
    glPixelStorei(GL_PACK_ALIGNMENT, 4);
@@ -10546,7 +14744,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       break;
    }
 
-   glBindTexture(dst_res->target, dst_res->gl_id);
+   vrend_gl_bind_texture(dst_res->target, dst_res->gl_id);
    slice_offset = src_box->z * slice_size;
    cube_slice = (src_res->target == GL_TEXTURE_CUBE_MAP) ? src_box->z + src_box->depth : cube_slice;
    i = (src_res->target == GL_TEXTURE_CUBE_MAP) ? src_box->z : 0;
@@ -10584,8 +14782,14 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
 
 cleanup:
    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-   free(tptr);
-   glBindTexture(dst_res->target, 0);
+   if (pbo) {
+      vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      vrend_gl_state_forget_buffer(pbo);
+      glDeleteBuffers(1, &pbo);
+   } else {
+      vrend_staging_free(tptr);
+   }
+   vrend_gl_bind_texture(dst_res->target, 0);
 }
 
 static inline void
@@ -10679,6 +14883,8 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       return;
    }
 
+   vrend_resource_invalidate_cursor(dst_res);
+
    if (!resource_contains_box(src_res, src_box, src_level)) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_CMD_BUFFER, src_handle);
       return;
@@ -10748,7 +14954,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
 
    glmask = GL_COLOR_BUFFER_BIT;
-   glDisable(GL_SCISSOR_TEST);
+   vrend_gl_enable(GL_SCISSOR_TEST, false);
 
    if (!src_res->y_0_top) {
       sy1 = src_box->y;
@@ -10784,7 +14990,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->fb_id);
 
    if (ctx->sub->rs_state.scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, true);
 }
 
 
@@ -10829,6 +15035,32 @@ static GLuint vrend_make_view(struct vrend_resource *res, enum virgl_formats for
    return view_id;
 }
 
+/* Blits keep using the same few formats on a resource, so the views are
+ * kept with it, and the oldest one makes room for a new format. */
+static GLuint vrend_get_blit_view(struct vrend_resource *res, enum virgl_formats format)
+{
+   uint32_t slot;
+   GLuint view_id;
+
+   for (uint32_t i = 0; i < MIN2(res->num_blit_views, VREND_MAX_BLIT_VIEWS); i++) {
+      if (res->blit_view_formats[i] == format)
+         return res->blit_view_ids[i];
+   }
+
+   view_id = vrend_make_view(res, format);
+   if (view_id == res->gl_id)
+      return view_id;
+
+   slot = res->num_blit_views++ % VREND_MAX_BLIT_VIEWS;
+   if (res->num_blit_views > VREND_MAX_BLIT_VIEWS) {
+      vrend_gl_state_forget_texture(res->blit_view_ids[slot]);
+      glDeleteTextures(1, &res->blit_view_ids[slot]);
+   }
+   res->blit_view_ids[slot] = view_id;
+   res->blit_view_formats[slot] = format;
+   return view_id;
+}
+
 static bool vrend_blit_needs_redblue_swizzle(struct vrend_resource *src_res,
                                              struct vrend_resource *dst_res,
                                              const struct pipe_blit_info *info)
@@ -11000,9 +15232,9 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
                 info->b.scissor.maxx - info->b.scissor.minx,
                 info->b.scissor.maxy - info->b.scissor.miny);
       ctx->sub->scissor_state_dirty = (1 << 0);
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, true);
    } else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, false);
 
    /* An GLES GL_INVALID_OPERATION is generated if one wants to blit from a
     * multi-sample fbo to a non multi-sample fbo and the source and destination
@@ -11097,9 +15329,9 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
       if (has_feature(feat_srgb_write_control)) {
          if (util_format_is_srgb(info->b.dst.format) ||
              util_format_is_srgb(info->b.src.format))
-            glEnable(GL_FRAMEBUFFER_SRGB);
+            vrend_gl_enable(GL_FRAMEBUFFER_SRGB, true);
          else
-            glDisable(GL_FRAMEBUFFER_SRGB);
+            vrend_gl_enable(GL_FRAMEBUFFER_SRGB, false);
       }
 
       glBindFramebuffer(GL_READ_FRAMEBUFFER, intermediate_fbo);
@@ -11131,9 +15363,9 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
 
    if (has_feature(feat_srgb_write_control)) {
       if (ctx->sub->framebuffer_srgb_enabled)
-         glEnable(GL_FRAMEBUFFER_SRGB);
+         vrend_gl_enable(GL_FRAMEBUFFER_SRGB, true);
       else
-         glDisable(GL_FRAMEBUFFER_SRGB);
+         vrend_gl_enable(GL_FRAMEBUFFER_SRGB, false);
    }
 
    if (make_intermediate_copy) {
@@ -11142,9 +15374,9 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
    }
 
    if (ctx->sub->rs_state.scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, true);
    else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_gl_enable(GL_SCISSOR_TEST, false);
 
 }
 
@@ -11160,15 +15392,14 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       .swizzle =  {0, 1, 2, 3}
    };
 
-   /* We create the texture views in this function instead of doing it in
-    * vrend_renderer_prepare_blit_extra_info because we also delete them here */
+   /* The texture views are owned by the resources and destroyed with them */
    if ((src_res->base.format != info->src.format) && has_feature(feat_texture_view) &&
        vrend_resource_supports_view(src_res, info->src.format))
-      blit_info.src_view = vrend_make_view(src_res, info->src.format);
+      blit_info.src_view = vrend_get_blit_view(src_res, info->src.format);
 
    if ((dst_res->base.format != info->dst.format) && has_feature(feat_texture_view) &&
        vrend_resource_supports_view(dst_res, info->dst.format))
-      blit_info.dst_view = vrend_make_view(dst_res, info->dst.format);
+      blit_info.dst_view = vrend_get_blit_view(dst_res, info->dst.format);
 
    vrend_renderer_prepare_blit_extra_info(ctx, src_res, dst_res, &blit_info);
 
@@ -11183,24 +15414,123 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       vrend_renderer_blit_gl(ctx, src_res, dst_res, &blit_info);
       vrend_sync_make_current(ctx->sub->gl_context);
    }
+}
+
+static void vrend_renderer_blit_resources(struct vrend_context *ctx,
+                                          struct vrend_resource *src_res,
+                                          struct vrend_resource *dst_res,
+                                          const struct pipe_blit_info *info);
+
+/* Whether the blit downsamples a whole level of a texture to the next
+ * level, the same way glGenerateMipmap does. */
+static bool vrend_blit_is_mipmap_level(const struct vrend_resource *src_res,
+                                       const struct vrend_resource *dst_res,
+                                       const struct pipe_blit_info *info)
+{
+   const enum virgl_formats format = src_res->base.format;
+
+   if (!vrend_state.use_mipmap_blits || src_res != dst_res ||
+       info->mask != PIPE_MASK_RGBA || info->filter != PIPE_TEX_FILTER_LINEAR ||
+       info->scissor_enable || info->alpha_blend || info->render_condition_enable ||
+       info->src.format != format || info->dst.format != format ||
+       info->dst.level != info->src.level + 1)
+      return false;
+
+   if ((src_res->base.target != PIPE_TEXTURE_2D &&
+        src_res->base.target != PIPE_TEXTURE_2D_ARRAY &&
+        src_res->base.target != PIPE_TEXTURE_CUBE) ||
+       src_res->base.nr_samples > 1 || info->dst.level > src_res->base.last_level ||
+       !has_bit(src_res->storage_bits, VREND_STORAGE_GL_TEXTURE) ||
+       src_res->egl_image)
+      return false;
+
+   /* the generated levels have to be filtered like the blits, sRGB
+    * textures may or may not be filtered in linear space */
+   if (!vrend_format_can_render(format) || vrend_format_is_ds(format) ||
+       util_format_is_pure_integer(format) || util_format_is_srgb(format) ||
+       vrend_format_is_emulated_compression(format) ||
+       (tex_conv_table[format].flags & VIRGL_TEXTURE_NEED_SWIZZLE))
+      return false;
+
+   /* all the layers are generated */
+   const int layers = src_res->base.target == PIPE_TEXTURE_CUBE ? 6 :
+                      (int)src_res->base.array_size;
+   if (info->src.box.z || info->dst.box.z ||
+       info->src.box.depth != layers || info->dst.box.depth != layers)
+      return false;
+
+   /* a linear blit of half the size averages 2x2 texels like the box
+    * filter of glGenerateMipmap, odd sizes are filtered differently */
+   const int src_width = u_minify(src_res->base.width0, info->src.level);
+   const int src_height = u_minify(src_res->base.height0, info->src.level);
+   const int dst_width = u_minify(src_res->base.width0, info->dst.level);
+   const int dst_height = u_minify(src_res->base.height0, info->dst.level);
+   if ((src_width != dst_width * 2 && src_width != 1) ||
+       (src_height != dst_height * 2 && src_height != 1))
+      return false;
+
+   return info->src.box.x == 0 && info->src.box.y == 0 &&
+          info->src.box.width == src_width && info->src.box.height == src_height &&
+          info->dst.box.x == 0 && info->dst.box.y == 0 &&
+          info->dst.box.width == dst_width && info->dst.box.height == dst_height;
+}
+
+void vrend_flush_mipmap_blits(struct vrend_context *ctx)
+{
+   struct vrend_pending_mipmap *mipmap = &ctx->sub->pending_mipmap;
+   struct vrend_pending_mipmap pending = *mipmap;
+
+   if (!pending.num_levels)
+      return;
+
+   memset(mipmap, 0, sizeof(*mipmap));
+   if (ctx->in_error)
+      return;
+
+   struct vrend_resource *res = vrend_renderer_ctx_res_lookup(ctx, pending.handle);
+   if (!res)
+      return;
+
+   /* a single level is not worth changing the texture levels */
+   if (pending.num_levels == 1) {
+      vrend_renderer_blit_resources(ctx, res, res, &pending.info);
+      return;
+   }
+
+   struct vrend_texture *tex = (struct vrend_texture *)res;
+   const uint32_t base_level = pending.info.src.level;
+   const uint32_t max_level = base_level + pending.num_levels;
 
-   if (blit_info.src_view != src_res->gl_id)
-      glDeleteTextures(1, &blit_info.src_view);
+   VREND_DEBUG(dbg_blit, ctx, "BLIT: generate levels %u-%u of %s with glGenerateMipmap\n",
+               base_level + 1, max_level, util_format_name(res->base.format));
 
-   if (blit_info.dst_view != dst_res->gl_id)
-      glDeleteTextures(1, &blit_info.dst_view);
+   struct vrend_gpu_timer *timer = vrend_gpu_timer_begin(ctx, VREND_GPU_TIMER_BLIT);
+   vrend_gl_bind_texture(res->target, res->gl_id);
+   if (tex->cur_base != base_level) {
+      glTexParameteri(res->target, GL_TEXTURE_BASE_LEVEL, base_level);
+      tex->cur_base = base_level;
+   }
+   if (tex->cur_max != max_level) {
+      glTexParameteri(res->target, GL_TEXTURE_MAX_LEVEL, max_level);
+      tex->cur_max = max_level;
+   }
+   glGenerateMipmap(res->target);
+   vrend_gpu_timer_end(timer);
 }
 
 void vrend_renderer_blit(struct vrend_context *ctx,
                          uint32_t dst_handle, uint32_t src_handle,
                          const struct pipe_blit_info *info)
 {
-   unsigned int comp_flags = 0;
    struct vrend_resource *src_res, *dst_res;
-   int src_width, src_height, dst_width, dst_height;
    src_res = vrend_renderer_ctx_res_lookup(ctx, src_handle);
    dst_res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
 
+   /* the dispatch leaves pending clears to the blit */
+   if (src_res && dst_res)
+      vrend_drop_overwritten_clears(ctx->sub, src_res, dst_res, info);
+   vrend_flush_clears(ctx);
+
    if (!src_res) {
       vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
       return;
@@ -11210,6 +15540,8 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       return;
    }
 
+   vrend_resource_invalidate_cursor(dst_res);
+
    if (ctx->in_error)
       return;
 
@@ -11247,6 +15579,34 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       return;
    }
 
+   if (vrend_blit_is_mipmap_level(src_res, dst_res, info)) {
+      struct vrend_pending_mipmap *mipmap = &ctx->sub->pending_mipmap;
+
+      if (mipmap->num_levels && mipmap->handle == dst_handle &&
+          mipmap->info.src.level + mipmap->num_levels == info->src.level) {
+         mipmap->num_levels++;
+         return;
+      }
+
+      vrend_flush_mipmap_blits(ctx);
+      mipmap->handle = dst_handle;
+      mipmap->info = *info;
+      mipmap->num_levels = 1;
+      return;
+   }
+
+   vrend_flush_mipmap_blits(ctx);
+   vrend_renderer_blit_resources(ctx, src_res, dst_res, info);
+}
+
+static void vrend_renderer_blit_resources(struct vrend_context *ctx,
+                                          struct vrend_resource *src_res,
+                                          struct vrend_resource *dst_res,
+                                          const struct pipe_blit_info *info)
+{
+   unsigned int comp_flags = 0;
+   int src_width, src_height, dst_width, dst_height;
+
    if (info->render_condition_enable == false)
       vrend_pause_render_condition(ctx, true);
 
@@ -11296,6 +15656,7 @@ void vrend_renderer_blit(struct vrend_context *ctx,
     * to resource_copy_region, in this case and if no render states etx need
     * to be applied, forward the call to glCopyImageSubData, otherwise do a
     * normal blit. */
+   struct vrend_gpu_timer *timer = vrend_gpu_timer_begin(ctx, VREND_GPU_TIMER_BLIT);
    if (has_feature(feat_copy_image) &&
        (!info->render_condition_enable || !ctx->sub->cond_render_gl_mode) &&
        format_is_copy_compatible(info->src.format,info->dst.format, comp_flags) &&
@@ -11318,6 +15679,7 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       VREND_DEBUG(dbg_blit, ctx, "  Use blit_int\n");
       vrend_renderer_blit_int(ctx, src_res, dst_res, info);
    }
+   vrend_gpu_timer_end(timer);
 
    if (info->render_condition_enable == false)
       vrend_pause_render_condition(ctx, false);
@@ -11338,13 +15700,24 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
 {
    struct vrend_fence *fence;
 
-   fence = malloc(sizeof(struct vrend_fence));
+   fence = slab_alloc(&vrend_state.fence_pool);
    if (!fence)
       return ENOMEM;
 
    fence->ctx = ctx;
+   fence->gl_context = vrend_state.current_gl_context;
    fence->flags = flags;
    fence->fence_id = fence_id;
+   fence->readback_seqno = vrend_state.num_readbacks;
+#ifdef ENABLE_VIDEO
+   fence->video_seqno = vrend_video_job_seqno();
+#endif
+   fence->seqno = vrend_state.num_fences++;
+   fence->sync_fd = -1;
+   fence->signaled = false;
+
+   /* the guest expects its uploads to be done when the fence signals */
+   vrend_renderer_flush_uploads();
 
 #ifdef HAVE_EPOXY_EGL_H
    if (vrend_state.use_egl_fence) {
@@ -11359,6 +15732,13 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
    if (fence->glsyncobj == NULL)
       goto fail;
 
+   TRACE_FENCE(TRACE_FENCE_SUBMIT, ctx->ctx_id, 0, fence_id);
+
+#ifdef HAVE_EPOLL_H
+   if (vrend_state.use_fence_fds)
+      vrend_register_fence_fd(fence);
+#endif
+
    if (vrend_state.sync_thread) {
       mtx_lock(&vrend_state.fence_mutex);
       list_addtail(&fence->fences, &vrend_state.fence_wait_list);
@@ -11371,7 +15751,7 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
 #ifdef HAVE_EPOXY_EGL_H
    int fence_fd = -1;
    if (vrend_renderer_export_ctx0_fence(fence_id, &fence_fd) == 0 &&
-       virgl_fence_set_fd(fence_id, fence_fd))
+       virgl_fence_set_fd(0, fence_id, fence_fd))
       virgl_error("failed to export fence sync object\n");
    if (fence_fd != -1)
       close(fence_fd);
@@ -11380,7 +15760,7 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
 
  fail:
    virgl_error("Failed to create fence sync object\n");
-   free(fence);
+   slab_free(&vrend_state.fence_pool, fence);
    return ENOMEM;
 }
 
@@ -11405,9 +15785,34 @@ static bool need_fence_retire_signal_locked(struct vrend_fence *fence,
    return false;
 }
 
+/* Reorders the fences so that those of a context follow each other, in
+ * their original order */
+static void vrend_group_fences_by_context(struct list_head *fences)
+{
+   struct list_head grouped;
+
+   list_inithead(&grouped);
+   while (!list_is_empty(fences)) {
+      struct vrend_fence *first = LIST_ENTRY(struct vrend_fence, fences->next, fences);
+      struct vrend_context *ctx = first->ctx;
+
+      list_for_each_entry_safe(struct vrend_fence, fence, fences, fences) {
+         if (fence->ctx == ctx) {
+            list_del(&fence->fences);
+            list_addtail(&fence->fences, &grouped);
+         }
+      }
+   }
+   list_splicetail(&grouped, fences);
+}
+
 void vrend_renderer_check_fences(void)
 {
    struct list_head retired_fences;
+   uint64_t readback_seqno = 0;
+#ifdef ENABLE_VIDEO
+   uint64_t video_seqno = 0;
+#endif
 
    assert(!vrend_state.use_async_fence_cb);
 
@@ -11425,36 +15830,69 @@ void vrend_renderer_check_fences(void)
             continue;
          }
 
-         if (need_fence_retire_signal_locked(fence, &vrend_state.fence_list)) {
-            list_del(&fence->fences);
-            list_addtail(&fence->fences, &retired_fences);
-         } else {
-            free_fence_locked(fence);
-         }
+         readback_seqno = MAX2(readback_seqno, fence->readback_seqno);
+#ifdef ENABLE_VIDEO
+         video_seqno = MAX2(video_seqno, fence->video_seqno);
+#endif
+         list_del(&fence->fences);
+         list_addtail(&fence->fences, &retired_fences);
       }
       mtx_unlock(&vrend_state.fence_mutex);
    } else {
+#ifdef HAVE_EPOLL_H
+      if (vrend_state.use_fence_fds)
+         vrend_poll_fence_fds();
+#endif
       vrend_renderer_force_ctx_0();
 
+      /* every context is a timeline of its own, a fence that has not
+       * signaled yet only holds back the later fences of its context */
       list_for_each_entry_safe(struct vrend_fence, fence, &vrend_state.fence_list, fences) {
-         if (do_wait(fence, /* can_block */ false)) {
+         if (fence->ctx->fences_stalled)
+            continue;
+
+         if (vrend_fence_signaled(fence)) {
+            TRACE_FENCE(TRACE_FENCE_SIGNAL, fence->ctx->ctx_id, 0, fence->fence_id);
+            readback_seqno = MAX2(readback_seqno, fence->readback_seqno);
+#ifdef ENABLE_VIDEO
+            video_seqno = MAX2(video_seqno, fence->video_seqno);
+#endif
             list_del(&fence->fences);
             list_addtail(&fence->fences, &retired_fences);
          } else {
-            /* don't bother checking any subsequent ones */
-            break;
+            fence->ctx->fences_stalled = true;
          }
       }
 
-      list_for_each_entry_safe(struct vrend_fence, fence, &retired_fences, fences) {
-         if (!need_fence_retire_signal_locked(fence, &retired_fences))
-            free_fence_locked(fence);
-      }
+      list_for_each_entry(struct vrend_fence, fence, &vrend_state.fence_list, fences)
+         fence->ctx->fences_stalled = false;
    }
 
+   /* retire the fences of a context in one go, mergeable ones only signal
+    * the last fence of the context */
+   vrend_group_fences_by_context(&retired_fences);
+   list_for_each_entry_safe(struct vrend_fence, fence, &retired_fences, fences) {
+      if (!need_fence_retire_signal_locked(fence, &retired_fences))
+         free_fence_locked(fence);
+   }
+
+   /* the guest may read the data as soon as a later fence is retired */
+   if (!list_is_empty(&vrend_state.readback_list))
+      vrend_renderer_check_readbacks(readback_seqno);
+
+#ifdef ENABLE_VIDEO
+   /* same for the decoded frames, which are copied to their resources */
+   vrend_video_finish_jobs(video_seqno);
+#endif
+
+   if (vrend_state.use_buffer_eviction)
+      vrend_renderer_check_memory_pressure();
+
    if (list_is_empty(&retired_fences))
       return;
 
+   list_for_each_entry(struct vrend_fence, fence, &retired_fences, fences)
+      vrend_update_retired_fence_seqno(fence->seqno);
    vrend_renderer_check_queries();
 
    list_for_each_entry_safe(struct vrend_fence, fence, &retired_fences, fences) {
@@ -11499,16 +15937,12 @@ vrend_update_oq_samples_multiplier(struct vrend_context *ctx)
 }
 
 
-static bool vrend_check_query(struct vrend_query *query)
+static void vrend_write_query_state(struct vrend_query *query, uint64_t result)
 {
    struct virgl_host_query_state state;
-   bool ret;
 
    state.result_size = vrend_is_timer_query(query->gltype) ? 8 : 4;
-   ret = vrend_get_one_query_result(query->id, state.result_size == 8,
-         &state.result);
-   if (ret == false)
-      return false;
+   state.result = state.result_size == 8 ? result : (uint32_t)result;
 
    /* We got a boolean, but the client wanted the actual number of samples
     * blow the number up so that the client doesn't think it was just one pixel
@@ -11530,57 +15964,228 @@ static bool vrend_check_query(struct vrend_query *query)
       else
          virgl_error("Query state does not fit buffer size\n");
    }
+}
+
+static bool vrend_check_query(struct vrend_query *query)
+{
+   uint64_t result;
+
+   if (!vrend_get_one_query_result(query->id, vrend_is_timer_query(query->gltype),
+                                   &result))
+      return false;
+
+   vrend_write_query_state(query, result);
+   return true;
+}
+
+/* Reads the slot of a query that has a resolve pending, without any GL
+ * call, and tells whether the resolve is done. */
+static bool vrend_query_slot_done(struct vrend_query *query)
+{
+   volatile struct vrend_query_slot *slot = &vrend_state.query_slots[query->slot];
+
+   if (!slot->available)
+      return false;
+
+   query->resolve_pending = false;
+   return true;
+}
+
+static bool vrend_check_query_slot(struct vrend_query *query)
+{
+   if (!vrend_query_slot_done(query))
+      return false;
+
+   vrend_write_query_state(query, vrend_state.query_slots[query->slot].result);
+   return true;
+}
+
+static void vrend_release_busy_query_slots(void)
+{
+   uint32_t i = 0;
+
+   while (i < vrend_state.num_busy_query_slots) {
+      const uint32_t slot = vrend_state.busy_query_slots[i];
+      if (vrend_state.query_slots[slot].available) {
+         vrend_state.free_query_slots[vrend_state.num_free_query_slots++] = slot;
+         vrend_state.busy_query_slots[i] =
+            vrend_state.busy_query_slots[--vrend_state.num_busy_query_slots];
+      } else {
+         i++;
+      }
+   }
+}
+
+static struct vrend_sub_context *vrend_renderer_find_sub_ctx(struct vrend_context *ctx,
+                                                             int sub_ctx_id)
+{
+   if (ctx->sub && ctx->sub->sub_ctx_id == sub_ctx_id)
+      return ctx->sub;
+
+   list_for_each_entry_safe(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
+      if (sub->sub_ctx_id == sub_ctx_id)
+         return sub;
+   }
+
+   return NULL;
+}
+
+static bool vrend_hw_switch_context_with_sub(struct vrend_context *ctx, int sub_ctx_id)
+{
+   if (!ctx)
+      return false;
+
+   if (ctx == vrend_state.current_ctx && sub_ctx_id == ctx->sub->sub_ctx_id &&
+       ctx->ctx_switch_pending == false) {
+      return true;
+   }
+
+   if (ctx->ctx_id != 0 && ctx->in_error)
+      return false;
+
+   struct vrend_sub_context *sub = vrend_renderer_find_sub_ctx(ctx, sub_ctx_id);
+   if (!sub)
+      return false;
+
+   /* force the gl context switch to occur */
+   if (ctx->sub != sub) {
+      vrend_state.current_hw_ctx = NULL;
+      ctx->sub = sub;
+   }
+
+   ctx->ctx_switch_pending = true;
+   vrend_finish_context_switch(ctx);
+
+   vrend_state.current_ctx = ctx;
+   return true;
+}
+
+static void vrend_update_waiting_query_seqno(void)
+{
+   uint64_t seqno = UINT64_MAX;
+
+   /* the queries are in the order they started waiting */
+   if (!list_is_empty(&vrend_state.waiting_query_list)) {
+      struct vrend_query *query = LIST_ENTRY(struct vrend_query, vrend_state.waiting_query_list.next,
+                                             waiting_queries);
+      seqno = query->fence_seqno;
+   }
+   atomic_store(&vrend_state.waiting_query_seqno, seqno);
+}
+
+static struct vrend_gpu_timer *vrend_gpu_timer_begin(struct vrend_context *ctx,
+                                                     enum vrend_gpu_timer_type type)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   struct vrend_gpu_timer *timer;
+
+   if (!vrend_state.use_gpu_timestamps)
+      return NULL;
+
+   if (!list_is_empty(&sub->gpu_timer_free_list)) {
+      timer = LIST_ENTRY(struct vrend_gpu_timer, sub->gpu_timer_free_list.next, head);
+      list_del(&timer->head);
+   } else {
+      timer = CALLOC_STRUCT(vrend_gpu_timer);
+      if (!timer)
+         return NULL;
+      glGenQueries(ARRAY_SIZE(timer->queries), timer->queries);
+   }
 
-   return true;
+   timer->type = type;
+   timer->ctx = ctx;
+   timer->sub_ctx_id = sub->sub_ctx_id;
+   glQueryCounter(timer->queries[0], GL_TIMESTAMP);
+
+   return timer;
 }
 
-static struct vrend_sub_context *vrend_renderer_find_sub_ctx(struct vrend_context *ctx,
-                                                             int sub_ctx_id)
+static void vrend_gpu_timer_end(struct vrend_gpu_timer *timer)
 {
-   if (ctx->sub && ctx->sub->sub_ctx_id == sub_ctx_id)
-      return ctx->sub;
+   if (!timer)
+      return;
 
-   list_for_each_entry_safe(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
-      if (sub->sub_ctx_id == sub_ctx_id)
-         return sub;
-   }
+   glQueryCounter(timer->queries[1], GL_TIMESTAMP);
+   list_addtail(&timer->head, &vrend_state.gpu_timer_list);
+}
 
-   return NULL;
+void vrend_gpu_timer_begin_batch(struct vrend_context *ctx)
+{
+   if (!ctx->sub->batch_timer)
+      ctx->sub->batch_timer = vrend_gpu_timer_begin(ctx, VREND_GPU_TIMER_BATCH);
 }
 
-static bool vrend_hw_switch_context_with_sub(struct vrend_context *ctx, int sub_ctx_id)
+void vrend_gpu_timer_end_batch(struct vrend_context *ctx)
 {
-   if (!ctx)
-      return false;
+   vrend_gpu_timer_end(ctx->sub->batch_timer);
+   ctx->sub->batch_timer = NULL;
+}
 
-   if (ctx == vrend_state.current_ctx && sub_ctx_id == ctx->sub->sub_ctx_id &&
-       ctx->ctx_switch_pending == false) {
-      return true;
-   }
+uint64_t vrend_context_take_gpu_time(struct vrend_context *ctx)
+{
+   const uint64_t gpu_time = ctx->gpu_batch_time;
+   ctx->gpu_batch_time = 0;
+   return gpu_time;
+}
 
-   if (ctx->ctx_id != 0 && ctx->in_error)
-      return false;
+static bool vrend_check_gpu_timer(struct vrend_gpu_timer *timer)
+{
+   uint64_t begin;
+   uint64_t end;
 
-   struct vrend_sub_context *sub = vrend_renderer_find_sub_ctx(ctx, sub_ctx_id);
-   if (!sub)
+   if (!vrend_get_one_query_result(timer->queries[1], true, &end) ||
+       !vrend_get_one_query_result(timer->queries[0], true, &begin))
       return false;
 
-   /* force the gl context switch to occur */
-   if (ctx->sub != sub) {
-      vrend_state.current_hw_ctx = NULL;
-      ctx->sub = sub;
-   }
+   const uint64_t elapsed = end > begin ? end - begin : 0;
+   vrend_state.gpu_time[timer->type] += elapsed;
+   if (timer->type == VREND_GPU_TIMER_BATCH)
+      timer->ctx->gpu_batch_time += elapsed;
 
-   ctx->ctx_switch_pending = true;
-   vrend_finish_context_switch(ctx);
+#ifdef ENABLE_TRACING
+   static const char *const counter_names[VREND_GPU_TIMER_TYPE_COUNT] = {
+      [VREND_GPU_TIMER_BLIT] = "vrend gpu blit time",
+      [VREND_GPU_TIMER_CLEAR] = "vrend gpu clear time",
+   };
+   const char *name = timer->type == VREND_GPU_TIMER_BATCH ?
+                      timer->ctx->gpu_time_counter_name : counter_names[timer->type];
+   TRACE_COUNTER_SET(name, elapsed);
+#endif
 
-   vrend_state.current_ctx = ctx;
    return true;
 }
 
+static void vrend_renderer_check_gpu_timers(void)
+{
+   /* a timer of a context in error stays until its sub context is destroyed */
+   list_for_each_entry_safe(struct vrend_gpu_timer, timer,
+                            &vrend_state.gpu_timer_list, head) {
+      if (!vrend_hw_switch_context_with_sub(timer->ctx, timer->sub_ctx_id) ||
+          !vrend_check_gpu_timer(timer))
+         continue;
+
+      list_del(&timer->head);
+      list_add(&timer->head, &timer->ctx->sub->gpu_timer_free_list);
+   }
+}
+
 static void vrend_renderer_check_queries(void)
 {
+   const uint64_t retired_seqno = atomic_load(&vrend_state.retired_fence_seqno);
+
    list_for_each_entry_safe(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
+      /* the queries are in the order they started waiting, the ones that
+       * no retired fence follows yet are checked later */
+      if (query->fence_seqno >= retired_seqno)
+         break;
+
+      /* resolved queries are a memory read away, without a context switch */
+      if (query->resolve_pending && !query->resolve_stale) {
+         if (vrend_check_query_slot(query))
+            list_delinit(&query->waiting_queries);
+         continue;
+      }
+
       if (!vrend_hw_switch_context_with_sub(query->ctx, query->sub_ctx_id)) {
          virgl_warn("Failed to switch to context (%d) with sub (%d) for query %u\n",
                       query->ctx->ctx_id, query->sub_ctx_id, query->id);
@@ -11592,8 +16197,27 @@ static void vrend_renderer_check_queries(void)
       list_delinit(&query->waiting_queries);
    }
 
-   atomic_store(&vrend_state.has_waiting_queries,
-                !list_is_empty(&vrend_state.waiting_query_list));
+   vrend_update_waiting_query_seqno();
+
+   if (vrend_state.num_busy_query_slots)
+      vrend_release_busy_query_slots();
+
+   if (!list_is_empty(&vrend_state.gpu_timer_list))
+      vrend_renderer_check_gpu_timers();
+}
+
+void vrend_renderer_get_gpu_time_stats(uint64_t *batch_time,
+                                       uint64_t *blit_time,
+                                       uint64_t *clear_time)
+{
+   *batch_time = vrend_state.gpu_time[VREND_GPU_TIMER_BATCH];
+   *blit_time = vrend_state.gpu_time[VREND_GPU_TIMER_BLIT];
+   *clear_time = vrend_state.gpu_time[VREND_GPU_TIMER_CLEAR];
+}
+
+void vrend_renderer_reset_gpu_time_stats(void)
+{
+   memset(vrend_state.gpu_time, 0, sizeof(vrend_state.gpu_time));
 }
 
 bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
@@ -11627,12 +16251,17 @@ static void vrend_finish_context_switch(struct vrend_context *ctx)
 
    vrend_state.current_hw_ctx = ctx;
 
-   vrend_clicbs->make_current(ctx->sub->gl_context);
+   vrend_make_current(ctx->sub->gl_context);
 }
 
 void
 vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle)
 {
+   struct vrend_surface *surf = vrend_object_lookup(ctx->sub->object_hash, handle,
+                                                    VIRGL_OBJECT_SURFACE);
+   if (surf)
+      vrend_fbo_forget_surface(ctx->sub, surf);
+
    vrend_object_remove(ctx->sub->object_hash, handle, 0);
 }
 
@@ -11681,7 +16310,7 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
       return EINVAL;
    }
 
-   struct vrend_query *q = CALLOC_STRUCT(vrend_query);
+   struct vrend_query *q = slab_zalloc(&vrend_state.query_pool);
    if (!q)
       return ENOMEM;
 
@@ -11693,6 +16322,7 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
    q->ctx = ctx;
    q->sub_ctx_id = ctx->sub->sub_ctx_id;
    q->fake_samples_passed = fake_samples_passed;
+   q->slot = -1;
 
    vrend_resource_reference(&q->res, res);
 
@@ -11763,12 +16393,15 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
       if (!vrend_renderer_object_insert(ctx, q, handle, VIRGL_OBJECT_QUERY)) {
          glDeleteQueries(1, &q->id);
          err = ENOMEM;
+      } else if (vrend_state.num_free_query_slots) {
+         /* the queries past the slots are polled */
+         q->slot = vrend_state.free_query_slots[--vrend_state.num_free_query_slots];
       }
    }
 
    if (err) {
       vrend_resource_reference(&q->res, NULL);
-      FREE(q);
+      slab_free(&vrend_state.query_pool, q);
    }
 
    return err;
@@ -11776,10 +16409,18 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
 
 static void vrend_destroy_query(struct vrend_query *query)
 {
+   /* a resolve in flight would write to the next query of the slot */
+   if (query->slot >= 0 && vrend_state.use_query_buffer) {
+      if (query->resolve_pending && !vrend_query_slot_done(query))
+         vrend_state.busy_query_slots[vrend_state.num_busy_query_slots++] = query->slot;
+      else
+         vrend_state.free_query_slots[vrend_state.num_free_query_slots++] = query->slot;
+   }
+
    vrend_resource_reference(&query->res, NULL);
    list_del(&query->waiting_queries);
    glDeleteQueries(1, &query->id);
-   free(query);
+   slab_free(&vrend_state.query_pool, query);
 }
 
 static void vrend_destroy_query_object(void *obj_ptr)
@@ -11800,6 +16441,8 @@ int vrend_begin_query(struct vrend_context *ctx, uint32_t handle)
       return EINVAL;
 
    list_delinit(&q->waiting_queries);
+   if (q->resolve_pending)
+      q->resolve_stale = true;
 
    if (q->gltype == GL_TIMESTAMP)
       return 0;
@@ -11840,6 +16483,30 @@ int vrend_end_query(struct vrend_context *ctx, uint32_t handle)
    return 0;
 }
 
+static inline void *buffer_offset(intptr_t i)
+{
+   return (void *)i;
+}
+
+/* Has the GPU write the result of the query to its slot once it is
+ * available, and then the availability. */
+static void vrend_resolve_query(struct vrend_query *q)
+{
+   const GLintptr offset = q->slot * sizeof(struct vrend_query_slot);
+
+   vrend_state.query_slots[q->slot].available = 0;
+
+   vrend_gl_bind_buffer(GL_QUERY_BUFFER, vrend_state.query_buffer_id);
+   glGetQueryObjectui64v(q->id, GL_QUERY_RESULT,
+                         buffer_offset(offset + offsetof(struct vrend_query_slot, result)));
+   glGetQueryObjectui64v(q->id, GL_QUERY_RESULT_AVAILABLE,
+                         buffer_offset(offset + offsetof(struct vrend_query_slot, available)));
+   vrend_gl_bind_buffer(GL_QUERY_BUFFER, 0);
+
+   q->resolve_pending = true;
+   q->resolve_stale = false;
+}
+
 int vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
                             UNUSED uint32_t wait)
 {
@@ -11850,30 +16517,36 @@ int vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
    if (!q)
       return EINVAL;
 
-   ret = vrend_check_query(q);
+   /* The result is resolved on the GPU and read once a later fence is
+    * retired.  The slot is only reused when the previous resolve is done,
+    * until then the result is polled. */
+   if (q->slot >= 0 && q->resolve_pending && !q->resolve_stale) {
+      ret = vrend_check_query_slot(q);
+   } else if (q->slot >= 0 && (!q->resolve_pending || vrend_query_slot_done(q))) {
+      vrend_resolve_query(q);
+      ret = false;
+   } else {
+      ret = vrend_check_query(q);
+   }
+
    if (ret) {
       list_delinit(&q->waiting_queries);
    } else if (list_is_empty(&q->waiting_queries)) {
+      q->fence_seqno = vrend_state.num_fences;
       list_addtail(&q->waiting_queries, &vrend_state.waiting_query_list);
    }
 
-   atomic_store(&vrend_state.has_waiting_queries,
-                !list_is_empty(&vrend_state.waiting_query_list));
+   vrend_update_waiting_query_seqno();
    return 0;
 }
 
 #define COPY_QUERY_RESULT_TO_BUFFER(resid, offset, pvalue, size, multiplier) \
-    glBindBuffer(GL_QUERY_BUFFER, resid); \
+    vrend_gl_bind_buffer(GL_QUERY_BUFFER, resid); \
     value *= multiplier; \
     void* buf = glMapBufferRange(GL_QUERY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT); \
     if (buf) memcpy(buf, &value, size); \
     glUnmapBuffer(GL_QUERY_BUFFER);
 
-static inline void *buffer_offset(intptr_t i)
-{
-   return (void *)i;
-}
-
 int vrend_get_query_result_qbo(struct vrend_context *ctx, uint32_t handle,
                                 uint32_t qbo_handle,
                                 uint32_t wait, uint32_t result_type, uint32_t offset,
@@ -11905,7 +16578,7 @@ int vrend_get_query_result_qbo(struct vrend_context *ctx, uint32_t handle,
      qtype = wait ? GL_QUERY_RESULT : GL_QUERY_RESULT_NO_WAIT;
 
   if (!q->fake_samples_passed) {
-     glBindBuffer(GL_QUERY_BUFFER, res->gl_id);
+     vrend_gl_bind_buffer(GL_QUERY_BUFFER, res->gl_id);
      switch ((enum pipe_query_value_type)result_type) {
      case PIPE_QUERY_TYPE_I32:
         glGetQueryObjectiv(q->id, qtype, buffer_offset(offset));
@@ -11956,7 +16629,7 @@ int vrend_get_query_result_qbo(struct vrend_context *ctx, uint32_t handle,
 
   }
 
-  glBindBuffer(GL_QUERY_BUFFER, 0);
+  vrend_gl_bind_buffer(GL_QUERY_BUFFER, 0);
 
   return 0;
 }
@@ -12195,7 +16868,7 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
    if (caps->v1.glsl_level >= 400 || has_feature(feat_tessellation))
       caps->v1.prim_mask |= (1 << PIPE_PRIM_PATCHES);
 
-   if (epoxy_has_gl_extension("GL_ARB_vertex_type_10f_11f_11f_rev"))
+   if (vrend_has_gl_extension("GL_ARB_vertex_type_10f_11f_11f_rev"))
       set_format_bit(&caps->v1.vertexbuffer, VIRGL_FORMAT_R11G11B10_FLOAT);
 
    if (has_feature(feat_nv_conditional_render) ||
@@ -12213,6 +16886,9 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
       /* GL_MAX_VERTEX_UNIFORM_BLOCKS is omitting the ordinary uniform block, add it
        * also reduce by 1 as we might generate a VirglBlock helper uniform block */
       caps->v1.max_uniform_blocks = max + 1 - 1;
+      /* and by one more for the block of the constants */
+      if (vrend_state.use_const_ubo)
+         caps->v1.max_uniform_blocks--;
    }
 
    if (has_feature(feat_depth_clamp))
@@ -12222,9 +16898,9 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
       caps->v1.bset.fragment_coord_conventions = 1;
       caps->v1.bset.seamless_cube_map = 1;
    } else {
-      if (epoxy_has_gl_extension("GL_ARB_fragment_coord_conventions"))
+      if (vrend_has_gl_extension("GL_ARB_fragment_coord_conventions"))
          caps->v1.bset.fragment_coord_conventions = 1;
-      if (epoxy_has_gl_extension("GL_ARB_seamless_cube_map") || gles_ver >= 30)
+      if (vrend_has_gl_extension("GL_ARB_seamless_cube_map") || gles_ver >= 30)
          caps->v1.bset.seamless_cube_map = 1;
    }
 
@@ -12256,15 +16932,15 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
       caps->v1.bset.has_fp64 = 1;
    } else {
       /* need gpu shader 5 for bitfield insert */
-      if (epoxy_has_gl_extension("GL_ARB_gpu_shader_fp64") &&
-          epoxy_has_gl_extension("GL_ARB_gpu_shader5"))
+      if (vrend_has_gl_extension("GL_ARB_gpu_shader_fp64") &&
+          vrend_has_gl_extension("GL_ARB_gpu_shader5"))
          caps->v1.bset.has_fp64 = 1;
    }
 
    if (has_feature(feat_base_instance))
       caps->v1.bset.start_instance = 1;
 
-   if (epoxy_has_gl_extension("GL_ARB_shader_stencil_export")) {
+   if (vrend_has_gl_extension("GL_ARB_shader_stencil_export")) {
       caps->v1.bset.shader_stencil_export = 1;
    }
 
@@ -12277,7 +16953,7 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
    } else {
      if (has_feature(feat_cull_distance))
         caps->v1.bset.has_cull = 1;
-     if (epoxy_has_gl_extension("GL_ARB_derivative_control"))
+     if (vrend_has_gl_extension("GL_ARB_derivative_control"))
         caps->v1.bset.derivative_control = 1;
    }
 
@@ -12507,8 +17183,11 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
          glGetIntegerv(GL_MAX_IMAGE_SAMPLES, (GLint*)&caps->v2.max_image_samples);
    }
 
-   if (has_feature(feat_storage_multisample))
+   if (has_feature(feat_storage_multisample)) {
       caps->v1.max_samples = vrend_renderer_query_multisample_caps(caps->v1.max_samples, &caps->v2);
+      /* the probes bind and delete textures without going through the shadow */
+      vrend_gl_state_invalidate();
+   }
 
    caps->v2.capability_bits |= VIRGL_CAP_TGSI_INVARIANT | VIRGL_CAP_SET_MIN_SAMPLES |
                                VIRGL_CAP_TGSI_PRECISE | VIRGL_CAP_APP_TWEAK_SUPPORT;
@@ -12644,6 +17323,7 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
 
    if (vrend_check_framebuffer_mixed_color_attachements())
       caps->v2.capability_bits |= VIRGL_CAP_FBO_MIXED_COLOR_FORMATS;
+   vrend_gl_state_invalidate();
 
    /* We want to expose ARB_gpu_shader_fp64 when running on top of ES */
    if (vrend_state.use_gles) {
@@ -12694,7 +17374,7 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
    if (has_feature(feat_clip_control))
       caps->v2.capability_bits |= VIRGL_CAP_CLIP_HALFZ;
 
-   if (epoxy_has_gl_extension("GL_KHR_texture_compression_astc_sliced_3d"))
+   if (vrend_has_gl_extension("GL_KHR_texture_compression_astc_sliced_3d"))
       caps->v2.capability_bits |= VIRGL_CAP_3D_ASTC;
 
    caps->v2.capability_bits |= VIRGL_CAP_INDIRECT_INPUT_ADDR;
@@ -12860,6 +17540,49 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
       caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_RESOURCE_LAYOUT;
 }
 
+/* the capset, along with the limits that filling it records in vrend_state */
+struct vrend_cached_caps {
+   union virgl_caps caps;
+   uint32_t max_texture_buffer_size;
+   uint32_t max_texture_2d_size;
+   uint32_t max_texture_3d_size;
+   uint32_t max_texture_cube_size;
+   uint32_t max_shader_patch_varyings;
+   uint32_t inferred_gl_caching_type;
+};
+
+static bool vrend_renderer_load_cached_caps(union virgl_caps *caps)
+{
+   struct vrend_cached_caps cached;
+
+   if (!vrend_caps_cache_load(VREND_CAPS_CACHE_CAPS, &cached, sizeof(cached)))
+      return false;
+
+   *caps = cached.caps;
+   vrend_state.max_texture_buffer_size = cached.max_texture_buffer_size;
+   vrend_state.max_texture_2d_size = cached.max_texture_2d_size;
+   vrend_state.max_texture_3d_size = cached.max_texture_3d_size;
+   vrend_state.max_texture_cube_size = cached.max_texture_cube_size;
+   vrend_state.max_shader_patch_varyings = cached.max_shader_patch_varyings;
+   vrend_state.inferred_gl_caching_type = cached.inferred_gl_caching_type;
+   return true;
+}
+
+static void vrend_renderer_store_cached_caps(const union virgl_caps *caps)
+{
+   struct vrend_cached_caps cached;
+
+   memset(&cached, 0, sizeof(cached));
+   cached.caps = *caps;
+   cached.max_texture_buffer_size = vrend_state.max_texture_buffer_size;
+   cached.max_texture_2d_size = vrend_state.max_texture_2d_size;
+   cached.max_texture_3d_size = vrend_state.max_texture_3d_size;
+   cached.max_texture_cube_size = vrend_state.max_texture_cube_size;
+   cached.max_shader_patch_varyings = vrend_state.max_shader_patch_varyings;
+   cached.inferred_gl_caching_type = vrend_state.inferred_gl_caching_type;
+   vrend_caps_cache_store(VREND_CAPS_CACHE_CAPS, &cached, sizeof(cached));
+}
+
 void vrend_renderer_fill_caps(uint32_t set, uint32_t version,
                               union virgl_caps *caps)
 {
@@ -12880,6 +17603,8 @@ void vrend_renderer_fill_caps(uint32_t set, uint32_t version,
    case VIRTGPU_DRM_CAPSET_VIRGL2:
       if (version > VREND_CAPSET_VIRGL2_MAX_VERSION)
          return;
+      if (vrend_renderer_load_cached_caps(caps))
+         return;
       memset(caps, 0, sizeof(*caps));
       caps->max_version = VREND_CAPSET_VIRGL2_MAX_VERSION;
       fill_capset2 = true;
@@ -12911,6 +17636,7 @@ void vrend_renderer_fill_caps(uint32_t set, uint32_t version,
       return;
 
    vrend_renderer_fill_caps_v2(gl_ver, gles_ver, caps);
+   vrend_renderer_store_cached_caps(caps);
 }
 
 GLint64 vrend_renderer_get_timestamp(void)
@@ -12920,61 +17646,118 @@ GLint64 vrend_renderer_get_timestamp(void)
    return v;
 }
 
-void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
-                                         uint32_t *width,
-                                         uint32_t *height)
+/* Size of the contents of a resource that can be used as a cursor, 0 for
+ * any other resource */
+static uint32_t vrend_cursor_size(const struct vrend_resource *res)
 {
-   struct vrend_resource *res = (struct vrend_resource *)pres;
-   GLenum format, type;
-   int blsize;
-   char *data, *data2;
-   int size;
-   unsigned h;
-
    if (res->base.width0 > 128 || res->base.height0 > 128)
-      return NULL;
+      return 0;
 
    if (res->target != GL_TEXTURE_2D)
-      return NULL;
+      return 0;
 
-   if (!width || !height)
-      return NULL;
+   return util_format_get_nblocks(res->base.format, res->base.width0, res->base.height0) *
+          util_format_get_blocksize(res->base.format);
+}
 
-   *width = res->base.width0;
-   *height = res->base.height0;
+/* The contents are only kept when all the writes go through the renderer */
+static bool vrend_cursor_is_cacheable(const struct vrend_resource *res)
+{
+   return !res->gpu_written && !res->is_imported && !res->gbm_bo && !res->egl_image;
+}
+
+/* Reads the texture back with the rows flipped, this waits for the GPU */
+static bool vrend_read_cursor(struct vrend_resource *res, char *data, uint32_t size)
+{
+   GLenum format, type;
+   int blsize;
+   char *tmp;
+   unsigned h;
+
+   tmp = malloc(size);
+   if (!tmp)
+      return false;
+
+   vrend_renderer_force_ctx_0();
 
    format = tex_conv_table[res->base.format].glformat;
    type = tex_conv_table[res->base.format].gltype;
    blsize = util_format_get_blocksize(res->base.format);
-   size = util_format_get_nblocks(res->base.format, res->base.width0, res->base.height0) * blsize;
-   data = malloc(size);
-   data2 = malloc(size);
-
-   if (!data || !data2) {
-      free(data);
-      free(data2);
-      return NULL;
-   }
 
    if (has_feature(feat_arb_robustness)) {
-      glBindTexture(res->target, res->gl_id);
-      glGetnTexImageARB(res->target, 0, format, type, size, data);
+      vrend_gl_bind_texture(res->target, res->gl_id);
+      glGetnTexImageARB(res->target, 0, format, type, size, tmp);
    } else if (vrend_state.use_gles) {
-      do_readpixels(res, 0, 0, 0, 0, 0, *width, *height, format, type, size, data);
+      do_readpixels(res, 0, 0, 0, 0, 0, res->base.width0, res->base.height0,
+                    format, type, size, tmp);
    } else {
-      glBindTexture(res->target, res->gl_id);
-      glGetTexImage(res->target, 0, format, type, data);
+      vrend_gl_bind_texture(res->target, res->gl_id);
+      glGetTexImage(res->target, 0, format, type, tmp);
    }
 
    for (h = 0; h < res->base.height0; h++) {
       uint32_t doff = (res->base.height0 - h - 1) * res->base.width0 * blsize;
       uint32_t soff = h * res->base.width0 * blsize;
 
-      memcpy(data2 + doff, data + soff, res->base.width0 * blsize);
+      memcpy(data + doff, tmp + soff, res->base.width0 * blsize);
+   }
+   free(tmp);
+   vrend_gl_bind_texture(res->target, 0);
+   return true;
+}
+
+int vrend_renderer_read_cursor_contents(struct pipe_resource *pres,
+                                        void *data, uint32_t size,
+                                        uint32_t *width,
+                                        uint32_t *height)
+{
+   struct vrend_resource *res = (struct vrend_resource *)pres;
+   uint32_t cursor_size = vrend_cursor_size(res);
+
+   if (!cursor_size || !width || !height)
+      return EINVAL;
+
+   *width = res->base.width0;
+   *height = res->base.height0;
+
+   if (size < cursor_size)
+      return ENOSPC;
+
+   if (res->cursor_data) {
+      memcpy(data, res->cursor_data, cursor_size);
+      return 0;
+   }
+
+   if (!vrend_read_cursor(res, data, cursor_size))
+      return ENOMEM;
+
+   if (vrend_cursor_is_cacheable(res)) {
+      res->cursor_data = malloc(cursor_size);
+      if (res->cursor_data)
+         memcpy(res->cursor_data, data, cursor_size);
+   }
+   return 0;
+}
+
+void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
+                                         uint32_t *width,
+                                         uint32_t *height)
+{
+   uint32_t size = vrend_cursor_size((struct vrend_resource *)pres);
+   void *data;
+
+   if (!size)
+      return NULL;
+
+   data = malloc(size);
+   if (!data)
+      return NULL;
+
+   if (vrend_renderer_read_cursor_contents(pres, data, size, width, height)) {
+      free(data);
+      return NULL;
    }
-   free(data);
-   glBindTexture(res->target, 0);
-   return data2;
+   return data;
 }
 
 
@@ -13027,6 +17810,52 @@ vrend_renderer_find_untyped_resource(struct vrend_context *ctx, uint32_t res_id)
    return NULL;
 }
 
+/* an estimate of the GPU memory backing the resource, without padding */
+static uint64_t vrend_resource_memory_size(const struct vrend_resource *res)
+{
+   const struct pipe_resource *pr = &res->base;
+
+   if (pr->target == PIPE_BUFFER)
+      return pr->width0;
+
+   const uint32_t blocksize = util_format_get_blocksize(pr->format);
+   uint64_t size = 0;
+   for (uint32_t level = 0; level <= pr->last_level; level++) {
+      const uint32_t width = u_minify(pr->width0, level);
+      const uint32_t height = u_minify(pr->height0, level);
+      const uint32_t depth =
+         pr->target == PIPE_TEXTURE_3D ? u_minify(pr->depth0, level) : 1;
+
+      size += (uint64_t)util_format_get_nblocksx(pr->format, width) *
+              util_format_get_nblocksy(pr->format, height) * depth * blocksize;
+   }
+
+   return size * MAX2(pr->array_size, 1) * MAX2(pr->nr_samples, 1);
+}
+
+/* resources over the hard budget of the context are not attached */
+static void vrend_ctx_attach_resource(struct vrend_context *ctx, uint32_t res_id,
+                                      struct vrend_resource *res)
+{
+   struct vrend_resource *old = vrend_ctx_resource_lookup(ctx->res_hash, res_id);
+   if (old == res)
+      return;
+
+   const uint64_t size = vrend_resource_memory_size(res);
+   if (!virgl_memory_budget_charge(&ctx->memory_budget, size)) {
+      virgl_warn("Dropping attached resource %d over the memory budget\n", res_id);
+      vrend_texture_pool_trim(true);
+      return;
+   }
+
+   if (old)
+      virgl_memory_budget_uncharge(&ctx->memory_budget, vrend_resource_memory_size(old));
+   vrend_ctx_resource_insert(ctx->res_hash, res_id, res);
+
+   if (atomic_load(&ctx->memory_budget.over_soft_limit))
+      vrend_state.evict_requested = true;
+}
+
 void vrend_renderer_attach_res_ctx(struct vrend_context *ctx,
                                    struct virgl_resource *res)
 {
@@ -13052,8 +17881,7 @@ void vrend_renderer_attach_res_ctx(struct vrend_context *ctx,
       return;
    }
 
-   vrend_ctx_resource_insert(ctx->res_hash,
-                             res->res_id,
+   vrend_ctx_attach_resource(ctx, res->res_id,
                              (struct vrend_resource *)res->pipe_resource);
 }
 
@@ -13075,12 +17903,20 @@ void vrend_renderer_detach_res_ctx(struct vrend_context *ctx,
       return;
    }
 
-   vrend_ctx_resource_remove(ctx->res_hash, res->res_id);
+   struct vrend_resource *vres = vrend_ctx_resource_lookup(ctx->res_hash, res->res_id);
+   if (vres) {
+      if (has_bit(vres->storage_bits, VREND_STORAGE_GL_BUFFER))
+         vrend_vao_forget_resource(ctx, vres);
+      virgl_memory_budget_uncharge(&ctx->memory_budget, vrend_resource_memory_size(vres));
+      vrend_ctx_resource_remove(ctx->res_hash, res->res_id);
+   }
 }
 
 struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx, int res_handle)
 {
-   return vrend_ctx_resource_lookup(ctx->res_hash, res_handle);
+   struct vrend_resource *res = vrend_ctx_resource_lookup(ctx->res_hash, res_handle);
+   vrend_resource_touch(res);
+   return res;
 }
 
 void vrend_context_set_debug_flags(struct vrend_context *ctx, const char *flagstring)
@@ -13109,6 +17945,30 @@ void vrend_renderer_resource_get_info(struct pipe_resource *pres,
    info->stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, 0)) * elsize;
 }
 
+int
+vrend_renderer_d3d11_signal_fence(void **d3d11_fence, uint64_t *value)
+{
+#if defined(WIN32) && defined(HAVE_EPOXY_EGL_H)
+   ID3D11Fence *fence;
+
+   if (!vrend_state.d3d_share_texture)
+      return ENOTSUP;
+
+   vrend_renderer_force_ctx_0();
+   glFlush();
+
+   if (!virgl_egl_win32_signal_d3d11_fence(egl, &fence, value))
+      return ENOTSUP;
+
+   *d3d11_fence = fence;
+   return 0;
+#else
+   (void)d3d11_fence;
+   (void)value;
+   return ENOTSUP;
+#endif
+}
+
 int
 vrend_renderer_resource_d3d11_texture2d(struct pipe_resource *pres, void **d3d_tex2d)
 {
@@ -13164,21 +18024,64 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (!sub)
       return;
 
+   sub->program_table = _mesa_hash_table_create(NULL, vrend_program_key_hash,
+                                                vrend_program_key_equal);
+   if (!sub->program_table)
+      goto fail;
+
+   sub->vao_table = _mesa_hash_table_create(NULL, vrend_vao_key_hash,
+                                            vrend_vao_key_equal);
+   if (!sub->vao_table)
+      goto fail_program_table;
+
+   sub->streamout_table = _mesa_hash_table_create(NULL, vrend_streamout_key_hash,
+                                                  vrend_streamout_key_equal);
+   if (!sub->streamout_table)
+      goto fail_vao_table;
+
+   sub->fbo_table = _mesa_hash_table_create(NULL, vrend_fbo_key_hash,
+                                            vrend_fbo_key_equal);
+   if (!sub->fbo_table)
+      goto fail_streamout_table;
+
+   if (!virgl_id_table_init(&sub->combo_variants))
+      goto fail_fbo_table;
+
+   sub->object_hash = vrend_object_init_ctx_table();
+   if (!sub->object_hash)
+      goto fail_combo_variants;
+
+   list_inithead(&sub->vaos);
+   list_inithead(&sub->fbos);
+
    ctx_params.shared = (ctx->ctx_id == 0 && sub_ctx_id == 0) ? false : true;
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
    ctx_params.compat_ctx = !vrend_state.use_core_profile && !vrend_state.use_gles;
-   sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+   ctx_params.no_error = vrend_state.use_no_error;
+   sub->gl_context = vrend_context_pool_take(&ctx_params);
+   if (!sub->gl_context)
+      sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+   if (!sub->gl_context)
+      goto fail_object_hash;
    sub->parent = ctx;
-   vrend_clicbs->make_current(sub->gl_context);
+   vrend_make_current(sub->gl_context);
 
    /* enable if vrend_renderer_init function has done it as well */
    if (has_feature(feat_debug_cb)) {
       glDebugMessageCallback(vrend_debug_cb, NULL);
       glEnable(GL_DEBUG_OUTPUT);
-      glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+      /* with per-batch checks, this is what tells the failing command */
+      if (vrend_state.gl_error_check == VREND_GL_ERROR_CHECK_BATCH)
+         glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+      else
+         glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
    }
 
+   /* let the driver pick as many compiler threads as it likes */
+   if (has_feature(feat_parallel_shader_compile))
+      glMaxShaderCompilerThreadsKHR(0xffffffff);
+
    sub->sub_ctx_id = sub_ctx_id;
 
    /* initialize the depth far_val to 1 */
@@ -13193,19 +18096,22 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 
    glGenVertexArrays(1, &sub->vaoid);
    if (!has_feature(feat_gles31_vertex_attrib_binding)) {
-      glBindVertexArray(sub->vaoid);
+      vrend_gl_bind_vertex_array(sub->vaoid);
    }
 
-   glGenFramebuffers(1, &sub->fb_id);
-   glBindFramebuffer(GL_FRAMEBUFFER, sub->fb_id);
+   /* start out with a framebuffer without attachments */
+   struct vrend_fbo_key fbo_key;
+   memset(&fbo_key, 0, sizeof(fbo_key));
+   sub->current_fbo = vrend_fbo_lookup(sub, &fbo_key);
+   if (sub->current_fbo)
+      sub->fb_id = sub->current_fbo->id;
    glGenFramebuffers(2, sub->blit_fb_ids);
 
-   for (int i = 0; i < VREND_PROGRAM_NQUEUES; ++i)
-      list_inithead(&sub->gl_programs[i]);
+   list_inithead(&sub->gl_programs);
    list_inithead(&sub->cs_programs);
+   list_inithead(&sub->injected_tcs);
    list_inithead(&sub->streamout_list);
-
-   sub->object_hash = vrend_object_init_ctx_table();
+   list_inithead(&sub->gpu_timer_free_list);
 
    sub->sysvalue_data.winsys_adjust_y = 1.f;
 
@@ -13215,6 +18121,22 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       ctx->sub0 = sub;
 
    vrend_set_tweak_from_env(&ctx->sub->tweaks);
+   return;
+
+fail_object_hash:
+   vrend_object_fini_ctx_table(sub->object_hash);
+fail_combo_variants:
+   virgl_id_table_fini(&sub->combo_variants);
+fail_fbo_table:
+   _mesa_hash_table_destroy(sub->fbo_table, NULL);
+fail_streamout_table:
+   _mesa_hash_table_destroy(sub->streamout_table, NULL);
+fail_vao_table:
+   _mesa_hash_table_destroy(sub->vao_table, NULL);
+fail_program_table:
+   _mesa_hash_table_destroy(sub->program_table, NULL);
+fail:
+   FREE(sub);
 }
 
 unsigned vrend_context_has_debug_flag(const struct vrend_context *ctx, enum virgl_debug_flags flag)
@@ -13243,7 +18165,7 @@ void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
             ctx->sub = ctx->sub0;
          }
          vrend_destroy_sub_context(sub);
-         vrend_clicbs->make_current(ctx->sub->gl_context);
+         vrend_make_current(ctx->sub->gl_context);
          break;
       }
    }
@@ -13253,8 +18175,15 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 {
    struct vrend_sub_context *sub = vrend_renderer_find_sub_ctx(ctx, sub_ctx_id);
    if (sub && ctx->sub != sub) {
+      /* the queries of a timer belong to the GL context of one sub context */
+      const bool in_batch = ctx->sub->batch_timer;
+      vrend_gpu_timer_end_batch(ctx);
+
       ctx->sub = sub;
-      vrend_clicbs->make_current(sub->gl_context);
+      vrend_make_current(sub->gl_context);
+
+      if (in_batch)
+         vrend_gpu_timer_begin_batch(ctx);
    }
 }
 
@@ -13268,6 +18197,7 @@ void vrend_renderer_prepare_reset(void)
 void vrend_renderer_reset(void)
 {
    vrend_free_fences();
+   vrend_free_readbacks();
    vrend_blitter_fini();
 
    vrend_destroy_context(vrend_state.ctx0);
@@ -13280,6 +18210,10 @@ void vrend_renderer_reset(void)
 
 int vrend_renderer_get_poll_fd(void)
 {
+   /* the epoll fd is readable while one of its sync files is */
+   if (vrend_state.use_fence_fds)
+      return vrend_state.fence_epoll_fd;
+
    int fd = vrend_state.eventfd;
    if (vrend_state.use_async_fence_cb && fd < 0)
       virgl_error("Failed to duplicate eventfd: error=%d\n", errno);
@@ -13319,6 +18253,13 @@ int vrend_renderer_pipe_resource_create(struct vrend_context *ctx, uint32_t blob
    if (!res)
       return EINVAL;
 
+   /* it is charged when attached, but fail early when it would not fit */
+   if (!virgl_memory_budget_fits(&ctx->memory_budget, vrend_resource_memory_size(res))) {
+      vrend_renderer_resource_destroy(res);
+      vrend_texture_pool_trim(true);
+      return ENOMEM;
+   }
+
    res->blob_id = blob_id;
    list_addtail(&res->head, &ctx->vrend_resources);
    return 0;
@@ -13477,19 +18418,18 @@ vrend_renderer_pipe_resource_set_type(struct vrend_context *ctx,
 
          /* Create a GL texture which uses that memory as storage */
          glGenTextures(1, &gr->gl_id);
-         glBindTexture(gr->target, gr->gl_id);
+         vrend_gl_bind_texture(gr->target, gr->gl_id);
          GLsizei width = (GLsizei)args->width;
          GLsizei height = (GLsizei)args->height;
          glTexParameteri(gr->target, GL_TEXTURE_TILING_EXT, GL_LINEAR_TILING_EXT);
          glTexStorageMem2DEXT(gr->target, 1, internalformat, width, height, mem_object, 0);
-         glBindTexture(gr->target, 0);
+         vrend_gl_bind_texture(gr->target, 0);
          gr->is_imported = true;
       }
       res->pipe_resource = &gr->base;
    }
 
-   vrend_ctx_resource_insert(ctx->res_hash,
-                             res->res_id,
+   vrend_ctx_attach_resource(ctx, res->res_id,
                              (struct vrend_resource *)res->pipe_resource);
 
    return 0;
@@ -13501,31 +18441,85 @@ uint32_t vrend_renderer_resource_get_map_info(struct pipe_resource *pres)
    return res->map_info;
 }
 
+bool vrend_renderer_resource_map_is_stable(struct pipe_resource *pres)
+{
+   struct vrend_resource *res = (struct vrend_resource *)pres;
+   return has_bits(res->storage_bits, VREND_STORAGE_GL_BUFFER | VREND_STORAGE_GL_IMMUTABLE) &&
+          (res->buffer_storage_flags & GL_MAP_PERSISTENT_BIT);
+}
+
+static void *vrend_resource_blob_map(struct vrend_resource *res)
+{
+   if (!res->blob_map) {
+      vrend_gl_bind_buffer(res->target, res->gl_id);
+      res->blob_map = glMapBufferRange(res->target, 0, res->size, res->buffer_storage_flags);
+      vrend_gl_bind_buffer(res->target, 0);
+   }
+   return res->blob_map;
+}
+
 int vrend_renderer_resource_map(struct pipe_resource *pres, void **map, uint64_t *out_size)
 {
    struct vrend_resource *res = (struct vrend_resource *)pres;
    if (!has_bits(res->storage_bits, VREND_STORAGE_GL_BUFFER | VREND_STORAGE_GL_IMMUTABLE))
       return -EINVAL;
 
-   glBindBufferARB(res->target, res->gl_id);
-   *map = glMapBufferRange(res->target, 0, res->size, res->buffer_storage_flags);
-   if (!*map)
+   if (!vrend_resource_blob_map(res))
       return -EINVAL;
 
-   glBindBufferARB(res->target, 0);
+   res->blob_map_count++;
+   *map = res->blob_map;
    *out_size = res->size;
    return 0;
 }
 
+/* Places the persistent mapping of a blob buffer at addr as well.  The
+ * driver mapping is duplicated with mremap, which only works when it is a
+ * shared mapping starting on a page boundary, the caller falls back to a
+ * regular map otherwise. */
+int vrend_renderer_resource_map_fixed(struct pipe_resource *pres, void *addr)
+{
+#ifdef __linux__
+   struct vrend_resource *res = (struct vrend_resource *)pres;
+   const uintptr_t page_mask = getpagesize() - 1;
+   void *map;
+
+   if (!vrend_renderer_resource_map_is_stable(pres))
+      return -EOPNOTSUPP;
+
+   /* the persistent mapping stays until the buffer is deleted */
+   map = vrend_resource_blob_map(res);
+   if (!map)
+      return -EINVAL;
+
+   if (((uintptr_t)map & page_mask) || (res->size & page_mask))
+      return -EOPNOTSUPP;
+
+   map = mremap(map, 0, res->size, MREMAP_MAYMOVE | MREMAP_FIXED, addr);
+   return map == MAP_FAILED ? -EOPNOTSUPP : 0;
+#else
+   (void)pres;
+   (void)addr;
+   return -EOPNOTSUPP;
+#endif
+}
+
 int vrend_renderer_resource_unmap(struct pipe_resource *pres)
 {
    struct vrend_resource *res = (struct vrend_resource *)pres;
-   if (!has_bits(res->storage_bits, VREND_STORAGE_GL_BUFFER | VREND_STORAGE_GL_IMMUTABLE))
+   if (!has_bits(res->storage_bits, VREND_STORAGE_GL_BUFFER | VREND_STORAGE_GL_IMMUTABLE) ||
+       !res->blob_map_count)
       return -EINVAL;
 
-   glBindBufferARB(res->target, res->gl_id);
+   /* persistent mappings stay until the buffer is deleted, mapping the
+    * resource again hands out the same pointer */
+   if (--res->blob_map_count || vrend_renderer_resource_map_is_stable(pres))
+      return 0;
+
+   vrend_gl_bind_buffer(res->target, res->gl_id);
    glUnmapBuffer(res->target);
-   glBindBufferARB(res->target, 0);
+   vrend_gl_bind_buffer(res->target, 0);
+   res->blob_map = NULL;
    return 0;
 }
 
@@ -13645,6 +18639,19 @@ void vrend_renderer_get_meminfo(struct vrend_context *ctx, uint32_t res_handle)
       info->avail_device_memory = i[0];
       info->avail_staging_memory = i[2];
    }
+
+   /* report the context budget as the device memory, in KiB */
+   const struct virgl_memory_budget *budget = &ctx->memory_budget;
+   const uint64_t limit = budget->soft_limit ? budget->soft_limit : budget->hard_limit;
+   if (limit) {
+      const uint32_t total = MIN2(limit / 1024, UINT32_MAX);
+      const uint32_t avail = MIN2(virgl_memory_budget_available(budget) / 1024, total);
+
+      info->total_device_memory = info->total_device_memory ?
+                                  MIN2(info->total_device_memory, total) : total;
+      info->avail_device_memory = info->avail_device_memory ?
+                                  MIN2(info->avail_device_memory, avail) : avail;
+   }
 }
 
 static uint32_t vrend_renderer_get_video_memory(void)
@@ -58,11 +58,14 @@ struct virgl_gl_ctx_param {
    int minor_ver;
    bool shared;
    bool compat_ctx;
+   /* KHR_no_error, only honoured by the EGL winsys */
+   bool no_error;
 };
 
 struct virgl_context;
 struct virgl_resource;
 struct vrend_context;
+struct vrend_pending_uploads;
 
 /* Number of mipmap levels for which to keep the backing iov offsets.
  * Value mirrored from mesa/virgl
@@ -79,6 +82,8 @@ struct vrend_context;
 #define VREND_STORAGE_GL_MEMOBJ          BIT(7)
 #define VREND_STORAGE_D3D_TEXTURE        BIT(8)
 
+#define VREND_MAX_BLIT_VIEWS 4
+
 struct vrend_resource {
    struct pipe_resource base;
    uint32_t storage_bits;
@@ -101,6 +106,10 @@ struct vrend_resource {
    /* IOV pointing to shared guest memory storage for this resource. */
    const struct iovec *iov;
    uint32_t num_iovs;
+   /* start offsets of the iov entries, for seeking in large iovs */
+   size_t *iov_offsets;
+   /* small buffer uploads that are merged until the buffer is used */
+   struct vrend_pending_uploads *pending_uploads;
    uint64_t mipmap_offsets[VR_MAX_TEXTURE_2D_LEVELS];
    void *gbm_bo, *egl_image;
    void *aux_plane_egl_image[VIRGL_GBM_MAX_PLANES];
@@ -110,11 +119,41 @@ struct vrend_resource {
 
    uint64_t size;
    GLbitfield buffer_storage_flags;
+   /* of the glBufferData storage, kept when evicted buffers are restored */
+   GLenum buffer_usage;
    GLuint memobj;
 
+   /* host-only buffers the guest writes often stay mapped for their
+    * lifetime, write_sync fences the last write that went through GL */
+   void *write_map;
+   GLsync write_sync;
+
+   /* the mapping handed out for blobs, persistent mappings are kept until
+    * the resource is destroyed so that the VMM sees the same pointer */
+   void *blob_map;
+   uint32_t blob_map_count;
+
    uint32_t blob_id;
    struct list_head head;
    bool is_imported;
+
+   /* views of the whole texture in other formats, kept for the blits */
+   GLuint blit_view_ids[VREND_MAX_BLIT_VIEWS];
+   enum virgl_formats blit_view_formats[VREND_MAX_BLIT_VIEWS];
+   uint32_t num_blit_views;
+
+   /* the flipped contents last read for the cursor, NULL when stale */
+   void *cursor_data;
+   /* rendered to or written by shaders, so the contents change without the
+    * renderer noticing */
+   bool gpu_written;
+
+   /* the eviction epoch the resource was last used in */
+   uint32_t last_used_epoch;
+   /* in the evictable buffers of the renderer when the storage can be released */
+   struct list_head evict_head;
+   /* the contents of an evicted buffer until its next use */
+   void *evicted_data;
 };
 
 #define VIRGL_TEXTURE_NEED_SWIZZLE        (1 << 0)
@@ -122,6 +161,8 @@ struct vrend_resource {
 #define VIRGL_TEXTURE_CAN_READBACK        (1 << 2)
 #define VIRGL_TEXTURE_CAN_TARGET_RECTANGLE (1 << 3)
 #define VIRGL_TEXTURE_CAN_MULTISAMPLE      (1 << 4)
+/* compressed on the guest side only, decoded by vrend_etc2 on writes */
+#define VIRGL_TEXTURE_EMULATED_COMPRESSION (1 << 5)
 
 enum view_class {
    view_class_unsupported,
@@ -201,6 +242,21 @@ struct vrend_if_cbs {
 
 bool vrend_check_no_error(struct vrend_context *ctx);
 
+/* When the GL errors of the decoded commands are checked */
+enum vrend_gl_error_check {
+   /* never, the contexts are created with KHR_no_error */
+   VREND_GL_ERROR_CHECK_NONE,
+   /* once at the end of every submitted batch */
+   VREND_GL_ERROR_CHECK_BATCH,
+   /* after every command, so that the failing command is reported */
+   VREND_GL_ERROR_CHECK_COMMAND,
+};
+
+enum vrend_gl_error_check vrend_renderer_gl_error_check(void);
+
+/* labels the GL errors reported through KHR_debug on this thread */
+void vrend_renderer_set_current_command(uint32_t index, const char *name);
+
 const struct virgl_resource_pipe_callbacks *
 vrend_renderer_get_pipe_callbacks(void);
 
@@ -250,6 +306,36 @@ int vrend_draw_vbo(struct vrend_context *ctx,
                    const struct pipe_draw_info *info,
                    uint32_t cso, uint32_t indirect_handle, uint32_t indirect_draw_count_handle);
 
+/* Direct draws are batched until the next command that is not a draw or an
+ * index buffer update, the decoder flushes them before any such command. */
+int vrend_flush_draws(struct vrend_context *ctx);
+
+/* Returns true once after a flush of batched draws failed, with the index
+ * of the command of the first draw of the batch.  The draws of a batch share
+ * all their state, so that is the draw that failed, and the error is
+ * reported on it whichever command caused the flush. */
+bool vrend_take_draw_batch_failure(struct vrend_context *ctx, uint32_t *cmd_index);
+
+/* Clears are merged until the next command that is not a clear or a blit,
+ * the decoder flushes them before any other command. */
+void vrend_flush_clears(struct vrend_context *ctx);
+
+/* Blits that generate mipmaps are merged until the next command that is not
+ * a blit, the decoder flushes them before any other command. */
+void vrend_flush_mipmap_blits(struct vrend_context *ctx);
+
+/* Barriers are merged until the next command that is not a barrier, the
+ * decoder flushes them before any other command. */
+void vrend_flush_barriers(struct vrend_context *ctx);
+
+/* Consecutive dispatches bind the compute state once, the decoder ends the
+ * run before any other command. */
+void vrend_end_dispatch_run(struct vrend_context *ctx);
+
+/* Small buffer uploads are merged until the next command that is not a
+ * transfer, the decoder flushes them before any such command. */
+void vrend_renderer_flush_uploads(void);
+
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
                                  uint32_t nr_cbufs, uint32_t surf_handle[PIPE_MAX_COLOR_BUFS],
                                  uint32_t zsurf_handle);
@@ -259,6 +345,8 @@ void vrend_destroy_context(struct vrend_context *ctx);
 struct virgl_context *vrend_renderer_context_create(uint32_t handle,
                                                     uint32_t nlen,
                                                     const char *name);
+/* runs the submissions queued with VREND_SCHED_SUBMITS */
+void vrend_renderer_drain_submits(void);
 
 struct vrend_renderer_resource_create_args {
    enum pipe_texture_target target;
@@ -488,12 +576,19 @@ void vrend_render_condition(struct vrend_context *ctx,
 void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
                                          uint32_t *width,
                                          uint32_t *height);
+int vrend_renderer_read_cursor_contents(struct pipe_resource *pres,
+                                        void *data, uint32_t size,
+                                        uint32_t *width,
+                                        uint32_t *height);
 
 void vrend_renderer_fill_caps(uint32_t set, uint32_t version,
                               union virgl_caps *caps);
 
 GLint64 vrend_renderer_get_timestamp(void);
 
+/* same as epoxy_has_gl_extension, from the list gathered at init */
+bool vrend_has_gl_extension(const char *name);
+
 void vrend_build_format_list_common(void);
 void vrend_build_format_list_gl(void);
 void vrend_build_format_list_gles(void);
@@ -523,6 +618,15 @@ vrend_resource_reference(struct vrend_resource **ptr, struct vrend_resource *tex
 
 void vrend_renderer_force_ctx_0(void);
 
+#ifdef ENABLE_TESTS
+/* Evicts a buffer right away, as if it went cold under memory pressure, and
+ * gets the size and usage of its GL storage.  Intended to be used in unit
+ * tests only. */
+int vrend_renderer_resource_evict(uint32_t res_handle);
+int vrend_renderer_resource_get_buffer_storage(uint32_t res_handle, uint32_t *size,
+                                               GLenum *usage);
+#endif
+
 void vrend_renderer_get_rect(struct pipe_resource *pres,
                              const struct iovec *iov, unsigned int num_iovs,
                              uint32_t offset,
@@ -571,6 +675,20 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
 void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
 void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
 
+/* With VREND_GPU_TIMESTAMPS set, the GPU time of each command batch, blit and
+ * clear is measured, and resolved when the queries are checked.
+ */
+void vrend_gpu_timer_begin_batch(struct vrend_context *ctx);
+void vrend_gpu_timer_end_batch(struct vrend_context *ctx);
+
+/* returns the GPU time of the batches of ctx resolved since the last call */
+uint64_t vrend_context_take_gpu_time(struct vrend_context *ctx);
+
+void vrend_renderer_get_gpu_time_stats(uint64_t *batch_time,
+                                       uint64_t *blit_time,
+                                       uint64_t *clear_time);
+void vrend_renderer_reset_gpu_time_stats(void);
+
 void vrend_report_context_error_internal(const char *fname, struct vrend_context *ctx,
                                    enum virgl_ctx_errors error, uint32_t value);
 
@@ -632,8 +750,12 @@ uint32_t vrend_renderer_resource_get_map_info(struct pipe_resource *pres);
 
 int vrend_renderer_resource_map(struct pipe_resource *pres, void **map, uint64_t *out_size);
 
+int vrend_renderer_resource_map_fixed(struct pipe_resource *pres, void *addr);
+
 int vrend_renderer_resource_unmap(struct pipe_resource *pres);
 
+bool vrend_renderer_resource_map_is_stable(struct pipe_resource *pres);
+
 void vrend_renderer_get_meminfo(struct vrend_context *ctx, uint32_t res_handle);
 
 void vrend_context_emit_string_marker(struct vrend_context *ctx, GLsizei length, const char * message);
@@ -643,6 +765,9 @@ struct vrend_video_context *vrend_context_get_video_ctx(struct vrend_context *ct
 int
 vrend_renderer_resource_d3d11_texture2d(struct pipe_resource *res, void **handle);
 
+int
+vrend_renderer_d3d11_signal_fence(void **d3d11_fence, uint64_t *value);
+
 int
 vrend_renderer_pipe_resource_get_layout(struct vrend_context *ctx,
                                         uint32_t out_res_id, uint32_t res_id);
@@ -25,6 +25,8 @@
 #include "tgsi/tgsi_info.h"
 #include "tgsi/tgsi_iterate.h"
 #include "tgsi/tgsi_scan.h"
+#include "c11/threads.h"
+#include "util/hash_table.h"
 #include "util/u_memory.h"
 #include "util/u_math.h"
 #include <string.h>
@@ -37,6 +39,9 @@
 
 #include "vrend_strbuf.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
 /* start convert of tgsi to glsl */
 
 #define INVARI_PREFIX "invariant"
@@ -209,8 +214,11 @@ struct dump_ctx {
    struct vrend_glsl_strbufs glsl_strbufs;
    unsigned instno;
 
-   struct vrend_strbuf src_bufs[TGSI_FULL_MAX_SRC_REGISTERS];
-   struct vrend_strbuf dst_bufs[TGSI_FULL_MAX_DST_REGISTERS];
+   /* from translation_scratch */
+   struct vrend_strbuf *src_bufs;
+   struct vrend_strbuf *dst_bufs;
+   struct vrend_strbuf *bias_buf;
+   struct vrend_strbuf *offset_buf;
 
    uint64_t interp_input_mask;
    uint32_t num_inputs;
@@ -329,6 +337,171 @@ struct dump_ctx {
    uint16_t local_cs_block_size[3];
 };
 
+/* The scratch string buffers of the translation are kept from one translation
+ * to the next and only emptied, each thread translates one shader at a time.
+ * The output buffers are handed over to the shader, they are sized from the
+ * output of the previous translation instead.
+ */
+static _Thread_local struct {
+   struct vrend_strbuf src_bufs[TGSI_FULL_MAX_SRC_REGISTERS];
+   struct vrend_strbuf dst_bufs[TGSI_FULL_MAX_DST_REGISTERS];
+   struct vrend_strbuf bias_buf;
+   struct vrend_strbuf offset_buf;
+
+   size_t glsl_main_size;
+   size_t glsl_hdr_size;
+   size_t glsl_ver_ext_size;
+} translation_scratch;
+
+static bool translation_scratch_acquire(struct dump_ctx *ctx)
+{
+   for (size_t i = 0; i < ARRAY_SIZE(translation_scratch.src_bufs); ++i)
+      strbuf_clear(&translation_scratch.src_bufs[i]);
+   for (size_t i = 0; i < ARRAY_SIZE(translation_scratch.dst_bufs); ++i)
+      strbuf_clear(&translation_scratch.dst_bufs[i]);
+
+   ctx->src_bufs = translation_scratch.src_bufs;
+   ctx->dst_bufs = translation_scratch.dst_bufs;
+   ctx->bias_buf = &translation_scratch.bias_buf;
+   ctx->offset_buf = &translation_scratch.offset_buf;
+
+   /* these are read as strings even when nothing was written to them */
+   if (!ctx->bias_buf->buf && !strbuf_alloc(ctx->bias_buf, 128))
+      return false;
+   if (!ctx->offset_buf->buf && !strbuf_alloc(ctx->offset_buf, 128))
+      return false;
+   return true;
+}
+
+void vrend_shader_free_scratch(void)
+{
+   for (size_t i = 0; i < ARRAY_SIZE(translation_scratch.src_bufs); ++i)
+      strbuf_free(&translation_scratch.src_bufs[i]);
+   for (size_t i = 0; i < ARRAY_SIZE(translation_scratch.dst_bufs); ++i)
+      strbuf_free(&translation_scratch.dst_bufs[i]);
+   strbuf_free(&translation_scratch.bias_buf);
+   strbuf_free(&translation_scratch.offset_buf);
+   memset(&translation_scratch, 0, sizeof(translation_scratch));
+}
+
+/* The #version, extension and precision lines only depend on the stage, the
+ * shader config and the features the shader requires, so the translations
+ * mostly produce the same few preambles.  Each distinct preamble is kept once
+ * and shared by the translations that produced it.
+ */
+struct shader_preamble {
+   /* protected by the mutex of the table */
+   uint32_t refcount;
+   uint64_t hash;
+   char buf[];
+};
+
+static struct {
+   once_flag init_once;
+   mtx_t mutex;
+   struct hash_table *table;
+} shader_preambles = {
+   .init_once = ONCE_FLAG_INIT,
+};
+
+static uint32_t shader_preamble_hash(const void *key)
+{
+   return (uint32_t)XXH64(key, strlen(key), 0);
+}
+
+static bool shader_preamble_equal(const void *a, const void *b)
+{
+   return !strcmp(a, b);
+}
+
+static void shader_preambles_init_once(void)
+{
+   mtx_init(&shader_preambles.mutex, mtx_plain);
+   shader_preambles.table = _mesa_hash_table_create(NULL, shader_preamble_hash,
+                                                    shader_preamble_equal);
+}
+
+static struct shader_preamble *shader_preamble_of(const struct vrend_strbuf *sb)
+{
+   return (struct shader_preamble *)(sb->buf - offsetof(struct shader_preamble, buf));
+}
+
+/* Replaces the preamble in sb by its shared copy.  sb keeps its own copy
+ * when the preamble cannot be shared. */
+static void shader_preamble_share(struct vrend_strbuf *sb)
+{
+   struct shader_preamble *preamble;
+
+   call_once(&shader_preambles.init_once, shader_preambles_init_once);
+   if (!shader_preambles.table)
+      return;
+
+   const uint64_t hash = XXH64(sb->buf, sb->size, 0);
+
+   mtx_lock(&shader_preambles.mutex);
+   struct hash_entry *entry = _mesa_hash_table_search_pre_hashed(shader_preambles.table,
+                                                                 (uint32_t)hash, sb->buf);
+   if (entry) {
+      preamble = entry->data;
+      preamble->refcount++;
+   } else {
+      preamble = malloc(sizeof(*preamble) + sb->size + 1);
+      if (preamble) {
+         preamble->refcount = 1;
+         preamble->hash = hash;
+         memcpy(preamble->buf, sb->buf, sb->size + 1);
+         if (!_mesa_hash_table_insert_pre_hashed(shader_preambles.table, (uint32_t)hash,
+                                                 preamble->buf, preamble)) {
+            free(preamble);
+            preamble = NULL;
+         }
+      }
+   }
+   mtx_unlock(&shader_preambles.mutex);
+
+   if (!preamble)
+      return;
+
+   strbuf_free(sb);
+   sb->buf = preamble->buf;
+   sb->alloc_size = sb->size + 1;
+   sb->external_buffer = true;
+}
+
+static void shader_preamble_unref(struct shader_preamble *preamble)
+{
+   mtx_lock(&shader_preambles.mutex);
+   if (!--preamble->refcount) {
+      struct hash_entry *entry =
+         _mesa_hash_table_search_pre_hashed(shader_preambles.table, (uint32_t)preamble->hash,
+                                            preamble->buf);
+      assert(entry && entry->data == preamble);
+      _mesa_hash_table_remove(shader_preambles.table, entry);
+      free(preamble);
+   }
+   mtx_unlock(&shader_preambles.mutex);
+}
+
+void vrend_shader_strings_free(struct vrend_strarray *shader)
+{
+   /* the preamble is the only external buffer of the translations */
+   if (shader->num_strings > SHADER_STRING_VER_EXT &&
+       shader->strings[SHADER_STRING_VER_EXT].external_buffer)
+      shader_preamble_unref(shader_preamble_of(&shader->strings[SHADER_STRING_VER_EXT]));
+
+   strarray_free(shader, true);
+}
+
+uint64_t vrend_shader_preamble_hash(const struct vrend_strarray *shader)
+{
+   const struct vrend_strbuf *sb = &shader->strings[SHADER_STRING_VER_EXT];
+
+   assert(shader->num_strings > SHADER_STRING_VER_EXT);
+   if (sb->external_buffer)
+      return shader_preamble_of(sb)->hash;
+   return XXH64(sb->buf, sb->size, 0);
+}
+
 static const struct vrend_shader_table shader_req_table[] = {
     { SHADER_REQ_SAMPLER_RECT, "ARB_texture_rectangle" },
     { SHADER_REQ_CUBE_ARRAY, "ARB_texture_cube_map_array" },
@@ -3138,15 +3311,15 @@ static void translate_tex(struct dump_ctx *ctx,
 
    int sampler_index = 1;
 
-   struct vrend_strbuf bias_buf;
-   struct vrend_strbuf offset_buf;
+   struct vrend_strbuf *bias_buf = ctx->bias_buf;
+   struct vrend_strbuf *offset_buf = ctx->offset_buf;
 
-   strbuf_alloc(&bias_buf, 128);
-   strbuf_alloc(&offset_buf, 128);
+   strbuf_clear(bias_buf);
+   strbuf_clear(offset_buf);
 
    if (!set_texture_reqs(ctx, inst, sinfo->sreg_index)) {
       set_buf_error(&ctx->glsl_strbufs);
-      goto cleanup;
+      return;
    }
 
    is_shad = samplertype_is_shadow(inst->Texture.Texture);
@@ -3233,14 +3406,14 @@ static void translate_tex(struct dump_ctx *ctx,
    case TGSI_OPCODE_TEX2:
       sampler_index = 2;
       if (inst->Texture.Texture == TGSI_TEXTURE_SHADOWCUBE_ARRAY)
-         strbuf_appendf(&bias_buf, ", %s.x", srcs[1]);
+         strbuf_appendf(bias_buf, ", %s.x", srcs[1]);
       break;
    case TGSI_OPCODE_TXB2:
    case TGSI_OPCODE_TXL2:
       sampler_index = 2;
-      strbuf_appendf(&bias_buf, ", %s.x", srcs[1]);
+      strbuf_appendf(bias_buf, ", %s.x", srcs[1]);
       if (inst->Texture.Texture == TGSI_TEXTURE_SHADOWCUBE_ARRAY)
-         strbuf_appendf(&bias_buf, ", %s.y", srcs[1]);
+         strbuf_appendf(bias_buf, ", %s.y", srcs[1]);
       break;
    case TGSI_OPCODE_TXB:
    case TGSI_OPCODE_TXL:
@@ -3250,7 +3423,7 @@ static void translate_tex(struct dump_ctx *ctx,
        * the bias value */
       if (!(ctx->cfg->use_gles && !ctx->cfg->has_texture_shadow_lod &&
             TGSI_TEXTURE_SHADOW1D_ARRAY == inst->Texture.Texture))
-         strbuf_appendf(&bias_buf, ", %s.w", srcs[0]);
+         strbuf_appendf(bias_buf, ", %s.w", srcs[0]);
       break;
    case TGSI_OPCODE_TXF:
       if (inst->Texture.Texture == TGSI_TEXTURE_1D ||
@@ -3260,7 +3433,7 @@ static void translate_tex(struct dump_ctx *ctx,
           inst->Texture.Texture == TGSI_TEXTURE_3D ||
           inst->Texture.Texture == TGSI_TEXTURE_1D_ARRAY ||
           inst->Texture.Texture == TGSI_TEXTURE_2D_ARRAY)
-         strbuf_appendf(&bias_buf, ", int(%s.w)", srcs[0]);
+         strbuf_appendf(bias_buf, ", int(%s.w)", srcs[0]);
       break;
    case TGSI_OPCODE_TXD:
       sampler_index = 3;
@@ -3270,9 +3443,9 @@ static void translate_tex(struct dump_ctx *ctx,
       case TGSI_TEXTURE_1D_ARRAY:
       case TGSI_TEXTURE_SHADOW1D_ARRAY:
          if (ctx->cfg->use_gles)
-            strbuf_appendf(&bias_buf, ", vec2(%s.x, 0), vec2(%s.x, 0)", srcs[1], srcs[2]);
+            strbuf_appendf(bias_buf, ", vec2(%s.x, 0), vec2(%s.x, 0)", srcs[1], srcs[2]);
          else
-            strbuf_appendf(&bias_buf, ", %s.x, %s.x", srcs[1], srcs[2]);
+            strbuf_appendf(bias_buf, ", %s.x, %s.x", srcs[1], srcs[2]);
          break;
       case TGSI_TEXTURE_2D:
       case TGSI_TEXTURE_SHADOW2D:
@@ -3280,16 +3453,16 @@ static void translate_tex(struct dump_ctx *ctx,
       case TGSI_TEXTURE_SHADOW2D_ARRAY:
       case TGSI_TEXTURE_RECT:
       case TGSI_TEXTURE_SHADOWRECT:
-         strbuf_appendf(&bias_buf, ", %s.xy, %s.xy", srcs[1], srcs[2]);
+         strbuf_appendf(bias_buf, ", %s.xy, %s.xy", srcs[1], srcs[2]);
          break;
       case TGSI_TEXTURE_3D:
       case TGSI_TEXTURE_CUBE:
       case TGSI_TEXTURE_SHADOWCUBE:
       case TGSI_TEXTURE_CUBE_ARRAY:
-         strbuf_appendf(&bias_buf, ", %s.xyz, %s.xyz", srcs[1], srcs[2]);
+         strbuf_appendf(bias_buf, ", %s.xyz, %s.xyz", srcs[1], srcs[2]);
          break;
       default:
-         strbuf_appendf(&bias_buf, ", %s, %s", srcs[1], srcs[2]);
+         strbuf_appendf(bias_buf, ", %s, %s", srcs[1], srcs[2]);
          break;
       }
       break;
@@ -3307,11 +3480,11 @@ static void translate_tex(struct dump_ctx *ctx,
       if (is_shad) {
          if (inst->Texture.Texture == TGSI_TEXTURE_SHADOWCUBE ||
              inst->Texture.Texture == TGSI_TEXTURE_SHADOW2D_ARRAY)
-            strbuf_appendf(&bias_buf, ", %s.w", srcs[0]);
+            strbuf_appendf(bias_buf, ", %s.w", srcs[0]);
          else if (inst->Texture.Texture == TGSI_TEXTURE_SHADOWCUBE_ARRAY)
-            strbuf_appendf(&bias_buf, ", %s.x", srcs[1]);
+            strbuf_appendf(bias_buf, ", %s.x", srcs[1]);
          else
-            strbuf_appendf(&bias_buf, ", %s.z", srcs[0]);
+            strbuf_appendf(bias_buf, ", %s.z", srcs[0]);
       } else if (sinfo->tg4_has_component) {
          if (inst->Texture.NumOffsets == 0) {
             if (inst->Texture.Texture == TGSI_TEXTURE_2D ||
@@ -3319,12 +3492,12 @@ static void translate_tex(struct dump_ctx *ctx,
                 inst->Texture.Texture == TGSI_TEXTURE_CUBE ||
                 inst->Texture.Texture == TGSI_TEXTURE_2D_ARRAY ||
                 inst->Texture.Texture == TGSI_TEXTURE_CUBE_ARRAY)
-               strbuf_appendf(&bias_buf, ", int(%s)", srcs[1]);
+               strbuf_appendf(bias_buf, ", int(%s)", srcs[1]);
          } else if (inst->Texture.NumOffsets) {
             if (inst->Texture.Texture == TGSI_TEXTURE_2D ||
                 inst->Texture.Texture == TGSI_TEXTURE_RECT ||
                 inst->Texture.Texture == TGSI_TEXTURE_2D_ARRAY)
-               strbuf_appendf(&bias_buf, ", int(%s)", srcs[1]);
+               strbuf_appendf(bias_buf, ", int(%s)", srcs[1]);
          }
       }
       break;
@@ -3337,12 +3510,12 @@ static void translate_tex(struct dump_ctx *ctx,
       if (unlikely((unsigned) inst->TexOffsets[0].Index >= MAX_IMMEDIATE)) {
          virgl_error("Immediate exceeded, max is %u\n", MAX_IMMEDIATE);
          set_buf_error(&ctx->glsl_strbufs);
-         goto cleanup;
+         return;
       }
 
-      if (!fill_offset_buffer(ctx, inst, &offset_buf, &ctx->require_dummy_value)) {
+      if (!fill_offset_buffer(ctx, inst, offset_buf, &ctx->require_dummy_value)) {
          set_buf_error(&ctx->glsl_strbufs);
-         goto cleanup;
+         return;
       }
 
       exchange_bias_offset = inst->Instruction.Opcode == TGSI_OPCODE_TXL ||
@@ -3352,8 +3525,8 @@ static void translate_tex(struct dump_ctx *ctx,
 
    }
 
-   bool has_bias = strbuf_get_len (&bias_buf) != 0;
-   bool has_offset = strbuf_get_len (&offset_buf) != 0;
+   bool has_bias = strbuf_get_len(bias_buf) != 0;
+   bool has_offset = strbuf_get_len(offset_buf) != 0;
    // EXT_texture_shadow_lod defines a few more functions handling bias
    if (has_bias &&
        (inst->Texture.Texture == TGSI_TEXTURE_SHADOW2D_ARRAY ||
@@ -3370,8 +3543,8 @@ static void translate_tex(struct dump_ctx *ctx,
    char buf[255];
    const char *new_srcs[4] = { buf, srcs[1], srcs[2], srcs[3] };
    const char *tex_ext = get_tex_inst_ext(inst);
-   const char *bias = exchange_bias_offset ? offset_buf.buf : bias_buf.buf;
-   const char *offset = exchange_bias_offset ? bias_buf.buf : offset_buf.buf;
+   const char *bias = exchange_bias_offset ? offset_buf->buf : bias_buf->buf;
+   const char *offset = exchange_bias_offset ? bias_buf->buf : offset_buf->buf;
 
    /* We have to unnormalize the coordinate for all but the texel fetch instruction */
    if (inst->Instruction.Opcode != TGSI_OPCODE_TXF &&
@@ -3577,10 +3750,6 @@ static void translate_tex(struct dump_ctx *ctx,
                    offset, bias, dinfo->dst_override_no_wm[0] ? "" : writemask);
       }
    }
-
-cleanup:
-   strbuf_free(&offset_buf);
-   strbuf_free(&bias_buf);
 }
 
 static void
@@ -6263,8 +6432,8 @@ static void emit_header(const struct dump_ctx *ctx, struct vrend_glsl_strbufs *g
       if (ctx->shader_req_bits & SHADER_REQ_SHADER_NOPERSPECTIVE_INTERPOLATION)
          emit_ext(glsl_strbufs, "NV_shader_noperspective_interpolation", "require");
 
-      emit_hdr(glsl_strbufs, "precision highp float;\n");
-      emit_hdr(glsl_strbufs, "precision highp int;\n");
+      emit_ver_ext(glsl_strbufs, "precision highp float;\n");
+      emit_ver_ext(glsl_strbufs, "precision highp int;\n");
    } else {
       if (ctx->prog_type == TGSI_PROCESSOR_COMPUTE) {
          emit_ver_ext(glsl_strbufs, "#version 330\n");
@@ -6304,7 +6473,7 @@ static void emit_header(const struct dump_ctx *ctx, struct vrend_glsl_strbufs *g
       if (ctx->prog_type == TGSI_PROCESSOR_FRAGMENT && fs_emit_layout(ctx))
          emit_ext(glsl_strbufs, "ARB_fragment_coord_conventions", "require");
 
-      if (ctx->ubo_used_mask)
+      if (ctx->ubo_used_mask || (ctx->num_consts && ctx->cfg->use_const_ubo))
          emit_ext(glsl_strbufs, "ARB_uniform_buffer_object", "require");
 
       if (ctx->num_cull_dist_prop || ctx->key->num_in_cull || ctx->key->num_out_cull)
@@ -6673,7 +6842,11 @@ static int emit_ios_common(const struct dump_ctx *ctx,
    }
    if (ctx->num_consts) {
       const char *cname = tgsi_proc_to_prefix(ctx->prog_type);
-      emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
+      if (ctx->cfg->use_const_ubo)
+         emit_hdrf(glsl_strbufs, "layout (std140) uniform %sconstbuf { uvec4 %sconst0[%d]; };\n",
+                   cname, cname, ctx->num_consts);
+      else
+         emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
    }
 
    if (ctx->ubo_used_mask) {
@@ -7934,16 +8107,18 @@ static void fill_sinfo(const struct dump_ctx *ctx, struct vrend_shader_info *sin
 
 static bool allocate_strbuffers(struct vrend_glsl_strbufs* glsl_strbufs)
 {
-   if (!strbuf_alloc(&glsl_strbufs->glsl_main, 4096))
+   /* the variants of a shader come one after the other, so the previous
+    * output is a good guess of the size of this one */
+   if (!strbuf_alloc(&glsl_strbufs->glsl_main, MAX2(translation_scratch.glsl_main_size, 4096)))
       return false;
 
    if (strbuf_get_error(&glsl_strbufs->glsl_main))
       return false;
 
-   if (!strbuf_alloc(&glsl_strbufs->glsl_hdr, 1024))
+   if (!strbuf_alloc(&glsl_strbufs->glsl_hdr, MAX2(translation_scratch.glsl_hdr_size, 1024)))
       return false;
 
-   if (!strbuf_alloc(&glsl_strbufs->glsl_ver_ext, 1024))
+   if (!strbuf_alloc(&glsl_strbufs->glsl_ver_ext, MAX2(translation_scratch.glsl_ver_ext_size, 1024)))
       return false;
 
    return true;
@@ -7952,7 +8127,14 @@ static bool allocate_strbuffers(struct vrend_glsl_strbufs* glsl_strbufs)
 static void set_strbuffers(const struct vrend_glsl_strbufs* glsl_strbufs,
                            struct vrend_strarray *shader)
 {
-   strarray_addstrbuf(shader, &glsl_strbufs->glsl_ver_ext);
+   translation_scratch.glsl_main_size = glsl_strbufs->glsl_main.size + 1;
+   translation_scratch.glsl_hdr_size = glsl_strbufs->glsl_hdr.size + 1;
+   translation_scratch.glsl_ver_ext_size = glsl_strbufs->glsl_ver_ext.size + 1;
+
+   struct vrend_strbuf ver_ext = glsl_strbufs->glsl_ver_ext;
+   shader_preamble_share(&ver_ext);
+
+   strarray_addstrbuf(shader, &ver_ext);
    strarray_addstrbuf(shader, &glsl_strbufs->glsl_hdr);
    strarray_addstrbuf(shader, &glsl_strbufs->glsl_main);
 }
@@ -8077,31 +8259,93 @@ bool vrend_shader_query_separable_program(const struct tgsi_token *tokens,
                              (ctx.max_generic_out_sid + ctx.max_patch_out_sid < MAX_VARYING) &&
                              (ctx.max_patch_in_sid < ctx.cfg->max_shader_patch_varyings) &&
                              (ctx.max_patch_out_sid < ctx.cfg->max_shader_patch_varyings);
-   return ctx.separable_program && supports_separable;
+   return (ctx.separable_program || cfg->use_separable_programs) && supports_separable;
+}
+
+struct vrend_shader_analysis {
+   struct tgsi_processor processor;
+   struct tgsi_shader_info info;
+
+   /* gathered by the first pass */
+   uint32_t fog_input_mask;
+   uint32_t fog_output_mask;
+   uint32_t ssbo_first_binding;
+   uint32_t ssbo_integer_mask;
+   bool integer_memory;
+   int fs_uses_clipdist_input;
+};
+
+static bool analyze_shader(const struct tgsi_token *tokens,
+                           struct vrend_shader_analysis *analysis)
+{
+   struct dump_ctx ctx;
+
+   memset(&ctx, 0, sizeof(struct dump_ctx));
+
+   /* First pass to deal with edge cases. */
+   ctx.iter.iterate_declaration = iter_decls;
+   ctx.iter.iterate_instruction = analyze_instruction;
+   ctx.ssbo_first_binding = UINT32_MAX;
+   if (!tgsi_iterate_shader(tokens, &ctx.iter))
+      return false;
+
+   if (!tgsi_scan_shader(tokens, &analysis->info))
+      return false;
+
+   analysis->processor = ctx.iter.processor;
+   analysis->fog_input_mask = ctx.fog_input_mask;
+   analysis->fog_output_mask = ctx.fog_output_mask;
+   analysis->ssbo_first_binding = ctx.ssbo_first_binding;
+   analysis->ssbo_integer_mask = ctx.ssbo_integer_mask;
+   analysis->integer_memory = ctx.integer_memory;
+   analysis->fs_uses_clipdist_input = ctx.fs_uses_clipdist_input;
+   return true;
+}
+
+struct vrend_shader_analysis *vrend_shader_analyze(const struct tgsi_token *tokens)
+{
+   struct vrend_shader_analysis *analysis = malloc(sizeof(*analysis));
+   if (!analysis)
+      return NULL;
+
+   if (!analyze_shader(tokens, analysis)) {
+      free(analysis);
+      return NULL;
+   }
+   return analysis;
 }
 
 bool vrend_convert_shader(const struct vrend_context *rctx,
                           const struct vrend_shader_cfg *cfg,
                           const struct tgsi_token *tokens,
+                          const struct vrend_shader_analysis *analysis,
                           uint32_t req_local_mem,
                           const struct vrend_shader_key *key,
                           struct vrend_shader_info *sinfo,
                           struct vrend_variable_shader_info *var_sinfo,
                           struct vrend_strarray *shader)
 {
+   struct vrend_shader_analysis local_analysis;
    struct dump_ctx ctx;
    bool bret;
 
-   memset(&ctx, 0, sizeof(struct dump_ctx));
-   ctx.cfg = cfg;
+   if (!analysis) {
+      if (!analyze_shader(tokens, &local_analysis))
+         return false;
+      analysis = &local_analysis;
+   }
 
-   /* First pass to deal with edge cases. */
-   ctx.iter.iterate_declaration = iter_decls;
-   ctx.iter.iterate_instruction = analyze_instruction;
-   ctx.ssbo_first_binding = UINT32_MAX;
-   bret = tgsi_iterate_shader(tokens, &ctx.iter);
-   if (bret == false)
+   memset(&ctx, 0, sizeof(struct dump_ctx));
+   if (!translation_scratch_acquire(&ctx))
       return false;
+   ctx.cfg = cfg;
+   ctx.iter.processor = analysis->processor;
+   ctx.fog_input_mask = analysis->fog_input_mask;
+   ctx.fog_output_mask = analysis->fog_output_mask;
+   ctx.ssbo_first_binding = analysis->ssbo_first_binding;
+   ctx.ssbo_integer_mask = analysis->ssbo_integer_mask;
+   ctx.integer_memory = analysis->integer_memory;
+   ctx.fs_uses_clipdist_input = analysis->fs_uses_clipdist_input;
 
    ctx.is_last_vertex_stage =
          (ctx.iter.processor.Processor == TGSI_PROCESSOR_GEOMETRY) ||
@@ -8134,11 +8378,16 @@ bool vrend_convert_shader(const struct vrend_context *rctx,
    ctx.has_sample_input = false;
    ctx.req_local_mem = req_local_mem;
    ctx.guest_sent_io_arrays = false;
+   /* The guest didn't ask for a separable program, but the stage can be one */
+   if (cfg->use_separable_programs && sinfo->separable_program) {
+      ctx.separable_program = true;
+      ctx.shader_req_bits |= SHADER_REQ_SEPERATE_SHADER_OBJECTS;
+      ctx.shader_req_bits |= SHADER_REQ_EXPLICIT_ATTRIB_LOCATION;
+   }
    ctx.generic_ios.match.outputs_expected_mask = key->out_generic_expected_mask;
    ctx.texcoord_ios.match.outputs_expected_mask = key->out_texcoord_expected_mask;
 
-   if (!tgsi_scan_shader(tokens, &ctx.info))
-      goto fail;
+   ctx.info = analysis->info;
 
    /* if we are in core profile mode we should use GLSL 1.40 */
    if (cfg->glsl_version >= 140)
@@ -8194,12 +8443,6 @@ bool vrend_convert_shader(const struct vrend_context *rctx,
       ctx.shader_req_bits |= SHADER_REQ_ARRAYS_OF_ARRAYS;
    }
 
-   for (size_t i = 0; i < ARRAY_SIZE(ctx.src_bufs); ++i)
-      strbuf_free(ctx.src_bufs + i);
-
-   for (size_t i = 0; i < ARRAY_SIZE(ctx.dst_bufs); ++i)
-      strbuf_free(ctx.dst_bufs + i);
-
    if (ctx.prog_type == TGSI_PROCESSOR_FRAGMENT)
       qsort(ctx.outputs, ctx.num_outputs, sizeof(struct vrend_shader_io), compare_sid);
 
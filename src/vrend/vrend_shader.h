@@ -259,6 +259,10 @@ struct vrend_shader_cfg {
    uint32_t has_texture_shadow_lod : 1;
    uint32_t has_vs_layer : 1;
    uint32_t has_vs_viewport_index : 1;
+   /* the constants are declared in a uniform block instead of as uniforms */
+   uint32_t use_const_ubo : 1;
+   /* all stages whose IO can be matched by location are made separable */
+   uint32_t use_separable_programs : 1;
 };
 
 struct vrend_context;
@@ -267,9 +271,19 @@ struct vrend_context;
 #define SHADER_STRING_VER_EXT 0
 #define SHADER_STRING_HDR 1
 
+/* The results of the passes over the tokens that do not depend on the shader
+ * key, gathered once per shader and reused by the translation of each of its
+ * variants.  Freed with free().
+ */
+struct vrend_shader_analysis;
+
+struct vrend_shader_analysis *vrend_shader_analyze(const struct tgsi_token *tokens);
+
+/* analysis may be NULL, the tokens are then analyzed for this translation */
 bool vrend_convert_shader(const struct vrend_context *rctx,
                           const struct vrend_shader_cfg *cfg,
                           const struct tgsi_token *tokens,
+                          const struct vrend_shader_analysis *analysis,
                           uint32_t req_local_mem,
                           const struct vrend_shader_key *key,
                           struct vrend_shader_info *sinfo,
@@ -282,6 +296,18 @@ char vrend_shader_samplerreturnconv(enum tgsi_return_type type);
 
 int vrend_shader_lookup_sampler_array(const struct vrend_shader_info *sinfo, int index);
 
+/* frees the scratch buffers the translations of the calling thread keep */
+void vrend_shader_free_scratch(void);
+
+/* The first string of a translation, with the #version, extension and
+ * precision lines, is shared with the other translations that have the same
+ * one.  The strings of translations must be freed with this instead of
+ * strarray_free. */
+void vrend_shader_strings_free(struct vrend_strarray *shader);
+
+/* identifies the text of the shared first string of a translation */
+uint64_t vrend_shader_preamble_hash(const struct vrend_strarray *shader);
+
 bool vrend_shader_create_passthrough_tcs(const struct vrend_context *ctx,
                                          const struct vrend_shader_cfg *cfg,
                                          const struct tgsi_token *vs_info,
@@ -0,0 +1,354 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_shader_cache.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "c11/threads.h"
+#include "tgsi/tgsi_parse.h"
+#include "util/hash_table.h"
+#include "util/list.h"
+#include "util/u_debug.h"
+#include "util/u_memory.h"
+#include "virgl_util.h"
+
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+#define SHADER_CACHE_DEFAULT_MAX_SIZE (32 * 1024 * 1024)
+
+struct vrend_shader_cache_entry {
+   struct vrend_shader_cache_key key;
+   /* in least recently used order, only while the entry is in the table */
+   struct list_head head;
+   uint32_t refcount;
+   size_t size;
+
+   struct vrend_shader_info sinfo;
+   struct vrend_variable_shader_info var_sinfo;
+   struct vrend_strarray glsl;
+};
+
+static struct {
+   bool enabled;
+   mtx_t mutex;
+   struct hash_table *table;
+   struct list_head lru;
+   size_t max_size;
+   size_t total_size;
+   uint64_t hits;
+   uint64_t misses;
+} shader_cache;
+
+static uint32_t shader_cache_key_hash(const void *key)
+{
+   const struct vrend_shader_cache_key *cache_key = key;
+   return cache_key->hash;
+}
+
+static bool shader_cache_key_equal(const void *a, const void *b)
+{
+   const struct vrend_shader_cache_key *ka = a, *kb = b;
+   return ka->size == kb->size && !memcmp(ka->data, kb->data, ka->size);
+}
+
+bool vrend_shader_cache_init(void)
+{
+   long max_size = debug_get_num_option("VREND_SHADER_CACHE_MAX_SIZE",
+                                        SHADER_CACHE_DEFAULT_MAX_SIZE);
+   if (max_size <= 0)
+      return false;
+
+   shader_cache.table = _mesa_hash_table_create(NULL, shader_cache_key_hash,
+                                                shader_cache_key_equal);
+   if (!shader_cache.table)
+      return false;
+
+   mtx_init(&shader_cache.mutex, mtx_plain);
+   list_inithead(&shader_cache.lru);
+   shader_cache.max_size = max_size;
+   shader_cache.total_size = 0;
+   shader_cache.enabled = true;
+   return true;
+}
+
+static void shader_info_free_arrays(struct vrend_shader_info *sinfo)
+{
+   if (sinfo->so_names) {
+      for (uint32_t i = 0; i < sinfo->so_info.num_outputs; i++)
+         free(sinfo->so_names[i]);
+      free(sinfo->so_names);
+   }
+   free(sinfo->sampler_arrays);
+   free(sinfo->image_arrays);
+   sinfo->so_names = NULL;
+   sinfo->sampler_arrays = NULL;
+   sinfo->image_arrays = NULL;
+}
+
+/* Copy everything the translation produces, so_info is an input and the
+ * caller is expected to have it set already. */
+static bool shader_info_copy(struct vrend_shader_info *dst, const struct vrend_shader_info *src)
+{
+   struct vrend_shader_info tmp = *src;
+
+   tmp.so_info = dst->so_info;
+   tmp.so_names = NULL;
+   tmp.sampler_arrays = NULL;
+   tmp.image_arrays = NULL;
+
+   if (src->so_names && src->so_info.num_outputs) {
+      tmp.so_names = calloc(src->so_info.num_outputs, sizeof(char *));
+      if (!tmp.so_names)
+         goto fail;
+      for (uint32_t i = 0; i < src->so_info.num_outputs; i++) {
+         if (!src->so_names[i])
+            continue;
+         tmp.so_names[i] = strdup(src->so_names[i]);
+         if (!tmp.so_names[i])
+            goto fail;
+      }
+   }
+
+   if (src->num_sampler_arrays) {
+      tmp.sampler_arrays = malloc(src->num_sampler_arrays * sizeof(struct vrend_array));
+      if (!tmp.sampler_arrays)
+         goto fail;
+      memcpy(tmp.sampler_arrays, src->sampler_arrays,
+             src->num_sampler_arrays * sizeof(struct vrend_array));
+   }
+
+   if (src->num_image_arrays) {
+      tmp.image_arrays = malloc(src->num_image_arrays * sizeof(struct vrend_array));
+      if (!tmp.image_arrays)
+         goto fail;
+      memcpy(tmp.image_arrays, src->image_arrays,
+             src->num_image_arrays * sizeof(struct vrend_array));
+   }
+
+   shader_info_free_arrays(dst);
+   *dst = tmp;
+   return true;
+
+fail:
+   shader_info_free_arrays(&tmp);
+   return false;
+}
+
+static void shader_cache_entry_destroy(struct vrend_shader_cache_entry *entry)
+{
+   shader_info_free_arrays(&entry->sinfo);
+   vrend_shader_strings_free(&entry->glsl);
+   free(entry->key.data);
+   free(entry);
+}
+
+static void shader_cache_entry_unref_locked(struct vrend_shader_cache_entry *entry)
+{
+   assert(entry->refcount);
+   if (--entry->refcount == 0)
+      shader_cache_entry_destroy(entry);
+}
+
+static void shader_cache_evict_locked(struct vrend_shader_cache_entry *entry)
+{
+   struct hash_entry *he = _mesa_hash_table_search_pre_hashed(shader_cache.table,
+                                                              entry->key.hash, &entry->key);
+   if (he)
+      _mesa_hash_table_remove(shader_cache.table, he);
+   list_del(&entry->head);
+   shader_cache.total_size -= entry->size;
+   /* shaders still using the entry keep it alive */
+   shader_cache_entry_unref_locked(entry);
+}
+
+void vrend_shader_cache_fini(void)
+{
+   if (!shader_cache.enabled)
+      return;
+
+   mtx_lock(&shader_cache.mutex);
+   list_for_each_entry_safe(struct vrend_shader_cache_entry, entry, &shader_cache.lru, head)
+      shader_cache_evict_locked(entry);
+   _mesa_hash_table_destroy(shader_cache.table, NULL);
+   shader_cache.table = NULL;
+   mtx_unlock(&shader_cache.mutex);
+
+   virgl_debug("shader cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+               shader_cache.hits, shader_cache.misses);
+
+   mtx_destroy(&shader_cache.mutex);
+   shader_cache.enabled = false;
+   shader_cache.hits = shader_cache.misses = 0;
+}
+
+bool vrend_shader_cache_key_init(struct vrend_shader_cache_key *cache_key,
+                                 const struct vrend_shader_cfg *cfg,
+                                 const struct tgsi_token *tokens,
+                                 uint32_t req_local_mem,
+                                 const struct vrend_shader_key *key,
+                                 const struct vrend_shader_info *sinfo)
+{
+   const struct pipe_stream_output_info *so_info = &sinfo->so_info;
+   size_t tokens_size = tgsi_num_tokens(tokens) * sizeof(struct tgsi_token);
+   uint32_t so_header[1 + PIPE_MAX_SO_BUFFERS];
+   uint8_t *ptr;
+
+   memset(cache_key, 0, sizeof(*cache_key));
+   if (!shader_cache.enabled)
+      return false;
+
+   /* The stream output info is not fully initialized by the decoder, so
+    * only the fields that are set go into the key. */
+   so_header[0] = so_info->num_outputs;
+   memcpy(&so_header[1], so_info->stride, sizeof(so_info->stride));
+
+   cache_key->size = sizeof(*cfg) + sizeof(*key) + sizeof(req_local_mem) +
+                     sizeof(sinfo->invariant_outputs) + sizeof(sinfo->output_arrays) +
+                     sizeof(sinfo->fs_output_layout) + sizeof(so_header) +
+                     so_info->num_outputs * sizeof(uint32_t[7]) + tokens_size;
+   cache_key->data = malloc(cache_key->size);
+   if (!cache_key->data)
+      return false;
+
+#define APPEND(data, size) do { memcpy(ptr, data, size); ptr += size; } while (0)
+   ptr = cache_key->data;
+   APPEND(cfg, sizeof(*cfg));
+   APPEND(key, sizeof(*key));
+   APPEND(&req_local_mem, sizeof(req_local_mem));
+   /* vrend_convert_shader accumulates into these */
+   APPEND(sinfo->invariant_outputs, sizeof(sinfo->invariant_outputs));
+   APPEND(&sinfo->output_arrays, sizeof(sinfo->output_arrays));
+   APPEND(sinfo->fs_output_layout, sizeof(sinfo->fs_output_layout));
+   APPEND(so_header, sizeof(so_header));
+   for (unsigned i = 0; i < so_info->num_outputs; i++) {
+      const struct pipe_stream_output *out = &so_info->output[i];
+      uint32_t so_out[7] = { out->register_index, out->start_component, out->num_components,
+                             out->output_buffer, out->dst_offset, out->stream, out->need_temp };
+      APPEND(so_out, sizeof(so_out));
+   }
+   APPEND(tokens, tokens_size);
+#undef APPEND
+
+   cache_key->hash = (uint32_t)XXH64(cache_key->data, cache_key->size, 0);
+   return true;
+}
+
+void vrend_shader_cache_key_fini(struct vrend_shader_cache_key *cache_key)
+{
+   free(cache_key->data);
+   cache_key->data = NULL;
+}
+
+struct vrend_shader_cache_entry *
+vrend_shader_cache_lookup(const struct vrend_shader_cache_key *cache_key)
+{
+   struct vrend_shader_cache_entry *entry = NULL;
+
+   if (!shader_cache.enabled || !cache_key->data)
+      return NULL;
+
+   mtx_lock(&shader_cache.mutex);
+   struct hash_entry *he = _mesa_hash_table_search_pre_hashed(shader_cache.table,
+                                                              cache_key->hash, cache_key);
+   if (he) {
+      entry = he->data;
+      entry->refcount++;
+      list_del(&entry->head);
+      list_addtail(&entry->head, &shader_cache.lru);
+      shader_cache.hits++;
+   } else {
+      shader_cache.misses++;
+   }
+   mtx_unlock(&shader_cache.mutex);
+
+   return entry;
+}
+
+struct vrend_shader_cache_entry *
+vrend_shader_cache_insert(struct vrend_shader_cache_key *cache_key,
+                          const struct vrend_shader_info *sinfo,
+                          const struct vrend_variable_shader_info *var_sinfo,
+                          struct vrend_strarray *glsl)
+{
+   struct vrend_shader_cache_entry *entry;
+
+   if (!shader_cache.enabled || !cache_key->data)
+      return NULL;
+
+   entry = CALLOC_STRUCT(vrend_shader_cache_entry);
+   if (!entry)
+      return NULL;
+
+   entry->sinfo.so_info = sinfo->so_info;
+   if (!shader_info_copy(&entry->sinfo, sinfo)) {
+      free(entry);
+      return NULL;
+   }
+   entry->var_sinfo = *var_sinfo;
+
+   entry->size = sizeof(*entry) + cache_key->size;
+   /* the shared preamble is not accounted to any entry */
+   for (int i = 0; i < glsl->num_strings; i++) {
+      if (!glsl->strings[i].external_buffer)
+         entry->size += glsl->strings[i].alloc_size;
+   }
+   entry->size += sizeof(char *) * sinfo->so_info.num_outputs +
+                  sizeof(struct vrend_array) * (sinfo->num_sampler_arrays + sinfo->num_image_arrays);
+
+   if (entry->size > shader_cache.max_size) {
+      shader_info_free_arrays(&entry->sinfo);
+      free(entry);
+      return NULL;
+   }
+
+   entry->key = *cache_key;
+   entry->glsl = *glsl;
+   cache_key->data = NULL;
+
+   /* one reference for the table and one for the caller */
+   entry->refcount = 2;
+
+   mtx_lock(&shader_cache.mutex);
+   struct hash_entry *he = _mesa_hash_table_search_pre_hashed(shader_cache.table,
+                                                              entry->key.hash, &entry->key);
+   if (he)
+      shader_cache_evict_locked(he->data);
+
+   while (shader_cache.total_size + entry->size > shader_cache.max_size &&
+          !list_is_empty(&shader_cache.lru)) {
+      shader_cache_evict_locked(list_first_entry(&shader_cache.lru,
+                                                 struct vrend_shader_cache_entry, head));
+   }
+
+   _mesa_hash_table_insert_pre_hashed(shader_cache.table, entry->key.hash, &entry->key, entry);
+   list_addtail(&entry->head, &shader_cache.lru);
+   shader_cache.total_size += entry->size;
+   mtx_unlock(&shader_cache.mutex);
+
+   return entry;
+}
+
+bool vrend_shader_cache_entry_apply(const struct vrend_shader_cache_entry *entry,
+                                    struct vrend_shader_info *sinfo,
+                                    struct vrend_variable_shader_info *var_sinfo,
+                                    struct vrend_strarray *glsl)
+{
+   if (!shader_info_copy(sinfo, &entry->sinfo))
+      return false;
+
+   *var_sinfo = entry->var_sinfo;
+   *glsl = entry->glsl;
+   return true;
+}
+
+void vrend_shader_cache_entry_unref(struct vrend_shader_cache_entry *entry)
+{
+   mtx_lock(&shader_cache.mutex);
+   shader_cache_entry_unref_locked(entry);
+   mtx_unlock(&shader_cache.mutex);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_SHADER_CACHE_H
+#define VREND_SHADER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vrend_shader.h"
+
+/* Process wide cache of TGSI to GLSL translations.
+ *
+ * A translation only depends on the tokens, the variant key, the shader
+ * config and the parts of the selector's vrend_shader_info that
+ * vrend_convert_shader reads or accumulates into, so all of those make up
+ * the cache key.  Entries are refcounted, shaders keep a reference for as
+ * long as they use the GLSL strings of an entry.
+ *
+ * VREND_SHADER_CACHE_MAX_SIZE bounds the memory held by the cache in bytes,
+ * setting it to 0 disables the cache.
+ */
+
+struct vrend_shader_cache_entry;
+
+struct vrend_shader_cache_key {
+   void *data;
+   size_t size;
+   uint32_t hash;
+};
+
+bool vrend_shader_cache_init(void);
+
+void vrend_shader_cache_fini(void);
+
+bool vrend_shader_cache_key_init(struct vrend_shader_cache_key *cache_key,
+                                 const struct vrend_shader_cfg *cfg,
+                                 const struct tgsi_token *tokens,
+                                 uint32_t req_local_mem,
+                                 const struct vrend_shader_key *key,
+                                 const struct vrend_shader_info *sinfo);
+
+void vrend_shader_cache_key_fini(struct vrend_shader_cache_key *cache_key);
+
+/* Returns a referenced entry or NULL */
+struct vrend_shader_cache_entry *
+vrend_shader_cache_lookup(const struct vrend_shader_cache_key *cache_key);
+
+/* Takes over the key data and the GLSL strings, glsl is left pointing at the
+ * strings owned by the returned entry.  Returns NULL when the entry could
+ * not be added, glsl is left untouched in that case. */
+struct vrend_shader_cache_entry *
+vrend_shader_cache_insert(struct vrend_shader_cache_key *cache_key,
+                          const struct vrend_shader_info *sinfo,
+                          const struct vrend_variable_shader_info *var_sinfo,
+                          struct vrend_strarray *glsl);
+
+/* Restore a translation into sinfo, var_sinfo and glsl.  The GLSL strings
+ * stay owned by the entry. */
+bool vrend_shader_cache_entry_apply(const struct vrend_shader_cache_entry *entry,
+                                    struct vrend_shader_info *sinfo,
+                                    struct vrend_variable_shader_info *var_sinfo,
+                                    struct vrend_strarray *glsl);
+
+void vrend_shader_cache_entry_unref(struct vrend_shader_cache_entry *entry);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_staging_pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "c11/threads.h"
+#include "util/macros.h"
+#include "util/u_math.h"
+#include "virgl_numa.h"
+
+/* 4 KiB up to 64 MiB */
+#define STAGING_MIN_ORDER 12
+#define STAGING_MAX_ORDER 26
+#define STAGING_NUM_CLASSES (STAGING_MAX_ORDER - STAGING_MIN_ORDER + 1)
+#define STAGING_MAX_CACHED 4
+#define STAGING_MAX_CACHED_BYTES (128ull * 1024 * 1024)
+#define STAGING_IDLE_NS (2ull * 1000000000)
+
+/* the size class is stored in front of the data, this keeps the data
+ * aligned for any of the vector kernels that work on it */
+#define STAGING_HEADER_SIZE 64
+#define STAGING_UNPOOLED UINT32_MAX
+
+struct staging_class {
+   /* the most recently released buffer comes last */
+   void *buffers[STAGING_MAX_CACHED];
+   uint64_t released[STAGING_MAX_CACHED];
+   uint32_t num_buffers;
+};
+
+static struct {
+   bool enabled;
+   mtx_t mutex;
+   uint64_t cached_bytes;
+   struct staging_class classes[STAGING_NUM_CLASSES];
+} staging_pool;
+
+static uint64_t staging_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *staging_buffer_create(uint32_t order, uint64_t size)
+{
+   uint8_t *buffer = malloc(STAGING_HEADER_SIZE + size);
+
+   if (!buffer)
+      return NULL;
+
+   /* the pages are only allocated by the first copy into the buffer */
+   virgl_numa_bind_memory(buffer, STAGING_HEADER_SIZE + size);
+
+   memcpy(buffer, &order, sizeof(order));
+   return buffer + STAGING_HEADER_SIZE;
+}
+
+static void staging_buffer_destroy(void *ptr)
+{
+   free((uint8_t *)ptr - STAGING_HEADER_SIZE);
+}
+
+static void staging_pool_release_idle(uint64_t now)
+{
+   for (uint32_t i = 0; i < STAGING_NUM_CLASSES; i++) {
+      struct staging_class *class = &staging_pool.classes[i];
+      uint32_t idle = 0;
+
+      while (idle < class->num_buffers && now - class->released[idle] > STAGING_IDLE_NS) {
+         staging_buffer_destroy(class->buffers[idle]);
+         staging_pool.cached_bytes -= 1ull << (i + STAGING_MIN_ORDER);
+         idle++;
+      }
+
+      if (idle) {
+         class->num_buffers -= idle;
+         memmove(class->buffers, class->buffers + idle, class->num_buffers * sizeof(void *));
+         memmove(class->released, class->released + idle, class->num_buffers * sizeof(uint64_t));
+      }
+   }
+}
+
+void vrend_staging_pool_init(void)
+{
+   if (staging_pool.enabled)
+      return;
+
+   if (mtx_init(&staging_pool.mutex, mtx_plain) != thrd_success)
+      return;
+
+   staging_pool.enabled = true;
+}
+
+void vrend_staging_pool_fini(void)
+{
+   if (!staging_pool.enabled)
+      return;
+
+   for (uint32_t i = 0; i < STAGING_NUM_CLASSES; i++) {
+      struct staging_class *class = &staging_pool.classes[i];
+      for (uint32_t j = 0; j < class->num_buffers; j++)
+         staging_buffer_destroy(class->buffers[j]);
+   }
+
+   mtx_destroy(&staging_pool.mutex);
+   memset(&staging_pool, 0, sizeof(staging_pool));
+}
+
+void *vrend_staging_alloc(uint64_t size)
+{
+   uint32_t order;
+   void *ptr = NULL;
+
+   if (!staging_pool.enabled || size > (1ull << STAGING_MAX_ORDER))
+      return staging_buffer_create(STAGING_UNPOOLED, size);
+
+   order = MAX2(util_logbase2_ceil64(size), STAGING_MIN_ORDER);
+
+   mtx_lock(&staging_pool.mutex);
+   struct staging_class *class = &staging_pool.classes[order - STAGING_MIN_ORDER];
+   if (class->num_buffers) {
+      ptr = class->buffers[--class->num_buffers];
+      staging_pool.cached_bytes -= 1ull << order;
+   }
+   mtx_unlock(&staging_pool.mutex);
+
+   return ptr ? ptr : staging_buffer_create(order, 1ull << order);
+}
+
+void vrend_staging_free(void *ptr)
+{
+   uint32_t order;
+
+   if (!ptr)
+      return;
+
+   memcpy(&order, (uint8_t *)ptr - STAGING_HEADER_SIZE, sizeof(order));
+
+   if (!staging_pool.enabled || order == STAGING_UNPOOLED) {
+      staging_buffer_destroy(ptr);
+      return;
+   }
+
+   uint64_t now = staging_now();
+
+   mtx_lock(&staging_pool.mutex);
+   staging_pool_release_idle(now);
+
+   struct staging_class *class = &staging_pool.classes[order - STAGING_MIN_ORDER];
+   if (class->num_buffers < STAGING_MAX_CACHED &&
+       staging_pool.cached_bytes + (1ull << order) <= STAGING_MAX_CACHED_BYTES) {
+      class->buffers[class->num_buffers] = ptr;
+      class->released[class->num_buffers] = now;
+      class->num_buffers++;
+      staging_pool.cached_bytes += 1ull << order;
+      ptr = NULL;
+   }
+   mtx_unlock(&staging_pool.mutex);
+
+   if (ptr)
+      staging_buffer_destroy(ptr);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_STAGING_POOL_H
+#define VREND_STAGING_POOL_H
+
+#include <stdint.h>
+
+/* Temporary buffers of the transfer and copy paths.
+ *
+ * The buffers are kept in power of two size classes and reused by later
+ * allocations of the same class, buffers that stay unused for a while are
+ * released.  Allocation and release may happen on any thread.  Until
+ * vrend_staging_pool_init is called, and for sizes beyond the largest class,
+ * the buffers are neither pooled nor reused.
+ */
+
+void vrend_staging_pool_init(void);
+
+void vrend_staging_pool_fini(void);
+
+void *vrend_staging_alloc(uint64_t size);
+
+void vrend_staging_free(void *ptr);
+
+#endif
@@ -65,6 +65,15 @@ static inline void strbuf_reset(struct vrend_strbuf *sb)
    sb->size = 0;
 }
 
+/* empties a buffer to use it again, keeping its allocation */
+static inline void strbuf_clear(struct vrend_strbuf *sb)
+{
+   sb->size = 0;
+   sb->error_state = false;
+   if (sb->buf)
+      sb->buf[0] = 0;
+}
+
 
 static inline void strbuf_free(struct vrend_strbuf *sb)
 {
@@ -110,10 +119,12 @@ static inline bool strbuf_grow(struct vrend_strbuf *sb, int len)
          strbuf_set_error(sb);
          return false;
       }
-      /* Reallocate to the larger size of current alloc + min realloc,
-       * or the resulting string size if larger.
+      /* Reallocate to twice the current alloc, at least by min realloc,
+       * or the resulting string size if larger, so that building a long
+       * string does not copy it over and over.
        */
-      size_t new_size = MAX2(sb->size + len + 1, sb->alloc_size + STRBUF_MIN_MALLOC);
+      size_t new_size = MAX3(sb->size + len + 1, sb->alloc_size * 2,
+                             sb->alloc_size + STRBUF_MIN_MALLOC);
       char *new = realloc(sb->buf, new_size);
       if (!new) {
          strbuf_set_error(sb);
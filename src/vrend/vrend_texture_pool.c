@@ -0,0 +1,137 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_texture_pool.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "vrend_gl_state.h"
+
+#define TEXTURE_POOL_MAX_ENTRIES 64
+#define TEXTURE_POOL_IDLE_NS (2ull * 1000000000)
+
+struct texture_pool_entry {
+   struct vrend_texture_pool_key key;
+   GLuint id;
+   uint64_t size;
+   uint64_t released;
+};
+
+static struct {
+   bool enabled;
+   uint64_t max_bytes;
+   uint64_t cached_bytes;
+   /* the most recently released texture comes last */
+   struct texture_pool_entry entries[TEXTURE_POOL_MAX_ENTRIES];
+   uint32_t num_entries;
+} texture_pool;
+
+static uint64_t texture_pool_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void texture_pool_delete(GLuint id)
+{
+   vrend_gl_state_forget_texture(id);
+   glDeleteTextures(1, &id);
+}
+
+static void texture_pool_remove(uint32_t index)
+{
+   texture_pool.cached_bytes -= texture_pool.entries[index].size;
+   texture_pool.num_entries--;
+   memmove(&texture_pool.entries[index], &texture_pool.entries[index + 1],
+           (texture_pool.num_entries - index) * sizeof(struct texture_pool_entry));
+}
+
+static void texture_pool_release_idle(uint64_t now)
+{
+   uint32_t idle = 0;
+
+   while (idle < texture_pool.num_entries &&
+          now - texture_pool.entries[idle].released > TEXTURE_POOL_IDLE_NS)
+      idle++;
+
+   for (uint32_t i = 0; i < idle; i++)
+      texture_pool_delete(texture_pool.entries[i].id);
+   while (idle--)
+      texture_pool_remove(0);
+}
+
+void vrend_texture_pool_init(uint64_t max_bytes)
+{
+   texture_pool.enabled = max_bytes > 0;
+   texture_pool.max_bytes = max_bytes;
+}
+
+void vrend_texture_pool_fini(void)
+{
+   vrend_texture_pool_trim(true);
+   memset(&texture_pool, 0, sizeof(texture_pool));
+}
+
+GLuint vrend_texture_pool_get(const struct vrend_texture_pool_key *key)
+{
+   if (!texture_pool.num_entries)
+      return 0;
+
+   texture_pool_release_idle(texture_pool_now());
+
+   /* the most recently released texture is the most likely to be resident */
+   for (uint32_t i = texture_pool.num_entries; i-- > 0;) {
+      struct texture_pool_entry *entry = &texture_pool.entries[i];
+      if (!memcmp(&entry->key, key, sizeof(*key))) {
+         GLuint id = entry->id;
+         texture_pool_remove(i);
+         return id;
+      }
+   }
+   return 0;
+}
+
+void vrend_texture_pool_put(const struct vrend_texture_pool_key *key,
+                            GLuint id, uint64_t size)
+{
+   struct texture_pool_entry *entry;
+   uint64_t now;
+
+   if (!texture_pool.enabled || size > texture_pool.max_bytes) {
+      texture_pool_delete(id);
+      return;
+   }
+
+   now = texture_pool_now();
+   texture_pool_release_idle(now);
+
+   while (texture_pool.num_entries == TEXTURE_POOL_MAX_ENTRIES ||
+          texture_pool.cached_bytes + size > texture_pool.max_bytes) {
+      texture_pool_delete(texture_pool.entries[0].id);
+      texture_pool_remove(0);
+   }
+
+   entry = &texture_pool.entries[texture_pool.num_entries++];
+   entry->key = *key;
+   entry->id = id;
+   entry->size = size;
+   entry->released = now;
+   texture_pool.cached_bytes += size;
+}
+
+void vrend_texture_pool_trim(bool all)
+{
+   if (!all) {
+      texture_pool_release_idle(texture_pool_now());
+      return;
+   }
+
+   for (uint32_t i = 0; i < texture_pool.num_entries; i++)
+      texture_pool_delete(texture_pool.entries[i].id);
+   texture_pool.num_entries = 0;
+   texture_pool.cached_bytes = 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_TEXTURE_POOL_H
+#define VREND_TEXTURE_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <epoxy/gl.h>
+
+/* Textures with immutable storage of destroyed resources.
+ *
+ * Guests create and destroy transient render targets all the time, so the
+ * textures are kept for a while and handed to new resources that are created
+ * with the same parameters, which saves the driver the allocation.  The pool
+ * is bounded in entries and in bytes, the least recently released textures
+ * are deleted first, and textures that stay unused for a while are deleted.
+ *
+ * The contents of a recycled texture are whatever its previous resource left
+ * there, the caller has to clear them.  All functions must be called with a
+ * GL context current.
+ */
+
+struct vrend_texture_pool_key {
+   GLenum target;
+   GLenum internalformat;
+   uint32_t width;
+   uint32_t height;
+   uint32_t depth;
+   uint32_t array_size;
+   uint32_t levels;
+   uint32_t samples;
+   uint32_t bind;
+};
+
+void vrend_texture_pool_init(uint64_t max_bytes);
+
+void vrend_texture_pool_fini(void);
+
+/* Returns a texture created with the parameters of key, or 0 */
+GLuint vrend_texture_pool_get(const struct vrend_texture_pool_key *key);
+
+/* Keeps the texture for later, or deletes it when the pool is disabled or it
+ * does not fit. */
+void vrend_texture_pool_put(const struct vrend_texture_pool_key *key,
+                            GLuint id, uint64_t size);
+
+/* Deletes the textures that have not been used for a while, or all of them */
+void vrend_texture_pool_trim(bool all);
+
+#endif
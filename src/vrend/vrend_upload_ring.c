@@ -0,0 +1,187 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_upload_ring.h"
+
+#include <string.h>
+
+#include "util/macros.h"
+#include "util/u_debug.h"
+#include "util/u_math.h"
+#include "virgl_util.h"
+#include "vrend_gl_state.h"
+
+#define UPLOAD_RING_DEFAULT_SIZE (16 * 1024 * 1024)
+#define UPLOAD_RING_NUM_SECTIONS 4
+#define UPLOAD_RING_MAX_FENCES 16
+/* enough for the element size of any unpack type */
+#define UPLOAD_RING_ALIGNMENT 64
+
+#define UPLOAD_RING_MAP_FLAGS (GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+
+struct upload_ring_section {
+   GLsync fences[UPLOAD_RING_MAX_FENCES];
+   uint32_t num_fences;
+};
+
+static struct {
+   bool enabled;
+   GLuint id;
+   uint8_t *map;
+   uint32_t section_size;
+   uint32_t current;
+   uint32_t head;
+   /* the number of times the allocation moved on to the next section */
+   uint64_t generation;
+   /* the current context sourced uploads from the ring since the last fence */
+   bool dirty;
+   struct upload_ring_section sections[UPLOAD_RING_NUM_SECTIONS];
+} upload_ring;
+
+static void upload_ring_wait_fence(GLsync fence)
+{
+   GLenum ret;
+
+   do {
+      ret = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+   } while (ret == GL_TIMEOUT_EXPIRED);
+
+   if (ret == GL_WAIT_FAILED)
+      virgl_error("Waiting for upload ring fence failed\n");
+
+   glDeleteSync(fence);
+}
+
+static void upload_ring_wait_section(struct upload_ring_section *section)
+{
+   for (uint32_t i = 0; i < section->num_fences; i++)
+      upload_ring_wait_fence(section->fences[i]);
+   section->num_fences = 0;
+}
+
+bool vrend_upload_ring_init(void)
+{
+   long size = debug_get_num_option("VREND_UPLOAD_RING_SIZE", UPLOAD_RING_DEFAULT_SIZE);
+   uint32_t section_size;
+
+   if (size <= 0)
+      return false;
+
+   section_size = MIN2((uint64_t)size, UINT32_MAX) / UPLOAD_RING_NUM_SECTIONS;
+   section_size &= ~(UPLOAD_RING_ALIGNMENT - 1);
+   if (!section_size)
+      return false;
+
+   glGenBuffers(1, &upload_ring.id);
+   vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_ring.id);
+   glBufferStorage(GL_PIXEL_UNPACK_BUFFER, section_size * UPLOAD_RING_NUM_SECTIONS,
+                   NULL, UPLOAD_RING_MAP_FLAGS);
+   upload_ring.map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                      section_size * UPLOAD_RING_NUM_SECTIONS,
+                                      UPLOAD_RING_MAP_FLAGS);
+   vrend_gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+   if (!upload_ring.map) {
+      virgl_warn("Unable to map the texture upload ring, texture uploads are not streamed\n");
+      vrend_gl_state_forget_buffer(upload_ring.id);
+      glDeleteBuffers(1, &upload_ring.id);
+      memset(&upload_ring, 0, sizeof(upload_ring));
+      return false;
+   }
+
+   upload_ring.section_size = section_size;
+   upload_ring.enabled = true;
+   return true;
+}
+
+void vrend_upload_ring_fini(void)
+{
+   if (!upload_ring.enabled)
+      return;
+
+   for (uint32_t i = 0; i < UPLOAD_RING_NUM_SECTIONS; i++) {
+      struct upload_ring_section *section = &upload_ring.sections[i];
+      for (uint32_t j = 0; j < section->num_fences; j++)
+         glDeleteSync(section->fences[j]);
+   }
+
+   /* deleting the buffer also unmaps it */
+   vrend_gl_state_forget_buffer(upload_ring.id);
+   glDeleteBuffers(1, &upload_ring.id);
+   memset(&upload_ring, 0, sizeof(upload_ring));
+}
+
+void *vrend_upload_ring_alloc(uint64_t size, uint32_t *offset)
+{
+   return vrend_upload_ring_alloc_aligned(size, UPLOAD_RING_ALIGNMENT, offset);
+}
+
+void *vrend_upload_ring_alloc_aligned(uint64_t size, uint32_t alignment, uint32_t *offset)
+{
+   uint32_t section_end;
+   uint32_t head;
+
+   alignment = MAX2(alignment, UPLOAD_RING_ALIGNMENT);
+   if (!upload_ring.enabled || !size || size > upload_ring.section_size)
+      return NULL;
+
+   size = align64(size, UPLOAD_RING_ALIGNMENT);
+   head = (uint32_t)align64(upload_ring.head, alignment);
+
+   section_end = (upload_ring.current + 1) * upload_ring.section_size;
+   if (head + size > section_end) {
+      vrend_upload_ring_flush();
+      upload_ring.current = (upload_ring.current + 1) % UPLOAD_RING_NUM_SECTIONS;
+      upload_ring.generation++;
+      upload_ring_wait_section(&upload_ring.sections[upload_ring.current]);
+      upload_ring.head = upload_ring.current * upload_ring.section_size;
+
+      /* the sections are only aligned to UPLOAD_RING_ALIGNMENT */
+      section_end = upload_ring.head + upload_ring.section_size;
+      head = (uint32_t)align64(upload_ring.head, alignment);
+      if (head + size > section_end)
+         return NULL;
+   }
+
+   *offset = head;
+   upload_ring.head = head + size;
+   upload_ring.dirty = true;
+   return upload_ring.map + *offset;
+}
+
+uint64_t vrend_upload_ring_generation(void)
+{
+   return upload_ring.generation;
+}
+
+bool vrend_upload_ring_is_live(uint64_t generation)
+{
+   return upload_ring.generation - generation < UPLOAD_RING_NUM_SECTIONS;
+}
+
+GLuint vrend_upload_ring_buffer(void)
+{
+   return upload_ring.id;
+}
+
+void vrend_upload_ring_flush(void)
+{
+   struct upload_ring_section *section = &upload_ring.sections[upload_ring.current];
+
+   if (!upload_ring.dirty)
+      return;
+
+   if (section->num_fences == UPLOAD_RING_MAX_FENCES) {
+      upload_ring_wait_fence(section->fences[0]);
+      memmove(section->fences, section->fences + 1,
+              (UPLOAD_RING_MAX_FENCES - 1) * sizeof(section->fences[0]));
+      section->num_fences--;
+   }
+
+   section->fences[section->num_fences++] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   /* the fence may be waited for from another context */
+   glFlush();
+   upload_ring.dirty = false;
+}
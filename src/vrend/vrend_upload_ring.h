@@ -0,0 +1,58 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_UPLOAD_RING_H
+#define VREND_UPLOAD_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <epoxy/gl.h>
+
+/* Streaming buffer for texture uploads.
+ *
+ * A persistently and coherently mapped buffer that transfer data is gathered
+ * into, so that uploads can be sourced from GL_PIXEL_UNPACK_BUFFER and the
+ * driver does not need to copy the data again before returning.
+ *
+ * The buffer is split in sections that are reused round robin.  Fences are
+ * inserted when the allocation moves on to the next section and when the
+ * current GL context changes, and a section is only handed out again once
+ * all fences in it signalled.
+ *
+ * The ring also streams the constants of the shaders when they are emitted as
+ * a uniform block, bound with glBindBufferRange.
+ *
+ * VREND_UPLOAD_RING_SIZE sets the size of the buffer in bytes, setting it to
+ * 0 disables the ring.
+ */
+
+bool vrend_upload_ring_init(void);
+
+void vrend_upload_ring_fini(void);
+
+/* Returns a pointer to size bytes of mapped memory and their offset in the
+ * ring buffer, or NULL when the request can not be served by the ring. */
+void *vrend_upload_ring_alloc(uint64_t size, uint32_t *offset);
+
+/* Same as vrend_upload_ring_alloc, with the offset aligned to alignment, which
+ * must be a power of two. */
+void *vrend_upload_ring_alloc_aligned(uint64_t size, uint32_t alignment, uint32_t *offset);
+
+/* The generation counts the moves of the allocation to the next section.  The
+ * data written to memory handed out in a generation stays there until the
+ * allocation comes back to its section, which vrend_upload_ring_is_live
+ * tells. */
+uint64_t vrend_upload_ring_generation(void);
+
+bool vrend_upload_ring_is_live(uint64_t generation);
+
+GLuint vrend_upload_ring_buffer(void);
+
+/* Fence the uploads the current context sourced from the ring, to be called
+ * before another GL context is made current. */
+void vrend_upload_ring_flush(void);
+
+#endif
@@ -66,11 +66,17 @@
  */
 
 
+#include "c11/threads.h"
+#include "util/u_debug.h"
+#include "util/u_thread.h"
+
 #include "virgl_video.h"
 #include "virgl_video_hw.h"
 
 #include "vrend_debug.h"
+#include "vrend_gl_state.h"
 #include "vrend_winsys.h"
+#include "vrend_program_cache.h"
 #include "vrend_renderer.h"
 #include "vrend_video.h"
 
@@ -96,8 +102,45 @@ struct vrend_video_plane {
     GLuint texture;         /* texture for temporary use */
     GLuint framebuffer;     /* framebuffer for temporary use */
     EGLImageKHR egl_image;  /* egl image for temporary use */
+    bool zero_copy;         /* the resource samples the VA surface directly */
 };
 
+/* with VREND_VIDEO_ZERO_COPY, decoded frames are not copied to the resources */
+static bool video_zero_copy;
+
+/*
+ * A decoded frame that is not complete yet.  The job thread waits for the VA
+ * surface, and the frame is completed, which copies it to the resources, when
+ * a fence submitted after it retires, or when its buffer is used again.
+ */
+struct vrend_video_job {
+    struct list_head head;
+    struct vrend_video_codec *cdc;
+    struct vrend_video_buffer *buf;
+    uint64_t seqno;
+    bool synced;
+    int result;
+};
+
+static struct {
+    bool enabled;
+    /* end_frame waits for the oldest job once this many are in flight */
+    unsigned max_jobs;
+
+    thrd_t thread;
+    mtx_t mutex;
+    cnd_t cond;
+    bool stop;
+
+    /* vrend_video_job in submission order */
+    struct list_head jobs;
+    unsigned num_jobs;
+    uint64_t next_seqno;
+
+    /* the framebuffers of the planes belong to another GL context */
+    bool completing;
+} video_jobs;
+
 struct vrend_video_buffer {
     struct virgl_video_buffer *buffer;
 
@@ -146,6 +189,58 @@ static struct vrend_video_buffer *get_video_buffer(
 }
 
 
+static EGLImageKHR create_plane_image(const struct virgl_video_dma_buf *dmabuf,
+                                     unsigned i, uint32_t width, uint32_t height)
+{
+    EGLint img_attrs[16] = {
+        EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[i].drm_format,
+        EGL_WIDTH,                      width,
+        EGL_HEIGHT,                     height,
+        EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[i].fd,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[i].offset,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[i].pitch,
+        EGL_NONE
+    };
+
+    return eglCreateImageKHR(eglGetCurrentDisplay(), EGL_NO_CONTEXT,
+                             EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
+}
+
+/*
+ * The VA surface stays the same for the lifetime of the video buffer, so the
+ * texture of a plane resource can be bound to it once, and the frames decoded
+ * later are sampled or scanned out from the surface without a copy.  This
+ * needs a mutable 2D texture that is not larger than the surface plane, the
+ * image is cropped to the size of the resource.
+ */
+static bool bind_plane_to_dmabuf(struct vrend_video_plane *plane,
+                                 struct vrend_resource *res,
+                                 const struct virgl_video_dma_buf *dmabuf,
+                                 unsigned i)
+{
+    if (!video_zero_copy || res->target != GL_TEXTURE_2D ||
+        has_bit(res->storage_bits, VREND_STORAGE_GL_IMMUTABLE) ||
+        res->base.width0 > dmabuf->width / (i + 1) ||
+        res->base.height0 > dmabuf->height / (i + 1))
+        return false;
+
+    plane->egl_image = create_plane_image(dmabuf, i, res->base.width0,
+                                          res->base.height0);
+    if (EGL_NO_IMAGE_KHR == plane->egl_image)
+        return false;
+
+    vrend_gl_bind_texture(GL_TEXTURE_2D, res->gl_id);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)(plane->egl_image));
+    if (glGetError() != GL_NO_ERROR) {
+        eglDestroyImageKHR(eglGetCurrentDisplay(), plane->egl_image);
+        plane->egl_image = EGL_NO_IMAGE_KHR;
+        return false;
+    }
+
+    plane->zero_copy = true;
+    return true;
+}
+
 static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
                                        const struct virgl_video_dma_buf *dmabuf)
 {
@@ -158,12 +253,23 @@ static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
         struct vrend_video_plane *plane = &buf->planes[i];
         struct vrend_resource *res;
 
+        if (plane->zero_copy)
+            continue;
+
         res = vrend_renderer_ctx_res_lookup(buf->ctx->ctx, plane->res_handle);
         if (!res) {
             virgl_error("%s: res %d not found\n", __func__, plane->res_handle);
             continue;
         }
 
+        if (EGL_NO_IMAGE_KHR == plane->egl_image &&
+            bind_plane_to_dmabuf(plane, res, dmabuf, i))
+            continue;
+
+        GLuint framebuffer = plane->framebuffer;
+        if (video_jobs.completing)
+            glGenFramebuffers(1, &framebuffer);
+
         /* dmabuf -> eglimage */
         if (EGL_NO_IMAGE_KHR == plane->egl_image) {
             EGLint img_attrs[16] = {
@@ -186,22 +292,27 @@ static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
         }
 
         /* eglimage -> texture */
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, plane->texture);
         glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
                                     (GLeglImageOES)(plane->egl_image));
 
         /* texture -> framebuffer */
-        glBindFramebuffer(GL_READ_FRAMEBUFFER, plane->framebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
         glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                                GL_TEXTURE_2D, plane->texture, 0);
 
         /* framebuffer -> vrend_video_buffer.planes[i] */
-        glBindTexture(GL_TEXTURE_2D, res->gl_id);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, res->gl_id);
         glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0,
                             res->base.width0, res->base.height0);
+
+        if (framebuffer != plane->framebuffer) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+            glDeleteFramebuffers(1, &framebuffer);
+        }
     }
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+    vrend_gl_bind_texture(GL_TEXTURE_2D, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     return 0;
@@ -247,7 +358,7 @@ static int sync_video_buffer_to_dmabuf(struct vrend_video_buffer *buf,
         }
 
         /* eglimage -> texture */
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, plane->texture);
         glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
                                     (GLeglImageOES)(plane->egl_image));
 
@@ -257,13 +368,13 @@ static int sync_video_buffer_to_dmabuf(struct vrend_video_buffer *buf,
                                GL_TEXTURE_2D, res->gl_id, 0);
 
         /* framebuffer -> texture */
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, plane->texture);
         glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0,
                             res->base.width0, res->base.height0);
 
     }
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+    vrend_gl_bind_texture(GL_TEXTURE_2D, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     return 0;
@@ -315,8 +426,26 @@ static void vrend_video_encode_completed(
     memset(&feedback, 0, sizeof(feedback));
 
     /* sync coded data to guest */
-    if (has_bit(cdc->dest_res->storage_bits, VREND_STORAGE_GL_BUFFER)) {
-        glBindBufferARB(cdc->dest_res->target, cdc->dest_res->gl_id);
+    if (cdc->dest_res->iov &&
+        (is_only_bit(cdc->dest_res->storage_bits, VREND_STORAGE_GUEST_MEMORY) ||
+         has_bit(cdc->dest_res->storage_bits, VREND_STORAGE_HOST_SYSTEM_MEMORY))) {
+        /*
+         * Staging and custom buffers are not backed by GL, so the segments
+         * are streamed from the coded buffer directly into the guest pages.
+         */
+        for (i = 0, data_size = 0; i < num_coded_bufs &&
+                    data_size < cdc->dest_res->base.width0; i++) {
+            size = MIN2(cdc->dest_res->base.width0 - data_size, coded_sizes[i]);
+            if (cdc->dest_res->ptr)
+                memcpy(cdc->dest_res->ptr + data_size, coded_bufs[i], size);
+            vrend_write_to_iovec(cdc->dest_res->iov, cdc->dest_res->num_iovs,
+                                 data_size, coded_bufs[i], size);
+            data_size += size;
+        }
+        feedback.stat = VIRGL_VIDEO_ENCODE_STAT_SUCCESS;
+        feedback.coded_size = data_size;
+    } else if (has_bit(cdc->dest_res->storage_bits, VREND_STORAGE_GL_BUFFER)) {
+        vrend_gl_bind_buffer(cdc->dest_res->target, cdc->dest_res->gl_id);
         buf = glMapBufferRange(cdc->dest_res->target, 0,
                                cdc->dest_res->base.width0, GL_MAP_WRITE_BIT);
         for (i = 0, data_size = 0; i < num_coded_bufs &&
@@ -328,7 +457,7 @@ static void vrend_video_encode_completed(
             data_size += size;
         }
         glUnmapBuffer(cdc->dest_res->target);
-        glBindBufferARB(cdc->dest_res->target, 0);
+        vrend_gl_bind_buffer(cdc->dest_res->target, 0);
         feedback.stat = VIRGL_VIDEO_ENCODE_STAT_SUCCESS;
         feedback.coded_size = data_size;
     } else {
@@ -352,16 +481,166 @@ static struct virgl_video_callbacks video_callbacks = {
     .encode_completed           = vrend_video_encode_completed,
 };
 
-int vrend_video_init(int drm_fd)
+static int thread_video_jobs(UNUSED void *arg)
+{
+    u_thread_setname("vrend-video");
+
+    mtx_lock(&video_jobs.mutex);
+    while (!video_jobs.stop) {
+        struct vrend_video_job *next = NULL;
+
+        list_for_each_entry(struct vrend_video_job, job, &video_jobs.jobs, head) {
+            if (!job->synced) {
+                next = job;
+                break;
+            }
+        }
+
+        if (!next) {
+            cnd_wait(&video_jobs.cond, &video_jobs.mutex);
+            continue;
+        }
+
+        /* jobs are only freed once synced */
+        mtx_unlock(&video_jobs.mutex);
+        const int result = virgl_video_sync_buffer(next->buf->buffer);
+        mtx_lock(&video_jobs.mutex);
+
+        next->result = result;
+        next->synced = true;
+        cnd_broadcast(&video_jobs.cond);
+    }
+    mtx_unlock(&video_jobs.mutex);
+
+    return 0;
+}
+
+static void init_video_jobs(bool async_frames)
+{
+    video_jobs.max_jobs = debug_get_num_option("VREND_VIDEO_FRAMES_IN_FLIGHT", 4);
+    if (!async_frames || video_jobs.max_jobs <= 1)
+        return;
+
+    list_inithead(&video_jobs.jobs);
+    mtx_init(&video_jobs.mutex, mtx_plain);
+    cnd_init(&video_jobs.cond);
+
+    video_jobs.thread = u_thread_create(thread_video_jobs, NULL);
+    if (!video_jobs.thread) {
+        virgl_warn("failed to create the video thread, decoding synchronously\n");
+        cnd_destroy(&video_jobs.cond);
+        mtx_destroy(&video_jobs.mutex);
+        return;
+    }
+
+    video_jobs.enabled = true;
+}
+
+/* waits for the oldest job and completes it */
+static void finish_first_job(void)
+{
+    struct vrend_video_job *job =
+        list_first_entry(&video_jobs.jobs, struct vrend_video_job, head);
+
+    mtx_lock(&video_jobs.mutex);
+    while (!job->synced)
+        cnd_wait(&video_jobs.cond, &video_jobs.mutex);
+    list_del(&job->head);
+    video_jobs.num_jobs--;
+    mtx_unlock(&video_jobs.mutex);
+
+    if (!job->result) {
+        video_jobs.completing = true;
+        virgl_video_complete_frame(job->cdc->codec, job->buf->buffer);
+        video_jobs.completing = false;
+    }
+
+    free(job);
+}
+
+static void finish_all_jobs(void)
+{
+    if (!video_jobs.enabled)
+        return;
+
+    while (!list_is_empty(&video_jobs.jobs))
+        finish_first_job();
+}
+
+/* finishes the jobs of buf and the ones before them */
+static void finish_buffer_jobs(struct vrend_video_buffer *buf)
+{
+    if (!video_jobs.enabled)
+        return;
+
+    uint64_t seqno = 0;
+    list_for_each_entry(struct vrend_video_job, job, &video_jobs.jobs, head) {
+        if (job->buf == buf)
+            seqno = job->seqno + 1;
+    }
+
+    vrend_video_finish_jobs(seqno);
+}
+
+uint64_t vrend_video_job_seqno(void)
+{
+    return video_jobs.next_seqno;
+}
+
+void vrend_video_finish_jobs(uint64_t seqno)
+{
+    if (!video_jobs.enabled)
+        return;
+
+    /* also complete the frames that are already decoded */
+    while (!list_is_empty(&video_jobs.jobs)) {
+        struct vrend_video_job *job =
+            list_first_entry(&video_jobs.jobs, struct vrend_video_job, head);
+
+        mtx_lock(&video_jobs.mutex);
+        const bool synced = job->synced;
+        mtx_unlock(&video_jobs.mutex);
+
+        if (job->seqno >= seqno && !synced)
+            break;
+
+        finish_first_job();
+    }
+}
+
+int vrend_video_init(int drm_fd, bool async_frames)
 {
     if (drm_fd < 0)
         return -1;
 
-    return virgl_video_init(drm_fd, &video_callbacks, 0);
+    video_zero_copy = debug_get_bool_option("VREND_VIDEO_ZERO_COPY", true);
+
+    /* the probed caps are kept next to the program binaries */
+    virgl_video_set_cache_dir(vrend_program_cache_dir());
+
+    int ret = virgl_video_init(drm_fd, &video_callbacks, 0);
+    if (!ret)
+        init_video_jobs(async_frames);
+
+    return ret;
 }
 
 void vrend_video_fini(void)
 {
+    if (video_jobs.enabled) {
+        finish_all_jobs();
+
+        mtx_lock(&video_jobs.mutex);
+        video_jobs.stop = true;
+        cnd_signal(&video_jobs.cond);
+        mtx_unlock(&video_jobs.mutex);
+
+        thrd_join(video_jobs.thread, NULL);
+        cnd_destroy(&video_jobs.cond);
+        mtx_destroy(&video_jobs.mutex);
+        memset(&video_jobs, 0, sizeof(video_jobs));
+    }
+
     virgl_video_destroy();
 }
 
@@ -429,6 +708,8 @@ int vrend_video_create_codec(struct vrend_video_context *ctx,
 
 static void destroy_video_codec(struct vrend_video_codec *cdc)
 {
+    finish_all_jobs();
+
     if (cdc) {
         list_del(&cdc->head);
         virgl_video_destroy_codec(cdc->codec);
@@ -496,12 +777,12 @@ int vrend_video_create_buffer(struct vrend_video_context *ctx,
         plane->res_handle = res_handles[i];
         glGenFramebuffers(1, &plane->framebuffer);
         glGenTextures(1, &plane->texture);
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, plane->texture);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        vrend_gl_bind_texture(GL_TEXTURE_2D, 0);
     }
 
     buf->handle = handle;
@@ -519,14 +800,16 @@ static void destroy_video_buffer(struct vrend_video_buffer *buf)
     if (!buf)
         return;
 
+    finish_buffer_jobs(buf);
     list_del(&buf->head);
 
     for (i = 0; i < buf->num_planes; i++) {
         plane = &buf->planes[i];
 
+        vrend_gl_state_forget_texture(plane->texture);
         glDeleteTextures(1, &plane->texture);
         glDeleteFramebuffers(1, &plane->framebuffer);
-        if (plane->egl_image == EGL_NO_IMAGE_KHR)
+        if (plane->egl_image != EGL_NO_IMAGE_KHR)
             eglDestroyImageKHR(eglGetCurrentDisplay(), plane->egl_image);
     }
 
@@ -578,6 +861,9 @@ int vrend_video_begin_frame(struct vrend_video_context *ctx,
     if (!cdc || !tgt)
         return -1;
 
+    /* the previous frame of the target has to be copied out first */
+    finish_buffer_jobs(tgt);
+
     return virgl_video_begin_frame(cdc->codec, tgt->buffer);
 }
 
@@ -853,6 +1139,28 @@ int vrend_video_end_frame(struct vrend_video_context *ctx,
     if (!cdc || !tgt)
         return -1;
 
-    return virgl_video_end_frame(cdc->codec, tgt->buffer);
+    if (!video_jobs.enabled || !virgl_video_codec_is_decoder(cdc->codec))
+        return virgl_video_end_frame(cdc->codec, tgt->buffer);
+
+    struct vrend_video_job *job = calloc(1, sizeof(*job));
+    if (!job || virgl_video_submit_frame(cdc->codec, tgt->buffer)) {
+        free(job);
+        return job ? -1 : virgl_video_end_frame(cdc->codec, tgt->buffer);
+    }
+
+    job->cdc = cdc;
+    job->buf = tgt;
+    job->seqno = video_jobs.next_seqno++;
+
+    mtx_lock(&video_jobs.mutex);
+    list_addtail(&job->head, &video_jobs.jobs);
+    video_jobs.num_jobs++;
+    cnd_signal(&video_jobs.cond);
+    mtx_unlock(&video_jobs.mutex);
+
+    if (video_jobs.num_jobs > video_jobs.max_jobs)
+        finish_first_job();
+
+    return 0;
 }
 
@@ -35,15 +35,23 @@
 #ifndef VREND_VIDEO_H
 #define VREND_VIDEO_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <virgl_hw.h>
 
 #define VREND_VIDEO_BUFFER_PLANE_NUM  3
 
 struct vrend_video_context;
 
-int vrend_video_init(int drm_fd);
+/* with async_frames, decoded frames complete when a later fence retires */
+int vrend_video_init(int drm_fd, bool async_frames);
 void vrend_video_fini(void);
 
+/* the seqno of the next decode job, and completes the jobs before seqno */
+uint64_t vrend_video_job_seqno(void);
+void vrend_video_finish_jobs(uint64_t seqno);
+
 int vrend_video_fill_caps(union virgl_caps *caps);
 
 struct vrend_video_context *vrend_video_create_context(struct vrend_context *ctx);
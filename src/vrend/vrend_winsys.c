@@ -24,6 +24,7 @@
 
 #include "vrend_winsys.h"
 #include "vrend_debug.h"
+#include "virgl_numa.h"
 
 #ifdef HAVE_EPOXY_GLX_H
 #include "vrend_winsys_glx.h"
@@ -75,6 +76,10 @@ int vrend_winsys_init(uint32_t flags, int preferred_fd)
          return -1;
       }
 
+      /* when EGL did not pick a device of its own */
+      if (gbm)
+         virgl_numa_set_device(gbm->fd);
+
       use_context = CONTEXT_EGL;
 #else
       (void)preferred_fd;
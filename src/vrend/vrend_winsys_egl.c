@@ -33,24 +33,32 @@
 #define EGL_EGLEXT_PROTOTYPES
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifdef WIN32
 #include <d3d11.h>
+#include <d3d11_4.h>
 #else
 #include <poll.h>
 #endif
 #include <stdbool.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #ifdef ENABLE_LIBDRM
 #include <xf86drm.h>
 #endif
 
+#include "util/hash_table.h"
 #include "util/u_memory.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
 #include "virglrenderer.h"
 #include "vrend_winsys.h"
 #include "vrend_winsys_egl.h"
 #include "virgl_hw.h"
+#include "virgl_numa.h"
 #ifdef ENABLE_GBM
 #include "vrend_winsys_gbm.h"
 #endif
@@ -69,6 +77,7 @@
 #define EGL_EXT_DEVICE_ENUMERATION             BIT(10)
 #define EGL_EXT_DEVICE_QUERY                   BIT(11)
 #define EGL_EXT_PLATFORM_DEVICE                BIT(12)
+#define EGL_KHR_CREATE_CONTEXT_NO_ERROR        BIT(13)
 
 static const struct {
    uint32_t bit;
@@ -86,6 +95,7 @@ static const struct {
    { EGL_EXT_DEVICE_ENUMERATION, "EGL_EXT_device_enumeration" },
    { EGL_EXT_DEVICE_QUERY, "EGL_EXT_device_query" },
    { EGL_EXT_PLATFORM_DEVICE, "EGL_EXT_platform_device" },
+   { EGL_KHR_CREATE_CONTEXT_NO_ERROR, "EGL_KHR_create_context_no_error" },
 };
 
 struct egl_funcs {
@@ -109,9 +119,52 @@ struct virgl_egl {
    struct egl_funcs funcs;
 #ifdef WIN32
    ID3D11Device *d3d11_device;
+   /* created on first use, shared with the VMM */
+   ID3D11Fence *d3d11_fence;
+   uint64_t d3d11_fence_value;
+#endif
+#ifdef ENABLE_GBM
+   /* virgl_egl_image_key to virgl_egl_image_entry, and image to entry */
+   struct hash_table *image_cache;
+   struct hash_table *image_entries;
+   /* drm format to virgl_egl_modifiers */
+   struct hash_table_u64 *modifiers;
 #endif
 };
 
+#ifdef ENABLE_GBM
+/* The dma-bufs are identified by the inodes of their fds, which stay valid
+ * while an EGLImage holds a reference on the buffers.
+ */
+struct virgl_egl_image_key {
+   uint32_t width;
+   uint32_t height;
+   uint32_t drm_format;
+   uint32_t plane_count;
+   uint64_t drm_modifier;
+   struct {
+      uint64_t dev;
+      uint64_t ino;
+      uint32_t stride;
+      uint32_t offset;
+   } planes[VIRGL_GBM_MAX_PLANES];
+};
+
+struct virgl_egl_image_entry {
+   struct virgl_egl_image_key key;
+   EGLImageKHR image;
+   /* the resources sharing the image */
+   uint32_t refcount;
+};
+
+#define VIRGL_EGL_MAX_MODIFIERS 64
+
+struct virgl_egl_modifiers {
+   uint32_t count;
+   uint64_t modifiers[VIRGL_EGL_MAX_MODIFIERS];
+};
+#endif
+
 static bool virgl_egl_has_extension_in_string(const char *haystack, const char *needle)
 {
    const unsigned needle_len = strlen(needle);
@@ -271,6 +324,17 @@ static EGLDeviceEXT virgl_egl_get_device(struct virgl_egl *egl) {
    if (device_num < 0)
       return EGL_NO_DEVICE_EXT;
 
+   /* the chosen GPU might not be the one of the gbm device */
+   const char *dev_node = egl->funcs.eglQueryDeviceString(devices[device_num],
+                                                          EGL_DRM_DEVICE_FILE_EXT);
+   if (dev_node) {
+      int fd = open(dev_node, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+         virgl_numa_set_device(fd);
+         close(fd);
+      }
+   }
+
   return devices[device_num];
 }
 
@@ -446,11 +510,34 @@ struct virgl_egl *virgl_egl_init(EGLNativeDisplayType display_id, bool surfacele
    return NULL;
 }
 
+#ifdef ENABLE_GBM
+static void virgl_egl_free_entry(struct hash_entry *entry)
+{
+   free(entry->data);
+}
+#endif
+
 void virgl_egl_destroy(struct virgl_egl *egl)
 {
+#ifdef ENABLE_GBM
+   if (egl->image_entries) {
+      hash_table_foreach(egl->image_entries, entry) {
+         struct virgl_egl_image_entry *image_entry = entry->data;
+         eglDestroyImageKHR(egl->egl_display, image_entry->image);
+         free(image_entry);
+      }
+      _mesa_hash_table_destroy(egl->image_entries, NULL);
+      _mesa_hash_table_destroy(egl->image_cache, NULL);
+   }
+   _mesa_hash_table_u64_destroy(egl->modifiers, virgl_egl_free_entry);
+#endif
    if (egl->signaled_fence) {
       eglDestroySyncKHR(egl->egl_display, egl->signaled_fence);
    }
+#ifdef WIN32
+   if (egl->d3d11_fence)
+      egl->d3d11_fence->lpVtbl->Release(egl->d3d11_fence);
+#endif
    eglMakeCurrent(egl->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
                   EGL_NO_CONTEXT);
    eglDestroyContext(egl->egl_display, egl->egl_ctx);
@@ -545,6 +632,69 @@ virgl_egl_win32_image_from_d3d11_texture2d(struct virgl_egl *egl, ID3D11Texture2
                             EGL_D3D11_TEXTURE_ANGLE, (EGLClientBuffer)tex,
                             attribs);
 }
+
+static bool virgl_egl_win32_create_d3d11_fence(struct virgl_egl *egl)
+{
+   ID3D11Device5 *device5 = NULL;
+   HRESULT hr;
+
+   hr = egl->d3d11_device->lpVtbl->QueryInterface(egl->d3d11_device,
+                                                  &IID_ID3D11Device5, (void **)&device5);
+   if (FAILED(hr)) {
+      debug_hresult(hr);
+      return false;
+   }
+
+   hr = device5->lpVtbl->CreateFence(device5, 0, D3D11_FENCE_FLAG_SHARED,
+                                     &IID_ID3D11Fence, (void **)&egl->d3d11_fence);
+   device5->lpVtbl->Release(device5);
+   if (FAILED(hr)) {
+      debug_hresult(hr);
+      egl->d3d11_fence = NULL;
+      return false;
+   }
+
+   egl->d3d11_fence_value = 0;
+   return true;
+}
+
+bool virgl_egl_win32_signal_d3d11_fence(struct virgl_egl *egl,
+                                        ID3D11Fence **fence, uint64_t *value)
+{
+   ID3D11DeviceContext *context = NULL;
+   ID3D11DeviceContext4 *context4 = NULL;
+   HRESULT hr;
+
+   if (!egl || !egl->d3d11_device)
+      return false;
+
+   if (!egl->d3d11_fence && !virgl_egl_win32_create_d3d11_fence(egl))
+      return false;
+
+   /* ANGLE records the GL work of all contexts in the immediate context of
+    * its device, the signal is queued behind the flushed work */
+   egl->d3d11_device->lpVtbl->GetImmediateContext(egl->d3d11_device, &context);
+   hr = context->lpVtbl->QueryInterface(context, &IID_ID3D11DeviceContext4,
+                                        (void **)&context4);
+   context->lpVtbl->Release(context);
+   if (FAILED(hr)) {
+      debug_hresult(hr);
+      return false;
+   }
+
+   hr = context4->lpVtbl->Signal(context4, egl->d3d11_fence, egl->d3d11_fence_value + 1);
+   if (SUCCEEDED(hr))
+      context4->lpVtbl->Flush(context4);
+   context4->lpVtbl->Release(context4);
+   if (FAILED(hr)) {
+      debug_hresult(hr);
+      return false;
+   }
+
+   *fence = egl->d3d11_fence;
+   *value = ++egl->d3d11_fence_value;
+   return true;
+}
 #endif
 
 static void
@@ -624,12 +774,20 @@ virgl_renderer_gl_context virgl_egl_create_context(struct virgl_egl *egl, struct
       EGL_CONTEXT_CLIENT_VERSION, vparams->major_ver,
       EGL_CONTEXT_MINOR_VERSION_KHR, vparams->minor_ver,
       EGL_NONE, EGL_NONE,
+      EGL_NONE, EGL_NONE,
       EGL_NONE
    };
+   int att = 4;
 
    if (vparams->compat_ctx) {
-      ctx_att[4] = EGL_CONTEXT_OPENGL_PROFILE_MASK;
-      ctx_att[5] = EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT;
+      ctx_att[att++] = EGL_CONTEXT_OPENGL_PROFILE_MASK;
+      ctx_att[att++] = EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT;
+   }
+
+   if (vparams->no_error &&
+       has_bit(egl->extension_bits, EGL_KHR_CREATE_CONTEXT_NO_ERROR)) {
+      ctx_att[att++] = EGL_CONTEXT_OPENGL_NO_ERROR_KHR;
+      ctx_att[att++] = EGL_TRUE;
    }
 
    egl_ctx = eglCreateContext(egl->egl_display,
@@ -778,15 +936,76 @@ bool virgl_has_egl_khr_gl_colorspace(struct virgl_egl *egl)
 }
 
 #ifdef ENABLE_GBM
-void *virgl_egl_image_from_dmabuf(struct virgl_egl *egl,
-                                  uint32_t width,
-                                  uint32_t height,
-                                  uint32_t drm_format,
-                                  uint64_t drm_modifier,
-                                  uint32_t plane_count,
-                                  const int *plane_fds,
-                                  const uint32_t *plane_strides,
-                                  const uint32_t *plane_offsets)
+static uint32_t virgl_egl_image_key_hash(const void *key)
+{
+   return (uint32_t)XXH64(key, sizeof(struct virgl_egl_image_key), 0);
+}
+
+static bool virgl_egl_image_key_equal(const void *a, const void *b)
+{
+   return !memcmp(a, b, sizeof(struct virgl_egl_image_key));
+}
+
+static bool virgl_egl_image_init_cache(struct virgl_egl *egl)
+{
+   if (egl->image_entries)
+      return true;
+
+   egl->image_cache = _mesa_hash_table_create(NULL, virgl_egl_image_key_hash,
+                                              virgl_egl_image_key_equal);
+   egl->image_entries = _mesa_pointer_hash_table_create(NULL);
+   if (!egl->image_cache || !egl->image_entries) {
+      _mesa_hash_table_destroy(egl->image_cache, NULL);
+      _mesa_hash_table_destroy(egl->image_entries, NULL);
+      egl->image_cache = NULL;
+      egl->image_entries = NULL;
+      return false;
+   }
+
+   return true;
+}
+
+static bool virgl_egl_image_get_key(uint32_t width,
+                                    uint32_t height,
+                                    uint32_t drm_format,
+                                    uint64_t drm_modifier,
+                                    uint32_t plane_count,
+                                    const int *plane_fds,
+                                    const uint32_t *plane_strides,
+                                    const uint32_t *plane_offsets,
+                                    struct virgl_egl_image_key *key)
+{
+   /* the padding is hashed too */
+   memset(key, 0, sizeof(*key));
+   key->width = width;
+   key->height = height;
+   key->drm_format = drm_format;
+   key->plane_count = plane_count;
+   key->drm_modifier = drm_modifier;
+
+   for (uint32_t i = 0; i < plane_count; i++) {
+      struct stat st;
+      if (fstat(plane_fds[i], &st))
+         return false;
+
+      key->planes[i].dev = st.st_dev;
+      key->planes[i].ino = st.st_ino;
+      key->planes[i].stride = plane_strides[i];
+      key->planes[i].offset = plane_offsets[i];
+   }
+
+   return true;
+}
+
+static void *virgl_egl_image_create(struct virgl_egl *egl,
+                                    uint32_t width,
+                                    uint32_t height,
+                                    uint32_t drm_format,
+                                    uint64_t drm_modifier,
+                                    uint32_t plane_count,
+                                    const int *plane_fds,
+                                    const uint32_t *plane_strides,
+                                    const uint32_t *plane_offsets)
 {
    EGLint attrs[6 + VIRGL_GBM_MAX_PLANES * 10 + 1];
    uint32_t count;
@@ -839,8 +1058,119 @@ void *virgl_egl_image_from_dmabuf(struct virgl_egl *egl,
                                     attrs);
 }
 
+/* Importing the same dma-buf with the same layout returns the same EGLImage,
+ * which is destroyed when the last resource using it is.
+ */
+void *virgl_egl_image_from_dmabuf(struct virgl_egl *egl,
+                                  uint32_t width,
+                                  uint32_t height,
+                                  uint32_t drm_format,
+                                  uint64_t drm_modifier,
+                                  uint32_t plane_count,
+                                  const int *plane_fds,
+                                  const uint32_t *plane_strides,
+                                  const uint32_t *plane_offsets)
+{
+   struct virgl_egl_image_key key;
+
+   if (!virgl_egl_image_init_cache(egl) ||
+       !virgl_egl_image_get_key(width, height, drm_format, drm_modifier, plane_count,
+                                plane_fds, plane_strides, plane_offsets, &key)) {
+      return virgl_egl_image_create(egl, width, height, drm_format, drm_modifier,
+                                    plane_count, plane_fds, plane_strides,
+                                    plane_offsets);
+   }
+
+   struct hash_entry *entry = _mesa_hash_table_search(egl->image_cache, &key);
+   if (entry) {
+      struct virgl_egl_image_entry *image_entry = entry->data;
+      image_entry->refcount++;
+      return image_entry->image;
+   }
+
+   void *image = virgl_egl_image_create(egl, width, height, drm_format, drm_modifier,
+                                        plane_count, plane_fds, plane_strides,
+                                        plane_offsets);
+   if (!image)
+      return NULL;
+
+   struct virgl_egl_image_entry *image_entry = calloc(1, sizeof(*image_entry));
+   if (!image_entry)
+      return image;
+
+   image_entry->key = key;
+   image_entry->image = image;
+   image_entry->refcount = 1;
+   _mesa_hash_table_insert(egl->image_cache, &image_entry->key, image_entry);
+   _mesa_hash_table_insert(egl->image_entries, image, image_entry);
+
+   return image;
+}
+
+static void virgl_egl_query_dmabuf_modifiers(struct virgl_egl *egl, uint32_t drm_format,
+                                             struct virgl_egl_modifiers *out)
+{
+   uint64_t modifiers[VIRGL_EGL_MAX_MODIFIERS];
+   EGLBoolean external_only[VIRGL_EGL_MAX_MODIFIERS];
+   EGLint count;
+
+   out->count = 0;
+   if (!has_bit(egl->extension_bits, EGL_EXT_IMAGE_DMA_BUF_IMPORT_MODIFIERS))
+      return;
+
+   if (!eglQueryDmaBufModifiersEXT(egl->egl_display, drm_format, VIRGL_EGL_MAX_MODIFIERS,
+                                   (EGLuint64KHR *)modifiers, external_only, &count))
+      return;
+
+   /* the images are bound to GL_TEXTURE_2D */
+   for (EGLint i = 0; i < count; i++) {
+      if (!external_only[i] && modifiers[i] != DRM_FORMAT_MOD_INVALID)
+         out->modifiers[out->count++] = modifiers[i];
+   }
+}
+
+uint32_t virgl_egl_get_dmabuf_modifiers(struct virgl_egl *egl, uint32_t drm_format,
+                                        const uint64_t **modifiers)
+{
+   struct virgl_egl_modifiers *entry;
+
+   *modifiers = NULL;
+
+   if (!egl->modifiers) {
+      egl->modifiers = _mesa_hash_table_u64_create(NULL);
+      if (!egl->modifiers)
+         return 0;
+   }
+
+   entry = _mesa_hash_table_u64_search(egl->modifiers, drm_format);
+   if (!entry) {
+      entry = calloc(1, sizeof(*entry));
+      if (!entry)
+         return 0;
+
+      virgl_egl_query_dmabuf_modifiers(egl, drm_format, entry);
+      _mesa_hash_table_u64_insert(egl->modifiers, drm_format, entry);
+   }
+
+   *modifiers = entry->modifiers;
+   return entry->count;
+}
+
 void virgl_egl_image_destroy(struct virgl_egl *egl, void *image)
 {
+   struct hash_entry *entry =
+      egl->image_entries ? _mesa_hash_table_search(egl->image_entries, image) : NULL;
+
+   if (entry) {
+      struct virgl_egl_image_entry *image_entry = entry->data;
+      if (--image_entry->refcount)
+         return;
+
+      _mesa_hash_table_remove(egl->image_entries, entry);
+      _mesa_hash_table_remove_key(egl->image_cache, &image_entry->key);
+      free(image_entry);
+   }
+
    eglDestroyImageKHR(egl->egl_display, image);
 }
 #endif
@@ -940,16 +1270,16 @@ void virgl_egl_fence_destroy(struct virgl_egl *egl, EGLSyncKHR fence) {
    eglDestroySyncKHR(egl->egl_display, fence);
 }
 
-static bool client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool blocking)
+static bool client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, uint64_t timeout_ns)
 {
    EGLint egl_result = eglClientWaitSyncKHR(egl->egl_display, fence, 0,
-                                            blocking ? EGL_FOREVER_KHR : 0);
+                                            timeout_ns == UINT64_MAX ? EGL_FOREVER_KHR : timeout_ns);
    if (egl_result == EGL_FALSE)
       virgl_warn("Wait sync failed\n");
    return egl_result != EGL_TIMEOUT_EXPIRED_KHR;
 }
 
-bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool blocking)
+bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, uint64_t timeout_ns)
 {
 #ifndef _WIN32
    /* attempt to poll the native fence fd instead of eglClientWaitSyncKHR() to
@@ -957,7 +1287,7 @@ bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool b
     */
    int fd = -1;
    if (!virgl_egl_export_fence(egl, fence, &fd)) {
-      return client_wait_fence(egl, fence, blocking);
+      return client_wait_fence(egl, fence, timeout_ns);
    }
    assert(fd >= 0);
 
@@ -966,8 +1296,10 @@ bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool b
       .fd = fd,
       .events = POLLIN,
    };
+   int timeout_ms = timeout_ns == UINT64_MAX ? -1 :
+                    (int)MIN2(DIV_ROUND_UP(timeout_ns, 1000000), INT_MAX);
    do {
-      ret = poll(&pfd, 1, blocking ? -1 : 0);
+      ret = poll(&pfd, 1, timeout_ms);
       if (ret > 0 && (pfd.revents & (POLLERR | POLLNVAL))) {
          ret = -1;
          break;
@@ -979,7 +1311,7 @@ bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool b
       virgl_warn("Wait sync failed\n");
    return ret != 0;
 #else
-   return client_wait_fence(egl, fence, blocking);
+   return client_wait_fence(egl, fence, timeout_ns);
 #endif
 }
 
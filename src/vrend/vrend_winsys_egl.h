@@ -31,6 +31,7 @@
 
 #ifdef WIN32
 #include <d3d11.h>
+#include <d3d11_4.h>
 #endif
 
 struct virgl_egl;
@@ -82,6 +83,10 @@ void *virgl_egl_image_from_dmabuf(struct virgl_egl *egl,
                                   const uint32_t *plane_offsets);
 void virgl_egl_image_destroy(struct virgl_egl *egl, void *image);
 
+/* the modifiers of format that can be imported as GL_TEXTURE_2D */
+uint32_t virgl_egl_get_dmabuf_modifiers(struct virgl_egl *egl, uint32_t drm_format,
+                                        const uint64_t **modifiers);
+
 void *virgl_egl_image_from_gbm_bo(struct virgl_egl *egl, struct gbm_bo *bo);
 void *virgl_egl_aux_plane_image_from_gbm_bo(struct virgl_egl *egl, struct gbm_bo *bo, int plane);
 #endif
@@ -89,7 +94,8 @@ void *virgl_egl_aux_plane_image_from_gbm_bo(struct virgl_egl *egl, struct gbm_bo
 bool virgl_egl_supports_fences(struct virgl_egl *egl);
 EGLSyncKHR virgl_egl_fence_create(struct virgl_egl *egl);
 void virgl_egl_fence_destroy(struct virgl_egl *egl, EGLSyncKHR fence);
-bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, bool blocking);
+/* timeout_ns is UINT64_MAX to wait until the fence signals */
+bool virgl_egl_client_wait_fence(struct virgl_egl *egl, EGLSyncKHR fence, uint64_t timeout_ns);
 bool virgl_egl_export_signaled_fence(struct virgl_egl *egl, int *out_fd);
 bool virgl_egl_export_fence(struct virgl_egl *egl, EGLSyncKHR fence, int *out_fd);
 bool virgl_egl_different_gpu(struct virgl_egl *egl);
@@ -99,6 +105,9 @@ const char *virgl_egl_error_string(EGLint error);
 bool virgl_egl_win32_create_d3d11_texture2d(struct virgl_egl *egl,
                                             const D3D11_TEXTURE2D_DESC *desc, ID3D11Texture2D **tex);
 EGLImageKHR virgl_egl_win32_image_from_d3d11_texture2d(struct virgl_egl *egl, ID3D11Texture2D *tex);
+/* queues a signal of the shared fence of the device behind the submitted work */
+bool virgl_egl_win32_signal_d3d11_fence(struct virgl_egl *egl,
+                                        ID3D11Fence **fence, uint64_t *value);
 #endif
 
 #endif
@@ -352,13 +352,35 @@ int virgl_gbm_transfer(struct gbm_bo *bo, uint32_t direction, const struct iovec
    host_map_stride0 = 0;
    uint32_t map_flags = (direction == VIRGL_TRANSFER_TO_HOST) ? GBM_BO_TRANSFER_WRITE :
                                                                 GBM_BO_TRANSFER_READ;
-   /* XXX remove this and map just the region when single plane and GBM honors the region */
-   if (direction == VIRGL_TRANSFER_TO_HOST &&
-       !(info->box->x == 0 && info->box->y == 0 &&
-         info->box->width == (int)width && info->box->height == (int)height))
+
+   /*
+    * minigbm honors the region and returns the address of its first pixel, so a
+    * single plane transfer maps just the box.  The box is fully written, which
+    * saves the readback of the whole BO for partial writes.
+    */
+#ifdef MINIGBM
+   const bool map_region = plane_count == 1;
+#else
+   const bool map_region = false;
+#endif
+
+   uint32_t map_x = 0;
+   uint32_t map_y = 0;
+   uint32_t map_width = width;
+   uint32_t map_height = height;
+   if (map_region) {
+      map_x = info->box->x;
+      map_y = info->box->y;
+      map_width = info->box->width;
+      map_height = info->box->height;
+   } else if (direction == VIRGL_TRANSFER_TO_HOST &&
+              !(info->box->x == 0 && info->box->y == 0 &&
+                info->box->width == (int)width && info->box->height == (int)height)) {
       map_flags |= GBM_BO_TRANSFER_READ;
+   }
 
-   void *addr = gbm_bo_map(bo, 0, 0, width, height, map_flags, &host_map_stride0, &map_data);
+   void *addr = gbm_bo_map(bo, map_x, map_y, map_width, map_height, map_flags,
+                           &host_map_stride0, &map_data);
    if (!addr || addr == MAP_FAILED)
       return -1;
 
@@ -397,8 +419,11 @@ int virgl_gbm_transfer(struct gbm_bo *bo, uint32_t direction, const struct iovec
             ? host_map_stride0 : gbm_bo_get_stride_for_plane(bo, plane);
 
       uint32_t guest_resource_offset = guest_plane_offset;
-      uint32_t host_resource_offset = host_plane_offset + (subsampled_y * host_plane_stride)
-                                       + subsampled_x * layout->bytes_per_pixel[plane];
+      uint32_t host_resource_offset = 0;
+      if (!map_region) {
+         host_resource_offset = host_plane_offset + (subsampled_y * host_plane_stride)
+                                + subsampled_x * layout->bytes_per_pixel[plane];
+      }
 
       uint8_t *host_address = (uint8_t*)addr + host_resource_offset;
 
@@ -467,6 +492,32 @@ uint32_t virgl_gbm_convert_flags(uint32_t virgl_bind_flags)
    return flags;
 }
 
+struct gbm_bo *virgl_gbm_bo_create(struct virgl_gbm *gbm, uint32_t width, uint32_t height,
+                                   uint32_t format, uint32_t flags,
+                                   const uint64_t *modifiers, uint32_t modifier_count)
+{
+#ifdef HAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+   const uint32_t linear_flags = GBM_BO_USE_LINEAR |
+                                 GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_READ_RARELY |
+                                 GBM_BO_USE_SW_WRITE_OFTEN | GBM_BO_USE_SW_WRITE_RARELY;
+
+   if (modifier_count && !(flags & linear_flags)) {
+      struct gbm_bo *bo = gbm_bo_create_with_modifiers2(gbm->device, width, height,
+                                                        format, modifiers,
+                                                        modifier_count, flags);
+      if (bo)
+         return bo;
+
+      virgl_debug("failed to allocate a bo with modifiers, falling back\n");
+   }
+#else
+   (void)modifiers;
+   (void)modifier_count;
+#endif
+
+   return gbm_bo_create(gbm->device, width, height, format, flags);
+}
+
 int virgl_gbm_export_query(struct gbm_bo *bo, struct virgl_renderer_export_query *query)
 {
    int ret = -1;
@@ -134,6 +134,11 @@ int virgl_gbm_transfer(struct gbm_bo *bo, uint32_t direction, const struct iovec
 
 uint32_t virgl_gbm_convert_flags(uint32_t virgl_bind_flags);
 
+/* picks one of the modifiers, unless the flags ask for a linear or CPU mapped bo */
+struct gbm_bo *virgl_gbm_bo_create(struct virgl_gbm *gbm, uint32_t width, uint32_t height,
+                                   uint32_t format, uint32_t flags,
+                                   const uint64_t *modifiers, uint32_t modifier_count);
+
 int virgl_gbm_export_fd(struct gbm_device *gbm, uint32_t handle, int32_t *out_fd);
 
 int virgl_gbm_export_query(struct gbm_bo *bo, struct virgl_renderer_export_query *query);
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench_util.h"
+#include "util/hash_table.h"
+#include "virgl_id_table.h"
+
+/* Time the lookups of ids in tables of various sizes, against the generic
+ * 64-bit key hash table the id tables replaced */
+
+#define LOOKUPS (1 << 22)
+
+static uint64_t ids[1 << 16];
+
+static uint64_t bench_id_table(uint32_t count, uint64_t *sum)
+{
+   struct virgl_id_table table;
+
+   if (!virgl_id_table_init(&table))
+      exit(EXIT_FAILURE);
+   for (uint32_t i = 0; i < count; i++)
+      virgl_id_table_insert(&table, ids[i], &ids[i]);
+
+   uint64_t start = bench_time_ns();
+   for (uint32_t i = 0; i < LOOKUPS; i++)
+      *sum += *(uint64_t *)virgl_id_table_search(&table, ids[i & (count - 1)]);
+   uint64_t total = bench_time_ns() - start;
+
+   virgl_id_table_fini(&table);
+   return total;
+}
+
+static uint64_t bench_hash_table_u64(uint32_t count, uint64_t *sum)
+{
+   struct hash_table_u64 *table = _mesa_hash_table_u64_create(NULL);
+
+   if (!table)
+      exit(EXIT_FAILURE);
+   for (uint32_t i = 0; i < count; i++)
+      _mesa_hash_table_u64_insert(table, ids[i], &ids[i]);
+
+   uint64_t start = bench_time_ns();
+   for (uint32_t i = 0; i < LOOKUPS; i++)
+      *sum += *(uint64_t *)_mesa_hash_table_u64_search(table, ids[i & (count - 1)]);
+   uint64_t total = bench_time_ns() - start;
+
+   _mesa_hash_table_u64_destroy(table, NULL);
+   return total;
+}
+
+int main(void)
+{
+   uint64_t sum = 0;
+
+   /* sequential ids with a random start, like fence and resource ids */
+   const uint64_t base = ((uint64_t)rand() << 32) | 1;
+   for (uint32_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+      ids[i] = base + i;
+
+   for (uint32_t count = 16; count <= sizeof(ids) / sizeof(ids[0]); count *= 16) {
+      char params[64];
+
+      snprintf(params, sizeof(params), "table=virgl_id_table,count=%u", count);
+      bench_report("id_table_lookup", params, LOOKUPS, bench_id_table(count, &sum), 0);
+
+      snprintf(params, sizeof(params), "table=hash_table_u64,count=%u", count);
+      bench_report("id_table_lookup", params, LOOKUPS, bench_hash_table_u64(count, &sum), 0);
+   }
+
+   /* keep the lookups from being optimized out */
+   return sum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_util.h"
+#include "vrend/vrend_pixel_ops.h"
+
+/* Time the pixel conversions of each implementation on a full HD frame */
+
+#define FRAME_SIZE (1920 * 1080 * 4)
+#define ITERATIONS 200
+
+typedef void (*pixel_op)(uint64_t size, void *data);
+
+static const struct {
+   const char *name;
+   pixel_op op;
+} ops[] = {
+   { "swizzle_bgra", vrend_swizzle_data_bgra },
+   { "swizzle_and_collapse_bgrx", vrend_swizzle_and_collapse_data_bgrx },
+   { "collapse_r8g8b8x8", vrend_collapse_data_r8g8b8x8 },
+   { "collapse_r16g16b16x16", vrend_collapse_data_r16g16b16x16 },
+};
+
+int main(void)
+{
+   uint8_t *src = malloc(FRAME_SIZE);
+   uint8_t *data = malloc(FRAME_SIZE);
+
+   if (!src || !data)
+      return EXIT_FAILURE;
+
+   for (uint32_t i = 0; i < FRAME_SIZE; i++)
+      src[i] = rand();
+
+   for (int impl = 0; impl < VREND_PIXEL_OPS_NUM_IMPLS; impl++) {
+      if (!vrend_pixel_ops_select(impl))
+         continue;
+
+      for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+         uint64_t total = 0;
+         char params[64];
+
+         for (int j = 0; j < ITERATIONS; j++) {
+            memcpy(data, src, FRAME_SIZE);
+            uint64_t start = bench_time_ns();
+            ops[i].op(FRAME_SIZE, data);
+            total += bench_time_ns() - start;
+         }
+
+         snprintf(params, sizeof(params), "impl=%s,op=%s",
+                  vrend_pixel_ops_impl_name(impl), ops[i].name);
+         bench_report("pixel_ops", params, ITERATIONS, total,
+                      (uint64_t)FRAME_SIZE * ITERATIONS);
+      }
+   }
+
+   free(data);
+   free(src);
+   return EXIT_SUCCESS;
+}
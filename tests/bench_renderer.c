@@ -0,0 +1,385 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <virglrenderer.h>
+
+#include "bench_util.h"
+#include "testvirgl_encode.h"
+#include "util/u_memory.h"
+#include "virgl_protocol.h"
+
+/* Time the hot paths of vrend: transfers, resource lookups, shader variant
+ * selection and fences.  Set VRENDTEST_USE_EGL_SURFACELESS and
+ * VRENDTEST_USE_EGL_GLES as for the tests.
+ */
+
+#define TRANSFER_ITERATIONS 100
+#define LOOKUP_ITERATIONS (1 << 22)
+#define SHADER_SELECT_ITERATIONS 20000
+#define FENCE_ITERATIONS 2000
+#define FENCE_BATCH_SIZE 64
+
+static void bench_transfer(struct virgl_context *ctx)
+{
+   static const int sizes[] = { 64, 256, 1024, 2048 };
+   static const int stride_paddings[] = { 0, 256 };
+   int handle = 100;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(sizes); i++) {
+      for (unsigned j = 0; j < ARRAY_SIZE(stride_paddings); j++) {
+         const int size = sizes[i];
+         const uint32_t stride = size * 4 + stride_paddings[j];
+         struct virgl_resource res;
+         char params[64];
+
+         if (testvirgl_create_backed_simple_2d_res(&res, handle, size, size))
+            continue;
+         virgl_renderer_ctx_attach_resource(ctx->ctx_id, res.handle);
+
+         struct iovec iov = {
+            .iov_len = (size_t)stride * size,
+         };
+         iov.iov_base = calloc(1, iov.iov_len);
+         struct virgl_box box = { .w = size, .h = size, .d = 1 };
+
+         snprintf(params, sizeof(params), "size=%dx%d,stride=%u", size, size, stride);
+
+         uint64_t total = 0;
+         for (int k = 0; k < TRANSFER_ITERATIONS; k++) {
+            const uint64_t start = bench_time_ns();
+            virgl_renderer_transfer_write_iov(res.handle, ctx->ctx_id, 0, stride, 0, &box,
+                                              0, &iov, 1);
+            total += bench_time_ns() - start;
+         }
+         bench_report("transfer_write_iov", params, TRANSFER_ITERATIONS, total,
+                      (uint64_t)size * size * 4 * TRANSFER_ITERATIONS);
+
+         total = 0;
+         for (int k = 0; k < TRANSFER_ITERATIONS; k++) {
+            const uint64_t start = bench_time_ns();
+            virgl_renderer_transfer_read_iov(res.handle, ctx->ctx_id, 0, stride, 0, &box,
+                                             0, &iov, 1);
+            total += bench_time_ns() - start;
+         }
+         bench_report("transfer_read_iov", params, TRANSFER_ITERATIONS, total,
+                      (uint64_t)size * size * 4 * TRANSFER_ITERATIONS);
+
+         free(iov.iov_base);
+         virgl_renderer_ctx_detach_resource(ctx->ctx_id, res.handle);
+         testvirgl_destroy_backed_res(&res);
+         handle++;
+      }
+   }
+}
+
+/* guest blobs are plain virgl_resources, without any vrend state, and
+ * virgl_renderer_resource_get_map_info does little more than the lookup
+ */
+static void bench_resource_lookup(void)
+{
+   static const uint32_t counts[] = { 16, 1024, 16384 };
+   /* above the ids used by the other benchmarks */
+   const uint32_t first_id = 1u << 20;
+   uint32_t *ids = malloc(sizeof(*ids) * LOOKUP_ITERATIONS);
+   uint32_t storage[16];
+   struct iovec iov = {
+      .iov_base = storage,
+      .iov_len = sizeof(storage),
+   };
+
+   if (!ids)
+      return;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(counts); i++) {
+      const uint32_t count = counts[i];
+      char params[64];
+
+      for (uint32_t j = 0; j < count; j++) {
+         const struct virgl_renderer_resource_create_blob_args args = {
+            .res_handle = first_id + j,
+            .blob_mem = VIRGL_RENDERER_BLOB_MEM_GUEST,
+            .size = sizeof(storage),
+            .iovecs = &iov,
+            .num_iovs = 1,
+         };
+         virgl_renderer_resource_create_blob(&args);
+      }
+
+      /* a fixed sequence, so that the runs are comparable */
+      uint32_t seed = 1;
+      for (uint32_t j = 0; j < LOOKUP_ITERATIONS; j++) {
+         seed = seed * 1103515245 + 12345;
+         ids[j] = first_id + (seed >> 8) % count;
+      }
+
+      uint32_t found = 0;
+      const uint64_t start = bench_time_ns();
+      for (uint32_t j = 0; j < LOOKUP_ITERATIONS; j++) {
+         uint32_t map_info;
+         found += !virgl_renderer_resource_get_map_info(ids[j], &map_info);
+      }
+      const uint64_t total = bench_time_ns() - start;
+
+      if (found != LOOKUP_ITERATIONS)
+         fprintf(stderr, "resource lookup failed\n");
+
+      snprintf(params, sizeof(params), "resources=%u", count);
+      bench_report("resource_lookup", params, LOOKUP_ITERATIONS, total, 0);
+
+      for (uint32_t j = 0; j < count; j++)
+         virgl_renderer_resource_unref(first_id + j);
+   }
+
+   free(ids);
+}
+
+struct vertex {
+   float position[4];
+   float color[4];
+};
+
+static const struct vertex vertices[3] = {
+   { { 0.0f, -0.9f, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f, 1.0f } },
+   { { -0.9f, 0.9f, 0.0f, 1.0f }, { 0.0f, 1.0f, 0.0f, 1.0f } },
+   { { 0.9f, 0.9f, 0.0f, 1.0f }, { 0.0f, 0.0f, 1.0f, 1.0f } },
+};
+
+/* 9 alpha test states times 4 rasterizer states select 36 fragment shader
+ * variants.  They are all compiled by a first untimed pass, the timed pass
+ * measures the selection among the cached variants and the draw.
+ */
+#define ALPHA_STATE_COUNT 9
+#define RS_STATE_COUNT 4
+
+static void bench_shader_select(struct virgl_context *ctx)
+{
+   struct virgl_resource res;
+   struct virgl_resource vbo;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   struct pipe_vertex_element ve[2];
+   struct pipe_vertex_buffer vbuf;
+   struct virgl_box box;
+   uint32_t dsa_handles[ALPHA_STATE_COUNT];
+   uint32_t rs_handles[RS_STATE_COUNT];
+   uint32_t handle = 1;
+   const int size = 64;
+   char params[64];
+
+   if (testvirgl_create_backed_simple_2d_res(&res, 1, size, size))
+      return;
+   virgl_renderer_ctx_attach_resource(ctx->ctx_id, res.handle);
+
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+   surf.handle = handle++;
+   surf.base.texture = &res.base;
+   virgl_encoder_create_surface(ctx, surf.handle, &res, &surf.base);
+
+   memset(&fb_state, 0, sizeof(fb_state));
+   fb_state.nr_cbufs = 1;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(ctx, &fb_state);
+
+   const uint32_t ve_handle = handle++;
+   memset(ve, 0, sizeof(ve));
+   ve[0].src_offset = offsetof(struct vertex, position);
+   ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   ve[1].src_offset = offsetof(struct vertex, color);
+   ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   virgl_encoder_create_vertex_elements(ctx, ve_handle, 2, ve);
+   virgl_encode_bind_object(ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+
+   if (testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices),
+                                             PIPE_BIND_VERTEX_BUFFER)) {
+      virgl_renderer_ctx_detach_resource(ctx->ctx_id, res.handle);
+      testvirgl_destroy_backed_res(&res);
+      return;
+   }
+   virgl_renderer_ctx_attach_resource(ctx->ctx_id, vbo.handle);
+
+   memset(&box, 0, sizeof(box));
+   box.w = sizeof(vertices);
+   box.h = 1;
+   box.d = 1;
+   virgl_encoder_inline_write(ctx, &vbo, 0, 0, (struct pipe_box *)&box, vertices, box.w,
+                              0);
+
+   vbuf.stride = sizeof(struct vertex);
+   vbuf.buffer_offset = 0;
+   vbuf.buffer = &vbo.base;
+   virgl_encoder_set_vertex_buffers(ctx, 1, &vbuf);
+
+   {
+      struct pipe_shader_state vs;
+      const char *text =
+         "VERT\n"
+         "DCL IN[0]\n"
+         "DCL IN[1]\n"
+         "DCL OUT[0], POSITION\n"
+         "DCL OUT[1], COLOR\n"
+         "  0: MOV OUT[1], IN[1]\n"
+         "  1: MOV OUT[0], IN[0]\n"
+         "  2: END\n";
+      memset(&vs, 0, sizeof(vs));
+      const uint32_t vs_handle = handle++;
+      virgl_encode_shader_state(ctx, vs_handle, PIPE_SHADER_VERTEX, &vs, text);
+      virgl_encode_bind_shader(ctx, vs_handle, PIPE_SHADER_VERTEX);
+   }
+
+   {
+      struct pipe_shader_state fs;
+      const char *text =
+         "FRAG\n"
+         "DCL IN[0], COLOR, LINEAR\n"
+         "DCL OUT[0], COLOR\n"
+         "  0: MOV OUT[0], IN[0]\n"
+         "  1: END\n";
+      memset(&fs, 0, sizeof(fs));
+      const uint32_t fs_handle = handle++;
+      virgl_encode_shader_state(ctx, fs_handle, PIPE_SHADER_FRAGMENT, &fs, text);
+      virgl_encode_bind_shader(ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+   }
+
+   {
+      struct pipe_blend_state blend;
+      const uint32_t blend_handle = handle++;
+      memset(&blend, 0, sizeof(blend));
+      blend.rt[0].colormask = PIPE_MASK_RGBA;
+      virgl_encode_blend_state(ctx, blend_handle, &blend);
+      virgl_encode_bind_object(ctx, blend_handle, VIRGL_OBJECT_BLEND);
+   }
+
+   for (uint32_t i = 0; i < ALPHA_STATE_COUNT; i++) {
+      struct pipe_depth_stencil_alpha_state dsa;
+      memset(&dsa, 0, sizeof(dsa));
+      /* the first state disables the alpha test */
+      dsa.alpha.enabled = i > 0;
+      dsa.alpha.func = i > 0 ? i - 1 : 0;
+      dsa.alpha.ref_value = 0.5f;
+      dsa_handles[i] = handle++;
+      virgl_encode_dsa_state(ctx, dsa_handles[i], &dsa);
+   }
+
+   for (uint32_t i = 0; i < RS_STATE_COUNT; i++) {
+      struct pipe_rasterizer_state rasterizer;
+      memset(&rasterizer, 0, sizeof(rasterizer));
+      rasterizer.cull_face = PIPE_FACE_NONE;
+      rasterizer.half_pixel_center = 1;
+      rasterizer.bottom_edge_rule = 1;
+      rasterizer.depth_clip = 1;
+      rasterizer.flatshade = i & 1;
+      rasterizer.light_twoside = (i >> 1) & 1;
+      rs_handles[i] = handle++;
+      virgl_encode_rasterizer_state(ctx, rs_handles[i], &rasterizer);
+   }
+
+   {
+      struct pipe_viewport_state vp;
+      vp.scale[0] = size / 2.0f;
+      vp.scale[1] = size / 2.0f;
+      vp.scale[2] = 0.5f;
+      vp.translate[0] = size / 2.0f;
+      vp.translate[1] = size / 2.0f;
+      vp.translate[2] = 0.5f;
+      virgl_encoder_set_viewport_states(ctx, 0, 1, &vp);
+   }
+
+   testvirgl_ctx_send_cmdbuf(ctx);
+
+   struct pipe_draw_info info;
+   memset(&info, 0, sizeof(info));
+   info.count = 3;
+   info.mode = PIPE_PRIM_TRIANGLES;
+
+   uint64_t total = 0;
+   for (int pass = 0; pass < 2; pass++) {
+      const int count =
+         pass ? SHADER_SELECT_ITERATIONS : ALPHA_STATE_COUNT * RS_STATE_COUNT;
+
+      for (int i = 0; i < count; i++) {
+         virgl_encode_bind_object(ctx, dsa_handles[i % ALPHA_STATE_COUNT],
+                                  VIRGL_OBJECT_DSA);
+         const uint32_t rs = (i / ALPHA_STATE_COUNT) % RS_STATE_COUNT;
+         virgl_encode_bind_object(ctx, rs_handles[rs], VIRGL_OBJECT_RASTERIZER);
+         virgl_encoder_draw_vbo(ctx, &info);
+
+         /* submit in batches well within the command buffer */
+         if (ctx->cbuf->cdw > VIRGL_MAX_CMDBUF_DWORDS / 2 || i == count - 1) {
+            const uint64_t start = bench_time_ns();
+            testvirgl_ctx_send_cmdbuf(ctx);
+            if (pass)
+               total += bench_time_ns() - start;
+         }
+      }
+   }
+
+   snprintf(params, sizeof(params), "variants=%d", ALPHA_STATE_COUNT * RS_STATE_COUNT);
+   bench_report("shader_select_draw", params, SHADER_SELECT_ITERATIONS, total, 0);
+
+   virgl_renderer_ctx_detach_resource(ctx->ctx_id, vbo.handle);
+   testvirgl_destroy_backed_res(&vbo);
+   virgl_renderer_ctx_detach_resource(ctx->ctx_id, res.handle);
+   testvirgl_destroy_backed_res(&res);
+}
+
+static void bench_wait_fence(uint32_t fence_id)
+{
+   while (testvirgl_get_last_fence() < fence_id)
+      virgl_renderer_poll();
+}
+
+static void bench_fence(struct virgl_context *ctx)
+{
+   char params[64];
+   uint32_t fence_id = 0;
+
+   testvirgl_reset_fence();
+
+   uint64_t start = bench_time_ns();
+   for (int i = 0; i < FENCE_ITERATIONS; i++) {
+      virgl_renderer_create_fence(++fence_id, ctx->ctx_id);
+      bench_wait_fence(fence_id);
+   }
+   bench_report("fence_create_retire", "batch=1", FENCE_ITERATIONS,
+                bench_time_ns() - start, 0);
+
+   start = bench_time_ns();
+   for (int i = 0; i < FENCE_ITERATIONS / FENCE_BATCH_SIZE; i++) {
+      for (int j = 0; j < FENCE_BATCH_SIZE; j++)
+         virgl_renderer_create_fence(++fence_id, ctx->ctx_id);
+      bench_wait_fence(fence_id);
+   }
+   snprintf(params, sizeof(params), "batch=%d", FENCE_BATCH_SIZE);
+   bench_report("fence_create_retire", params,
+                FENCE_ITERATIONS / FENCE_BATCH_SIZE * FENCE_BATCH_SIZE,
+                bench_time_ns() - start, 0);
+}
+
+int main(void)
+{
+   struct virgl_context ctx;
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   if (testvirgl_init_ctx_cmdbuf(&ctx, context_flags)) {
+      fprintf(stderr, "failed to initialize the renderer\n");
+      return EXIT_FAILURE;
+   }
+
+   bench_transfer(&ctx);
+   bench_resource_lookup();
+   bench_shader_select(&ctx);
+   bench_fence(&ctx);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+   return EXIT_SUCCESS;
+}
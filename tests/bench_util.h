@@ -0,0 +1,38 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Each result is printed as one JSON object per line, so that the output of
+ * "meson test --benchmark" can be collected and compared across commits.
+ */
+
+static inline uint64_t bench_time_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* bytes is the data processed by all the iterations, or 0 */
+static inline void bench_report(const char *name, const char *params, uint64_t iterations,
+                                uint64_t total_ns, uint64_t bytes)
+{
+   const double ns_per_iter = iterations ? (double)total_ns / iterations : 0.0;
+
+   printf("{\"benchmark\": \"%s\", \"params\": \"%s\", \"iterations\": %" PRIu64
+          ", \"ns_per_iter\": %.1f",
+          name, params ? params : "", iterations, ns_per_iter);
+   if (bytes && total_ns)
+      printf(", \"mib_per_s\": %.2f", bytes * 1e9 / total_ns / (1024.0 * 1024.0));
+   printf("}\n");
+   fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "vkr_context.h"
+#include "vkr_cs.h"
+
+/* Decode synthetic command streams the way the generated decoders do: a
+ * command header, a command buffer handle and an array of buffer handles,
+ * which are looked up and copied to the temp pool.
+ */
+
+#define STREAM_SIZE (1024 * 1024)
+#define STREAM_PASSES 64
+#define BUFFER_COUNT 1024
+#define COMMAND_BUFFER_ID 1
+#define FIRST_BUFFER_ID 2
+
+static bool bench_insert_object(struct vkr_context *ctx, VkObjectType type,
+                                vkr_object_id id)
+{
+   struct vkr_object *obj = calloc(1, sizeof(*obj));
+   if (!obj)
+      return false;
+   obj->type = type;
+   obj->id = id;
+   obj->handle.u64 = id;
+
+   mtx_lock(&ctx->object_table.mutex);
+   const bool ok = vkr_object_table_insert_locked(&ctx->object_table, obj);
+   mtx_unlock(&ctx->object_table.mutex);
+
+   if (!ok)
+      free(obj);
+   return ok;
+}
+
+/* returns the stream size */
+static size_t bench_fill_stream(uint8_t *stream, uint64_t buffer_count)
+{
+   const size_t cmd_size = 4 + 4 + 8 + 8 + 8 * buffer_count;
+   uint8_t *cur = stream;
+   uint32_t next_buffer = 0;
+
+   while ((size_t)(cur - stream) + cmd_size <= STREAM_SIZE) {
+      const uint32_t cmd_type = 1;
+      const uint32_t cmd_flags = 0;
+      const uint64_t cmd_buffer_id = COMMAND_BUFFER_ID;
+
+      memcpy(cur, &cmd_type, 4);
+      memcpy(cur + 4, &cmd_flags, 4);
+      memcpy(cur + 8, &cmd_buffer_id, 8);
+      memcpy(cur + 16, &buffer_count, 8);
+      cur += 24;
+
+      for (uint64_t i = 0; i < buffer_count; i++) {
+         const uint64_t id = FIRST_BUFFER_ID + next_buffer;
+         next_buffer = (next_buffer + 1) % BUFFER_COUNT;
+         memcpy(cur, &id, 8);
+         cur += 8;
+      }
+   }
+
+   return cur - stream;
+}
+
+static uint64_t bench_decode_stream(struct vkr_cs_decoder *dec)
+{
+   uint64_t checksum = 0;
+
+   while (vkr_cs_decoder_has_command(dec)) {
+      uint32_t cmd_type;
+      uint32_t cmd_flags;
+      uint64_t id;
+      uint64_t count;
+
+      vkr_cs_decoder_read(dec, 4, &cmd_type, sizeof(cmd_type));
+      vkr_cs_decoder_read(dec, 4, &cmd_flags, sizeof(cmd_flags));
+      vkr_cs_decoder_read(dec, 8, &id, sizeof(id));
+      struct vkr_object *cmd_buffer =
+         vkr_cs_decoder_lookup_object(dec, id, VK_OBJECT_TYPE_COMMAND_BUFFER);
+      vkr_cs_decoder_read(dec, 8, &count, sizeof(count));
+
+      VkBuffer *buffers = vkr_cs_decoder_alloc_temp_array(dec, sizeof(*buffers), count);
+      if (!buffers || !cmd_buffer)
+         break;
+
+      for (uint64_t i = 0; i < count; i++) {
+         vkr_cs_decoder_read(dec, 8, &id, sizeof(id));
+         struct vkr_object *buffer =
+            vkr_cs_decoder_lookup_object(dec, id, VK_OBJECT_TYPE_BUFFER);
+         buffers[i] = buffer ? buffer->handle.buffer : VK_NULL_HANDLE;
+      }
+
+      if (vkr_cs_decoder_get_fatal(dec))
+         break;
+
+      checksum += (uint64_t)buffers[count - 1];
+      vkr_cs_decoder_reset_temp_pool(dec);
+   }
+
+   return checksum;
+}
+
+int main(void)
+{
+   static const uint64_t buffer_counts[] = { 1, 16, 256 };
+   static struct vkr_context ctx;
+   struct vkr_cs_decoder dec;
+   int ret = EXIT_FAILURE;
+
+   uint8_t *stream = malloc(STREAM_SIZE);
+   if (!stream)
+      return EXIT_FAILURE;
+
+   if (!vkr_object_table_init(&ctx.object_table)) {
+      free(stream);
+      return EXIT_FAILURE;
+   }
+
+   if (!bench_insert_object(&ctx, VK_OBJECT_TYPE_COMMAND_BUFFER, COMMAND_BUFFER_ID))
+      goto out_table;
+   for (uint32_t i = 0; i < BUFFER_COUNT; i++) {
+      if (!bench_insert_object(&ctx, VK_OBJECT_TYPE_BUFFER, FIRST_BUFFER_ID + i))
+         goto out_table;
+   }
+
+   if (vkr_cs_decoder_init(&dec, &ctx))
+      goto out_table;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(buffer_counts); i++) {
+      const size_t size = bench_fill_stream(stream, buffer_counts[i]);
+      uint64_t checksum = 0;
+      char params[64];
+
+      const uint64_t start = bench_time_ns();
+      for (int pass = 0; pass < STREAM_PASSES; pass++) {
+         vkr_cs_decoder_set_buffer_stream(&dec, stream, size);
+         checksum += bench_decode_stream(&dec);
+      }
+      const uint64_t total = bench_time_ns() - start;
+
+      if (vkr_cs_decoder_get_fatal(&dec) || !checksum) {
+         fprintf(stderr, "failed to decode the stream\n");
+         goto out_decoder;
+      }
+
+      snprintf(params, sizeof(params), "handles_per_command=%" PRIu64, buffer_counts[i]);
+      bench_report("vkr_cs_decode", params, STREAM_PASSES, total,
+                   (uint64_t)size * STREAM_PASSES);
+   }
+
+   ret = EXIT_SUCCESS;
+
+out_decoder:
+   vkr_cs_decoder_fini(&dec);
+out_table:
+   vkr_object_table_fini(&ctx.object_table);
+   free(stream);
+   return ret;
+}
@@ -81,10 +81,20 @@ fuzz_context_create(UNUSED struct fuzz_renderer *renderer)
    return ctx_id;
 }
 
+/* The renderer stays initialized for all the inputs, so an input must not
+ * leave anything behind for the next ones to run into.
+ */
 static void
 fuzz_context_destroy(UNUSED struct fuzz_renderer *renderer, uint32_t ctx_id)
 {
+   struct virgl_renderer_stats stats = { .version = VIRGL_RENDERER_STATS_VERSION };
+
+   virgl_renderer_resource_unref(1);
    virgl_renderer_context_destroy(ctx_id);
+
+   virgl_renderer_get_stats(&stats);
+   if (stats.context_count || stats.resource_count)
+      abort();
 }
 
 static void
@@ -108,6 +108,13 @@ static struct virgl_renderer_callbacks fuzzer_cbs = {
 
 static bool initialized = false;
 
+// With VIRGL_FUZZER_PERSISTENT set in the environment, the renderer stays
+// initialized and is reset between the inputs, instead of paying for the GL
+// initialization and the caps probing of each input.  CLEANUP_EACH_INPUT is
+// ignored then.
+static bool persistent = false;
+static bool renderer_initialized = false;
+
 static int initialize_environment(void)
 {
    if (!initialized) {
@@ -142,6 +149,7 @@ static int initialize_environment(void)
                           cookie.ctx);
       assert(ok);
 
+      persistent = getenv("VIRGL_FUZZER_PERSISTENT") != NULL;
       initialized = true;
    }
 
@@ -173,8 +181,11 @@ static uint32_t fuzz_mode_init(void) {
    // resources that comes with repeated dlopen()/dlclose()ing the mesa
    // driver with each eglInitialize()/eglTerminate() if CLEANUP_EACH_INPUT
    // is set.
-   ret = virgl_renderer_init(&cookie, 0, &fuzzer_cbs);
-   assert(!ret);
+   if (!renderer_initialized) {
+      ret = virgl_renderer_init(&cookie, 0, &fuzzer_cbs);
+      assert(!ret);
+      renderer_initialized = true;
+   }
 
    const char *name = "fuzzctx";
    ret = virgl_renderer_context_create(ctx_id, strlen(name), name);
@@ -184,10 +195,28 @@ static uint32_t fuzz_mode_init(void) {
 }
 
 
+// Once the inputs destroyed what they created, nothing may be left for the
+// next inputs to run into.
+static void check_no_leaks(void)
+{
+   struct virgl_renderer_stats stats = { .version = VIRGL_RENDERER_STATS_VERSION };
+
+   virgl_renderer_get_stats(&stats);
+   if (stats.context_count || stats.resource_count)
+      abort();
+}
+
 static void fuzz_mode_fini(uint32_t ctx_id) {
    virgl_renderer_context_destroy(ctx_id);
 
+   if (persistent) {
+      check_no_leaks();
+      virgl_renderer_reset();
+      return;
+   }
+
    virgl_renderer_cleanup(&cookie);
+   renderer_initialized = false;
 
 #ifdef CLEANUP_EACH_INPUT
    // The following cleans up between each input which is a lot slower.
@@ -226,6 +255,9 @@ static void FuzzMode1(const uint8_t* data, size_t size)
 
    virgl_renderer_submit_cmd((void *)data, ctx_id, size / sizeof(uint32_t));
 
+   virgl_renderer_ctx_detach_resource(ctx_id, args.handle);
+   virgl_renderer_resource_unref(args.handle);
+
    fuzz_mode_fini(ctx_id);
 }
 
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vrend/vrend_etc2.h"
+
+/* Decode hand-encoded blocks of each ETC2/EAC mode */
+
+static void decode_block(enum virgl_formats format, const uint8_t *block,
+                         uint32_t width, uint32_t height, uint8_t *texels)
+{
+   ck_assert(vrend_etc2_is_supported(format));
+   vrend_etc2_decode(format, block, width, height, 1, texels);
+}
+
+static void check_rgba(const uint8_t *texels, uint32_t width, uint32_t x, uint32_t y,
+                       uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+   const uint8_t *texel = texels + (y * width + x) * 4;
+   ck_assert_msg(texel[0] == r && texel[1] == g && texel[2] == b && texel[3] == a,
+                 "texel %u,%u is %02x%02x%02x%02x", x, y,
+                 texel[0], texel[1], texel[2], texel[3]);
+}
+
+START_TEST(etc2_individual)
+{
+   /* the subblocks side by side, the texel 1,2 uses the modifier -2 */
+   const uint8_t block[8] = { 0x12, 0x34, 0x56, 0x00, 0x00, 0x40, 0x00, 0x00 };
+   uint8_t texels[16 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_RGB8, block, 4, 4, texels);
+   check_rgba(texels, 4, 0, 0, 0x13, 0x35, 0x57, 0xff);
+   check_rgba(texels, 4, 1, 2, 0x0f, 0x31, 0x53, 0xff);
+   check_rgba(texels, 4, 3, 3, 0x24, 0x46, 0x68, 0xff);
+}
+END_TEST
+
+START_TEST(etc2_t_mode)
+{
+   /* the red overflow selects the T mode, the texel 0,0 uses the index 1 */
+   const uint8_t block[8] = { 0x07, 0x00, 0x80, 0x02, 0x00, 0x00, 0x00, 0x01 };
+   uint8_t texels[16 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_RGB8, block, 4, 4, texels);
+   check_rgba(texels, 4, 0, 0, 0x8b, 0x03, 0x03, 0xff);
+   check_rgba(texels, 4, 2, 1, 0x33, 0x00, 0x00, 0xff);
+}
+END_TEST
+
+START_TEST(etc2_planar)
+{
+   /* the blue overflow selects the planar mode, blue grows vertically */
+   const uint8_t block[8] = { 0x00, 0x00, 0x04, 0x02, 0x00, 0x00, 0x00, 0x3f };
+   uint8_t texels[16 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_RGB8, block, 4, 4, texels);
+   check_rgba(texels, 4, 3, 0, 0x00, 0x00, 0x00, 0xff);
+   check_rgba(texels, 4, 0, 1, 0x00, 0x00, 0x40, 0xff);
+   check_rgba(texels, 4, 2, 3, 0x00, 0x00, 0xbf, 0xff);
+}
+END_TEST
+
+START_TEST(etc2_punchthrough)
+{
+   /* without the opaque bit, the index 2 is transparent */
+   const uint8_t block[8] = { 0x80, 0x80, 0x80, 0x00, 0x00, 0x01, 0x00, 0x00 };
+   uint8_t texels[16 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_RGB8A1, block, 4, 4, texels);
+   check_rgba(texels, 4, 0, 0, 0x00, 0x00, 0x00, 0x00);
+   check_rgba(texels, 4, 1, 0, 0x84, 0x84, 0x84, 0xff);
+}
+END_TEST
+
+START_TEST(etc2_partial_block)
+{
+   const uint8_t block[8] = { 0x12, 0x34, 0x56, 0x00, 0x00, 0x40, 0x00, 0x00 };
+   uint8_t texels[3 * 3 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_SRGB8, block, 3, 3, texels);
+   check_rgba(texels, 3, 1, 2, 0x0f, 0x31, 0x53, 0xff);
+   check_rgba(texels, 3, 2, 2, 0x24, 0x46, 0x68, 0xff);
+}
+END_TEST
+
+START_TEST(eac_alpha)
+{
+   /* alpha 0x40 with the multiplier 2 and the modifier 14 */
+   const uint8_t block[16] = { 0x40, 0x20, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                               0x12, 0x34, 0x56, 0x00, 0x00, 0x00, 0x00, 0x00 };
+   uint8_t texels[16 * 4];
+
+   decode_block(VIRGL_FORMAT_ETC2_RGBA8, block, 4, 4, texels);
+   check_rgba(texels, 4, 3, 3, 0x24, 0x46, 0x68, 0x5c);
+}
+END_TEST
+
+START_TEST(eac_r11)
+{
+   const uint8_t unorm[8] = { 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+   const uint8_t snorm[8] = { 0x80, 0x1d, 0x92, 0x49, 0x24, 0x92, 0x49, 0x24 };
+   uint16_t texels[16];
+
+   /* 128 * 8 + 4 - 3, without multiplier */
+   decode_block(VIRGL_FORMAT_ETC2_R11_UNORM, unorm, 4, 4, (uint8_t *)texels);
+   ck_assert_uint_eq(texels[5], (1025 << 5) | (1025 >> 6));
+
+   /* -128 is clamped to -127, the modifier is 0 */
+   decode_block(VIRGL_FORMAT_ETC2_R11_SNORM, snorm, 4, 4, (uint8_t *)texels);
+   ck_assert_int_eq((int16_t)texels[9], -((1016 << 5) | (1016 >> 5)));
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vrend_etc2");
+  tc_core = tcase_create("etc2");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, etc2_individual);
+  tcase_add_test(tc_core, etc2_t_mode);
+  tcase_add_test(tc_core, etc2_planar);
+  tcase_add_test(tc_core, etc2_punchthrough);
+  tcase_add_test(tc_core, etc2_partial_block);
+  tcase_add_test(tc_core, eac_alpha);
+  tcase_add_test(tc_core, eac_r11);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include "virgl_id_table.h"
+
+/* The values are the addresses of the ids in this array */
+static uint64_t ids[4096];
+
+static void *value_of(uint32_t i)
+{
+   return &ids[i];
+}
+
+START_TEST(id_table_insert_search)
+{
+   struct virgl_id_table table;
+
+   ck_assert(virgl_id_table_init(&table));
+
+   /* ids that collide in the low bits, and the ids 0 and UINT64_MAX */
+   for (uint32_t i = 0; i < 4096; i++) {
+      ids[i] = i ? (uint64_t)i << 32 : 0;
+      if (i == 4095)
+         ids[i] = UINT64_MAX;
+      ck_assert(virgl_id_table_insert(&table, ids[i], value_of(i)));
+   }
+   ck_assert_uint_eq(table.count, 4096);
+
+   for (uint32_t i = 0; i < 4096; i++)
+      ck_assert_ptr_eq(virgl_id_table_search(&table, ids[i]), value_of(i));
+   ck_assert_ptr_null(virgl_id_table_search(&table, 1));
+
+   /* replacing a value does not add an entry */
+   ck_assert(virgl_id_table_insert(&table, ids[7], value_of(8)));
+   ck_assert_ptr_eq(virgl_id_table_search(&table, ids[7]), value_of(8));
+   ck_assert_uint_eq(table.count, 4096);
+
+   virgl_id_table_fini(&table);
+}
+END_TEST
+
+START_TEST(id_table_remove)
+{
+   struct virgl_id_table table;
+
+   ck_assert(virgl_id_table_init(&table));
+
+   for (uint32_t i = 0; i < 4096; i++) {
+      ids[i] = i * 7;
+      ck_assert(virgl_id_table_insert(&table, ids[i], value_of(i)));
+   }
+
+   /* the remaining ids are still found after the runs were shifted back */
+   for (uint32_t i = 0; i < 4096; i += 3)
+      ck_assert_ptr_eq(virgl_id_table_remove(&table, ids[i]), value_of(i));
+   ck_assert_ptr_null(virgl_id_table_remove(&table, ids[0]));
+
+   for (uint32_t i = 0; i < 4096; i++) {
+      ck_assert_ptr_eq(virgl_id_table_search(&table, ids[i]),
+                       i % 3 ? value_of(i) : NULL);
+   }
+
+   uint32_t count = 0;
+   virgl_id_table_foreach(&table, slot) {
+      ck_assert_ptr_eq(slot->value, value_of(slot->id / 7));
+      count++;
+   }
+   ck_assert_uint_eq(count, table.count);
+
+   virgl_id_table_clear(&table);
+   ck_assert_uint_eq(table.count, 0);
+   ck_assert_ptr_null(virgl_id_table_search(&table, ids[1]));
+
+   virgl_id_table_fini(&table);
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("virgl_id_table");
+  tc_core = tcase_create("id_table");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, id_table_insert_search);
+  tcase_add_test(tc_core, id_table_remove);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/macros.h"
+#include "vrend/vrend_iov.h"
+
+/* The iovecs split TOTAL_SIZE bytes in entries of uneven sizes, some of them
+ * empty, and are compared against the same bytes in one flat buffer.  The
+ * entries are GUARD_SIZE bytes apart, so accesses that run past the end of
+ * an entry are caught. */
+
+#define TOTAL_SIZE 4096
+#define MAX_ENTRIES 64
+#define GUARD_SIZE 8
+#define GUARD_VALUE 0x5a
+
+static const size_t entry_sizes[] = { 1, 0, 7, 64, 3, 0, 0, 250, 129, 1000, 5 };
+
+struct split_iov {
+   struct iovec iov[MAX_ENTRIES];
+   int iovlen;
+   char storage[TOTAL_SIZE + MAX_ENTRIES * GUARD_SIZE];
+   char flat[TOTAL_SIZE];
+};
+
+static void split_iov_init(struct split_iov *split)
+{
+   char *ptr = split->storage;
+   size_t offset = 0;
+
+   memset(split->storage, GUARD_VALUE, sizeof(split->storage));
+
+   split->iovlen = 0;
+   for (uint32_t i = 0; offset < TOTAL_SIZE; i++) {
+      size_t len = entry_sizes[i % ARRAY_SIZE(entry_sizes)];
+
+      if (len > TOTAL_SIZE - offset)
+         len = TOTAL_SIZE - offset;
+
+      ck_assert_int_lt(split->iovlen, MAX_ENTRIES);
+      split->iov[split->iovlen].iov_base = ptr;
+      split->iov[split->iovlen].iov_len = len;
+      split->iovlen++;
+
+      for (size_t j = 0; j < len; j++)
+         ptr[j] = (char)((offset + j) * 7 + 3);
+
+      ptr += len + GUARD_SIZE;
+      offset += len;
+   }
+}
+
+/* gathers the entries into flat, after checking that the guards between
+ * them are untouched */
+static const char *split_iov_flat(struct split_iov *split)
+{
+   size_t offset = 0;
+
+   for (int i = 0; i < split->iovlen; i++) {
+      const char *base = split->iov[i].iov_base;
+      const size_t len = split->iov[i].iov_len;
+
+      for (size_t j = 0; j < GUARD_SIZE; j++)
+         ck_assert_int_eq(base[len + j], GUARD_VALUE);
+
+      memcpy(split->flat + offset, base, len);
+      offset += len;
+   }
+
+   return split->flat;
+}
+
+static void check_cursor(bool with_offsets)
+{
+   static struct split_iov split;
+   struct vrend_iov_cursor cursor;
+   char buf[TOTAL_SIZE];
+
+   split_iov_init(&split);
+   size_t *offsets = with_offsets ?
+                     vrend_iovec_build_offsets(split.iov, split.iovlen) : NULL;
+   ck_assert(!with_offsets || offsets);
+   vrend_iov_cursor_init(&cursor, split.iov, split.iovlen, offsets);
+
+   /* forward reads that start and end inside different entries */
+   for (size_t offset = 0; offset < TOTAL_SIZE; offset += 37) {
+      size_t count = MIN2(300, TOTAL_SIZE - offset);
+      ck_assert_uint_eq(vrend_iov_cursor_read(&cursor, offset, buf, count), count);
+      ck_assert(!memcmp(buf, split_iov_flat(&split) + offset, count));
+   }
+
+   /* backwards, which restarts or searches */
+   for (size_t i = 0; i < TOTAL_SIZE / 113; i++) {
+      size_t offset = TOTAL_SIZE - 1 - i * 113;
+      size_t count = MIN2(77, TOTAL_SIZE - offset);
+      ck_assert_uint_eq(vrend_iov_cursor_read(&cursor, offset, buf, count), count);
+      ck_assert(!memcmp(buf, split_iov_flat(&split) + offset, count));
+   }
+
+   /* reads past the end are short, reads from there copy nothing */
+   ck_assert_uint_eq(vrend_iov_cursor_read(&cursor, TOTAL_SIZE - 10, buf, 100), 10);
+   ck_assert(!memcmp(buf, split_iov_flat(&split) + TOTAL_SIZE - 10, 10));
+   ck_assert_uint_eq(vrend_iov_cursor_read(&cursor, TOTAL_SIZE, buf, 1), 0);
+   ck_assert_uint_eq(vrend_iov_cursor_read(&cursor, 0, buf, 0), 0);
+
+   /* writes land in the right entries and leave the bytes around them */
+   char expected[TOTAL_SIZE];
+   memcpy(expected, split_iov_flat(&split), TOTAL_SIZE);
+   for (size_t i = 0; i < 600; i++)
+      buf[i] = (char)~i;
+   ck_assert_uint_eq(vrend_iov_cursor_write(&cursor, 70, buf, 600), 600);
+   memcpy(expected + 70, buf, 600);
+   ck_assert(!memcmp(expected, split_iov_flat(&split), TOTAL_SIZE));
+
+   free(offsets);
+}
+
+START_TEST(iov_cursor_walk)
+{
+   check_cursor(false);
+}
+END_TEST
+
+START_TEST(iov_cursor_offsets)
+{
+   check_cursor(true);
+}
+END_TEST
+
+/* The rows of the box as a plain loop over the flat buffer */
+static void copy_box_reference(char *flat, size_t offset, char *buf,
+                               size_t row_size, uint32_t rows, size_t stride,
+                               uint32_t layers, size_t layer_stride,
+                               bool invert, bool to_iov)
+{
+   for (uint32_t d = 0; d < layers; d++) {
+      for (uint32_t h = 0; h < rows; h++) {
+         char *iov_row = flat + offset + d * layer_stride + h * stride;
+         char *buf_row = buf + (d * rows + (invert ? rows - 1 - h : h)) * row_size;
+
+         if (to_iov)
+            memcpy(iov_row, buf_row, row_size);
+         else
+            memcpy(buf_row, iov_row, row_size);
+      }
+   }
+}
+
+struct box {
+   size_t offset;
+   size_t row_size;
+   uint32_t rows;
+   size_t stride;
+   uint32_t layers;
+   size_t layer_stride;
+};
+
+static const struct box boxes[] = {
+   /* contiguous, copied at once across many entries */
+   { 5, 64, 16, 64, 1, 0 },
+   { 0, 32, 8, 32, 3, 256 },
+   /* rows that straddle entries */
+   { 3, 20, 30, 50, 1, 0 },
+   { 60, 129, 9, 131, 2, 1400 },
+   /* rows smaller than the entries, most of them inside one */
+   { 100, 4, 60, 16, 3, 1300 },
+   /* a single byte wide column */
+   { 1, 1, 200, 17, 1, 0 },
+};
+
+static void check_copy_box(bool with_offsets, bool invert, bool to_iov)
+{
+   static struct split_iov split;
+   static char reference[TOTAL_SIZE];
+   static char buf[TOTAL_SIZE], expected_buf[TOTAL_SIZE];
+
+   for (uint32_t b = 0; b < ARRAY_SIZE(boxes); b++) {
+      const struct box *box = &boxes[b];
+      const size_t size = box->row_size * box->rows * box->layers;
+
+      split_iov_init(&split);
+      memcpy(reference, split_iov_flat(&split), TOTAL_SIZE);
+      size_t *offsets = with_offsets ?
+                        vrend_iovec_build_offsets(split.iov, split.iovlen) : NULL;
+
+      for (size_t i = 0; i < size; i++)
+         buf[i] = expected_buf[i] = (char)(i * 13 + b);
+
+      copy_box_reference(reference, box->offset, expected_buf, box->row_size,
+                         box->rows, box->stride, box->layers, box->layer_stride,
+                         invert, to_iov);
+      size_t copied = vrend_iov_copy_box(split.iov, split.iovlen, offsets,
+                                         box->offset, buf, box->row_size,
+                                         box->rows, box->stride, box->layers,
+                                         box->layer_stride, invert, to_iov);
+
+      ck_assert_uint_eq(copied, size);
+      ck_assert_msg(!memcmp(split_iov_flat(&split), reference, TOTAL_SIZE),
+                    "iovec differs for box %u", b);
+      ck_assert_msg(!memcmp(buf, expected_buf, size), "buffer differs for box %u", b);
+
+      free(offsets);
+   }
+}
+
+START_TEST(iov_copy_box_read)
+{
+   check_copy_box(false, false, false);
+   check_copy_box(true, false, false);
+}
+END_TEST
+
+START_TEST(iov_copy_box_write)
+{
+   check_copy_box(false, false, true);
+   check_copy_box(true, false, true);
+}
+END_TEST
+
+START_TEST(iov_copy_box_invert)
+{
+   check_copy_box(false, true, false);
+   check_copy_box(true, true, true);
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("virgl_iov");
+  tc_core = tcase_create("iov");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, iov_cursor_walk);
+  tcase_add_test(tc_core, iov_cursor_offsets);
+  tcase_add_test(tc_core, iov_copy_box_read);
+  tcase_add_test(tc_core, iov_copy_box_write);
+  tcase_add_test(tc_core, iov_copy_box_invert);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vrend/vrend_pixel_ops.h"
+
+/* Compare the vectorized pixel conversions against the scalar ones */
+
+#define MAX_TEST_SIZE 1031
+
+typedef void (*pixel_op)(uint64_t size, void *data);
+
+static void check_op(int impl, pixel_op op, uint32_t in_bpp, uint32_t out_bpp)
+{
+   uint8_t src[MAX_TEST_SIZE], expected[MAX_TEST_SIZE], result[MAX_TEST_SIZE];
+
+   if (!vrend_pixel_ops_select(impl))
+      return;
+
+   for (uint32_t i = 0; i < MAX_TEST_SIZE; i++)
+      src[i] = rand();
+
+   /* odd sizes exercise the scalar tails */
+   for (uint32_t size = 0; size <= MAX_TEST_SIZE; size++) {
+      uint32_t valid = size / in_bpp * out_bpp;
+
+      memcpy(expected, src, size);
+      ck_assert(vrend_pixel_ops_select(VREND_PIXEL_OPS_SCALAR));
+      op(size, expected);
+
+      memcpy(result, src, size);
+      ck_assert(vrend_pixel_ops_select(impl));
+      op(size, result);
+
+      ck_assert_msg(!memcmp(expected, result, valid), "%s differs for size %u",
+                    vrend_pixel_ops_impl_name(impl), size);
+   }
+}
+
+START_TEST(pixel_ops_swizzle_bgra)
+{
+   check_op(_i, vrend_swizzle_data_bgra, 4, 4);
+}
+END_TEST
+
+START_TEST(pixel_ops_swizzle_and_collapse_bgrx)
+{
+   check_op(_i, vrend_swizzle_and_collapse_data_bgrx, 4, 3);
+}
+END_TEST
+
+START_TEST(pixel_ops_collapse_r8g8b8x8)
+{
+   check_op(_i, vrend_collapse_data_r8g8b8x8, 4, 3);
+}
+END_TEST
+
+START_TEST(pixel_ops_collapse_r16g16b16x16)
+{
+   check_op(_i, vrend_collapse_data_r16g16b16x16, 8, 6);
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vrend_pixel_ops");
+  tc_core = tcase_create("pixel_ops");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_loop_test(tc_core, pixel_ops_swizzle_bgra, 1, VREND_PIXEL_OPS_NUM_IMPLS);
+  tcase_add_loop_test(tc_core, pixel_ops_swizzle_and_collapse_bgrx, 1, VREND_PIXEL_OPS_NUM_IMPLS);
+  tcase_add_loop_test(tc_core, pixel_ops_collapse_r8g8b8x8, 1, VREND_PIXEL_OPS_NUM_IMPLS);
+  tcase_add_loop_test(tc_core, pixel_ops_collapse_r16g16b16x16, 1, VREND_PIXEL_OPS_NUM_IMPLS);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -200,6 +200,48 @@ START_TEST(strbuf_test_fixed_string)
 END_TEST
 
 
+START_TEST(strbuf_test_grow_doubles)
+{
+   struct vrend_strbuf sb;
+   bool ret;
+   char str[4096];
+   ret = strbuf_alloc(&sb, 4096);
+   ck_assert_int_eq(ret, true);
+
+   for (int i = 0; i < 4095; i++)
+      str[i] = 'a' + (i % 26);
+   str[4095] = 0;
+   strbuf_append(&sb, str);
+   strbuf_append(&sb, "a");
+   ck_assert_int_eq(strbuf_get_error(&sb), false);
+   ck_assert_int_eq(sb.alloc_size, 8192);
+   strbuf_free(&sb);
+}
+END_TEST
+
+START_TEST(strbuf_test_clear)
+{
+   struct vrend_strbuf sb;
+   bool ret;
+   char buf[8];
+   ret = strbuf_alloc_fixed(&sb, buf, 8);
+   ck_assert_int_eq(ret, true);
+
+   strbuf_append(&sb, "too long for it");
+   ck_assert_int_eq(strbuf_get_error(&sb), true);
+
+   strbuf_clear(&sb);
+   ck_assert_int_eq(strbuf_get_error(&sb), false);
+   ck_assert_int_eq(strbuf_get_len(&sb), 0);
+   ck_assert_str_eq(sb.buf, "");
+   ck_assert_int_eq(sb.alloc_size, 8);
+
+   strbuf_append(&sb, "fits");
+   ck_assert_str_eq(sb.buf, "fits");
+   strbuf_free(&sb);
+}
+END_TEST
+
 static Suite *init_suite(void)
 {
   Suite *s;
@@ -220,6 +262,8 @@ static Suite *init_suite(void)
   tcase_add_test(tc_core, strbuf_test_appendf);
   tcase_add_test(tc_core, strbuf_test_appendf_str);
   tcase_add_test(tc_core, strbuf_test_fixed_string);
+  tcase_add_test(tc_core, strbuf_test_grow_doubles);
+  tcase_add_test(tc_core, strbuf_test_clear);
   return s;
 }
 
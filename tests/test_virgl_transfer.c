@@ -30,6 +30,7 @@
 #include "pipe/p_defines.h"
 #include "virgl_hw.h"
 #include "vrend/vrend_iov.h"
+#include "vrend/vrend_renderer.h"
 #include "virgl_protocol.h"
 #include "testvirgl_encode.h"
 
@@ -1010,6 +1011,65 @@ START_TEST(test_vrend_host_backed_memory_no_data_leak)
 }
 END_TEST
 
+/* the contents and the usage hint of an evicted buffer come back on its next
+ * use, here a read back */
+START_TEST(virgl_test_transfer_evicted_buffer)
+{
+  static unsigned char data[64 * 1024];
+  struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+  struct virgl_box box = { .w = sizeof(data), .h = 1, .d = 1 };
+  struct virgl_resource res;
+  uint32_t size;
+  GLenum usage, expected_usage;
+  int ret;
+
+  ret = testvirgl_create_backed_simple_buffer(&res, 1, sizeof(data), VIRGL_BIND_SHADER_BUFFER);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_ctx_attach_resource(1, res.handle);
+
+  for (unsigned i = 0; i < sizeof(data); i++)
+    data[i] = i * 7;
+  ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0, &box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  ret = vrend_renderer_resource_get_buffer_storage(res.handle, &size, &expected_usage);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_uint_eq(size, sizeof(data));
+
+  ret = vrend_renderer_resource_evict(res.handle);
+  ck_assert_int_eq(ret, 0);
+  ret = vrend_renderer_resource_get_buffer_storage(res.handle, &size, &usage);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_uint_eq(size, 0);
+  ck_assert_uint_eq(usage, expected_usage);
+
+  memset(res.iovs[0].iov_base, 0, res.iovs[0].iov_len);
+  ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  ck_assert(!memcmp(res.iovs[0].iov_base, data, sizeof(data)));
+
+  ret = vrend_renderer_resource_get_buffer_storage(res.handle, &size, &usage);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_uint_eq(size, sizeof(data));
+  ck_assert_uint_eq(usage, expected_usage);
+
+  virgl_renderer_ctx_detach_resource(1, res.handle);
+  testvirgl_destroy_backed_res(&res);
+}
+END_TEST
+
+static void testvirgl_init_single_ctx_eviction(void)
+{
+  setenv("VREND_BUFFER_EVICTION", "true", 1);
+  testvirgl_init_single_ctx_nr();
+}
+
+static void testvirgl_fini_single_ctx_eviction(void)
+{
+  testvirgl_fini_single_ctx();
+  unsetenv("VREND_BUFFER_EVICTION");
+}
+
 
 static Suite *virgl_init_suite(void)
 {
@@ -1073,6 +1133,13 @@ static Suite *virgl_init_suite(void)
 
   suite_add_tcase(s, tc_core);
 
+  tc_core = tcase_create("transfer_evicted_buffer");
+  tcase_add_checked_fixture(tc_core, testvirgl_init_single_ctx_eviction,
+                            testvirgl_fini_single_ctx_eviction);
+  tcase_add_test(tc_core, virgl_test_transfer_evicted_buffer);
+
+  suite_add_tcase(s, tc_core);
+
   return s;
 
 }
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include "vkr_object_table.h"
+
+#define STABLE_COUNT 256
+#define CHURN_COUNT 1024
+#define READER_COUNT 4
+#define WRITER_ROUNDS 200
+
+/* The objects are never freed by the table in these tests, they are all
+ * removed before vkr_object_table_fini. */
+static struct vkr_object stable_objs[STABLE_COUNT];
+static struct vkr_object churn_objs[CHURN_COUNT];
+
+static void init_objects(void)
+{
+   for (uint32_t i = 0; i < STABLE_COUNT; i++)
+      stable_objs[i].id = i + 1;
+   for (uint32_t i = 0; i < CHURN_COUNT; i++)
+      churn_objs[i].id = STABLE_COUNT + i + 1;
+}
+
+static void insert_object(struct vkr_object_table *table, struct vkr_object *obj)
+{
+   mtx_lock(&table->mutex);
+   ck_assert(vkr_object_table_insert_locked(table, obj));
+   mtx_unlock(&table->mutex);
+}
+
+static void remove_object(struct vkr_object_table *table, struct vkr_object *obj)
+{
+   mtx_lock(&table->mutex);
+   ck_assert_ptr_eq(vkr_object_table_remove_locked(table, obj->id), obj);
+   mtx_unlock(&table->mutex);
+}
+
+START_TEST(object_table_insert_lookup_remove)
+{
+   struct vkr_object_table table;
+   struct vkr_object_table_reader reader;
+
+   init_objects();
+   ck_assert(vkr_object_table_init(&table));
+   vkr_object_table_add_reader(&table, &reader);
+
+   /* enough objects for the table to grow a few times */
+   for (uint32_t i = 0; i < CHURN_COUNT; i++)
+      insert_object(&table, &churn_objs[i]);
+   ck_assert_uint_eq(table.count, CHURN_COUNT);
+
+   for (uint32_t i = 0; i < CHURN_COUNT; i++) {
+      ck_assert_ptr_eq(vkr_object_table_lookup(&table, &reader, churn_objs[i].id),
+                       &churn_objs[i]);
+   }
+   ck_assert_ptr_null(vkr_object_table_lookup(&table, &reader, 1));
+
+   const uint64_t generation = vkr_object_table_generation(&table);
+   for (uint32_t i = 0; i < CHURN_COUNT; i += 2)
+      remove_object(&table, &churn_objs[i]);
+   ck_assert(vkr_object_table_generation(&table) != generation);
+
+   /* the removed ids stay in their slots, the other lookups go past them */
+   for (uint32_t i = 0; i < CHURN_COUNT; i++) {
+      ck_assert_ptr_eq(vkr_object_table_lookup(&table, &reader, churn_objs[i].id),
+                       i % 2 ? &churn_objs[i] : NULL);
+   }
+
+   /* and are reused when the same ids come back */
+   const uint32_t used = table.used;
+   for (uint32_t i = 0; i < CHURN_COUNT; i += 2)
+      insert_object(&table, &churn_objs[i]);
+   ck_assert_uint_eq(table.used, used);
+
+   for (uint32_t i = 0; i < CHURN_COUNT; i++)
+      remove_object(&table, &churn_objs[i]);
+   ck_assert_uint_eq(table.count, 0);
+
+   vkr_object_table_remove_reader(&table, &reader);
+   vkr_object_table_fini(&table);
+}
+END_TEST
+
+struct stress_state {
+   struct vkr_object_table table;
+   atomic_bool stop;
+   atomic_uint failures;
+};
+
+static int stress_reader(void *arg)
+{
+   struct stress_state *state = arg;
+   struct vkr_object_table_reader reader;
+   uint32_t i = 0;
+
+   vkr_object_table_add_reader(&state->table, &reader);
+
+   while (!atomic_load(&state->stop)) {
+      struct vkr_object *stable = &stable_objs[i % STABLE_COUNT];
+      struct vkr_object *churn = &churn_objs[i % CHURN_COUNT];
+
+      /* the stable objects are never removed */
+      if (vkr_object_table_lookup(&state->table, &reader, stable->id) != stable)
+         atomic_fetch_add(&state->failures, 1);
+
+      /* the others come and go, but are never found under another id */
+      struct vkr_object *obj = vkr_object_table_lookup(&state->table, &reader, churn->id);
+      if (obj && obj != churn)
+         atomic_fetch_add(&state->failures, 1);
+
+      i++;
+   }
+
+   vkr_object_table_remove_reader(&state->table, &reader);
+   return 0;
+}
+
+/* Readers look objects up without the mutex while a writer adds and removes
+ * objects, which makes the table grow and retire its arrays.  Run it under
+ * ThreadSanitizer or AddressSanitizer to check for races and for arrays
+ * freed under a reader.
+ */
+START_TEST(object_table_concurrent_lookup)
+{
+   static struct stress_state state;
+   thrd_t readers[READER_COUNT];
+
+   init_objects();
+   ck_assert(vkr_object_table_init(&state.table));
+   atomic_init(&state.stop, false);
+   atomic_init(&state.failures, 0);
+
+   for (uint32_t i = 0; i < STABLE_COUNT; i++)
+      insert_object(&state.table, &stable_objs[i]);
+
+   for (uint32_t i = 0; i < READER_COUNT; i++)
+      ck_assert_int_eq(thrd_create(&readers[i], stress_reader, &state), thrd_success);
+
+   for (uint32_t round = 0; round < WRITER_ROUNDS; round++) {
+      /* a growing number of objects, so that the table is rehashed */
+      const uint32_t count = CHURN_COUNT * (round % 8 + 1) / 8;
+
+      for (uint32_t i = 0; i < count; i++)
+         insert_object(&state.table, &churn_objs[i]);
+      for (uint32_t i = 0; i < count; i++)
+         remove_object(&state.table, &churn_objs[i]);
+   }
+
+   atomic_store(&state.stop, true);
+   for (uint32_t i = 0; i < READER_COUNT; i++)
+      thrd_join(readers[i], NULL);
+
+   ck_assert_uint_eq(atomic_load(&state.failures), 0);
+
+   for (uint32_t i = 0; i < STABLE_COUNT; i++)
+      remove_object(&state.table, &stable_objs[i]);
+   vkr_object_table_fini(&state.table);
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vkr_object_table");
+  tc_core = tcase_create("object_table");
+  tcase_set_timeout(tc_core, 60);
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, object_table_insert_lookup_remove);
+  tcase_add_test(tc_core, object_table_concurrent_lookup);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vkr_command_buffer.h"
+#include "vkr_context.h"
+#include "vkr_cs.h"
+#include "vkr_record_cache.h"
+
+/* Recordings are streams of commands made of the command type, the flags, the
+ * command buffer id and a payload.  The dispatch of a command is simulated by
+ * moving the decoder past it, the way the generated decoders do.
+ */
+
+#define COMMAND_BUFFER_ID 1
+#define COMMAND_SIZE 24
+#define COMMAND_COUNT 8
+
+static struct vkr_context ctx;
+static struct vkr_cs_decoder dec;
+static struct vn_dispatch_context dispatch;
+static struct vkr_command_buffer *cmd;
+
+static void setup(void)
+{
+   vkr_record_cache = true;
+
+   ck_assert(vkr_object_table_init(&ctx.object_table));
+   atomic_init(&ctx.record_cache_epoch, 0);
+
+   cmd = calloc(1, sizeof(*cmd));
+   ck_assert_ptr_nonnull(cmd);
+   cmd->base.type = VK_OBJECT_TYPE_COMMAND_BUFFER;
+   cmd->base.id = COMMAND_BUFFER_ID;
+   mtx_lock(&ctx.object_table.mutex);
+   ck_assert(vkr_object_table_insert_locked(&ctx.object_table, &cmd->base));
+   mtx_unlock(&ctx.object_table.mutex);
+
+   ck_assert_int_eq(vkr_cs_decoder_init(&dec, &ctx), 0);
+   dispatch.data = &ctx;
+   dispatch.decoder = (struct vn_cs_decoder *)&dec;
+}
+
+static void teardown(void)
+{
+   vkr_cs_decoder_fini(&dec);
+
+   vkr_record_cache_drop(cmd);
+   mtx_lock(&ctx.object_table.mutex);
+   ck_assert_ptr_eq(vkr_object_table_remove_locked(&ctx.object_table, COMMAND_BUFFER_ID),
+                    &cmd->base);
+   mtx_unlock(&ctx.object_table.mutex);
+   free(cmd);
+
+   vkr_object_table_fini(&ctx.object_table);
+}
+
+static void write_command(uint8_t *dst, uint32_t type, uint32_t flags, uint64_t payload)
+{
+   const uint64_t id = COMMAND_BUFFER_ID;
+
+   memcpy(dst, &type, 4);
+   memcpy(dst + 4, &flags, 4);
+   memcpy(dst + 8, &id, 8);
+   memcpy(dst + 16, &payload, 8);
+}
+
+/* a begin, draws with payload as their vertex count, and an end */
+static void fill_recording(uint8_t *stream, uint64_t payload, uint32_t draw_flags)
+{
+   write_command(stream, VK_COMMAND_TYPE_vkBeginCommandBuffer_EXT, 0, 0);
+   for (uint32_t i = 1; i < COMMAND_COUNT - 1; i++) {
+      write_command(stream + i * COMMAND_SIZE, VK_COMMAND_TYPE_vkCmdDraw_EXT, draw_flags,
+                    payload + i);
+   }
+   write_command(stream + (COMMAND_COUNT - 1) * COMMAND_SIZE,
+                 VK_COMMAND_TYPE_vkEndCommandBuffer_EXT, 0, 0);
+}
+
+/* Returns the number of commands dispatched.  With reuse, each command is
+ * overwritten once dispatched, like a guest reusing the ring space that was
+ * handed back.
+ */
+static uint32_t decode_recording(uint8_t *stream, bool reuse)
+{
+   uint32_t dispatched = 0;
+
+   vkr_cs_decoder_set_buffer_stream(&dec, stream, COMMAND_SIZE * COMMAND_COUNT);
+   while (vkr_cs_decoder_has_command(&dec)) {
+      if (vkr_record_cache_begin_command(&dispatch))
+         continue;
+
+      uint8_t *command = (uint8_t *)dec.cur;
+      uint32_t type;
+      memcpy(&type, command, sizeof(type));
+      if (type == VK_COMMAND_TYPE_vkBeginCommandBuffer_EXT)
+         cmd->record_cacheable = true;
+
+      dec.cur += COMMAND_SIZE;
+      dispatched++;
+      vkr_record_cache_end_command(&dispatch);
+
+      if (reuse)
+         memset(command, 0xff, COMMAND_SIZE);
+   }
+
+   ck_assert(!vkr_cs_decoder_get_fatal(&dec));
+   return dispatched;
+}
+
+START_TEST(record_cache_miss_then_hit)
+{
+   uint8_t stream[COMMAND_SIZE * COMMAND_COUNT];
+
+   setup();
+
+   fill_recording(stream, 3, 0);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_ptr_nonnull(cmd->record_cache);
+   ck_assert_uint_eq(cmd->record_cache->size, sizeof(stream));
+   ck_assert(!memcmp(cmd->record_cache->data, stream, sizeof(stream)));
+
+   /* the same recording is skipped as a whole */
+   ck_assert_uint_eq(decode_recording(stream, false), 0);
+
+   /* a different one is dispatched and replaces it */
+   fill_recording(stream, 4, 0);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert(!memcmp(cmd->record_cache->data, stream, sizeof(stream)));
+   ck_assert_uint_eq(decode_recording(stream, false), 0);
+
+   teardown();
+}
+END_TEST
+
+/* the cache holds the commands as they were dispatched, even when the stream
+ * is overwritten before the recording ends */
+START_TEST(record_cache_reused_stream)
+{
+   uint8_t stream[COMMAND_SIZE * COMMAND_COUNT];
+   uint8_t expected[COMMAND_SIZE * COMMAND_COUNT];
+
+   setup();
+
+   fill_recording(stream, 5, 0);
+   memcpy(expected, stream, sizeof(stream));
+   ck_assert_uint_eq(decode_recording(stream, true), COMMAND_COUNT);
+   ck_assert_ptr_nonnull(cmd->record_cache);
+   ck_assert(!memcmp(cmd->record_cache->data, expected, sizeof(expected)));
+
+   ck_assert_uint_eq(decode_recording(expected, false), 0);
+
+   teardown();
+}
+END_TEST
+
+START_TEST(record_cache_invalidate)
+{
+   uint8_t stream[COMMAND_SIZE * COMMAND_COUNT];
+
+   setup();
+
+   fill_recording(stream, 6, 0);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_uint_eq(decode_recording(stream, false), 0);
+
+   /* stale recordings are dispatched again, and cached anew */
+   vkr_record_cache_invalidate(&ctx);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_uint_eq(decode_recording(stream, false), 0);
+
+   /* as are the ones that were dropped */
+   vkr_record_cache_drop(cmd);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_uint_eq(decode_recording(stream, false), 0);
+
+   teardown();
+}
+END_TEST
+
+/* the replies of a skipped recording would never be sent */
+START_TEST(record_cache_reply)
+{
+   uint8_t stream[COMMAND_SIZE * COMMAND_COUNT];
+
+   setup();
+
+   fill_recording(stream, 7, VK_COMMAND_GENERATE_REPLY_BIT_EXT);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_ptr_null(cmd->record_cache);
+   ck_assert_uint_eq(decode_recording(stream, false), COMMAND_COUNT);
+   ck_assert_ptr_null(cmd->record_cache);
+
+   teardown();
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vkr_record_cache");
+  tc_core = tcase_create("record_cache");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, record_cache_miss_then_hit);
+  tcase_add_test(tc_core, record_cache_reused_stream);
+  tcase_add_test(tc_core, record_cache_invalidate);
+  tcase_add_test(tc_core, record_cache_reply);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
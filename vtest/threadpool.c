@@ -3,118 +3,164 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "threadpool.h"
 #include "list.h"
 #include "macros.h"
 
-struct threadpool_worker {
+struct threadpool_job {
    struct list_head node;
-   struct threadpool *tp;
-   cnd_t cnd;
-   thrd_t thread;
    threadpool_work work;
    void *arg;
 };
 
 void
-threadpool_init(struct threadpool *tp)
+threadpool_init(struct threadpool *tp, uint32_t max_workers)
 {
-   list_inithead(&tp->idle_workers);
-   list_inithead(&tp->busy_workers);
+   assert(max_workers);
+
    mtx_init(&tp->lock, mtx_plain);
-   cnd_init(&tp->cnd);
-}
+   cnd_init(&tp->job_cnd);
+   cnd_init(&tp->exit_cnd);
 
-static void
-exit_work(UNUSED void *job)
-{}
+   list_inithead(&tp->jobs);
+   tp->queued_job_count = 0;
 
-static int
-worker_main(void *arg)
+   tp->max_workers = max_workers;
+   tp->worker_count = 0;
+   tp->idle_worker_count = 0;
+   tp->stop = false;
+
+   memset(&tp->stats, 0, sizeof(tp->stats));
+}
+
+static struct threadpool_job *
+wait_job_locked(struct threadpool *tp)
 {
-   struct threadpool_worker *w = arg;
+   struct timespec timeout;
 
-   mtx_lock(&w->tp->lock);
+   timespec_get(&timeout, TIME_UTC);
+   timeout.tv_sec += THREADPOOL_IDLE_TIMEOUT;
 
-   do {
-      if (!w->work)
-         cnd_wait(&w->cnd, &w->tp->lock);
+   tp->idle_worker_count++;
 
-      if (w->work == exit_work)
+   while (list_is_empty(&tp->jobs) && !tp->stop) {
+      if (cnd_timedwait(&tp->job_cnd, &tp->lock, &timeout) == thrd_timeout)
          break;
+   }
+
+   tp->idle_worker_count--;
+
+   if (list_is_empty(&tp->jobs))
+      return NULL;
 
-      mtx_unlock(&w->tp->lock);
-      w->work(w->arg);
-      mtx_lock(&w->tp->lock);
+   struct threadpool_job *job =
+      list_first_entry(&tp->jobs, struct threadpool_job, node);
+   list_del(&job->node);
+   tp->queued_job_count--;
 
-      w->work = NULL;
-      w->arg = NULL;
+   return job;
+}
+
+static int
+worker_main(void *arg)
+{
+   struct threadpool *tp = arg;
+
+   mtx_lock(&tp->lock);
 
-      /* Move ourself back to the idle list when done: */
-      list_del(&w->node);
-      list_add(&w->node, &w->tp->idle_workers);
+   while (true) {
+      /* the queued jobs are still run when stopping */
+      struct threadpool_job *job = wait_job_locked(tp);
+      if (!job)
+         break;
 
-      /* And tell the threadpool we are back to idle: */
-      cnd_signal(&w->tp->cnd);
+      mtx_unlock(&tp->lock);
+      job->work(job->arg);
+      free(job);
+      mtx_lock(&tp->lock);
 
-   } while (true);
+      tp->stats.jobs_run++;
+   }
 
-   /* When exiting, remove ourselves from the idle list: */
-   list_del(&w->node);
+   /* Reap ourself when idle for too long or stopping: */
+   tp->worker_count--;
+   if (!tp->stop)
+      tp->stats.workers_reaped++;
 
    /* And tell the threadpool we are exiting: */
-   cnd_signal(&w->cnd);
+   cnd_signal(&tp->exit_cnd);
 
-   mtx_unlock(&w->tp->lock);
+   mtx_unlock(&tp->lock);
 
    return 0;
 }
 
-static void
-spawn_worker(struct threadpool *tp)
+static bool
+spawn_worker_locked(struct threadpool *tp)
 {
-   struct threadpool_worker *w = calloc(1, sizeof(*w));
+   thrd_t thread;
+
+   if (thrd_create(&thread, worker_main, tp) != thrd_success)
+      return false;
+   thrd_detach(thread);
+
+   tp->worker_count++;
+   tp->stats.workers_spawned++;
+   tp->stats.peak_workers = MAX2(tp->stats.peak_workers, tp->worker_count);
 
-   w->tp = tp;
-   cnd_init(&w->cnd);
-   list_add(&w->node, &tp->idle_workers);
-   thrd_create(&w->thread, worker_main, w);
+   return true;
 }
 
-static struct threadpool_worker *
-kick_work_locked(struct threadpool *tp, threadpool_work work, void *arg)
+void
+threadpool_run(struct threadpool *tp, threadpool_work work, void *arg)
 {
-   struct threadpool_worker *w;
+   struct threadpool_job *job = malloc(sizeof(*job));
+
+   if (!job) {
+      /* Better block the caller than lose the job: */
+      work(arg);
+      return;
+   }
+
+   job->work = work;
+   job->arg = arg;
+
+   mtx_lock(&tp->lock);
 
-   assert(!list_is_empty(&tp->idle_workers));
+   assert(!tp->stop);
 
-   w = list_first_entry(&tp->idle_workers, struct threadpool_worker, node);
+   list_addtail(&job->node, &tp->jobs);
+   tp->queued_job_count++;
+   tp->stats.peak_queued_jobs = MAX2(tp->stats.peak_queued_jobs, tp->queued_job_count);
 
-   assert(!w->work);
-   w->work = work;
-   w->arg  = arg;
+   /* If all workers are busy, spawn a new one unless there are too many: */
+   if (tp->queued_job_count > tp->idle_worker_count &&
+       tp->worker_count < tp->max_workers) {
+      if (!spawn_worker_locked(tp) && !tp->worker_count) {
+         list_del(&job->node);
+         tp->queued_job_count--;
+         mtx_unlock(&tp->lock);
 
-   /* Move the worker to the busy list: */
-   list_del(&w->node);
-   list_add(&w->node, &tp->busy_workers);
+         work(arg);
+         free(job);
+         return;
+      }
+   }
 
-   /* And then kick the worker: */
-   cnd_signal(&w->cnd);
+   cnd_signal(&tp->job_cnd);
 
-   return w;
+   mtx_unlock(&tp->lock);
 }
 
 void
-threadpool_run(struct threadpool *tp, threadpool_work work, void *arg)
+threadpool_get_stats(struct threadpool *tp, struct threadpool_stats *stats)
 {
    mtx_lock(&tp->lock);
-
-   /* If all workers are busy, spawn a new one: */
-   if (list_is_empty(&tp->idle_workers))
-      spawn_worker(tp);
-
-   kick_work_locked(tp, work, arg);
-
+   *stats = tp->stats;
    mtx_unlock(&tp->lock);
 }
 
@@ -123,27 +169,19 @@ threadpool_fini(struct threadpool *tp)
 {
    mtx_lock(&tp->lock);
 
-   while (!list_is_empty(&tp->idle_workers) &&
-          !list_is_empty(&tp->busy_workers)) {
-      struct threadpool_worker *w;
-      int ret;
-
-      /* Wait for an idle worker: */
-      if (list_is_empty(&tp->idle_workers))
-         cnd_wait(&tp->cnd, &tp->lock);
-
-      /* Kick exit job to notify the worker to shut down: */
-      w = kick_work_locked(tp, exit_work, NULL);
+   /* Tell the workers to exit once the queue is empty: */
+   tp->stop = true;
+   cnd_broadcast(&tp->job_cnd);
 
-      mtx_unlock(&tp->lock);
-
-      /* Wait for the worker to exit: */
-      thrd_join(w->thread, &ret);
-
-      free(w);
+   /* And wait for them to exit: */
+   while (tp->worker_count)
+      cnd_wait(&tp->exit_cnd, &tp->lock);
 
-      mtx_lock(&tp->lock);
-   }
+   assert(list_is_empty(&tp->jobs));
 
    mtx_unlock(&tp->lock);
+
+   cnd_destroy(&tp->exit_cnd);
+   cnd_destroy(&tp->job_cnd);
+   mtx_destroy(&tp->lock);
 }
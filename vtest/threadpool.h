@@ -6,26 +6,52 @@
 #ifndef THREADPOOL_H_
 #define THREADPOOL_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "c11/threads.h"
 #include "list.h"
 
-struct threadpool_worker;
+/* idle workers exit after this many seconds */
+#define THREADPOOL_IDLE_TIMEOUT 10
+
+struct threadpool_stats {
+   uint64_t jobs_run;
+   uint64_t workers_spawned;
+   uint64_t workers_reaped;
+   uint32_t peak_workers;
+   uint32_t peak_queued_jobs;
+};
 
 /**
- * A threadpool manages a list of workers, dispatching work to an idle
- * worker, or if necessary spawning a new worker.
+ * A threadpool manages a queue of jobs, dispatching them to idle workers,
+ * or if necessary spawning a new worker, up to max_workers.  Once there are
+ * max_workers busy workers, the jobs wait in the queue.
  */
 struct threadpool {
-   struct list_head idle_workers;
-   struct list_head busy_workers;
    mtx_t lock;
-   cnd_t cnd;
+   /* signaled when jobs are queued or the pool is stopped */
+   cnd_t job_cnd;
+   /* signaled when a worker exits */
+   cnd_t exit_cnd;
+
+   struct list_head jobs;
+   uint32_t queued_job_count;
+
+   uint32_t max_workers;
+   uint32_t worker_count;
+   uint32_t idle_worker_count;
+   bool stop;
+
+   struct threadpool_stats stats;
 };
 
 typedef void (*threadpool_work)(void *job);
 
-void threadpool_init(struct threadpool *tp);
+void threadpool_init(struct threadpool *tp, uint32_t max_workers);
 void threadpool_run(struct threadpool *tp, threadpool_work work, void *arg);
+void threadpool_get_stats(struct threadpool *tp, struct threadpool_stats *stats);
+/* waits for the queued jobs to complete */
 void threadpool_fini(struct threadpool *tp);
 
 #endif /*  THREADPOOL_H_ */
@@ -46,6 +46,7 @@ int vtest_init_renderer(bool multi_clients,
                         int ctx_flags,
                         const char *render_device);
 void vtest_cleanup_renderer(void);
+void vtest_reset_renderer(void);
 
 int vtest_create_context(struct vtest_input *input, int out_fd,
                          uint32_t length_dw, struct vtest_context **out_ctx);
@@ -113,6 +114,12 @@ int vtest_drm_sync_query(uint32_t length_dw);
 int vtest_drm_sync_transfer(uint32_t length_dw);
 int vtest_resource_export_fd(uint32_t length_dw);
 
+/* since protocol version 5 */
+int vtest_cmd_ring_create(uint32_t length_dw);
+int vtest_submit_cmd_ring(uint32_t length_dw);
+int vtest_transfer_get3(uint32_t length_dw);
+int vtest_transfer_put3(uint32_t length_dw);
+
 void vtest_set_max_length(uint32_t length);
 
 #endif
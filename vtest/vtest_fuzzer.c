@@ -86,8 +86,25 @@ static vtest_cmd_fptr_t vtest_commands[] = {
    vtest_transfer_put2_nop,
 };
 
+/* With VTEST_FUZZER_PERSISTENT set in the environment, the renderer stays
+ * initialized and is reset between the inputs, instead of paying for the GL
+ * initialization and the caps probing of each input.
+ */
+static bool renderer_initialized;
+
+static void vtest_fuzzer_check_no_leaks(void)
+{
+   struct virgl_renderer_stats stats = { .version = VIRGL_RENDERER_STATS_VERSION };
+
+   /* nothing of an input may be left for the next inputs to run into */
+   virgl_renderer_get_stats(&stats);
+   if (stats.context_count || stats.resource_count)
+      abort();
+}
+
 static void vtest_fuzzer_run_renderer(int out_fd, struct vtest_input *input,
-                                      int ctx_flags, bool wait_fences)
+                                      int ctx_flags, bool wait_fences,
+                                      bool persistent)
 {
    struct vtest_context *context = NULL;
    int ret;
@@ -108,7 +125,10 @@ static void vtest_fuzzer_run_renderer(int out_fd, struct vtest_input *input,
             break;
          }
 
-         ret = vtest_init_renderer(false, ctx_flags, NULL);
+         if (!renderer_initialized) {
+            ret = vtest_init_renderer(false, ctx_flags, NULL);
+            renderer_initialized = ret >= 0;
+         }
          if (ret >= 0) {
             ret = vtest_create_context(input, out_fd, header[0], &context);
          }
@@ -141,7 +161,15 @@ static void vtest_fuzzer_run_renderer(int out_fd, struct vtest_input *input,
    if (context) {
       vtest_destroy_context(context);
    }
+
+   if (persistent && renderer_initialized) {
+      vtest_fuzzer_check_no_leaks();
+      vtest_reset_renderer();
+      return;
+   }
+
    vtest_cleanup_renderer();
+   renderer_initialized = false;
 }
 
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
@@ -163,7 +191,8 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
                              VIRGL_RENDERER_USE_SURFACELESS |
                              (getenv("VTEST_FUZZER_USE_GL") != NULL ?
                               0 : VIRGL_RENDERER_USE_GLES),
-                             getenv("VTEST_FUZZER_FENCES") != NULL);
+                             getenv("VTEST_FUZZER_FENCES") != NULL,
+                             getenv("VTEST_FUZZER_PERSISTENT") != NULL);
 
    close(out_fd);
 
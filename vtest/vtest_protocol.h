@@ -27,7 +27,7 @@
 
 #define VTEST_DEFAULT_SOCKET_NAME "/tmp/.virgl_test"
 
-#define VTEST_PROTOCOL_VERSION 4
+#define VTEST_PROTOCOL_VERSION 5
 
 /* 32-bit length field */
 /* 32-bit cmd field */
@@ -94,6 +94,12 @@
 #define VCMD_DRM_SYNC_TRANSFER 37
 #define VCMD_RESOURCE_EXPORT_FD 38
 
+/* since protocol version 5 */
+#define VCMD_CMD_RING_CREATE 39
+#define VCMD_SUBMIT_CMD_RING 40
+#define VCMD_TRANSFER_GET3 41
+#define VCMD_TRANSFER_PUT3 42
+
 #define VCMD_RES_CREATE_SIZE 10
 #define VCMD_RES_CREATE_RES_HANDLE 0 /* must be 0 since protocol version 3 */
 #define VCMD_RES_CREATE_TARGET 1
@@ -149,6 +155,14 @@
 #define VCMD_TRANSFER2_DATA_SIZE 8
 #define VCMD_TRANSFER2_OFFSET 9
 
+/* Like TRANSFER2, except that the data is DATA_SIZE bytes at OFFSET in the
+ * shm of the resource BLOB_HANDLE instead of the shm of RES_HANDLE.  This
+ * lets resources without shm, or any number of resources, use a staging
+ * blob without copying the data through the socket.
+ */
+#define VCMD_TRANSFER3_HDR_SIZE 11
+#define VCMD_TRANSFER3_BLOB_HANDLE 10
+
 #define VCMD_BUSY_WAIT_FLAG_WAIT 1
 
 #define VCMD_BUSY_WAIT_SIZE 2
@@ -349,4 +363,35 @@ struct vcmd_submit_cmd2_batch {
 #define VCMD_RESOURCE_EXPORT_FD_RES_HANDLE 0
 /* rsp fd */
 
+/* A command ring in shared memory, to submit commands without copying them
+ * through the socket.  The shm starts with a struct vcmd_cmd_ring_header
+ * followed by the ring data at VCMD_CMD_RING_DATA_OFFSET.  The client writes
+ * a command buffer to the ring and sends VCMD_SUBMIT_CMD_RING as the doorbell.
+ * A command buffer must not wrap around the end of the ring.  Once it has
+ * been submitted, the server sets head to its end offset, and the client may
+ * reuse the space before it.
+ */
+#define VCMD_CMD_RING_DATA_OFFSET 64
+
+struct vcmd_cmd_ring_header {
+   uint32_t head;
+};
+
+#define VCMD_CMD_RING_CREATE_SIZE 1
+#define VCMD_CMD_RING_CREATE_RING_SIZE 0 /* in bytes, a multiple of 4 */
+/* rsp fd */
+
+enum vcmd_submit_cmd_ring_flag {
+   /* reply with an empty VCMD_SUBMIT_CMD_RING after the submission, which
+    * lets the client measure the latency of the doorbell like with
+    * VCMD_PING_PROTOCOL_VERSION
+    */
+   VCMD_SUBMIT_CMD_RING_FLAG_REPLY = 1 << 0,
+};
+
+#define VCMD_SUBMIT_CMD_RING_SIZE 3
+#define VCMD_SUBMIT_CMD_RING_OFFSET 0 /* in bytes, relative to the ring data */
+#define VCMD_SUBMIT_CMD_RING_LENGTH_DW 1
+#define VCMD_SUBMIT_CMD_RING_FLAGS 2
+
 #endif /* VTEST_PROTOCOL */
@@ -32,6 +32,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <c11/threads.h>
 
@@ -58,6 +59,7 @@
 
 #include "util.h"
 #include "util/list.h"
+#include "util/u_atomic.h"
 #include "util/u_debug.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
@@ -75,6 +77,9 @@
 
 #define VTEST_MAX_TIMELINE_COUNT 64
 
+/* more waits are queued until a thread is available */
+#define VTEST_DRM_SYNC_WAIT_MAX_THREADS 32
+
 struct vtest_resource {
    struct list_head head;
 
@@ -82,6 +87,10 @@ struct vtest_resource {
    uint32_t res_id;
 
    struct iovec iov;
+
+   /* the last implicit fence when the resource was created, the submits up
+    * to it could not use the resource */
+   uint32_t created_fence_id;
 };
 
 struct vtest_sync {
@@ -157,6 +166,9 @@ struct vtest_context {
    unsigned capset_id;
    bool context_initialized;
 
+   /* the implicit fence of the last submit of the context */
+   uint32_t last_fence_id;
+
    struct util_hash_table *resource_table;
    struct util_hash_table *sync_table;
 
@@ -164,11 +176,23 @@ struct vtest_context {
 
    struct list_head sync_waits;
 
+   /* created by VCMD_CMD_RING_CREATE */
+   struct {
+      void *ptr;
+      size_t size;
+      volatile struct vcmd_cmd_ring_header *header;
+      const uint32_t *data;
+      uint32_t data_size;
+      /* private copy of the submitted commands, the decoders expect them
+       * not to change while they run */
+      uint32_t *copy;
+   } cmd_ring;
+
 #ifdef ENABLE_DRM
    /* A threadpool for blocking syncobj waits.  We don't want to serialize
     * waits, because the wakeups could be out of order.  But we dont' want
     * to have to spawn a thread for each wait.  So use a threadpool that
-    * can add new threads on demand.
+    * can add new threads on demand, up to VTEST_DRM_SYNC_WAIT_MAX_THREADS.
     */
    struct threadpool drm_sync_wait_pool;
 #endif
@@ -181,8 +205,8 @@ struct vtest_renderer {
 
    uint32_t max_length;
 
-   int implicit_fence_submitted;
-   int implicit_fence_completed;
+   uint32_t implicit_fence_submitted;
+   uint32_t implicit_fence_completed;
 
    struct list_head active_contexts;
    struct list_head free_contexts;
@@ -200,10 +224,29 @@ struct vtest_renderer {
 /*
  * VCMD_RESOURCE_BUSY_WAIT is used to wait GPU works (VCMD_SUBMIT_CMD) or CPU
  * works (VCMD_TRANSFER_GET2).  A fence is needed only for GPU works.
+ *
+ * The implicit fences signal in order.  A resource is busy while the fence
+ * of the last submit of its context is pending, unless that submit predates
+ * the resource.
  */
-static void vtest_create_implicit_fence(struct vtest_renderer *renderer)
+static void vtest_create_implicit_fence(struct vtest_renderer *renderer,
+                                        struct vtest_context *ctx)
+{
+   ctx->last_fence_id = ++renderer->implicit_fence_submitted;
+   virgl_renderer_create_fence(ctx->last_fence_id, 0);
+}
+
+/* whether fence a is b or was created after it, across the wraparound */
+static bool vtest_implicit_fence_after_or_equal(uint32_t a, uint32_t b)
+{
+   return (int32_t)(a - b) >= 0;
+}
+
+static bool vtest_implicit_fence_pending(struct vtest_renderer *renderer,
+                                         uint32_t fence_id)
 {
-   virgl_renderer_create_fence(++renderer->implicit_fence_submitted, 0);
+   return !vtest_implicit_fence_after_or_equal(renderer->implicit_fence_completed,
+                                               fence_id);
 }
 
 static void vtest_write_implicit_fence(UNUSED void *cookie, uint32_t fence_id_in)
@@ -271,6 +314,7 @@ static struct vtest_resource *vtest_new_resource(uint32_t client_res_id)
    res->res_id = client_res_id ? client_res_id : res->server_res_id;
    res->iov.iov_base = NULL;
    res->iov.iov_len = 0;
+   res->created_fence_id = renderer.implicit_fence_submitted;
 
    return res;
 }
@@ -671,6 +715,21 @@ void vtest_cleanup_renderer(void)
    virgl_renderer_cleanup(&renderer);
 }
 
+/* Returns the renderer to its initial state while keeping it initialized.
+ * The freed contexts and resources stay cached for reuse.
+ */
+void vtest_reset_renderer(void)
+{
+   struct vtest_context *ctx, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(ctx, tmp, &renderer.active_contexts, head) {
+      vtest_destroy_context(ctx);
+   }
+   renderer.current_context = NULL;
+
+   virgl_renderer_reset();
+}
+
 static struct vtest_context *vtest_new_context(struct vtest_input *input,
                                                int out_fd)
 {
@@ -708,10 +767,6 @@ static struct vtest_context *vtest_new_context(struct vtest_input *input,
 
       list_inithead(&ctx->sync_waits);
 
-#ifdef ENABLE_DRM
-      threadpool_init(&ctx->drm_sync_wait_pool);
-#endif
-
       ctx->ctx_id = renderer.next_context_id++;
    } else {
       ctx = LIST_ENTRY(struct vtest_context, renderer.free_contexts.next, head);
@@ -726,6 +781,13 @@ static struct vtest_context *vtest_new_context(struct vtest_input *input,
    ctx->protocol_version = 0;
    ctx->capset_id = 0;
    ctx->context_initialized = false;
+   ctx->last_fence_id = renderer.implicit_fence_submitted;
+   memset(&ctx->cmd_ring, 0, sizeof(ctx->cmd_ring));
+
+#ifdef ENABLE_DRM
+   /* the pool is stopped when the context is destroyed */
+   threadpool_init(&ctx->drm_sync_wait_pool, VTEST_DRM_SYNC_WAIT_MAX_THREADS);
+#endif
 
    return ctx;
 }
@@ -834,9 +896,22 @@ void vtest_destroy_context(struct vtest_context *ctx)
    list_inithead(&ctx->sync_waits);
 
 #ifdef ENABLE_DRM
+   if (getenv("VTEST_THREADPOOL_STATS")) {
+      struct threadpool_stats stats;
+
+      threadpool_get_stats(&ctx->drm_sync_wait_pool, &stats);
+      printf("%s: sync wait pool: %" PRIu64 " jobs, %" PRIu64 " threads spawned, "
+             "%" PRIu64 " reaped, at most %u threads and %u queued jobs\n",
+             __func__, stats.jobs_run, stats.workers_spawned, stats.workers_reaped,
+             stats.peak_workers, stats.peak_queued_jobs);
+   }
    threadpool_fini(&ctx->drm_sync_wait_pool);
 #endif
 
+   if (ctx->cmd_ring.ptr)
+      munmap(ctx->cmd_ring.ptr, ctx->cmd_ring.size);
+   free(ctx->cmd_ring.copy);
+
    free(ctx->debug_name);
    if (ctx->context_initialized)
       virgl_renderer_context_destroy(ctx->ctx_id);
@@ -1493,7 +1568,124 @@ int vtest_submit_cmd(uint32_t length_dw)
    if (ret)
       return -1;
 
-   vtest_create_implicit_fence(&renderer);
+   vtest_create_implicit_fence(&renderer, ctx);
+   return 0;
+}
+
+int vtest_cmd_ring_create(UNUSED uint32_t length_dw)
+{
+   struct vtest_context *ctx = vtest_get_current_context();
+   uint32_t ring_buf[VCMD_CMD_RING_CREATE_SIZE];
+   uint32_t hdr_buf[VTEST_HDR_SIZE];
+   uint32_t data_size;
+   size_t size;
+   uint32_t *copy;
+   void *ptr;
+   int fd;
+   int ret;
+
+   ret = ctx->input->read(ctx->input, ring_buf, sizeof(ring_buf));
+   if (ret != sizeof(ring_buf))
+      return -1;
+
+   data_size = ring_buf[VCMD_CMD_RING_CREATE_RING_SIZE];
+   if (!data_size || data_size % 4 || data_size > renderer.max_length)
+      return report_failed_call("invalid ring size", -EINVAL);
+
+   if (ctx->cmd_ring.ptr)
+      return report_failed_call("ring already created", -EBUSY);
+
+   copy = malloc(data_size);
+   if (!copy)
+      return report_failed_call("malloc", -ENOMEM);
+
+   size = VCMD_CMD_RING_DATA_OFFSET + data_size;
+   fd = vtest_new_shm(ctx->ctx_id, size);
+   if (fd < 0) {
+      free(copy);
+      return report_failed_call("vtest_new_shm", fd);
+   }
+
+   ptr = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+   if (ptr == MAP_FAILED) {
+      free(copy);
+      close(fd);
+      return -1;
+   }
+
+   hdr_buf[VTEST_CMD_LEN] = 0;
+   hdr_buf[VTEST_CMD_ID] = VCMD_CMD_RING_CREATE;
+   ret = vtest_block_write(ctx->out_fd, hdr_buf, sizeof(hdr_buf));
+   if (ret >= 0)
+      ret = vtest_send_fd(ctx->out_fd, fd);
+
+   /* Closing the file descriptor does not unmap the region. */
+   close(fd);
+
+   if (ret < 0) {
+      munmap(ptr, size);
+      free(copy);
+      return report_failed_call("vtest_send_fd", ret);
+   }
+
+   ctx->cmd_ring.ptr = ptr;
+   ctx->cmd_ring.size = size;
+   ctx->cmd_ring.header = ptr;
+   ctx->cmd_ring.data = (const uint32_t *)((char *)ptr + VCMD_CMD_RING_DATA_OFFSET);
+   ctx->cmd_ring.data_size = data_size;
+   ctx->cmd_ring.copy = copy;
+
+   return 0;
+}
+
+int vtest_submit_cmd_ring(UNUSED uint32_t length_dw)
+{
+   struct vtest_context *ctx = vtest_get_current_context();
+   uint32_t submit_buf[VCMD_SUBMIT_CMD_RING_SIZE];
+   uint32_t offset;
+   uint32_t cmd_length_dw;
+   int ret;
+
+   ret = ctx->input->read(ctx->input, submit_buf, sizeof(submit_buf));
+   if (ret != sizeof(submit_buf))
+      return -1;
+
+   if (!ctx->cmd_ring.ptr)
+      return report_failed_call("no command ring", -EINVAL);
+
+   offset = submit_buf[VCMD_SUBMIT_CMD_RING_OFFSET];
+   cmd_length_dw = submit_buf[VCMD_SUBMIT_CMD_RING_LENGTH_DW];
+   if (offset % 4 || offset > ctx->cmd_ring.data_size ||
+       cmd_length_dw > (ctx->cmd_ring.data_size - offset) / 4)
+      return report_failed_call("invalid ring range", -EINVAL);
+
+   /* The client can write to the ring at any time, and the decoders read
+    * some fields more than once, so the commands are copied out first like
+    * those sent through the socket.  This still saves the socket round trip
+    * of the data.
+    */
+   if (cmd_length_dw) {
+      memcpy(ctx->cmd_ring.copy, &ctx->cmd_ring.data[offset / 4], cmd_length_dw * 4);
+
+      ret = virgl_renderer_submit_cmd(ctx->cmd_ring.copy, ctx->ctx_id, cmd_length_dw);
+      if (ret)
+         return -1;
+
+      vtest_create_implicit_fence(&renderer, ctx);
+   }
+
+   p_atomic_set(&ctx->cmd_ring.header->head, offset + cmd_length_dw * 4);
+
+   if (submit_buf[VCMD_SUBMIT_CMD_RING_FLAGS] & VCMD_SUBMIT_CMD_RING_FLAG_REPLY) {
+      uint32_t hdr_buf[VTEST_HDR_SIZE] = {
+         [VTEST_CMD_LEN] = 0,
+         [VTEST_CMD_ID] = VCMD_SUBMIT_CMD_RING,
+      };
+      ret = vtest_block_write(ctx->out_fd, hdr_buf, sizeof(hdr_buf));
+      if (ret < 0)
+         return ret;
+   }
+
    return 0;
 }
 
@@ -1539,17 +1731,9 @@ static int vtest_transfer_decode_args(struct vtest_context *ctx,
    return 0;
 }
 
-static int vtest_transfer_decode_args2(struct vtest_context *ctx,
-                                       struct vtest_transfer_args *args)
+static void vtest_transfer_init_args2(struct vtest_transfer_args *args,
+                                      const uint32_t *thdr_buf)
 {
-   uint32_t thdr_buf[VCMD_TRANSFER2_HDR_SIZE];
-   int ret;
-
-   ret = ctx->input->read(ctx->input, thdr_buf, sizeof(thdr_buf));
-   if (ret != sizeof(thdr_buf)) {
-      return -1;
-   }
-
    args->handle = thdr_buf[VCMD_TRANSFER2_RES_HANDLE];
    args->level = thdr_buf[VCMD_TRANSFER2_LEVEL];
    args->stride = 0;
@@ -1561,6 +1745,40 @@ static int vtest_transfer_decode_args2(struct vtest_context *ctx,
    args->box.h = thdr_buf[VCMD_TRANSFER2_HEIGHT];
    args->box.d = thdr_buf[VCMD_TRANSFER2_DEPTH];
    args->offset = thdr_buf[VCMD_TRANSFER2_OFFSET];
+}
+
+static int vtest_transfer_decode_args2(struct vtest_context *ctx,
+                                       struct vtest_transfer_args *args)
+{
+   uint32_t thdr_buf[VCMD_TRANSFER2_HDR_SIZE];
+   int ret;
+
+   ret = ctx->input->read(ctx->input, thdr_buf, sizeof(thdr_buf));
+   if (ret != sizeof(thdr_buf)) {
+      return -1;
+   }
+
+   vtest_transfer_init_args2(args, thdr_buf);
+
+   return 0;
+}
+
+static int vtest_transfer_decode_args3(struct vtest_context *ctx,
+                                       struct vtest_transfer_args *args,
+                                       uint32_t *blob_handle,
+                                       uint32_t *data_size)
+{
+   uint32_t thdr_buf[VCMD_TRANSFER3_HDR_SIZE];
+   int ret;
+
+   ret = ctx->input->read(ctx->input, thdr_buf, sizeof(thdr_buf));
+   if (ret != sizeof(thdr_buf)) {
+      return -1;
+   }
+
+   vtest_transfer_init_args2(args, thdr_buf);
+   *blob_handle = thdr_buf[VCMD_TRANSFER3_BLOB_HANDLE];
+   *data_size = thdr_buf[VCMD_TRANSFER2_DATA_SIZE];
 
    return 0;
 }
@@ -1670,6 +1888,53 @@ static int vtest_transfer_put_internal(struct vtest_context *ctx,
    return ret;
 }
 
+static int vtest_transfer_blob_internal(struct vtest_context *ctx,
+                                        struct vtest_transfer_args *args,
+                                        uint32_t blob_handle,
+                                        uint32_t data_size,
+                                        bool is_put)
+{
+   struct vtest_resource *res;
+   struct vtest_resource *blob;
+   struct iovec data_iov;
+   int ret;
+
+   res = util_hash_table_get(ctx->resource_table,
+                             intptr_to_pointer(args->handle));
+   blob = util_hash_table_get(ctx->resource_table,
+                              intptr_to_pointer(blob_handle));
+   if (!res || !blob) {
+      return report_failed_call("util_hash_table_get", -ESRCH);
+   }
+
+   if (!blob->iov.iov_base || args->offset > blob->iov.iov_len ||
+       data_size > blob->iov.iov_len - args->offset) {
+      return report_failure("range larger then length of blob", -EFAULT);
+   }
+
+   /* the data is read and written in place */
+   data_iov.iov_base = (char *)blob->iov.iov_base + args->offset;
+   data_iov.iov_len = data_size;
+
+   if (is_put) {
+      ret = virgl_renderer_transfer_write_iov(res->res_id, ctx->ctx_id, args->level,
+                                              args->stride, args->layer_stride,
+                                              &args->box, 0, &data_iov, 1);
+      if (ret) {
+         report_failed_call("virgl_renderer_transfer_write_iov", ret);
+      }
+   } else {
+      ret = virgl_renderer_transfer_read_iov(res->res_id, ctx->ctx_id, args->level,
+                                             args->stride, args->layer_stride,
+                                             &args->box, 0, &data_iov, 1);
+      if (ret) {
+         report_failed_call("virgl_renderer_transfer_read_iov", ret);
+      }
+   }
+
+   return ret;
+}
+
 int vtest_transfer_get(UNUSED uint32_t length_dw)
 {
    struct vtest_context *ctx = vtest_get_current_context();
@@ -1786,6 +2051,38 @@ int vtest_transfer_put2_nop(UNUSED uint32_t length_dw)
    return vtest_transfer_put_internal(ctx, &args, 0, false);
 }
 
+int vtest_transfer_get3(UNUSED uint32_t length_dw)
+{
+   struct vtest_context *ctx = vtest_get_current_context();
+   int ret;
+   struct vtest_transfer_args args;
+   uint32_t blob_handle;
+   uint32_t data_size;
+
+   ret = vtest_transfer_decode_args3(ctx, &args, &blob_handle, &data_size);
+   if (ret < 0) {
+      return ret;
+   }
+
+   return vtest_transfer_blob_internal(ctx, &args, blob_handle, data_size, false);
+}
+
+int vtest_transfer_put3(UNUSED uint32_t length_dw)
+{
+   struct vtest_context *ctx = vtest_get_current_context();
+   int ret;
+   struct vtest_transfer_args args;
+   uint32_t blob_handle;
+   uint32_t data_size;
+
+   ret = vtest_transfer_decode_args3(ctx, &args, &blob_handle, &data_size);
+   if (ret < 0) {
+      return ret;
+   }
+
+   return vtest_transfer_blob_internal(ctx, &args, blob_handle, data_size, true);
+}
+
 int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
 {
    struct vtest_context *ctx = vtest_get_current_context();
@@ -1794,6 +2091,9 @@ int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
    int flags;
    uint32_t hdr_buf[VTEST_HDR_SIZE];
    uint32_t reply_buf[1];
+   struct vtest_resource *res;
+   uint32_t fence_id;
+   bool idle = false;
    bool busy = false;
 
    ret = ctx->input->read(ctx->input, &bw_buf, sizeof(bw_buf));
@@ -1809,22 +2109,36 @@ int vtest_resource_busy_wait(UNUSED uint32_t length_dw)
    if (!ctx->context_initialized && bw_buf[VCMD_BUSY_WAIT_HANDLE])
       return -1;
 
-   /*  handle = bw_buf[VCMD_BUSY_WAIT_HANDLE]; unused as of now */
    flags = bw_buf[VCMD_BUSY_WAIT_FLAGS];
 
-   do {
-      busy = renderer.implicit_fence_completed !=
-             renderer.implicit_fence_submitted;
+   /* only the work of the context can be using the resource, and none of it
+    * when the resource is newer; without a known resource, all the work of
+    * the context is waited for
+    */
+   fence_id = ctx->last_fence_id;
+   res = util_hash_table_get(ctx->resource_table,
+                             intptr_to_pointer(bw_buf[VCMD_BUSY_WAIT_HANDLE]));
+   if (res && vtest_implicit_fence_after_or_equal(res->created_fence_id, fence_id))
+      idle = true;
+
+   while (!idle) {
+      busy = vtest_implicit_fence_pending(&renderer, fence_id);
       if (!busy || !(flags & VCMD_BUSY_WAIT_FLAG_WAIT))
          break;
 
-      /* TODO this is bad when there are multiple clients */
-      fd = virgl_renderer_get_poll_fd();
-      if (fd != -1) {
+      /* the fd of the fence, when it has one, is not woken up by the work of
+       * the other clients */
+      if (!virgl_renderer_export_fence(fence_id, &fd)) {
          vtest_wait_for_fd_read(fd);
+         close(fd);
+      } else {
+         fd = virgl_renderer_get_poll_fd();
+         if (fd != -1) {
+            vtest_wait_for_fd_read(fd);
+         }
       }
       virgl_renderer_poll();
-   } while (true);
+   }
 
    hdr_buf[VTEST_CMD_LEN] = 1;
    hdr_buf[VTEST_CMD_ID] = VCMD_RESOURCE_BUSY_WAIT;
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2026 Collabora, Ltd.
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Replays the input captured by virgl_test_server --capture against the
+ * renderer, as fast as the renderer executes it, and reports the time spent
+ * in each command.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "c11/threads.h"
+#include "util.h"
+#include "virglrenderer.h"
+#include "vtest.h"
+#include "vtest_protocol.h"
+#include "vtest_server.h"
+
+/* large enough for all the command ids */
+#define VTEST_REPLAY_MAX_COMMANDS 64
+
+struct vtest_replay_command_stats {
+   uint64_t count;
+   uint64_t size;
+   uint64_t time_ns;
+};
+
+static struct {
+   const char *trace_file;
+   const char *render_device;
+   int ctx_flags;
+   unsigned iterations;
+
+   struct vtest_replay_command_stats stats[VTEST_REPLAY_MAX_COMMANDS];
+   uint64_t command_count;
+   uint64_t size;
+   uint64_t time_ns;
+} replay = {
+   .iterations = 1,
+};
+
+static uint64_t vtest_replay_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* receives and drops the replies, including the fds */
+static int vtest_replay_drain_main(void *arg)
+{
+   const int fd = (int)(intptr_t)arg;
+
+   while (true) {
+      char buf[4096];
+      char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
+      struct iovec iov = {
+         .iov_base = buf,
+         .iov_len = sizeof(buf),
+      };
+      struct msghdr msg = {
+         .msg_iov = &iov,
+         .msg_iovlen = 1,
+         .msg_control = cmsg_buf,
+         .msg_controllen = sizeof(cmsg_buf),
+      };
+
+      const ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         break;
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+         const int *fds = (const int *)CMSG_DATA(cmsg);
+         const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         for (size_t i = 0; i < count; i++)
+            close(fds[i]);
+      }
+   }
+
+   return 0;
+}
+
+static int vtest_replay_run(int in_fd, int out_fd)
+{
+   struct vtest_input input = {
+      .data.fd = in_fd,
+      .read = vtest_block_read,
+   };
+   struct vtest_context *context = NULL;
+   bool context_initialized = false;
+   uint32_t header[VTEST_HDR_SIZE];
+   int ret;
+
+   ret = vtest_init_renderer(false, replay.ctx_flags, replay.render_device);
+   if (ret < 0) {
+      fprintf(stderr, "failed to initialize the renderer\n");
+      return ret;
+   }
+
+   while (true) {
+      ret = input.read(&input, &header, sizeof(header));
+      if (!ret)
+         break;
+      if (ret < 0 || (size_t)ret < sizeof(header)) {
+         fprintf(stderr, "truncated trace\n");
+         ret = -EINVAL;
+         break;
+      }
+
+      if (!context) {
+         if (header[VTEST_CMD_ID] != VCMD_CREATE_RENDERER) {
+            fprintf(stderr, "the trace does not start with VCMD_CREATE_RENDERER\n");
+            ret = -EINVAL;
+            break;
+         }
+
+         ret = vtest_create_context(&input, out_fd, header[VTEST_CMD_LEN], &context);
+         if (ret < 0) {
+            fprintf(stderr, "failed to create the context\n");
+            break;
+         }
+         continue;
+      }
+
+      const uint32_t cmd_id = header[VTEST_CMD_ID];
+      const struct vtest_command *cmd = vtest_get_command(cmd_id);
+      if (!cmd || cmd_id >= VTEST_REPLAY_MAX_COMMANDS) {
+         fprintf(stderr, "unexpected command %u\n", cmd_id);
+         ret = -EINVAL;
+         break;
+      }
+
+      if (cmd->init_context && !context_initialized) {
+         ret = vtest_lazy_init_context(context);
+         if (ret) {
+            fprintf(stderr, "failed to initialize the context\n");
+            break;
+         }
+         context_initialized = true;
+      }
+
+      vtest_set_current_context(context);
+
+      const uint64_t begin = vtest_replay_now();
+      ret = cmd->dispatch(header[VTEST_CMD_LEN]);
+      if (context_initialized)
+         vtest_poll_context(context);
+      const uint64_t elapsed = vtest_replay_now() - begin;
+
+      if (ret < 0) {
+         fprintf(stderr, "failed to replay %s\n", cmd->name);
+         break;
+      }
+
+      struct vtest_replay_command_stats *stats = &replay.stats[cmd_id];
+      const uint64_t size = (uint64_t)header[VTEST_CMD_LEN] * 4;
+      stats->count++;
+      stats->size += size;
+      stats->time_ns += elapsed;
+      replay.command_count++;
+      replay.size += size;
+      replay.time_ns += elapsed;
+   }
+
+   if (context)
+      vtest_destroy_context(context);
+   vtest_cleanup_renderer();
+
+   return ret < 0 ? ret : 0;
+}
+
+static void vtest_replay_report(void)
+{
+   printf("%-24s %10s %12s %12s %10s\n", "command", "count", "MiB", "time (ms)",
+          "avg (us)");
+
+   for (uint32_t i = 0; i < VTEST_REPLAY_MAX_COMMANDS; i++) {
+      const struct vtest_replay_command_stats *stats = &replay.stats[i];
+      if (!stats->count)
+         continue;
+
+      printf("%-24s %10" PRIu64 " %12.2f %12.2f %10.2f\n", vtest_get_command(i)->name,
+             stats->count, stats->size / (1024.0 * 1024.0), stats->time_ns / 1e6,
+             stats->time_ns / 1e3 / stats->count);
+   }
+
+   const double seconds = replay.time_ns / 1e9;
+   printf("%u iteration(s), %" PRIu64 " commands in %.3f s\n", replay.iterations,
+          replay.command_count, seconds);
+   if (seconds > 0.0) {
+      printf("%.0f commands/s, %.2f MiB/s\n", replay.command_count / seconds,
+             replay.size / (1024.0 * 1024.0) / seconds);
+   }
+}
+
+#define OPT_USE_GLX 'x'
+#define OPT_USE_EGL_SURFACELESS 's'
+#define OPT_USE_GLES 'e'
+#define OPT_RENDERNODE 'r'
+#define OPT_VENUS 'v'
+#define OPT_DRM 'd'
+#define OPT_ITERATIONS 'i'
+
+static void vtest_replay_usage(const char *name)
+{
+   printf("Usage: %s [--use-glx] [--use-egl-surfaceless] [--use-gles] "
+          "[--rendernode <dev>] [--venus] [--drm] [--iterations <n>] <file>\n",
+          name);
+   exit(EXIT_FAILURE);
+}
+
+static void vtest_replay_parse_args(int argc, char **argv)
+{
+   static const struct option long_options[] = {
+      {"use-glx",             no_argument, NULL, OPT_USE_GLX},
+      {"use-egl-surfaceless", no_argument, NULL, OPT_USE_EGL_SURFACELESS},
+      {"use-gles",            no_argument, NULL, OPT_USE_GLES},
+      {"rendernode",          required_argument, NULL, OPT_RENDERNODE},
+      {"venus",               no_argument, NULL, OPT_VENUS},
+      {"drm",                 no_argument, NULL, OPT_DRM},
+      {"iterations",          required_argument, NULL, OPT_ITERATIONS},
+      {0, 0, 0, 0}
+   };
+   bool use_glx = false;
+   bool use_egl_surfaceless = false;
+   bool use_gles = false;
+   bool venus = false;
+   bool drm = false;
+   int ret;
+
+   do {
+      ret = getopt_long(argc, argv, "", long_options, NULL);
+
+      switch (ret) {
+      case -1:
+         break;
+      case OPT_USE_GLX:
+         use_glx = true;
+         break;
+      case OPT_USE_EGL_SURFACELESS:
+         use_egl_surfaceless = true;
+         break;
+      case OPT_USE_GLES:
+         use_gles = true;
+         break;
+      case OPT_RENDERNODE:
+         replay.render_device = optarg;
+         break;
+      case OPT_VENUS:
+         venus = true;
+         break;
+      case OPT_DRM:
+         drm = true;
+         break;
+      case OPT_ITERATIONS:
+         replay.iterations = strtoul(optarg, NULL, 0);
+         break;
+      default:
+         vtest_replay_usage(argv[0]);
+         break;
+      }
+   } while (ret >= 0);
+
+   if (!replay.iterations || optind != argc - 1)
+      vtest_replay_usage(argv[0]);
+   replay.trace_file = argv[optind];
+
+   /* this matches virgl_test_server */
+   if (use_glx) {
+      if (use_egl_surfaceless || use_gles) {
+         fprintf(stderr, "Cannot use surfaceless or GLES with GLX.\n");
+         exit(EXIT_FAILURE);
+      }
+      replay.ctx_flags = VIRGL_RENDERER_USE_GLX;
+   } else {
+      replay.ctx_flags = VIRGL_RENDERER_USE_EGL;
+      if (use_egl_surfaceless)
+         replay.ctx_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+      if (use_gles)
+         replay.ctx_flags |= VIRGL_RENDERER_USE_GLES;
+   }
+
+   if (venus)
+      replay.ctx_flags |= VIRGL_RENDERER_VENUS | VIRGL_RENDERER_RENDER_SERVER;
+   if (drm)
+      replay.ctx_flags |= VIRGL_RENDERER_DRM | VIRGL_RENDERER_ASYNC_FENCE_CB;
+}
+
+int main(int argc, char **argv)
+{
+   int sv[2];
+   thrd_t drain_thread;
+   int ret = 0;
+
+   vtest_replay_parse_args(argc, argv);
+
+   int in_fd = open(replay.trace_file, O_RDONLY | O_CLOEXEC);
+   if (in_fd < 0) {
+      perror("Failed to open the trace");
+      return EXIT_FAILURE;
+   }
+
+   /* the replies are written to a socket, since some of them carry fds */
+   if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+      perror("Failed to create the reply socket");
+      close(in_fd);
+      return EXIT_FAILURE;
+   }
+
+   if (thrd_create(&drain_thread, vtest_replay_drain_main, (void *)(intptr_t)sv[1]) !=
+       thrd_success) {
+      fprintf(stderr, "Failed to create the reply thread\n");
+      close(sv[0]);
+      close(sv[1]);
+      close(in_fd);
+      return EXIT_FAILURE;
+   }
+
+   for (unsigned i = 0; i < replay.iterations; i++) {
+      if (lseek(in_fd, 0, SEEK_SET)) {
+         perror("Failed to rewind the trace");
+         ret = -errno;
+         break;
+      }
+
+      ret = vtest_replay_run(in_fd, sv[0]);
+      if (ret)
+         break;
+   }
+
+   /* the drain thread stops on EOF */
+   shutdown(sv[0], SHUT_RDWR);
+   thrd_join(drain_thread, NULL);
+   close(sv[0]);
+   close(sv[1]);
+   close(in_fd);
+
+   vtest_replay_report();
+
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,20 +27,24 @@
 #endif
 
 #include <stdio.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <sys/un.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <string.h>
 
 #include "util.h"
 #include "util/list.h"
+#include "util/macros.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "vtest.h"
@@ -48,10 +52,17 @@
 #include "virglrenderer.h"
 #include "vtest_server.h"
 #include "virgl_util.h"
-#ifdef HAVE_SYS_SELECT_H
+#ifdef HAVE_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_SELECT_H)
 #include <sys/select.h>
 #endif
 
+/* commands dispatched for a client before the others get their turn */
+#define VTEST_CLIENT_MAX_BATCH_COUNT 64
+
+#define VTEST_SERVER_MAX_EVENT_COUNT 32
+
 enum vtest_client_result {
    VTEST_CLIENT_DISCONNECTED = 1,
    VTEST_CLIENT_ERROR_INPUT_READ,
@@ -62,11 +73,22 @@ enum vtest_client_result {
    VTEST_CLIENT_ERROR_COMMAND_DISPATCH,
 };
 
+struct vtest_client;
+
+/* the data of the epoll events of a client */
+struct vtest_client_source
+{
+   struct vtest_client *client;
+   bool context;
+};
+
 struct vtest_client
 {
    int in_fd;
    int out_fd;
    struct vtest_input input;
+   /* the input is also written here with --capture */
+   int capture_fd;
 
    struct list_head head;
 
@@ -74,6 +96,14 @@ struct vtest_client
    struct vtest_context *context;
    int context_poll_fd;
    bool context_need_poll;
+
+   /* epoll registrations */
+   struct vtest_client_source in_source;
+   struct vtest_client_source context_source;
+   bool in_fd_registered;
+   /* regular files, which epoll rejects, are always ready */
+   bool in_fd_always_ready;
+   int registered_context_poll_fd;
 };
 
 struct vtest_server
@@ -81,6 +111,9 @@ struct vtest_server
    const char *socket_name;
    int socket;
    const char *read_file;
+   const char *capture_file;
+   /* the clients captured so far */
+   unsigned capture_count;
 
    const char *render_device;
 
@@ -88,6 +121,8 @@ struct vtest_server
    bool do_fork;
    bool loop;
    bool multi_clients;
+   /* the renderer lives as long as the server, instead of its clients */
+   bool shared_renderer;
 
    bool use_glx;
    bool use_egl_surfaceless;
@@ -100,6 +135,10 @@ struct vtest_server
 
    int ctx_flags;
 
+   /* created by each server process, since forks must not share it */
+   int epoll_fd;
+   bool socket_registered;
+
    struct list_head new_clients;
    struct list_head active_clients;
    struct list_head inactive_clients;
@@ -119,12 +158,15 @@ struct vtest_server server = {
    .multi_clients = false,
 
    .ctx_flags = 0,
+
+   .epoll_fd = -1,
 };
 
 static void vtest_server_getenv(void);
 static void vtest_server_parse_args(int argc, char **argv);
 static void vtest_server_set_signal_child(void);
 static void vtest_server_set_signal_segv(void);
+static void vtest_server_set_signal_dump(void);
 static void vtest_server_open_read_file(void);
 static void vtest_server_open_socket(void);
 static void vtest_server_run(void);
@@ -150,6 +192,7 @@ while (__AFL_LOOP(1000)) {
    } else {
       vtest_server_set_signal_segv();
    }
+   vtest_server_set_signal_dump();
 
    vtest_server_run();
 
@@ -176,6 +219,8 @@ while (__AFL_LOOP(1000)) {
 #define OPT_NO_VIRGL 'g'
 #define OPT_COMPAT_PROFILE 'c'
 #define OPT_DRM 'd'
+#define OPT_SHARED_RENDERER 'a'
+#define OPT_CAPTURE 'k'
 
 static void vtest_server_parse_args(int argc, char **argv)
 {
@@ -185,6 +230,7 @@ static void vtest_server_parse_args(int argc, char **argv)
       {"no-fork",             no_argument, NULL, OPT_NO_FORK},
       {"no-loop-or-fork",     no_argument, NULL, OPT_NO_LOOP_OR_FORK},
       {"multi-clients",       no_argument, NULL, OPT_MULTI_CLIENTS},
+      {"shared-renderer",     no_argument, NULL, OPT_SHARED_RENDERER},
       {"use-glx",             no_argument, NULL, OPT_USE_GLX},
       {"use-egl-surfaceless", no_argument, NULL, OPT_USE_EGL_SURFACELESS},
       {"use-gles",            no_argument, NULL, OPT_USE_GLES},
@@ -194,6 +240,7 @@ static void vtest_server_parse_args(int argc, char **argv)
       {"no-virgl",            no_argument, NULL, OPT_NO_VIRGL},
       {"compat",              no_argument, NULL, OPT_COMPAT_PROFILE},
       {"drm",                 no_argument, NULL, OPT_DRM},
+      {"capture",             required_argument, NULL, OPT_CAPTURE},
       {0, 0, 0, 0}
    };
 
@@ -217,6 +264,13 @@ static void vtest_server_parse_args(int argc, char **argv)
          printf("multi-clients enabled: clients must trust each other\n");
          server.multi_clients = true;
          break;
+      case OPT_SHARED_RENDERER:
+         /* all clients are served by this process, each with its context */
+         printf("shared renderer enabled: clients must trust each other\n");
+         server.do_fork = false;
+         server.multi_clients = true;
+         server.shared_renderer = true;
+         break;
       case OPT_USE_GLX:
          server.use_glx = true;
          break;
@@ -248,10 +302,14 @@ static void vtest_server_parse_args(int argc, char **argv)
          server.drm = true;
          break;
 #endif
+      case OPT_CAPTURE:
+         server.capture_file = optarg;
+         break;
       default:
          printf("Usage: %s [--no-fork] [--no-loop-or-fork] [--multi-clients] "
+                "[--shared-renderer] "
                 "[--use-glx] [--use-egl-surfaceless] [--use-gles] [--no-virgl]"
-                "[--rendernode <dev>] [--socket-path <path>] "
+                "[--rendernode <dev>] [--socket-path <path>] [--capture <path>] "
 #ifdef ENABLE_VENUS
                 " [--venus]"
 #endif
@@ -270,6 +328,7 @@ static void vtest_server_parse_args(int argc, char **argv)
       server.loop = false;
       server.do_fork = false;
       server.multi_clients = false;
+      server.shared_renderer = false;
    }
 
    if (!server.no_virgl) {
@@ -358,6 +417,85 @@ static void vtest_server_set_signal_segv(void)
    }
 }
 
+static volatile sig_atomic_t vtest_server_dump_requested;
+
+static void vtest_server_dump_handler(int sig)
+{
+   (void)sig;
+
+   vtest_server_dump_requested = 1;
+}
+
+/* SIGUSR1 dumps the last commands of the contexts of the process */
+static void vtest_server_set_signal_dump(void)
+{
+   struct sigaction sa;
+   int ret;
+
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_handler = vtest_server_dump_handler;
+   sa.sa_flags = 0;
+
+   ret = sigaction(SIGUSR1, &sa, NULL);
+   if (ret == -1) {
+      perror("Failed to set SIGUSR1");
+      exit(1);
+   }
+}
+
+static int vtest_client_capture_read(struct vtest_input *input, void *buf, int size)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+   struct vtest_client *client = container_of(input, struct vtest_client, input);
+#pragma GCC diagnostic pop
+   int ret = vtest_block_read(input, buf, size);
+
+   if (ret > 0 && client->capture_fd >= 0) {
+      const char *ptr = buf;
+      int left = ret;
+      while (left) {
+         ssize_t written = write(client->capture_fd, ptr, left);
+         if (written < 0) {
+            if (errno == EINTR)
+               continue;
+            perror("Failed to write capture, stopping it");
+            close(client->capture_fd);
+            client->capture_fd = -1;
+            break;
+         }
+         left -= written;
+         ptr += written;
+      }
+   }
+
+   return ret;
+}
+
+/* The input of each client is written to its own file, which can be replayed by
+ * virgl_test_replay or passed as the file argument.  The first client is written
+ * to the capture path, and the following ones to <path>.<n>.  Only the socket
+ * stream is captured.  The fds and the shared memory the client writes to, such
+ * as the command ring, are not.
+ */
+static int vtest_server_open_capture(void)
+{
+   char path[PATH_MAX];
+
+   if (server.capture_count)
+      snprintf(path, sizeof(path), "%s.%u", server.capture_file, server.capture_count);
+   else
+      snprintf(path, sizeof(path), "%s", server.capture_file);
+   server.capture_count++;
+
+   int fd = open(path, O_CLOEXEC | O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+   if (fd < 0)
+      perror("Failed to open capture file");
+
+   return fd;
+}
+
 static int vtest_server_add_client(int in_fd, int out_fd)
 {
    struct vtest_client *client;
@@ -372,8 +510,20 @@ static int vtest_server_add_client(int in_fd, int out_fd)
    client->input.data.fd = in_fd;
    client->input.read = vtest_block_read;
 
+   client->capture_fd = -1;
+   if (server.capture_file) {
+      client->capture_fd = vtest_server_open_capture();
+      if (client->capture_fd >= 0)
+         client->input.read = vtest_client_capture_read;
+   }
+
    client->context_poll_fd = -1;
 
+   client->in_source.client = client;
+   client->context_source.client = client;
+   client->context_source.context = true;
+   client->registered_context_poll_fd = -1;
+
    list_addtail(&client->head, &server.new_clients);
 
    return 0;
@@ -433,6 +583,158 @@ err:
    exit(1);
 }
 
+#ifdef HAVE_EPOLL_H
+static void vtest_server_close_epoll(void)
+{
+   if (server.epoll_fd >= 0) {
+      close(server.epoll_fd);
+      server.epoll_fd = -1;
+   }
+   server.socket_registered = false;
+}
+
+static void vtest_server_register_client(struct vtest_client *client)
+{
+   struct epoll_event ev;
+
+   if (!client->in_fd_registered) {
+      /* edge-triggered, vtest_server_dispatch_clients reads all the input */
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.ptr = &client->in_source;
+      if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, client->in_fd, &ev)) {
+         if (errno != EPERM) {
+            perror("Failed to add client to epoll");
+            exit(1);
+         }
+         client->in_fd_always_ready = true;
+      }
+      client->in_fd_registered = true;
+   }
+
+   if (client->context_poll_fd != client->registered_context_poll_fd) {
+      if (client->registered_context_poll_fd >= 0) {
+         epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->registered_context_poll_fd,
+                   NULL);
+         client->registered_context_poll_fd = -1;
+      }
+
+      ev.events = EPOLLIN;
+      ev.data.ptr = &client->context_source;
+      if (client->context_poll_fd >= 0) {
+         if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, client->context_poll_fd, &ev)) {
+            perror("Failed to add context to epoll");
+            exit(1);
+         }
+         client->registered_context_poll_fd = client->context_poll_fd;
+      }
+   }
+}
+
+static void vtest_server_unregister_client(struct vtest_client *client)
+{
+   if (server.epoll_fd < 0)
+      return;
+
+   if (client->in_fd_registered && !client->in_fd_always_ready)
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->in_fd, NULL);
+   if (client->registered_context_poll_fd >= 0)
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->registered_context_poll_fd, NULL);
+
+   client->in_fd_registered = false;
+   client->registered_context_poll_fd = -1;
+}
+
+static void vtest_server_wait_clients(void)
+{
+   struct vtest_client *client;
+   struct epoll_event events[VTEST_SERVER_MAX_EVENT_COUNT];
+   bool has_client = false;
+   bool accept_client = false;
+   int timeout = -1;
+   int count;
+
+   if (server.epoll_fd < 0) {
+      server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (server.epoll_fd < 0) {
+         perror("Failed to create epoll");
+         exit(1);
+      }
+   }
+
+   LIST_FOR_EACH_ENTRY(client, &server.active_clients, head) {
+      vtest_server_register_client(client);
+      has_client = true;
+
+      /* do not block when there is input left from the last batch */
+      if (client->in_fd_ready || client->in_fd_always_ready)
+         timeout = 0;
+   }
+
+   /* accept new clients when there is none or when multi_clients is set */
+   const bool want_socket = server.socket >= 0 && (!has_client || server.multi_clients);
+   if (want_socket != server.socket_registered) {
+      struct epoll_event ev = {
+         .events = EPOLLIN,
+         .data.ptr = NULL,
+      };
+      if (epoll_ctl(server.epoll_fd, want_socket ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                    server.socket, &ev)) {
+         perror("Failed to update socket in epoll");
+         exit(1);
+      }
+      server.socket_registered = want_socket;
+   }
+
+   if (!has_client && !want_socket) {
+      if (!list_is_empty(&server.new_clients)) {
+         return;
+      }
+
+      fprintf(stderr, "server has no fd to wait\n");
+      exit(1);
+   }
+
+   count = epoll_wait(server.epoll_fd, events, ARRAY_SIZE(events), timeout);
+   if (count < 0) {
+      if (errno == EINTR)
+         return;
+      perror("Failed to wait on epoll!");
+      exit(1);
+   }
+
+   for (int i = 0; i < count; i++) {
+      struct vtest_client_source *source = events[i].data.ptr;
+
+      if (!source)
+         accept_client = true;
+      else if (source->context)
+         source->client->context_need_poll = true;
+      else
+         source->client->in_fd_ready = true;
+   }
+
+   LIST_FOR_EACH_ENTRY(client, &server.active_clients, head) {
+      if (client->in_fd_always_ready)
+         client->in_fd_ready = true;
+
+      if (client->context_poll_fd < 0 && client->context)
+         client->context_need_poll = true;
+   }
+
+   if (accept_client) {
+      int new_fd = accept(server.socket, NULL, NULL);
+      if (new_fd < 0) {
+         perror("Failed to accept socket.");
+         exit(1);
+      }
+
+      if (vtest_server_add_client(new_fd, new_fd)) {
+         perror("Failed to add client.");
+         exit(1);
+      }
+   }
+}
+#else
 static void vtest_server_wait_clients(void)
 {
    struct vtest_client *client;
@@ -469,6 +771,8 @@ static void vtest_server_wait_clients(void)
 
    ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
    if (ret < 0) {
+      if (errno == EINTR)
+         return;
       perror("Failed to select on socket!");
       exit(1);
    }
@@ -500,6 +804,7 @@ static void vtest_server_wait_clients(void)
       }
    }
 }
+#endif /* HAVE_EPOLL_H */
 
 static const char *vtest_client_result_string(enum vtest_client_result ret)
 {
@@ -517,6 +822,16 @@ static const char *vtest_client_result_string(enum vtest_client_result ret)
    }
 }
 
+static bool vtest_client_has_input(const struct vtest_client *client)
+{
+   struct pollfd pfd = {
+      .fd = client->in_fd,
+      .events = POLLIN,
+   };
+
+   return poll(&pfd, 1, 0) == 1;
+}
+
 static void vtest_server_dispatch_clients(void)
 {
    struct vtest_client *client, *tmp;
@@ -533,7 +848,16 @@ static void vtest_server_dispatch_clients(void)
          continue;
       client->in_fd_ready = false;
 
-      ret = vtest_client_dispatch_commands(client);
+      /* dispatch all the pending commands, up to a limit for fairness */
+      for (int i = 0; i < VTEST_CLIENT_MAX_BATCH_COUNT; i++) {
+         ret = vtest_client_dispatch_commands(client);
+         if (ret || !vtest_client_has_input(client))
+            break;
+
+         if (i == VTEST_CLIENT_MAX_BATCH_COUNT - 1)
+            client->in_fd_ready = true;
+      }
+
       if (ret) {
          fprintf(ret == VTEST_CLIENT_DISCONNECTED ? stdout : stderr, "client: %s\n",
                  vtest_client_result_string(ret));
@@ -550,6 +874,9 @@ static pid_t vtest_server_fork(void)
    if (pid == 0) {
       /* child */
       vtest_server_set_signal_segv();
+#ifdef HAVE_EPOLL_H
+      vtest_server_close_epoll();
+#endif
       vtest_server_close_socket();
       server.main_server = false;
       server.do_fork = false;
@@ -610,6 +937,10 @@ static void vtest_server_tidy_clients(void)
    struct vtest_client *client, *tmp;
 
    LIST_FOR_EACH_ENTRY_SAFE(client, tmp, &server.inactive_clients, head) {
+#ifdef HAVE_EPOLL_H
+      vtest_server_unregister_client(client);
+#endif
+
       if (client->context) {
          vtest_destroy_context(client->context);
       }
@@ -622,6 +953,10 @@ static void vtest_server_tidy_clients(void)
          close(client->out_fd);
       }
 
+      if (client->capture_fd >= 0) {
+         close(client->capture_fd);
+      }
+
       free(client);
    }
 
@@ -638,11 +973,24 @@ static void vtest_server_run(void)
       vtest_server_open_socket();
    }
 
+   /* clients skip the renderer init when it is shared */
+   if (server.shared_renderer) {
+      if (vtest_init_renderer(server.multi_clients, server.ctx_flags,
+                              server.render_device)) {
+         fprintf(stderr, "failed to init the shared renderer\n");
+         exit(1);
+      }
+   }
+
    while (run) {
       const bool was_empty = list_is_empty(&server.active_clients);
       bool is_empty;
 
       vtest_server_wait_clients();
+      if (vtest_server_dump_requested) {
+         vtest_server_dump_requested = 0;
+         virgl_renderer_dump_commands();
+      }
       vtest_server_dispatch_clients();
 
       if (server.do_fork) {
@@ -653,7 +1001,7 @@ static void vtest_server_run(void)
 
       /* init renderer after the first active client is added */
       is_empty = list_is_empty(&server.active_clients);
-      if (was_empty && !is_empty) {
+      if (was_empty && !is_empty && !server.shared_renderer) {
          int ret = vtest_init_renderer(server.multi_clients,
                                        server.ctx_flags,
                                        server.render_device);
@@ -667,21 +1015,26 @@ static void vtest_server_run(void)
 
       /* clean up renderer after the last active client is removed */
       if (!was_empty && is_empty) {
-         vtest_cleanup_renderer();
+         if (!server.shared_renderer) {
+            vtest_cleanup_renderer();
+         }
          if (!server.loop) {
             run = false;
          }
       }
    }
 
+   if (server.shared_renderer) {
+      vtest_cleanup_renderer();
+   }
+
+#ifdef HAVE_EPOLL_H
+   vtest_server_close_epoll();
+#endif
    vtest_server_close_socket();
 }
 
-static const struct vtest_command {
-   const char *name;
-   int (*dispatch)(uint32_t);
-   bool init_context;
-} vtest_commands[] = {
+static const struct vtest_command vtest_commands[] = {
 #define HANDLER(N, n, init_context) \
    [VCMD_##N] = { #N, vtest_##n, init_context }
 
@@ -730,8 +1083,22 @@ static const struct vtest_command {
    HANDLER(DRM_SYNC_TRANSFER,           drm_sync_transfer,         true   ),
 #endif /* ENABLE_DRM */
    HANDLER(RESOURCE_EXPORT_FD,          resource_export_fd,        true   ),
+
+   /* since protocol version 5 */
+   HANDLER(CMD_RING_CREATE,             cmd_ring_create,           true   ),
+   HANDLER(SUBMIT_CMD_RING,             submit_cmd_ring,           true   ),
+   HANDLER(TRANSFER_GET3,               transfer_get3,             true   ),
+   HANDLER(TRANSFER_PUT3,               transfer_put3,             true   ),
 };
 
+const struct vtest_command *vtest_get_command(uint32_t cmd_id)
+{
+   if (cmd_id >= ARRAY_SIZE(vtest_commands) || !vtest_commands[cmd_id].dispatch)
+      return NULL;
+
+   return &vtest_commands[cmd_id];
+}
+
 static int vtest_client_dispatch_commands(struct vtest_client *client)
 {
    TRACE_FUNC();
@@ -767,8 +1134,8 @@ static int vtest_client_dispatch_commands(struct vtest_client *client)
       return VTEST_CLIENT_ERROR_COMMAND_ID;
    }
 
-   cmd = &vtest_commands[header[1]];
-   if (cmd->dispatch == NULL) {
+   cmd = vtest_get_command(header[1]);
+   if (cmd == NULL) {
       return VTEST_CLIENT_ERROR_COMMAND_UNEXPECTED;
    }
 
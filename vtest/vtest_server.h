@@ -25,7 +25,19 @@
 #ifndef VTEST_SERVER_H
 #define VTEST_SERVER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+struct vtest_command {
+   const char *name;
+   int (*dispatch)(uint32_t);
+   bool init_context;
+};
+
 int vtest_main(int argc, char **argv);
 
+/* returns NULL for VCMD_CREATE_RENDERER and unknown commands */
+const struct vtest_command *vtest_get_command(uint32_t cmd_id);
+
 #endif
 